@@ -75,6 +75,7 @@ cbsasl_error_t cram_md5_server_step(cbsasl_conn_t *conn,
              conn->c.server.sasl_data_len,
              (unsigned char *)pass,
              strlen(pass), digest);
+    free(pass);
 
     cbsasl_hex_encode(md5string, (char *) digest, DIGEST_LENGTH);
 
@@ -82,10 +83,11 @@ cbsasl_error_t cram_md5_server_step(cbsasl_conn_t *conn,
                               (DIGEST_LENGTH * 2),
                               &(input[userlen + 1]),
                               (DIGEST_LENGTH * 2)) != 0) {
+        free(cfg);
         return SASL_PWERR;
     }
 
-    conn->c.server.config = strdup(cfg);
+    conn->c.server.config = cfg;
     *output = NULL;
     *outputlen = 0;
     return SASL_OK;
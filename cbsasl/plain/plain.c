@@ -17,6 +17,7 @@
 #include "cbsasl/pwfile.h"
 #include "cbsasl/util.h"
 #include <string.h>
+#include <stdlib.h>
 
 cbsasl_error_t plain_server_init()
 {
@@ -77,10 +78,13 @@ cbsasl_error_t plain_server_step(cbsasl_conn_t *conn,
         stored_pwlen = strlen(stored_password);
         if (cbsasl_secure_compare(password, pwlen,
                                   stored_password, stored_pwlen) != 0) {
+            free(stored_password);
+            free(cfg);
             return SASL_PWERR;
         }
+        free(stored_password);
 
-        conn->c.server.config = strdup(cfg);
+        conn->c.server.config = cfg;
     }
 
     *output = NULL;
@@ -20,14 +20,103 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stdbool.h>
 
-static cb_mutex_t uhash_lock;
-static user_db_entry_t **user_ht;
-static const int n_uht_buckets = 12289;
+/*
+ * The user database is an immutable snapshot (an open addressed hash
+ * table of the entries), which the lookups use without any locks. A
+ * reload builds a new one, reusing the entries of the users which didn't
+ * change, swaps it in and frees the old one once nobody may look at it
+ * anymore.
+ *
+ * The readers announce themselves in the counter of the current epoch
+ * (see user_db_enter); the reloader flips the epoch and waits for the old
+ * counter to drain, twice, so that no reader can still hold the old
+ * snapshot (the same as Userspace RCU does).
+ */
+struct user_db {
+    uint32_t mask;
+    user_db_entry_t *slots[1];
+};
+
+static struct user_db * volatile user_db;
+static volatile int user_db_readers[2];
+static volatile int user_db_epoch;
+
+/* Serializes the reloads */
+static cb_mutex_t reload_lock;
+static cb_cond_t reload_cond;
 
 void pwfile_init(void)
 {
-    cb_mutex_initialize(&uhash_lock);
+    cb_mutex_initialize(&reload_lock);
+    cb_cond_initialize(&reload_cond);
+}
+
+#ifdef WIN32
+static void user_db_barrier(void)
+{
+    MemoryBarrier();
+}
+
+static void user_db_add(volatile int *counter, int delta)
+{
+    InterlockedExchangeAdd((volatile LONG *)counter, delta);
+}
+#elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+static void user_db_barrier(void)
+{
+    membar_producer();
+    membar_consumer();
+}
+
+static void user_db_add(volatile int *counter, int delta)
+{
+    atomic_add_int((volatile uint_t *)counter, delta);
+    membar_enter();
+}
+#else
+static void user_db_barrier(void)
+{
+    __sync_synchronize();
+}
+
+static void user_db_add(volatile int *counter, int delta)
+{
+    __sync_add_and_fetch(counter, delta);
+}
+#endif
+
+/**
+ * Start looking at the user database
+ *
+ * @return the epoch to hand to user_db_exit
+ */
+static int user_db_enter(void)
+{
+    int epoch = user_db_epoch;
+    user_db_add(&user_db_readers[epoch], 1);
+    return epoch;
+}
+
+static void user_db_exit(int epoch)
+{
+    user_db_add(&user_db_readers[epoch], -1);
+}
+
+/* Wait for all of the readers which may have seen the old snapshot */
+static void user_db_synchronize(void)
+{
+    int ii;
+    for (ii = 0; ii < 2; ++ii) {
+        int epoch = user_db_epoch;
+        user_db_epoch = !epoch;
+        user_db_barrier();
+        while (user_db_readers[epoch] != 0) {
+            cb_cond_timedwait(&reload_cond, &reload_lock, 1);
+        }
+    }
 }
 
 static void kill_whitey(char *s)
@@ -38,11 +127,9 @@ static void kill_whitey(char *s)
     }
 }
 
-static int u_hash_key(const char *u)
+static uint32_t u_hash_key(const char *u)
 {
-    uint32_t h = hash(u, strlen(u), 0) % n_uht_buckets;
-    cb_assert(h < n_uht_buckets);
-    return h;
+    return hash(u, strlen(u), 0);
 }
 
 static const char *get_isasl_filename(void)
@@ -50,84 +137,200 @@ static const char *get_isasl_filename(void)
     return getenv("ISASL_PWFILE");
 }
 
-void free_user_ht(void)
+static void free_entry(user_db_entry_t *e)
 {
-    if (user_ht) {
-        int i;
-        for (i = 0; i < n_uht_buckets; i++) {
-            while (user_ht[i]) {
-                user_db_entry_t *e = user_ht[i];
-                user_db_entry_t *n = e->next;
-                free(e->username);
-                free(e->password);
-                free(e->config);
-                free(e);
-                user_ht[i] = n;
-            }
+    free(e->username);
+    free(e->password);
+    free(e->config);
+    free(e);
+}
+
+/* Drop the references of the snapshot to its entries, and free it */
+static void free_user_db(struct user_db *db)
+{
+    uint32_t i;
+    for (i = 0; i <= db->mask; i++) {
+        user_db_entry_t *e = db->slots[i];
+        if (e != NULL && --e->refcount == 0) {
+            free_entry(e);
         }
-        free(user_ht);
-        user_ht = NULL;
     }
+    free(db);
 }
 
-static void store_pw(user_db_entry_t **ht,
-                     const char *u,
-                     const char *p,
-                     const char *cfg)
+void free_user_ht(void)
+{
+    struct user_db *old;
+
+    cb_mutex_enter(&reload_lock);
+    old = user_db;
+    user_db = NULL;
+    user_db_barrier();
+    if (old != NULL) {
+        user_db_synchronize();
+        free_user_db(old);
+    }
+    cb_mutex_exit(&reload_lock);
+}
+
+/* The slot of the user in the snapshot (an empty one if it's not in it) */
+static user_db_entry_t **find_slot(struct user_db *db, const char *u)
+{
+    uint32_t h = u_hash_key(u) & db->mask;
+
+    while (db->slots[h] != NULL && strcmp(db->slots[h]->username, u) != 0) {
+        h = (h + 1) & db->mask;
+    }
+    return &db->slots[h];
+}
+
+static bool same_string(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+    return strcmp(a, b) == 0;
+}
+
+/**
+ * Get the entry of the user for the new snapshot: the one of the
+ * current snapshot if it didn't change, or a new one
+ *
+ * @param reused set to true if we could use the current one
+ * @return the entry with a reference for the new snapshot
+ */
+static user_db_entry_t *get_entry(const char *u,
+                                  const char *p,
+                                  const char *cfg,
+                                  bool *reused)
 {
     user_db_entry_t *e;
-    int h;
 
-    cb_assert(ht);
     cb_assert(u);
     cb_assert(p);
 
+    if (user_db != NULL) {
+        e = *find_slot(user_db, u);
+        if (e != NULL && strcmp(e->password, p) == 0 &&
+            same_string(e->config, cfg)) {
+            ++e->refcount;
+            *reused = true;
+            return e;
+        }
+    }
+
+    *reused = false;
     e = calloc(1, sizeof(user_db_entry_t));
-    cb_assert(e);
+    if (e == NULL) {
+        return NULL;
+    }
     e->username = strdup(u);
-    cb_assert(e->username);
     e->password = strdup(p);
-    cb_assert(e->password);
     e->config = cfg ? strdup(cfg) : NULL;
-    cb_assert(!cfg || e->config);
-
-    h = u_hash_key(u);
-
-    e->next = ht[h];
-    ht[h] = e;
+    if (e->username == NULL || e->password == NULL ||
+        (cfg && e->config == NULL)) {
+        free_entry(e);
+        return NULL;
+    }
+    e->refcount = 1;
+    return e;
 }
 
 char *find_pw(const char *u, char **cfg)
 {
-    int h;
-    user_db_entry_t *e;
+    struct user_db *db;
+    char *password = NULL;
+    int epoch;
 
     cb_assert(u);
-    cb_assert(user_ht);
 
-    cb_mutex_enter(&uhash_lock);
-    h = u_hash_key(u);
+    epoch = user_db_enter();
+    db = user_db;
+    if (db != NULL) {
+        user_db_entry_t *e = *find_slot(db, u);
+        if (e != NULL) {
+            password = strdup(e->password);
+            *cfg = e->config ? strdup(e->config) : NULL;
+            if (password == NULL || (e->config && *cfg == NULL)) {
+                free(password);
+                free(*cfg);
+                password = NULL;
+            }
+        }
+    }
+    user_db_exit(epoch);
+
+    return password;
+}
+
+/* The users in the snapshot (-1 if we don't have one) */
+static int count_users(const struct user_db *db)
+{
+    int nusers = 0;
+    uint32_t i;
+
+    if (db == NULL) {
+        return -1;
+    }
+    for (i = 0; i <= db->mask; i++) {
+        if (db->slots[i] != NULL) {
+            ++nusers;
+        }
+    }
+    return nusers;
+}
+
+/**
+ * Replace the entries with a new snapshot of them
+ *
+ * @return false if we couldn't allocate it
+ */
+static bool publish_user_db(user_db_entry_t **entries, int nentries)
+{
+    struct user_db *db;
+    struct user_db *old;
+    uint32_t size = 16;
+    int i;
 
-    e = user_ht[h];
-    while (e && strcmp(e->username, u) != 0) {
-        e = e->next;
+    while (size < (uint32_t)nentries * 2) {
+        size <<= 1;
     }
+    db = calloc(1, sizeof(*db) + (size - 1) * sizeof(db->slots[0]));
+    if (db == NULL) {
+        return false;
+    }
+    db->mask = size - 1;
 
-    if (e != NULL) {
-        *cfg = e->config;
-        cb_mutex_exit(&uhash_lock);
-        return e->password;
-    } else {
-        cb_mutex_exit(&uhash_lock);
-        return NULL;
+    /* The last line of the user is the one which counts */
+    for (i = 0; i < nentries; i++) {
+        user_db_entry_t **slot = find_slot(db, entries[i]->username);
+        if (*slot != NULL && --(*slot)->refcount == 0) {
+            free_entry(*slot);
+        }
+        *slot = entries[i];
     }
+
+    user_db_barrier();
+    old = user_db;
+    user_db = db;
+    user_db_barrier();
+    if (old != NULL) {
+        user_db_synchronize();
+        free_user_db(old);
+    }
+    return true;
 }
 
 cbsasl_error_t load_user_db(void)
 {
-    user_db_entry_t **new_ut;
+    user_db_entry_t **entries = NULL;
+    int nentries = 0;
+    int size = 0;
+    int nreused = 0;
+    int i;
     FILE *sfile;
     char up[128];
+    cbsasl_error_t ret = SASL_OK;
     const char *filename = get_isasl_filename();
 
 
@@ -140,21 +343,17 @@ cbsasl_error_t load_user_db(void)
         return SASL_FAIL;
     }
 
-    new_ut = calloc(n_uht_buckets, sizeof(user_db_entry_t *));
-
-    if (!new_ut) {
-        fclose(sfile);
-        return SASL_NOMEM;
-    }
+    cb_mutex_enter(&reload_lock);
 
     /* File has lines that are newline terminated. */
     /* File may have comment lines that must being with '#'. */
     /* Lines should look like... */
     /*   <NAME><whitespace><PASSWORD><whitespace><CONFIG><optional_whitespace> */
     /* */
-    while (fgets(up, sizeof(up), sfile)) {
+    while (ret == SASL_OK && fgets(up, sizeof(up), sfile)) {
         if (up[0] != '#') {
             char *uname = up, *p = up, *cfg = NULL;
+            bool reused;
             kill_whitey(up);
             while (*p && !isspace(p[0])) {
                 p++;
@@ -186,11 +385,49 @@ cbsasl_error_t load_user_db(void)
                     }
                 }
             }
-            store_pw(new_ut, uname, p, cfg);
+
+            if (nentries == size) {
+                int nsize = size ? size * 2 : 1024;
+                void *ptr = realloc(entries, nsize * sizeof(*entries));
+                if (ptr == NULL) {
+                    ret = SASL_NOMEM;
+                    break;
+                }
+                entries = ptr;
+                size = nsize;
+            }
+            entries[nentries] = get_entry(uname, p, cfg, &reused);
+            if (entries[nentries] == NULL) {
+                ret = SASL_NOMEM;
+                break;
+            }
+            if (reused) {
+                ++nreused;
+            }
+            ++nentries;
         }
     }
 
     fclose(sfile);
+
+    /* Replace the current configuration with the new one (unless every
+     * user of it is the same) */
+    if (ret == SASL_OK &&
+        (nreused != nentries || count_users(user_db) != nentries)) {
+        if (publish_user_db(entries, nentries)) {
+            /* They belong to the snapshot now */
+            nentries = 0;
+        } else {
+            ret = SASL_NOMEM;
+        }
+    }
+    for (i = 0; i < nentries; i++) {
+        if (--entries[i]->refcount == 0) {
+            free_entry(entries[i]);
+        }
+    }
+    cb_mutex_exit(&reload_lock);
+    free(entries);
     /*
      if (settings.verbose) {
      settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
@@ -198,11 +435,6 @@ cbsasl_error_t load_user_db(void)
      filename);
      }
      */
-    /* Replace the current configuration with the new one */
-    cb_mutex_enter(&uhash_lock);
-    free_user_ht();
-    user_ht = new_ut;
-    cb_mutex_exit(&uhash_lock);
 
-    return SASL_OK;
+    return ret;
 }
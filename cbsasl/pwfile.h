@@ -23,9 +23,18 @@ typedef struct user_db_entry {
     char *username;
     char *password;
     char *config;
-    struct user_db_entry *next;
+    /* The snapshots of the user database it's in */
+    int refcount;
 } user_db_entry_t;
 
+/**
+ * Look up the user (without blocking a reload)
+ *
+ * @param u the name of the user
+ * @param cfg where to store a copy of the config of the user
+ * @return a copy of the password (the caller frees it and the config) or
+ *         NULL if there's no such user
+ */
 char *find_pw(const char *u, char **cfg);
 
 cbsasl_error_t load_user_db(void);
@@ -28,6 +28,86 @@ static void (*releaseFreeMemory)(void);
 
 static alloc_hooks_type type = none;
 
+/* Can we tell what the threads allocate (see mc_enter_account) */
+static bool accounting = false;
+
+/* How deep the accounts of a thread may nest (the ones deeper than that
+ * are charged to the one at this depth) */
+#define MAX_ACCOUNT_DEPTH 8
+
+#ifdef WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/*
+ * The accounts a thread charges its memory to. Instead of adding every
+ * allocation to the account (with an atomic operation on memory all of
+ * the threads in the bucket share) the thread sums them up, and settles
+ * with the account when another one becomes the current one.
+ */
+struct account_state {
+    allocator_account *stack[MAX_ACCOUNT_DEPTH];
+    int depth;
+    /* What the thread allocated and freed since it settled (or with
+     * jemalloc, its counters of the thread when it settled) */
+    uint64_t allocated;
+    uint64_t freed;
+#ifdef HAVE_JEMALLOC
+    /* The counters jemalloc keeps of the thread, NULL until we have
+     * looked them up */
+    uint64_t *allocatedp;
+    uint64_t *deallocatedp;
+    /* The arena the thread allocates from, and the one it goes back to
+     * outside of the accounts with an arena of their own (only known
+     * once the thread changed arenas) */
+    unsigned int arena;
+    unsigned int home;
+    bool bound;
+#endif
+};
+
+static THREAD_LOCAL struct account_state account_state;
+
+#ifdef HAVE_JEMALLOC
+/* Do the worker threads and the engines get arenas of their own (see
+ * mc_enable_arenas) */
+static bool arenas = false;
+static bool tcache = true;
+
+/* "thread.arena" looked up once, so that changing the arena of the
+ * thread on the way into an engine doesn't have to parse the name */
+static size_t thread_arena_mib[2];
+static size_t thread_arena_miblen;
+
+/* The arenas the engines gave back, to hand out again before we create
+ * new ones (jemalloc can't get rid of them) */
+#define MAX_FREE_ARENAS 64
+static struct {
+    cb_mutex_t mutex;
+    unsigned int arena[MAX_FREE_ARENAS];
+    int num;
+} free_arenas;
+#endif
+
+static allocator_account *current_account(struct account_state *st);
+
+#ifdef WIN32
+static void add_uint64(volatile uint64_t *ptr, uint64_t val) {
+    InterlockedExchangeAdd64((volatile LONGLONG *)ptr, (LONGLONG)val);
+}
+#elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+static void add_uint64(volatile uint64_t *ptr, uint64_t val) {
+    atomic_add_64(ptr, (int64_t)val);
+}
+#else
+static void add_uint64(volatile uint64_t *ptr, uint64_t val) {
+    __sync_fetch_and_add(ptr, val);
+}
+#endif
+
 #ifdef HAVE_JEMALLOC
 
 static int jemalloc_addrem_new_hook(void (*hook)(const void *ptr, size_t size)) {
@@ -96,6 +176,61 @@ static void jemalloc_release_free_memory(void) {
     return;
 }
 
+/**
+ * Look up the counters of what the calling thread allocated and freed
+ * (which jemalloc only keeps if it was built with statistics)
+ */
+static bool jemalloc_thread_counters(struct account_state *st) {
+    uint64_t *allocatedp;
+    uint64_t *deallocatedp;
+    size_t size = sizeof(allocatedp);
+
+    if (je_mallctl("thread.allocatedp", &allocatedp, &size, NULL, 0) != 0 ||
+        je_mallctl("thread.deallocatedp", &deallocatedp, &size,
+                   NULL, 0) != 0) {
+        return false;
+    }
+    st->allocatedp = allocatedp;
+    st->deallocatedp = deallocatedp;
+    st->allocated = *allocatedp;
+    st->freed = *deallocatedp;
+    return true;
+}
+
+static bool set_thread_arena(struct account_state *st, unsigned int arena) {
+    if (je_mallctlbymib(thread_arena_mib, thread_arena_miblen, NULL, NULL,
+                        &arena, sizeof(arena)) != 0) {
+        return false;
+    }
+    st->arena = arena;
+    return true;
+}
+
+/**
+ * Allocate from the arena of the current account (if it has one) or
+ * else the arena of the thread
+ */
+static void follow_account(struct account_state *st) {
+    allocator_account *account = current_account(st);
+    unsigned int arena;
+
+    if (!st->bound) {
+        size_t size = sizeof(arena);
+        if (account == NULL || account->arena == 0 ||
+            je_mallctl("thread.arena", &arena, &size, NULL, 0) != 0) {
+            return;
+        }
+        st->home = st->arena = arena;
+        st->bound = true;
+    }
+
+    arena = (account != NULL && account->arena != 0) ? account->arena
+                                                     : st->home;
+    if (arena != st->arena) {
+        set_thread_arena(st, arena);
+    }
+}
+
 static void init_no_hooks(void) {
     addNewHook = jemalloc_addrem_new_hook;
     removeNewHook = jemalloc_addrem_new_hook;
@@ -106,6 +241,7 @@ static void init_no_hooks(void) {
     getDetailedStats = jemalloc_get_detailed_stats;
     releaseFreeMemory = jemalloc_release_free_memory;
     type = jemalloc;
+    accounting = true;
 }
 
 #elif defined(HAVE_TCMALLOC)
@@ -119,6 +255,19 @@ static size_t tcmalloc_getAllocSize(const void *ptr) {
     return 0;
 }
 
+static void account_new_hook(const void *ptr, size_t size) {
+    (void)size;
+    if (ptr != NULL && account_state.depth > 0) {
+        account_state.allocated += MallocExtension_GetAllocatedSize(ptr);
+    }
+}
+
+static void account_delete_hook(const void *ptr) {
+    if (ptr != NULL && account_state.depth > 0) {
+        account_state.freed += MallocExtension_GetAllocatedSize(ptr);
+    }
+}
+
 static void init_tcmalloc_hooks(void) {
     addNewHook = MallocHook_AddNewHook;
     removeNewHook = MallocHook_RemoveNewHook;
@@ -129,6 +278,8 @@ static void init_tcmalloc_hooks(void) {
     getDetailedStats = MallocExtension_GetStats;
     releaseFreeMemory = MallocExtension_ReleaseFreeMemory;
     type = tcmalloc;
+    accounting = MallocHook_AddNewHook(account_new_hook) &&
+                 MallocHook_AddDeleteHook(account_delete_hook);
 }
 #else
 static int invalid_addrem_new_hook(void (*hook)(const void *ptr, size_t size)) {
@@ -260,3 +411,173 @@ void mc_release_free_memory() {
 alloc_hooks_type get_alloc_hooks_type(void) {
     return type;
 }
+
+static allocator_account *current_account(struct account_state *st) {
+    if (st->depth == 0) {
+        return NULL;
+    }
+    if (st->depth > MAX_ACCOUNT_DEPTH) {
+        return st->stack[MAX_ACCOUNT_DEPTH - 1];
+    }
+    return st->stack[st->depth - 1];
+}
+
+/**
+ * Charge what the thread allocated and freed since the last time to the
+ * current account
+ */
+static void settle_account(struct account_state *st) {
+    allocator_account *account = current_account(st);
+    uint64_t allocated;
+    uint64_t freed;
+
+#ifdef HAVE_JEMALLOC
+    if (st->allocatedp == NULL) {
+        return;
+    }
+    allocated = *st->allocatedp - st->allocated;
+    freed = *st->deallocatedp - st->freed;
+    st->allocated = *st->allocatedp;
+    st->freed = *st->deallocatedp;
+#else
+    allocated = st->allocated;
+    freed = st->freed;
+    st->allocated = 0;
+    st->freed = 0;
+#endif
+
+    if (account != NULL) {
+        if (allocated != 0) {
+            add_uint64(&account->allocated, allocated);
+        }
+        if (freed != 0) {
+            add_uint64(&account->freed, freed);
+        }
+    }
+}
+
+bool mc_enter_account(allocator_account *account) {
+    struct account_state *st = &account_state;
+    bool ret = accounting;
+
+#ifdef HAVE_JEMALLOC
+    if (ret && st->allocatedp == NULL && !jemalloc_thread_counters(st)) {
+        /* It wasn't built with them, so no thread has them */
+        accounting = false;
+        ret = false;
+    }
+#endif
+
+    settle_account(st);
+    if (st->depth < MAX_ACCOUNT_DEPTH) {
+        st->stack[st->depth] = account;
+    }
+    st->depth++;
+#ifdef HAVE_JEMALLOC
+    if (arenas) {
+        follow_account(st);
+    }
+#endif
+    return ret;
+}
+
+void mc_leave_account(void) {
+    struct account_state *st = &account_state;
+
+    cb_assert(st->depth > 0);
+    settle_account(st);
+    st->depth--;
+#ifdef HAVE_JEMALLOC
+    if (arenas) {
+        follow_account(st);
+    }
+#endif
+}
+
+bool mc_enable_arenas(bool use_tcache) {
+#ifdef HAVE_JEMALLOC
+    thread_arena_miblen = sizeof(thread_arena_mib) / sizeof(size_t);
+    if (type != jemalloc ||
+        je_mallctlnametomib("thread.arena", thread_arena_mib,
+                            &thread_arena_miblen) != 0) {
+        return false;
+    }
+    cb_mutex_initialize(&free_arenas.mutex);
+    tcache = use_tcache;
+    arenas = true;
+    return true;
+#else
+    (void)use_tcache;
+    return false;
+#endif
+}
+
+bool mc_thread_arena(void) {
+#ifdef HAVE_JEMALLOC
+    struct account_state *st = &account_state;
+    unsigned int arena;
+
+    if (!arenas || !mc_create_arena(&arena) || !set_thread_arena(st, arena)) {
+        return false;
+    }
+    st->home = arena;
+    st->bound = true;
+    if (!tcache) {
+        bool enabled = false;
+        je_mallctl("thread.tcache.enabled", NULL, NULL,
+                   &enabled, sizeof(enabled));
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool mc_create_arena(unsigned int *arena) {
+#ifdef HAVE_JEMALLOC
+    size_t size = sizeof(*arena);
+
+    if (!arenas) {
+        return false;
+    }
+
+    cb_mutex_enter(&free_arenas.mutex);
+    if (free_arenas.num > 0) {
+        *arena = free_arenas.arena[--free_arenas.num];
+        cb_mutex_exit(&free_arenas.mutex);
+        return true;
+    }
+    cb_mutex_exit(&free_arenas.mutex);
+
+#if defined(JEMALLOC_VERSION_MAJOR) && JEMALLOC_VERSION_MAJOR >= 5
+    return je_mallctl("arenas.create", arena, &size, NULL, 0) == 0;
+#else
+    return je_mallctl("arenas.extend", arena, &size, NULL, 0) == 0;
+#endif
+#else
+    (void)arena;
+    return false;
+#endif
+}
+
+void mc_release_arena(unsigned int arena) {
+#ifdef HAVE_JEMALLOC
+    char name[64];
+
+    if (!arenas || arena == 0) {
+        return;
+    }
+
+    /* The pages nobody uses go back to the OS */
+    snprintf(name, sizeof(name), "arena.%u.purge", arena);
+    je_mallctl(name, NULL, NULL, NULL, 0);
+
+    cb_mutex_enter(&free_arenas.mutex);
+    if (free_arenas.num < MAX_FREE_ARENAS) {
+        free_arenas.arena[free_arenas.num++] = arena;
+    }
+    cb_mutex_exit(&free_arenas.mutex);
+#else
+    (void)arena;
+#endif
+}
@@ -34,6 +34,12 @@ extern "C" {
     size_t mc_get_allocation_size(const void*);
     void mc_get_detailed_stats(char*, int);
     void mc_release_free_memory(void);
+    bool mc_enter_account(allocator_account *account);
+    void mc_leave_account(void);
+    bool mc_enable_arenas(bool tcache);
+    bool mc_thread_arena(void);
+    bool mc_create_arena(unsigned int *arena);
+    void mc_release_arena(unsigned int arena);
 
     alloc_hooks_type get_alloc_hooks_type(void);
 
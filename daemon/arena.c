@@ -0,0 +1,115 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The per request arena of the connections (see arena.h)
+ */
+#include "config.h"
+#include "arena.h"
+#include "net_buf_pool.h"
+#include "zerocopy.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* The smallest block we take (a size class of the buffer pool) */
+#define ARENA_BLOCK_SIZE (DATA_BUFFER_SIZE * 2)
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    /* The bytes of the block we've handed out */
+    size_t used;
+    /* Where the last allocation starts */
+    size_t last;
+};
+
+#define ARENA_HEADER ARENA_ROUND(sizeof(struct arena_block))
+
+static struct arena_block *block_new(conn *c, size_t needed) {
+    size_t size = ARENA_BLOCK_SIZE;
+    struct arena_block *block;
+    bool allocated;
+
+    /* The powers of two are what the pool keeps */
+    while (size < ARENA_HEADER + needed) {
+        size <<= 1;
+    }
+
+    if (c->thread != NULL && c->thread->buffers != NULL) {
+        block = (void *)net_buf_pool_get(c->thread->buffers, (uint32_t)size,
+                                         &allocated);
+    } else {
+        block = malloc(size);
+    }
+    if (block == NULL) {
+        return NULL;
+    }
+
+    block->size = size;
+    block->used = block->last = ARENA_HEADER;
+    block->next = c->arena;
+    c->arena = block;
+    return block;
+}
+
+void *arena_alloc(conn *c, size_t size) {
+    struct arena_block *block = c->arena;
+
+    size = ARENA_ROUND(size);
+    if (block == NULL || block->size - block->used < size) {
+        block = block_new(c, size);
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    block->last = block->used;
+    block->used += size;
+    return (char *)block + block->last;
+}
+
+void *arena_realloc(conn *c, void *ptr, size_t size, size_t nsize) {
+    struct arena_block *block = c->arena;
+    void *nptr;
+
+    if (ptr == NULL) {
+        return arena_alloc(c, nsize);
+    }
+
+    if (block != NULL && (char *)ptr == (char *)block + block->last &&
+        block->size - block->last >= ARENA_ROUND(nsize)) {
+        block->used = block->last + ARENA_ROUND(nsize);
+        return ptr;
+    }
+
+    nptr = arena_alloc(c, nsize);
+    if (nptr != NULL) {
+        memcpy(nptr, ptr, size < nsize ? size : nsize);
+    }
+    return nptr;
+}
+
+void arena_reset(conn *c) {
+    while (c->arena != NULL) {
+        struct arena_block *block = c->arena;
+        c->arena = block->next;
+
+        /* The pool buffers are plain malloc'ed memory, so whoever ends up
+         * releasing them may free them */
+        if (zerocopy_hold(c, ZEROCOPY_BUFFER, block)) {
+            continue;
+        }
+        if (c->thread != NULL && c->thread->buffers != NULL) {
+            net_buf_pool_put(c->thread->buffers, (char *)block,
+                             (uint32_t)block->size);
+        } else {
+            free(block);
+        }
+    }
+
+    /* It lived in the arena */
+    c->dynamic_buffer.buffer = NULL;
+    c->dynamic_buffer.size = c->dynamic_buffer.offset = 0;
+}
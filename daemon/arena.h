@@ -0,0 +1,50 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "memcached.h"
+
+/*
+ * The scratch memory of the request a connection is running (the
+ * dynamic buffer the stats and other responses are built in, and what
+ * the engines ask for through alloc_scratch in the cookie API). The
+ * allocations are bumped out of blocks we take from the buffer pool of
+ * the thread, and they are all released at once when the connection
+ * moves on to the next request (or goes away), so there is nothing to
+ * free one by one. Blocks the kernel may still be sending from with
+ * zerocopy are held on to until it is done.
+ *
+ * Everything must be done from the thread running the connection.
+ */
+
+struct arena_block;
+
+/**
+ * Allocate memory which lives until the arena is reset
+ * @param c the connection
+ * @param size the number of bytes
+ * @return the memory (aligned for any type) or NULL if we failed to
+ *         allocate it
+ */
+void *arena_alloc(conn *c, size_t size);
+
+/**
+ * Grow an allocation (like realloc does). It grows in place if it is the
+ * last allocation and there is room for it, and else moves to a new one
+ * (the old one is released along with the rest of the arena).
+ * @param c the connection
+ * @param ptr the allocation (or NULL)
+ * @param size the size of it
+ * @param nsize the size we want
+ * @return the allocation or NULL if we failed to allocate it (and ptr is
+ *         left as it is)
+ */
+void *arena_realloc(conn *c, void *ptr, size_t size, size_t nsize);
+
+/**
+ * Release everything allocated from the arena of a connection
+ * @param c the connection
+ */
+void arena_reset(conn *c);
+
+#endif
@@ -18,6 +18,31 @@ int cache_error = 0;
 
 const int initial_pool_size = 64;
 
+#ifdef WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/*
+ * Every thread keeps a magazine (a small stack of free objects) for each
+ * cache, so that allocating and freeing objects doesn't take the lock of
+ * the cache. When the magazine runs empty (or full) we move half a
+ * magazine worth of objects from (or to) the free list of the cache in
+ * one go. An object freed by another thread than the one which allocated
+ * it goes into the magazine of the thread freeing it.
+ */
+#define CACHE_MAGAZINE_SIZE 32
+
+struct cache_magazine {
+    size_t count;
+    void *ptr[CACHE_MAGAZINE_SIZE];
+};
+
+/* The index + 1 of the thread in cache_t.magazines (0 until it has one) */
+static THREAD_LOCAL unsigned int thread_index;
+static volatile unsigned int thread_counter;
+
 static bool inFreeList(cache_t *cache, void *object) {
     bool rv = false;
     size_t i;
@@ -27,6 +52,68 @@ static bool inFreeList(cache_t *cache, void *object) {
     return rv;
 }
 
+static bool inMagazine(struct cache_magazine *mag, void *object) {
+    bool rv = false;
+    size_t i;
+    for (i = 0; i < mag->count; i++) {
+        rv |= mag->ptr[i] == object;
+    }
+    return rv;
+}
+
+/*
+ * Get the magazine of the calling thread (NULL if it doesn't get one, in
+ * which case it has to use the free list of the cache)
+ */
+static struct cache_magazine *get_magazine(cache_t *cache) {
+    struct cache_magazine *mag;
+
+    if (thread_index == 0) {
+#ifdef WIN32
+        thread_index = InterlockedIncrement((volatile LONG *)&thread_counter);
+#else
+        thread_index = __sync_add_and_fetch(&thread_counter, 1);
+#endif
+    }
+    if (thread_index > CACHE_MAX_THREADS) {
+        return NULL;
+    }
+
+    mag = cache->magazines[thread_index - 1];
+    if (mag == NULL) {
+        mag = calloc(1, sizeof(*mag));
+        cache->magazines[thread_index - 1] = mag;
+    }
+    return mag;
+}
+
+/* Put a free element on the free list. Caller must hold the mutex */
+static void depot_put(cache_t *cache, void *ptr) {
+    cb_assert(!inFreeList(cache, ptr));
+    if (cache->freecurr < cache->freetotal) {
+        cache->ptr[cache->freecurr++] = ptr;
+        cb_assert(inFreeList(cache, ptr));
+    } else {
+        /* try to enlarge free connections array */
+        size_t newtotal = cache->freetotal * 2;
+        void **new_free;
+        cb_assert(newtotal > 0);
+        new_free = realloc(cache->ptr, sizeof(void *) * newtotal);
+        if (new_free) {
+            cache->freetotal = newtotal;
+            cache->ptr = new_free;
+            cache->ptr[cache->freecurr++] = ptr;
+            cb_assert(inFreeList(cache, ptr));
+        } else {
+            if (cache->destructor) {
+                cache->destructor(ptr, NULL);
+            }
+            free(ptr);
+            cb_assert(!inFreeList(cache, ptr));
+        }
+    }
+}
+
 cache_t* cache_create(const char *name, size_t bufsize, size_t align,
                       cache_constructor_t* constructor,
                       cache_destructor_t* destructor) {
@@ -66,6 +153,21 @@ static void* get_object(void *ptr) {
 }
 
 void cache_destroy(cache_t *cache) {
+    int ii;
+    for (ii = 0; ii < CACHE_MAX_THREADS; ++ii) {
+        struct cache_magazine *mag = cache->magazines[ii];
+        if (mag == NULL) {
+            continue;
+        }
+        while (mag->count > 0) {
+            void *ptr = mag->ptr[--mag->count];
+            if (cache->destructor) {
+                cache->destructor(get_object(ptr), NULL);
+            }
+            free(ptr);
+        }
+        free(mag);
+    }
     while (cache->freecurr > 0) {
         void *ptr = cache->ptr[--cache->freecurr];
         if (cache->destructor) {
@@ -80,13 +182,33 @@ void cache_destroy(cache_t *cache) {
 }
 
 void* cache_alloc(cache_t *cache) {
-    void *ret;
+    struct cache_magazine *mag = get_magazine(cache);
+    void *ret = NULL;
     void *object;
-    cb_mutex_enter(&cache->mutex);
-    if (cache->freecurr > 0) {
-        ret = cache->ptr[--cache->freecurr];
+
+    if (mag == NULL || mag->count == 0) {
+        cb_mutex_enter(&cache->mutex);
+        if (mag == NULL) {
+            if (cache->freecurr > 0) {
+                ret = cache->ptr[--cache->freecurr];
+                cb_assert(!inFreeList(cache, ret));
+            }
+        } else {
+            /* Refill half of the magazine */
+            while (cache->freecurr > 0 &&
+                   mag->count < CACHE_MAGAZINE_SIZE / 2) {
+                mag->ptr[mag->count++] = cache->ptr[--cache->freecurr];
+            }
+        }
+        cb_mutex_exit(&cache->mutex);
+    }
+    if (mag != NULL && mag->count > 0) {
+        ret = mag->ptr[--mag->count];
+        cb_assert(!inMagazine(mag, ret));
+    }
+
+    if (ret != NULL) {
         object = get_object(ret);
-        cb_assert(!inFreeList(cache, ret));
     } else {
         object = ret = malloc(cache->bufsize);
         if (ret != NULL) {
@@ -99,7 +221,6 @@ void* cache_alloc(cache_t *cache) {
             }
         }
     }
-    cb_mutex_exit(&cache->mutex);
 
 #ifndef NDEBUG
     if (object != NULL) {
@@ -116,53 +237,43 @@ void* cache_alloc(cache_t *cache) {
 }
 
 void cache_free(cache_t *cache, void *object) {
+    struct cache_magazine *mag;
     void *ptr = object;
 #ifndef NDEBUG
     uint64_t *pre = ptr;
-#endif
-
-    cb_mutex_enter(&cache->mutex);
 
-#ifndef NDEBUG
     /* validate redzone... */
     if (memcmp(((char*)ptr) + cache->bufsize - (2 * sizeof(redzone_pattern)),
                &redzone_pattern, sizeof(redzone_pattern)) != 0) {
         raise(SIGABRT);
         cache_error = 1;
-        cb_mutex_exit(&cache->mutex);
         return;
     }
     --pre;
     if (*pre != redzone_pattern) {
         raise(SIGABRT);
         cache_error = -1;
-        cb_mutex_exit(&cache->mutex);
         return;
     }
     ptr = pre;
 #endif
-    cb_assert(!inFreeList(cache, ptr));
-    if (cache->freecurr < cache->freetotal) {
-        cache->ptr[cache->freecurr++] = ptr;
-        cb_assert(inFreeList(cache, ptr));
-    } else {
-        /* try to enlarge free connections array */
-        size_t newtotal = cache->freetotal * 2;
-        void **new_free;
-        cb_assert(newtotal > 0);
-        new_free = realloc(cache->ptr, sizeof(void *) * newtotal);
-        if (new_free) {
-            cache->freetotal = newtotal;
-            cache->ptr = new_free;
-            cache->ptr[cache->freecurr++] = ptr;
-            cb_assert(inFreeList(cache, ptr));
-        } else {
-            if (cache->destructor) {
-                cache->destructor(ptr, NULL);
-            }
-            free(ptr);
-            cb_assert(!inFreeList(cache, ptr));
+
+    mag = get_magazine(cache);
+    if (mag == NULL) {
+        cb_mutex_enter(&cache->mutex);
+        depot_put(cache, ptr);
+        cb_mutex_exit(&cache->mutex);
+        return;
+    }
+
+    cb_assert(!inMagazine(mag, ptr));
+    if (mag->count == CACHE_MAGAZINE_SIZE) {
+        /* Flush half of the magazine */
+        cb_mutex_enter(&cache->mutex);
+        while (mag->count > CACHE_MAGAZINE_SIZE / 2) {
+            depot_put(cache, mag->ptr[--mag->count]);
         }
+        cb_mutex_exit(&cache->mutex);
     }
-    cb_mutex_exit(&cache->mutex);
+    mag->ptr[mag->count++] = ptr;
 }
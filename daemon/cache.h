@@ -38,6 +38,11 @@ typedef int cache_constructor_t(void* obj, void* notused1, int notused2);
  */
 typedef void cache_destructor_t(void* obj, void* notused);
 
+/** The most threads which get magazines of their own (see cache.c) */
+#define CACHE_MAX_THREADS 64
+
+struct cache_magazine;
+
 /**
  * Definition of the structure to keep track of the internal details of
  * the cache allocator. Touching any of these variables results in
@@ -60,6 +65,8 @@ typedef struct {
     cache_constructor_t* constructor;
     /** The destructor to be called each time before we release memory */
     cache_destructor_t* destructor;
+    /** The free elements held by each thread (only it touches its own) */
+    struct cache_magazine *magazines[CACHE_MAX_THREADS];
 } cache_t;
 
 /**
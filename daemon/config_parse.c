@@ -83,6 +83,15 @@ static int get_int_value(cJSON *i, const char *key) {
     }
 }
 
+static int get_non_negative_int_value(cJSON *i, const char *key) {
+    int value = get_int_value(i, key);
+    if (value < 0) {
+        fprintf(stderr, "%s can't be negative\n", key);
+        exit(EXIT_FAILURE);
+    }
+    return value;
+}
+
 static in_port_t get_in_port_value(cJSON *i, const char *key) {
     int value = get_int_value(i, key);
     if (value < 0 || value > UINT16_MAX) {
@@ -295,6 +304,43 @@ static void get_interface_host(int idx, cJSON *r) {
     settings.interfaces[idx].host = strdup(get_host_value(r, "interface host"));
 }
 
+static void get_interface_path(int idx, cJSON *r) {
+    settings.interfaces[idx].path = strdup(get_string_value(r, "interface path"));
+}
+
+static void get_interface_priority(int idx, cJSON *r) {
+    const char *priority = get_string_value(r, "interface priority");
+
+    if (strcasecmp(priority, "high") == 0) {
+        settings.interfaces[idx].priority = CONN_PRIORITY_HIGH;
+    } else if (strcasecmp(priority, "low") == 0) {
+        settings.interfaces[idx].priority = CONN_PRIORITY_LOW;
+    } else {
+        fprintf(stderr, "Invalid value specified for interface priority: "
+                "%s\n", priority);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void get_interface_defer_accept(int idx, cJSON *r) {
+    settings.interfaces[idx].defer_accept =
+        get_non_negative_int_value(r, "interface defer_accept");
+}
+
+static void get_interface_fastopen(int idx, cJSON *r) {
+    settings.interfaces[idx].fastopen =
+        get_non_negative_int_value(r, "interface fastopen");
+}
+
+static void get_interface_cork(int idx, cJSON *r) {
+    settings.interfaces[idx].cork = get_bool_value(r, r->string);
+}
+
+static void get_interface_thread_group(int idx, cJSON *r) {
+    settings.interfaces[idx].thread_group =
+        strdup(get_string_value(r, "interface thread_group"));
+}
+
 static void get_interface_ssl(int idx, cJSON *r) {
     const char *cert = NULL;
     const char *key = NULL;
@@ -331,6 +377,7 @@ static void handle_interface(int idx, cJSON *r) {
     settings.interfaces[idx].ipv4 = true;
     settings.interfaces[idx].ipv6 = true;
     settings.interfaces[idx].tcp_nodelay = true;
+    settings.interfaces[idx].priority = CONN_PRIORITY_HIGH;
 
     if (r->type == cJSON_Object) {
         struct {
@@ -344,7 +391,14 @@ static void handle_interface(int idx, cJSON *r) {
             { "ipv4", get_interface_ipv4 },
             { "ipv6", get_interface_ipv6 },
             { "tcp_nodelay", get_interface_tcp_nodelay },
-            { "ssl", get_interface_ssl }
+            { "ssl", get_interface_ssl },
+            { "path", get_interface_path },
+            { "priority", get_interface_priority },
+            { "thread_group", get_interface_thread_group },
+            { "defer_accept", get_interface_defer_accept },
+            { "fastopen", get_interface_fastopen },
+            { "cork", get_interface_cork },
+            { NULL, NULL }
         };
         cJSON *obj = r->child;
         while (obj != NULL) {
@@ -463,6 +517,206 @@ static void get_datatype(cJSON *o) {
     settings.datatype = get_bool_value(o, o->string);
 }
 
+static void get_numa(cJSON *o) {
+    settings.numa = get_bool_value(o, o->string);
+}
+
+static void get_hot_cache(cJSON *o) {
+    settings.hot_cache = get_non_negative_int_value(o, o->string);
+}
+
+static void get_hot_cache_ttl(cJSON *o) {
+    settings.hot_cache_ttl = get_non_negative_int_value(o, o->string);
+}
+
+static void get_compress_responses(cJSON *o) {
+    settings.compress_responses = get_non_negative_int_value(o, o->string);
+}
+
+static void get_json_detect(cJSON *o) {
+    settings.json_detect = get_bool_value(o, o->string);
+}
+
+static void get_reuseport(cJSON *o) {
+    settings.reuseport = get_bool_value(o, o->string);
+}
+
+static void get_zerocopy_threshold(cJSON *o) {
+    settings.zerocopy_threshold = get_non_negative_int_value(o, o->string);
+}
+
+static void get_coalesce_responses(cJSON *o) {
+    settings.coalesce_responses = get_non_negative_int_value(o, o->string);
+}
+
+static void get_event_time_slice(cJSON *o) {
+    settings.event_time_slice = get_non_negative_int_value(o, o->string);
+}
+
+static void get_executor_threads(cJSON *o) {
+    settings.executor_threads = get_int_value(o, o->string);
+    if (settings.executor_threads < 1) {
+        fprintf(stderr, "executor_threads must be at least 1\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void get_ktls(cJSON *o) {
+    settings.ktls = get_bool_value(o, o->string);
+}
+
+static void get_ssl_session_cache(cJSON *o) {
+    settings.ssl_session_cache = get_non_negative_int_value(o, o->string);
+}
+
+static void get_ssl_session_timeout(cJSON *o) {
+    settings.ssl_session_timeout = get_non_negative_int_value(o, o->string);
+}
+
+static void get_ssl_ticket_rotation(cJSON *o) {
+    settings.ssl_ticket_rotation = get_non_negative_int_value(o, o->string);
+}
+
+static void get_ssl_thread_contexts(cJSON *o) {
+    settings.ssl_thread_contexts = get_bool_value(o, o->string);
+}
+
+static void get_ssl_async(cJSON *o) {
+    settings.ssl_async = get_bool_value(o, o->string);
+}
+
+static void get_buffer_pool_low(cJSON *o) {
+    settings.buffer_pool_low = get_non_negative_int_value(o, o->string);
+}
+
+static void get_buffer_pool_high(cJSON *o) {
+    settings.buffer_pool_high = get_non_negative_int_value(o, o->string);
+}
+
+static void get_idle_hibernate(cJSON *o) {
+    settings.idle_hibernate = get_non_negative_int_value(o, o->string);
+}
+
+static void get_max_pending_output(cJSON *o) {
+    settings.max_pending_output = get_non_negative_int_value(o, o->string);
+}
+
+static void get_replication_threads(cJSON *o) {
+    settings.replication_threads = get_non_negative_int_value(o, o->string);
+}
+
+static void get_replication_nice(cJSON *o) {
+    settings.replication_nice = get_int_value(o, o->string);
+}
+
+static void handle_thread_group(struct thread_group *group, cJSON *r) {
+    cJSON *obj;
+
+    if (r->type != cJSON_Object) {
+        fprintf(stderr, "Invalid entry for thread group\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (obj = r->child; obj != NULL; obj = obj->next) {
+        if (strcasecmp("name", obj->string) == 0) {
+            group->name = strdup(get_string_value(obj, "thread group name"));
+        } else if (strcasecmp("threads", obj->string) == 0) {
+            group->threads = get_non_negative_int_value(obj,
+                                                        "thread group threads");
+        } else if (strcasecmp("busy_poll", obj->string) == 0) {
+            group->busy_poll = get_non_negative_int_value(obj,
+                                                          "thread group busy_poll");
+        } else if (strcasecmp("cpus", obj->string) == 0) {
+            cJSON *cpu;
+            int ii = 0;
+
+            if (obj->type != cJSON_Array) {
+                fprintf(stderr, "Invalid value specified for thread group "
+                        "cpus: %s\n", cJSON_Print(obj));
+                exit(EXIT_FAILURE);
+            }
+            group->ncpus = cJSON_GetArraySize(obj);
+            group->cpus = calloc(group->ncpus + 1, sizeof(int));
+            for (cpu = obj->child; cpu != NULL; cpu = cpu->next) {
+                group->cpus[ii++] = get_non_negative_int_value(cpu,
+                                                               "thread group cpu");
+            }
+        } else {
+            fprintf(stderr, "Unknown token \"%s\" for thread group ignored.\n",
+                    obj->string);
+        }
+    }
+
+    if (group->name == NULL || group->threads == 0) {
+        fprintf(stderr, "A thread group needs a name and some threads\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void get_thread_groups(cJSON *o) {
+    cJSON *c;
+    int ii = 0;
+
+    if (o->type != cJSON_Array) {
+        fprintf(stderr, "Invalid entry for thread_groups\n");
+        exit(EXIT_FAILURE);
+    }
+    settings.num_thread_groups = cJSON_GetArraySize(o);
+    settings.thread_groups = calloc(settings.num_thread_groups,
+                                    sizeof(struct thread_group));
+    for (c = o->child; c != NULL; c = c->next) {
+        handle_thread_group(&settings.thread_groups[ii++], c);
+    }
+}
+
+static void get_port_timings(cJSON *o) {
+    settings.port_timings = get_bool_value(o, o->string);
+}
+
+static void get_slow_op_threshold(cJSON *o) {
+    settings.slow_op_threshold = get_non_negative_int_value(o, o->string);
+}
+
+static void get_stats_aggregate_interval(cJSON *o) {
+    settings.stats_aggregate_interval = get_non_negative_int_value(o, o->string);
+}
+
+static void get_lock_stats_sample(cJSON *o) {
+    settings.lock_stats_sample = get_non_negative_int_value(o, o->string);
+}
+
+static void get_request_trace(cJSON *o) {
+    settings.request_trace = get_bool_value(o, o->string);
+}
+
+static void get_trace_sample_rate(cJSON *o) {
+    settings.trace_sample_rate = get_non_negative_int_value(o, o->string);
+}
+
+static void get_trace_ring_size(cJSON *o) {
+    settings.trace_ring_size = get_non_negative_int_value(o, o->string);
+}
+
+static void get_jemalloc_arenas(cJSON *o) {
+    settings.jemalloc_arenas = get_bool_value(o, o->string);
+}
+
+static void get_jemalloc_tcache(cJSON *o) {
+    settings.jemalloc_tcache = get_bool_value(o, o->string);
+}
+
+static void get_hot_restart(cJSON *o) {
+    settings.hot_restart = strdup(get_string_value(o, o->string));
+}
+
+static void get_hot_restart_drain(cJSON *o) {
+    settings.hot_restart_drain = get_non_negative_int_value(o, o->string);
+}
+
+static void get_hash_algorithm(cJSON *o) {
+    settings.hash_algorithm = strdup(get_string_value(o, o->string));
+}
+
 void read_config_file(const char *file)
 {
     struct {
@@ -486,6 +740,41 @@ void read_config_file(const char *file)
         { "pid_file", get_pid_file },
         { "bio_drain_buffer_sz", get_bio_drain_buffer_sz },
         { "datatype_support", get_datatype },
+        { "numa", get_numa },
+        { "hot_cache", get_hot_cache },
+        { "hot_cache_ttl", get_hot_cache_ttl },
+        { "compress_responses", get_compress_responses },
+        { "json_detect", get_json_detect },
+        { "reuseport", get_reuseport },
+        { "zerocopy_threshold", get_zerocopy_threshold },
+        { "coalesce_responses", get_coalesce_responses },
+        { "event_time_slice", get_event_time_slice },
+        { "executor_threads", get_executor_threads },
+        { "ktls", get_ktls },
+        { "ssl_session_cache", get_ssl_session_cache },
+        { "ssl_session_timeout", get_ssl_session_timeout },
+        { "ssl_ticket_rotation", get_ssl_ticket_rotation },
+        { "ssl_thread_contexts", get_ssl_thread_contexts },
+        { "ssl_async", get_ssl_async },
+        { "buffer_pool_low", get_buffer_pool_low },
+        { "buffer_pool_high", get_buffer_pool_high },
+        { "idle_hibernate", get_idle_hibernate },
+        { "max_pending_output", get_max_pending_output },
+        { "replication_threads", get_replication_threads },
+        { "replication_nice", get_replication_nice },
+        { "thread_groups", get_thread_groups },
+        { "port_timings", get_port_timings },
+        { "slow_op_threshold", get_slow_op_threshold },
+        { "stats_aggregate_interval", get_stats_aggregate_interval },
+        { "lock_stats_sample", get_lock_stats_sample },
+        { "hash_algorithm", get_hash_algorithm },
+        { "request_trace", get_request_trace },
+        { "trace_sample_rate", get_trace_sample_rate },
+        { "trace_ring_size", get_trace_ring_size },
+        { "jemalloc_arenas", get_jemalloc_arenas },
+        { "jemalloc_tcache", get_jemalloc_tcache },
+        { "hot_restart", get_hot_restart },
+        { "hot_restart_drain", get_hot_restart_drain },
         { NULL, NULL}
     };
     cJSON *obj;
@@ -16,16 +16,53 @@
  */
 
 #include "connections.h"
+#include "hot_cache.h"
+#include "zerocopy.h"
+#include "ssl_context.h"
+#include "net_buf_pool.h"
+#include "arena.h"
+#include "timings.h"
 
 /*
  * Free list management for connections.
+ *
+ * The connections come out of a slab sized for settings.maxconns, which
+ * we construct as we first use them. A released connection keeps its
+ * (default sized) arrays and goes onto a lock-free stack of free ones for
+ * the next connection to pick up. The head of the stack is the index of
+ * the top connection (plus one, so that 0 is the empty stack) in its low
+ * half and a tag we bump with every change in its high half, so that a
+ * pop racing with a pop and a push of the same connection fails its cas.
+ *
+ * The connections we have to malloc once the slab runs out are kept
+ * in the list (and take the mutex).
  */
 struct connections {
     conn sentinal; /* Sentinal conn object used as the base of the linked-list
                       of connections. */
     cb_mutex_t mutex;
+    mc_mutex_stats_t mutex_stats;
+    /* Every connection in it starts on a cache line of its own, so that
+     * the hot fields at the start of it share the first two (see
+     * struct conn) */
+    char *slab_mem;
+    char *slab;
+    size_t slab_stride;
+    uint32_t slab_size;
+    /* The number of connections we took out of the slab so far */
+    volatile uint32_t slab_used;
+    /* The next free connection of every one in the slab (index plus one) */
+    uint32_t *slab_next;
+    volatile uint64_t free_head;
 } connections;
 
+/* The size we align the connections in the slab to */
+#define CONN_CACHE_LINE 64
+
+static conn *slab_conn(uint32_t idx) {
+    return (conn *)(connections.slab + idx * connections.slab_stride);
+}
+
 /** Types ********************************************************************/
 
 /** Result of a buffer loan attempt */
@@ -40,11 +77,11 @@ enum loan_res {
 static void conn_loan_buffers(conn *c);
 static void conn_return_buffers(conn *c);
 static bool conn_reset_buffersize(conn *c);
-static enum loan_res conn_loan_single_buffer(conn *c, struct net_buf *thread_buf,
-                                             struct net_buf *conn_buf);
-static void conn_return_single_buffer(conn *c, struct net_buf *thread_buf,
-                                      struct net_buf *conn_buf);
+static enum loan_res conn_loan_single_buffer(conn *c, struct net_buf *conn_buf);
+static void conn_return_single_buffer(conn *c, struct net_buf *conn_buf);
+static void conn_free_ssl(conn *c);
 static int conn_constructor(conn *c);
+static void conn_recycle(conn *c);
 static void conn_destructor(conn *c);
 static conn *allocate_connection(void);
 static void release_connection(conn *c);
@@ -55,12 +92,37 @@ static void release_connection(conn *c);
 void initialize_connections(void)
 {
     cb_mutex_initialize(&connections.mutex);
+    mc_mutex_stats_register(&connections.mutex_stats, "connections");
     connections.sentinal.all_next = &connections.sentinal;
     connections.sentinal.all_prev = &connections.sentinal;
+
+    /* The pages of the slab are only touched once we use them */
+    connections.slab_size = settings.maxconns;
+    connections.slab_used = 0;
+    connections.free_head = 0;
+    connections.slab_stride = (sizeof(conn) + CONN_CACHE_LINE - 1) &
+                              ~(size_t)(CONN_CACHE_LINE - 1);
+    connections.slab_mem = calloc(1, connections.slab_size *
+                                  connections.slab_stride + CONN_CACHE_LINE);
+    connections.slab_next = calloc(connections.slab_size, sizeof(uint32_t));
+    if (connections.slab_mem == NULL || connections.slab_next == NULL) {
+        /* Everything gets malloc'ed instead */
+        free(connections.slab_mem);
+        free(connections.slab_next);
+        connections.slab_mem = NULL;
+        connections.slab_next = NULL;
+        connections.slab_size = 0;
+    }
+    connections.slab = (char *)(((uintptr_t)connections.slab_mem +
+                                 CONN_CACHE_LINE - 1) &
+                                ~(uintptr_t)(CONN_CACHE_LINE - 1));
 }
 
 void destroy_connections(void)
 {
+    uint32_t ii;
+    uint32_t used = connections.slab_used;
+
     /* traverse the list of connections. */
     conn *c = connections.sentinal.all_next;
     while (c != &connections.sentinal) {
@@ -70,6 +132,24 @@ void destroy_connections(void)
     }
     connections.sentinal.all_next = &connections.sentinal;
     connections.sentinal.all_prev = &connections.sentinal;
+
+    /* and the ones in the slab (in use or not) */
+    if (used > connections.slab_size) {
+        used = connections.slab_size;
+    }
+    for (ii = 0; ii < used; ++ii) {
+        /* Unless we failed to construct it */
+        if (slab_conn(ii)->iov != NULL) {
+            conn_destructor(slab_conn(ii));
+        }
+    }
+    free(connections.slab_mem);
+    free(connections.slab_next);
+    connections.slab_mem = NULL;
+    connections.slab = NULL;
+    connections.slab_next = NULL;
+    connections.slab_size = connections.slab_used = 0;
+    connections.free_head = 0;
 }
 
 void run_event_loop(conn* c) {
@@ -89,6 +169,12 @@ void run_event_loop(conn* c) {
         conn_return_buffers(c);
     }
 
+    if (c->state == conn_move_thread || c->state == conn_leave_thread) {
+        /* Another thread owns it from now on */
+        dispatch_conn_move(c);
+        return;
+    }
+
     if (c->state == conn_destroyed) {
         /* Actually free the memory from this connection. Unsafe to dereference
          * c after this point.
@@ -110,47 +196,62 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
     c->admin = false;
     cb_assert(c->thread == NULL);
 
-    memset(&c->ssl, 0, sizeof(c->ssl));
+    cb_assert(c->ssl == NULL);
     if (init_state != conn_listening) {
         int ii;
         for (ii = 0; ii < settings.num_interfaces; ++ii) {
             if (parent_port == settings.interfaces[ii].port) {
                 if (settings.interfaces[ii].ssl.cert != NULL) {
-                    const char *cert = settings.interfaces[ii].ssl.cert;
-                    const char *pkey = settings.interfaces[ii].ssl.key;
-
-                    c->ssl.ctx = SSL_CTX_new(SSLv23_server_method());
+                    c->ssl = calloc(1, sizeof(*c->ssl));
+                    if (c->ssl == NULL) {
+                        release_connection(c);
+                        return NULL;
+                    }
 
-                    /* @todo don't read files, but use in-memory-copies */
-                    if (!SSL_CTX_use_certificate_chain_file(c->ssl.ctx, cert) ||
-                        !SSL_CTX_use_PrivateKey_file(c->ssl.ctx, pkey, SSL_FILETYPE_PEM)) {
+                    /* Shared by all of the connections to the port (or
+                     * the ones of the thread, with ssl_thread_contexts),
+                     * so that the clients may resume their sessions */
+                    c->ssl->ctx = ssl_context_get(ii);
+                    if (c->ssl->ctx == NULL) {
                         release_connection(c);
                         return NULL;
                     }
 
-                    c->ssl.enabled = true;
-                    c->ssl.error = false;
-                    c->ssl.client = NULL;
+#ifdef HAVE_KTLS
+                    if (settings.ktls) {
+                        /* OpenSSL only hands the keys over to the kernel
+                         * for a socket of its own */
+                        c->ssl->client = SSL_new(c->ssl->ctx);
+                        if (c->ssl->client == NULL ||
+                            SSL_set_fd(c->ssl->client, (int)sfd) != 1) {
+                            release_connection(c);
+                            return NULL;
+                        }
+                        SSL_set_options(c->ssl->client, SSL_OP_ENABLE_KTLS);
+                        c->ssl->socket_bio = true;
+                        continue;
+                    }
+#endif
 
-                    c->ssl.in.buffer = malloc(settings.bio_drain_buffer_sz);
-                    c->ssl.out.buffer = malloc(settings.bio_drain_buffer_sz);
+                    c->ssl->in.buffer = malloc(settings.bio_drain_buffer_sz);
+                    c->ssl->out.buffer = malloc(settings.bio_drain_buffer_sz);
 
-                    if (c->ssl.in.buffer == NULL || c->ssl.out.buffer == NULL) {
+                    if (c->ssl->in.buffer == NULL || c->ssl->out.buffer == NULL) {
                         release_connection(c);
                         return NULL;
                     }
 
-                    c->ssl.in.buffsz = settings.bio_drain_buffer_sz;
-                    c->ssl.out.buffsz = settings.bio_drain_buffer_sz;
-                    BIO_new_bio_pair(&c->ssl.application,
+                    c->ssl->in.buffsz = settings.bio_drain_buffer_sz;
+                    c->ssl->out.buffsz = settings.bio_drain_buffer_sz;
+                    BIO_new_bio_pair(&c->ssl->application,
                                      settings.bio_drain_buffer_sz,
-                                     &c->ssl.network,
+                                     &c->ssl->network,
                                      settings.bio_drain_buffer_sz);
 
-                    c->ssl.client = SSL_new(c->ssl.ctx);
-                    SSL_set_bio(c->ssl.client,
-                                c->ssl.application,
-                                c->ssl.application);
+                    c->ssl->client = SSL_new(c->ssl->ctx);
+                    SSL_set_bio(c->ssl->client,
+                                c->ssl->application,
+                                c->ssl->application);
                 }
             }
         }
@@ -170,6 +271,15 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
 
     c->sfd = sfd;
     c->parent_port = parent_port;
+    c->bucket_timings = NULL;
+    c->port_timings = NULL;
+    c->slow_op.start = 0;
+    c->span.sampled = false;
+    if (settings.port_timings && init_state != conn_listening) {
+        char name[32];
+        snprintf(name, sizeof(name), "port:%u", (unsigned int)parent_port);
+        c->port_timings = timings_group_get(name, true);
+    }
     c->state = init_state;
     c->rlbytes = 0;
     c->cmd = -1;
@@ -178,6 +288,7 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
     c->read.curr = c->read.buf = NULL;
     c->read.size = c->write.size = 0;
     c->ritem = 0;
+    c->riovused = c->riovcurr = 0;
     c->icurr = c->ilist = NULL;
     c->temp_alloc_curr = c->temp_alloc_list;
     c->ileft = 0;
@@ -186,19 +297,28 @@ conn *conn_new(const SOCKET sfd, in_port_t parent_port,
     c->msgcurr = 0;
     c->msgused = 0;
     c->next = NULL;
-    c->list_state = 0;
+    c->pending_prev = NULL;
+    c->io_pending = 0;
 
     c->write_and_go = init_state;
-    c->write_and_free = 0;
     c->item = 0;
+    c->hot_item = NULL;
     c->supports_datatype = false;
+    c->supports_compression = false;
     c->noreply = false;
+    c->coalesced.bytes = 0;
+    c->write_prepared = false;
+    zerocopy_init(c);
+    c->cork = init_state != conn_listening && interface_cork(parent_port);
 
     event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
     event_base_set(base, &c->event);
+    conn_set_priority(c, init_state == conn_listening ? CONN_PRIORITY_HIGH :
+                      interface_priority(parent_port));
     c->ev_flags = event_flags;
 
-    if (!register_event(c, timeout)) {
+    if (!register_event(c, timeout != NULL ? timeout :
+                                    idle_timeout(c, event_flags))) {
         cb_assert(c->thread == NULL);
         release_connection(c);
         return NULL;
@@ -226,6 +346,10 @@ static void conn_cleanup(conn *c) {
         settings.engine.v1->release(settings.engine.v0, c, c->item);
         c->item = 0;
     }
+    if (c->hot_item) {
+        hot_cache_release(c->hot_item);
+        c->hot_item = NULL;
+    }
 
     if (c->ileft != 0) {
         for (; c->ileft > 0; c->ileft--,c->icurr++) {
@@ -239,11 +363,6 @@ static void conn_cleanup(conn *c) {
         }
     }
 
-    if (c->write_and_free) {
-        free(c->write_and_free);
-        c->write_and_free = 0;
-    }
-
     if (c->sasl_conn) {
         cbsasl_dispose(&c->sasl_conn);
         c->sasl_conn = NULL;
@@ -260,23 +379,26 @@ static void conn_cleanup(conn *c) {
      */
     c->tap_iterator = NULL;
     c->dcp = 0;
+    c->dcp_window = c->dcp_unacked = 0;
     conn_return_buffers(c);
 
     c->engine_storage = NULL;
+    arena_reset(c);
+    zerocopy_release_all(c);
+    free(c->coalesced.buf);
+    c->coalesced.buf = NULL;
+    c->coalesced.size = c->coalesced.bytes = 0;
 
+    if (c->thread != NULL) {
+        thread_conn_released(c->thread);
+    }
     c->thread = NULL;
     cb_assert(c->next == NULL);
     c->sfd = INVALID_SOCKET;
     c->start = 0;
-    if (c->ssl.enabled) {
-        BIO_free_all(c->ssl.network);
-        SSL_free(c->ssl.client);
-        c->ssl.enabled = false;
-        c->ssl.error = false;
-        free(c->ssl.in.buffer);
-        free(c->ssl.out.buffer);
-        memset(&c->ssl, 0, sizeof(c->ssl));
-    }
+    c->slow_op.start = 0;
+    c->span.sampled = false;
+    conn_free_ssl(c);
 }
 
 void conn_close(conn *c) {
@@ -286,11 +408,11 @@ void conn_close(conn *c) {
 
     cb_assert(c->thread);
     /* remove from pending-io list */
-    if (settings.verbose > 1 && list_contains(c->thread->pending_io, c)) {
+    if (settings.verbose > 1 && c->io_pending) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                                         "Current connection was in the pending-io list.. Nuking it\n");
     }
-    c->thread->pending_io = list_remove(c->thread->pending_io, c);
+    remove_pending_io(c);
 
     conn_cleanup(c);
 
@@ -309,7 +431,8 @@ void conn_shrink(conn *c) {
             memmove(c->read.buf, c->read.curr, (size_t)c->read.bytes);
         }
 
-        newbuf = realloc(c->read.buf, DATA_BUFFER_SIZE);
+        newbuf = net_buf_pool_resize(c->thread->buffers, c->read.buf,
+                                     c->read.size, DATA_BUFFER_SIZE);
 
         if (newbuf) {
             c->read.buf = newbuf;
@@ -336,24 +459,82 @@ void conn_shrink(conn *c) {
     }
 }
 
+void conn_hibernate(conn *c) {
+    cb_assert(!c->hibernated);
+
+    free(c->ilist);
+    c->ilist = NULL;
+    c->isize = 0;
+    free(c->riov);
+    c->riov = NULL;
+    c->riovsize = 0;
+    free(c->temp_alloc_list);
+    c->temp_alloc_list = NULL;
+    c->temp_alloc_size = 0;
+    free(c->iov);
+    c->iov = NULL;
+    c->iovsize = 0;
+    free(c->msglist);
+    c->msglist = NULL;
+    c->msgsize = 0;
+
+    free(c->coalesced.buf);
+    c->coalesced.buf = NULL;
+    c->coalesced.size = c->coalesced.bytes = 0;
+
+    if (c->ssl != NULL && !c->ssl->socket_bio) {
+        free(c->ssl->in.buffer);
+        free(c->ssl->out.buffer);
+        c->ssl->in.buffer = c->ssl->out.buffer = NULL;
+    }
+
+    c->hibernated = true;
+    STATS_LOCK();
+    stats.hibernated_conns++;
+    STATS_UNLOCK();
+}
+
+bool conn_wake(conn *c) {
+    bool ret;
+
+    cb_assert(c->hibernated);
+    c->hibernated = false;
+    STATS_LOCK();
+    stats.hibernated_conns--;
+    STATS_UNLOCK();
+
+    /* All of the sizes are 0, so this allocates all of them */
+    ret = conn_reset_buffersize(c);
+
+    if (c->ssl != NULL && !c->ssl->socket_bio) {
+        c->ssl->in.buffer = malloc(c->ssl->in.buffsz);
+        c->ssl->out.buffer = malloc(c->ssl->out.buffsz);
+        if (c->ssl->in.buffer == NULL || c->ssl->out.buffer == NULL) {
+            ret = false;
+        }
+    }
+
+    return ret;
+}
+
 /** Internal functions *******************************************************/
 
 /**
  * If the connection doesn't already have read/write buffers, ensure that it
  * does.
  *
- * In the common case, only one read/write buffer is created per worker thread,
- * and this buffer is loaned to the connection the worker is currently
- * handling. As long as the connection doesn't have a partial read/write (i.e.
- * the buffer is totally consumed) when it goes idle, the buffer is simply
- * returned back to the worker thread.
+ * The buffers are loaned from the pool of the worker thread (see
+ * net_buf_pool.h) to the connection the worker is currently handling. As
+ * long as the connection doesn't have a partial read/write (i.e. the buffer
+ * is totally consumed) when it goes idle, the buffer is simply returned
+ * back to the pool.
  *
  * If there is a partial read/write, then the buffer is left loaned to that
- * connection and the worker thread will allocate a new one.
+ * connection and the next connection gets another one from the pool.
  */
 static void conn_loan_buffers(conn *c) {
     enum loan_res res;
-    res = conn_loan_single_buffer(c, &c->thread->read, &c->read);
+    res = conn_loan_single_buffer(c, &c->read);
     if (res == loan_allocated) {
         STATS_NOKEY(c, rbufs_allocated);
     } else if (res == loan_loaned) {
@@ -362,7 +543,7 @@ static void conn_loan_buffers(conn *c) {
         STATS_NOKEY(c, rbufs_existing);
     }
 
-    res = conn_loan_single_buffer(c, &c->thread->write, &c->write);
+    res = conn_loan_single_buffer(c, &c->write);
     if (res == loan_allocated) {
         STATS_NOKEY(c, wbufs_allocated);
     } else if (res == loan_loaned) {
@@ -374,7 +555,8 @@ static void conn_loan_buffers(conn *c) {
  * Return any empty buffers back to the owning worker thread.
  *
  * Converse of conn_loan_buffer(); if any of the read/write buffers are empty
- * (have no partial data) then return the buffer back to the worker thread.
+ * (have no partial data) then return the buffer back to the pool of the
+ * worker thread.
  * If there is partial data, then keep the buffer with the connection.
  */
 static void conn_return_buffers(conn *c) {
@@ -392,8 +574,8 @@ static void conn_return_buffers(conn *c) {
         return;
     }
 
-    conn_return_single_buffer(c, &c->thread->read, &c->read);
-    conn_return_single_buffer(c, &c->thread->write, &c->write);
+    conn_return_single_buffer(c, &c->read);
+    conn_return_single_buffer(c, &c->write);
 }
 
 /**
@@ -418,6 +600,11 @@ static bool conn_reset_buffersize(conn *c) {
     c->ilist = NULL;
     c->isize = 0;
 
+    /* Only needed for values not stored contiguously by the engine */
+    free(c->riov);
+    c->riov = NULL;
+    c->riovsize = 0;
+
     if (c->temp_alloc_size != TEMP_ALLOC_LIST_INITIAL) {
         void *ptr = malloc(sizeof(char *) * TEMP_ALLOC_LIST_INITIAL);
         if (ptr != NULL) {
@@ -487,29 +674,180 @@ static int conn_constructor(conn *c) {
     return 0;
 }
 
+/**
+ * Release the SSL state of a connection (if it has any)
+ */
+static void conn_free_ssl(conn *c) {
+    if (c->ssl != NULL) {
+#ifdef SSL_MODE_ASYNC
+        if (c->ssl->async_waiting) {
+            event_del(&c->ssl->async_event);
+        }
+#endif
+        BIO_free_all(c->ssl->network);
+        SSL_free(c->ssl->client);
+        free(c->ssl->in.buffer);
+        free(c->ssl->out.buffer);
+        free(c->ssl);
+        c->ssl = NULL;
+    }
+}
+
+/**
+ * Put a released connection back into the state conn_constructor leaves it
+ * in, keeping the arrays it allocated (shrunk back to their default sizes).
+ */
+static void conn_recycle(conn *c) {
+    struct iovec *iov;
+    int iovsize;
+    struct msghdr *msglist;
+    int msgsize;
+    char **temp_alloc_list;
+    int temp_alloc_size;
+
+    free(c->read.buf);
+    free(c->write.buf);
+    /* conn_new may have failed half way through setting it up */
+    conn_free_ssl(c);
+    arena_reset(c);
+    /* If it fails we just keep the bigger ones */
+    (void)conn_reset_buffersize(c);
+
+    iov = c->iov;
+    iovsize = c->iovsize;
+    msglist = c->msglist;
+    msgsize = c->msgsize;
+    temp_alloc_list = c->temp_alloc_list;
+    temp_alloc_size = c->temp_alloc_size;
+
+    memset(c, 0, sizeof(*c));
+    c->iov = iov;
+    c->iovsize = iovsize;
+    c->msglist = msglist;
+    c->msgsize = msgsize;
+    c->temp_alloc_list = temp_alloc_list;
+    c->temp_alloc_size = temp_alloc_size;
+    c->state = conn_immediate_close;
+    c->sfd = INVALID_SOCKET;
+}
+
+static bool in_slab(const conn *c) {
+    const char *ptr = (const char *)c;
+    return connections.slab_size > 0 && ptr >= connections.slab &&
+           ptr < connections.slab +
+                 connections.slab_size * connections.slab_stride;
+}
+
 /**
  * Destructor for all connection objects. Release all allocated resources.
  */
 static void conn_destructor(conn *c) {
+    conn_free_ssl(c);
+    arena_reset(c);
     free(c->read.buf);
     free(c->write.buf);
     free(c->ilist);
     free(c->temp_alloc_list);
     free(c->iov);
+    free(c->riov);
     free(c->msglist);
-    free(c);
+    if (!in_slab(c)) {
+        free(c);
+    }
 
     STATS_LOCK();
     stats.conn_structs--;
     STATS_UNLOCK();
 }
 
-/** Allocate a connection, creating memory and adding it to the conections
- *  list. Returns a pointer to the newly-allocated connection if successful,
- *  else NULL.
+#ifdef WIN32
+static bool cas_uint64(volatile uint64_t *dst, uint64_t oldval, uint64_t newval) {
+    uint64_t prev = InterlockedCompareExchange64((volatile LONGLONG *)dst,
+                                                 newval, oldval);
+    return prev == oldval;
+}
+
+static uint32_t slab_take(void) {
+    return InterlockedIncrement((volatile LONG *)&connections.slab_used) - 1;
+}
+#elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+static bool cas_uint64(volatile uint64_t *dst, uint64_t oldval, uint64_t newval) {
+    uint64_t prev = atomic_cas_64(dst, oldval, newval);
+    return prev == oldval;
+}
+
+static uint32_t slab_take(void) {
+    return atomic_inc_32_nv(&connections.slab_used) - 1;
+}
+#else
+static bool cas_uint64(volatile uint64_t *dst, uint64_t oldval, uint64_t newval) {
+    return __sync_bool_compare_and_swap(dst, oldval, newval);
+}
+
+static uint32_t slab_take(void) {
+    return __sync_fetch_and_add(&connections.slab_used, 1);
+}
+#endif
+
+static void free_list_push(conn *c) {
+    uint32_t idx = (uint32_t)(((char *)c - connections.slab) /
+                              connections.slab_stride);
+    uint64_t head;
+    uint64_t next;
+
+    do {
+        head = connections.free_head;
+        connections.slab_next[idx] = (uint32_t)head;
+        next = (((head >> 32) + 1) << 32) | (idx + 1);
+    } while (!cas_uint64(&connections.free_head, head, next));
+}
+
+static conn *free_list_pop(void) {
+    uint64_t head;
+    uint64_t next;
+    uint32_t top;
+
+    do {
+        head = connections.free_head;
+        top = (uint32_t)head;
+        if (top == 0) {
+            return NULL;
+        }
+        /* May be stale if someone else took it, but then the cas fails */
+        next = (((head >> 32) + 1) << 32) | connections.slab_next[top - 1];
+    } while (!cas_uint64(&connections.free_head, head, next));
+
+    return slab_conn(top - 1);
+}
+
+/** Allocate a connection, picking up a free one or constructing the next
+ *  one of the slab (or malloc'ing it and adding it to the connections list
+ *  once the slab runs out). Returns a pointer to the connection if
+ *  successful, else NULL.
  */
 static conn *allocate_connection(void) {
-    conn *ret = malloc(sizeof(conn));
+    conn *ret = free_list_pop();
+    if (ret != NULL) {
+        return ret;
+    }
+
+    if (connections.slab_used < connections.slab_size) {
+        uint32_t idx = slab_take();
+        if (idx < connections.slab_size) {
+            ret = slab_conn(idx);
+            if (conn_constructor(ret) != 0) {
+                /* We lose the slot (destroy_connections skips it) */
+                memset(ret, 0, sizeof(*ret));
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                                "Failed to allocate memory for connection");
+                return NULL;
+            }
+            return ret;
+        }
+    }
+
+    ret = malloc(sizeof(conn));
     if (ret == NULL) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
                                         "Failed to allocate memory for connection");
@@ -523,7 +861,7 @@ static conn *allocate_connection(void) {
         return NULL;
     }
 
-    cb_mutex_enter(&connections.mutex);
+    mc_mutex_enter(&connections.mutex, &connections.mutex_stats);
     // First update the new nodes' links ...
     ret->all_next = connections.sentinal.all_next;
     ret->all_prev = &connections.sentinal;
@@ -535,11 +873,18 @@ static conn *allocate_connection(void) {
     return ret;
 }
 
-/** Release a connection; removing it from the connection list management
- *  and freeing the conn object.
+/** Release a connection; handing it back to the free list (or removing it
+ *  from the connection list management and freeing the conn object if it
+ *  isn't one of the slab).
  */
 static void release_connection(conn *c) {
-    cb_mutex_enter(&connections.mutex);
+    if (in_slab(c)) {
+        conn_recycle(c);
+        free_list_push(c);
+        return;
+    }
+
+    mc_mutex_enter(&connections.mutex, &connections.mutex_stats);
     c->all_next->all_prev = c->all_prev;
     c->all_prev->all_next = c->all_next;
     cb_mutex_exit(&connections.mutex);
@@ -550,64 +895,51 @@ static void release_connection(conn *c) {
 
 /**
  * If the connection doesn't already have a populated conn_buff, ensure that
- * it does by either loaning out the threads, or allocating a new one if
- * necessary.
+ * it does by loaning one from the pool of the thread (which allocates a new
+ * one if it ran dry).
  */
-static enum loan_res conn_loan_single_buffer(conn *c, struct net_buf *thread_buf,
-                                    struct net_buf *conn_buf)
+static enum loan_res conn_loan_single_buffer(conn *c, struct net_buf *conn_buf)
 {
+    bool allocated;
+
     /* Already have a (partial) buffer - nothing to do. */
     if (conn_buf->buf != NULL) {
         return loan_existing;
     }
 
-    if (thread_buf->buf != NULL) {
-        /* Loan thread's buffer to connection. */
-        *conn_buf = *thread_buf;
-
-        thread_buf->buf = NULL;
-        thread_buf->size = 0;
-        return loan_loaned;
-    } else {
-        /* Need to allocate a new buffer. */
-        conn_buf->buf = malloc(DATA_BUFFER_SIZE);
-        if (conn_buf->buf == NULL) {
-            /* Unable to alloc a buffer for the thread. Not much we can do here
-             * other than terminate the current connection.
-             */
-            if (settings.verbose) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                    "%d: Failed to allocate new read buffer.. closing connection\n",
-                    c->sfd);
-            }
-            conn_set_state(c, conn_closing);
-            return loan_existing;
+    conn_buf->buf = net_buf_pool_get(c->thread->buffers, DATA_BUFFER_SIZE,
+                                     &allocated);
+    if (conn_buf->buf == NULL) {
+        /* Unable to alloc a buffer for the thread. Not much we can do here
+         * other than terminate the current connection.
+         */
+        if (settings.verbose) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                "%d: Failed to allocate new read buffer.. closing connection\n",
+                c->sfd);
         }
-        conn_buf->size = DATA_BUFFER_SIZE;
-        conn_buf->curr = conn_buf->buf;
-        conn_buf->bytes = 0;
-        return loan_allocated;
+        conn_set_state(c, conn_closing);
+        return loan_existing;
     }
+    conn_buf->size = DATA_BUFFER_SIZE;
+    conn_buf->curr = conn_buf->buf;
+    conn_buf->bytes = 0;
+    return allocated ? loan_allocated : loan_loaned;
 }
 
 /**
- * Return an empty read buffer back to the owning worker thread.
+ * Return an empty buffer back to the pool of the owning worker thread.
  */
-static void conn_return_single_buffer(conn *c, struct net_buf *thread_buf,
-                                      struct net_buf *conn_buf) {
+static void conn_return_single_buffer(conn *c, struct net_buf *conn_buf) {
     if (conn_buf->buf == NULL) {
         /* No buffer - nothing to do. */
         return;
     }
 
     if ((conn_buf->curr == conn_buf->buf) && (conn_buf->bytes == 0)) {
-        /* Buffer clean, dispose of it. */
-        if (thread_buf->buf == NULL) {
-            /* Give back to thread. */
-            *thread_buf = *conn_buf;
-        } else {
-            free(conn_buf->buf);
-        }
+        /* Buffer clean, hand it back (the pool frees it if it has enough
+         * of them already). */
+        net_buf_pool_put(c->thread->buffers, conn_buf->buf, conn_buf->size);
         conn_buf->buf = conn_buf->curr = NULL;
         conn_buf->size = 0;
     } else {
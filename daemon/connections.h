@@ -60,4 +60,18 @@ void conn_close(conn *c);
  */
 void conn_shrink(conn *c);
 
+/*
+ * Frees everything an idle connection can do without (its arrays, the
+ * SSL drain buffers and the coalesced responses) until it wakes up again
+ * (see the idle_hibernate setting). The connection must not have any
+ * buffered data.
+ */
+void conn_hibernate(conn *c);
+
+/*
+ * Reallocates what conn_hibernate freed. Returns false if we failed to
+ * (and the connection should be closed).
+ */
+bool conn_wake(conn *c);
+
 #endif /* CONNECTIONS_H */
@@ -0,0 +1,174 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The pool of threads for the blocking work (see executor.h)
+ */
+#include "config.h"
+#include "executor.h"
+
+#include <stdlib.h>
+
+struct executor_task {
+    struct executor_task *next;
+    const void *cookie;
+    EXECUTOR_TASK task;
+    void *arg;
+};
+
+struct executor_queue {
+    struct executor_task *head;
+    struct executor_task *tail;
+    size_t size;
+};
+
+static struct {
+    cb_mutex_t mutex;
+    cb_cond_t cond;
+    /* Indexed by the priority */
+    struct executor_queue queues[EXECUTOR_PRIORITY_LOW + 1];
+    cb_thread_t *tids;
+    int nthreads;
+    bool shutdown;
+    uint64_t done;
+    uint64_t rejected;
+} executor;
+
+/* Caller must hold executor.mutex */
+static struct executor_task *executor_pop(void) {
+    int ii;
+
+    for (ii = EXECUTOR_PRIORITY_HIGH; ii <= EXECUTOR_PRIORITY_LOW; ++ii) {
+        struct executor_queue *queue = &executor.queues[ii];
+        struct executor_task *task = queue->head;
+        if (task != NULL) {
+            queue->head = task->next;
+            if (queue->head == NULL) {
+                queue->tail = NULL;
+            }
+            queue->size--;
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+static void executor_main(void *arg) {
+    cb_mutex_enter(&executor.mutex);
+    while (!executor.shutdown) {
+        struct executor_task *task = executor_pop();
+        ENGINE_ERROR_CODE status;
+
+        if (task == NULL) {
+            cb_cond_wait(&executor.cond, &executor.mutex);
+            continue;
+        }
+
+        cb_mutex_exit(&executor.mutex);
+        status = task->task(task->arg);
+        if (task->cookie != NULL) {
+            notify_io_complete(task->cookie, status);
+        }
+        free(task);
+        cb_mutex_enter(&executor.mutex);
+        executor.done++;
+    }
+    cb_mutex_exit(&executor.mutex);
+}
+
+void executor_init(int nthreads) {
+    int ii;
+
+    cb_mutex_initialize(&executor.mutex);
+    cb_cond_initialize(&executor.cond);
+
+    executor.tids = calloc(nthreads, sizeof(cb_thread_t));
+    if (executor.tids == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to allocate the executor threads");
+        exit(EXIT_FAILURE);
+    }
+
+    for (ii = 0; ii < nthreads; ++ii) {
+        int ret = cb_create_thread(&executor.tids[ii], executor_main, NULL, 0);
+        if (ret != 0) {
+            log_system_error(EXTENSION_LOG_WARNING, NULL,
+                             "Can't create executor thread: %s");
+            exit(EXIT_FAILURE);
+        }
+        executor.nthreads++;
+    }
+}
+
+void executor_shutdown(void) {
+    struct executor_task *task;
+    int ii;
+
+    cb_mutex_enter(&executor.mutex);
+    executor.shutdown = true;
+    cb_cond_broadcast(&executor.cond);
+    cb_mutex_exit(&executor.mutex);
+
+    for (ii = 0; ii < executor.nthreads; ++ii) {
+        cb_join_thread(executor.tids[ii]);
+    }
+    free(executor.tids);
+    executor.tids = NULL;
+    executor.nthreads = 0;
+
+    /* Nobody waits for them anymore */
+    while ((task = executor_pop()) != NULL) {
+        free(task);
+    }
+}
+
+ENGINE_ERROR_CODE executor_submit(const void *cookie, EXECUTOR_TASK task,
+                                  void *arg, executor_priority_t priority) {
+    struct executor_task *item;
+    struct executor_queue *queue;
+
+    if (priority < EXECUTOR_PRIORITY_HIGH || priority > EXECUTOR_PRIORITY_LOW) {
+        return ENGINE_EINVAL;
+    }
+
+    item = malloc(sizeof(*item));
+    if (item == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    item->next = NULL;
+    item->cookie = cookie;
+    item->task = task;
+    item->arg = arg;
+
+    queue = &executor.queues[priority];
+    cb_mutex_enter(&executor.mutex);
+    if (executor.shutdown || queue->size >= EXECUTOR_MAX_TASKS) {
+        executor.rejected++;
+        cb_mutex_exit(&executor.mutex);
+        free(item);
+        return ENGINE_TMPFAIL;
+    }
+    if (queue->tail == NULL) {
+        queue->head = item;
+    } else {
+        queue->tail->next = item;
+    }
+    queue->tail = item;
+    queue->size++;
+    cb_cond_signal(&executor.cond);
+    cb_mutex_exit(&executor.mutex);
+
+    return ENGINE_SUCCESS;
+}
+
+void executor_get_stats(uint64_t *queued, uint64_t *done, uint64_t *rejected) {
+    int ii;
+
+    cb_mutex_enter(&executor.mutex);
+    *queued = 0;
+    for (ii = EXECUTOR_PRIORITY_HIGH; ii <= EXECUTOR_PRIORITY_LOW; ++ii) {
+        *queued += executor.queues[ii].size;
+    }
+    *done = executor.done;
+    *rejected = executor.rejected;
+    cb_mutex_exit(&executor.mutex);
+}
@@ -0,0 +1,50 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include "memcached.h"
+
+/*
+ * A small pool of threads (see the executor_threads setting) running the
+ * blocking work of the core and the engines (through submit_task in the
+ * server API), so that no event loop ever waits for it. Every priority
+ * has a queue of its own of at most EXECUTOR_MAX_TASKS tasks, and the
+ * threads always take the high priority ones first. A task submitted for
+ * a connection reports what it returns with notify_io_complete.
+ */
+
+#define EXECUTOR_MAX_TASKS 1024
+
+/**
+ * Start the threads of the executor
+ * @param nthreads the number of threads
+ */
+void executor_init(int nthreads);
+
+/**
+ * Stop the threads of the executor (after they're done with the task
+ * they are running), dropping the tasks still queued
+ */
+void executor_shutdown(void);
+
+/**
+ * Queue a task
+ * @param cookie the connection to notify once it's done (or NULL)
+ * @param task the task
+ * @param arg the argument to the task
+ * @param priority the priority of the task
+ * @return ENGINE_SUCCESS if it's queued, ENGINE_TMPFAIL if the queue of
+ *         the priority is full
+ */
+ENGINE_ERROR_CODE executor_submit(const void *cookie, EXECUTOR_TASK task,
+                                  void *arg, executor_priority_t priority);
+
+/**
+ * Get the stats of the executor
+ * @param queued where to store the number of tasks waiting to run
+ * @param done where to store the number of tasks run
+ * @param rejected where to store the number of tasks we had no room for
+ */
+void executor_get_stats(uint64_t *queued, uint64_t *done, uint64_t *rejected);
+
+#endif
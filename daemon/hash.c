@@ -2,15 +2,22 @@
 /*
  * Hash table
  *
- * The hash function used here is by Bob Jenkins, 1996:
+ * The default hash function used here is by Bob Jenkins, 1996:
  *    <http://burtleburtle.net/bob/hash/doobs.html>
  *       "By Bob Jenkins, 1996.  bob_jenkins@burtleburtle.net.
  *       You may use this code any way you wish, private, educational,
  *       or commercial.  It's free."
  *
+ * The others (see hash_init) are faster for the short keys we see: XXH32
+ * by Yann Collet, and CRC32C on the SSE4.2 instruction (which isn't much
+ * of a hash on its own, so we mix it up like the finalizer of MurmurHash3
+ * by Austin Appleby does).
  */
 #include "config.h"
-#include "memcached.h"
+#include <platform/platform.h>
+#include <stdbool.h>
+#include <string.h>
+#include "hash.h"
 
 /*
  * Since the hash function does bit manipulation, it needs to know
@@ -118,7 +125,7 @@ and these came close:
 }
 
 #if HASH_LITTLE_ENDIAN == 1
-uint32_t hash(
+static uint32_t jenkins_hash(
   const void *key,       /* the key to hash */
   size_t      length,    /* length of the key */
   const uint32_t    initval)   /* initval */
@@ -299,7 +306,7 @@ uint32_t hash(
  * from hashlittle() on all machines.  hashbig() takes advantage of
  * big-endian byte ordering.
  */
-uint32_t hash( const void *key, size_t length, const uint32_t initval)
+static uint32_t jenkins_hash( const void *key, size_t length, const uint32_t initval)
 {
   uint32_t a,b,c;
   union { const void *ptr; size_t i; } u; /* to cast key to (size_t) happily */
@@ -425,3 +432,164 @@ uint32_t hash( const void *key, size_t length, const uint32_t initval)
 #else /* HASH_XXX_ENDIAN == 1 */
 #error Must define HASH_BIG_ENDIAN or HASH_LITTLE_ENDIAN
 #endif /* HASH_XXX_ENDIAN == 1 */
+
+#define XXH_PRIME32_1 2654435761U
+#define XXH_PRIME32_2 2246822519U
+#define XXH_PRIME32_3 3266489917U
+#define XXH_PRIME32_4 668265263U
+#define XXH_PRIME32_5 374761393U
+
+/* The byte order doesn't matter; it only has to be the same every time */
+static uint32_t xxh32_read(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t xxh32_round(uint32_t acc, uint32_t input)
+{
+    acc += input * XXH_PRIME32_2;
+    acc = rot(acc, 13);
+    return acc * XXH_PRIME32_1;
+}
+
+static uint32_t xxh32_hash(const void *key, size_t length,
+                           const uint32_t initval)
+{
+    const unsigned char *p = key;
+    const unsigned char *end = p + length;
+    uint32_t h;
+
+    if (length >= 16) {
+        const unsigned char *limit = end - 16;
+        uint32_t v1 = initval + XXH_PRIME32_1 + XXH_PRIME32_2;
+        uint32_t v2 = initval + XXH_PRIME32_2;
+        uint32_t v3 = initval;
+        uint32_t v4 = initval - XXH_PRIME32_1;
+
+        do {
+            v1 = xxh32_round(v1, xxh32_read(p));
+            v2 = xxh32_round(v2, xxh32_read(p + 4));
+            v3 = xxh32_round(v3, xxh32_read(p + 8));
+            v4 = xxh32_round(v4, xxh32_read(p + 12));
+            p += 16;
+        } while (p <= limit);
+
+        h = rot(v1, 1) + rot(v2, 7) + rot(v3, 12) + rot(v4, 18);
+    } else {
+        h = initval + XXH_PRIME32_5;
+    }
+
+    h += (uint32_t)length;
+
+    while (p + 4 <= end) {
+        h += xxh32_read(p) * XXH_PRIME32_3;
+        h = rot(h, 17) * XXH_PRIME32_4;
+        p += 4;
+    }
+    while (p < end) {
+        h += (*p) * XXH_PRIME32_5;
+        h = rot(h, 11) * XXH_PRIME32_1;
+        p++;
+    }
+
+    h ^= h >> 15;
+    h *= XXH_PRIME32_2;
+    h ^= h >> 13;
+    h *= XXH_PRIME32_3;
+    h ^= h >> 16;
+    return h;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_CRC32C_HASH 1
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hash(const void *key, size_t length,
+                            const uint32_t initval)
+{
+    const unsigned char *p = key;
+    uint32_t crc = ~initval;
+    uint32_t h;
+
+#ifdef __x86_64__
+    while (length >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = (uint32_t)__builtin_ia32_crc32di(crc, v);
+        p += 8;
+        length -= 8;
+    }
+#endif
+    while (length >= 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __builtin_ia32_crc32si(crc, v);
+        p += 4;
+        length -= 4;
+    }
+    while (length > 0) {
+        crc = __builtin_ia32_crc32qi(crc, *p);
+        p++;
+        length--;
+    }
+
+    h = ~crc;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static bool crc32c_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+static struct {
+    const char *name;
+    uint32_t (*function)(const void *key, size_t length,
+                         const uint32_t initval);
+} hash_function = { "jenkins", jenkins_hash };
+
+uint32_t hash(const void *key, size_t length, const uint32_t initval)
+{
+    return hash_function.function(key, length, initval);
+}
+
+bool hash_init(const char *name)
+{
+    bool crc32c = false;
+
+#ifdef HAVE_CRC32C_HASH
+    crc32c = crc32c_supported();
+#endif
+
+    if (name == NULL || strcmp(name, "jenkins") == 0) {
+        hash_function.name = "jenkins";
+        hash_function.function = jenkins_hash;
+    } else if (strcmp(name, "xxh32") == 0 ||
+               (strcmp(name, "auto") == 0 && !crc32c)) {
+        hash_function.name = "xxh32";
+        hash_function.function = xxh32_hash;
+#ifdef HAVE_CRC32C_HASH
+    } else if ((strcmp(name, "crc32c") == 0 ||
+                strcmp(name, "auto") == 0) && crc32c) {
+        hash_function.name = "crc32c";
+        hash_function.function = crc32c_hash;
+#endif
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char *hash_name(void)
+{
+    return hash_function.name;
+}
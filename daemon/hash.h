@@ -5,11 +5,29 @@
 extern "C" {
 #endif
 
+/**
+ * Hash the data with the hash function we picked in hash_init (this is
+ * the hash of the server api too)
+ */
 uint32_t hash(const void *key, size_t length, const uint32_t initval);
 
+/**
+ * Pick the hash function. It has to be done before anybody uses it.
+ *
+ * @param name "jenkins" (the default if NULL), "xxh32", "crc32c" (if
+ *             the CPU has SSE4.2), or "auto" for crc32c if we can and
+ *             xxh32 otherwise
+ * @return false if we don't know the function or can't run it
+ */
+bool hash_init(const char *name);
+
+/**
+ * The name of the hash function we use
+ */
+const char *hash_name(void);
+
 #ifdef    __cplusplus
 }
 #endif
 
 #endif    /* HASH_H */
-
@@ -0,0 +1,295 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The per thread cache of hot items (see hot_cache.h)
+ */
+#include "config.h"
+#include "hot_cache.h"
+#include "hash.h"
+#include "mc_time.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* The number of generations (must be a power of two) */
+#define HOT_CACHE_GENERATIONS (1 << 14)
+#define HOT_CACHE_GENERATION_MASK (HOT_CACHE_GENERATIONS - 1)
+
+/* The number of reads within the same second it takes to get in */
+#define HOT_CACHE_ADMIT 4
+
+/* The number of keys we count the reads of for every entry */
+#define HOT_CACHE_CANDIDATES 4
+
+struct hot_cache_entry {
+    item *it;
+    /* The info of the item (with the single value we allow) */
+    item_info info;
+    uint32_t hv;
+    uint32_t generation;
+    uint16_t vbucket;
+    /* When we stop serving it */
+    hrtime_t expires;
+    /* The number of connections still sending the value */
+    int users;
+    /* No longer in the cache; released along with the last user */
+    bool retired;
+    /* The value compressed for the clients asking for it (if we tried) */
+    bool compress_tried;
+    char *compressed;
+    size_t ncompressed;
+    /* The value inflated for the clients without datatype support */
+    char *inflated;
+    size_t ninflated;
+};
+
+/* A key being read, which may make it into the cache */
+struct hot_cache_candidate {
+    uint32_t hv;
+    uint32_t reads;
+    rel_time_t since;
+};
+
+struct hot_cache {
+    /* Direct mapped on the hash of the key */
+    struct hot_cache_entry **entries;
+    size_t size;
+    struct hot_cache_candidate *candidates;
+    size_t ncandidates;
+    hrtime_t ttl;
+    struct timeval sweep_interval;
+    struct event sweep_event;
+};
+
+static volatile uint32_t generations[HOT_CACHE_GENERATIONS];
+
+#ifdef WIN32
+static void bump_generation(uint32_t hv) {
+    InterlockedIncrement((volatile LONG *)&generations[hv & HOT_CACHE_GENERATION_MASK]);
+}
+#elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+static void bump_generation(uint32_t hv) {
+    atomic_inc_32(&generations[hv & HOT_CACHE_GENERATION_MASK]);
+}
+#else
+static void bump_generation(uint32_t hv) {
+    __sync_add_and_fetch(&generations[hv & HOT_CACHE_GENERATION_MASK], 1);
+}
+#endif
+
+static bool entry_valid(const struct hot_cache_entry *entry, hrtime_t now) {
+    rel_time_t exptime = entry->info.exptime;
+    return entry->generation ==
+               generations[entry->hv & HOT_CACHE_GENERATION_MASK] &&
+           entry->expires > now &&
+           (exptime == 0 || exptime > mc_time_get_current_time());
+}
+
+static void entry_free(struct hot_cache_entry *entry) {
+    /* The connection which got it in may be long gone */
+    settings.engine.v1->release(settings.engine.v0, NULL, entry->it);
+    free(entry->compressed);
+    free(entry->inflated);
+    free(entry);
+}
+
+/* Take the entry out of the cache */
+static void entry_drop(struct hot_cache_entry *entry) {
+    if (entry->users == 0) {
+        entry_free(entry);
+    } else {
+        entry->retired = true;
+    }
+}
+
+/*
+ * Drop the entries which are no longer valid, so that we don't keep
+ * references to items nobody reads anymore
+ */
+static void hot_cache_sweep(evutil_socket_t fd, short which, void *arg) {
+    struct hot_cache *cache = arg;
+    hrtime_t now = gethrtime();
+    size_t ii;
+
+    for (ii = 0; ii < cache->size; ++ii) {
+        struct hot_cache_entry *entry = cache->entries[ii];
+        if (entry != NULL && !entry_valid(entry, now)) {
+            cache->entries[ii] = NULL;
+            entry_drop(entry);
+        }
+    }
+
+    evtimer_add(&cache->sweep_event, &cache->sweep_interval);
+}
+
+struct hot_cache *hot_cache_create(struct event_base *base, size_t size,
+                                   uint32_t ttl) {
+    struct hot_cache *cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->size = size;
+    cache->ncandidates = size * HOT_CACHE_CANDIDATES;
+    cache->entries = calloc(cache->size, sizeof(*cache->entries));
+    cache->candidates = calloc(cache->ncandidates,
+                               sizeof(*cache->candidates));
+    if (cache->entries == NULL || cache->candidates == NULL) {
+        free(cache->entries);
+        free(cache->candidates);
+        free(cache);
+        return NULL;
+    }
+
+    if (ttl == 0) {
+        ttl = 1;
+    }
+    cache->ttl = (hrtime_t)ttl * 1000000;
+    cache->sweep_interval.tv_sec = ttl / 1000;
+    cache->sweep_interval.tv_usec = (ttl % 1000) * 1000;
+
+    evtimer_set(&cache->sweep_event, hot_cache_sweep, cache);
+    event_base_set(base, &cache->sweep_event);
+    evtimer_add(&cache->sweep_event, &cache->sweep_interval);
+
+    return cache;
+}
+
+struct hot_cache_entry *hot_cache_get(struct hot_cache *cache,
+                                      const void *key, size_t nkey,
+                                      uint32_t hv, uint16_t vbucket,
+                                      uint32_t *generation) {
+    size_t slot = hv % cache->size;
+    struct hot_cache_entry *entry = cache->entries[slot];
+
+    /* Read before the caller goes to the engine, so that a change after
+     * it makes the entry we may create from the item invalid */
+    *generation = generations[hv & HOT_CACHE_GENERATION_MASK];
+
+    if (entry == NULL || entry->hv != hv) {
+        return NULL;
+    }
+
+    if (!entry_valid(entry, gethrtime())) {
+        cache->entries[slot] = NULL;
+        entry_drop(entry);
+        return NULL;
+    }
+
+    if (entry->vbucket != vbucket || entry->info.nkey != nkey ||
+        memcmp(entry->info.key, key, nkey) != 0) {
+        return NULL;
+    }
+
+    entry->users++;
+    return entry;
+}
+
+item *hot_cache_item(struct hot_cache_entry *entry, item_info *info) {
+    *info = entry->info;
+    return entry->it;
+}
+
+struct hot_cache_entry *hot_cache_offer(struct hot_cache *cache, item *it,
+                                        const item_info *info, uint32_t hv,
+                                        uint16_t vbucket,
+                                        uint32_t generation) {
+    rel_time_t now = mc_time_get_current_time();
+    struct hot_cache_candidate *candidate;
+    struct hot_cache_entry *entry;
+    size_t slot;
+
+    /* We only keep a single value (and not the array of them) */
+    if (info->nvalue != 1) {
+        return NULL;
+    }
+
+    candidate = &cache->candidates[hv % cache->ncandidates];
+    if (candidate->hv != hv || candidate->since != now) {
+        candidate->hv = hv;
+        candidate->reads = 0;
+        candidate->since = now;
+    }
+    if (++candidate->reads < HOT_CACHE_ADMIT) {
+        return NULL;
+    }
+    candidate->reads = 0;
+
+    entry = malloc(sizeof(*entry));
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->it = it;
+    entry->info = *info;
+    entry->hv = hv;
+    entry->generation = generation;
+    entry->vbucket = vbucket;
+    entry->expires = gethrtime() + cache->ttl;
+    entry->users = 1;
+    entry->retired = false;
+    entry->compress_tried = false;
+    entry->compressed = NULL;
+    entry->ncompressed = 0;
+    entry->inflated = NULL;
+    entry->ninflated = 0;
+
+    slot = hv % cache->size;
+    if (cache->entries[slot] != NULL) {
+        entry_drop(cache->entries[slot]);
+    }
+    cache->entries[slot] = entry;
+
+    return entry;
+}
+
+bool hot_cache_compressed(struct hot_cache_entry *entry,
+                          const char **value, size_t *nvalue) {
+    *value = entry->compressed;
+    *nvalue = entry->ncompressed;
+    return entry->compress_tried;
+}
+
+void hot_cache_set_compressed(struct hot_cache_entry *entry, char *value,
+                              size_t nvalue) {
+    cb_assert(!entry->compress_tried);
+    entry->compress_tried = true;
+    entry->compressed = value;
+    entry->ncompressed = nvalue;
+}
+
+bool hot_cache_inflated(struct hot_cache_entry *entry,
+                        const char **value, size_t *nvalue) {
+    *value = entry->inflated;
+    *nvalue = entry->ninflated;
+    return entry->inflated != NULL;
+}
+
+void hot_cache_set_inflated(struct hot_cache_entry *entry, char *value,
+                            size_t nvalue) {
+    cb_assert(entry->inflated == NULL);
+    entry->inflated = value;
+    entry->ninflated = nvalue;
+}
+
+void hot_cache_release(struct hot_cache_entry *entry) {
+    cb_assert(entry->users > 0);
+    if (--entry->users == 0 && entry->retired) {
+        entry_free(entry);
+    }
+}
+
+void hot_cache_invalidate(const void *key, size_t nkey) {
+    if (settings.hot_cache > 0) {
+        bump_generation(hash(key, nkey, 0));
+    }
+}
+
+void hot_cache_invalidate_all(void) {
+    uint32_t ii;
+
+    if (settings.hot_cache > 0) {
+        for (ii = 0; ii < HOT_CACHE_GENERATIONS; ++ii) {
+            bump_generation(ii);
+        }
+    }
+}
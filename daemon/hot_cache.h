@@ -0,0 +1,139 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef HOT_CACHE_H
+#define HOT_CACHE_H
+
+#include "memcached.h"
+
+/*
+ * A small cache of the hottest items in every worker thread (see the
+ * hot_cache setting). It holds a reference to the items that have been
+ * read a few times in a row, and serves the next reads of them for up to
+ * hot_cache_ttl milliseconds without going into the engine. The entries
+ * are checked against a generation per hash of the key, which the
+ * daemon bumps every time it hands a change of the key to the engine
+ * (and all of them on a flush). Changes the engine makes on its own
+ * (expiry, eviction, changes arriving through tap or dcp into another
+ * bucket) are only picked up once the entry times out.
+ *
+ * Everything but the generations belongs to the thread the cache was
+ * created for.
+ */
+
+struct hot_cache;
+struct hot_cache_entry;
+
+/**
+ * Create the cache of a worker thread
+ * @param base the event base of the thread (for the sweep timer)
+ * @param size the number of entries
+ * @param ttl the number of milliseconds we may serve an entry
+ * @return the cache or NULL if we failed to allocate it
+ */
+struct hot_cache *hot_cache_create(struct event_base *base, size_t size,
+                                   uint32_t ttl);
+
+/**
+ * Look up a key
+ * @param cache the cache of the thread
+ * @param key the key to look up
+ * @param nkey the length of the key
+ * @param hv the hash of the key (hash(key, nkey, 0))
+ * @param vbucket the vbucket of the request
+ * @param generation where to store the generation to hand to
+ *                   hot_cache_offer if we don't have the key
+ * @return the entry (which must be released with hot_cache_release) or
+ *         NULL if we don't have a valid entry for the key
+ */
+struct hot_cache_entry *hot_cache_get(struct hot_cache *cache,
+                                      const void *key, size_t nkey,
+                                      uint32_t hv, uint16_t vbucket,
+                                      uint32_t *generation);
+
+/**
+ * Get the item of an entry
+ * @param entry the entry
+ * @param info where to store the item info (with a single value)
+ * @return the item
+ */
+item *hot_cache_item(struct hot_cache_entry *entry, item_info *info);
+
+/**
+ * Offer an item just read from the engine to the cache. If the key has
+ * been read often enough to be let in, the cache takes over the
+ * reference to the item and hands back an entry of it instead.
+ * @param cache the cache of the thread
+ * @param it the item
+ * @param info the item info of the item
+ * @param hv the hash of its key
+ * @param vbucket the vbucket of the request
+ * @param generation the generation we got from hot_cache_get (before
+ *                   reading the item from the engine)
+ * @return the entry (which must be released with hot_cache_release) or
+ *         NULL if the caller still holds the reference to the item
+ */
+struct hot_cache_entry *hot_cache_offer(struct hot_cache *cache, item *it,
+                                        const item_info *info, uint32_t hv,
+                                        uint16_t vbucket,
+                                        uint32_t generation);
+
+/**
+ * Get the compressed value of an entry (see hot_cache_set_compressed)
+ * @param entry the entry
+ * @param value where to store the compressed value (NULL if compressing
+ *              it didn't make it smaller)
+ * @param nvalue where to store the length of the compressed value
+ * @return false if nobody tried to compress the value yet
+ */
+bool hot_cache_compressed(struct hot_cache_entry *entry,
+                          const char **value, size_t *nvalue);
+
+/**
+ * Keep the compressed value of an entry for the next clients asking for
+ * compressed responses
+ * @param entry the entry
+ * @param value the compressed value, which the entry takes over (or NULL
+ *              if compressing it didn't make it smaller)
+ * @param nvalue the length of the compressed value
+ */
+void hot_cache_set_compressed(struct hot_cache_entry *entry, char *value,
+                              size_t nvalue);
+
+/**
+ * Get the inflated value of a compressed entry (see hot_cache_set_inflated)
+ * @param entry the entry
+ * @param value where to store the inflated value
+ * @param nvalue where to store the length of the inflated value
+ * @return false if nobody inflated the value yet
+ */
+bool hot_cache_inflated(struct hot_cache_entry *entry,
+                        const char **value, size_t *nvalue);
+
+/**
+ * Keep the inflated value of a compressed entry for the next clients
+ * without datatype support
+ * @param entry the entry
+ * @param value the inflated value, which the entry takes over
+ * @param nvalue the length of the inflated value
+ */
+void hot_cache_set_inflated(struct hot_cache_entry *entry, char *value,
+                            size_t nvalue);
+
+/**
+ * Release an entry we got from hot_cache_get or hot_cache_offer
+ * @param entry the entry
+ */
+void hot_cache_release(struct hot_cache_entry *entry);
+
+/**
+ * Invalidate the entries of a key in all of the caches
+ * @param key the key that was changed
+ * @param nkey the length of the key
+ */
+void hot_cache_invalidate(const void *key, size_t nkey);
+
+/**
+ * Invalidate all of the entries in all of the caches
+ */
+void hot_cache_invalidate_all(void);
+
+#endif
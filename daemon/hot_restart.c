@@ -0,0 +1,265 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Handing the listening sockets over to a new server (see hot_restart.h)
+ */
+#include "config.h"
+#include "hot_restart.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <sys/un.h>
+
+/*
+ * The message carrying the sockets is a header and then the port of each
+ * socket (all in network byte order), and the new server answers it with
+ * HOT_RESTART_ACK
+ */
+#define HOT_RESTART_MAGIC 0x4d434852
+#define HOT_RESTART_ACK 'A'
+
+/* How long (in seconds) either side waits for the other */
+#define HOT_RESTART_TIMEOUT 10
+
+struct hot_restart_header {
+    uint32_t magic;
+    uint32_t nsfds;
+};
+
+static bool hot_restart_address(const char *path, struct sockaddr_un *addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "hot_restart path too long: %s\n",
+                                        path);
+        return false;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+static void hot_restart_timeout(SOCKET sfd) {
+    struct timeval tv;
+
+    tv.tv_sec = HOT_RESTART_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof(tv));
+    setsockopt(sfd, SOL_SOCKET, SO_SNDTIMEO, (void *)&tv, sizeof(tv));
+}
+
+SOCKET hot_restart_listen(const char *path) {
+    struct sockaddr_un addr;
+    SOCKET sfd;
+
+    if (!hot_restart_address(path, &addr)) {
+        return INVALID_SOCKET;
+    }
+
+    if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+        log_socket_error(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to create the hot restart socket: %s");
+        return INVALID_SOCKET;
+    }
+
+    /* The previous server is done with it (or gone) */
+    unlink(path);
+    if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        listen(sfd, 1) == SOCKET_ERROR ||
+        evutil_make_socket_nonblocking(sfd) == -1) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to listen on %s: %s\n",
+                                        path, strerror(errno));
+        closesocket(sfd);
+        return INVALID_SOCKET;
+    }
+
+    return sfd;
+}
+
+int hot_restart_receive(const char *path, SOCKET *sfds, in_port_t *ports,
+                        int max) {
+    struct sockaddr_un addr;
+    struct hot_restart_header header;
+    uint16_t wire[HOT_RESTART_MAX_SOCKETS];
+    int received[HOT_RESTART_MAX_SOCKETS];
+    union {
+        struct cmsghdr hdr;
+        char buffer[CMSG_SPACE(sizeof(int) * HOT_RESTART_MAX_SOCKETS)];
+    } control;
+    struct iovec iov[2];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    char ack = HOT_RESTART_ACK;
+    ssize_t nr;
+    int nsfds = 0;
+    int ii;
+    SOCKET sfd;
+
+    if (!hot_restart_address(path, &addr)) {
+        return -1;
+    }
+    if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+        log_socket_error(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to create the hot restart socket: %s");
+        return -1;
+    }
+    if (connect(sfd, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        /* A socket nobody listens on is left behind by a crash */
+        int error = errno;
+        closesocket(sfd);
+        if (error == ENOENT || error == ECONNREFUSED) {
+            return 0;
+        }
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to connect to %s: %s\n",
+                                        path, strerror(error));
+        return -1;
+    }
+    hot_restart_timeout(sfd);
+
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = (void *)&header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)wire;
+    iov[1].iov_len = sizeof(wire);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    do {
+        nr = recvmsg(sfd, &msg, 0);
+    } while (nr == -1 && errno == EINTR);
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); nr > 0 && cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nsfds = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(received, CMSG_DATA(cmsg), nsfds * sizeof(int));
+            break;
+        }
+    }
+
+    if (nr < (ssize_t)sizeof(header) || (msg.msg_flags & MSG_CTRUNC) ||
+        ntohl(header.magic) != HOT_RESTART_MAGIC ||
+        ntohl(header.nsfds) != (uint32_t)nsfds || nsfds > max ||
+        nr != (ssize_t)(sizeof(header) + nsfds * sizeof(uint16_t)) ||
+        send(sfd, &ack, 1, 0) != 1) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to get the listening "
+                                        "sockets from %s\n", path);
+        for (ii = 0; ii < nsfds; ++ii) {
+            closesocket(received[ii]);
+        }
+        closesocket(sfd);
+        return -1;
+    }
+
+    for (ii = 0; ii < nsfds; ++ii) {
+        sfds[ii] = received[ii];
+        ports[ii] = ntohs(wire[ii]);
+    }
+    closesocket(sfd);
+    return nsfds;
+}
+
+bool hot_restart_send(SOCKET sfd, const SOCKET *sfds, const in_port_t *ports,
+                      int nsfds) {
+    struct hot_restart_header header;
+    uint16_t wire[HOT_RESTART_MAX_SOCKETS];
+    union {
+        struct cmsghdr hdr;
+        char buffer[CMSG_SPACE(sizeof(int) * HOT_RESTART_MAX_SOCKETS)];
+    } control;
+    struct iovec iov[2];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    char ack = 0;
+    ssize_t nw;
+    int flags;
+    int ii;
+
+    if (nsfds <= 0 || nsfds > HOT_RESTART_MAX_SOCKETS) {
+        return false;
+    }
+
+    /* Accepted from a nonblocking socket, but we want to wait for it */
+    if ((flags = fcntl(sfd, F_GETFL, 0)) != -1) {
+        fcntl(sfd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    hot_restart_timeout(sfd);
+
+    header.magic = htonl(HOT_RESTART_MAGIC);
+    header.nsfds = htonl((uint32_t)nsfds);
+    for (ii = 0; ii < nsfds; ++ii) {
+        wire[ii] = htons(ports[ii]);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov[0].iov_base = (void *)&header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)wire;
+    iov[1].iov_len = nsfds * sizeof(uint16_t);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nsfds);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nsfds);
+    memcpy(CMSG_DATA(cmsg), sfds, sizeof(int) * nsfds);
+
+    do {
+        nw = sendmsg(sfd, &msg, 0);
+    } while (nw == -1 && errno == EINTR);
+    if (nw != (ssize_t)(iov[0].iov_len + iov[1].iov_len)) {
+        log_socket_error(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to send the listening sockets: %s");
+        return false;
+    }
+
+    /* Until then it may still fail, and we keep them */
+    if (recv(sfd, &ack, 1, 0) != 1 || ack != HOT_RESTART_ACK) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "The new server didn't take the "
+                                        "listening sockets\n");
+        return false;
+    }
+    return true;
+}
+
+#else
+
+SOCKET hot_restart_listen(const char *path) {
+    (void)path;
+    settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                    "hot_restart is not supported on "
+                                    "this platform\n");
+    return INVALID_SOCKET;
+}
+
+int hot_restart_receive(const char *path, SOCKET *sfds, in_port_t *ports,
+                        int max) {
+    (void)path;
+    (void)sfds;
+    (void)ports;
+    (void)max;
+    return 0;
+}
+
+bool hot_restart_send(SOCKET sfd, const SOCKET *sfds, const in_port_t *ports,
+                      int nsfds) {
+    (void)sfd;
+    (void)sfds;
+    (void)ports;
+    (void)nsfds;
+    return false;
+}
+
+#endif
@@ -0,0 +1,60 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef HOT_RESTART_H
+#define HOT_RESTART_H
+
+#include "memcached.h"
+
+/*
+ * Handing the listening sockets over to a new server (see the hot_restart
+ * setting). A server with hot_restart listens on a Unix socket at that
+ * path. A new server started with the same setting connects to it before
+ * it binds any ports, and the old one sends it all of its listening
+ * sockets (with SCM_RIGHTS) along with the port of the interface each of
+ * them is for. Once the new server has them, it acknowledges them and the
+ * old one stops accepting connections, serves the ones it has until they
+ * are closed (or hot_restart_drain seconds have passed), and exits. The
+ * connections waiting in the backlog are never dropped, as the sockets
+ * stay open all along.
+ *
+ * Only the sockets are handed over; the cache warms up from the snapshot
+ * of the engine (if it has one). Unix sockets only, so this isn't
+ * supported on Windows.
+ */
+
+/* The most sockets we hand over */
+#define HOT_RESTART_MAX_SOCKETS 64
+
+/**
+ * Listen on the Unix socket for the next server (replacing the one of an
+ * old server at the path)
+ * @param path where to listen
+ * @return the socket, or INVALID_SOCKET if we failed
+ */
+SOCKET hot_restart_listen(const char *path);
+
+/**
+ * Get the listening sockets of the server running at path (if there is
+ * one)
+ * @param path the Unix socket of the server
+ * @param sfds where to store the sockets
+ * @param ports where to store the port of the interface of each of them
+ * @param max the room in sfds and ports
+ * @return the number of sockets we got, 0 if there is no server running
+ *         or -1 if we failed to get them
+ */
+int hot_restart_receive(const char *path, SOCKET *sfds, in_port_t *ports,
+                        int max);
+
+/**
+ * Send the listening sockets to a new server and wait for it to tell us
+ * that it has them
+ * @param sfd the connection from the new server
+ * @param sfds the sockets
+ * @param ports the port of the interface of each of them
+ * @param nsfds the number of sockets
+ * @return true if the new server has them (and we should stop accepting)
+ */
+bool hot_restart_send(SOCKET sfd, const SOCKET *sfds, const in_port_t *ports,
+                      int nsfds);
+
+#endif
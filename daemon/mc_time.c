@@ -13,16 +13,23 @@
  *  2. approximation of system-clock. - mc_time_convert_to_abs_time()
  *    2.1 The following returns system clock time - mc_time_convert_to_abs_time(mc_time_get_current_time())
  *  3. A method for work with expiry timestamps as per the memcached protocol - mc_time_convert_to_real_time()
+ *  4. The monotonic interval time in milliseconds, from a coarse clock. - mc_time_get_current_time_ms()
  *
  */
 
 
 #include <signal.h>
+#include <time.h>
 
 #include "config.h"
 #include "memcached.h"
 #include "mc_time.h"
 
+#if defined(__linux__) && defined(CLOCK_MONOTONIC_COARSE)
+/* Read from the vDSO, without a system call */
+#define HAVE_COARSE_CLOCK 1
+#endif
+
 extern volatile sig_atomic_t memcached_shutdown;
 
 /*
@@ -46,11 +53,13 @@ const time_t memcached_maximum_relative_time = 60*60*24*30;
 static volatile rel_time_t memcached_uptime = 0;
 static volatile time_t memcached_epoch = 0;
 static volatile uint64_t memcached_monotonic_start = 0;
+static uint64_t memcached_monotonic_start_ms = 0;
 static struct event_base* main_ev_base = NULL;
 
 static void mc_time_clock_event_handler(evutil_socket_t fd, short which, void *arg);
 static void mc_time_clock_tick(void);
 static void mc_time_init_epoch(void);
+static uint64_t mc_time_coarse_ms(void);
 
 /*
  * Init internal state and start the timer event callback.
@@ -77,6 +86,7 @@ static void mc_time_init_epoch(void) {
     struct timeval t;
     memcached_uptime = 0;
     memcached_monotonic_start = cb_get_monotonic_seconds();
+    memcached_monotonic_start_ms = mc_time_coarse_ms();
     cb_get_timeofday(&t);
     memcached_epoch = t.tv_sec;
 }
@@ -89,6 +99,27 @@ rel_time_t mc_time_get_current_time(void) {
     return memcached_uptime;
 }
 
+/*
+ * The coarse monotonic clock in milliseconds (from an arbitrary point)
+ */
+static uint64_t mc_time_coarse_ms(void) {
+#ifdef HAVE_COARSE_CLOCK
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0) {
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+#endif
+    return gethrtime() / 1000000;
+}
+
+/*
+ * Return a monotonically increasing value.
+ * The value returned represents milliseconds since memcached started.
+ */
+uint64_t mc_time_get_current_time_ms(void) {
+    return mc_time_coarse_ms() - memcached_monotonic_start_ms;
+}
+
 /*
  * Given a timestamp (timestamp follows the rules of mc store protocol)
  * return the seconds from "now" it is expected to expire.
@@ -23,6 +23,14 @@ void mc_time_init(struct event_base* ev_base);
  */
 rel_time_t mc_time_get_current_time(void);
 
+/*
+ * Return a monotonically increasing value with millisecond resolution.
+ * The value returned represents milliseconds since memcached started,
+ * read from a coarse clock (CLOCK_MONOTONIC_COARSE where we have it), so it
+ * is cheap enough to call for every request but may be a few ms behind.
+ */
+uint64_t mc_time_get_current_time_ms(void);
+
 /*
  * Convert a relative time value to an absolute time.
  *
@@ -22,6 +22,14 @@
 #include "cmdline.h"
 #include "connections.h"
 #include "mc_time.h"
+#include "hot_cache.h"
+#include "span.h"
+#include "zerocopy.h"
+#include "executor.h"
+#include "ssl_context.h"
+#include "net_buf_pool.h"
+#include "arena.h"
+#include "hot_restart.h"
 
 #include <signal.h>
 #include <fcntl.h>
@@ -36,6 +44,10 @@
 #include <stddef.h>
 #include <snappy-c.h>
 #include <JSON_checker.h>
+#ifndef WIN32
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
 
 static bool grow_dynamic_buffer(conn *c, size_t needed);
 static void cookie_set_admin(const void *cookie);
@@ -52,10 +64,15 @@ static void item_set_cas(const void *cookie, item *it, uint64_t cas) {
 
 #define MAX_SASL_MECH_LEN 32
 
+/* The rate limit of the warnings which may come from every request during
+ * an incident: one a second, with bursts of up to ten more */
+#define DAEMON_LOG_LIMIT EXTENSION_LOG_LIMIT_INIT(1, 10)
+
 volatile sig_atomic_t memcached_shutdown;
 
 /* Lock for global stats */
 static cb_mutex_t stats_lock;
+static mc_mutex_stats_t stats_lock_stats;
 
 /**
  * Structure to save ns_server's session cas token.
@@ -66,8 +83,17 @@ static struct session_cas {
     cb_mutex_t mutex;
 } session_cas;
 
+/**
+ * The rate limit of the slow operation log (see slow_op_done).
+ */
+static struct slow_op_log {
+    rel_time_t logged;
+    uint64_t suppressed;
+    cb_mutex_t mutex;
+} slow_op_log;
+
 void STATS_LOCK() {
-    cb_mutex_enter(&stats_lock);
+    mc_mutex_enter(&stats_lock, &stats_lock_stats);
 }
 
 void STATS_UNLOCK() {
@@ -145,10 +171,12 @@ static void settings_init(void);
 
 /* event handling, network IO */
 static void complete_nread(conn *c);
-static void write_and_free(conn *c, char *buf, size_t bytes);
+static void write_dynamic_buffer(conn *c);
 static int ensure_iov_space(conn *c);
 static int add_iov(conn *c, const void *buf, size_t len);
 static int add_msghdr(conn *c);
+static bool flush_coalesced(conn *c, STATE_FUNC next);
+static bool coalesce_response(conn *c);
 
 /** exported globals **/
 struct stats stats;
@@ -212,7 +240,7 @@ static void stats_reset(const void *cookie) {
     stats.total_conns = 0;
     stats_prefix_clear();
     STATS_UNLOCK();
-    threadlocal_stats_reset(get_independent_stats(conn));
+    independent_stats_reset(get_independent_stats(conn));
     settings.engine.v1->reset_stats(settings.engine.v0, cookie);
 }
 
@@ -270,6 +298,39 @@ static void settings_init(void) {
     settings.admin = NULL;
     settings.disable_admin = false;
     settings.datatype = false;
+    settings.hot_cache = 0;
+    settings.hot_cache_ttl = 5;
+    settings.compress_responses = 0;
+    settings.json_detect = false;
+    settings.reuseport = false;
+    settings.zerocopy_threshold = 0;
+    settings.coalesce_responses = 65536;
+    settings.event_time_slice = 0;
+    settings.executor_threads = 2;
+    settings.ktls = false;
+    settings.ssl_session_cache = 20480;
+    settings.ssl_session_timeout = 300;
+    settings.ssl_ticket_rotation = 3600;
+    settings.ssl_thread_contexts = false;
+    settings.ssl_async = false;
+    settings.buffer_pool_low = 16;
+    settings.buffer_pool_high = 64;
+    settings.idle_hibernate = 0;
+    settings.max_pending_output = 4 * 1024 * 1024;
+    settings.replication_threads = 0;
+    settings.replication_nice = 0;
+    settings.port_timings = false;
+    settings.slow_op_threshold = 0;
+    settings.stats_aggregate_interval = 100;
+    settings.lock_stats_sample = 0;
+    settings.hash_algorithm = NULL;
+    settings.request_trace = false;
+    settings.trace_sample_rate = 0;
+    settings.trace_ring_size = 1024;
+    settings.jemalloc_arenas = false;
+    settings.jemalloc_tcache = true;
+    settings.hot_restart = NULL;
+    settings.hot_restart_drain = 30;
 }
 
 /*
@@ -319,6 +380,21 @@ struct {
     uint64_t num_disable;
 } listen_state;
 
+/* See hot_restart.h */
+static struct {
+    /* Where the next server connects to us */
+    SOCKET sfd;
+    struct event event;
+    /* The sockets we got from the previous server (and their ports) */
+    SOCKET sfds[HOT_RESTART_MAX_SOCKETS];
+    in_port_t ports[HOT_RESTART_MAX_SOCKETS];
+    int nsfds;
+    /* We've handed ours over, and serve the connections we have left */
+    bool handed_off;
+    struct event drain;
+    time_t deadline;
+} hot_restart;
+
 static bool is_listen_disabled(void) {
     bool ret;
     cb_mutex_enter(&listen_state.mutex);
@@ -350,6 +426,37 @@ static void disable_listen(void) {
                              "listen() failed: %s");
         }
     }
+    notify_listening_threads();
+}
+
+static int listen_backlog(in_port_t port) {
+    int ii;
+    for (ii = 0; ii < settings.num_interfaces; ++ii) {
+        if (port == settings.interfaces[ii].port) {
+            return settings.interfaces[ii].backlog;
+        }
+    }
+    return 1024;
+}
+
+/*
+ * Make the listening sockets of a worker thread follow the listen state
+ * (the dispatcher pauses and resumes the others itself)
+ */
+void thread_update_listen(LIBEVENT_THREAD *me) {
+    bool disabled = is_listen_disabled();
+    conn *next;
+
+    for (next = me->listen_conn; next; next = next->next) {
+        if (disabled == (next->ev_flags == 0)) {
+            continue;
+        }
+        update_event(next, disabled ? 0 : EV_READ | EV_PERSIST);
+        if (listen(next->sfd, disabled ? 1 : listen_backlog(next->parent_port)) != 0) {
+            log_socket_error(EXTENSION_LOG_WARNING, NULL,
+                             "listen() failed: %s");
+        }
+    }
 }
 
 void safe_close(SOCKET sfd) {
@@ -405,6 +512,10 @@ const char *state_text(STATE_FUNC state) {
         return "conn_ship_log";
     } else if (state == conn_setup_tap_stream) {
         return "conn_setup_tap_stream";
+    } else if (state == conn_move_thread) {
+        return "conn_move_thread";
+    } else if (state == conn_leave_thread) {
+        return "conn_leave_thread";
     } else if (state == conn_pending_close) {
         return "conn_pending_close";
     } else if (state == conn_immediate_close) {
@@ -413,11 +524,226 @@ const char *state_text(STATE_FUNC state) {
         return "conn_refresh_cbsasl";
     } else if (state == conn_refresh_ssl_certs) {
         return "conn_refresh_ssl_cert";
+    } else if (state == conn_sasl_auth) {
+        return "conn_sasl_auth";
     } else {
         return "Unknown";
     }
 }
 
+/*
+ * The requests of the workers start at the clock of the thread (see
+ * thread_clock), which the one before them updated when it was done
+ */
+static hrtime_t request_start_time(conn *c) {
+    if (c->thread != NULL && thread_clock(c->thread) != 0) {
+        return thread_clock(c->thread);
+    }
+    return gethrtime();
+}
+
+static hrtime_t request_end_time(conn *c) {
+    if (c->thread != NULL) {
+        return thread_clock_update(c->thread);
+    }
+    return gethrtime();
+}
+
+/*
+ * Logs the request of the connection if it took longer than the
+ * slow_op_threshold, now that its response has gone out (or the next
+ * request started, if it was held back to go out with its response).
+ * We log one of them per second at most.
+ */
+static void slow_op_done(conn *c, hrtime_t now) {
+    hrtime_t start = c->slow_op.start;
+    hrtime_t engine = c->slow_op.engine ? c->slow_op.engine : start;
+    hrtime_t response = c->slow_op.response;
+    const void *username = NULL;
+    uint64_t suppressed = 0;
+    bool log = false;
+
+    c->slow_op.start = 0;
+    if (now - start < (hrtime_t)settings.slow_op_threshold * 1000000) {
+        return;
+    }
+
+    STATS_NOKEY(c, slow_ops);
+    cb_mutex_enter(&slow_op_log.mutex);
+    if (slow_op_log.logged != mc_time_get_current_time()) {
+        slow_op_log.logged = mc_time_get_current_time();
+        suppressed = slow_op_log.suppressed;
+        slow_op_log.suppressed = 0;
+        log = true;
+    } else {
+        slow_op_log.suppressed++;
+    }
+    cb_mutex_exit(&slow_op_log.mutex);
+
+    if (!log) {
+        return;
+    }
+
+    if (c->sasl_conn != NULL) {
+        cbsasl_getprop(c->sasl_conn, CBSASL_USERNAME, &username);
+    }
+    /* The key may be anyone's data, so we only log its length */
+    settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+            "%d: Slow operation 0x%02x of bucket \"%s\" with a key of "
+            "%u bytes: %" PRIu64 " ms (read %" PRIu64 " ms, engine %"
+            PRIu64 " ms, send %" PRIu64 " ms), %" PRIu64
+            " more since the last one\n",
+            c->sfd, c->slow_op.cmd,
+            username ? (const char *)username : "",
+            (unsigned int)c->slow_op.keylen,
+            (uint64_t)((now - start) / 1000000),
+            (uint64_t)((engine - start) / 1000000),
+            (uint64_t)((response - engine) / 1000000),
+            (uint64_t)((now - response) / 1000000),
+            suppressed);
+}
+
+/*
+ * Notes the time the sampled request of the connection got to a point,
+ * unless it got there before
+ */
+void span_mark(conn *c, span_point_t point) {
+    hrtime_t elapsed;
+
+    if (!c->span.sampled || c->span.points[point] != SPAN_MISSING) {
+        return;
+    }
+    elapsed = gethrtime() - c->span.start;
+    c->span.points[point] = elapsed < SPAN_MISSING ?
+        (uint32_t)elapsed : SPAN_MISSING - 1;
+}
+
+/*
+ * Starts the span of the request the connection starts, if its thread
+ * samples it
+ */
+static void span_begin(conn *c, uint8_t opcode) {
+    int ii;
+
+    if (c->thread == NULL || !thread_span_sample(c->thread)) {
+        return;
+    }
+    c->span.sampled = true;
+    c->span.opcode = opcode;
+    c->span.start = gethrtime();
+    for (ii = 0; ii < SPAN_POINTS; ++ii) {
+        c->span.points[ii] = SPAN_MISSING;
+    }
+}
+
+/*
+ * Puts the span of the request in the ring of the thread, now that its
+ * response has gone out (or the next request started, if it was held
+ * back to go out with its response)
+ */
+static void span_done(conn *c) {
+    span_record_t record;
+    struct timeval now;
+    hrtime_t elapsed = gethrtime() - c->span.start;
+
+    c->span.sampled = false;
+    if (c->thread == NULL || c->thread->spans == NULL ||
+        cb_get_timeofday(&now) != 0) {
+        return;
+    }
+
+    record.timestamp = (uint64_t)now.tv_sec * 1000000 +
+        (uint64_t)now.tv_usec - (uint64_t)(elapsed / 1000);
+    record.connection = (uint32_t)c->sfd;
+    record.key_hash = c->trace.key_hash;
+    record.status = c->trace.status;
+    record.opcode = c->span.opcode;
+    memcpy(record.points, c->span.points, sizeof(record.points));
+    span_ring_push(c->thread->spans, &record);
+}
+
+/*
+ * The log_limited of the loggers which don't have one of their own
+ */
+static void log_limited(EXTENSION_LOG_LEVEL severity,
+                        const void* client_cookie,
+                        EXTENSION_LOG_LIMIT *limit,
+                        const char *fmt, ...) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger = settings.extensions.logger;
+    char buffer[1024];
+    uint32_t suppressed;
+    va_list ap;
+
+    if (!extension_log_limit_take(limit, &suppressed)) {
+        return;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, ap);
+    va_end(ap);
+    logger->log(severity, client_cookie, "%s", buffer);
+    if (suppressed > 0) {
+        logger->log(severity, client_cookie,
+                    "%u similar messages suppressed", suppressed);
+    }
+}
+
+/*
+ * Gives the logger the record of the request (with request_trace, if the
+ * logger keeps a trace)
+ */
+static void trace_request(conn *c, hrtime_t elapsed) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger = settings.extensions.logger;
+    EXTENSION_LOG_RECORD record;
+    struct timeval now;
+    hrtime_t latency = elapsed / 1000;
+    uint32_t nonvalue = c->binary_header.request.keylen +
+        c->binary_header.request.extlen;
+
+    if (logger->log_record == NULL || cb_get_timeofday(&now) != 0) {
+        return;
+    }
+
+    record.timestamp = (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_usec;
+    record.latency = latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency;
+    record.connection = (uint32_t)c->sfd;
+    record.key_hash = c->trace.key_hash;
+    record.status = c->trace.status;
+    record.opcode = (uint8_t)c->cmd;
+    record.reserved = 0;
+    record.keylen = c->binary_header.request.keylen;
+    record.value_length = c->binary_header.request.bodylen > nonvalue ?
+        c->binary_header.request.bodylen - nonvalue : 0;
+    logger->log_record(&record);
+}
+
+/*
+ * Collects the time the request took in the timings of the process, and
+ * of the bucket and the port of the connection
+ */
+static void collect_request_timing(conn *c) {
+    hrtime_t now = request_end_time(c);
+    hrtime_t elapsed = now - c->start;
+    /* Every thread has its own slot, the dispatcher the one after them */
+    int thread = c->thread ? c->thread->index : settings.num_threads + 1;
+
+    collect_timing(NULL, thread, c->cmd, elapsed);
+    if (c->bucket_timings != NULL) {
+        collect_timing(c->bucket_timings, thread, c->cmd, elapsed);
+    }
+    if (c->port_timings != NULL) {
+        collect_timing(c->port_timings, thread, c->cmd, elapsed);
+    }
+
+    if (c->slow_op.start != 0) {
+        c->slow_op.response = now;
+    }
+
+    if (settings.request_trace) {
+        trace_request(c, elapsed);
+    }
+}
+
 /*
  * Sets a connection's current state in the state machine. Any special
  * processing that needs to happen on certain state transitions can
@@ -450,7 +776,7 @@ void conn_set_state(conn *c, STATE_FUNC state) {
 
         if (state == conn_write || state == conn_mwrite) {
             if (c->start != 0) {
-                collect_timing(c->cmd, gethrtime() - c->start);
+                collect_request_timing(c);
                 c->start = 0;
             }
             MEMCACHED_PROCESS_COMMAND_END(c->sfd, c->write.buf, c->write.bytes);
@@ -498,8 +824,6 @@ static int ensure_iov_space(conn *c) {
 
 static int add_iov(conn *c, const void *buf, size_t len) {
     struct msghdr *m;
-    size_t leftover;
-    bool limit_to_mtu;
 
     cb_assert(c != NULL);
 
@@ -507,44 +831,28 @@ static int add_iov(conn *c, const void *buf, size_t len) {
         return 0;
     }
 
-    do {
-        m = &c->msglist[c->msgused - 1];
-
-        /*
-         * Limit the first payloads of TCP replies, to
-         * UDP_MAX_PAYLOAD_SIZE bytes.
-         */
-        limit_to_mtu = (1 == c->msgused);
-
-        /* We may need to start a new msghdr if this one is full. */
-        if (m->msg_iovlen == IOV_MAX ||
-            (limit_to_mtu && c->msgbytes >= UDP_MAX_PAYLOAD_SIZE)) {
-            add_msghdr(c);
-        }
+    m = &c->msglist[c->msgused - 1];
 
-        if (ensure_iov_space(c) != 0)
-            return -1;
-
-        /* If the fragment is too big to fit in the datagram, split it up */
-        if (limit_to_mtu && len + c->msgbytes > UDP_MAX_PAYLOAD_SIZE) {
-            leftover = len + c->msgbytes - UDP_MAX_PAYLOAD_SIZE;
-            len -= leftover;
-        } else {
-            leftover = 0;
-        }
+    /*
+     * We only need to start a new msghdr if this one is full; everything
+     * else goes out with a single sendmsg (we're TCP only so there is no
+     * datagram size to stay within).
+     */
+    if (m->msg_iovlen == IOV_MAX) {
+        add_msghdr(c);
+    }
 
-        m = &c->msglist[c->msgused - 1];
-        m->msg_iov[m->msg_iovlen].iov_base = (void *)buf;
-        m->msg_iov[m->msg_iovlen].iov_len = len;
+    if (ensure_iov_space(c) != 0)
+        return -1;
 
-        c->msgbytes += (int)len;
-        c->iovused++;
-        STATS_MAX(c, iovused_high_watermark, c->iovused);
-        m->msg_iovlen++;
+    m = &c->msglist[c->msgused - 1];
+    m->msg_iov[m->msg_iovlen].iov_base = (void *)buf;
+    m->msg_iov[m->msg_iovlen].iov_len = len;
 
-        buf = ((char *)buf) + len;
-        len = leftover;
-    } while (leftover > 0);
+    c->msgbytes += (int)len;
+    c->iovused++;
+    STATS_MAX(c, iovused_high_watermark, c->iovused);
+    m->msg_iovlen++;
 
     return 0;
 }
@@ -568,6 +876,24 @@ static char* binary_get_key(conn *c) {
     return c->read.curr - (c->binary_header.request.keylen);
 }
 
+/*
+ * Hashes a key of the request the connection is running, unless it is
+ * the one we hashed last for the request (which the engines get through
+ * get_key_hash, so that we don't all hash it again)
+ */
+static uint32_t conn_key_hash(conn *c, const void *key, size_t nkey) {
+    if (key == c->key_hash.key && nkey == c->key_hash.nkey) {
+        return c->key_hash.hash;
+    }
+    if (nkey > UINT16_MAX) {
+        return hash(key, nkey, 0);
+    }
+    c->key_hash.hash = hash(key, nkey, 0);
+    c->key_hash.key = key;
+    c->key_hash.nkey = (uint16_t)nkey;
+    return c->key_hash.hash;
+}
+
 /**
  * Insert a key into a buffer, but replace all non-printable characters
  * with a '.'.
@@ -688,6 +1014,7 @@ static int add_bin_header(conn *c,
     header->response.extlen = (uint8_t)hdr_len;
     header->response.datatype = datatype;
     header->response.status = (uint16_t)htons(err);
+    c->trace.status = err;
 
     header->response.bodylen = htonl(body_len);
     header->response.opaque = c->opaque;
@@ -771,6 +1098,7 @@ static ENGINE_ERROR_CODE get_vb_map_cb(const void *cookie,
     header.response.magic = (uint8_t)PROTOCOL_BINARY_RES;
     header.response.opcode = c->binary_header.request.opcode;
     header.response.status = (uint16_t)htons(PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET);
+    c->trace.status = PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET;
     header.response.bodylen = htonl((uint32_t)mapsize);
     header.response.opaque = c->opaque;
 
@@ -790,9 +1118,7 @@ static void write_bin_packet(conn *c, protocol_binary_response_status err, int s
         ret = settings.engine.v1->get_engine_vb_map(settings.engine.v0, c,
                                                     get_vb_map_cb);
         if (ret == ENGINE_SUCCESS) {
-            write_and_free(c, c->dynamic_buffer.buffer,
-                           c->dynamic_buffer.offset);
-            c->dynamic_buffer.buffer = NULL;
+            write_dynamic_buffer(c);
         } else {
             conn_set_state(c, conn_closing);
         }
@@ -840,13 +1166,101 @@ static void write_bin_response(conn *c, const void *d, int hlen, int keylen, int
         c->write_and_go = conn_new_cmd;
     } else {
         if (c->start != 0) {
-            collect_timing(c->cmd, gethrtime() - c->start);
+            collect_request_timing(c);
             c->start = 0;
         }
+        if (c->slow_op.start != 0) {
+            /* There is nothing to send */
+            slow_op_done(c, c->slow_op.response);
+        }
+        if (c->span.sampled) {
+            span_done(c);
+        }
         conn_set_state(c, conn_new_cmd);
     }
 }
 
+/*
+ * JSON_checker walks all of the value a byte at a time. A JSON document is
+ * an object, an array, a string, a number or a literal (with optional
+ * whitespace around it), so most of the values which aren't JSON can be
+ * told by their first and last bytes before we get that far.
+ */
+static bool is_json(const void *value, size_t nvalue) {
+    const unsigned char *ptr = value;
+    size_t first = 0;
+    size_t last = nvalue;
+    unsigned char end;
+
+    while (first < last && (ptr[first] == ' ' || ptr[first] == '\t' ||
+                            ptr[first] == '\n' || ptr[first] == '\r')) {
+        ++first;
+    }
+    while (last > first && (ptr[last - 1] == ' ' || ptr[last - 1] == '\t' ||
+                            ptr[last - 1] == '\n' || ptr[last - 1] == '\r')) {
+        --last;
+    }
+    if (first == last) {
+        return false;
+    }
+
+    end = ptr[last - 1];
+    switch (ptr[first]) {
+    case '{':
+        if (end != '}') {
+            return false;
+        }
+        break;
+    case '[':
+        if (end != ']') {
+            return false;
+        }
+        break;
+    case '"':
+        if (end != '"' || last - first < 2) {
+            return false;
+        }
+        break;
+    case 't':
+    case 'f':
+        if (end != 'e') {
+            return false;
+        }
+        break;
+    case 'n':
+        if (end != 'l') {
+            return false;
+        }
+        break;
+    case '-':
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+        if (end < '0' || end > '9') {
+            return false;
+        }
+        break;
+    default:
+        return false;
+    }
+
+    return checkUTF8JSON(value, (int)nvalue);
+}
+
+/*
+ * Get the datatype to store a value with. The clients without datatype
+ * support can't tell us about JSON, so we look for it in whatever they
+ * send; with json_detect we also look at the raw values of the others.
+ */
+static uint8_t detect_datatype(conn *c, uint8_t datatype,
+                               const void *value, size_t nvalue) {
+    if ((!c->supports_datatype ||
+         (settings.json_detect && datatype == PROTOCOL_BINARY_RAW_BYTES)) &&
+        is_json(value, nvalue)) {
+        return PROTOCOL_BINARY_DATATYPE_JSON;
+    }
+    return datatype;
+}
+
 static void complete_update_bin(conn *c) {
     protocol_binary_response_status eno = PROTOCOL_BINARY_RESPONSE_EINVAL;
     ENGINE_ERROR_CODE ret;
@@ -856,13 +1270,15 @@ static void complete_update_bin(conn *c) {
     cb_assert(c != NULL);
     it = c->item;
     memset(&info, 0, sizeof(info));
-    info.info.nvalue = 1;
+    info.info.nvalue = IOV_MAX;
     if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
                                            (void*)&info)) {
+        static EXTENSION_LOG_LIMIT limit = DAEMON_LOG_LIMIT;
         settings.engine.v1->release(settings.engine.v0, c, it);
-        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                                        "%d: Failed to get item info",
-                                        c->sfd);
+        settings.extensions.logger->log_limited(EXTENSION_LOG_WARNING, c,
+                                                &limit,
+                                                "%d: Failed to get item info",
+                                                c->sfd);
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL, 0);
         return;
     }
@@ -870,10 +1286,13 @@ static void complete_update_bin(conn *c) {
     ret = c->aiostat;
     c->aiostat = ENGINE_SUCCESS;
     if (ret == ENGINE_SUCCESS) {
-        if (!c->supports_datatype) {
-            if (checkUTF8JSON((void*)info.info.value[0].iov_base,
-                              (int)info.info.value[0].iov_len)) {
-                info.info.datatype = PROTOCOL_BINARY_DATATYPE_JSON;
+        /* We don't look for JSON in values which are scattered */
+        if (info.info.nvalue == 1) {
+            uint8_t datatype = detect_datatype(c, info.info.datatype,
+                                               info.info.value[0].iov_base,
+                                               info.info.value[0].iov_len);
+            if (datatype != info.info.datatype) {
+                info.info.datatype = datatype;
                 if (!settings.engine.v1->set_item_info(settings.engine.v0, c,
                                                        it, &info.info)) {
                     settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
@@ -885,6 +1304,7 @@ static void complete_update_bin(conn *c) {
         ret = settings.engine.v1->store(settings.engine.v0, c,
                                         it, &c->cas, c->store_op,
                                         c->binary_header.request.vbucket);
+        hot_cache_invalidate(info.info.key, info.info.nkey);
     }
 
 #ifdef ENABLE_DTRACE
@@ -980,6 +1400,64 @@ static void complete_update_bin(conn *c) {
     }
 }
 
+/*
+ * Compress the value of an item for a client which asked for compressed
+ * responses (see compress_responses).
+ * Returns a buffer the caller must free, or NULL if the value doesn't get
+ * smaller.
+ */
+static char *compress_value(const item_info *info, size_t *ncompressed) {
+    const char *value = info->value[0].iov_base;
+    char *buf = NULL;
+    char *compressed;
+    int ii;
+
+    if (info->nvalue != 1) {
+        char *ptr;
+        if ((buf = malloc(info->nbytes)) == NULL) {
+            return NULL;
+        }
+        for (ptr = buf, ii = 0; ii < info->nvalue; ++ii) {
+            memcpy(ptr, info->value[ii].iov_base, info->value[ii].iov_len);
+            ptr += info->value[ii].iov_len;
+        }
+        value = buf;
+    }
+
+    *ncompressed = snappy_max_compressed_length(info->nbytes);
+    if ((compressed = malloc(*ncompressed)) != NULL &&
+        (snappy_compress(value, info->nbytes, compressed,
+                         ncompressed) != SNAPPY_OK ||
+         *ncompressed >= info->nbytes)) {
+        free(compressed);
+        compressed = NULL;
+    }
+    if (compressed == NULL) {
+        *ncompressed = 0;
+    }
+    free(buf);
+    return compressed;
+}
+
+/* Inflate a (single) compressed value for a client without datatype support */
+static char *inflate_value(const item_info *info, size_t *ninflated) {
+    const char *value = info->value[0].iov_base;
+    size_t nvalue = info->value[0].iov_len;
+    char *inflated;
+
+    if (info->nvalue != 1 ||
+        snappy_uncompressed_length(value, nvalue, ninflated) != SNAPPY_OK) {
+        return NULL;
+    }
+    /* Don't hand malloc a zero we could get NULL back for */
+    if ((inflated = malloc(*ninflated + 1)) != NULL &&
+        snappy_uncompress(value, nvalue, inflated, ninflated) != SNAPPY_OK) {
+        free(inflated);
+        inflated = NULL;
+    }
+    return inflated;
+}
+
 static void process_bin_get(conn *c) {
     item *it;
     protocol_binary_response_get* rsp = (protocol_binary_response_get*)c->write.buf;
@@ -992,6 +1470,17 @@ static void process_bin_get(conn *c) {
     ENGINE_ERROR_CODE ret;
     uint8_t datatype;
     bool need_inflate = false;
+    struct hot_cache *cache = c->thread ? c->thread->hot_cache : NULL;
+    struct hot_cache_entry *hot = NULL;
+    uint32_t generation = 0;
+    const char *compressed = NULL;
+    char *compressed_buf = NULL;
+    size_t ncompressed = 0;
+    bool compress = false;
+    bool have_info = false;
+    const char *inflated = NULL;
+    char *inflated_buf = NULL;
+    size_t ninflated = 0;
 
     memset(&info, 0, sizeof(info));
     if (settings.verbose > 1) {
@@ -1005,22 +1494,45 @@ static void process_bin_get(conn *c) {
 
     ret = c->aiostat;
     c->aiostat = ENGINE_SUCCESS;
-    if (ret == ENGINE_SUCCESS) {
+    if (ret == ENGINE_SUCCESS && cache != NULL) {
+        hot = hot_cache_get(cache, key, nkey, conn_key_hash(c, key, nkey),
+                            c->binary_header.request.vbucket, &generation);
+    }
+    info.info.nvalue = IOV_MAX;
+    if (ret == ENGINE_SUCCESS && hot == NULL &&
+        settings.engine.v1->get_with_info != NULL) {
+        /* Saves the get_item_info call (and a trip through bucket_engine) */
+        ret = settings.engine.v1->get_with_info(settings.engine.v0, c, &it,
+                                                &info.info, key, (int)nkey,
+                                                c->binary_header.request.vbucket);
+        if (ret == ENGINE_SUCCESS) {
+            have_info = true;
+        } else if (ret == ENGINE_ENOTSUP) {
+            info.info.nvalue = IOV_MAX;
+            ret = ENGINE_SUCCESS;
+        }
+    }
+    if (ret == ENGINE_SUCCESS && hot == NULL && !have_info) {
         ret = settings.engine.v1->get(settings.engine.v0, c, &it, key, (int)nkey,
                                       c->binary_header.request.vbucket);
     }
 
-    info.info.nvalue = IOV_MAX;
     switch (ret) {
     case ENGINE_SUCCESS:
         STATS_HIT(c, get, key, nkey);
 
-        if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
-                                               (void*)&info)) {
+        if (hot != NULL) {
+            it = hot_cache_item(hot, &info.info);
+            STATS_NOKEY(c, hot_cache_hits);
+        } else if (!have_info &&
+                   !settings.engine.v1->get_item_info(settings.engine.v0, c, it,
+                                                      (void*)&info)) {
+            static EXTENSION_LOG_LIMIT limit = DAEMON_LOG_LIMIT;
             settings.engine.v1->release(settings.engine.v0, c, it);
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                                            "%d: Failed to get item info",
-                                            c->sfd);
+            settings.extensions.logger->log_limited(EXTENSION_LOG_WARNING, c,
+                                                    &limit,
+                                                    "%d: Failed to get item info",
+                                                    c->sfd);
             write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL, 0);
             break;
         }
@@ -1034,52 +1546,110 @@ static void process_bin_get(conn *c) {
             }
         }
 
-        keylen = 0;
-        bodylen = sizeof(rsp->message.body) + info.info.nbytes;
-
-        if (c->cmd == PROTOCOL_BINARY_CMD_GETK) {
-            bodylen += (uint32_t)nkey;
-            keylen = (uint16_t)nkey;
+        if (c->supports_compression &&
+            (datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) == 0 &&
+            info.info.nbytes >= (uint32_t)settings.compress_responses) {
+            if (hot == NULL ||
+                !hot_cache_compressed(hot, &compressed, &ncompressed)) {
+                compressed = compressed_buf = compress_value(&info.info,
+                                                             &ncompressed);
+                compress = true;
+            }
+            if (compressed != NULL) {
+                datatype |= PROTOCOL_BINARY_DATATYPE_COMPRESSED;
+                STATS_NOKEY(c, compressed_responses);
+            }
         }
 
         if (need_inflate) {
-            if (info.info.nvalue != 1) {
-                write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL, 0);
-            } else if (binary_response_handler(key, keylen,
-                                               &info.info.flags, 4,
-                                               info.info.value[0].iov_base,
-                                               (uint32_t)info.info.value[0].iov_len,
-                                               datatype,
-                                               PROTOCOL_BINARY_RESPONSE_SUCCESS,
-                                               info.info.cas, c)) {
-                write_and_free(c, c->dynamic_buffer.buffer, c->dynamic_buffer.offset);
-                c->dynamic_buffer.buffer = NULL;
-                settings.engine.v1->release(settings.engine.v0, c, it);
+            /* A hot item keeps its inflated value for the next reads */
+            if (hot != NULL &&
+                hot_cache_inflated(hot, &inflated, &ninflated)) {
+                STATS_NOKEY(c, hot_cache_inflated_hits);
             } else {
+                inflated = inflated_buf = inflate_value(&info.info,
+                                                        &ninflated);
+            }
+            if (inflated == NULL) {
                 write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL, 0);
+                if (hot != NULL) {
+                    hot_cache_release(hot);
+                } else {
+                    settings.engine.v1->release(settings.engine.v0, c, it);
+                }
+                break;
             }
+            datatype = PROTOCOL_BINARY_RAW_BYTES;
+            STATS_NOKEY(c, inflated_responses);
+        }
+
+        keylen = 0;
+        bodylen = sizeof(rsp->message.body);
+        if (compressed != NULL) {
+            bodylen += (uint32_t)ncompressed;
+        } else if (inflated != NULL) {
+            bodylen += (uint32_t)ninflated;
         } else {
-            if (add_bin_header(c, 0, sizeof(rsp->message.body),
-                               keylen, bodylen, datatype) == -1) {
-                conn_set_state(c, conn_closing);
-                return;
-            }
-            rsp->message.header.response.cas = htonll(info.info.cas);
+            bodylen += info.info.nbytes;
+        }
 
-            /* add the flags */
-            rsp->message.body.flags = info.info.flags;
-            add_iov(c, &rsp->message.body, sizeof(rsp->message.body));
+        if (c->cmd == PROTOCOL_BINARY_CMD_GETK) {
+            bodylen += (uint32_t)nkey;
+            keylen = (uint16_t)nkey;
+        }
 
-            if (c->cmd == PROTOCOL_BINARY_CMD_GETK) {
-                add_iov(c, info.info.key, nkey);
-            }
+        if (add_bin_header(c, 0, sizeof(rsp->message.body),
+                           keylen, bodylen, datatype) == -1) {
+            free(compressed_buf);
+            free(inflated_buf);
+            conn_set_state(c, conn_closing);
+            return;
+        }
+        rsp->message.header.response.cas = htonll(info.info.cas);
+
+        /* add the flags */
+        rsp->message.body.flags = info.info.flags;
+        add_iov(c, &rsp->message.body, sizeof(rsp->message.body));
+
+        if (c->cmd == PROTOCOL_BINARY_CMD_GETK) {
+            add_iov(c, info.info.key, nkey);
+        }
 
+        if (compressed != NULL) {
+            add_iov(c, compressed, ncompressed);
+        } else if (inflated != NULL) {
+            add_iov(c, inflated, ninflated);
+        } else {
             for (ii = 0; ii < info.info.nvalue; ++ii) {
                 add_iov(c, info.info.value[ii].iov_base,
                         info.info.value[ii].iov_len);
             }
-            conn_set_state(c, conn_mwrite);
-            /* Remember this item so we can garbage collect it later */
+        }
+        conn_set_state(c, conn_mwrite);
+        if (hot == NULL && cache != NULL) {
+            hot = hot_cache_offer(cache, it, &info.info,
+                                  conn_key_hash(c, key, nkey),
+                                  c->binary_header.request.vbucket,
+                                  generation);
+            if (hot != NULL) {
+                STATS_NOKEY(c, hot_cache_admits);
+            }
+        }
+        /* A hot item keeps what we compressed for the next reads */
+        if (compress && hot != NULL) {
+            hot_cache_set_compressed(hot, compressed_buf, ncompressed);
+        } else if (compressed_buf != NULL) {
+            c->temp_alloc_list[c->temp_alloc_left++] = compressed_buf;
+        }
+        if (inflated_buf != NULL && hot != NULL) {
+            hot_cache_set_inflated(hot, inflated_buf, ninflated);
+        } else if (inflated_buf != NULL) {
+            c->temp_alloc_list[c->temp_alloc_left++] = inflated_buf;
+        }
+        /* Remember this item so we can garbage collect it later */
+        if (hot != NULL) {
+            c->hot_item = hot;
+        } else {
             c->item = it;
         }
         break;
@@ -1118,7 +1688,7 @@ static void process_bin_get(conn *c) {
     }
 
     if (settings.detail_enabled && ret != ENGINE_EWOULDBLOCK) {
-        stats_prefix_record_get(key, nkey, ret == ENGINE_SUCCESS);
+        stats_prefix_record_get(c, key, nkey, ret == ENGINE_SUCCESS);
     }
 }
 
@@ -1171,7 +1741,8 @@ static bool grow_dynamic_buffer(conn *c, size_t needed) {
     }
 
     if (nsize != c->dynamic_buffer.size) {
-        char *ptr = realloc(c->dynamic_buffer.buffer, nsize);
+        char *ptr = arena_realloc(c, c->dynamic_buffer.buffer,
+                                  c->dynamic_buffer.size, nsize);
         if (ptr) {
             c->dynamic_buffer.buffer = ptr;
             c->dynamic_buffer.size = nsize;
@@ -1227,7 +1798,8 @@ static void bin_read_chunk(conn *c,
                         "%d: Need to grow buffer from %lu to %lu\n",
                         c->sfd, (unsigned long)c->read.size, (unsigned long)nsize);
             }
-            newm = realloc(c->read.buf, nsize);
+            newm = net_buf_pool_resize(c->thread->buffers, c->read.buf,
+                                       c->read.size, nsize);
             if (newm == NULL) {
                 if (settings.verbose) {
                     settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
@@ -1289,6 +1861,10 @@ static void get_auth_data(const void *cookie, auth_data_t *data) {
 struct sasl_tmp {
     int ksize;
     int vsize;
+    /* What the mechanism said (see sasl_auth_step) */
+    int result;
+    const char *out;
+    unsigned int outlen;
     char data[1]; /* data + ksize == value */
 };
 
@@ -1331,48 +1907,39 @@ static void process_bin_sasl_auth(conn *c) {
     c->substate = bin_reading_sasl_auth_data;
 }
 
-static void process_bin_complete_sasl_auth(conn *c) {
-    auth_data_t data;
-    const char *out = NULL;
-    unsigned int outlen = 0;
-    int nkey;
-    int vlen;
-    struct sasl_tmp *stmp;
+/*
+ * Run the mechanism on the data of the SASL_AUTH/SASL_STEP. It runs on
+ * the executor, so it only touches what belongs to the connection.
+ */
+static void sasl_auth_step(conn *c) {
+    int nkey = c->binary_header.request.keylen;
+    int vlen = c->binary_header.request.bodylen - nkey;
+    struct sasl_tmp *stmp = c->item;
     char mech[1024];
     const char *challenge;
-    int result=-1;
 
-    cb_assert(c->item);
-
-    nkey = c->binary_header.request.keylen;
-    if (nkey > 1023) {
-        /* too big.. */
-        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                "%d: sasl error. key: %d > 1023", c->sfd, nkey);
-        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_AUTH_ERROR, 0);
-        return;
-    }
-    vlen = c->binary_header.request.bodylen - nkey;
-
-    stmp = c->item;
-    memcpy(mech, stmp->data, nkey);
-    mech[nkey] = 0x00;
+    memcpy(mech, stmp->data, nkey);
+    mech[nkey] = 0x00;
 
     if (settings.verbose) {
         settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
                 "%d: mech: ``%s'' with %d bytes of data\n", c->sfd, mech, vlen);
     }
 
+    stmp->result = -1;
+    stmp->out = NULL;
+    stmp->outlen = 0;
     challenge = vlen == 0 ? NULL : (stmp->data + nkey);
     switch (c->cmd) {
     case PROTOCOL_BINARY_CMD_SASL_AUTH:
-        result = cbsasl_server_start(&c->sasl_conn, mech,
-                                     challenge, vlen,
-                                     (unsigned char **)&out, &outlen);
+        stmp->result = cbsasl_server_start(&c->sasl_conn, mech,
+                                           challenge, vlen,
+                                           (unsigned char **)&stmp->out,
+                                           &stmp->outlen);
         break;
     case PROTOCOL_BINARY_CMD_SASL_STEP:
-        result = cbsasl_server_step(c->sasl_conn, challenge,
-                                    vlen, &out, &outlen);
+        stmp->result = cbsasl_server_step(c->sasl_conn, challenge,
+                                          vlen, &stmp->out, &stmp->outlen);
         break;
     default:
         cb_assert(false); /* CMD should be one of the above */
@@ -1385,6 +1952,20 @@ static void process_bin_complete_sasl_auth(conn *c) {
         }
         break;
     }
+}
+
+static ENGINE_ERROR_CODE sasl_auth_task(void *arg) {
+    sasl_auth_step(arg);
+    return ENGINE_SUCCESS;
+}
+
+/* Send the response of the mechanism */
+static void sasl_auth_done(conn *c) {
+    auth_data_t data;
+    struct sasl_tmp *stmp = c->item;
+    const char *out = stmp->out;
+    unsigned int outlen = stmp->outlen;
+    int result = stmp->result;
 
     free(c->item);
     c->item = NULL;
@@ -1409,6 +1990,9 @@ static void process_bin_complete_sasl_auth(conn *c) {
             }
         }
         perform_callbacks(ON_AUTH, (const void*)&data, c);
+        /* The bucket engine picks the bucket by the user */
+        c->bucket_timings = data.username != NULL ?
+            timings_group_get(data.username, true) : NULL;
         STATS_NOKEY(c, auth_cmds);
         break;
     case SASL_CONTINUE:
@@ -1443,6 +2027,35 @@ static void process_bin_complete_sasl_auth(conn *c) {
     }
 }
 
+static void process_bin_complete_sasl_auth(conn *c) {
+    int nkey;
+
+    cb_assert(c->item);
+
+    nkey = c->binary_header.request.keylen;
+    if (nkey > 1023) {
+        /* too big.. */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                "%d: sasl error. key: %d > 1023", c->sfd, nkey);
+        write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_AUTH_ERROR, 0);
+        return;
+    }
+
+    /* The mechanisms hash the password, which may take a while, so they
+     * run on the executor (unless it's full) and we carry on in
+     * conn_sasl_auth when they're done */
+    c->ewouldblock = true;
+    conn_set_state(c, conn_sasl_auth);
+    if (executor_submit(c, sasl_auth_task, c,
+                        EXECUTOR_PRIORITY_HIGH) == ENGINE_SUCCESS) {
+        return;
+    }
+
+    c->ewouldblock = false;
+    sasl_auth_step(c);
+    sasl_auth_done(c);
+}
+
 static bool authenticated(conn *c) {
     bool rv = false;
 
@@ -1524,6 +2137,7 @@ bool binary_response_handler(const void *key, uint16_t keylen,
     header.response.extlen = extlen;
     header.response.datatype = datatype;
     header.response.status = (uint16_t)htons(status);
+    c->trace.status = status;
     if (need_inflate) {
         header.response.bodylen = htonl((uint32_t)(inflated_length + keylen + extlen));
     } else {
@@ -1691,9 +2305,11 @@ static void ship_tap_log(conn *c) {
         case TAP_MUTATION:
             if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
                                                    (void*)&info)) {
+                static EXTENSION_LOG_LIMIT limit = DAEMON_LOG_LIMIT;
                 settings.engine.v1->release(settings.engine.v0, c, it);
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                                                "%d: Failed to get item info\n", c->sfd);
+                settings.extensions.logger->log_limited(EXTENSION_LOG_WARNING, c,
+                                                        &limit,
+                                                        "%d: Failed to get item info\n", c->sfd);
                 break;
             }
             send_data = true;
@@ -1817,9 +2433,11 @@ static void ship_tap_log(conn *c) {
             /* This is a delete */
             if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
                                                    (void*)&info)) {
+                static EXTENSION_LOG_LIMIT limit = DAEMON_LOG_LIMIT;
                 settings.engine.v1->release(settings.engine.v0, c, it);
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                                                "%d: Failed to get item info\n", c->sfd);
+                settings.extensions.logger->log_limited(EXTENSION_LOG_WARNING, c,
+                                                        &limit,
+                                                        "%d: Failed to get item info\n", c->sfd);
                 break;
             }
             send_data = true;
@@ -1944,8 +2562,20 @@ static ENGINE_ERROR_CODE default_unknown_command(EXTENSION_BINARY_PROTOCOL_DESCR
             return ENGINE_DISCONNECT;
         }
     } else {
-        return settings.engine.v1->unknown_command(handle, cookie,
-                                                   request, response);
+        ENGINE_ERROR_CODE ret;
+        uint16_t nkey = ntohs(request->request.keylen);
+
+        ret = settings.engine.v1->unknown_command(handle, cookie,
+                                                  request, response);
+        /* It may well change the item (touch and friends) */
+        if (request->request.opcode ==
+            PROTOCOL_BINARY_CMD_NAMESPACE_INVALIDATE) {
+            hot_cache_invalidate_all();
+        } else if (nkey > 0) {
+            hot_cache_invalidate((char*)request + sizeof(*request) +
+                                 request->request.extlen, nkey);
+        }
+        return ret;
     }
 }
 
@@ -1986,9 +2616,9 @@ static void process_bin_unknown_packet(conn *c) {
     switch (ret) {
     case ENGINE_SUCCESS:
         if (c->dynamic_buffer.buffer != NULL) {
-            write_and_free(c, c->dynamic_buffer.buffer, c->dynamic_buffer.offset);
-            c->dynamic_buffer.buffer = NULL;
-        } else {
+            write_dynamic_buffer(c);
+        } else if (c->state != conn_mwrite) {
+            /* (it is conn_mwrite if it was sent with send_item_response) */
             conn_set_state(c, conn_new_cmd);
         }
         break;
@@ -1999,61 +2629,58 @@ static void process_bin_unknown_packet(conn *c) {
         conn_set_state(c, conn_closing);
         break;
     default:
-        /* Release the dynamic buffer.. it may be partial.. */
-        free(c->dynamic_buffer.buffer);
+        /* Drop the dynamic buffer.. it may be partial.. (it is released
+         * along with the arena) */
         c->dynamic_buffer.buffer = NULL;
         write_bin_packet(c, engine_error_2_protocol_error(ret), 0);
     }
 }
 
-static void cbsasl_refresh_main(void *c)
+static ENGINE_ERROR_CODE cbsasl_refresh_task(void *arg)
 {
-    int rv = cbsasl_server_refresh();
-    if (rv == SASL_OK) {
-        notify_io_complete(c, ENGINE_SUCCESS);
-    } else {
-        notify_io_complete(c, ENGINE_EINVAL);
+    (void)arg;
+    if (cbsasl_server_refresh() == SASL_OK) {
+        return ENGINE_SUCCESS;
     }
+    return ENGINE_EINVAL;
 }
 
 static ENGINE_ERROR_CODE refresh_cbsasl(conn *c)
 {
-    cb_thread_t tid;
-    int err;
+    ENGINE_ERROR_CODE ret;
 
-    err = cb_create_thread(&tid, cbsasl_refresh_main, c, 1);
-    if (err != 0) {
+    ret = executor_submit(c, cbsasl_refresh_task, NULL,
+                          EXECUTOR_PRIORITY_HIGH);
+    if (ret != ENGINE_SUCCESS) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                                        "Failed to create cbsasl db "
-                                        "update thread: %s",
-                                        strerror(err));
-        return ENGINE_DISCONNECT;
+                                        "Failed to schedule the cbsasl db "
+                                        "update\n");
+        return ret;
     }
 
     return ENGINE_EWOULDBLOCK;
 }
 
 #if 0
-static void ssl_certs_refresh_main(void *c)
+static ENGINE_ERROR_CODE ssl_certs_refresh_task(void *arg)
 {
     /* Update the internal certificates */
 
-    notify_io_complete(c, ENGINE_SUCCESS);
+    return ENGINE_SUCCESS;
 }
 #endif
 static ENGINE_ERROR_CODE refresh_ssl_certs(conn *c)
 {
 #if 0
-    cb_thread_t tid;
-    int err;
+    ENGINE_ERROR_CODE ret;
 
-    err = cb_create_thread(&tid, ssl_certs_refresh_main, c, 1);
-    if (err != 0) {
+    ret = executor_submit(c, ssl_certs_refresh_task, NULL,
+                          EXECUTOR_PRIORITY_HIGH);
+    if (ret != ENGINE_SUCCESS) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                                        "Failed to create ssl_certificate "
-                                        "update thread: %s",
-                                        strerror(err));
-        return ENGINE_DISCONNECT;
+                                        "Failed to schedule the "
+                                        "ssl_certificate update\n");
+        return ret;
     }
 
     return ENGINE_EWOULDBLOCK;
@@ -2116,6 +2743,7 @@ static void process_bin_tap_connect(conn *c) {
         c->write_and_go = conn_closing;
     } else {
         c->tap_iterator = iterator;
+        conn_set_priority(c, CONN_PRIORITY_LOW);
         c->which = EV_WRITE;
         conn_set_state(c, conn_ship_log);
     }
@@ -2178,10 +2806,8 @@ static void process_bin_tap_packet(tap_event_t event, conn *c) {
 
         if (ret == ENGINE_SUCCESS) {
             uint8_t datatype = c->binary_header.request.datatype;
-            if (event == TAP_MUTATION && !c->supports_datatype) {
-                if (checkUTF8JSON((void*)data, ndata)) {
-                    datatype = PROTOCOL_BINARY_DATATYPE_JSON;
-                }
+            if (event == TAP_MUTATION) {
+                datatype = detect_datatype(c, datatype, data, ndata);
             }
 
             ret = settings.engine.v1->tap_notify(settings.engine.v0, c,
@@ -2194,6 +2820,11 @@ static void process_bin_tap_packet(tap_event_t event, conn *c) {
                                                  datatype,
                                                  data, ndata,
                                                  c->binary_header.request.vbucket);
+            if (event == TAP_FLUSH) {
+                hot_cache_invalidate_all();
+            } else {
+                hot_cache_invalidate(key, nkey);
+            }
         }
     }
 
@@ -2487,8 +3118,9 @@ static ENGINE_ERROR_CODE dcp_message_mutation(const void* cookie,
     protocol_binary_request_dcp_mutation packet;
     int xx;
 
-    if (c->write.bytes + sizeof(packet.bytes) + nmeta >= c->write.size) {
-        /* We don't have room in the buffer */
+    if (c->write.bytes + sizeof(packet.bytes) + nmeta >= c->write.size ||
+        c->ileft == c->isize) {
+        /* We don't have room in the buffer (or the item list) */
         return ENGINE_E2BIG;
     }
 
@@ -2497,9 +3129,11 @@ static ENGINE_ERROR_CODE dcp_message_mutation(const void* cookie,
 
     if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
                                            (void*)&info)) {
+        static EXTENSION_LOG_LIMIT limit = DAEMON_LOG_LIMIT;
         settings.engine.v1->release(settings.engine.v0, c, it);
-        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                                        "%d: Failed to get item info\n", c->sfd);
+        settings.extensions.logger->log_limited(EXTENSION_LOG_WARNING, c,
+                                                &limit,
+                                                "%d: Failed to get item info\n", c->sfd);
         return ENGINE_FAILED;
     }
 
@@ -2793,6 +3427,11 @@ static ENGINE_ERROR_CODE dcp_message_control(const void* cookie,
     return ENGINE_SUCCESS;
 }
 
+/* The most we queue up for a DCP connection before we send it (what fits
+ * in one sendmsg) */
+#define DCP_BATCH_MAX_BYTES (1024 * 1024)
+#define DCP_BATCH_MAX_IOV IOV_MAX
+
 static void ship_dcp_log(conn *c) {
     static struct dcp_message_producers producers = {
         dcp_message_get_failover_log,
@@ -2812,6 +3451,8 @@ static void ship_dcp_log(conn *c) {
         dcp_message_control
     };
     ENGINE_ERROR_CODE ret;
+    size_t nbytes = 0;
+    int iovused;
 
     c->msgcurr = 0;
     c->msgused = 0;
@@ -2838,8 +3479,34 @@ static void ship_dcp_log(conn *c) {
     }
     c->icurr = c->ilist;
 
+    if (c->dcp_window != 0 && c->dcp_unacked >= c->dcp_window) {
+        /* Wait for the consumer to acknowledge what it's got */
+        c->ewouldblock = true;
+        return;
+    }
+
     c->ewouldblock = false;
-    ret = settings.engine.v1->dcp.step(settings.engine.v0, c, &producers);
+    /*
+     * Keep on stepping for as long as the engine has got more to send and
+     * there is room for it, so that the messages of many steps go out
+     * together
+     */
+    do {
+        iovused = c->iovused;
+        ret = settings.engine.v1->dcp.step(settings.engine.v0, c, &producers);
+        for (; iovused < c->iovused; ++iovused) {
+            nbytes += c->iov[iovused].iov_len;
+        }
+    } while (ret == ENGINE_WANT_MORE && nbytes < DCP_BATCH_MAX_BYTES &&
+             c->iovused < DCP_BATCH_MAX_IOV &&
+             (c->dcp_window == 0 ||
+              c->dcp_unacked + nbytes < c->dcp_window));
+    c->dcp_unacked += (uint32_t)nbytes;
+
+    if (ret == ENGINE_E2BIG && c->iovused > 0) {
+        /* The buffer filled up with the previous steps; send them */
+        ret = ENGINE_WANT_MORE;
+    }
     if (ret == ENGINE_SUCCESS) {
         /* the engine don't have more data to send at this moment */
         c->ewouldblock = true;
@@ -3303,15 +3970,15 @@ static int get_validator(void *packet)
     return 0;
 }
 
-static int delete_validator(void *packet)
+static int touch_validator(void *packet)
 {
-    protocol_binary_request_no_extras *req = packet;
+    protocol_binary_request_touch *req = packet;
     uint16_t klen = ntohs(req->message.header.request.keylen);
     uint32_t blen = ntohl(req->message.header.request.bodylen);
 
     if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        req->message.header.request.extlen != 0 ||
-        klen == 0 || klen != blen ||
+        req->message.header.request.extlen != 4 ||
+        klen == 0 || klen + 4 != blen ||
         req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
         return -1;
     }
@@ -3358,7 +4025,7 @@ static int get_cmd_timer_validator(void *packet)
     uint8_t extlen = req->message.header.request.extlen;
 
     if (req->message.header.request.magic != PROTOCOL_BINARY_REQ ||
-        extlen != 1 || klen != 0 || (klen + extlen) != blen ||
+        extlen != 1 || klen > KEY_MAX_LENGTH || (klen + extlen) != blen ||
         req->message.header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
         return -1;
     }
@@ -3422,6 +4089,12 @@ static void dcp_open_executor(conn *c, void *packet)
 
         switch (ret) {
         case ENGINE_SUCCESS:
+            /* It's a replication stream from now on */
+            conn_set_priority(c, CONN_PRIORITY_LOW);
+            if ((ntohl(req->message.body.flags) & DCP_OPEN_PRODUCER) == 0) {
+                /* A consumer never asks for a stream, so it's one now */
+                c->dcp = 1;
+            }
             write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, 0);
             break;
 
@@ -3562,9 +4235,7 @@ static void dcp_get_failover_log_executor(conn *c, void *packet) {
         switch (ret) {
         case ENGINE_SUCCESS:
             if (c->dynamic_buffer.buffer != NULL) {
-                write_and_free(c, c->dynamic_buffer.buffer,
-                               c->dynamic_buffer.offset);
-                c->dynamic_buffer.buffer = NULL;
+                write_dynamic_buffer(c);
             } else {
                 write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, 0);
             }
@@ -3622,9 +4293,7 @@ static void dcp_stream_req_executor(conn *c, void *packet)
         case ENGINE_SUCCESS:
             c->dcp = 1;
             if (c->dynamic_buffer.buffer != NULL) {
-                write_and_free(c, c->dynamic_buffer.buffer,
-                               c->dynamic_buffer.offset);
-                c->dynamic_buffer.buffer = NULL;
+                write_dynamic_buffer(c);
             } else {
                 write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, 0);
             }
@@ -3636,9 +4305,7 @@ static void dcp_stream_req_executor(conn *c, void *packet)
                                         sizeof(rollback_seqno), 0,
                                         PROTOCOL_BINARY_RESPONSE_ROLLBACK, 0,
                                         c)) {
-                write_and_free(c, c->dynamic_buffer.buffer,
-                               c->dynamic_buffer.offset);
-                c->dynamic_buffer.buffer = NULL;
+                write_dynamic_buffer(c);
             } else {
                 write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, 0);
             }
@@ -3772,6 +4439,7 @@ static void dcp_mutation_executor(conn *c, void *packet)
                                                    expiration, lock_time,
                                                    (char*)value + nvalue, nmeta,
                                                    req->message.body.nru);
+            hot_cache_invalidate(key, nkey);
         }
 
         switch (ret) {
@@ -3817,6 +4485,7 @@ static void dcp_deletion_executor(conn *c, void *packet)
                                                    req->message.header.request.opaque,
                                                    key, nkey, cas, vbucket,
                                                    by_seqno, rev_seqno, key + nkey, nmeta);
+            hot_cache_invalidate(key, nkey);
         }
 
         switch (ret) {
@@ -3862,6 +4531,7 @@ static void dcp_expiration_executor(conn *c, void *packet)
                                                      req->message.header.request.opaque,
                                                      key, nkey, cas, vbucket,
                                                      by_seqno, rev_seqno, key + nkey, nmeta);
+            hot_cache_invalidate(key, nkey);
         }
 
         switch (ret) {
@@ -3993,25 +4663,33 @@ static void dcp_noop_executor(conn *c, void *packet)
 static void dcp_buffer_acknowledgement_executor(conn *c, void *packet)
 {
     protocol_binary_request_dcp_buffer_acknowledgement *req = (void*)packet;
+    uint32_t bbytes;
 
-    if (settings.engine.v1->dcp.buffer_acknowledgement == NULL) {
+    memcpy(&bbytes, &req->message.body.buffer_bytes, 4);
+    bbytes = ntohl(bbytes);
+
+    if (settings.engine.v1->dcp.buffer_acknowledgement == NULL &&
+        c->dcp_window == 0) {
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED, 0);
     } else {
         ENGINE_ERROR_CODE ret = c->aiostat;
         c->aiostat = ENGINE_SUCCESS;
         c->ewouldblock = false;
 
-        if (ret == ENGINE_SUCCESS) {
-            uint32_t bbytes;
-            memcpy(&bbytes, &req->message.body.buffer_bytes, 4);
+        if (ret == ENGINE_SUCCESS &&
+            settings.engine.v1->dcp.buffer_acknowledgement != NULL) {
             ret = settings.engine.v1->dcp.buffer_acknowledgement(settings.engine.v0, c,
                                                                  c->binary_header.request.opaque,
                                                                  c->binary_header.request.vbucket,
-                                                                 ntohl(bbytes));
+                                                                 bbytes);
         }
 
         switch (ret) {
         case ENGINE_SUCCESS:
+            /* The stepping picks up again when we're back in
+             * conn_ship_log */
+            c->dcp_unacked -= bbytes < c->dcp_unacked ? bbytes :
+                                                        c->dcp_unacked;
             conn_set_state(c, conn_new_cmd);
             break;
 
@@ -4029,9 +4707,44 @@ static void dcp_buffer_acknowledgement_executor(conn *c, void *packet)
     }
 }
 
+/* The control key the consumers set their flow control window with */
+#define DCP_CONTROL_BUFFER_SIZE "connection_buffer_size"
+
+/**
+ * Set the flow control window of a DCP connection (the core does the
+ * accounting, whether or not the engine knows about it too)
+ * @param c the connection
+ * @param value the size of the window (in ASCII)
+ * @param nvalue the length of value
+ * @return ENGINE_EINVAL if the value isn't a number
+ */
+static ENGINE_ERROR_CODE set_dcp_window(conn *c, const uint8_t *value,
+                                        uint32_t nvalue) {
+    char buffer[32];
+    uint32_t window;
+
+    if (nvalue == 0 || nvalue >= sizeof(buffer)) {
+        return ENGINE_EINVAL;
+    }
+    memcpy(buffer, value, nvalue);
+    buffer[nvalue] = '\0';
+    if (!safe_strtoul(buffer, &window)) {
+        return ENGINE_EINVAL;
+    }
+
+    c->dcp_window = window;
+    return ENGINE_SUCCESS;
+}
+
 static void dcp_control_executor(conn *c, void *packet)
 {
-    if (settings.engine.v1->dcp.control == NULL) {
+    protocol_binary_request_dcp_control *req = (void*)packet;
+    const uint8_t *key = req->bytes + sizeof(req->bytes);
+    uint16_t nkey = ntohs(req->message.header.request.keylen);
+    bool window = nkey == sizeof(DCP_CONTROL_BUFFER_SIZE) - 1 &&
+        memcmp(key, DCP_CONTROL_BUFFER_SIZE, nkey) == 0;
+
+    if (settings.engine.v1->dcp.control == NULL && !window) {
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED, 0);
     } else {
         ENGINE_ERROR_CODE ret = c->aiostat;
@@ -4039,14 +4752,17 @@ static void dcp_control_executor(conn *c, void *packet)
         c->ewouldblock = false;
 
         if (ret == ENGINE_SUCCESS) {
-            protocol_binary_request_dcp_control *req = (void*)packet;
-            const uint8_t *key = req->bytes + sizeof(req->bytes);
-            uint16_t nkey = ntohs(req->message.header.request.keylen);
             const uint8_t *value = key + nkey;
             uint32_t nvalue = ntohl(req->message.header.request.bodylen) - nkey;
-            ret = settings.engine.v1->dcp.control(settings.engine.v0, c,
-                                                  c->binary_header.request.opaque,
-                                                  key, nkey, value, nvalue);
+            if (window) {
+                ret = set_dcp_window(c, value, nvalue);
+            }
+            if (ret == ENGINE_SUCCESS &&
+                settings.engine.v1->dcp.control != NULL) {
+                ret = settings.engine.v1->dcp.control(settings.engine.v0, c,
+                                                      c->binary_header.request.opaque,
+                                                      key, nkey, value, nvalue);
+            }
         }
 
         switch (ret) {
@@ -4141,18 +4857,20 @@ static void process_hello_packet_executor(conn *c, void *packet) {
     uint32_t total = (ntohl(req->message.header.request.bodylen) - klen) / 2;
     uint32_t ii;
     char *curr = key + klen;
-    uint16_t out[2]; /* We're currently only supporting two features */
+    /* Every feature we support is in the response at most once */
+    uint16_t out[MEMCACHED_TOTAL_HELLO_FEATURES];
+    bool requested[MEMCACHED_FIRST_HELLO_FEATURE +
+                   MEMCACHED_TOTAL_HELLO_FEATURES];
     int jj = 0;
-#if 0
-    int added_tls = 0;
-#endif
     memset((char*)out, 0, sizeof(out));
+    memset(requested, 0, sizeof(requested));
 
     /*
      * Disable all features the hello packet may enable, so that
      * the client can toggle features on/off during a connection
      */
     c->supports_datatype = false;
+    c->supports_compression = false;
 
     if (klen) {
         if (klen > 256) {
@@ -4165,34 +4883,39 @@ static void process_hello_packet_executor(conn *c, void *packet) {
         log_buffer[offset++] = ' ';
     }
 
+    /* Look at all of them first: some only make sense with others */
     for (ii = 0; ii < total; ++ii) {
         uint16_t in;
         /* to avoid alignment */
         memcpy(&in, curr, 2);
         curr += 2;
-        switch (ntohs(in)) {
-        case PROTOCOL_BINARY_FEATURE_TLS:
-#if 0
-            /* Not implemented */
-            if (added_tls == 0) {
-                out[jj++] = htons(PROTOCOL_BINARY_FEATURE_TLS);
-                added_sls++;
-            }
-#endif
-
-            break;
-        case PROTOCOL_BINARY_FEATURE_DATATYPE:
-            if (settings.datatype && !c->supports_datatype) {
-                offset += snprintf(log_buffer + offset,
-                                   sizeof(log_buffer) - offset,
-                                   "datatype ");
-                out[jj++] = htons(PROTOCOL_BINARY_FEATURE_DATATYPE);
-                c->supports_datatype = true;
-            }
-            break;
+        in = ntohs(in);
+        if (in >= MEMCACHED_FIRST_HELLO_FEATURE &&
+            in < MEMCACHED_FIRST_HELLO_FEATURE + MEMCACHED_TOTAL_HELLO_FEATURES) {
+            requested[in] = true;
         }
     }
 
+    /* PROTOCOL_BINARY_FEATURE_TLS is not implemented */
+
+    if (requested[PROTOCOL_BINARY_FEATURE_DATATYPE] && settings.datatype) {
+        offset += snprintf(log_buffer + offset,
+                           sizeof(log_buffer) - offset,
+                           "datatype ");
+        out[jj++] = htons(PROTOCOL_BINARY_FEATURE_DATATYPE);
+        c->supports_datatype = true;
+    }
+
+    /* The client can only tell a compressed value by its datatype */
+    if (requested[PROTOCOL_BINARY_FEATURE_SNAPPY] && c->supports_datatype &&
+        settings.compress_responses > 0) {
+        offset += snprintf(log_buffer + offset,
+                           sizeof(log_buffer) - offset,
+                           "snappy ");
+        out[jj++] = htons(PROTOCOL_BINARY_FEATURE_SNAPPY);
+        c->supports_compression = true;
+    }
+
     if (jj == 0) {
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, 0);
     } else {
@@ -4200,9 +4923,7 @@ static void process_hello_packet_executor(conn *c, void *packet) {
                                 PROTOCOL_BINARY_RAW_BYTES,
                                 PROTOCOL_BINARY_RESPONSE_SUCCESS,
                                 0, c);
-        write_and_free(c, c->dynamic_buffer.buffer,
-                       c->dynamic_buffer.offset);
-        c->dynamic_buffer.buffer = NULL;
+        write_dynamic_buffer(c);
     }
 
     log_buffer[offset++] = '\0';
@@ -4269,6 +4990,7 @@ static void flush_executor(conn *c, void *packet)
     }
 
     ret = settings.engine.v1->flush(settings.engine.v0, c, exptime);
+    hot_cache_invalidate_all();
 
     if (ret == ENGINE_SUCCESS) {
         write_bin_response(c, NULL, 0, 0, 0);
@@ -4280,8 +5002,195 @@ static void flush_executor(conn *c, void *packet)
     STATS_NOKEY(c, cmd_flush);
 }
 
+/* The most quiet gets we look up in one call to get_multi */
+#define GET_MULTI_MAX 64
+/* The room for each response header in the write buffer (kept aligned) */
+#define GET_MULTI_RSP_SIZE ((sizeof(protocol_binary_response_get) + 7) & ~7)
+
+/**
+ * Look up the current GETQ/GETKQ together with the ones following it in
+ * the input buffer with a single call to get_multi. We only batch when
+ * the packets are all there already (we never wait for more data), and
+ * stop at the first packet that isn't a plain quiet get. The responses for
+ * the hits are written in one go; the misses don't need any since the
+ * commands are quiet. We also stop once the responses add up to
+ * max_pending_output, and only read the rest of the packets when they
+ * have been sent (so a client which doesn't read what it asked for can't
+ * pin any number of items).
+ *
+ * @return false if the caller should process the current packet with
+ *         process_bin_get (nothing is consumed in that case)
+ */
+static bool process_bin_get_multi(conn *c) {
+    engine_key_t keys[GET_MULTI_MAX];
+    item *items[GET_MULTI_MAX];
+    ENGINE_ERROR_CODE status[GET_MULTI_MAX];
+    protocol_binary_request_header *reqs[GET_MULTI_MAX];
+    char *curr = c->read.curr;
+    uint32_t avail = c->read.bytes;
+    char *wbuf = c->write.buf;
+    size_t wsize = c->write.size;
+    size_t pending = c->coalesced.bytes;
+    int nkeys = 1;
+    int ndone = 0;
+    int ii;
+
+    if (settings.engine.v1->get_multi == NULL) {
+        return false;
+    }
+
+    keys[0].key = binary_get_key(c);
+    keys[0].nkey = c->binary_header.request.keylen;
+    keys[0].vbucket = c->binary_header.request.vbucket;
+    reqs[0] = NULL;
+
+    while (nkeys < GET_MULTI_MAX &&
+           avail >= sizeof(protocol_binary_request_header)) {
+        protocol_binary_request_header *req = (void*)curr;
+        uint16_t keylen = ntohs(req->request.keylen);
+        uint32_t bodylen = ntohl(req->request.bodylen);
+
+        if (req->request.magic != PROTOCOL_BINARY_REQ ||
+            (req->request.opcode != PROTOCOL_BINARY_CMD_GETQ &&
+             req->request.opcode != PROTOCOL_BINARY_CMD_GETKQ) ||
+            req->request.extlen != 0 || keylen == 0 ||
+            keylen > KEY_MAX_LENGTH || bodylen != keylen ||
+            avail - sizeof(*req) < bodylen) {
+            break;
+        }
+
+        reqs[nkeys] = req;
+        keys[nkeys].key = curr + sizeof(*req);
+        keys[nkeys].nkey = keylen;
+        keys[nkeys].vbucket = ntohs(req->request.vbucket);
+        ++nkeys;
+        curr += sizeof(*req) + bodylen;
+        avail -= (uint32_t)(sizeof(*req) + bodylen);
+    }
+
+    if (nkeys == 1) {
+        return false;
+    }
+
+    if (settings.engine.v1->get_multi(settings.engine.v0, c, keys, nkeys,
+                                      items, status) != ENGINE_SUCCESS ||
+        !conn_setup_itemlist(c)) {
+        return false;
+    }
+
+    /* Build the responses until we hit one that needs the slow path */
+    c->write.bytes = 0;
+    c->write.curr = wbuf;
+    for (ndone = 0; ndone < nkeys; ++ndone) {
+        protocol_binary_response_get *rsp;
+        item_info_holder info;
+        uint8_t opcode;
+        uint32_t opaque;
+        uint16_t keylen = 0;
+
+        if (status[ndone] == ENGINE_KEY_ENOENT) {
+            STATS_MISS(c, get, keys[ndone].key, keys[ndone].nkey);
+            continue;
+        } else if (status[ndone] != ENGINE_SUCCESS ||
+                   c->write.bytes + GET_MULTI_RSP_SIZE > wsize) {
+            break;
+        }
+
+        memset(&info, 0, sizeof(info));
+        info.info.nvalue = IOV_MAX;
+        if (!settings.engine.v1->get_item_info(settings.engine.v0, c,
+                                               items[ndone],
+                                               (void*)&info) ||
+            (!c->supports_datatype &&
+             (info.info.datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) ==
+             PROTOCOL_BINARY_DATATYPE_COMPRESSED) ||
+            (c->supports_compression &&
+             (info.info.datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) == 0 &&
+             info.info.nbytes >= (uint32_t)settings.compress_responses)) {
+            break;
+        }
+
+        if (reqs[ndone] == NULL) {
+            opcode = c->binary_header.request.opcode;
+            opaque = c->opaque;
+        } else {
+            opcode = reqs[ndone]->request.opcode;
+            opaque = reqs[ndone]->request.opaque;
+        }
+        if (opcode == PROTOCOL_BINARY_CMD_GETK ||
+            opcode == PROTOCOL_BINARY_CMD_GETKQ) {
+            keylen = keys[ndone].nkey;
+        }
+
+        if (settings.max_pending_output > 0 && c->ileft > 0 &&
+            pending + sizeof(rsp->bytes) + keylen + info.info.nbytes >
+            (size_t)settings.max_pending_output) {
+            STATS_NOKEY(c, conn_backpressure);
+            break;
+        }
+        pending += sizeof(rsp->bytes) + keylen + info.info.nbytes;
+
+        rsp = (void*)(wbuf + c->write.bytes);
+        memset(rsp, 0, sizeof(rsp->bytes));
+        rsp->message.header.response.magic = (uint8_t)PROTOCOL_BINARY_RES;
+        rsp->message.header.response.opcode = opcode;
+        rsp->message.header.response.keylen = htons(keylen);
+        rsp->message.header.response.extlen = sizeof(rsp->message.body);
+        rsp->message.header.response.datatype = c->supports_datatype ?
+            info.info.datatype : PROTOCOL_BINARY_RAW_BYTES;
+        rsp->message.header.response.bodylen =
+            htonl(sizeof(rsp->message.body) + keylen + info.info.nbytes);
+        rsp->message.header.response.opaque = opaque;
+        rsp->message.header.response.cas = htonll(info.info.cas);
+        rsp->message.body.flags = info.info.flags;
+        c->write.bytes += GET_MULTI_RSP_SIZE;
+
+        add_iov(c, rsp, sizeof(rsp->bytes));
+        if (keylen != 0) {
+            add_iov(c, info.info.key, keylen);
+        }
+        for (ii = 0; ii < info.info.nvalue; ++ii) {
+            add_iov(c, info.info.value[ii].iov_base,
+                    info.info.value[ii].iov_len);
+        }
+        c->ilist[c->ileft++] = items[ndone];
+        STATS_HIT(c, get, keys[ndone].key, keys[ndone].nkey);
+    }
+
+    /* Leave the rest of the packets to be read again */
+    for (ii = ndone; ii < nkeys; ++ii) {
+        if (items[ii] != NULL) {
+            settings.engine.v1->release(settings.engine.v0, c, items[ii]);
+        }
+    }
+
+    if (ndone == 0) {
+        c->write.bytes = 0;
+        return false;
+    }
+
+    for (ii = 1; ii < ndone; ++ii) {
+        uint32_t len = (uint32_t)sizeof(*reqs[ii]) + keys[ii].nkey;
+        c->read.curr += len;
+        c->read.bytes -= len;
+    }
+
+    if (c->ileft > 0) {
+        conn_set_state(c, conn_mwrite);
+    } else {
+        conn_set_state(c, conn_new_cmd);
+    }
+    return true;
+}
+
 static void get_executor(conn *c, void *packet)
 {
+    if ((c->cmd == PROTOCOL_BINARY_CMD_GETQ ||
+         c->cmd == PROTOCOL_BINARY_CMD_GETKQ) &&
+        c->aiostat == ENGINE_SUCCESS && process_bin_get_multi(c)) {
+        return;
+    }
+
     switch (c->cmd) {
     case PROTOCOL_BINARY_CMD_GETQ:
         c->cmd = PROTOCOL_BINARY_CMD_GET;
@@ -4304,6 +5213,123 @@ static void get_executor(conn *c, void *packet)
     process_bin_get(c);
 }
 
+/*
+ * TOUCH, GAT and GATQ through the touch method of the engine, so that
+ * we send the value of GAT from the item (as for get) rather than have
+ * the engine copy it into a response.
+ */
+static void process_bin_touch(conn *c) {
+    protocol_binary_response_get* rsp = (protocol_binary_response_get*)c->write.buf;
+    protocol_binary_request_touch *req = binary_get_request(c);
+    char* key = binary_get_key(c);
+    size_t nkey = c->binary_header.request.keylen;
+    rel_time_t exptime = ntohl(req->message.body.expiration);
+    bool gat = c->cmd != PROTOCOL_BINARY_CMD_TOUCH;
+    item *it = NULL;
+    item_info_holder info;
+    uint8_t datatype;
+    int ii;
+    ENGINE_ERROR_CODE ret;
+
+    ret = c->aiostat;
+    c->aiostat = ENGINE_SUCCESS;
+    if (ret == ENGINE_SUCCESS) {
+        ret = settings.engine.v1->touch(settings.engine.v0, c,
+                                        gat ? &it : NULL, key, (uint16_t)nkey,
+                                        exptime,
+                                        c->binary_header.request.vbucket);
+        if (ret == ENGINE_ENOTSUP) {
+            process_bin_unknown_packet(c);
+            return;
+        }
+        hot_cache_invalidate(key, nkey);
+    }
+
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        if (!gat) {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, 0);
+            break;
+        }
+
+        memset(&info, 0, sizeof(info));
+        info.info.nvalue = IOV_MAX;
+        if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
+                                               (void*)&info)) {
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL, 0);
+            break;
+        }
+
+        datatype = info.info.datatype;
+        if (!c->supports_datatype &&
+            (datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) != 0) {
+            /* It has to be inflated, so it can't be sent from the item */
+            if (info.info.nvalue == 1 &&
+                binary_response_handler(NULL, 0, &info.info.flags, 4,
+                                        info.info.value[0].iov_base,
+                                        (uint32_t)info.info.value[0].iov_len,
+                                        datatype,
+                                        PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                                        info.info.cas, c)) {
+                write_dynamic_buffer(c);
+            } else {
+                write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL, 0);
+            }
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            break;
+        } else if (!c->supports_datatype) {
+            datatype = PROTOCOL_BINARY_RAW_BYTES;
+        }
+
+        if (add_bin_header(c, 0, sizeof(rsp->message.body), 0,
+                           sizeof(rsp->message.body) + info.info.nbytes,
+                           datatype) == -1) {
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            conn_set_state(c, conn_closing);
+            return;
+        }
+        rsp->message.header.response.cas = htonll(info.info.cas);
+        rsp->message.body.flags = info.info.flags;
+        add_iov(c, &rsp->message.body, sizeof(rsp->message.body));
+        for (ii = 0; ii < info.info.nvalue; ++ii) {
+            add_iov(c, info.info.value[ii].iov_base,
+                    info.info.value[ii].iov_len);
+        }
+        conn_set_state(c, conn_mwrite);
+        /* Released when the response is sent */
+        c->item = it;
+        break;
+    case ENGINE_KEY_ENOENT:
+        if (c->cmd == PROTOCOL_BINARY_CMD_GATQ) {
+            conn_set_state(c, conn_new_cmd);
+        } else {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0);
+        }
+        break;
+    case ENGINE_EWOULDBLOCK:
+        c->ewouldblock = true;
+        break;
+    case ENGINE_DISCONNECT:
+        c->state = conn_closing;
+        break;
+    default:
+        write_bin_packet(c, engine_error_2_protocol_error(ret), 0);
+    }
+}
+
+static void touch_executor(conn *c, void *packet)
+{
+    (void)packet;
+    /* Unless the engine doesn't have it, or an extension took it over */
+    if (settings.engine.v1->touch == NULL ||
+        request_handlers[c->cmd].callback != default_unknown_command) {
+        process_bin_unknown_packet(c);
+    } else {
+        process_bin_touch(c);
+    }
+}
+
 static void process_bin_delete(conn *c);
 static void delete_executor(conn *c, void *packet)
 {
@@ -4375,6 +5401,12 @@ static void stat_executor(conn *c, void *packet)
             }
         } else if (strncmp(subcommand, "aggregate", 9) == 0) {
             server_stats(&append_stats, c, true);
+        } else if (strncmp(subcommand, "worker", 6) == 0) {
+            threads_worker_stats(&append_stats, c);
+        } else if (strncmp(subcommand, "locks", 5) == 0) {
+            mc_mutex_stats(&append_stats, c);
+        } else if (strncmp(subcommand, "spans", 5) == 0) {
+            threads_span_stats(&append_stats, c);
         } else {
             ret = settings.engine.v1->get_stats(settings.engine.v0, c,
                                                 subcommand, (int)nkey,
@@ -4385,8 +5417,7 @@ static void stat_executor(conn *c, void *packet)
     switch (ret) {
     case ENGINE_SUCCESS:
         append_stats(NULL, 0, NULL, 0, c);
-        write_and_free(c, c->dynamic_buffer.buffer, c->dynamic_buffer.offset);
-        c->dynamic_buffer.buffer = NULL;
+        write_dynamic_buffer(c);
         break;
     case ENGINE_ENOMEM:
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, 0);
@@ -4489,6 +5520,7 @@ static void arithmetic_executor(conn *c, void *packet)
                                              c->binary_header.request.datatype,
                                              &rsp->message.body.value,
                                              c->binary_header.request.vbucket);
+        hot_cache_invalidate(key, nkey);
     }
 
     switch (ret) {
@@ -4542,13 +5574,29 @@ static void arithmetic_executor(conn *c, void *packet)
     }
 }
 
+/*
+ * The timings of the whole process, or with a key of the bucket by that
+ * name (or the port, as port:<number>)
+ */
 static void get_cmd_timer_executor(conn *c, void *packet)
 {
     protocol_binary_request_get_cmd_timer *req = packet;
+    uint16_t klen = ntohs(req->message.header.request.keylen);
+    struct timings_group *group = NULL;
+
+    if (klen > 0) {
+        char name[KEY_MAX_LENGTH + 1];
+        memcpy(name, (char *)packet + sizeof(req->bytes), klen);
+        name[klen] = '\0';
+        group = timings_group_get(name, false);
+        if (group == NULL) {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0);
+            return;
+        }
+    }
 
-    generate_timings(req->message.body.opcode, c);
-    write_and_free(c, c->dynamic_buffer.buffer, c->dynamic_buffer.offset);
-    c->dynamic_buffer.buffer = NULL;
+    generate_timings(group, req->message.body.opcode, c);
+    write_dynamic_buffer(c);
 }
 
 static void set_ctrl_token_executor(conn *c, void *packet)
@@ -4574,8 +5622,7 @@ static void set_ctrl_token_executor(conn *c, void *packet)
                                 ret, session_cas.value, c);
         cb_mutex_exit(&(session_cas.mutex));
 
-        write_and_free(c, c->dynamic_buffer.buffer, c->dynamic_buffer.offset);
-        c->dynamic_buffer.buffer = NULL;
+        write_dynamic_buffer(c);
     } else {
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EACCESS, 0);
     }
@@ -4590,8 +5637,7 @@ static void get_ctrl_token_executor(conn *c, void *packet)
                                 PROTOCOL_BINARY_RESPONSE_SUCCESS,
                                 session_cas.value, c);
         cb_mutex_exit(&(session_cas.mutex));
-        write_and_free(c, c->dynamic_buffer.buffer, c->dynamic_buffer.offset);
-        c->dynamic_buffer.buffer = NULL;
+        write_dynamic_buffer(c);
     } else {
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EACCESS, 0);
     }
@@ -4603,20 +5649,86 @@ static void ioctl_get_executor(conn *c, void *packet)
     write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED, 0);
 }
 
-static void ioctl_set_executor(conn *c, void *packet)
-{
-    protocol_binary_request_ioctl_set *req = packet;
+/*
+ * Changes one of the settings we may change at runtime with IOCTL_SET
+ * (the key is the name of the setting, and the value is the new one):
+ *
+ *   num_threads         the number of the client workers which take
+ *                       connections (up to the ones we started with)
+ *   reqs_per_event      see the settings of the same name
+ *   reqs_per_tap_event
+ *   tcp_nodelay         of the connections accepted from now on, on all
+ *                       of the interfaces
+ */
+static protocol_binary_response_status ioctl_set_setting(conn *c,
+                                                         const char *key,
+                                                         size_t keylen,
+                                                         const char *value) {
+    int32_t val;
+    int ii;
 
-    size_t keylen = ntohs(req->message.header.request.keylen);
+    if (!cookie_is_admin(c)) {
+        return PROTOCOL_BINARY_RESPONSE_EACCESS;
+    }
+
+    if (keylen == strlen("tcp_nodelay") &&
+        strncmp("tcp_nodelay", key, keylen) == 0) {
+        bool nodelay;
+        if (strcmp(value, "true") == 0) {
+            nodelay = true;
+        } else if (strcmp(value, "false") == 0) {
+            nodelay = false;
+        } else {
+            return PROTOCOL_BINARY_RESPONSE_EINVAL;
+        }
+        for (ii = 0; ii < settings.num_interfaces; ++ii) {
+            settings.interfaces[ii].tcp_nodelay = nodelay;
+        }
+        settings.tcp_nodelay = nodelay;
+        return PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    }
+
+    if (!safe_strtol(value, &val) || val <= 0) {
+        return PROTOCOL_BINARY_RESPONSE_EINVAL;
+    }
+
+    if (keylen == strlen("num_threads") &&
+        strncmp("num_threads", key, keylen) == 0) {
+        /* The kernel would keep on handing the retired ones connections */
+        if (settings.reuseport || !threads_set_active(val)) {
+            return PROTOCOL_BINARY_RESPONSE_EINVAL;
+        }
+    } else if (keylen == strlen("reqs_per_event") &&
+               strncmp("reqs_per_event", key, keylen) == 0) {
+        settings.reqs_per_event = val;
+    } else if (keylen == strlen("reqs_per_tap_event") &&
+               strncmp("reqs_per_tap_event", key, keylen) == 0) {
+        settings.reqs_per_tap_event = val;
+    } else {
+        return PROTOCOL_BINARY_RESPONSE_EINVAL;
+    }
+    return PROTOCOL_BINARY_RESPONSE_SUCCESS;
+}
 
-    if (keylen == 0 || keylen > KEY_MAX_LENGTH) {
+static void ioctl_set_executor(conn *c, void *packet)
+{
+    protocol_binary_request_ioctl_set *req = packet;
+
+    size_t keylen = ntohs(req->message.header.request.keylen);
+    size_t extlen = req->message.header.request.extlen;
+    size_t bodylen = ntohl(req->message.header.request.bodylen);
+    protocol_binary_response_status status;
+    char buffer[32];
+    size_t valuelen;
+
+    if (keylen == 0 || keylen > KEY_MAX_LENGTH || keylen + extlen > bodylen) {
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL, 0);
         return;
     }
 
-    const char* key = (const char*)(req->bytes + sizeof(req->bytes));
+    const char* key = (const char*)(req->bytes + sizeof(req->bytes)) + extlen;
     const char* value = key + keylen;
-    (void)value; /* Value currently unused. */
+    valuelen = bodylen - keylen - extlen;
 
     if (strncmp("release_free_memory", key, keylen) == 0 &&
         keylen == strlen("release_free_memory")) {
@@ -4624,9 +5736,23 @@ static void ioctl_set_executor(conn *c, void *packet)
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                 "%d: IOCTL_SET: release_free_memory called\n", c->sfd);
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, 0);
-    } else {
+        return;
+    }
+
+    if (valuelen >= sizeof(buffer)) {
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL, 0);
+        return;
+    }
+    memcpy(buffer, value, valuelen);
+    buffer[valuelen] = '\0';
+
+    status = ioctl_set_setting(c, key, keylen, buffer);
+    if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
+                "%d: IOCTL_SET: %.*s set to %s\n", c->sfd, (int)keylen,
+                key, buffer);
     }
+    write_bin_packet(c, status, 0);
 }
 
 static void not_supported_executor(conn *c, void *packet)
@@ -4638,117 +5764,197 @@ static void not_supported_executor(conn *c, void *packet)
 typedef int (*bin_package_validate)(void *packet);
 typedef void (*bin_package_execute)(conn *c, void *packet);
 
-bin_package_validate validators[0xff];
-bin_package_execute executors[0xff];
+/* How dispatch_bin_command reads the rest of a packet */
+enum bin_read {
+    /* Not one of ours, so it goes to the engine (if it has got one) */
+    BIN_READ_UNKNOWN = 0,
+    /* The whole body, for the validator and executor to look at */
+    BIN_READ_PACKET,
+    /* Like BIN_READ_PACKET, but the body is the key and nothing else,
+     * which we check with the header we've got already */
+    BIN_READ_KEY,
+    /* The key and extras of SET, ADD and REPLACE */
+    BIN_READ_STORE,
+    /* The key of APPEND and PREPEND */
+    BIN_READ_CONCAT,
+    /* The mechanism of a SASL AUTH or STEP */
+    BIN_READ_SASL
+};
+
+struct bin_command {
+    bin_package_validate validate;
+    bin_package_execute execute;
+    enum bin_read read;
+    /* The command we run it as (the quiet mutations are run as the
+     * non quiet ones with noreply set) */
+    uint8_t cmd;
+    bool noreply;
+};
+
+/* Indexed by the opcode (all 256 of them) */
+static struct bin_command bin_commands[0x100];
+
+static void set_bin_executor(uint8_t opcode, bin_package_validate validate,
+                             bin_package_execute execute) {
+    bin_commands[opcode].validate = validate;
+    bin_commands[opcode].execute = execute;
+    bin_commands[opcode].read = BIN_READ_PACKET;
+    bin_commands[opcode].cmd = opcode;
+}
+
+static void set_bin_key_executor(uint8_t opcode, bin_package_execute execute) {
+    set_bin_executor(opcode, NULL, execute);
+    bin_commands[opcode].read = BIN_READ_KEY;
+}
+
+static void set_bin_reader(uint8_t opcode, enum bin_read read, uint8_t cmd,
+                           bool noreply) {
+    bin_commands[opcode].read = read;
+    bin_commands[opcode].cmd = cmd;
+    bin_commands[opcode].noreply = noreply;
+}
 
 static void setup_bin_packet_handlers(void) {
-    validators[PROTOCOL_BINARY_CMD_DCP_OPEN] = dcp_open_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_ADD_STREAM] = dcp_add_stream_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_CLOSE_STREAM] = dcp_close_stream_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_SNAPSHOT_MARKER] = dcp_snapshot_marker_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_DELETION] = dcp_deletion_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_EXPIRATION] = dcp_expiration_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_FLUSH] = dcp_flush_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_GET_FAILOVER_LOG] = dcp_get_failover_log_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_MUTATION] = dcp_mutation_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_SET_VBUCKET_STATE] = dcp_set_vbucket_state_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_NOOP] = dcp_noop_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_BUFFER_ACKNOWLEDGEMENT] = dcp_buffer_acknowledgement_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_CONTROL] = dcp_control_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_STREAM_END] = dcp_stream_end_validator;
-    validators[PROTOCOL_BINARY_CMD_DCP_STREAM_REQ] = dcp_stream_req_validator;
-    validators[PROTOCOL_BINARY_CMD_ISASL_REFRESH] = isasl_refresh_validator;
-    validators[PROTOCOL_BINARY_CMD_SSL_CERTS_REFRESH] = ssl_certs_refresh_validator;
-    validators[PROTOCOL_BINARY_CMD_VERBOSITY] = verbosity_validator;
-    validators[PROTOCOL_BINARY_CMD_HELLO] = hello_validator;
-    validators[PROTOCOL_BINARY_CMD_VERSION] = version_validator;
-    validators[PROTOCOL_BINARY_CMD_QUIT] = quit_validator;
-    validators[PROTOCOL_BINARY_CMD_QUITQ] = quit_validator;
-    validators[PROTOCOL_BINARY_CMD_SASL_LIST_MECHS] = sasl_list_mech_validator;
-    validators[PROTOCOL_BINARY_CMD_NOOP] = noop_validator;
-    validators[PROTOCOL_BINARY_CMD_FLUSH] = flush_validator;
-    validators[PROTOCOL_BINARY_CMD_FLUSHQ] = flush_validator;
-    validators[PROTOCOL_BINARY_CMD_GET] = get_validator;
-    validators[PROTOCOL_BINARY_CMD_GETQ] = get_validator;
-    validators[PROTOCOL_BINARY_CMD_GETK] = get_validator;
-    validators[PROTOCOL_BINARY_CMD_GETKQ] = get_validator;
-    validators[PROTOCOL_BINARY_CMD_DELETE] = delete_validator;
-    validators[PROTOCOL_BINARY_CMD_DELETEQ] = delete_validator;
-    validators[PROTOCOL_BINARY_CMD_STAT] = stat_validator;
-    validators[PROTOCOL_BINARY_CMD_INCREMENT] = arithmetic_validator;
-    validators[PROTOCOL_BINARY_CMD_INCREMENTQ] = arithmetic_validator;
-    validators[PROTOCOL_BINARY_CMD_DECREMENT] = arithmetic_validator;
-    validators[PROTOCOL_BINARY_CMD_DECREMENTQ] = arithmetic_validator;
-    validators[PROTOCOL_BINARY_CMD_GET_CMD_TIMER] = get_cmd_timer_validator;
-    validators[PROTOCOL_BINARY_CMD_SET_CTRL_TOKEN] = set_ctrl_token_validator;
-    validators[PROTOCOL_BINARY_CMD_GET_CTRL_TOKEN] = get_ctrl_token_validator;
-    validators[PROTOCOL_BINARY_CMD_IOCTL_GET] = get_validator;
-
-    executors[PROTOCOL_BINARY_CMD_DCP_OPEN] = dcp_open_executor;
-    executors[PROTOCOL_BINARY_CMD_DCP_ADD_STREAM] = dcp_add_stream_executor;
-    executors[PROTOCOL_BINARY_CMD_DCP_CLOSE_STREAM] = dcp_close_stream_executor;
-    executors[PROTOCOL_BINARY_CMD_DCP_SNAPSHOT_MARKER] = dcp_snapshot_marker_executor;
-    executors[PROTOCOL_BINARY_CMD_TAP_CHECKPOINT_END] = tap_checkpoint_end_executor;
-    executors[PROTOCOL_BINARY_CMD_TAP_CHECKPOINT_START] = tap_checkpoint_start_executor;
-    executors[PROTOCOL_BINARY_CMD_TAP_CONNECT] = tap_connect_executor;
-    executors[PROTOCOL_BINARY_CMD_TAP_DELETE] = tap_delete_executor;
-    executors[PROTOCOL_BINARY_CMD_TAP_FLUSH] = tap_flush_executor;
-    executors[PROTOCOL_BINARY_CMD_TAP_MUTATION] = tap_mutation_executor;
-    executors[PROTOCOL_BINARY_CMD_TAP_OPAQUE] = tap_opaque_executor;
-    executors[PROTOCOL_BINARY_CMD_TAP_VBUCKET_SET] = tap_vbucket_set_executor;
-    executors[PROTOCOL_BINARY_CMD_DCP_DELETION] = dcp_deletion_executor;
-    executors[PROTOCOL_BINARY_CMD_DCP_EXPIRATION] = dcp_expiration_executor;
-    executors[PROTOCOL_BINARY_CMD_DCP_FLUSH] = dcp_flush_executor;
-    executors[PROTOCOL_BINARY_CMD_DCP_GET_FAILOVER_LOG] = dcp_get_failover_log_executor;
-    executors[PROTOCOL_BINARY_CMD_DCP_MUTATION] = dcp_mutation_executor;
-    executors[PROTOCOL_BINARY_CMD_DCP_SET_VBUCKET_STATE] = dcp_set_vbucket_state_executor;
-    executors[PROTOCOL_BINARY_CMD_DCP_NOOP] = dcp_noop_executor;
-    executors[PROTOCOL_BINARY_CMD_DCP_BUFFER_ACKNOWLEDGEMENT] = dcp_buffer_acknowledgement_executor;
-    executors[PROTOCOL_BINARY_CMD_DCP_CONTROL] = dcp_control_executor;
-    executors[PROTOCOL_BINARY_CMD_DCP_STREAM_END] = dcp_stream_end_executor;
-    executors[PROTOCOL_BINARY_CMD_DCP_STREAM_REQ] = dcp_stream_req_executor;
-    executors[PROTOCOL_BINARY_CMD_ISASL_REFRESH] = isasl_refresh_executor;
-    executors[PROTOCOL_BINARY_CMD_SSL_CERTS_REFRESH] = ssl_certs_refresh_executor;
-    executors[PROTOCOL_BINARY_CMD_VERBOSITY] = verbosity_executor;
-    executors[PROTOCOL_BINARY_CMD_HELLO] = process_hello_packet_executor;
-    executors[PROTOCOL_BINARY_CMD_VERSION] = version_executor;
-    executors[PROTOCOL_BINARY_CMD_QUIT] = quit_executor;
-    executors[PROTOCOL_BINARY_CMD_QUITQ] = quitq_executor;
-    executors[PROTOCOL_BINARY_CMD_SASL_LIST_MECHS] = sasl_list_mech_executor;
-    executors[PROTOCOL_BINARY_CMD_NOOP] = noop_executor;
-    executors[PROTOCOL_BINARY_CMD_FLUSH] = flush_executor;
-    executors[PROTOCOL_BINARY_CMD_FLUSHQ] = flush_executor;
-    executors[PROTOCOL_BINARY_CMD_GET] = get_executor;
-    executors[PROTOCOL_BINARY_CMD_GETQ] = get_executor;
-    executors[PROTOCOL_BINARY_CMD_GETK] = get_executor;
-    executors[PROTOCOL_BINARY_CMD_GETKQ] = get_executor;
-    executors[PROTOCOL_BINARY_CMD_DELETE] = delete_executor;
-    executors[PROTOCOL_BINARY_CMD_DELETEQ] = delete_executor;
-    executors[PROTOCOL_BINARY_CMD_STAT] = stat_executor;
-    executors[PROTOCOL_BINARY_CMD_INCREMENT] = arithmetic_executor;
-    executors[PROTOCOL_BINARY_CMD_INCREMENTQ] = arithmetic_executor;
-    executors[PROTOCOL_BINARY_CMD_DECREMENT] = arithmetic_executor;
-    executors[PROTOCOL_BINARY_CMD_DECREMENTQ] = arithmetic_executor;
-    executors[PROTOCOL_BINARY_CMD_GET_CMD_TIMER] = get_cmd_timer_executor;
-    executors[PROTOCOL_BINARY_CMD_SET_CTRL_TOKEN] = set_ctrl_token_executor;
-    executors[PROTOCOL_BINARY_CMD_GET_CTRL_TOKEN] = get_ctrl_token_executor;
-    executors[PROTOCOL_BINARY_CMD_IOCTL_GET] = ioctl_get_executor;
-    executors[PROTOCOL_BINARY_CMD_IOCTL_SET] = ioctl_set_executor;
+    int ii;
+
+    for (ii = 0; ii < 0x100; ++ii) {
+        bin_commands[ii].cmd = (uint8_t)ii;
+    }
+
+    set_bin_executor(PROTOCOL_BINARY_CMD_DCP_OPEN,
+                     dcp_open_validator, dcp_open_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_DCP_ADD_STREAM,
+                     dcp_add_stream_validator, dcp_add_stream_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_DCP_CLOSE_STREAM,
+                     dcp_close_stream_validator, dcp_close_stream_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_DCP_SNAPSHOT_MARKER,
+                     dcp_snapshot_marker_validator, dcp_snapshot_marker_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_TAP_CHECKPOINT_END,
+                     NULL, tap_checkpoint_end_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_TAP_CHECKPOINT_START,
+                     NULL, tap_checkpoint_start_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_TAP_CONNECT,
+                     NULL, tap_connect_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_TAP_DELETE, NULL, tap_delete_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_TAP_FLUSH, NULL, tap_flush_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_TAP_MUTATION,
+                     NULL, tap_mutation_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_TAP_OPAQUE, NULL, tap_opaque_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_TAP_VBUCKET_SET,
+                     NULL, tap_vbucket_set_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_DCP_DELETION,
+                     dcp_deletion_validator, dcp_deletion_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_DCP_EXPIRATION,
+                     dcp_expiration_validator, dcp_expiration_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_DCP_FLUSH,
+                     dcp_flush_validator, dcp_flush_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_DCP_GET_FAILOVER_LOG,
+                     dcp_get_failover_log_validator, dcp_get_failover_log_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_DCP_MUTATION,
+                     dcp_mutation_validator, dcp_mutation_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_DCP_SET_VBUCKET_STATE,
+                     dcp_set_vbucket_state_validator, dcp_set_vbucket_state_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_DCP_NOOP,
+                     dcp_noop_validator, dcp_noop_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_DCP_BUFFER_ACKNOWLEDGEMENT,
+                     dcp_buffer_acknowledgement_validator, dcp_buffer_acknowledgement_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_DCP_CONTROL,
+                     dcp_control_validator, dcp_control_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_DCP_STREAM_END,
+                     dcp_stream_end_validator, dcp_stream_end_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_DCP_STREAM_REQ,
+                     dcp_stream_req_validator, dcp_stream_req_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_ISASL_REFRESH,
+                     isasl_refresh_validator, isasl_refresh_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_SSL_CERTS_REFRESH,
+                     ssl_certs_refresh_validator, ssl_certs_refresh_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_VERBOSITY,
+                     verbosity_validator, verbosity_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_HELLO,
+                     hello_validator, process_hello_packet_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_VERSION,
+                     version_validator, version_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_QUIT, quit_validator, quit_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_QUITQ, quit_validator, quitq_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_SASL_LIST_MECHS,
+                     sasl_list_mech_validator, sasl_list_mech_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_NOOP, noop_validator, noop_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_FLUSH,
+                     flush_validator, flush_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_FLUSHQ,
+                     flush_validator, flush_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_STAT, stat_validator, stat_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_INCREMENT,
+                     arithmetic_validator, arithmetic_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_INCREMENTQ,
+                     arithmetic_validator, arithmetic_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_DECREMENT,
+                     arithmetic_validator, arithmetic_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_DECREMENTQ,
+                     arithmetic_validator, arithmetic_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_GET_CMD_TIMER,
+                     get_cmd_timer_validator, get_cmd_timer_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_SET_CTRL_TOKEN,
+                     set_ctrl_token_validator, set_ctrl_token_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_GET_CTRL_TOKEN,
+                     get_ctrl_token_validator, get_ctrl_token_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_IOCTL_GET,
+                     get_validator, ioctl_get_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_IOCTL_SET, NULL, ioctl_set_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_TOUCH,
+                     touch_validator, touch_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_GAT,
+                     touch_validator, touch_executor);
+    set_bin_executor(PROTOCOL_BINARY_CMD_GATQ,
+                     touch_validator, touch_executor);
+
+    /* The commands we run most often don't need the validators */
+    set_bin_key_executor(PROTOCOL_BINARY_CMD_GET, get_executor);
+    set_bin_key_executor(PROTOCOL_BINARY_CMD_GETQ, get_executor);
+    set_bin_key_executor(PROTOCOL_BINARY_CMD_GETK, get_executor);
+    set_bin_key_executor(PROTOCOL_BINARY_CMD_GETKQ, get_executor);
+    set_bin_key_executor(PROTOCOL_BINARY_CMD_DELETE, delete_executor);
+    set_bin_key_executor(PROTOCOL_BINARY_CMD_DELETEQ, delete_executor);
+
+    set_bin_reader(PROTOCOL_BINARY_CMD_SET, BIN_READ_STORE,
+                   PROTOCOL_BINARY_CMD_SET, false);
+    set_bin_reader(PROTOCOL_BINARY_CMD_SETQ, BIN_READ_STORE,
+                   PROTOCOL_BINARY_CMD_SET, true);
+    set_bin_reader(PROTOCOL_BINARY_CMD_ADD, BIN_READ_STORE,
+                   PROTOCOL_BINARY_CMD_ADD, false);
+    set_bin_reader(PROTOCOL_BINARY_CMD_ADDQ, BIN_READ_STORE,
+                   PROTOCOL_BINARY_CMD_ADD, true);
+    set_bin_reader(PROTOCOL_BINARY_CMD_REPLACE, BIN_READ_STORE,
+                   PROTOCOL_BINARY_CMD_REPLACE, false);
+    set_bin_reader(PROTOCOL_BINARY_CMD_REPLACEQ, BIN_READ_STORE,
+                   PROTOCOL_BINARY_CMD_REPLACE, true);
+    set_bin_reader(PROTOCOL_BINARY_CMD_APPEND, BIN_READ_CONCAT,
+                   PROTOCOL_BINARY_CMD_APPEND, false);
+    set_bin_reader(PROTOCOL_BINARY_CMD_APPENDQ, BIN_READ_CONCAT,
+                   PROTOCOL_BINARY_CMD_APPEND, true);
+    set_bin_reader(PROTOCOL_BINARY_CMD_PREPEND, BIN_READ_CONCAT,
+                   PROTOCOL_BINARY_CMD_PREPEND, false);
+    set_bin_reader(PROTOCOL_BINARY_CMD_PREPENDQ, BIN_READ_CONCAT,
+                   PROTOCOL_BINARY_CMD_PREPEND, true);
+    set_bin_reader(PROTOCOL_BINARY_CMD_SASL_AUTH, BIN_READ_SASL,
+                   PROTOCOL_BINARY_CMD_SASL_AUTH, false);
+    set_bin_reader(PROTOCOL_BINARY_CMD_SASL_STEP, BIN_READ_SASL,
+                   PROTOCOL_BINARY_CMD_SASL_STEP, false);
 }
 
 static void setup_not_supported_handlers(void) {
     if (settings.engine.v1->get_tap_iterator == NULL) {
-        executors[PROTOCOL_BINARY_CMD_TAP_CONNECT] = not_supported_executor;
+        bin_commands[PROTOCOL_BINARY_CMD_TAP_CONNECT].execute = not_supported_executor;
     }
 
     if (settings.engine.v1->tap_notify == NULL) {
-        executors[PROTOCOL_BINARY_CMD_TAP_MUTATION] = not_supported_executor;
-        executors[PROTOCOL_BINARY_CMD_TAP_CHECKPOINT_START] = not_supported_executor;
-        executors[PROTOCOL_BINARY_CMD_TAP_CHECKPOINT_END] = not_supported_executor;
-        executors[PROTOCOL_BINARY_CMD_TAP_DELETE] = not_supported_executor;
-        executors[PROTOCOL_BINARY_CMD_TAP_FLUSH] = not_supported_executor;
-        executors[PROTOCOL_BINARY_CMD_TAP_OPAQUE] = not_supported_executor;
-        executors[PROTOCOL_BINARY_CMD_TAP_VBUCKET_SET] = not_supported_executor;
+        bin_commands[PROTOCOL_BINARY_CMD_TAP_MUTATION].execute = not_supported_executor;
+        bin_commands[PROTOCOL_BINARY_CMD_TAP_CHECKPOINT_START].execute = not_supported_executor;
+        bin_commands[PROTOCOL_BINARY_CMD_TAP_CHECKPOINT_END].execute = not_supported_executor;
+        bin_commands[PROTOCOL_BINARY_CMD_TAP_DELETE].execute = not_supported_executor;
+        bin_commands[PROTOCOL_BINARY_CMD_TAP_FLUSH].execute = not_supported_executor;
+        bin_commands[PROTOCOL_BINARY_CMD_TAP_OPAQUE].execute = not_supported_executor;
+        bin_commands[PROTOCOL_BINARY_CMD_TAP_VBUCKET_SET].execute = not_supported_executor;
     }
 }
 
@@ -4774,21 +5980,21 @@ static void process_bin_packet(conn *c) {
     char *packet = (c->read.curr - (c->binary_header.request.bodylen +
                                 sizeof(c->binary_header)));
 
-    uint8_t opcode = c->binary_header.request.opcode;
-
-    bin_package_validate validator = validators[opcode];
-    bin_package_execute executor = executors[opcode];
+    const struct bin_command *cmd =
+        &bin_commands[c->binary_header.request.opcode];
 
-    if (validator != NULL && validator(packet) != 0) {
+    if (cmd->validate != NULL && cmd->validate(packet) != 0) {
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL, 0);
-    } else if (executor != NULL) {
-        executor(c, packet);
+    } else if (cmd->execute != NULL) {
+        cmd->execute(c, packet);
     } else {
         process_bin_unknown_packet(c);
     }
 }
 
 static void dispatch_bin_command(conn *c) {
+    const struct bin_command *cmd =
+        &bin_commands[c->binary_header.request.opcode];
     int protocol_error = 0;
 
     int extlen = c->binary_header.request.extlen;
@@ -4801,15 +6007,37 @@ static void dispatch_bin_command(conn *c) {
         return;
     }
 
-    if (invalid_datatype(c)) {
+    if (c->binary_header.request.datatype != PROTOCOL_BINARY_RAW_BYTES &&
+        invalid_datatype(c)) {
         write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL, 0);
         c->write_and_go = conn_closing;
         return;
     }
 
     if (c->start == 0) {
-        c->start = gethrtime();
+        c->start = request_start_time(c);
+        if (settings.slow_op_threshold > 0) {
+            if (c->slow_op.start != 0) {
+                /* Its response was held back to go out with this one's */
+                slow_op_done(c, c->start);
+            }
+            c->slow_op.start = c->start;
+            c->slow_op.engine = 0;
+            c->slow_op.response = c->start;
+            c->slow_op.keylen = keylen;
+            c->slow_op.cmd = (uint8_t)c->binary_header.request.opcode;
+        }
+        if (settings.trace_sample_rate > 0) {
+            if (c->span.sampled) {
+                /* Its response was held back to go out with this one's */
+                span_done(c);
+            }
+            span_begin(c, (uint8_t)c->binary_header.request.opcode);
+        }
+        c->trace.key_hash = 0;
+        c->trace.status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
     }
+    c->key_hash.key = NULL;
 
     MEMCACHED_PROCESS_COMMAND_START(c->sfd, c->read.curr, c->read.bytes);
 
@@ -4819,47 +6047,33 @@ static void dispatch_bin_command(conn *c) {
         return;
     }
 
-    if (executors[c->cmd] != NULL) {
-        c->noreply = false;
-        bin_read_chunk(c, bin_reading_packet, c->binary_header.request.bodylen);
-        return;
-    }
-
-    c->noreply = true;
+    c->cmd = cmd->cmd;
+    c->noreply = cmd->noreply;
 
-    switch (c->cmd) {
-    case PROTOCOL_BINARY_CMD_SETQ:
-        c->cmd = PROTOCOL_BINARY_CMD_SET;
-        break;
-    case PROTOCOL_BINARY_CMD_ADDQ:
-        c->cmd = PROTOCOL_BINARY_CMD_ADD;
-        break;
-    case PROTOCOL_BINARY_CMD_REPLACEQ:
-        c->cmd = PROTOCOL_BINARY_CMD_REPLACE;
-        break;
-    case PROTOCOL_BINARY_CMD_APPENDQ:
-        c->cmd = PROTOCOL_BINARY_CMD_APPEND;
-        break;
-    case PROTOCOL_BINARY_CMD_PREPENDQ:
-        c->cmd = PROTOCOL_BINARY_CMD_PREPEND;
+    switch (cmd->read) {
+    case BIN_READ_KEY:
+        /* What the validator would have checked */
+        if (extlen != 0 || keylen == 0 || bodylen != keylen ||
+            c->binary_header.request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINVAL, bodylen);
+            break;
+        }
+        /* FALLTHROUGH */
+    case BIN_READ_PACKET:
+        bin_read_chunk(c, bin_reading_packet, bodylen);
         break;
-    default:
-        c->noreply = false;
-    }
 
-    switch (c->cmd) {
-    case PROTOCOL_BINARY_CMD_SET: /* FALLTHROUGH */
-    case PROTOCOL_BINARY_CMD_ADD: /* FALLTHROUGH */
-    case PROTOCOL_BINARY_CMD_REPLACE:
-        if (extlen == 8 && keylen != 0 && bodylen >= (uint32_t)(keylen + 8)) {
-            bin_read_key(c, bin_reading_set_header, 8);
+    case BIN_READ_STORE:
+        /* The optional third word is the cost hint */
+        if ((extlen == 8 || extlen == 12) && keylen != 0 &&
+            bodylen >= (uint32_t)(keylen + extlen)) {
+            bin_read_key(c, bin_reading_set_header, extlen);
         } else {
             protocol_error = 1;
         }
-
         break;
-    case PROTOCOL_BINARY_CMD_APPEND:
-    case PROTOCOL_BINARY_CMD_PREPEND:
+
+    case BIN_READ_CONCAT:
         if (keylen > 0 && extlen == 0) {
             bin_read_key(c, bin_reading_set_header, 0);
         } else {
@@ -4867,8 +6081,7 @@ static void dispatch_bin_command(conn *c) {
         }
         break;
 
-    case PROTOCOL_BINARY_CMD_SASL_AUTH:
-    case PROTOCOL_BINARY_CMD_SASL_STEP:
+    case BIN_READ_SASL:
         if (extlen == 0 && keylen != 0) {
             bin_read_key(c, bin_reading_sasl_auth, 0);
         } else {
@@ -4876,13 +6089,14 @@ static void dispatch_bin_command(conn *c) {
         }
         break;
 
-    default:
+    case BIN_READ_UNKNOWN:
         if (settings.engine.v1->unknown_command == NULL) {
             write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND,
                              bodylen);
         } else {
-            bin_read_chunk(c, bin_reading_packet, c->binary_header.request.bodylen);
+            bin_read_chunk(c, bin_reading_packet, bodylen);
         }
+        break;
     }
 
     if (protocol_error) {
@@ -4890,6 +6104,238 @@ static void dispatch_bin_command(conn *c) {
     }
 }
 
+/**
+ * Prepare to read the value of an item into the piece(s) of memory the
+ * engine gave us for it.
+ *
+ * @param c the connection to read the value for
+ * @param info the item info for the item
+ * @return false if we failed to allocate memory
+ */
+static bool conn_set_read_value(conn *c, const item_info *info) {
+    int nrest = info->nvalue - 1;
+    if (nrest > c->riovsize) {
+        struct iovec *ptr = realloc(c->riov, nrest * sizeof(struct iovec));
+        if (ptr == NULL) {
+            return false;
+        }
+        c->riov = ptr;
+        c->riovsize = nrest;
+    }
+    if (nrest > 0) {
+        memcpy(c->riov, info->value + 1, nrest * sizeof(struct iovec));
+    }
+    c->riovused = nrest;
+    c->riovcurr = 0;
+    c->ritem = info->value[0].iov_base;
+    c->rlbytes = (uint32_t)info->value[0].iov_len;
+    return true;
+}
+
+/* The most quiet mutations we store in one call to store_multi */
+#define STORE_MULTI_MAX 64
+
+/**
+ * Store the current SETQ/ADDQ/REPLACEQ together with the ones following
+ * it in the input buffer with a single call to store_multi. As with the
+ * gets we only batch packets which are all there already. The commands
+ * are quiet so we only have to write responses for the failures.
+ *
+ * @return false if the caller should process the current packet with
+ *         process_bin_update (nothing is consumed in that case)
+ */
+static bool process_bin_update_multi(conn *c) {
+    engine_store_t reqs[STORE_MULTI_MAX];
+    uint64_t cas[STORE_MULTI_MAX];
+    ENGINE_ERROR_CODE status[STORE_MULTI_MAX];
+    uint8_t opcodes[STORE_MULTI_MAX];
+    uint32_t opaques[STORE_MULTI_MAX];
+    uint32_t lens[STORE_MULTI_MAX];
+    protocol_binary_request_set *req = binary_get_request(c);
+    char *curr = c->read.curr;
+    uint32_t avail = c->read.bytes;
+    int nreqs = 0;
+    int ndone;
+    int ii;
+    /* For the slab stats macros; we don't get to see the items, so their
+     * counts all go to class 0 (we only report the totals anyway) */
+    item_info_holder info;
+
+    if (settings.engine.v1->store_multi == NULL) {
+        return false;
+    }
+    memset(&info, 0, sizeof(info));
+
+    do {
+        protocol_binary_request_header hdr;
+        uint32_t vlen;
+        engine_store_t *r = &reqs[nreqs];
+
+        if (nreqs == 0) {
+            /* We've read the key and extras of the current one already */
+            hdr = c->binary_header;
+            vlen = hdr.request.bodylen - hdr.request.keylen - 8;
+            lens[nreqs] = vlen;
+        } else {
+            hdr = req->message.header;
+            hdr.request.keylen = ntohs(hdr.request.keylen);
+            hdr.request.vbucket = ntohs(hdr.request.vbucket);
+            hdr.request.bodylen = ntohl(hdr.request.bodylen);
+            hdr.request.cas = ntohll(hdr.request.cas);
+            if (hdr.request.magic != PROTOCOL_BINARY_REQ ||
+                (hdr.request.opcode != PROTOCOL_BINARY_CMD_SETQ &&
+                 hdr.request.opcode != PROTOCOL_BINARY_CMD_ADDQ &&
+                 hdr.request.opcode != PROTOCOL_BINARY_CMD_REPLACEQ) ||
+                hdr.request.extlen != 8 || hdr.request.keylen == 0 ||
+                hdr.request.keylen > KEY_MAX_LENGTH ||
+                hdr.request.bodylen < (uint32_t)hdr.request.keylen + 8) {
+                break;
+            }
+            vlen = hdr.request.bodylen - hdr.request.keylen - 8;
+            lens[nreqs] = sizeof(hdr) + hdr.request.bodylen;
+        }
+        if (avail < lens[nreqs]) {
+            break;
+        }
+
+        r->key = (char*)req + sizeof(req->bytes);
+        r->nkey = hdr.request.keylen;
+        r->vbucket = hdr.request.vbucket;
+        r->value = (char*)r->key + r->nkey;
+        r->nvalue = vlen;
+        r->flags = req->message.body.flags;
+        r->exptime = ntohl(req->message.body.expiration);
+        r->datatype = hdr.request.datatype;
+        r->datatype = detect_datatype(c, r->datatype, r->value, vlen);
+        r->cas = hdr.request.cas;
+        opcodes[nreqs] = hdr.request.opcode;
+        opaques[nreqs] = hdr.request.opaque;
+        if (hdr.request.opcode == PROTOCOL_BINARY_CMD_ADDQ) {
+            r->operation = OPERATION_ADD;
+        } else if (r->cas != 0) {
+            r->operation = OPERATION_CAS;
+        } else if (hdr.request.opcode == PROTOCOL_BINARY_CMD_SETQ) {
+            r->operation = OPERATION_SET;
+        } else {
+            r->operation = OPERATION_REPLACE;
+        }
+
+        curr += lens[nreqs];
+        avail -= lens[nreqs];
+        ++nreqs;
+        req = (void*)curr;
+    } while (nreqs < STORE_MULTI_MAX &&
+             avail >= sizeof(protocol_binary_request_header) + 8);
+
+    if (nreqs < 2 ||
+        settings.engine.v1->store_multi(settings.engine.v0, c, reqs, nreqs,
+                                        cas, status) != ENGINE_SUCCESS) {
+        return false;
+    }
+    for (ii = 0; ii < nreqs; ++ii) {
+        hot_cache_invalidate(reqs[ii].key, reqs[ii].nkey);
+    }
+
+    /* The engine stops at the first item for a vbucket it doesn't own,
+     * and we let the regular path deal with that one and the rest */
+    for (ndone = 0; ndone < nreqs; ++ndone) {
+        if (status[ndone] == ENGINE_NOT_MY_VBUCKET ||
+            status[ndone] == ENGINE_DISCONNECT) {
+            break;
+        }
+    }
+    if (ndone == 0) {
+        return false;
+    }
+
+    c->write.bytes = 0;
+    c->write.curr = c->write.buf;
+    for (ii = 0; ii < ndone; ++ii) {
+        protocol_binary_response_status eno;
+        protocol_binary_response_header *rsp;
+        const char *errtext;
+
+        if (reqs[ii].operation == OPERATION_CAS) {
+            if (status[ii] == ENGINE_SUCCESS) {
+                SLAB_INCR(c, cas_hits, reqs[ii].key, reqs[ii].nkey);
+            } else if (status[ii] == ENGINE_KEY_EEXISTS) {
+                SLAB_INCR(c, cas_badval, reqs[ii].key, reqs[ii].nkey);
+            } else if (status[ii] == ENGINE_KEY_ENOENT) {
+                STATS_NOKEY(c, cas_misses);
+            }
+        } else {
+            SLAB_INCR(c, cmd_set, reqs[ii].key, reqs[ii].nkey);
+        }
+        if (settings.detail_enabled) {
+            stats_prefix_record_set(c, reqs[ii].key, reqs[ii].nkey);
+        }
+
+        /* Same as complete_update_bin */
+        switch (status[ii]) {
+        case ENGINE_SUCCESS:
+            continue;
+        case ENGINE_KEY_EEXISTS:
+            eno = PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
+            break;
+        case ENGINE_KEY_ENOENT:
+            eno = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+            break;
+        case ENGINE_ENOMEM:
+            eno = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+            break;
+        case ENGINE_TMPFAIL:
+            eno = PROTOCOL_BINARY_RESPONSE_ETMPFAIL;
+            break;
+        case ENGINE_ENOTSUP:
+            eno = PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED;
+            break;
+        case ENGINE_E2BIG:
+            eno = PROTOCOL_BINARY_RESPONSE_E2BIG;
+            break;
+        default:
+            if (reqs[ii].operation == OPERATION_ADD) {
+                eno = PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
+            } else if (reqs[ii].operation == OPERATION_REPLACE) {
+                eno = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+            } else {
+                eno = PROTOCOL_BINARY_RESPONSE_NOT_STORED;
+            }
+        }
+
+        if (c->write.bytes + sizeof(*rsp) > c->write.size) {
+            /* Can't happen with the default buffer size */
+            conn_set_state(c, conn_closing);
+            return true;
+        }
+        errtext = memcached_protocol_errcode_2_text(eno);
+        rsp = (void*)(c->write.buf + c->write.bytes);
+        memset(rsp, 0, sizeof(*rsp));
+        rsp->response.magic = (uint8_t)PROTOCOL_BINARY_RES;
+        rsp->response.opcode = opcodes[ii];
+        rsp->response.status = htons(eno);
+        rsp->response.bodylen = htonl(errtext ? (uint32_t)strlen(errtext) : 0);
+        rsp->response.opaque = opaques[ii];
+        c->write.bytes += sizeof(*rsp);
+        add_iov(c, rsp, sizeof(*rsp));
+        if (errtext) {
+            add_iov(c, errtext, strlen(errtext));
+        }
+    }
+
+    for (ii = 0; ii < ndone; ++ii) {
+        c->read.curr += lens[ii];
+        c->read.bytes -= lens[ii];
+    }
+
+    if (c->write.bytes > 0) {
+        conn_set_state(c, conn_mwrite);
+        c->write_and_go = conn_new_cmd;
+    } else {
+        conn_set_state(c, conn_new_cmd);
+    }
+    return true;
+}
+
 static void process_bin_update(conn *c) {
     char *key;
     uint16_t nkey;
@@ -4902,7 +6348,7 @@ static void process_bin_update(conn *c) {
 
     cb_assert(c != NULL);
     memset(&info, 0, sizeof(info));
-    info.info.nvalue = 1;
+    info.info.nvalue = IOV_MAX;
     key = binary_get_key(c);
     nkey = c->binary_header.request.keylen;
 
@@ -4912,6 +6358,12 @@ static void process_bin_update(conn *c) {
 
     vlen = c->binary_header.request.bodylen - (nkey + c->binary_header.request.extlen);
 
+    if (c->noreply && c->aiostat == ENGINE_SUCCESS &&
+        c->binary_header.request.extlen == 8 &&
+        process_bin_update_multi(c)) {
+        return;
+    }
+
     if (settings.verbose > 1) {
         size_t nw;
         char buffer[1024];
@@ -4937,7 +6389,7 @@ static void process_bin_update(conn *c) {
     }
 
     if (settings.detail_enabled) {
-        stats_prefix_record_set(key, nkey);
+        stats_prefix_record_set(c, key, nkey);
     }
 
     ret = c->aiostat;
@@ -4959,10 +6411,20 @@ static void process_bin_update(conn *c) {
             return;
         }
     }
+        if (ret == ENGINE_SUCCESS && !conn_set_read_value(c, &info.info)) {
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            ret = ENGINE_ENOMEM;
+        }
 
     switch (ret) {
     case ENGINE_SUCCESS:
         item_set_cas(c, it, c->binary_header.request.cas);
+        if (c->binary_header.request.extlen == 12 &&
+            settings.engine.v1->item_set_cost != NULL) {
+            protocol_binary_request_set_cost *creq = (void*)req;
+            settings.engine.v1->item_set_cost(settings.engine.v0, c, it,
+                                              ntohl(creq->message.body.cost));
+        }
 
         switch (c->cmd) {
         case PROTOCOL_BINARY_CMD_ADD:
@@ -4987,8 +6449,6 @@ static void process_bin_update(conn *c) {
         }
 
         c->item = it;
-        c->ritem = info.info.value[0].iov_base;
-        c->rlbytes = vlen;
         conn_set_state(c, conn_nread);
         c->substate = bin_read_set_value;
         break;
@@ -5018,7 +6478,7 @@ static void process_bin_append_prepend(conn *c) {
     item *it;
     item_info_holder info;
     memset(&info, 0, sizeof(info));
-    info.info.nvalue = 1;
+    info.info.nvalue = IOV_MAX;
 
     cb_assert(c != NULL);
 
@@ -5032,7 +6492,7 @@ static void process_bin_append_prepend(conn *c) {
     }
 
     if (settings.detail_enabled) {
-        stats_prefix_record_set(key, nkey);
+        stats_prefix_record_set(c, key, nkey);
     }
 
     ret = c->aiostat;
@@ -5052,6 +6512,10 @@ static void process_bin_append_prepend(conn *c) {
             return;
         }
     }
+        if (ret == ENGINE_SUCCESS && !conn_set_read_value(c, &info.info)) {
+            settings.engine.v1->release(settings.engine.v0, c, it);
+            ret = ENGINE_ENOMEM;
+        }
 
     switch (ret) {
     case ENGINE_SUCCESS:
@@ -5069,8 +6533,6 @@ static void process_bin_append_prepend(conn *c) {
         }
 
         c->item = it;
-        c->ritem = info.info.value[0].iov_base;
-        c->rlbytes = vlen;
         conn_set_state(c, conn_nread);
         c->substate = bin_read_set_value;
         break;
@@ -5119,10 +6581,11 @@ static void process_bin_delete(conn *c) {
 
     if (ret == ENGINE_SUCCESS) {
         if (settings.detail_enabled) {
-            stats_prefix_record_delete(key, nkey);
+            stats_prefix_record_delete(c, key, nkey);
         }
         ret = settings.engine.v1->remove(settings.engine.v0, c, key, nkey,
                                          &cas, c->binary_header.request.vbucket);
+        hot_cache_invalidate(key, nkey);
     }
 
     /* For some reason the SLAB_INCR tries to access this... */
@@ -5153,10 +6616,44 @@ static void process_bin_delete(conn *c) {
     }
 }
 
+/*
+ * Hashes the key of the request we've just read the key (or all) of, for
+ * its trace record
+ */
+static void trace_key(conn *c) {
+    uint16_t keylen = c->binary_header.request.keylen;
+    const char *key;
+
+    switch (c->substate) {
+    case bin_reading_packet:
+        key = c->read.curr - c->binary_header.request.bodylen +
+              c->binary_header.request.extlen;
+        break;
+    case bin_reading_set_header:
+    case bin_reading_sasl_auth:
+        key = binary_get_key(c);
+        break;
+    default:
+        /* We hashed it when we read it */
+        return;
+    }
+
+    c->trace.key_hash = keylen > 0 ? conn_key_hash(c, key, keylen) : 0;
+}
+
 static void complete_nread(conn *c) {
     cb_assert(c != NULL);
     cb_assert(c->cmd >= 0);
 
+    if (c->slow_op.start != 0 && c->slow_op.engine == 0) {
+        c->slow_op.engine = gethrtime();
+    }
+
+    if (settings.request_trace || c->span.sampled) {
+        trace_key(c);
+    }
+    span_mark(c, SPAN_ENGINE_ENTER);
+
     switch(c->substate) {
     case bin_reading_set_header:
         if (c->cmd == PROTOCOL_BINARY_CMD_APPEND ||
@@ -5196,6 +6693,16 @@ static void complete_nread(conn *c) {
                 "Not handling substate %d\n", c->substate);
         abort();
     }
+
+    if (c->span.sampled) {
+        if (c->ewouldblock) {
+            span_mark(c, SPAN_PARK);
+        } else {
+            /* The last time we ran it, if it blocked before */
+            c->span.points[SPAN_ENGINE_EXIT] = SPAN_MISSING;
+            span_mark(c, SPAN_ENGINE_EXIT);
+        }
+    }
 }
 
 static void reset_cmd_handler(conn *c) {
@@ -5203,9 +6710,18 @@ static void reset_cmd_handler(conn *c) {
     c->cmd = -1;
     c->substate = bin_no_state;
     if(c->item != NULL) {
-        settings.engine.v1->release(settings.engine.v0, c, c->item);
+        if (!zerocopy_hold(c, ZEROCOPY_ITEM, c->item)) {
+            settings.engine.v1->release(settings.engine.v0, c, c->item);
+        }
         c->item = NULL;
     }
+    if (c->hot_item != NULL) {
+        if (!zerocopy_hold(c, ZEROCOPY_HOT_ITEM, c->hot_item)) {
+            hot_cache_release(c->hot_item);
+        }
+        c->hot_item = NULL;
+    }
+    arena_reset(c);
 
     if (c->read.bytes == 0) {
         /* Make the whole read buffer available. */
@@ -5220,12 +6736,16 @@ static void reset_cmd_handler(conn *c) {
     }
 }
 
-/* set up a connection to write a buffer then free it, used for stats */
-static void write_and_free(conn *c, char *buf, size_t bytes) {
+/*
+ * set up a connection to write the dynamic buffer, used for stats. It
+ * lives in the arena, which is reset once we're done with the response.
+ */
+static void write_dynamic_buffer(conn *c) {
+    char *buf = c->dynamic_buffer.buffer;
     if (buf) {
-        c->write_and_free = buf;
+        c->dynamic_buffer.buffer = NULL;
         c->write.curr = buf;
-        c->write.bytes = (uint32_t)bytes;
+        c->write.bytes = (uint32_t)c->dynamic_buffer.offset;
         conn_set_state(c, conn_write);
         c->write_and_go = conn_new_cmd;
     } else {
@@ -5268,6 +6788,10 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
     int i;
     struct tap_stats ts;
     rel_time_t now = mc_time_get_current_time();
+    uint64_t req_cost;
+    uint64_t reqs_per_event;
+    uint64_t executor_queued, executor_done, executor_rejected;
+    uint64_t ssl_session_hits, ssl_session_misses;
 
     struct thread_stats thread_stats;
     threadlocal_stats_clear(&thread_stats);
@@ -5278,8 +6802,7 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
                                             aggregate_callback,
                                             &thread_stats);
     } else {
-        threadlocal_stats_aggregate(get_independent_stats(c),
-                                    &thread_stats);
+        independent_stats_aggregate(get_independent_stats(c), &thread_stats);
     }
 
     slab_stats_aggregate(&thread_stats, &slab_stats);
@@ -5319,6 +6842,7 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
     }
     APPEND_STAT("total_connections", "%u", stats.total_conns);
     APPEND_STAT("connection_structures", "%u", stats.conn_structs);
+    APPEND_STAT("hibernated_connections", "%u", stats.hibernated_conns);
     APPEND_STAT("cmd_get", "%"PRIu64, thread_stats.cmd_get);
     APPEND_STAT("cmd_set", "%"PRIu64, slab_stats.cmd_set);
     APPEND_STAT("cmd_flush", "%"PRIu64, thread_stats.cmd_flush);
@@ -5342,6 +6866,16 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
     APPEND_STAT("rejected_conns", "%" PRIu64, (uint64_t)stats.rejected_conns);
     APPEND_STAT("threads", "%d", settings.num_threads);
     APPEND_STAT("conn_yields", "%" PRIu64, (uint64_t)thread_stats.conn_yields);
+    threads_event_budget(&req_cost, &reqs_per_event);
+    APPEND_STAT("event_req_cost_ns", "%" PRIu64, req_cost);
+    APPEND_STAT("event_reqs_per_event", "%" PRIu64, reqs_per_event);
+    executor_get_stats(&executor_queued, &executor_done, &executor_rejected);
+    APPEND_STAT("executor_queued", "%" PRIu64, executor_queued);
+    APPEND_STAT("executor_tasks", "%" PRIu64, executor_done);
+    APPEND_STAT("executor_rejected", "%" PRIu64, executor_rejected);
+    ssl_context_get_stats(&ssl_session_hits, &ssl_session_misses);
+    APPEND_STAT("ssl_session_hits", "%" PRIu64, ssl_session_hits);
+    APPEND_STAT("ssl_session_misses", "%" PRIu64, ssl_session_misses);
     APPEND_STAT("rbufs_allocated", "%" PRIu64, (uint64_t)thread_stats.rbufs_allocated);
     APPEND_STAT("rbufs_loaned", "%" PRIu64, (uint64_t)thread_stats.rbufs_loaned);
     APPEND_STAT("rbufs_existing", "%" PRIu64, (uint64_t)thread_stats.rbufs_existing);
@@ -5349,6 +6883,15 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
     APPEND_STAT("wbufs_loaned", "%" PRIu64, (uint64_t)thread_stats.wbufs_loaned);
     APPEND_STAT("iovused_high_watermark", "%" PRIu64, (uint64_t)thread_stats.iovused_high_watermark);
     APPEND_STAT("msgused_high_watermark", "%" PRIu64, (uint64_t)thread_stats.msgused_high_watermark);
+    APPEND_STAT("hot_cache_hits", "%" PRIu64, (uint64_t)thread_stats.hot_cache_hits);
+    APPEND_STAT("hot_cache_admits", "%" PRIu64, (uint64_t)thread_stats.hot_cache_admits);
+    APPEND_STAT("compressed_responses", "%" PRIu64, (uint64_t)thread_stats.compressed_responses);
+    APPEND_STAT("inflated_responses", "%" PRIu64, (uint64_t)thread_stats.inflated_responses);
+    APPEND_STAT("hot_cache_inflated_hits", "%" PRIu64, (uint64_t)thread_stats.hot_cache_inflated_hits);
+    APPEND_STAT("zerocopy_sends", "%" PRIu64, (uint64_t)thread_stats.zerocopy_sends);
+    APPEND_STAT("responses_coalesced", "%" PRIu64, (uint64_t)thread_stats.responses_coalesced);
+    APPEND_STAT("conn_backpressure", "%" PRIu64, (uint64_t)thread_stats.conn_backpressure);
+    APPEND_STAT("slow_ops", "%" PRIu64, (uint64_t)thread_stats.slow_ops);
     STATS_UNLOCK();
 
     /*
@@ -5442,6 +6985,31 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
         APPEND_STAT(interface, "%s", settings.interfaces[ii].tcp_nodelay ?
                     "true" : "false");
 
+        snprintf(interface + offset, sizeof(interface) - offset, "-priority");
+        APPEND_STAT(interface, "%s",
+                    settings.interfaces[ii].priority == CONN_PRIORITY_LOW ?
+                    "low" : "high");
+
+        snprintf(interface + offset, sizeof(interface) - offset,
+                 "-defer_accept");
+        APPEND_STAT(interface, "%d", settings.interfaces[ii].defer_accept);
+        snprintf(interface + offset, sizeof(interface) - offset, "-fastopen");
+        APPEND_STAT(interface, "%d", settings.interfaces[ii].fastopen);
+        snprintf(interface + offset, sizeof(interface) - offset, "-cork");
+        APPEND_STAT(interface, "%s", settings.interfaces[ii].cork ?
+                    "true" : "false");
+
+        snprintf(interface + offset, sizeof(interface) - offset,
+                 "-thread_group");
+        APPEND_STAT(interface, "%s", settings.interfaces[ii].group == -1 ?
+                    "default" :
+                    settings.thread_groups[settings.interfaces[ii].group].name);
+
+        if (settings.interfaces[ii].path) {
+            snprintf(interface + offset, sizeof(interface) - offset, "-path");
+            APPEND_STAT(interface, "%s", settings.interfaces[ii].path);
+        }
+
         if (settings.interfaces[ii].ssl.key) {
             snprintf(interface + offset, sizeof(interface) - offset,
                      "-ssl-pkey");
@@ -5458,6 +7026,7 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
 
     APPEND_STAT("verbosity", "%d", settings.verbose);
     APPEND_STAT("num_threads", "%d", settings.num_threads);
+    APPEND_STAT("active_threads", "%d", threads_active());
     APPEND_STAT("stat_key_prefix", "%c", settings.prefix_delimiter);
     APPEND_STAT("detail_enabled", "%s",
                 settings.detail_enabled ? "yes" : "no");
@@ -5465,6 +7034,54 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
                 settings.allow_detailed ? "yes" : "no");
     APPEND_STAT("reqs_per_event", "%d", settings.reqs_per_event);
     APPEND_STAT("reqs_per_tap_event", "%d", settings.reqs_per_tap_event);
+    APPEND_STAT("event_time_slice", "%d", settings.event_time_slice);
+    APPEND_STAT("executor_threads", "%d", settings.executor_threads);
+    APPEND_STAT("ktls", "%s", settings.ktls ? "yes" : "no");
+    APPEND_STAT("ssl_session_cache", "%d", settings.ssl_session_cache);
+    APPEND_STAT("ssl_session_timeout", "%d", settings.ssl_session_timeout);
+    APPEND_STAT("ssl_ticket_rotation", "%d", settings.ssl_ticket_rotation);
+    APPEND_STAT("ssl_thread_contexts", "%s",
+                settings.ssl_thread_contexts ? "yes" : "no");
+    APPEND_STAT("ssl_async", "%s", settings.ssl_async ? "yes" : "no");
+    APPEND_STAT("buffer_pool_low", "%d", settings.buffer_pool_low);
+    APPEND_STAT("buffer_pool_high", "%d", settings.buffer_pool_high);
+    APPEND_STAT("idle_hibernate", "%d", settings.idle_hibernate);
+    APPEND_STAT("max_pending_output", "%d", settings.max_pending_output);
+    APPEND_STAT("replication_threads", "%d", settings.replication_threads);
+    APPEND_STAT("replication_nice", "%d", settings.replication_nice);
+    for (ii = 0; ii < settings.num_thread_groups; ++ii) {
+        char group[1024];
+        snprintf(group, sizeof(group), "thread_group-%s",
+                 settings.thread_groups[ii].name);
+        APPEND_STAT(group, "%d", settings.thread_groups[ii].threads);
+        snprintf(group, sizeof(group), "thread_group-%s-busy_poll",
+                 settings.thread_groups[ii].name);
+        APPEND_STAT(group, "%d", settings.thread_groups[ii].busy_poll);
+    }
+    APPEND_STAT("port_timings", "%s", settings.port_timings ? "yes" : "no");
+    APPEND_STAT("slow_op_threshold", "%d", settings.slow_op_threshold);
+    APPEND_STAT("stats_aggregate_interval", "%d",
+                settings.stats_aggregate_interval);
+    APPEND_STAT("lock_stats_sample", "%d", settings.lock_stats_sample);
+    APPEND_STAT("hash_algorithm", "%s", hash_name());
+    APPEND_STAT("request_trace", "%s", settings.request_trace ? "yes" : "no");
+    APPEND_STAT("trace_sample_rate", "%d", settings.trace_sample_rate);
+    APPEND_STAT("trace_ring_size", "%d", settings.trace_ring_size);
+    APPEND_STAT("jemalloc_arenas", "%s",
+                settings.jemalloc_arenas ? "yes" : "no");
+    APPEND_STAT("jemalloc_tcache", "%s",
+                settings.jemalloc_tcache ? "yes" : "no");
+    if (settings.hot_restart != NULL) {
+        APPEND_STAT("hot_restart", "%s", settings.hot_restart);
+    }
+    APPEND_STAT("hot_restart_drain", "%d", settings.hot_restart_drain);
+    APPEND_STAT("hot_cache", "%d", settings.hot_cache);
+    APPEND_STAT("hot_cache_ttl", "%d", settings.hot_cache_ttl);
+    APPEND_STAT("compress_responses", "%d", settings.compress_responses);
+    APPEND_STAT("json_detect", "%s", settings.json_detect ? "yes" : "no");
+    APPEND_STAT("reuseport", "%s", settings.reuseport ? "yes" : "no");
+    APPEND_STAT("zerocopy_threshold", "%d", settings.zerocopy_threshold);
+    APPEND_STAT("coalesce_responses", "%d", settings.coalesce_responses);
     APPEND_STAT("auth_enabled_sasl", "%s", "yes");
 
     APPEND_STAT("auth_sasl_engine", "%s", "cbsasl");
@@ -5584,19 +7201,23 @@ static void drain_bio_send_pipe(conn *c) {
     int n;
     bool stop = false;
 
+    if (c->ssl->socket_bio) {
+        return;
+    }
+
     do {
-        if (c->ssl.out.current < c->ssl.out.total) {
+        if (c->ssl->out.current < c->ssl->out.total) {
 #ifdef WIN32
             DWORD error;
 #else
             int error;
 #endif
-            n = send(c->sfd, c->ssl.out.buffer + c->ssl.out.current,
-                     c->ssl.out.total - c->ssl.out.current, 0);
+            n = send(c->sfd, c->ssl->out.buffer + c->ssl->out.current,
+                     c->ssl->out.total - c->ssl->out.current, 0);
             if (n > 0) {
-                c->ssl.out.current += n;
-                if (c->ssl.out.current == c->ssl.out.total) {
-                    c->ssl.out.current = c->ssl.out.total = 0;
+                c->ssl->out.current += n;
+                if (c->ssl->out.current == c->ssl->out.total) {
+                    c->ssl->out.current = c->ssl->out.total = 0;
                 }
             } else {
                 if (n == -1) {
@@ -5606,17 +7227,17 @@ static void drain_bio_send_pipe(conn *c) {
                     error = errno;
 #endif
                     if (!is_blocking(error)) {
-                        c->ssl.error = true;
+                        c->ssl->error = true;
                     }
                 }
                 return ;
             }
         }
 
-        if (c->ssl.out.total == 0) {
-            n = BIO_read(c->ssl.network, c->ssl.out.buffer, c->ssl.out.buffsz);
+        if (c->ssl->out.total == 0) {
+            n = BIO_read(c->ssl->network, c->ssl->out.buffer, c->ssl->out.buffsz);
             if (n > 0) {
-                c->ssl.out.total = n;
+                c->ssl->out.total = n;
             } else {
                 stop = true;
             }
@@ -5628,15 +7249,19 @@ static void drain_bio_recv_pipe(conn *c) {
     int n;
     bool stop = false;
 
+    if (c->ssl->socket_bio) {
+        return;
+    }
+
     stop = false;
     do {
-        if (c->ssl.in.current < c->ssl.in.total) {
-            n = BIO_write(c->ssl.network, c->ssl.in.buffer + c->ssl.in.current,
-                          c->ssl.in.total - c->ssl.in.current);
+        if (c->ssl->in.current < c->ssl->in.total) {
+            n = BIO_write(c->ssl->network, c->ssl->in.buffer + c->ssl->in.current,
+                          c->ssl->in.total - c->ssl->in.current);
             if (n > 0) {
-                c->ssl.in.current += n;
-                if (c->ssl.in.current == c->ssl.in.total) {
-                    c->ssl.in.current = c->ssl.in.total = 0;
+                c->ssl->in.current += n;
+                if (c->ssl->in.current == c->ssl->in.total) {
+                    c->ssl->in.current = c->ssl->in.total = 0;
                 }
             } else {
                 /* Our input BIO is full, no need to grab more data from
@@ -5646,20 +7271,20 @@ static void drain_bio_recv_pipe(conn *c) {
             }
         }
 
-        if (c->ssl.in.total < c->ssl.in.buffsz) {
+        if (c->ssl->in.total < c->ssl->in.buffsz) {
 #ifdef WIN32
             DWORD error;
 #else
             int error;
 #endif
-            n = recv(c->sfd, c->ssl.in.buffer + c->ssl.in.total,
-                     c->ssl.in.buffsz - c->ssl.in.total, 0);
+            n = recv(c->sfd, c->ssl->in.buffer + c->ssl->in.total,
+                     c->ssl->in.buffsz - c->ssl->in.total, 0);
             if (n > 0) {
-                c->ssl.in.total += n;
+                c->ssl->in.total += n;
             } else {
                 stop = true;
                 if (n == 0) {
-                    c->ssl.error = true; /* read end shutdown */
+                    c->ssl->error = true; /* read end shutdown */
                 } else {
 #ifdef WIN32
                     error = WSAGetLastError();
@@ -5667,7 +7292,7 @@ static void drain_bio_recv_pipe(conn *c) {
                     error = errno;
 #endif
                     if (!is_blocking(error)) {
-                        c->ssl.error = true;
+                        c->ssl->error = true;
                     }
                 }
             }
@@ -5675,22 +7300,89 @@ static void drain_bio_recv_pipe(conn *c) {
     } while (!stop);
 }
 
+/*
+ * See if OpenSSL handed the keys of the session to the kernel once the
+ * handshake is done, so that we may use the socket as if it was a plain
+ * one for the directions it did
+ */
+static void check_ktls(conn *c) {
+#ifdef HAVE_KTLS
+    if (c->ssl->socket_bio) {
+        c->ssl->ktls_send = BIO_get_ktls_send(SSL_get_wbio(c->ssl->client)) == 1;
+        c->ssl->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(c->ssl->client)) == 1;
+        /* We must not go around something OpenSSL has read ahead */
+        if (c->ssl->ktls_recv && SSL_pending(c->ssl->client) > 0) {
+            c->ssl->ktls_recv = false;
+        }
+        if (settings.verbose > 1) {
+            settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                            "%d: kernel TLS send=%d recv=%d\n",
+                                            c->sfd, c->ssl->ktls_send,
+                                            c->ssl->ktls_recv);
+        }
+    }
+#endif
+}
+
+#ifdef SSL_MODE_ASYNC
+static void ssl_async_ready(evutil_socket_t fd, short which, void *arg) {
+    conn *c = arg;
+
+    c->ssl->async_waiting = false;
+    event_handler(c->sfd, EV_READ | EV_WRITE, c);
+}
+
+/*
+ * The crypto engine took over the handshake, read or write of the
+ * connection (with ssl_async), so we run it again once the engine says
+ * it's done. If the engine doesn't give us a single fd to wait for, we
+ * just try again with the next event of the socket.
+ */
+static void ssl_wait_async(conn *c) {
+    OSSL_ASYNC_FD fd;
+    size_t numfds = 0;
+
+    if (!c->ssl->async_waiting &&
+        SSL_get_all_async_fds(c->ssl->client, NULL, &numfds) == 1 &&
+        numfds == 1 &&
+        SSL_get_all_async_fds(c->ssl->client, &fd, &numfds) == 1 &&
+        event_assign(&c->ssl->async_event, c->event.ev_base, fd, EV_READ,
+                     ssl_async_ready, c) == 0 &&
+        event_add(&c->ssl->async_event, NULL) == 0) {
+        c->ssl->async_waiting = true;
+    }
+    set_ewouldblock();
+}
+#endif
+
 static int do_ssl_pre_connection(conn *c) {
-    int r = SSL_accept(c->ssl.client);
+    int r = SSL_accept(c->ssl->client);
     if (r == 1) {
         drain_bio_send_pipe(c);
-        c->ssl.connected = true;
+        c->ssl->connected = true;
+        check_ktls(c);
     } else {
-        if (SSL_get_error(c->ssl.client, r) == SSL_ERROR_WANT_READ) {
+        int error = SSL_get_error(c->ssl->client, r);
+        /* With the socket BIO the handshake may wait for a full socket
+         * buffer too (it's small enough that we just try again on the
+         * next read event) */
+        if (error == SSL_ERROR_WANT_READ ||
+            (c->ssl->socket_bio && error == SSL_ERROR_WANT_WRITE)) {
             drain_bio_send_pipe(c);
             set_ewouldblock();
             return -1;
+#ifdef SSL_MODE_ASYNC
+        } else if (error == SSL_ERROR_WANT_ASYNC) {
+            drain_bio_send_pipe(c);
+            ssl_wait_async(c);
+            return -1;
+#endif
         } else {
             char *errmsg = malloc(8*1024);
             if (errmsg) {
                 int offset = sprintf(errmsg,
                                      "SSL_accept() returned %d with error %d\n",
-                                     r, SSL_get_error(c->ssl.client, r));
+                                     r, SSL_get_error(c->ssl->client, r));
 
                 ERR_error_string_n(ERR_get_error(), errmsg + offset,
                                    8192 - offset);
@@ -5709,21 +7401,22 @@ static int do_ssl_pre_connection(conn *c) {
 }
 
 static int do_ssl_read(conn *c, char *dest, size_t nbytes) {
+    static EXTENSION_LOG_LIMIT limit = DAEMON_LOG_LIMIT;
     int ret = 0;
 
     while (ret < nbytes) {
         int n;
         drain_bio_recv_pipe(c);
-        if (c->ssl.error) {
+        if (c->ssl->error) {
             set_econnreset();
             return -1;
         }
-        n = SSL_read(c->ssl.client, dest + ret, nbytes - ret);
+        n = SSL_read(c->ssl->client, dest + ret, nbytes - ret);
         if (n > 0) {
             ret += n;
         } else {
             /* n < 0 and n == 0 require a check of SSL error*/
-            int error = SSL_get_error(c->ssl.client, n);
+            int error = SSL_get_error(c->ssl->client, n);
 
             switch (error) {
             case SSL_ERROR_WANT_READ:
@@ -5731,7 +7424,7 @@ static int do_ssl_read(conn *c, char *dest, size_t nbytes) {
                  * Drain the buffers and retry if we've got data in
                  * our input buffers
                  */
-                if (c->ssl.in.current < c->ssl.in.total) {
+                if (c->ssl->in.current < c->ssl->in.total) {
                     /* our recv buf has data feed the BIO */
                     drain_bio_recv_pipe(c);
                 } else if (ret > 0) {
@@ -5743,14 +7436,24 @@ static int do_ssl_read(conn *c, char *dest, size_t nbytes) {
                 }
                 break;
 
+#ifdef SSL_MODE_ASYNC
+            case SSL_ERROR_WANT_ASYNC:
+                if (ret > 0) {
+                    return ret;
+                }
+                ssl_wait_async(c);
+                return -1;
+#endif
+
             default:
                 /*
                  * @todo I don't know how to gracefully recover from this
                  * let's just shut down the connection
                  */
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                                                "%d: ERROR: SSL_read returned -1 with error %d",
-                                                c->sfd, error);
+                settings.extensions.logger->log_limited(EXTENSION_LOG_WARNING, c,
+                                                        &limit,
+                                                        "%d: ERROR: SSL_read returned -1 with error %d",
+                                                        c->sfd, error);
                 set_econnreset();
                 return -1;
             }
@@ -5762,10 +7465,10 @@ static int do_ssl_read(conn *c, char *dest, size_t nbytes) {
 
 static int do_data_recv(conn *c, void *dest, size_t nbytes) {
     int res;
-    if (c->ssl.enabled) {
+    if (c->ssl != NULL) {
         drain_bio_recv_pipe(c);
 
-        if (!c->ssl.connected) {
+        if (!c->ssl->connected) {
             res = do_ssl_pre_connection(c);
             if (res == -1) {
                 return -1;
@@ -5773,7 +7476,9 @@ static int do_data_recv(conn *c, void *dest, size_t nbytes) {
         }
 
         /* The SSL negotiation might be complete at this time */
-        if (c->ssl.connected) {
+        if (c->ssl->ktls_recv) {
+            res = recv(c->sfd, dest, nbytes, 0);
+        } else if (c->ssl->connected) {
             res = do_ssl_read(c, dest, nbytes);
         }
     } else {
@@ -5784,6 +7489,7 @@ static int do_data_recv(conn *c, void *dest, size_t nbytes) {
 }
 
 static int do_ssl_write(conn *c, char *dest, size_t nbytes) {
+    static EXTENSION_LOG_LIMIT limit = DAEMON_LOG_LIMIT;
     int ret = 0;
 
     int chunksize = settings.bio_drain_buffer_sz;
@@ -5793,7 +7499,7 @@ static int do_ssl_write(conn *c, char *dest, size_t nbytes) {
         int chunk;
 
         drain_bio_send_pipe(c);
-        if (c->ssl.error) {
+        if (c->ssl->error) {
             set_econnreset();
             return -1;
         }
@@ -5803,7 +7509,7 @@ static int do_ssl_write(conn *c, char *dest, size_t nbytes) {
             chunk = chunksize;
         }
 
-        n = SSL_write(c->ssl.client, dest + ret, chunk);
+        n = SSL_write(c->ssl->client, dest + ret, chunk);
         if (n > 0) {
             ret += n;
         } else {
@@ -5813,20 +7519,27 @@ static int do_ssl_write(conn *c, char *dest, size_t nbytes) {
             }
 
             if (n < 0) {
-                int error = SSL_get_error(c->ssl.client, n);
+                int error = SSL_get_error(c->ssl->client, n);
                 switch (error) {
                 case SSL_ERROR_WANT_WRITE:
                     set_ewouldblock();
                     return -1;
 
+#ifdef SSL_MODE_ASYNC
+                case SSL_ERROR_WANT_ASYNC:
+                    ssl_wait_async(c);
+                    return -1;
+#endif
+
                 default:
                     /*
                      * @todo I don't know how to gracefully recover from this
                      * let's just shut down the connection
                      */
-                    settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
-                                                    "%d: ERROR: SSL_write returned -1 with error %d",
-                                                    c->sfd, error);
+                    settings.extensions.logger->log_limited(EXTENSION_LOG_WARNING, c,
+                                                            &limit,
+                                                            "%d: ERROR: SSL_write returned -1 with error %d",
+                                                            c->sfd, error);
                     set_econnreset();
                     return -1;
                 }
@@ -5838,9 +7551,12 @@ static int do_ssl_write(conn *c, char *dest, size_t nbytes) {
 }
 
 
-static int do_data_sendmsg(conn *c, struct msghdr *m) {
+static int do_data_sendmsg(conn *c, struct msghdr *m, int flags) {
     int res;
-    if (c->ssl.enabled) {
+    if (c->ssl != NULL && c->ssl->ktls_send) {
+        /* The kernel builds the records out of all of the iovecs */
+        res = sendmsg(c->sfd, m, flags);
+    } else if (c->ssl != NULL) {
         int ii;
         res = 0;
         for (ii = 0; ii < m->msg_iovlen; ++ii) {
@@ -5860,7 +7576,7 @@ static int do_data_sendmsg(conn *c, struct msghdr *m) {
         drain_bio_send_pipe(c);
         return res;
     } else {
-        res = sendmsg(c->sfd, m, 0);
+        res = zerocopy_sendmsg(c, m, flags);
     }
 
     return res;
@@ -5905,7 +7621,8 @@ static enum try_read_result try_read_network(conn *c) {
                 return gotdata;
             }
             ++num_allocs;
-            new_rbuf = realloc(c->read.buf, c->read.size * 2);
+            new_rbuf = net_buf_pool_resize(c->thread->buffers, c->read.buf,
+                                           c->read.size, c->read.size * 2);
             if (!new_rbuf) {
                 if (settings.verbose > 0) {
                     settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
@@ -5954,7 +7671,7 @@ static enum try_read_result try_read_network(conn *c) {
     return gotdata;
 }
 
-bool register_event(conn *c, struct timeval *timeout) {
+bool register_event(conn *c, const struct timeval *timeout) {
     cb_assert(!c->registered_in_libevent);
     cb_assert(c->sfd != INVALID_SOCKET);
 
@@ -5970,26 +7687,120 @@ bool register_event(conn *c, struct timeval *timeout) {
     return true;
 }
 
-bool unregister_event(conn *c) {
-    cb_assert(c->registered_in_libevent);
-    cb_assert(c->sfd != INVALID_SOCKET);
-
-    if (event_del(&c->event) == -1) {
-        return false;
+/*
+ * Sets the priority of the connection. The workers run the connections
+ * which are ready in the order of their priority (the dispatcher has
+ * just the one, so it keeps them all at CONN_PRIORITY_HIGH). An event
+ * which is active keeps the priority it has until it is set again (see
+ * update_event).
+ */
+void conn_set_priority(conn *c, int priority) {
+    c->priority = priority;
+    if (c->event.ev_base == main_base) {
+        priority = CONN_PRIORITY_HIGH;
     }
+    event_priority_set(&c->event, priority);
+}
+
+/*
+ * The priority of the connections to the interface of the port
+ */
+int interface_priority(in_port_t port) {
+    int ii;
+
+    for (ii = 0; ii < settings.num_interfaces; ++ii) {
+        if (settings.interfaces[ii].port == port) {
+            return settings.interfaces[ii].priority;
+        }
+    }
+    return CONN_PRIORITY_HIGH;
+}
+
+/*
+ * Whether the connections to the interface of the port send the responses
+ * which span several msghdrs with MSG_MORE
+ */
+bool interface_cork(in_port_t port) {
+    int ii;
+
+    for (ii = 0; ii < settings.num_interfaces; ++ii) {
+        if (settings.interfaces[ii].port == port) {
+            return settings.interfaces[ii].cork;
+        }
+    }
+    return false;
+}
+
+bool unregister_event(conn *c) {
+    cb_assert(c->registered_in_libevent);
+    cb_assert(c->sfd != INVALID_SOCKET);
+
+    if (event_del(&c->event) == -1) {
+        return false;
+    }
+
+    c->registered_in_libevent = false;
 
-    c->registered_in_libevent = false;
-
     return true;
 }
 
+/*
+ * The timeout of the event of a connection waiting for the next request
+ * with the given flags, after which we hibernate it (see conn_hibernate),
+ * or NULL if we don't. The persistent events start their timeout over
+ * every time they trigger, so it only fires once the connection has been
+ * idle for that long. All of the connections share the timeout, which
+ * libevent keeps in a queue instead of its heap.
+ */
+const struct timeval *idle_timeout(conn *c, int flags) {
+    struct timeval tv;
+
+    if (settings.idle_hibernate == 0 || c->hibernated ||
+        c->state == conn_listening || c->tap_iterator != NULL || c->dcp ||
+        (flags & (EV_READ | EV_PERSIST)) != (EV_READ | EV_PERSIST)) {
+        return NULL;
+    }
+
+    tv.tv_sec = settings.idle_hibernate;
+    tv.tv_usec = 0;
+    return event_base_init_common_timeout(c->event.ev_base, &tv);
+}
+
+/* Register the event again with the timeout it should have now */
+static bool rearm_event(conn *c) {
+    return unregister_event(c) &&
+           register_event(c, idle_timeout(c, c->ev_flags));
+}
+
+/*
+ * Called when the event of a connection timed out (see idle_timeout).
+ * Returns true if the connection must run (because we failed to register
+ * it again and it is closing).
+ */
+static bool conn_idle(conn *c) {
+    if (c->state != conn_read || c->hibernated || c->read.buf != NULL ||
+        c->write.buf != NULL || c->tap_iterator != NULL || c->dcp ||
+        c->zerocopy_held != NULL ||
+        (c->ssl != NULL && (c->ssl->in.total != 0 || c->ssl->out.total != 0))) {
+        return false;
+    }
+
+    conn_hibernate(c);
+    if (!rearm_event(c)) {
+        conn_set_state(c, conn_closing);
+        return true;
+    }
+    return false;
+}
+
 bool update_event(conn *c, const int new_flags) {
     struct event_base *base;
 
     cb_assert(c != NULL);
     base = c->event.ev_base;
 
-    if (c->ssl.enabled && c->ssl.connected && (new_flags & EV_READ)) {
+    if (c->ssl != NULL && c->ssl->connected && !c->ssl->ktls_recv &&
+        (new_flags & EV_READ)) {
         /*
          * If we want more data and we have SSL, that data might be inside
          * SSL's internal buffers rather than inside the socket buffer. In
@@ -5998,7 +7809,7 @@ bool update_event(conn *c, const int new_flags) {
          */
         char dummy;
         /* SSL_pending() will not work here despite the name */
-        int rv = SSL_peek(c->ssl.client, &dummy, 1);
+        int rv = SSL_peek(c->ssl->client, &dummy, 1);
         if (rv > 0) {
             /* signal a call to the handler */
             event_active(&c->event, EV_READ, 0);
@@ -6021,9 +7832,10 @@ bool update_event(conn *c, const int new_flags) {
 
     event_set(&c->event, c->sfd, new_flags, event_handler, (void *)c);
     event_base_set(base, &c->event);
+    conn_set_priority(c, c->priority);
     c->ev_flags = new_flags;
 
-    return register_event(c, NULL);
+    return register_event(c, idle_timeout(c, new_flags));
 }
 
 /*
@@ -6052,8 +7864,15 @@ static enum transmit_result transmit(conn *c) {
 #endif
         ssize_t res;
         struct msghdr *m = &c->msglist[c->msgcurr];
+        int flags = 0;
 
-        res = do_data_sendmsg(c, m);
+#ifdef MSG_MORE
+        /* The kernel holds on to a partial packet until the last of them */
+        if (c->cork && c->msgcurr + 1 < c->msgused) {
+            flags = MSG_MORE;
+        }
+#endif
+        res = do_data_sendmsg(c, m, flags);
 #ifdef WIN32
         error = WSAGetLastError();
 #else
@@ -6061,6 +7880,7 @@ static enum transmit_result transmit(conn *c) {
 #endif
         if (res > 0) {
             STATS_ADD(c, bytes_written, res);
+            span_mark(c, SPAN_FIRST_BYTE);
 
             /* We've written some of the data. Remove the completed
                iovec entries from the list of pending writes. */
@@ -6076,6 +7896,20 @@ static enum transmit_result transmit(conn *c) {
                 m->msg_iov->iov_base = (void*)((unsigned char*)m->msg_iov->iov_base + res);
                 m->msg_iov->iov_len -= res;
             }
+
+            /* A short write means the socket buffer is full, so wait for
+               it to drain rather than spend a sendmsg on EAGAIN */
+            if (m->msg_iovlen > 0 && (c->ssl == NULL || c->ssl->ktls_send)) {
+                if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+                    if (settings.verbose > 0) {
+                        settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
+                                "Couldn't update event\n");
+                    }
+                    conn_set_state(c, conn_closing);
+                    return TRANSMIT_HARD_ERROR;
+                }
+                return TRANSMIT_SOFT_ERROR;
+            }
             return TRANSMIT_INCOMPLETE;
         }
 
@@ -6113,9 +7947,9 @@ static enum transmit_result transmit(conn *c) {
         conn_set_state(c, conn_closing);
         return TRANSMIT_HARD_ERROR;
     } else {
-        if (c->ssl.enabled) {
+        if (c->ssl != NULL) {
             drain_bio_send_pipe(c);
-            if (c->ssl.out.total) {
+            if (c->ssl->out.total) {
                 if (!update_event(c, EV_WRITE | EV_PERSIST)) {
                     if (settings.verbose > 0) {
                         settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
@@ -6199,8 +8033,19 @@ bool conn_listening(conn *c)
         return false;
     }
 
-    dispatch_conn_new(sfd, c->parent_port, conn_new_cmd, EV_READ | EV_PERSIST,
-                      DATA_BUFFER_SIZE);
+    if (c->thread != NULL) {
+        /* A socket of the worker's own (see reuseport) */
+        if (!thread_conn_new(c->thread, sfd, c->parent_port, conn_new_cmd,
+                             EV_READ | EV_PERSIST, DATA_BUFFER_SIZE)) {
+            STATS_LOCK();
+            --port_instance->curr_conns;
+            STATS_UNLOCK();
+            safe_close(sfd);
+        }
+    } else {
+        dispatch_conn_new(sfd, c->parent_port, conn_new_cmd,
+                          EV_READ | EV_PERSIST, DATA_BUFFER_SIZE);
+    }
 
     return false;
 }
@@ -6224,6 +8069,13 @@ bool conn_ship_log(conn *c) {
         return false;
     }
 
+    if (settings.replication_threads > 0 && c->thread != NULL &&
+        c->thread->type == GENERAL) {
+        /* The stream is set up, so it goes to the replication threads */
+        conn_set_state(c, conn_move_thread);
+        return false;
+    }
+
     if (c->which & EV_READ || c->read.bytes > 0) {
         if (c->read.bytes > 0) {
             if (try_read_command(c) == 0) {
@@ -6274,6 +8126,22 @@ bool conn_ship_log(conn *c) {
 }
 
 bool conn_waiting(conn *c) {
+    if (flush_coalesced(c, conn_waiting)) {
+        return true;
+    }
+    if (c->coalesced.size > DATA_BUFFER_SIZE) {
+        free(c->coalesced.buf);
+        c->coalesced.buf = NULL;
+        c->coalesced.size = 0;
+    }
+
+    if (c->thread != NULL && c->thread->retired &&
+        c->tap_iterator == NULL && c->zerocopy_held == NULL) {
+        /* Nothing of it is in flight, so it may move to another worker */
+        conn_set_state(c, conn_leave_thread);
+        return false;
+    }
+
     if (!update_event(c, EV_READ | EV_PERSIST)) {
         if (settings.verbose > 0) {
             settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
@@ -6306,11 +8174,54 @@ bool conn_read(conn *c) {
     return true;
 }
 
-bool conn_parse_cmd(conn *c) {
-    if (try_read_command(c) == 0) {
-        /* wee need more data! */
-        conn_set_state(c, conn_waiting);
+/*
+ * Do what conn_nread does for the current command if the rest of it is
+ * in the read buffer already.
+ * Returns false if it isn't (and leaves it to conn_nread to read it).
+ */
+static bool complete_buffered_nread(conn *c) {
+    while (c->state == conn_nread) {
+        if (c->rlbytes > c->read.bytes || c->riovcurr < c->riovused) {
+            return false;
+        }
+        if (c->ritem != c->read.curr) {
+            memmove(c->ritem, c->read.curr, c->rlbytes);
+        }
+        c->ritem += c->rlbytes;
+        c->read.curr += c->rlbytes;
+        c->read.bytes -= c->rlbytes;
+        c->rlbytes = 0;
+
+        c->ewouldblock = false;
+        c->riovused = c->riovcurr = 0;
+        complete_nread(c);
+        if (c->ewouldblock) {
+            unregister_event(c);
+            break;
+        }
     }
+    return true;
+}
+
+bool conn_parse_cmd(conn *c) {
+    /*
+     * Run the requests that are in the read buffer already back to back
+     * (for as long as we may coalesce their responses) instead of going
+     * through conn_nread, conn_mwrite and conn_new_cmd for every one.
+     */
+    do {
+        if (try_read_command(c) == 0) {
+            /* wee need more data! */
+            conn_set_state(c, conn_waiting);
+            break;
+        }
+        if (!complete_buffered_nread(c) || c->ewouldblock ||
+            c->state != conn_mwrite || c->write_prepared ||
+            !coalesce_response(c) || c->state != conn_new_cmd) {
+            break;
+        }
+        conn_new_cmd(c);
+    } while (c->state == conn_parse_cmd);
 
     return !c->ewouldblock;
 }
@@ -6319,14 +8230,21 @@ bool conn_new_cmd(conn *c) {
     /* Only process nreqs at a time to avoid starving other connections */
     int ssl_peek = 0;
     c->start = 0;
+    if (c->thread != NULL) {
+        c->thread->requests++;
+    }
     --c->nevents;
     if (c->nevents >= 0) {
         reset_cmd_handler(c);
     } else {
+        /* Don't keep the responses we held back while we yield */
+        if (flush_coalesced(c, conn_new_cmd)) {
+            return true;
+        }
         /* check ssl for pending data */
-        if (c->ssl.enabled) {
+        if (c->ssl != NULL && !c->ssl->ktls_recv) {
             char dummy;
-            ssl_peek = SSL_peek(c->ssl.client, &dummy, 1);
+            ssl_peek = SSL_peek(c->ssl->client, &dummy, 1);
         }
         STATS_NOKEY(c, conn_yields);
         if (c->read.bytes > 0 || ssl_peek > 0) {
@@ -6351,6 +8269,26 @@ bool conn_new_cmd(conn *c) {
     return true;
 }
 
+/*
+ * Throw away the next bytes of the connection (up to sbytes of them).
+ * On Linux the kernel can drop them for us (MSG_TRUNC) rather than copy
+ * them into the read buffer, which matters for the large values we
+ * refuse. It only does so for TCP, so we copy when it fails.
+ */
+static ssize_t swallow_recv(conn *c) {
+    size_t nbytes = c->read.size > c->sbytes ? c->sbytes : c->read.size;
+#ifdef __linux__
+    if (c->ssl == NULL && c->sbytes > c->read.size) {
+        ssize_t res = recv(c->sfd, NULL, c->sbytes, MSG_TRUNC);
+        if (res != -1 || (errno != EFAULT && errno != EINVAL &&
+                          errno != EOPNOTSUPP)) {
+            return res;
+        }
+    }
+#endif
+    return do_data_recv(c, c->read.buf, nbytes);
+}
+
 bool conn_swallow(conn *c) {
     ssize_t res;
 #ifdef WIN32
@@ -6374,7 +8312,7 @@ bool conn_swallow(conn *c) {
     }
 
     /*  now try reading from the socket */
-    res = do_data_recv(c, c->read.buf, c->read.size > c->sbytes ? c->sbytes : c->read.size);
+    res = swallow_recv(c);
 #ifdef WIN32
     error = WSAGetLastError();
 #else
@@ -6416,6 +8354,59 @@ bool conn_swallow(conn *c) {
     return true;
 }
 
+#ifndef WIN32
+/* The most pieces of the value (and the read buffer) we read in one go */
+#define NREAD_IOV_MAX 16
+
+/*
+ * Read the rest of the value straight into the pieces of the item with a
+ * single readv, rather than one recv per piece. The read buffer goes
+ * last, so that the header of the next command (if the client pipelines
+ * them) comes in with the value rather than with another read. The
+ * caller has made sure the read buffer is empty.
+ */
+static ssize_t nread_vec(conn *c) {
+    struct iovec iov[NREAD_IOV_MAX];
+    int niov = 0;
+    int ii;
+    ssize_t res;
+    size_t left;
+    size_t n;
+
+    iov[niov].iov_base = c->ritem;
+    iov[niov++].iov_len = c->rlbytes;
+    for (ii = c->riovcurr; ii < c->riovused && niov < NREAD_IOV_MAX - 1; ++ii) {
+        iov[niov++] = c->riov[ii];
+    }
+    if (ii == c->riovused) {
+        c->read.curr = c->read.buf;
+        iov[niov].iov_base = c->read.buf;
+        iov[niov++].iov_len = c->read.size;
+    }
+
+    res = readv(c->sfd, iov, niov);
+    if (res <= 0) {
+        return res;
+    }
+
+    left = (size_t)res;
+    n = left > c->rlbytes ? c->rlbytes : left;
+    c->ritem += n;
+    c->rlbytes -= (uint32_t)n;
+    left -= n;
+    while (left > 0 && c->riovcurr < c->riovused) {
+        struct iovec *piece = &c->riov[c->riovcurr++];
+        n = left > piece->iov_len ? piece->iov_len : left;
+        c->ritem = (char*)piece->iov_base + n;
+        c->rlbytes = (uint32_t)(piece->iov_len - n);
+        left -= n;
+    }
+    /* What is left went into the read buffer */
+    c->read.bytes += (uint32_t)left;
+    return res;
+}
+#endif
+
 bool conn_nread(conn *c) {
     ssize_t res;
 #ifdef WIN32
@@ -6424,8 +8415,17 @@ bool conn_nread(conn *c) {
     int error;
 #endif
 
+    if (c->rlbytes == 0 && c->riovcurr < c->riovused) {
+        /* Move on to the next piece of the value */
+        c->ritem = c->riov[c->riovcurr].iov_base;
+        c->rlbytes = (uint32_t)c->riov[c->riovcurr].iov_len;
+        ++c->riovcurr;
+        return true;
+    }
+
     if (c->rlbytes == 0) {
         bool block = c->ewouldblock = false;
+        c->riovused = c->riovcurr = 0;
         complete_nread(c);
         if (c->ewouldblock) {
             unregister_event(c);
@@ -6448,6 +8448,17 @@ bool conn_nread(conn *c) {
         }
     }
 
+#ifndef WIN32
+    /* (unless we're reading it into the read buffer itself) */
+    if (c->ssl == NULL && (c->ritem < c->read.buf ||
+                           c->ritem >= c->read.buf + c->read.size)) {
+        res = nread_vec(c);
+        if (res > 0) {
+            STATS_ADD(c, bytes_read, res);
+            return true;
+        }
+    } else
+#endif
     /*  now try reading from the socket */
     res = do_data_recv(c, c->ritem, c->rlbytes);
 #ifdef WIN32
@@ -6515,37 +8526,200 @@ bool conn_write(conn *c) {
     return conn_mwrite(c);
 }
 
-bool conn_mwrite(conn *c) {
-    switch (transmit(c)) {
-    case TRANSMIT_COMPLETE:
-        if (c->state == conn_mwrite) {
-            while (c->ileft > 0) {
-                item *it = *(c->icurr);
+/*
+ * Release what we kept for the response we're done with, and move on to
+ * the next state
+ */
+static void finish_write(conn *c) {
+    if (c->slow_op.start != 0) {
+        slow_op_done(c, request_end_time(c));
+    }
+    if (c->span.sampled) {
+        span_mark(c, SPAN_LAST_BYTE);
+        span_done(c);
+    }
+
+    if (c->state == conn_mwrite) {
+        while (c->ileft > 0) {
+            item *it = *(c->icurr);
+            if (!zerocopy_hold(c, ZEROCOPY_ITEM, it)) {
                 settings.engine.v1->release(settings.engine.v0, c, it);
-                c->icurr++;
-                c->ileft--;
             }
-            while (c->temp_alloc_left > 0) {
-                char *temp_alloc_ = *(c->temp_alloc_curr);
+            c->icurr++;
+            c->ileft--;
+        }
+        while (c->temp_alloc_left > 0) {
+            char *temp_alloc_ = *(c->temp_alloc_curr);
+            if (!zerocopy_hold(c, ZEROCOPY_BUFFER, temp_alloc_)) {
                 free(temp_alloc_);
-                c->temp_alloc_curr++;
-                c->temp_alloc_left--;
             }
-            /* XXX:  I don't know why this wasn't the general case */
-            conn_set_state(c, c->write_and_go);
-        } else if (c->state == conn_write) {
-            if (c->write_and_free) {
-                free(c->write_and_free);
-                c->write_and_free = 0;
-            }
-            conn_set_state(c, c->write_and_go);
-        } else {
+            c->temp_alloc_curr++;
+            c->temp_alloc_left--;
+        }
+        /* XXX:  I don't know why this wasn't the general case */
+        conn_set_state(c, c->write_and_go);
+    } else if (c->state == conn_write) {
+        conn_set_state(c, c->write_and_go);
+    } else {
+        if (settings.verbose > 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
+                                            "Unexpected state %d\n", c->state);
+        }
+        conn_set_state(c, conn_closing);
+    }
+}
+
+/*
+ * Is there another request in the read buffer we can start on right away?
+ */
+static bool has_complete_request(conn *c) {
+    protocol_binary_request_header req;
+
+    if (c->read.bytes < sizeof(req.bytes)) {
+        return false;
+    }
+    memcpy(req.bytes, c->read.curr, sizeof(req.bytes));
+    return req.request.magic == PROTOCOL_BINARY_REQ &&
+           c->read.bytes - sizeof(req.bytes) >= ntohl(req.request.bodylen);
+}
+
+/*
+ * Copy the response into the coalesced responses instead of sending it,
+ * if the next request is already in the read buffer (so that we send its
+ * response along with this one). The caller has checked that nothing of
+ * the response has been sent yet.
+ * Returns true if we did (and the response is done with).
+ */
+static bool coalesce_response(conn *c) {
+    size_t nbytes = 0;
+    int ii;
+    int jj;
+
+    if (settings.coalesce_responses == 0 || c->write_and_go != conn_new_cmd ||
+        c->nevents <= 0 || !has_complete_request(c)) {
+        return false;
+    }
+
+    for (ii = 0; ii < c->msgused; ++ii) {
+        struct msghdr *m = &c->msglist[ii];
+        for (jj = 0; jj < m->msg_iovlen; ++jj) {
+            nbytes += m->msg_iov[jj].iov_len;
+        }
+    }
+    if (c->coalesced.bytes + nbytes > (size_t)settings.coalesce_responses) {
+        return false;
+    }
+    if (settings.max_pending_output > 0 &&
+        c->coalesced.bytes + nbytes > (size_t)settings.max_pending_output) {
+        /* Send what we've got before we take the next request */
+        STATS_NOKEY(c, conn_backpressure);
+        return false;
+    }
+
+    if (c->coalesced.bytes + nbytes > c->coalesced.size) {
+        size_t size = c->coalesced.size == 0 ? DATA_BUFFER_SIZE :
+                                               c->coalesced.size;
+        char *buf;
+        while (size < c->coalesced.bytes + nbytes) {
+            size *= 2;
+        }
+        buf = realloc(c->coalesced.buf, size);
+        if (buf == NULL) {
+            return false;
+        }
+        c->coalesced.buf = buf;
+        c->coalesced.size = size;
+    }
+
+    for (ii = 0; ii < c->msgused; ++ii) {
+        struct msghdr *m = &c->msglist[ii];
+        for (jj = 0; jj < m->msg_iovlen; ++jj) {
+            memcpy(c->coalesced.buf + c->coalesced.bytes,
+                   m->msg_iov[jj].iov_base, m->msg_iov[jj].iov_len);
+            c->coalesced.bytes += m->msg_iov[jj].iov_len;
+        }
+    }
+
+    STATS_NOKEY(c, responses_coalesced);
+    finish_write(c);
+    return true;
+}
+
+/*
+ * Put the coalesced responses in front of the response we're about to
+ * send (in its first msghdr unless that one is full)
+ */
+static int prepend_coalesced(conn *c) {
+    int ii;
+
+    if (c->msglist[0].msg_iovlen == IOV_MAX) {
+        if (add_msghdr(c) != 0) {
+            return -1;
+        }
+        memmove(c->msglist + 1, c->msglist,
+                (c->msgused - 1) * sizeof(c->msglist[0]));
+        memset(c->msglist, 0, sizeof(c->msglist[0]));
+        c->msglist[0].msg_iov = c->iov;
+    }
+
+    if (ensure_iov_space(c) != 0) {
+        return -1;
+    }
+    memmove(c->iov + 1, c->iov, c->iovused * sizeof(c->iov[0]));
+    c->iov[0].iov_base = c->coalesced.buf;
+    c->iov[0].iov_len = c->coalesced.bytes;
+    c->iovused++;
+    c->msglist[0].msg_iovlen++;
+    for (ii = 1; ii < c->msgused; ++ii) {
+        c->msglist[ii].msg_iov++;
+    }
+
+    return 0;
+}
+
+/*
+ * Send the coalesced responses on their own (there is no response left
+ * to send them along with) before moving on to next
+ */
+static bool flush_coalesced(conn *c, STATE_FUNC next) {
+    if (c->coalesced.bytes == 0) {
+        return false;
+    }
+
+    c->msgcurr = 0;
+    c->msgused = 0;
+    c->iovused = 0;
+    if (add_msghdr(c) != 0) {
+        conn_set_state(c, conn_closing);
+        return true;
+    }
+    c->write_and_go = next;
+    conn_set_state(c, conn_mwrite);
+    return true;
+}
+
+bool conn_mwrite(conn *c) {
+    if (!c->write_prepared) {
+        c->write_prepared = true;
+        if (coalesce_response(c)) {
+            c->write_prepared = false;
+            return true;
+        }
+        if (c->coalesced.bytes > 0 && prepend_coalesced(c) != 0) {
             if (settings.verbose > 0) {
                 settings.extensions.logger->log(EXTENSION_LOG_INFO, c,
-                                                "Unexpected state %d\n", c->state);
+                                                "Couldn't build response\n");
             }
             conn_set_state(c, conn_closing);
+            return true;
         }
+    }
+
+    switch (transmit(c)) {
+    case TRANSMIT_COMPLETE:
+        c->write_prepared = false;
+        c->coalesced.bytes = 0;
+        finish_write(c);
         break;
 
     case TRANSMIT_INCOMPLETE:
@@ -6618,6 +8792,28 @@ bool conn_destroyed(conn* c) {
     return false;
 }
 
+/**
+ * The connection is on its way to one of the replication threads (see
+ * dispatch_conn_move), which picks it up in conn_ship_log.
+ * @param c the connection
+ * @return false, as the thread it is on must not touch it any more
+ */
+bool conn_move_thread(conn *c) {
+    (void)c;
+    return false;
+}
+
+/**
+ * The client is on its way from a retired worker to another one (see
+ * dispatch_conn_move), which picks it up in conn_new_cmd.
+ * @param c the connection
+ * @return false, as the thread it is on must not touch it any more
+ */
+bool conn_leave_thread(conn *c) {
+    (void)c;
+    return false;
+}
+
 bool conn_setup_tap_stream(conn *c) {
     process_bin_tap_connect(c);
     return true;
@@ -6644,6 +8840,16 @@ bool conn_refresh_cbsasl(conn *c) {
     return true;
 }
 
+bool conn_sasl_auth(conn *c) {
+    ENGINE_ERROR_CODE ret = c->aiostat;
+    c->aiostat = ENGINE_SUCCESS;
+    c->ewouldblock = false;
+
+    cb_assert(ret == ENGINE_SUCCESS);
+    sasl_auth_done(c);
+    return true;
+}
+
 bool conn_refresh_ssl_certs(conn *c) {
     ENGINE_ERROR_CODE ret = c->aiostat;
     c->aiostat = ENGINE_SUCCESS;
@@ -6685,33 +8891,54 @@ void event_handler(evutil_socket_t fd, short which, void *arg) {
          * object was scheduled to run in the dispatcher before the
          * callback for the worker thread is executed.
          */
-        c->thread->pending_io = list_remove(c->thread->pending_io, c);
+        remove_pending_io(c);
     }
 
     c->which = which;
 
     /* sanity */
     cb_assert(fd == c->sfd);
+    if (which == EV_TIMEOUT && !conn_idle(c)) {
+        if (thr) {
+            UNLOCK_THREAD(thr);
+        }
+        return;
+    }
+    if (c->hibernated && (!conn_wake(c) || !rearm_event(c))) {
+        conn_set_state(c, conn_closing);
+    }
+    if (c->zerocopy_held != NULL || c->zerocopy_done != c->zerocopy_sent) {
+        /* The completions wake us up until we've read them */
+        zerocopy_reap(c);
+    }
     perform_callbacks(ON_SWITCH_CONN, c, c);
 
 
-    c->nevents = settings.reqs_per_event;
     if (c->state == conn_ship_log) {
         c->nevents = settings.reqs_per_tap_event;
+    } else if (thr) {
+        c->nevents = thread_reqs_per_event(thr);
+    } else {
+        c->nevents = settings.reqs_per_event;
     }
 
-    run_event_loop(c);
-
     if (thr) {
+        hrtime_t start = thread_clock_update(thr);
+        uint64_t requests = thr->requests;
+        /* c may be gone once it returns */
+        run_event_loop(c);
+        thread_event_done(thr, thr->requests - requests,
+                          thread_clock_update(thr) - start);
         UNLOCK_THREAD(thr);
+    } else {
+        run_event_loop(c);
     }
 }
 
 static void dispatch_event_handler(evutil_socket_t fd, short which, void *arg) {
-    char buffer[80];
-    ssize_t nr = recv(fd, buffer, sizeof(buffer), 0);
+    ssize_t nr = read_notifications(fd);
 
-    if (nr != -1 && is_listen_disabled()) {
+    if (nr != -1 && is_listen_disabled() && !hot_restart.handed_off) {
         bool enable = false;
         cb_mutex_enter(&listen_state.mutex);
         listen_state.count -= nr;
@@ -6723,83 +8950,336 @@ static void dispatch_event_handler(evutil_socket_t fd, short which, void *arg) {
         if (enable) {
             conn *next;
             for (next = listen_conn; next; next = next->next) {
-                int backlog = 1024;
-                int ii;
                 update_event(next, EV_READ | EV_PERSIST);
-                for (ii = 0; ii < settings.num_interfaces; ++ii) {
-                    if (next->parent_port == settings.interfaces[ii].port) {
-                        backlog = settings.interfaces[ii].backlog;
-                        break;
-                    }
-                }
-
-                if (listen(next->sfd, backlog) != 0) {
+                if (listen(next->sfd, listen_backlog(next->parent_port)) != 0) {
                     settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
                                                     "listen() failed",
                                                     strerror(errno));
                 }
             }
+            notify_listening_threads();
+        }
+    }
+}
+
+/*
+ * Sets a socket's send buffer size to the maximum allowed by the system.
+ */
+static void maximize_sndbuf(const SOCKET sfd) {
+    socklen_t intsize = sizeof(int);
+    int last_good = 0;
+    int min, max, avg;
+    int old_size;
+
+    /* Start with the default size. */
+    if (getsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (void *)&old_size, &intsize) != 0) {
+        if (settings.verbose > 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "getsockopt(SO_SNDBUF): %s",
+                                            strerror(errno));
+        }
+
+        return;
+    }
+
+    /* Binary-search for the real maximum. */
+    min = old_size;
+    max = MAX_SENDBUF_SIZE;
+
+    while (min <= max) {
+        avg = ((unsigned int)(min + max)) / 2;
+        if (setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (void *)&avg, intsize) == 0) {
+            last_good = avg;
+            min = avg + 1;
+        } else {
+            max = avg - 1;
+        }
+    }
+
+    if (settings.verbose > 1) {
+        settings.extensions.logger->log(EXTENSION_LOG_DEBUG, NULL,
+                 "<%d send buffer was %d, now %d\n", sfd, old_size, last_good);
+    }
+}
+
+static SOCKET new_socket(struct addrinfo *ai) {
+    SOCKET sfd;
+
+    sfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sfd == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+
+    if (evutil_make_socket_nonblocking(sfd) == -1) {
+        safe_close(sfd);
+        return INVALID_SOCKET;
+    }
+
+    maximize_sndbuf(sfd);
+
+    return sfd;
+}
+
+/**
+ * Set the options of a socket we're about to bind to listen on
+ * @param sfd the socket
+ * @param interf the interface it is for
+ * @param family the address family of the socket
+ * @return false if we can't use the socket
+ */
+static bool set_server_socket_options(SOCKET sfd, struct interface *interf,
+                                      int family) {
+    struct linger ling = {0, 0};
+    int flags = 1;
+    int error;
+
+#ifdef IPV6_V6ONLY
+    if (family == AF_INET6) {
+        error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(IPV6_V6ONLY): %s",
+                                            strerror(errno));
+            return false;
+        }
+    }
+#endif
+
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+#ifdef SO_REUSEPORT
+    if (settings.reuseport) {
+        error = setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(SO_REUSEPORT): %s",
+                                            strerror(errno));
+            return false;
+        }
+    }
+#endif
+
+    error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
+    if (error != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "setsockopt(SO_KEEPALIVE): %s",
+                                        strerror(errno));
+    }
+
+    error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+    if (error != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "setsockopt(SO_LINGER): %s",
+                                        strerror(errno));
+    }
+
+    if (interf->tcp_nodelay) {
+        error = setsockopt(sfd, IPPROTO_TCP,
+                           TCP_NODELAY, (void *)&flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(TCP_NODELAY): %s",
+                                            strerror(errno));
+        }
+    }
+
+#ifdef TCP_DEFER_ACCEPT
+    /* We aren't woken up for a connect until its first request is in */
+    if (interf->defer_accept > 0) {
+        error = setsockopt(sfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                           (void *)&interf->defer_accept,
+                           sizeof(interf->defer_accept));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(TCP_DEFER_ACCEPT): %s",
+                                            strerror(errno));
+        }
+    }
+#endif
+
+#ifdef TCP_FASTOPEN
+    /* A returning client may send its first request with the SYN */
+    if (interf->fastopen > 0) {
+        error = setsockopt(sfd, IPPROTO_TCP, TCP_FASTOPEN,
+                           (void *)&interf->fastopen,
+                           sizeof(interf->fastopen));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(TCP_FASTOPEN): %s",
+                                            strerror(errno));
+        }
+    }
+#endif
+
+    return true;
+}
+
+/**
+ * Hand a socket we're listening on to every worker thread of the thread
+ * group of the interface, so that they accept the connections to it
+ * themselves (see reuseport). The first one gets the socket, the others a
+ * new one bound to the same address.
+ * @param interf the interface we're listening on
+ * @param ai the address the socket is bound to
+ * @param sfd the socket
+ */
+static void dispatch_reuseport_sockets(struct interface *interf,
+                                       struct addrinfo *ai, SOCKET sfd) {
+    struct listening_port *port_instance;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    bool first = true;
+    int ii;
+
+    /* Bind the others to the port we got if we asked for any */
+    if (getsockname(sfd, (struct sockaddr *)&addr, &addrlen) != 0) {
+        memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+        addrlen = (socklen_t)ai->ai_addrlen;
+    }
+
+    /* The replication threads don't accept any connections */
+    for (ii = 0; ii < settings.num_threads - settings.replication_threads; ++ii) {
+        if (thread_group_of(ii) != interf->group) {
+            continue;
+        }
+        if (!first) {
+            sfd = new_socket(ai);
+            if (sfd == INVALID_SOCKET) {
+                break;
+            }
+            if (!set_server_socket_options(sfd, interf, ai->ai_family) ||
+                bind(sfd, (struct sockaddr *)&addr, addrlen) == SOCKET_ERROR ||
+                listen(sfd, interf->backlog) == SOCKET_ERROR) {
+                /* The workers with a socket accept all of the connections */
+                log_socket_error(EXTENSION_LOG_WARNING, NULL,
+                                 "Failed to open a SO_REUSEPORT socket: %s");
+                safe_close(sfd);
+                break;
+            }
         }
+
+        dispatch_listen_conn(sfd, interf->port, ii);
+        first = false;
+        STATS_LOCK();
+        ++stats.curr_conns;
+        ++stats.daemon_conns;
+        port_instance = get_listening_port_instance(interf->port);
+        cb_assert(port_instance);
+        ++port_instance->curr_conns;
+        STATS_UNLOCK();
     }
 }
 
-/*
- * Sets a socket's send buffer size to the maximum allowed by the system.
+/**
+ * Write the port a socket listens on to the port number file
+ * @param sfd the socket
+ * @param portnumber_file the file (may be NULL)
  */
-static void maximize_sndbuf(const SOCKET sfd) {
-    socklen_t intsize = sizeof(int);
-    int last_good = 0;
-    int min, max, avg;
-    int old_size;
-
-    /* Start with the default size. */
-    if (getsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (void *)&old_size, &intsize) != 0) {
-        if (settings.verbose > 0) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "getsockopt(SO_SNDBUF): %s",
-                                            strerror(errno));
-        }
-
+static void save_port_number(SOCKET sfd, FILE *portnumber_file) {
+    union {
+        struct sockaddr_storage storage;
+        struct sockaddr_in in;
+        struct sockaddr_in6 in6;
+    } my_sockaddr;
+    socklen_t len = sizeof(my_sockaddr);
+
+    if (portnumber_file == NULL ||
+        getsockname(sfd, (struct sockaddr*)&my_sockaddr, &len) != 0) {
         return;
     }
-
-    /* Binary-search for the real maximum. */
-    min = old_size;
-    max = MAX_SENDBUF_SIZE;
-
-    while (min <= max) {
-        avg = ((unsigned int)(min + max)) / 2;
-        if (setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (void *)&avg, intsize) == 0) {
-            last_good = avg;
-            min = avg + 1;
-        } else {
-            max = avg - 1;
-        }
+    if (my_sockaddr.storage.ss_family == AF_INET) {
+        fprintf(portnumber_file, "%s INET: %u\n", "TCP",
+                ntohs(my_sockaddr.in.sin_port));
+    } else if (my_sockaddr.storage.ss_family == AF_INET6) {
+        fprintf(portnumber_file, "%s INET6: %u\n", "TCP",
+                ntohs(my_sockaddr.in6.sin6_port));
     }
+}
 
-    if (settings.verbose > 1) {
-        settings.extensions.logger->log(EXTENSION_LOG_DEBUG, NULL,
-                 "<%d send buffer was %d, now %d\n", sfd, old_size, last_good);
+/**
+ * Accept the connections to a listening socket in the dispatcher
+ * @param interf the interface it is for
+ * @param sfd the socket
+ */
+static void add_listen_conn(struct interface *interf, SOCKET sfd) {
+    struct listening_port *port_instance;
+    conn *listen_conn_add;
+
+    if (!(listen_conn_add = conn_new(sfd, interf->port, conn_listening,
+                                     EV_READ | EV_PERSIST, 1,
+                                     main_base, NULL))) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "failed to create listening connection\n");
+        exit(EXIT_FAILURE);
     }
+    listen_conn_add->next = listen_conn;
+    listen_conn = listen_conn_add;
+    STATS_LOCK();
+    ++stats.curr_conns;
+    ++stats.daemon_conns;
+    port_instance = get_listening_port_instance(interf->port);
+    cb_assert(port_instance);
+    ++port_instance->curr_conns;
+    STATS_UNLOCK();
 }
 
-static SOCKET new_socket(struct addrinfo *ai) {
+#ifndef WIN32
+/**
+ * Create a Unix domain socket for the interface and listen on it
+ * @param interf the interface (with a path)
+ * @return zero if we succeeded
+ */
+static int server_socket_unix(struct interface *interf) {
+    struct sockaddr_un addr;
+    struct stat st;
     SOCKET sfd;
 
-    sfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-    if (sfd == INVALID_SOCKET) {
-        return INVALID_SOCKET;
+    if (strlen(interf->path) >= sizeof(addr.sun_path)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Unix socket path too long: %s\n",
+                                        interf->path);
+        return 1;
     }
 
+    if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+        log_socket_error(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to create the Unix socket: %s");
+        return 1;
+    }
     if (evutil_make_socket_nonblocking(sfd) == -1) {
         safe_close(sfd);
-        return INVALID_SOCKET;
+        return 1;
     }
-
     maximize_sndbuf(sfd);
 
-    return sfd;
+    /* Left behind by a server which is gone (but never remove a file) */
+    if (lstat(interf->path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(interf->path);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, interf->path);
+    if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        listen(sfd, interf->backlog) == SOCKET_ERROR) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to listen on %s: %s\n",
+                                        interf->path, strerror(errno));
+        safe_close(sfd);
+        return 1;
+    }
+
+    /* The workers can't have a socket of their own bound to the path */
+    add_listen_conn(interf, sfd);
+    return 0;
+}
+#else
+static int server_socket_unix(struct interface *interf) {
+    settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                    "Unix sockets are not supported on "
+                                    "this platform: %s\n", interf->path);
+    return 1;
 }
+#endif
 
 /**
  * Create a socket and bind it to a specific port number
@@ -6811,16 +9291,18 @@ static SOCKET new_socket(struct addrinfo *ai) {
  */
 static int server_socket(struct interface *interf, FILE *portnumber_file) {
     SOCKET sfd;
-    struct linger ling = {0, 0};
     struct addrinfo *ai;
     struct addrinfo *next;
     struct addrinfo hints;
     char port_buf[NI_MAXSERV];
     int error;
     int success = 0;
-    int flags =1;
     char *host = NULL;
 
+    if (interf->path != NULL) {
+        return server_socket_unix(interf);
+    }
+
     memset(&hints, 0, sizeof(hints));
     hints.ai_flags = AI_PASSIVE;
     hints.ai_protocol = IPPROTO_TCP;
@@ -6859,8 +9341,6 @@ static int server_socket(struct interface *interf, FILE *portnumber_file) {
     }
 
     for (next= ai; next; next= next->ai_next) {
-        struct listening_port *port_instance;
-        conn *listen_conn_add;
         if ((sfd = new_socket(next)) == INVALID_SOCKET) {
             /* getaddrinfo can return "junk" addresses,
              * we make sure at least one works before erroring.
@@ -6868,42 +9348,9 @@ static int server_socket(struct interface *interf, FILE *portnumber_file) {
             continue;
         }
 
-#ifdef IPV6_V6ONLY
-        if (next->ai_family == AF_INET6) {
-            error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
-            if (error != 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                "setsockopt(IPV6_V6ONLY): %s",
-                                                strerror(errno));
-                safe_close(sfd);
-                continue;
-            }
-        }
-#endif
-
-        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
-        error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
-        if (error != 0) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "setsockopt(SO_KEEPALIVE): %s",
-                                            strerror(errno));
-        }
-
-        error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
-        if (error != 0) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "setsockopt(SO_LINGER): %s",
-                                            strerror(errno));
-        }
-
-        if (interf->tcp_nodelay) {
-            error = setsockopt(sfd, IPPROTO_TCP,
-                               TCP_NODELAY, (void *)&flags, sizeof(flags));
-            if (error != 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                "setsockopt(TCP_NODELAY): %s",
-                                                strerror(errno));
-            }
+        if (!set_server_socket_options(sfd, interf, next->ai_family)) {
+            safe_close(sfd);
+            continue;
         }
 
         if (bind(sfd, next->ai_addr, (socklen_t)next->ai_addrlen) == SOCKET_ERROR) {
@@ -6931,42 +9378,15 @@ static int server_socket(struct interface *interf, FILE *portnumber_file) {
                 freeaddrinfo(ai);
                 return 1;
             }
-            if (portnumber_file != NULL &&
-                (next->ai_addr->sa_family == AF_INET ||
-                 next->ai_addr->sa_family == AF_INET6)) {
-                union {
-                    struct sockaddr_in in;
-                    struct sockaddr_in6 in6;
-                } my_sockaddr;
-                socklen_t len = sizeof(my_sockaddr);
-                if (getsockname(sfd, (struct sockaddr*)&my_sockaddr, &len)==0) {
-                    if (next->ai_addr->sa_family == AF_INET) {
-                        fprintf(portnumber_file, "%s INET: %u\n", "TCP",
-                                ntohs(my_sockaddr.in.sin_port));
-                    } else {
-                        fprintf(portnumber_file, "%s INET6: %u\n", "TCP",
-                                ntohs(my_sockaddr.in6.sin6_port));
-                    }
-                }
-            }
+            save_port_number(sfd, portnumber_file);
         }
 
-        if (!(listen_conn_add = conn_new(sfd, interf->port, conn_listening,
-                                         EV_READ | EV_PERSIST, 1,
-                                         main_base, NULL))) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "failed to create listening connection\n");
-            exit(EXIT_FAILURE);
+        if (settings.reuseport) {
+            dispatch_reuseport_sockets(interf, next, sfd);
+            continue;
         }
-        listen_conn_add->next = listen_conn;
-        listen_conn = listen_conn_add;
-        STATS_LOCK();
-        ++stats.curr_conns;
-        ++stats.daemon_conns;
-        port_instance = get_listening_port_instance(interf->port);
-        cb_assert(port_instance);
-        ++port_instance->curr_conns;
-        STATS_UNLOCK();
+
+        add_listen_conn(interf, sfd);
     }
 
     freeaddrinfo(ai);
@@ -6979,15 +9399,189 @@ static int server_sockets(FILE *portnumber_file) {
     int ret = 0;
     int ii = 0;
 
+#ifndef SO_REUSEPORT
+    if (settings.reuseport) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "SO_REUSEPORT is not supported; "
+                                        "accepting all connections in "
+                                        "the dispatcher");
+        settings.reuseport = false;
+    }
+#endif
+
     for (ii = 0; ii < settings.num_interfaces; ++ii) {
-        stats.listening_ports[ii].port = settings.interfaces[ii].port;
-        stats.listening_ports[ii].maxconns = settings.interfaces[ii].maxconn;
-        ret |= server_socket(settings.interfaces + ii, portnumber_file);
+        struct interface *interf = settings.interfaces + ii;
+        bool adopted = false;
+        int jj;
+
+        stats.listening_ports[ii].port = interf->port;
+        stats.listening_ports[ii].maxconns = interf->maxconn;
+
+        /* Use the sockets of the previous server for it if it had any */
+        for (jj = 0; jj < hot_restart.nsfds; ++jj) {
+            if (hot_restart.sfds[jj] != INVALID_SOCKET &&
+                hot_restart.ports[jj] == interf->port) {
+                save_port_number(hot_restart.sfds[jj], portnumber_file);
+                add_listen_conn(interf, hot_restart.sfds[jj]);
+                hot_restart.sfds[jj] = INVALID_SOCKET;
+                adopted = true;
+            }
+        }
+        if (!adopted) {
+            ret |= server_socket(interf, portnumber_file);
+        }
+    }
+
+    /* The interfaces which are gone from the configuration */
+    for (ii = 0; ii < hot_restart.nsfds; ++ii) {
+        if (hot_restart.sfds[ii] != INVALID_SOCKET) {
+            settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+                                            "Closing the socket of port %u "
+                                            "of the previous server\n",
+                                            hot_restart.ports[ii]);
+            closesocket(hot_restart.sfds[ii]);
+            hot_restart.sfds[ii] = INVALID_SOCKET;
+        }
     }
 
     return ret;
 }
 
+static void hot_restart_drain_handler(evutil_socket_t fd, short which,
+                                      void *arg) {
+    struct timeval tv;
+    unsigned int conns;
+
+    STATS_LOCK();
+    conns = stats.curr_conns - stats.daemon_conns;
+    STATS_UNLOCK();
+
+    if (conns == 0 || time(NULL) >= hot_restart.deadline) {
+        settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
+                                        "Done draining (%u connections "
+                                        "left), shutting down\n", conns);
+        memcached_shutdown = 1;
+        event_base_loopbreak(main_base);
+        return;
+    }
+
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    evtimer_add(&hot_restart.drain, &tv);
+}
+
+/*
+ * A new server wants our listening sockets. Once it has them we stop
+ * accepting, and shut down when the connections we have are done.
+ */
+static void hot_restart_handler(evutil_socket_t fd, short which, void *arg) {
+    SOCKET sfds[HOT_RESTART_MAX_SOCKETS];
+    in_port_t ports[HOT_RESTART_MAX_SOCKETS];
+    int nsfds = 0;
+    conn *next;
+    SOCKET sfd = accept(fd, NULL, NULL);
+
+    if (sfd == INVALID_SOCKET) {
+        return;
+    }
+
+    for (next = listen_conn; next; next = next->next) {
+        if (nsfds == HOT_RESTART_MAX_SOCKETS) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "Too many listening sockets to "
+                                            "hand over, dropping the rest\n");
+            break;
+        }
+        sfds[nsfds] = next->sfd;
+        ports[nsfds] = next->parent_port;
+        ++nsfds;
+    }
+
+    if (!hot_restart_send(sfd, sfds, ports, nsfds)) {
+        closesocket(sfd);
+        return;
+    }
+    closesocket(sfd);
+
+    /* It listens on the path for the next one now */
+    event_del(&hot_restart.event);
+    closesocket(hot_restart.sfd);
+    hot_restart.sfd = INVALID_SOCKET;
+
+    /* The sockets stay open, so the backlog goes to the new server */
+    hot_restart.handed_off = true;
+    for (next = listen_conn; next; next = next->next) {
+        update_event(next, 0);
+    }
+
+    settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                    "Handed the listening sockets over to "
+                                    "a new server, draining the "
+                                    "connections for up to %d seconds\n",
+                                    settings.hot_restart_drain);
+    hot_restart.deadline = time(NULL) + settings.hot_restart_drain;
+    evtimer_set(&hot_restart.drain, hot_restart_drain_handler, NULL);
+    event_base_set(main_base, &hot_restart.drain);
+    hot_restart_drain_handler(INVALID_SOCKET, EV_TIMEOUT, NULL);
+}
+
+/*
+ * Get the listening sockets of the server we replace (if there is one
+ * running), before we create any of our own
+ */
+static void hot_restart_takeover(void) {
+    hot_restart.sfd = INVALID_SOCKET;
+    if (settings.hot_restart == NULL) {
+        return;
+    }
+
+    /* The workers have sockets of their own, which we can't hand over */
+    if (settings.reuseport) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "hot_restart is not supported "
+                                        "with reuseport, ignored\n");
+        settings.hot_restart = NULL;
+        return;
+    }
+
+    hot_restart.nsfds = hot_restart_receive(settings.hot_restart,
+                                            hot_restart.sfds,
+                                            hot_restart.ports,
+                                            HOT_RESTART_MAX_SOCKETS);
+    if (hot_restart.nsfds < 0) {
+        /* Not taking over, but the other server still runs */
+        exit(EX_OSERR);
+    }
+    if (hot_restart.nsfds > 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Took over %d listening sockets "
+                                        "from the previous server\n",
+                                        hot_restart.nsfds);
+    }
+}
+
+/* Let the next server take our listening sockets */
+static void hot_restart_enable(void) {
+    if (settings.hot_restart == NULL) {
+        return;
+    }
+
+    hot_restart.sfd = hot_restart_listen(settings.hot_restart);
+    if (hot_restart.sfd == INVALID_SOCKET) {
+        return;
+    }
+    event_set(&hot_restart.event, hot_restart.sfd, EV_READ | EV_PERSIST,
+              hot_restart_handler, NULL);
+    event_base_set(main_base, &hot_restart.event);
+    if (event_add(&hot_restart.event, NULL) == -1) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to add the hot restart "
+                                        "event\n");
+        closesocket(hot_restart.sfd);
+        hot_restart.sfd = INVALID_SOCKET;
+    }
+}
+
 
 
 
@@ -7001,7 +9595,9 @@ static void save_pid(const char *pid_file) {
             char buffer[1024];
             if (fgets(buffer, sizeof(buffer), fp) != NULL) {
                 unsigned int pid;
-                if (safe_strtoul(buffer, &pid) && kill((pid_t)pid, 0) == 0) {
+                /* The server we took over from still drains */
+                if (safe_strtoul(buffer, &pid) && kill((pid_t)pid, 0) == 0 &&
+                    hot_restart.nsfds == 0) {
                     settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
                                "WARNING: The pid file contained the following (running) pid: %u\n", pid);
                 }
@@ -7145,9 +9741,16 @@ static ENGINE_ERROR_CODE release_cookie(const void *cookie) {
     LIBEVENT_THREAD *thr;
 
     cb_assert(c);
-    thr = c->thread;
-    cb_assert(thr);
-    LOCK_THREAD(thr);
+    /* The TAP / DCP connections may move to a replication thread */
+    for (;;) {
+        thr = c->thread;
+        cb_assert(thr);
+        LOCK_THREAD(thr);
+        if (thr == c->thread) {
+            break;
+        }
+        UNLOCK_THREAD(thr);
+    }
     --c->refcount;
 
     /* Releasing the refererence to the object may cause it to change
@@ -7170,6 +9773,8 @@ static ENGINE_ERROR_CODE release_cookie(const void *cookie) {
 static void cookie_set_admin(const void *cookie) {
     cb_assert(cookie);
     ((conn *)cookie)->admin = true;
+    /* Its stats polls and maintenance shouldn't hold up the data traffic */
+    conn_set_priority((conn *)cookie, CONN_PRIORITY_LOW);
 }
 
 static bool cookie_is_admin(const void *cookie) {
@@ -7180,6 +9785,89 @@ static bool cookie_is_admin(const void *cookie) {
     return ((conn *)cookie)->admin;
 }
 
+static void *cookie_alloc_scratch(const void *cookie, size_t size) {
+    cb_assert(cookie);
+    return arena_alloc((conn *)cookie, size);
+}
+
+static bool cookie_send_item_response(const void *cookie, item *it,
+                                      uint64_t offset, uint32_t length,
+                                      uint64_t cas) {
+    conn *c = (conn *)cookie;
+    item_info_holder info;
+    uint64_t end = offset + length;
+    uint64_t pos = 0;
+    int ii;
+
+    cb_assert(c);
+    if (c->item != NULL) {
+        return false;
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.info.nvalue = IOV_MAX;
+    if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
+                                           (void*)&info) ||
+        end > (uint64_t)info.info.nbytes) {
+        return false;
+    }
+
+    c->cas = cas;
+    if (add_bin_header(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, 0, length,
+                       PROTOCOL_BINARY_RAW_BYTES) == -1) {
+        return false;
+    }
+
+    /* Only send the pieces of the value which overlap the range */
+    for (ii = 0; ii < info.info.nvalue && pos < end; ++ii) {
+        uint64_t len = info.info.value[ii].iov_len;
+        if (pos + len > offset) {
+            uint64_t skip = offset > pos ? offset - pos : 0;
+            uint64_t n = len - skip;
+            if (pos + len > end) {
+                n -= pos + len - end;
+            }
+            if (add_iov(c, (char*)info.info.value[ii].iov_base + skip,
+                        (size_t)n) != 0) {
+                return false;
+            }
+        }
+        pos += len;
+    }
+
+    conn_set_state(c, conn_mwrite);
+    /* Released when the response is sent */
+    c->item = it;
+    return true;
+}
+
+static void cookie_trace_point(const void *cookie, span_point_t point) {
+    if (cookie != NULL && point < SPAN_POINTS) {
+        span_mark((conn *)cookie, point);
+    }
+}
+
+static uint32_t cookie_get_key_hash(const void *cookie, const void *key,
+                                    size_t nkey) {
+    if (cookie == NULL) {
+        return hash(key, nkey, 0);
+    }
+    return conn_key_hash((conn *)cookie, key, nkey);
+}
+
+static int cookie_get_thread_index(const void *cookie) {
+    const conn *c = cookie;
+    if (c == NULL || c->thread == NULL || c->thread->index < 0 ||
+        c->thread->index >= settings.num_threads) {
+        return -1;
+    }
+    return c->thread->index;
+}
+
+static int get_num_threads(void) {
+    return settings.num_threads;
+}
+
 static void register_callback(ENGINE_HANDLE *eh,
                               ENGINE_EVENT_TYPE type,
                               EVENT_CALLBACK cb, const void *cb_data) {
@@ -7349,6 +10037,9 @@ static bool register_extension(extension_type_t type, void *extension)
         return true;
     case EXTENSION_LOGGER:
         settings.extensions.logger = extension;
+        if (settings.extensions.logger->log_limited == NULL) {
+            settings.extensions.logger->log_limited = log_limited;
+        }
         return true;
 
     case EXTENSION_BINARY_PROTOCOL:
@@ -7545,6 +10236,10 @@ static SERVER_HANDLE_V1 *get_server_api(void)
         core_api.parse_config = parse_config;
         core_api.shutdown = shutdown_server;
         core_api.get_config = get_config;
+        core_api.submit_task = executor_submit;
+        core_api.get_current_time_ms = mc_time_get_current_time_ms;
+        core_api.get_num_threads = get_num_threads;
+        core_api.item_changed = hot_cache_invalidate;
 
         server_cookie_api.get_auth_data = get_auth_data;
         server_cookie_api.store_engine_specific = store_engine_specific;
@@ -7555,10 +10250,16 @@ static SERVER_HANDLE_V1 *get_server_api(void)
         server_cookie_api.decrement_session_ctr = decrement_session_ctr;
         server_cookie_api.get_socket_fd = get_socket_fd;
         server_cookie_api.notify_io_complete = notify_io_complete;
+        server_cookie_api.notify_io_complete_batch = notify_io_complete_batch;
         server_cookie_api.reserve = reserve_cookie;
         server_cookie_api.release = release_cookie;
         server_cookie_api.set_admin = cookie_set_admin;
         server_cookie_api.is_admin = cookie_is_admin;
+        server_cookie_api.alloc_scratch = cookie_alloc_scratch;
+        server_cookie_api.get_thread_index = cookie_get_thread_index;
+        server_cookie_api.send_item_response = cookie_send_item_response;
+        server_cookie_api.trace_point = cookie_trace_point;
+        server_cookie_api.get_key_hash = cookie_get_key_hash;
 
         server_stat_api.new_stats = new_independent_stats;
         server_stat_api.release_stats = release_independent_stats;
@@ -7584,6 +10285,10 @@ static SERVER_HANDLE_V1 *get_server_api(void)
         hooks_api.get_allocation_size = mc_get_allocation_size;
         hooks_api.get_detailed_stats = mc_get_detailed_stats;
         hooks_api.release_free_memory = mc_release_free_memory;
+        hooks_api.enter_account = mc_enter_account;
+        hooks_api.leave_account = mc_leave_account;
+        hooks_api.create_arena = mc_create_arena;
+        hooks_api.release_arena = mc_release_arena;
 
         rv.interface = 1;
         rv.core = &core_api;
@@ -7892,6 +10597,20 @@ static void set_max_filehandles(void) {
 
 #endif
 
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+/*
+ * OpenSSL 1.1.0 and later initialize themselves and do their own locking
+ * (with rwlocks where they can), so all we have to do is to load the
+ * configuration (which may load a crypto engine or provider for
+ * ssl_async) and the error strings.
+ */
+static void initialize_openssl(void) {
+    OPENSSL_init_ssl(OPENSSL_INIT_LOAD_CONFIG |
+                     OPENSSL_INIT_LOAD_SSL_STRINGS |
+                     OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL);
+    ssl_context_init();
+}
+#else
 static cb_mutex_t *openssl_lock_cs;
 
 static unsigned long get_thread_id(void) {
@@ -7923,7 +10642,9 @@ static void initialize_openssl(void) {
 
     CRYPTO_set_id_callback((unsigned long (*)())get_thread_id);
     CRYPTO_set_locking_callback((void (*)())openssl_locking_callback);
+    ssl_context_init();
 }
+#endif
 
 static void calculate_maxconns(void) {
     int ii;
@@ -7938,13 +10659,12 @@ int main (int argc, char **argv) {
 
     initialize_openssl();
 
-    initialize_timings();
-
     /* Initialize global variables */
     cb_mutex_initialize(&listen_state.mutex);
     cb_mutex_initialize(&tap_stats.mutex);
     cb_mutex_initialize(&stats_lock);
     cb_mutex_initialize(&session_cas.mutex);
+    cb_mutex_initialize(&slow_op_log.mutex);
 
     session_cas.value = 0xdeadbeef;
     session_cas.ctr = 0;
@@ -7973,6 +10693,26 @@ int main (int argc, char **argv) {
     /* Parse command line arguments */
     parse_arguments(argc, argv);
 
+    /* Before anybody hashes anything */
+    if (!hash_init(settings.hash_algorithm)) {
+        fprintf(stderr, "Unknown (or unsupported) hash_algorithm: %s\n",
+                settings.hash_algorithm);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Before the worker threads and the engines want theirs */
+    if (settings.jemalloc_arenas &&
+        !mc_enable_arenas(settings.jemalloc_tcache)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "jemalloc_arenas needs a server "
+                                        "built with jemalloc, ignored\n");
+        settings.jemalloc_arenas = false;
+    }
+
+    /* Before anyone registers their locks (the engines too) */
+    mc_mutex_stats_init((unsigned int)settings.lock_stats_sample);
+    mc_mutex_stats_register(&stats_lock_stats, "stats");
+
     set_max_filehandles();
 
     if (getenv("MEMCACHED_REQS_TAP_EVENT") != NULL) {
@@ -7997,6 +10737,9 @@ int main (int argc, char **argv) {
 
     cbsasl_server_init();
 
+    /* Before the engine, which may hand it work as soon as it's created */
+    executor_init(settings.executor_threads);
+
     /* initialize main thread libevent instance */
     main_base = event_base_new();
 
@@ -8023,11 +10766,22 @@ int main (int argc, char **argv) {
         settings.engine.v1->arithmetic = internal_arithmetic;
     }
 
+    /* The same key may live in every bucket, and we'd mix them up */
+    if (settings.hot_cache > 0 &&
+        strstr(settings.engine_module, "bucket_engine") != NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "The hot item cache is not supported with the bucket engine");
+        settings.hot_cache = 0;
+    }
+
     setup_not_supported_handlers();
 
     /* initialize other stuff */
     stats_init();
 
+    /* Every worker, and the dispatcher */
+    initialize_timings(settings.num_threads + 2);
+
     default_independent_stats = new_independent_stats();
 
 #ifndef WIN32
@@ -8081,9 +10835,11 @@ int main (int argc, char **argv) {
             }
         }
 
+        hot_restart_takeover();
         if (server_sockets(portnumber_file)) {
             exit(EX_OSERR);
         }
+        hot_restart_enable();
 
         if (portnumber_file) {
             fclose(portnumber_file);
@@ -8116,11 +10872,21 @@ int main (int argc, char **argv) {
 
     settings.engine.v1->destroy(settings.engine.v0, false);
 
+    /* After the engine, which may wait for its tasks to finish */
+    executor_shutdown();
+
     threads_cleanup();
 
     /* remove the PID file if we're a daemon */
 #ifndef WIN32
-    if (settings.daemonize)
+    /* Nobody is going to take over from us */
+    if (hot_restart.sfd != INVALID_SOCKET) {
+        closesocket(hot_restart.sfd);
+        unlink(settings.hot_restart);
+    }
+
+    /* Unless the server we handed over to wrote its own over it */
+    if (settings.daemonize && !hot_restart.handed_off)
         remove_pidfile(settings.pid_file);
 #endif
 
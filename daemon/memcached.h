@@ -12,6 +12,11 @@
 
 #include <memcached/openssl.h>
 
+/* Handing the TLS sessions to the kernel (see ktls) takes OpenSSL 3.0 */
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define HAVE_KTLS 1
+#endif
+
 #include <memcached/protocol_binary.h>
 #include <memcached/engine.h>
 #include <memcached/extension.h>
@@ -25,7 +30,6 @@
 #define INCR_MAX_STORAGE_LEN 24
 
 #define DATA_BUFFER_SIZE 2048
-#define UDP_MAX_PAYLOAD_SIZE 1400
 #define MAX_SENDBUF_SIZE (256 * 1024 * 1024)
 
 /** Initial size of list of items being returned by "get". */
@@ -94,10 +98,11 @@ struct slab_stats {
 };
 
 /**
- * Stats stored per-thread.
+ * Stats stored per-thread. Only the thread a slot belongs to updates it,
+ * so it does so without a lock; whoever reads the other slots may see a
+ * count which is a bit behind.
  */
 struct thread_stats {
-    cb_mutex_t   mutex;
     uint64_t          cmd_get;
     uint64_t          get_misses;
     uint64_t          delete_misses;
@@ -127,6 +132,19 @@ struct thread_stats {
     uint64_t          iovused_high_watermark;
     /* High value conn->msgused has got to */
     uint64_t          msgused_high_watermark;
+    /* # of gets served from (and items let into) the hot item cache */
+    uint64_t          hot_cache_hits;
+    uint64_t          hot_cache_admits;
+    uint64_t          compressed_responses;
+    uint64_t          inflated_responses;
+    uint64_t          hot_cache_inflated_hits;
+    uint64_t          zerocopy_sends;
+    /* # of responses held back to go out with the next one */
+    uint64_t          responses_coalesced;
+    /* # of times we stopped taking requests until the responses drained */
+    uint64_t          conn_backpressure;
+    /* # of requests which took longer than slow_op_threshold */
+    uint64_t          slow_ops;
     struct slab_stats slab_stats[MAX_NUMBER_OF_SLAB_CLASSES];
 };
 
@@ -148,6 +166,7 @@ struct stats {
     unsigned int  curr_conns;
     unsigned int  total_conns;
     unsigned int  conn_structs;
+    unsigned int  hibernated_conns;
     time_t        started;          /* when the process was started */
     uint64_t      rejected_conns; /* number of times I reject a client */
     struct listening_port *listening_ports;
@@ -167,6 +186,25 @@ struct interface {
     bool ipv6;
     bool ipv4;
     bool tcp_nodelay;
+    char *path;     /* Unix socket to listen on (instead of host:port) */
+    int priority;   /* of the connections to it (see conn_set_priority) */
+    char *thread_group; /* name of the thread group running its clients */
+    int group;      /* index of that group (-1 for the default workers) */
+    int defer_accept; /* seconds we let a connect wait for its first data */
+    int fastopen;   /* # of pending TCP Fast Open connects (0 for none) */
+    bool cork;      /* send the responses spanning msghdrs as full packets */
+};
+
+/**
+ * Some of the client workers set apart for the connections to the
+ * interfaces naming it (so that a batch load can't starve the others).
+ */
+struct thread_group {
+    char *name;
+    int threads;    /* # of workers taken from the client workers */
+    int *cpus;      /* the CPUs they run on (any if there are none) */
+    int ncpus;
+    int busy_poll;  /* usec they spin for work before they block */
 };
 
 /* When adding a setting, be sure to update process_stat_settings */
@@ -208,6 +246,42 @@ struct settings {
     char *admin;
     bool disable_admin;
     bool datatype;
+    bool numa;              /* pin the worker threads to NUMA nodes */
+    int hot_cache;          /* # of hot items cached in every worker thread */
+    int hot_cache_ttl;      /* # of milliseconds we may serve a hot item */
+    int compress_responses; /* smallest value we compress for snappy clients */
+    bool json_detect;       /* look for JSON in the raw values of all clients */
+    bool reuseport;         /* accept on a SO_REUSEPORT socket per worker */
+    int zerocopy_threshold; /* smallest value we send with MSG_ZEROCOPY */
+    int coalesce_responses; /* most bytes of responses we hold back */
+    int event_time_slice;   /* # of usec for a round of the runnable conns */
+    int executor_threads;   /* # of threads running the blocking work */
+    bool ktls;              /* let the kernel do the TLS of the SSL ports */
+    int ssl_session_cache;  /* number of TLS sessions to keep per interface */
+    int ssl_session_timeout; /* seconds we may resume a TLS session */
+    int ssl_ticket_rotation; /* seconds between new session ticket keys */
+    bool ssl_thread_contexts; /* an SSL context per interface and thread */
+    bool ssl_async;         /* let the crypto engine work asynchronously */
+    int buffer_pool_low;    /* free network buffers a thread tops up to */
+    int buffer_pool_high;   /* free network buffers a thread keeps at most */
+    int idle_hibernate;     /* seconds idle before we free most of a conn */
+    int max_pending_output; /* most bytes of responses a conn may queue */
+    int replication_threads; /* workers running the TAP / DCP connections */
+    int replication_nice;   /* nice value of the replication threads */
+    struct thread_group *thread_groups;
+    int num_thread_groups;
+    bool port_timings;      /* keep the timings of every port apart too */
+    int slow_op_threshold;  /* ms a request may take before we log it */
+    int stats_aggregate_interval; /* ms the sums of the thread stats last */
+    int lock_stats_sample;  /* time one of every this many lock waits */
+    char *hash_algorithm;   /* the hash function (see hash_init) */
+    bool request_trace;     /* give the logger a record of every request */
+    int trace_sample_rate;  /* keep the span of one in this many requests */
+    int trace_ring_size;    /* # of spans every worker keeps until drained */
+    bool jemalloc_arenas;   /* arenas for the worker threads and engines */
+    bool jemalloc_tcache;   /* keep the thread caches (with the arenas) */
+    char *hot_restart;      /* Unix socket to hand the listening sockets over */
+    int hot_restart_drain;  /* # of seconds the old server serves for after */
 };
 
 struct engine_event_handler {
@@ -235,27 +309,74 @@ struct net_buf {
     uint32_t bytes; /** how much data, starting from curr, do we have unparsed */
 };
 
+/*
+ * The priorities of the connections on the workers, in the order the
+ * workers run the ones which are ready (the data traffic goes before the
+ * admin and replication connections)
+ */
+#define CONN_PRIORITY_HIGH 0
+#define CONN_PRIORITY_LOW 1
+#define CONN_PRIORITIES 2
+
 typedef struct {
     cb_thread_t thread_id;      /* unique ID of this thread */
     struct event_base *base;    /* libevent handle this thread uses */
     struct event notify_event;  /* listen event for notify pipe */
     SOCKET notify[2];           /* notification pipes */
+    volatile int notified;      /* Notified and not woken up since */
     struct conn_queue *new_conn_queue; /* queue of new connections to handle */
-    cb_mutex_t mutex;      /* Mutex to lock protect access to the pending_io */
+    cb_mutex_t mutex;      /* Held while it runs its connections */
     bool is_locked;
-    struct conn *pending_io;    /* List of connection with pending async io ops */
+    /* The connections with pending async io ops, oldest first (only the
+     * thread itself looks at it; see take_pending_io) */
+    struct conn *pending_io;
+    struct conn *pending_io_tail;
+    /* Where the other threads push them onto (see add_conn_to_pending_io_list) */
+    struct conn * volatile pending_notify;
     int index;                  /* index of this thread in the threads array */
     enum thread_type type;      /* Type of IO this thread processes */
+    int numa_node;              /* The NUMA node it runs on (with numa) */
+    int group;                  /* Its thread group (-1 if none) */
+    struct hot_cache *hot_cache; /* The hot items (with hot_cache) */
+    struct span_ring *spans;    /* The sampled spans (with trace_sample_rate) */
+    int span_countdown;         /* # of requests until we sample one */
+    struct conn *listen_conn;   /* Its own listening sockets (with reuseport) */
+    volatile int nconns;        /* # of connections given to it */
+    /* Takes no new connections, and its clients move away (see
+     * threads_set_active) */
+    volatile bool retired;
+    volatile hrtime_t busy;     /* ns spent running its connections */
+    /* The busy time per second at the last sample (see dispatch_conn_new) */
+    hrtime_t busy_sampled;
+    rel_time_t busy_sampled_at;
+    hrtime_t recent_busy;
+    uint64_t requests;          /* # of requests its connections started */
+    hrtime_t req_cost;          /* ns per request (moving average) */
+    volatile int reqs_per_event; /* The budget of the last connection run */
+    hrtime_t now;               /* The clock it read last (see thread_clock) */
+
+    /* How its event loop is doing (see threads_worker_stats) */
+    struct {
+        hrtime_t started;       /* When it started running it */
+        uint64_t loops;         /* # of times it woke up */
+        uint64_t callbacks;     /* # of callbacks it ran */
+        hrtime_t max_callback;  /* ns the longest of them took */
+        int pending_io;         /* # of conns it ran on the last notification */
+        int max_pending_io;
+        uint64_t spins;         /* # of times it spun for work (busy_poll) */
+        uint64_t spin_hits;     /* # of those which found some */
+        hrtime_t spinning;      /* ns it spent spinning */
+    } loop;
 
     rel_time_t last_checked;
 
-    struct net_buf read; /** Shared read buffer for all connections serviced by this thread. */
-    struct net_buf write; /** Shared write buffer for all connections serviced by this thread. */
+    /** The read and write buffers it loans to its connections */
+    struct net_buf_pool *buffers;
 
 } LIBEVENT_THREAD;
 
 #define LOCK_THREAD(t)                          \
-    cb_mutex_enter(&t->mutex);                  \
+    mc_mutex_enter(&t->mutex, &thread_lock_stats); \
     cb_assert(t->is_locked == false);              \
     t->is_locked = true;
 
@@ -267,38 +388,103 @@ typedef struct {
 extern void notify_thread(LIBEVENT_THREAD *thread);
 extern void notify_dispatcher(void);
 extern bool create_notification_pipe(LIBEVENT_THREAD *me);
+extern ssize_t read_notifications(SOCKET fd);
 
 typedef struct conn conn;
 typedef bool (*STATE_FUNC)(conn *);
 
 
+/**
+ * The SSL state of a connection to an SSL port
+ */
+struct conn_ssl {
+    struct {
+        char *buffer;
+        int buffsz;
+        int total;
+        int current;
+    } in, out;
+
+    bool error;
+    SSL_CTX *ctx;
+    SSL *client;
+
+    bool connected;
+    BIO *application;
+    BIO *network;
+    /* SSL reads and writes the socket itself (instead of the BIO pair),
+     * which it does with ktls */
+    bool socket_bio;
+    /* The kernel encrypts what we send / decrypts what we read */
+    bool ktls_send;
+    bool ktls_recv;
+#ifdef SSL_MODE_ASYNC
+    /* Waits for the crypto engine to finish its job (with ssl_async) */
+    struct event async_event;
+    bool async_waiting;
+#endif
+};
+
 /**
  * The structure representing a connection into memcached.
+ *
+ * The fields the state machine touches for every request come first, so
+ * that they fit in the first two cache lines (tests/sizes.c checks it).
+ * The ones only used by some of the connections (SSL, TAP / DCP, SASL)
+ * or only once in a while go at the end or behind a pointer.
  */
 struct conn {
-    conn* all_next; /** Intrusive list to track all connections */
-    conn* all_prev;
+    /* -- hot: used by every request -- */
+    STATE_FUNC   state;
+    struct net_buf read; /** Read buffer */
+    struct net_buf write; /* Write buffer */
+
+    /* Binary protocol stuff */
+    /* This is where the binary header goes */
+    protocol_binary_request_header binary_header;
+
+    /* data for the mwrite state */
+    struct iovec *iov;
+    int    iovsize;   /* number of elements allocated in iov[] */
+    int    iovused;   /* number of elements used in iov[] */
+
+    struct msghdr *msglist;
+    int    msgsize;   /* number of elements allocated in msglist[] */
+    int    msgused;   /* number of elements used in msglist[] */
+    int    msgcurr;   /* element in msglist[] being transmitted now */
+    int    msgbytes;  /* number of bytes in current msg */
 
     SOCKET sfd;
     int nevents; /** number of events this connection can process in a single
                      worker thread timeslice */
-    bool admin;
-    cbsasl_conn_t *sasl_conn;
-    STATE_FUNC   state;
+
+    /* -- warm: used by most requests -- */
     enum bin_substates substate;
-    bool   registered_in_libevent;
-    struct event event;
+    short cmd; /* current command being processed */
     short  ev_flags;
     short  which;   /** which events were just triggered */
-    struct net_buf read; /** Read buffer */
-    struct net_buf write; /* Write buffer */
+    bool   noreply;   /* True if the reply should not be sent. */
+    bool ewouldblock;
+    int opaque;
+    int keylen;
+    /* The key of the request we hashed last and its hash (see
+     * conn_key_hash) */
+    struct {
+        const void *key;
+        uint32_t hash;
+        uint16_t nkey;
+    } key_hash;
+    uint64_t cas; /* the cas to return */
+    LIBEVENT_THREAD *thread; /* Pointer to the thread object serving this connection */
+    ENGINE_ERROR_CODE aiostat;
 
     /** which state to go into after finishing current write */
     STATE_FUNC   write_and_go;
-    void   *write_and_free; /** free this memory after finishing writing */
 
     char   *ritem;  /** when we read in an item's value, it goes here */
     uint32_t rlbytes;
+    /* data for the swallow state */
+    uint32_t sbytes;    /* how many bytes to swallow */
 
     /* data for the nread state */
 
@@ -309,22 +495,18 @@ struct conn {
      */
 
     void   *item;     /* for commands set/add/replace  */
+    /* The hot item we're sending (in place of item) */
+    struct hot_cache_entry *hot_item;
     ENGINE_STORE_OPERATION    store_op; /* which one is it: set/add/replace */
 
-
-    /* data for the swallow state */
-    uint32_t sbytes;    /* how many bytes to swallow */
-
-    /* data for the mwrite state */
-    struct iovec *iov;
-    int    iovsize;   /* number of elements allocated in iov[] */
-    int    iovused;   /* number of elements used in iov[] */
-
-    struct msghdr *msglist;
-    int    msgsize;   /* number of elements allocated in msglist[] */
-    int    msgused;   /* number of elements used in msglist[] */
-    int    msgcurr;   /* element in msglist[] being transmitted now */
-    int    msgbytes;  /* number of bytes in current msg */
+    /**
+     * The rest of the pieces of the item's value if the engine didn't give
+     * us one contiguous piece (ritem is set to each of them in turn)
+     */
+    struct iovec *riov;
+    int    riovsize;  /* number of elements allocated in riov[] */
+    int    riovused;  /* number of elements used in riov[] */
+    int    riovcurr;  /* element in riov[] to read into next */
 
     item   **ilist;   /* list of items to write out */
     int    isize;
@@ -336,68 +518,98 @@ struct conn {
     char   **temp_alloc_curr;
     int    temp_alloc_left;
 
-    struct sockaddr_storage request_addr; /* Who sent the most recent request */
-    socklen_t request_addr_size;
     int    hdrsize;   /* number of headers' worth of space is allocated */
 
-    bool   noreply;   /* True if the reply should not be sent. */
-    /* current stats command */
-
-    uint8_t refcount; /* number of references to the object */
-    bool   supports_datatype;
-
+    /*
+     * The responses we've held back to send along with the response to
+     * the next request already in the read buffer (see coalesce_responses)
+     */
     struct {
-        char *buffer;
+        char *buf;
         size_t size;
-        size_t offset;
-    } dynamic_buffer;
+        size_t bytes;
+    } coalesced;
+    /* We've looked at the response in conn_mwrite and started sending it */
+    bool   write_prepared;
+
+    /* The values we sent with MSG_ZEROCOPY (see zerocopy.h) */
+    bool   zerocopy;
+    /* Hold back the packets of a response with more msghdrs to come */
+    bool   cork;
+    uint32_t zerocopy_sent;
+    uint32_t zerocopy_done;
+    struct zerocopy_hold *zerocopy_held;
 
     void *engine_storage;
     hrtime_t start;
+    /* The phases of the last request (with slow_op_threshold) */
+    struct {
+        hrtime_t start;     /* 0 unless its response is on its way */
+        hrtime_t engine;    /* we had all of it and ran it (or 0) */
+        hrtime_t response;  /* its response was ready */
+        uint16_t keylen;
+        uint8_t cmd;
+    } slow_op;
+    /* What goes in the record of the request (with request_trace) */
+    struct {
+        uint32_t key_hash;
+        uint16_t status;
+    } trace;
+    /* The span of the request (if trace_sample_rate sampled it) */
+    struct {
+        bool sampled;
+        uint8_t opcode;
+        hrtime_t start;
+        uint32_t points[SPAN_POINTS];
+    } span;
 
-    /* Binary protocol stuff */
-    /* This is where the binary header goes */
-    protocol_binary_request_header binary_header;
-    uint64_t cas; /* the cas to return */
-    short cmd; /* current command being processed */
-    int opaque;
-    int keylen;
+    /* -- cold: connection setup, teardown and the rarer subsystems -- */
+    bool admin;
+    /* The libevent priority of its event (see conn_set_priority) */
+    int priority;
+    bool   registered_in_libevent;
+    /** Idle with most of its memory freed (see conn_hibernate) */
+    bool   hibernated;
+    uint8_t refcount; /* number of references to the object */
+    bool   supports_datatype;
+    /* Asked for compressed values through HELLO (see compress_responses) */
+    bool   supports_compression;
+    in_port_t parent_port; /* Listening port that creates this connection instance */
+    /* The timings of the bucket it authenticated to, and of its port */
+    struct timings_group *bucket_timings;
+    struct timings_group *port_timings;
+    struct event event;
 
-    int list_state; /* bitmask of list state data for this connection */
+    volatile int io_pending; /* On the pending io of its thread */
     conn   *next;     /* Used for generating a list of conn structures */
-    LIBEVENT_THREAD *thread; /* Pointer to the thread object serving this connection */
+    conn   *pending_prev; /* The one before it on pending_io */
 
-    ENGINE_ERROR_CODE aiostat;
-    bool ewouldblock;
+    cbsasl_conn_t *sasl_conn;
     TAP_ITERATOR tap_iterator;
-    in_port_t parent_port; /* Listening port that creates this connection instance */
-
     int dcp;
+    /* The bytes a DCP consumer lets us send before it acknowledges them
+     * (0 if it doesn't do flow control), and the ones it hasn't yet */
+    uint32_t dcp_window;
+    uint32_t dcp_unacked;
 
-    /* Clean up this at one point.. */
+    /* The response we build piece by piece, in the arena */
     struct {
-        struct {
-            char *buffer;
-            int buffsz;
-            int total;
-            int current;
-        } in, out;
-
-        bool enabled;
-        bool error;
-        SSL_CTX *ctx;
-        SSL *client;
-
-        bool connected;
-        BIO *application;
-        BIO *network;
-    } ssl;
-};
+        char *buffer;
+        size_t size;
+        size_t offset;
+    } dynamic_buffer;
+    /* The scratch memory of the current request (see arena.h) */
+    struct arena_block *arena;
+
+    /* Set for the connections to an SSL port */
+    struct conn_ssl *ssl;
 
-/* States for the connection list_state */
-#define LIST_STATE_PROCESSING 1
-#define LIST_STATE_REQ_PENDING_IO 2
-#define LIST_STATE_REQ_PENDING_CLOSE 4
+    struct sockaddr_storage request_addr; /* Who sent the most recent request */
+    socklen_t request_addr_size;
+
+    conn* all_next; /** Intrusive list to track all connections */
+    conn* all_prev;
+};
 
 /*
  * Functions
@@ -412,10 +624,14 @@ extern int daemonize(int nochdir, int noclose);
 #include "hash.h"
 #include <memcached/util.h>
 
+/* The contention of the thread mutexes (see LOCK_THREAD) */
+extern mc_mutex_stats_t thread_lock_stats;
+
 /*
  * Functions to add / update the connection to libevent
  */
-bool register_event(conn *c, struct timeval *timeout);
+bool register_event(conn *c, const struct timeval *timeout);
+const struct timeval *idle_timeout(conn *c, int flags);
 bool unregister_event(conn *c);
 bool update_event(conn *c, const int new_flags);
 
@@ -435,6 +651,27 @@ int  dispatch_event_add(int thread, conn *c);
 void dispatch_conn_new(SOCKET sfd, int parent_port,
                        STATE_FUNC init_state, int event_flags,
                        int read_buffer_size);
+void dispatch_listen_conn(SOCKET sfd, int parent_port, int tid);
+int thread_group_of(int tid);
+void dispatch_conn_move(conn *c);
+bool thread_conn_new(LIBEVENT_THREAD *me, SOCKET sfd, int parent_port,
+                     STATE_FUNC init_state, int event_flags,
+                     int read_buffer_size);
+void notify_listening_threads(void);
+void thread_conn_released(LIBEVENT_THREAD *me);
+void thread_update_listen(LIBEVENT_THREAD *me);
+int thread_reqs_per_event(LIBEVENT_THREAD *me);
+void thread_event_done(LIBEVENT_THREAD *me, uint64_t requests,
+                       hrtime_t elapsed);
+void threads_event_budget(uint64_t *req_cost, uint64_t *reqs_per_event);
+void threads_worker_stats(ADD_STAT add_stats, conn *c);
+void threads_span_stats(ADD_STAT add_stats, conn *c);
+bool thread_span_sample(LIBEVENT_THREAD *me);
+void span_mark(conn *c, span_point_t point);
+bool threads_set_active(int count);
+int threads_active(void);
+hrtime_t thread_clock(LIBEVENT_THREAD *me);
+hrtime_t thread_clock_update(LIBEVENT_THREAD *me);
 
 /* Lock wrappers for cache functions that are called from main loop. */
 void accept_new_conns(const bool do_accept);
@@ -454,24 +691,20 @@ void append_stat(const char *name, ADD_STAT add_stats, conn *c,
                  const char *fmt, ...);
 
 void notify_io_complete(const void *cookie, ENGINE_ERROR_CODE status);
+void notify_io_complete_batch(const io_completion_t *completions,
+                              size_t count);
 void conn_set_state(conn *c, STATE_FUNC state);
 const char *state_text(STATE_FUNC state);
 void safe_close(SOCKET sfd);
 
 
-/* Number of times this connection is in the given pending list */
-int number_of_pending(conn *c, conn *pending);
 bool has_cycle(conn *c);
-bool list_contains(conn *h, conn *n);
-conn *list_remove(conn *h, conn *n);
-size_t list_to_array(conn **dest, size_t max_items, conn **l);
-void enlist_conn(conn *c, conn **list);
-void finalize_list(conn **list, size_t items);
 bool set_socket_nonblocking(SOCKET sfd);
 
 bool load_extension(const char *soname, const char *config);
 
 int add_conn_to_pending_io_list(conn *c);
+void remove_pending_io(conn *c);
 
 extern void drop_privileges(void);
 
@@ -490,9 +723,15 @@ bool conn_closing(conn *c);
 bool conn_destroyed(conn *c);
 bool conn_mwrite(conn *c);
 bool conn_ship_log(conn *c);
+bool conn_move_thread(conn *c);
+bool conn_leave_thread(conn *c);
+void conn_set_priority(conn *c, int priority);
+int interface_priority(in_port_t port);
+bool interface_cork(in_port_t port);
 bool conn_setup_tap_stream(conn *c);
 bool conn_refresh_cbsasl(conn *c);
 bool conn_refresh_ssl_certs(conn *c);
+bool conn_sasl_auth(conn *c);
 
 void event_handler(evutil_socket_t fd, short which, void *arg);
 
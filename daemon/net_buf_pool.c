@@ -0,0 +1,170 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The per thread pool of network buffers (see net_buf_pool.h)
+ */
+#include "config.h"
+#include "net_buf_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* DATA_BUFFER_SIZE up to 32 times it */
+#define NET_BUF_CLASSES 6
+
+/* How often we top the classes up to their low watermark */
+#define NET_BUF_REFILL_USEC 100000
+
+struct net_buf_class {
+    /* The free buffers */
+    char **free;
+    int nfree;
+    int low;
+    int high;
+};
+
+struct net_buf_pool {
+    struct net_buf_class classes[NET_BUF_CLASSES];
+    struct timeval refill_interval;
+    struct event refill_event;
+};
+
+static uint32_t class_size(int clsid) {
+    return (uint32_t)DATA_BUFFER_SIZE << clsid;
+}
+
+/* The class of a size, or -1 if it isn't one of ours */
+static int size_class(uint32_t size) {
+    int ii;
+    for (ii = 0; ii < NET_BUF_CLASSES; ++ii) {
+        if (class_size(ii) == size) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+static void refill(struct net_buf_pool *pool) {
+    int ii;
+
+    for (ii = 0; ii < NET_BUF_CLASSES; ++ii) {
+        struct net_buf_class *cls = &pool->classes[ii];
+        while (cls->nfree < cls->low) {
+            char *buf = malloc(class_size(ii));
+            if (buf == NULL) {
+                /* Try again with the next refill */
+                return;
+            }
+            cls->free[cls->nfree++] = buf;
+        }
+    }
+}
+
+static void refill_handler(evutil_socket_t fd, short which, void *arg) {
+    struct net_buf_pool *pool = arg;
+    refill(pool);
+    evtimer_add(&pool->refill_event, &pool->refill_interval);
+}
+
+struct net_buf_pool *net_buf_pool_create(struct event_base *base,
+                                         int low, int high) {
+    struct net_buf_pool *pool = calloc(1, sizeof(*pool));
+    int ii;
+
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    if (low > high) {
+        low = high;
+    }
+
+    for (ii = 0; ii < NET_BUF_CLASSES; ++ii) {
+        struct net_buf_class *cls = &pool->classes[ii];
+        cls->low = low >> ii;
+        cls->high = high >> ii;
+        if (cls->high == 0 && high > 0) {
+            cls->high = 1;
+        }
+        if (cls->high > 0) {
+            cls->free = calloc(cls->high, sizeof(char *));
+            if (cls->free == NULL) {
+                net_buf_pool_destroy(pool);
+                return NULL;
+            }
+        }
+    }
+    refill(pool);
+
+    pool->refill_interval.tv_sec = 0;
+    pool->refill_interval.tv_usec = NET_BUF_REFILL_USEC;
+    evtimer_set(&pool->refill_event, refill_handler, pool);
+    event_base_set(base, &pool->refill_event);
+    evtimer_add(&pool->refill_event, &pool->refill_interval);
+
+    return pool;
+}
+
+void net_buf_pool_destroy(struct net_buf_pool *pool) {
+    int ii;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    if (evtimer_initialized(&pool->refill_event)) {
+        evtimer_del(&pool->refill_event);
+    }
+    for (ii = 0; ii < NET_BUF_CLASSES; ++ii) {
+        struct net_buf_class *cls = &pool->classes[ii];
+        while (cls->nfree > 0) {
+            free(cls->free[--cls->nfree]);
+        }
+        free(cls->free);
+    }
+    free(pool);
+}
+
+char *net_buf_pool_get(struct net_buf_pool *pool, uint32_t size,
+                       bool *allocated) {
+    int clsid = size_class(size);
+
+    if (clsid != -1 && pool->classes[clsid].nfree > 0) {
+        struct net_buf_class *cls = &pool->classes[clsid];
+        *allocated = false;
+        return cls->free[--cls->nfree];
+    }
+
+    *allocated = true;
+    return malloc(size);
+}
+
+void net_buf_pool_put(struct net_buf_pool *pool, char *buf, uint32_t size) {
+    int clsid = size_class(size);
+
+    if (clsid != -1) {
+        struct net_buf_class *cls = &pool->classes[clsid];
+        if (cls->nfree < cls->high) {
+            cls->free[cls->nfree++] = buf;
+            return;
+        }
+    }
+    free(buf);
+}
+
+char *net_buf_pool_resize(struct net_buf_pool *pool, char *buf,
+                          uint32_t size, uint32_t nsize) {
+    bool allocated;
+    char *nbuf;
+
+    if (size_class(nsize) == -1) {
+        /* Let the allocator grow it in place if it can */
+        return realloc(buf, nsize);
+    }
+
+    nbuf = net_buf_pool_get(pool, nsize, &allocated);
+    if (nbuf != NULL) {
+        memcpy(nbuf, buf, size < nsize ? size : nsize);
+        net_buf_pool_put(pool, buf, size);
+    }
+    return nbuf;
+}
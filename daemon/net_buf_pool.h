@@ -0,0 +1,72 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef NET_BUF_POOL_H
+#define NET_BUF_POOL_H
+
+#include "memcached.h"
+
+/*
+ * The read and write buffers every worker thread loans to the connections
+ * it runs. The buffers come in a few size classes (DATA_BUFFER_SIZE and
+ * the powers of two above it, which is what the read buffers grow to),
+ * and every class keeps a stack of free buffers. A timer of the thread
+ * tops the classes up to their low watermark, so that taking a buffer
+ * doesn't have to go to the allocator, and a buffer handed back to a
+ * class at its high watermark is freed (see the buffer_pool_low and
+ * buffer_pool_high settings). The watermarks are halved for every class
+ * above the smallest one.
+ *
+ * Everything belongs to the thread the pool was created for.
+ */
+
+struct net_buf_pool;
+
+/**
+ * Create the pool of a worker thread, filled up to the low watermarks
+ * @param base the event base of the thread (for the refill timer)
+ * @param low the low watermark of the smallest class
+ * @param high the high watermark of the smallest class
+ * @return the pool or NULL if we failed to allocate it
+ */
+struct net_buf_pool *net_buf_pool_create(struct event_base *base,
+                                         int low, int high);
+
+/**
+ * Release a pool and all of the free buffers in it
+ * @param pool the pool to release
+ */
+void net_buf_pool_destroy(struct net_buf_pool *pool);
+
+/**
+ * Get a buffer
+ * @param pool the pool of the thread
+ * @param size the size of the buffer
+ * @param allocated where to store if we had to allocate it
+ * @return the buffer (to be handed back with net_buf_pool_put, or freed)
+ *         or NULL if we failed to allocate it
+ */
+char *net_buf_pool_get(struct net_buf_pool *pool, uint32_t size,
+                       bool *allocated);
+
+/**
+ * Hand a buffer back to the pool (or free it if its class is full, or
+ * it isn't of any)
+ * @param pool the pool of the thread
+ * @param buf the buffer
+ * @param size the size of the buffer
+ */
+void net_buf_pool_put(struct net_buf_pool *pool, char *buf, uint32_t size);
+
+/**
+ * Move the content of a buffer into one of another size from the pool
+ * (like realloc does)
+ * @param pool the pool of the thread
+ * @param buf the buffer
+ * @param size the size of the buffer
+ * @param nsize the size we want
+ * @return the new buffer or NULL if we failed to allocate it (and buf is
+ *         left as it is)
+ */
+char *net_buf_pool_resize(struct net_buf_pool *pool, char *buf,
+                          uint32_t size, uint32_t nsize);
+
+#endif
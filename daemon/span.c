@@ -0,0 +1,118 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The rings of the trace spans of the worker threads (see span.h). The
+ * thread a ring belongs to is the only one which puts spans in it, and
+ * the drains take the mutex of the ring between them, so the head only
+ * moves in the owner and the tail in whoever drains it.
+ */
+#include "config.h"
+#include "span.h"
+
+#include <stdlib.h>
+#include <string.h>
+#if defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+#endif
+
+struct span_ring {
+    cb_mutex_t mutex;           /* Held by the drains */
+    size_t size;
+    volatile uint64_t head;     /* # of spans put in it */
+    volatile uint64_t tail;     /* # of spans taken out */
+    volatile uint64_t dropped;
+    span_record_t records[1];
+};
+
+/* Makes what we read or wrote visible before what we write next */
+static void span_barrier(void) {
+#ifdef WIN32
+    MemoryBarrier();
+#elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+    membar_enter();
+#else
+    __sync_synchronize();
+#endif
+}
+
+struct span_ring *span_ring_create(size_t size) {
+    struct span_ring *ring;
+
+    if (size == 0) {
+        return NULL;
+    }
+    ring = calloc(1, sizeof(*ring) + (size - 1) * sizeof(span_record_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    cb_mutex_initialize(&ring->mutex);
+    ring->size = size;
+    return ring;
+}
+
+void span_ring_destroy(struct span_ring *ring) {
+    if (ring != NULL) {
+        cb_mutex_destroy(&ring->mutex);
+        free(ring);
+    }
+}
+
+bool span_ring_push(struct span_ring *ring, const span_record_t *record) {
+    uint64_t head = ring->head;
+
+    if (head - ring->tail >= ring->size) {
+        ring->dropped++;
+        return false;
+    }
+    ring->records[head % ring->size] = *record;
+    span_barrier();
+    ring->head = head + 1;
+    return true;
+}
+
+static void span_encode(char *dest, const span_record_t *record) {
+    uint64_t timestamp = htonll(record->timestamp);
+    uint32_t word;
+    uint16_t status = htons(record->status);
+    int ii;
+
+    memcpy(dest, &timestamp, 8);
+    word = htonl(record->connection);
+    memcpy(dest + 8, &word, 4);
+    word = htonl(record->key_hash);
+    memcpy(dest + 12, &word, 4);
+    memcpy(dest + 16, &status, 2);
+    dest[18] = (char)record->opcode;
+    dest[19] = 0;
+    for (ii = 0; ii < SPAN_POINTS; ++ii) {
+        word = htonl(record->points[ii]);
+        memcpy(dest + 20 + ii * 4, &word, 4);
+    }
+}
+
+size_t span_ring_drain(struct span_ring *ring, char *dest, size_t size) {
+    uint64_t head;
+    uint64_t tail;
+    size_t ret = 0;
+
+    cb_mutex_enter(&ring->mutex);
+    head = ring->head;
+    span_barrier();
+    for (tail = ring->tail;
+         tail < head && ret + SPAN_RECORD_SIZE <= size;
+         ++tail, ret += SPAN_RECORD_SIZE) {
+        span_encode(dest + ret, &ring->records[tail % ring->size]);
+    }
+    /* We're done reading the records before the owner reuses them */
+    span_barrier();
+    ring->tail = tail;
+    cb_mutex_exit(&ring->mutex);
+    return ret;
+}
+
+size_t span_ring_bytes(struct span_ring *ring) {
+    return ring->size * SPAN_RECORD_SIZE;
+}
+
+uint64_t span_ring_dropped(struct span_ring *ring) {
+    return ring->dropped;
+}
@@ -0,0 +1,85 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef SPAN_H
+#define SPAN_H
+
+#include <memcached/server_api.h>
+
+/*
+ * The trace spans of the requests we sample (one in trace_sample_rate of
+ * every worker thread's requests). A worker puts the span of a request
+ * in a ring of its own once its response has gone out, without taking a
+ * lock, and "stats spans" takes them out of the rings (dropping the
+ * spans which don't fit until then). Every worker_<n> stat of it is the
+ * spans of a thread, one after the other, SPAN_RECORD_SIZE bytes each:
+ *
+ *     0  timestamp    64 bits, us since the epoch the request started
+ *     8  connection   32 bits
+ *    12  key hash     32 bits
+ *    16  status       16 bits
+ *    18  opcode        8 bits
+ *    19  (reserved)    8 bits
+ *    20  the points   SPAN_POINTS times 32 bits, ns from the start of the
+ *                     request to each of the span_point_t in order (or
+ *                     SPAN_MISSING if it didn't get there)
+ *
+ * All of the numbers are in network byte order.
+ */
+#define SPAN_RECORD_SIZE (20 + SPAN_POINTS * 4)
+#define SPAN_MISSING 0xffffffff
+
+typedef struct {
+    uint64_t timestamp;
+    uint32_t connection;
+    uint32_t key_hash;
+    uint16_t status;
+    uint8_t opcode;
+    uint32_t points[SPAN_POINTS];
+} span_record_t;
+
+struct span_ring;
+
+/**
+ * Create the ring of a worker thread
+ * @param size the number of spans it holds
+ * @return the ring or NULL if we failed to allocate it
+ */
+struct span_ring *span_ring_create(size_t size);
+
+/**
+ * Release a ring nobody uses any more
+ * @param ring the ring
+ */
+void span_ring_destroy(struct span_ring *ring);
+
+/**
+ * Put a span in the ring. Only the thread the ring was created for may.
+ * @param ring the ring of the thread
+ * @param record the span
+ * @return false if the ring is full (and the span dropped)
+ */
+bool span_ring_push(struct span_ring *ring, const span_record_t *record);
+
+/**
+ * Take the spans out of the ring (from any thread)
+ * @param ring the ring
+ * @param dest where to put them, in the format described above
+ * @param size the number of bytes of dest
+ * @return the number of bytes we put in dest
+ */
+size_t span_ring_drain(struct span_ring *ring, char *dest, size_t size);
+
+/**
+ * Get the size of the ring in bytes, drained
+ * @param ring the ring
+ * @return the number of bytes it takes span_ring_drain to take all of it
+ */
+size_t span_ring_bytes(struct span_ring *ring);
+
+/**
+ * Get the number of spans a ring dropped because it was full
+ * @param ring the ring
+ * @return the number of spans
+ */
+uint64_t span_ring_dropped(struct span_ring *ring);
+
+#endif
@@ -0,0 +1,290 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The SSL contexts of the interfaces (see ssl_context.h)
+ */
+#include "config.h"
+#include "ssl_context.h"
+#include "mc_time.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+typedef EVP_MAC_CTX TICKET_HMAC_CTX;
+#else
+#include <openssl/hmac.h>
+typedef HMAC_CTX TICKET_HMAC_CTX;
+#endif
+
+#define TICKET_KEY_LENGTH 16
+
+#ifdef WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/* The contexts of the interfaces for the calling thread (allocated with
+ * the first one, with ssl_thread_contexts) */
+static THREAD_LOCAL SSL_CTX **thread_contexts;
+
+struct ticket_key {
+    unsigned char name[TICKET_KEY_LENGTH];
+    unsigned char aes[TICKET_KEY_LENGTH];
+    unsigned char hmac[TICKET_KEY_LENGTH];
+};
+
+static struct {
+    cb_mutex_t mutex;
+    /* The contexts of the interfaces (allocated with the first one) */
+    SSL_CTX **contexts;
+    /* All of the contexts we created, for ssl_context_get_stats */
+    SSL_CTX **all;
+    int num_all;
+    int all_size;
+    /* The key we encrypt the new tickets with, and the one before it */
+    struct ticket_key current;
+    struct ticket_key previous;
+    bool have_previous;
+    rel_time_t rotated;
+    /* We failed to create a key, so we don't use tickets at all */
+    bool no_tickets;
+} ssl_contexts;
+
+static bool create_ticket_key(struct ticket_key *key) {
+    return RAND_bytes(key->name, sizeof(key->name)) == 1 &&
+           RAND_bytes(key->aes, sizeof(key->aes)) == 1 &&
+           RAND_bytes(key->hmac, sizeof(key->hmac)) == 1;
+}
+
+/* Must be called with the mutex held */
+static void rotate_ticket_keys(void) {
+    rel_time_t now = mc_time_get_current_time();
+    struct ticket_key key;
+
+    if (now - ssl_contexts.rotated < (rel_time_t)settings.ssl_ticket_rotation) {
+        return;
+    }
+
+    if (!create_ticket_key(&key)) {
+        /* Keep the current one and try again with the next ticket */
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to create a new session "
+                                        "ticket key");
+        return;
+    }
+
+    ssl_contexts.previous = ssl_contexts.current;
+    ssl_contexts.have_previous = true;
+    ssl_contexts.current = key;
+    ssl_contexts.rotated = now;
+    memset(&key, 0, sizeof(key));
+}
+
+static int init_ticket_hmac(TICKET_HMAC_CTX *hctx, const unsigned char *key) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM params[2];
+    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 "SHA256", 0);
+    params[1] = OSSL_PARAM_construct_end();
+    return EVP_MAC_init(hctx, key, TICKET_KEY_LENGTH, params);
+#else
+    return HMAC_Init_ex(hctx, key, TICKET_KEY_LENGTH, EVP_sha256(), NULL);
+#endif
+}
+
+/*
+ * Called by OpenSSL to encrypt a new ticket (enc is set) or to look up
+ * the key of one a client sent us. Returns 1 if the ticket is good, 2 if
+ * it is good but was encrypted with the previous key (so the client gets
+ * a new one), 0 if we don't have its key and -1 on errors.
+ */
+static int ticket_key_callback(SSL *ssl, unsigned char *name,
+                               unsigned char *iv, EVP_CIPHER_CTX *ctx,
+                               TICKET_HMAC_CTX *hctx, int enc) {
+    struct ticket_key key;
+    int ret = 1;
+
+    (void)ssl;
+    cb_mutex_enter(&ssl_contexts.mutex);
+    if (enc) {
+        rotate_ticket_keys();
+        key = ssl_contexts.current;
+    } else if (memcmp(name, ssl_contexts.current.name,
+                      TICKET_KEY_LENGTH) == 0) {
+        key = ssl_contexts.current;
+    } else if (ssl_contexts.have_previous &&
+               memcmp(name, ssl_contexts.previous.name,
+                      TICKET_KEY_LENGTH) == 0) {
+        key = ssl_contexts.previous;
+        ret = 2;
+    } else {
+        ret = 0;
+    }
+    cb_mutex_exit(&ssl_contexts.mutex);
+
+    if (ret == 0) {
+        return 0;
+    }
+
+    if (enc) {
+        memcpy(name, key.name, TICKET_KEY_LENGTH);
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_128_cbc())) != 1 ||
+            !EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key.aes, iv)) {
+            ret = -1;
+        }
+    } else if (!EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key.aes, iv)) {
+        ret = -1;
+    }
+
+    if (ret != -1 && !init_ticket_hmac(hctx, key.hmac)) {
+        ret = -1;
+    }
+    memset(&key, 0, sizeof(key));
+    return ret;
+}
+
+void ssl_context_init(void) {
+    cb_mutex_initialize(&ssl_contexts.mutex);
+    if (!create_ticket_key(&ssl_contexts.current)) {
+        ssl_contexts.no_tickets = true;
+    }
+    ssl_contexts.rotated = mc_time_get_current_time();
+}
+
+/*
+ * @param interface the interface
+ * @param cache_size the number of sessions the context keeps
+ */
+static SSL_CTX *create_context(const struct interface *interface,
+                               int cache_size) {
+    static const unsigned char session_id_context[] = "memcached";
+    SSL_CTX *ctx = SSL_CTX_new(SSLv23_server_method());
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    /* @todo don't read files, but use in-memory-copies */
+    if (!SSL_CTX_use_certificate_chain_file(ctx, interface->ssl.cert) ||
+        !SSL_CTX_use_PrivateKey_file(ctx, interface->ssl.key,
+                                     SSL_FILETYPE_PEM)) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    SSL_CTX_set_session_id_context(ctx, session_id_context,
+                                   sizeof(session_id_context) - 1);
+    if (cache_size > 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, cache_size);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+    SSL_CTX_set_timeout(ctx, settings.ssl_session_timeout);
+
+    if (settings.ssl_ticket_rotation == 0 || ssl_contexts.no_tickets) {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    } else {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_callback);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_callback);
+#endif
+    }
+
+#ifdef SSL_MODE_ASYNC
+    if (settings.ssl_async) {
+        SSL_CTX_set_mode(ctx, SSL_MODE_ASYNC);
+    }
+#endif
+
+    return ctx;
+}
+
+/*
+ * Create a context and remember it for the stats. Must be called with
+ * the mutex held.
+ */
+static SSL_CTX *add_context(int interface, int cache_size) {
+    SSL_CTX *ctx;
+
+    if (ssl_contexts.num_all == ssl_contexts.all_size) {
+        int size = ssl_contexts.all_size ? ssl_contexts.all_size * 2 : 8;
+        SSL_CTX **all = realloc(ssl_contexts.all, size * sizeof(SSL_CTX *));
+        if (all == NULL) {
+            return NULL;
+        }
+        ssl_contexts.all = all;
+        ssl_contexts.all_size = size;
+    }
+
+    ctx = create_context(&settings.interfaces[interface], cache_size);
+    if (ctx != NULL) {
+        ssl_contexts.all[ssl_contexts.num_all++] = ctx;
+    }
+    return ctx;
+}
+
+/*
+ * Get the context of the interface for the calling thread, which only
+ * takes the mutex to create it
+ */
+static SSL_CTX *thread_context_get(int interface) {
+    if (thread_contexts == NULL) {
+        thread_contexts = calloc(settings.num_interfaces, sizeof(SSL_CTX *));
+        if (thread_contexts == NULL) {
+            return NULL;
+        }
+    }
+
+    if (thread_contexts[interface] == NULL) {
+        /* Every thread gets its share of the session cache */
+        int threads = settings.num_threads > 0 ? settings.num_threads : 1;
+        int cache_size = (settings.ssl_session_cache + threads - 1) / threads;
+
+        cb_mutex_enter(&ssl_contexts.mutex);
+        thread_contexts[interface] = add_context(interface, cache_size);
+        cb_mutex_exit(&ssl_contexts.mutex);
+    }
+    return thread_contexts[interface];
+}
+
+SSL_CTX *ssl_context_get(int interface) {
+    SSL_CTX *ctx = NULL;
+
+    if (settings.ssl_thread_contexts) {
+        return thread_context_get(interface);
+    }
+
+    cb_mutex_enter(&ssl_contexts.mutex);
+    if (ssl_contexts.contexts == NULL) {
+        ssl_contexts.contexts = calloc(settings.num_interfaces,
+                                       sizeof(SSL_CTX *));
+    }
+    if (ssl_contexts.contexts != NULL) {
+        ctx = ssl_contexts.contexts[interface];
+        if (ctx == NULL) {
+            /* We try again with the next connection if it fails */
+            ctx = add_context(interface, settings.ssl_session_cache);
+            ssl_contexts.contexts[interface] = ctx;
+        }
+    }
+    cb_mutex_exit(&ssl_contexts.mutex);
+
+    return ctx;
+}
+
+void ssl_context_get_stats(uint64_t *hits, uint64_t *misses) {
+    int ii;
+
+    *hits = *misses = 0;
+    cb_mutex_enter(&ssl_contexts.mutex);
+    for (ii = 0; ii < ssl_contexts.num_all; ++ii) {
+        *hits += SSL_CTX_sess_hits(ssl_contexts.all[ii]);
+        *misses += SSL_CTX_sess_misses(ssl_contexts.all[ii]);
+    }
+    cb_mutex_exit(&ssl_contexts.mutex);
+}
@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef SSL_CONTEXT_H
+#define SSL_CONTEXT_H
+
+#include "memcached.h"
+
+/*
+ * The SSL contexts of the interfaces. All of the connections to an SSL
+ * interface share a single context, created (and the certificate and key
+ * loaded) by the first connection to it, so that clients may resume
+ * their sessions on a new connection instead of doing a full handshake.
+ * With ssl_thread_contexts every worker thread has a context of its own
+ * for every interface instead, so that the threads don't contend for
+ * the locks of a shared one:
+ *
+ *  - the context keeps the last ssl_session_cache sessions for up to
+ *    ssl_session_timeout seconds (with ssl_thread_contexts, every thread
+ *    keeps its share of them, so a client resuming its session from the
+ *    cache has to come back to the same thread; the tickets are good
+ *    on any of them)
+ *  - session tickets are encrypted with a key we replace every
+ *    ssl_ticket_rotation seconds. We still accept the tickets of the
+ *    previous key (and hand out a new ticket for them), so a ticket is
+ *    good for somewhere between one and two rotations (and no longer
+ *    than the session timeout). The keys are shared by all of the
+ *    interfaces and never leave the process, so a restart invalidates
+ *    all of the tickets.
+ */
+
+/**
+ * Initialize the ticket keys (called once OpenSSL is initialized)
+ */
+void ssl_context_init(void);
+
+/**
+ * Get the SSL context of an interface (for the calling thread with
+ * ssl_thread_contexts), creating it the first time
+ * @param interface the index of the interface in settings.interfaces
+ * @return the context (owned by us, SSL_new takes a reference of it) or
+ *         NULL if we failed to create it or load the certificate or key
+ */
+SSL_CTX *ssl_context_get(int interface);
+
+/**
+ * Get the number of session resumptions of all of the interfaces
+ * @param hits where to store the number of sessions resumed (from the
+ *             cache or a ticket)
+ * @param misses where to store the number of sessions the client asked
+ *               to resume which we didn't have
+ */
+void ssl_context_get_stats(uint64_t *hits, uint64_t *misses);
+
+#endif
@@ -9,64 +9,132 @@
  */
 #include "config.h"
 #include "memcached.h"
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+#endif
 
 /*
- * Stats are tracked on the basis of key prefixes. This is a simple
- * fixed-size hash of prefixes; we run the prefixes through the same
- * CRC function used by the cache hashtable.
+ * Stats are tracked on the basis of key prefixes. Every thread records them
+ * in a table of its own, which nobody else writes to, so that recording
+ * them doesn't take any lock. The tables are open addressed (we run the
+ * prefixes through the same hash function used by the cache hashtable)
+ * and take PREFIX_MAX_ENTRIES prefixes; the ones after that are counted
+ * together as PREFIX_OVERFLOW_NAME. The dump merges the tables of all of
+ * the threads, which it reads without their owners' knowledge (like the
+ * thread stats), so a count bumped at the very same time may be missed.
  */
 typedef struct _prefix_stats PREFIX_STATS;
 struct _prefix_stats {
-    char         *prefix;
+    char          prefix[KEY_MAX_LENGTH + 1];
     size_t        prefix_len;
+    /* Set once the prefix is in place */
+    volatile bool used;
     uint64_t      num_gets;
     uint64_t      num_sets;
     uint64_t      num_deletes;
     uint64_t      num_hits;
-    PREFIX_STATS *next;
 };
 
-#define PREFIX_HASH_SIZE 256
+#define PREFIX_TABLE_SIZE 512
+#define PREFIX_MAX_ENTRIES (PREFIX_TABLE_SIZE * 3 / 4)
+#define PREFIX_OVERFLOW_NAME "(other)"
+
+typedef struct {
+    PREFIX_STATS entries[PREFIX_TABLE_SIZE];
+    PREFIX_STATS overflow;
+    int num_entries;
+    /* The prefix_generation it was cleared for */
+    volatile int generation;
+} PREFIX_TABLE;
 
-static PREFIX_STATS *prefix_stats[PREFIX_HASH_SIZE];
-static int num_prefixes = 0;
-static int total_prefix_size = 0;
+/* Indexed by the index of the thread, allocated by the thread itself */
+static PREFIX_TABLE * volatile *prefix_tables;
+static int num_prefix_tables;
+/* Bumped by stats_prefix_clear, the threads clear their own tables */
+static volatile int prefix_generation;
+
+#define PREFIX_HASH_SIZE 256
 
 struct thread_stats *default_independent_stats;
 
+static int num_independent_stats(void);
+
+/* Makes what we wrote visible before what we write next */
+static void prefix_barrier(void) {
+#ifdef WIN32
+    MemoryBarrier();
+#elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+    membar_producer();
+#else
+    __sync_synchronize();
+#endif
+}
+
 void stats_prefix_init() {
-    memset(prefix_stats, 0, sizeof(prefix_stats));
+    num_prefix_tables = num_independent_stats();
+    prefix_tables = calloc(num_prefix_tables, sizeof(PREFIX_TABLE *));
+    if (prefix_tables == NULL) {
+        num_prefix_tables = 0;
+    }
 }
 
 /*
  * Cleans up all our previously collected stats. NOTE: the stats lock is
- * assumed to be held when this is called.
+ * assumed to be held when this is called. The threads clear their tables
+ * the next time they record something, and the dump skips them until then.
  */
 void stats_prefix_clear() {
-    int i;
+    ++prefix_generation;
+}
 
-    for (i = 0; i < PREFIX_HASH_SIZE; i++) {
-        PREFIX_STATS *cur, *next;
-        for (cur = prefix_stats[i]; cur != NULL; cur = next) {
-            next = cur->next;
-            free(cur->prefix);
-            free(cur);
+/*
+ * Returns the table of the thread serving the connection (cleared if that
+ * is due), or NULL if we failed to allocate it.
+ */
+static PREFIX_TABLE *stats_prefix_table(conn *c) {
+    PREFIX_TABLE *table;
+    int index;
+
+    cb_assert(c->thread != NULL);
+    index = c->thread->index;
+    if (index >= num_prefix_tables) {
+        return NULL;
+    }
+
+    table = prefix_tables[index];
+    if (table == NULL) {
+        table = calloc(1, sizeof(PREFIX_TABLE));
+        if (table == NULL) {
+            return NULL;
         }
-        prefix_stats[i] = NULL;
+        table->generation = prefix_generation;
+        prefix_barrier();
+        prefix_tables[index] = table;
+    } else if (table->generation != prefix_generation) {
+        int generation = prefix_generation;
+        memset(table->entries, 0, sizeof(table->entries));
+        memset(&table->overflow, 0, sizeof(table->overflow));
+        table->num_entries = 0;
+        prefix_barrier();
+        table->generation = generation;
     }
-    num_prefixes = 0;
-    total_prefix_size = 0;
+
+    return table;
 }
 
 /*
- * Returns the stats structure for a prefix, creating it if it's not already
- * in the list.
+ * Returns the stats structure for a prefix in the table of the thread,
+ * adding it if it's not already there (or the overflow entry if there is
+ * no room for it).
  */
 /*@null@*/
-static PREFIX_STATS *stats_prefix_find(const char *key, const size_t nkey) {
+static PREFIX_STATS *stats_prefix_find(conn *c, const char *key,
+                                       const size_t nkey) {
+    PREFIX_TABLE *table;
     PREFIX_STATS *pfs;
     uint32_t hashval;
     size_t length;
@@ -81,39 +149,39 @@ static PREFIX_STATS *stats_prefix_find(const char *key, const size_t nkey) {
         }
     }
 
-    if (bailout) {
+    if (bailout || length > KEY_MAX_LENGTH) {
         return NULL;
     }
 
-    hashval = hash(key, length, 0) % PREFIX_HASH_SIZE;
-
-    for (pfs = prefix_stats[hashval]; NULL != pfs; pfs = pfs->next) {
-        if (strncmp(pfs->prefix, key, length) == 0)
-            return pfs;
+    table = stats_prefix_table(c);
+    if (table == NULL) {
+        return NULL;
     }
 
-    pfs = calloc(sizeof(PREFIX_STATS), 1);
-    if (NULL == pfs) {
-        perror("Can't allocate space for stats structure: calloc");
-        return NULL;
+    hashval = hash(key, length, 0) % PREFIX_TABLE_SIZE;
+    for (;;) {
+        pfs = &table->entries[hashval];
+        if (!pfs->used) {
+            break;
+        }
+        if (pfs->prefix_len == length &&
+            memcmp(pfs->prefix, key, length) == 0) {
+            return pfs;
+        }
+        hashval = (hashval + 1) % PREFIX_TABLE_SIZE;
     }
 
-    pfs->prefix = malloc(length + 1);
-    if (NULL == pfs->prefix) {
-        perror("Can't allocate space for copy of prefix: malloc");
-        free(pfs);
-        return NULL;
+    if (table->num_entries == PREFIX_MAX_ENTRIES) {
+        return &table->overflow;
     }
 
-    strncpy(pfs->prefix, key, length);
-    pfs->prefix[length] = '\0';      /* because strncpy() sucks */
+    memcpy(pfs->prefix, key, length);
+    pfs->prefix[length] = '\0';
+    /* The dump may look at it as soon as the length is set */
     pfs->prefix_len = length;
-
-    pfs->next = prefix_stats[hashval];
-    prefix_stats[hashval] = pfs;
-
-    num_prefixes++;
-    total_prefix_size += (int)length;
+    prefix_barrier();
+    pfs->used = true;
+    table->num_entries++;
 
     return pfs;
 }
@@ -121,46 +189,76 @@ static PREFIX_STATS *stats_prefix_find(const char *key, const size_t nkey) {
 /*
  * Records a "get" of a key.
  */
-void stats_prefix_record_get(const char *key, const size_t nkey, const bool is_hit) {
-    PREFIX_STATS *pfs;
-
-    STATS_LOCK();
-    pfs = stats_prefix_find(key, nkey);
+void stats_prefix_record_get(conn *c, const char *key, const size_t nkey,
+                             const bool is_hit) {
+    PREFIX_STATS *pfs = stats_prefix_find(c, key, nkey);
     if (NULL != pfs) {
         pfs->num_gets++;
         if (is_hit) {
             pfs->num_hits++;
         }
     }
-    STATS_UNLOCK();
 }
 
 /*
  * Records a "delete" of a key.
  */
-void stats_prefix_record_delete(const char *key, const size_t nkey) {
-    PREFIX_STATS *pfs;
-
-    STATS_LOCK();
-    pfs = stats_prefix_find(key, nkey);
+void stats_prefix_record_delete(conn *c, const char *key, const size_t nkey) {
+    PREFIX_STATS *pfs = stats_prefix_find(c, key, nkey);
     if (NULL != pfs) {
         pfs->num_deletes++;
     }
-    STATS_UNLOCK();
 }
 
 /*
  * Records a "set" of a key.
  */
-void stats_prefix_record_set(const char *key, const size_t nkey) {
-    PREFIX_STATS *pfs;
-
-    STATS_LOCK();
-    pfs = stats_prefix_find(key, nkey);
+void stats_prefix_record_set(conn *c, const char *key, const size_t nkey) {
+    PREFIX_STATS *pfs = stats_prefix_find(c, key, nkey);
     if (NULL != pfs) {
         pfs->num_sets++;
     }
-    STATS_UNLOCK();
+}
+
+/* A prefix of the dump, with the counts of all of the threads */
+typedef struct {
+    const char *prefix;
+    size_t      prefix_len;
+    uint64_t    num_gets;
+    uint64_t    num_sets;
+    uint64_t    num_deletes;
+    uint64_t    num_hits;
+    int         next;
+} PREFIX_MERGED;
+
+static void stats_prefix_merge(PREFIX_MERGED *merged, int *num_merged,
+                               int *heads, const PREFIX_STATS *pfs,
+                               const char *prefix, size_t length) {
+    uint32_t hashval = hash(prefix, length, 0) % PREFIX_HASH_SIZE;
+    PREFIX_MERGED *m = NULL;
+    int ii;
+
+    for (ii = heads[hashval]; ii != -1; ii = merged[ii].next) {
+        if (merged[ii].prefix_len == length &&
+            memcmp(merged[ii].prefix, prefix, length) == 0) {
+            m = &merged[ii];
+            break;
+        }
+    }
+
+    if (m == NULL) {
+        m = &merged[*num_merged];
+        memset(m, 0, sizeof(*m));
+        m->prefix = prefix;
+        m->prefix_len = length;
+        m->next = heads[hashval];
+        heads[hashval] = (*num_merged)++;
+    }
+
+    m->num_gets += pfs->num_gets;
+    m->num_sets += pfs->num_sets;
+    m->num_deletes += pfs->num_deletes;
+    m->num_hits += pfs->num_hits;
 }
 
 /*
@@ -168,11 +266,55 @@ void stats_prefix_record_set(const char *key, const size_t nkey) {
  */
 /*@null@*/
 char *stats_prefix_dump(int *length) {
-    const char *format = "PREFIX %s get %llu hit %llu set %llu del %llu\r\n";
-    PREFIX_STATS *pfs;
+    const char *format = "PREFIX %.*s get %llu hit %llu set %llu del %llu\r\n";
+    PREFIX_MERGED *merged;
+    int heads[PREFIX_HASH_SIZE];
+    int num_merged = 0;
     char *buf;
-    int i, pos;
+    int i, jj, pos;
     size_t size = 0, written = 0, total_written = 0;
+    size_t total_prefix_size = 0;
+
+    STATS_LOCK();
+    /* Every prefix of every table, and an overflow entry */
+    merged = calloc((size_t)num_prefix_tables * PREFIX_MAX_ENTRIES + 1,
+                    sizeof(PREFIX_MERGED));
+    if (NULL == merged) {
+        perror("Can't allocate stats response: calloc");
+        STATS_UNLOCK();
+        return NULL;
+    }
+    for (i = 0; i < PREFIX_HASH_SIZE; i++) {
+        heads[i] = -1;
+    }
+
+    for (i = 0; i < num_prefix_tables; i++) {
+        PREFIX_TABLE *table = prefix_tables[i];
+        if (table == NULL || table->generation != prefix_generation) {
+            continue;
+        }
+        for (jj = 0; jj < PREFIX_TABLE_SIZE; jj++) {
+            PREFIX_STATS *pfs = &table->entries[jj];
+            size_t len;
+            if (!pfs->used) {
+                continue;
+            }
+            prefix_barrier();
+            len = pfs->prefix_len;
+            /* It may have been cleared since (and the table refilled) */
+            if (len <= KEY_MAX_LENGTH &&
+                num_merged < num_prefix_tables * PREFIX_MAX_ENTRIES) {
+                stats_prefix_merge(merged, &num_merged, heads, pfs,
+                                   pfs->prefix, len);
+            }
+        }
+        if (table->overflow.num_gets + table->overflow.num_sets +
+            table->overflow.num_deletes > 0) {
+            stats_prefix_merge(merged, &num_merged, heads, &table->overflow,
+                               PREFIX_OVERFLOW_NAME,
+                               sizeof(PREFIX_OVERFLOW_NAME) - 1);
+        }
+    }
 
     /*
      * Figure out how big the buffer needs to be. This is the sum of the
@@ -180,31 +322,37 @@ char *stats_prefix_dump(int *length) {
      * the per-prefix output with 20-digit values for all the counts,
      * plus space for the "END" at the end.
      */
-    STATS_LOCK();
+    for (i = 0; i < num_merged; i++) {
+        total_prefix_size += merged[i].prefix_len;
+    }
     size = strlen(format) + total_prefix_size +
-           num_prefixes * (strlen(format) - 2 /* %s */
-                           + 4 * (20 - 4)) /* %llu replaced by 20-digit num */
-                           + sizeof("END\r\n");
+           num_merged * (strlen(format) - 4 /* %.*s */
+                         + 4 * (20 - 4)) /* %llu replaced by 20-digit num */
+                         + sizeof("END\r\n");
     buf = malloc(size);
     if (NULL == buf) {
         perror("Can't allocate stats response: malloc");
+        free(merged);
         STATS_UNLOCK();
         return NULL;
     }
 
     pos = 0;
-    for (i = 0; i < PREFIX_HASH_SIZE; i++) {
-        for (pfs = prefix_stats[i]; NULL != pfs; pfs = pfs->next) {
-            written = snprintf(buf + pos, size-pos, format,
-                           pfs->prefix, pfs->num_gets, pfs->num_hits,
-                           pfs->num_sets, pfs->num_deletes);
-            pos += (int)written;
-            total_written += written;
-            cb_assert(total_written < size);
-        }
+    for (i = 0; i < num_merged; i++) {
+        PREFIX_MERGED *m = &merged[i];
+        written = snprintf(buf + pos, size-pos, format,
+                           (int)m->prefix_len, m->prefix,
+                           (unsigned long long)m->num_gets,
+                           (unsigned long long)m->num_hits,
+                           (unsigned long long)m->num_sets,
+                           (unsigned long long)m->num_deletes);
+        pos += (int)written;
+        total_written += written;
+        cb_assert(total_written < size);
     }
 
     STATS_UNLOCK();
+    free(merged);
     memcpy(buf + pos, "END\r\n", 6);
 
     *length = pos + 5;
@@ -215,24 +363,73 @@ static int num_independent_stats(void) {
     return settings.num_threads + 1;
 }
 
+/*
+ * The slots of the threads come with the sums of them handed out to the
+ * stats requests, so that a busy poller doesn't add up every counter of
+ * every thread (and slab class) each time. The sums are redone once they
+ * are more than stats_aggregate_interval ms old, and after a reset. The
+ * mutex is only taken by the stats requests, never by the workers
+ * counting.
+ */
+struct independent_stats {
+    cb_mutex_t mutex;
+    /* When we added up the aggregate (0 if we have to do it again) */
+    hrtime_t published;
+    struct thread_stats aggregate;
+    /* num_independent_stats() of them (what the engines get) */
+    struct thread_stats threads[1];
+};
+
+static struct independent_stats *independent_stats_header(void *stats) {
+    return (void*)((char*)stats - offsetof(struct independent_stats, threads));
+}
+
 void *new_independent_stats(void) {
     int nrecords = num_independent_stats();
-    struct thread_stats *ts = calloc(nrecords, sizeof(struct thread_stats));
-    int ii;
-    for (ii = 0; ii < nrecords; ii++) {
-        cb_mutex_initialize(&ts[ii].mutex);
+    struct independent_stats *ret;
+
+    ret = calloc(1, offsetof(struct independent_stats, threads) +
+                 nrecords * sizeof(struct thread_stats));
+    if (ret == NULL) {
+        return NULL;
     }
-    return ts;
+    cb_mutex_initialize(&ret->mutex);
+    return ret->threads;
 }
 
 void release_independent_stats(void *stats) {
-    int nrecords = num_independent_stats();
-    struct thread_stats *ts = stats;
-    int ii;
-    for (ii = 0; ii < nrecords; ii++) {
-        cb_mutex_destroy(&ts[ii].mutex);
+    struct independent_stats *s;
+    if (stats == NULL) {
+        return;
+    }
+    s = independent_stats_header(stats);
+    cb_mutex_destroy(&s->mutex);
+    free(s);
+}
+
+void independent_stats_aggregate(struct thread_stats *stats,
+                                 struct thread_stats *out) {
+    struct independent_stats *s = independent_stats_header(stats);
+    hrtime_t interval = (hrtime_t)settings.stats_aggregate_interval * 1000000;
+    hrtime_t now = gethrtime();
+
+    cb_mutex_enter(&s->mutex);
+    if (interval == 0 || s->published == 0 || now - s->published >= interval) {
+        threadlocal_stats_clear(&s->aggregate);
+        threadlocal_stats_aggregate(stats, &s->aggregate);
+        s->published = now;
     }
-    free(ts);
+    *out = s->aggregate;
+    cb_mutex_exit(&s->mutex);
+}
+
+void independent_stats_reset(struct thread_stats *stats) {
+    struct independent_stats *s = independent_stats_header(stats);
+
+    threadlocal_stats_reset(stats);
+    cb_mutex_enter(&s->mutex);
+    s->published = 0;
+    cb_mutex_exit(&s->mutex);
 }
 
 struct thread_stats* get_independent_stats(conn *c) {
@@ -8,9 +8,10 @@ extern struct thread_stats *default_independent_stats;
 
 void stats_prefix_init(void);
 void stats_prefix_clear(void);
-void stats_prefix_record_get(const char *key, const size_t nkey, const bool is_hit);
-void stats_prefix_record_delete(const char *key, const size_t nkey);
-void stats_prefix_record_set(const char *key, const size_t nkey);
+void stats_prefix_record_get(conn *c, const char *key, const size_t nkey,
+                             const bool is_hit);
+void stats_prefix_record_delete(conn *c, const char *key, const size_t nkey);
+void stats_prefix_record_set(conn *c, const char *key, const size_t nkey);
 /*@null@*/
 char *stats_prefix_dump(int *length);
 
@@ -18,11 +19,22 @@ char *stats_prefix_dump(int *length);
 void *new_independent_stats(void);
 void release_independent_stats(void *stats);
 
+/*
+ * The sums of the slots of the threads in stats (from new_independent_stats)
+ * as of at most stats_aggregate_interval ms ago
+ */
+void independent_stats_aggregate(struct thread_stats *stats,
+                                 struct thread_stats *out);
+/* Clear the slots of the threads in stats (and their sums) */
+void independent_stats_reset(struct thread_stats *stats);
+
 struct thread_stats* get_independent_stats(conn *c);
 struct thread_stats *get_thread_stats(conn *c);
 
 /*
- *  Macros for managing statistics inside memcached
+ *  Macros for managing statistics inside memcached. They update the slot
+ *  of the thread serving the connection, which nobody else writes to (see
+ *  struct thread_stats), so they don't need a lock.
  */
 
 /* The item must always be called "it" */
@@ -42,9 +54,7 @@ struct thread_stats *get_thread_stats(conn *c);
 
 #define STATS_INCR1(GUTS, conn, slab_op, thread_op, key, nkey) { \
     struct thread_stats *thread_stats = get_thread_stats(conn); \
-    cb_mutex_enter(&thread_stats->mutex); \
     GUTS(conn, thread_stats, slab_op, thread_op); \
-    cb_mutex_exit(&thread_stats->mutex); \
 }
 
 #define STATS_INCR(conn, op, key, nkey) \
@@ -68,26 +78,20 @@ struct thread_stats *get_thread_stats(conn *c);
 #define STATS_NOKEY(conn, op) { \
     struct thread_stats *thread_stats = \
         get_thread_stats(conn); \
-    cb_mutex_enter(&thread_stats->mutex); \
     thread_stats->op++; \
-    cb_mutex_exit(&thread_stats->mutex); \
 }
 
 #define STATS_NOKEY2(conn, op1, op2) { \
     struct thread_stats *thread_stats = \
         get_thread_stats(conn); \
-    cb_mutex_enter(&thread_stats->mutex); \
     thread_stats->op1++; \
     thread_stats->op2++; \
-    cb_mutex_exit(&thread_stats->mutex); \
 }
 
 #define STATS_ADD(conn, op, amt) { \
     struct thread_stats *thread_stats = \
         get_thread_stats(conn); \
-    cb_mutex_enter(&thread_stats->mutex); \
     thread_stats->op += amt; \
-    cb_mutex_exit(&thread_stats->mutex); \
 }
 
 /* Set the statistic to the maximum of the current value, and the specified
@@ -96,9 +100,7 @@ struct thread_stats *get_thread_stats(conn *c);
 #define STATS_MAX(conn, op, value) { \
     struct thread_stats *thread_stats = get_thread_stats(conn); \
     if (value > thread_stats->op) { \
-        cb_mutex_enter(&thread_stats->mutex); \
         thread_stats->op = value; \
-        cb_mutex_exit(&thread_stats->mutex); \
     } \
 }
 
@@ -5,6 +5,11 @@
 #include "config.h"
 #include "memcached.h"
 #include "connections.h"
+#include "hot_cache.h"
+#include "span.h"
+#include "net_buf_pool.h"
+#include "mc_time.h"
+#include "alloc_hooks.h"
 
 #include <stdio.h>
 #include <errno.h>
@@ -16,7 +21,12 @@
 #include <fcntl.h>
 #include <platform/platform.h>
 
-#define ITEMS_PER_ALLOC 64
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#define HAVE_EVENTFD 1
+#endif
 
 static char devnull[8192];
 extern volatile sig_atomic_t memcached_shutdown;
@@ -29,27 +39,31 @@ struct conn_queue_item {
     STATE_FUNC        init_state;
     int               event_flags;
     int               read_buffer_size;
+    /* A connection another worker hands over (see dispatch_conn_move) */
+    conn             *c;
     CQ_ITEM          *next;
 };
 
-/* A connection queue. */
+/*
+ * A connection queue. The other threads push onto head (without a lock),
+ * and the worker takes all of it at once into the items it pops from.
+ */
 typedef struct conn_queue CQ;
 struct conn_queue {
-    CQ_ITEM *head;
-    CQ_ITEM *tail;
-    cb_mutex_t lock;
-    cb_cond_t  cond;
+    CQ_ITEM * volatile head;    /* Newest first */
+    CQ_ITEM *taken;             /* Oldest first, only the worker uses it */
 };
 
 /* Connection lock around accepting new connections */
 cb_mutex_t conn_lock;
 
-/* Free list of CQ_ITEM structs */
-static CQ_ITEM *cqi_freelist;
-static cb_mutex_t cqi_freelist_lock;
+/* The CQ_ITEM structs (allocated on one thread and freed on another) */
+static cache_t *cqi_cache;
 
 static LIBEVENT_THREAD dispatcher_thread;
 
+mc_mutex_stats_t thread_lock_stats;
+
 /*
  * Each libevent instance has a wakeup pipe, which other threads
  * can use to signal that they've put a new connection on its queue.
@@ -58,6 +72,12 @@ static int nthreads;
 static LIBEVENT_THREAD *threads;
 static cb_thread_t *thread_ids;
 
+/*
+ * The client workers are the default ones (the first of them), the ones
+ * of the thread groups in order, and then the replication threads.
+ */
+static int ndefault;
+
 /*
  * Number of worker threads that have finished setting themselves up.
  */
@@ -66,88 +86,115 @@ static cb_mutex_t init_lock;
 static cb_cond_t init_cond;
 
 static void thread_libevent_process(evutil_socket_t fd, short which, void *arg);
+static bool setup_conn(LIBEVENT_THREAD *me, SOCKET sfd, int parent_port,
+                       STATE_FUNC init_state, int event_flags,
+                       int read_buffer_size);
+static void thread_callback_done(LIBEVENT_THREAD *me, hrtime_t elapsed);
+static void add_thread_conns(LIBEVENT_THREAD *thread, int delta);
+static void take_pending_io(LIBEVENT_THREAD *me);
+static void unlink_pending_io(LIBEVENT_THREAD *me, conn *c);
+
+/*
+ * The queues the other threads hand things to a worker through are lists
+ * they push onto with a compare and swap. Only the worker takes from them,
+ * and it takes the whole list in one go, so there is no ABA problem.
+ */
+#ifdef WIN32
+static bool cas_pointer(void * volatile *ptr, void *old, void *val) {
+    return InterlockedCompareExchangePointer(ptr, val, old) == old;
+}
+
+static void *swap_pointer(void * volatile *ptr, void *val) {
+    return InterlockedExchangePointer(ptr, val);
+}
+
+static bool cas_int(volatile int *ptr, int old, int val) {
+    return InterlockedCompareExchange((volatile LONG *)ptr, val, old) == old;
+}
+#elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+static bool cas_pointer(void * volatile *ptr, void *old, void *val) {
+    return atomic_cas_ptr(ptr, old, val) == old;
+}
+
+static void *swap_pointer(void * volatile *ptr, void *val) {
+    return atomic_swap_ptr(ptr, val);
+}
+
+static bool cas_int(volatile int *ptr, int old, int val) {
+    return atomic_cas_uint((volatile uint_t *)ptr, old, val) == (uint_t)old;
+}
+#else
+static bool cas_pointer(void * volatile *ptr, void *old, void *val) {
+    return __sync_bool_compare_and_swap(ptr, old, val);
+}
+
+static void *swap_pointer(void * volatile *ptr, void *val) {
+    /* An acquire barrier is all the taker needs */
+    return __sync_lock_test_and_set(ptr, val);
+}
+
+static bool cas_int(volatile int *ptr, int old, int val) {
+    return __sync_bool_compare_and_swap(ptr, old, val);
+}
+#endif
 
 /*
  * Initializes a connection queue.
  */
 static void cq_init(CQ *cq) {
-    cb_mutex_initialize(&cq->lock);
-    cb_cond_initialize(&cq->cond);
     cq->head = NULL;
-    cq->tail = NULL;
+    cq->taken = NULL;
 }
 
 /*
  * Looks for an item on a connection queue, but doesn't block if there isn't
- * one.
+ * one. Only the thread owning the queue may pop from it.
  * Returns the item, or NULL if no item is available
  */
 static CQ_ITEM *cq_pop(CQ *cq) {
     CQ_ITEM *item;
 
-    cb_mutex_enter(&cq->lock);
-    item = cq->head;
+    if (cq->taken == NULL) {
+        /* Take what was pushed, turning it around to the oldest first */
+        item = swap_pointer((void * volatile *)&cq->head, NULL);
+        while (item != NULL) {
+            CQ_ITEM *next = item->next;
+            item->next = cq->taken;
+            cq->taken = item;
+            item = next;
+        }
+    }
+
+    item = cq->taken;
     if (NULL != item) {
-        cq->head = item->next;
-        if (NULL == cq->head)
-            cq->tail = NULL;
+        cq->taken = item->next;
     }
-    cb_mutex_exit(&cq->lock);
 
     return item;
 }
 
 /*
  * Adds an item to a connection queue.
+ * Returns true if the queue was empty (so that the caller must wake up the
+ * thread; whoever pushed the items before it already did)
  */
-static void cq_push(CQ *cq, CQ_ITEM *item) {
-    item->next = NULL;
+static bool cq_push(CQ *cq, CQ_ITEM *item) {
+    CQ_ITEM *head;
+
+    do {
+        head = cq->head;
+        item->next = head;
+    } while (!cas_pointer((void * volatile *)&cq->head, head, item));
 
-    cb_mutex_enter(&cq->lock);
-    if (NULL == cq->tail)
-        cq->head = item;
-    else
-        cq->tail->next = item;
-    cq->tail = item;
-    cb_cond_signal(&cq->cond);
-    cb_mutex_exit(&cq->lock);
+    return head == NULL;
 }
 
 /*
  * Returns a fresh connection queue item.
  */
 static CQ_ITEM *cqi_new(void) {
-    CQ_ITEM *item = NULL;
-    cb_mutex_enter(&cqi_freelist_lock);
-    if (cqi_freelist) {
-        item = cqi_freelist;
-        cqi_freelist = item->next;
-    }
-    cb_mutex_exit(&cqi_freelist_lock);
-
-    if (NULL == item) {
-        int i;
-
-        /* Allocate a bunch of items at once to reduce fragmentation */
-        item = malloc(sizeof(CQ_ITEM) * ITEMS_PER_ALLOC);
-        if (NULL == item)
-            return NULL;
-
-        /*
-         * Link together all the new items except the first one
-         * (which we'll return to the caller) for placement on
-         * the freelist.
-         */
-        for (i = 2; i < ITEMS_PER_ALLOC; i++)
-            item[i - 1].next = &item[i];
-
-        cb_mutex_enter(&cqi_freelist_lock);
-        item[ITEMS_PER_ALLOC - 1].next = cqi_freelist;
-        cqi_freelist = &item[1];
-        cb_mutex_exit(&cqi_freelist_lock);
-    }
-
-    return item;
+    return cache_alloc(cqi_cache);
 }
 
 
@@ -155,10 +202,7 @@ static CQ_ITEM *cqi_new(void) {
  * Frees a connection queue item (adds it to the freelist.)
  */
 static void cqi_free(CQ_ITEM *item) {
-    cb_mutex_enter(&cqi_freelist_lock);
-    item->next = cqi_freelist;
-    cqi_freelist = item;
-    cb_mutex_exit(&cqi_freelist_lock);
+    cache_free(cqi_cache, item);
 }
 
 
@@ -177,8 +221,24 @@ static void create_worker(void (*func)(void *), void *arg, cb_thread_t *id) {
 
 /****************************** LIBEVENT THREADS *****************************/
 
+/*
+ * On Linux the notifications go through an eventfd (in both notify[0] and
+ * notify[1]), which counts them so that the thread reads all of them with
+ * a single read. Everywhere else it's a socket pair with a byte per
+ * notification.
+ */
 bool create_notification_pipe(LIBEVENT_THREAD *me)
 {
+#ifdef HAVE_EVENTFD
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd == -1) {
+        log_system_error(EXTENSION_LOG_WARNING, NULL,
+                         "Can't create notify eventfd: %s");
+        return false;
+    }
+    me->notify[0] = me->notify[1] = efd;
+    return true;
+#else
     int j;
     if (evutil_socketpair(SOCKETPAIR_AF, SOCK_STREAM, 0,
                           (void*)me->notify) == SOCKET_ERROR) {
@@ -202,6 +262,23 @@ bool create_notification_pipe(LIBEVENT_THREAD *me)
         }
     }
     return true;
+#endif
+}
+
+/*
+ * Reads the notifications sent to a thread.
+ * Returns the number of them, or -1 if the read failed
+ */
+ssize_t read_notifications(SOCKET fd) {
+#ifdef HAVE_EVENTFD
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+    }
+    return (ssize_t)count;
+#else
+    return recv(fd, devnull, sizeof(devnull), 0);
+#endif
 }
 
 static void setup_dispatcher(struct event_base *main_base,
@@ -237,12 +314,19 @@ static void setup_thread(LIBEVENT_THREAD *me) {
                                         "Can't allocate event base\n");
         exit(1);
     }
+    if (event_base_priority_init(me->base, CONN_PRIORITIES) == -1) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Can't set up the event priorities\n");
+        exit(1);
+    }
 
     /* Listen for notifications from other threads */
     event_set(&me->notify_event, me->notify[0],
               EV_READ | EV_PERSIST,
               thread_libevent_process, me);
     event_base_set(me->base, &me->notify_event);
+    /* It runs the pending io of all of them */
+    event_priority_set(&me->notify_event, CONN_PRIORITY_HIGH);
 
     if (event_add(&me->notify_event, 0) == -1) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
@@ -261,32 +345,120 @@ static void setup_thread(LIBEVENT_THREAD *me) {
     cb_mutex_initialize(&me->mutex);
 }
 
+/*
+ * Runs whatever is ready in the event loop without blocking, over and over
+ * for up to the given number of ns or until it ran something (busy_poll).
+ * Returns true if it did. The time spent in the callbacks is busy time as
+ * usual, the rest is spinning.
+ */
+static bool worker_spin(LIBEVENT_THREAD *me, hrtime_t period) {
+    hrtime_t start = gethrtime();
+    hrtime_t busy = me->busy;
+    uint64_t callbacks = me->loop.callbacks;
+    bool found = false;
+
+    me->loop.spins++;
+    while (!memcached_shutdown && gethrtime() - start < period) {
+        if (event_base_loop(me->base, EVLOOP_NONBLOCK) != 0) {
+            break;
+        }
+        if (me->loop.callbacks != callbacks) {
+            me->loop.spin_hits++;
+            found = true;
+            break;
+        }
+    }
+    me->loop.spinning += gethrtime() - start - (me->busy - busy);
+    return found;
+}
+
 /*
  * Worker thread: main event loop
  */
 static void worker_libevent(void *arg) {
     LIBEVENT_THREAD *me = arg;
+    hrtime_t spin = 0;
 
     /* Any per-thread setup can happen here; thread_init() will block until
      * all threads have finished initializing.
      */
+    if (settings.numa && !mc_numa_bind_thread(me->numa_node)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to bind thread %d to NUMA node %d\n",
+                                        me->index, me->numa_node);
+    }
+
+    if (me->group != -1) {
+        spin = (hrtime_t)settings.thread_groups[me->group].busy_poll * 1000;
+    }
+
+    /* The CPUs of its group are what it is there for, so they win */
+    if (me->group != -1 && settings.thread_groups[me->group].ncpus > 0 &&
+        !mc_bind_thread_cpus(settings.thread_groups[me->group].cpus,
+                             settings.thread_groups[me->group].ncpus)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to bind thread %d to the "
+                                        "CPUs of thread group %s\n",
+                                        me->index,
+                                        settings.thread_groups[me->group].name);
+    }
+
+    /* The buffers of its connections come from an arena of its own */
+    if (settings.jemalloc_arenas && !mc_thread_arena()) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to create an arena for "
+                                        "thread %d\n", me->index);
+    }
+
+#ifdef __linux__
+    /* The nice value of a thread is its own on Linux */
+    if (me->type == TAP && settings.replication_nice != 0 &&
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid),
+                    settings.replication_nice) != 0) {
+        log_system_error(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to set the nice value of a replication "
+                         "thread: %s");
+    }
+#endif
+
+    me->loop.started = gethrtime();
 
     cb_mutex_enter(&init_lock);
     init_count++;
     cb_cond_signal(&init_cond);
     cb_mutex_exit(&init_lock);
 
-    event_base_loop(me->base, 0);
-}
-
-int number_of_pending(conn *c, conn *list) {
-    int rv = 0;
-    for (; list; list = list->next) {
-        if (list == c) {
-            rv ++;
+    /* A round at a time, so that we know how often it wakes up. With
+     * busy_poll it only blocks once it found nothing to do for a while. */
+    while (!memcached_shutdown) {
+        if (spin == 0 || !worker_spin(me, spin)) {
+            if (event_base_loop(me->base, EVLOOP_ONCE) != 0) {
+                break;
+            }
         }
+        me->loop.loops++;
     }
-    return rv;
+}
+
+/*
+ * Takes over a connection another worker moved to us (see
+ * dispatch_conn_move). It is still marked as pending io, so that nobody
+ * else could queue it, and we run it (in the given state) with the rest
+ * of the pending io.
+ */
+static void receive_conn(LIBEVENT_THREAD *me, conn *c, STATE_FUNC state) {
+    c->thread = me;
+    event_set(&c->event, c->sfd, EV_READ | EV_WRITE | EV_PERSIST,
+              event_handler, c);
+    event_base_set(me->base, &c->event);
+    conn_set_priority(c, c->priority);
+    c->ev_flags = EV_READ | EV_WRITE | EV_PERSIST;
+    c->which = EV_WRITE;
+    conn_set_state(c, state);
+
+    /* We take the pending io right after this, so there's no one to wake */
+    cas_int(&c->io_pending, 1, 0);
+    add_conn_to_pending_io_list(c);
 }
 
 /*
@@ -296,14 +468,20 @@ int number_of_pending(conn *c, conn *list) {
 static void thread_libevent_process(evutil_socket_t fd, short which, void *arg) {
     LIBEVENT_THREAD *me = arg;
     CQ_ITEM *item;
-    conn* pending;
+    conn *c;
+    hrtime_t start;
+    int npending = 0;
 
-    cb_assert(me->type == GENERAL);
+    cb_assert(me->type != DISPATCHER);
+    start = thread_clock_update(me);
 
-    if (recv(fd, devnull, sizeof(devnull), 0) == -1) {
+    if (read_notifications(fd) == -1) {
         log_socket_error(EXTENSION_LOG_WARNING, NULL,
                          "Can't read from libevent pipe: %s");
     }
+    /* Before we look for the work, so that whoever hands us more from now
+     * on wakes us up again */
+    cas_int(&me->notified, 1, 0);
 
     if (memcached_shutdown) {
          event_base_loopbreak(me->base);
@@ -311,31 +489,46 @@ static void thread_libevent_process(evutil_socket_t fd, short which, void *arg)
     }
 
     while ((item = cq_pop(me->new_conn_queue)) != NULL) {
-        conn *c = conn_new(item->sfd, item->parent_port, item->init_state,
-                           item->event_flags, item->read_buffer_size,
-                           me->base, NULL);
-        if (c == NULL) {
+        if (item->c != NULL) {
+            receive_conn(me, item->c, item->init_state);
+            cqi_free(item);
+            continue;
+        }
+        /* The dispatcher counted it in already */
+        if (!setup_conn(me, item->sfd, item->parent_port,
+                        item->init_state, item->event_flags,
+                        item->read_buffer_size)) {
+            add_thread_conns(me, -1);
+            if (item->init_state == conn_listening) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                                "failed to create listening connection\n");
+                exit(EXIT_FAILURE);
+            }
             if (settings.verbose > 0) {
                 settings.extensions.logger->log(EXTENSION_LOG_INFO, NULL,
                                                 "Can't listen for events on fd %d\n",
                                                 item->sfd);
             }
             closesocket(item->sfd);
-        } else {
-            cb_assert(c->thread == NULL);
-            c->thread = me;
         }
         cqi_free(item);
     }
 
+    if (me->listen_conn != NULL) {
+        thread_update_listen(me);
+    }
+
     LOCK_THREAD(me);
-    pending = me->pending_io;
-    me->pending_io = NULL;
-    while (pending != NULL) {
-        conn *c = pending;
+    /*
+     * The ones notified while we run these go on pending_notify, and wake
+     * us up again to run them
+     */
+    take_pending_io(me);
+    while ((c = me->pending_io) != NULL) {
         cb_assert(me == c->thread);
-        pending = pending->next;
-        c->next = NULL;
+        unlink_pending_io(me, c);
+        /* With a barrier, so that nobody pushes it before next is cleared */
+        cas_int(&c->io_pending, 1, 0);
 
         if (c->sfd != INVALID_SOCKET && !c->registered_in_libevent) {
             /* The socket may have been shut down while we're looping */
@@ -348,8 +541,16 @@ static void thread_libevent_process(evutil_socket_t fd, short which, void *arg)
          * run one time to set up the correct mask in libevent
          */
         c->nevents = 1;
+        thread_clock_update(me);
+        MEMCACHED_CONN_IO_RESUME(c->sfd, c->aiostat);
         run_event_loop(c);
+        ++npending;
     }
+    me->loop.pending_io = npending;
+    if (npending > me->loop.max_pending_io) {
+        me->loop.max_pending_io = npending;
+    }
+    thread_callback_done(me, thread_clock_update(me) - start);
     UNLOCK_THREAD(me);
 }
 
@@ -372,124 +573,655 @@ bool has_cycle(conn *c) {
     return false;
 }
 
-bool list_contains(conn *haystack, conn *needle) {
-    for (; haystack; haystack = haystack -> next) {
-        if (needle == haystack) {
-            return true;
-        }
+void notify_io_complete(const void *cookie, ENGINE_ERROR_CODE status)
+{
+    struct conn *conn = (struct conn *)cookie;
+
+    cb_assert(conn);
+    cb_assert(conn->thread);
+
+    settings.extensions.logger->log(EXTENSION_LOG_DEBUG, NULL,
+                                    "Got notify from %d, status %x\n",
+                                    conn->sfd, status);
+
+    MEMCACHED_CONN_IO_COMPLETE(conn->sfd, status);
+
+    /* This doesn't wait for the thread to be done running its connections */
+    conn->aiostat = status;
+    span_mark(conn, SPAN_WAKE);
+
+    /* kick the thread in the butt (the one it is on once it's queued, as
+     * it may move to a replication thread until then) */
+    if (add_conn_to_pending_io_list(conn)) {
+        notify_thread(conn->thread);
     }
-    return false;
 }
 
-conn* list_remove(conn *haystack, conn *needle) {
-    if (!haystack) {
-        return NULL;
+/* The connections of a batch on their way to the pending io of a thread */
+struct pending_batch {
+    LIBEVENT_THREAD *thread;
+    conn *head;
+    conn *tail;
+};
+
+/* How many threads we gather the connections of before we hand them over */
+#define PENDING_BATCH_THREADS 16
+
+/*
+ * Push the connections we gathered for a thread onto its pending_notify
+ * at once (newest first, as add_conn_to_pending_io_list leaves them),
+ * and wake it up if we were the first to.
+ */
+static void push_pending_batch(struct pending_batch *batch) {
+    LIBEVENT_THREAD *thr = batch->thread;
+    conn *head;
+
+    do {
+        head = thr->pending_notify;
+        batch->tail->next = head;
+    } while (!cas_pointer((void * volatile *)&thr->pending_notify, head,
+                          batch->head));
+
+    if (head == NULL) {
+        notify_thread(thr);
     }
+}
+
+void notify_io_complete_batch(const io_completion_t *completions,
+                              size_t count)
+{
+    struct pending_batch batches[PENDING_BATCH_THREADS];
+    int nbatches = 0;
+    size_t ii;
+    int jj;
 
-    if (haystack == needle) {
-        conn *rv = needle->next;
-        needle->next = NULL;
-        return rv;
+    settings.extensions.logger->log(EXTENSION_LOG_DEBUG, NULL,
+                                    "Got %lu notifications\n",
+                                    (unsigned long)count);
+
+    for (ii = 0; ii < count; ++ii) {
+        struct conn *conn = (struct conn *)completions[ii].cookie;
+        LIBEVENT_THREAD *thr;
+
+        cb_assert(conn);
+        cb_assert(conn->thread);
+        MEMCACHED_CONN_IO_COMPLETE(conn->sfd, completions[ii].status);
+        conn->aiostat = completions[ii].status;
+        span_mark(conn, SPAN_WAKE);
+
+        /* Unless it's pending already (see add_conn_to_pending_io_list) */
+        if (!cas_int(&conn->io_pending, 0, 1)) {
+            continue;
+        }
+        thr = conn->thread;
+
+        for (jj = 0; jj < nbatches && batches[jj].thread != thr; ++jj) {
+        }
+        if (jj == nbatches) {
+            if (nbatches == PENDING_BATCH_THREADS) {
+                push_pending_batch(&batches[--nbatches]);
+                jj = nbatches;
+            }
+            batches[jj].thread = thr;
+            batches[jj].head = batches[jj].tail = NULL;
+            ++nbatches;
+        }
+
+        conn->next = batches[jj].head;
+        batches[jj].head = conn;
+        if (batches[jj].tail == NULL) {
+            batches[jj].tail = conn;
+        }
+    }
+
+    for (jj = 0; jj < nbatches; ++jj) {
+        push_pending_batch(&batches[jj]);
     }
+}
+
+/* Which thread we assigned a connection to most recently. */
+static int last_thread = -1;
+
+/* And which replication thread (the workers move them there themselves) */
+static volatile int last_replication_thread = -1;
 
-    haystack->next = list_remove(haystack->next, needle);
+/*
+ * Busy times (per second) this close to each other count as the same, so
+ * that we place by the number of connections between the idle threads
+ */
+#define BUSY_SLACK 10000000
 
-    return haystack;
+#ifdef WIN32
+static void add_thread_conns(LIBEVENT_THREAD *thread, int delta) {
+    InterlockedExchangeAdd((volatile LONG *)&thread->nconns, delta);
+}
+#elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+static void add_thread_conns(LIBEVENT_THREAD *thread, int delta) {
+    atomic_add_int((volatile uint_t *)&thread->nconns, delta);
 }
+#else
+static void add_thread_conns(LIBEVENT_THREAD *thread, int delta) {
+    __sync_add_and_fetch(&thread->nconns, delta);
+}
+#endif
+
+/*
+ * Update the busy time per second of the workers we haven't looked at
+ * within the current second
+ */
+static void sample_thread_load(void) {
+    rel_time_t now = mc_time_get_current_time();
+    int ii;
 
-size_t list_to_array(conn **dest, size_t max_items, conn **l) {
-    size_t n_items = 0;
-    for (; *l && n_items < max_items - 1; ++n_items) {
-        dest[n_items] = *l;
-        *l = dest[n_items]->next;
-        dest[n_items]->next = NULL;
-        dest[n_items]->list_state |= LIST_STATE_PROCESSING;
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        LIBEVENT_THREAD *thread = threads + ii;
+        if (thread->busy_sampled_at != now) {
+            hrtime_t busy = thread->busy;
+            thread->recent_busy = (busy - thread->busy_sampled) /
+                                  (now - thread->busy_sampled_at);
+            thread->busy_sampled = busy;
+            thread->busy_sampled_at = now;
+        }
     }
-    return n_items;
 }
 
-void enlist_conn(conn *c, conn **list) {
-    LIBEVENT_THREAD *thr = c->thread;
-    cb_assert(list == &thr->pending_io);
-    if ((c->list_state & LIST_STATE_PROCESSING) == 0) {
-        cb_assert(!list_contains(thr->pending_io, c));
-        cb_assert(c->next == NULL);
-        c->next = *list;
-        *list = c;
-        cb_assert(list_contains(*list, c));
-        cb_assert(!has_cycle(*list));
-    } else {
-        c->list_state |= LIST_STATE_REQ_PENDING_IO;
+static bool less_loaded(const LIBEVENT_THREAD *a, const LIBEVENT_THREAD *b) {
+    if (a->recent_busy + BUSY_SLACK < b->recent_busy) {
+        return true;
+    }
+    if (b->recent_busy + BUSY_SLACK < a->recent_busy) {
+        return false;
     }
+    return a->nconns < b->nconns;
 }
 
-void finalize_list(conn **list, size_t items) {
-    size_t i;
-    for (i = 0; i < items; i++) {
-        if (list[i] != NULL) {
-            list[i]->list_state &= ~LIST_STATE_PROCESSING;
-            if (list[i]->sfd != INVALID_SOCKET) {
-                if (list[i]->list_state & LIST_STATE_REQ_PENDING_IO) {
-                    enlist_conn(list[i], &list[i]->thread->pending_io);
-                }
-            }
-            list[i]->list_state = 0;
+/*
+ * The least loaded of the workers of the type and thread group (on the
+ * node unless it is -1), starting after the last one we picked so that we
+ * go round-robin between equals. Returns -1 if there is no such worker on
+ * the node. The retired ones don't count.
+ */
+static int least_loaded_thread(int node, enum thread_type type, int group,
+                               int last) {
+    int tid = -1;
+    int ii;
+
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        int candidate = (last + 1 + ii) % settings.num_threads;
+        if (threads[candidate].type != type || threads[candidate].retired ||
+            threads[candidate].group != group ||
+            (node != -1 && threads[candidate].numa_node != node)) {
+            continue;
+        }
+        if (tid == -1 || less_loaded(threads + candidate, threads + tid)) {
+            tid = candidate;
         }
     }
-}
 
-void notify_io_complete(const void *cookie, ENGINE_ERROR_CODE status)
-{
-    struct conn *conn = (struct conn *)cookie;
-    LIBEVENT_THREAD *thr;
-    int notify;
-
-    cb_assert(conn);
-    thr = conn->thread;
-    cb_assert(thr);
+    return tid;
+}
 
-    settings.extensions.logger->log(EXTENSION_LOG_DEBUG, NULL,
-                                    "Got notify from %d, status %x\n",
-                                    conn->sfd, status);
+/*
+ * The NUMA node of the CPU the kernel received the connection's packets
+ * on (the one servicing the NIC queue), or -1 if we can't tell
+ */
+static int conn_numa_node(SOCKET sfd) {
+#if defined(__linux__) && defined(SO_INCOMING_CPU)
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(sfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+        cpu >= 0) {
+        return mc_numa_cpu_node(cpu);
+    }
+#endif
+    (void)sfd;
+    return -1;
+}
 
-    LOCK_THREAD(thr);
-    conn->aiostat = status;
-    notify = add_conn_to_pending_io_list(conn);
-    UNLOCK_THREAD(thr);
+/*
+ * The thread group running the clients of the interface listening on the
+ * port (-1 for the default workers)
+ */
+static int port_thread_group(int port) {
+    int ii;
 
-    /* kick the thread in the butt */
-    if (notify) {
-        notify_thread(thr);
+    for (ii = 0; ii < settings.num_interfaces; ++ii) {
+        if (settings.interfaces[ii].port == port) {
+            return settings.interfaces[ii].group;
+        }
     }
+    return -1;
 }
 
-/* Which thread we assigned a connection to most recently. */
-static int last_thread = -1;
+/*
+ * Returns the thread group of the worker (-1 if it has none).
+ */
+int thread_group_of(int tid) {
+    return threads[tid].group;
+}
 
 /*
- * Dispatches a new connection to another thread. This is only ever called
- * from the main thread, or because of an incoming connection.
+ * Dispatches a new connection to another thread (one of the thread group
+ * of its interface). This is only ever called from the main thread, or
+ * because of an incoming connection.
  */
 void dispatch_conn_new(SOCKET sfd, int parent_port,
                        STATE_FUNC init_state, int event_flags,
                        int read_buffer_size) {
     CQ_ITEM *item = cqi_new();
-    int tid = (last_thread + 1) % settings.num_threads;
+    int group = port_thread_group(parent_port);
+    int tid = -1;
+    LIBEVENT_THREAD *thread;
+
+    sample_thread_load();
+    if (settings.numa) {
+        /* Prefer the workers on the node of the NIC */
+        int node = conn_numa_node(sfd);
+        if (node != -1) {
+            tid = least_loaded_thread(node, GENERAL, group, last_thread);
+        }
+    }
+    if (tid == -1) {
+        tid = least_loaded_thread(-1, GENERAL, group, last_thread);
+    }
 
-    LIBEVENT_THREAD *thread = threads + tid;
+    thread = threads + tid;
 
     last_thread = tid;
+    add_thread_conns(thread, 1);
 
     item->sfd = sfd;
     item->parent_port = parent_port;
     item->init_state = init_state;
     item->event_flags = event_flags;
     item->read_buffer_size = read_buffer_size;
-
-    cq_push(thread->new_conn_queue, item);
+    item->c = NULL;
 
     MEMCACHED_CONN_DISPATCH(sfd, (uintptr_t)thread->thread_id);
-    notify_thread(thread);
+    if (cq_push(thread->new_conn_queue, item)) {
+        notify_thread(thread);
+    }
+}
+
+/*
+ * Hands a listening socket to a worker thread, which accepts the
+ * connections to it itself (see reuseport).
+ */
+void dispatch_listen_conn(SOCKET sfd, int parent_port, int tid) {
+    CQ_ITEM *item = cqi_new();
+    LIBEVENT_THREAD *thread = threads + tid;
+
+    cb_assert(tid < settings.num_threads);
+
+    item->sfd = sfd;
+    item->parent_port = parent_port;
+    item->init_state = conn_listening;
+    item->event_flags = EV_READ | EV_PERSIST;
+    item->read_buffer_size = 1;
+    item->c = NULL;
+
+    add_thread_conns(thread, 1);
+    if (cq_push(thread->new_conn_queue, item)) {
+        notify_thread(thread);
+    }
+}
+
+/*
+ * Moves a connection from the worker running it (the caller) to another
+ * one: a TAP / DCP connection in conn_move_thread to the least loaded of
+ * the replication threads, and a client in conn_leave_thread to the least
+ * loaded of the workers which aren't retired. The caller must not touch
+ * it when this returns. If we fail to queue it, it stays where it is.
+ */
+void dispatch_conn_move(conn *c) {
+    LIBEVENT_THREAD *from = c->thread;
+    LIBEVENT_THREAD *to;
+    CQ_ITEM *item;
+    STATE_FUNC resume;
+    int tid;
+
+    if (c->state == conn_leave_thread) {
+        /* It is between requests, so it just starts on the next one */
+        resume = conn_new_cmd;
+        tid = least_loaded_thread(-1, GENERAL, from->group, last_thread);
+    } else {
+        resume = conn_ship_log;
+        tid = least_loaded_thread(-1, TAP, -1, last_replication_thread);
+    }
+    item = tid == -1 ? NULL : cqi_new();
+    if (item == NULL) {
+        /* Let it run from here then */
+        conn_set_state(c, resume);
+        c->which = EV_WRITE;
+        if (add_conn_to_pending_io_list(c)) {
+            notify_thread(from);
+        }
+        return;
+    }
+    if (resume == conn_ship_log) {
+        last_replication_thread = tid;
+    }
+    to = threads + tid;
+
+    if (c->registered_in_libevent) {
+        unregister_event(c);
+    }
+    /* Keeps everybody from queueing it on the old thread until it's moved */
+    while (!cas_int(&c->io_pending, 0, 1)) {
+        remove_pending_io(c);
+    }
+
+    add_thread_conns(from, -1);
+    add_thread_conns(to, 1);
+
+    memset(item, 0, sizeof(*item));
+    item->c = c;
+    item->init_state = resume;
+    if (cq_push(to->new_conn_queue, item)) {
+        notify_thread(to);
+    }
+}
+
+static bool setup_conn(LIBEVENT_THREAD *me, SOCKET sfd, int parent_port,
+                       STATE_FUNC init_state, int event_flags,
+                       int read_buffer_size) {
+    conn *c = conn_new(sfd, parent_port, init_state, event_flags,
+                       read_buffer_size, me->base, NULL);
+    if (c == NULL) {
+        return false;
+    }
+
+    cb_assert(c->thread == NULL);
+    c->thread = me;
+    if (init_state == conn_listening) {
+        c->next = me->listen_conn;
+        me->listen_conn = c;
+    }
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+    else if (me->group != -1 && settings.thread_groups[me->group].busy_poll) {
+        /* Let the kernel spin on the NIC queue for its reads too (it is
+         * just slower without it, so we don't mind if it says no) */
+        int usec = settings.thread_groups[me->group].busy_poll;
+        (void)setsockopt(sfd, SOL_SOCKET, SO_BUSY_POLL, (void *)&usec,
+                         sizeof(usec));
+    }
+#endif
+    return true;
+}
+
+/*
+ * Creates a connection served by the calling worker thread. Returns false
+ * if we failed to (and the caller still owns the socket).
+ */
+bool thread_conn_new(LIBEVENT_THREAD *me, SOCKET sfd, int parent_port,
+                     STATE_FUNC init_state, int event_flags,
+                     int read_buffer_size) {
+    if (!setup_conn(me, sfd, parent_port, init_state, event_flags,
+                    read_buffer_size)) {
+        return false;
+    }
+    add_thread_conns(me, 1);
+    return true;
+}
+
+/*
+ * Called when a connection the thread served goes away.
+ */
+void thread_conn_released(LIBEVENT_THREAD *me) {
+    add_thread_conns(me, -1);
+}
+
+/*
+ * The most requests we let a connection run with event_time_slice (the
+ * cost of a request may be way off for the next one)
+ */
+#define MAX_REQS_PER_EVENT 1000
+
+/*
+ * Returns the number of requests the connection the thread is about to
+ * run may serve before it yields. With event_time_slice that is its share
+ * of the slice (with the other connections which are ready to run) over
+ * what a request has cost the thread lately.
+ */
+int thread_reqs_per_event(LIBEVENT_THREAD *me) {
+    hrtime_t runnable = 1;
+    hrtime_t budget;
+
+    if (settings.event_time_slice == 0 || me->req_cost == 0) {
+        me->reqs_per_event = settings.reqs_per_event;
+        return me->reqs_per_event;
+    }
+
+#if defined(LIBEVENT_VERSION_NUMBER) && LIBEVENT_VERSION_NUMBER >= 0x02010100
+    /* The one we're running is no longer active */
+    runnable += event_base_get_num_events(me->base, EVENT_BASE_COUNT_ACTIVE);
+#endif
+
+    budget = (hrtime_t)settings.event_time_slice * 1000 / runnable /
+             me->req_cost;
+    if (budget < 1) {
+        budget = 1;
+    } else if (budget > MAX_REQS_PER_EVENT) {
+        budget = MAX_REQS_PER_EVENT;
+    }
+    me->reqs_per_event = (int)budget;
+    return me->reqs_per_event;
+}
+
+/*
+ * Called once the thread is done with a callback of its event loop, which
+ * took the given number of ns.
+ */
+static void thread_callback_done(LIBEVENT_THREAD *me, hrtime_t elapsed) {
+    me->busy += elapsed;
+    me->loop.callbacks++;
+    if (elapsed > me->loop.max_callback) {
+        me->loop.max_callback = elapsed;
+    }
+}
+
+/*
+ * Called once the thread is done running a connection, which started the
+ * given number of requests in the given number of ns.
+ */
+void thread_event_done(LIBEVENT_THREAD *me, uint64_t requests,
+                       hrtime_t elapsed) {
+    thread_callback_done(me, elapsed);
+    if (requests > 0) {
+        hrtime_t cost = elapsed / requests;
+        if (cost == 0) {
+            cost = 1;
+        }
+        if (me->req_cost == 0) {
+            me->req_cost = cost;
+        } else {
+            me->req_cost = (me->req_cost * 7 + cost) / 8;
+        }
+    }
+}
+
+/*
+ * Returns the clock of the thread as of the last time it read it, which is
+ * when it started running its current connection or finished the last
+ * request. That is as good as the time now for stamping the start of the
+ * next request, and it saves reading the clock for every one of them.
+ */
+hrtime_t thread_clock(LIBEVENT_THREAD *me) {
+    return me->now;
+}
+
+/*
+ * Reads the clock, and keeps it as the clock of the thread.
+ * Returns the time now
+ */
+hrtime_t thread_clock_update(LIBEVENT_THREAD *me) {
+    me->now = gethrtime();
+    return me->now;
+}
+
+/*
+ * Returns the average of the request cost and the budget of the workers
+ * (for the stats; they are read without the locks of the threads).
+ */
+void threads_event_budget(uint64_t *req_cost, uint64_t *reqs_per_event) {
+    int ii;
+
+    *req_cost = 0;
+    *reqs_per_event = 0;
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        *req_cost += threads[ii].req_cost;
+        *reqs_per_event += threads[ii].reqs_per_event;
+    }
+    if (settings.num_threads > 0) {
+        *req_cost /= settings.num_threads;
+        *reqs_per_event /= settings.num_threads;
+    }
+}
+
+/*
+ * Sets the number of the client workers which take connections (the
+ * first count of them), and retires the rest. The clients of a retired
+ * worker move to the others as they are done with their requests (see
+ * conn_waiting), so that it goes idle. It can't be more than the workers
+ * we started with, and the ones of the thread groups are left alone.
+ */
+bool threads_set_active(int count) {
+    int ii;
+
+    if (count < 1 || count > ndefault) {
+        return false;
+    }
+    for (ii = 0; ii < ndefault; ++ii) {
+        threads[ii].retired = ii >= count;
+    }
+    return true;
+}
+
+/*
+ * Returns the number of the default client workers which aren't retired.
+ */
+int threads_active(void) {
+    int count = 0;
+    int ii;
+
+    for (ii = 0; ii < ndefault; ++ii) {
+        if (!threads[ii].retired) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+/*
+ * Adds the stats of the event loops of the workers ("stats worker").
+ * They are read without the locks of the threads, so they may be a bit
+ * behind.
+ */
+void threads_worker_stats(ADD_STAT add_stats, conn *c) {
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen, vlen;
+    hrtime_t now = gethrtime();
+    int ii;
+
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        LIBEVENT_THREAD *thread = &threads[ii];
+        uint64_t loops = thread->loop.loops;
+        uint64_t callbacks = thread->loop.callbacks;
+        hrtime_t busy = thread->busy;
+        hrtime_t running = now - thread->loop.started;
+
+        APPEND_NUM_FMT_STAT("worker_%d:%s", ii, "type", "%s",
+                            thread->type == TAP ? "replication" : "general");
+        APPEND_NUM_FMT_STAT("worker_%d:%s", ii, "group", "%s",
+                            thread->group == -1 ? "default" :
+                            settings.thread_groups[thread->group].name);
+        APPEND_NUM_FMT_STAT("worker_%d:%s", ii, "loops", "%" PRIu64, loops);
+        APPEND_NUM_FMT_STAT("worker_%d:%s", ii, "callbacks", "%" PRIu64,
+                            callbacks);
+        APPEND_NUM_FMT_STAT("worker_%d:%s", ii, "callbacks_per_loop", "%.2f",
+                            loops ? (double)callbacks / (double)loops : 0.0);
+        APPEND_NUM_FMT_STAT("worker_%d:%s", ii, "busy_usec", "%" PRIu64,
+                            (uint64_t)(busy / 1000));
+        APPEND_NUM_FMT_STAT("worker_%d:%s", ii, "idle_usec", "%" PRIu64,
+                            (uint64_t)(running > busy ?
+                                       (running - busy) / 1000 : 0));
+        APPEND_NUM_FMT_STAT("worker_%d:%s", ii, "max_callback_usec",
+                            "%" PRIu64,
+                            (uint64_t)(thread->loop.max_callback / 1000));
+        APPEND_NUM_FMT_STAT("worker_%d:%s", ii, "pending_io", "%d",
+                            thread->loop.pending_io);
+        APPEND_NUM_FMT_STAT("worker_%d:%s", ii, "max_pending_io", "%d",
+                            thread->loop.max_pending_io);
+        APPEND_NUM_FMT_STAT("worker_%d:%s", ii, "conns", "%d",
+                            thread->nconns);
+        APPEND_NUM_FMT_STAT("worker_%d:%s", ii, "retired", "%s",
+                            thread->retired ? "true" : "false");
+        if (thread->loop.spins > 0) {
+            APPEND_NUM_FMT_STAT("worker_%d:%s", ii, "spins", "%" PRIu64,
+                                thread->loop.spins);
+            APPEND_NUM_FMT_STAT("worker_%d:%s", ii, "spin_hits", "%" PRIu64,
+                                thread->loop.spin_hits);
+            APPEND_NUM_FMT_STAT("worker_%d:%s", ii, "spin_usec", "%" PRIu64,
+                                (uint64_t)(thread->loop.spinning / 1000));
+        }
+    }
+}
+
+/*
+ * Takes the sampled spans out of the rings of the workers (see span.h)
+ */
+void threads_span_stats(ADD_STAT add_stats, conn *c) {
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen, vlen;
+    int ii;
+
+    for (ii = 0; ii < nthreads; ++ii) {
+        struct span_ring *ring = threads[ii].spans;
+        char *buffer;
+        size_t nbytes;
+
+        if (ring == NULL ||
+            (buffer = malloc(span_ring_bytes(ring))) == NULL) {
+            continue;
+        }
+        nbytes = span_ring_drain(ring, buffer, span_ring_bytes(ring));
+        if (nbytes > 0) {
+            klen = snprintf(key_str, STAT_KEY_LEN, "worker_%d", ii);
+            add_stats(key_str, klen, buffer, (uint32_t)nbytes, c);
+        }
+        free(buffer);
+        APPEND_NUM_FMT_STAT("worker_%d:%s", ii, "dropped", "%" PRIu64,
+                            span_ring_dropped(ring));
+    }
+}
+
+/*
+ * Tells if the thread samples the span of the request it starts (one in
+ * trace_sample_rate of them)
+ */
+bool thread_span_sample(LIBEVENT_THREAD *me) {
+    if (me->spans == NULL || --me->span_countdown > 0) {
+        return false;
+    }
+    me->span_countdown = settings.trace_sample_rate;
+    return true;
+}
+
+/*
+ * Wakes up the workers to pick up a change of whether we accept new
+ * connections (they have listening sockets of their own with reuseport).
+ */
+void notify_listening_threads(void) {
+    int ii;
+
+    if (settings.reuseport) {
+        for (ii = 0; ii < settings.num_threads; ++ii) {
+            notify_thread(&threads[ii]);
+        }
+    }
 }
 
 /*
@@ -527,25 +1259,34 @@ void threadlocal_stats_clear(struct thread_stats *stats) {
     stats->wbufs_loaned = 0;
     stats->iovused_high_watermark = 0;
     stats->msgused_high_watermark = 0;
+    stats->hot_cache_hits = 0;
+    stats->hot_cache_admits = 0;
+    stats->compressed_responses = 0;
+    stats->inflated_responses = 0;
+    stats->hot_cache_inflated_hits = 0;
+    stats->zerocopy_sends = 0;
+    stats->responses_coalesced = 0;
+    stats->conn_backpressure = 0;
+    stats->slow_ops = 0;
 
     memset(stats->slab_stats, 0,
            sizeof(struct slab_stats) * MAX_NUMBER_OF_SLAB_CLASSES);
 }
 
+/*
+ * The workers keep counting while we clear their slots, so a count bumped
+ * at the very same time may survive the reset.
+ */
 void threadlocal_stats_reset(struct thread_stats *thread_stats) {
     int ii;
     for (ii = 0; ii < settings.num_threads; ++ii) {
-        cb_mutex_enter(&thread_stats[ii].mutex);
         threadlocal_stats_clear(&thread_stats[ii]);
-        cb_mutex_exit(&thread_stats[ii].mutex);
     }
 }
 
 void threadlocal_stats_aggregate(struct thread_stats *thread_stats, struct thread_stats *stats) {
     int ii, sid;
     for (ii = 0; ii < settings.num_threads; ++ii) {
-        cb_mutex_enter(&thread_stats[ii].mutex);
-
         stats->cmd_get += thread_stats[ii].cmd_get;
         stats->get_misses += thread_stats[ii].get_misses;
         stats->delete_misses += thread_stats[ii].delete_misses;
@@ -565,6 +1306,15 @@ void threadlocal_stats_aggregate(struct thread_stats *thread_stats, struct threa
         stats->rbufs_existing += thread_stats[ii].rbufs_existing;
         stats->wbufs_allocated += thread_stats[ii].wbufs_allocated;
         stats->wbufs_loaned += thread_stats[ii].wbufs_loaned;
+        stats->hot_cache_hits += thread_stats[ii].hot_cache_hits;
+        stats->hot_cache_admits += thread_stats[ii].hot_cache_admits;
+        stats->compressed_responses += thread_stats[ii].compressed_responses;
+        stats->inflated_responses += thread_stats[ii].inflated_responses;
+        stats->hot_cache_inflated_hits += thread_stats[ii].hot_cache_inflated_hits;
+        stats->zerocopy_sends += thread_stats[ii].zerocopy_sends;
+        stats->responses_coalesced += thread_stats[ii].responses_coalesced;
+        stats->conn_backpressure += thread_stats[ii].conn_backpressure;
+        stats->slow_ops += thread_stats[ii].slow_ops;
 
         if (thread_stats[ii].iovused_high_watermark > stats->iovused_high_watermark) {
             stats->iovused_high_watermark = thread_stats[ii].iovused_high_watermark;
@@ -585,8 +1335,6 @@ void threadlocal_stats_aggregate(struct thread_stats *thread_stats, struct threa
             stats->slab_stats[sid].cas_badval +=
                 thread_stats[ii].slab_stats[sid].cas_badval;
         }
-
-        cb_mutex_exit(&thread_stats[ii].mutex);
     }
 }
 
@@ -616,13 +1364,64 @@ void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out) {
  */
 void thread_init(int nthr, struct event_base *main_base,
                  void (*dispatcher_callback)(evutil_socket_t, short, void *)) {
-    int i;
+    int i, group, first;
     nthreads = nthr + 1;
 
-    cqi_freelist = NULL;
+    mc_mutex_stats_register(&thread_lock_stats, "thread");
+
+    if (settings.replication_threads >= nthr) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "replication_threads must leave some "
+                                        "of the %d threads for the clients, "
+                                        "ignoring it\n", nthr);
+        settings.replication_threads = 0;
+    }
+
+    ndefault = nthr - settings.replication_threads;
+    for (group = 0; group < settings.num_thread_groups; ++group) {
+        ndefault -= settings.thread_groups[group].threads;
+    }
+    if (ndefault < 1) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "thread_groups must leave some of the "
+                                        "%d threads for the other clients, "
+                                        "ignoring them\n", nthr);
+        settings.num_thread_groups = 0;
+        ndefault = nthr - settings.replication_threads;
+    }
+
+    for (i = 0; i < settings.num_interfaces; ++i) {
+        struct interface *interf = &settings.interfaces[i];
+        interf->group = -1;
+        if (interf->thread_group == NULL) {
+            continue;
+        }
+        for (group = 0; group < settings.num_thread_groups; ++group) {
+            if (strcmp(interf->thread_group,
+                       settings.thread_groups[group].name) == 0) {
+                interf->group = group;
+                break;
+            }
+        }
+        if (interf->group == -1) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "Unknown thread group %s for port "
+                                            "%d, using the default workers\n",
+                                            interf->thread_group,
+                                            (int)interf->port);
+        }
+    }
+
+    cqi_cache = cache_create("cq_item", sizeof(CQ_ITEM), sizeof(char*),
+                             NULL, NULL);
+    if (cqi_cache == NULL) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Can't allocate the connection queue "
+                                        "items");
+        exit(1);
+    }
 
     cb_mutex_initialize(&conn_lock);
-    cb_mutex_initialize(&cqi_freelist_lock);
     cb_mutex_initialize(&init_lock);
     cb_cond_initialize(&init_cond);
 
@@ -643,13 +1442,56 @@ void thread_init(int nthr, struct event_base *main_base,
 
     setup_dispatcher(main_base, dispatcher_callback);
 
+    group = -1;
+    first = ndefault;
     for (i = 0; i < nthreads; i++) {
         if (!create_notification_pipe(&threads[i])) {
             exit(1);
         }
         threads[i].index = i;
+        /* Spread the workers evenly over the nodes */
+        threads[i].numa_node = settings.numa ? i % mc_numa_nodes() : 0;
 
         setup_thread(&threads[i]);
+        if (i < nthr && i >= nthr - settings.replication_threads) {
+            threads[i].type = TAP;
+        }
+        /* The groups take the workers after the default ones */
+        while (i == first && group + 1 < settings.num_thread_groups) {
+            first += settings.thread_groups[++group].threads;
+        }
+        threads[i].group = i >= ndefault && threads[i].type != TAP &&
+            i < nthr ? group : -1;
+
+        threads[i].buffers = net_buf_pool_create(threads[i].base,
+                                                 settings.buffer_pool_low,
+                                                 settings.buffer_pool_high);
+        if (threads[i].buffers == NULL) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "Failed to allocate the buffer pool");
+            exit(EXIT_FAILURE);
+        }
+
+        if (settings.hot_cache > 0) {
+            threads[i].hot_cache = hot_cache_create(threads[i].base,
+                                                    settings.hot_cache,
+                                                    settings.hot_cache_ttl);
+            if (threads[i].hot_cache == NULL) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                                "Failed to allocate the hot item cache");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if (settings.trace_sample_rate > 0 && settings.trace_ring_size > 0) {
+            threads[i].spans = span_ring_create(settings.trace_ring_size);
+            if (threads[i].spans == NULL) {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                                "Failed to allocate the span ring");
+                exit(EXIT_FAILURE);
+            }
+            threads[i].span_countdown = settings.trace_sample_rate;
+        }
     }
 
     /* Create threads after we've done all the libevent setup. */
@@ -682,36 +1524,141 @@ void threads_cleanup(void)
         CQ_ITEM *it;
 
         safe_close(threads[ii].notify[0]);
-        safe_close(threads[ii].notify[1]);
+        if (threads[ii].notify[1] != threads[ii].notify[0]) {
+            safe_close(threads[ii].notify[1]);
+        }
+        net_buf_pool_destroy(threads[ii].buffers);
+        span_ring_destroy(threads[ii].spans);
         event_base_free(threads[ii].base);
 
         while ((it = cq_pop(threads[ii].new_conn_queue)) != NULL) {
             cqi_free(it);
         }
         free(threads[ii].new_conn_queue);
-        free(threads[ii].read.buf);
-        free(threads[ii].write.buf);
     }
 
+    cache_destroy(cqi_cache);
+    cqi_cache = NULL;
     free(thread_ids);
     free(threads);
 }
 
+/*
+ * Wakes up a thread. A worker signalled already which hasn't woken up yet
+ * will see what we handed it anyway, so we only tell it once. The
+ * dispatcher counts the notifications (see dispatch_event_handler), so
+ * it gets every one of them.
+ */
 void notify_thread(LIBEVENT_THREAD *thread) {
+    if (thread->type != DISPATCHER && !cas_int(&thread->notified, 0, 1)) {
+        return;
+    }
+
+#ifdef HAVE_EVENTFD
+    {
+        uint64_t one = 1;
+        if (write(thread->notify[1], &one, sizeof(one)) != sizeof(one)) {
+            log_system_error(EXTENSION_LOG_WARNING, NULL,
+                             "Failed to notify thread: %s");
+        }
+    }
+#else
     if (send(thread->notify[1], "", 1, 0) != 1) {
         log_socket_error(EXTENSION_LOG_WARNING, NULL,
                          "Failed to notify thread: %s");
     }
+#endif
 }
 
+/*
+ * Puts the connection on the pending io of its thread (unless it's there
+ * already). It may be called from any thread.
+ * Returns nonzero if the caller must wake the thread up; only the first
+ * one to push onto an empty list does, so that N notifications get
+ * handled with a single wakeup.
+ */
 int add_conn_to_pending_io_list(conn *c) {
-    int notify = 0;
-    if (number_of_pending(c, c->thread->pending_io) == 0) {
-        if (c->thread->pending_io == NULL) {
-            notify = 1;
+    LIBEVENT_THREAD *thr;
+    conn *head;
+
+    if (!cas_int(&c->io_pending, 0, 1)) {
+        return 0;
+    }
+    /* Only once we have it, as it may have been moving to another thread */
+    thr = c->thread;
+
+    do {
+        head = thr->pending_notify;
+        c->next = head;
+    } while (!cas_pointer((void * volatile *)&thr->pending_notify, head, c));
+
+    return head == NULL;
+}
+
+/*
+ * Moves what the other threads pushed onto pending_notify to the end of
+ * pending_io (oldest first). Only the thread itself may call it. It
+ * costs as much as there was pushed (pending_io is doubly linked, and we
+ * know where it ends), not as much as there is pending.
+ */
+static void take_pending_io(LIBEVENT_THREAD *me) {
+    conn *pushed = swap_pointer((void * volatile *)&me->pending_notify, NULL);
+    conn *taken = NULL;
+
+    while (pushed != NULL) {
+        conn *next = pushed->next;
+        pushed->next = taken;
+        taken = pushed;
+        pushed = next;
+    }
+
+    while (taken != NULL) {
+        conn *next = taken->next;
+        taken->next = NULL;
+        taken->pending_prev = me->pending_io_tail;
+        if (me->pending_io_tail == NULL) {
+            me->pending_io = taken;
+        } else {
+            me->pending_io_tail->next = taken;
         }
-        enlist_conn(c, &c->thread->pending_io);
+        me->pending_io_tail = taken;
+        taken = next;
     }
+#ifndef NDEBUG
+    cb_assert(!has_cycle(me->pending_io));
+#endif
+}
+
+/* Takes the connection off pending_io (if it is on it) */
+static void unlink_pending_io(LIBEVENT_THREAD *me, conn *c) {
+    if (c->pending_prev == NULL && me->pending_io != c) {
+        /* Still on its way onto pending_notify */
+        return;
+    }
+    if (c->pending_prev == NULL) {
+        me->pending_io = c->next;
+    } else {
+        c->pending_prev->next = c->next;
+    }
+    if (c->next == NULL) {
+        me->pending_io_tail = c->pending_prev;
+    } else {
+        c->next->pending_prev = c->pending_prev;
+    }
+    c->next = NULL;
+    c->pending_prev = NULL;
+}
+
+/*
+ * Takes the connection off the pending io of its thread (from the thread
+ * itself), as it is about to run or go away.
+ */
+void remove_pending_io(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
 
-    return notify;
+    if (c->io_pending) {
+        take_pending_io(me);
+        unlink_pending_io(me, c);
+        cas_int(&c->io_pending, 1, 0);
+    }
 }
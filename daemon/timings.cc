@@ -5,85 +5,267 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sstream>
+#include <string>
 
 #ifdef HAVE_ATOMIC
 #include <atomic>
+#include <new>
+
+/*
+ * The timings are log-linear histograms of nanoseconds: every power of
+ * two is split into TIMING_SUB_BUCKETS buckets (so a bucket is at most
+ * 12.5% wide), and the values below TIMING_SUB_BUCKETS get one each.
+ *
+ * Every thread collects into histograms of its own (by the index the
+ * caller gives us), so that collecting a timing is a plain increment of a
+ * counter nobody else writes to (they are atomics so that the reader may
+ * look at them at any time). They are merged when somebody asks for them.
+ *
+ * Besides the ones of the whole process there are named groups of them
+ * (a bucket, or a listening port), which the connections look up once and
+ * collect into along with the process.
+ */
+#define TIMING_SUB_BITS 3
+#define TIMING_SUB_BUCKETS (1 << TIMING_SUB_BITS)
+#define TIMING_BUCKETS ((64 - TIMING_SUB_BITS + 1) * TIMING_SUB_BUCKETS)
+
 typedef struct timings_st {
-    /* We collect timings for <=1 us */
-    std::atomic<uint32_t> ns;
+    std::atomic<uint32_t> buckets[TIMING_BUCKETS];
+    std::atomic<uint64_t> max;
+} timings_t;
 
-    /* We collect timings per 10usec */
-    std::atomic<uint32_t> usec[100];
+/* The histograms of a thread, which are allocated the first time it
+ * collects a timing for the opcode (and live as long as the process) */
+typedef struct thread_timings_st {
+    std::atomic<timings_t *> timings[0x100];
+} thread_timings_t;
 
-    /* we collect timings from 0-49 ms (entry 0 is never used!) */
-    std::atomic<uint32_t> msec[50];
+struct timings_group {
+    std::string name;
+    /* By the index of the thread */
+    thread_timings_t *threads;
+};
 
-    std::atomic<uint32_t> halfsec[10];
+/* The most groups we keep (they live as long as the process) */
+#define TIMINGS_MAX_GROUPS 256
 
-    std::atomic<uint32_t> wayout;
-} timings_t;
+static struct timings_group process_timings;
+static struct timings_group *timings_groups[TIMINGS_MAX_GROUPS];
+static int num_timings_groups;
+static cb_mutex_t timings_groups_mutex;
+static int num_timings;
+
+static int timing_bucket(uint64_t nsec)
+{
+    int msb;
+
+    if (nsec < TIMING_SUB_BUCKETS) {
+        return (int)nsec;
+    }
+
+    msb = 63;
+    while ((nsec & ((uint64_t)1 << msb)) == 0) {
+        --msb;
+    }
+    return (msb - TIMING_SUB_BITS + 1) * TIMING_SUB_BUCKETS +
+           (int)((nsec >> (msb - TIMING_SUB_BITS)) & (TIMING_SUB_BUCKETS - 1));
+}
+
+/* The smallest value which goes into the bucket */
+static uint64_t timing_bucket_lower(int bucket)
+{
+    int magnitude;
+
+    if (bucket < TIMING_SUB_BUCKETS) {
+        return (uint64_t)bucket;
+    }
+
+    magnitude = bucket / TIMING_SUB_BUCKETS - 1;
+    return (uint64_t)(TIMING_SUB_BUCKETS + bucket % TIMING_SUB_BUCKETS) <<
+           magnitude;
+}
+
+/* The largest value which goes into the bucket */
+static uint64_t timing_bucket_upper(int bucket)
+{
+    if (bucket == TIMING_BUCKETS - 1) {
+        return ~(uint64_t)0;
+    }
+    return timing_bucket_lower(bucket + 1) - 1;
+}
+
+static thread_timings_t *new_thread_timings(void)
+{
+    thread_timings_t *threads = new (std::nothrow) thread_timings_t[num_timings];
+    if (threads != NULL) {
+        for (int ii = 0; ii < num_timings; ++ii) {
+            for (int jj = 0; jj < 0x100; ++jj) {
+                threads[ii].timings[jj].store(NULL);
+            }
+        }
+    }
+    return threads;
+}
+
+static timings_t *thread_timings(struct timings_group *group, int thread,
+                                 uint8_t cmd)
+{
+    thread_timings_t *threads = group->threads;
+    timings_t *t;
 
-timings_t timings[0x100];
+    if (threads == NULL || thread < 0 || thread >= num_timings) {
+        return NULL;
+    }
+
+    t = threads[thread].timings[cmd].load(std::memory_order_relaxed);
+    if (t == NULL) {
+        t = new (std::nothrow) timings_t;
+        if (t == NULL) {
+            return NULL;
+        }
+        for (int ii = 0; ii < TIMING_BUCKETS; ++ii) {
+            t->buckets[ii].store(0, std::memory_order_relaxed);
+        }
+        t->max.store(0, std::memory_order_relaxed);
+        threads[thread].timings[cmd].store(t);
+    }
+
+    return t;
+}
 
-void collect_timing(uint8_t cmd, hrtime_t nsec)
+void collect_timing(struct timings_group *group, int thread, uint8_t cmd,
+                    hrtime_t nsec)
 {
-    timings_t *t = &timings[cmd];
-    hrtime_t usec = nsec / 1000;
-    hrtime_t msec = usec / 1000;
-    hrtime_t hsec = msec / 500;
-
-    if (usec == 0) {
-        t->ns++;
-    } else if (usec < 1000) {
-        t->usec[usec / 10]++;
-    } else if (msec < 50) {
-        t->msec[msec]++;
-    } else if (hsec < 10) {
-        t->halfsec[hsec]++;
-    } else {
-        t->wayout++;
+    timings_t *t = thread_timings(group ? group : &process_timings,
+                                  thread, cmd);
+    std::atomic<uint32_t> *bucket;
+
+    if (t == NULL) {
+        return;
+    }
+
+    /* We're the only one writing to it */
+    bucket = &t->buckets[timing_bucket(nsec)];
+    bucket->store(bucket->load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+    if (nsec > t->max.load(std::memory_order_relaxed)) {
+        t->max.store(nsec, std::memory_order_relaxed);
     }
 }
 
-void initialize_timings(void)
+void initialize_timings(int nthreads)
 {
-    int ii, jj;
-    for (ii = 0; ii < 0x100; ++ii) {
-        timings[ii].ns.store(0);
-        for (jj = 0; jj < 100; ++jj) {
-            timings[ii].usec[jj].store(0);
+    cb_mutex_initialize(&timings_groups_mutex);
+    num_timings = nthreads;
+    /* We just won't have any timings if it fails */
+    process_timings.threads = new_thread_timings();
+}
+
+struct timings_group *timings_group_get(const char *name, bool create)
+{
+    struct timings_group *group = NULL;
+
+    cb_mutex_enter(&timings_groups_mutex);
+    for (int ii = 0; ii < num_timings_groups; ++ii) {
+        if (timings_groups[ii]->name == name) {
+            group = timings_groups[ii];
+            break;
         }
-        for (jj = 0; jj < 50; ++jj) {
-            timings[ii].msec[jj].store(0);
+    }
+
+    if (group == NULL && create && num_timings_groups < TIMINGS_MAX_GROUPS) {
+        group = new (std::nothrow) struct timings_group;
+        if (group != NULL) {
+            group->name = name;
+            group->threads = new_thread_timings();
+            if (group->threads == NULL) {
+                delete group;
+                group = NULL;
+            } else {
+                timings_groups[num_timings_groups++] = group;
+            }
         }
-        for (jj = 0; jj < 10; ++jj) {
-            timings[ii].halfsec[jj].store(0);
+    }
+    cb_mutex_exit(&timings_groups_mutex);
+
+    return group;
+}
+
+/* The value below which the fraction of the samples are (the upper bound
+ * of where the sample falls, and no more than the largest one) */
+static uint64_t timing_percentile(const uint64_t *buckets, uint64_t total,
+                                  uint64_t max, double fraction)
+{
+    uint64_t rank = (uint64_t)(fraction * (double)total);
+    uint64_t seen = 0;
+
+    if ((double)rank < fraction * (double)total || rank == 0) {
+        ++rank;
+    }
+    for (int ii = 0; ii < TIMING_BUCKETS; ++ii) {
+        seen += buckets[ii];
+        if (seen >= rank) {
+            uint64_t upper = timing_bucket_upper(ii);
+            return upper < max ? upper : max;
         }
-        timings[ii].wayout.store(0);
     }
+    return max;
 }
 #endif
 
-void generate_timings(uint8_t opcode, const void *cookie)
+void generate_timings(struct timings_group *group, uint8_t opcode,
+                      const void *cookie)
 {
     std::stringstream ss;
 #ifdef HAVE_ATOMIC
-    timings_t *t = &timings[opcode];
+    uint64_t buckets[TIMING_BUCKETS];
+    uint64_t total = 0;
+    uint64_t max = 0;
+    bool first = true;
+    thread_timings_t *threads;
 
-    ss << "{\"ns\":" << t->ns.load() << ",\"us\":[";
-    for (int ii = 0; ii < 99; ++ii) {
-        ss << t->usec[ii].load() << ",";
+    if (group == NULL) {
+        group = &process_timings;
     }
-    ss << t->usec[99].load() << "],\"ms\":[";
-    for (int ii = 1; ii < 49; ++ii) {
-        ss << t->msec[ii].load() << ",";
+    threads = group->threads;
+
+    memset(buckets, 0, sizeof(buckets));
+    for (int thread = 0; threads != NULL && thread < num_timings; ++thread) {
+        timings_t *t = threads[thread].timings[opcode].load();
+        if (t != NULL) {
+            for (int ii = 0; ii < TIMING_BUCKETS; ++ii) {
+                buckets[ii] += t->buckets[ii].load(std::memory_order_relaxed);
+            }
+            if (t->max.load(std::memory_order_relaxed) > max) {
+                max = t->max.load(std::memory_order_relaxed);
+            }
+        }
     }
-    ss << t->msec[49].load() << "],\"500ms\":[";
-    for (int ii = 0; ii < 9; ++ii) {
-        ss << t->halfsec[ii].load() << ",";
+    for (int ii = 0; ii < TIMING_BUCKETS; ++ii) {
+        total += buckets[ii];
+    }
+
+    /* All in ns, and the histogram has the buckets with samples in them
+     * as [lowest, highest, count] */
+    ss << "{\"count\":" << total << ",\"max\":" << max
+       << ",\"p50\":" << timing_percentile(buckets, total, max, 0.5)
+       << ",\"p90\":" << timing_percentile(buckets, total, max, 0.9)
+       << ",\"p99\":" << timing_percentile(buckets, total, max, 0.99)
+       << ",\"p99.9\":" << timing_percentile(buckets, total, max, 0.999)
+       << ",\"histogram\":[";
+    for (int ii = 0; ii < TIMING_BUCKETS; ++ii) {
+        if (buckets[ii] > 0) {
+            if (!first) {
+                ss << ",";
+            }
+            first = false;
+            ss << "[" << timing_bucket_lower(ii) << ","
+               << timing_bucket_upper(ii) << "," << buckets[ii] << "]";
+        }
     }
-    ss << t->halfsec[9].load() << "],\"wayout\":" << t->wayout.load() << "}";
+    ss << "]}";
 #else
+    (void)group;
     ss << "{\"error\":\"The server was built without timings support\"}";
 #endif
     std::string str = ss.str();
@@ -8,17 +8,52 @@
 extern "C" {
 #endif
 
+    /* The timings of a bucket or a listening port */
+    struct timings_group;
+
 #ifdef HAVE_ATOMIC
-    void collect_timing(uint8_t cmd, hrtime_t delay);
-    void initialize_timings(void);
+    /**
+     * Collect the time a command took
+     * @param group the group to collect it in, or NULL for the timings of
+     *              the whole process
+     * @param thread the index of the thread which ran it (each one must
+     *               use its own)
+     * @param cmd the opcode of the command
+     * @param delay the ns it took
+     */
+    void collect_timing(struct timings_group *group, int thread,
+                        uint8_t cmd, hrtime_t delay);
+
+    /**
+     * Set up the timings
+     * @param nthreads the number of threads which collect timings
+     */
+    void initialize_timings(int nthreads);
+
+    /**
+     * Look up a group of timings
+     * @param name the name of it
+     * @param create if we should create it if there is no such group
+     * @return the group, or NULL if there is no such group (or we failed
+     *         to create it, or there are too many of them)
+     */
+    struct timings_group *timings_group_get(const char *name, bool create);
 
 #else
 
-#define collect_timing(a, b)
-#define initialize_timings()
+#define collect_timing(a, b, c, d)
+#define initialize_timings(a)
+#define timings_group_get(a, b) NULL
 
 #endif
-    void generate_timings(uint8_t opcode, const void *cookie);
+    /**
+     * Send the timings of a command (as JSON)
+     * @param group the group, or NULL for the timings of the whole process
+     * @param opcode the command
+     * @param cookie the connection to send them to
+     */
+    void generate_timings(struct timings_group *group, uint8_t opcode,
+                          const void *cookie);
 
     bool binary_response_handler(const void *key, uint16_t keylen,
                                  const void *ext, uint8_t extlen,
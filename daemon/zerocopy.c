@@ -0,0 +1,198 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Sending the large values with MSG_ZEROCOPY (see zerocopy.h)
+ */
+#include "config.h"
+#include "zerocopy.h"
+#include "hot_cache.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <linux/errqueue.h>
+#define HAVE_ZEROCOPY 1
+#endif
+
+/*
+ * The smallest value we send with MSG_ZEROCOPY whatever the threshold
+ * (pinning the pages costs more than copying small values)
+ */
+#define ZEROCOPY_MIN 16384
+
+struct zerocopy_hold {
+    struct zerocopy_hold *next;
+    /* The number of zerocopy sends made before we got it */
+    uint32_t sent;
+    enum zerocopy_hold_type type;
+    void *ptr;
+};
+
+static void hold_release(conn *c, struct zerocopy_hold *hold) {
+    switch (hold->type) {
+    case ZEROCOPY_ITEM:
+        settings.engine.v1->release(settings.engine.v0, c, hold->ptr);
+        break;
+    case ZEROCOPY_HOT_ITEM:
+        hot_cache_release(hold->ptr);
+        break;
+    case ZEROCOPY_BUFFER:
+        free(hold->ptr);
+        break;
+    }
+    free(hold);
+}
+
+void zerocopy_init(conn *c) {
+    c->zerocopy = false;
+    c->zerocopy_sent = 0;
+    c->zerocopy_done = 0;
+    c->zerocopy_held = NULL;
+
+#ifdef HAVE_ZEROCOPY
+    if (settings.zerocopy_threshold > 0 && c->ssl == NULL) {
+        int flags = 1;
+        c->zerocopy = setsockopt(c->sfd, SOL_SOCKET, SO_ZEROCOPY,
+                                 (void *)&flags, sizeof(flags)) == 0;
+    }
+#endif
+}
+
+#ifdef HAVE_ZEROCOPY
+static bool is_zerocopy_iov(conn *c, const struct iovec *iov) {
+    const char *base = iov->iov_base;
+    size_t threshold = settings.zerocopy_threshold;
+
+    if (threshold < ZEROCOPY_MIN) {
+        threshold = ZEROCOPY_MIN;
+    }
+
+    /* The write buffer and the coalesced responses are reused as soon as
+     * we're done with the message */
+    return iov->iov_len >= threshold &&
+           (c->write.buf == NULL || base < c->write.buf ||
+            base >= c->write.buf + c->write.size) &&
+           (c->coalesced.buf == NULL || base < c->coalesced.buf ||
+            base >= c->coalesced.buf + c->coalesced.size);
+}
+#endif
+
+ssize_t zerocopy_sendmsg(conn *c, struct msghdr *m, int flags) {
+#ifdef HAVE_ZEROCOPY
+    if (c->zerocopy) {
+        struct msghdr part = *m;
+        size_t ii;
+
+        for (ii = 0; ii < m->msg_iovlen; ++ii) {
+            if (is_zerocopy_iov(c, &m->msg_iov[ii])) {
+                break;
+            }
+        }
+
+        if (ii == 0) {
+            ssize_t res;
+            part.msg_iovlen = 1;
+            res = sendmsg(c->sfd, &part, flags | MSG_ZEROCOPY);
+            if (res > 0) {
+                ++c->zerocopy_sent;
+                STATS_NOKEY(c, zerocopy_sends);
+                return res;
+            } else if (res == -1 && errno == ENOBUFS) {
+                /* We're out of the option memory to pin it with */
+                return sendmsg(c->sfd, &part, flags);
+            }
+            return res;
+        }
+
+        /* Send what we've got up to the value on its own */
+        part.msg_iovlen = ii;
+        return sendmsg(c->sfd, &part, flags);
+    }
+#endif
+
+    return sendmsg(c->sfd, m, flags);
+}
+
+bool zerocopy_hold(conn *c, enum zerocopy_hold_type type, void *ptr) {
+    struct zerocopy_hold *hold;
+
+    if (c->zerocopy_done == c->zerocopy_sent) {
+        return false;
+    }
+
+    hold = malloc(sizeof(*hold));
+    if (hold == NULL) {
+        return false;
+    }
+    hold->sent = c->zerocopy_sent;
+    hold->type = type;
+    hold->ptr = ptr;
+    hold->next = c->zerocopy_held;
+    c->zerocopy_held = hold;
+    return true;
+}
+
+void zerocopy_reap(conn *c) {
+    struct zerocopy_hold **prev;
+
+#ifdef HAVE_ZEROCOPY
+    while (c->zerocopy_done != c->zerocopy_sent) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                                sizeof(struct sockaddr_in6))];
+        struct msghdr msg;
+        struct cmsghdr *cm;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(c->sfd, &msg, MSG_ERRQUEUE) == -1) {
+            break;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *err;
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            err = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            /* ee_info to ee_data are the sends it is done with */
+            if ((int32_t)(err->ee_data + 1 - c->zerocopy_done) > 0) {
+                c->zerocopy_done = err->ee_data + 1;
+            }
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                /* It copied them anyway (like it does over loopback) */
+                c->zerocopy = false;
+            }
+        }
+    }
+#endif
+
+    prev = &c->zerocopy_held;
+    while (*prev != NULL) {
+        struct zerocopy_hold *hold = *prev;
+        if ((int32_t)(c->zerocopy_done - hold->sent) >= 0) {
+            *prev = hold->next;
+            hold_release(c, hold);
+        } else {
+            prev = &hold->next;
+        }
+    }
+}
+
+void zerocopy_release_all(conn *c) {
+    /*
+     * The socket is closed, so the kernel drops what it hasn't sent (the
+     * pages stay pinned until it does)
+     */
+    while (c->zerocopy_held != NULL) {
+        struct zerocopy_hold *hold = c->zerocopy_held;
+        c->zerocopy_held = hold->next;
+        hold_release(c, hold);
+    }
+    c->zerocopy_sent = c->zerocopy_done = 0;
+}
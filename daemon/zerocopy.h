@@ -0,0 +1,71 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include "memcached.h"
+
+/*
+ * Sending the large values with MSG_ZEROCOPY (see the zerocopy_threshold
+ * setting). The kernel sends the value straight out of the item instead
+ * of copying it into the socket buffer, and tells us through the error
+ * queue of the socket once it is done with it. Until then we must not
+ * let go of the item (or the buffer) the value lives in, so whatever the
+ * connection would release while it has zerocopy sends outstanding is
+ * held on to, and released once the kernel is done with all of the sends
+ * made before it.
+ *
+ * The values are sent with a sendmsg of their own so that the kernel
+ * never holds on to the (shared) write buffer of the thread. Only Linux
+ * with MSG_ZEROCOPY supports it; everywhere else this sends as usual.
+ */
+
+struct zerocopy_hold;
+
+enum zerocopy_hold_type {
+    ZEROCOPY_ITEM,
+    ZEROCOPY_HOT_ITEM,
+    ZEROCOPY_BUFFER
+};
+
+/**
+ * Turn on zerocopy for a new connection if it is enabled (and the socket
+ * supports it)
+ * @param c the connection
+ */
+void zerocopy_init(conn *c);
+
+/**
+ * Send (the start of) a message, using MSG_ZEROCOPY for the values over
+ * the threshold
+ * @param c the connection
+ * @param m the message
+ * @param flags the flags to send it with (such as MSG_MORE)
+ * @return what sendmsg returned
+ */
+ssize_t zerocopy_sendmsg(conn *c, struct msghdr *m, int flags);
+
+/**
+ * Hold on to something the connection is done with until the kernel is
+ * done with the zerocopy sends made before it
+ * @param c the connection
+ * @param type what it is
+ * @param ptr the item, hot cache entry or buffer
+ * @return false if the caller should release it (there are no zerocopy
+ *         sends outstanding, or we failed to allocate the hold)
+ */
+bool zerocopy_hold(conn *c, enum zerocopy_hold_type type, void *ptr);
+
+/**
+ * Read the completions off the error queue of the socket and release what
+ * we no longer need to hold on to
+ * @param c the connection
+ */
+void zerocopy_reap(conn *c);
+
+/**
+ * Release everything we hold for a connection going away
+ * @param c the connection
+ */
+void zerocopy_release_all(conn *c);
+
+#endif
@@ -37,6 +37,10 @@ static int ATOMIC_CAS(volatile bucket_state_t *dest, int prev, int next) {
     return old == prev;
 }
 
+static int ATOMIC_CAS_PTR(void * volatile *dest, void *prev, void *next) {
+    return InterlockedCompareExchangePointer(dest, next, prev) == prev;
+}
+
 #elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
 #include <atomic.h>
 static inline int ATOMIC_ADD(volatile int *dest, int value) {
@@ -55,12 +59,19 @@ static inline int ATOMIC_CAS(volatile bucket_state_t *dest, int prev, int next)
     return (prev == atomic_cas_uint((volatile uint_t*)dest, (uint_t)prev,
                                     (uint_t)next));
 }
+
+static inline int ATOMIC_CAS_PTR(void * volatile *dest, void *prev,
+                                 void *next) {
+    return prev == atomic_cas_ptr(dest, prev, next);
+}
 #else
 #define ATOMIC_ADD(i, by) __sync_add_and_fetch(i, by)
 #define ATOMIC_INCR(i) ATOMIC_ADD(i, 1)
 #define ATOMIC_DECR(i) ATOMIC_ADD(i, -1)
 #define ATOMIC_CAS(ptr, oldval, newval) \
             __sync_bool_compare_and_swap(ptr, oldval, newval)
+#define ATOMIC_CAS_PTR(ptr, oldval, newval) \
+            __sync_bool_compare_and_swap(ptr, oldval, newval)
 #endif
 
 static ENGINE_ERROR_CODE (*upstream_reserve_cookie)(const void *cookie);
@@ -110,6 +121,46 @@ static ENGINE_ERROR_CODE bucket_get(ENGINE_HANDLE* handle,
                                     const void* key,
                                     const int nkey,
                                     uint16_t vbucket);
+static ENGINE_ERROR_CODE bucket_get_with_info(ENGINE_HANDLE* handle,
+                                              const void* cookie,
+                                              item** itm,
+                                              item_info *itm_info,
+                                              const void* key,
+                                              const int nkey,
+                                              uint16_t vbucket);
+static ENGINE_ERROR_CODE bucket_get_multi(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          const engine_key_t *keys,
+                                          int nkeys,
+                                          item** itms,
+                                          ENGINE_ERROR_CODE *status);
+static ENGINE_ERROR_CODE bucket_store_multi(ENGINE_HANDLE* handle,
+                                            const void* cookie,
+                                            const engine_store_t *reqs,
+                                            int nreqs,
+                                            uint64_t *cas,
+                                            ENGINE_ERROR_CODE *status);
+static ENGINE_ERROR_CODE bucket_patch(ENGINE_HANDLE* handle,
+                                      const void* cookie,
+                                      const void* key,
+                                      const uint16_t nkey,
+                                      uint64_t offset,
+                                      const void *data,
+                                      uint32_t length,
+                                      uint64_t *cas,
+                                      uint16_t vbucket);
+static ENGINE_ERROR_CODE bucket_sample(ENGINE_HANDLE* handle,
+                                       const void* cookie,
+                                       item **items,
+                                       int nitems,
+                                       int *nfound);
+static ENGINE_ERROR_CODE bucket_touch(ENGINE_HANDLE* handle,
+                                      const void* cookie,
+                                      item **itm,
+                                      const void* key,
+                                      const uint16_t nkey,
+                                      const rel_time_t exptime,
+                                      uint16_t vbucket);
 static ENGINE_ERROR_CODE bucket_get_stats(ENGINE_HANDLE* handle,
                                           const void *cookie,
                                           const char *stat_key,
@@ -328,6 +379,9 @@ static void free_engine_handle(proxied_engine_handle_t *);
 static bool list_buckets(struct bucket_engine *e, struct bucket_list **blist);
 static void bucket_list_free(struct bucket_list *blist);
 static void maybe_start_engine_shutdown(proxied_engine_handle_t *e);
+static void enter_engine_account(proxied_engine_handle_t *peh,
+                                 const void *cookie);
+static void leave_engine_account(void);
 
 
 /**
@@ -375,6 +429,7 @@ static const char * bucket_state_name(bucket_state_t s) {
     case STATE_RUNNING: rv = "running"; break;
     case STATE_STOPPING: rv = "stopping"; break;
     case STATE_STOPPED: rv = "stopped"; break;
+    case STATE_INITIALIZING: rv = "initializing"; break;
     }
     cb_assert(rv);
     return rv;
@@ -437,10 +492,10 @@ static void find_bucket_by_engine(const void* key, size_t nkey,
  * want this notification, so we intercept their attemt to register
  * callbacks and forward the callback to the correct engine.
  *
- * This function will _always_ be called while we're holding the global
- * lock for the hash table (during the call to "initialize" in the
- * underlying engine. It is therefore safe to try to traverse the
- * engines list.
+ * This function is called during the call to "initialize" in the
+ * underlying engine, which runs without the global lock for the hash
+ * table (see create_bucket_UNLOCKED), so we need to grab it to traverse
+ * the engines list.
  */
 static void bucket_register_callback(ENGINE_HANDLE *eh,
                                      ENGINE_EVENT_TYPE type,
@@ -452,13 +507,12 @@ static void bucket_register_callback(ENGINE_HANDLE *eh,
        we need them. */
     cb_assert(type == ON_DISCONNECT);
 
-    /* Assume this always happens while holding the hash table lock. */
-    /* This is called from underlying engine 'initialize' handler
-     * which we invoke with engines_mutex held */
     find_data.needle = eh;
     find_data.peh = NULL;
 
+    lock_engines();
     genhash_iter(bucket_engine.engines, find_bucket_by_engine, &find_data);
+    unlock_engines();
 
     if (find_data.peh) {
         find_data.peh->cb = cb;
@@ -581,6 +635,12 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
     bucket_engine.engine.remove = bucket_item_delete;
     bucket_engine.engine.release = bucket_item_release;
     bucket_engine.engine.get = bucket_get;
+    bucket_engine.engine.get_with_info = bucket_get_with_info;
+    bucket_engine.engine.get_multi = bucket_get_multi;
+    bucket_engine.engine.store_multi = bucket_store_multi;
+    bucket_engine.engine.patch = bucket_patch;
+    bucket_engine.engine.sample = bucket_sample;
+    bucket_engine.engine.touch = bucket_touch;
     bucket_engine.engine.store = bucket_store;
     bucket_engine.engine.arithmetic = bucket_arithmetic;
     bucket_engine.engine.flush = bucket_flush;
@@ -616,6 +676,8 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
     bucket_engine.initialized = false;
     bucket_engine.shutdown.in_progress = false;
     bucket_engine.shutdown.bucket_counter = 0;
+    bucket_engine.shutdown.dying = NULL;
+    bucket_engine.shutdown.reaper_running = false;
     cb_mutex_initialize(&bucket_engine.shutdown.mutex);
     cb_cond_initialize(&bucket_engine.shutdown.cond);
     cb_cond_initialize(&bucket_engine.shutdown.refcount_cond);
@@ -686,6 +748,81 @@ static proxied_engine_handle_t *find_bucket_inner(const char *name) {
     return genhash_find(bucket_engine.engines, name, strlen(name));
 }
 
+/**
+ * A callback function used by genhash_iter to add the engine handles
+ * to a new bucket map.
+ */
+static void bucket_map_add(const void* key, size_t nkey,
+                           const void *val, size_t nval,
+                           void *args) {
+    struct bucket_map *map = args;
+    unsigned int ii = (unsigned int)genhash_string_hash(key, nkey) & map->mask;
+    (void)nval;
+
+    while (map->slots[ii] != NULL) {
+        ii = (ii + 1) & map->mask;
+    }
+    map->slots[ii] = (proxied_engine_handle_t *)val;
+}
+
+static proxied_engine_handle_t *bucket_map_find(struct bucket_map *map,
+                                                const char *name) {
+    size_t nkey = strlen(name);
+    unsigned int ii = (unsigned int)genhash_string_hash(name, nkey) & map->mask;
+    proxied_engine_handle_t *peh;
+
+    /* It always has an empty slot */
+    while ((peh = map->slots[ii]) != NULL) {
+        if (peh->name_len == nkey && memcmp(peh->name, name, nkey) == 0) {
+            return peh;
+        }
+        ii = (ii + 1) & map->mask;
+    }
+    return NULL;
+}
+
+/**
+ * Replace the bucket map with a new one built from the list of engines,
+ * and free the old one once none of the lookups may be using it. It
+ * must be called with the engines lock held every time the list of
+ * engines changes. When it returns nobody may find the engines which are
+ * no longer on the list (unless they hold a reference to them).
+ */
+static void publish_bucket_map(void) {
+    struct bucket_map *map = NULL;
+    struct bucket_map *old = bucket_engine.bucket_map;
+    int ii;
+
+    if (bucket_engine.engines != NULL) {
+        unsigned int size = 2;
+        while (size < 2 * (unsigned int)genhash_size(bucket_engine.engines)) {
+            size <<= 1;
+        }
+        map = calloc(1, sizeof(*map) +
+                     (size - 1) * sizeof(proxied_engine_handle_t *));
+        if (map != NULL) {
+            map->mask = size - 1;
+            genhash_iter(bucket_engine.engines, bucket_map_add, map);
+        }
+        /* Without one the lookups take the lock */
+    }
+
+    /* With a full barrier, so that we see anyone who may have found the
+     * old one */
+    if (!ATOMIC_CAS_PTR((void * volatile *)&bucket_engine.bucket_map,
+                        old, map)) {
+        /* We're the only one replacing it */
+        abort();
+    }
+
+    for (ii = 0; old != NULL && ii < bucket_engine.map_nreaders; ++ii) {
+        while (bucket_engine.map_readers[ii].count != 0) {
+            /* It is in the middle of a lookup, which won't be long */
+        }
+    }
+    free(old);
+}
+
 /**
  * If the bucket is in a runnable state, increment its reference counter
  * and return its handle. Otherwise a NIL pointer is returned.
@@ -704,14 +841,72 @@ static proxied_engine_handle_t* retain_handle(proxied_engine_handle_t *peh) {
     return rv;
 }
 
+/**
+ * The index of the worker thread of the cookie
+ *
+ * @param cookie the cookie of the connection (may be NULL)
+ * @return the index, or -1 if it isn't on one of the worker threads
+ *         (or we don't keep anything by the thread)
+ */
+static int bucket_thread_index(const void *cookie) {
+    int thread = -1;
+
+    if (cookie != NULL &&
+        bucket_engine.upstream_server->cookie->get_thread_index != NULL) {
+        thread = bucket_engine.upstream_server->cookie->get_thread_index(cookie);
+    }
+    if (thread >= bucket_engine.map_nreaders) {
+        thread = -1;
+    }
+    return thread;
+}
+
+/**
+ * The hash of a key of the request of the cookie, which the server
+ * computes once for all of us
+ *
+ * @param cookie the cookie of the connection (may be NULL)
+ * @param key the key
+ * @param nkey the length of the key
+ * @return the hash
+ */
+static uint32_t bucket_key_hash(const void *cookie, const void *key,
+                                size_t nkey) {
+    SERVER_COOKIE_API *api = bucket_engine.upstream_server->cookie;
+
+    if (api->get_key_hash != NULL) {
+        return api->get_key_hash(cookie, key, nkey);
+    }
+    return (uint32_t)genhash_string_hash(key, nkey);
+}
+
 /**
  * Search the list of buckets for a named bucket. If the bucket
  * exists and is in a runnable state, it's reference count is
  * incremented and returned. The caller is responsible for
  * releasing the handle with release_handle.
 */
-static proxied_engine_handle_t *find_bucket(const char *name) {
+static proxied_engine_handle_t *find_bucket(const void *cookie,
+                                            const char *name) {
     proxied_engine_handle_t *rv;
+    int thread = bucket_thread_index(cookie);
+
+    /* The worker threads look it up in the bucket map without the lock,
+     * and the retained handle can't go away once they're done */
+    if (thread >= 0) {
+        struct bucket_thread_count *reader = &bucket_engine.map_readers[thread];
+        struct bucket_map *map;
+
+        ATOMIC_INCR(&reader->count);
+        map = bucket_engine.bucket_map;
+        if (map != NULL) {
+            rv = retain_handle(bucket_map_find(map, name));
+            ATOMIC_DECR(&reader->count);
+            return rv;
+        }
+        ATOMIC_DECR(&reader->count);
+    }
+
     lock_engines();
     rv = retain_handle(find_bucket_inner(name));
     unlock_engines();
@@ -735,15 +930,49 @@ static bool has_valid_bucket_name(const char *n) {
 static ENGINE_ERROR_CODE init_engine_handle(proxied_engine_handle_t *peh,
                                             const char *name,
                                             const char *module) {
+    ALLOCATOR_HOOKS_API *hooks = bucket_engine.upstream_server->alloc_hooks;
+
     peh->stats = bucket_engine.upstream_server->stat->new_stats();
     if (peh->stats == NULL) {
         return ENGINE_ENOMEM;
     }
-    if (bucket_engine.topkeys != 0) {
+    if (bucket_engine.map_nreaders > 0) {
+        /* Without them everyone counts in the shared one */
+        peh->thread_clients = calloc(bucket_engine.map_nreaders,
+                                     sizeof(*peh->thread_clients));
+    }
+    /* The engine allocates from an arena of its own (if the server has
+     * them), which gives its memory back once it's deleted */
+    if (hooks != NULL && hooks->create_arena != NULL &&
+        hooks->create_arena(&peh->account.arena)) {
+        int ii;
+        for (ii = 0; peh->thread_clients != NULL &&
+                 ii < bucket_engine.map_nreaders; ++ii) {
+            peh->thread_clients[ii].account.arena = peh->account.arena;
+        }
+    }
+    if (bucket_engine.topkeys != 0 && bucket_engine.topkeys_sample > 0) {
+        SERVER_HANDLE_V1 *server = bucket_engine.upstream_server;
+        int nthreads = 0;
+        if (server->core->get_num_threads != NULL) {
+            nthreads = server->core->get_num_threads();
+        }
+        peh->tk_sampled = tk_sampled_init(bucket_engine.topkeys,
+                                          (int)bucket_engine.topkeys_sample,
+                                          nthreads,
+                                          server->cookie->get_thread_index,
+                                          bucket_key_hash);
+        if (peh->tk_sampled == NULL) {
+            bucket_engine.upstream_server->stat->release_stats(peh->stats);
+            peh->stats = NULL;
+            return ENGINE_ENOMEM;
+        }
+    } else if (bucket_engine.topkeys != 0) {
         int i;
         peh->topkeys = calloc(TK_SHARDS, sizeof(topkeys_t *));
         for (i = 0; i < TK_SHARDS; i++) {
-            peh->topkeys[i] = topkeys_init(bucket_engine.topkeys);
+            peh->topkeys[i] = topkeys_init(bucket_engine.topkeys,
+                                           bucket_key_hash);
         }
         if (peh->topkeys == NULL) {
             bucket_engine.upstream_server->stat->release_stats(peh->stats);
@@ -762,6 +991,7 @@ static ENGINE_ERROR_CODE init_engine_handle(proxied_engine_handle_t *peh,
         peh->tap_iterator_disabled = true;
     }
 
+    cb_mutex_initialize(&peh->snapshot.mutex);
     peh->state = STATE_RUNNING;
     return ENGINE_SUCCESS;
 }
@@ -772,7 +1002,12 @@ static ENGINE_ERROR_CODE init_engine_handle(proxied_engine_handle_t *peh,
  * proxied engine handle itself...
  */
 static void uninit_engine_handle(proxied_engine_handle_t *peh) {
+    ALLOCATOR_HOOKS_API *hooks = bucket_engine.upstream_server->alloc_hooks;
+
     bucket_engine.upstream_server->stat->release_stats(peh->stats);
+    if (peh->account.arena != 0 && hooks->release_arena != NULL) {
+        hooks->release_arena(peh->account.arena);
+    }
     if (peh->topkeys != NULL) {
         int i;
         for (i = 0; i < TK_SHARDS; i++) {
@@ -780,6 +1015,12 @@ static void uninit_engine_handle(proxied_engine_handle_t *peh) {
         }
         free(peh->topkeys);
     }
+    if (peh->tk_sampled != NULL) {
+        tk_sampled_free(peh->tk_sampled);
+    }
+    free(peh->thread_clients);
+    free(peh->snapshot.buf);
+    cb_mutex_destroy(&peh->snapshot.mutex);
     release_memory((void*)peh->name, peh->name_len);
     /* Note: looks like current engine API allows engine to keep some
      * connections reserved past destroy call return. This implies
@@ -807,6 +1048,12 @@ static void free_engine_handle(proxied_engine_handle_t *peh) {
 /**
  * Creates bucket and places it's handle into *e_out. NOTE: that
  * caller is responsible for calling release_handle on that handle
+ *
+ * The caller holds the engines lock, but we drop it while the engine
+ * initializes (which may take a while for an engine warming up), so
+ * that the other buckets may be created (and looked up) meanwhile. The
+ * bucket is in the list in STATE_INITIALIZING until then, so nobody
+ * else gets to use (or create) it, and shutdown waits for us.
  */
 static ENGINE_ERROR_CODE create_bucket_UNLOCKED(struct bucket_engine *e,
                                                 const char *bucket_name,
@@ -847,22 +1094,57 @@ static ENGINE_ERROR_CODE create_bucket_UNLOCKED(struct bucket_engine *e,
 
     tmppeh = find_bucket_inner(bucket_name);
     if (tmppeh == NULL) {
+        bool skip;
+
+        cb_mutex_enter(&bucket_engine.shutdown.mutex);
+        skip = bucket_engine.shutdown.in_progress;
+        if (!skip) {
+            ++bucket_engine.shutdown.bucket_counter;
+        }
+        cb_mutex_exit(&bucket_engine.shutdown.mutex);
+
+        if (skip) {
+            if (msg) {
+                snprintf(msg, msglen, "Shutting down.");
+            }
+            peh->pe.v1->destroy(peh->pe.v0, true);
+            free_engine_handle(peh);
+            return ENGINE_FAILED;
+        }
+
+        peh->state = STATE_INITIALIZING;
         genhash_update(e->engines, bucket_name, strlen(bucket_name), peh, 0);
+        publish_bucket_map();
 
         /* This was already verified, but we'll check it anyway */
         cb_assert(peh->pe.v0->interface == 1);
 
-        rv = ENGINE_SUCCESS;
+        unlock_engines();
+        enter_engine_account(peh, NULL);
+        rv = peh->pe.v1->initialize(peh->pe.v0, config);
+        leave_engine_account();
+        lock_engines();
 
-        if (peh->pe.v1->initialize(peh->pe.v0, config) != ENGINE_SUCCESS) {
+        if (rv == ENGINE_SUCCESS) {
+            peh->state = STATE_RUNNING;
+        } else {
             peh->pe.v1->destroy(peh->pe.v0, false);
             genhash_delete_all(e->engines, bucket_name, strlen(bucket_name));
+            publish_bucket_map();
             if (msg) {
                 snprintf(msg, msglen,
                          "Failed to initialize instance. Error code: %d\n", rv);
             }
             rv = ENGINE_FAILED;
         }
+
+        cb_mutex_enter(&bucket_engine.shutdown.mutex);
+        --bucket_engine.shutdown.bucket_counter;
+        if (bucket_engine.shutdown.in_progress &&
+            bucket_engine.shutdown.bucket_counter == 0) {
+            cb_cond_signal(&bucket_engine.shutdown.cond);
+        }
+        cb_mutex_exit(&bucket_engine.shutdown.mutex);
     } else {
         if (msg) {
             snprintf(msg, msglen,
@@ -885,23 +1167,149 @@ static ENGINE_ERROR_CODE create_bucket_UNLOCKED(struct bucket_engine *e,
     return rv;
 }
 
+/**
+ * The counter to bump for a client of the cookie calling into the
+ * engine. The worker threads count in one of their own, so that the
+ * calls don't all write to the same cache line, and it's up to the one
+ * shutting the engine down to add them up (see engine_clients).
+ *
+ * @param peh the proxied engine
+ * @param cookie the cookie of the caller
+ * @return the counter
+ */
+static volatile int *engine_clients_counter(proxied_engine_handle_t *peh,
+                                            const void *cookie) {
+    int thread;
+
+    if (peh->thread_clients == NULL) {
+        return &peh->clients;
+    }
+    thread = bucket_thread_index(cookie);
+    return thread >= 0 ? &peh->thread_clients[thread].count : &peh->clients;
+}
+
+/**
+ * The number of clients currently calling into the engine
+ *
+ * @param peh the proxied engine
+ * @return the sum of the counters of all of them
+ */
+static int engine_clients(proxied_engine_handle_t *peh) {
+    int count = peh->clients;
+    int ii;
+
+    for (ii = 0; peh->thread_clients != NULL &&
+             ii < bucket_engine.map_nreaders; ++ii) {
+        count += peh->thread_clients[ii].count;
+    }
+    return count;
+}
+
+/**
+ * The account to charge the memory the cookie allocates in the engine to
+ * (the worker threads have one of their own, like the counters of the
+ * clients)
+ */
+static allocator_account *engine_account(proxied_engine_handle_t *peh,
+                                         const void *cookie) {
+    int thread;
+
+    if (peh->thread_clients == NULL) {
+        return &peh->account;
+    }
+    thread = bucket_thread_index(cookie);
+    return thread >= 0 ? &peh->thread_clients[thread].account : &peh->account;
+}
+
+/**
+ * The memory the threads allocated and freed in the engine
+ *
+ * @param peh the proxied engine
+ * @param allocated where to store the bytes allocated
+ * @param freed where to store the bytes freed
+ */
+static void engine_heap_usage(proxied_engine_handle_t *peh,
+                              uint64_t *allocated, uint64_t *freed) {
+    int ii;
+
+    *allocated = peh->account.allocated;
+    *freed = peh->account.freed;
+    for (ii = 0; peh->thread_clients != NULL &&
+             ii < bucket_engine.map_nreaders; ++ii) {
+        *allocated += peh->thread_clients[ii].account.allocated;
+        *freed += peh->thread_clients[ii].account.freed;
+    }
+}
+
+/**
+ * Charge the memory the thread allocates and frees from now on to the
+ * engine, until the matching leave_engine_account. The calls nest (in
+ * the server), so a call into one engine from within another is charged
+ * to the inner one.
+ */
+static void enter_engine_account(proxied_engine_handle_t *peh,
+                                 const void *cookie) {
+    ALLOCATOR_HOOKS_API *hooks = bucket_engine.upstream_server->alloc_hooks;
+
+    if (hooks != NULL && hooks->enter_account != NULL &&
+        hooks->enter_account(engine_account(peh, cookie)) &&
+        !peh->accounted) {
+        peh->accounted = true;
+    }
+}
+
+static void leave_engine_account(void) {
+    ALLOCATOR_HOOKS_API *hooks = bucket_engine.upstream_server->alloc_hooks;
+
+    if (hooks != NULL && hooks->leave_account != NULL) {
+        hooks->leave_account();
+    }
+}
+
 /**
  * The client returned from the call inside the engine. If this was the
  * last client inside the engine, and the engine is scheduled for removal
  * it should be safe to nuke the engine :)
  *
  * @param engine the proxied engine
+ * @param cookie the cookie of the client (as we got the handle with)
  */
-static void release_engine_handle(proxied_engine_handle_t *engine) {
+static void leave_engine(proxied_engine_handle_t *engine,
+                         const void *cookie) {
+    volatile int *clients = engine_clients_counter(engine, cookie);
     int count;
-    cb_assert(engine->clients > 0);
-    count = ATOMIC_DECR(&engine->clients);
+    cb_assert(*clients > 0);
+    count = ATOMIC_DECR(clients);
     cb_assert(count >= 0);
-    if (count == 0 && engine->state == STATE_STOPPING) {
+    /* Any of the counters may be the last one to drop to zero */
+    if (engine->state == STATE_STOPPING) {
         maybe_start_engine_shutdown(engine);
     }
 }
 
+/**
+ * Release the engine handle we got with get_engine_handle (or
+ * try_get_engine_handle or mem_enter_engine)
+ *
+ * @param engine the proxied engine
+ * @param cookie the cookie of the client (as we got the handle with)
+ */
+static void release_engine_handle(proxied_engine_handle_t *engine,
+                                  const void *cookie) {
+    /* Before the engine may go away with the last client */
+    leave_engine_account();
+    leave_engine(engine, cookie);
+}
+
+/*
+ * Let the server note when we found the bucket of a request it traces
+ */
+static void trace_bucket_found(struct bucket_engine *e, const void *cookie) {
+    if (e->upstream_server->cookie->trace_point != NULL) {
+        e->upstream_server->cookie->trace_point(cookie, SPAN_BUCKET);
+    }
+}
+
 /**
  * Returns engine handle for this connection.
  * All access to underlying engine must go through this function, because
@@ -933,6 +1341,10 @@ static void release_engine_handle(proxied_engine_handle_t *engine) {
      it cannot happen because our bumped clients count prevents that.
  *
  * Q.E.D.
+ *
+ * The same goes for the counter of our thread: the increment and the
+ * change of the state are full barriers, so whoever adds the counters
+ * up after seeing STATE_STOPPING sees ours.
  */
 static proxied_engine_handle_t *get_engine_handle(ENGINE_HANDLE *h,
                                                   const void *cookie) {
@@ -953,14 +1365,16 @@ static proxied_engine_handle_t *get_engine_handle(ENGINE_HANDLE *h,
         }
     }
 
-    count = ATOMIC_INCR(&peh->clients);
+    count = ATOMIC_INCR(engine_clients_counter(peh, cookie));
     cb_assert(count > 0);
 
     if (peh->state != STATE_RUNNING) {
-        release_engine_handle(peh);
-        peh = NULL;
+        leave_engine(peh, cookie);
+        return NULL;
     }
 
+    enter_engine_account(peh, cookie);
+    trace_bucket_found(e, cookie);
     return peh;
 }
 
@@ -985,16 +1399,76 @@ static proxied_engine_handle_t *try_get_engine_handle(ENGINE_HANDLE *h,
     peh = es->peh;
     ret = peh;
 
-    count = ATOMIC_INCR(&peh->clients);
+    count = ATOMIC_INCR(engine_clients_counter(peh, cookie));
     cb_assert(count > 0);
     if (peh->state != STATE_RUNNING) {
-        release_engine_handle(peh);
+        leave_engine(peh, cookie);
         ret = NULL;
+    } else {
+        enter_engine_account(peh, cookie);
+        trace_bucket_found(e, cookie);
     }
 
     return ret;
 }
 
+/**
+ * Check whether the bucket used up its quota of the current second, so
+ * that a busy bucket gets temporary failures instead of taking the
+ * worker threads from the others. The calls racing the start of a new
+ * second may be counted in either, as the quota is only approximate.
+ *
+ * @param peh the proxied engine
+ * @param nops the number of operations of the call
+ * @param start where to store when the call started (0 unless we keep
+ *              the time share), to pass to bucket_quota_used
+ * @return true if the call should fail with ENGINE_TMPFAIL
+ */
+static bool bucket_throttle(proxied_engine_handle_t *peh, int nops,
+                            hrtime_t *start) {
+    rel_time_t now;
+
+    *start = 0;
+    if (bucket_engine.ops_limit == 0 && bucket_engine.time_budget == 0) {
+        return false;
+    }
+
+    now = get_current_time();
+    if (peh->quota.window != now) {
+        peh->quota.window = now;
+        peh->quota.ops = 0;
+        peh->quota.usec = 0;
+    }
+
+    if ((bucket_engine.ops_limit != 0 &&
+         peh->quota.ops >= (int)bucket_engine.ops_limit) ||
+        (bucket_engine.time_budget != 0 &&
+         peh->quota.usec >= bucket_engine.time_budget)) {
+        ATOMIC_INCR(&peh->quota.throttled);
+        return true;
+    }
+
+    if (bucket_engine.ops_limit != 0) {
+        ATOMIC_ADD(&peh->quota.ops, nops);
+    }
+    if (bucket_engine.time_budget != 0) {
+        *start = gethrtime();
+    }
+    return false;
+}
+
+/**
+ * Count the time of a call against the quota of the bucket
+ *
+ * @param peh the proxied engine
+ * @param start when the call started (as bucket_throttle gave us)
+ */
+static void bucket_quota_used(proxied_engine_handle_t *peh, hrtime_t start) {
+    if (start != 0) {
+        ATOMIC_ADD(&peh->quota.usec, (int)((gethrtime() - start) / 1000));
+    }
+}
+
 /**
  * Create an engine specific section for the cookie
  */
@@ -1229,7 +1703,7 @@ static void handle_disconnect(const void *cookie,
     }
 
     if (cb_peh != NULL) {
-        release_engine_handle(cb_peh);
+        release_engine_handle(cb_peh, cookie);
     }
 
     /*
@@ -1288,7 +1762,7 @@ static void handle_connect(const void *cookie,
 
     if (e->default_bucket_name != NULL) {
         /* Assign a default named bucket (if there is one). */
-        peh = find_bucket(e->default_bucket_name);
+        peh = find_bucket(cookie, e->default_bucket_name);
         if (!peh && e->auto_create) {
             lock_engines();
             create_bucket_UNLOCKED(e, e->default_bucket_name,
@@ -1328,7 +1802,7 @@ static void handle_auth(const void *cookie,
                         const void *cb_data) {
     struct bucket_engine *e = (struct bucket_engine*)cb_data;
     const auth_data_t *auth_data = (const auth_data_t*)event_data;
-    proxied_engine_handle_t *peh = find_bucket(auth_data->username);
+    proxied_engine_handle_t *peh = find_bucket(cookie, auth_data->username);
     cb_assert(type == ON_AUTH);
 
     if (!peh && e->auto_create) {
@@ -1372,7 +1846,9 @@ static ENGINE_ERROR_CODE init_default_bucket(struct bucket_engine* se)
         return ENGINE_FAILED;
     }
 
+    enter_engine_account(&se->default_engine, NULL);
     ret = dv1->initialize(se->default_engine.pe.v0, se->default_bucket_config);
+    leave_engine_account();
     if (ret != ENGINE_SUCCESS) {
         dv1->destroy(se->default_engine.pe.v0, false);
     }
@@ -1380,6 +1856,351 @@ static ENGINE_ERROR_CODE init_default_bucket(struct bucket_engine* se)
     return ret;
 }
 
+/* How often the housekeeper wakes up (in ms) */
+#define HOUSEKEEPER_INTERVAL 1000
+
+/* A bucket the memory manager looks at */
+struct mem_bucket {
+    proxied_engine_handle_t *peh;
+    engine_mem_info_t info;
+    /* The evictions since the last look */
+    uint64_t pressure;
+};
+
+/**
+ * Call into the engine from a thread of our own, like get_engine_handle
+ * does for the connections
+ *
+ * @return false if the engine isn't running
+ */
+static bool mem_enter_engine(proxied_engine_handle_t *peh) {
+    int count = ATOMIC_INCR(engine_clients_counter(peh, NULL));
+    cb_assert(count > 0);
+    if (peh->state != STATE_RUNNING) {
+        leave_engine(peh, NULL);
+        return false;
+    }
+    enter_engine_account(peh, NULL);
+    return true;
+}
+
+/**
+ * Look at the memory use of the bucket, and keep it if we may change it
+ *
+ * @return true if we keep it (and have to release it)
+ */
+static bool mem_add_bucket(struct mem_bucket *b, proxied_engine_handle_t *peh) {
+    if (peh->pe.v1 == NULL || !mem_enter_engine(peh)) {
+        return false;
+    }
+    if (peh->pe.v1->get_mem_info == NULL || peh->pe.v1->set_mem_limit == NULL) {
+        release_engine_handle(peh, NULL);
+        return false;
+    }
+
+    b->peh = peh;
+    peh->pe.v1->get_mem_info(peh->pe.v0, NULL, &b->info);
+    /* Somebody may have reset the stats */
+    if (b->info.evictions >= peh->mem_evictions) {
+        b->pressure = b->info.evictions - peh->mem_evictions;
+    } else {
+        b->pressure = b->info.evictions;
+    }
+    peh->mem_evictions = b->info.evictions;
+    return true;
+}
+
+/* The memory the bucket may take but doesn't use */
+static size_t mem_slack(const struct mem_bucket *b) {
+    return b->info.used < b->info.limit ? b->info.limit - b->info.used : 0;
+}
+
+/**
+ * Change the memory limit of the bucket
+ *
+ * @return the new limit (the old one if the engine wouldn't change it)
+ */
+static size_t mem_set_limit(struct mem_bucket *b, size_t limit) {
+    if (b->peh->pe.v1->set_mem_limit(b->peh->pe.v0, NULL,
+                                     limit) == ENGINE_SUCCESS) {
+        b->info.limit = limit;
+    }
+    return b->info.limit;
+}
+
+/**
+ * Move some of the memory budget to the bucket which had to evict the
+ * most items since the last time, from the unused part of the budget or
+ * a bucket which didn't have to evict anything (the one with the most
+ * memory it doesn't use). When the buckets took more than the budget
+ * between them (when they're created with a cache_size of their own) we
+ * take the rest back from them instead. We never leave a bucket with
+ * less than mem_min (or a step of the budget).
+ */
+static void mem_manager_round(void) {
+    struct bucket_list *blist = NULL;
+    struct bucket_list *p;
+    struct mem_bucket *buckets;
+    struct mem_bucket *recipient = NULL;
+    struct mem_bucket *donor = NULL;
+    size_t step = bucket_engine.mem.budget / 32;
+    size_t min = bucket_engine.mem.min > 0 ? bucket_engine.mem.min : step;
+    size_t total = 0;
+    int nbuckets = 1;
+    int num = 0;
+    int ii;
+
+    list_buckets(&bucket_engine, &blist);
+    for (p = blist; p != NULL; p = p->next) {
+        ++nbuckets;
+    }
+    buckets = calloc(nbuckets, sizeof(*buckets));
+    if (buckets == NULL) {
+        bucket_list_free(blist);
+        return;
+    }
+
+    if (bucket_engine.default_engine.pe.v0 != NULL &&
+        mem_add_bucket(&buckets[num], &bucket_engine.default_engine)) {
+        ++num;
+    }
+    for (p = blist; p != NULL; p = p->next) {
+        if (mem_add_bucket(&buckets[num], p->peh)) {
+            ++num;
+        }
+    }
+
+    for (ii = 0; ii < num; ++ii) {
+        struct mem_bucket *b = &buckets[ii];
+        total += b->info.limit;
+        if (b->pressure > 0 &&
+            (recipient == NULL || b->pressure > recipient->pressure)) {
+            recipient = b;
+        }
+    }
+    for (ii = 0; ii < num; ++ii) {
+        struct mem_bucket *b = &buckets[ii];
+        if (b == recipient || b->info.limit <= min ||
+            (b->pressure > 0 && total <= bucket_engine.mem.budget)) {
+            continue;
+        }
+        if (donor == NULL ||
+            (donor->pressure > 0 && b->pressure == 0) ||
+            (b->pressure == donor->pressure &&
+             mem_slack(b) > mem_slack(donor))) {
+            donor = b;
+        }
+    }
+
+    if (total > bucket_engine.mem.budget) {
+        if (donor != NULL) {
+            size_t take = total - bucket_engine.mem.budget;
+            if (take > step) {
+                take = step;
+            }
+            if (take > donor->info.limit - min) {
+                take = donor->info.limit - min;
+            }
+            mem_set_limit(donor, donor->info.limit - take);
+        }
+    } else if (recipient != NULL && step > 0) {
+        size_t grant = bucket_engine.mem.budget - total;
+        if (grant > step) {
+            grant = step;
+        }
+        if (grant < step && donor != NULL) {
+            size_t take = step - grant;
+            size_t limit = donor->info.limit;
+            if (take > limit - min) {
+                take = limit - min;
+            }
+            grant += limit - mem_set_limit(donor, limit - take);
+        }
+        if (grant > 0) {
+            mem_set_limit(recipient, recipient->info.limit + grant);
+            logger->log(EXTENSION_LOG_INFO, NULL,
+                        "Grew the memory of \"%s\" to %lu bytes",
+                        recipient->peh->name,
+                        (unsigned long)recipient->info.limit);
+        }
+    }
+
+    for (ii = 0; ii < num; ++ii) {
+        release_engine_handle(buckets[ii].peh, NULL);
+    }
+    free(buckets);
+    bucket_list_free(blist);
+}
+
+/* The stats of an engine as we take them for the snapshot */
+struct stats_snapshot_builder {
+    char *buf;
+    size_t len;
+    size_t size;
+    bool failed;
+};
+
+/**
+ * The ADD_STAT of the snapshot, which appends the stat in the compact
+ * format: the length of the key (2 bytes) and of the value (4 bytes) in
+ * network byte order, followed by the key and the value.
+ */
+static void stats_snapshot_add_stat(const char *key, const uint16_t klen,
+                                    const char *val, const uint32_t vlen,
+                                    const void *cookie) {
+    struct stats_snapshot_builder *b = (void*)cookie;
+    size_t needed = 6 + klen + vlen;
+    uint16_t nklen = htons(klen);
+    uint32_t nvlen = htonl(vlen);
+
+    if (b->failed) {
+        return;
+    }
+    if (b->size - b->len < needed) {
+        size_t nsize = b->size > 0 ? b->size : 1024;
+        char *ptr;
+        while (nsize - b->len < needed) {
+            nsize <<= 1;
+        }
+        ptr = realloc(b->buf, nsize);
+        if (ptr == NULL) {
+            b->failed = true;
+            return;
+        }
+        b->buf = ptr;
+        b->size = nsize;
+    }
+
+    memcpy(b->buf + b->len, &nklen, 2);
+    memcpy(b->buf + b->len + 2, &nvlen, 4);
+    memcpy(b->buf + b->len + 6, key, klen);
+    memcpy(b->buf + b->len + 6 + klen, val, vlen);
+    b->len += needed;
+}
+
+/**
+ * Take a new snapshot of the general stats of the bucket. The engine
+ * gets the builder as the cookie, which it should only hand back to
+ * add_stat.
+ */
+static void stats_snapshot_refresh(proxied_engine_handle_t *peh) {
+    struct stats_snapshot_builder b;
+    char *old;
+
+    memset(&b, 0, sizeof(b));
+    if (peh->pe.v1->get_stats(peh->pe.v0, &b, NULL, 0,
+                              stats_snapshot_add_stat) != ENGINE_SUCCESS ||
+        b.failed) {
+        free(b.buf);
+        return;
+    }
+
+    cb_mutex_enter(&peh->snapshot.mutex);
+    old = peh->snapshot.buf;
+    peh->snapshot.buf = b.buf;
+    peh->snapshot.len = b.len;
+    peh->snapshot.valid = true;
+    cb_mutex_exit(&peh->snapshot.mutex);
+    free(old);
+}
+
+/**
+ * Throw the snapshot away (so that the stats come from the engine until
+ * the next one)
+ */
+static void stats_snapshot_drop(proxied_engine_handle_t *peh) {
+    char *old;
+
+    cb_mutex_enter(&peh->snapshot.mutex);
+    old = peh->snapshot.buf;
+    peh->snapshot.buf = NULL;
+    peh->snapshot.len = 0;
+    peh->snapshot.valid = false;
+    cb_mutex_exit(&peh->snapshot.mutex);
+    free(old);
+}
+
+/**
+ * Hand the stats of the snapshot to add_stat one by one
+ *
+ * @return false if we don't have a snapshot of the bucket
+ */
+static bool stats_snapshot_replay(proxied_engine_handle_t *peh,
+                                  const void *cookie, ADD_STAT add_stat) {
+    bool ret = false;
+    size_t offset = 0;
+
+    cb_mutex_enter(&peh->snapshot.mutex);
+    if (peh->snapshot.valid) {
+        const char *buf = peh->snapshot.buf;
+        while (offset < peh->snapshot.len) {
+            uint16_t klen;
+            uint32_t vlen;
+            memcpy(&klen, buf + offset, 2);
+            memcpy(&vlen, buf + offset + 2, 4);
+            klen = ntohs(klen);
+            vlen = ntohl(vlen);
+            add_stat(buf + offset + 6, klen, buf + offset + 6 + klen, vlen,
+                     cookie);
+            offset += 6 + klen + vlen;
+        }
+        ret = true;
+    }
+    cb_mutex_exit(&peh->snapshot.mutex);
+    return ret;
+}
+
+/**
+ * Take a new snapshot of the stats of all of the buckets
+ */
+static void stats_snapshot_round(void) {
+    struct bucket_list *blist = NULL;
+    struct bucket_list *p;
+    proxied_engine_handle_t *def = &bucket_engine.default_engine;
+
+    if (def->pe.v0 != NULL && mem_enter_engine(def)) {
+        stats_snapshot_refresh(def);
+        release_engine_handle(def, NULL);
+    }
+
+    list_buckets(&bucket_engine, &blist);
+    for (p = blist; p != NULL; p = p->next) {
+        if (p->peh->pe.v1 != NULL && mem_enter_engine(p->peh)) {
+            stats_snapshot_refresh(p->peh);
+            release_engine_handle(p->peh, NULL);
+        }
+    }
+    bucket_list_free(blist);
+}
+
+/**
+ * The thread moving the memory budget between the buckets and taking
+ * the snapshots of their stats
+ */
+static void housekeeper_main(void *arg) {
+    size_t rounds = 0;
+    (void)arg;
+
+    cb_mutex_enter(&bucket_engine.housekeeper.mutex);
+    while (!bucket_engine.housekeeper.shutdown) {
+        cb_cond_timedwait(&bucket_engine.housekeeper.cond,
+                          &bucket_engine.housekeeper.mutex,
+                          HOUSEKEEPER_INTERVAL);
+        if (!bucket_engine.housekeeper.shutdown) {
+            cb_mutex_exit(&bucket_engine.housekeeper.mutex);
+            if (bucket_engine.mem.budget > 0) {
+                mem_manager_round();
+            }
+            if (bucket_engine.stats_interval > 0 &&
+                rounds++ % bucket_engine.stats_interval == 0) {
+                stats_snapshot_round();
+            }
+            cb_mutex_enter(&bucket_engine.housekeeper.mutex);
+        }
+    }
+    cb_mutex_exit(&bucket_engine.housekeeper.mutex);
+}
+
 /**
  * This is the implementation of the "initialize" function in the engine
  * interface. It is called right after create_instance if memcached liked
@@ -1410,6 +2231,16 @@ static ENGINE_ERROR_CODE bucket_initialize(ENGINE_HANDLE* handle,
         return ret;
     }
 
+    if (se->time_share > 0 && se->time_share < 100) {
+        int nthreads = 1;
+        if (se->upstream_server->core->get_num_threads != NULL &&
+            se->upstream_server->core->get_num_threads() > 0) {
+            nthreads = se->upstream_server->core->get_num_threads();
+        }
+        /* The usec of all the threads in a second */
+        se->time_budget = (int)se->time_share * nthreads * 10000;
+    }
+
     my_hash_ops.hashfunc = genhash_string_hash;
     my_hash_ops.hasheq = my_hash_eq;
     my_hash_ops.dupKey = hash_strdup;
@@ -1422,6 +2253,18 @@ static ENGINE_ERROR_CODE bucket_initialize(ENGINE_HANDLE* handle,
         return ENGINE_ENOMEM;
     }
 
+    if (se->upstream_server->core->get_num_threads != NULL) {
+        int nthreads = se->upstream_server->core->get_num_threads();
+        if (nthreads > 0) {
+            se->map_readers = calloc(nthreads, sizeof(*se->map_readers));
+            /* Without them everyone takes the lock */
+            if (se->map_readers != NULL) {
+                se->map_nreaders = nthreads;
+            }
+        }
+    }
+    publish_bucket_map();
+
     se->upstream_server->callback->register_callback(handle, ON_CONNECT,
                                                      handle_connect, se);
     se->upstream_server->callback->register_callback(handle, ON_AUTH,
@@ -1439,6 +2282,21 @@ static ENGINE_ERROR_CODE bucket_initialize(ENGINE_HANDLE* handle,
         }
     }
 
+    if (se->mem.budget > 0 || se->stats_interval > 0) {
+        cb_mutex_initialize(&se->housekeeper.mutex);
+        cb_cond_initialize(&se->housekeeper.cond);
+        se->housekeeper.shutdown = false;
+        se->housekeeper.running = true;
+        if (cb_create_thread(&se->housekeeper.tid, housekeeper_main,
+                             NULL, 0) != 0) {
+            logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Failed to start the housekeeper; the buckets "
+                        "keep the memory they're given and their stats "
+                        "come from the engines");
+            se->housekeeper.running = false;
+        }
+    }
+
     se->initialized = true;
     return ENGINE_SUCCESS;
 }
@@ -1487,6 +2345,15 @@ static void bucket_destroy(ENGINE_HANDLE* handle,
         return;
     }
 
+    if (se->housekeeper.running) {
+        cb_mutex_enter(&se->housekeeper.mutex);
+        se->housekeeper.shutdown = true;
+        cb_cond_signal(&se->housekeeper.cond);
+        cb_mutex_exit(&se->housekeeper.mutex);
+        cb_join_thread(se->housekeeper.tid);
+        se->housekeeper.running = false;
+    }
+
     cb_mutex_enter(&bucket_engine.shutdown.mutex);
     bucket_engine.shutdown.in_progress = true;
     /* kick bucket deletion threads in butt broadcasting in_progress = true condition */
@@ -1506,6 +2373,10 @@ static void bucket_destroy(ENGINE_HANDLE* handle,
 
     genhash_free(se->engines);
     se->engines = NULL;
+    publish_bucket_map();
+    free(se->map_readers);
+    se->map_readers = NULL;
+    se->map_nreaders = 0;
     free(se->default_engine_path);
     se->default_engine_path = NULL;
     free(se->admin_user);
@@ -1518,6 +2389,71 @@ static void bucket_destroy(ENGINE_HANDLE* handle,
     se->initialized = false;
 }
 
+/**
+ * The reaper frees the deleted buckets once nobody references them any
+ * more (or we're shutting down), and goes away when there are none left.
+ * There's only one of it, so that a bucket's refcount dropping to zero
+ * doesn't wake the threads of all of the other deleted buckets.
+ *
+ * NOTE: that even though DECR in release_handle happens without lock,
+ * the reaper cannot miss wakeup event. That's because broadcast happens
+ * under lock. Here's why.
+ *
+ * Suppose the reaper went to cond_wait sleep with a refcount = 0 and was
+ * never awaken (we want to prove by contradiction that this cannot
+ * happen). But we know it have observed refcount > 0. This means
+ * concurrent release_handle decremented it after we've observed refcount
+ * value. But we know that if this happened, release_handle would go and
+ * broadcast signal. But our assumtion tells us we've missed this
+ * broadcast. But this cannot happen because nobody can do broadcast
+ * between us observing refcount value and going to sleep because we're
+ * holding mutex that broadcast takes.
+ */
+static void bucket_reaper_main(void *arg) {
+    (void)arg;
+
+    cb_mutex_enter(&bucket_engine.shutdown.mutex);
+    while (bucket_engine.shutdown.dying != NULL) {
+        proxied_engine_handle_t **prev = &bucket_engine.shutdown.dying;
+        proxied_engine_handle_t *freed = NULL;
+        proxied_engine_handle_t *peh;
+
+        while ((peh = *prev) != NULL) {
+            if (peh->refcount == 0 || bucket_engine.shutdown.in_progress) {
+                *prev = peh->next_dying;
+                peh->next_dying = freed;
+                freed = peh;
+            } else {
+                prev = &peh->next_dying;
+            }
+        }
+
+        if (freed == NULL) {
+            cb_cond_wait(&bucket_engine.shutdown.refcount_cond,
+                         &bucket_engine.shutdown.mutex);
+            continue;
+        }
+
+        cb_mutex_exit(&bucket_engine.shutdown.mutex);
+        while ((peh = freed) != NULL) {
+            freed = peh->next_dying;
+            logger->log(EXTENSION_LOG_INFO, NULL,
+                        "Release all resources for engine \"%s\"\n",
+                        peh->name);
+            free_engine_handle(peh);
+        }
+        cb_mutex_enter(&bucket_engine.shutdown.mutex);
+    }
+
+    bucket_engine.shutdown.reaper_running = false;
+    --bucket_engine.shutdown.bucket_counter;
+    if (bucket_engine.shutdown.in_progress &&
+        bucket_engine.shutdown.bucket_counter == 0) {
+        cb_cond_signal(&bucket_engine.shutdown.cond);
+    }
+    cb_mutex_exit(&bucket_engine.shutdown.mutex);
+}
+
 /**
  * The deletion (shutdown) of a bucket is performed by its own thread
  * for simplicity (since we can't block the worker threads while we're
@@ -1528,7 +2464,8 @@ static void bucket_destroy(ENGINE_HANDLE* handle,
  * into the engine. Since we don't have any connections calling functions
  * into the engine we can safely start shutdown of the engine, but we can't
  * delete the proxied engine handle until all of the connections has
- * released their reference to the proxied engine handle.
+ * released their reference to the proxied engine handle (which we leave
+ * to the reaper).
  */
 static void engine_shutdown_thread(void *arg) {
     bool skip;
@@ -1577,6 +2514,8 @@ static void engine_shutdown_thread(void *arg) {
     cb_assert(upd == 1);
     cb_assert(genhash_find(bucket_engine.engines,
                         peh->name, peh->name_len) == NULL);
+    /* Anybody who found it in the old map holds a reference by now */
+    publish_bucket_map();
     unlock_engines();
 
     if (peh->cookie != NULL) {
@@ -1586,39 +2525,27 @@ static void engine_shutdown_thread(void *arg) {
                                                                   ENGINE_SUCCESS);
     }
 
-    /* NOTE: that even though DECR in release_handle happens without
-     * lock, engine_shutdown_thread cannot miss wakeup event. That's
-     * because broadcast happens under lock. Here's why.
-     *
-     * Suppose engine_shutdown_thread went to cond_wait sleep with
-     * refcount = 0 and was never awaken (we want to prove by
-     * contradiction that this cannot happen). But we know it have
-     * observed refcount > 0. This means concurrent release_handle
-     * decremented it after we've observed refcount value. But we know
-     * that if this happened, release_handle would go and broadcast
-     * signal. But our assumtion tells us we've missed this
-     * broadcast. But this cannot happen because nobody can do
-     * broadcast between us observing refcount value and going to
-     * sleep because we're holding mutex that broadcast takes.
-     */
-    cb_mutex_enter(&bucket_engine.shutdown.mutex);
-    while (peh->refcount > 0 && !bucket_engine.shutdown.in_progress) {
-        logger->log(EXTENSION_LOG_INFO, NULL,
-                    "There are %d references to \"%s\".. waiting more\n",
-                    peh->refcount, peh->name);
-
-        cb_cond_wait(&bucket_engine.shutdown.refcount_cond,
-                     &bucket_engine.shutdown.mutex);
-    }
-    cb_mutex_exit(&bucket_engine.shutdown.mutex);
-
+    /* Leave it to the reaper, which frees it when the remaining
+     * connections let go of it */
     logger->log(EXTENSION_LOG_INFO, NULL,
-                "Release all resources for engine \"%s\"\n", peh->name);
-
-    /* and free it */
-    free_engine_handle(peh);
-
+                "There are %d references to \"%s\".. leaving it to the "
+                "reaper\n", peh->refcount, peh->name);
     cb_mutex_enter(&bucket_engine.shutdown.mutex);
+    peh->next_dying = bucket_engine.shutdown.dying;
+    bucket_engine.shutdown.dying = peh;
+    if (bucket_engine.shutdown.reaper_running) {
+        cb_cond_broadcast(&bucket_engine.shutdown.refcount_cond);
+    } else {
+        cb_thread_t tid;
+        bucket_engine.shutdown.reaper_running = true;
+        ++bucket_engine.shutdown.bucket_counter;
+        if (cb_create_thread(&tid, bucket_reaper_main, NULL, 1) != 0) {
+            /* Then we're the reaper */
+            cb_mutex_exit(&bucket_engine.shutdown.mutex);
+            bucket_reaper_main(NULL);
+            cb_mutex_enter(&bucket_engine.shutdown.mutex);
+        }
+    }
     --bucket_engine.shutdown.bucket_counter;
     if (bucket_engine.shutdown.in_progress && bucket_engine.shutdown.bucket_counter == 0){
         cb_cond_signal(&bucket_engine.shutdown.cond);
@@ -1640,7 +2567,7 @@ static void maybe_start_engine_shutdown(proxied_engine_handle_t *e) {
     cb_assert(e->state == STATE_STOPPING || e->state == STATE_STOPPED || e->state == STATE_NULL);
     /* observing 'state' before clients == 0 is _crucial_. See
      * get_engine_handle. */
-    if (e->state == STATE_STOPPING && e->clients == 0 && ATOMIC_CAS(&e->state, STATE_STOPPING, STATE_STOPPED)) {
+    if (e->state == STATE_STOPPING && engine_clients(e) == 0 && ATOMIC_CAS(&e->state, STATE_STOPPING, STATE_STOPPED)) {
         /* Spin off a new thread to shut down the engine.. */
         cb_thread_t tid;
         if (cb_create_thread(&tid, engine_shutdown_thread, e, 1) != 0) {
@@ -1669,11 +2596,15 @@ static ENGINE_ERROR_CODE bucket_item_allocate(ENGINE_HANDLE* handle,
 
     proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
     if (peh != NULL) {
-        ENGINE_ERROR_CODE ret;
-        ret = peh->pe.v1->allocate(peh->pe.v0, cookie, itm, key,
-                                   nkey, nbytes, flags, exptime,
-                                   datatype);
-        release_engine_handle(peh);
+        ENGINE_ERROR_CODE ret = ENGINE_TMPFAIL;
+        hrtime_t start;
+        if (!bucket_throttle(peh, 1, &start)) {
+            ret = peh->pe.v1->allocate(peh->pe.v0, cookie, itm, key,
+                                       nkey, nbytes, flags, exptime,
+                                       datatype);
+            bucket_quota_used(peh, start);
+        }
+        release_engine_handle(peh, cookie);
         return ret;
     } else {
         return ENGINE_DISCONNECT;
@@ -1695,15 +2626,21 @@ static ENGINE_ERROR_CODE bucket_item_delete(ENGINE_HANDLE* handle,
     proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
     if (peh) {
         ENGINE_ERROR_CODE ret;
+        hrtime_t start;
+        if (bucket_throttle(peh, 1, &start)) {
+            release_engine_handle(peh, cookie);
+            return ENGINE_TMPFAIL;
+        }
         ret = peh->pe.v1->remove(peh->pe.v0, cookie, key, nkey, cas, vbucket);
-        release_engine_handle(peh);
+        bucket_quota_used(peh, start);
+        release_engine_handle(peh, cookie);
 
         if (ret == ENGINE_SUCCESS) {
-            TK(peh->topkeys, delete_hits, key, nkey, get_current_time());
+            TK(peh, cookie, delete_hits, key, nkey, get_current_time());
         } else if (ret == ENGINE_KEY_ENOENT) {
-            TK(peh->topkeys, delete_misses, key, nkey, get_current_time());
+            TK(peh, cookie, delete_misses, key, nkey, get_current_time());
         } else if (ret == ENGINE_KEY_EEXISTS) {
-            TK(peh->topkeys, cas_badval, key, nkey, get_current_time());
+            TK(peh, cookie, cas_badval, key, nkey, get_current_time());
         }
 
         return ret;
@@ -1723,7 +2660,7 @@ static void bucket_item_release(ENGINE_HANDLE* handle,
     proxied_engine_handle_t *peh = try_get_engine_handle(handle, cookie);
     if (peh) {
         peh->pe.v1->release(peh->pe.v0, cookie, itm);
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         logger->log(EXTENSION_LOG_DEBUG, NULL,
                     "Potential memory leak. Failed to get engine handle for %p",
@@ -1746,15 +2683,233 @@ static ENGINE_ERROR_CODE bucket_get(ENGINE_HANDLE* handle,
     proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
     if (peh) {
         ENGINE_ERROR_CODE ret;
+        hrtime_t start;
+        if (bucket_throttle(peh, 1, &start)) {
+            release_engine_handle(peh, cookie);
+            return ENGINE_TMPFAIL;
+        }
         ret = peh->pe.v1->get(peh->pe.v0, cookie, itm, key, nkey, vbucket);
+        bucket_quota_used(peh, start);
 
         if (ret == ENGINE_SUCCESS) {
-            TK(peh->topkeys, get_hits, key, nkey, get_current_time());
+            TK(peh, cookie, get_hits, key, nkey, get_current_time());
         } else if (ret == ENGINE_KEY_ENOENT) {
-            TK(peh->topkeys, get_misses, key, nkey, get_current_time());
+            TK(peh, cookie, get_misses, key, nkey, get_current_time());
+        }
+
+        release_engine_handle(peh, cookie);
+        return ret;
+    } else {
+        return ENGINE_DISCONNECT;
+    }
+}
+
+/**
+ * Implementation of the "get_with_info" function in the engine
+ * specification. Engines without it get ENGINE_ENOTSUP so that the
+ * server falls back to calling get and get_item_info.
+ */
+static ENGINE_ERROR_CODE bucket_get_with_info(ENGINE_HANDLE* handle,
+                                              const void* cookie,
+                                              item** itm,
+                                              item_info *itm_info,
+                                              const void* key,
+                                              const int nkey,
+                                              uint16_t vbucket) {
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh) {
+        ENGINE_ERROR_CODE ret = ENGINE_ENOTSUP;
+        hrtime_t start;
+        if (peh->pe.v1->get_with_info != NULL) {
+            if (bucket_throttle(peh, 1, &start)) {
+                release_engine_handle(peh, cookie);
+                return ENGINE_TMPFAIL;
+            }
+            ret = peh->pe.v1->get_with_info(peh->pe.v0, cookie, itm,
+                                            itm_info, key, nkey, vbucket);
+            bucket_quota_used(peh, start);
+
+            if (ret == ENGINE_SUCCESS) {
+                TK(peh, cookie, get_hits, key, nkey, get_current_time());
+            } else if (ret == ENGINE_KEY_ENOENT) {
+                TK(peh, cookie, get_misses, key, nkey, get_current_time());
+            }
+        }
+
+        release_engine_handle(peh, cookie);
+        return ret;
+    } else {
+        return ENGINE_DISCONNECT;
+    }
+}
+
+/**
+ * Implementation of the "get_multi" function in the engine
+ * specification. Engines without it get ENGINE_ENOTSUP so that the
+ * server falls back to calling get for each key.
+ */
+static ENGINE_ERROR_CODE bucket_get_multi(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          const engine_key_t *keys,
+                                          int nkeys,
+                                          item** itms,
+                                          ENGINE_ERROR_CODE *status) {
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh) {
+        ENGINE_ERROR_CODE ret = ENGINE_ENOTSUP;
+        hrtime_t start;
+        if (peh->pe.v1->get_multi != NULL) {
+            /* The server gets them one by one when we fail it */
+            if (bucket_throttle(peh, nkeys, &start)) {
+                release_engine_handle(peh, cookie);
+                return ENGINE_TMPFAIL;
+            }
+            ret = peh->pe.v1->get_multi(peh->pe.v0, cookie, keys, nkeys,
+                                        itms, status);
+            bucket_quota_used(peh, start);
+        }
+
+        if (ret == ENGINE_SUCCESS) {
+            int ii;
+            for (ii = 0; ii < nkeys; ++ii) {
+                if (status[ii] == ENGINE_SUCCESS) {
+                    TK(peh, cookie, get_hits, keys[ii].key, keys[ii].nkey,
+                       get_current_time());
+                } else if (status[ii] == ENGINE_KEY_ENOENT) {
+                    TK(peh, cookie, get_misses, keys[ii].key, keys[ii].nkey,
+                       get_current_time());
+                }
+            }
+        }
+
+        release_engine_handle(peh, cookie);
+        return ret;
+    } else {
+        return ENGINE_DISCONNECT;
+    }
+}
+
+/**
+ * Implementation of the "store_multi" function in the engine
+ * specification (see bucket_get_multi).
+ */
+static ENGINE_ERROR_CODE bucket_store_multi(ENGINE_HANDLE* handle,
+                                            const void* cookie,
+                                            const engine_store_t *reqs,
+                                            int nreqs,
+                                            uint64_t *cas,
+                                            ENGINE_ERROR_CODE *status) {
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh) {
+        ENGINE_ERROR_CODE ret = ENGINE_ENOTSUP;
+        if (peh->pe.v1->store_multi != NULL) {
+            ret = peh->pe.v1->store_multi(peh->pe.v0, cookie, reqs, nreqs,
+                                          cas, status);
+        }
+
+        if (ret == ENGINE_SUCCESS && (peh->topkeys || peh->tk_sampled)) {
+            int ii;
+            for (ii = 0; ii < nreqs; ++ii) {
+                const void *key = reqs[ii].key;
+                const int nkey = reqs[ii].nkey;
+
+                if (reqs[ii].operation != OPERATION_CAS) {
+                    TK(peh, cookie, cmd_set, key, nkey, get_current_time());
+                } else if (status[ii] == ENGINE_SUCCESS) {
+                    TK(peh, cookie, cas_hits, key, nkey, get_current_time());
+                } else if (status[ii] == ENGINE_KEY_EEXISTS) {
+                    TK(peh, cookie, cas_badval, key, nkey,
+                       get_current_time());
+                } else if (status[ii] == ENGINE_KEY_ENOENT) {
+                    TK(peh, cookie, cas_misses, key, nkey,
+                       get_current_time());
+                }
+            }
+        }
+
+        release_engine_handle(peh, cookie);
+        return ret;
+    } else {
+        return ENGINE_DISCONNECT;
+    }
+}
+
+/**
+ * Implementation of the "patch" function in the engine
+ * specification.
+ */
+static ENGINE_ERROR_CODE bucket_patch(ENGINE_HANDLE* handle,
+                                      const void* cookie,
+                                      const void* key,
+                                      const uint16_t nkey,
+                                      uint64_t offset,
+                                      const void *data,
+                                      uint32_t length,
+                                      uint64_t *cas,
+                                      uint16_t vbucket) {
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh) {
+        ENGINE_ERROR_CODE ret = ENGINE_ENOTSUP;
+        if (peh->pe.v1->patch != NULL) {
+            ret = peh->pe.v1->patch(peh->pe.v0, cookie, key, nkey, offset,
+                                    data, length, cas, vbucket);
+        }
+        release_engine_handle(peh, cookie);
+        return ret;
+    } else {
+        return ENGINE_DISCONNECT;
+    }
+}
+
+/**
+ * Implementation of the "sample" function in the engine
+ * specification.
+ */
+static ENGINE_ERROR_CODE bucket_sample(ENGINE_HANDLE* handle,
+                                       const void* cookie,
+                                       item **items,
+                                       int nitems,
+                                       int *nfound) {
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh) {
+        ENGINE_ERROR_CODE ret = ENGINE_ENOTSUP;
+        if (peh->pe.v1->sample != NULL) {
+            ret = peh->pe.v1->sample(peh->pe.v0, cookie, items, nitems,
+                                     nfound);
         }
+        release_engine_handle(peh, cookie);
+        return ret;
+    } else {
+        return ENGINE_DISCONNECT;
+    }
+}
 
-        release_engine_handle(peh);
+/**
+ * Implementation of the "touch" function in the engine
+ * specification. Engines without it get ENGINE_ENOTSUP so that the
+ * server sends the command to unknown_command.
+ */
+static ENGINE_ERROR_CODE bucket_touch(ENGINE_HANDLE* handle,
+                                      const void* cookie,
+                                      item **itm,
+                                      const void* key,
+                                      const uint16_t nkey,
+                                      const rel_time_t exptime,
+                                      uint16_t vbucket) {
+    proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
+    if (peh) {
+        ENGINE_ERROR_CODE ret = ENGINE_ENOTSUP;
+        hrtime_t start;
+        if (peh->pe.v1->touch != NULL) {
+            if (bucket_throttle(peh, 1, &start)) {
+                release_engine_handle(peh, cookie);
+                return ENGINE_TMPFAIL;
+            }
+            ret = peh->pe.v1->touch(peh->pe.v0, cookie, itm, key, nkey,
+                                    exptime, vbucket);
+            bucket_quota_used(peh, start);
+        }
+        release_engine_handle(peh, cookie);
         return ret;
     } else {
         return ENGINE_DISCONNECT;
@@ -1902,22 +3057,67 @@ static ENGINE_ERROR_CODE bucket_get_stats(ENGINE_HANDLE* handle,
     if (peh) {
         if (nkey == (sizeof("topkeys") - 1) &&
             memcmp("topkeys", stat_key, nkey) == 0) {
-            rc = topkeys_stats(peh->topkeys, TK_SHARDS, cookie, get_current_time(),
-                               add_stat);
+            if (peh->tk_sampled != NULL) {
+                rc = tk_sampled_stats(peh->tk_sampled, cookie,
+                                      get_current_time(), add_stat);
+            } else {
+                rc = topkeys_stats(peh->topkeys, TK_SHARDS, cookie,
+                                   get_current_time(), add_stat);
+            }
+        } else if (nkey == (sizeof("snapshot") - 1) &&
+                   memcmp("snapshot", stat_key, nkey) == 0 &&
+                   bucket_engine.stats_interval > 0) {
+            /* All of them as one stat in the compact format */
+            rc = ENGINE_TMPFAIL;
+            cb_mutex_enter(&peh->snapshot.mutex);
+            if (peh->snapshot.valid) {
+                add_stat("snapshot", sizeof("snapshot") - 1,
+                         peh->snapshot.buf, (uint32_t)peh->snapshot.len,
+                         cookie);
+                rc = ENGINE_SUCCESS;
+            }
+            cb_mutex_exit(&peh->snapshot.mutex);
         } else {
-            rc = peh->pe.v1->get_stats(peh->pe.v0, cookie, stat_key,
-                                       nkey, add_stat);
+            if (nkey == 0 && bucket_engine.stats_interval > 0 &&
+                stats_snapshot_replay(peh, cookie, add_stat)) {
+                rc = ENGINE_SUCCESS;
+            } else {
+                rc = peh->pe.v1->get_stats(peh->pe.v0, cookie, stat_key,
+                                           nkey, add_stat);
+            }
             if (nkey == 0) {
-                char statval[20];
+                char statval[32];
                 snprintf(statval, sizeof(statval), "%d", peh->refcount - 1);
                 add_stat("bucket_conns", sizeof("bucket_conns") - 1, statval,
                          (uint32_t)strlen(statval), cookie);
-                snprintf(statval, sizeof(statval), "%d", peh->clients);
+                snprintf(statval, sizeof(statval), "%d", engine_clients(peh));
                 add_stat("bucket_active_conns", sizeof("bucket_active_conns") -1,
                          statval, (uint32_t)strlen(statval), cookie);
+                if (bucket_engine.ops_limit != 0 ||
+                    bucket_engine.time_budget != 0) {
+                    snprintf(statval, sizeof(statval), "%d",
+                             peh->quota.throttled);
+                    add_stat("bucket_throttled",
+                             sizeof("bucket_throttled") - 1,
+                             statval, (uint32_t)strlen(statval), cookie);
+                }
+                if (peh->accounted) {
+                    uint64_t allocated;
+                    uint64_t freed;
+                    engine_heap_usage(peh, &allocated, &freed);
+                    snprintf(statval, sizeof(statval), "%"PRIu64, allocated);
+                    add_stat("bucket_heap_allocated",
+                             sizeof("bucket_heap_allocated") - 1,
+                             statval, (uint32_t)strlen(statval), cookie);
+                    snprintf(statval, sizeof(statval), "%"PRId64,
+                             (int64_t)(allocated - freed));
+                    add_stat("bucket_heap_used",
+                             sizeof("bucket_heap_used") - 1,
+                             statval, (uint32_t)strlen(statval), cookie);
+                }
             }
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     }
     return rc;
 }
@@ -1934,7 +3134,7 @@ static void *bucket_get_stats_struct(ENGINE_HANDLE* handle,
     proxied_engine_handle_t *peh = try_get_engine_handle(handle, cookie);
     if (peh) {
         ret = peh->stats;
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     }
 
     return ret;
@@ -1956,7 +3156,7 @@ static ENGINE_ERROR_CODE bucket_store(ENGINE_HANDLE* handle,
     if (peh) {
         ENGINE_ERROR_CODE ret;
         ret = peh->pe.v1->store(peh->pe.v0, cookie, itm, cas, operation, vbucket);
-        if (ret != ENGINE_EWOULDBLOCK && peh->topkeys) {
+        if (ret != ENGINE_EWOULDBLOCK && (peh->topkeys || peh->tk_sampled)) {
             item_info itm_info;
             itm_info.nvalue = 1;
             if (peh->pe.v1->get_item_info(peh->pe.v0, cookie, itm, &itm_info)) {
@@ -1964,22 +3164,22 @@ static ENGINE_ERROR_CODE bucket_store(ENGINE_HANDLE* handle,
                 const int nkey = itm_info.nkey;
 
                 if (operation != OPERATION_CAS) {
-                    TK(peh->topkeys, cmd_set, key, nkey, get_current_time());
+                    TK(peh, cookie, cmd_set, key, nkey, get_current_time());
                 } else {
                     if (ret == ENGINE_SUCCESS) {
-                        TK(peh->topkeys, cas_hits, key, nkey,
+                        TK(peh, cookie, cas_hits, key, nkey,
                            get_current_time());
                     } else if (ret == ENGINE_KEY_EEXISTS) {
-                        TK(peh->topkeys, cas_badval, key, nkey,
+                        TK(peh, cookie, cas_badval, key, nkey,
                            get_current_time());
                     } else if (ret == ENGINE_KEY_ENOENT) {
-                        TK(peh->topkeys, cas_misses, key, nkey,
+                        TK(peh, cookie, cas_misses, key, nkey,
                            get_current_time());
                     }
                 }
             }
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
         return ret;
     } else {
         return ENGINE_DISCONNECT;
@@ -2008,28 +3208,34 @@ static ENGINE_ERROR_CODE bucket_arithmetic(ENGINE_HANDLE* handle,
     proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
     if (peh) {
         ENGINE_ERROR_CODE ret;
+        hrtime_t start;
+        if (bucket_throttle(peh, 1, &start)) {
+            release_engine_handle(peh, cookie);
+            return ENGINE_TMPFAIL;
+        }
         ret = peh->pe.v1->arithmetic(peh->pe.v0, cookie, key, nkey,
                                 increment, create, delta, initial,
                                 exptime, cas, datatype, result, vbucket);
+        bucket_quota_used(peh, start);
 
 
         if (ret == ENGINE_SUCCESS) {
             if (increment) {
-                TK(peh->topkeys, incr_hits, key, nkey, get_current_time());
+                TK(peh, cookie, incr_hits, key, nkey, get_current_time());
             } else {
-                TK(peh->topkeys, decr_hits, key, nkey, get_current_time());
+                TK(peh, cookie, decr_hits, key, nkey, get_current_time());
 
             }
         } else if (ret == ENGINE_KEY_ENOENT) {
             if (increment) {
-                TK(peh->topkeys, incr_misses, key, nkey, get_current_time());
+                TK(peh, cookie, incr_misses, key, nkey, get_current_time());
             } else {
-                TK(peh->topkeys, decr_misses, key, nkey, get_current_time());
+                TK(peh, cookie, decr_misses, key, nkey, get_current_time());
 
             }
         }
 
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
         return ret;
     } else {
         return ENGINE_DISCONNECT;
@@ -2048,7 +3254,7 @@ static ENGINE_ERROR_CODE bucket_flush(ENGINE_HANDLE* handle,
     if (peh) {
         ENGINE_ERROR_CODE ret;
         ret = peh->pe.v1->flush(peh->pe.v0, cookie, when);
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
         return ret;
     } else {
         return ENGINE_DISCONNECT;
@@ -2064,7 +3270,8 @@ static void bucket_reset_stats(ENGINE_HANDLE* handle, const void *cookie) {
     proxied_engine_handle_t *peh = try_get_engine_handle(handle, cookie);
     if (peh) {
         peh->pe.v1->reset_stats(peh->pe.v0, cookie);
-        release_engine_handle(peh);
+        stats_snapshot_drop(peh);
+        release_engine_handle(peh, cookie);
     }
 }
 
@@ -2081,7 +3288,7 @@ static bool bucket_get_item_info(ENGINE_HANDLE *handle,
     proxied_engine_handle_t *peh = try_get_engine_handle(handle, cookie);
     if (peh) {
         ret = peh->pe.v1->get_item_info(peh->pe.v0, cookie, itm, itm_info);
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     }
 
     return ret;
@@ -2100,7 +3307,7 @@ static bool bucket_set_item_info(ENGINE_HANDLE *handle,
     proxied_engine_handle_t *peh = try_get_engine_handle(handle, cookie);
     if (peh) {
         ret = peh->pe.v1->set_item_info(peh->pe.v0, cookie, itm, itm_info);
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     }
 
     return ret;
@@ -2117,7 +3324,7 @@ static void bucket_item_set_cas(ENGINE_HANDLE *handle, const void *cookie,
     proxied_engine_handle_t *peh = try_get_engine_handle(handle, cookie);
     if (peh) {
         peh->pe.v1->item_set_cas(peh->pe.v0, cookie, itm, cas);
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         logger->log(EXTENSION_LOG_WARNING, NULL,
                     "The engine is no longer there... %p", cookie);
@@ -2153,7 +3360,7 @@ static ENGINE_ERROR_CODE bucket_tap_notify(ENGINE_HANDLE* handle,
                                 nengine, ttl, tap_flags, tap_event, tap_seqno,
                                 key, nkey, flags, exptime, cas, datatype,
                                 data, ndata, vbucket);
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
         return ret;
     } else {
         return ENGINE_DISCONNECT;
@@ -2183,7 +3390,7 @@ static tap_event_t bucket_tap_iterator_shim(ENGINE_HANDLE* handle,
                               ttl, flags, seqno, vbucket);
 
 
-        release_engine_handle(e);
+        release_engine_handle(e, cookie);
         return ret;
     } else {
         return TAP_DISCONNECT;
@@ -2209,7 +3416,7 @@ static TAP_ITERATOR bucket_get_tap_iterator(ENGINE_HANDLE* handle, const void* c
                                                          flags, userdata, nuserdata);
             ret = e->tap_iterator ? bucket_tap_iterator_shim : NULL;
         }
-        release_engine_handle(e);
+        release_engine_handle(e, cookie);
     }
 
     return ret;
@@ -2226,7 +3433,7 @@ static ENGINE_ERROR_CODE dcp_step(ENGINE_HANDLE* handle, const void* cookie,
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2252,7 +3459,7 @@ static ENGINE_ERROR_CODE dcp_open(ENGINE_HANDLE* handle,
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2276,7 +3483,7 @@ static ENGINE_ERROR_CODE dcp_add_stream(ENGINE_HANDLE* handle,
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2298,7 +3505,7 @@ static ENGINE_ERROR_CODE dcp_close_stream(ENGINE_HANDLE* handle,
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2331,7 +3538,7 @@ static ENGINE_ERROR_CODE dcp_stream_req(ENGINE_HANDLE* handle, const void* cooki
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2356,7 +3563,7 @@ static ENGINE_ERROR_CODE dcp_get_failover_log(ENGINE_HANDLE* handle, const void*
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2378,7 +3585,7 @@ static ENGINE_ERROR_CODE dcp_stream_end(ENGINE_HANDLE* handle, const void* cooki
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2405,7 +3612,7 @@ static ENGINE_ERROR_CODE dcp_snapshot_marker(ENGINE_HANDLE* handle,
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2443,7 +3650,7 @@ static ENGINE_ERROR_CODE dcp_mutation(ENGINE_HANDLE* handle, const void* cookie,
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2473,7 +3680,7 @@ static ENGINE_ERROR_CODE dcp_deletion(ENGINE_HANDLE* handle, const void* cookie,
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2503,7 +3710,7 @@ static ENGINE_ERROR_CODE dcp_expiration(ENGINE_HANDLE* handle, const void* cooki
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2525,7 +3732,7 @@ static  ENGINE_ERROR_CODE dcp_flush(ENGINE_HANDLE* handle, const void* cookie,
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2549,7 +3756,7 @@ static ENGINE_ERROR_CODE dcp_set_vbucket_state(ENGINE_HANDLE* handle, const void
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2569,7 +3776,7 @@ static ENGINE_ERROR_CODE dcp_noop(ENGINE_HANDLE* handle,
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2592,7 +3799,7 @@ static ENGINE_ERROR_CODE dcp_buffer_acknowledgement(ENGINE_HANDLE* handle,
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2617,7 +3824,7 @@ static ENGINE_ERROR_CODE dcp_control(ENGINE_HANDLE* handle,
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2638,7 +3845,7 @@ static ENGINE_ERROR_CODE dcp_response_handler(ENGINE_HANDLE* handle,
         } else {
             ret = ENGINE_DISCONNECT;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     } else {
         ret = ENGINE_DISCONNECT;
     }
@@ -2659,7 +3866,7 @@ static ENGINE_ERROR_CODE bucket_get_engine_vb_map(ENGINE_HANDLE* handle,
         } else {
             ret = ENGINE_ENOTSUP;
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     }
 
     return ret;
@@ -2679,7 +3886,7 @@ static size_t bucket_errinfo(ENGINE_HANDLE *handle, const void* cookie,
         if (peh->pe.v1->errinfo) {
             ret = peh->pe.v1->errinfo(peh->pe.v0, cookie, buffer, buffsz);
         }
-        release_engine_handle(peh);
+        release_engine_handle(peh, cookie);
     }
 
     return ret;
@@ -2700,7 +3907,7 @@ static ENGINE_ERROR_CODE initialize_configuration(struct bucket_engine *me,
     if (cfg_str != NULL) {
         int r;
         int ii = 0;
-#define CONFIG_SIZE 8
+#define CONFIG_SIZE 14
         struct config_item items[CONFIG_SIZE];
         memset(&items, 0, sizeof(items));
 
@@ -2734,6 +3941,36 @@ static ENGINE_ERROR_CODE initialize_configuration(struct bucket_engine *me,
         items[ii].value.dt_bool = &me->auto_create;
         ++ii;
 
+        items[ii].key = "topkeys_sample";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &me->topkeys_sample;
+        ++ii;
+
+        items[ii].key = "bucket_ops_limit";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &me->ops_limit;
+        ++ii;
+
+        items[ii].key = "bucket_time_share";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &me->time_share;
+        ++ii;
+
+        items[ii].key = "mem_budget";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &me->mem.budget;
+        ++ii;
+
+        items[ii].key = "mem_min";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &me->mem.min;
+        ++ii;
+
+        items[ii].key = "stats_interval";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &me->stats_interval;
+        ++ii;
+
         items[ii].key = "config_file";
         items[ii].datatype = DT_CONFIGFILE;
         ++ii;
@@ -2783,24 +4020,87 @@ static char* extract_key(void *packet) {
 }
 
 
+#define MSGLEN 1024
+
+/**
+ * A bucket being created on the executor of the server (see
+ * handle_create_bucket)
+ */
+struct create_bucket_task {
+    struct bucket_engine *e;
+    char *name;
+    char *spec;
+    const char *config;
+    ENGINE_ERROR_CODE ret;
+    char msg[MSGLEN];
+};
+
+/**
+ * Send the response to the "CREATE" command
+ */
+static void create_bucket_response(ENGINE_ERROR_CODE ret, const char *msg,
+                                   const void *cookie, ADD_RESPONSE response) {
+    protocol_binary_response_status rc;
+
+    switch(ret) {
+    case ENGINE_SUCCESS:
+        rc = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+        break;
+    case ENGINE_KEY_EEXISTS:
+        rc = PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
+        break;
+    default:
+        rc = PROTOCOL_BINARY_RESPONSE_NOT_STORED;
+    }
+
+    response(NULL, 0, NULL, 0, msg, (uint32_t)strlen(msg), 0, rc, 0, cookie);
+}
+
+static ENGINE_ERROR_CODE create_bucket_task_main(void *arg) {
+    struct create_bucket_task *task = arg;
+
+    lock_engines();
+    task->ret = create_bucket_UNLOCKED(task->e, task->name, task->spec,
+                                       task->config, NULL, task->msg, MSGLEN);
+    unlock_engines();
+    /* The connection picks up the result when it runs the command again */
+    return ENGINE_SUCCESS;
+}
+
 /**
  * Implementation of the "CREATE" command.
+ *
+ * Initializing the engine of the bucket may take a while, so if the
+ * server lets us we do it on its executor (as we can't block the worker
+ * thread) and return EWOULDBLOCK. The task is stored in the
+ * engine-specific section of the cookie, and we send its result when
+ * the command is run again once the cookie is notified.
  */
 static ENGINE_ERROR_CODE handle_create_bucket(ENGINE_HANDLE* handle,
                                               const void* cookie,
                                               protocol_binary_request_header *request,
                                               ADD_RESPONSE response) {
 
-#define MSGLEN 1024
-    protocol_binary_response_status rc;
     ENGINE_ERROR_CODE ret;
     char msg[MSGLEN];
     struct bucket_engine *e = (void*)handle;
     protocol_binary_request_create_bucket *breq = (void*)request;
+    struct create_bucket_task *task = bucket_get_engine_specific(cookie);
     size_t bodylen;
     char *config = "";
     char *spec;
-    char *keyz = extract_key(breq);
+    char *keyz;
+
+    if (task != NULL) {
+        bucket_store_engine_specific(cookie, NULL);
+        create_bucket_response(task->ret, task->msg, cookie, response);
+        free(task->name);
+        free(task->spec);
+        free(task);
+        return ENGINE_SUCCESS;
+    }
+
+    keyz = extract_key(breq);
     if (keyz == NULL) {
         return ENGINE_ENOMEM;
     }
@@ -2836,29 +4136,37 @@ static ENGINE_ERROR_CODE handle_create_bucket(ENGINE_HANDLE* handle,
         config = spec + strlen(spec)+1;
     }
 
+    if (e->upstream_server->core->submit_task != NULL &&
+        (task = calloc(1, sizeof(*task))) != NULL) {
+        task->e = e;
+        task->name = keyz;
+        task->spec = spec;
+        task->config = config;
+        bucket_store_engine_specific(cookie, task);
+        if (e->upstream_server->core->submit_task(cookie,
+                                                  create_bucket_task_main,
+                                                  task,
+                                                  EXECUTOR_PRIORITY_LOW) ==
+            ENGINE_SUCCESS) {
+            return ENGINE_EWOULDBLOCK;
+        }
+        /* The queue is full, so we'll have to do it ourselves */
+        bucket_store_engine_specific(cookie, NULL);
+        free(task);
+    }
+
     msg[0] = 0;
     lock_engines();
     ret = create_bucket_UNLOCKED(e, keyz, spec, config, NULL, msg, MSGLEN);
     unlock_engines();
 
-    switch(ret) {
-    case ENGINE_SUCCESS:
-        rc = PROTOCOL_BINARY_RESPONSE_SUCCESS;
-        break;
-    case ENGINE_KEY_EEXISTS:
-        rc = PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
-        break;
-    default:
-        rc = PROTOCOL_BINARY_RESPONSE_NOT_STORED;
-    }
-
-    response(NULL, 0, NULL, 0, msg, (uint32_t)strlen(msg), 0, rc, 0, cookie);
+    create_bucket_response(ret, msg, cookie, response);
 
     free(keyz);
     free(spec);
-#undef MSGLEN
     return ENGINE_SUCCESS;
 }
+#undef MSGLEN
 
 /**
  * Implementation of the "DELETE" command. The delete command shuts down
@@ -2933,7 +4241,7 @@ static ENGINE_ERROR_CODE handle_delete_bucket(ENGINE_HANDLE* handle,
         free(config);
 
         found = false;
-        peh = find_bucket(keyz);
+        peh = find_bucket(cookie, keyz);
         free(keyz);
 
         if (peh) {
@@ -2941,7 +4249,7 @@ static ENGINE_ERROR_CODE handle_delete_bucket(ENGINE_HANDLE* handle,
             /* bumped clients count protects transition from
              * STATE_RUNNING to STATE_STOPPED while peh->cookie is not
              * yet set. */
-            int count = ATOMIC_INCR(&peh->clients);
+            int count = ATOMIC_INCR(engine_clients_counter(peh, cookie));
             cb_assert(count > 0);
             if (ATOMIC_CAS(&peh->state, STATE_RUNNING, STATE_STOPPING)) {
                 peh->cookie = cookie;
@@ -2950,7 +4258,7 @@ static ENGINE_ERROR_CODE handle_delete_bucket(ENGINE_HANDLE* handle,
             }
             /* it'll decrement clients and also initiate bucket
              * shutdown when there are no active clients */
-            release_engine_handle(peh);
+            release_engine_handle(peh, cookie);
 
             /* If we're deleting the bucket we're connected to we need */
             /* to disconnect from the bucket in order to avoid trying */
@@ -3051,7 +4359,7 @@ static ENGINE_ERROR_CODE handle_select_bucket(ENGINE_HANDLE* handle,
         return ENGINE_ENOMEM;
     }
 
-    proxied = find_bucket(keyz);
+    proxied = find_bucket(cookie, keyz);
     set_engine_handle(handle, cookie, proxied);
     release_handle(proxied);
 
@@ -3106,6 +4414,7 @@ static bool is_authorized(ENGINE_HANDLE* handle, const void* cookie) {
  * cache for erronous requests from these, so ignore all misses etc
  */
 static void update_topkey_command( proxied_engine_handle_t *peh,
+                                   const void *cookie,
                                    protocol_binary_request_header *request,
                                    ENGINE_ERROR_CODE rv)
 {
@@ -3121,28 +4430,28 @@ static void update_topkey_command( proxied_engine_handle_t *peh,
     if (key) {
         switch (request->request.opcode) {
         case PROTOCOL_BINARY_CMD_GET_REPLICA:
-            TK(peh->topkeys, get_replica, key, nkey, get_current_time());
+            TK(peh, cookie, get_replica, key, nkey, get_current_time());
             break;
         case PROTOCOL_BINARY_CMD_EVICT_KEY:
-            TK(peh->topkeys, evict, key, nkey, get_current_time());
+            TK(peh, cookie, evict, key, nkey, get_current_time());
             break;
         case PROTOCOL_BINARY_CMD_GET_LOCKED:
-            TK(peh->topkeys, getl, key, nkey, get_current_time());
+            TK(peh, cookie, getl, key, nkey, get_current_time());
             break;
         case PROTOCOL_BINARY_CMD_UNLOCK_KEY:
-            TK(peh->topkeys, unlock, key, nkey, get_current_time());
+            TK(peh, cookie, unlock, key, nkey, get_current_time());
             break;
         case PROTOCOL_BINARY_CMD_GET_META:
         case PROTOCOL_BINARY_CMD_GETQ_META:
-            TK(peh->topkeys, get_meta, key, nkey, get_current_time());
+            TK(peh, cookie, get_meta, key, nkey, get_current_time());
             break;
         case PROTOCOL_BINARY_CMD_SET_WITH_META:
         case PROTOCOL_BINARY_CMD_SETQ_WITH_META:
-            TK(peh->topkeys, set_meta, key, nkey, get_current_time());
+            TK(peh, cookie, set_meta, key, nkey, get_current_time());
             break;
         case PROTOCOL_BINARY_CMD_DEL_WITH_META:
         case PROTOCOL_BINARY_CMD_DELQ_WITH_META:
-            TK(peh->topkeys, del_meta, key, nkey, get_current_time());
+            TK(peh, cookie, del_meta, key, nkey, get_current_time());
             break;
         }
         free((void*)key);
@@ -3191,7 +4500,9 @@ static ENGINE_ERROR_CODE bucket_unknown_command(ENGINE_HANDLE* handle,
             switch(request->request.opcode) {
             case PROTOCOL_BINARY_CMD_CREATE_BUCKET:
                 rv = handle_create_bucket(handle, cookie, request, response);
-                bucket_decrement_session_ctr();
+                if (rv != ENGINE_EWOULDBLOCK) {
+                    bucket_decrement_session_ctr();
+                }
                 break;
             case PROTOCOL_BINARY_CMD_DELETE_BUCKET:
                 rv = handle_delete_bucket(handle, cookie, request, response);
@@ -3211,11 +4522,16 @@ static ENGINE_ERROR_CODE bucket_unknown_command(ENGINE_HANDLE* handle,
         }
     } else {
         proxied_engine_handle_t *peh = get_engine_handle(handle, cookie);
-        if (peh) {
+        hrtime_t start;
+        if (peh && bucket_throttle(peh, 1, &start)) {
+            release_engine_handle(peh, cookie);
+            rv = ENGINE_TMPFAIL;
+        } else if (peh) {
             rv = peh->pe.v1->unknown_command(peh->pe.v0, cookie, request,
                                              response);
-            update_topkey_command(peh, request, rv);
-            release_engine_handle(peh);
+            bucket_quota_used(peh, start);
+            update_topkey_command(peh, cookie, request, rv);
+            release_engine_handle(peh, cookie);
         } else {
             rv = ENGINE_DISCONNECT;
         }
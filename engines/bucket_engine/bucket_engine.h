@@ -16,7 +16,8 @@ typedef enum {
     STATE_NULL,
     STATE_RUNNING,
     STATE_STOPPING,
-    STATE_STOPPED
+    STATE_STOPPED,
+    STATE_INITIALIZING
 } bucket_state_t;
 
 typedef struct proxied_engine_handle {
@@ -25,6 +26,7 @@ typedef struct proxied_engine_handle {
     proxied_engine_t     pe;
     void                *stats;
     topkeys_t          **topkeys;
+    tk_sampled_t        *tk_sampled;
     TAP_ITERATOR         tap_iterator;
     bool                 tap_iterator_disabled;
     /* ON_DISCONNECT handling */
@@ -50,11 +52,69 @@ typedef struct proxied_engine_handle {
      * because some connection can hold pointer longer) */
     volatile int         refcount;
     volatile int clients; /* # of clients currently calling functions in the engine */
+    /* The clients of the worker threads, which count them by the index
+     * of the thread instead (see engine_clients_counter) */
+    struct bucket_thread_clients *thread_clients;
+    /* The memory the other threads allocated in the engine (the worker
+     * threads charge theirs to thread_clients, see engine_account) */
+    allocator_account account;
+    /* Could the allocator tell us what they allocated */
+    volatile bool accounted;
+    /* What the bucket used of its quota in the current second (see
+     * bucket_throttle) */
+    struct {
+        volatile rel_time_t window;
+        volatile int ops;
+        volatile int usec;
+        volatile int throttled;
+    } quota;
+    /* The evictions at the last look of the memory manager */
+    uint64_t mem_evictions;
+    /* The general stats of the engine as of the last time the
+     * housekeeper looked (see stats_snapshot_refresh) */
+    struct {
+        cb_mutex_t mutex;
+        /* The stats in the compact format */
+        char *buf;
+        size_t len;
+        /* Do we have one */
+        bool valid;
+    } snapshot;
+    /* The next of the deleted buckets waiting for the reaper */
+    struct proxied_engine_handle *next_dying;
     const void *cookie;
     void *dlhandle;
     volatile bucket_state_t state;
 } proxied_engine_handle_t;
 
+/**
+ * An immutable snapshot of the list of engines (see publish_bucket_map),
+ * which the worker threads look the buckets up in without the engines
+ * lock. It's an open addressed hash table by the name of the bucket.
+ */
+struct bucket_map {
+    unsigned int mask;
+    proxied_engine_handle_t *slots[1];
+};
+
+/**
+ * A counter only one worker thread bumps, on a cache line of its own
+ */
+struct bucket_thread_count {
+    volatile int count;
+    char pad[64 - sizeof(int)];
+};
+
+/**
+ * The clients of a bucket on one of the worker threads, and the memory
+ * they allocated in it, on a cache line of their own
+ */
+struct bucket_thread_clients {
+    allocator_account account;
+    volatile int count;
+    char pad[64 - sizeof(allocator_account) - sizeof(int)];
+};
+
 #define ES_CONNECTED_FLAG 0x1000
 
 /**
@@ -91,6 +151,10 @@ struct bucket_engine {
     proxied_engine_handle_t default_engine;
     cb_mutex_t engines_mutex;
     genhash_t *engines;
+    struct bucket_map * volatile bucket_map;
+    /* By the index of the worker thread */
+    struct bucket_thread_count *map_readers;
+    int map_nreaders;
     GET_SERVER_API get_server_api;
     SERVER_HANDLE_V1 server;
     SERVER_CALLBACK_API callback_api;
@@ -102,16 +166,14 @@ struct bucket_engine {
         int bucket_counter; /* Number of treads currently running shutdown */
         cb_mutex_t mutex;
         cb_cond_t cond;
-        /* this condition signals either in_progress being true or
-         * some bucket's refcount being 0.
-         *
-         * This means that under some conditions (lots of buckets
-         * recently deleted but still have connections assigned on
-         * them) we'll have a bit of thundering herd problem, where
-         * too many bucket deletion threads are woken up
-         * needlessly. But that can be improved much later when and if
-         * we actually find this to be a problem. */
+        /* this condition signals either in_progress being true, some
+         * bucket's refcount being 0 or a new bucket in dying. Only the
+         * reaper waits for it, however many buckets are deleted. */
         cb_cond_t refcount_cond;
+        /* The deleted buckets (which we destroyed already) waiting for
+         * their last references to go away (see bucket_reaper_main) */
+        struct proxied_engine_handle *dying;
+        bool reaper_running;
     } shutdown;
 
     union {
@@ -121,6 +183,38 @@ struct bucket_engine {
     } info;
 
     int topkeys;
+    /* Sample one of every this many operations into the topkeys of the
+     * threads instead (0 counts them all) */
+    size_t topkeys_sample;
+    /* The most operations a bucket may do in a second (0 for no limit) */
+    size_t ops_limit;
+    /* The most of the time of the worker threads a bucket may spend in
+     * its engine, in percent (0 for no limit) */
+    size_t time_share;
+    /* The time_share as the usec a bucket may spend in a second */
+    int time_budget;
+
+    /* The memory the buckets share (see mem_manager_round) */
+    struct {
+        /* The bytes of all of them (0 if they don't share any) */
+        size_t budget;
+        /* The least we leave a bucket with */
+        size_t min;
+    } mem;
+
+    /* Serve the general stats of the buckets from a snapshot taken
+     * every this many seconds (0 asks the engines every time) */
+    size_t stats_interval;
+
+    /* The thread running the memory manager and taking the stats
+     * snapshots (see housekeeper_main) */
+    struct {
+        cb_mutex_t mutex;
+        cb_cond_t cond;
+        cb_thread_t tid;
+        bool running;
+        bool shutdown;
+    } housekeeper;
 };
 
 #endif
@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <platform/cbassert.h>
 
@@ -18,6 +19,17 @@ static int prime_size_table[]={
     1610612741
 };
 
+#define PRIME_SIZES ((int)(sizeof(prime_size_table) / sizeof(int)))
+
+/*
+ * The table grows (to the next size in prime_size_table) when it holds
+ * more entries than it has buckets. The entries are moved over to the
+ * new table a few buckets at a time by the calls changing the table, so
+ * no single call pays for all of them. Until they're all moved we look
+ * in both tables: the entries in the new one are the most recent ones.
+ */
+#define MIGRATE_BUCKETS 4
+
 static void* dup_key(genhash_t *h, const void *key, size_t klen)
 {
     if (h->ops.dupKey != NULL) {
@@ -36,10 +48,10 @@ static void* dup_value(genhash_t *h, const void *value, size_t vlen)
     }
 }
 
-static void free_key(genhash_t *h, void *key)
+static void free_key(genhash_t *h, struct genhash_entry_t *p)
 {
-    if (h->ops.freeKey != NULL) {
-        h->ops.freeKey(key);
+    if (h->ops.freeKey != NULL && p->key != p->inline_key) {
+        h->ops.freeKey(p->key);
     }
 }
 
@@ -59,14 +71,19 @@ static int estimate_table_size(int est)
     magn--;
     magn = ((int)magn < 0) ? 0 : magn;
     cb_assert(magn < (sizeof(prime_size_table) / sizeof(int)));
-    rv=prime_size_table[magn];
+    rv=(int)magn;
     return rv;
 }
 
+static size_t hash_key(genhash_t *h, const void *k, size_t klen)
+{
+    return (size_t)(unsigned int)h->ops.hashfunc(k, klen);
+}
+
 genhash_t* genhash_init(int est, struct hash_ops ops)
 {
     genhash_t* rv=NULL;
-    int size=0;
+    int idx=0;
     if (est < 1) {
         return NULL;
     }
@@ -76,11 +93,13 @@ genhash_t* genhash_init(int est, struct hash_ops ops)
     cb_assert((ops.dupKey != NULL && ops.freeKey != NULL) || ops.freeKey == NULL);
     cb_assert((ops.dupValue != NULL && ops.freeValue != NULL) || ops.freeValue == NULL);
 
-    size=estimate_table_size(est);
-    rv=calloc(1, sizeof(genhash_t)
-              + (size * sizeof(struct genhash_entry_t *)));
+    idx=estimate_table_size(est);
+    rv=calloc(1, sizeof(genhash_t));
     cb_assert(rv != NULL);
-    rv->size=size;
+    rv->sizeidx=idx;
+    rv->size=prime_size_table[idx];
+    rv->buckets=calloc(rv->size, sizeof(struct genhash_entry_t *));
+    cb_assert(rv->buckets != NULL);
     rv->ops=ops;
 
     return rv;
@@ -90,10 +109,119 @@ void genhash_free(genhash_t* h)
 {
     if(h != NULL) {
         genhash_clear(h);
+        while (h->arenas != NULL) {
+            struct genhash_arena_t *next = h->arenas->next;
+            free(h->arenas);
+            h->arenas = next;
+        }
+        free(h->buckets);
         free(h);
     }
 }
 
+static struct genhash_entry_t *new_entry(genhash_t *h)
+{
+    struct genhash_entry_t *p;
+
+    if (h->freelist == NULL) {
+        struct genhash_arena_t *arena;
+        int i;
+
+        arena=malloc(sizeof(*arena));
+        cb_assert(arena);
+        arena->next=h->arenas;
+        h->arenas=arena;
+        for (i = 0; i < GENHASH_ARENA_ENTRIES; i++) {
+            arena->entries[i].next=h->freelist;
+            h->freelist=&arena->entries[i];
+        }
+    }
+
+    p=h->freelist;
+    h->freelist=p->next;
+    return p;
+}
+
+static void free_item(genhash_t *h, struct genhash_entry_t *i)
+{
+    cb_assert(i);
+    free_key(h, i);
+    free_value(h, i->value);
+    i->next=h->freelist;
+    h->freelist=i;
+    h->count--;
+}
+
+/* The bucket in the old table the key would be in (if it still has one) */
+static struct genhash_entry_t **old_bucket(genhash_t *h, size_t hv)
+{
+    size_t n;
+    if (h->old == NULL) {
+        return NULL;
+    }
+    n=hv % h->oldsize;
+    return n < h->migrate ? NULL : &h->old[n];
+}
+
+/* Move a few of the buckets of the old table over to the new one */
+static void migrate_buckets(genhash_t *h)
+{
+    int i;
+
+    for (i = 0; h->old != NULL && i < MIGRATE_BUCKETS; i++) {
+        struct genhash_entry_t *p=h->old[h->migrate];
+
+        /* Keep the order (the most recent one first) */
+        while (p != NULL) {
+            struct genhash_entry_t *next=p->next;
+            struct genhash_entry_t **pp=&h->buckets[p->hv % h->size];
+            while (*pp != NULL) {
+                pp=&(*pp)->next;
+            }
+            p->next=NULL;
+            *pp=p;
+            p=next;
+        }
+        h->old[h->migrate]=NULL;
+
+        if (++h->migrate == h->oldsize) {
+            free(h->old);
+            h->old=NULL;
+            h->oldsize=0;
+            h->migrate=0;
+        }
+    }
+}
+
+/* Start growing the table if it is getting full */
+static void maybe_grow(genhash_t *h)
+{
+    struct genhash_entry_t **buckets;
+    size_t size;
+
+    if (h->old != NULL) {
+        migrate_buckets(h);
+        return;
+    }
+    if ((size_t)h->count <= h->size || h->sizeidx + 1 >= PRIME_SIZES) {
+        return;
+    }
+
+    size=prime_size_table[h->sizeidx + 1];
+    buckets=calloc(size, sizeof(struct genhash_entry_t *));
+    if (buckets == NULL) {
+        /* We'll just have longer chains */
+        return;
+    }
+    h->old=h->buckets;
+    h->oldsize=h->size;
+    h->migrate=0;
+    h->buckets=buckets;
+    h->size=size;
+    h->sizeidx++;
+    migrate_buckets(h);
+}
+
 void genhash_store(genhash_t *h, const void* k, size_t klen,
                    const void* v, size_t vlen)
 {
@@ -102,35 +230,54 @@ void genhash_store(genhash_t *h, const void* k, size_t klen,
 
     cb_assert(h != NULL);
 
-    n=h->ops.hashfunc(k, klen) % h->size;
-    cb_assert((int)n >= 0);
-    cb_assert(n < h->size);
+    maybe_grow(h);
 
-    p=calloc(1, sizeof(struct genhash_entry_t));
-    cb_assert(p);
+    p=new_entry(h);
+    p->hv=hash_key(h, k, klen);
+    n=p->hv % h->size;
+    cb_assert(n < h->size);
 
-    p->key=dup_key(h, k, klen);
+    if (h->ops.dupKey != NULL && klen <= GENHASH_INLINE_KEY) {
+        memcpy(p->inline_key, k, klen);
+        p->key=p->inline_key;
+    } else {
+        p->key=dup_key(h, k, klen);
+    }
     p->nkey = klen;
     p->value=dup_value(h, v, vlen);
     p->nvalue = vlen;
 
     p->next=h->buckets[n];
     h->buckets[n]=p;
+    h->count++;
+}
+
+static struct genhash_entry_t *find_in(genhash_t *h,
+                                       struct genhash_entry_t *p,
+                                       size_t hv,
+                                       const void* k,
+                                       size_t klen)
+{
+    for(; p && (p->hv != hv || !h->ops.hasheq(k, klen, p->key, p->nkey));
+        p=p->next);
+    return p;
 }
 
 static struct genhash_entry_t *genhash_find_entry(genhash_t *h,
                                                   const void* k,
                                                   size_t klen)
 {
-    size_t n=0;
+    size_t hv=0;
     struct genhash_entry_t *p;
+    struct genhash_entry_t **ob;
 
     cb_assert(h != NULL);
-    n=h->ops.hashfunc(k, klen) % h->size;
-    cb_assert((int)n >= 0);
-    cb_assert(n < h->size);
+    hv=hash_key(h, k, klen);
 
-    for(p=h->buckets[n]; p && !h->ops.hasheq(k, klen, p->key, p->nkey); p=p->next);
+    p=find_in(h, h->buckets[hv % h->size], hv, k, klen);
+    if (p == NULL && (ob=old_bucket(h, hv)) != NULL) {
+        p=find_in(h, *ob, hv, k, klen);
+    }
     return p;
 }
 
@@ -197,44 +344,44 @@ enum update_type genhash_fun_update(genhash_t* h, const void* k, size_t klen,
     return rv;
 }
 
-static void free_item(genhash_t *h, struct genhash_entry_t *i)
+/* Unlink the first entry for the key in the chain (NULL if none) */
+static struct genhash_entry_t *unlink_from(genhash_t *h,
+                                           struct genhash_entry_t **pp,
+                                           size_t hv,
+                                           const void* k,
+                                           size_t klen)
 {
-    cb_assert(i);
-    free_key(h, i->key);
-    free_value(h, i->value);
-    free(i);
+    for(; *pp != NULL; pp=&(*pp)->next) {
+        struct genhash_entry_t *p=*pp;
+        if(p->hv == hv && h->ops.hasheq(p->key, p->nkey, k, klen)) {
+            *pp=p->next;
+            return p;
+        }
+    }
+    return NULL;
 }
 
 int genhash_delete(genhash_t* h, const void* k, size_t klen)
 {
     struct genhash_entry_t *deleteme=NULL;
-    size_t n=0;
+    struct genhash_entry_t **ob;
+    size_t hv=0;
     int rv=0;
 
     cb_assert(h != NULL);
-    n=h->ops.hashfunc(k, klen) % h->size;
-    cb_assert((int)n >= 0);
-    cb_assert(n < h->size);
+    hv=hash_key(h, k, klen);
 
-    if(h->buckets[n] != NULL) {
-        /* Special case the first one */
-        if(h->ops.hasheq(h->buckets[n]->key, h->buckets[n]->nkey, k, klen)) {
-            deleteme=h->buckets[n];
-            h->buckets[n]=deleteme->next;
-        } else {
-            struct genhash_entry_t *p=NULL;
-            for(p=h->buckets[n]; deleteme==NULL && p->next != NULL; p=p->next) {
-                if(h->ops.hasheq(p->next->key, p->next->nkey, k, klen)) {
-                    deleteme=p->next;
-                    p->next=deleteme->next;
-                }
-            }
-        }
+    deleteme=unlink_from(h, &h->buckets[hv % h->size], hv, k, klen);
+    if(deleteme == NULL && (ob=old_bucket(h, hv)) != NULL) {
+        deleteme=unlink_from(h, ob, hv, k, klen);
     }
     if(deleteme != NULL) {
         free_item(h, deleteme);
         rv++;
     }
+    if (h->old != NULL) {
+        migrate_buckets(h);
+    }
 
     return rv;
 }
@@ -262,22 +409,41 @@ void genhash_iter(genhash_t* h,
             iterfunc(p->key, p->nkey, p->value, p->nvalue, arg);
         }
     }
+    for(i=h->migrate; h->old != NULL && i<h->oldsize; i++) {
+        for(p=h->old[i]; p!=NULL; p=p->next) {
+            iterfunc(p->key, p->nkey, p->value, p->nvalue, arg);
+        }
+    }
+}
+
+static void clear_buckets(genhash_t *h, struct genhash_entry_t **buckets,
+                          size_t from, size_t size)
+{
+    size_t i;
+    for(i = from; i < size; i++) {
+        while(buckets[i]) {
+            struct genhash_entry_t *p = NULL;
+            p = buckets[i];
+            buckets[i] = p->next;
+            free_item(h, p);
+        }
+    }
 }
 
 int genhash_clear(genhash_t *h)
 {
-    size_t i = 0;
     int rv = 0;
     cb_assert(h != NULL);
 
-    for(i = 0; i < h->size; i++) {
-        while(h->buckets[i]) {
-            struct genhash_entry_t *p = NULL;
-            p = h->buckets[i];
-            h->buckets[i] = p->next;
-            free_item(h, p);
-        }
+    clear_buckets(h, h->buckets, 0, h->size);
+    if (h->old != NULL) {
+        clear_buckets(h, h->old, h->migrate, h->oldsize);
+        free(h->old);
+        h->old = NULL;
+        h->oldsize = 0;
+        h->migrate = 0;
     }
+    cb_assert(h->count == 0);
 
     return rv;
 }
@@ -294,10 +460,8 @@ static void count_entries(const void *key, size_t klen,
 }
 
 int genhash_size(genhash_t* h) {
-    int rv=0;
     cb_assert(h != NULL);
-    genhash_iter(h, count_entries, &rv);
-    return rv;
+    return h->count;
 }
 
 int genhash_size_for_key(genhash_t* h, const void* k, size_t klen)
@@ -313,19 +477,25 @@ void genhash_iter_key(genhash_t* h, const void* key, size_t klen,
                                        const void* val, size_t vlen,
                                        void *arg), void *arg)
 {
-    size_t n=0;
+    size_t hv=0;
     struct genhash_entry_t *p=NULL;
+    struct genhash_entry_t **ob;
 
     cb_assert(h != NULL);
-    n=h->ops.hashfunc(key, klen) % h->size;
-    cb_assert((int)n >= 0);
-    cb_assert(n < h->size);
+    hv=hash_key(h, key, klen);
 
-    for(p=h->buckets[n]; p!=NULL; p=p->next) {
-        if(h->ops.hasheq(key, klen, p->key, p->nkey)) {
+    for(p=h->buckets[hv % h->size]; p!=NULL; p=p->next) {
+        if(p->hv == hv && h->ops.hasheq(key, klen, p->key, p->nkey)) {
             iterfunc(p->key, p->nkey, p->value, p->nvalue, arg);
         }
     }
+    if ((ob=old_bucket(h, hv)) != NULL) {
+        for(p=*ob; p!=NULL; p=p->next) {
+            if(p->hv == hv && h->ops.hasheq(key, klen, p->key, p->nkey)) {
+                iterfunc(p->key, p->nkey, p->value, p->nvalue, arg);
+            }
+        }
+    }
 }
 
 int genhash_string_hash(const void* p, size_t nkey)
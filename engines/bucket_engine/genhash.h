@@ -47,7 +47,8 @@ struct hash_ops {
      */
     int   (*hasheq)(const void *, size_t, const void *, size_t);
     /**
-     * Function to duplicate a key for storage.
+     * Function to duplicate a key for storage. Short keys are copied into
+     * the entry instead (and never passed to freeKey).
      */
     void* (*dupKey)(const void *, size_t);
     /**
@@ -78,7 +79,9 @@ enum update_type {
 };
 
 /**
- * Create a new generic hashtable.
+ * Create a new generic hashtable. The table grows as it fills up, a few
+ * buckets at a time with every store and delete (lookups don't change
+ * the table).
  *
  * @param est the estimated number of items to store (must be > 0)
  * @param ops the key and value operations
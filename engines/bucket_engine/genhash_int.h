@@ -1,3 +1,9 @@
+/**
+ * The longest key stored in the entry itself (instead of with dupKey)
+ * \private
+ */
+#define GENHASH_INLINE_KEY 32
+
 /**
  * \private
  */
@@ -10,12 +16,42 @@ struct genhash_entry_t {
     void *value;
     /** Size of the value */
     size_t nvalue;
+    /** The hash value of the key */
+    size_t hv;
     /** Pointer to the next entry */
     struct genhash_entry_t *next;
+    /** The key when it is short enough (key points here) */
+    char inline_key[GENHASH_INLINE_KEY];
+};
+
+/**
+ * The entries are allocated this many at a time
+ * \private
+ */
+#define GENHASH_ARENA_ENTRIES 64
+
+/**
+ * \private
+ */
+struct genhash_arena_t {
+    struct genhash_arena_t *next;
+    struct genhash_entry_t entries[GENHASH_ARENA_ENTRIES];
 };
 
 struct _genhash {
     size_t size;
     struct hash_ops ops;
-   struct genhash_entry_t *buckets[1]; /* It is actually variable size */
+    /** Where size is in the table of primes */
+    int sizeidx;
+    /** The number of entries */
+    int count;
+    struct genhash_entry_t **buckets;
+    /** The table we're moving the entries from while growing (or NULL) */
+    struct genhash_entry_t **old;
+    size_t oldsize;
+    /** The next bucket in old to move */
+    size_t migrate;
+    /** The entries not in use, and the arenas they all come from */
+    struct genhash_entry_t *freelist;
+    struct genhash_arena_t *arenas;
 };
@@ -28,6 +28,9 @@ struct mock_engine {
     genhash_t *hashtbl;
     struct mock_stats stats;
     int disconnects;
+    /* The mock is always full, so every store counts as an eviction */
+    size_t mem_limit;
+    uint64_t evictions;
     uint64_t magic2;
 
     union {
@@ -117,6 +120,11 @@ static const char* item_get_key(const item* item);
 static void item_set_cas(ENGINE_HANDLE* handle, const void *cookie,
                          item* item, uint64_t val);
 static uint64_t item_get_cas(const item* item);
+static void mock_get_mem_info(ENGINE_HANDLE *handle, const void *cookie,
+                              engine_mem_info_t *info);
+static ENGINE_ERROR_CODE mock_set_mem_limit(ENGINE_HANDLE *handle,
+                                            const void *cookie,
+                                            size_t limit);
 
 static bool get_item_info(ENGINE_HANDLE *handle, const void *cookie,
                           const item* item, item_info *item_info);
@@ -238,6 +246,9 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
     h->engine.get_item_info = get_item_info;
     h->engine.get_tap_iterator = mock_get_tap_iterator;
     h->engine.tap_notify = mock_tap_notify;
+    h->engine.get_mem_info = mock_get_mem_info;
+    h->engine.set_mem_limit = mock_set_mem_limit;
+    h->mem_limit = 1024 * 1024;
 
     h->server = gsapi();
 
@@ -403,12 +414,37 @@ static ENGINE_ERROR_CODE mock_get_stats(ENGINE_HANDLE* handle,
                                         int nkey,
                                         ADD_STAT add_stat)
 {
-    (void)handle;
+    struct mock_engine* se = get_handle(handle);
+    if (nkey == 3 && memcmp(stat_key, "mem", 3) == 0) {
+        char val[32];
+        int len = snprintf(val, sizeof(val), "%lu",
+                           (unsigned long)se->mem_limit);
+        add_stat("mem_limit", 9, val, len, cookie);
+    } else if (nkey == 0 && se->evictions > 0) {
+        char val[32];
+        int len = snprintf(val, sizeof(val), "%lu",
+                           (unsigned long)se->evictions);
+        add_stat("evictions", 9, val, len, cookie);
+    }
+    /* TODO:  Implement the rest */
+    return ENGINE_SUCCESS;
+}
+
+static void mock_get_mem_info(ENGINE_HANDLE *handle, const void *cookie,
+                              engine_mem_info_t *info) {
+    struct mock_engine* se = get_handle(handle);
     (void)cookie;
-    (void)stat_key;
-    (void)nkey;
-    (void)add_stat;
-    /* TODO:  Implement */
+    info->limit = se->mem_limit;
+    info->used = se->mem_limit;
+    info->evictions = se->evictions;
+}
+
+static ENGINE_ERROR_CODE mock_set_mem_limit(ENGINE_HANDLE *handle,
+                                            const void *cookie,
+                                            size_t limit) {
+    struct mock_engine* se = get_handle(handle);
+    (void)cookie;
+    se->mem_limit = limit;
     return ENGINE_SUCCESS;
 }
 
@@ -423,6 +459,7 @@ static ENGINE_ERROR_CODE mock_store(ENGINE_HANDLE* handle,
     (void)cas;
     (void)vbucket;
     (void)operation;
+    get_handle(handle)->evictions++;
     genhash_update(get_ht(handle), item_get_key(itm), it->nkey, itm, 0);
     return ENGINE_SUCCESS;
 }
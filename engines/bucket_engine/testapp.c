@@ -25,12 +25,20 @@
 #define DEFAULT_CONFIG "engine=bucket_engine_mock_engine.dll;default=true;admin=admin;auto_create=false"
 #define DEFAULT_CONFIG_NO_DEF "engine=bucket_engine_mock_engine.dll;default=false;admin=admin;auto_create=false"
 #define DEFAULT_CONFIG_AC "engine=bucket_engine_mock_engine.dll;default=true;admin=admin;auto_create=true"
+#define DEFAULT_CONFIG_TK_SAMPLE "engine=bucket_engine_mock_engine.dll;default=true;admin=admin;auto_create=false;topkeys_sample=1"
+#define DEFAULT_CONFIG_OPS_LIMIT "engine=bucket_engine_mock_engine.dll;default=true;admin=admin;auto_create=false;bucket_ops_limit=5"
+#define DEFAULT_CONFIG_MEM_BUDGET "engine=bucket_engine_mock_engine.dll;default=true;admin=admin;auto_create=false;mem_budget=4194304;mem_min=1048576"
+#define DEFAULT_CONFIG_STATS_SNAPSHOT "engine=bucket_engine_mock_engine.dll;default=true;admin=admin;auto_create=false;stats_interval=1"
 #else
 #define BUCKET_ENGINE_PATH "bucket_engine.so"
 #define ENGINE_PATH "bucket_engine_mock_engine.so"
 #define DEFAULT_CONFIG "engine=bucket_engine_mock_engine.so;default=true;admin=admin;auto_create=false"
 #define DEFAULT_CONFIG_NO_DEF "engine=bucket_engine_mock_engine.so;default=false;admin=admin;auto_create=false"
 #define DEFAULT_CONFIG_AC "engine=bucket_engine_mock_engine.so;default=true;admin=admin;auto_create=true"
+#define DEFAULT_CONFIG_TK_SAMPLE "engine=bucket_engine_mock_engine.so;default=true;admin=admin;auto_create=false;topkeys_sample=1"
+#define DEFAULT_CONFIG_OPS_LIMIT "engine=bucket_engine_mock_engine.so;default=true;admin=admin;auto_create=false;bucket_ops_limit=5"
+#define DEFAULT_CONFIG_MEM_BUDGET "engine=bucket_engine_mock_engine.so;default=true;admin=admin;auto_create=false;mem_budget=4194304;mem_min=1048576"
+#define DEFAULT_CONFIG_STATS_SNAPSHOT "engine=bucket_engine_mock_engine.so;default=true;admin=admin;auto_create=false;stats_interval=1"
 #endif
 
 #define MOCK_CONFIG_NO_ALLOC "no_alloc"
@@ -285,6 +293,39 @@ static rel_time_t get_current_time(void) {
     return (rel_time_t)time(NULL);
 }
 
+/* Can the allocator hooks tell what the threads allocate (only for
+ * test_heap_accounting, so the others don't see the stats) */
+static bool accounting;
+
+/* Does the server have arenas (see test_bucket_arenas), and the arena
+ * of the last account a thread entered */
+static bool arenas;
+static unsigned int next_arena = 1;
+static unsigned int last_arena;
+
+static bool enter_account(allocator_account *account) {
+    /* As though every call into the engine allocated a bit */
+    if (accounting) {
+        account->allocated += 100;
+    }
+    last_arena = account->arena;
+    return accounting;
+}
+
+static void leave_account(void) {
+}
+
+static bool create_arena(unsigned int *arena) {
+    if (arenas) {
+        *arena = next_arena++;
+    }
+    return arenas;
+}
+
+static void release_arena(unsigned int arena) {
+    cb_assert(arenas && arena != 0 && arena < next_arena);
+}
+
 /**
  * Callback the engines may call to get the public server interface
  * @param interface the requested interface from the server
@@ -298,6 +339,7 @@ static SERVER_HANDLE_V1 *get_server_api(void)
     static SERVER_STAT_API server_stat_api;
     static SERVER_EXTENSION_API extension_api;
     static SERVER_CALLBACK_API callback_api;
+    static ALLOCATOR_HOOKS_API hooks_api;
     static SERVER_HANDLE_V1 rv;
 
     core_api.server_version = get_server_version;
@@ -323,12 +365,18 @@ static SERVER_HANDLE_V1 *get_server_api(void)
     callback_api.register_callback = register_callback;
     callback_api.perform_callbacks = perform_callbacks;
 
+    hooks_api.enter_account = enter_account;
+    hooks_api.leave_account = leave_account;
+    hooks_api.create_arena = create_arena;
+    hooks_api.release_arena = release_arena;
+
     rv.interface = 1;
     rv.core = &core_api;
     rv.stat = &server_stat_api;
     rv.extension = &extension_api;
     rv.callback = &callback_api;
     rv.cookie = &cookie_api;
+    rv.alloc_hooks = &hooks_api;
 
     return &rv;
 }
@@ -1664,6 +1712,288 @@ static enum test_result test_topkeys(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_topkeys_sampled(ENGINE_HANDLE *h,
+                                             ENGINE_HANDLE_V1 *h1) {
+    ENGINE_ERROR_CODE rv = ENGINE_SUCCESS;
+    const void *adm_cookie = mk_conn("admin", NULL);
+    int cmd;
+    int ii;
+    char *val;
+    void *pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    cb_assert(rv == ENGINE_SUCCESS);
+    free(pkt);
+
+    /* With a sample of 1 every operation is counted */
+    pkt = create_packet(PROTOCOL_BINARY_CMD_GET_REPLICA, "somekey", "someval");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    cb_assert(rv == ENGINE_SUCCESS);
+    free(pkt);
+
+    for (cmd = 0x90; cmd < 0xff; ++cmd) {
+        pkt = create_packet(cmd, "somekey", "someval");
+        h1->unknown_command(h, adm_cookie, pkt, add_response);
+        free(pkt);
+    }
+
+    rv = h1->get_stats(h, adm_cookie, "topkeys", 7, add_stats);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(genhash_size(stats_hash) == 1);
+    val = genhash_find(stats_hash, "somekey", strlen("somekey"));
+    cb_assert(val != NULL);
+    cb_assert(strstr(val, "get_replica=1,evict=1,getl=1,unlock=1,get_meta=2,set_meta=2,del_meta=2") != NULL);
+    cb_assert(strstr(val, "error=0") != NULL);
+
+    /* The sketch keeps 10 keys, and the new ones take over the least
+     * counted ones without pushing out the hot one */
+    for (ii = 0; ii < 20; ++ii) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%d", ii);
+        pkt = create_packet(PROTOCOL_BINARY_CMD_GET_REPLICA, key, "someval");
+        h1->unknown_command(h, adm_cookie, pkt, add_response);
+        free(pkt);
+    }
+
+    genhash_clear(stats_hash);
+    rv = h1->get_stats(h, adm_cookie, "topkeys", 7, add_stats);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(genhash_size(stats_hash) == 10);
+    cb_assert(genhash_find(stats_hash, "somekey", strlen("somekey")) != NULL);
+    return SUCCESS;
+}
+
+static enum test_result test_ops_limit(ENGINE_HANDLE *h,
+                                       ENGINE_HANDLE_V1 *h1) {
+    ENGINE_ERROR_CODE rv;
+    const void *cookie = mk_conn(NULL, NULL);
+    item *fetched_item;
+    int served = 0;
+    int throttled = 0;
+    int ii;
+    char *val;
+
+    /* The loop may start a new second, but it won't span more than two */
+    for (ii = 0; ii < 100; ++ii) {
+        rv = h1->get(h, cookie, &fetched_item, "nokey", 5, 0);
+        if (rv == ENGINE_TMPFAIL) {
+            ++throttled;
+        } else {
+            cb_assert(rv == ENGINE_KEY_ENOENT);
+            ++served;
+        }
+    }
+    cb_assert(served >= 5 && served <= 10);
+    cb_assert(throttled == 100 - served);
+
+    rv = h1->get_stats(h, cookie, NULL, 0, add_stats);
+    cb_assert(rv == ENGINE_SUCCESS);
+    val = genhash_find(stats_hash, "bucket_throttled",
+                       strlen("bucket_throttled"));
+    cb_assert(val != NULL);
+    cb_assert(atoi(val) == throttled);
+    return SUCCESS;
+}
+
+static size_t mem_limit;
+static void mem_stats_handler(const char *key, const uint16_t klen,
+                              const char *val, const uint32_t vlen,
+                              const void *cookie) {
+    (void)cookie;
+    if (klen == 9 && memcmp(key, "mem_limit", klen) == 0) {
+        char buffer[32];
+        cb_assert(vlen < sizeof(buffer));
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        mem_limit = (size_t)atol(buffer);
+    }
+}
+
+static enum test_result test_mem_budget(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    const void *cookie;
+    item *itm;
+    void *pkt;
+    ENGINE_ERROR_CODE rv;
+    int ii;
+
+    pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cookie = mk_conn("someuser", NULL);
+
+    /* The mock evicts something with every store, so the bucket gets
+     * more of the budget (which the default bucket doesn't use) */
+    mem_limit = 0;
+    for (ii = 0; ii < 500 && mem_limit <= 1024 * 1024; ++ii) {
+        store(h, h1, cookie, "somekey", "somevalue", &itm);
+        h1->release(h, cookie, itm);
+        usleep(10000);
+        rv = h1->get_stats(h, cookie, "mem", 3, mem_stats_handler);
+        cb_assert(rv == ENGINE_SUCCESS);
+    }
+    cb_assert(mem_limit > 1024 * 1024);
+    cb_assert(mem_limit <= 3 * 1024 * 1024);
+
+    mem_limit = 0;
+    rv = h1->get_stats(h, mk_conn(NULL, NULL), "mem", 3, mem_stats_handler);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(mem_limit >= 1024 * 1024);
+    return SUCCESS;
+}
+
+/* What the general stats of the bucket say it allocated */
+static uint64_t heap_allocated(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                               const void *cookie) {
+    char *val;
+
+    cb_assert(h1->get_stats(h, cookie, NULL, 0, add_stats) == ENGINE_SUCCESS);
+    cb_assert(genhash_find(stats_hash, "bucket_heap_used",
+                           strlen("bucket_heap_used")) != NULL);
+    val = genhash_find(stats_hash, "bucket_heap_allocated",
+                       strlen("bucket_heap_allocated"));
+    cb_assert(val != NULL);
+    return (uint64_t)strtoull(val, NULL, 10);
+}
+
+static enum test_result test_heap_accounting(ENGINE_HANDLE *h,
+                                             ENGINE_HANDLE_V1 *h1) {
+    const void *cookie1 = mk_conn("user1", NULL);
+    const void *cookie2 = mk_conn("user2", NULL);
+    uint64_t before1;
+    uint64_t before2;
+    item *itm;
+    int ii;
+
+    accounting = true;
+    store(h, h1, cookie1, "somekey", "some value1", &itm);
+    h1->release(h, cookie1, itm);
+    store(h, h1, cookie2, "somekey", "some value2", &itm);
+    h1->release(h, cookie2, itm);
+
+    before1 = heap_allocated(h, h1, cookie1);
+    before2 = heap_allocated(h, h1, cookie2);
+    for (ii = 0; ii < 10; ++ii) {
+        store(h, h1, cookie1, "somekey", "some value1", &itm);
+        h1->release(h, cookie1, itm);
+    }
+
+    /* The other bucket was only charged for the call of the stats */
+    cb_assert(heap_allocated(h, h1, cookie2) - before2 == 100);
+    cb_assert(heap_allocated(h, h1, cookie1) - before1 >= 10 * 3 * 100);
+    return SUCCESS;
+}
+
+static enum test_result test_bucket_arenas(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    const void *cookie1;
+    const void *cookie2;
+    unsigned int arena1;
+    item *itm;
+
+    /* The buckets are created as the connections are made */
+    arenas = true;
+    cookie1 = mk_conn("user1", NULL);
+    cookie2 = mk_conn("user2", NULL);
+    store(h, h1, cookie1, "somekey", "some value1", &itm);
+    arena1 = last_arena;
+    h1->release(h, cookie1, itm);
+    cb_assert(arena1 != 0);
+
+    /* Every bucket allocates from its own */
+    store(h, h1, cookie2, "somekey", "some value2", &itm);
+    cb_assert(last_arena != 0 && last_arena != arena1);
+    h1->release(h, cookie2, itm);
+
+    store(h, h1, cookie1, "somekey", "some value1", &itm);
+    cb_assert(last_arena == arena1);
+    h1->release(h, cookie1, itm);
+    return SUCCESS;
+}
+
+static char evictions_stat[32];
+static void evictions_stats_handler(const char *key, const uint16_t klen,
+                                    const char *val, const uint32_t vlen,
+                                    const void *cookie) {
+    (void)cookie;
+    if (klen == 9 && memcmp(key, "evictions", klen) == 0) {
+        cb_assert(vlen < sizeof(evictions_stat));
+        memcpy(evictions_stat, val, vlen);
+        evictions_stat[vlen] = '\0';
+    }
+}
+
+/* Hand the stats of the compact format to evictions_stats_handler */
+static void snapshot_stats_handler(const char *key, const uint16_t klen,
+                                   const char *val, const uint32_t vlen,
+                                   const void *cookie) {
+    uint32_t offset = 0;
+    cb_assert(klen == 8 && memcmp(key, "snapshot", klen) == 0);
+    while (offset < vlen) {
+        uint16_t nklen;
+        uint32_t nvlen;
+        cb_assert(vlen - offset >= 6);
+        memcpy(&nklen, val + offset, 2);
+        memcpy(&nvlen, val + offset + 2, 4);
+        nklen = ntohs(nklen);
+        nvlen = ntohl(nvlen);
+        cb_assert(vlen - offset - 6 >= (uint32_t)nklen + nvlen);
+        evictions_stats_handler(val + offset + 6, nklen,
+                                val + offset + 6 + nklen, nvlen, cookie);
+        offset += 6 + nklen + nvlen;
+    }
+}
+
+static enum test_result test_stats_snapshot(ENGINE_HANDLE *h,
+                                            ENGINE_HANDLE_V1 *h1) {
+    const void *adm_cookie = mk_conn("admin", NULL);
+    const void *cookie;
+    item *itm;
+    void *pkt;
+    ENGINE_ERROR_CODE rv;
+    int ii;
+
+    pkt = create_create_bucket_pkt("someuser", ENGINE_PATH, "");
+    rv = h1->unknown_command(h, adm_cookie, pkt, add_response);
+    free(pkt);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cookie = mk_conn("someuser", NULL);
+
+    /* The mock counts an eviction for every store */
+    store(h, h1, cookie, "somekey", "somevalue", &itm);
+    h1->release(h, cookie, itm);
+
+    evictions_stat[0] = '\0';
+    for (ii = 0; ii < 300 && strcmp(evictions_stat, "1") != 0; ++ii) {
+        usleep(10000);
+        rv = h1->get_stats(h, cookie, "snapshot", 8, snapshot_stats_handler);
+        cb_assert(rv == ENGINE_SUCCESS || rv == ENGINE_TMPFAIL);
+    }
+    cb_assert(strcmp(evictions_stat, "1") == 0);
+
+    /* The general stats come from the snapshot until the next one */
+    store(h, h1, cookie, "somekey", "somevalue", &itm);
+    h1->release(h, cookie, itm);
+    evictions_stat[0] = '\0';
+    rv = h1->get_stats(h, cookie, NULL, 0, evictions_stats_handler);
+    cb_assert(rv == ENGINE_SUCCESS);
+    cb_assert(strcmp(evictions_stat, "1") == 0 ||
+              strcmp(evictions_stat, "2") == 0);
+    for (ii = 0; ii < 300 && strcmp(evictions_stat, "2") != 0; ++ii) {
+        usleep(10000);
+        rv = h1->get_stats(h, cookie, NULL, 0, evictions_stats_handler);
+        cb_assert(rv == ENGINE_SUCCESS);
+    }
+    cb_assert(strcmp(evictions_stat, "2") == 0);
+
+    /* The default bucket has one too */
+    rv = h1->get_stats(h, mk_conn(NULL, NULL), "snapshot", 8,
+                       snapshot_stats_handler);
+    cb_assert(rv == ENGINE_SUCCESS);
+    return SUCCESS;
+}
+
 static ENGINE_HANDLE_V1 *start_your_engines(const char *cfg) {
     ENGINE_HANDLE_V1 *h = (ENGINE_HANDLE_V1 *)load_engine(BUCKET_ENGINE_PATH, cfg);
     cb_assert(h);
@@ -1749,6 +2079,70 @@ static void* hash_strdup(const void *x, size_t n) {
     return memcpy(rv, x, n);
 }
 
+/*
+ * Verify that a table sized for one entry grows to hold many (with the
+ * short and long keys), and that the most recent value for a key stored
+ * more than once is found while the entries are moved over
+ */
+static enum test_result test_genhash_grow(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    struct hash_ops ops;
+    genhash_t *hash;
+    char key[64];
+    char val[32];
+    int ii;
+    (void)h;
+    (void)h1;
+
+    memset(&ops, 0, sizeof(ops));
+    ops.hashfunc = genhash_string_hash;
+    ops.hasheq = hash_key_eq;
+    ops.dupKey = hash_strdup;
+    ops.dupValue = hash_strdup;
+    ops.freeKey = free;
+    ops.freeValue = free;
+    hash = genhash_init(1, ops);
+    cb_assert(hash != NULL);
+
+    for (ii = 0; ii < 10000; ++ii) {
+        int klen = snprintf(key, sizeof(key), ii % 2 ? "key_%d" :
+                            "a_much_longer_key_than_fits_inline_%d", ii);
+        int vlen = snprintf(val, sizeof(val), "%d", ii);
+        genhash_store(hash, key, klen, val, vlen + 1);
+        if (ii % 100 == 0) {
+            /* Again, and this one is the one we should find */
+            vlen = snprintf(val, sizeof(val), "again_%d", ii);
+            genhash_store(hash, key, klen, val, vlen + 1);
+        }
+    }
+    cb_assert(genhash_size(hash) == 10100);
+
+    for (ii = 0; ii < 10000; ++ii) {
+        int klen = snprintf(key, sizeof(key), ii % 2 ? "key_%d" :
+                            "a_much_longer_key_than_fits_inline_%d", ii);
+        const char *found = genhash_find(hash, key, klen);
+        if (ii % 100 == 0) {
+            snprintf(val, sizeof(val), "again_%d", ii);
+            cb_assert(genhash_size_for_key(hash, key, klen) == 2);
+        } else {
+            snprintf(val, sizeof(val), "%d", ii);
+        }
+        cb_assert(found != NULL && strcmp(found, val) == 0);
+    }
+
+    for (ii = 0; ii < 10000; ii += 2) {
+        int klen = snprintf(key, sizeof(key),
+                            "a_much_longer_key_than_fits_inline_%d", ii);
+        cb_assert(genhash_delete_all(hash, key, klen) == (ii % 100 ? 1 : 2));
+    }
+    cb_assert(genhash_size(hash) == 5000);
+    cb_assert(genhash_find(hash, "key_1", 5) != NULL);
+    cb_assert(genhash_find(hash, "key_2", 5) == NULL);
+
+    genhash_free(hash);
+    return SUCCESS;
+}
+
 static int execute_test(struct test test) {
     enum test_result ret = PENDING;
 
@@ -1911,6 +2305,13 @@ int main(int argc, char **argv) {
         {"concurrent connect/disconnect (tap)",
          test_concurrent_connect_disconnect_tap, NULL },
         {"topkeys", test_topkeys, NULL },
+        {"topkeys (sampled)", test_topkeys_sampled, DEFAULT_CONFIG_TK_SAMPLE },
+        {"ops limit", test_ops_limit, DEFAULT_CONFIG_OPS_LIMIT },
+        {"memory budget", test_mem_budget, DEFAULT_CONFIG_MEM_BUDGET },
+        {"stats snapshot", test_stats_snapshot, DEFAULT_CONFIG_STATS_SNAPSHOT },
+        {"heap accounting", test_heap_accounting, DEFAULT_CONFIG_AC },
+        {"bucket arenas", test_bucket_arenas, DEFAULT_CONFIG_AC },
+        {"genhash grow", test_genhash_grow, NULL },
         {NULL, NULL, NULL}
     };
 
@@ -32,7 +32,9 @@ static int my_hash_eq(const void *k1, size_t nkey1,
     return nkey1 == nkey2 && memcmp(k1, k2, nkey1) == 0;
 }
 
-topkeys_t *topkeys_init(int max_keys) {
+topkeys_t *topkeys_init(int max_keys,
+                        uint32_t (*key_hash)(const void *cookie,
+                                             const void *key, size_t nkey)) {
     static struct hash_ops my_hash_ops;
     topkeys_t *tk = calloc(sizeof(topkeys_t), 1);
     if (tk == NULL) {
@@ -48,6 +50,7 @@ topkeys_t *topkeys_init(int max_keys) {
 
     cb_mutex_initialize(&tk->mutex);
     tk->max_keys = max_keys;
+    tk->key_hash = key_hash;
     tk->list.next = &tk->list;
     tk->list.prev = &tk->list;
 
@@ -160,10 +163,251 @@ ENGINE_ERROR_CODE topkeys_stats(topkeys_t **tks, size_t shards,
     return ENGINE_SUCCESS;
 }
 
-topkeys_t *tk_get_shard(topkeys_t **tks, const void *key, size_t nkey) {
+/* The hash of the key the server (may have) already computed for the
+ * request, or our own */
+static uint32_t tk_key_hash(uint32_t (*key_hash)(const void *, const void *,
+                                                 size_t),
+                            const void *cookie, const void *key, size_t nkey) {
+    if (key_hash != NULL) {
+        return key_hash(cookie, key, nkey);
+    }
+    return (uint32_t)genhash_string_hash(key, nkey);
+}
+
+topkeys_t *tk_get_shard(topkeys_t **tks, const void *cookie,
+                        const void *key, size_t nkey) {
     /* This is special-cased for 8 */
-    int khash;
+    uint32_t khash;
     cb_assert(TK_SHARDS == 8);
-    khash = genhash_string_hash(key, nkey);
+    khash = tk_key_hash(tks[0]->key_hash, cookie, key, nkey);
     return tks[khash & 0x07];
 }
+
+tk_sampled_t *tk_sampled_init(int max_keys, int sample, int nthreads,
+                              int (*thread_index)(const void *cookie),
+                              uint32_t (*key_hash)(const void *cookie,
+                                                   const void *key,
+                                                   size_t nkey)) {
+    tk_sampled_t *tks = calloc(1, sizeof(*tks));
+    int ii;
+
+    if (tks == NULL) {
+        return NULL;
+    }
+    if (nthreads < 0) {
+        nthreads = 0;
+    }
+    tks->sample = sample > 0 ? sample : 1;
+    tks->max_keys = max_keys;
+    tks->nthreads = nthreads;
+    tks->thread_index = thread_index;
+    tks->key_hash = key_hash;
+    tks->sketches = calloc(nthreads + 1, sizeof(tk_sketch_t));
+    if (tks->sketches == NULL) {
+        free(tks);
+        return NULL;
+    }
+
+    for (ii = 0; ii <= nthreads; ++ii) {
+        tk_sketch_t *sk = &tks->sketches[ii];
+        cb_mutex_initialize(&sk->mutex);
+        sk->seed = 2463534242U + (uint32_t)ii;
+        sk->skip = 1;
+        sk->entries = calloc(max_keys, sizeof(tk_entry_t));
+        if (sk->entries == NULL) {
+            tks->nthreads = ii;
+            tk_sampled_free(tks);
+            return NULL;
+        }
+    }
+
+    return tks;
+}
+
+void tk_sampled_free(tk_sampled_t *tks) {
+    int ii;
+    for (ii = 0; ii <= tks->nthreads; ++ii) {
+        cb_mutex_destroy(&tks->sketches[ii].mutex);
+        free(tks->sketches[ii].entries);
+    }
+    free(tks->sketches);
+    free(tks);
+}
+
+/* Somewhere between 1 and twice the sample, so that we don't keep on
+ * missing the same operations of a workload which repeats itself */
+static int tk_next_skip(tk_sketch_t *sk, int sample) {
+    uint32_t x = sk->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sk->seed = x;
+    return sample == 1 ? 1 : 1 + (int)(x % (uint32_t)(2 * sample - 1));
+}
+
+static void tk_sketch_add(tk_sketch_t *sk, int max_keys, size_t offset,
+                          uint32_t hash, const void *key, size_t nkey,
+                          rel_time_t ct) {
+    tk_entry_t *it = NULL;
+    tk_entry_t *min = NULL;
+    int ii;
+
+    for (ii = 0; ii < sk->nentries; ++ii) {
+        tk_entry_t *e = &sk->entries[ii];
+        if (e->hash == hash && e->nkey == nkey &&
+            memcmp(e->key, key, nkey) == 0) {
+            it = e;
+            break;
+        }
+        if (min == NULL || e->count < min->count) {
+            min = e;
+        }
+    }
+
+    if (it == NULL) {
+        uint64_t count = 0;
+        if (sk->nentries < max_keys) {
+            it = &sk->entries[sk->nentries++];
+        } else if (min != NULL) {
+            /* It takes over the count of the one it replaces */
+            it = min;
+            count = min->count;
+        } else {
+            return;
+        }
+        memset(it, 0, sizeof(*it));
+        it->hash = hash;
+        it->nkey = (uint16_t)nkey;
+        memcpy(it->key, key, nkey);
+        it->count = it->error = count;
+        it->ti_ctime = ct;
+    }
+
+    it->count++;
+    it->ti_atime = ct;
+    ++*(int *)((char *)it + offset);
+}
+
+void tk_sampled_record(tk_sampled_t *tks, const void *cookie, size_t offset,
+                       const void *key, size_t nkey, rel_time_t ctime) {
+    int thread = tks->thread_index ? tks->thread_index(cookie) : -1;
+    bool shared = thread < 0 || thread >= tks->nthreads;
+    tk_sketch_t *sk;
+    uint32_t hash;
+
+    cb_assert(key);
+    cb_assert(nkey > 0);
+    if (nkey > TK_MAX_KEY_LEN) {
+        nkey = TK_MAX_KEY_LEN;
+    }
+
+    sk = &tks->sketches[shared ? tks->nthreads : thread];
+    if (shared) {
+        cb_mutex_enter(&sk->mutex);
+    }
+    /* Only its own thread touches skip and seed (or whoever holds the
+     * lock of the shared one) */
+    if (--sk->skip > 0) {
+        if (shared) {
+            cb_mutex_exit(&sk->mutex);
+        }
+        return;
+    }
+    sk->skip = tk_next_skip(sk, tks->sample);
+
+    /* Only the sampled operations need the hash */
+    hash = tk_key_hash(tks->key_hash, cookie, key, nkey);
+    if (!shared) {
+        cb_mutex_enter(&sk->mutex);
+    }
+    tk_sketch_add(sk, tks->max_keys, offset, hash, key, nkey, ctime);
+    cb_mutex_exit(&sk->mutex);
+}
+
+static int tk_entry_compare(const void *a, const void *b) {
+    const tk_entry_t *ea = *(const tk_entry_t * const *)a;
+    const tk_entry_t *eb = *(const tk_entry_t * const *)b;
+    if (ea->count != eb->count) {
+        return ea->count > eb->count ? -1 : 1;
+    }
+    return 0;
+}
+
+ENGINE_ERROR_CODE tk_sampled_stats(tk_sampled_t *tks, const void *cookie,
+                                   const rel_time_t current_time,
+                                   ADD_STAT add_stat) {
+    static struct hash_ops merge_ops;
+    size_t max = (size_t)(tks->nthreads + 1) * tks->max_keys;
+    tk_entry_t *merged = calloc(max > 0 ? max : 1, sizeof(tk_entry_t));
+    tk_entry_t **sorted = calloc(max > 0 ? max : 1, sizeof(tk_entry_t *));
+    genhash_t *hash;
+    size_t nmerged = 0;
+    size_t ii;
+    int thread;
+
+    merge_ops.hashfunc = genhash_string_hash;
+    merge_ops.hasheq = my_hash_eq;
+    hash = genhash_init(tks->max_keys > 0 ? tks->max_keys : 1, merge_ops);
+    if (merged == NULL || sorted == NULL || hash == NULL) {
+        free(merged);
+        free(sorted);
+        if (hash != NULL) {
+            genhash_free(hash);
+        }
+        return ENGINE_ENOMEM;
+    }
+
+    for (thread = 0; thread <= tks->nthreads; ++thread) {
+        tk_sketch_t *sk = &tks->sketches[thread];
+        int jj;
+
+        cb_mutex_enter(&sk->mutex);
+        for (jj = 0; jj < sk->nentries; ++jj) {
+            tk_entry_t *e = &sk->entries[jj];
+            tk_entry_t *m = genhash_find(hash, e->key, e->nkey);
+            if (m == NULL) {
+                m = &merged[nmerged++];
+                *m = *e;
+                genhash_update(hash, m->key, m->nkey, m, sizeof(*m));
+                continue;
+            }
+            m->count += e->count;
+            m->error += e->error;
+            if (e->ti_ctime < m->ti_ctime) {
+                m->ti_ctime = e->ti_ctime;
+            }
+            if (e->ti_atime > m->ti_atime) {
+                m->ti_atime = e->ti_atime;
+            }
+#define TK_MERGE(name) m->name += e->name;
+            TK_OPS(TK_MERGE)
+#undef TK_MERGE
+        }
+        cb_mutex_exit(&sk->mutex);
+    }
+    genhash_free(hash);
+
+    for (ii = 0; ii < nmerged; ++ii) {
+        sorted[ii] = &merged[ii];
+    }
+    qsort(sorted, nmerged, sizeof(tk_entry_t *), tk_entry_compare);
+
+    for (ii = 0; ii < nmerged && ii < (size_t)tks->max_keys; ++ii) {
+        tk_entry_t *it = sorted[ii];
+        char val_str[TK_MAX_VAL_LEN];
+        int vlen;
+#define TK_SCALED_ARGS(name) it->name * tks->sample,
+        vlen = snprintf(val_str, sizeof(val_str) - 1,
+                        TK_OPS(TK_FMT)"ctime=%"PRIu32",atime=%"PRIu32
+                        ",error=%"PRIu64, TK_OPS(TK_SCALED_ARGS)
+                        current_time - it->ti_ctime,
+                        current_time - it->ti_atime,
+                        it->error * (uint64_t)tks->sample);
+#undef TK_SCALED_ARGS
+        add_stat(it->key, it->nkey, val_str, vlen, cookie);
+    }
+
+    free(sorted);
+    free(merged);
+    return ENGINE_SUCCESS;
+}
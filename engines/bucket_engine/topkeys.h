@@ -4,6 +4,7 @@
 
 #include <platform/cbassert.h>
 #include <memcached/engine.h>
+#include <stddef.h>
 #include "genhash.h"
 
 /* A list of operations for which we have int stats */
@@ -18,15 +19,21 @@
 
 #define TK_SHARDS 8
 
-/* Update the correct stat for a given operation */
-#define TK(tks, op, key, nkey, ctime) \
+/* The longest key the sampled topkeys keep */
+#define TK_MAX_KEY_LEN 250
+
+/* Update the correct stat for a given operation of the bucket */
+#define TK(peh, cookie, op, key, nkey, ctime) \
 { \
-    if (tks) { \
+    if ((peh)->tk_sampled) { \
+        tk_sampled_record((peh)->tk_sampled, (cookie), \
+                          offsetof(tk_entry_t, op), (key), (nkey), (ctime)); \
+    } else if ((peh)->topkeys) { \
         topkeys_t *tk; \
         topkey_item_t *tmp; \
         cb_assert(key); \
         cb_assert(nkey > 0); \
-        tk = tk_get_shard((tks), (key), (nkey)); \
+        tk = tk_get_shard((peh)->topkeys, (cookie), (key), (nkey)); \
         cb_mutex_enter(&tk->mutex); \
         tmp = topkeys_item_get_or_create((tk), (key), (nkey), (ctime)); \
         if (tmp != NULL) { \
@@ -57,11 +64,22 @@ typedef struct topkeys {
     genhash_t *hash;
     int nkeys;
     int max_keys;
+    uint32_t (*key_hash)(const void *cookie, const void *key, size_t nkey);
 } topkeys_t;
 
-topkeys_t *topkeys_init(int max_keys);
+/**
+ * Create a shard of the topkeys of a bucket
+ * @param max_keys the keys it keeps
+ * @param key_hash returns the hash of a key of the request of a cookie,
+ *        which picks the shard (may be NULL)
+ * @return the shard or NULL if we failed to allocate it
+ */
+topkeys_t *topkeys_init(int max_keys,
+                        uint32_t (*key_hash)(const void *cookie,
+                                             const void *key, size_t nkey));
 void topkeys_free(topkeys_t *topkeys);
-topkeys_t *tk_get_shard(topkeys_t **tk, const void *key, size_t nkey);
+topkeys_t *tk_get_shard(topkeys_t **tk, const void *cookie,
+                        const void *key, size_t nkey);
 topkey_item_t *topkeys_item_get_or_create(topkeys_t *tk,
                                           const void *key,
                                           size_t nkey,
@@ -72,4 +90,76 @@ ENGINE_ERROR_CODE topkeys_stats(topkeys_t **tk, size_t n,
                                 const rel_time_t current_time,
                                 ADD_STAT add_stat);
 
+/*
+ * The sampled topkeys (with topkeys_sample). Every worker thread counts
+ * one of (about) every sample of its operations into a space-saving
+ * sketch of its own: the max_keys keys it counted the most, where a new
+ * key takes over the entry of the least counted one (and its count, which
+ * is what it may be off by). Nobody but the stats ever waits for the lock
+ * of a sketch, and they merge them when they're asked for.
+ */
+typedef struct tk_entry {
+    uint32_t hash;
+    uint16_t nkey;
+    rel_time_t ti_ctime, ti_atime;
+    uint64_t count;     /* The sampled operations */
+    uint64_t error;     /* How many of them may have been other keys */
+#define TK_CUR(ti_name) int ti_name;
+    TK_OPS(TK_CUR)
+#undef TK_CUR
+    char key[TK_MAX_KEY_LEN];
+} tk_entry_t;
+
+typedef struct tk_sketch {
+    cb_mutex_t mutex;
+    int skip;           /* The operations to go until the next sample */
+    uint32_t seed;
+    int nentries;
+    tk_entry_t *entries;
+} tk_sketch_t;
+
+typedef struct tk_sampled {
+    int sample;
+    int max_keys;
+    int nthreads;
+    int (*thread_index)(const void *cookie);
+    uint32_t (*key_hash)(const void *cookie, const void *key, size_t nkey);
+    /* By the index of the thread, and one more for any other thread
+     * (which all take its lock) */
+    tk_sketch_t *sketches;
+} tk_sampled_t;
+
+/**
+ * Create the sampled topkeys of a bucket
+ * @param max_keys the keys every thread keeps
+ * @param sample count one of every this many operations
+ * @param nthreads the number of threads
+ * @param thread_index returns the index of the thread running a cookie
+ *        (below nthreads), or -1 (may be NULL)
+ * @param key_hash returns the hash of a key of the request of a cookie
+ *        (may be NULL)
+ * @return the topkeys or NULL if we failed to allocate them
+ */
+tk_sampled_t *tk_sampled_init(int max_keys, int sample, int nthreads,
+                              int (*thread_index)(const void *cookie),
+                              uint32_t (*key_hash)(const void *cookie,
+                                                   const void *key,
+                                                   size_t nkey));
+void tk_sampled_free(tk_sampled_t *tks);
+
+/**
+ * Count an operation (if it is sampled)
+ * @param offset the offset of its counter in tk_entry_t
+ */
+void tk_sampled_record(tk_sampled_t *tks, const void *cookie, size_t offset,
+                       const void *key, size_t nkey, rel_time_t ctime);
+
+/**
+ * Add the stats of the max_keys keys counted the most by all of the
+ * threads, with their counts scaled up by the sample
+ */
+ENGINE_ERROR_CODE tk_sampled_stats(tk_sampled_t *tks, const void *cookie,
+                                   const rel_time_t current_time,
+                                   ADD_STAT add_stat);
+
 #endif
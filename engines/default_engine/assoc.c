@@ -11,19 +11,82 @@
 #include <string.h>
 #include <platform/platform.h>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define ASSOC_USE_SSE2 1
+#endif
+
 #include "default_engine.h"
 
 #define hashsize(n) ((uint32_t)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
 
+/*
+ * The chained table grows when it holds 1.5 items per bucket, the tagged
+ * table when it holds this many (each bucket has room for
+ * ASSOC_BUCKET_SLOTS of them before we start chaining).
+ */
+#define TAGGED_LOAD_FACTOR 4
+
+/*
+ * We shrink the table when it falls below this fraction of the load that
+ * would make it grow. Shrinking doubles the load, so this leaves plenty of
+ * room before we would want to grow again.
+ */
+#define SHRINK_RATIO 8
+
+/*
+ * How long the maintenance thread sleeps between each time slice of
+ * moving buckets (in microseconds)
+ */
+#define ASSOC_YIELD_TIME 100
+
+static size_t assoc_bucket_size(struct default_engine *engine) {
+    return engine->config.tagged_assoc ? sizeof(struct assoc_bucket)
+                                       : sizeof(hash_item*);
+}
+
+/* The number of items which makes a table of the given size grow */
+static unsigned int assoc_grow_limit(struct default_engine *engine,
+                                     unsigned int hashpower) {
+    if (engine->config.tagged_assoc) {
+        return hashsize(hashpower) * TAGGED_LOAD_FACTOR;
+    }
+    return (hashsize(hashpower) * 3) / 2;
+}
+
+/*
+ * Get the size the table should have for the current number of items.
+ * Caller must hold assoc.lock
+ */
+static unsigned int assoc_target_hashpower(struct default_engine *engine) {
+    unsigned int hashpower = engine->assoc.hashpower;
+    unsigned int limit = assoc_grow_limit(engine, hashpower);
+
+    if (engine->assoc.hash_items > limit) {
+        return hashpower + 1;
+    }
+    if (hashpower > engine->assoc.min_hashpower &&
+        engine->assoc.hash_items < limit / SHRINK_RATIO) {
+        return hashpower - 1;
+    }
+    return hashpower;
+}
+
 ENGINE_ERROR_CODE assoc_init(struct default_engine *engine) {
+    engine->assoc.hashpower = (unsigned int)engine->config.hashpower;
+    if (engine->config.tagged_assoc && engine->assoc.hashpower > 2) {
+        /* Each bucket holds several items, so start out with fewer */
+        engine->assoc.hashpower -= 2;
+    }
+    engine->assoc.min_hashpower = engine->assoc.hashpower;
     engine->assoc.primary_hashtable = calloc(hashsize(engine->assoc.hashpower),
-                                             sizeof(hash_item*));
+                                             assoc_bucket_size(engine));
     return (engine->assoc.primary_hashtable != NULL) ? ENGINE_SUCCESS : ENGINE_ENOMEM;
 }
 
 void assoc_destroy(struct default_engine *engine) {
-    while (engine->assoc.expanding) {
+    while (engine->assoc.expanding || engine->assoc.expand_scheduled) {
 #ifdef WIN32
         Sleep(1);
 #else
@@ -33,177 +96,722 @@ void assoc_destroy(struct default_engine *engine) {
     free(engine->assoc.primary_hashtable);
 }
 
-hash_item *assoc_find(struct default_engine *engine, uint32_t hash, const char *key, const size_t nkey) {
-    hash_item *it;
-    unsigned int oldbucket;
-    hash_item *ret = NULL;
-    int depth = 0;
+/*
+ * The buckets are moved in the order of their index in the smaller of the
+ * two tables, so all of the buckets with the same index there move at the
+ * same time (and share an item lock).
+ */
+static unsigned int assoc_move_power(struct default_engine *engine) {
+    if (engine->assoc.old_hashpower < engine->assoc.hashpower) {
+        return engine->assoc.old_hashpower;
+    }
+    return engine->assoc.hashpower;
+}
 
+/*
+ * Get the index of the bucket for hash, and the table it currently lives in
+ */
+static void *assoc_get_table(struct default_engine *engine, uint32_t hash,
+                             unsigned int *bucket) {
     if (engine->assoc.expanding &&
-        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
+        (hash & hashmask(assoc_move_power(engine))) >= engine->assoc.expand_bucket)
     {
-        it = engine->assoc.old_hashtable[oldbucket];
-    } else {
-        it = engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
+        *bucket = hash & hashmask(engine->assoc.old_hashpower);
+        return engine->assoc.old_hashtable;
     }
+    *bucket = hash & hashmask(engine->assoc.hashpower);
+    return engine->assoc.primary_hashtable;
+}
+
+/*
+ * The chained table: each bucket is the head of a list of items linked
+ * through h_next.
+ */
+
+static hash_item *chained_find(struct default_engine *engine, uint32_t hash,
+                               const char *key, const size_t nkey) {
+    unsigned int bucket;
+    hash_item **table = assoc_get_table(engine, hash, &bucket);
+    hash_item *it = table[bucket];
+    hash_item *ret = NULL;
+    int depth = 0;
 
     while (it) {
         if ((nkey == it->nkey) && (memcmp(key, item_get_key(it), nkey) == 0)) {
             ret = it;
             break;
         }
-        it = it->h_next;
+        it = item_h_next(engine, it);
         ++depth;
     }
     MEMCACHED_ASSOC_FIND(key, nkey, depth);
     return ret;
 }
 
-/* returns the address of the item pointer before the key.  if *item == 0,
-   the item wasn't found */
+static void chained_insert(struct default_engine *engine, uint32_t hash,
+                           hash_item *it) {
+    unsigned int bucket;
+    hash_item **table = assoc_get_table(engine, hash, &bucket);
 
-static hash_item** _hashitem_before(struct default_engine *engine,
-                                    uint32_t hash,
-                                    const char *key,
-                                    const size_t nkey) {
-    hash_item **pos;
-    unsigned int oldbucket;
+    item_set_h_next(engine, it, table[bucket]);
+    table[bucket] = it;
+}
 
-    if (engine->assoc.expanding &&
-        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
-    {
-        pos = &engine->assoc.old_hashtable[oldbucket];
+static bool chained_delete(struct default_engine *engine, uint32_t hash,
+                           const char *key, const size_t nkey) {
+    unsigned int bucket;
+    hash_item **table = assoc_get_table(engine, hash, &bucket);
+    hash_item *it = table[bucket];
+    hash_item *prev = NULL;
+
+    while (it && ((nkey != it->nkey) || memcmp(key, item_get_key(it), nkey))) {
+        prev = it;
+        it = item_h_next(engine, it);
+    }
+
+    if (it) {
+        if (prev == NULL) {
+            table[bucket] = item_h_next(engine, it);
+        } else {
+            prev->h_next = it->h_next;
+        }
+        it->h_next = 0;   /* probably pointless, but whatever. */
+        return true;
+    }
+    return false;
+}
+
+/* Move all of the items in the old bucket over to the primary table */
+static void chained_move_bucket(struct default_engine *engine,
+                                unsigned int bucket) {
+    hash_item **old_table = engine->assoc.old_hashtable;
+    hash_item **new_table = engine->assoc.primary_hashtable;
+    hash_item *it, *next;
+
+    for (it = old_table[bucket]; NULL != it; it = next) {
+        unsigned int nb;
+        next = item_h_next(engine, it);
+
+        nb = engine->server.core->hash(item_get_key(it), it->nkey, 0)
+            & hashmask(engine->assoc.hashpower);
+        item_set_h_next(engine, it, new_table[nb]);
+        new_table[nb] = it;
+    }
+
+    old_table[bucket] = NULL;
+}
+
+/*
+ * The tagged table: each bucket is a cache line with room for
+ * ASSOC_BUCKET_SLOTS items and an 8 bit tag (from the upper bits of the
+ * hash) for each of them. We compare all of the tags at once and only
+ * look at the items whose tag match. Once all of the slots in a bucket
+ * are taken the rest of the items are chained off the item in the last
+ * slot (and the extra tag at the end is set).
+ */
+
+#define TAGGED_LAST (ASSOC_BUCKET_SLOTS - 1)
+#define TAGGED_OVERFLOW ASSOC_BUCKET_SLOTS
+
+static uint8_t assoc_tag(uint32_t hash) {
+    uint8_t tag = (uint8_t)(hash >> 24);
+    /* 0 marks an empty slot */
+    return (tag == 0) ? 1 : tag;
+}
+
+/* Return a bitmask of the slots with the given tag */
+static unsigned int tagged_match(const struct assoc_bucket *bucket,
+                                 uint8_t tag) {
+#ifdef ASSOC_USE_SSE2
+    __m128i tags = _mm_loadl_epi64((const __m128i*)bucket->tags);
+    __m128i match = _mm_cmpeq_epi8(tags, _mm_set1_epi8((char)tag));
+    return (unsigned int)_mm_movemask_epi8(match) &
+        ((1U << ASSOC_BUCKET_SLOTS) - 1);
+#else
+    unsigned int mask = 0;
+    int ii;
+    for (ii = 0; ii < ASSOC_BUCKET_SLOTS; ++ii) {
+        if (bucket->tags[ii] == tag) {
+            mask |= 1U << ii;
+        }
+    }
+    return mask;
+#endif
+}
+
+static struct assoc_bucket *tagged_get_bucket(struct default_engine *engine,
+                                              uint32_t hash) {
+    unsigned int bucket;
+    struct assoc_bucket *table = assoc_get_table(engine, hash, &bucket);
+    return &table[bucket];
+}
+
+static hash_item *tagged_find(struct default_engine *engine, uint32_t hash,
+                              const char *key, const size_t nkey) {
+    struct assoc_bucket *bucket = tagged_get_bucket(engine, hash);
+    unsigned int mask = tagged_match(bucket, assoc_tag(hash));
+    hash_item *it;
+    int depth = 0;
+    int ii;
+
+    for (ii = 0; mask != 0; ++ii, mask >>= 1) {
+        if ((mask & 1) != 0) {
+            it = bucket->slots[ii];
+            if ((nkey == it->nkey) && (memcmp(key, item_get_key(it), nkey) == 0)) {
+                MEMCACHED_ASSOC_FIND(key, nkey, depth);
+                return it;
+            }
+            ++depth;
+        }
+    }
+
+    if (bucket->tags[TAGGED_OVERFLOW] != 0) {
+        for (it = item_h_next(engine, bucket->slots[TAGGED_LAST]); it;
+             it = item_h_next(engine, it)) {
+            if ((nkey == it->nkey) && (memcmp(key, item_get_key(it), nkey) == 0)) {
+                MEMCACHED_ASSOC_FIND(key, nkey, depth);
+                return it;
+            }
+            ++depth;
+        }
+    }
+
+    MEMCACHED_ASSOC_FIND(key, nkey, depth);
+    return NULL;
+}
+
+static void tagged_bucket_insert(struct default_engine *engine,
+                                 struct assoc_bucket *bucket, uint8_t tag,
+                                 hash_item *it) {
+    unsigned int empty = tagged_match(bucket, 0);
+
+    if (empty != 0) {
+        int ii;
+        for (ii = 0; (empty & 1) == 0; ++ii, empty >>= 1) {
+            /* empty */
+        }
+        it->h_next = 0;
+        bucket->slots[ii] = it;
+        bucket->tags[ii] = tag;
     } else {
-        pos = &engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
+        hash_item *last = bucket->slots[TAGGED_LAST];
+        it->h_next = last->h_next;
+        item_set_h_next(engine, last, it);
+        bucket->tags[TAGGED_OVERFLOW] = 1;
+    }
+}
+
+static void tagged_insert(struct default_engine *engine, uint32_t hash,
+                          hash_item *it) {
+    tagged_bucket_insert(engine, tagged_get_bucket(engine, hash),
+                         assoc_tag(hash), it);
+}
+
+static bool tagged_delete(struct default_engine *engine, uint32_t hash,
+                          const char *key, const size_t nkey) {
+    struct assoc_bucket *bucket = tagged_get_bucket(engine, hash);
+    unsigned int mask = tagged_match(bucket, assoc_tag(hash));
+    hash_item *it;
+    hash_item *prev;
+    int ii;
+
+    for (ii = 0; mask != 0; ++ii, mask >>= 1) {
+        if ((mask & 1) == 0) {
+            continue;
+        }
+        it = bucket->slots[ii];
+        if ((nkey != it->nkey) || (memcmp(key, item_get_key(it), nkey) != 0)) {
+            continue;
+        }
+
+        if (ii == TAGGED_LAST && bucket->tags[TAGGED_OVERFLOW] != 0) {
+            /* Move the first of the chained items into the slot */
+            hash_item *next = item_h_next(engine, it);
+            bucket->slots[ii] = next;
+            bucket->tags[ii] = assoc_tag(engine->server.core->hash(item_get_key(next),
+                                                                   next->nkey, 0));
+            if (next->h_next == 0) {
+                bucket->tags[TAGGED_OVERFLOW] = 0;
+            }
+        } else {
+            bucket->slots[ii] = NULL;
+            bucket->tags[ii] = 0;
+        }
+        it->h_next = 0;
+        return true;
+    }
+
+    if (bucket->tags[TAGGED_OVERFLOW] == 0) {
+        return false;
+    }
+
+    prev = bucket->slots[TAGGED_LAST];
+    it = item_h_next(engine, prev);
+    while (it && ((nkey != it->nkey) || memcmp(key, item_get_key(it), nkey))) {
+        prev = it;
+        it = item_h_next(engine, it);
+    }
+    if (it == NULL) {
+        return false;
     }
 
-    while (*pos && ((nkey != (*pos)->nkey) || memcmp(key, item_get_key(*pos), nkey))) {
-        pos = &(*pos)->h_next;
+    prev->h_next = it->h_next;
+    it->h_next = 0;
+    if (bucket->slots[TAGGED_LAST]->h_next == 0) {
+        bucket->tags[TAGGED_OVERFLOW] = 0;
     }
-    return pos;
+    return true;
 }
 
-static void assoc_maintenance_thread(void *arg);
+static void tagged_move_item(struct default_engine *engine, hash_item *it) {
+    struct assoc_bucket *table = engine->assoc.primary_hashtable;
+    uint32_t hash = engine->server.core->hash(item_get_key(it), it->nkey, 0);
+    tagged_bucket_insert(engine,
+                         &table[hash & hashmask(engine->assoc.hashpower)],
+                         assoc_tag(hash), it);
+}
 
-/* grows the hashtable to the next power of 2. */
-static void assoc_expand(struct default_engine *engine) {
-    engine->assoc.old_hashtable = engine->assoc.primary_hashtable;
+/* Move all of the items in the old bucket over to the primary table */
+static void tagged_move_bucket(struct default_engine *engine,
+                               unsigned int bucket) {
+    struct assoc_bucket *old_table = engine->assoc.old_hashtable;
+    struct assoc_bucket *old = &old_table[bucket];
+    hash_item *chain = NULL;
+    int ii;
+
+    if (old->tags[TAGGED_OVERFLOW] != 0) {
+        chain = item_h_next(engine, old->slots[TAGGED_LAST]);
+    }
+
+    for (ii = 0; ii < ASSOC_BUCKET_SLOTS; ++ii) {
+        if (old->tags[ii] != 0) {
+            tagged_move_item(engine, old->slots[ii]);
+        }
+    }
+
+    while (chain != NULL) {
+        hash_item *next = item_h_next(engine, chain);
+        tagged_move_item(engine, chain);
+        chain = next;
+    }
+
+    memset(old, 0, sizeof(*old));
+}
+
+hash_item *assoc_find(struct default_engine *engine, uint32_t hash, const char *key, const size_t nkey) {
+    if (engine->config.tagged_assoc) {
+        return tagged_find(engine, hash, key, nkey);
+    }
+    return chained_find(engine, hash, key, nkey);
+}
+
+static bool assoc_key_matches(hash_item *it, const char *key,
+                              const size_t nkey) {
+    return nkey == it->nkey && memcmp(key, item_get_key(it), nkey) == 0;
+}
+
+/*
+ * The lookup of item_get with lockless_get: we only follow a pointer we
+ * read once we've checked that the sequence of the stripe didn't move
+ * since seq, that is, that the item was still in the bucket at the time
+ * (and the table still in use). See the notes at the top of items.c
+ */
+bool assoc_find_lockless(struct default_engine *engine, uint32_t hash,
+                         const char *key, const size_t nkey, uint32_t seq,
+                         hash_item **found) {
+    unsigned int bucket;
+    void *table = assoc_get_table(engine, hash, &bucket);
+    hash_item *it;
+
+    *found = NULL;
+    if (!item_seq_check(engine, hash, seq)) {
+        return false;
+    }
+
+    if (engine->config.tagged_assoc) {
+        struct assoc_bucket *b = (struct assoc_bucket *)table + bucket;
+        unsigned int mask = tagged_match(b, assoc_tag(hash));
+        int ii;
+
+        for (ii = 0; mask != 0; ++ii, mask >>= 1) {
+            if ((mask & 1) == 0) {
+                continue;
+            }
+            it = b->slots[ii];
+            if (!item_seq_check(engine, hash, seq) || it == NULL) {
+                return false;
+            }
+            if (assoc_key_matches(it, key, nkey)) {
+                *found = it;
+                return item_seq_check(engine, hash, seq);
+            }
+        }
+
+        if (b->tags[TAGGED_OVERFLOW] == 0) {
+            return item_seq_check(engine, hash, seq);
+        }
+        it = b->slots[TAGGED_LAST];
+        if (!item_seq_check(engine, hash, seq) || it == NULL) {
+            return false;
+        }
+        it = item_h_next(engine, it);
+    } else {
+        it = ((hash_item **)table)[bucket];
+    }
+
+    while (item_seq_check(engine, hash, seq)) {
+        if (it == NULL) {
+            return true;
+        }
+        if (assoc_key_matches(it, key, nkey)) {
+            *found = it;
+            return item_seq_check(engine, hash, seq);
+        }
+        it = item_h_next(engine, it);
+    }
+    return false;
+}
+
+/*
+ * Pick the nth (modulo the number of them) of the items in the bucket
+ * for hash. The chains are short, so we count them first.
+ */
+hash_item *assoc_random(struct default_engine *engine, uint32_t hash,
+                        uint32_t nth) {
+    unsigned int bucket;
+    void *table = assoc_get_table(engine, hash, &bucket);
+    hash_item *slots[ASSOC_BUCKET_SLOTS];
+    hash_item *chain;
+    hash_item *it;
+    uint32_t nslots = 0;
+    uint32_t count;
+
+    if (engine->config.tagged_assoc) {
+        struct assoc_bucket *b = (struct assoc_bucket *)table + bucket;
+        int ii;
 
-    engine->assoc.primary_hashtable = calloc(hashsize(engine->assoc.hashpower + 1),
-                                             sizeof(hash_item *));
-    if (engine->assoc.primary_hashtable) {
-        int ret = 0;
-        cb_thread_t tid;
-
-        engine->assoc.hashpower++;
-        engine->assoc.expanding = true;
-        engine->assoc.expand_bucket = 0;
-
-        /* start a thread to do the expansion */
-        if ((ret = cb_create_thread(&tid, assoc_maintenance_thread, engine, 1)) != 0)
-        {
-            EXTENSION_LOGGER_DESCRIPTOR *logger;
-            logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-            logger->log(EXTENSION_LOG_WARNING, NULL,
-                        "Can't create thread: %s\n", strerror(ret));
-            engine->assoc.hashpower--;
-            engine->assoc.expanding = false;
-            free(engine->assoc.primary_hashtable);
-            engine->assoc.primary_hashtable =engine->assoc.old_hashtable;
+        for (ii = 0; ii < ASSOC_BUCKET_SLOTS; ++ii) {
+            if (b->tags[ii] != 0) {
+                slots[nslots++] = b->slots[ii];
+            }
         }
+        chain = NULL;
+        if (b->tags[TAGGED_OVERFLOW] != 0) {
+            chain = item_h_next(engine, b->slots[TAGGED_LAST]);
+        }
+    } else {
+        chain = ((hash_item **)table)[bucket];
+    }
+
+    count = nslots;
+    for (it = chain; it != NULL; it = item_h_next(engine, it)) {
+        ++count;
+    }
+    if (count == 0) {
+        return NULL;
+    }
+
+    nth %= count;
+    if (nth < nslots) {
+        return slots[nth];
+    }
+    for (it = chain, nth -= nslots; nth > 0; --nth) {
+        it = item_h_next(engine, it);
+    }
+    return it;
+}
+
+uint32_t assoc_buckets(struct default_engine *engine) {
+    unsigned int hashpower = engine->assoc.hashpower;
+    if (engine->assoc.expanding && engine->assoc.old_hashpower > hashpower) {
+        hashpower = engine->assoc.old_hashpower;
+    }
+    return hashsize(hashpower);
+}
+
+void assoc_prefetch(struct default_engine *engine, uint32_t hash) {
+#ifdef __GNUC__
+    /* Only the address of the bucket; the table may be moving under us */
+    if (engine->config.tagged_assoc) {
+        __builtin_prefetch(tagged_get_bucket(engine, hash));
     } else {
-        engine->assoc.primary_hashtable = engine->assoc.old_hashtable;
+        unsigned int bucket;
+        hash_item **table = assoc_get_table(engine, hash, &bucket);
+        __builtin_prefetch(&table[bucket]);
+    }
+#else
+    (void)engine;
+    (void)hash;
+#endif
+}
+
+static void assoc_maintenance_thread(void *arg);
+static ENGINE_ERROR_CODE assoc_maintenance_task(void *arg);
+
+/*
+ * Replace the primary table with one of the given size. Called from the
+ * maintenance thread with all of the item locks held.
+ */
+static bool assoc_resize(struct default_engine *engine, void *table,
+                         unsigned int hashpower) {
+    if (table == NULL) {
         /* Bad news, but we can keep running. */
+        return false;
+    }
+    engine->assoc.old_hashtable = engine->assoc.primary_hashtable;
+    engine->assoc.old_hashpower = engine->assoc.hashpower;
+    engine->assoc.primary_hashtable = table;
+    engine->assoc.hashpower = hashpower;
+    engine->assoc.expanding = true;
+    engine->assoc.expand_bucket = 0;
+    return true;
+}
+
+/*
+ * Start the maintenance (on the executor of the server if it has one) to
+ * resize the table if the load factor is out of range. We can't do the
+ * actual swap here, because our caller holds one of the item locks.
+ * Caller must hold assoc.lock
+ */
+static void assoc_schedule_resize(struct default_engine *engine) {
+    int ret;
+    cb_thread_t tid;
+
+    if (engine->assoc.expanding || engine->assoc.expand_scheduled ||
+        assoc_target_hashpower(engine) == engine->assoc.hashpower) {
+        return;
+    }
+
+    engine->assoc.expand_scheduled = true;
+    if (engine->server.core->submit_task != NULL &&
+        engine->server.core->submit_task(NULL, assoc_maintenance_task, engine,
+                                         EXECUTOR_PRIORITY_LOW) == ENGINE_SUCCESS) {
+        return;
+    }
+
+    /* The server can't run it for us */
+    if ((ret = cb_create_thread(&tid, assoc_maintenance_thread, engine, 1)) != 0)
+    {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Can't create thread: %s\n", strerror(ret));
+        engine->assoc.expand_scheduled = false;
     }
 }
 
 /* Note: this isn't an assoc_update.  The key must not already exist to call this */
 int assoc_insert(struct default_engine *engine, uint32_t hash, hash_item *it) {
-    unsigned int oldbucket;
-
     cb_assert(assoc_find(engine, hash, item_get_key(it), it->nkey) == 0);  /* shouldn't have duplicately named things defined */
 
-    if (engine->assoc.expanding &&
-        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
-    {
-        it->h_next = engine->assoc.old_hashtable[oldbucket];
-        engine->assoc.old_hashtable[oldbucket] = it;
+    item_seq_write_begin(engine, hash);
+    if (engine->config.tagged_assoc) {
+        tagged_insert(engine, hash, it);
     } else {
-        it->h_next = engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
-        engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)] = it;
+        chained_insert(engine, hash, it);
     }
+    item_seq_write_end(engine, hash);
 
+    mc_mutex_enter(&engine->assoc.lock, &engine->lock_stats.assoc);
     engine->assoc.hash_items++;
-    if (! engine->assoc.expanding && engine->assoc.hash_items > (hashsize(engine->assoc.hashpower) * 3) / 2) {
-        assoc_expand(engine);
-    }
+    assoc_schedule_resize(engine);
+    cb_mutex_exit(&engine->assoc.lock);
 
     MEMCACHED_ASSOC_INSERT(item_get_key(it), it->nkey, engine->assoc.hash_items);
     return 1;
 }
 
 void assoc_delete(struct default_engine *engine, uint32_t hash, const char *key, const size_t nkey) {
-    hash_item **before = _hashitem_before(engine, hash, key, nkey);
+    bool deleted;
 
-    if (*before) {
-        hash_item *nxt;
+    item_seq_write_begin(engine, hash);
+    if (engine->config.tagged_assoc) {
+        deleted = tagged_delete(engine, hash, key, nkey);
+    } else {
+        deleted = chained_delete(engine, hash, key, nkey);
+    }
+    item_seq_write_end(engine, hash);
+
+    if (deleted) {
+        mc_mutex_enter(&engine->assoc.lock, &engine->lock_stats.assoc);
         engine->assoc.hash_items--;
+        assoc_schedule_resize(engine);
+        cb_mutex_exit(&engine->assoc.lock);
         /* The DTrace probe cannot be triggered as the last instruction
          * due to possible tail-optimization by the compiler
          */
         MEMCACHED_ASSOC_DELETE(key, nkey, engine->assoc.hash_items);
-        nxt = (*before)->h_next;
-        (*before)->h_next = 0;   /* probably pointless, but whatever. */
-        *before = nxt;
         return;
     }
     /* Note:  we never actually get here.  the callers don't delete things
        they can't find. */
-    cb_assert(*before != 0);
+    cb_assert(deleted);
 }
 
 
 
-#define DEFAULT_HASH_BULK_MOVE 1
-int hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
+/*
+ * Move all of the buckets with index n in the smaller table over to the
+ * primary table. In the larger table those are the buckets n,
+ * n + hashsize(smaller), n + 2 * hashsize(smaller) and so on, and all of
+ * their keys share the item lock for n (we never have more item locks than
+ * buckets in the smallest table), so we only need that lock while moving
+ * them. Readers holding the lock for some other bucket may look at
+ * expand_bucket, but the answer only matters to them for their own bucket
+ * (which can't move while they hold its lock).
+ */
+static void assoc_move_next_bucket(struct default_engine *engine) {
+    unsigned int bucket = engine->assoc.expand_bucket;
+    unsigned int step = hashsize(assoc_move_power(engine));
+    unsigned int ii;
 
-static void assoc_maintenance_thread(void *arg) {
-    struct default_engine *engine = arg;
-    bool done = false;
-    do {
-        int ii;
-        cb_mutex_enter(&engine->cache_lock);
+    item_lock(engine, bucket);
+    item_seq_write_begin(engine, bucket);
+    for (ii = bucket; ii < hashsize(engine->assoc.old_hashpower); ii += step) {
+        if (engine->config.tagged_assoc) {
+            tagged_move_bucket(engine, ii);
+        } else {
+            chained_move_bucket(engine, ii);
+        }
+    }
+    engine->assoc.expand_bucket++;
+    item_seq_write_end(engine, bucket);
+    item_unlock(engine, bucket);
+}
+
+/*
+ * Resize the table one step in the direction of hashpower, moving as many
+ * buckets as we can within hash_move_budget before we yield the CPU.
+ */
+static void assoc_resize_step(struct default_engine *engine,
+                              unsigned int hashpower) {
+    hrtime_t budget = (hrtime_t)engine->config.hash_move_budget * 1000;
+    void *table;
+    bool grow = hashpower > engine->assoc.hashpower;
+    unsigned int nbuckets;
+
+    table = calloc(hashsize(hashpower), assoc_bucket_size(engine));
+    item_lock_all(engine);
+    if (!assoc_resize(engine, table, hashpower)) {
+        item_unlock_all(engine);
+        return;
+    }
+    item_unlock_all(engine);
 
-        for (ii = 0; ii < hash_bulk_move && engine->assoc.expanding; ++ii) {
-            hash_item *it, *next;
-            int bucket;
+    nbuckets = hashsize(assoc_move_power(engine));
+    while (engine->assoc.expand_bucket < nbuckets) {
+        hrtime_t start = gethrtime();
+        do {
+            assoc_move_next_bucket(engine);
+        } while (engine->assoc.expand_bucket < nbuckets &&
+                 gethrtime() - start < budget);
 
-            for (it = engine->assoc.old_hashtable[engine->assoc.expand_bucket];
-                 NULL != it; it = next) {
-                next = it->h_next;
+        if (engine->assoc.expand_bucket < nbuckets) {
+#ifdef WIN32
+            Sleep(0);
+#else
+            usleep(ASSOC_YIELD_TIME);
+#endif
+        }
+    }
 
-                bucket = engine->server.core->hash(item_get_key(it), it->nkey, 0)
-                    & hashmask(engine->assoc.hashpower);
-                it->h_next = engine->assoc.primary_hashtable[bucket];
-                engine->assoc.primary_hashtable[bucket] = it;
-            }
+    item_lock_all(engine);
+    engine->assoc.expanding = false;
+    table = engine->assoc.old_hashtable;
+    engine->assoc.old_hashtable = NULL;
+    item_unlock_all(engine);
 
-            engine->assoc.old_hashtable[engine->assoc.expand_bucket] = NULL;
-            engine->assoc.expand_bucket++;
-            if (engine->assoc.expand_bucket == hashsize(engine->assoc.hashpower - 1)) {
-                engine->assoc.expanding = false;
-                free(engine->assoc.old_hashtable);
-                if (engine->config.verbose > 1) {
-                    EXTENSION_LOGGER_DESCRIPTOR *logger;
-                    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-                    logger->log(EXTENSION_LOG_INFO, NULL,
-                                "Hash table expansion done\n");
-                }
-            }
+    /* Lookups without the lock may still be looking at it */
+    item_epoch_synchronize(engine);
+    free(table);
+
+    mc_mutex_enter(&engine->assoc.lock, &engine->lock_stats.assoc);
+    if (grow) {
+        engine->assoc.expansions++;
+    } else {
+        engine->assoc.shrinks++;
+    }
+    cb_mutex_exit(&engine->assoc.lock);
+
+    if (engine->config.verbose > 1) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_INFO, NULL,
+                    "Hash table %s done (hashpower %u)\n",
+                    grow ? "expansion" : "shrinking", hashpower);
+    }
+}
+
+/*
+ * Keep resizing the table (one power of two at a time) until the load
+ * factor is back in range
+ */
+static ENGINE_ERROR_CODE assoc_maintenance_task(void *arg) {
+    assoc_maintenance_thread(arg);
+    return ENGINE_SUCCESS;
+}
+
+static void assoc_maintenance_thread(void *arg) {
+    struct default_engine *engine = arg;
+    unsigned int hashpower;
+
+    /* Only this thread changes hashpower, so we can read it without locks */
+    while (true) {
+        mc_mutex_enter(&engine->assoc.lock, &engine->lock_stats.assoc);
+        hashpower = assoc_target_hashpower(engine);
+        if (hashpower == engine->assoc.hashpower) {
+            engine->assoc.expand_scheduled = false;
+            cb_mutex_exit(&engine->assoc.lock);
+            return;
         }
-        if (!engine->assoc.expanding) {
-            done = true;
+        cb_mutex_exit(&engine->assoc.lock);
+
+        assoc_resize_step(engine, hashpower);
+        if (engine->assoc.hashpower != hashpower) {
+            /* Couldn't allocate the new table; try again later */
+            mc_mutex_enter(&engine->assoc.lock, &engine->lock_stats.assoc);
+            engine->assoc.expand_scheduled = false;
+            cb_mutex_exit(&engine->assoc.lock);
+            return;
         }
-        cb_mutex_exit(&engine->cache_lock);
-    } while (!done);
+    }
+}
+
+void assoc_stats(struct default_engine *engine,
+                 ADD_STAT add_stat, const void *cookie) {
+    char val[128];
+    int len;
+    uint64_t bytes;
+
+    mc_mutex_enter(&engine->assoc.lock, &engine->lock_stats.assoc);
+    bytes = (uint64_t)hashsize(engine->assoc.hashpower) * assoc_bucket_size(engine);
+    if (engine->assoc.expanding) {
+        bytes += (uint64_t)hashsize(engine->assoc.old_hashpower) *
+            assoc_bucket_size(engine);
+    }
+    len = sprintf(val, "%u", engine->assoc.hashpower);
+    add_stat("hash_power_level", 16, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, bytes);
+    add_stat("hash_bytes", 10, val, len, cookie);
+    len = sprintf(val, "%u", engine->assoc.hash_items);
+    add_stat("hash_items", 10, val, len, cookie);
+    len = sprintf(val, "%d",
+                  engine->assoc.expanding &&
+                  engine->assoc.hashpower > engine->assoc.old_hashpower);
+    add_stat("hash_is_expanding", 17, val, len, cookie);
+    len = sprintf(val, "%d",
+                  engine->assoc.expanding &&
+                  engine->assoc.hashpower < engine->assoc.old_hashpower);
+    add_stat("hash_is_shrinking", 17, val, len, cookie);
+    if (engine->assoc.expanding) {
+        len = sprintf(val, "%u", engine->assoc.expand_bucket);
+        add_stat("hash_moved_buckets", 18, val, len, cookie);
+        len = sprintf(val, "%u", hashsize(assoc_move_power(engine)));
+        add_stat("hash_total_buckets", 18, val, len, cookie);
+    }
+    len = sprintf(val, "%"PRIu64, engine->assoc.expansions);
+    add_stat("hash_expansions", 15, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, engine->assoc.shrinks);
+    add_stat("hash_shrinks", 12, val, len, cookie);
+    cb_mutex_exit(&engine->assoc.lock);
 }
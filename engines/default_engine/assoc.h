@@ -1,31 +1,68 @@
 #ifndef ASSOC_H
 #define ASSOC_H
 
+/* Number of items in each bucket of the tagged table */
+#define ASSOC_BUCKET_SLOTS 7
+
+/*
+ * A bucket in the tagged table (used when tagged_assoc is set). Slots with
+ * a 0 tag are empty, and the last tag is set when there are more items
+ * chained off the item in the last slot. Sized to fit in a cache line.
+ */
+struct assoc_bucket {
+   uint8_t tags[ASSOC_BUCKET_SLOTS + 1];
+   hash_item *slots[ASSOC_BUCKET_SLOTS];
+};
+
 struct assoc {
    /* how many powers of 2's worth of buckets we use */
    unsigned int hashpower;
 
+   /* We never shrink the table below its initial size */
+   unsigned int min_hashpower;
 
-   /* Main hash table. This is where we look except during expansion. */
-   hash_item** primary_hashtable;
+   /* The size of the old table while we're resizing */
+   unsigned int old_hashpower;
+
+
+   /*
+    * Main hash table. This is where we look except during expansion.
+    * Either an array of hash_item pointers or of struct assoc_bucket,
+    * depending on config.tagged_assoc.
+    */
+   void *primary_hashtable;
 
    /*
     * Previous hash table. During expansion, we look here for keys that haven't
     * been moved over to the primary yet.
     */
-   hash_item** old_hashtable;
+   void *old_hashtable;
 
    /* Number of items in the hash table. */
    unsigned int hash_items;
 
-   /* Flag: Are we in the middle of expanding now? */
+   /* Flag: Are we in the middle of expanding (or shrinking) now? */
    bool expanding;
 
    /*
     * During expansion we migrate values with bucket granularity; this is how
-    * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
+    * far we've gotten so far. Ranges from 0 .. hashsize(n) - 1, where n is
+    * the smaller of hashpower and old_hashpower.
     */
    unsigned int expand_bucket;
+
+   /* Flag: Has the maintenance thread been started (but not finished)? */
+   bool expand_scheduled;
+
+   /* Number of times the table has been grown and shrunk */
+   uint64_t expansions;
+   uint64_t shrinks;
+
+   /*
+    * Protects hash_items, expand_scheduled and the counters. The primary
+    * and old tables are protected by the item locks (see items.c)
+    */
+   cb_mutex_t lock;
 };
 
 /* associative array */
@@ -33,10 +70,28 @@ ENGINE_ERROR_CODE assoc_init(struct default_engine *engine);
 void assoc_destroy(struct default_engine *engine);
 hash_item *assoc_find(struct default_engine *engine, uint32_t hash,
                       const char *key, const size_t nkey);
+/* Look the key up without the item lock: returns false unless nothing
+ * changed the bucket since item_seq_read returned seq (see lockless_get),
+ * and the caller must be in an epoch */
+bool assoc_find_lockless(struct default_engine *engine, uint32_t hash,
+                         const char *key, const size_t nkey, uint32_t seq,
+                         hash_item **found);
+/* Start loading the bucket for hash into the cache (a hint only; it
+ * doesn't need the item lock) */
+void assoc_prefetch(struct default_engine *engine, uint32_t hash);
+/* Pick one of the items in the bucket for hash (NULL if it is empty),
+ * with the item lock for hash held */
+hash_item *assoc_random(struct default_engine *engine, uint32_t hash,
+                        uint32_t nth);
+/* The number of hash values to look at to see all of the buckets (of
+ * both tables while we're resizing), with an item lock held */
+uint32_t assoc_buckets(struct default_engine *engine);
 int assoc_insert(struct default_engine *engine, uint32_t hash,
                  hash_item *item);
 void assoc_delete(struct default_engine *engine, uint32_t hash,
                   const char *key, const size_t nkey);
+void assoc_stats(struct default_engine *engine,
+                 ADD_STAT add_stat, const void *cookie);
 int start_assoc_maintenance_thread(struct default_engine *engine);
 void stop_assoc_maintenance_thread(struct default_engine *engine);
 
@@ -0,0 +1,985 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "default_engine.h"
+
+/*
+ * Locking: dcp.lock nests inside the item locks (the changes are logged
+ * with the item lock held, so the log is in seqno order). We never hold
+ * it while walking the items, calling the producers or calling back into
+ * the server: the worker threads call us with their thread lock held, and
+ * notify_io_complete takes that lock.
+ */
+
+/* The most messages (or skipped changes) we do per step */
+#define DCP_STEP_MAX 64
+
+static struct dcp_change *dcp_log_entry(struct dcp *dcp, uint64_t pos) {
+    return &dcp->log[pos % dcp->log_size];
+}
+
+/* Has the log wrapped past pos? Caller must hold the lock */
+static bool dcp_log_lost(const struct dcp *dcp, uint64_t pos) {
+    return dcp->log_head - pos > dcp->log_size;
+}
+
+static bool dcp_has_stream(const struct dcp_connection *conn,
+                           uint16_t vbucket) {
+    const struct dcp_stream *stream;
+    for (stream = conn->streams; stream != NULL; stream = stream->next) {
+        if (stream->vbucket == vbucket) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Mark the paused connections streaming the vbucket for the notifier */
+static void dcp_wakeup(struct dcp *dcp, uint16_t vbucket) {
+    struct dcp_connection *conn;
+    bool signal = false;
+
+    for (conn = dcp->connections; conn != NULL; conn = conn->next) {
+        if (conn->paused && !conn->wakeup && !conn->dead &&
+            dcp_has_stream(conn, vbucket)) {
+            conn->wakeup = true;
+            signal = true;
+        }
+    }
+    if (signal) {
+        cb_cond_signal(&dcp->cond);
+    }
+}
+
+/* Caller must hold the lock */
+static void dcp_log_append(struct dcp *dcp, const hash_item *it,
+                           uint8_t type, uint16_t vbucket, uint64_t seqno) {
+    struct dcp_change *change = dcp_log_entry(dcp, dcp->log_head++);
+
+    change->seqno = seqno;
+    change->cas = item_get_cas(it);
+    change->vbucket = vbucket;
+    change->type = type;
+    if (it->nkey <= DCP_KEY_MAX) {
+        change->nkey = (uint8_t)it->nkey;
+        memcpy(change->key, item_get_key(it), it->nkey);
+    } else {
+        /* Too long for the protocol; the streams skip it */
+        change->nkey = 0;
+    }
+    dcp_wakeup(dcp, vbucket);
+}
+
+void dcp_log_mutation(struct default_engine *engine, hash_item *it) {
+    struct dcp *dcp = &engine->dcp;
+    uint16_t vbucket = item_get_vbucket(it);
+    uint64_t seqno;
+
+    cb_mutex_enter(&dcp->lock);
+    seqno = ++dcp->seqnos[vbucket];
+    item_set_seqno(it, vbucket, seqno);
+    dcp_log_append(dcp, it, DCP_CHANGE_MUTATION, vbucket, seqno);
+    dcp->stats.mutations++;
+    cb_mutex_exit(&dcp->lock);
+}
+
+void dcp_log_removal(struct default_engine *engine, const hash_item *it,
+                     uint8_t type) {
+    struct dcp *dcp = &engine->dcp;
+    uint16_t vbucket = item_get_vbucket(it);
+
+    cb_mutex_enter(&dcp->lock);
+    dcp_log_append(dcp, it, type, vbucket, ++dcp->seqnos[vbucket]);
+    if (type == DCP_CHANGE_DELETION) {
+        dcp->stats.deletions++;
+    } else {
+        dcp->stats.expirations++;
+    }
+    cb_mutex_exit(&dcp->lock);
+}
+
+/*
+ * Set the stream up for a snapshot of the cache up to the high seqno of
+ * its vbucket, followed by the log from here. Caller must hold the lock.
+ */
+static void dcp_stream_snapshot(struct dcp *dcp, struct dcp_stream *stream) {
+    stream->snap_end = dcp->seqnos[stream->vbucket];
+    if (stream->snap_end > stream->end_seqno) {
+        stream->snap_end = stream->end_seqno;
+    }
+    stream->log_pos = dcp->log_head;
+    stream->marker_sent = false;
+    stream->state = DCP_STREAM_BACKFILL;
+    if (stream->snap_end > stream->last_seqno) {
+        dcp->stats.backfills++;
+    }
+}
+
+/*
+ * Pick the stream up from the log if it still has all of the changes
+ * after the start of the stream. Caller must hold the lock.
+ */
+static bool dcp_stream_resume(struct dcp *dcp, struct dcp_stream *stream) {
+    uint64_t pos = 0;
+
+    stream->state = DCP_STREAM_MEMORY;
+    stream->marker_sent = false;
+    if (dcp->seqnos[stream->vbucket] == stream->last_seqno) {
+        stream->log_pos = dcp->log_head;
+        return true;
+    }
+
+    if (dcp->log_head > dcp->log_size) {
+        pos = dcp->log_head - dcp->log_size;
+    }
+    for (; pos < dcp->log_head; ++pos) {
+        const struct dcp_change *change = dcp_log_entry(dcp, pos);
+        if (change->vbucket == stream->vbucket &&
+            change->seqno > stream->last_seqno) {
+            if (change->seqno != stream->last_seqno + 1) {
+                break;
+            }
+            stream->log_pos = pos;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Link the cursor for the backfill set up by dcp_stream_snapshot */
+static ENGINE_ERROR_CODE dcp_stream_backfill(struct default_engine *engine,
+                                             struct dcp_stream *stream) {
+    ENGINE_ERROR_CODE ret = ENGINE_KEY_ENOENT;
+
+    if (stream->snap_end > stream->last_seqno) {
+        ret = item_backfill_start(engine, &stream->cursor, stream->vbucket);
+        if (ret == ENGINE_ENOMEM) {
+            return ret;
+        }
+    }
+    if (ret == ENGINE_KEY_ENOENT) {
+        /* Nothing to walk */
+        stream->state = DCP_STREAM_MEMORY;
+        stream->last_seqno = stream->snap_end;
+    }
+    return ENGINE_SUCCESS;
+}
+
+static void dcp_stream_free(struct default_engine *engine,
+                            struct dcp_stream *stream) {
+    if (stream->it != NULL) {
+        item_release(engine, stream->it);
+    }
+    if (stream->state == DCP_STREAM_BACKFILL) {
+        item_backfill_stop(engine, &stream->cursor);
+    }
+    free(stream);
+}
+
+/* Take the stream out of the connection. Caller must hold the lock */
+static void dcp_stream_unlink(struct dcp_connection *conn,
+                              struct dcp_stream *stream) {
+    struct dcp_stream **pp = &conn->streams;
+    while (*pp != stream) {
+        pp = &(*pp)->next;
+    }
+    *pp = stream->next;
+    if (conn->current == stream) {
+        conn->current = stream->next;
+    }
+}
+
+static bool dcp_backfill_filter(const hash_item *it, void *arg) {
+    const struct dcp_stream *stream = arg;
+    uint64_t seqno;
+
+    if ((it->iflag & ITEM_LINKED) == 0 ||
+        item_get_vbucket(it) != stream->vbucket) {
+        return false;
+    }
+    seqno = item_get_seqno(it);
+    return seqno > stream->last_seqno && seqno <= stream->snap_end;
+}
+
+static ENGINE_ERROR_CODE dcp_backfill_step(struct default_engine *engine,
+                                           const void *cookie,
+                                           struct dcp_stream *stream,
+                                           struct dcp_message_producers *producers,
+                                           int *nitems) {
+    ENGINE_ERROR_CODE ret;
+
+    if (!stream->marker_sent) {
+        ret = producers->marker(cookie, stream->opaque, stream->vbucket,
+                                stream->last_seqno, stream->snap_end,
+                                DCP_MARKER_DISK);
+        if (ret == ENGINE_SUCCESS) {
+            stream->marker_sent = true;
+        }
+        return ret;
+    }
+
+    if (stream->it == NULL) {
+        stream->it = item_backfill_next(engine, &stream->cursor,
+                                        dcp_backfill_filter, stream);
+        if (stream->it == NULL) {
+            /* Done; the log picks up after the snapshot */
+            item_backfill_stop(engine, &stream->cursor);
+            stream->state = DCP_STREAM_MEMORY;
+            stream->last_seqno = stream->snap_end;
+            stream->marker_sent = false;
+            return ENGINE_SUCCESS;
+        }
+    }
+
+    ret = producers->mutation(cookie, stream->opaque, stream->it,
+                              stream->vbucket, item_get_seqno(stream->it),
+                              0, 0, NULL, 0, 0);
+    if (ret != ENGINE_E2BIG) {
+        /* The producer took over our reference (or released it) */
+        stream->it = NULL;
+    }
+    if (ret == ENGINE_SUCCESS) {
+        ++*nitems;
+    }
+    return ret;
+}
+
+/* Send a change from the log */
+static ENGINE_ERROR_CODE dcp_send_change(struct default_engine *engine,
+                                         const void *cookie,
+                                         const struct dcp_stream *stream,
+                                         const struct dcp_change *change,
+                                         struct dcp_message_producers *producers,
+                                         int *nitems) {
+    hash_item *it;
+    ENGINE_ERROR_CODE ret;
+
+    if (change->nkey == 0) {
+        return ENGINE_SUCCESS;
+    }
+
+    if (change->type == DCP_CHANGE_DELETION) {
+        return producers->deletion(cookie, stream->opaque, change->key,
+                                   change->nkey, change->cas,
+                                   stream->vbucket, change->seqno, 0,
+                                   NULL, 0);
+    } else if (change->type == DCP_CHANGE_EXPIRATION) {
+        return producers->expiration(cookie, stream->opaque, change->key,
+                                     change->nkey, change->cas,
+                                     stream->vbucket, change->seqno, 0,
+                                     NULL, 0);
+    }
+
+    it = item_get(engine, NULL, change->key, change->nkey);
+    if (it != NULL && (item_get_seqno(it) != change->seqno ||
+                       item_get_vbucket(it) != stream->vbucket)) {
+        item_release(engine, it);
+        it = NULL;
+    }
+    if (it != NULL && (it->iflag & ITEM_HDR) != 0) {
+        it = item_ext_fetch(engine, it, NULL);
+    }
+    if (it == NULL) {
+        /* Changed (or gone) since; a later change in the log covers it */
+        return ENGINE_SUCCESS;
+    }
+
+    ret = producers->mutation(cookie, stream->opaque, it, stream->vbucket,
+                              change->seqno, 0, 0, NULL, 0, 0);
+    if (ret == ENGINE_E2BIG) {
+        item_release(engine, it);
+    } else if (ret == ENGINE_SUCCESS) {
+        ++*nitems;
+    }
+    return ret;
+}
+
+static ENGINE_ERROR_CODE dcp_memory_step(struct default_engine *engine,
+                                         const void *cookie,
+                                         struct dcp_stream *stream,
+                                         struct dcp_message_producers *producers,
+                                         bool *idle, int *nitems) {
+    struct dcp *dcp = &engine->dcp;
+    struct dcp_change change;
+    uint64_t pos;
+    ENGINE_ERROR_CODE ret;
+
+    cb_mutex_enter(&dcp->lock);
+    if (dcp_log_lost(dcp, stream->log_pos)) {
+        /* We've fallen too far behind; walk the cache again */
+        dcp->stats.log_misses++;
+        dcp_stream_snapshot(dcp, stream);
+        cb_mutex_exit(&dcp->lock);
+        return dcp_stream_backfill(engine, stream);
+    }
+
+    for (pos = stream->log_pos; pos < dcp->log_head; ++pos) {
+        if (dcp_log_entry(dcp, pos)->vbucket == stream->vbucket) {
+            break;
+        }
+    }
+    stream->log_pos = pos;
+    if (pos == dcp->log_head) {
+        cb_mutex_exit(&dcp->lock);
+        *idle = true;
+        return ENGINE_SUCCESS;
+    }
+
+    if (!stream->marker_sent) {
+        /* The snapshot is whatever we've got for the vbucket right now */
+        uint64_t start = dcp_log_entry(dcp, pos)->seqno;
+        uint64_t end = start;
+        uint64_t ii;
+
+        for (ii = pos + 1; ii < dcp->log_head; ++ii) {
+            const struct dcp_change *next = dcp_log_entry(dcp, ii);
+            if (next->vbucket == stream->vbucket) {
+                end = next->seqno;
+            }
+        }
+        cb_mutex_exit(&dcp->lock);
+
+        if (end > stream->end_seqno) {
+            end = stream->end_seqno;
+        }
+        ret = producers->marker(cookie, stream->opaque, stream->vbucket,
+                                start, end, DCP_MARKER_MEMORY);
+        if (ret == ENGINE_SUCCESS) {
+            stream->marker_sent = true;
+            stream->snap_end = end;
+        }
+        return ret;
+    }
+
+    change = *dcp_log_entry(dcp, pos);
+    cb_mutex_exit(&dcp->lock);
+
+    ret = ENGINE_SUCCESS;
+    if (change.seqno > stream->end_seqno) {
+        /* Past the end of the stream */
+        change.seqno = stream->end_seqno;
+    } else if (change.seqno > stream->last_seqno) {
+        ret = dcp_send_change(engine, cookie, stream, &change, producers,
+                              nitems);
+    }
+    if (ret == ENGINE_SUCCESS) {
+        stream->log_pos = pos + 1;
+        if (change.seqno > stream->last_seqno) {
+            stream->last_seqno = change.seqno;
+        }
+        if (stream->last_seqno >= stream->snap_end) {
+            stream->marker_sent = false;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Do the next thing for the stream. Sets *idle if there is nothing to
+ * send right now, and *ended once we've sent the end of the stream.
+ */
+static ENGINE_ERROR_CODE dcp_stream_step(struct default_engine *engine,
+                                         const void *cookie,
+                                         struct dcp_stream *stream,
+                                         struct dcp_message_producers *producers,
+                                         bool *idle, bool *ended,
+                                         int *nitems) {
+    ENGINE_ERROR_CODE ret;
+
+    *idle = false;
+    *ended = false;
+    if (stream->state == DCP_STREAM_BACKFILL) {
+        return dcp_backfill_step(engine, cookie, stream, producers, nitems);
+    }
+
+    if (stream->last_seqno >= stream->end_seqno) {
+        ret = producers->stream_end(cookie, stream->opaque, stream->vbucket,
+                                    DCP_STREAM_END_OK);
+        *ended = (ret == ENGINE_SUCCESS);
+        return ret;
+    }
+    return dcp_memory_step(engine, cookie, stream, producers, idle, nitems);
+}
+
+/* Look up the (live) connection of the cookie. Caller must hold the lock */
+static struct dcp_connection *dcp_find(struct dcp *dcp, const void *cookie) {
+    struct dcp_connection *conn;
+    for (conn = dcp->connections; conn != NULL; conn = conn->next) {
+        if (conn->cookie == cookie && !conn->dead) {
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+ENGINE_ERROR_CODE dcp_producer_open(struct default_engine *engine,
+                                    const void *cookie, uint32_t opaque,
+                                    uint32_t flags) {
+    struct dcp *dcp = &engine->dcp;
+    struct dcp_connection *conn;
+
+    /* We don't do notifiers */
+    if ((flags & DCP_OPEN_NOTIFIER) != 0) {
+        return ENGINE_ENOTSUP;
+    }
+    if (engine->server.cookie->get_engine_specific(cookie) != NULL) {
+        return ENGINE_KEY_EEXISTS;
+    }
+    if ((conn = calloc(1, sizeof(*conn))) == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    if ((flags & DCP_OPEN_PRODUCER) == 0 &&
+        (conn->consumer = calloc(1, sizeof(*conn->consumer))) == NULL) {
+        free(conn);
+        return ENGINE_ENOMEM;
+    }
+    conn->cookie = cookie;
+    conn->opaque = opaque;
+
+    /* Keep the connection around until the notifier is done with it */
+    engine->server.cookie->reserve(cookie);
+    engine->server.cookie->store_engine_specific(cookie, conn);
+
+    cb_mutex_enter(&dcp->lock);
+    conn->next = dcp->connections;
+    dcp->connections = conn;
+    cb_mutex_exit(&dcp->lock);
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE dcp_producer_stream_req(struct default_engine *engine,
+                                          const void *cookie,
+                                          uint32_t flags,
+                                          uint32_t opaque,
+                                          uint16_t vbucket,
+                                          uint64_t start_seqno,
+                                          uint64_t end_seqno,
+                                          uint64_t vbucket_uuid,
+                                          uint64_t *rollback_seqno,
+                                          dcp_add_failover_log callback) {
+    struct dcp *dcp = &engine->dcp;
+    struct dcp_connection *conn;
+    struct dcp_stream *stream;
+    vbucket_failover_t entry;
+    ENGINE_ERROR_CODE ret;
+
+    if (start_seqno > end_seqno) {
+        return ENGINE_ERANGE;
+    }
+    if ((stream = calloc(1, sizeof(*stream))) == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    stream->opaque = opaque;
+    stream->flags = flags;
+    stream->vbucket = vbucket;
+    stream->last_seqno = start_seqno;
+    stream->end_seqno = end_seqno;
+
+    cb_mutex_enter(&dcp->lock);
+    conn = dcp_find(dcp, cookie);
+    if (conn == NULL || conn->consumer != NULL) {
+        ret = ENGINE_EINVAL;
+    } else if (dcp_has_stream(conn, vbucket)) {
+        ret = ENGINE_KEY_EEXISTS;
+    } else if (start_seqno != 0 && (vbucket_uuid != dcp->uuid ||
+                                    start_seqno > dcp->seqnos[vbucket])) {
+        /* The consumer has seen a history we don't know about */
+        *rollback_seqno = 0;
+        ret = ENGINE_ROLLBACK;
+    } else {
+        if (!dcp_stream_resume(dcp, stream)) {
+            dcp_stream_snapshot(dcp, stream);
+        }
+        ret = ENGINE_SUCCESS;
+    }
+    entry.uuid = dcp->uuid;
+    entry.seqno = 0;
+    cb_mutex_exit(&dcp->lock);
+
+    if (ret == ENGINE_SUCCESS && stream->state == DCP_STREAM_BACKFILL) {
+        ret = dcp_stream_backfill(engine, stream);
+    }
+    if (ret == ENGINE_SUCCESS) {
+        ret = callback(&entry, 1, cookie);
+    }
+    if (ret != ENGINE_SUCCESS) {
+        dcp_stream_free(engine, stream);
+        return ret;
+    }
+
+    /* The connection is only ever changed by its own worker (or us) */
+    cb_mutex_enter(&dcp->lock);
+    stream->next = conn->streams;
+    conn->streams = stream;
+    dcp->stats.streams_opened++;
+    cb_mutex_exit(&dcp->lock);
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE dcp_producer_close_stream(struct default_engine *engine,
+                                            const void *cookie,
+                                            uint16_t vbucket) {
+    struct dcp *dcp = &engine->dcp;
+    struct dcp_connection *conn;
+    struct dcp_stream *stream = NULL;
+
+    cb_mutex_enter(&dcp->lock);
+    if ((conn = dcp_find(dcp, cookie)) != NULL) {
+        for (stream = conn->streams; stream != NULL; stream = stream->next) {
+            if (stream->vbucket == vbucket) {
+                dcp_stream_unlink(conn, stream);
+                break;
+            }
+        }
+    }
+    cb_mutex_exit(&dcp->lock);
+
+    if (stream == NULL) {
+        return ENGINE_KEY_ENOENT;
+    }
+    dcp_stream_free(engine, stream);
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE dcp_producer_step(struct default_engine *engine,
+                                    const void *cookie,
+                                    struct dcp_message_producers *producers) {
+    struct dcp *dcp = &engine->dcp;
+    struct dcp_connection *conn;
+    struct dcp_stream *stream;
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    uint64_t head, pos;
+    int nstreams = 0;
+    int nidle = 0;
+    int ndone = 0;
+    int nitems = 0;
+
+    cb_mutex_enter(&dcp->lock);
+    conn = dcp_find(dcp, cookie);
+    if (conn == NULL) {
+        cb_mutex_exit(&dcp->lock);
+        return ENGINE_DISCONNECT;
+    }
+    conn->paused = false;
+    head = dcp->log_head;
+    for (stream = conn->streams; stream != NULL; stream = stream->next) {
+        ++nstreams;
+    }
+    cb_mutex_exit(&dcp->lock);
+
+    /* Go round the streams until they've all got nothing to send */
+    while (nidle < nstreams && ndone < DCP_STEP_MAX) {
+        bool idle, ended;
+
+        stream = (conn->current != NULL) ? conn->current : conn->streams;
+        ret = dcp_stream_step(engine, cookie, stream, producers, &idle,
+                              &ended, &nitems);
+        if (ret != ENGINE_SUCCESS) {
+            break;
+        }
+        conn->current = stream->next;
+        if (ended) {
+            cb_mutex_enter(&dcp->lock);
+            dcp_stream_unlink(conn, stream);
+            cb_mutex_exit(&dcp->lock);
+            dcp_stream_free(engine, stream);
+            --nstreams;
+        }
+        if (idle) {
+            ++nidle;
+        } else {
+            nidle = 0;
+            ++ndone;
+        }
+    }
+
+    cb_mutex_enter(&dcp->lock);
+    dcp->stats.items_sent += nitems;
+    if (ret == ENGINE_E2BIG && ndone > 0) {
+        /* The buffer is full */
+        ret = ENGINE_SUCCESS;
+    }
+    if (ret == ENGINE_SUCCESS) {
+        ret = ENGINE_WANT_MORE;
+        if (ndone == 0) {
+            /* Unless something came in while we looked, wait for it */
+            for (pos = head; pos < dcp->log_head; ++pos) {
+                if (dcp_log_lost(dcp, pos) ||
+                    dcp_has_stream(conn, dcp_log_entry(dcp, pos)->vbucket)) {
+                    break;
+                }
+            }
+            if (pos == dcp->log_head) {
+                conn->paused = true;
+                ret = ENGINE_SUCCESS;
+            }
+        }
+    }
+    cb_mutex_exit(&dcp->lock);
+    return ret;
+}
+
+/* Get the consumer of the connection (only its own worker ever uses it) */
+static struct dcp_consumer *dcp_get_consumer(struct default_engine *engine,
+                                             const void *cookie) {
+    struct dcp *dcp = &engine->dcp;
+    struct dcp_connection *conn;
+
+    cb_mutex_enter(&dcp->lock);
+    conn = dcp_find(dcp, cookie);
+    cb_mutex_exit(&dcp->lock);
+    return conn != NULL ? conn->consumer : NULL;
+}
+
+static void dcp_consumer_store(struct default_engine *engine,
+                               const void *cookie,
+                               struct dcp_consumer *consumer) {
+    struct dcp *dcp = &engine->dcp;
+    uint64_t dropped = 0;
+    int ii;
+
+    if (consumer->nitems == 0) {
+        return;
+    }
+    item_store_multi(engine, consumer->reqs, consumer->items,
+                     consumer->nitems, consumer->cas, consumer->status,
+                     cookie);
+    for (ii = 0; ii < consumer->nitems; ++ii) {
+        if (consumer->status[ii] != ENGINE_SUCCESS) {
+            ++dropped;
+        }
+        item_release(engine, consumer->items[ii]);
+        consumer->items[ii] = NULL;
+    }
+
+    cb_mutex_enter(&dcp->lock);
+    dcp->stats.consumer_mutations += consumer->nitems - dropped;
+    dcp->stats.consumer_dropped += dropped;
+    dcp->stats.consumer_batches++;
+    cb_mutex_exit(&dcp->lock);
+    consumer->nitems = 0;
+}
+
+static struct dcp_consumer_snapshot *dcp_consumer_snapshot(struct dcp_consumer *consumer,
+                                                           uint16_t vbucket) {
+    int ii;
+    for (ii = 0; ii < consumer->nsnapshots; ++ii) {
+        if (consumer->snapshots[ii].vbucket == vbucket) {
+            return &consumer->snapshots[ii];
+        }
+    }
+    return NULL;
+}
+
+ENGINE_ERROR_CODE dcp_consumer_marker(struct default_engine *engine,
+                                      const void *cookie, uint16_t vbucket,
+                                      uint64_t end_seqno) {
+    struct dcp_consumer *consumer = dcp_get_consumer(engine, cookie);
+    struct dcp_consumer_snapshot *snapshot;
+
+    if (consumer == NULL) {
+        return ENGINE_EINVAL;
+    }
+    dcp_consumer_store(engine, cookie, consumer);
+
+    if ((snapshot = dcp_consumer_snapshot(consumer, vbucket)) == NULL) {
+        /* A connection only streams a few vbuckets */
+        void *ptr = realloc(consumer->snapshots, (consumer->nsnapshots + 1) *
+                            sizeof(*consumer->snapshots));
+        if (ptr == NULL) {
+            return ENGINE_ENOMEM;
+        }
+        consumer->snapshots = ptr;
+        snapshot = &consumer->snapshots[consumer->nsnapshots++];
+        snapshot->vbucket = vbucket;
+    }
+    snapshot->end_seqno = end_seqno;
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE dcp_consumer_mutation(struct default_engine *engine,
+                                        const void *cookie,
+                                        const void *key, uint16_t nkey,
+                                        const void *value, uint32_t nvalue,
+                                        uint16_t vbucket, uint32_t flags,
+                                        uint8_t datatype, uint64_t by_seqno,
+                                        uint32_t expiration) {
+    struct dcp_consumer *consumer = dcp_get_consumer(engine, cookie);
+    struct dcp_consumer_snapshot *snapshot;
+    hash_item *it;
+
+    if (consumer == NULL) {
+        return ENGINE_EINVAL;
+    }
+
+    /* The flags are kept the way the clients sent them */
+    it = item_alloc(engine, key, nkey, htonl(flags),
+                    engine->server.core->realtime(expiration), nvalue,
+                    cookie, datatype);
+    if (it == NULL) {
+        /* Like any store into a memcached bucket, this one may fail */
+        cb_mutex_enter(&engine->dcp.lock);
+        engine->dcp.stats.consumer_dropped++;
+        cb_mutex_exit(&engine->dcp.lock);
+        return ENGINE_SUCCESS;
+    }
+    item_write_value(engine, it, 0, value, nvalue);
+    item_set_seqno(it, vbucket, 0);
+
+    consumer->reqs[consumer->nitems].operation = OPERATION_SET;
+    consumer->reqs[consumer->nitems].vbucket = vbucket;
+    consumer->items[consumer->nitems++] = it;
+
+    snapshot = dcp_consumer_snapshot(consumer, vbucket);
+    if (consumer->nitems == DCP_CONSUMER_BATCH || snapshot == NULL ||
+        by_seqno >= snapshot->end_seqno) {
+        dcp_consumer_store(engine, cookie, consumer);
+    }
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE dcp_consumer_deletion(struct default_engine *engine,
+                                        const void *cookie,
+                                        const void *key, uint16_t nkey) {
+    struct dcp_consumer *consumer = dcp_get_consumer(engine, cookie);
+    hash_item *it;
+
+    if (consumer == NULL) {
+        return ENGINE_EINVAL;
+    }
+    /* The mutations before it go in first */
+    dcp_consumer_store(engine, cookie, consumer);
+
+    if ((it = item_get(engine, NULL, key, nkey)) != NULL) {
+        item_delete(engine, it);
+        item_release(engine, it);
+    }
+    cb_mutex_enter(&engine->dcp.lock);
+    engine->dcp.stats.consumer_deletions++;
+    cb_mutex_exit(&engine->dcp.lock);
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE dcp_consumer_flush(struct default_engine *engine,
+                                     const void *cookie) {
+    struct dcp_consumer *consumer = dcp_get_consumer(engine, cookie);
+
+    if (consumer == NULL) {
+        return ENGINE_EINVAL;
+    }
+    dcp_consumer_store(engine, cookie, consumer);
+    return ENGINE_SUCCESS;
+}
+
+static void dcp_consumer_free(struct default_engine *engine,
+                              struct dcp_consumer *consumer) {
+    int ii;
+
+    if (consumer == NULL) {
+        return;
+    }
+    for (ii = 0; ii < consumer->nitems; ++ii) {
+        item_release(engine, consumer->items[ii]);
+    }
+    free(consumer->snapshots);
+    free(consumer);
+}
+
+void dcp_disconnect(struct default_engine *engine, const void *cookie) {
+    struct dcp *dcp = &engine->dcp;
+    struct dcp_connection *conn;
+    struct dcp_stream *streams = NULL;
+    struct dcp_consumer *consumer;
+
+    /* What the producer sent us before it went away still goes in */
+    if ((consumer = dcp_get_consumer(engine, cookie)) != NULL) {
+        dcp_consumer_store(engine, cookie, consumer);
+    }
+
+    cb_mutex_enter(&dcp->lock);
+    if ((conn = dcp_find(dcp, cookie)) != NULL) {
+        /* Before the notifier gets to release the cookie */
+        engine->server.cookie->store_engine_specific(cookie, NULL);
+        conn->dead = true;
+        streams = conn->streams;
+        conn->streams = conn->current = NULL;
+        cb_cond_signal(&dcp->cond);
+    }
+    cb_mutex_exit(&dcp->lock);
+
+    while (streams != NULL) {
+        struct dcp_stream *next = streams->next;
+        dcp_stream_free(engine, streams);
+        streams = next;
+    }
+}
+
+/*
+ * Notify the connections with something new to send, and release the
+ * ones that are gone (neither can be done by the worker threads)
+ */
+static void dcp_notifier_main(void *arg) {
+    struct default_engine *engine = arg;
+    struct dcp *dcp = &engine->dcp;
+
+    cb_mutex_enter(&dcp->lock);
+    while (!dcp->shutdown) {
+        struct dcp_connection **pp = &dcp->connections;
+        struct dcp_connection *conn;
+        const void *cookie;
+
+        while (*pp != NULL && !(*pp)->dead && !(*pp)->wakeup) {
+            pp = &(*pp)->next;
+        }
+        if ((conn = *pp) == NULL) {
+            cb_cond_wait(&dcp->cond, &dcp->lock);
+            continue;
+        }
+
+        cookie = conn->cookie;
+        if (conn->dead) {
+            *pp = conn->next;
+            cb_mutex_exit(&dcp->lock);
+            engine->server.cookie->release(cookie);
+            dcp_consumer_free(engine, conn->consumer);
+            free(conn);
+        } else {
+            conn->wakeup = false;
+            conn->paused = false;
+            cb_mutex_exit(&dcp->lock);
+            /* The reservation keeps the cookie around (we release it) */
+            engine->server.cookie->notify_io_complete(cookie, ENGINE_SUCCESS);
+        }
+        cb_mutex_enter(&dcp->lock);
+    }
+    dcp->running = false;
+    cb_mutex_exit(&dcp->lock);
+}
+
+ENGINE_ERROR_CODE dcp_init(struct default_engine *engine) {
+    struct dcp *dcp = &engine->dcp;
+
+    if (engine->config.dcp_log_size == 0) {
+        return ENGINE_EINVAL;
+    }
+    dcp->seqnos = calloc(NUM_VBUCKETS, sizeof(*dcp->seqnos));
+    dcp->log = calloc(engine->config.dcp_log_size, sizeof(*dcp->log));
+    if (dcp->seqnos == NULL || dcp->log == NULL) {
+        dcp_destroy(engine);
+        return ENGINE_ENOMEM;
+    }
+    dcp->log_size = engine->config.dcp_log_size;
+
+    /* A new history every time we start (we don't keep the seqnos) */
+    dcp->uuid = ((uint64_t)time(NULL) << 32) ^ (uint64_t)gethrtime() ^
+        (uint64_t)(uintptr_t)engine;
+    if (dcp->uuid == 0) {
+        dcp->uuid = 1;
+    }
+
+    dcp->shutdown = false;
+    dcp->running = true;
+    if (cb_create_thread(&dcp->tid, dcp_notifier_main, engine, 0) != 0) {
+        dcp->running = false;
+        dcp_destroy(engine);
+        return ENGINE_FAILED;
+    }
+    return ENGINE_SUCCESS;
+}
+
+void dcp_destroy(struct default_engine *engine) {
+    struct dcp *dcp = &engine->dcp;
+    bool running;
+
+    cb_mutex_enter(&dcp->lock);
+    running = dcp->running;
+    dcp->shutdown = true;
+    cb_cond_signal(&dcp->cond);
+    cb_mutex_exit(&dcp->lock);
+
+    if (running) {
+        cb_join_thread(dcp->tid);
+    }
+
+    while (dcp->connections != NULL) {
+        struct dcp_connection *conn = dcp->connections;
+        dcp->connections = conn->next;
+        while (conn->streams != NULL) {
+            struct dcp_stream *next = conn->streams->next;
+            dcp_stream_free(engine, conn->streams);
+            conn->streams = next;
+        }
+        if (conn->dead) {
+            engine->server.cookie->release(conn->cookie);
+        }
+        dcp_consumer_free(engine, conn->consumer);
+        free(conn);
+    }
+
+    free(dcp->seqnos);
+    dcp->seqnos = NULL;
+    free(dcp->log);
+    dcp->log = NULL;
+    dcp->log_size = 0;
+}
+
+void dcp_stats(struct default_engine *engine, ADD_STAT add_stats,
+               const void *c) {
+    struct dcp *dcp = &engine->dcp;
+    struct dcp_connection *conn;
+    const struct dcp_stream *stream;
+    unsigned int nconns = 0;
+    unsigned int nconsumers = 0;
+    unsigned int nstreams = 0;
+
+    cb_mutex_enter(&dcp->lock);
+    for (conn = dcp->connections; conn != NULL; conn = conn->next) {
+        if (!conn->dead) {
+            ++nconns;
+            if (conn->consumer != NULL) {
+                ++nconsumers;
+            }
+            for (stream = conn->streams; stream != NULL;
+                 stream = stream->next) {
+                ++nstreams;
+            }
+        }
+    }
+    add_statistics(c, add_stats, NULL, -1, "dcp_connections", "%u", nconns);
+    add_statistics(c, add_stats, NULL, -1, "dcp_consumers", "%u",
+                   nconsumers);
+    add_statistics(c, add_stats, NULL, -1, "dcp_streams", "%u", nstreams);
+    add_statistics(c, add_stats, NULL, -1, "dcp_uuid", "%"PRIu64, dcp->uuid);
+    add_statistics(c, add_stats, NULL, -1, "dcp_log_size", "%"PRIu64,
+                   (uint64_t)dcp->log_size);
+    add_statistics(c, add_stats, NULL, -1, "dcp_log_changes", "%"PRIu64,
+                   dcp->log_head);
+    add_statistics(c, add_stats, NULL, -1, "dcp_mutations", "%"PRIu64,
+                   dcp->stats.mutations);
+    add_statistics(c, add_stats, NULL, -1, "dcp_deletions", "%"PRIu64,
+                   dcp->stats.deletions);
+    add_statistics(c, add_stats, NULL, -1, "dcp_expirations", "%"PRIu64,
+                   dcp->stats.expirations);
+    add_statistics(c, add_stats, NULL, -1, "dcp_streams_opened", "%"PRIu64,
+                   dcp->stats.streams_opened);
+    add_statistics(c, add_stats, NULL, -1, "dcp_backfills", "%"PRIu64,
+                   dcp->stats.backfills);
+    add_statistics(c, add_stats, NULL, -1, "dcp_items_sent", "%"PRIu64,
+                   dcp->stats.items_sent);
+    add_statistics(c, add_stats, NULL, -1, "dcp_log_misses", "%"PRIu64,
+                   dcp->stats.log_misses);
+    add_statistics(c, add_stats, NULL, -1, "dcp_consumer_mutations",
+                   "%"PRIu64, dcp->stats.consumer_mutations);
+    add_statistics(c, add_stats, NULL, -1, "dcp_consumer_deletions",
+                   "%"PRIu64, dcp->stats.consumer_deletions);
+    add_statistics(c, add_stats, NULL, -1, "dcp_consumer_batches",
+                   "%"PRIu64, dcp->stats.consumer_batches);
+    add_statistics(c, add_stats, NULL, -1, "dcp_consumer_dropped",
+                   "%"PRIu64, dcp->stats.consumer_dropped);
+    cb_mutex_exit(&dcp->lock);
+}
@@ -0,0 +1,302 @@
+/* DCP producer streams over the items in the cache */
+#ifndef DCP_H
+#define DCP_H
+
+#include "default_engine.h"
+
+/*
+ * With dcp enabled every item carries the vbucket it was stored in and a
+ * seqno, handed out per vbucket in the order the items are linked (see
+ * item_get_seqno). The changes are also appended to a log of dcp_log_size
+ * entries, which the streams replay once they have caught up with the
+ * cache. A stream starts out with a backfill: a walk over all of the
+ * items (or just the ones of its vbucket with vbucket_index) sending the
+ * ones in its vbucket with a seqno up to the high seqno at the time (as a
+ * disk snapshot), unless the log still holds all of the changes after
+ * the start seqno. It then moves on to the log (sending memory
+ * snapshots), and goes back to a backfill if the log has wrapped past it. The mutations in the log only hold the key; we look up the
+ * item and send it if it still has the seqno (a later entry covers it if
+ * it doesn't). Evicted items are not streamed as deletions: like any
+ * memcached bucket a consumer may hold items this cache has dropped.
+ *
+ * A connection opened without DCP_OPEN_PRODUCER is a consumer, feeding
+ * the replica (and pending) vbuckets from another node's streams so the
+ * cache is warm when they are made active. The mutations are held back
+ * on the connection and stored together (see item_store_multi) at the
+ * end of their snapshot, once DCP_CONSUMER_BATCH of them have come in,
+ * before anything else the producer sends and when the connection goes
+ * away. The items get our own CAS and seqnos.
+ */
+
+#define DCP_SEQNO_BITS 48
+#define DCP_SEQNO_MASK ((UINT64_C(1) << DCP_SEQNO_BITS) - 1)
+
+/* The kinds of changes in the log */
+#define DCP_CHANGE_MUTATION 0
+#define DCP_CHANGE_DELETION 1
+#define DCP_CHANGE_EXPIRATION 2
+
+/* The flags of the snapshot markers and the stream ends we send */
+#define DCP_MARKER_MEMORY 0x01
+#define DCP_MARKER_DISK 0x02
+#define DCP_STREAM_END_OK 0
+
+/* The longest key the protocol allows */
+#define DCP_KEY_MAX 250
+
+/* The most mutations a consumer holds back before storing them */
+#define DCP_CONSUMER_BATCH 256
+
+struct dcp_change {
+    uint64_t seqno;
+    uint64_t cas;
+    uint16_t vbucket;
+    uint8_t type;
+    uint8_t nkey;
+    char key[DCP_KEY_MAX];
+};
+
+enum dcp_stream_state {
+    /* Walking the cache for the snapshot up to snap_end */
+    DCP_STREAM_BACKFILL,
+    /* Replaying the log from log_pos */
+    DCP_STREAM_MEMORY
+};
+
+struct dcp_stream {
+    struct dcp_stream *next;
+    uint32_t opaque;
+    uint32_t flags;
+    uint16_t vbucket;
+    enum dcp_stream_state state;
+    /* The seqno the stream stops at */
+    uint64_t end_seqno;
+    /* The last seqno we've sent (or skipped) */
+    uint64_t last_seqno;
+    /* The end of the snapshot we're in, and whether we've sent its marker */
+    uint64_t snap_end;
+    bool marker_sent;
+    /* The next change in the log to look at (see log_head) */
+    uint64_t log_pos;
+    /* The item we've got to send next (with a reference held) */
+    hash_item *it;
+    hash_item cursor;
+};
+
+/* The snapshot a consumer is in for a vbucket */
+struct dcp_consumer_snapshot {
+    uint16_t vbucket;
+    uint64_t end_seqno;
+};
+
+/* What a consumer connection holds back (only used by its worker) */
+struct dcp_consumer {
+    struct dcp_consumer_snapshot *snapshots;
+    int nsnapshots;
+    int nitems;
+    engine_store_t reqs[DCP_CONSUMER_BATCH];
+    hash_item *items[DCP_CONSUMER_BATCH];
+    uint64_t cas[DCP_CONSUMER_BATCH];
+    ENGINE_ERROR_CODE status[DCP_CONSUMER_BATCH];
+};
+
+/* A dcp connection (stored as the engine specific of the cookie) */
+struct dcp_connection {
+    struct dcp_connection *next;
+    const void *cookie;
+    uint32_t opaque;
+    /* NULL for a producer */
+    struct dcp_consumer *consumer;
+    struct dcp_stream *streams;
+    /* The stream to look at first in the next step */
+    struct dcp_stream *current;
+    /* The last step found nothing to send; notify it on new changes */
+    bool paused;
+    bool wakeup;
+    /* Disconnected; the notifier thread releases the cookie */
+    bool dead;
+};
+
+struct dcp {
+    /* Protects everything below */
+    cb_mutex_t lock;
+    /* Signalled when there are connections to wake up (or release) */
+    cb_cond_t cond;
+    cb_thread_t tid;
+    bool running;
+    bool shutdown;
+
+    /* The vbucket uuid we hand out (there is a single failover entry) */
+    uint64_t uuid;
+    /* The high seqno of every vbucket */
+    uint64_t *seqnos;
+    struct dcp_change *log;
+    size_t log_size;
+    /* The number of changes ever logged */
+    uint64_t log_head;
+
+    struct dcp_connection *connections;
+
+    struct {
+        uint64_t mutations;
+        uint64_t deletions;
+        uint64_t expirations;
+        uint64_t streams_opened;
+        uint64_t backfills;
+        uint64_t items_sent;
+        uint64_t log_misses;
+        uint64_t consumer_mutations;
+        uint64_t consumer_deletions;
+        uint64_t consumer_batches;
+        uint64_t consumer_dropped;
+    } stats;
+};
+
+/**
+ * Set up the seqnos and the log and start the notifier thread
+ * @param engine handle to the storage engine
+ */
+ENGINE_ERROR_CODE dcp_init(struct default_engine *engine);
+
+/**
+ * Stop the notifier thread and drop all of the connections
+ * @param engine handle to the storage engine
+ */
+void dcp_destroy(struct default_engine *engine);
+
+/**
+ * Give the item the next seqno of its vbucket and log the mutation.
+ * Caller must hold the item lock.
+ * @param engine handle to the storage engine
+ * @param it the item being linked (or updated in place)
+ */
+void dcp_log_mutation(struct default_engine *engine, hash_item *it);
+
+/**
+ * Log the removal of the item (with the next seqno of its vbucket).
+ * Caller must hold the item lock.
+ * @param engine handle to the storage engine
+ * @param it the item being unlinked
+ * @param type DCP_CHANGE_DELETION or DCP_CHANGE_EXPIRATION
+ */
+void dcp_log_removal(struct default_engine *engine, const hash_item *it,
+                     uint8_t type);
+
+/**
+ * Make the connection a producer (or a consumer without DCP_OPEN_PRODUCER)
+ * @param engine handle to the storage engine
+ * @param cookie the connection
+ * @param opaque the opaque of the open request
+ * @param flags the flags of the open request (DCP_OPEN_*)
+ */
+ENGINE_ERROR_CODE dcp_producer_open(struct default_engine *engine,
+                                    const void *cookie, uint32_t opaque,
+                                    uint32_t flags);
+
+/**
+ * Start a snapshot of the vbucket on a consumer connection
+ * @param engine handle to the storage engine
+ * @param cookie the connection
+ * @param vbucket the vbucket of the snapshot
+ * @param end_seqno the last seqno of the snapshot
+ * @return ENGINE_EINVAL if the connection isn't a consumer
+ */
+ENGINE_ERROR_CODE dcp_consumer_marker(struct default_engine *engine,
+                                      const void *cookie, uint16_t vbucket,
+                                      uint64_t end_seqno);
+
+/**
+ * Apply a mutation received on a consumer connection (it may be held
+ * back until the end of its snapshot)
+ * @param engine handle to the storage engine
+ * @param cookie the connection
+ * @param key the key of the item
+ * @param nkey the length of the key
+ * @param value the value of the item
+ * @param nvalue the length of the value
+ * @param vbucket the vbucket of the item
+ * @param flags the flags of the item (in host order)
+ * @param datatype the datatype of the value
+ * @param by_seqno the seqno of the mutation at the producer
+ * @param expiration the expiry time of the item
+ * @return ENGINE_EINVAL if the connection isn't a consumer
+ */
+ENGINE_ERROR_CODE dcp_consumer_mutation(struct default_engine *engine,
+                                        const void *cookie,
+                                        const void *key, uint16_t nkey,
+                                        const void *value, uint32_t nvalue,
+                                        uint16_t vbucket, uint32_t flags,
+                                        uint8_t datatype, uint64_t by_seqno,
+                                        uint32_t expiration);
+
+/**
+ * Apply a deletion (or expiration) received on a consumer connection
+ * @param engine handle to the storage engine
+ * @param cookie the connection
+ * @param key the key of the item
+ * @param nkey the length of the key
+ * @return ENGINE_EINVAL if the connection isn't a consumer
+ */
+ENGINE_ERROR_CODE dcp_consumer_deletion(struct default_engine *engine,
+                                        const void *cookie,
+                                        const void *key, uint16_t nkey);
+
+/**
+ * Store the mutations a consumer connection has held back
+ * @param engine handle to the storage engine
+ * @param cookie the connection
+ * @return ENGINE_EINVAL if the connection isn't a consumer
+ */
+ENGINE_ERROR_CODE dcp_consumer_flush(struct default_engine *engine,
+                                     const void *cookie);
+
+/**
+ * Start a stream of the vbucket on the connection (see the stream_req
+ * entry point in engine.h)
+ */
+ENGINE_ERROR_CODE dcp_producer_stream_req(struct default_engine *engine,
+                                          const void *cookie,
+                                          uint32_t flags,
+                                          uint32_t opaque,
+                                          uint16_t vbucket,
+                                          uint64_t start_seqno,
+                                          uint64_t end_seqno,
+                                          uint64_t vbucket_uuid,
+                                          uint64_t *rollback_seqno,
+                                          dcp_add_failover_log callback);
+
+/**
+ * Stop streaming the vbucket on the connection
+ * @param engine handle to the storage engine
+ * @param cookie the connection
+ * @param vbucket the vbucket to stop streaming
+ * @return ENGINE_KEY_ENOENT if there is no stream for it
+ */
+ENGINE_ERROR_CODE dcp_producer_close_stream(struct default_engine *engine,
+                                            const void *cookie,
+                                            uint16_t vbucket);
+
+/**
+ * Send what we've got for the streams of the connection
+ * @param engine handle to the storage engine
+ * @param cookie the connection
+ * @param producers where to send the messages
+ * @return ENGINE_WANT_MORE if we sent something, ENGINE_SUCCESS if there
+ *         was nothing to send (the connection is notified when there is)
+ */
+ENGINE_ERROR_CODE dcp_producer_step(struct default_engine *engine,
+                                    const void *cookie,
+                                    struct dcp_message_producers *producers);
+
+/**
+ * Drop the streams of a connection going away
+ * @param engine handle to the storage engine
+ * @param cookie the connection
+ */
+void dcp_disconnect(struct default_engine *engine, const void *cookie);
+
+/** Fill buffer with the dcp stats */
+void dcp_stats(struct default_engine *engine, ADD_STAT add_stats,
+               const void *c);
+
+#endif
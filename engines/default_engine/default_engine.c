@@ -43,12 +43,57 @@ static ENGINE_ERROR_CODE default_get(ENGINE_HANDLE* handle,
                                      const void* key,
                                      const int nkey,
                                      uint16_t vbucket);
+static ENGINE_ERROR_CODE default_get_with_info(ENGINE_HANDLE* handle,
+                                               const void* cookie,
+                                               item** item,
+                                               item_info *item_info,
+                                               const void* key,
+                                               const int nkey,
+                                               uint16_t vbucket);
+static ENGINE_ERROR_CODE default_get_multi(ENGINE_HANDLE* handle,
+                                           const void* cookie,
+                                           const engine_key_t *keys,
+                                           int nkeys,
+                                           item** items,
+                                           ENGINE_ERROR_CODE *status);
+static ENGINE_ERROR_CODE default_store_multi(ENGINE_HANDLE* handle,
+                                             const void* cookie,
+                                             const engine_store_t *reqs,
+                                             int nreqs,
+                                             uint64_t *cas,
+                                             ENGINE_ERROR_CODE *status);
 static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
                   const void *cookie,
                   const char *stat_key,
                   int nkey,
                   ADD_STAT add_stat);
 static void default_reset_stats(ENGINE_HANDLE* handle, const void *cookie);
+static void default_get_mem_info(ENGINE_HANDLE* handle, const void *cookie,
+                                 engine_mem_info_t *info);
+static ENGINE_ERROR_CODE default_set_mem_limit(ENGINE_HANDLE* handle,
+                                               const void *cookie,
+                                               size_t limit);
+static ENGINE_ERROR_CODE default_patch(ENGINE_HANDLE* handle,
+                                       const void *cookie,
+                                       const void *key,
+                                       const uint16_t nkey,
+                                       uint64_t offset,
+                                       const void *data,
+                                       uint32_t length,
+                                       uint64_t *cas,
+                                       uint16_t vbucket);
+static ENGINE_ERROR_CODE default_sample(ENGINE_HANDLE* handle,
+                                        const void *cookie,
+                                        item **items,
+                                        int nitems,
+                                        int *nfound);
+static ENGINE_ERROR_CODE default_touch(ENGINE_HANDLE* handle,
+                                       const void *cookie,
+                                       item **item,
+                                       const void *key,
+                                       const uint16_t nkey,
+                                       const rel_time_t exptime,
+                                       uint16_t vbucket);
 static ENGINE_ERROR_CODE default_store(ENGINE_HANDLE* handle,
                                        const void *cookie,
                                        item* item,
@@ -239,6 +284,15 @@ static bool handled_vbucket(struct default_engine *e, uint16_t vbid) {
 /* mechanism for handling bad vbucket requests */
 #define VBUCKET_GUARD(e, v) if (!handled_vbucket(e, v)) { return ENGINE_NOT_MY_VBUCKET; }
 
+/* The dcp consumers feed the vbuckets we don't serve (yet) */
+static bool replica_vbucket(struct default_engine *e, uint16_t vbid) {
+    vbucket_state_t state = get_vbucket_state(e, vbid);
+    return e->config.ignore_vbucket || state == vbucket_state_replica ||
+        state == vbucket_state_pending;
+}
+
+#define REPLICA_VBUCKET_GUARD(e, v) if (!replica_vbucket(e, v)) { return ENGINE_NOT_MY_VBUCKET; }
+
 static bool get_item_info(ENGINE_HANDLE *handle, const void *cookie,
                           const item* item, item_info *item_info);
 
@@ -250,6 +304,7 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
                                   ENGINE_HANDLE **handle) {
    SERVER_HANDLE_V1 *api = get_server_api();
    struct default_engine *engine;
+   int ii;
 
    if (interface != 1 || api == NULL) {
       return ENGINE_ENOTSUP;
@@ -260,10 +315,35 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
    }
 
    cb_mutex_initialize(&engine->slabs.lock);
-   cb_mutex_initialize(&engine->cache_lock);
+   cb_cond_initialize(&engine->slabs.rebalance.cond);
+   for (ii = 0; ii < POWER_LARGEST; ++ii) {
+       cb_mutex_initialize(&engine->items.lock[ii]);
+   }
+   cb_mutex_initialize(&engine->assoc.lock);
    cb_mutex_initialize(&engine->stats.lock);
    cb_mutex_initialize(&engine->scrubber.lock);
+   cb_mutex_initialize(&engine->snapshot.lock);
+   cb_cond_initialize(&engine->scrubber.cond);
+   cb_mutex_initialize(&engine->lru_maintainer.lock);
+   cb_cond_initialize(&engine->lru_maintainer.cond);
+   cb_mutex_initialize(&engine->lru_crawler.lock);
+   cb_cond_initialize(&engine->lru_crawler.cond);
+   cb_mutex_initialize(&engine->expiry.lock);
+   cb_cond_initialize(&engine->expiry.cond);
+   cb_mutex_initialize(&engine->ext.lock);
+   mc_mutex_stats_register(&engine->lock_stats.items, "item_locks");
+   mc_mutex_stats_register(&engine->lock_stats.lru, "lru_locks");
+   mc_mutex_stats_register(&engine->lock_stats.slabs, "slabs.lock");
+   mc_mutex_stats_register(&engine->lock_stats.assoc, "assoc.lock");
+   mc_mutex_stats_register(&engine->lock_stats.stats, "engine_stats.lock");
+   mc_mutex_stats_register(&engine->lock_stats.vbuckets, "vbucket_locks");
+   cb_cond_initialize(&engine->ext.cond);
+   cb_mutex_initialize(&engine->dcp.lock);
+   cb_cond_initialize(&engine->dcp.cond);
    cb_mutex_initialize(&engine->tap_connections.lock);
+#ifdef COMPACT_ITEMS
+   cb_mutex_initialize(&engine->items.cursor_lock);
+#endif
 
    engine->engine.interface.interface = 1;
    engine->engine.get_info = default_get_info;
@@ -273,15 +353,24 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
    engine->engine.remove = default_item_delete;
    engine->engine.release = default_item_release;
    engine->engine.get = default_get;
+   engine->engine.get_multi = default_get_multi;
    engine->engine.get_stats = default_get_stats;
    engine->engine.reset_stats = default_reset_stats;
    engine->engine.store = default_store;
+   engine->engine.store_multi = default_store_multi;
    engine->engine.arithmetic = default_arithmetic;
    engine->engine.flush = default_flush;
    engine->engine.unknown_command = default_unknown_command;
    engine->engine.tap_notify = default_tap_notify;
    engine->engine.get_tap_iterator = default_get_tap_iterator;
    engine->engine.item_set_cas = item_set_cas;
+   engine->engine.item_set_cost = item_set_cost;
+   engine->engine.get_mem_info = default_get_mem_info;
+   engine->engine.set_mem_limit = default_set_mem_limit;
+   engine->engine.patch = default_patch;
+   engine->engine.sample = default_sample;
+   engine->engine.touch = default_touch;
+   engine->engine.get_with_info = default_get_with_info;
    engine->engine.get_item_info = get_item_info;
    engine->engine.set_item_info = set_item_info;
    engine->engine.dcp.step = dcp_step;
@@ -300,16 +389,66 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
    engine->server = *api;
    engine->get_server_api = get_server_api;
    engine->initialized = true;
-   engine->assoc.hashpower = 16;
    engine->config.use_cas = true;
    engine->config.verbose = 0;
    engine->config.oldest_live = 0;
+   engine->config.oldest_cas = 0;
    engine->config.evict_to_free = true;
    engine->config.maxbytes = 64 * 1024 * 1024;
    engine->config.preallocate = false;
    engine->config.factor = 1.25;
    engine->config.chunk_size = 48;
    engine->config.item_size_max= 1024 * 1024;
+   engine->config.lock_stripes = 1024;
+   engine->config.lru_segmented = true;
+   engine->config.hot_lru_pct = 20;
+   engine->config.warm_lru_pct = 40;
+   engine->config.temporary_ttl = 0;
+   engine->config.free_chunk_reserve = 0;
+   engine->config.tagged_assoc = false;
+   engine->config.hashpower = 16;
+   engine->config.hash_move_budget = 1000;
+   engine->config.slab_reassign = false;
+   engine->config.slab_automove = false;
+   engine->config.slab_defrag_pct = 0;
+   engine->config.slab_madvise = false;
+   engine->config.lru_crawler = true;
+   engine->config.lru_crawler_interval = 60;
+   engine->config.lru_crawler_sleep = 1;
+   engine->config.slab_chunk_max = 0;
+   engine->config.tiny_items = 0;
+   engine->config.slab_sizes = NULL;
+   engine->config.slab_sizes_auto = false;
+   engine->config.ext_path = NULL;
+   engine->config.ext_size = 1024 * 1024 * 1024;
+   engine->config.ext_page_size = 4 * 1024 * 1024;
+   engine->config.ext_item_size = 512;
+   engine->config.ext_item_age = 0;
+   engine->config.ext_recache_rate = 2000;
+   engine->ext.fd = -1;
+   engine->config.restart_file = NULL;
+   engine->config.hugepage_size = 0;
+   engine->config.prefault_threads = 4;
+   engine->config.numa = false;
+   engine->config.dcp = false;
+   engine->config.dcp_log_size = 16384;
+   engine->config.vbucket_index = false;
+   engine->config.vbucket_locks = VBUCKET_INDEX_LOCKS;
+   engine->config.eviction_policy = NULL;
+   engine->config.eviction_gdsf = false;
+   engine->config.eviction_samples = 5;
+   engine->config.expiry_wheel = false;
+   engine->config.native_counters = false;
+   engine->config.lockless_get = false;
+   engine->config.compression_threshold = 0;
+   engine->config.scrub_threads = 4;
+   engine->config.scrub_rate = 0;
+   engine->config.namespace_delimiter = NULL;
+   engine->config.namespace_slots = NAMESPACE_SLOTS;
+   engine->config.snapshot_file = NULL;
+   engine->config.snapshot_load = false;
+   engine->config.snapshot_threads = 4;
+   engine->slabs.restart.fd = -1;
    engine->tap_connections.size = 10;
    engine->tap_connections.clients = calloc(engine->tap_connections.size,
                                             sizeof(void*));
@@ -346,22 +485,176 @@ static ENGINE_ERROR_CODE default_initialize(ENGINE_HANDLE* handle,
       return ret;
    }
 
+   if (se->config.hot_lru_pct + se->config.warm_lru_pct > 100) {
+      return ENGINE_EINVAL;
+   }
+
+   if (se->config.hashpower < 1 || se->config.hashpower > 31) {
+      return ENGINE_EINVAL;
+   }
+
+   if (se->config.slab_automove && !se->config.slab_reassign) {
+      return ENGINE_EINVAL;
+   }
+
+   if (se->config.slab_defrag_pct > 100 ||
+       (se->config.slab_defrag_pct != 0 && !se->config.slab_reassign)) {
+      return ENGINE_EINVAL;
+   }
+
+   if (se->config.slab_madvise && !se->config.slab_reassign) {
+      return ENGINE_EINVAL;
+   }
+
+   if (se->config.vbucket_locks < 1 ||
+       se->config.vbucket_locks > NUM_VBUCKETS) {
+      return ENGINE_EINVAL;
+   }
+
+   if (se->config.eviction_policy != NULL) {
+      if (strcmp(se->config.eviction_policy, "gdsf") == 0) {
+         se->config.eviction_gdsf = true;
+      } else if (strcmp(se->config.eviction_policy, "lru") != 0) {
+         return ENGINE_EINVAL;
+      }
+   }
+
+   if (se->config.eviction_samples == 0) {
+      return ENGINE_EINVAL;
+   }
+
+   /* The items are restored into the pages they were in */
+   if (se->config.numa && se->config.restart_file != NULL) {
+      return ENGINE_EINVAL;
+   }
+
+   /* The seqnos (and the failover log) aren't kept across restarts */
+   if (se->config.dcp && se->config.restart_file != NULL) {
+      return ENGINE_EINVAL;
+   }
+
+   if (se->config.scrub_threads == 0) {
+      return ENGINE_EINVAL;
+   }
+
+   /* The namespaces are invalidated by the CAS (see item_is_flushed) */
+   if (se->config.namespace_delimiter != NULL &&
+       (strlen(se->config.namespace_delimiter) != 1 ||
+        !se->config.use_cas || se->config.namespace_slots == 0 ||
+        (se->config.namespace_slots &
+         (se->config.namespace_slots - 1)) != 0)) {
+      return ENGINE_EINVAL;
+   }
+
+   if ((se->config.snapshot_load && se->config.snapshot_file == NULL) ||
+       se->config.snapshot_threads == 0) {
+      return ENGINE_EINVAL;
+   }
+
+   /* The hugepage sizes are powers of two (2MB and 1GB on x86-64) */
+   if ((se->config.hugepage_size & (se->config.hugepage_size - 1)) != 0) {
+      return ENGINE_EINVAL;
+   }
+
+   /* The LRU maintainer is the one writing the cold items out */
+   if (se->config.ext_path != NULL && !se->config.lru_segmented) {
+      return ENGINE_EINVAL;
+   }
+
+#ifdef USE_SYSTEM_MALLOC
+   /* The lookups without the lock rely on the slab pages staying mapped */
+   if (se->config.lockless_get) {
+      return ENGINE_EINVAL;
+   }
+#endif
+
    /* fixup feature_info */
    if (se->config.use_cas) {
        se->info.engine_info.features[se->info.engine_info.num_features++].feature = ENGINE_FEATURE_CAS;
    }
 
+   item_layout_init(se);
+
+   /* The number of lock stripes is capped by the size of the hash table */
    ret = assoc_init(se);
    if (ret != ENGINE_SUCCESS) {
       return ret;
    }
 
+   ret = item_locks_init(se, se->config.lock_stripes);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
    ret = slabs_init(se, se->config.maxbytes, se->config.factor,
                     se->config.preallocate);
    if (ret != ENGINE_SUCCESS) {
       return ret;
    }
 
+   if (se->config.vbucket_index) {
+      ret = item_vbucket_index_init(se);
+      if (ret != ENGINE_SUCCESS) {
+         return ret;
+      }
+   }
+
+   if (se->config.namespace_delimiter != NULL) {
+      ret = item_namespace_init(se);
+      if (ret != ENGINE_SUCCESS) {
+         return ret;
+      }
+   }
+
+   /* The wheel starts at the time the (restored) items are linked at */
+   se->expiry.now = se->server.core->get_current_time();
+
+   if (se->slabs.restart.restored) {
+      ret = item_restore(se);
+      if (ret != ENGINE_SUCCESS) {
+         return ret;
+      }
+   }
+
+   if (se->config.ext_path != NULL) {
+      ret = extstore_init(se);
+      if (ret != ENGINE_SUCCESS) {
+         return ret;
+      }
+   }
+
+   if (se->config.dcp) {
+      ret = dcp_init(se);
+      if (ret != ENGINE_SUCCESS) {
+         return ret;
+      }
+   }
+
+   /* The restored items are newer than those of the snapshot */
+   if (se->config.snapshot_load && !se->slabs.restart.restored) {
+      ret = snapshot_load(se);
+      if (ret != ENGINE_SUCCESS) {
+         return ret;
+      }
+   }
+
+   if ((se->config.lru_segmented || se->config.free_chunk_reserve > 0) &&
+       !item_lru_maintainer_start(se)) {
+      return ENGINE_FAILED;
+   }
+
+   if (se->config.slab_reassign && !slabs_rebalancer_start(se)) {
+      return ENGINE_FAILED;
+   }
+
+   if (se->config.lru_crawler && !item_lru_crawler_start(se)) {
+      return ENGINE_FAILED;
+   }
+
+   if (se->config.expiry_wheel && !item_expiry_start(se)) {
+      return ENGINE_FAILED;
+   }
+
    se->server.callback->register_callback(handle, ON_DISCONNECT,
                                           default_handle_disconnect, handle);
 
@@ -370,9 +663,22 @@ static ENGINE_ERROR_CODE default_initialize(ENGINE_HANDLE* handle,
 
 static void default_destroy(ENGINE_HANDLE* handle, const bool force) {
     struct default_engine* se = get_handle(handle);
+    int ii;
     (void)force;
 
     if (se->initialized) {
+        /* Stop moving items around */
+        snapshot_destroy(se);
+        item_scrubber_stop(se);
+        item_expiry_stop(se);
+        item_lru_crawler_stop(se);
+        slabs_rebalancer_stop(se);
+        item_lru_maintainer_stop(se);
+        extstore_destroy(se);
+        dcp_destroy(se);
+        item_vbucket_index_destroy(se);
+        item_namespace_destroy(se);
+
         /* Destroy the association table */
         assoc_destroy(se);
 
@@ -380,13 +686,46 @@ static void default_destroy(ENGINE_HANDLE* handle, const bool force) {
         slabs_destroy(se);
 
         free(se->config.uuid);
+        free(se->config.ext_path);
+        free(se->config.eviction_policy);
+        free(se->config.restart_file);
+        free(se->config.slab_sizes);
+        free(se->config.namespace_delimiter);
+        free(se->config.snapshot_file);
+
+        item_locks_destroy(se);
 
         /* Clean up the mutexes */
-        cb_mutex_destroy(&se->cache_lock);
+        mc_mutex_stats_unregister(&se->lock_stats.items);
+        mc_mutex_stats_unregister(&se->lock_stats.lru);
+        mc_mutex_stats_unregister(&se->lock_stats.slabs);
+        mc_mutex_stats_unregister(&se->lock_stats.assoc);
+        mc_mutex_stats_unregister(&se->lock_stats.stats);
+        mc_mutex_stats_unregister(&se->lock_stats.vbuckets);
+        for (ii = 0; ii < POWER_LARGEST; ++ii) {
+            cb_mutex_destroy(&se->items.lock[ii]);
+        }
+        cb_mutex_destroy(&se->assoc.lock);
         cb_mutex_destroy(&se->stats.lock);
         cb_mutex_destroy(&se->slabs.lock);
+        cb_cond_destroy(&se->slabs.rebalance.cond);
         cb_mutex_destroy(&se->scrubber.lock);
+        cb_mutex_destroy(&se->snapshot.lock);
+        cb_cond_destroy(&se->scrubber.cond);
+        cb_mutex_destroy(&se->lru_maintainer.lock);
+        cb_cond_destroy(&se->lru_maintainer.cond);
+        cb_mutex_destroy(&se->lru_crawler.lock);
+        cb_cond_destroy(&se->lru_crawler.cond);
+        cb_mutex_destroy(&se->expiry.lock);
+        cb_cond_destroy(&se->expiry.cond);
+        cb_mutex_destroy(&se->ext.lock);
+        cb_cond_destroy(&se->ext.cond);
+        cb_mutex_destroy(&se->dcp.lock);
+        cb_cond_destroy(&se->dcp.cond);
         cb_mutex_destroy(&se->tap_connections.lock);
+#ifdef COMPACT_ITEMS
+        cb_mutex_destroy(&se->items.cursor_lock);
+#endif
         se->initialized = false;
         free((void*)se->tap_connections.clients);
         free(se);
@@ -405,10 +744,8 @@ static ENGINE_ERROR_CODE default_item_allocate(ENGINE_HANDLE* handle,
    hash_item *it;
    unsigned int id;
    struct default_engine* engine = get_handle(handle);
-   size_t ntotal = sizeof(hash_item) + nkey + nbytes;
-   if (engine->config.use_cas) {
-      ntotal += sizeof(uint64_t);
-   }
+   size_t ntotal = sizeof(hash_item) + item_header_extra(engine) +
+      nkey + nbytes;
    id = slabs_clsid(engine, ntotal);
    if (id == 0) {
       return ENGINE_E2BIG;
@@ -437,13 +774,13 @@ static ENGINE_ERROR_CODE default_item_delete(ENGINE_HANDLE* handle,
 
    VBUCKET_GUARD(engine, vbucket);
 
-   it = item_get(engine, key, nkey);
+   it = item_get(engine, cookie, key, nkey);
    if (it == NULL) {
       return ENGINE_KEY_ENOENT;
    }
 
    if (*cas == 0 || *cas == item_get_cas(it)) {
-      item_unlink(engine, it);
+      item_delete(engine, it);
       item_release(engine, it);
    } else {
       return ENGINE_KEY_EEXISTS;
@@ -465,16 +802,93 @@ static ENGINE_ERROR_CODE default_get(ENGINE_HANDLE* handle,
                                      const int nkey,
                                      uint16_t vbucket) {
    struct default_engine *engine = get_handle(handle);
+   hash_item *it;
    VBUCKET_GUARD(engine, vbucket);
 
-   *item = item_get(engine, key, nkey);
-   if (*item != NULL) {
+   if (extstore_enabled(engine) &&
+       (it = extstore_get_result(engine, cookie, key, nkey)) != NULL) {
+      /* We've read it back in for the connection */
+      *item = it;
+      return ENGINE_SUCCESS;
+   }
+
+   it = item_get(engine, cookie, key, nkey);
+   if (it != NULL && (it->iflag & ITEM_HDR) != 0) {
+      if (cookie != NULL) {
+         /* The connection is notified when we've read it */
+         ENGINE_ERROR_CODE ret = extstore_get(engine, cookie, it, &it);
+         if (ret != ENGINE_SUCCESS) {
+            return ret;
+         }
+      } else {
+         it = item_ext_fetch(engine, it, cookie);
+      }
+   }
+
+   *item = it;
+   if (it != NULL) {
+      slabs_numa_hit(engine, it);
       return ENGINE_SUCCESS;
    } else {
       return ENGINE_KEY_ENOENT;
    }
 }
 
+static ENGINE_ERROR_CODE default_get_with_info(ENGINE_HANDLE* handle,
+                                               const void* cookie,
+                                               item** item,
+                                               item_info *item_info,
+                                               const void* key,
+                                               const int nkey,
+                                               uint16_t vbucket) {
+   ENGINE_ERROR_CODE ret = default_get(handle, cookie, item, key, nkey,
+                                       vbucket);
+   if (ret == ENGINE_SUCCESS &&
+       !get_item_info(handle, cookie, *item, item_info)) {
+      item_release(get_handle(handle), *item);
+      *item = NULL;
+      ret = ENGINE_FAILED;
+   }
+   return ret;
+}
+
+static ENGINE_ERROR_CODE default_get_multi(ENGINE_HANDLE* handle,
+                                           const void* cookie,
+                                           const engine_key_t *keys,
+                                           int nkeys,
+                                           item** items,
+                                           ENGINE_ERROR_CODE *status) {
+   struct default_engine *engine = get_handle(handle);
+   int ii;
+
+   item_get_multi(engine, keys, nkeys, (hash_item**)items);
+
+   for (ii = 0; ii < nkeys; ++ii) {
+      hash_item *it = items[ii];
+      if (!handled_vbucket(engine, keys[ii].vbucket)) {
+         if (it != NULL) {
+            item_release(engine, it);
+            items[ii] = NULL;
+         }
+         status[ii] = ENGINE_NOT_MY_VBUCKET;
+         continue;
+      }
+      if (it != NULL && (it->iflag & ITEM_HDR) != 0) {
+         /* We can't block, so read it back in right away */
+         it = item_ext_fetch(engine, it, NULL);
+         items[ii] = it;
+      }
+      if (it != NULL) {
+         slabs_numa_hit(engine, it);
+         status[ii] = ENGINE_SUCCESS;
+      } else {
+         status[ii] = ENGINE_KEY_ENOENT;
+      }
+   }
+   (void)cookie;
+   return ENGINE_SUCCESS;
+}
+
 static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
                                            const void* cookie,
                                            const char* stat_key,
@@ -488,7 +902,7 @@ static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
       char val[128];
       int len;
 
-      cb_mutex_enter(&engine->stats.lock);
+      mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
       len = sprintf(val, "%"PRIu64, (uint64_t)engine->stats.evictions);
       add_stat("evictions", 9, val, len, cookie);
       len = sprintf(val, "%"PRIu64, (uint64_t)engine->stats.curr_items);
@@ -499,15 +913,79 @@ static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
       add_stat("bytes", 5, val, len, cookie);
       len = sprintf(val, "%"PRIu64, engine->stats.reclaimed);
       add_stat("reclaimed", 9, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, engine->stats.appends_in_place);
+      add_stat("appends_in_place", 16, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, engine->stats.patches_in_place);
+      add_stat("patches_in_place", 16, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, engine->stats.values_compressed);
+      add_stat("values_compressed", 17, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, engine->stats.values_inflated);
+      add_stat("values_inflated", 15, val, len, cookie);
       len = sprintf(val, "%"PRIu64, (uint64_t)engine->config.maxbytes);
       add_stat("engine_maxbytes", 15, val, len, cookie);
       cb_mutex_exit(&engine->stats.lock);
+
+      if (engine->namespaces.slots != NULL) {
+         cb_mutex_enter(&engine->namespaces.lock);
+         len = sprintf(val, "%"PRIu64, (uint64_t)engine->namespaces.used);
+         add_stat("namespaces", 10, val, len, cookie);
+         len = sprintf(val, "%"PRIu64, engine->namespaces.invalidations);
+         add_stat("namespace_invalidations", 23, val, len, cookie);
+         cb_mutex_exit(&engine->namespaces.lock);
+      }
+
+      cb_mutex_enter(&engine->lru_maintainer.lock);
+      len = sprintf(val, "%"PRIu64, engine->lru_maintainer.juggles);
+      add_stat("lru_maintainer_juggles", 22, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, engine->lru_maintainer.evicted_ahead);
+      add_stat("lru_maintainer_evicted_ahead", 28, val, len, cookie);
+      cb_mutex_exit(&engine->lru_maintainer.lock);
+
+      cb_mutex_enter(&engine->lru_crawler.lock);
+      len = sprintf(val, "%d", engine->lru_crawler.crawling);
+      add_stat("lru_crawler_running", 19, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, engine->lru_crawler.starts);
+      add_stat("lru_crawler_starts", 18, val, len, cookie);
+      cb_mutex_exit(&engine->lru_crawler.lock);
+
+      if (engine->config.expiry_wheel) {
+         cb_mutex_enter(&engine->expiry.lock);
+         len = sprintf(val, "%"PRIu64, engine->expiry.items);
+         add_stat("expiry_wheel_items", 18, val, len, cookie);
+         len = sprintf(val, "%"PRIu64, engine->expiry.reclaimed);
+         add_stat("expiry_wheel_reclaimed", 22, val, len, cookie);
+         cb_mutex_exit(&engine->expiry.lock);
+      }
+
+      assoc_stats(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "slabs", 5) == 0) {
       slabs_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "slab_sizes", 10) == 0) {
+      slabs_sizes_stats(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "items", 5) == 0) {
       item_stats(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "sizes", 5) == 0) {
       item_stats_sizes(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "key_prefixes", 12) == 0) {
+      item_key_prefix_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "ages", 4) == 0) {
+      item_stats_ages(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "extstore", 8) == 0) {
+      extstore_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "snapshot", 8) == 0) {
+      snapshot_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "tap", 3) == 0) {
+      item_tap_stats(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "dcp", 3) == 0) {
+      if (engine->config.dcp) {
+         dcp_stats(engine, add_stat, cookie);
+      }
+   } else if (strncmp(stat_key, "vbucket", 7) == 0) {
+      if (engine->config.vbucket_index) {
+         item_vbucket_stats(engine, add_stat, cookie);
+      }
+   } else if (strncmp(stat_key, "numa", 4) == 0) {
+      slabs_numa_stats(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "uuid", 4) == 0) {
        if (engine->config.uuid) {
            add_stat("uuid", 4, engine->config.uuid,
@@ -518,6 +996,9 @@ static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
    } else if (strncmp(stat_key, "scrub", 5) == 0) {
       char val[128];
       int len;
+      uint64_t percent = 0;
+      uint64_t rate = 0;
+      hrtime_t elapsed;
 
       cb_mutex_enter(&engine->scrubber.lock);
       if (engine->scrubber.running) {
@@ -528,7 +1009,7 @@ static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
 
       if (engine->scrubber.started != 0) {
          if (engine->scrubber.stopped != 0) {
-            time_t diff = engine->scrubber.started - engine->scrubber.stopped;
+            time_t diff = engine->scrubber.stopped - engine->scrubber.started;
             len = sprintf(val, "%"PRIu64, (uint64_t)diff);
             add_stat("scrubber:last_run", 17, val, len, cookie);
          }
@@ -537,6 +1018,33 @@ static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
          add_stat("scrubber:visited", 16, val, len, cookie);
          len = sprintf(val, "%"PRIu64, engine->scrubber.cleaned);
          add_stat("scrubber:cleaned", 16, val, len, cookie);
+         len = sprintf(val, "%"PRIu64, (uint64_t)engine->scrubber.nthreads);
+         add_stat("scrubber:threads", 16, val, len, cookie);
+
+         /* The items may come and go while we run, so this is an estimate */
+         if (!engine->scrubber.running) {
+            percent = 100;
+         } else if (engine->scrubber.expected != 0) {
+            percent = engine->scrubber.visited * 100 /
+               engine->scrubber.expected;
+            if (percent > 100) {
+               percent = 100;
+            }
+         }
+         len = sprintf(val, "%"PRIu64, percent);
+         add_stat("scrubber:percent", 16, val, len, cookie);
+
+         if (engine->scrubber.running) {
+            elapsed = gethrtime() - engine->scrubber.start_time;
+         } else {
+            elapsed = engine->scrubber.stop_time - engine->scrubber.start_time;
+         }
+         if (elapsed != 0) {
+            rate = (uint64_t)((double)engine->scrubber.visited * 1000000000.0 /
+                              (double)elapsed);
+         }
+         len = sprintf(val, "%"PRIu64, rate);
+         add_stat("scrubber:items_per_second", 25, val, len, cookie);
       }
       cb_mutex_exit(&engine->scrubber.lock);
    } else {
@@ -554,10 +1062,65 @@ static ENGINE_ERROR_CODE default_store(ENGINE_HANDLE* handle,
                                        uint16_t vbucket) {
     struct default_engine *engine = get_handle(handle);
     VBUCKET_GUARD(engine, vbucket);
+    item_set_seqno(get_real_item(item), vbucket, 0);
     return store_item(engine, get_real_item(item), cas, operation,
                       cookie);
 }
 
+static ENGINE_ERROR_CODE default_store_multi(ENGINE_HANDLE* handle,
+                                             const void* cookie,
+                                             const engine_store_t *reqs,
+                                             int nreqs,
+                                             uint64_t *cas,
+                                             ENGINE_ERROR_CODE *status) {
+   struct default_engine *engine = get_handle(handle);
+   hash_item *items[64];
+   bool stop = false;
+   int base, num, ii;
+
+   for (base = 0; base < nreqs; base += num) {
+      num = nreqs - base;
+      if (num > 64) {
+         num = 64;
+      }
+
+      for (ii = 0; ii < num; ++ii) {
+         const engine_store_t *req = &reqs[base + ii];
+         item *it = NULL;
+
+         items[ii] = NULL;
+         cas[base + ii] = 0;
+         if (stop || !handled_vbucket(engine, req->vbucket)) {
+            /* Leave it (and the rest) to the caller */
+            status[base + ii] = ENGINE_NOT_MY_VBUCKET;
+            stop = true;
+            continue;
+         }
+         status[base + ii] = default_item_allocate(handle, cookie, &it,
+                                                   req->key, req->nkey,
+                                                   req->nvalue, req->flags,
+                                                   req->exptime,
+                                                   req->datatype);
+         if (status[base + ii] == ENGINE_SUCCESS) {
+            items[ii] = it;
+            item_write_value(engine, items[ii], 0, req->value, req->nvalue);
+            item_set_cas(handle, cookie, it, req->cas);
+            item_set_seqno(items[ii], req->vbucket, 0);
+         }
+      }
+
+      item_store_multi(engine, reqs + base, items, num, cas + base,
+                       status + base, cookie);
+
+      for (ii = 0; ii < num; ++ii) {
+         if (items[ii] != NULL) {
+            item_release(engine, items[ii]);
+         }
+      }
+   }
+   return ENGINE_SUCCESS;
+}
+
 static ENGINE_ERROR_CODE default_arithmetic(ENGINE_HANDLE* handle,
                                             const void* cookie,
                                             const void* key,
@@ -576,7 +1139,7 @@ static ENGINE_ERROR_CODE default_arithmetic(ENGINE_HANDLE* handle,
 
    return arithmetic(engine, cookie, key, nkey, increment,
                      create, delta, initial, engine->server.core->realtime(exptime), cas,
-                     datatype, result);
+                     datatype, result, vbucket);
 }
 
 static ENGINE_ERROR_CODE default_flush(ENGINE_HANDLE* handle,
@@ -590,13 +1153,125 @@ static void default_reset_stats(ENGINE_HANDLE* handle, const void *cookie) {
    struct default_engine *engine = get_handle(handle);
    item_stats_reset(engine);
 
-   cb_mutex_enter(&engine->stats.lock);
+   mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
    engine->stats.evictions = 0;
    engine->stats.reclaimed = 0;
    engine->stats.total_items = 0;
+   engine->stats.appends_in_place = 0;
+   engine->stats.patches_in_place = 0;
+   engine->stats.values_compressed = 0;
+   engine->stats.values_inflated = 0;
+   cb_mutex_exit(&engine->stats.lock);
+}
+
+static void default_get_mem_info(ENGINE_HANDLE* handle, const void *cookie,
+                                 engine_mem_info_t *info) {
+   struct default_engine *engine = get_handle(handle);
+   (void)cookie;
+
+   mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
+   info->limit = engine->slabs.mem_limit;
+   info->used = engine->slabs.mem_malloced;
+   cb_mutex_exit(&engine->slabs.lock);
+
+   mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+   info->evictions = engine->stats.evictions;
    cb_mutex_exit(&engine->stats.lock);
 }
 
+static ENGINE_ERROR_CODE default_set_mem_limit(ENGINE_HANDLE* handle,
+                                               const void *cookie,
+                                               size_t limit) {
+   struct default_engine *engine = get_handle(handle);
+   (void)cookie;
+
+   if (limit == 0) {
+      return ENGINE_EINVAL;
+   }
+   if (!slabs_set_mem_limit(engine, limit)) {
+      return ENGINE_ENOTSUP;
+   }
+
+   mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+   engine->config.maxbytes = limit;
+   cb_mutex_exit(&engine->stats.lock);
+   return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE default_patch(ENGINE_HANDLE* handle,
+                                       const void *cookie,
+                                       const void *key,
+                                       const uint16_t nkey,
+                                       uint64_t offset,
+                                       const void *data,
+                                       uint32_t length,
+                                       uint64_t *cas,
+                                       uint16_t vbucket) {
+   struct default_engine *engine = get_handle(handle);
+   VBUCKET_GUARD(engine, vbucket);
+
+   return item_patch(engine, cookie, key, nkey, offset, data, length, cas);
+}
+
+static ENGINE_ERROR_CODE default_sample(ENGINE_HANDLE* handle,
+                                        const void *cookie,
+                                        item **items,
+                                        int nitems,
+                                        int *nfound) {
+   struct default_engine *engine = get_handle(handle);
+   int found = item_sample(engine, (hash_item**)items, nitems);
+   int ii, jj;
+   (void)cookie;
+
+   /* The caller gets the values too, so read the ones in extstore in */
+   for (ii = 0, jj = 0; ii < found; ++ii) {
+      hash_item *it = items[ii];
+      if ((it->iflag & ITEM_HDR) != 0) {
+         it = item_ext_fetch(engine, it, NULL);
+      }
+      if (it != NULL) {
+         items[jj++] = it;
+      }
+   }
+
+   *nfound = jj;
+   return jj > 0 ? ENGINE_SUCCESS : ENGINE_KEY_ENOENT;
+}
+
+static ENGINE_ERROR_CODE default_touch(ENGINE_HANDLE* handle,
+                                       const void *cookie,
+                                       item **item,
+                                       const void *key,
+                                       const uint16_t nkey,
+                                       const rel_time_t exptime,
+                                       uint16_t vbucket) {
+   struct default_engine *engine = get_handle(handle);
+   hash_item *it;
+   VBUCKET_GUARD(engine, vbucket);
+
+   it = touch_item(engine, cookie, key, nkey,
+                   engine->server.core->realtime(exptime));
+   if (it == NULL) {
+      return ENGINE_KEY_ENOENT;
+   }
+
+   if (item == NULL) {
+      item_release(engine, it);
+      return ENGINE_SUCCESS;
+   }
+
+   if ((it->iflag & ITEM_HDR) != 0) {
+      /* We need the value */
+      it = item_ext_fetch(engine, it, cookie);
+      if (it == NULL) {
+         return ENGINE_KEY_ENOENT;
+      }
+   }
+   slabs_numa_hit(engine, it);
+   *item = it;
+   return ENGINE_SUCCESS;
+}
+
 static ENGINE_ERROR_CODE initalize_configuration(struct default_engine *se,
                                                  const char *cfg_str) {
    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
@@ -604,7 +1279,7 @@ static ENGINE_ERROR_CODE initalize_configuration(struct default_engine *se,
    se->config.vb0 = true;
 
    if (cfg_str != NULL) {
-       struct config_item items[13];
+       struct config_item items[60];
        int ii = 0;
 
        memset(&items, 0, sizeof(items));
@@ -667,9 +1342,244 @@ static ENGINE_ERROR_CODE initalize_configuration(struct default_engine *se,
        items[ii].value.dt_string = &se->config.uuid;
        ++ii;
 
+       items[ii].key = "lock_stripes";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.lock_stripes;
+       ++ii;
+
+       items[ii].key = "lru_segmented";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.lru_segmented;
+       ++ii;
+
+       items[ii].key = "hot_lru_pct";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.hot_lru_pct;
+       ++ii;
+
+       items[ii].key = "free_chunk_reserve";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.free_chunk_reserve;
+       ++ii;
+
+       items[ii].key = "temporary_ttl";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.temporary_ttl;
+       ++ii;
+
+       items[ii].key = "warm_lru_pct";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.warm_lru_pct;
+       ++ii;
+
+       items[ii].key = "tagged_assoc";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.tagged_assoc;
+       ++ii;
+
+       items[ii].key = "hashpower";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.hashpower;
+       ++ii;
+
+       items[ii].key = "hash_move_budget";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.hash_move_budget;
+       ++ii;
+
+       items[ii].key = "slab_reassign";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.slab_reassign;
+       ++ii;
+
+       items[ii].key = "slab_automove";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.slab_automove;
+       ++ii;
+
+       items[ii].key = "slab_defrag_pct";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.slab_defrag_pct;
+       ++ii;
+
+       items[ii].key = "slab_madvise";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.slab_madvise;
+       ++ii;
+
+       items[ii].key = "lru_crawler";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.lru_crawler;
+       ++ii;
+
+       items[ii].key = "lru_crawler_interval";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.lru_crawler_interval;
+       ++ii;
+
+       items[ii].key = "lru_crawler_sleep";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.lru_crawler_sleep;
+       ++ii;
+
+       items[ii].key = "slab_chunk_max";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.slab_chunk_max;
+       ++ii;
+
+       items[ii].key = "tiny_items";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.tiny_items;
+       ++ii;
+
+       items[ii].key = "slab_sizes";
+       items[ii].datatype = DT_STRING;
+       items[ii].value.dt_string = &se->config.slab_sizes;
+       ++ii;
+
+       items[ii].key = "slab_sizes_auto";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.slab_sizes_auto;
+       ++ii;
+
+       items[ii].key = "ext_path";
+       items[ii].datatype = DT_STRING;
+       items[ii].value.dt_string = &se->config.ext_path;
+       ++ii;
+
+       items[ii].key = "ext_size";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.ext_size;
+       ++ii;
+
+       items[ii].key = "ext_page_size";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.ext_page_size;
+       ++ii;
+
+       items[ii].key = "ext_item_size";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.ext_item_size;
+       ++ii;
+
+       items[ii].key = "ext_item_age";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.ext_item_age;
+       ++ii;
+
+       items[ii].key = "ext_recache_rate";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.ext_recache_rate;
+       ++ii;
+
+       items[ii].key = "restart_file";
+       items[ii].datatype = DT_STRING;
+       items[ii].value.dt_string = &se->config.restart_file;
+       ++ii;
+
+       items[ii].key = "hugepage_size";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.hugepage_size;
+       ++ii;
+
+       items[ii].key = "prefault_threads";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.prefault_threads;
+       ++ii;
+
+       items[ii].key = "numa";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.numa;
+       ++ii;
+
+       items[ii].key = "dcp";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.dcp;
+       ++ii;
+
+       items[ii].key = "dcp_log_size";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.dcp_log_size;
+       ++ii;
+
+       items[ii].key = "vbucket_index";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.vbucket_index;
+       ++ii;
+
+       items[ii].key = "vbucket_locks";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.vbucket_locks;
+       ++ii;
+
+       items[ii].key = "eviction_policy";
+       items[ii].datatype = DT_STRING;
+       items[ii].value.dt_string = &se->config.eviction_policy;
+       ++ii;
+
+       items[ii].key = "eviction_samples";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.eviction_samples;
+       ++ii;
+
+       items[ii].key = "expiry_wheel";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.expiry_wheel;
+       ++ii;
+
+       items[ii].key = "native_counters";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.native_counters;
+       ++ii;
+
+       items[ii].key = "lockless_get";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.lockless_get;
+       ++ii;
+
+       items[ii].key = "compression_threshold";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.compression_threshold;
+       ++ii;
+
+       items[ii].key = "scrub_threads";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.scrub_threads;
+       ++ii;
+
+       items[ii].key = "scrub_rate";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.scrub_rate;
+       ++ii;
+
+       items[ii].key = "namespace_delimiter";
+       items[ii].datatype = DT_STRING;
+       items[ii].value.dt_string = &se->config.namespace_delimiter;
+       ++ii;
+
+       items[ii].key = "namespace_slots";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.namespace_slots;
+       ++ii;
+
+       items[ii].key = "snapshot_file";
+       items[ii].datatype = DT_STRING;
+       items[ii].value.dt_string = &se->config.snapshot_file;
+       ++ii;
+
+       items[ii].key = "snapshot_load";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.snapshot_load;
+       ++ii;
+
+       items[ii].key = "snapshot_threads";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.snapshot_threads;
+       ++ii;
+
        items[ii].key = NULL;
        ++ii;
-       cb_assert(ii == 13);
+       cb_assert(ii == 60);
        ret = se->server.core->parse_config(cfg_str, items, stderr);
    }
 
@@ -726,7 +1636,12 @@ static bool rm_vbucket(struct default_engine *e,
                        const void *cookie,
                        protocol_binary_request_header *req,
                        ADD_RESPONSE response) {
-    set_vbucket_state(e, ntohs(req->request.vbucket), vbucket_state_dead);
+    uint16_t vbucket = ntohs(req->request.vbucket);
+    set_vbucket_state(e, vbucket, vbucket_state_dead);
+    if (e->config.vbucket_index) {
+        /* The dead vbucket doesn't take new items */
+        item_vbucket_delete(e, vbucket);
+    }
     return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
                     PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
 }
@@ -745,6 +1660,162 @@ static bool scrub_cmd(struct default_engine *e,
                     res, 0, cookie);
 }
 
+static bool slabs_reassign_cmd(struct default_engine *e,
+                               const void *cookie,
+                               protocol_binary_request_slabs_reassign *req,
+                               ADD_RESPONSE response) {
+    protocol_binary_response_status res = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    const char *msg = NULL;
+
+    if (req->message.header.request.extlen != sizeof(req->message.body)) {
+        msg = "Incorrect packet format";
+        res = PROTOCOL_BINARY_RESPONSE_EINVAL;
+    } else {
+        switch (slabs_reassign(e, ntohl(req->message.body.src),
+                               ntohl(req->message.body.dst))) {
+        case REASSIGN_OK:
+            break;
+        case REASSIGN_RUNNING:
+            res = PROTOCOL_BINARY_RESPONSE_EBUSY;
+            break;
+        case REASSIGN_BADCLASS:
+            msg = "Invalid slab class";
+            res = PROTOCOL_BINARY_RESPONSE_EINVAL;
+            break;
+        case REASSIGN_NOSPARE:
+            msg = "No spare pages in the source class";
+            res = PROTOCOL_BINARY_RESPONSE_EINVAL;
+            break;
+        case REASSIGN_SRC_DST_SAME:
+            msg = "Source and destination class are the same";
+            res = PROTOCOL_BINARY_RESPONSE_EINVAL;
+            break;
+        case REASSIGN_DISABLED:
+            res = PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED;
+            break;
+        }
+    }
+
+    return response(NULL, 0, NULL, 0, msg, msg ? (uint32_t)strlen(msg) : 0,
+                    PROTOCOL_BINARY_RAW_BYTES, res, 0, cookie);
+}
+
+static bool namespace_invalidate_cmd(struct default_engine *e,
+                                     const void *cookie,
+                                     protocol_binary_request_header *request,
+                                     ADD_RESPONSE response) {
+    protocol_binary_response_status res = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    uint16_t nkey = ntohs(request->request.keylen);
+    const char *msg = NULL;
+    uint64_t generation = 0;
+
+    if (e->namespaces.slots == NULL) {
+        res = PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED;
+    } else if (request->request.extlen != 0 || nkey == 0) {
+        msg = "Incorrect packet format";
+        res = PROTOCOL_BINARY_RESPONSE_EINVAL;
+    } else if (item_namespace_invalidate(e, request + 1, nkey,
+                                         &generation) != ENGINE_SUCCESS) {
+        msg = "Too many namespaces";
+        res = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+    } else {
+        generation = htonll(generation);
+        return response(NULL, 0, NULL, 0, &generation, sizeof(generation),
+                        PROTOCOL_BINARY_RAW_BYTES, res, 0, cookie);
+    }
+
+    return response(NULL, 0, NULL, 0, msg, msg ? (uint32_t)strlen(msg) : 0,
+                    PROTOCOL_BINARY_RAW_BYTES, res, 0, cookie);
+}
+
+static bool snapshot_cmd(struct default_engine *e, const void *cookie,
+                         protocol_binary_request_header *request,
+                         ADD_RESPONSE response) {
+    protocol_binary_response_status res = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    const char *msg = NULL;
+
+    if (e->config.snapshot_file == NULL) {
+        res = PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED;
+    } else if (request->request.extlen != 0 ||
+               request->request.keylen != 0 ||
+               request->request.bodylen != 0) {
+        msg = "Incorrect packet format";
+        res = PROTOCOL_BINARY_RESPONSE_EINVAL;
+    } else {
+        switch (snapshot_start(e)) {
+        case ENGINE_SUCCESS:
+            break;
+        case ENGINE_TMPFAIL:
+            msg = "A snapshot is being written";
+            res = PROTOCOL_BINARY_RESPONSE_EBUSY;
+            break;
+        default:
+            msg = "Failed to start the snapshot";
+            res = PROTOCOL_BINARY_RESPONSE_EINTERNAL;
+        }
+    }
+
+    return response(NULL, 0, NULL, 0, msg, msg ? (uint32_t)strlen(msg) : 0,
+                    PROTOCOL_BINARY_RAW_BYTES, res, 0, cookie);
+}
+
+/*
+ * Send the value of the item (copied out if it is chunked, as the
+ * response must be contiguous), and its key if key isn't NULL
+ */
+static bool item_response(struct default_engine *e, const void *cookie,
+                          hash_item *item, const void *key, uint16_t nkey,
+                          uint8_t datatype, ADD_RESPONSE response) {
+    bool ret;
+
+    if (item->iflag & ITEM_CHUNKED) {
+        char *value = malloc(item->nbytes);
+        if (value == NULL) {
+            return response(NULL, 0, NULL, 0, NULL, 0,
+                            PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_ENOMEM, 0, cookie);
+        }
+        item_read_value(e, item, value);
+        ret = response(key, nkey, &item->flags, sizeof(item->flags),
+                       value, item->nbytes, datatype,
+                       PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                       item_get_cas(item), cookie);
+        free(value);
+    } else {
+        ret = response(key, nkey, &item->flags, sizeof(item->flags),
+                       item_get_data(item), item->nbytes, datatype,
+                       PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                       item_get_cas(item), cookie);
+    }
+    return ret;
+}
+
+static bool get_random_key(struct default_engine *e, const void *cookie,
+                           protocol_binary_request_header *request,
+                           ADD_RESPONSE response) {
+    item *picked;
+    hash_item *it;
+    int found;
+    bool ret;
+
+    if (request->request.extlen != 0 || request->request.keylen != 0) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    if (default_sample((ENGINE_HANDLE*)&e->engine, cookie, &picked, 1,
+                       &found) != ENGINE_SUCCESS) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0, cookie);
+    }
+    it = get_real_item(picked);
+
+    ret = item_response(e, cookie, it, item_get_key(it), it->nkey,
+                        it->datatype, response);
+    item_release(e, it);
+    return ret;
+}
+
 static bool touch(struct default_engine *e, const void *cookie,
                   protocol_binary_request_header *request,
                   ADD_RESPONSE response) {
@@ -753,8 +1824,8 @@ static bool touch(struct default_engine *e, const void *cookie,
     void *key;
     uint32_t exptime;
     uint16_t nkey;
-    hash_item *item;
-
+    item *item = NULL;
+    ENGINE_ERROR_CODE ret;
 
     if (request->request.extlen != 4 || request->request.keylen == 0) {
         return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
@@ -765,9 +1836,15 @@ static bool touch(struct default_engine *e, const void *cookie,
     key = t->bytes + sizeof(t->bytes);
     exptime = ntohl(t->message.body.expiration);
     nkey = ntohs(request->request.keylen);
-    item = touch_item(e, key, nkey, e->server.core->realtime(exptime));
+    ret = default_touch((ENGINE_HANDLE*)&e->engine, cookie,
+                        request->request.opcode != PROTOCOL_BINARY_CMD_TOUCH ?
+                        &item : NULL, key, nkey, exptime,
+                        ntohs(request->request.vbucket));
 
-    if (item == NULL) {
+    if (ret == ENGINE_NOT_MY_VBUCKET) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET, 0, cookie);
+    } else if (ret != ENGINE_SUCCESS) {
         if (request->request.opcode == PROTOCOL_BINARY_CMD_GATQ) {
             return true;
         } else {
@@ -775,19 +1852,16 @@ static bool touch(struct default_engine *e, const void *cookie,
                             PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0, cookie);
         }
     } else {
-        bool ret;
-        if (request->request.opcode == PROTOCOL_BINARY_CMD_TOUCH) {
-            ret = response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
-                           PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+        bool sent;
+        if (item == NULL) {
+            sent = response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                            PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
         } else {
-            ret = response(NULL, 0, &item->flags, sizeof(item->flags),
-                           item_get_data(item), item->nbytes,
-                           PROTOCOL_BINARY_RAW_BYTES,
-                           PROTOCOL_BINARY_RESPONSE_SUCCESS,
-                           item_get_cas(item), cookie);
+            sent = item_response(e, cookie, item, NULL, 0,
+                                 PROTOCOL_BINARY_RAW_BYTES, response);
+            item_release(e, item);
         }
-        item_release(e, item);
-        return ret;
+        return sent;
     }
 }
 
@@ -803,6 +1877,18 @@ static ENGINE_ERROR_CODE default_unknown_command(ENGINE_HANDLE* handle,
     case PROTOCOL_BINARY_CMD_SCRUB:
         sent = scrub_cmd(e, cookie, request, response);
         break;
+    case PROTOCOL_BINARY_CMD_SLABS_REASSIGN:
+        sent = slabs_reassign_cmd(e, cookie, (void*)request, response);
+        break;
+    case PROTOCOL_BINARY_CMD_NAMESPACE_INVALIDATE:
+        sent = namespace_invalidate_cmd(e, cookie, request, response);
+        break;
+    case PROTOCOL_BINARY_CMD_SNAPSHOT:
+        sent = snapshot_cmd(e, cookie, request, response);
+        break;
+    case PROTOCOL_BINARY_CMD_GET_RANDOM_KEY:
+        sent = get_random_key(e, cookie, request, response);
+        break;
     case PROTOCOL_BINARY_CMD_DEL_VBUCKET:
         sent = rm_vbucket(e, cookie, request, response);
         break;
@@ -831,36 +1917,77 @@ static ENGINE_ERROR_CODE default_unknown_command(ENGINE_HANDLE* handle,
 }
 
 
-uint64_t item_get_cas(const hash_item* item)
-{
-    if (item->iflag & ITEM_WITH_CAS) {
-        return *(uint64_t*)(item + 1);
-    }
-    return 0;
-}
+#define ITEM_LAYOUT_SIZE(f) \
+    ((((f) & ITEM_WITH_CAS) ? sizeof(uint64_t) : 0) + \
+     (((f) & ITEM_WITH_SEQNO) ? sizeof(uint64_t) : 0) + \
+     (((f) & ITEM_WITH_VBLINKS) ? sizeof(struct item_vb_links) : 0) + \
+     (((f) & ITEM_WITH_COST) ? sizeof(struct item_cost) : 0) + \
+     (((f) & ITEM_WITH_EXPIRY) ? sizeof(struct item_expiry_links) : 0) + \
+     (((f) & ITEM_WITH_COUNTER) ? sizeof(uint64_t) : 0))
+#define ITEM_LAYOUT_SIZE4(f) \
+    ITEM_LAYOUT_SIZE(f), ITEM_LAYOUT_SIZE((f) + 1), \
+    ITEM_LAYOUT_SIZE((f) + 2), ITEM_LAYOUT_SIZE((f) + 3)
+#define ITEM_LAYOUT_SIZE16(f) \
+    ITEM_LAYOUT_SIZE4(f), ITEM_LAYOUT_SIZE4((f) + 4), \
+    ITEM_LAYOUT_SIZE4((f) + 8), ITEM_LAYOUT_SIZE4((f) + 12)
+
+const uint8_t item_layout_size[ITEM_LAYOUT_MASK + 1] = {
+    ITEM_LAYOUT_SIZE16(0), ITEM_LAYOUT_SIZE16(16),
+    ITEM_LAYOUT_SIZE16(32), ITEM_LAYOUT_SIZE16(48)
+};
 
 void item_set_cas(ENGINE_HANDLE *handle, const void *cookie,
                   item* item, uint64_t val)
 {
     hash_item* it = get_real_item(item);
     if (it->iflag & ITEM_WITH_CAS) {
-        *(uint64_t*)(it + 1) = val;
+        memcpy(item_header_end(it), &val, sizeof(val));
     }
 }
 
-const void* item_get_key(const hash_item* item)
+/* The word holding the vbucket (top bits) and the seqno of the item */
+static char *item_seqno_word(const hash_item* item)
 {
-    char *ret = (void*)(item + 1);
-    if (item->iflag & ITEM_WITH_CAS) {
-        ret += sizeof(uint64_t);
+    return item_layout_word(item, ITEM_WITH_SEQNO);
+}
+
+uint64_t item_get_seqno(const hash_item* item)
+{
+    uint64_t ret = 0;
+    if (item->iflag & ITEM_WITH_SEQNO) {
+        memcpy(&ret, item_seqno_word(item), sizeof(ret));
     }
+    return ret & DCP_SEQNO_MASK;
+}
 
-    return ret;
+uint16_t item_get_vbucket(const hash_item* item)
+{
+    uint64_t ret = 0;
+    if (item->iflag & ITEM_WITH_SEQNO) {
+        memcpy(&ret, item_seqno_word(item), sizeof(ret));
+    }
+    return (uint16_t)(ret >> DCP_SEQNO_BITS);
 }
 
-char* item_get_data(const hash_item* item)
+void item_set_seqno(hash_item* item, uint16_t vbucket, uint64_t seqno)
 {
-    return ((char*)item_get_key(item)) + item->nkey;
+    if (item->iflag & ITEM_WITH_SEQNO) {
+        uint64_t val = ((uint64_t)vbucket << DCP_SEQNO_BITS) |
+            (seqno & DCP_SEQNO_MASK);
+        memcpy(item_seqno_word(item), &val, sizeof(val));
+    }
+}
+
+void item_set_cost(ENGINE_HANDLE *handle, const void *cookie,
+                   item* item, uint32_t cost)
+{
+    hash_item* it = get_real_item(item);
+    if (it->iflag & ITEM_WITH_COST) {
+        struct item_cost val;
+        memcpy(&val, item_get_cost(it), sizeof(val));
+        val.cost = cost;
+        memcpy(item_get_cost(it), &val, sizeof(val));
+    }
 }
 
 uint8_t item_get_clsid(const hash_item* item)
@@ -872,7 +1999,13 @@ static bool get_item_info(ENGINE_HANDLE *handle, const void *cookie,
                           const item* item, item_info *item_info)
 {
     hash_item* it = (hash_item*)item;
-    if (item_info->nvalue < 1) {
+    int nvalue;
+    if (item_info->nvalue < 1 || (it->iflag & ITEM_HDR) != 0) {
+        return false;
+    }
+    nvalue = item_get_value_iov(get_handle(handle), it, item_info->value,
+                                item_info->nvalue);
+    if (nvalue > item_info->nvalue) {
         return false;
     }
     item_info->cas = item_get_cas(it);
@@ -881,10 +2014,8 @@ static bool get_item_info(ENGINE_HANDLE *handle, const void *cookie,
     item_info->flags = it->flags;
     item_info->clsid = it->slabs_clsid;
     item_info->nkey = it->nkey;
-    item_info->nvalue = 1;
+    item_info->nvalue = (uint16_t)nvalue;
     item_info->key = item_get_key(it);
-    item_info->value[0].iov_base = item_get_data(it);
-    item_info->value[0].iov_len = it->nbytes;
     item_info->datatype = it->datatype;
     return true;
 }
@@ -947,7 +2078,7 @@ static ENGINE_ERROR_CODE default_tap_notify(ENGINE_HANDLE* handle,
                 return ret;
             }
         }
-        memcpy(item_get_data(it), data, ndata);
+        item_write_value(engine, it, 0, data, ndata);
         engine->server.cookie->store_engine_specific(cookie, NULL);
         item_set_cas(handle, cookie, it, cas);
         ret = default_store(handle, cookie, it, &cas, OPERATION_SET, vbucket);
@@ -1012,7 +2143,8 @@ static TAP_ITERATOR default_get_tap_iterator(ENGINE_HANDLE* handle,
         return NULL;
     }
 
-    if (!initialize_item_tap_walker(engine, cookie)) {
+    if (!initialize_item_tap_walker(engine, cookie, flags,
+                                    userdata, nuserdata)) {
         /* Failed to create */
         cb_mutex_enter(&engine->tap_connections.lock);
         engine->tap_connections.clients[ii] = NULL;
@@ -1032,11 +2164,19 @@ static void default_handle_disconnect(const void *cookie,
     cb_mutex_enter(&engine->tap_connections.lock);
     for (ii = 0; ii < engine->tap_connections.size; ++ii) {
         if (engine->tap_connections.clients[ii] == cookie) {
-            free(engine->server.cookie->get_engine_specific(cookie));
+            destroy_item_tap_walker(engine, cookie);
             break;
         }
     }
     cb_mutex_exit(&engine->tap_connections.lock);
+
+    if (extstore_enabled(engine)) {
+        extstore_disconnect(engine, cookie);
+    }
+
+    if (engine->config.dcp) {
+        dcp_disconnect(engine, cookie);
+    }
 }
 
 
@@ -1044,19 +2184,10 @@ static ENGINE_ERROR_CODE dcp_step(ENGINE_HANDLE* handle, const void* cookie,
                                   struct dcp_message_producers *producers)
 {
     struct default_engine* engine = get_handle(handle);
-    struct dcp_connection *connection;
-    ENGINE_ERROR_CODE ret;
-
-    fprintf(stderr, "STEP\n");
-
-    connection = engine->server.cookie->get_engine_specific(cookie);
-    if (connection == NULL) {
-        ret = ENGINE_EINVAL;
-    } else {
-        ret = item_dcp_step(engine, connection, cookie, producers);
+    if (!engine->config.dcp) {
+        return ENGINE_ENOTSUP;
     }
-    fprintf(stderr, "STEP returns: %u\n", ret);
-    return ret;
+    return dcp_producer_step(engine, cookie, producers);
 }
 
 static ENGINE_ERROR_CODE dcp_open(ENGINE_HANDLE* handle,
@@ -1067,7 +2198,11 @@ static ENGINE_ERROR_CODE dcp_open(ENGINE_HANDLE* handle,
                                   void *name,
                                   uint16_t nname)
 {
-    return ENGINE_ENOTSUP;
+    struct default_engine* engine = get_handle(handle);
+    if (!engine->config.dcp) {
+        return ENGINE_ENOTSUP;
+    }
+    return dcp_producer_open(engine, cookie, opaque, flags);
 }
 
 static ENGINE_ERROR_CODE dcp_add_stream(ENGINE_HANDLE* handle,
@@ -1088,7 +2223,10 @@ static ENGINE_ERROR_CODE dcp_close_stream(ENGINE_HANDLE* handle,
 {
     struct default_engine* engine = get_handle(handle);
     VBUCKET_GUARD(engine, vbucket);
-    return ENGINE_ENOTSUP;
+    if (!engine->config.dcp) {
+        return ENGINE_ENOTSUP;
+    }
+    return dcp_producer_close_stream(engine, cookie, vbucket);
 }
 
 static ENGINE_ERROR_CODE dcp_stream_req(ENGINE_HANDLE* handle, const void* cookie,
@@ -1104,44 +2242,13 @@ static ENGINE_ERROR_CODE dcp_stream_req(ENGINE_HANDLE* handle, const void* cooki
                                         dcp_add_failover_log callback)
 {
     struct default_engine* engine = get_handle(handle);
-    struct dcp_connection *connection;
-    vbucket_failover_t id;
     VBUCKET_GUARD(engine, vbucket);
-
-    if (vbucket_uuid != 0xfeeddeca) {
-        /* @todo trond - add this to the protocol spec */
-        return ENGINE_KEY_ENOENT;
-    }
-
-    if (start_seqno != 0) {
-        /* Currently I can't continue a stream */
-        *rollback_seqno = 0;
-        return ENGINE_ROLLBACK;
-    }
-
-    if (engine->server.cookie->get_engine_specific(cookie) != NULL) {
-        /* Someone is already running a stream req */
-        return ENGINE_TMPFAIL;
-    }
-
-    if ((connection = calloc(1, sizeof(*connection))) == NULL) {
-        return ENGINE_ENOMEM;
+    if (!engine->config.dcp) {
+        return ENGINE_ENOTSUP;
     }
-
-    connection->flags = flags;
-    connection->opaque = opaque;
-    connection->vbucket = vbucket;
-    connection->start_seqno = start_seqno;
-    connection->end_seqno = end_seqno;
-    connection->vbucket_uuid = vbucket_uuid;
-    connection->snap_start_seqno = snap_start_seqno;
-    connection->snap_end_seqno = snap_end_seqno;
-
-    link_dcp_walker(engine, connection);
-    engine->server.cookie->store_engine_specific(cookie, connection);
-    id.uuid = 0xfeeddeca;
-    id.seqno = 0;
-    return callback(&id, 1, cookie);
+    return dcp_producer_stream_req(engine, cookie, flags, opaque, vbucket,
+                                   start_seqno, end_seqno, vbucket_uuid,
+                                   rollback_seqno, callback);
 }
 
 static ENGINE_ERROR_CODE dcp_get_failover_log(ENGINE_HANDLE* handle,
@@ -1154,9 +2261,13 @@ static ENGINE_ERROR_CODE dcp_get_failover_log(ENGINE_HANDLE* handle,
 {
     struct default_engine* engine = get_handle(handle);
     vbucket_failover_t id;
-    id.uuid = 0xfeeddeca;
-    id.seqno = 0;
     VBUCKET_GUARD(engine, vbucket);
+    if (!engine->config.dcp) {
+        return ENGINE_ENOTSUP;
+    }
+    /* The uuid never changes while we're up */
+    id.uuid = engine->dcp.uuid;
+    id.seqno = 0;
     return failover_log(&id, 1, cookie);
 }
 
@@ -1166,8 +2277,11 @@ static ENGINE_ERROR_CODE dcp_stream_end(ENGINE_HANDLE* handle, const void* cooki
                                         uint32_t flags)
 {
     struct default_engine* engine = get_handle(handle);
-    VBUCKET_GUARD(engine, vbucket);
-    return ENGINE_ENOTSUP;
+    REPLICA_VBUCKET_GUARD(engine, vbucket);
+    if (!engine->config.dcp) {
+        return ENGINE_ENOTSUP;
+    }
+    return dcp_consumer_flush(engine, cookie);
 }
 
 static ENGINE_ERROR_CODE dcp_snapshot_marker(ENGINE_HANDLE* handle, const void* cookie,
@@ -1178,8 +2292,11 @@ static ENGINE_ERROR_CODE dcp_snapshot_marker(ENGINE_HANDLE* handle, const void*
                                              uint32_t flags)
 {
     struct default_engine* engine = get_handle(handle);
-    VBUCKET_GUARD(engine, vbucket);
-    return ENGINE_ENOTSUP;
+    REPLICA_VBUCKET_GUARD(engine, vbucket);
+    if (!engine->config.dcp) {
+        return ENGINE_ENOTSUP;
+    }
+    return dcp_consumer_marker(engine, cookie, vbucket, end_seqno);
 }
 
 static ENGINE_ERROR_CODE dcp_mutation(ENGINE_HANDLE* handle, const void* cookie,
@@ -1201,8 +2318,13 @@ static ENGINE_ERROR_CODE dcp_mutation(ENGINE_HANDLE* handle, const void* cookie,
                                       uint8_t nru)
 {
     struct default_engine* engine = get_handle(handle);
-    VBUCKET_GUARD(engine, vbucket);
-    return ENGINE_ENOTSUP;
+    REPLICA_VBUCKET_GUARD(engine, vbucket);
+    if (!engine->config.dcp) {
+        return ENGINE_ENOTSUP;
+    }
+    return dcp_consumer_mutation(engine, cookie, key, nkey, value, nvalue,
+                                 vbucket, flags, datatype, by_seqno,
+                                 expiration);
 }
 
 static ENGINE_ERROR_CODE dcp_deletion(ENGINE_HANDLE* handle, const void* cookie,
@@ -1217,8 +2339,11 @@ static ENGINE_ERROR_CODE dcp_deletion(ENGINE_HANDLE* handle, const void* cookie,
                                       uint16_t nmeta)
 {
     struct default_engine* engine = get_handle(handle);
-    VBUCKET_GUARD(engine, vbucket);
-    return ENGINE_ENOTSUP;
+    REPLICA_VBUCKET_GUARD(engine, vbucket);
+    if (!engine->config.dcp) {
+        return ENGINE_ENOTSUP;
+    }
+    return dcp_consumer_deletion(engine, cookie, key, nkey);
 }
 
 static ENGINE_ERROR_CODE dcp_expiration(ENGINE_HANDLE* handle, const void* cookie,
@@ -1229,12 +2354,15 @@ static ENGINE_ERROR_CODE dcp_expiration(ENGINE_HANDLE* handle, const void* cooki
                                         uint16_t vbucket,
                                         uint64_t by_seqno,
                                         uint64_t rev_seqno,
-                                        const void *meta,
-                                        uint16_t nmeta)
+                                      const void *meta,
+                                      uint16_t nmeta)
 {
     struct default_engine* engine = get_handle(handle);
-    VBUCKET_GUARD(engine, vbucket);
-    return ENGINE_ENOTSUP;
+    REPLICA_VBUCKET_GUARD(engine, vbucket);
+    if (!engine->config.dcp) {
+        return ENGINE_ENOTSUP;
+    }
+    return dcp_consumer_deletion(engine, cookie, key, nkey);
 }
 
 static  ENGINE_ERROR_CODE dcp_flush(ENGINE_HANDLE* handle, const void* cookie,
@@ -1252,6 +2380,17 @@ static ENGINE_ERROR_CODE dcp_set_vbucket_state(ENGINE_HANDLE* handle, const void
                                                vbucket_state_t state)
 {
     struct default_engine* engine = get_handle(handle);
-    VBUCKET_GUARD(engine, vbucket);
-    return ENGINE_ENOTSUP;
+    ENGINE_ERROR_CODE ret;
+    REPLICA_VBUCKET_GUARD(engine, vbucket);
+    if (!engine->config.dcp) {
+        return ENGINE_ENOTSUP;
+    }
+    if (!is_valid_vbucket_state_t(state)) {
+        return ENGINE_EINVAL;
+    }
+    /* Everything before the takeover goes in before we serve it */
+    if ((ret = dcp_consumer_flush(engine, cookie)) == ENGINE_SUCCESS) {
+        set_vbucket_state(engine, vbucket, state);
+    }
+    return ret;
 }
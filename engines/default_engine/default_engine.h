@@ -11,6 +11,7 @@
 #include "config.h"
 
 #include <stdbool.h>
+#include <string.h>
 
 #include <memcached/engine.h>
 #include <memcached/util.h>
@@ -36,6 +37,9 @@ struct default_engine;
 #include "items.h"
 #include "assoc.h"
 #include "slabs.h"
+#include "extstore.h"
+#include "dcp.h"
+#include "snapshot.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -43,16 +47,47 @@ extern "C" {
 
    /* Flags */
 #define ITEM_WITH_CAS 1
+/* The vbucket and seqno of the item follow the CAS (see dcp.h) */
+#define ITEM_WITH_SEQNO 2
+/* The links in the list of its vbucket follow the seqno (see vbucket_index) */
+#define ITEM_WITH_VBLINKS 4
+/* The cost and priority of the item follow the links (see eviction_policy) */
+#define ITEM_WITH_COST 8
+/* The links in the expiry wheel follow the cost (see expiry_wheel) */
+#define ITEM_WITH_EXPIRY 16
+/* The native value of a counter follows the expiry links (see native_counters) */
+#define ITEM_WITH_COUNTER 32
+/* The counter word holds the value, and the text is made from it */
+#define ITEM_COUNTER 64
+/* The item lives in a tiny slab class: its header ends before the LRU
+ * links, and eviction goes by the CLOCK of the class (see tiny_items) */
+#define ITEM_TINY 128
 
 #define ITEM_LINKED (1<<8)
 
 /* temp */
 #define ITEM_SLABBED (2<<8)
 
+/* The item has been accessed since the LRU maintainer last moved it */
+#define ITEM_ACTIVE (4<<8)
+
+/* The LRU segment the item lives in (hot if none of them are set) */
+#define ITEM_WARM (8<<8)
+#define ITEM_COLD (16<<8)
+
+/* The value is stored in a chain of chunks (see item_chunk_head in items.c) */
+#define ITEM_CHUNKED (32<<8)
+/* This is one of the chunks holding the value of an ITEM_CHUNKED item */
+#define ITEM_CHUNK (64<<8)
+/* The value lives in extstore; the item only holds where (see extstore.h) */
+#define ITEM_HDR (128<<8)
+
 struct config {
    bool use_cas;
    size_t verbose;
    rel_time_t oldest_live;
+   /* The CAS taken by the last flush_all (see item_is_flushed) */
+   uint64_t oldest_cas;
    bool evict_to_free;
    size_t maxbytes;
    bool preallocate;
@@ -62,6 +97,67 @@ struct config {
    bool ignore_vbucket;
    bool vb0;
    char *uuid;
+   size_t lock_stripes;
+   bool lru_segmented;
+   size_t hot_lru_pct;
+   size_t warm_lru_pct;
+   /* The items which expire within this many seconds go to the temp
+    * segment (0 is off) */
+   size_t temporary_ttl;
+   /* The LRU maintainer evicts ahead of the allocations to keep this
+    * many free chunks in every full slab class (0 is off) */
+   size_t free_chunk_reserve;
+   bool tagged_assoc;
+   size_t hashpower;
+   size_t hash_move_budget;
+   bool slab_reassign;
+   bool slab_automove;
+   size_t slab_defrag_pct;
+   bool slab_madvise;
+   bool lru_crawler;
+   size_t lru_crawler_interval;
+   size_t lru_crawler_sleep;
+   size_t slab_chunk_max;
+   /* The slab classes with chunks up to this size hold tiny items (0 is off) */
+   size_t tiny_items;
+   /* The chunk sizes of the slab classes ("96-120-...", NULL for the
+    * geometric series of factor) */
+   char *slab_sizes;
+   /* Count the allocations by size to derive slab_sizes from (see
+    * "stats slab_sizes") */
+   bool slab_sizes_auto;
+   char *ext_path;
+   size_t ext_size;
+   size_t ext_page_size;
+   size_t ext_item_size;
+   size_t ext_item_age;
+   size_t ext_recache_rate;
+   char *restart_file;
+   size_t hugepage_size;
+   size_t prefault_threads;
+   bool numa;
+   bool dcp;
+   size_t dcp_log_size;
+   bool vbucket_index;
+   size_t vbucket_locks;
+   /* "lru" or "gdsf" (evict the cheapest of the items at the tail) */
+   char *eviction_policy;
+   bool eviction_gdsf;
+   size_t eviction_samples;
+   bool expiry_wheel;
+   bool native_counters;
+   bool lockless_get;
+   /* Store the values of at least this many bytes compressed (0 is off) */
+   size_t compression_threshold;
+   size_t scrub_threads;
+   size_t scrub_rate;
+   /* The keys up to the first of it are in a namespace (NULL is off) */
+   char *namespace_delimiter;
+   size_t namespace_slots;
+   /* Where the snapshot command writes to (and snapshot_load reads from) */
+   char *snapshot_file;
+   bool snapshot_load;
+   size_t snapshot_threads;
 };
 
 MEMCACHED_PUBLIC_API
@@ -72,6 +168,16 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
 /**
  * Statistic information collected by the default engine
  */
+/* The size histogram of "stats sizes" has buckets of 32 bytes up to 1MB */
+#define ITEM_SIZE_GRANULARITY 32
+#define ITEM_SIZE_BUCKETS 32768
+
+/*
+ * The age and ttl histograms of "stats ages" have a bucket per power of
+ * two seconds (bucket n > 0 holds the ones from 2^(n-1) up to 2^n)
+ */
+#define ITEM_AGE_BUCKETS 32
+
 struct engine_stats {
    cb_mutex_t lock;
    uint64_t evictions;
@@ -79,29 +185,144 @@ struct engine_stats {
    uint64_t curr_bytes;
    uint64_t curr_items;
    uint64_t total_items;
+   /* The appends done without building a new item */
+   uint64_t appends_in_place;
+   uint64_t patches_in_place;
+   /* The values we compressed when they were stored, and the ones we had
+    * to inflate to append to or do arithmetic on */
+   uint64_t values_compressed;
+   uint64_t values_inflated;
+   /* The linked items by size, kept up to date on link and unlink */
+   uint32_t sizes[ITEM_SIZE_BUCKETS];
+};
+
+/* The items of a slab class seen by a run of the LRU crawler */
+struct item_age_histogram {
+   uint32_t age[ITEM_AGE_BUCKETS];
+   uint32_t ttl[ITEM_AGE_BUCKETS];
+   /* The ones that don't expire */
+   uint32_t no_ttl;
 };
 
 struct engine_scrubber {
    cb_mutex_t lock;
+   /* Signalled to wake the workers up when we're shutting down */
+   cb_cond_t cond;
    bool running;
+   bool shutdown;
+   /* The workers of the current (or last) run, and how many still run */
+   cb_thread_t *tids;
+   size_t nthreads;
+   size_t active;
+   /* The next slab class for a worker to pick up */
+   unsigned int next_class;
+   /* The number of items when the run started (for the progress) */
+   uint64_t expected;
+   hrtime_t start_time;
+   hrtime_t stop_time;
    uint64_t visited;
    uint64_t cleaned;
    time_t started;
    time_t stopped;
 };
 
+struct lru_maintainer {
+   cb_mutex_t lock;
+   cb_cond_t cond;
+   cb_thread_t tid;
+   bool running;
+   bool shutdown;
+   uint64_t juggles;
+   /* The items evicted to keep the free chunk reserves */
+   uint64_t evicted_ahead;
+};
+
+struct lru_crawler {
+   cb_mutex_t lock;
+   cb_cond_t cond;
+   cb_thread_t tid;
+   bool running;
+   bool shutdown;
+   /* Are we in the middle of a run over the LRUs? */
+   bool crawling;
+   uint64_t starts;
+   /* What the last complete run saw (per slab class), and what this one
+    * has seen so far (only touched by the crawler thread) */
+   struct item_age_histogram *ages;
+   struct item_age_histogram *next_ages;
+   uint64_t ages_runs;
+};
+
+/*
+ * The expiry wheel has EXPIRY_WHEEL_LEVELS levels of EXPIRY_WHEEL_SLOTS
+ * slots. A slot of level n covers 64^n seconds, so it reaches about 194
+ * days out (the ones further away wait in the last level).
+ */
+#define EXPIRY_WHEEL_BITS 6
+#define EXPIRY_WHEEL_SLOTS (1 << EXPIRY_WHEEL_BITS)
+#define EXPIRY_WHEEL_LEVELS 4
+
+struct expiry_wheel {
+   /* Taken after the item lock and the LRU lock */
+   cb_mutex_t lock;
+   cb_cond_t cond;
+   cb_thread_t tid;
+   bool running;
+   bool shutdown;
+   /* The next second to expire the items of; the ones before it are done */
+   rel_time_t now;
+   hash_item *slots[EXPIRY_WHEEL_LEVELS][EXPIRY_WHEEL_SLOTS];
+   uint64_t items;
+   uint64_t reclaimed;
+};
+
+struct tap_client;
+
 struct tap_connections {
     cb_mutex_t lock;
     size_t size;
     const void* *clients;
+    /* The walkers of the clients (for the progress stats) */
+    struct tap_client *walkers;
+    /* What the walkers which are gone have sent */
+    uint64_t items_sent;
+    uint64_t backfills;
 };
 
 struct vbucket_info {
-    int state : 2;
+    unsigned int state : 3;
 };
 
 #define NUM_VBUCKETS 65536
 
+/* The items of a vbucket, in the order they were linked */
+struct vbucket_items {
+    hash_item *head;
+    hash_item *tail;
+    uint64_t items;
+    uint64_t bytes;
+};
+
+/* The default number of locks of the vbucket lists (vbucket_locks) */
+#define VBUCKET_INDEX_LOCKS 64
+
+/*
+ * A namespace which has been invalidated: the items of it with a CAS
+ * below oldest_cas are dead. The hash is never 0 in a slot in use, and
+ * is written last (see item_namespace_invalidate); the name doesn't
+ * change after that.
+ */
+struct namespace_slot {
+    volatile uint32_t hash;
+    uint32_t generation;
+    volatile uint64_t oldest_cas;
+    char *name;
+    size_t nname;
+};
+
+/* The default number of slots of the namespace table (namespace_slots) */
+#define NAMESPACE_SLOTS 16384
+
 /**
  * Definition of the private instance data used by the default engine.
  *
@@ -122,14 +343,43 @@ struct default_engine {
    struct items items;
 
    /**
-    * The cache layer (item_* and assoc_*) is currently protected by
-    * this single mutex
+    * An item (and the assoc bucket it hashes into) is protected by one
+    * of these locks, picked by the low bits of the key hash. The LRU
+    * lists are protected by the per-class items.lock and the slab
+    * allocator by slabs.lock. See the locking notes at the top of items.c
     */
-   cb_mutex_t cache_lock;
+   struct {
+      cb_mutex_t *locks;
+      /* The sequence of every stripe (see item_seq_write_begin) */
+      struct item_lock_seq *seqs;
+      unsigned int size;
+   } item_locks;
+
+   /**
+    * The lookups running without the item locks (with lockless_get). The
+    * hash tables and slab pages they may be looking at are only freed (or
+    * handed to another class) once all of them have left the epoch they
+    * entered in. See item_epoch_synchronize
+    */
+   struct {
+      volatile uint64_t current;
+      struct item_epoch_slot slots[ITEM_EPOCH_SLOTS];
+   } epochs;
 
    struct config config;
    struct engine_stats stats;
+   /**
+    * The last CAS value handed out. Bumped atomically (see get_cas_id)
+    * so that the store path doesn't need a global lock for it
+    */
+   volatile uint64_t cas_id;
    struct engine_scrubber scrubber;
+   struct lru_maintainer lru_maintainer;
+   struct lru_crawler lru_crawler;
+   struct expiry_wheel expiry;
+   struct extstore ext;
+   struct dcp dcp;
+   struct snapshot snapshot;
    struct tap_connections tap_connections;
 
    union {
@@ -139,12 +389,193 @@ struct default_engine {
    } info;
 
    char vbucket_infos[NUM_VBUCKETS];
+
+   /**
+    * With vbucket_index every linked item is also on the list of its
+    * vbucket (lists[vbucket]), so that we may get to the items of a
+    * vbucket without walking all of the LRUs. A list is protected by
+    * lock vbucket % nlocks (with vbucket_locks of 65536 every vbucket
+    * has one of its own), which is taken after the item lock and the
+    * LRU lock.
+    */
+   struct {
+      cb_mutex_t *locks;
+      unsigned int nlocks;
+      struct vbucket_items *lists;
+   } vbucket_index;
+
+   /**
+    * With namespace_delimiter the namespaces that have been invalidated,
+    * in an open addressed table of namespace_slots slots (by the hash of
+    * the name). The lookups don't take the lock; invalidations do.
+    */
+   struct {
+      cb_mutex_t lock;
+      struct namespace_slot *slots;
+      size_t mask;
+      volatile size_t used;
+      uint64_t invalidations;
+   } namespaces;
+
+   /**
+    * The contention of the busiest locks (with lock_stats_sample in the
+    * daemon, see mc_mutex_enter). The stripes of item_locks and the LRU
+    * locks share one each.
+    */
+   struct {
+      mc_mutex_stats_t items;
+      mc_mutex_stats_t lru;
+      mc_mutex_stats_t slabs;
+      mc_mutex_stats_t assoc;
+      mc_mutex_stats_t stats;
+      mc_mutex_stats_t vbuckets;
+   } lock_stats;
 };
 
-char* item_get_data(const hash_item* item);
-const void* item_get_key(const hash_item* item);
+/* The ITEM_WITH_* flags (the ones telling what follows the header) */
+#define ITEM_LAYOUT_MASK 63
+
+/*
+ * The size of the words between the item header and the key for each
+ * combination of the ITEM_WITH_* flags. The words come in the order of
+ * their flags, so the one for a flag starts at
+ * item_layout_size[iflag & (flag - 1)]: finding any of them is a load
+ * from this table rather than a walk past the ones in front of it.
+ */
+extern const uint8_t item_layout_size[ITEM_LAYOUT_MASK + 1];
+
+/* The size of the words between the item header and the key */
+static inline size_t item_header_extra(const struct default_engine *engine) {
+    return engine->items.header_extra;
+}
+
+/* Where the header of the item ends (and the ITEM_WITH_* words start) */
+static inline char *item_header_end(const hash_item *item) {
+    return (char*)(item + 1) - ((item->iflag & ITEM_TINY) ? ITEM_LINKS_SIZE : 0);
+}
+
+/* Where the word for flag (one of the ITEM_WITH_* flags) lives */
+static inline char *item_layout_word(const hash_item *item, uint16_t flag) {
+    return item_header_end(item) + item_layout_size[item->iflag & (flag - 1)];
+}
+
+static inline bool extstore_enabled(const struct default_engine *engine) {
+    return engine->ext.npages != 0;
+}
+
+/*
+ * Translate between the item pointers and the references stored in the
+ * item header (see item_ref_t in items.h)
+ */
+#ifdef COMPACT_ITEMS
+static inline hash_item *item_deref(const struct default_engine *engine,
+                                    item_ref_t ref) {
+    if (ref == 0) {
+        return NULL;
+    }
+    if (ref & ITEM_REF_CURSOR) {
+        return engine->items.cursors[ref & ~ITEM_REF_CURSOR];
+    }
+    return (hash_item*)((char*)engine->slabs.mem_base +
+                        (size_t)(ref - 1) * CHUNK_ALIGN_BYTES);
+}
+
+static inline item_ref_t item_ref(const struct default_engine *engine,
+                                  const hash_item *it) {
+    if (it == NULL) {
+        return 0;
+    }
+    if (it->nkey == 0 && it->nbytes == 0) {
+        /* cursors keep their own reference in h_next */
+        return it->h_next;
+    }
+    return (item_ref_t)(((const char*)it - (const char*)engine->slabs.mem_base) /
+                        CHUNK_ALIGN_BYTES) + 1;
+}
+#else
+static inline hash_item *item_deref(const struct default_engine *engine,
+                                    item_ref_t ref) {
+    (void)engine;
+    return ref;
+}
+
+static inline item_ref_t item_ref(const struct default_engine *engine,
+                                  const hash_item *it) {
+    (void)engine;
+    return (hash_item*)it;
+}
+#endif
+
+static inline hash_item *item_next(const struct default_engine *engine,
+                                   const hash_item *it) {
+    return item_deref(engine, it->next);
+}
+
+static inline hash_item *item_prev(const struct default_engine *engine,
+                                   const hash_item *it) {
+    return item_deref(engine, it->prev);
+}
+
+static inline hash_item *item_h_next(const struct default_engine *engine,
+                                     const hash_item *it) {
+    return item_deref(engine, it->h_next);
+}
+
+static inline void item_set_next(const struct default_engine *engine,
+                                 hash_item *it, const hash_item *next) {
+    it->next = item_ref(engine, next);
+}
+
+static inline void item_set_prev(const struct default_engine *engine,
+                                 hash_item *it, const hash_item *prev) {
+    it->prev = item_ref(engine, prev);
+}
+
+static inline void item_set_h_next(const struct default_engine *engine,
+                                   hash_item *it, const hash_item *next) {
+    it->h_next = item_ref(engine, next);
+}
+
+/* These are on every lookup, so they are inlined (see item_layout_size) */
+static inline const void* item_get_key(const hash_item* item) {
+    return item_header_end(item) + item_layout_size[item->iflag & ITEM_LAYOUT_MASK];
+}
+
+static inline char* item_get_data(const hash_item* item) {
+    return (char*)item_get_key(item) + item->nkey;
+}
+
+static inline uint64_t item_get_cas(const hash_item* item) {
+    uint64_t ret = 0;
+    if (item->iflag & ITEM_WITH_CAS) {
+        /* The compact header leaves the cas unaligned */
+        memcpy(&ret, item_header_end(item), sizeof(ret));
+    }
+    return ret;
+}
+
+static inline struct item_vb_links *item_get_vb_links(const hash_item* item) {
+    return (void*)item_layout_word(item, ITEM_WITH_VBLINKS);
+}
+
+static inline struct item_cost *item_get_cost(const hash_item* item) {
+    return (void*)item_layout_word(item, ITEM_WITH_COST);
+}
+
+static inline struct item_expiry_links *item_get_expiry_links(const hash_item* item) {
+    return (void*)item_layout_word(item, ITEM_WITH_EXPIRY);
+}
+
+static inline void *item_get_counter_word(const hash_item* item) {
+    return item_layout_word(item, ITEM_WITH_COUNTER);
+}
+
 void item_set_cas(ENGINE_HANDLE *handle, const void *cookie,
                   item* item, uint64_t val);
-uint64_t item_get_cas(const hash_item* item);
+uint64_t item_get_seqno(const hash_item* item);
+uint16_t item_get_vbucket(const hash_item* item);
+void item_set_seqno(hash_item* item, uint16_t vbucket, uint64_t seqno);
+void item_set_cost(ENGINE_HANDLE *handle, const void *cookie,
+                   item* item, uint32_t cost);
 uint8_t item_get_clsid(const hash_item* item);
 #endif
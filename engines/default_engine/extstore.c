@@ -0,0 +1,576 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include "default_engine.h"
+
+static EXTENSION_LOGGER_DESCRIPTOR *ext_logger(struct default_engine *engine)
+{
+    return (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+}
+
+#ifdef WIN32
+static bool ext_pread(int fd, void *buf, size_t len, uint64_t offset) {
+    return false;
+}
+
+static bool ext_pwrite(int fd, const void *buf, size_t len, uint64_t offset) {
+    return false;
+}
+#else
+static bool ext_pread(int fd, void *buf, size_t len, uint64_t offset) {
+    char *ptr = buf;
+    while (len > 0) {
+        ssize_t nr = pread(fd, ptr, len, (off_t)offset);
+        if (nr <= 0) {
+            if (nr == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += nr;
+        len -= nr;
+        offset += nr;
+    }
+    return true;
+}
+
+static bool ext_pwrite(int fd, const void *buf, size_t len, uint64_t offset) {
+    const char *ptr = buf;
+    while (len > 0) {
+        ssize_t nw = pwrite(fd, ptr, len, (off_t)offset);
+        if (nw <= 0) {
+            if (nw == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += nw;
+        len -= nw;
+        offset += nw;
+    }
+    return true;
+}
+#endif
+
+/*
+ * Start filling the page (the values on it from the last time round are
+ * lost). Caller must hold ext.lock.
+ */
+static void ext_start_page(struct default_engine *engine, unsigned int page)
+{
+    struct extstore *ext = &engine->ext;
+
+    cb_assert(ext->spare != NULL);
+    if (ext->pages[page].version != 0) {
+        ext->stats.pages_evicted++;
+    }
+    ext->pages[page].version = ++ext->version;
+    ext->pages[page].buf = ext->spare;
+    ext->spare = NULL;
+    ext->wpage = page;
+    ext->woffset = 0;
+}
+
+/* Write out a page we're done filling (without holding ext.lock) */
+static void ext_write_page(struct default_engine *engine, unsigned int page,
+                           char *buf)
+{
+    struct extstore *ext = &engine->ext;
+    size_t page_size = engine->config.ext_page_size;
+    bool ok = ext_pwrite(ext->fd, buf, page_size, (uint64_t)page * page_size);
+
+    cb_mutex_enter(&ext->lock);
+    if (ok) {
+        ext->stats.pages_written++;
+    } else {
+        /* Whatever was on it is lost */
+        ext->stats.write_errors++;
+        ext->pages[page].version = 0;
+    }
+    ext->pages[page].buf = NULL;
+    ext->spare = buf;
+    cb_mutex_exit(&ext->lock);
+
+    if (!ok) {
+        ext_logger(engine)->log(EXTENSION_LOG_WARNING, NULL,
+                                "Failed to write page %u to %s: %s\n",
+                                page, engine->config.ext_path,
+                                strerror(errno));
+    }
+}
+
+bool extstore_write(struct default_engine *engine, const hash_item *it,
+                    struct ext_loc *loc)
+{
+    struct extstore *ext = &engine->ext;
+    char *full = NULL;
+    unsigned int full_page = 0;
+
+    if (it->nbytes > engine->config.ext_page_size) {
+        return false;
+    }
+
+    cb_mutex_enter(&ext->lock);
+    if (ext->woffset + it->nbytes > engine->config.ext_page_size) {
+        full_page = ext->wpage;
+        full = ext->pages[full_page].buf;
+        ext_start_page(engine, (full_page + 1) % ext->npages);
+    }
+    loc->version = ext->pages[ext->wpage].version;
+    loc->page = ext->wpage;
+    loc->offset = (uint32_t)ext->woffset;
+    item_read_value(engine, it, ext->pages[ext->wpage].buf + ext->woffset);
+    ext->woffset += it->nbytes;
+    ext->stats.items_written++;
+    ext->stats.bytes_written += it->nbytes;
+    cb_mutex_exit(&ext->lock);
+
+    if (full != NULL) {
+        ext_write_page(engine, full_page, full);
+    }
+    return true;
+}
+
+bool extstore_valid(struct default_engine *engine, const struct ext_loc *loc)
+{
+    bool ret;
+    cb_mutex_enter(&engine->ext.lock);
+    ret = engine->ext.pages[loc->page].version == loc->version;
+    cb_mutex_exit(&engine->ext.lock);
+    return ret;
+}
+
+bool extstore_read(struct default_engine *engine, const struct ext_loc *loc,
+                   hash_item *it)
+{
+    struct extstore *ext = &engine->ext;
+    struct ext_page *page = &ext->pages[loc->page];
+    uint64_t offset;
+    struct iovec iov;
+    bool ok;
+
+    cb_mutex_enter(&ext->lock);
+    if (page->version != loc->version) {
+        ext->stats.misses++;
+        cb_mutex_exit(&ext->lock);
+        return false;
+    }
+    if (page->buf != NULL) {
+        /* It hasn't made it to the file yet */
+        item_write_value(engine, it, 0, page->buf + loc->offset, it->nbytes);
+        ext->stats.reads++;
+        ext->stats.bytes_read += it->nbytes;
+        cb_mutex_exit(&ext->lock);
+        return true;
+    }
+    cb_mutex_exit(&ext->lock);
+
+    offset = (uint64_t)loc->page * engine->config.ext_page_size + loc->offset;
+    if (item_get_value_iov(engine, it, &iov, 1) == 1) {
+        ok = ext_pread(ext->fd, iov.iov_base, it->nbytes, offset);
+    } else {
+        char *buf = malloc(it->nbytes);
+        ok = buf != NULL && ext_pread(ext->fd, buf, it->nbytes, offset);
+        if (ok) {
+            item_write_value(engine, it, 0, buf, it->nbytes);
+        }
+        free(buf);
+    }
+
+    /* We may have started filling the page again while reading it */
+    cb_mutex_enter(&ext->lock);
+    ok = ok && page->version == loc->version;
+    if (ok) {
+        ext->stats.reads++;
+        ext->stats.bytes_read += it->nbytes;
+    } else {
+        ext->stats.misses++;
+    }
+    cb_mutex_exit(&ext->lock);
+
+    return ok;
+}
+
+/* Read the value for a connection. Returns the status to notify it with */
+static ENGINE_ERROR_CODE ext_do_read(struct default_engine *engine,
+                                     struct ext_read *io)
+{
+    struct extstore *ext = &engine->ext;
+    ENGINE_ERROR_CODE ret;
+
+    ret = item_ext_load(engine, io->hdr, io->cookie, &io->it);
+    if (ret == ENGINE_KEY_ENOENT) {
+        /* The value is gone, and so is the item */
+        item_unlink(engine, io->hdr);
+    } else if (ret == ENGINE_SUCCESS &&
+               engine->config.ext_recache_rate != 0 &&
+               ++ext->recache_counter >= engine->config.ext_recache_rate) {
+        /* Bring it back into memory once in a while */
+        ext->recache_counter = 0;
+        if (item_ext_recache(engine, io->hdr, io->it)) {
+            cb_mutex_enter(&ext->lock);
+            ext->stats.recaches++;
+            cb_mutex_exit(&ext->lock);
+        }
+    }
+    item_release(engine, io->hdr);
+    io->hdr = NULL;
+
+    return ret;
+}
+
+/* The most reads we do before we notify the connections of them */
+#define EXT_NOTIFY_BATCH 32
+
+/* Let the connections know their reads are done (and let go of them) */
+static void ext_notify(struct default_engine *engine,
+                       const io_completion_t *done, size_t count)
+{
+    SERVER_COOKIE_API *api = engine->server.cookie;
+    size_t ii;
+
+    if (api->notify_io_complete_batch != NULL) {
+        api->notify_io_complete_batch(done, count);
+    } else {
+        for (ii = 0; ii < count; ++ii) {
+            api->notify_io_complete(done[ii].cookie, done[ii].status);
+        }
+    }
+    for (ii = 0; ii < count; ++ii) {
+        api->release(done[ii].cookie);
+    }
+}
+
+static void extstore_io_main(void *arg)
+{
+    struct default_engine *engine = arg;
+    struct extstore *ext = &engine->ext;
+    io_completion_t done[EXT_NOTIFY_BATCH];
+
+    cb_mutex_enter(&ext->lock);
+    while (!ext->shutdown) {
+        struct ext_read *io = ext->queue;
+        size_t taken = 0;
+        size_t count;
+
+        if (io == NULL) {
+            cb_cond_wait(&ext->cond, &ext->lock);
+            continue;
+        }
+
+        /* Take the reads queued by now (up to a batch of them) */
+        while (ext->queue != NULL && taken < EXT_NOTIFY_BATCH) {
+            ext->queue = ext->queue->next;
+            ++taken;
+        }
+        if (ext->queue == NULL) {
+            ext->queue_tail = NULL;
+        }
+        cb_mutex_exit(&ext->lock);
+
+        for (count = 0; count < taken; ++count) {
+            struct ext_read *next = io->next;
+            done[count].cookie = io->cookie;
+            done[count].status = ext_do_read(engine, io);
+
+            if (done[count].status == ENGINE_SUCCESS) {
+                /* The next get for the key picks it up */
+                cb_mutex_enter(&ext->lock);
+                io->next = ext->done;
+                ext->done = io;
+                cb_mutex_exit(&ext->lock);
+            } else {
+                free(io);
+            }
+            io = next;
+        }
+        /*
+         * Not under the lock: the worker threads take it while holding
+         * the connection lock that notifying takes. Our reservations
+         * keep the connections around until we're done with them.
+         */
+        ext_notify(engine, done, count);
+        cb_mutex_enter(&ext->lock);
+    }
+    ext->running = false;
+    cb_mutex_exit(&ext->lock);
+}
+
+ENGINE_ERROR_CODE extstore_get(struct default_engine *engine,
+                               const void *cookie, hash_item *hdr,
+                               hash_item **it)
+{
+    struct extstore *ext = &engine->ext;
+    const struct ext_loc *loc = item_get_ext_loc(engine, hdr);
+    struct ext_read *io;
+    bool lost, buffered;
+
+    cb_mutex_enter(&ext->lock);
+    lost = ext->pages[loc->page].version != loc->version;
+    buffered = !lost && ext->pages[loc->page].buf != NULL;
+    if (lost) {
+        ext->stats.misses++;
+        ext->stats.inline_misses++;
+    } else if (buffered) {
+        ext->stats.inline_reads++;
+    }
+    cb_mutex_exit(&ext->lock);
+
+    if (lost || buffered) {
+        /* No need to wait for the I/O thread for these */
+        ENGINE_ERROR_CODE ret = ENGINE_KEY_ENOENT;
+        *it = NULL;
+        if (buffered) {
+            ret = item_ext_load(engine, hdr, cookie, it);
+        }
+        if (ret == ENGINE_KEY_ENOENT) {
+            item_unlink(engine, hdr);
+        }
+        item_release(engine, hdr);
+        return ret;
+    }
+
+    io = calloc(1, sizeof(*io));
+    if (io == NULL) {
+        item_release(engine, hdr);
+        return ENGINE_ENOMEM;
+    }
+    io->cookie = cookie;
+    io->hdr = hdr;
+
+    /* Keep the connection around until we're done with it */
+    engine->server.cookie->reserve(cookie);
+
+    cb_mutex_enter(&ext->lock);
+    if (ext->queue_tail == NULL) {
+        ext->queue = io;
+    } else {
+        ext->queue_tail->next = io;
+    }
+    ext->queue_tail = io;
+    cb_cond_signal(&ext->cond);
+    cb_mutex_exit(&ext->lock);
+
+    return ENGINE_EWOULDBLOCK;
+}
+
+hash_item *extstore_get_result(struct default_engine *engine,
+                               const void *cookie,
+                               const void *key, size_t nkey)
+{
+    struct extstore *ext = &engine->ext;
+    struct ext_read **pp;
+    struct ext_read *io = NULL;
+    hash_item *it;
+
+    /* Don't bother with the lock unless there is anything to pick up */
+    if (ext->done == NULL) {
+        return NULL;
+    }
+
+    cb_mutex_enter(&ext->lock);
+    for (pp = &ext->done; *pp != NULL; pp = &(*pp)->next) {
+        if ((*pp)->cookie == cookie) {
+            io = *pp;
+            *pp = io->next;
+            break;
+        }
+    }
+    cb_mutex_exit(&ext->lock);
+
+    if (io == NULL) {
+        return NULL;
+    }
+    it = io->it;
+    free(io);
+
+    if (it->nkey != nkey || memcmp(item_get_key(it), key, nkey) != 0) {
+        /* Not what they're asking for (any more) */
+        item_release(engine, it);
+        return NULL;
+    }
+    return it;
+}
+
+void extstore_disconnect(struct default_engine *engine, const void *cookie)
+{
+    struct extstore *ext = &engine->ext;
+    struct ext_read **pp;
+    struct ext_read *list = NULL;
+
+    if (ext->done == NULL) {
+        return;
+    }
+
+    cb_mutex_enter(&ext->lock);
+    pp = &ext->done;
+    while (*pp != NULL) {
+        struct ext_read *io = *pp;
+        if (io->cookie == cookie) {
+            *pp = io->next;
+            io->next = list;
+            list = io;
+        } else {
+            pp = &io->next;
+        }
+    }
+    cb_mutex_exit(&ext->lock);
+
+    while (list != NULL) {
+        struct ext_read *next = list->next;
+        item_release(engine, list->it);
+        free(list);
+        list = next;
+    }
+}
+
+ENGINE_ERROR_CODE extstore_init(struct default_engine *engine)
+{
+#ifdef WIN32
+    return ENGINE_ENOTSUP;
+#else
+    struct extstore *ext = &engine->ext;
+    size_t page_size = engine->config.ext_page_size;
+    size_t npages = engine->config.ext_size / page_size;
+    struct stat st;
+
+    /* We need one page to fill while the last one is written */
+    if (page_size < 4096 || page_size > UINT32_MAX || npages < 2 ||
+        npages > UINT32_MAX || engine->config.ext_item_size == 0) {
+        return ENGINE_EINVAL;
+    }
+
+    ext->fd = open(engine->config.ext_path, O_RDWR | O_CREAT, 0600);
+    if (ext->fd == -1) {
+        ext_logger(engine)->log(EXTENSION_LOG_WARNING, NULL,
+                                "Failed to open %s: %s\n",
+                                engine->config.ext_path, strerror(errno));
+        return ENGINE_FAILED;
+    }
+    /* It may be a block device */
+    if (fstat(ext->fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        ftruncate(ext->fd, (off_t)npages * page_size) != 0) {
+        ext_logger(engine)->log(EXTENSION_LOG_WARNING, NULL,
+                                "Failed to resize %s: %s\n",
+                                engine->config.ext_path, strerror(errno));
+        close(ext->fd);
+        ext->fd = -1;
+        return ENGINE_FAILED;
+    }
+
+    ext->pages = calloc(npages, sizeof(*ext->pages));
+    ext->spare = malloc(page_size);
+    if (ext->pages == NULL || ext->spare == NULL) {
+        extstore_destroy(engine);
+        return ENGINE_ENOMEM;
+    }
+    ext->npages = (unsigned int)npages;
+    ext_start_page(engine, 0);
+    if ((ext->spare = malloc(page_size)) == NULL) {
+        extstore_destroy(engine);
+        return ENGINE_ENOMEM;
+    }
+
+    ext->shutdown = false;
+    ext->running = true;
+    if (cb_create_thread(&ext->tid, extstore_io_main, engine, 0) != 0) {
+        ext->running = false;
+        extstore_destroy(engine);
+        return ENGINE_FAILED;
+    }
+
+    return ENGINE_SUCCESS;
+#endif
+}
+
+void extstore_destroy(struct default_engine *engine)
+{
+    struct extstore *ext = &engine->ext;
+    bool running;
+    unsigned int ii;
+
+    cb_mutex_enter(&ext->lock);
+    running = ext->running;
+    ext->shutdown = true;
+    cb_cond_signal(&ext->cond);
+    cb_mutex_exit(&ext->lock);
+
+    if (running) {
+        cb_join_thread(ext->tid);
+    }
+
+    /* Nobody is waiting for these any more */
+    while (ext->queue != NULL) {
+        struct ext_read *next = ext->queue->next;
+        free(ext->queue);
+        ext->queue = next;
+    }
+    ext->queue_tail = NULL;
+    while (ext->done != NULL) {
+        struct ext_read *next = ext->done->next;
+        free(ext->done);
+        ext->done = next;
+    }
+
+    if (ext->pages != NULL) {
+        for (ii = 0; ii < ext->npages; ++ii) {
+            free(ext->pages[ii].buf);
+        }
+        free(ext->pages);
+        ext->pages = NULL;
+    }
+    ext->npages = 0;
+    free(ext->spare);
+    ext->spare = NULL;
+#ifndef WIN32
+    if (ext->fd != -1) {
+        close(ext->fd);
+        ext->fd = -1;
+    }
+#endif
+}
+
+void extstore_stats(struct default_engine *engine, ADD_STAT add_stats,
+                    const void *c)
+{
+    struct extstore *ext = &engine->ext;
+
+    cb_mutex_enter(&ext->lock);
+    add_statistics(c, add_stats, NULL, -1, "ext_pages", "%u", ext->npages);
+    add_statistics(c, add_stats, NULL, -1, "ext_page_size", "%"PRIu64,
+                   (uint64_t)engine->config.ext_page_size);
+    add_statistics(c, add_stats, NULL, -1, "ext_items_written", "%"PRIu64,
+                   ext->stats.items_written);
+    add_statistics(c, add_stats, NULL, -1, "ext_bytes_written", "%"PRIu64,
+                   ext->stats.bytes_written);
+    add_statistics(c, add_stats, NULL, -1, "ext_pages_written", "%"PRIu64,
+                   ext->stats.pages_written);
+    add_statistics(c, add_stats, NULL, -1, "ext_pages_evicted", "%"PRIu64,
+                   ext->stats.pages_evicted);
+    add_statistics(c, add_stats, NULL, -1, "ext_write_errors", "%"PRIu64,
+                   ext->stats.write_errors);
+    add_statistics(c, add_stats, NULL, -1, "ext_reads", "%"PRIu64,
+                   ext->stats.reads);
+    add_statistics(c, add_stats, NULL, -1, "ext_bytes_read", "%"PRIu64,
+                   ext->stats.bytes_read);
+    add_statistics(c, add_stats, NULL, -1, "ext_misses", "%"PRIu64,
+                   ext->stats.misses);
+    add_statistics(c, add_stats, NULL, -1, "ext_recaches", "%"PRIu64,
+                   ext->stats.recaches);
+    add_statistics(c, add_stats, NULL, -1, "ext_inline_reads", "%"PRIu64,
+                   ext->stats.inline_reads);
+    add_statistics(c, add_stats, NULL, -1, "ext_inline_misses", "%"PRIu64,
+                   ext->stats.inline_misses);
+    cb_mutex_exit(&ext->lock);
+}
@@ -0,0 +1,160 @@
+/* Flash storage for the values of cold items */
+#ifndef EXTSTORE_H
+#define EXTSTORE_H
+
+#include "default_engine.h"
+
+/*
+ * The LRU maintainer writes the values of items at the tail of the cold
+ * segments to a file (ext_path), and replaces the items with headers
+ * (ITEM_HDR) which only hold the key and where the value is. The file is
+ * split into pages of ext_page_size bytes which are filled one at a time
+ * in a memory buffer and written out in one go. When we run out of pages
+ * we start over with the oldest one; the values on it are lost, so every
+ * location carries the version of the page it was written to.
+ */
+
+/* Where the value of an ITEM_HDR item lives (stored after its key) */
+struct ext_loc {
+    uint64_t version; /* The version of the page when we wrote the value */
+    uint32_t page;
+    uint32_t offset;
+};
+
+struct ext_page {
+    /* Bumped every time we start filling the page (0 if never used) */
+    uint64_t version;
+    /* The contents of the page while it is filled (or written out) */
+    char *buf;
+};
+
+/* A value to read back in for a connection (see extstore_get) */
+struct ext_read {
+    struct ext_read *next;
+    const void *cookie;
+    hash_item *hdr;
+    hash_item *it;
+};
+
+struct extstore {
+    /* Protects everything below (but not the file I/O) */
+    cb_mutex_t lock;
+    /* Signalled when there are reads for the I/O thread */
+    cb_cond_t cond;
+    cb_thread_t tid;
+    bool running;
+    bool shutdown;
+
+    int fd;
+    struct ext_page *pages;
+    unsigned int npages;
+    /* The page we're filling, and how far we've got */
+    unsigned int wpage;
+    size_t woffset;
+    /* The buffer to fill the next page in (when it isn't in use) */
+    char *spare;
+    uint64_t version;
+
+    /* The reads waiting for the I/O thread, and the ones it has done */
+    struct ext_read *queue;
+    struct ext_read *queue_tail;
+    struct ext_read *done;
+    unsigned int recache_counter;
+
+    struct {
+        uint64_t items_written;
+        uint64_t bytes_written;
+        uint64_t pages_written;
+        uint64_t pages_evicted;
+        uint64_t write_errors;
+        uint64_t reads;
+        uint64_t bytes_read;
+        uint64_t misses;
+        uint64_t recaches;
+        /* The gets we didn't have to hand to the I/O thread */
+        uint64_t inline_reads;
+        uint64_t inline_misses;
+    } stats;
+};
+
+/**
+ * Open the file and start the I/O thread
+ * @param engine handle to the storage engine
+ */
+ENGINE_ERROR_CODE extstore_init(struct default_engine *engine);
+
+/**
+ * Stop the I/O thread and close the file
+ * @param engine handle to the storage engine
+ */
+void extstore_destroy(struct default_engine *engine);
+
+/**
+ * Append the value of the item to the page being filled (writing the
+ * page out if it is full). The caller must hold a reference to the item.
+ * @param engine handle to the storage engine
+ * @param it the item to write the value of
+ * @param loc where to store the location of the value
+ * @return false if the value doesn't fit in a page
+ */
+bool extstore_write(struct default_engine *engine, const hash_item *it,
+                    struct ext_loc *loc);
+
+/**
+ * Is the value at the location still around?
+ * @param engine handle to the storage engine
+ * @param loc the location of the value
+ */
+bool extstore_valid(struct default_engine *engine, const struct ext_loc *loc);
+
+/**
+ * Read a value back in (see item_ext_load)
+ * @param engine handle to the storage engine
+ * @param loc the location of the value
+ * @param it the item to read it into (it->nbytes bytes)
+ * @return false if the value was lost
+ */
+bool extstore_read(struct default_engine *engine, const struct ext_loc *loc,
+                   hash_item *it);
+
+/**
+ * Start reading the value of a header for a connection. The I/O thread
+ * notifies the connection when it is done, and the next get for the key
+ * picks up the item (see extstore_get_result). Values which are lost or
+ * still in memory never go to the I/O thread: we know which from the
+ * page versions, so those are answered right away.
+ * @param engine handle to the storage engine
+ * @param cookie the connection
+ * @param hdr the header (the reference held by the caller is taken over)
+ * @param it where to store the item when we read it right away
+ * @return ENGINE_EWOULDBLOCK, ENGINE_SUCCESS, ENGINE_KEY_ENOENT or
+ *         ENGINE_ENOMEM
+ */
+ENGINE_ERROR_CODE extstore_get(struct default_engine *engine,
+                               const void *cookie, hash_item *hdr,
+                               hash_item **it);
+
+/**
+ * Pick up the item read for a connection
+ * @param engine handle to the storage engine
+ * @param cookie the connection
+ * @param key the key the connection is looking for
+ * @param nkey the length of the key
+ * @return the item (with a reference held), or NULL if we haven't got it
+ */
+hash_item *extstore_get_result(struct default_engine *engine,
+                               const void *cookie,
+                               const void *key, size_t nkey);
+
+/**
+ * Drop the reads done for a connection going away
+ * @param engine handle to the storage engine
+ * @param cookie the connection
+ */
+void extstore_disconnect(struct default_engine *engine, const void *cookie);
+
+/** Fill buffer with the extstore stats */
+void extstore_stats(struct default_engine *engine, ADD_STAT add_stats,
+                    const void *c);
+
+#endif
@@ -7,9 +7,51 @@
 #include <string.h>
 #include <time.h>
 #include <inttypes.h>
+#include <snappy-c.h>
 
 #include "default_engine.h"
 
+/*
+ * Locking
+ *
+ * The cache used to be protected by a single lock. It is now split up so
+ * that operations on different keys don't contend with each other:
+ *
+ *   item lock -> LRU lock (items.lock[clsid]) -> slabs.lock / stats.lock
+ *
+ * The item locks are striped on the low bits of the key hash. The stripe
+ * protects the refcount and iflag of every item hashing into it, and the
+ * assoc buckets they live in. Each slab class has its own LRU lock for
+ * its list and itemstats, so LRU maintenance in one class never blocks
+ * another. We never hold two LRU locks at the same time. Code walking an
+ * LRU (eviction, the scrubber, the tap and dcp walkers) already holds the
+ * LRU lock when it finds an item, so it may only *try* to lock the item to
+ * avoid inverting the lock order above.
+ *
+ * With the segmented LRU a hit only sets ITEM_ACTIVE on the item (under the
+ * item lock), and the LRU maintainer thread does the relinking later. The
+ * segment bits in iflag may only change with both the item lock and the
+ * LRU lock held.
+ *
+ * With lockless_get item_get looks the key up without the item lock. Each
+ * stripe has a sequence which is odd while the assoc buckets it protects
+ * are being changed (see item_seq_write_begin), and the lookup checks that
+ * it didn't move before it follows any pointer it read. Taking the
+ * reference still needs the lock (the refcount is a plain counter
+ * everybody else reads and writes under it), but we only take it for a
+ * hit, and only redo the lookup if the sequence moved in between. Unlinked
+ * items may be reused right away: their memory stays an item of the same
+ * slab class, so reading it is harmless. The hash tables freed after a
+ * resize and the pages handed to another slab class wait for the readers
+ * to leave their epoch (see item_epoch_synchronize).
+ *
+ * The items of the tiny slab classes (ITEM_TINY, see tiny_items) aren't on
+ * the LRUs. A hit sets ITEM_ACTIVE, and the CLOCK hand of the class sweeps
+ * its pages (under the LRU lock) for an item without it when we need room
+ * (see do_item_clock_evict). The LRU cursors walk their pages instead of
+ * the lists (see item_link_cursor_from).
+ */
+
 /* Forward Declarations */
 static void item_link_q(struct default_engine *engine, hash_item *it);
 static void item_unlink_q(struct default_engine *engine, hash_item *it);
@@ -18,15 +60,21 @@ static hash_item *do_item_alloc(struct default_engine *engine,
                                 const int flags, const rel_time_t exptime,
                                 const int nbytes,
                                 const void *cookie,
-                                uint8_t datatype);
+                                uint8_t datatype,
+                                cb_mutex_t *held);
 static hash_item *do_item_get(struct default_engine *engine,
-                              const char *key, const size_t nkey);
-static int do_item_link(struct default_engine *engine, hash_item *it);
-static void do_item_unlink(struct default_engine *engine, hash_item *it);
+                              const char *key, const size_t nkey,
+                              uint32_t hv);
+static int do_item_link(struct default_engine *engine, hash_item *it,
+                        uint32_t hv);
+static void do_item_unlink(struct default_engine *engine, hash_item *it,
+                           uint32_t hv);
+static void do_item_unlink_nolock(struct default_engine *engine,
+                                  hash_item *it, uint32_t hv);
 static void do_item_release(struct default_engine *engine, hash_item *it);
 static void do_item_update(struct default_engine *engine, hash_item *it);
 static int do_item_replace(struct default_engine *engine,
-                            hash_item *it, hash_item *new_it);
+                            hash_item *it, hash_item *new_it, uint32_t hv);
 static void item_free(struct default_engine *engine, hash_item *it);
 
 /*
@@ -40,1118 +88,4850 @@ static void item_free(struct default_engine *engine, hash_item *it);
  * just give up and return an error after inspecting a fixed number of objects.
  */
 static const int search_items = 50;
+/*
+ * How many chunks the CLOCK of a tiny class looks at before it stops
+ * giving the items with ITEM_ACTIVE set another round (and as many again
+ * before it gives up).
+ */
+static const unsigned int clock_items = 500;
+
+ENGINE_ERROR_CODE item_locks_init(struct default_engine *engine,
+                                  size_t nlocks) {
+    unsigned int size = 1;
+    unsigned int ii;
+
+    /*
+     * All of the keys in an assoc bucket must map to the same lock (also
+     * in the old table while we're expanding), so we can't have more
+     * locks than there are buckets in the smaller table.
+     */
+    while (size < nlocks && size < (1U << (engine->assoc.hashpower - 1))) {
+        size <<= 1;
+    }
 
-void item_stats_reset(struct default_engine *engine) {
-    cb_mutex_enter(&engine->cache_lock);
-    memset(engine->items.itemstats, 0, sizeof(engine->items.itemstats));
-    cb_mutex_exit(&engine->cache_lock);
-}
-
+    engine->item_locks.locks = calloc(size, sizeof(cb_mutex_t));
+    engine->item_locks.seqs = calloc(size, sizeof(struct item_lock_seq));
+    if (engine->item_locks.locks == NULL || engine->item_locks.seqs == NULL) {
+        free(engine->item_locks.locks);
+        free(engine->item_locks.seqs);
+        engine->item_locks.locks = NULL;
+        engine->item_locks.seqs = NULL;
+        return ENGINE_ENOMEM;
+    }
 
-/* warning: don't use these macros with a function, as it evals its arg twice */
-static size_t ITEM_ntotal(struct default_engine *engine,
-                          const hash_item *item) {
-    size_t ret = sizeof(*item) + item->nkey + item->nbytes;
-    if (engine->config.use_cas) {
-        ret += sizeof(uint64_t);
+    for (ii = 0; ii < size; ++ii) {
+        cb_mutex_initialize(&engine->item_locks.locks[ii]);
     }
+    engine->item_locks.size = size;
+    /* A free reader slot holds 0 */
+    engine->epochs.current = 1;
 
-    return ret;
+    return ENGINE_SUCCESS;
 }
 
-/* Get the next CAS id for a new item. */
-static uint64_t get_cas_id(void) {
-    static uint64_t cas_id = 0;
-    return ++cas_id;
+void item_locks_destroy(struct default_engine *engine) {
+    unsigned int ii;
+    for (ii = 0; ii < engine->item_locks.size; ++ii) {
+        cb_mutex_destroy(&engine->item_locks.locks[ii]);
+    }
+    free(engine->item_locks.locks);
+    free(engine->item_locks.seqs);
+    engine->item_locks.locks = NULL;
+    engine->item_locks.seqs = NULL;
+    engine->item_locks.size = 0;
 }
 
-/* Enable this for reference-count debugging. */
-#if 0
-# define DEBUG_REFCNT(it,op) \
-                fprintf(stderr, "item %x refcnt(%c) %d %c%c%c\n", \
-                        it, op, it->refcount, \
-                        (it->it_flags & ITEM_LINKED) ? 'L' : ' ', \
-                        (it->it_flags & ITEM_SLABBED) ? 'S' : ' ')
-#else
-# define DEBUG_REFCNT(it,op) while(0)
-#endif
+static cb_mutex_t *item_get_lock(struct default_engine *engine, uint32_t hv) {
+    return &engine->item_locks.locks[hv & (engine->item_locks.size - 1)];
+}
 
+void item_lock(struct default_engine *engine, uint32_t hv) {
+    mc_mutex_enter(item_get_lock(engine, hv), &engine->lock_stats.items);
+}
 
-/*@null@*/
-hash_item *do_item_alloc(struct default_engine *engine,
-                         const void *key,
-                         const size_t nkey,
-                         const int flags,
-                         const rel_time_t exptime,
-                         const int nbytes,
-                         const void *cookie,
-                         uint8_t datatype) {
-    hash_item *it = NULL;
-    int tries = search_items;
-    hash_item *search;
-    rel_time_t oldest_live;
-    rel_time_t current_time;
-    unsigned int id;
+void item_unlock(struct default_engine *engine, uint32_t hv) {
+    cb_mutex_exit(item_get_lock(engine, hv));
+}
 
-    size_t ntotal = sizeof(hash_item) + nkey + nbytes;
-    if (engine->config.use_cas) {
-        ntotal += sizeof(uint64_t);
+/* The whole table may change while we hold all of the locks */
+void item_lock_all(struct default_engine *engine) {
+    unsigned int ii;
+    for (ii = 0; ii < engine->item_locks.size; ++ii) {
+        cb_mutex_enter(&engine->item_locks.locks[ii]);
+        item_seq_write_begin(engine, ii);
     }
+}
 
-    if ((id = slabs_clsid(engine, ntotal)) == 0) {
-        return 0;
+void item_unlock_all(struct default_engine *engine) {
+    unsigned int ii;
+    for (ii = 0; ii < engine->item_locks.size; ++ii) {
+        item_seq_write_end(engine, ii);
+        cb_mutex_exit(&engine->item_locks.locks[ii]);
     }
+}
 
-    /* do a quick check if we have any expired items in the tail.. */
-    tries = search_items;
-    oldest_live = engine->config.oldest_live;
-    current_time = engine->server.core->get_current_time();
+#ifdef WIN32
+static void item_barrier(void) {
+    MemoryBarrier();
+}
 
-    for (search = engine->items.tails[id];
-         tries > 0 && search != NULL;
-         tries--, search=search->prev) {
-        if (search->refcount == 0 &&
-            ((search->time < oldest_live) || /* dead by flush */
-             (search->exptime != 0 && search->exptime < current_time))) {
-            it = search;
-            /* I don't want to actually free the object, just steal
-             * the item to avoid to grab the slab mutex twice ;-)
-             */
-            cb_mutex_enter(&engine->stats.lock);
-            engine->stats.reclaimed++;
-            cb_mutex_exit(&engine->stats.lock);
-            engine->items.itemstats[id].reclaimed++;
-            it->refcount = 1;
-            slabs_adjust_mem_requested(engine, it->slabs_clsid, ITEM_ntotal(engine, it), ntotal);
-            do_item_unlink(engine, it);
-            /* Initialize the item block: */
-            it->slabs_clsid = 0;
-            it->refcount = 0;
-            break;
-        }
-    }
+static bool item_epoch_claim(volatile uint64_t *slot, uint64_t epoch) {
+    return InterlockedCompareExchange64((volatile LONGLONG *)slot,
+                                        (LONGLONG)epoch, 0) == 0;
+}
 
-    if (it == NULL && (it = slabs_alloc(engine, ntotal, id)) == NULL) {
-        /*
-        ** Could not find an expired item at the tail, and memory allocation
-        ** failed. Try to evict some items!
-        */
-        tries = search_items;
+static uint64_t item_epoch_advance(struct default_engine *engine) {
+    return (uint64_t)InterlockedIncrement64((volatile LONGLONG *)&engine->epochs.current);
+}
+#elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+static void item_barrier(void) {
+    membar_producer();
+    membar_consumer();
+}
 
-        /* If requested to not push old items out of cache when memory runs out,
-         * we're out of luck at this point...
-         */
+static bool item_epoch_claim(volatile uint64_t *slot, uint64_t epoch) {
+    return atomic_cas_64(slot, 0, epoch) == 0;
+}
 
-        if (engine->config.evict_to_free == 0) {
-            engine->items.itemstats[id].outofmemory++;
-            return NULL;
-        }
+static uint64_t item_epoch_advance(struct default_engine *engine) {
+    return atomic_inc_64_nv(&engine->epochs.current);
+}
+#else
+static void item_barrier(void) {
+    __sync_synchronize();
+}
 
-        /*
-         * try to get one off the right LRU
-         * don't necessariuly unlink the tail because it may be locked: refcount>0
-         * search up from tail an item with refcount==0 and unlink it; give up after search_items
-         * tries
-         */
+static bool item_epoch_claim(volatile uint64_t *slot, uint64_t epoch) {
+    return __sync_bool_compare_and_swap(slot, 0, epoch);
+}
 
-        if (engine->items.tails[id] == 0) {
-            engine->items.itemstats[id].outofmemory++;
-            return NULL;
-        }
+static uint64_t item_epoch_advance(struct default_engine *engine) {
+    return __sync_add_and_fetch(&engine->epochs.current, 1);
+}
+#endif
 
-        for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
-            if (search->refcount == 0) {
-                if (search->exptime == 0 || search->exptime > current_time) {
-                    engine->items.itemstats[id].evicted++;
-                    engine->items.itemstats[id].evicted_time = current_time - search->time;
-                    if (search->exptime != 0) {
-                        engine->items.itemstats[id].evicted_nonzero++;
-                    }
-                    cb_mutex_enter(&engine->stats.lock);
-                    engine->stats.evictions++;
-                    cb_mutex_exit(&engine->stats.lock);
-                    engine->server.stat->evicting(cookie,
-                                                  item_get_key(search),
-                                                  search->nkey);
-                } else {
-                    engine->items.itemstats[id].reclaimed++;
-                    cb_mutex_enter(&engine->stats.lock);
-                    engine->stats.reclaimed++;
-                    cb_mutex_exit(&engine->stats.lock);
-                }
-                do_item_unlink(engine, search);
-                break;
-            }
-        }
-        it = slabs_alloc(engine, ntotal, id);
-        if (it == 0) {
-            engine->items.itemstats[id].outofmemory++;
-            /* Last ditch effort. There is a very rare bug which causes
-             * refcount leaks. We've fixed most of them, but it still happens,
-             * and it may happen in the future.
-             * We can reasonably assume no item can stay locked for more than
-             * three hours, so if we find one in the tail which is that old,
-             * free it anyway.
-             */
-            tries = search_items;
-            for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
-                if (search->refcount != 0 && search->time + TAIL_REPAIR_TIME < current_time) {
-                    engine->items.itemstats[id].tailrepairs++;
-                    search->refcount = 0;
-                    do_item_unlink(engine, search);
-                    break;
-                }
-            }
-            it = slabs_alloc(engine, ntotal, id);
-            if (it == 0) {
-                return NULL;
-            }
+static struct item_lock_seq *item_get_seq(struct default_engine *engine,
+                                          uint32_t hv) {
+    return &engine->item_locks.seqs[hv & (engine->item_locks.size - 1)];
+}
+
+void item_seq_write_begin(struct default_engine *engine, uint32_t hv) {
+    if (engine->config.lockless_get) {
+        struct item_lock_seq *seq = item_get_seq(engine, hv);
+        if (seq->depth++ == 0) {
+            seq->seq++;
+            item_barrier();
         }
     }
+}
 
-    cb_assert(it->slabs_clsid == 0);
-
-    it->slabs_clsid = id;
-
-    cb_assert(it != engine->items.heads[it->slabs_clsid]);
-
-    it->next = it->prev = it->h_next = 0;
-    it->refcount = 1;     /* the caller will have a reference */
-    DEBUG_REFCNT(it, '*');
-    it->iflag = engine->config.use_cas ? ITEM_WITH_CAS : 0;
-    it->nkey = (uint16_t)nkey;
-    it->nbytes = nbytes;
-    it->flags = flags;
-    it->datatype = datatype;
-    memcpy((void*)item_get_key(it), key, nkey);
-    it->exptime = exptime;
-    return it;
+void item_seq_write_end(struct default_engine *engine, uint32_t hv) {
+    if (engine->config.lockless_get) {
+        struct item_lock_seq *seq = item_get_seq(engine, hv);
+        if (--seq->depth == 0) {
+            item_barrier();
+            seq->seq++;
+        }
+    }
 }
 
-static void item_free(struct default_engine *engine, hash_item *it) {
-    size_t ntotal = ITEM_ntotal(engine, it);
-    unsigned int clsid;
-    cb_assert((it->iflag & ITEM_LINKED) == 0);
-    cb_assert(it != engine->items.heads[it->slabs_clsid]);
-    cb_assert(it != engine->items.tails[it->slabs_clsid]);
-    cb_assert(it->refcount == 0);
+uint32_t item_seq_read(struct default_engine *engine, uint32_t hv) {
+    uint32_t seq = item_get_seq(engine, hv)->seq;
+    item_barrier();
+    return seq;
+}
 
-    /* so slab size changer can tell later if item is already free or not */
-    clsid = it->slabs_clsid;
-    it->slabs_clsid = 0;
-    it->iflag |= ITEM_SLABBED;
-    DEBUG_REFCNT(it, 'F');
-    slabs_free(engine, it, ntotal, clsid);
+bool item_seq_check(struct default_engine *engine, uint32_t hv,
+                    uint32_t seq) {
+    item_barrier();
+    return item_get_seq(engine, hv)->seq == seq;
 }
 
-static void item_link_q(struct default_engine *engine, hash_item *it) { /* item is the new head */
-    hash_item **head, **tail;
-    cb_assert(it->slabs_clsid < POWER_LARGEST);
-    cb_assert((it->iflag & ITEM_SLABBED) == 0);
+/*
+ * Take a reader slot for a lookup without the lock. The address of a
+ * local tells the threads apart well enough to spread them over the slots.
+ * Returns NULL if they are all taken.
+ */
+static struct item_epoch_slot *item_epoch_enter(struct default_engine *engine,
+                                                uint32_t hv) {
+    uint64_t epoch = engine->epochs.current;
+    unsigned int start = hv ^ (unsigned int)((uintptr_t)&epoch >> 16);
+    unsigned int ii;
+
+    for (ii = 0; ii < ITEM_EPOCH_SLOTS; ++ii) {
+        struct item_epoch_slot *slot =
+            &engine->epochs.slots[(start + ii) & (ITEM_EPOCH_SLOTS - 1)];
+        if (slot->epoch == 0 && item_epoch_claim(&slot->epoch, epoch)) {
+            return slot;
+        }
+    }
+    return NULL;
+}
 
-    head = &engine->items.heads[it->slabs_clsid];
-    tail = &engine->items.tails[it->slabs_clsid];
-    cb_assert(it != *head);
-    cb_assert((*head && *tail) || (*head == 0 && *tail == 0));
-    it->prev = 0;
-    it->next = *head;
-    if (it->next) it->next->prev = it;
-    *head = it;
-    if (*tail == 0) *tail = it;
-    engine->items.sizes[it->slabs_clsid]++;
-    return;
+static void item_epoch_exit(struct item_epoch_slot *slot) {
+    item_barrier();
+    slot->epoch = 0;
 }
 
-static void item_unlink_q(struct default_engine *engine, hash_item *it) {
-    hash_item **head, **tail;
-    cb_assert(it->slabs_clsid < POWER_LARGEST);
-    head = &engine->items.heads[it->slabs_clsid];
-    tail = &engine->items.tails[it->slabs_clsid];
+/*
+ * Whatever was unlinked before we advance the epoch can't be reached by a
+ * reader entering after it, so we only wait for the ones which entered
+ * before (they are quick; they never block).
+ */
+void item_epoch_synchronize(struct default_engine *engine) {
+    uint64_t epoch;
+    unsigned int ii;
 
-    if (*head == it) {
-        cb_assert(it->prev == 0);
-        *head = it->next;
+    if (!engine->config.lockless_get) {
+        return;
     }
-    if (*tail == it) {
-        cb_assert(it->next == 0);
-        *tail = it->prev;
+
+    epoch = item_epoch_advance(engine);
+    for (ii = 0; ii < ITEM_EPOCH_SLOTS; ++ii) {
+        uint64_t entered;
+        while ((entered = engine->epochs.slots[ii].epoch) != 0 &&
+               entered < epoch) {
+#ifdef WIN32
+            Sleep(0);
+#else
+            usleep(10);
+#endif
+        }
     }
-    cb_assert(it->next != it);
-    cb_assert(it->prev != it);
+}
 
-    if (it->next) it->next->prev = it->prev;
-    if (it->prev) it->prev->next = it->next;
-    engine->items.sizes[it->slabs_clsid]--;
-    return;
+/*
+ * Try to lock an item we found while holding the LRU lock. If the caller
+ * already holds the stripe (held) there is nothing to do. Returns false
+ * if the item is busy; otherwise *acquired is set to the lock the caller
+ * must release (or NULL if it didn't take one).
+ */
+static bool item_trylock(struct default_engine *engine, uint32_t hv,
+                         cb_mutex_t *held, cb_mutex_t **acquired) {
+    cb_mutex_t *lock = item_get_lock(engine, hv);
+    *acquired = NULL;
+    if (lock == held) {
+        return true;
+    }
+    if (cb_mutex_try_enter(lock) != 0) {
+        return false;
+    }
+    *acquired = lock;
+    return true;
 }
 
-int do_item_link(struct default_engine *engine, hash_item *it) {
-    MEMCACHED_ITEM_LINK(item_get_key(it), it->nkey, it->nbytes);
-    cb_assert((it->iflag & (ITEM_LINKED|ITEM_SLABBED)) == 0);
-    cb_assert(it->nbytes < (1024 * 1024));  /* 1MB max size */
-    it->iflag |= ITEM_LINKED;
-    it->time = engine->server.core->get_current_time();
-    assoc_insert(engine, engine->server.core->hash(item_get_key(it),
-                                                        it->nkey, 0),
-                 it);
+static uint32_t item_hash(struct default_engine *engine, const hash_item *it) {
+    return engine->server.core->hash(item_get_key(it), it->nkey, 0);
+}
 
-    cb_mutex_enter(&engine->stats.lock);
-    engine->stats.curr_bytes += ITEM_ntotal(engine, it);
-    engine->stats.curr_items += 1;
-    engine->stats.total_items += 1;
-    cb_mutex_exit(&engine->stats.lock);
+uint32_t item_key_hash(struct default_engine *engine, const void *cookie,
+                       const void *key, size_t nkey) {
+    /* The server hashed the key of the request already (the same way) */
+    if (cookie != NULL && engine->server.cookie->get_key_hash != NULL) {
+        return engine->server.cookie->get_key_hash(cookie, key, nkey);
+    }
+    return engine->server.core->hash(key, nkey, 0);
+}
 
-    /* Allocate a new CAS ID on link. */
-    item_set_cas(NULL, NULL, it, get_cas_id());
+/* The temp segment has both of the bits */
+static int item_lru(const hash_item *it) {
+    switch (it->iflag & (ITEM_WARM | ITEM_COLD)) {
+    case ITEM_WARM | ITEM_COLD:
+        return TEMP_LRU;
+    case ITEM_COLD:
+        return COLD_LRU;
+    case ITEM_WARM:
+        return WARM_LRU;
+    }
+    return HOT_LRU;
+}
 
-    item_link_q(engine, it);
+static void item_set_lru(hash_item *it, int lru) {
+    it->iflag &= ~(ITEM_WARM | ITEM_COLD);
+    if (lru == WARM_LRU) {
+        it->iflag |= ITEM_WARM;
+    } else if (lru == COLD_LRU) {
+        it->iflag |= ITEM_COLD;
+    } else if (lru == TEMP_LRU) {
+        it->iflag |= ITEM_WARM | ITEM_COLD;
+    }
+}
 
-    return 1;
+/* Caller must hold the LRU lock for clsid */
+static unsigned int item_lru_size(struct default_engine *engine,
+                                  unsigned int clsid) {
+    return engine->items.sizes[clsid][HOT_LRU] +
+        engine->items.sizes[clsid][WARM_LRU] +
+        engine->items.sizes[clsid][COLD_LRU] +
+        engine->items.sizes[clsid][TEMP_LRU];
 }
 
-void do_item_unlink(struct default_engine *engine, hash_item *it) {
-    MEMCACHED_ITEM_UNLINK(item_get_key(it), it->nkey, it->nbytes);
-    if ((it->iflag & ITEM_LINKED) != 0) {
-        it->iflag &= ~ITEM_LINKED;
-        cb_mutex_enter(&engine->stats.lock);
-        engine->stats.curr_bytes -= ITEM_ntotal(engine, it);
-        engine->stats.curr_items -= 1;
-        cb_mutex_exit(&engine->stats.lock);
-        assoc_delete(engine, engine->server.core->hash(item_get_key(it),
-                                                            it->nkey, 0),
-                     item_get_key(it), it->nkey);
-        item_unlink_q(engine, it);
-        if (it->refcount == 0) {
-            item_free(engine, it);
+/*
+ * Return the last item in the class (the first one we'd evict, starting
+ * at the temp tail and then the cold one). Caller must hold the LRU lock
+ * for clsid.
+ */
+static hash_item *item_lru_last(struct default_engine *engine,
+                                unsigned int clsid) {
+    int lru;
+    for (lru = NUM_LRU - 1; lru >= HOT_LRU; --lru) {
+        if (engine->items.tails[clsid][lru] != NULL) {
+            return engine->items.tails[clsid][lru];
         }
     }
+    return NULL;
 }
 
-void do_item_release(struct default_engine *engine, hash_item *it) {
-    MEMCACHED_ITEM_REMOVE(item_get_key(it), it->nkey, it->nbytes);
-    if (it->refcount != 0) {
-        it->refcount--;
-        DEBUG_REFCNT(it, '-');
+/*
+ * Return the item before it in eviction order (moving on from the head of
+ * temp to the tail of cold and so on). Caller must hold the LRU lock.
+ */
+static hash_item *item_lru_prev(struct default_engine *engine,
+                                const hash_item *it) {
+    hash_item *prev = item_prev(engine, it);
+    int lru;
+    if (prev != NULL) {
+        return prev;
     }
-    if (it->refcount == 0 && (it->iflag & ITEM_LINKED) == 0) {
-        item_free(engine, it);
+    for (lru = item_lru(it) - 1; lru >= HOT_LRU; --lru) {
+        if (engine->items.tails[it->slabs_clsid][lru] != NULL) {
+            return engine->items.tails[it->slabs_clsid][lru];
+        }
     }
+    return NULL;
 }
 
-void do_item_update(struct default_engine *engine, hash_item *it) {
-    rel_time_t current_time = engine->server.core->get_current_time();
-    MEMCACHED_ITEM_UPDATE(item_get_key(it), it->nkey, it->nbytes);
-    if (it->time < current_time - ITEM_UPDATE_INTERVAL) {
-        cb_assert((it->iflag & ITEM_SLABBED) == 0);
+/* The random buckets item_sample looks at before it walks the table */
+#define SAMPLE_PROBES 64
 
-        if ((it->iflag & ITEM_LINKED) != 0) {
-            item_unlink_q(engine, it);
-            it->time = current_time;
-            item_link_q(engine, it);
-        }
-    }
+/* The slots of the namespace table we look at for a name */
+#define NAMESPACE_PROBES 8
+
+/* The hash of a namespace (0 marks the free slots) */
+static uint32_t item_namespace_hash(struct default_engine *engine,
+                                    const void *name, size_t nname) {
+    uint32_t hash = engine->server.core->hash(name, nname, 0);
+    return hash == 0 ? 1 : hash;
 }
 
-int do_item_replace(struct default_engine *engine,
-                    hash_item *it, hash_item *new_it) {
-    MEMCACHED_ITEM_REPLACE(item_get_key(it), it->nkey, it->nbytes,
+/*
+ * Is the item in a namespace which was invalidated after it was linked?
+ * We don't take the lock: a slot is filled in before its hash is set,
+ * and the hash and the name of a slot never change once it is set.
+ */
+static bool item_namespace_is_stale(struct default_engine *engine,
+                                    const hash_item *it) {
+    const char *key = item_get_key(it);
+    const char *end;
+    uint32_t hash;
+    size_t ii;
+
+    end = memchr(key, engine->config.namespace_delimiter[0], it->nkey);
+    if (end == NULL || end == key) {
+        return false;
+    }
+    hash = item_namespace_hash(engine, key, end - key);
+    for (ii = 0; ii < NAMESPACE_PROBES; ++ii) {
+        struct namespace_slot *slot;
+        uint32_t slot_hash;
+
+        slot = &engine->namespaces.slots[(hash + ii) & engine->namespaces.mask];
+        slot_hash = slot->hash;
+        if (slot_hash == 0) {
+            return false;
+        }
+        if (slot_hash == hash) {
+            item_barrier();
+            if (slot->nname == (size_t)(end - key) &&
+                memcmp(slot->name, key, slot->nname) == 0) {
+                uint64_t cas = item_get_cas(it);
+                return cas != 0 && cas < slot->oldest_cas;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ * Is the item dead because of a flush_all (or the invalidation of its
+ * namespace)? The times only have a resolution of a second, so with CAS we
+ * also look at the CAS the flush took (every item gets a new one when it
+ * is linked): the items that were linked before it are dead too (see
+ * item_flush_expired).
+ */
+static bool item_is_flushed(struct default_engine *engine,
+                            const hash_item *it,
+                            rel_time_t current_time) {
+    rel_time_t oldest_live = engine->config.oldest_live;
+    uint64_t oldest_cas = engine->config.oldest_cas;
+    uint64_t cas;
+
+    if (engine->namespaces.used != 0 &&
+        item_namespace_is_stale(engine, it)) {
+        return true;
+    }
+    if (oldest_live == 0 || oldest_live > current_time) {
+        return false;
+    }
+    if (it->time <= oldest_live) {
+        return true;
+    }
+    cas = item_get_cas(it);
+    return oldest_cas != 0 && cas != 0 && cas < oldest_cas;
+}
+
+/*
+ * Move the item to the head of another LRU segment (or back to the head of
+ * its own). Caller must hold the item lock and the LRU lock.
+ */
+static void do_item_lru_move(struct default_engine *engine, hash_item *it,
+                             int lru, rel_time_t current_time) {
+    MEMCACHED_ITEM_BUMP(item_get_key(it), it->nkey, item_lru(it), lru);
+    item_unlink_q(engine, it);
+    item_set_lru(it, lru);
+    it->iflag &= ~ITEM_ACTIVE;
+    /* Keep each segment sorted by time (item_flush_expired depends on it) */
+    it->time = current_time;
+    item_link_q(engine, it);
+    if (lru == COLD_LRU) {
+        engine->items.itemstats[it->slabs_clsid].moves_to_cold++;
+    } else if (lru == WARM_LRU) {
+        engine->items.itemstats[it->slabs_clsid].moves_to_warm++;
+    }
+}
+
+/*
+ * Drop the LRU lock for a moment so that whoever holds the item lock we
+ * failed to get can finish what they're doing (they may be waiting for
+ * the LRU lock).
+ */
+static void item_lru_backoff(struct default_engine *engine,
+                             unsigned int clsid) {
+    cb_mutex_exit(&engine->items.lock[clsid]);
+#ifdef WIN32
+    Sleep(0);
+#else
+    usleep(10);
+#endif
+    mc_mutex_enter(&engine->items.lock[clsid], &engine->lock_stats.lru);
+}
+
+void item_stats_reset(struct default_engine *engine) {
+    int ii;
+    for (ii = 0; ii < POWER_LARGEST; ++ii) {
+        mc_mutex_enter(&engine->items.lock[ii], &engine->lock_stats.lru);
+        memset(&engine->items.itemstats[ii], 0,
+               sizeof(engine->items.itemstats[ii]));
+        cb_mutex_exit(&engine->items.lock[ii]);
+    }
+}
+
+
+/*
+ * Large values may be stored in a chain of chunks instead of in one huge
+ * slab chunk (see slab_chunk_max). Such an item is allocated from the
+ * chunk class and holds the first part of the value itself:
+ *
+ *   item:  [hash_item][cas][key][pad][item_chunk_head][data...]
+ *   chunk: [hash_item][data...]
+ *
+ * The chunks have a hash_item header so that the slab mover can tell what
+ * it is looking at. In a chunk next refers to the next chunk, h_next to
+ * the item, nbytes is the number of bytes of the value in it and flags is
+ * the hash of the item's key (so the slab mover may lock the item).
+ * Chunks are never linked into the LRU or the hash table, and they are
+ * only freed together with their item.
+ */
+struct item_chunk_head {
+    item_ref_t first;
+    uint32_t nhead; /* the number of bytes of the value in the item */
+};
+
+void item_layout_init(struct default_engine *engine) {
+    engine->items.layout = (engine->config.use_cas ? ITEM_WITH_CAS : 0) |
+        (engine->config.dcp || engine->config.vbucket_index ?
+         ITEM_WITH_SEQNO : 0) |
+        (engine->config.vbucket_index ? ITEM_WITH_VBLINKS : 0) |
+        (engine->config.eviction_gdsf ? ITEM_WITH_COST : 0) |
+        (engine->config.expiry_wheel ? ITEM_WITH_EXPIRY : 0) |
+        (engine->config.native_counters ? ITEM_WITH_COUNTER : 0);
+    engine->items.header_extra = item_layout_size[engine->items.layout];
+}
+
+/*
+ * Where the item_chunk_head of a chunked item, or the ext_loc of an
+ * ITEM_HDR item, lives:
+ *
+ *   header: [hash_item][cas][seqno][vb links][cost][expiry][counter][key]
+ *           [pad][ext_loc]
+ */
+static size_t item_meta_offset(struct default_engine *engine,
+                               size_t nkey) {
+    size_t ret = sizeof(hash_item) + item_header_extra(engine) + nkey;
+    if (ret % CHUNK_ALIGN_BYTES) {
+        ret += CHUNK_ALIGN_BYTES - (ret % CHUNK_ALIGN_BYTES);
+    }
+    return ret;
+}
+
+static struct item_chunk_head *item_get_chunk_head(struct default_engine *engine,
+                                                   const hash_item *it) {
+    return (void*)((char*)it + item_meta_offset(engine, it->nkey));
+}
+
+struct ext_loc *item_get_ext_loc(struct default_engine *engine,
+                                 const hash_item *it) {
+    return (void*)((char*)it + item_meta_offset(engine, it->nkey));
+}
+
+/* warning: don't use these macros with a function, as it evals its arg twice */
+static size_t ITEM_ntotal(struct default_engine *engine,
+                          const hash_item *item) {
+    if (item->iflag & ITEM_CHUNKED) {
+        /* Just the part living in the item's own slab chunk */
+        return item_meta_offset(engine, item->nkey) +
+            sizeof(struct item_chunk_head) +
+            item_get_chunk_head(engine, item)->nhead;
+    }
+    if (item->iflag & ITEM_HDR) {
+        /* nbytes is the size of the value in extstore */
+        return item_meta_offset(engine, item->nkey) + sizeof(struct ext_loc);
+    }
+
+    return (size_t)(item_header_end(item) - (const char*)item) +
+        item_header_extra(engine) + item->nkey + item->nbytes;
+}
+
+/*
+ * Get the first (piece == NULL) or the next part of the item's value in
+ * iov. Returns NULL when there are no more of them.
+ */
+static const hash_item *item_value_piece(struct default_engine *engine,
+                                         const hash_item *it,
+                                         const hash_item *piece,
+                                         struct iovec *iov) {
+    struct item_chunk_head *head;
+    const hash_item *next;
+
+    if ((it->iflag & ITEM_CHUNKED) == 0) {
+        if (piece != NULL) {
+            return NULL;
+        }
+        iov->iov_base = item_get_data(it);
+        iov->iov_len = it->nbytes;
+        return it;
+    }
+
+    head = item_get_chunk_head(engine, it);
+    if (piece == NULL) {
+        iov->iov_base = (void*)(head + 1);
+        iov->iov_len = head->nhead;
+        return it;
+    }
+
+    if (piece == it) {
+        next = item_deref(engine, head->first);
+    } else {
+        next = item_next(engine, piece);
+    }
+    if (next != NULL) {
+        iov->iov_base = (void*)(next + 1);
+        iov->iov_len = next->nbytes;
+    }
+    return next;
+}
+
+int item_get_value_iov(struct default_engine *engine, const hash_item *it,
+                       struct iovec *iov, int niov) {
+    const hash_item *piece = NULL;
+    struct iovec dummy;
+    int ii = 0;
+
+    while ((piece = item_value_piece(engine, it, piece,
+                                     ii < niov ? &iov[ii] : &dummy)) != NULL) {
+        ++ii;
+    }
+    return ii;
+}
+
+void item_write_value(struct default_engine *engine, hash_item *it,
+                      size_t offset, const void *data, size_t len) {
+    const hash_item *piece = NULL;
+    const char *src = data;
+    struct iovec iov;
+
+    while (len > 0 &&
+           (piece = item_value_piece(engine, it, piece, &iov)) != NULL) {
+        size_t n;
+        if (offset >= iov.iov_len) {
+            offset -= iov.iov_len;
+            continue;
+        }
+        n = iov.iov_len - offset;
+        if (n > len) {
+            n = len;
+        }
+        memcpy((char*)iov.iov_base + offset, src, n);
+        src += n;
+        len -= n;
+        offset = 0;
+    }
+}
+
+void item_read_value(struct default_engine *engine, const hash_item *it,
+                     void *data) {
+    const hash_item *piece = NULL;
+    char *dst = data;
+    struct iovec iov;
+
+    while ((piece = item_value_piece(engine, it, piece, &iov)) != NULL) {
+        memcpy(dst, iov.iov_base, iov.iov_len);
+        dst += iov.iov_len;
+    }
+}
+
+/* Copy the value of src into dest, starting at offset */
+static void item_copy_value(struct default_engine *engine, hash_item *dest,
+                            size_t offset, const hash_item *src) {
+    const hash_item *piece = NULL;
+    struct iovec iov;
+
+    while ((piece = item_value_piece(engine, src, piece, &iov)) != NULL) {
+        item_write_value(engine, dest, offset, iov.iov_base, iov.iov_len);
+        offset += iov.iov_len;
+    }
+}
+
+/* The memory used by the item (including its chunks) */
+static size_t item_total_size(struct default_engine *engine,
+                              const hash_item *it) {
+    size_t ret = ITEM_ntotal(engine, it);
+    if (it->iflag & ITEM_CHUNKED) {
+        const hash_item *chunk;
+        chunk = item_deref(engine, item_get_chunk_head(engine, it)->first);
+        for (; chunk != NULL; chunk = item_next(engine, chunk)) {
+            ret += sizeof(hash_item) + chunk->nbytes;
+        }
+    }
+    return ret;
+}
+
+/* Give the chunk and the ones after it back to the slab allocator */
+static void item_free_chunk_list(struct default_engine *engine,
+                                 hash_item *chunk) {
+    while (chunk != NULL) {
+        hash_item *next = item_next(engine, chunk);
+        unsigned int clsid = chunk->slabs_clsid;
+        size_t ntotal = sizeof(hash_item) + chunk->nbytes;
+        chunk->slabs_clsid = 0;
+        chunk->iflag = ITEM_SLABBED;
+        slabs_free(engine, chunk, ntotal, clsid);
+        chunk = next;
+    }
+}
+
+/* Give the chunks of the item back to the slab allocator */
+static void item_free_chunks(struct default_engine *engine, hash_item *it) {
+    struct item_chunk_head *head = item_get_chunk_head(engine, it);
+
+    item_free_chunk_list(engine, item_deref(engine, head->first));
+    head->first = 0;
+    it->iflag &= ~ITEM_CHUNKED;
+}
+
+/*
+ * Get the next CAS id for a new item. The counter is bumped with an
+ * atomic add instead of under a lock. The values are unique and grow
+ * over time, and as every update of a key happens with its item lock
+ * held the CAS of a given key never goes backwards.
+ */
+#ifdef WIN32
+static uint64_t get_cas_id(struct default_engine *engine) {
+    return (uint64_t)InterlockedIncrement64((volatile LONGLONG *)&engine->cas_id);
+}
+#elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+static uint64_t get_cas_id(struct default_engine *engine) {
+    return atomic_inc_64_nv(&engine->cas_id);
+}
+#else
+static uint64_t get_cas_id(struct default_engine *engine) {
+    return __sync_add_and_fetch(&engine->cas_id, 1);
+}
+#endif
+
+/* Enable this for reference-count debugging. */
+#if 0
+# define DEBUG_REFCNT(it,op) \
+                fprintf(stderr, "item %x refcnt(%c) %d %c%c%c\n", \
+                        it, op, it->refcount, \
+                        (it->it_flags & ITEM_LINKED) ? 'L' : ' ', \
+                        (it->it_flags & ITEM_SLABBED) ? 'S' : ' ')
+#else
+# define DEBUG_REFCNT(it,op) while(0)
+#endif
+
+
+/*
+ * With eviction_policy=gdsf (GreedyDual-Size-Frequency) every item carries
+ * the cost of recreating it (1 unless the client told us otherwise) and a
+ * priority. The priority starts out at the inflation value of its slab
+ * class plus cost / size, goes up by cost / size on every hit, and is
+ * brought up to the inflation value first if that has moved past it. We
+ * evict the item with the lowest priority among the first
+ * eviction_samples evictable ones at the tail, and the inflation value
+ * of the class goes up to its priority, so the items nobody asks for
+ * fall behind the new ones over time.
+ */
+static float item_gdsf_value(const hash_item *it, const struct item_cost *c) {
+    return (float)c->cost / (float)(it->nkey + it->nbytes);
+}
+
+/* Set up the cost of a new item */
+static void item_gdsf_init(hash_item *it) {
+    if (it->iflag & ITEM_WITH_COST) {
+        struct item_cost c;
+        c.cost = 1;
+        c.priority = 0;
+        memcpy(item_get_cost(it), &c, sizeof(c));
+    }
+}
+
+/* Carry the cost and priority over to another form of the item */
+static void item_gdsf_copy(hash_item *to, const hash_item *from) {
+    if ((to->iflag & from->iflag & ITEM_WITH_COST) != 0) {
+        memcpy(item_get_cost(to), item_get_cost(from),
+               sizeof(struct item_cost));
+    }
+}
+
+/* Give the item its first priority. Caller must hold its LRU lock */
+static void do_item_gdsf_link(struct default_engine *engine, hash_item *it) {
+    struct item_cost c;
+    memcpy(&c, item_get_cost(it), sizeof(c));
+    c.priority = engine->items.inflation[it->slabs_clsid] +
+        item_gdsf_value(it, &c);
+    memcpy(item_get_cost(it), &c, sizeof(c));
+}
+
+/*
+ * Bump the priority of the item. Caller must hold the item lock (but not
+ * the LRU lock, so the inflation value we see may be a little behind).
+ */
+static void do_item_gdsf_hit(struct default_engine *engine, hash_item *it) {
+    float inflation = engine->items.inflation[it->slabs_clsid];
+    struct item_cost c;
+    memcpy(&c, item_get_cost(it), sizeof(c));
+    if (c.priority < inflation) {
+        c.priority = inflation;
+    }
+    c.priority += item_gdsf_value(it, &c);
+    memcpy(item_get_cost(it), &c, sizeof(c));
+}
+
+/*
+ * Evict the item (or reclaim it, if it has expired) to make room in its
+ * slab class. Caller must hold the item lock for hv and the LRU lock.
+ */
+static void do_item_evict(struct default_engine *engine, hash_item *it,
+                          uint32_t hv, const void *cookie,
+                          rel_time_t current_time) {
+    unsigned int id = it->slabs_clsid;
+
+    MEMCACHED_ITEM_EVICT(item_get_key(it), it->nkey, it->nbytes, id,
+                         it->exptime != 0 && it->exptime <= current_time);
+    if (it->exptime == 0 || it->exptime > current_time) {
+        engine->items.itemstats[id].evicted++;
+        engine->items.itemstats[id].evicted_time = current_time - it->time;
+        if (it->exptime != 0) {
+            engine->items.itemstats[id].evicted_nonzero++;
+        }
+        if (item_lru(it) == TEMP_LRU) {
+            engine->items.itemstats[id].evicted_temp++;
+        }
+        mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+        engine->stats.evictions++;
+        cb_mutex_exit(&engine->stats.lock);
+        if (cookie != NULL) {
+            /* NULL if one of our own threads allocates */
+            engine->server.stat->evicting(cookie, item_get_key(it), it->nkey);
+        }
+    } else {
+        engine->items.itemstats[id].reclaimed++;
+        mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+        engine->stats.reclaimed++;
+        cb_mutex_exit(&engine->stats.lock);
+    }
+    do_item_unlink_nolock(engine, it, hv);
+}
+
+/*
+ * Evict the item with the lowest gdsf priority among the first
+ * eviction_samples ones at the tail of slab class id nobody holds a
+ * reference to. Caller must hold the LRU lock. Returns false if we
+ * couldn't get at any of them.
+ */
+static bool do_item_evict_sampled(struct default_engine *engine,
+                                  unsigned int id, const void *cookie,
+                                  cb_mutex_t *held, rel_time_t current_time) {
+    hash_item *victim = NULL;
+    float lowest = 0;
+    size_t samples = 0;
+    int tries = search_items;
+    hash_item *search;
+    cb_mutex_t *lock;
+    uint32_t hv;
+    bool ret = false;
+
+    for (search = item_lru_last(engine, id);
+         tries > 0 && search != NULL &&
+         samples < engine->config.eviction_samples;
+         tries--, search = item_lru_prev(engine, search)) {
+        if (search->nkey == 0 && search->nbytes == 0) {
+            /* cursor */
+            continue;
+        }
+        hv = item_hash(engine, search);
+        if (!item_trylock(engine, hv, held, &lock)) {
+            continue;
+        }
+        if (search->refcount == 0) {
+            struct item_cost c;
+            memcpy(&c, item_get_cost(search), sizeof(c));
+            if (victim == NULL || c.priority < lowest) {
+                victim = search;
+                lowest = c.priority;
+            }
+            ++samples;
+        }
+        if (lock != NULL) {
+            cb_mutex_exit(lock);
+        }
+    }
+
+    /* Nobody can unlink it while we hold the LRU lock */
+    if (victim != NULL) {
+        hv = item_hash(engine, victim);
+        if (item_trylock(engine, hv, held, &lock)) {
+            if (victim->refcount == 0) {
+                if (lowest > engine->items.inflation[id]) {
+                    engine->items.inflation[id] = lowest;
+                }
+                do_item_evict(engine, victim, hv, cookie, current_time);
+                ret = true;
+            }
+            if (lock != NULL) {
+                cb_mutex_exit(lock);
+            }
+        }
+    }
+    return ret;
+}
+
+/*
+ * Move the CLOCK hand of tiny class id along its chunks to the first item
+ * nobody holds a reference to which wasn't used since the hand last came
+ * by (clearing ITEM_ACTIVE on the ones which were), and evict it. Caller
+ * must hold the LRU lock, which keeps anybody from allocating the chunks
+ * we look at. Returns false if we couldn't find one.
+ */
+static bool do_item_clock_evict(struct default_engine *engine,
+                                unsigned int id, const void *cookie,
+                                cb_mutex_t *held, rel_time_t current_time) {
+    unsigned int size = engine->slabs.slabclass[id].size;
+    unsigned int perslab = engine->slabs.slabclass[id].perslab;
+    unsigned int pos = engine->items.clock_hand[id];
+    char *page = slabs_page(engine, id, pos / perslab);
+    unsigned int ii;
+    bool ret = false;
+
+    for (ii = 0; ii < 2 * clock_items && !ret; ++ii) {
+        hash_item *it;
+        cb_mutex_t *lock;
+        uint32_t hv;
+
+        if (page == NULL) {
+            if (pos == 0) {
+                /* It has no pages */
+                break;
+            }
+            pos = 0;
+            page = slabs_page(engine, id, 0);
+            continue;
+        }
+        it = (hash_item*)(page + (size_t)(pos % perslab) * size);
+        if (++pos % perslab == 0) {
+            page = slabs_page(engine, id, pos / perslab);
+        }
+
+        /* A linked item keeps its key, so we may hash it without the lock */
+        if ((it->iflag & (ITEM_LINKED | ITEM_TINY)) !=
+            (ITEM_LINKED | ITEM_TINY)) {
+            continue;
+        }
+        hv = item_hash(engine, it);
+        if (!item_trylock(engine, hv, held, &lock)) {
+            continue;
+        }
+        if ((it->iflag & ITEM_LINKED) != 0 && it->refcount == 0) {
+            if ((it->iflag & ITEM_ACTIVE) != 0 && ii < clock_items &&
+                !item_is_flushed(engine, it, current_time) &&
+                (it->exptime == 0 || it->exptime > current_time)) {
+                it->iflag &= ~ITEM_ACTIVE;
+            } else {
+                do_item_evict(engine, it, hv, cookie, current_time);
+                ret = true;
+            }
+        }
+        if (lock != NULL) {
+            cb_mutex_exit(lock);
+        }
+    }
+    engine->items.clock_hand[id] = pos;
+    return ret;
+}
+
+/*@null@*/
+/*
+ * held is the item lock the caller already holds (if any). Items in that
+ * stripe may be reclaimed or evicted without taking their lock.
+ */
+static hash_item *do_item_alloc_slot(struct default_engine *engine,
+                                     const size_t ntotal,
+                                     const void *cookie,
+                                     cb_mutex_t *held) {
+    hash_item *it = NULL;
+    int tries = search_items;
+    hash_item *search;
+    rel_time_t current_time;
+    unsigned int id;
+    cb_mutex_t *lock;
+    int backoffs = search_items;
+
+    if ((id = slabs_clsid(engine, ntotal)) == 0) {
+        return 0;
+    }
+
+    mc_mutex_enter(&engine->items.lock[id], &engine->lock_stats.lru);
+    if (engine->slabs.sizer != NULL) {
+        slabs_count_alloc(engine, ntotal);
+    }
+
+    /* do a quick check if we have any expired items in the tail.. */
+    tries = search_items;
+    current_time = engine->server.core->get_current_time();
+
+    for (search = item_lru_last(engine, id);
+         tries > 0 && search != NULL;
+         tries--, search = item_lru_prev(engine, search)) {
+        uint32_t hv;
+        if (search->nkey == 0 && search->nbytes == 0) {
+            /* cursor */
+            continue;
+        }
+        hv = item_hash(engine, search);
+        if (!item_trylock(engine, hv, held, &lock)) {
+            continue;
+        }
+        if (search->refcount == 0 &&
+            (item_is_flushed(engine, search, current_time) ||
+             (search->exptime != 0 && search->exptime < current_time))) {
+            it = search;
+            /* I don't want to actually free the object, just steal
+             * the item to avoid to grab the slab mutex twice ;-)
+             */
+            mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+            engine->stats.reclaimed++;
+            cb_mutex_exit(&engine->stats.lock);
+            engine->items.itemstats[id].reclaimed++;
+            it->refcount = 1;
+            slabs_adjust_mem_requested(engine, it->slabs_clsid, ITEM_ntotal(engine, it), ntotal);
+            do_item_unlink_nolock(engine, it, hv);
+            if (it->iflag & ITEM_CHUNKED) {
+                item_free_chunks(engine, it);
+            }
+            /* Initialize the item block: */
+            it->slabs_clsid = 0;
+            it->refcount = 0;
+        }
+        if (lock != NULL) {
+            cb_mutex_exit(lock);
+        }
+        if (it != NULL) {
+            break;
+        }
+    }
+
+    if (it == NULL && (it = slabs_alloc(engine, ntotal, id)) == NULL) {
+        /*
+        ** Could not find an expired item at the tail, and memory allocation
+        ** failed. Try to evict some items!
+        */
+        tries = search_items;
+
+        /* If requested to not push old items out of cache when memory runs out,
+         * we're out of luck at this point...
+         */
+
+        if (engine->config.evict_to_free == 0) {
+            engine->items.itemstats[id].outofmemory++;
+            cb_mutex_exit(&engine->items.lock[id]);
+            return NULL;
+        }
+
+        /*
+         * try to get one off the right LRU
+         * don't necessariuly unlink the tail because it may be locked: refcount>0
+         * search up from tail an item with refcount==0 and unlink it; give up after search_items
+         * tries
+         */
+
+        if (item_lru_last(engine, id) == NULL &&
+            !engine->slabs.slabclass[id].tiny) {
+            engine->items.itemstats[id].outofmemory++;
+            cb_mutex_exit(&engine->items.lock[id]);
+            return NULL;
+        }
+
+        for (;;) {
+            bool evicted = false;
+            bool busy = false;
+            hash_item *next;
+
+            if (engine->slabs.slabclass[id].tiny &&
+                do_item_clock_evict(engine, id, cookie, held, current_time)) {
+                break;
+            }
+            if (engine->config.eviction_gdsf &&
+                do_item_evict_sampled(engine, id, cookie, held,
+                                      current_time)) {
+                break;
+            }
+            for (search = item_lru_last(engine, id); tries > 0 && search != NULL; tries--, search = next) {
+                uint32_t hv;
+                next = item_lru_prev(engine, search);
+                if (search->nkey == 0 && search->nbytes == 0) {
+                    continue;
+                }
+                hv = item_hash(engine, search);
+                if (!item_trylock(engine, hv, held, &lock)) {
+                    busy = true;
+                    continue;
+                }
+                if (search->refcount == 0 &&
+                    (search->iflag & ITEM_ACTIVE) != 0 &&
+                    engine->config.lru_segmented &&
+                    item_lru(search) != TEMP_LRU &&
+                    !item_is_flushed(engine, search, current_time)) {
+                    /* It has been used since it was demoted; second chance */
+                    do_item_lru_move(engine, search, WARM_LRU, current_time);
+                } else if (search->refcount == 0) {
+                    do_item_evict(engine, search, hv, cookie, current_time);
+                    evicted = true;
+                }
+                if (lock != NULL) {
+                    cb_mutex_exit(lock);
+                }
+                if (evicted) {
+                    break;
+                }
+            }
+
+            if (evicted || !busy || --backoffs == 0) {
+                break;
+            }
+            /*
+             * Someone else holds the lock for the items at the tail (and
+             * they may be waiting for our LRU lock). Let them finish and
+             * start over.
+             */
+            item_lru_backoff(engine, id);
+            tries = search_items;
+        }
+        it = slabs_alloc(engine, ntotal, id);
+        if (it == 0) {
+            engine->items.itemstats[id].outofmemory++;
+            /* Last ditch effort. There is a very rare bug which causes
+             * refcount leaks. We've fixed most of them, but it still happens,
+             * and it may happen in the future.
+             * We can reasonably assume no item can stay locked for more than
+             * three hours, so if we find one in the tail which is that old,
+             * free it anyway.
+             */
+            tries = search_items;
+            for (search = item_lru_last(engine, id); tries > 0 && search != NULL; tries--, search = item_lru_prev(engine, search)) {
+                uint32_t hv;
+                bool repaired = false;
+                if (search->nkey == 0 && search->nbytes == 0) {
+                    continue;
+                }
+                hv = item_hash(engine, search);
+                if (!item_trylock(engine, hv, held, &lock)) {
+                    continue;
+                }
+                if (search->refcount != 0 && search->time + TAIL_REPAIR_TIME < current_time) {
+                    engine->items.itemstats[id].tailrepairs++;
+                    search->refcount = 0;
+                    do_item_unlink_nolock(engine, search, hv);
+                    repaired = true;
+                }
+                if (lock != NULL) {
+                    cb_mutex_exit(lock);
+                }
+                if (repaired) {
+                    break;
+                }
+            }
+            it = slabs_alloc(engine, ntotal, id);
+            if (it == 0) {
+                cb_mutex_exit(&engine->items.lock[id]);
+                return NULL;
+            }
+        }
+    }
+
+    cb_assert(it->slabs_clsid == 0);
+
+    it->slabs_clsid = id;
+
+    cb_assert(it != engine->items.heads[it->slabs_clsid][HOT_LRU]);
+    cb_mutex_exit(&engine->items.lock[id]);
+
+    it->next = it->prev = it->h_next = 0;
+    it->refcount = 1;     /* the caller will have a reference */
+    DEBUG_REFCNT(it, '*');
+    return it;
+}
+
+/*
+ * Allocate chunks of the item for nbytes of its value, and store the ref
+ * to the first one in first. With whole every chunk gets a slot of the
+ * chunk class, leaving room at the end of the last one for appends. On
+ * failure the chunks allocated so far stay linked from first (for a new
+ * item they are released by item_free).
+ */
+static bool do_item_alloc_chunks(struct default_engine *engine,
+                                 hash_item *it, item_ref_t *first,
+                                 uint32_t hv, size_t nbytes, bool whole,
+                                 const void *cookie, cb_mutex_t *held) {
+    size_t chunk_max = engine->slabs.slabclass[engine->slabs.chunk_clsid].size;
+    hash_item *last = NULL;
+
+    while (nbytes > 0) {
+        hash_item *chunk;
+        size_t n = chunk_max - sizeof(hash_item);
+        if (n > nbytes) {
+            n = nbytes;
+        }
+        chunk = do_item_alloc_slot(engine,
+                                   whole ? chunk_max : sizeof(hash_item) + n,
+                                   cookie, held);
+        if (chunk == NULL) {
+            return false;
+        }
+        if (whole) {
+            /* What we use of it, as item_free_chunks gives back */
+            slabs_adjust_mem_requested(engine, chunk->slabs_clsid, chunk_max,
+                                       sizeof(hash_item) + n);
+        }
+        chunk->refcount = 0;
+        chunk->iflag = ITEM_CHUNK;
+        chunk->nkey = 0;
+        chunk->nbytes = (uint32_t)n;
+        chunk->flags = hv;
+        chunk->exptime = 0;
+        item_set_h_next(engine, chunk, it);
+        if (last == NULL) {
+            *first = item_ref(engine, chunk);
+        } else {
+            item_set_next(engine, last, chunk);
+        }
+        last = chunk;
+        nbytes -= n;
+    }
+    return true;
+}
+
+hash_item *do_item_alloc(struct default_engine *engine,
+                         const void *key,
+                         const size_t nkey,
+                         const int flags,
+                         const rel_time_t exptime,
+                         const int nbytes,
+                         const void *cookie,
+                         uint8_t datatype,
+                         cb_mutex_t *held) {
+    hash_item *it;
+    unsigned int chunk_clsid = engine->slabs.chunk_clsid;
+    size_t nhead = 0;
+    size_t ntotal = sizeof(hash_item) + item_header_extra(engine) + nkey +
+        nbytes;
+    bool tiny = false;
+
+    /*
+     * The daemon inflates compressed values in place, so they have to
+     * stay in one piece.
+     */
+    if (chunk_clsid != 0 &&
+        ntotal > engine->slabs.slabclass[chunk_clsid].size &&
+        (size_t)nbytes <= engine->config.item_size_max &&
+        datatype != PROTOCOL_BINARY_DATATYPE_COMPRESSED &&
+        datatype != PROTOCOL_BINARY_DATATYPE_COMPRESSED_JSON) {
+        ntotal = engine->slabs.slabclass[chunk_clsid].size;
+        nhead = ntotal - item_meta_offset(engine, nkey) -
+            sizeof(struct item_chunk_head);
+    } else if (ntotal - ITEM_LINKS_SIZE <= engine->slabs.tiny_max) {
+        /* It fits in a tiny class without the LRU links */
+        ntotal -= ITEM_LINKS_SIZE;
+        tiny = true;
+    }
+
+    if ((it = do_item_alloc_slot(engine, ntotal, cookie, held)) == NULL) {
+        return NULL;
+    }
+
+    it->iflag = engine->items.layout | (tiny ? ITEM_TINY : 0);
+    item_gdsf_init(it);
+    it->nkey = (uint16_t)nkey;
+    it->nbytes = nbytes;
+    it->flags = flags;
+    it->datatype = datatype;
+    memcpy((void*)item_get_key(it), key, nkey);
+    it->exptime = exptime;
+
+    if (nhead != 0) {
+        struct item_chunk_head *head = item_get_chunk_head(engine, it);
+        head->first = 0;
+        head->nhead = (uint32_t)nhead;
+        it->iflag |= ITEM_CHUNKED;
+        if (!do_item_alloc_chunks(engine, it, &head->first,
+                                  item_hash(engine, it), nbytes - nhead,
+                                  false, cookie, held)) {
+            it->refcount = 0;
+            item_free(engine, it);
+            return NULL;
+        }
+    }
+    return it;
+}
+
+static void item_free(struct default_engine *engine, hash_item *it) {
+    size_t ntotal = ITEM_ntotal(engine, it);
+    unsigned int clsid;
+    cb_assert((it->iflag & ITEM_LINKED) == 0);
+    cb_assert(it != engine->items.heads[it->slabs_clsid][item_lru(it)]);
+    cb_assert(it != engine->items.tails[it->slabs_clsid][item_lru(it)]);
+    cb_assert(it->refcount == 0);
+
+    if (it->iflag & ITEM_CHUNKED) {
+        item_free_chunks(engine, it);
+    }
+
+    /* so slab size changer can tell later if item is already free or not */
+    clsid = it->slabs_clsid;
+    it->slabs_clsid = 0;
+    it->iflag |= ITEM_SLABBED;
+    DEBUG_REFCNT(it, 'F');
+    slabs_free(engine, it, ntotal, clsid);
+}
+
+/* Caller must hold the LRU lock for the item's slab class */
+static void item_link_q(struct default_engine *engine, hash_item *it) { /* item is the new head */
+    hash_item **head, **tail;
+    cb_assert(it->slabs_clsid < POWER_LARGEST);
+    cb_assert((it->iflag & ITEM_SLABBED) == 0);
+
+    if (it->iflag & ITEM_TINY) {
+        /* The CLOCK of the class finds it on its page */
+        engine->items.sizes[it->slabs_clsid][item_lru(it)]++;
+        return;
+    }
+    head = &engine->items.heads[it->slabs_clsid][item_lru(it)];
+    tail = &engine->items.tails[it->slabs_clsid][item_lru(it)];
+    cb_assert(it != *head);
+    cb_assert((*head && *tail) || (*head == 0 && *tail == 0));
+    it->prev = 0;
+    item_set_next(engine, it, *head);
+    if (*head) item_set_prev(engine, *head, it);
+    *head = it;
+    if (*tail == 0) *tail = it;
+    engine->items.sizes[it->slabs_clsid][item_lru(it)]++;
+    return;
+}
+
+/* Caller must hold the LRU lock for the item's slab class */
+static void item_unlink_q(struct default_engine *engine, hash_item *it) {
+    hash_item **head, **tail;
+    hash_item *next, *prev;
+    cb_assert(it->slabs_clsid < POWER_LARGEST);
+
+    if (it->iflag & ITEM_TINY) {
+        engine->items.sizes[it->slabs_clsid][item_lru(it)]--;
+        return;
+    }
+    next = item_next(engine, it);
+    prev = item_prev(engine, it);
+    head = &engine->items.heads[it->slabs_clsid][item_lru(it)];
+    tail = &engine->items.tails[it->slabs_clsid][item_lru(it)];
+
+    if (*head == it) {
+        cb_assert(prev == 0);
+        *head = next;
+    }
+    if (*tail == it) {
+        cb_assert(next == 0);
+        *tail = prev;
+    }
+    cb_assert(next != it);
+    cb_assert(prev != it);
+
+    if (next) next->prev = it->prev;
+    if (prev) prev->next = it->next;
+    engine->items.sizes[it->slabs_clsid][item_lru(it)]--;
+    return;
+}
+
+/*
+ * The lists of the vbucket index are linked through the item_vb_links
+ * following the seqno of the items. The cursors walking them use their
+ * own next and prev, and keep the vbucket they are in in flags.
+ */
+static struct item_vb_links *item_vb_links(const hash_item *it) {
+    if (it->nkey == 0 && it->nbytes == 0) {
+        return (void*)&((hash_item*)it)->next;
+    }
+    return item_get_vb_links(it);
+}
+
+static uint16_t item_vb(const hash_item *it) {
+    if (it->nkey == 0 && it->nbytes == 0) {
+        return (uint16_t)it->flags;
+    }
+    return item_get_vbucket(it);
+}
+
+static cb_mutex_t *item_vb_lock(struct default_engine *engine,
+                                uint16_t vbucket) {
+    return &engine->vbucket_index.locks[vbucket % engine->vbucket_index.nlocks];
+}
+
+/*
+ * Put the item after prev in the list of its vbucket (first if prev is
+ * NULL). Caller must hold the vbucket lock.
+ */
+static void item_vb_link_q(struct default_engine *engine, hash_item *prev,
+                           hash_item *it) {
+    struct vbucket_items *list = &engine->vbucket_index.lists[item_vb(it)];
+    struct item_vb_links *links = item_vb_links(it);
+    hash_item *next;
+
+    if (prev != NULL) {
+        next = item_deref(engine, item_vb_links(prev)->next);
+        item_vb_links(prev)->next = item_ref(engine, it);
+    } else {
+        next = list->head;
+        list->head = it;
+    }
+    if (next != NULL) {
+        item_vb_links(next)->prev = item_ref(engine, it);
+    } else {
+        list->tail = it;
+    }
+    links->next = item_ref(engine, next);
+    links->prev = item_ref(engine, prev);
+}
+
+/* Caller must hold the vbucket lock */
+static void item_vb_unlink_q(struct default_engine *engine, hash_item *it) {
+    struct vbucket_items *list = &engine->vbucket_index.lists[item_vb(it)];
+    struct item_vb_links *links = item_vb_links(it);
+    hash_item *next = item_deref(engine, links->next);
+    hash_item *prev = item_deref(engine, links->prev);
+
+    if (prev != NULL) {
+        item_vb_links(prev)->next = links->next;
+    } else {
+        cb_assert(list->head == it);
+        list->head = next;
+    }
+    if (next != NULL) {
+        item_vb_links(next)->prev = links->prev;
+    } else {
+        cb_assert(list->tail == it);
+        list->tail = prev;
+    }
+    links->next = links->prev = 0;
+}
+
+/* Add the item to the end of its vbucket. Caller must hold the item lock */
+static void do_item_vb_link(struct default_engine *engine, hash_item *it) {
+    if (engine->config.vbucket_index) {
+        uint16_t vbucket = item_get_vbucket(it);
+        struct vbucket_items *list = &engine->vbucket_index.lists[vbucket];
+
+        mc_mutex_enter(item_vb_lock(engine, vbucket),
+                       &engine->lock_stats.vbuckets);
+        item_vb_link_q(engine, list->tail, it);
+        list->items++;
+        list->bytes += item_total_size(engine, it);
+        cb_mutex_exit(item_vb_lock(engine, vbucket));
+    }
+}
+
+/* Caller must hold the item lock */
+static void do_item_vb_unlink(struct default_engine *engine, hash_item *it) {
+    if (engine->config.vbucket_index) {
+        uint16_t vbucket = item_get_vbucket(it);
+        struct vbucket_items *list = &engine->vbucket_index.lists[vbucket];
+
+        mc_mutex_enter(item_vb_lock(engine, vbucket),
+                       &engine->lock_stats.vbuckets);
+        item_vb_unlink_q(engine, it);
+        list->items--;
+        list->bytes -= item_total_size(engine, it);
+        cb_mutex_exit(item_vb_lock(engine, vbucket));
+    }
+}
+
+/*
+ * Put the copy the slab mover made of the item in its place in the list.
+ * The links of the copy may be stale (they are only stable with the lock).
+ */
+static void do_item_vb_relocate(struct default_engine *engine,
+                                hash_item *it, hash_item *new_it) {
+    if (engine->config.vbucket_index) {
+        uint16_t vbucket = item_get_vbucket(it);
+        struct vbucket_items *list = &engine->vbucket_index.lists[vbucket];
+        struct item_vb_links *links = item_vb_links(new_it);
+        hash_item *next, *prev;
+
+        mc_mutex_enter(item_vb_lock(engine, vbucket),
+                       &engine->lock_stats.vbuckets);
+        *links = *item_vb_links(it);
+        next = item_deref(engine, links->next);
+        prev = item_deref(engine, links->prev);
+        if (prev != NULL) {
+            item_vb_links(prev)->next = item_ref(engine, new_it);
+        } else {
+            list->head = new_it;
+        }
+        if (next != NULL) {
+            item_vb_links(next)->prev = item_ref(engine, new_it);
+        } else {
+            list->tail = new_it;
+        }
+        cb_mutex_exit(item_vb_lock(engine, vbucket));
+    }
+}
+
+/*
+ * With expiry_wheel every linked item with an exptime is also in a slot
+ * of the expiry wheel, and the expiry thread unlinks the items of every
+ * second as it passes, so that their memory is free on time. A slot of
+ * level n holds the items expiring 64^n to 64^(n+1) seconds after
+ * wheel.now (picked by bits 6n and up of the exptime). When wheel.now
+ * gets to the start of the range of a slot of a higher level its items
+ * are "cascaded" down to where they belong now. The slots are protected
+ * by the wheel lock, which is taken after the item and LRU locks; the
+ * expiry thread only tries the item locks. An item is in the wheel if
+ * (and only if) it is linked with an exptime, which only changes with
+ * the item lock held.
+ */
+static uint32_t item_expiry_slot(const struct expiry_wheel *wheel,
+                                 rel_time_t exptime) {
+    const rel_time_t horizon =
+        (rel_time_t)1 << (EXPIRY_WHEEL_BITS * EXPIRY_WHEEL_LEVELS);
+    rel_time_t when = exptime < wheel->now ? wheel->now : exptime;
+    uint32_t level = 0;
+
+    while (level < EXPIRY_WHEEL_LEVELS - 1 &&
+           when - wheel->now >=
+           (rel_time_t)1 << (EXPIRY_WHEEL_BITS * (level + 1))) {
+        ++level;
+    }
+    if (when - wheel->now >= horizon) {
+        /* Wait at the end of the last level, and look again from there */
+        when = wheel->now + horizon - 1;
+    }
+    return level * EXPIRY_WHEEL_SLOTS +
+        ((when >> (EXPIRY_WHEEL_BITS * level)) & (EXPIRY_WHEEL_SLOTS - 1));
+}
+
+static hash_item **item_expiry_head(struct expiry_wheel *wheel,
+                                    uint32_t slot) {
+    return &wheel->slots[slot / EXPIRY_WHEEL_SLOTS][slot % EXPIRY_WHEEL_SLOTS];
+}
+
+/* Put the item first in its slot. Caller must hold the wheel lock */
+static void item_expiry_link_q(struct default_engine *engine,
+                               hash_item *it) {
+    struct expiry_wheel *wheel = &engine->expiry;
+    struct item_expiry_links *links = item_get_expiry_links(it);
+    hash_item **head;
+
+    links->slot = item_expiry_slot(wheel, it->exptime);
+    head = item_expiry_head(wheel, links->slot);
+    links->prev = 0;
+    links->next = item_ref(engine, *head);
+    if (*head != NULL) {
+        item_get_expiry_links(*head)->prev = item_ref(engine, it);
+    }
+    *head = it;
+}
+
+/* Caller must hold the wheel lock */
+static void item_expiry_unlink_q(struct default_engine *engine,
+                                 hash_item *it) {
+    struct item_expiry_links *links = item_get_expiry_links(it);
+    hash_item *next = item_deref(engine, links->next);
+    hash_item *prev = item_deref(engine, links->prev);
+
+    if (prev != NULL) {
+        item_get_expiry_links(prev)->next = links->next;
+    } else {
+        hash_item **head = item_expiry_head(&engine->expiry, links->slot);
+        cb_assert(*head == it);
+        *head = next;
+    }
+    if (next != NULL) {
+        item_get_expiry_links(next)->prev = links->prev;
+    }
+    links->next = links->prev = 0;
+    links->slot = ITEM_EXPIRY_NONE;
+}
+
+/* Caller must hold the item lock */
+static void do_item_expiry_link(struct default_engine *engine,
+                                hash_item *it) {
+    if (engine->config.expiry_wheel && it->exptime != 0) {
+        cb_mutex_enter(&engine->expiry.lock);
+        item_expiry_link_q(engine, it);
+        engine->expiry.items++;
+        cb_mutex_exit(&engine->expiry.lock);
+    }
+}
+
+/* Caller must hold the item lock */
+static void do_item_expiry_unlink(struct default_engine *engine,
+                                  hash_item *it) {
+    if (engine->config.expiry_wheel && it->exptime != 0) {
+        cb_mutex_enter(&engine->expiry.lock);
+        item_expiry_unlink_q(engine, it);
+        engine->expiry.items--;
+        cb_mutex_exit(&engine->expiry.lock);
+    }
+}
+
+/*
+ * Give the (linked) item a new exptime, and move it to the slot for it.
+ * Caller must hold the item lock.
+ */
+static void do_item_set_exptime(struct default_engine *engine,
+                                hash_item *it, rel_time_t exptime) {
+    do_item_expiry_unlink(engine, it);
+    it->exptime = exptime;
+    do_item_expiry_link(engine, it);
+}
+
+/* Put the copy the slab mover made of the item in its place in the slot */
+static void do_item_expiry_relocate(struct default_engine *engine,
+                                    hash_item *it, hash_item *new_it) {
+    if (engine->config.expiry_wheel && it->exptime != 0) {
+        struct item_expiry_links *links = item_get_expiry_links(new_it);
+        hash_item *next, *prev;
+
+        cb_mutex_enter(&engine->expiry.lock);
+        *links = *item_get_expiry_links(it);
+        next = item_deref(engine, links->next);
+        prev = item_deref(engine, links->prev);
+        if (prev != NULL) {
+            item_get_expiry_links(prev)->next = item_ref(engine, new_it);
+        } else {
+            *item_expiry_head(&engine->expiry, links->slot) = new_it;
+        }
+        if (next != NULL) {
+            item_get_expiry_links(next)->prev = item_ref(engine, new_it);
+        }
+        cb_mutex_exit(&engine->expiry.lock);
+    }
+}
+
+/* The bucket of the size histogram an item of ntotal bytes is counted in */
+static size_t item_size_bucket(size_t ntotal) {
+    return (ntotal + ITEM_SIZE_GRANULARITY - 1) / ITEM_SIZE_GRANULARITY;
+}
+
+/*
+ * Count the item in (or out of) curr_items, curr_bytes and the size
+ * histogram. Caller must hold the stats lock.
+ */
+static void do_item_stats_linked(struct default_engine *engine,
+                                 const hash_item *it, bool linked) {
+    size_t ntotal = item_total_size(engine, it);
+    size_t bucket = item_size_bucket(ntotal);
+
+    if (linked) {
+        engine->stats.curr_bytes += ntotal;
+        engine->stats.curr_items += 1;
+        if (bucket < ITEM_SIZE_BUCKETS) {
+            engine->stats.sizes[bucket]++;
+        }
+    } else {
+        engine->stats.curr_bytes -= ntotal;
+        engine->stats.curr_items -= 1;
+        if (bucket < ITEM_SIZE_BUCKETS) {
+            engine->stats.sizes[bucket]--;
+        }
+    }
+}
+
+/*
+ * Link the item into segment lru (counting it in total_items if it is a
+ * new item rather than an old one in another form). Caller must hold the
+ * item lock for hv.
+ */
+static void do_item_link_lru(struct default_engine *engine, hash_item *it,
+                             uint32_t hv, int lru, bool count) {
+    MEMCACHED_ITEM_LINK(item_get_key(it), it->nkey, it->nbytes);
+    cb_assert((it->iflag & (ITEM_LINKED|ITEM_SLABBED)) == 0);
+    cb_assert(it->nbytes < (1024 * 1024));  /* 1MB max size */
+    it->iflag |= ITEM_LINKED;
+    it->iflag &= ~ITEM_ACTIVE;
+    it->time = engine->server.core->get_current_time();
+    if (lru == HOT_LRU && engine->config.temporary_ttl != 0 &&
+        it->exptime != 0 && (it->iflag & ITEM_TINY) == 0 &&
+        it->exptime < it->time + engine->config.temporary_ttl) {
+        lru = TEMP_LRU;
+    }
+    item_set_lru(it, lru);
+    assoc_insert(engine, hv, it);
+
+    /* Allocate a new CAS ID on link. */
+    item_set_cas(NULL, NULL, it, get_cas_id(engine));
+
+    mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+    do_item_stats_linked(engine, it, true);
+    if (count) {
+        engine->stats.total_items += 1;
+    }
+    cb_mutex_exit(&engine->stats.lock);
+
+    mc_mutex_enter(&engine->items.lock[it->slabs_clsid],
+                   &engine->lock_stats.lru);
+    if (count && engine->config.eviction_gdsf) {
+        /* The other forms of an item keep the priority it had */
+        do_item_gdsf_link(engine, it);
+    }
+    item_link_q(engine, it);
+    cb_mutex_exit(&engine->items.lock[it->slabs_clsid]);
+    do_item_vb_link(engine, it);
+    do_item_expiry_link(engine, it);
+}
+
+/* Caller must hold the item lock for hv */
+int do_item_link(struct default_engine *engine, hash_item *it, uint32_t hv) {
+    do_item_link_lru(engine, it, hv, HOT_LRU, true);
+    if (engine->config.dcp) {
+        dcp_log_mutation(engine, it);
+    }
+    return 1;
+}
+
+/* Caller must hold the item lock for hv and the item's LRU lock */
+static void do_item_unlink_nolock(struct default_engine *engine,
+                                  hash_item *it, uint32_t hv) {
+    MEMCACHED_ITEM_UNLINK(item_get_key(it), it->nkey, it->nbytes);
+    if ((it->iflag & ITEM_LINKED) != 0) {
+        it->iflag &= ~ITEM_LINKED;
+        mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+        do_item_stats_linked(engine, it, false);
+        cb_mutex_exit(&engine->stats.lock);
+        assoc_delete(engine, hv, item_get_key(it), it->nkey);
+        item_unlink_q(engine, it);
+        do_item_vb_unlink(engine, it);
+        do_item_expiry_unlink(engine, it);
+        if (it->refcount == 0) {
+            item_free(engine, it);
+        }
+    }
+}
+
+/* Caller must hold the item lock for hv */
+void do_item_unlink(struct default_engine *engine, hash_item *it,
+                    uint32_t hv) {
+    unsigned int clsid = it->slabs_clsid;
+    mc_mutex_enter(&engine->items.lock[clsid], &engine->lock_stats.lru);
+    do_item_unlink_nolock(engine, it, hv);
+    cb_mutex_exit(&engine->items.lock[clsid]);
+}
+
+/* Caller must hold the item lock */
+void do_item_release(struct default_engine *engine, hash_item *it) {
+    MEMCACHED_ITEM_REMOVE(item_get_key(it), it->nkey, it->nbytes);
+    if (it->refcount != 0) {
+        it->refcount--;
+        DEBUG_REFCNT(it, '-');
+    }
+    if (it->refcount == 0 && (it->iflag & ITEM_LINKED) == 0) {
+        item_free(engine, it);
+    }
+}
+
+/* Caller must hold the item lock */
+void do_item_update(struct default_engine *engine, hash_item *it) {
+    rel_time_t current_time;
+    MEMCACHED_ITEM_UPDATE(item_get_key(it), it->nkey, it->nbytes);
+    if (engine->config.eviction_gdsf) {
+        do_item_gdsf_hit(engine, it);
+    }
+    if (engine->config.lru_segmented || (it->iflag & ITEM_TINY)) {
+        /* The LRU maintainer will move it when it gets to it (and the
+         * CLOCK of a tiny class gives it another round). The items in
+         * temp stay there until they expire. */
+        if ((it->iflag & ITEM_ACTIVE) == 0 && item_lru(it) != TEMP_LRU) {
+            it->iflag |= ITEM_ACTIVE;
+        }
+        return;
+    }
+
+    current_time = engine->server.core->get_current_time();
+    if (it->time < current_time - ITEM_UPDATE_INTERVAL) {
+        cb_assert((it->iflag & ITEM_SLABBED) == 0);
+
+        if ((it->iflag & ITEM_LINKED) != 0) {
+            mc_mutex_enter(&engine->items.lock[it->slabs_clsid],
+                           &engine->lock_stats.lru);
+            item_unlink_q(engine, it);
+            it->time = current_time;
+            item_link_q(engine, it);
+            cb_mutex_exit(&engine->items.lock[it->slabs_clsid]);
+        }
+    }
+}
+
+/* Caller must hold the item lock for hv (the hash of both keys) */
+int do_item_replace(struct default_engine *engine,
+                    hash_item *it, hash_item *new_it, uint32_t hv) {
+    int ret;
+
+    MEMCACHED_ITEM_REPLACE(item_get_key(it), it->nkey, it->nbytes,
                            item_get_key(new_it), new_it->nkey, new_it->nbytes);
     cb_assert((it->iflag & ITEM_SLABBED) == 0);
 
-    do_item_unlink(engine, it);
-    return do_item_link(engine, new_it);
+    /* A lookup without the lock sees either of them, never neither */
+    item_seq_write_begin(engine, hv);
+    do_item_unlink(engine, it, hv);
+    ret = do_item_link(engine, new_it, hv);
+    item_seq_write_end(engine, hv);
+    return ret;
+}
+
+/*
+ * Move one of the chunks of a chunked item. The chunk is only referred to
+ * by the item (or the chunk before it), so with the item lock held and no
+ * one using the item we may simply relink a copy of it.
+ */
+static enum evacuate_result item_evacuate_chunk(struct default_engine *engine,
+                                                hash_item *chunk) {
+    hash_item *parent;
+    hash_item *new_chunk;
+    hash_item *prev;
+    item_ref_t *ref;
+    uint32_t hv = chunk->flags;
+    cb_mutex_t *lock;
+    size_t ntotal;
+
+    if (!item_trylock(engine, hv, NULL, &lock)) {
+        return EVACUATE_BUSY;
+    }
+    parent = item_h_next(engine, chunk);
+    if ((chunk->iflag & ITEM_CHUNK) == 0 || parent == NULL ||
+        (parent->iflag & ITEM_LINKED) == 0 || parent->refcount != 0) {
+        cb_mutex_exit(lock);
+        return EVACUATE_BUSY;
+    }
+
+    ntotal = sizeof(hash_item) + chunk->nbytes;
+    if ((new_chunk = slabs_alloc(engine, ntotal, chunk->slabs_clsid)) == NULL) {
+        do_item_unlink(engine, parent, hv);
+        cb_mutex_exit(lock);
+        return EVACUATE_EVICTED;
+    }
+    memcpy(new_chunk, chunk, ntotal);
+
+    ref = &item_get_chunk_head(engine, parent)->first;
+    prev = NULL;
+    while (item_deref(engine, *ref) != chunk) {
+        prev = item_deref(engine, *ref);
+        ref = &prev->next;
+    }
+    if (prev == NULL) {
+        *ref = item_ref(engine, new_chunk);
+    } else {
+        item_set_next(engine, prev, new_chunk);
+    }
+
+    chunk->slabs_clsid = 0;
+    chunk->iflag = ITEM_SLABBED;
+    slabs_free(engine, chunk, ntotal, new_chunk->slabs_clsid);
+    cb_mutex_exit(lock);
+
+    return EVACUATE_RESCUED;
+}
+
+enum evacuate_result item_evacuate(struct default_engine *engine,
+                                   hash_item *it) {
+    hash_item *new_it;
+    unsigned int clsid;
+    int lru;
+    uint32_t hv;
+    cb_mutex_t *lock;
+    size_t ntotal;
+
+    if ((it->iflag & ITEM_SLABBED) != 0) {
+        return EVACUATE_FREE;
+    }
+    if ((it->iflag & ITEM_CHUNK) != 0) {
+        return item_evacuate_chunk(engine, it);
+    }
+    if ((it->iflag & ITEM_LINKED) == 0) {
+        /* Someone is still setting it up (or about to free it) */
+        return EVACUATE_BUSY;
+    }
+
+    /*
+     * The key of a linked item doesn't change, and nobody can reuse the
+     * chunk while its page is being moved, so we may look at it without
+     * the lock. Check again once we hold it.
+     */
+    hv = item_hash(engine, it);
+    if (!item_trylock(engine, hv, NULL, &lock)) {
+        return EVACUATE_BUSY;
+    }
+    if ((it->iflag & ITEM_LINKED) == 0 || it->refcount != 0) {
+        cb_mutex_exit(lock);
+        return EVACUATE_BUSY;
+    }
+
+    clsid = it->slabs_clsid;
+    ntotal = ITEM_ntotal(engine, it);
+    if ((new_it = slabs_alloc(engine, ntotal, clsid)) == NULL) {
+        do_item_unlink(engine, it, hv);
+        cb_mutex_exit(lock);
+        return EVACUATE_EVICTED;
+    }
+
+    /* Put the copy in the same place in the LRU */
+    mc_mutex_enter(&engine->items.lock[clsid], &engine->lock_stats.lru);
+    memcpy(new_it, it, ntotal);
+    lru = item_lru(new_it);
+    if ((new_it->iflag & ITEM_TINY) == 0) {
+        /* (the tiny ones aren't on the LRU) */
+        if (new_it->prev != 0) {
+            item_set_next(engine, item_prev(engine, new_it), new_it);
+        } else {
+            engine->items.heads[clsid][lru] = new_it;
+        }
+        if (new_it->next != 0) {
+            item_set_prev(engine, item_next(engine, new_it), new_it);
+        } else {
+            engine->items.tails[clsid][lru] = new_it;
+        }
+        it->next = it->prev = 0;
+    }
+    do_item_vb_relocate(engine, it, new_it);
+    do_item_expiry_relocate(engine, it, new_it);
+    cb_mutex_exit(&engine->items.lock[clsid]);
+
+    assoc_delete(engine, hv, item_get_key(it), it->nkey);
+    assoc_insert(engine, hv, new_it);
+    it->iflag &= ~ITEM_LINKED;
+    if (it->iflag & ITEM_CHUNKED) {
+        /* The chunks belong to the copy now */
+        hash_item *chunk;
+        chunk = item_deref(engine, item_get_chunk_head(engine, new_it)->first);
+        for (; chunk != NULL; chunk = item_next(engine, chunk)) {
+            item_set_h_next(engine, chunk, new_it);
+        }
+        item_get_chunk_head(engine, it)->first = 0;
+    }
+    item_free(engine, it);
+    cb_mutex_exit(lock);
+
+    return EVACUATE_RESCUED;
+}
+
+/*
+ * The value of an ITEM_HDR item lives in extstore (see extstore.h). We
+ * read it into a new item which isn't linked (the header stays where it
+ * is), or swap the header for the new item when the value is needed to
+ * update it or it is read often enough (ext_recache_rate). The new item
+ * keeps the CAS of the header.
+ */
+
+/* Read the value of a header into a new item (held as in do_item_alloc) */
+static ENGINE_ERROR_CODE do_item_ext_load(struct default_engine *engine,
+                                          const hash_item *hdr,
+                                          const void *cookie,
+                                          cb_mutex_t *held,
+                                          hash_item **it) {
+    hash_item *ret;
+
+    ret = do_item_alloc(engine, item_get_key(hdr), hdr->nkey, hdr->flags,
+                        hdr->exptime, hdr->nbytes, cookie, hdr->datatype,
+                        held);
+    if (ret == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    if (!extstore_read(engine, item_get_ext_loc(engine, hdr), ret)) {
+        ret->refcount = 0;
+        item_free(engine, ret);
+        return ENGINE_KEY_ENOENT;
+    }
+    item_set_cas(NULL, NULL, ret, item_get_cas(hdr));
+    item_set_seqno(ret, item_get_vbucket(hdr), item_get_seqno(hdr));
+    item_gdsf_copy(ret, hdr);
+    *it = ret;
+    return ENGINE_SUCCESS;
+}
+
+/* Replace the (linked) header with it. Caller must hold the item lock */
+static void do_item_ext_replace(struct default_engine *engine,
+                                hash_item *hdr, hash_item *it, uint32_t hv) {
+    uint64_t cas = item_get_cas(hdr);
+    do_item_unlink(engine, hdr, hv);
+    do_item_link_lru(engine, it, hv, HOT_LRU, false);
+    item_set_cas(NULL, NULL, it, cas);
+}
+
+/*
+ * Swap the header we hold a reference to for the full item, and return
+ * that in *it (with a reference held). The reference to the header is
+ * released, and the header is unlinked if the value was lost. Caller
+ * must hold the item lock for hv.
+ */
+static ENGINE_ERROR_CODE do_item_ext_fetch(struct default_engine *engine,
+                                           hash_item *hdr, uint32_t hv,
+                                           const void *cookie,
+                                           hash_item **it) {
+    ENGINE_ERROR_CODE ret;
+
+    *it = NULL;
+    ret = do_item_ext_load(engine, hdr, cookie, item_get_lock(engine, hv), it);
+    if (ret == ENGINE_SUCCESS && (hdr->iflag & ITEM_LINKED) != 0) {
+        do_item_ext_replace(engine, hdr, *it, hv);
+    } else if (ret == ENGINE_KEY_ENOENT) {
+        do_item_unlink(engine, hdr, hv);
+    }
+    do_item_release(engine, hdr);
+    return ret;
+}
+
+ENGINE_ERROR_CODE item_ext_load(struct default_engine *engine,
+                                const hash_item *hdr, const void *cookie,
+                                hash_item **it) {
+    return do_item_ext_load(engine, hdr, cookie, NULL, it);
+}
+
+bool item_ext_recache(struct default_engine *engine, hash_item *hdr,
+                      hash_item *it) {
+    uint32_t hv = item_hash(engine, hdr);
+    bool ret = false;
+
+    item_lock(engine, hv);
+    if ((hdr->iflag & ITEM_LINKED) != 0 && (it->iflag & ITEM_LINKED) == 0) {
+        do_item_ext_replace(engine, hdr, it, hv);
+        ret = true;
+    }
+    item_unlock(engine, hv);
+    return ret;
+}
+
+hash_item *item_ext_fetch(struct default_engine *engine, hash_item *hdr,
+                          const void *cookie) {
+    uint32_t hv = item_hash(engine, hdr);
+    hash_item *it;
+
+    item_lock(engine, hv);
+    do_item_ext_fetch(engine, hdr, hv, cookie, &it);
+    item_unlock(engine, hv);
+    return it;
+}
+
+/*
+ * Replace *it (a header we hold a reference to) with a copy of the item
+ * read back in, leaving the header where it is (or NULL if we can't).
+ * Used by the tap and dcp walkers.
+ */
+static void item_ext_take(struct default_engine *engine, hash_item **it) {
+    hash_item *hdr = *it;
+    ENGINE_ERROR_CODE ret = item_ext_load(engine, hdr, NULL, it);
+    if (ret == ENGINE_KEY_ENOENT) {
+        item_unlink(engine, hdr);
+    }
+    item_release(engine, hdr);
+    if (ret != ENGINE_SUCCESS) {
+        /* Skip it */
+        *it = NULL;
+    }
+}
+
+/* The most items we write out of a class per run */
+#define EXT_FLUSH_BATCH 16
+
+/*
+ * Write the values of the items at the tail of the cold segment of class
+ * id to extstore and replace the items with headers, and get rid of the
+ * headers whose values are lost. Returns the number of items we did
+ * something with.
+ */
+static int item_ext_flush(struct default_engine *engine, unsigned int id) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    hash_item *victims[EXT_FLUSH_BATCH];
+    hash_item *search, *next;
+    int tries = search_items;
+    int nvictims = 0;
+    int ret = 0;
+    int ii;
+
+    mc_mutex_enter(&engine->items.lock[id], &engine->lock_stats.lru);
+    for (search = engine->items.tails[id][COLD_LRU];
+         tries > 0 && search != NULL && nvictims < EXT_FLUSH_BATCH;
+         tries--, search = next) {
+        uint32_t hv;
+        cb_mutex_t *lock;
+
+        next = item_prev(engine, search);
+        if (search->nkey == 0 && search->nbytes == 0) {
+            /* cursor */
+            continue;
+        }
+        if ((search->iflag & ITEM_HDR) == 0 &&
+            (search->nbytes < engine->config.ext_item_size ||
+             search->nbytes > engine->config.ext_page_size)) {
+            continue;
+        }
+        if (search->time + engine->config.ext_item_age > current_time) {
+            /* The rest of the segment is younger still */
+            break;
+        }
+        hv = item_hash(engine, search);
+        if (!item_trylock(engine, hv, NULL, &lock)) {
+            continue;
+        }
+        if (search->refcount == 0) {
+            if ((search->iflag & ITEM_HDR) != 0) {
+                if (!extstore_valid(engine,
+                                    item_get_ext_loc(engine, search))) {
+                    do_item_unlink_nolock(engine, search, hv);
+                    ++ret;
+                }
+            } else if ((search->iflag & ITEM_ACTIVE) == 0 &&
+                       !item_is_flushed(engine, search, current_time) &&
+                       (search->exptime == 0 ||
+                        search->exptime > current_time)) {
+                search->refcount++;
+                DEBUG_REFCNT(search, '+');
+                victims[nvictims++] = search;
+            }
+        }
+        cb_mutex_exit(lock);
+    }
+    cb_mutex_exit(&engine->items.lock[id]);
+
+    /* Don't hold any locks while writing the pages out */
+    for (ii = 0; ii < nvictims; ++ii) {
+        hash_item *it = victims[ii];
+        hash_item *hdr = NULL;
+        struct ext_loc loc;
+        uint32_t hv = item_hash(engine, it);
+
+        if (extstore_write(engine, it, &loc) &&
+            (hdr = do_item_alloc_slot(engine,
+                                      item_meta_offset(engine, it->nkey) +
+                                      sizeof(loc), NULL, NULL)) != NULL) {
+            hdr->iflag = engine->items.layout | ITEM_HDR;
+            item_gdsf_copy(hdr, it);
+            hdr->nkey = it->nkey;
+            hdr->nbytes = it->nbytes;
+            hdr->flags = it->flags;
+            hdr->datatype = it->datatype;
+            hdr->exptime = it->exptime;
+            memcpy((void*)item_get_key(hdr), item_get_key(it), it->nkey);
+            *item_get_ext_loc(engine, hdr) = loc;
+        }
+
+        item_lock(engine, hv);
+        if (hdr != NULL) {
+            if ((it->iflag & ITEM_LINKED) != 0) {
+                uint64_t cas = item_get_cas(it);
+                item_set_seqno(hdr, item_get_vbucket(it), item_get_seqno(it));
+                do_item_unlink(engine, it, hv);
+                do_item_link_lru(engine, hdr, hv, COLD_LRU, false);
+                item_set_cas(NULL, NULL, hdr, cas);
+                ++ret;
+            }
+            do_item_release(engine, hdr);
+        }
+        do_item_release(engine, it);
+        item_unlock(engine, hv);
+    }
+
+    return ret;
+}
+
+/*@null@*/
+static char *do_item_cachedump(const unsigned int slabs_clsid,
+                               const unsigned int limit,
+                               unsigned int *bytes) {
+#ifdef FUTURE
+    unsigned int memlimit = 2 * 1024 * 1024;   /* 2MB max response size */
+    char *buffer;
+    unsigned int bufcurr;
+    hash_item *it;
+    unsigned int len;
+    unsigned int shown = 0;
+    char key_temp[KEY_MAX_LENGTH + 1];
+    char temp[512];
+
+    it = engine->items.heads[slabs_clsid][HOT_LRU];
+
+    buffer = malloc((size_t)memlimit);
+    if (buffer == 0) return NULL;
+    bufcurr = 0;
+
+
+    while (it != NULL && (limit == 0 || shown < limit)) {
+        cb_assert(it->nkey <= KEY_MAX_LENGTH);
+        /* Copy the key since it may not be null-terminated in the struct */
+        strncpy(key_temp, item_get_key(it), it->nkey);
+        key_temp[it->nkey] = 0x00; /* terminate */
+        len = snprintf(temp, sizeof(temp), "ITEM %s [%d b; %lu s]\r\n",
+                       key_temp, it->nbytes,
+                       (unsigned long)it->exptime + process_started);
+        if (bufcurr + len + 6 > memlimit)  /* 6 is END\r\n\0 */
+            break;
+        memcpy(buffer + bufcurr, temp, len);
+        bufcurr += len;
+        shown++;
+        it = item_next(engine, it);
+    }
+
+
+    memcpy(buffer + bufcurr, "END\r\n", 6);
+    bufcurr += 5;
+
+    *bytes = bufcurr;
+    return buffer;
+#endif
+    (void)slabs_clsid;
+    (void)limit;
+    (void)bytes;
+    return NULL;
+}
+
+static void do_item_stats(struct default_engine *engine,
+                          ADD_STAT add_stats, const void *c) {
+    int i;
+    rel_time_t current_time = engine->server.core->get_current_time();
+    for (i = 0; i < POWER_LARGEST; i++) {
+        hash_item *tail;
+        mc_mutex_enter(&engine->items.lock[i], &engine->lock_stats.lru);
+        tail = item_lru_last(engine, i);
+        if (tail != NULL) {
+            const char *prefix = "items";
+            int search = search_items;
+            while (search > 0 &&
+                   tail != NULL &&
+                   (item_is_flushed(engine, tail, current_time) ||
+                    (tail->exptime != 0 && /* and not expired */
+                     tail->exptime < current_time))) {
+                uint32_t hv = item_hash(engine, tail);
+                cb_mutex_t *lock;
+                bool unlinked = false;
+
+                --search;
+                if (!item_trylock(engine, hv, NULL, &lock)) {
+                    break;
+                }
+                if (tail->refcount == 0) {
+                    do_item_unlink_nolock(engine, tail, hv);
+                    unlinked = true;
+                }
+                cb_mutex_exit(lock);
+                if (!unlinked) {
+                    break;
+                }
+                tail = item_lru_last(engine, i);
+            }
+            if (tail == NULL) {
+                /* We removed all of the items in this slab class */
+                cb_mutex_exit(&engine->items.lock[i]);
+                continue;
+            }
+
+            add_statistics(c, add_stats, prefix, i, "number", "%u",
+                           item_lru_size(engine, i));
+            add_statistics(c, add_stats, prefix, i, "number_hot", "%u",
+                           engine->items.sizes[i][HOT_LRU]);
+            add_statistics(c, add_stats, prefix, i, "number_warm", "%u",
+                           engine->items.sizes[i][WARM_LRU]);
+            add_statistics(c, add_stats, prefix, i, "number_cold", "%u",
+                           engine->items.sizes[i][COLD_LRU]);
+            add_statistics(c, add_stats, prefix, i, "number_temp", "%u",
+                           engine->items.sizes[i][TEMP_LRU]);
+            add_statistics(c, add_stats, prefix, i, "age", "%u",
+                           tail->time);
+            add_statistics(c, add_stats, prefix, i, "evicted",
+                           "%u", engine->items.itemstats[i].evicted);
+            add_statistics(c, add_stats, prefix, i, "evicted_nonzero",
+                           "%u", engine->items.itemstats[i].evicted_nonzero);
+            add_statistics(c, add_stats, prefix, i, "evicted_temp",
+                           "%u", engine->items.itemstats[i].evicted_temp);
+            add_statistics(c, add_stats, prefix, i, "evicted_ahead",
+                           "%u", engine->items.itemstats[i].evicted_ahead);
+            add_statistics(c, add_stats, prefix, i, "evicted_time",
+                           "%u", engine->items.itemstats[i].evicted_time);
+            add_statistics(c, add_stats, prefix, i, "outofmemory",
+                           "%u", engine->items.itemstats[i].outofmemory);
+            add_statistics(c, add_stats, prefix, i, "tailrepairs",
+                           "%u", engine->items.itemstats[i].tailrepairs);;
+            add_statistics(c, add_stats, prefix, i, "reclaimed",
+                           "%u", engine->items.itemstats[i].reclaimed);;
+            add_statistics(c, add_stats, prefix, i, "moves_to_cold",
+                           "%u", engine->items.itemstats[i].moves_to_cold);
+            add_statistics(c, add_stats, prefix, i, "moves_to_warm",
+                           "%u", engine->items.itemstats[i].moves_to_warm);
+            add_statistics(c, add_stats, prefix, i, "crawler_reclaimed",
+                           "%u", engine->items.itemstats[i].crawler_reclaimed);
+        }
+        cb_mutex_exit(&engine->items.lock[i]);
+    }
+}
+
+/**
+ * dumps out the number of objects of each size, with granularity of 32
+ * bytes. We copy the histogram kept on link and unlink rather than walking
+ * the LRUs, so this doesn't hold up anyone.
+ */
+static void do_item_stats_sizes(struct default_engine *engine,
+                                ADD_STAT add_stats, const void *c) {
+    uint32_t *histogram = malloc(sizeof(engine->stats.sizes));
+
+    if (histogram != NULL) {
+        int i;
+
+        mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+        memcpy(histogram, engine->stats.sizes, sizeof(engine->stats.sizes));
+        cb_mutex_exit(&engine->stats.lock);
+
+        /* write the buffer */
+        for (i = 0; i < ITEM_SIZE_BUCKETS; i++) {
+            if (histogram[i] != 0) {
+                char key[8], val[32];
+                int klen, vlen;
+                klen = snprintf(key, sizeof(key), "%d",
+                                i * ITEM_SIZE_GRANULARITY);
+                vlen = snprintf(val, sizeof(val), "%u", histogram[i]);
+                cb_assert(klen < sizeof(key));
+                cb_assert(vlen < sizeof(val));
+                add_stats(key, klen, val, vlen, c);
+            }
+        }
+        free(histogram);
+    }
+}
+
+/**
+ * The lazy expiration logic for the item we found for key (or NULL), and
+ * taking the reference to it.
+ * Caller must hold the item lock for hv
+ */
+static hash_item *do_item_get_found(struct default_engine *engine,
+                                    const char *key, const size_t nkey,
+                                    uint32_t hv, hash_item *it) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    int was_found = 0;
+
+    if (engine->config.verbose > 2) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        if (it == NULL) {
+            logger->log(EXTENSION_LOG_DEBUG, NULL,
+                        "> NOT FOUND %s", key);
+        } else {
+            logger->log(EXTENSION_LOG_DEBUG, NULL,
+                        "> FOUND KEY %s",
+                        (const char*)item_get_key(it));
+            was_found++;
+        }
+    }
+
+    if (it != NULL && item_is_flushed(engine, it, current_time)) {
+        do_item_unlink(engine, it, hv);       /* MTSAFE - item lock held */
+        it = NULL;
+    }
+
+    if (it == NULL && was_found) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_DEBUG, NULL, " -nuked by flush");
+        was_found--;
+    }
+
+    if (it != NULL && it->exptime != 0 && it->exptime <= current_time) {
+        if (engine->config.dcp) {
+            dcp_log_removal(engine, it, DCP_CHANGE_EXPIRATION);
+        }
+        do_item_unlink(engine, it, hv);       /* MTSAFE - item lock held */
+        it = NULL;
+    }
+
+    if (it == NULL && was_found) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_DEBUG, NULL, " -nuked by expire");
+        was_found--;
+    }
+
+    if (it != NULL) {
+        it->refcount++;
+        DEBUG_REFCNT(it, '+');
+        do_item_update(engine, it);
+    }
+
+    return it;
+}
+
+/**
+ * wrapper around assoc_find which does the lazy expiration logic.
+ * Caller must hold the item lock for hv
+ */
+hash_item *do_item_get(struct default_engine *engine,
+                       const char *key, const size_t nkey,
+                       uint32_t hv) {
+    return do_item_get_found(engine, key, nkey, hv,
+                             assoc_find(engine, hv, key, nkey));
+}
+
+/*
+ * Look the key up without the item lock (see the notes at the top).
+ * Returns false if we couldn't get a consistent answer; otherwise *it is
+ * the item we found (or NULL), and *seq the sequence it is valid for.
+ */
+static bool item_find_lockless(struct default_engine *engine,
+                               const char *key, const size_t nkey,
+                               uint32_t hv, hash_item **it, uint32_t *seq) {
+    struct item_epoch_slot *slot = item_epoch_enter(engine, hv);
+    bool found = false;
+
+    if (slot == NULL) {
+        return false;
+    }
+    *seq = item_seq_read(engine, hv);
+    if ((*seq & 1) == 0) {
+        found = assoc_find_lockless(engine, hv, key, nkey, *seq, it);
+    }
+    item_epoch_exit(slot);
+    return found;
+}
+
+/*
+ * Append the value of it to old_it where it is: in the slack at the end
+ * of its slab chunk (or of its last chunk), and in new chunks linked to it
+ * when it is chunked, so that an append costs what is appended rather than
+ * a copy of the whole value. We only do so if nobody else holds a
+ * reference to old_it (they may be reading its value). Returns false if a
+ * new item has to be built instead. Caller must hold the item lock for hv.
+ */
+static bool do_item_append_in_place(struct default_engine *engine,
+                                    hash_item *old_it, const hash_item *it,
+                                    uint32_t hv, const void *cookie) {
+    size_t nbytes = it->nbytes;
+    size_t offset = old_it->nbytes;
+    hash_item *last = NULL;
+    item_ref_t more = 0;
+    size_t slack;
+
+    if (old_it->refcount != 1 || (old_it->iflag & ITEM_LINKED) == 0 ||
+        (old_it->iflag & ITEM_HDR) != 0) {
+        return false;
+    }
+
+    if (old_it->iflag & ITEM_CHUNKED) {
+        slack = 0;
+        last = item_deref(engine, item_get_chunk_head(engine, old_it)->first);
+        if (last != NULL) {
+            hash_item *next;
+            while ((next = item_next(engine, last)) != NULL) {
+                last = next;
+            }
+            slack = engine->slabs.slabclass[last->slabs_clsid].size -
+                sizeof(hash_item) - last->nbytes;
+        }
+        if (slack > nbytes) {
+            slack = nbytes;
+        }
+        if (nbytes > slack) {
+            if (!do_item_alloc_chunks(engine, old_it, &more, hv,
+                                      nbytes - slack, true, cookie,
+                                      item_get_lock(engine, hv))) {
+                item_free_chunk_list(engine, item_deref(engine, more));
+                return false;
+            }
+        }
+    } else {
+        slack = engine->slabs.slabclass[old_it->slabs_clsid].size -
+            ITEM_ntotal(engine, old_it);
+        if (nbytes > slack) {
+            return false;
+        }
+        slack = nbytes;
+    }
+
+    /* Unlink it while it changes, so that the stats follow its size */
+    do_item_unlink(engine, old_it, hv);
+    if (old_it->iflag & ITEM_CHUNKED) {
+        if (slack != 0) {
+            size_t ntotal = sizeof(hash_item) + last->nbytes;
+            slabs_adjust_mem_requested(engine, last->slabs_clsid, ntotal,
+                                       ntotal + slack);
+            last->nbytes += (uint32_t)slack;
+        }
+        if (more != 0) {
+            if (last != NULL) {
+                item_set_next(engine, last, item_deref(engine, more));
+            } else {
+                item_get_chunk_head(engine, old_it)->first = more;
+            }
+        }
+    } else {
+        size_t ntotal = ITEM_ntotal(engine, old_it);
+        slabs_adjust_mem_requested(engine, old_it->slabs_clsid, ntotal,
+                                   ntotal + slack);
+    }
+    old_it->nbytes += (uint32_t)nbytes;
+    old_it->datatype = it->datatype;
+    old_it->iflag &= ~ITEM_COUNTER;
+    item_copy_value(engine, old_it, offset, it);
+    item_set_seqno(old_it, item_get_vbucket(it), 0);
+    do_item_link(engine, old_it, hv);
+
+    mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+    engine->stats.appends_in_place++;
+    cb_mutex_exit(&engine->stats.lock);
+    return true;
+}
+
+static bool item_is_compressed(const hash_item *it) {
+    return (it->datatype & PROTOCOL_BINARY_DATATYPE_COMPRESSED) != 0;
+}
+
+/*
+ * Copy the value of the item as the client sent it (inflating it if it is
+ * compressed) into a buffer the caller must free. Returns NULL if we're
+ * out of memory or the value doesn't inflate.
+ */
+static char *item_inflate_value(struct default_engine *engine,
+                                const hash_item *it, size_t *nbytes) {
+    char *value;
+
+    if (!item_is_compressed(it)) {
+        if ((value = malloc(it->nbytes + 1)) != NULL) {
+            item_read_value(engine, it, value);
+            *nbytes = it->nbytes;
+        }
+        return value;
+    }
+
+    /* Compressed values are always in one piece */
+    if (snappy_uncompressed_length(item_get_data(it), it->nbytes,
+                                   nbytes) != SNAPPY_OK ||
+        (value = malloc(*nbytes + 1)) == NULL) {
+        return NULL;
+    }
+    if (snappy_uncompress(item_get_data(it), it->nbytes, value,
+                          nbytes) != SNAPPY_OK) {
+        free(value);
+        return NULL;
+    }
+
+    mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+    engine->stats.values_inflated++;
+    cb_mutex_exit(&engine->stats.lock);
+    return value;
+}
+
+/*
+ * Build the result of appending (or prepending) it to old_it when one of
+ * them is compressed. Putting the bytes next to each other won't do, so
+ * we inflate both of them and store the result as it is (the next set
+ * compresses it again). Caller must hold the item lock.
+ */
+static hash_item *do_item_append_inflated(struct default_engine *engine,
+                                          const hash_item *old_it,
+                                          const hash_item *it,
+                                          ENGINE_STORE_OPERATION operation,
+                                          const void *cookie, uint32_t hv,
+                                          ENGINE_ERROR_CODE *status) {
+    const hash_item *head = operation == OPERATION_APPEND ? old_it : it;
+    const hash_item *tail = operation == OPERATION_APPEND ? it : old_it;
+    hash_item *new_it = NULL;
+    char *first;
+    char *second = NULL;
+    size_t nfirst, nsecond;
+
+    *status = ENGINE_NOT_STORED;
+    if ((first = item_inflate_value(engine, head, &nfirst)) != NULL &&
+        (second = item_inflate_value(engine, tail, &nsecond)) != NULL) {
+        if (nfirst + nsecond > engine->config.item_size_max) {
+            *status = ENGINE_E2BIG;
+        } else {
+            new_it = do_item_alloc(engine, item_get_key(it), it->nkey,
+                                   old_it->flags, old_it->exptime,
+                                   (int)(nfirst + nsecond), cookie,
+                                   it->datatype &
+                                   ~PROTOCOL_BINARY_DATATYPE_COMPRESSED,
+                                   item_get_lock(engine, hv));
+        }
+    }
+
+    if (new_it != NULL) {
+        item_write_value(engine, new_it, 0, first, nfirst);
+        item_write_value(engine, new_it, nfirst, second, nsecond);
+        item_set_seqno(new_it, item_get_vbucket(it), 0);
+    }
+    free(first);
+    free(second);
+    return new_it;
+}
+
+/*
+ * Stores an item in the cache according to the semantics of one of the set
+ * commands. In threaded mode, this is protected by the item lock for hv.
+ *
+ * Returns the state of storage.
+ */
+static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
+                                       hash_item *it, uint64_t *cas,
+                                       ENGINE_STORE_OPERATION operation,
+                                       const void *cookie,
+                                       uint32_t hv) {
+    const char *key = item_get_key(it);
+    hash_item *old_it = do_item_get(engine, key, it->nkey, hv);
+    ENGINE_ERROR_CODE stored = ENGINE_NOT_STORED;
+
+    hash_item *new_it = NULL;
+
+    if (old_it != NULL && operation == OPERATION_ADD) {
+        /* add only adds a nonexistent item, but promote to head of LRU */
+        do_item_update(engine, old_it);
+    } else if (!old_it && (operation == OPERATION_REPLACE
+        || operation == OPERATION_APPEND || operation == OPERATION_PREPEND))
+    {
+        /* replace only replaces an existing value; don't store */
+    } else if (operation == OPERATION_CAS) {
+        /* validate cas operation */
+        if(old_it == NULL) {
+            /* LRU expired */
+            stored = ENGINE_KEY_ENOENT;
+        }
+        else if (item_get_cas(it) == item_get_cas(old_it)) {
+            /* cas validates */
+            /* it and old_it may belong to different classes. */
+            /* I'm updating the stats for the one that's getting pushed out */
+            do_item_replace(engine, old_it, it, hv);
+            stored = ENGINE_SUCCESS;
+        } else {
+            if (engine->config.verbose > 1) {
+                EXTENSION_LOGGER_DESCRIPTOR *logger;
+                logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+                logger->log(EXTENSION_LOG_INFO, NULL,
+                        "CAS:  failure: expected %"PRIu64", got %"PRIu64"\n",
+                        item_get_cas(old_it),
+                        item_get_cas(it));
+            }
+            stored = ENGINE_KEY_EEXISTS;
+        }
+    } else {
+        /*
+         * Append - combine new and old record into single one. Here it's
+         * atomic and thread-safe.
+         */
+        if (operation == OPERATION_APPEND || operation == OPERATION_PREPEND) {
+            if ((old_it->iflag & ITEM_HDR) != 0 &&
+                do_item_ext_fetch(engine, old_it, hv, cookie,
+                                  &old_it) != ENGINE_SUCCESS) {
+                /* We need the value, and it is gone (or there's no memory) */
+                return ENGINE_NOT_STORED;
+            }
+
+            /*
+             * Validate CAS
+             */
+            if (item_get_cas(it) != 0) {
+                /* CAS much be equal */
+                if (item_get_cas(it) != item_get_cas(old_it)) {
+                    stored = ENGINE_KEY_EEXISTS;
+                }
+            }
+
+            if (stored == ENGINE_NOT_STORED) {
+                size_t total = it->nbytes + old_it->nbytes;
+                if (total > engine->config.item_size_max) {
+                    return ENGINE_E2BIG;
+                }
+
+                if (item_is_compressed(old_it) || item_is_compressed(it)) {
+                    new_it = do_item_append_inflated(engine, old_it, it,
+                                                     operation, cookie, hv,
+                                                     &stored);
+                    if (new_it == NULL) {
+                        do_item_release(engine, old_it);
+                        return stored;
+                    }
+                    it = new_it;
+                } else if (operation == OPERATION_APPEND &&
+                           do_item_append_in_place(engine, old_it, it, hv,
+                                                   cookie)) {
+                    it = old_it;
+                    stored = ENGINE_SUCCESS;
+                }
+            }
+
+            if (stored == ENGINE_NOT_STORED && new_it == NULL) {
+                /* we have it and old_it here - alloc memory to hold both */
+                new_it = do_item_alloc(engine, key, it->nkey,
+                                       old_it->flags,
+                                       old_it->exptime,
+                                       it->nbytes + old_it->nbytes,
+                                       cookie, it->datatype,
+                                       item_get_lock(engine, hv));
+                if (new_it == NULL) {
+                    /* SERVER_ERROR out of memory */
+                    if (old_it != NULL) {
+                        do_item_release(engine, old_it);
+                    }
+
+                    return ENGINE_NOT_STORED;
+                }
+
+                /* copy data from it and old_it to new_it */
+
+                if (operation == OPERATION_APPEND) {
+                    item_copy_value(engine, new_it, 0, old_it);
+                    item_copy_value(engine, new_it, old_it->nbytes, it);
+                } else {
+                    /* OPERATION_PREPEND */
+                    item_copy_value(engine, new_it, 0, it);
+                    item_copy_value(engine, new_it, it->nbytes, old_it);
+                }
+                item_set_seqno(new_it, item_get_vbucket(it), 0);
+
+                it = new_it;
+            }
+        }
+
+        if (stored == ENGINE_NOT_STORED) {
+            if (old_it != NULL) {
+                do_item_replace(engine, old_it, it, hv);
+            } else {
+                do_item_link(engine, it, hv);
+            }
+
+            *cas = item_get_cas(it);
+            stored = ENGINE_SUCCESS;
+        }
+    }
+
+    if (old_it != NULL) {
+        do_item_release(engine, old_it);         /* release our reference */
+    }
+
+    if (new_it != NULL) {
+        do_item_release(engine, new_it);
+    }
+
+    if (stored == ENGINE_SUCCESS) {
+        *cas = item_get_cas(it);
+    }
+
+    return stored;
+}
+
+
+/*
+ * With native_counters the value a counter got from the last incr or decr
+ * is kept as a number next to its text, so that the next one doesn't have
+ * to parse it. The text grows into the slack at the end of the slab chunk
+ * when the counter gets more digits, so that it may be updated where it is
+ * until it outgrows its chunk.
+ */
+static uint64_t item_get_counter(const hash_item *it) {
+    uint64_t value;
+    memcpy(&value, item_get_counter_word(it), sizeof(value));
+    return value;
+}
+
+static void item_set_counter(hash_item *it, uint64_t value) {
+    if (it->iflag & ITEM_WITH_COUNTER) {
+        memcpy(item_get_counter_word(it), &value, sizeof(value));
+        it->iflag |= ITEM_COUNTER;
+    }
+}
+
+/*
+ * Make the linked item hold nbytes of value in its slab chunk, keeping the
+ * stats straight. Caller must hold the item lock.
+ */
+static bool do_item_resize_in_place(struct default_engine *engine,
+                                    hash_item *it, size_t nbytes) {
+    size_t ntotal = ITEM_ntotal(engine, it);
+    size_t new_ntotal = ntotal - it->nbytes + nbytes;
+
+    if ((it->iflag & (ITEM_CHUNKED | ITEM_HDR)) != 0 ||
+        new_ntotal > engine->slabs.slabclass[it->slabs_clsid].size) {
+        return false;
+    }
+    slabs_adjust_mem_requested(engine, it->slabs_clsid, ntotal, new_ntotal);
+    mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+    do_item_stats_linked(engine, it, false);
+    it->nbytes = (uint32_t)nbytes;
+    do_item_stats_linked(engine, it, true);
+    cb_mutex_exit(&engine->stats.lock);
+    return true;
+}
+
+/*
+ * adds a delta value to a numeric item.
+ *
+ * c     connection requesting the operation
+ * it    item to adjust
+ * incr  true to increment value, false to decrement
+ * delta amount to adjust value by
+ * buf   buffer for response string
+ *
+ * returns a response string to send back to the client.
+ */
+static ENGINE_ERROR_CODE do_add_delta(struct default_engine *engine,
+                                      hash_item *it, const bool incr,
+                                      const int64_t delta, uint64_t *rcas,
+                                      uint64_t *result, const void *cookie,
+                                      uint32_t hv) {
+    const char *ptr;
+    uint64_t value;
+    char buf[80];
+    int res;
+
+    if (it->iflag & ITEM_COUNTER) {
+        value = item_get_counter(it);
+    } else if (item_is_compressed(it)) {
+        size_t nbytes;
+        if (snappy_uncompressed_length(item_get_data(it), it->nbytes,
+                                       &nbytes) != SNAPPY_OK ||
+            nbytes >= (sizeof(buf) - 1) ||
+            snappy_uncompress(item_get_data(it), it->nbytes, buf,
+                              &nbytes) != SNAPPY_OK) {
+            return ENGINE_EINVAL;
+        }
+        buf[nbytes] = '\0';
+
+        if (!safe_strtoull(buf, &value)) {
+            return ENGINE_EINVAL;
+        }
+
+        mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+        engine->stats.values_inflated++;
+        cb_mutex_exit(&engine->stats.lock);
+    } else {
+        if (it->nbytes >= (sizeof(buf) - 1)) {
+            return ENGINE_EINVAL;
+        }
+
+        ptr = item_get_data(it);
+        memcpy(buf, ptr, it->nbytes);
+        buf[it->nbytes] = '\0';
+
+        if (!safe_strtoull(buf, &value)) {
+            return ENGINE_EINVAL;
+        }
+    }
+
+    if (incr) {
+        value += delta;
+    } else {
+        if ((uint64_t)delta > value) {
+            value = 0;
+        } else {
+            value -= delta;
+        }
+    }
+
+    *result = value;
+    if ((res = snprintf(buf, sizeof(buf), "%" PRIu64, value)) == -1) {
+        return ENGINE_EINVAL;
+    }
+
+    if (it->refcount == 1 && !item_is_compressed(it) &&
+        (res <= (int)it->nbytes ||
+         ((it->iflag & ITEM_WITH_COUNTER) != 0 &&
+          do_item_resize_in_place(engine, it, res)))) {
+        /* we can do inline replacement */
+        memcpy(item_get_data(it), buf, res);
+        memset(item_get_data(it) + res, ' ', it->nbytes - res);
+        item_set_counter(it, value);
+        item_set_cas(NULL, NULL, it, get_cas_id(engine));
+        if (engine->config.dcp) {
+            dcp_log_mutation(engine, it);
+        }
+        *rcas = item_get_cas(it);
+    } else {
+        hash_item *new_it = do_item_alloc(engine, item_get_key(it),
+                                          it->nkey, it->flags,
+                                          it->exptime, res, cookie,
+                                          it->datatype &
+                                          ~PROTOCOL_BINARY_DATATYPE_COMPRESSED,
+                                          item_get_lock(engine, hv));
+        if (new_it == NULL) {
+            do_item_unlink(engine, it, hv);
+            return ENGINE_ENOMEM;
+        }
+        memcpy(item_get_data(new_it), buf, res);
+        item_set_counter(new_it, value);
+        item_set_seqno(new_it, item_get_vbucket(it), 0);
+        do_item_replace(engine, it, new_it, hv);
+        *rcas = item_get_cas(new_it);
+        do_item_release(engine, new_it);       /* release our reference */
+    }
+
+    return ENGINE_SUCCESS;
 }
 
-/*@null@*/
-static char *do_item_cachedump(const unsigned int slabs_clsid,
-                               const unsigned int limit,
-                               unsigned int *bytes) {
-#ifdef FUTURE
-    unsigned int memlimit = 2 * 1024 * 1024;   /* 2MB max response size */
-    char *buffer;
-    unsigned int bufcurr;
+/********************************* ITEM ACCESS *******************************/
+
+/*
+ * Allocates a new item.
+ */
+hash_item *item_alloc(struct default_engine *engine,
+                      const void *key, size_t nkey, int flags,
+                      rel_time_t exptime, int nbytes, const void *cookie,
+                      uint8_t datatype) {
+    return do_item_alloc(engine, key, nkey, flags, exptime, nbytes, cookie,
+                         datatype, NULL);
+}
+
+/*
+ * Returns an item if it hasn't been marked as expired,
+ * lazy-expiring as needed.
+ */
+hash_item *item_get(struct default_engine *engine, const void *cookie,
+                    const void *key, const size_t nkey) {
     hash_item *it;
-    unsigned int len;
-    unsigned int shown = 0;
-    char key_temp[KEY_MAX_LENGTH + 1];
-    char temp[512];
+    uint32_t hv = item_key_hash(engine, cookie, key, nkey);
+    uint32_t seq;
+
+    if (engine->config.lockless_get &&
+        item_find_lockless(engine, key, nkey, hv, &it, &seq)) {
+        if (it == NULL) {
+            return NULL;
+        }
+        item_lock(engine, hv);
+        if (item_seq_check(engine, hv, seq)) {
+            /* Still linked, as nothing changed the bucket since */
+            it = do_item_get_found(engine, key, nkey, hv, it);
+        } else {
+            it = do_item_get(engine, key, nkey, hv);
+        }
+        item_unlock(engine, hv);
+        return it;
+    }
+
+    item_lock(engine, hv);
+    it = do_item_get(engine, key, nkey, hv);
+    item_unlock(engine, hv);
+    return it;
+}
+
+/* The number of keys item_get_multi and item_store_multi hash (and
+ * prefetch) at a time */
+#define ITEM_MULTI_BATCH 64
+
+void item_get_multi(struct default_engine *engine, const engine_key_t *keys,
+                    int nkeys, hash_item **items) {
+    uint32_t hv[ITEM_MULTI_BATCH];
+    bool done[ITEM_MULTI_BATCH];
+    int base, n, ii, jj;
+
+    for (base = 0; base < nkeys; base += n) {
+        n = nkeys - base;
+        if (n > ITEM_MULTI_BATCH) {
+            n = ITEM_MULTI_BATCH;
+        }
+
+        /* Get the buckets on their way while we hash the rest */
+        for (ii = 0; ii < n; ++ii) {
+            hv[ii] = engine->server.core->hash(keys[base + ii].key,
+                                               keys[base + ii].nkey, 0);
+            assoc_prefetch(engine, hv[ii]);
+            done[ii] = false;
+        }
+
+        /* Look up all of the keys sharing a lock while we hold it */
+        for (ii = 0; ii < n; ++ii) {
+            cb_mutex_t *lock;
+            if (done[ii]) {
+                continue;
+            }
+            lock = item_get_lock(engine, hv[ii]);
+            cb_mutex_enter(lock);
+            for (jj = ii; jj < n; ++jj) {
+                if (!done[jj] && item_get_lock(engine, hv[jj]) == lock) {
+                    items[base + jj] = do_item_get(engine,
+                                                   keys[base + jj].key,
+                                                   keys[base + jj].nkey,
+                                                   hv[jj]);
+                    done[jj] = true;
+                }
+            }
+            cb_mutex_exit(lock);
+        }
+    }
+}
+
+/*
+ * Decrements the reference count on an item and adds it to the freelist if
+ * needed.
+ */
+void item_release(struct default_engine *engine, hash_item *item) {
+    uint32_t hv = item_hash(engine, item);
+    item_lock(engine, hv);
+    do_item_release(engine, item);
+    item_unlock(engine, hv);
+}
+
+/*
+ * Unlinks an item from the LRU and hashtable.
+ */
+void item_unlink(struct default_engine *engine, hash_item *item) {
+    uint32_t hv = item_hash(engine, item);
+    item_lock(engine, hv);
+    do_item_unlink(engine, item, hv);
+    item_unlock(engine, hv);
+}
+
+void item_delete(struct default_engine *engine, hash_item *item) {
+    uint32_t hv = item_hash(engine, item);
+    item_lock(engine, hv);
+    if (engine->config.dcp && (item->iflag & ITEM_LINKED) != 0) {
+        dcp_log_removal(engine, item, DCP_CHANGE_DELETION);
+    }
+    do_item_unlink(engine, item, hv);
+    item_unlock(engine, hv);
+}
+
+static ENGINE_ERROR_CODE do_arithmetic(struct default_engine *engine,
+                                       const void* cookie,
+                                       const void* key,
+                                       const int nkey,
+                                       const bool increment,
+                                       const bool create,
+                                       const uint64_t delta,
+                                       const uint64_t initial,
+                                       const rel_time_t exptime,
+                                       uint64_t *cas,
+                                       uint8_t datatype,
+                                       uint64_t *result,
+                                       uint16_t vbucket,
+                                       uint32_t hv)
+{
+   hash_item *item = do_item_get(engine, key, nkey, hv);
+   ENGINE_ERROR_CODE ret;
+
+   if (item != NULL && (item->iflag & ITEM_HDR) != 0 &&
+       (ret = do_item_ext_fetch(engine, item, hv, cookie,
+                                &item)) == ENGINE_ENOMEM) {
+      return ret;
+   }
+
+   if (item == NULL) {
+      if (!create) {
+         return ENGINE_KEY_ENOENT;
+      } else {
+         char buffer[128];
+         int len = snprintf(buffer, sizeof(buffer), "%"PRIu64,
+                            (uint64_t)initial);
+
+         item = do_item_alloc(engine, key, nkey, 0, exptime, len, cookie,
+                              datatype, item_get_lock(engine, hv));
+         if (item == NULL) {
+            return ENGINE_ENOMEM;
+         }
+         memcpy((void*)item_get_data(item), buffer, len);
+         item_set_counter(item, initial);
+         item_set_seqno(item, vbucket, 0);
+         if ((ret = do_store_item(engine, item, cas,
+                                  OPERATION_ADD, cookie, hv)) == ENGINE_SUCCESS) {
+             *result = initial;
+             *cas = item_get_cas(item);
+         }
+         do_item_release(engine, item);
+      }
+   } else {
+      ret = do_add_delta(engine, item, increment, delta, cas, result, cookie,
+                         hv);
+      do_item_release(engine, item);
+   }
+
+   return ret;
+}
+
+ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
+                             const void* cookie,
+                             const void* key,
+                             const int nkey,
+                             const bool increment,
+                             const bool create,
+                             const uint64_t delta,
+                             const uint64_t initial,
+                             const rel_time_t exptime,
+                             uint64_t *cas,
+                             uint8_t datatype,
+                             uint64_t *result,
+                             uint16_t vbucket)
+{
+    ENGINE_ERROR_CODE ret;
+    uint32_t hv = item_key_hash(engine, cookie, key, nkey);
+
+    item_lock(engine, hv);
+    ret = do_arithmetic(engine, cookie, key, nkey, increment,
+                        create, delta, initial, exptime, cas,
+                        datatype, result, vbucket, hv);
+    item_unlock(engine, hv);
+    return ret;
+}
+
+/*
+ * With compression_threshold the values of at least that many bytes are
+ * stored compressed with snappy, as if the client had sent them that way,
+ * if that makes them smaller by an eighth at least. The daemon inflates
+ * them again for the clients which don't know about datatypes. The item
+ * isn't linked yet, so we don't need the item lock for it. We leave the
+ * pieces to append or prepend alone (they'd only be inflated again).
+ *
+ * Returns the compressed copy of the item (which the caller must release),
+ * or NULL to store the item as it is.
+ */
+static hash_item *item_compress(struct default_engine *engine,
+                                hash_item *it,
+                                ENGINE_STORE_OPERATION operation,
+                                const void *cookie) {
+    const char *value;
+    char *buf = NULL;
+    char *compressed;
+    size_t ncompressed;
+    hash_item *new_it = NULL;
+
+    if (engine->config.compression_threshold == 0 ||
+        it->nbytes < engine->config.compression_threshold ||
+        item_is_compressed(it) ||
+        operation == OPERATION_APPEND || operation == OPERATION_PREPEND) {
+        return NULL;
+    }
+
+    if (it->iflag & ITEM_CHUNKED) {
+        if ((buf = malloc(it->nbytes)) == NULL) {
+            return NULL;
+        }
+        item_read_value(engine, it, buf);
+        value = buf;
+    } else {
+        value = item_get_data(it);
+    }
+
+    ncompressed = snappy_max_compressed_length(it->nbytes);
+    if ((compressed = malloc(ncompressed)) != NULL &&
+        snappy_compress(value, it->nbytes, compressed,
+                        &ncompressed) == SNAPPY_OK &&
+        ncompressed <= it->nbytes - it->nbytes / 8) {
+        new_it = do_item_alloc(engine, item_get_key(it), it->nkey,
+                               it->flags, it->exptime, (int)ncompressed,
+                               cookie,
+                               it->datatype |
+                               PROTOCOL_BINARY_DATATYPE_COMPRESSED,
+                               NULL);
+    }
+
+    if (new_it != NULL) {
+        memcpy(item_get_data(new_it), compressed, ncompressed);
+        item_set_cas(NULL, NULL, new_it, item_get_cas(it));
+        item_set_seqno(new_it, item_get_vbucket(it), 0);
+        item_gdsf_copy(new_it, it);
+
+        mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+        engine->stats.values_compressed++;
+        cb_mutex_exit(&engine->stats.lock);
+    }
+    free(compressed);
+    free(buf);
+    return new_it;
+}
+
+/*
+ * Stores an item in the cache (high level, obeys set/add/replace semantics)
+ */
+ENGINE_ERROR_CODE store_item(struct default_engine *engine,
+                             hash_item *item, uint64_t *cas,
+                             ENGINE_STORE_OPERATION operation,
+                             const void *cookie) {
+    ENGINE_ERROR_CODE ret;
+    uint32_t hv = item_hash(engine, item);
+    hash_item *compressed = item_compress(engine, item, operation, cookie);
+
+    item_lock(engine, hv);
+    ret = do_store_item(engine, compressed != NULL ? compressed : item, cas,
+                        operation, cookie, hv);
+    item_unlock(engine, hv);
+
+    if (compressed != NULL) {
+        item_release(engine, compressed);
+    }
+    return ret;
+}
+
+void item_store_multi(struct default_engine *engine,
+                      const engine_store_t *reqs, hash_item **items, int n,
+                      uint64_t *cas, ENGINE_ERROR_CODE *status,
+                      const void *cookie) {
+    uint32_t hv[ITEM_MULTI_BATCH];
+    bool done[ITEM_MULTI_BATCH];
+    hash_item *compressed[ITEM_MULTI_BATCH];
+    int base, num, ii, jj;
+
+    for (base = 0; base < n; base += num) {
+        num = n - base;
+        if (num > ITEM_MULTI_BATCH) {
+            num = ITEM_MULTI_BATCH;
+        }
+
+        for (ii = 0; ii < num; ++ii) {
+            done[ii] = items[base + ii] == NULL;
+            compressed[ii] = NULL;
+            if (!done[ii]) {
+                hv[ii] = item_hash(engine, items[base + ii]);
+                assoc_prefetch(engine, hv[ii]);
+                compressed[ii] = item_compress(engine, items[base + ii],
+                                               reqs[base + ii].operation,
+                                               cookie);
+            }
+        }
+
+        /* Take each lock once for all of the items sharing it (in order,
+         * so that a key stored twice ends up with the last value) */
+        for (ii = 0; ii < num; ++ii) {
+            cb_mutex_t *lock;
+            if (done[ii]) {
+                continue;
+            }
+            lock = item_get_lock(engine, hv[ii]);
+            cb_mutex_enter(lock);
+            for (jj = ii; jj < num; ++jj) {
+                if (!done[jj] && item_get_lock(engine, hv[jj]) == lock) {
+                    status[base + jj] = do_store_item(engine,
+                                                      compressed[jj] != NULL ?
+                                                      compressed[jj] :
+                                                      items[base + jj],
+                                                      &cas[base + jj],
+                                                      reqs[base + jj].operation,
+                                                      cookie, hv[jj]);
+                    done[jj] = true;
+                }
+            }
+            cb_mutex_exit(lock);
+        }
+
+        for (ii = 0; ii < num; ++ii) {
+            if (compressed[ii] != NULL) {
+                item_release(engine, compressed[ii]);
+            }
+        }
+    }
+}
+
+static hash_item *do_touch_item(struct default_engine *engine,
+                                     const void *key,
+                                     uint16_t nkey,
+                                     uint32_t exptime,
+                                     uint32_t hv)
+{
+   hash_item *item = do_item_get(engine, key, nkey, hv);
+   if (item != NULL) {
+       do_item_set_exptime(engine, item, exptime);
+       if (engine->config.dcp) {
+           dcp_log_mutation(engine, item);
+       }
+   }
+   return item;
+}
 
-    it = engine->items.heads[slabs_clsid];
+hash_item *touch_item(struct default_engine *engine,
+                           const void *cookie,
+                           const void *key,
+                           uint16_t nkey,
+                           uint32_t exptime)
+{
+    hash_item *ret;
+    uint32_t hv = item_key_hash(engine, cookie, key, nkey);
 
-    buffer = malloc((size_t)memlimit);
-    if (buffer == 0) return NULL;
-    bufcurr = 0;
+    item_lock(engine, hv);
+    ret = do_touch_item(engine, key, nkey, exptime, hv);
+    item_unlock(engine, hv);
+    return ret;
+}
 
+/*
+ * Overwrite a range of the value of the item where it is. As with
+ * do_item_append_in_place we only do so if nobody else holds a reference
+ * to the item; a counter or a compressed value has to be rebuilt, and an
+ * item in extstore has its value elsewhere. Caller must hold the item
+ * lock for hv.
+ */
+static ENGINE_ERROR_CODE do_item_patch(struct default_engine *engine,
+                                       const void *key, uint16_t nkey,
+                                       uint64_t offset, const void *data,
+                                       uint32_t len, uint64_t *cas,
+                                       uint32_t hv) {
+    hash_item *it = do_item_get(engine, key, nkey, hv);
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+
+    if (it == NULL) {
+        return ENGINE_KEY_ENOENT;
+    }
 
-    while (it != NULL && (limit == 0 || shown < limit)) {
-        cb_assert(it->nkey <= KEY_MAX_LENGTH);
-        /* Copy the key since it may not be null-terminated in the struct */
-        strncpy(key_temp, item_get_key(it), it->nkey);
-        key_temp[it->nkey] = 0x00; /* terminate */
-        len = snprintf(temp, sizeof(temp), "ITEM %s [%d b; %lu s]\r\n",
-                       key_temp, it->nbytes,
-                       (unsigned long)it->exptime + process_started);
-        if (bufcurr + len + 6 > memlimit)  /* 6 is END\r\n\0 */
-            break;
-        memcpy(buffer + bufcurr, temp, len);
-        bufcurr += len;
-        shown++;
-        it = it->next;
+    if (*cas != 0 && item_get_cas(it) != *cas) {
+        ret = ENGINE_KEY_EEXISTS;
+    } else if (offset + len > (uint64_t)it->nbytes) {
+        ret = ENGINE_ERANGE;
+    } else if (it->refcount != 1 || (it->iflag & ITEM_LINKED) == 0 ||
+               (it->iflag & (ITEM_HDR | ITEM_COUNTER)) != 0 ||
+               item_is_compressed(it)) {
+        ret = ENGINE_ENOTSUP;
+    } else {
+        /* Unlink it while it changes so that it gets a new CAS */
+        do_item_unlink(engine, it, hv);
+        item_write_value(engine, it, (size_t)offset, data, len);
+        item_set_seqno(it, item_get_vbucket(it), 0);
+        do_item_link(engine, it, hv);
+        *cas = item_get_cas(it);
+
+        mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+        engine->stats.patches_in_place++;
+        cb_mutex_exit(&engine->stats.lock);
     }
 
+    do_item_release(engine, it);
+    return ret;
+}
 
-    memcpy(buffer + bufcurr, "END\r\n", 6);
-    bufcurr += 5;
+ENGINE_ERROR_CODE item_patch(struct default_engine *engine,
+                             const void *cookie,
+                             const void *key, uint16_t nkey,
+                             uint64_t offset, const void *data,
+                             uint32_t len, uint64_t *cas) {
+    ENGINE_ERROR_CODE ret;
+    uint32_t hv = item_key_hash(engine, cookie, key, nkey);
 
-    *bytes = bufcurr;
-    return buffer;
-#endif
-    (void)slabs_clsid;
-    (void)limit;
-    (void)bytes;
-    return NULL;
+    item_lock(engine, hv);
+    ret = do_item_patch(engine, key, nkey, offset, data, len, cas, hv);
+    item_unlock(engine, hv);
+    return ret;
 }
 
-static void do_item_stats(struct default_engine *engine,
-                          ADD_STAT add_stats, const void *c) {
+/*
+ * Flush all of the items (at when, or right now if it is 0). We don't
+ * walk the cache: from then on item_is_flushed() says the items are
+ * dead, so they are misses and get reclaimed by the allocator, the LRU
+ * maintainer and the crawler as they come across them. To tell the items
+ * linked just before a flush right now from the ones linked just after it
+ * we need their CAS, so without it we unlink the items of the last second
+ * (the heads of the LRUs) here.
+ */
+void item_flush_expired(struct default_engine *engine, time_t when) {
     int i;
-    rel_time_t current_time = engine->server.core->get_current_time();
-    for (i = 0; i < POWER_LARGEST; i++) {
-        if (engine->items.tails[i] != NULL) {
-            const char *prefix = "items";
-            int search = search_items;
-            while (search > 0 &&
-                   engine->items.tails[i] != NULL &&
-                   ((engine->config.oldest_live != 0 && /* Item flushd */
-                     engine->config.oldest_live <= current_time &&
-                     engine->items.tails[i]->time <= engine->config.oldest_live) ||
-                    (engine->items.tails[i]->exptime != 0 && /* and not expired */
-                     engine->items.tails[i]->exptime < current_time))) {
-                --search;
-                if (engine->items.tails[i]->refcount == 0) {
-                    do_item_unlink(engine, engine->items.tails[i]);
-                } else {
-                    break;
+    hash_item *iter, *next;
+
+    if (when != 0) {
+        engine->config.oldest_live = engine->server.core->realtime(when) - 1;
+        return;
+    }
+    if (engine->config.use_cas) {
+        engine->config.oldest_cas = get_cas_id(engine);
+        engine->config.oldest_live = engine->server.core->get_current_time() - 1;
+        return;
+    }
+
+    /*
+     * We need to be sure that every item we're about to nuke is
+     * unreferenced, so grab all of the item locks before the LRU
+     * locks (this is rare enough that we don't care about the cost)
+     */
+    item_lock_all(engine);
+
+    engine->config.oldest_live = engine->server.core->get_current_time() - 1;
+
+    if (engine->config.oldest_live != 0) {
+        for (i = 0; i < POWER_LARGEST; i++) {
+            int lru;
+            mc_mutex_enter(&engine->items.lock[i], &engine->lock_stats.lru);
+            /*
+             * Each LRU segment is sorted in decreasing time order, and an
+             * item's timestamp is never newer than its last access time,
+             * so we only need to walk back until we hit an item older
+             * than the oldest_live time.
+             * The oldest_live checking will auto-expire the remaining items.
+             */
+            for (lru = HOT_LRU; lru < NUM_LRU; ++lru) {
+                for (iter = engine->items.heads[i][lru]; iter != NULL; iter = next) {
+                    if (iter->time >= engine->config.oldest_live) {
+                        next = item_next(engine, iter);
+                        if ((iter->iflag & ITEM_SLABBED) == 0) {
+                            do_item_unlink_nolock(engine, iter,
+                                                  item_hash(engine, iter));
+                        }
+                    } else {
+                        /* We've hit the first old item. Continue to the next queue. */
+                        break;
+                    }
                 }
             }
-            if (engine->items.tails[i] == NULL) {
-                /* We removed all of the items in this slab class */
-                continue;
-            }
-
-            add_statistics(c, add_stats, prefix, i, "number", "%u",
-                           engine->items.sizes[i]);
-            add_statistics(c, add_stats, prefix, i, "age", "%u",
-                           engine->items.tails[i]->time);
-            add_statistics(c, add_stats, prefix, i, "evicted",
-                           "%u", engine->items.itemstats[i].evicted);
-            add_statistics(c, add_stats, prefix, i, "evicted_nonzero",
-                           "%u", engine->items.itemstats[i].evicted_nonzero);
-            add_statistics(c, add_stats, prefix, i, "evicted_time",
-                           "%u", engine->items.itemstats[i].evicted_time);
-            add_statistics(c, add_stats, prefix, i, "outofmemory",
-                           "%u", engine->items.itemstats[i].outofmemory);
-            add_statistics(c, add_stats, prefix, i, "tailrepairs",
-                           "%u", engine->items.itemstats[i].tailrepairs);;
-            add_statistics(c, add_stats, prefix, i, "reclaimed",
-                           "%u", engine->items.itemstats[i].reclaimed);;
+            cb_mutex_exit(&engine->items.lock[i]);
         }
     }
+    item_unlock_all(engine);
 }
 
-/** dumps out a list of objects of each size, with granularity of 32 bytes */
-/*@null@*/
-static void do_item_stats_sizes(struct default_engine *engine,
-                                ADD_STAT add_stats, const void *c) {
+/*
+ * Dumps part of the cache
+ */
+char *item_cachedump(struct default_engine *engine,
+                     const unsigned int slabs_clsid,
+                     const unsigned int limit,
+                     unsigned int *bytes) {
+    char *ret;
 
-    /* max 1MB object, divided into 32 bytes size buckets */
-    const int num_buckets = 32768;
-    unsigned int *histogram = calloc(num_buckets, sizeof(unsigned int));
+    if (slabs_clsid >= POWER_LARGEST) {
+        return NULL;
+    }
 
-    if (histogram != NULL) {
-        int i;
+    mc_mutex_enter(&engine->items.lock[slabs_clsid], &engine->lock_stats.lru);
+    ret = do_item_cachedump(slabs_clsid, limit, bytes);
+    cb_mutex_exit(&engine->items.lock[slabs_clsid]);
+    return ret;
+}
 
-        /* build the histogram */
-        for (i = 0; i < POWER_LARGEST; i++) {
-            hash_item *iter = engine->items.heads[i];
-            while (iter) {
-                size_t ntotal = ITEM_ntotal(engine, iter);
-                size_t bucket = ntotal / 32;
-                if ((ntotal % 32) != 0) {
-                    bucket++;
-                }
-                if (bucket < num_buckets) {
-                    histogram[bucket]++;
-                }
-                iter = iter->next;
+void item_stats(struct default_engine *engine,
+                   ADD_STAT add_stat, const void *cookie)
+{
+    do_item_stats(engine, add_stat, cookie);
+}
+
+
+void item_stats_sizes(struct default_engine *engine,
+                      ADD_STAT add_stat, const void *cookie)
+{
+    do_item_stats_sizes(engine, add_stat, cookie);
+}
+
+/* Caller must hold the LRU lock for slab class ii */
+static void do_item_link_cursor(struct default_engine *engine,
+                                hash_item *cursor, int ii, int lru)
+{
+    cursor->slabs_clsid = (uint8_t)ii;
+    item_set_lru(cursor, lru);
+    cursor->next = 0;
+    item_set_prev(engine, cursor, engine->items.tails[ii][lru]);
+    item_set_next(engine, engine->items.tails[ii][lru], cursor);
+    engine->items.tails[ii][lru] = cursor;
+    engine->items.sizes[ii][lru]++;
+}
+
+/*
+ * Link the cursor at the tail of the first non-empty LRU at or after
+ * segment lru of slab class ii. With pages the cursor walks the pages of
+ * the tiny classes before their LRUs (it isn't linked anywhere while it
+ * does: ITEM_TINY is set on it, and exptime is the chunk it looks at
+ * next). The caller must not hold any of the LRU locks (we take them one
+ * at a time).
+ */
+static bool item_link_cursor_from(struct default_engine *engine,
+                                  hash_item *cursor, int ii, int lru,
+                                  bool pages)
+{
+    /* Moving on from the pages of ii to its LRUs? */
+    bool paged = (cursor->iflag & ITEM_TINY) != 0;
+
+    cursor->iflag &= ~ITEM_TINY;
+    for (; ii < POWER_LARGEST; ++ii, lru = HOT_LRU, paged = false) {
+        bool linked = false;
+        if (pages && !paged && lru == HOT_LRU &&
+            engine->slabs.slabclass[ii].tiny) {
+            cursor->slabs_clsid = (uint8_t)ii;
+            item_set_lru(cursor, HOT_LRU);
+            cursor->next = cursor->prev = 0;
+            cursor->iflag |= ITEM_TINY;
+            cursor->exptime = 0;
+            return true;
+        }
+        mc_mutex_enter(&engine->items.lock[ii], &engine->lock_stats.lru);
+        for (; lru < NUM_LRU && !linked; ++lru) {
+            if (engine->items.heads[ii][lru] != NULL) {
+                /* add the item at the tail */
+                do_item_link_cursor(engine, cursor, ii, lru);
+                linked = true;
             }
         }
+        cb_mutex_exit(&engine->items.lock[ii]);
+        if (linked) {
+            return true;
+        }
+    }
+    return false;
+}
 
-        /* write the buffer */
-        for (i = 0; i < num_buckets; i++) {
-            if (histogram[i] != 0) {
-                char key[8], val[32];
-                int klen, vlen;
-                klen = snprintf(key, sizeof(key), "%d", i * 32);
-                vlen = snprintf(val, sizeof(val), "%u", histogram[i]);
-                cb_assert(klen < sizeof(key));
-                cb_assert(vlen < sizeof(val));
-                add_stats(key, klen, val, vlen, c);
+typedef ENGINE_ERROR_CODE (*ITERFUNC)(struct default_engine *engine,
+                                      hash_item *item, uint32_t hv,
+                                      void *cookie);
+
+/*
+ * Move the cursor steplength chunks along the pages of its tiny class and
+ * call itemfunc for the items on them, like do_item_walk_cursor does in
+ * the LRUs. Caller must hold the LRU lock for the class (so nobody
+ * allocates the chunks we look at).
+ */
+static bool do_item_walk_pages(struct default_engine *engine,
+                               hash_item *cursor,
+                               int steplength,
+                               ITERFUNC itemfunc,
+                               void *itemdata,
+                               ENGINE_ERROR_CODE *error)
+{
+    unsigned int id = cursor->slabs_clsid;
+    unsigned int size = engine->slabs.slabclass[id].size;
+    unsigned int perslab = engine->slabs.slabclass[id].perslab;
+    char *page = NULL;
+    int ii;
+    *error = ENGINE_SUCCESS;
+
+    for (ii = 0; ii < steplength; ++ii) {
+        hash_item *it;
+        uint32_t hv;
+        cb_mutex_t *lock;
+
+        if (page == NULL || cursor->exptime % perslab == 0) {
+            page = slabs_page(engine, id, cursor->exptime / perslab);
+            if (page == NULL) {
+                return false;
             }
         }
-        free(histogram);
+        it = (hash_item*)(page + (size_t)(cursor->exptime % perslab) * size);
+        if ((it->iflag & (ITEM_LINKED | ITEM_TINY)) !=
+            (ITEM_LINKED | ITEM_TINY)) {
+            cursor->exptime++;
+            continue;
+        }
+        hv = item_hash(engine, it);
+        if (!item_trylock(engine, hv, NULL, &lock)) {
+            *error = ENGINE_EWOULDBLOCK;
+            return true;
+        }
+        cursor->exptime++;
+        if ((it->iflag & ITEM_LINKED) != 0) {
+            *error = itemfunc(engine, it, hv, itemdata);
+        }
+        cb_mutex_exit(lock);
+        if (*error != ENGINE_SUCCESS) {
+            return false;
+        }
     }
+    return true;
 }
 
-/** wrapper around assoc_find which does the lazy expiration logic */
-hash_item *do_item_get(struct default_engine *engine,
-                       const char *key, const size_t nkey) {
-    rel_time_t current_time = engine->server.core->get_current_time();
-    hash_item *it = assoc_find(engine, engine->server.core->hash(key,
-                                                                      nkey, 0),
-                               key, nkey);
-    int was_found = 0;
+/*
+ * Move the cursor steplength items towards the head of the LRU and call
+ * itemfunc for each of them (with the item lock held). Caller must hold
+ * the LRU lock for the cursor's slab class. If an item is busy the cursor
+ * is left in front of it and *error is set to ENGINE_EWOULDBLOCK; the
+ * caller should back off and call us again.
+ */
+static bool do_item_walk_cursor(struct default_engine *engine,
+                                hash_item *cursor,
+                                int steplength,
+                                ITERFUNC itemfunc,
+                                void* itemdata,
+                                ENGINE_ERROR_CODE *error)
+{
+    int ii = 0;
 
-    if (engine->config.verbose > 2) {
-        EXTENSION_LOGGER_DESCRIPTOR *logger;
-        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-        if (it == NULL) {
-            logger->log(EXTENSION_LOG_DEBUG, NULL,
-                        "> NOT FOUND %s", key);
+    if (cursor->iflag & ITEM_TINY) {
+        return do_item_walk_pages(engine, cursor, steplength, itemfunc,
+                                  itemdata, error);
+    }
+
+    *error = ENGINE_SUCCESS;
+    while (cursor->prev != 0 && ii < steplength) {
+        /* Move cursor */
+        hash_item *ptr = item_prev(engine, cursor);
+        bool done = false;
+        bool is_cursor = (ptr->nkey == 0 && ptr->nbytes == 0);
+        uint32_t hv = 0;
+        cb_mutex_t *lock = NULL;
+
+        if (!is_cursor) {
+            hv = item_hash(engine, ptr);
+            if (!item_trylock(engine, hv, NULL, &lock)) {
+                *error = ENGINE_EWOULDBLOCK;
+                return true;
+            }
+        }
+
+        ++ii;
+        item_unlink_q(engine, cursor);
+
+        if (ptr == engine->items.heads[cursor->slabs_clsid][item_lru(cursor)]) {
+            done = true;
+            cursor->prev = 0;
         } else {
-            logger->log(EXTENSION_LOG_DEBUG, NULL,
-                        "> FOUND KEY %s",
-                        (const char*)item_get_key(it));
-            was_found++;
+            item_set_next(engine, cursor, ptr);
+            cursor->prev = ptr->prev;
+            item_set_next(engine, item_prev(engine, cursor), cursor);
+            item_set_prev(engine, ptr, cursor);
+            /* item_unlink_q took the cursor out of the size */
+            engine->items.sizes[cursor->slabs_clsid][item_lru(cursor)]++;
         }
-    }
 
-    if (it != NULL && engine->config.oldest_live != 0 &&
-        engine->config.oldest_live <= current_time &&
-        it->time <= engine->config.oldest_live) {
-        do_item_unlink(engine, it);           /* MTSAFE - cache_lock held */
-        it = NULL;
+        /* Ignore cursors */
+        if (is_cursor) {
+            --ii;
+        } else {
+            *error = itemfunc(engine, ptr, hv, itemdata);
+            cb_mutex_exit(lock);
+            if (*error != ENGINE_SUCCESS) {
+                return false;
+            }
+        }
+
+        if (done) {
+            return false;
+        }
     }
 
-    if (it == NULL && was_found) {
-        EXTENSION_LOGGER_DESCRIPTOR *logger;
-        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-        logger->log(EXTENSION_LOG_DEBUG, NULL, " -nuked by flush");
-        was_found--;
+    return (cursor->prev != 0);
+}
+
+/* What a scrubber worker found in the slice it just walked */
+struct item_scrub_counts {
+    uint64_t visited;
+    uint64_t cleaned;
+};
+
+static ENGINE_ERROR_CODE item_scrub(struct default_engine *engine,
+                                    hash_item *item,
+                                    uint32_t hv,
+                                    void *cookie) {
+    struct item_scrub_counts *counts = cookie;
+    rel_time_t current_time = engine->server.core->get_current_time();
+    counts->visited++;
+    if (item->refcount == 0 &&
+        (item->exptime != 0 && item->exptime < current_time)) {
+        do_item_unlink_nolock(engine, item, hv);
+        counts->cleaned++;
     }
+    return ENGINE_SUCCESS;
+}
 
-    if (it != NULL && it->exptime != 0 && it->exptime <= current_time) {
-        do_item_unlink(engine, it);           /* MTSAFE - cache_lock held */
-        it = NULL;
+/*
+ * Walk the cursor steplength items towards the head of its LRU with the
+ * LRU lock held. Returns false when we reach the head (or itemfunc fails).
+ * The caller must not hold any of the LRU locks.
+ */
+static bool item_walk_lru_slice(struct default_engine *engine,
+                                hash_item *cursor,
+                                int steplength,
+                                ITERFUNC itemfunc,
+                                void *itemdata) {
+    ENGINE_ERROR_CODE ret;
+    bool more;
+    unsigned int clsid = cursor->slabs_clsid;
+
+    mc_mutex_enter(&engine->items.lock[clsid], &engine->lock_stats.lru);
+    more = do_item_walk_cursor(engine, cursor, steplength, itemfunc,
+                               itemdata, &ret);
+    if (ret == ENGINE_EWOULDBLOCK) {
+        item_lru_backoff(engine, clsid);
+        ret = ENGINE_SUCCESS;
     }
+    cb_mutex_exit(&engine->items.lock[clsid]);
 
-    if (it == NULL && was_found) {
-        EXTENSION_LOGGER_DESCRIPTOR *logger;
-        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-        logger->log(EXTENSION_LOG_DEBUG, NULL, " -nuked by expire");
-        was_found--;
+    return more && ret == ENGINE_SUCCESS;
+}
+
+/*
+ * Take the cursor out of its LRU (if it is still in there). The caller
+ * must not hold any of the LRU locks.
+ */
+static void item_unlink_cursor(struct default_engine *engine,
+                               hash_item *cursor) {
+    unsigned int clsid = cursor->slabs_clsid;
+    int lru = item_lru(cursor);
+
+    mc_mutex_enter(&engine->items.lock[clsid], &engine->lock_stats.lru);
+    /* do_item_walk_cursor drops it from the list when it reaches the head */
+    if (cursor->prev != 0 || engine->items.heads[clsid][lru] == cursor) {
+        item_unlink_q(engine, cursor);
+        cursor->next = cursor->prev = 0;
     }
+    cb_mutex_exit(&engine->items.lock[clsid]);
+}
 
-    if (it != NULL) {
-        it->refcount++;
-        DEBUG_REFCNT(it, '+');
-        do_item_update(engine, it);
+/*
+ * Set up a cursor for walking the LRUs. With the compact item layout the
+ * cursor needs a slot in the cursor table (so that the items next to it
+ * can refer to it) until it is released with item_cursor_destroy().
+ */
+static bool item_cursor_init(struct default_engine *engine,
+                             hash_item *cursor) {
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->refcount = 1;
+#ifdef COMPACT_ITEMS
+    {
+        bool ret = false;
+        unsigned int ii;
+
+        cb_mutex_enter(&engine->items.cursor_lock);
+        for (ii = 0; ii < ITEM_MAX_CURSORS; ++ii) {
+            if (engine->items.cursors[ii] == NULL) {
+                engine->items.cursors[ii] = cursor;
+                cursor->h_next = ITEM_REF_CURSOR | ii;
+                ret = true;
+                break;
+            }
+        }
+        cb_mutex_exit(&engine->items.cursor_lock);
+        return ret;
     }
+#else
+    (void)engine;
+    return true;
+#endif
+}
 
-    return it;
+/* Give back the cursor's slot in the cursor table */
+static void item_cursor_release(struct default_engine *engine,
+                                hash_item *cursor) {
+#ifdef COMPACT_ITEMS
+    cb_mutex_enter(&engine->items.cursor_lock);
+    engine->items.cursors[cursor->h_next & ~ITEM_REF_CURSOR] = NULL;
+    cb_mutex_exit(&engine->items.cursor_lock);
+#else
+    (void)engine;
+    (void)cursor;
+#endif
 }
 
 /*
- * Stores an item in the cache according to the semantics of one of the set
- * commands. In threaded mode, this is protected by the cache lock.
- *
- * Returns the state of storage.
+ * Take the cursor out of the LRU and release it. The caller must not hold
+ * any of the LRU locks.
  */
-static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
-                                       hash_item *it, uint64_t *cas,
-                                       ENGINE_STORE_OPERATION operation,
-                                       const void *cookie) {
-    const char *key = item_get_key(it);
-    hash_item *old_it = do_item_get(engine, key, it->nkey);
-    ENGINE_ERROR_CODE stored = ENGINE_NOT_STORED;
-
-    hash_item *new_it = NULL;
+static void item_cursor_destroy(struct default_engine *engine,
+                                hash_item *cursor) {
+    item_unlink_cursor(engine, cursor);
+    item_cursor_release(engine, cursor);
+}
 
-    if (old_it != NULL && operation == OPERATION_ADD) {
-        /* add only adds a nonexistent item, but promote to head of LRU */
-        do_item_update(engine, old_it);
-    } else if (!old_it && (operation == OPERATION_REPLACE
-        || operation == OPERATION_APPEND || operation == OPERATION_PREPEND))
-    {
-        /* replace only replaces an existing value; don't store */
-    } else if (operation == OPERATION_CAS) {
-        /* validate cas operation */
-        if(old_it == NULL) {
-            /* LRU expired */
-            stored = ENGINE_KEY_ENOENT;
-        }
-        else if (item_get_cas(it) == item_get_cas(old_it)) {
-            /* cas validates */
-            /* it and old_it may belong to different classes. */
-            /* I'm updating the stats for the one that's getting pushed out */
-            do_item_replace(engine, old_it, it);
-            stored = ENGINE_SUCCESS;
-        } else {
-            if (engine->config.verbose > 1) {
-                EXTENSION_LOGGER_DESCRIPTOR *logger;
-                logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-                logger->log(EXTENSION_LOG_INFO, NULL,
-                        "CAS:  failure: expected %"PRIu64", got %"PRIu64"\n",
-                        item_get_cas(old_it),
-                        item_get_cas(it));
-            }
-            stored = ENGINE_KEY_EEXISTS;
-        }
-    } else {
-        /*
-         * Append - combine new and old record into single one. Here it's
-         * atomic and thread-safe.
-         */
-        if (operation == OPERATION_APPEND || operation == OPERATION_PREPEND) {
-            /*
-             * Validate CAS
-             */
-            if (item_get_cas(it) != 0) {
-                /* CAS much be equal */
-                if (item_get_cas(it) != item_get_cas(old_it)) {
-                    stored = ENGINE_KEY_EEXISTS;
-                }
-            }
+/*
+ * Link the cursor in front of the items of the vbucket (it walks towards
+ * the newest). Returns false if there are none (and the cursor isn't
+ * linked).
+ */
+static bool item_vb_link_cursor(struct default_engine *engine,
+                                hash_item *cursor, uint16_t vbucket) {
+    bool ret = false;
 
-            if (stored == ENGINE_NOT_STORED) {
-                size_t total = it->nbytes + old_it->nbytes;
-                if (total > engine->config.item_size_max) {
-                    return ENGINE_E2BIG;
-                }
+    cursor->flags = vbucket;
+    mc_mutex_enter(item_vb_lock(engine, vbucket),
+                   &engine->lock_stats.vbuckets);
+    if (engine->vbucket_index.lists[vbucket].items != 0) {
+        item_vb_link_q(engine, NULL, cursor);
+        ret = true;
+    }
+    cb_mutex_exit(item_vb_lock(engine, vbucket));
+    return ret;
+}
 
-                /* we have it and old_it here - alloc memory to hold both */
-                new_it = do_item_alloc(engine, key, it->nkey,
-                                       old_it->flags,
-                                       old_it->exptime,
-                                       it->nbytes + old_it->nbytes,
-                                       cookie, it->datatype);
-                if (new_it == NULL) {
-                    /* SERVER_ERROR out of memory */
-                    if (old_it != NULL) {
-                        do_item_release(engine, old_it);
-                    }
+/* Take the cursor out of the list of its vbucket (if it is in there) */
+static void item_vb_unlink_cursor(struct default_engine *engine,
+                                  hash_item *cursor) {
+    uint16_t vbucket = item_vb(cursor);
 
-                    return ENGINE_NOT_STORED;
-                }
+    mc_mutex_enter(item_vb_lock(engine, vbucket),
+                   &engine->lock_stats.vbuckets);
+    if (item_vb_links(cursor)->prev != 0 ||
+        engine->vbucket_index.lists[vbucket].head == cursor) {
+        item_vb_unlink_q(engine, cursor);
+    }
+    cb_mutex_exit(item_vb_lock(engine, vbucket));
+}
 
-                /* copy data from it and old_it to new_it */
+/*
+ * Move the cursor past the next item of its vbucket and call itemfunc for
+ * it, like do_item_walk_cursor does in the LRUs (with the vbucket lock in
+ * place of the LRU lock). Returns false when there are no more items.
+ */
+static bool do_item_vb_walk_cursor(struct default_engine *engine,
+                                   hash_item *cursor,
+                                   ITERFUNC itemfunc,
+                                   void *itemdata,
+                                   ENGINE_ERROR_CODE *error)
+{
+    hash_item *ptr;
+    *error = ENGINE_SUCCESS;
 
-                if (operation == OPERATION_APPEND) {
-                    memcpy(item_get_data(new_it), item_get_data(old_it), old_it->nbytes);
-                    memcpy(item_get_data(new_it) + old_it->nbytes, item_get_data(it), it->nbytes);
-                } else {
-                    /* OPERATION_PREPEND */
-                    memcpy(item_get_data(new_it), item_get_data(it), it->nbytes);
-                    memcpy(item_get_data(new_it) + it->nbytes, item_get_data(old_it), old_it->nbytes);
-                }
+    while ((ptr = item_deref(engine, item_vb_links(cursor)->next)) != NULL) {
+        bool is_cursor = (ptr->nkey == 0 && ptr->nbytes == 0);
+        uint32_t hv = 0;
+        cb_mutex_t *lock = NULL;
 
-                it = new_it;
+        if (!is_cursor) {
+            hv = item_hash(engine, ptr);
+            if (!item_trylock(engine, hv, NULL, &lock)) {
+                *error = ENGINE_EWOULDBLOCK;
+                return true;
             }
         }
 
-        if (stored == ENGINE_NOT_STORED) {
-            if (old_it != NULL) {
-                do_item_replace(engine, old_it, it);
-            } else {
-                do_item_link(engine, it);
-            }
+        item_vb_unlink_q(engine, cursor);
+        item_vb_link_q(engine, ptr, cursor);
 
-            *cas = item_get_cas(it);
-            stored = ENGINE_SUCCESS;
+        /* Ignore cursors */
+        if (!is_cursor) {
+            *error = itemfunc(engine, ptr, hv, itemdata);
+            cb_mutex_exit(lock);
+            return *error == ENGINE_SUCCESS;
         }
     }
 
-    if (old_it != NULL) {
-        do_item_release(engine, old_it);         /* release our reference */
+    return false;
+}
+
+static bool item_vb_walk_step(struct default_engine *engine,
+                              hash_item *cursor,
+                              int steplength,
+                              ITERFUNC itemfunc,
+                              void *itemdata)
+{
+    cb_mutex_t *lock = item_vb_lock(engine, item_vb(cursor));
+    ENGINE_ERROR_CODE ret;
+    bool more;
+
+    mc_mutex_enter(lock, &engine->lock_stats.vbuckets);
+    do {
+        more = do_item_vb_walk_cursor(engine, cursor, itemfunc, itemdata,
+                                      &ret);
+    } while (more && ret == ENGINE_SUCCESS && --steplength > 0);
+    cb_mutex_exit(lock);
+    if (more && ret == ENGINE_EWOULDBLOCK) {
+#ifdef WIN32
+        Sleep(0);
+#else
+        usleep(10);
+#endif
     }
+    return more;
+}
 
-    if (new_it != NULL) {
-        do_item_release(engine, new_it);
+/*
+ * Add what the worker found in its last slice to the totals, and hold it
+ * back for as long as it is ahead of scrub_rate (the rate is for all of
+ * the workers together). Returns false when we're shutting down.
+ */
+static bool item_scrub_account(struct default_engine *engine,
+                               const struct item_scrub_counts *counts) {
+    struct engine_scrubber *scrubber = &engine->scrubber;
+    bool ret;
+
+    cb_mutex_enter(&scrubber->lock);
+    scrubber->visited += counts->visited;
+    scrubber->cleaned += counts->cleaned;
+    while (engine->config.scrub_rate != 0 && !scrubber->shutdown) {
+        hrtime_t due = (hrtime_t)((double)scrubber->visited * 1000000000.0 /
+                                  (double)engine->config.scrub_rate);
+        hrtime_t elapsed = gethrtime() - scrubber->start_time;
+        hrtime_t ms;
+        if (due <= elapsed) {
+            break;
+        }
+        ms = (due - elapsed) / 1000000;
+        cb_cond_timedwait(&scrubber->cond, &scrubber->lock,
+                          (unsigned int)(ms == 0 ? 1 : ms));
     }
+    ret = !scrubber->shutdown;
+    cb_mutex_exit(&scrubber->lock);
+    return ret;
+}
 
-    if (stored == ENGINE_SUCCESS) {
-        *cas = item_get_cas(it);
+/* Walk all of the LRU segments of the slab class in slices of 200 items */
+static bool item_scrub_class(struct default_engine *engine,
+                             hash_item *cursor, unsigned int id) {
+    bool ret = true;
+    int lru;
+
+    for (lru = HOT_LRU; lru < NUM_LRU && ret; ++lru) {
+        bool more = true;
+        mc_mutex_enter(&engine->items.lock[id], &engine->lock_stats.lru);
+        if (engine->items.heads[id][lru] == NULL) {
+            more = false;
+        } else {
+            /* add the item at the tail */
+            do_item_link_cursor(engine, cursor, id, lru);
+        }
+        cb_mutex_exit(&engine->items.lock[id]);
+
+        while (more) {
+            struct item_scrub_counts counts = { 0, 0 };
+            more = item_walk_lru_slice(engine, cursor, 200, item_scrub,
+                                       &counts);
+            ret = item_scrub_account(engine, &counts);
+            more = more && ret;
+        }
+
+        /* The cursor lives on our stack, so make sure it's out of the list */
+        item_unlink_cursor(engine, cursor);
     }
 
-    return stored;
+    return ret;
 }
 
-
 /*
- * adds a delta value to a numeric item.
- *
- * c     connection requesting the operation
- * it    item to adjust
- * incr  true to increment value, false to decrement
- * delta amount to adjust value by
- * buf   buffer for response string
- *
- * returns a response string to send back to the client.
+ * A scrubber worker: take the next slab class nobody is at yet and walk
+ * it, until there are no more of them.
  */
-static ENGINE_ERROR_CODE do_add_delta(struct default_engine *engine,
-                                      hash_item *it, const bool incr,
-                                      const int64_t delta, uint64_t *rcas,
-                                      uint64_t *result, const void *cookie) {
-    const char *ptr;
-    uint64_t value;
-    char buf[80];
-    int res;
-
-    if (it->nbytes >= (sizeof(buf) - 1)) {
-        return ENGINE_EINVAL;
-    }
+static void item_scrubber_main(void *arg)
+{
+    struct default_engine *engine = arg;
+    struct engine_scrubber *scrubber = &engine->scrubber;
+    hash_item cursor;
 
-    ptr = item_get_data(it);
-    memcpy(buf, ptr, it->nbytes);
-    buf[it->nbytes] = '\0';
+    if (item_cursor_init(engine, &cursor)) {
+        bool more = true;
+        while (more) {
+            unsigned int id = 0;
+            cb_mutex_enter(&scrubber->lock);
+            if (scrubber->shutdown || scrubber->next_class >= POWER_LARGEST) {
+                more = false;
+            } else {
+                id = scrubber->next_class++;
+            }
+            cb_mutex_exit(&scrubber->lock);
 
-    if (!safe_strtoull(buf, &value)) {
-        return ENGINE_EINVAL;
+            if (more) {
+                more = item_scrub_class(engine, &cursor, id);
+            }
+        }
+        item_cursor_destroy(engine, &cursor);
     }
 
-    if (incr) {
-        value += delta;
-    } else {
-        if ((uint64_t)delta > value) {
-            value = 0;
-        } else {
-            value -= delta;
-        }
+    cb_mutex_enter(&scrubber->lock);
+    if (--scrubber->active == 0) {
+        scrubber->stopped = time(NULL);
+        scrubber->stop_time = gethrtime();
+        scrubber->running = false;
     }
+    cb_mutex_exit(&scrubber->lock);
+}
 
-    *result = value;
-    if ((res = snprintf(buf, sizeof(buf), "%" PRIu64, value)) == -1) {
-        return ENGINE_EINVAL;
+/* Wait for the workers of the last run to go away */
+static void item_scrubber_join(struct default_engine *engine)
+{
+    struct engine_scrubber *scrubber = &engine->scrubber;
+    size_t ii;
+
+    for (ii = 0; ii < scrubber->nthreads; ++ii) {
+        cb_join_thread(scrubber->tids[ii]);
     }
+    free(scrubber->tids);
+    scrubber->tids = NULL;
+    scrubber->nthreads = 0;
+}
 
-    if (it->refcount == 1 && res <= (int)it->nbytes) {
-        /* we can do inline replacement */
-        memcpy(item_get_data(it), buf, res);
-        memset(item_get_data(it) + res, ' ', it->nbytes - res);
-        item_set_cas(NULL, NULL, it, get_cas_id());
-        *rcas = item_get_cas(it);
-    } else {
-        hash_item *new_it = do_item_alloc(engine, item_get_key(it),
-                                          it->nkey, it->flags,
-                                          it->exptime, res,
-                                          cookie, it->datatype);
-        if (new_it == NULL) {
-            do_item_unlink(engine, it);
-            return ENGINE_ENOMEM;
+bool item_start_scrub(struct default_engine *engine)
+{
+    struct engine_scrubber *scrubber = &engine->scrubber;
+    bool ret = false;
+
+    cb_mutex_enter(&scrubber->lock);
+    if (!scrubber->running && !scrubber->shutdown) {
+        size_t nthreads = engine->config.scrub_threads;
+
+        /* They're done with the lock (and on their way out) */
+        item_scrubber_join(engine);
+
+        scrubber->tids = calloc(nthreads, sizeof(cb_thread_t));
+        if (scrubber->tids != NULL) {
+            mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+            scrubber->expected = engine->stats.curr_items;
+            cb_mutex_exit(&engine->stats.lock);
+
+            scrubber->started = time(NULL);
+            scrubber->stopped = 0;
+            scrubber->start_time = gethrtime();
+            scrubber->visited = 0;
+            scrubber->cleaned = 0;
+            scrubber->next_class = POWER_SMALLEST;
+            scrubber->active = 0;
+            scrubber->running = true;
+
+            /* The workers won't get anywhere until we let go of the lock */
+            while (scrubber->nthreads < nthreads &&
+                   cb_create_thread(&scrubber->tids[scrubber->nthreads],
+                                    item_scrubber_main, engine, 0) == 0) {
+                scrubber->nthreads++;
+                scrubber->active++;
+            }
+
+            if (scrubber->nthreads == 0) {
+                scrubber->running = false;
+                scrubber->stopped = scrubber->started;
+                scrubber->stop_time = scrubber->start_time;
+                free(scrubber->tids);
+                scrubber->tids = NULL;
+            } else {
+                ret = true;
+            }
         }
-        memcpy(item_get_data(new_it), buf, res);
-        do_item_replace(engine, it, new_it);
-        *rcas = item_get_cas(new_it);
-        do_item_release(engine, new_it);       /* release our reference */
     }
+    cb_mutex_exit(&scrubber->lock);
 
-    return ENGINE_SUCCESS;
+    return ret;
 }
 
-/********************************* ITEM ACCESS *******************************/
+void item_scrubber_stop(struct default_engine *engine)
+{
+    struct engine_scrubber *scrubber = &engine->scrubber;
 
-/*
- * Allocates a new item.
- */
-hash_item *item_alloc(struct default_engine *engine,
-                      const void *key, size_t nkey, int flags,
-                      rel_time_t exptime, int nbytes, const void *cookie,
-                      uint8_t datatype) {
-    hash_item *it;
-    cb_mutex_enter(&engine->cache_lock);
-    it = do_item_alloc(engine, key, nkey, flags, exptime, nbytes, cookie,
-                       datatype);
-    cb_mutex_exit(&engine->cache_lock);
-    return it;
+    cb_mutex_enter(&scrubber->lock);
+    scrubber->shutdown = true;
+    cb_cond_broadcast(&scrubber->cond);
+    cb_mutex_exit(&scrubber->lock);
+
+    /* Nobody starts a new run once shutdown is set */
+    item_scrubber_join(engine);
 }
 
-/*
- * Returns an item if it hasn't been marked as expired,
- * lazy-expiring as needed.
- */
-hash_item *item_get(struct default_engine *engine,
-                    const void *key, const size_t nkey) {
-    hash_item *it;
-    cb_mutex_enter(&engine->cache_lock);
-    it = do_item_get(engine, key, nkey);
-    cb_mutex_exit(&engine->cache_lock);
-    return it;
+/* The bucket of the age (or ttl) histogram for the number of seconds */
+static int item_age_bucket(rel_time_t secs) {
+    int bucket = 0;
+    while (secs != 0 && bucket < ITEM_AGE_BUCKETS - 1) {
+        secs >>= 1;
+        ++bucket;
+    }
+    return bucket;
 }
 
-/*
- * Decrements the reference count on an item and adds it to the freelist if
- * needed.
- */
-void item_release(struct default_engine *engine, hash_item *item) {
-    cb_mutex_enter(&engine->cache_lock);
-    do_item_release(engine, item);
-    cb_mutex_exit(&engine->cache_lock);
+static ENGINE_ERROR_CODE item_crawl(struct default_engine *engine,
+                                    hash_item *item,
+                                    uint32_t hv,
+                                    void *cookie) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    unsigned int clsid = item->slabs_clsid;
+    struct item_age_histogram *ages = cookie;
+
+    if (item->refcount == 0 &&
+        ((item->exptime != 0 && item->exptime < current_time) ||
+         item_is_flushed(engine, item, current_time) ||
+         ((item->iflag & ITEM_HDR) != 0 &&
+          !extstore_valid(engine, item_get_ext_loc(engine, item))))) {
+        do_item_unlink_nolock(engine, item, hv);
+        engine->items.itemstats[clsid].crawler_reclaimed++;
+    } else if (ages != NULL) {
+        ages = &ages[clsid];
+        ages->age[item_age_bucket(current_time - item->time)]++;
+        if (item->exptime == 0) {
+            ages->no_ttl++;
+        } else if (item->exptime > current_time) {
+            ages->ttl[item_age_bucket(item->exptime - current_time)]++;
+        } else {
+            ages->ttl[0]++;
+        }
+    }
+    return ENGINE_SUCCESS;
 }
 
+/* The number of items we look at per LRU lock grab */
+#define LRU_CRAWLER_SLICE 100
+
 /*
- * Unlinks an item from the LRU and hashtable.
+ * Walk all of the LRUs, a slice at a time, reclaiming the expired (and
+ * flushed) items so that their memory can be reused before we have to
+ * evict live items. Sleeps lru_crawler_sleep ms between the slices and
+ * lru_crawler_interval seconds between the runs.
  */
-void item_unlink(struct default_engine *engine, hash_item *item) {
-    cb_mutex_enter(&engine->cache_lock);
-    do_item_unlink(engine, item);
-    cb_mutex_exit(&engine->cache_lock);
-}
-
-static ENGINE_ERROR_CODE do_arithmetic(struct default_engine *engine,
-                                       const void* cookie,
-                                       const void* key,
-                                       const int nkey,
-                                       const bool increment,
-                                       const bool create,
-                                       const uint64_t delta,
-                                       const uint64_t initial,
-                                       const rel_time_t exptime,
-                                       uint64_t *cas,
-                                       uint8_t datatype,
-                                       uint64_t *result)
+static void item_lru_crawler_main(void *arg)
 {
-   hash_item *item = do_item_get(engine, key, nkey);
-   ENGINE_ERROR_CODE ret;
+    struct default_engine *engine = arg;
+    struct lru_crawler *crawler = &engine->lru_crawler;
+    hash_item cursor;
+    bool stop;
 
-   if (item == NULL) {
-      if (!create) {
-         return ENGINE_KEY_ENOENT;
-      } else {
-         char buffer[128];
-         int len = snprintf(buffer, sizeof(buffer), "%"PRIu64,
-                            (uint64_t)initial);
+    cb_mutex_enter(&crawler->lock);
+    if (!item_cursor_init(engine, &cursor)) {
+        crawler->running = false;
+        cb_mutex_exit(&crawler->lock);
+        return;
+    }
 
-         item = do_item_alloc(engine, key, nkey, 0, exptime, len, cookie,
-                              datatype);
-         if (item == NULL) {
-            return ENGINE_ENOMEM;
-         }
-         memcpy((void*)item_get_data(item), buffer, len);
-         if ((ret = do_store_item(engine, item, cas,
-                                  OPERATION_ADD, cookie)) == ENGINE_SUCCESS) {
-             *result = initial;
-             *cas = item_get_cas(item);
-         }
-         do_item_release(engine, item);
-      }
-   } else {
-      ret = do_add_delta(engine, item, increment, delta, cas, result, cookie);
-      do_item_release(engine, item);
-   }
+    while (!crawler->shutdown) {
+        cb_cond_timedwait(&crawler->cond, &crawler->lock,
+                          (unsigned int)engine->config.lru_crawler_interval * 1000);
+        if (crawler->shutdown) {
+            break;
+        }
 
-   return ret;
+        crawler->crawling = true;
+        crawler->starts++;
+        cb_mutex_exit(&crawler->lock);
+
+        stop = false;
+        /* (the CLOCK reclaims the expired tiny items) */
+        if (item_link_cursor_from(engine, &cursor, POWER_SMALLEST, HOT_LRU,
+                                  false)) {
+            bool more = true;
+            while (more) {
+                int lru;
+
+                more = item_walk_lru_slice(engine, &cursor, LRU_CRAWLER_SLICE,
+                                           item_crawl, crawler->next_ages);
+
+                cb_mutex_enter(&crawler->lock);
+                if (more && !crawler->shutdown &&
+                    engine->config.lru_crawler_sleep != 0) {
+                    cb_cond_timedwait(&crawler->cond, &crawler->lock,
+                                      (unsigned int)engine->config.lru_crawler_sleep);
+                }
+                stop = crawler->shutdown;
+                cb_mutex_exit(&crawler->lock);
+
+                if (!more || stop) {
+                    item_unlink_cursor(engine, &cursor);
+                    if (stop) {
+                        break;
+                    }
+                    /* On to the next segment (or class) */
+                    lru = item_lru(&cursor) + 1;
+                    more = item_link_cursor_from(engine, &cursor,
+                                                 cursor.slabs_clsid, lru,
+                                                 false);
+                }
+            }
+        }
+
+        cb_mutex_enter(&crawler->lock);
+        if (!stop && crawler->ages != NULL) {
+            /* The run saw all of the items, so it replaces the last one */
+            struct item_age_histogram *ages = crawler->ages;
+            crawler->ages = crawler->next_ages;
+            crawler->next_ages = ages;
+            crawler->ages_runs++;
+            memset(ages, 0, sizeof(*ages) * POWER_LARGEST);
+        }
+        crawler->crawling = false;
+    }
+    item_cursor_destroy(engine, &cursor);
+    crawler->running = false;
+    cb_mutex_exit(&crawler->lock);
 }
 
-ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
-                             const void* cookie,
-                             const void* key,
-                             const int nkey,
-                             const bool increment,
-                             const bool create,
-                             const uint64_t delta,
-                             const uint64_t initial,
-                             const rel_time_t exptime,
-                             uint64_t *cas,
-                             uint8_t datatype,
-                             uint64_t *result)
+bool item_lru_crawler_start(struct default_engine *engine)
 {
-    ENGINE_ERROR_CODE ret;
+    struct lru_crawler *crawler = &engine->lru_crawler;
+    bool ret = true;
+
+    cb_mutex_enter(&crawler->lock);
+    if (!crawler->running) {
+        if (crawler->ages == NULL) {
+            /* We don't need the histograms to crawl */
+            crawler->ages = calloc(POWER_LARGEST, sizeof(*crawler->ages));
+            crawler->next_ages = calloc(POWER_LARGEST,
+                                        sizeof(*crawler->next_ages));
+            if (crawler->ages == NULL || crawler->next_ages == NULL) {
+                free(crawler->ages);
+                free(crawler->next_ages);
+                crawler->ages = crawler->next_ages = NULL;
+            }
+        }
+        crawler->shutdown = false;
+        crawler->running = true;
+        if (cb_create_thread(&crawler->tid, item_lru_crawler_main,
+                             engine, 0) != 0) {
+            crawler->running = false;
+            ret = false;
+        }
+    }
+    cb_mutex_exit(&crawler->lock);
 
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_arithmetic(engine, cookie, key, nkey, increment,
-                        create, delta, initial, exptime, cas,
-                        datatype, result);
-    cb_mutex_exit(&engine->cache_lock);
     return ret;
 }
 
+void item_lru_crawler_stop(struct default_engine *engine)
+{
+    struct lru_crawler *crawler = &engine->lru_crawler;
+    bool running;
+
+    cb_mutex_enter(&crawler->lock);
+    running = crawler->running;
+    crawler->shutdown = true;
+    cb_cond_signal(&crawler->cond);
+    cb_mutex_exit(&crawler->lock);
+
+    if (running) {
+        cb_join_thread(crawler->tid);
+    }
+    free(crawler->ages);
+    free(crawler->next_ages);
+    crawler->ages = crawler->next_ages = NULL;
+}
+
 /*
- * Stores an item in the cache (high level, obeys set/add/replace semantics)
+ * Move the items of the slot of the level wheel.now has got to down to
+ * where they belong now. Caller must hold the wheel lock.
  */
-ENGINE_ERROR_CODE store_item(struct default_engine *engine,
-                             hash_item *item, uint64_t *cas,
-                             ENGINE_STORE_OPERATION operation,
-                             const void *cookie) {
-    ENGINE_ERROR_CODE ret;
+static void item_expiry_cascade(struct default_engine *engine, int level) {
+    struct expiry_wheel *wheel = &engine->expiry;
+    hash_item **head = &wheel->slots[level][(wheel->now >>
+        (EXPIRY_WHEEL_BITS * level)) & (EXPIRY_WHEEL_SLOTS - 1)];
+    hash_item *it = *head;
+
+    *head = NULL;
+    while (it != NULL) {
+        hash_item *next = item_deref(engine, item_get_expiry_links(it)->next);
+        item_expiry_link_q(engine, it);
+        it = next;
+    }
+}
 
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_store_item(engine, item, cas, operation, cookie);
-    cb_mutex_exit(&engine->cache_lock);
-    return ret;
+/*
+ * Unlink the items expiring at wheel.now, and move on to the next second.
+ * Caller must hold the wheel lock (which is dropped while unlinking).
+ */
+static void item_expiry_tick(struct default_engine *engine) {
+    struct expiry_wheel *wheel = &engine->expiry;
+    hash_item **head;
+    int level;
+
+    for (level = 1; level < EXPIRY_WHEEL_LEVELS; ++level) {
+        if ((wheel->now & (((rel_time_t)1 <<
+                            (EXPIRY_WHEEL_BITS * level)) - 1)) != 0) {
+            break;
+        }
+        item_expiry_cascade(engine, level);
+    }
+
+    head = &wheel->slots[0][wheel->now & (EXPIRY_WHEEL_SLOTS - 1)];
+    while (*head != NULL && !wheel->shutdown) {
+        hash_item *it = *head;
+        uint32_t hv = item_hash(engine, it);
+        cb_mutex_t *lock;
+
+        if (!item_trylock(engine, hv, NULL, &lock)) {
+            /* Whoever holds it may be waiting for the wheel lock */
+            cb_mutex_exit(&wheel->lock);
+#ifdef WIN32
+            Sleep(0);
+#else
+            usleep(10);
+#endif
+            cb_mutex_enter(&wheel->lock);
+            continue;
+        }
+        /* Nobody can move it out of the slot while we hold the item lock */
+        cb_mutex_exit(&wheel->lock);
+        if (engine->config.dcp) {
+            dcp_log_removal(engine, it, DCP_CHANGE_EXPIRATION);
+        }
+        do_item_unlink(engine, it, hv);
+        cb_mutex_exit(lock);
+        cb_mutex_enter(&wheel->lock);
+        wheel->reclaimed++;
+    }
+    if (!wheel->shutdown) {
+        wheel->now++;
+    }
 }
 
-static hash_item *do_touch_item(struct default_engine *engine,
-                                     const void *key,
-                                     uint16_t nkey,
-                                     uint32_t exptime)
-{
-   hash_item *item = do_item_get(engine, key, nkey);
-   if (item != NULL) {
-       item->exptime = exptime;
-   }
-   return item;
+static void item_expiry_main(void *arg) {
+    struct default_engine *engine = arg;
+    struct expiry_wheel *wheel = &engine->expiry;
+
+    cb_mutex_enter(&wheel->lock);
+    while (!wheel->shutdown) {
+        while (!wheel->shutdown &&
+               wheel->now <= engine->server.core->get_current_time()) {
+            item_expiry_tick(engine);
+        }
+        if (!wheel->shutdown) {
+            cb_cond_timedwait(&wheel->cond, &wheel->lock, 1000);
+        }
+    }
+    wheel->running = false;
+    cb_mutex_exit(&wheel->lock);
 }
 
-hash_item *touch_item(struct default_engine *engine,
-                           const void *key,
-                           uint16_t nkey,
-                           uint32_t exptime)
+bool item_expiry_start(struct default_engine *engine)
 {
-    hash_item *ret;
+    struct expiry_wheel *wheel = &engine->expiry;
+    bool ret = true;
+
+    cb_mutex_enter(&wheel->lock);
+    if (!wheel->running) {
+        wheel->shutdown = false;
+        wheel->running = true;
+        if (cb_create_thread(&wheel->tid, item_expiry_main, engine, 0) != 0) {
+            wheel->running = false;
+            ret = false;
+        }
+    }
+    cb_mutex_exit(&wheel->lock);
 
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_touch_item(engine, key, nkey, exptime);
-    cb_mutex_exit(&engine->cache_lock);
     return ret;
 }
 
-/*
- * Flushes expired items after a flush_all call
- */
-void item_flush_expired(struct default_engine *engine, time_t when) {
-    int i;
-    hash_item *iter, *next;
+void item_expiry_stop(struct default_engine *engine)
+{
+    struct expiry_wheel *wheel = &engine->expiry;
+    bool running;
 
-    cb_mutex_enter(&engine->cache_lock);
+    cb_mutex_enter(&wheel->lock);
+    running = wheel->running;
+    wheel->shutdown = true;
+    cb_cond_signal(&wheel->cond);
+    cb_mutex_exit(&wheel->lock);
 
-    if (when == 0) {
-        engine->config.oldest_live = engine->server.core->get_current_time() - 1;
-    } else {
-        engine->config.oldest_live = engine->server.core->realtime(when) - 1;
+    if (running) {
+        cb_join_thread(wheel->tid);
     }
+}
 
-    if (engine->config.oldest_live != 0) {
-        for (i = 0; i < POWER_LARGEST; i++) {
-            /*
-             * The LRU is sorted in decreasing time order, and an item's
-             * timestamp is never newer than its last access time, so we
-             * only need to walk back until we hit an item older than the
-             * oldest_live time.
-             * The oldest_live checking will auto-expire the remaining items.
-             */
-            for (iter = engine->items.heads[i]; iter != NULL; iter = next) {
-                if (iter->time >= engine->config.oldest_live) {
-                    next = iter->next;
-                    if ((iter->iflag & ITEM_SLABBED) == 0) {
-                        do_item_unlink(engine, iter);
-                    }
-                } else {
-                    /* We've hit the first old item. Continue to the next queue. */
-                    break;
+void item_stats_ages(struct default_engine *engine,
+                     ADD_STAT add_stat, const void *cookie)
+{
+    struct lru_crawler *crawler = &engine->lru_crawler;
+    int ii;
+
+    cb_mutex_enter(&crawler->lock);
+    if (crawler->ages != NULL && crawler->ages_runs != 0) {
+        for (ii = POWER_SMALLEST; ii < POWER_LARGEST; ++ii) {
+            const struct item_age_histogram *ages = &crawler->ages[ii];
+            char key[16];
+            int jj;
+
+            for (jj = 0; jj < ITEM_AGE_BUCKETS; ++jj) {
+                unsigned int secs = jj == 0 ? 0 : 1U << (jj - 1);
+                if (ages->age[jj] != 0) {
+                    snprintf(key, sizeof(key), "age_%u", secs);
+                    add_statistics(cookie, add_stat, "ages", ii, key, "%u",
+                                   ages->age[jj]);
+                }
+            }
+            for (jj = 0; jj < ITEM_AGE_BUCKETS; ++jj) {
+                unsigned int secs = jj == 0 ? 0 : 1U << (jj - 1);
+                if (ages->ttl[jj] != 0) {
+                    snprintf(key, sizeof(key), "ttl_%u", secs);
+                    add_statistics(cookie, add_stat, "ages", ii, key, "%u",
+                                   ages->ttl[jj]);
                 }
             }
+            if (ages->no_ttl != 0) {
+                add_statistics(cookie, add_stat, "ages", ii, "no_ttl", "%u",
+                               ages->no_ttl);
+            }
         }
     }
-    cb_mutex_exit(&engine->cache_lock);
+    add_statistics(cookie, add_stat, "ages", -1, "runs", "%"PRIu64,
+                   crawler->ages_runs);
+    cb_mutex_exit(&crawler->lock);
 }
 
 /*
- * Dumps part of the cache
+ * What we've found in the arena at restart (see item_restore). The items
+ * we keep are linked in again once we've been over all of the pages, and
+ * the chunks of the chunked items we drop are freed then.
  */
-char *item_cachedump(struct default_engine *engine,
-                     const unsigned int slabs_clsid,
-                     const unsigned int limit,
-                     unsigned int *bytes) {
-    char *ret;
+struct item_restore_list {
+    hash_item **items;
+    size_t count;
+    size_t size;
+};
 
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_item_cachedump(slabs_clsid, limit, bytes);
-    cb_mutex_exit(&engine->cache_lock);
-    return ret;
-}
+struct item_restore_state {
+    /* Add to a relative time of the last process to get ours */
+    int64_t shift;
+    rel_time_t current_time;
+    struct item_restore_list kept;
+    struct item_restore_list dropped;
+    bool oom;
+};
 
-void item_stats(struct default_engine *engine,
-                   ADD_STAT add_stat, const void *cookie)
-{
-    cb_mutex_enter(&engine->cache_lock);
-    do_item_stats(engine, add_stat, cookie);
-    cb_mutex_exit(&engine->cache_lock);
+static bool item_restore_push(struct item_restore_state *state,
+                              struct item_restore_list *list,
+                              hash_item *it) {
+    if (list->count == list->size) {
+        size_t size = list->size ? list->size * 2 : 1024;
+        hash_item **items = realloc(list->items, size * sizeof(*items));
+        if (items == NULL) {
+            state->oom = true;
+            return false;
+        }
+        list->items = items;
+        list->size = size;
+    }
+    list->items[list->count++] = it;
+    return true;
 }
 
+/* Is the item one we should keep (converting its times if it is)? */
+static bool item_restore_keep(struct default_engine *engine, hash_item *it,
+                              const struct item_restore_state *state) {
+    rel_time_t oldest_live = engine->slabs.restart.oldest_live;
+    int64_t time;
 
-void item_stats_sizes(struct default_engine *engine,
-                      ADD_STAT add_stat, const void *cookie)
-{
-    cb_mutex_enter(&engine->cache_lock);
-    do_item_stats_sizes(engine, add_stat, cookie);
-    cb_mutex_exit(&engine->cache_lock);
-}
+    if ((it->iflag & ITEM_LINKED) == 0 || (it->iflag & ITEM_HDR) != 0) {
+        /* The values of the headers were in the last process' extstore */
+        return false;
+    }
+    if (oldest_live != 0 &&
+        oldest_live <= engine->slabs.restart.current_time &&
+        (it->time <= oldest_live ||
+         item_get_cas(it) < engine->slabs.restart.oldest_cas)) {
+        return false;
+    }
+    if (it->exptime != 0) {
+        int64_t exptime = (int64_t)it->exptime + state->shift;
+        if (exptime <= (int64_t)state->current_time) {
+            return false;
+        }
+        it->exptime = (rel_time_t)exptime;
+    }
 
-static void do_item_link_cursor(struct default_engine *engine,
-                                hash_item *cursor, int ii)
-{
-    cursor->slabs_clsid = (uint8_t)ii;
-    cursor->next = NULL;
-    cursor->prev = engine->items.tails[ii];
-    engine->items.tails[ii]->next = cursor;
-    engine->items.tails[ii] = cursor;
-    engine->items.sizes[ii]++;
+    time = (int64_t)it->time + state->shift;
+    if (time < 0) {
+        time = 0;
+    } else if (time > (int64_t)state->current_time) {
+        time = state->current_time;
+    }
+    it->time = (rel_time_t)time;
+    return true;
 }
 
-typedef ENGINE_ERROR_CODE (*ITERFUNC)(struct default_engine *engine,
-                                      hash_item *item, void *cookie);
+static bool item_restore_chunk(struct default_engine *engine, void *ptr,
+                               unsigned int id, size_t *size, void *arg) {
+    struct item_restore_state *state = arg;
+    hash_item *it = ptr;
 
-static bool do_item_walk_cursor(struct default_engine *engine,
-                                hash_item *cursor,
-                                int steplength,
-                                ITERFUNC itemfunc,
-                                void* itemdata,
-                                ENGINE_ERROR_CODE *error)
-{
-    int ii = 0;
-    *error = ENGINE_SUCCESS;
+    if (it->slabs_clsid != id || (it->iflag & ITEM_SLABBED) != 0) {
+        return false;
+    }
 
-    while (cursor->prev != NULL && ii < steplength) {
-        /* Move cursor */
-        hash_item *ptr = cursor->prev;
-        bool done = false;
+#ifndef COMPACT_ITEMS
+    /* The references are pointers; move them along with the arena */
+    if (engine->slabs.restart.delta != 0) {
+        ptrdiff_t delta = engine->slabs.restart.delta;
+        if (it->iflag & ITEM_CHUNK) {
+            if (it->next != NULL) {
+                it->next = (hash_item*)((char*)it->next + delta);
+            }
+            it->h_next = (hash_item*)((char*)it->h_next + delta);
+        } else if (it->iflag & ITEM_CHUNKED) {
+            struct item_chunk_head *head = item_get_chunk_head(engine, it);
+            if (head->first != NULL) {
+                head->first = (hash_item*)((char*)head->first + delta);
+            }
+        }
+    }
+#endif
 
-        ++ii;
-        item_unlink_q(engine, cursor);
+    if (it->iflag & ITEM_CHUNK) {
+        /* Freed along with its item if we drop that */
+        *size = sizeof(hash_item) + it->nbytes;
+        return true;
+    }
 
-        if (ptr == engine->items.heads[cursor->slabs_clsid]) {
-            done = true;
-            cursor->prev = NULL;
-        } else {
-            cursor->next = ptr;
-            cursor->prev = ptr->prev;
-            cursor->prev->next = cursor;
-            ptr->prev = cursor;
+    *size = ITEM_ntotal(engine, it);
+    if (item_restore_keep(engine, it, state)) {
+        if (item_restore_push(state, &state->kept, it)) {
+            it->refcount = 0;
+            it->iflag &= ~(ITEM_LINKED | ITEM_ACTIVE);
+            if (!engine->config.lru_segmented) {
+                item_set_lru(it, HOT_LRU);
+            }
+            return true;
         }
+    } else if ((it->iflag & ITEM_CHUNKED) != 0 &&
+               item_restore_push(state, &state->dropped, it)) {
+        /* Hold on to it until we free its chunks */
+        return true;
+    }
+    it->slabs_clsid = 0;
+    it->iflag = ITEM_SLABBED;
+    return false;
+}
 
-        /* Ignore cursors */
-        if (ptr->nkey == 0 && ptr->nbytes == 0) {
-            --ii;
-        } else {
-            *error = itemfunc(engine, ptr, itemdata);
-            if (*error != ENGINE_SUCCESS) {
-                return false;
-            }
+static int item_restore_compare(const void *a, const void *b) {
+    const hash_item *x = *(const hash_item * const *)a;
+    const hash_item *y = *(const hash_item * const *)b;
+    if (x->time != y->time) {
+        return x->time < y->time ? -1 : 1;
+    }
+    return 0;
+}
+
+ENGINE_ERROR_CODE item_restore(struct default_engine *engine) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger;
+    struct item_restore_state state;
+    uint64_t cas_id = engine->slabs.restart.cas_id;
+    size_t ii;
+
+    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+
+    memset(&state, 0, sizeof(state));
+    state.current_time = engine->server.core->get_current_time();
+    state.shift = (int64_t)state.current_time -
+        (int64_t)engine->slabs.restart.current_time -
+        ((int64_t)engine->server.core->abstime(state.current_time) -
+         (int64_t)engine->slabs.restart.abstime);
+
+    slabs_restore(engine, item_restore_chunk, &state);
+
+    for (ii = 0; ii < state.dropped.count; ++ii) {
+        hash_item *it = state.dropped.items[ii];
+        unsigned int clsid = it->slabs_clsid;
+        size_t ntotal = ITEM_ntotal(engine, it);
+        item_free_chunks(engine, it);
+        it->slabs_clsid = 0;
+        it->iflag = ITEM_SLABBED;
+        slabs_free(engine, it, ntotal, clsid);
+    }
+    free(state.dropped.items);
+
+    if (state.oom) {
+        free(state.kept.items);
+        return ENGINE_ENOMEM;
+    }
+
+    /* Link them in oldest first, so that the LRUs end up in time order */
+    qsort(state.kept.items, state.kept.count, sizeof(*state.kept.items),
+          item_restore_compare);
+    for (ii = 0; ii < state.kept.count; ++ii) {
+        hash_item *it = state.kept.items[ii];
+        uint32_t hv = item_hash(engine, it);
+
+        if (item_get_cas(it) > cas_id) {
+            cas_id = item_get_cas(it);
         }
 
-        if (done) {
-            return false;
+        item_lock(engine, hv);
+        it->iflag |= ITEM_LINKED;
+        assoc_insert(engine, hv, it);
+        mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+        do_item_stats_linked(engine, it, true);
+        cb_mutex_exit(&engine->stats.lock);
+        mc_mutex_enter(&engine->items.lock[it->slabs_clsid],
+                       &engine->lock_stats.lru);
+        item_link_q(engine, it);
+        cb_mutex_exit(&engine->items.lock[it->slabs_clsid]);
+        do_item_vb_link(engine, it);
+        do_item_expiry_link(engine, it);
+        item_unlock(engine, hv);
+    }
+    engine->cas_id = cas_id;
+
+    logger->log(EXTENSION_LOG_INFO, NULL,
+                "Restored %lu items from %s\n",
+                (unsigned long)state.kept.count, engine->config.restart_file);
+    free(state.kept.items);
+    return ENGINE_SUCCESS;
+}
+
+/*
+ * Move items off the tail of segment lru of class id until it is down to
+ * limit items (or we've looked at search_items of them). Active items
+ * go to warm, the rest go to cold. The items in temp stay where they are
+ * (we only get rid of the dead ones). Caller must hold the LRU lock for
+ * id.
+ */
+static int do_item_lru_pull_tail(struct default_engine *engine,
+                                 unsigned int id, int lru,
+                                 unsigned int limit,
+                                 rel_time_t current_time) {
+    hash_item *search, *next;
+    int tries = search_items;
+    int moved = 0;
+
+    for (search = engine->items.tails[id][lru];
+         tries > 0 && search != NULL && engine->items.sizes[id][lru] > limit;
+         tries--, search = next) {
+        uint32_t hv;
+        cb_mutex_t *lock;
+
+        next = item_prev(engine, search);
+        if (search->nkey == 0 && search->nbytes == 0) {
+            /* cursor */
+            continue;
+        }
+        hv = item_hash(engine, search);
+        if (!item_trylock(engine, hv, NULL, &lock)) {
+            continue;
+        }
+        if (item_is_flushed(engine, search, current_time) ||
+            (search->exptime != 0 && search->exptime < current_time)) {
+            /* Don't bother moving dead items around */
+            if (search->refcount == 0) {
+                engine->items.itemstats[id].reclaimed++;
+                mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+                engine->stats.reclaimed++;
+                cb_mutex_exit(&engine->stats.lock);
+                do_item_unlink_nolock(engine, search, hv);
+            }
+        } else if (lru == TEMP_LRU) {
+            /* It stays until it expires */
+        } else if ((search->iflag & ITEM_ACTIVE) != 0) {
+            do_item_lru_move(engine, search, WARM_LRU, current_time);
+            ++moved;
+        } else {
+            do_item_lru_move(engine, search, COLD_LRU, current_time);
+            ++moved;
         }
+        cb_mutex_exit(lock);
     }
 
-    return (cursor->prev != NULL);
+    return moved;
 }
 
-static ENGINE_ERROR_CODE item_scrub(struct default_engine *engine,
-                                    hash_item *item,
-                                    void *cookie) {
+/*
+ * Keep the hot and warm segments of a slab class within their limits.
+ * Returns the number of items moved.
+ */
+static int item_lru_juggle(struct default_engine *engine, unsigned int id) {
     rel_time_t current_time = engine->server.core->get_current_time();
-    (void)cookie;
-    engine->scrubber.visited++;
-    if (item->refcount == 0 &&
-        (item->exptime != 0 && item->exptime < current_time)) {
-        do_item_unlink(engine, item);
-        engine->scrubber.cleaned++;
-    }
-    return ENGINE_SUCCESS;
+    unsigned int total;
+    int moved;
+
+    mc_mutex_enter(&engine->items.lock[id], &engine->lock_stats.lru);
+    total = item_lru_size(engine, id);
+    moved = do_item_lru_pull_tail(engine, id, HOT_LRU,
+                                  total * engine->config.hot_lru_pct / 100,
+                                  current_time);
+    moved += do_item_lru_pull_tail(engine, id, WARM_LRU,
+                                   total * engine->config.warm_lru_pct / 100,
+                                   current_time);
+    /* Reclaim the short lived items as they expire */
+    do_item_lru_pull_tail(engine, id, TEMP_LRU, 0, current_time);
+    cb_mutex_exit(&engine->items.lock[id]);
+
+    return moved;
 }
 
-static void item_scrub_class(struct default_engine *engine,
-                             hash_item *cursor) {
+/*
+ * Evict items off the tail of a full slab class until it has got
+ * free_chunk_reserve free chunks (capped at a page of them), so that the
+ * allocations find a free chunk instead of evicting one themselves. We
+ * pick the victims the way do_item_alloc does. Returns the number of
+ * items evicted.
+ */
+static int item_lru_pre_evict(struct default_engine *engine, unsigned int id) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    slabclass_t *p = &engine->slabs.slabclass[id];
+    unsigned int reserve = (unsigned int)engine->config.free_chunk_reserve;
+    unsigned int want;
+    hash_item *search, *next;
+    int tries = search_items;
+    int evicted = 0;
 
-    ENGINE_ERROR_CODE ret;
-    bool more;
-    do {
-        cb_mutex_enter(&engine->cache_lock);
-        more = do_item_walk_cursor(engine, cursor, 200, item_scrub, NULL, &ret);
-        cb_mutex_exit(&engine->cache_lock);
-        if (ret != ENGINE_SUCCESS) {
-            break;
+    if (reserve > p->perslab) {
+        reserve = p->perslab;
+    }
+    if (reserve == 0 || p->tiny || engine->config.evict_to_free == 0) {
+        return 0;
+    }
+    want = reserve - slabs_free_chunks(engine, id, reserve);
+    if (want == 0) {
+        return 0;
+    }
+
+    mc_mutex_enter(&engine->items.lock[id], &engine->lock_stats.lru);
+    if (engine->config.eviction_gdsf) {
+        while (evicted < (int)want &&
+               do_item_evict_sampled(engine, id, NULL, NULL,
+                                     current_time)) {
+            evicted++;
+        }
+    } else {
+        for (search = item_lru_last(engine, id);
+             tries > 0 && search != NULL && evicted < (int)want;
+             tries--, search = next) {
+            cb_mutex_t *lock;
+            uint32_t hv;
+
+            next = item_lru_prev(engine, search);
+            if (search->nkey == 0 && search->nbytes == 0) {
+                /* cursor */
+                continue;
+            }
+            hv = item_hash(engine, search);
+            if (!item_trylock(engine, hv, NULL, &lock)) {
+                continue;
+            }
+            if (search->refcount == 0 &&
+                (search->iflag & ITEM_ACTIVE) != 0 &&
+                engine->config.lru_segmented &&
+                item_lru(search) != TEMP_LRU &&
+                !item_is_flushed(engine, search, current_time)) {
+                /* It has been used since it was demoted; second chance */
+                do_item_lru_move(engine, search, WARM_LRU, current_time);
+            } else if (search->refcount == 0) {
+                do_item_evict(engine, search, hv, NULL, current_time);
+                evicted++;
+            }
+            if (lock != NULL) {
+                cb_mutex_exit(lock);
+            }
         }
-    } while (more);
+    }
+    engine->items.itemstats[id].evicted_ahead += evicted;
+    cb_mutex_exit(&engine->items.lock[id]);
+
+    return evicted;
 }
 
-static void item_scubber_main(void *arg)
+/* Don't sleep longer than this (in ms) between the runs */
+#define MAX_LRU_MAINTAINER_SLEEP 1000
+#define MIN_LRU_MAINTAINER_SLEEP 1
+
+static void item_lru_maintainer_main(void *arg)
 {
     struct default_engine *engine = arg;
-    hash_item cursor;
-    int ii;
-
-    memset(&cursor, 0, sizeof(cursor));
-    cursor.refcount = 1;
-    for (ii = 0; ii < POWER_LARGEST; ++ii) {
-        bool skip = false;
-        cb_mutex_enter(&engine->cache_lock);
-        if (engine->items.heads[ii] == NULL) {
-            skip = true;
+    struct lru_maintainer *maintainer = &engine->lru_maintainer;
+    unsigned int sleep_time = MAX_LRU_MAINTAINER_SLEEP;
+
+    cb_mutex_enter(&maintainer->lock);
+    while (!maintainer->shutdown) {
+        unsigned int ii;
+        int moved = 0;
+        int evicted = 0;
+
+        cb_mutex_exit(&maintainer->lock);
+        for (ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+            if (engine->config.lru_segmented) {
+                moved += item_lru_juggle(engine, ii);
+            }
+            if (extstore_enabled(engine)) {
+                moved += item_ext_flush(engine, ii);
+            }
+            if (engine->config.free_chunk_reserve > 0) {
+                evicted += item_lru_pre_evict(engine, ii);
+            }
+        }
+        cb_mutex_enter(&maintainer->lock);
+        maintainer->juggles += moved;
+        maintainer->evicted_ahead += evicted;
+        moved += evicted;
+
+        /* Back off while there is nothing to do */
+        if (moved == 0) {
+            if (sleep_time < MAX_LRU_MAINTAINER_SLEEP) {
+                sleep_time *= 2;
+                if (sleep_time > MAX_LRU_MAINTAINER_SLEEP) {
+                    sleep_time = MAX_LRU_MAINTAINER_SLEEP;
+                }
+            }
         } else {
-            /* add the item at the tail */
-            do_item_link_cursor(engine, &cursor, ii);
+            sleep_time = MIN_LRU_MAINTAINER_SLEEP;
         }
-        cb_mutex_exit(&engine->cache_lock);
 
-        if (!skip) {
-            item_scrub_class(engine, &cursor);
+        if (!maintainer->shutdown) {
+            cb_cond_timedwait(&maintainer->cond, &maintainer->lock,
+                              sleep_time);
         }
     }
-
-    cb_mutex_enter(&engine->scrubber.lock);
-    engine->scrubber.stopped = time(NULL);
-    engine->scrubber.running = false;
-    cb_mutex_exit(&engine->scrubber.lock);
+    maintainer->running = false;
+    cb_mutex_exit(&maintainer->lock);
 }
 
-bool item_start_scrub(struct default_engine *engine)
+bool item_lru_maintainer_start(struct default_engine *engine)
 {
-    bool ret = false;
-    cb_mutex_enter(&engine->scrubber.lock);
-    if (!engine->scrubber.running) {
-        cb_thread_t t;
-
-        engine->scrubber.started = time(NULL);
-        engine->scrubber.stopped = 0;
-        engine->scrubber.visited = 0;
-        engine->scrubber.cleaned = 0;
-        engine->scrubber.running = true;
-
-        if (cb_create_thread(&t, item_scubber_main, engine, 1) != 0)
-        {
-            engine->scrubber.running = false;
-        } else {
-            ret = true;
+    struct lru_maintainer *maintainer = &engine->lru_maintainer;
+    bool ret = true;
+
+    cb_mutex_enter(&maintainer->lock);
+    if (!maintainer->running) {
+        maintainer->shutdown = false;
+        maintainer->running = true;
+        if (cb_create_thread(&maintainer->tid, item_lru_maintainer_main,
+                             engine, 0) != 0) {
+            maintainer->running = false;
+            ret = false;
         }
     }
-    cb_mutex_exit(&engine->scrubber.lock);
+    cb_mutex_exit(&maintainer->lock);
 
     return ret;
 }
 
+void item_lru_maintainer_stop(struct default_engine *engine)
+{
+    struct lru_maintainer *maintainer = &engine->lru_maintainer;
+    bool running;
+
+    cb_mutex_enter(&maintainer->lock);
+    running = maintainer->running;
+    maintainer->shutdown = true;
+    cb_cond_signal(&maintainer->cond);
+    cb_mutex_exit(&maintainer->lock);
+
+    if (running) {
+        cb_join_thread(maintainer->tid);
+    }
+}
+
+/* The most items a tap walker takes from a list per lock acquisition */
+#define ITEM_TAP_BATCH 64
+
 struct tap_client {
+    /* On tap_connections.walkers */
+    struct tap_client *next;
     hash_item cursor;
-    hash_item *it;
+    /*
+     * The items we've taken off the list (with a reference held) and the
+     * next one to hand out
+     */
+    hash_item *batch[ITEM_TAP_BATCH];
+    int nbatch;
+    int current_item;
+    /*
+     * The vbuckets we walk in the vbucket index (NULL if we walk the
+     * LRUs), and the one the cursor is in
+     */
+    uint16_t *vbuckets;
+    uint16_t nvbuckets;
+    uint16_t current;
+    /* The progress (updated under tap_connections.lock once per batch) */
+    uint64_t sent;
+    uint64_t expected;
+    hrtime_t start_time;
+    hrtime_t stop_time;
+    bool done;
 };
 
 static ENGINE_ERROR_CODE item_tap_iterfunc(struct default_engine *engine,
                                     hash_item *item,
+                                    uint32_t hv,
                                     void *cookie) {
     struct tap_client *client = cookie;
-    client->it = item;
-    ++client->it->refcount;
+    cb_assert(client->nbatch < ITEM_TAP_BATCH);
+    client->batch[client->nbatch++] = item;
+    ++item->refcount;
     return ENGINE_SUCCESS;
 }
 
+/*
+ * Move the cursor to the tail of the next non-empty LRU (the next segment
+ * of the same class, or the next slab class). The caller must not hold
+ * any of the LRU locks.
+ */
+static bool item_link_cursor_next_lru(struct default_engine *engine,
+                                      hash_item *cursor)
+{
+    int ii = cursor->slabs_clsid;
+    int lru = item_lru(cursor);
+
+    if (cursor->iflag & ITEM_TINY) {
+        /* Done with the pages of the class, on to its LRUs */
+        return item_link_cursor_from(engine, cursor, ii, HOT_LRU, true);
+    }
+
+    /* Everything in front of the cursor may have been unlinked */
+    mc_mutex_enter(&engine->items.lock[ii], &engine->lock_stats.lru);
+    if (engine->items.heads[ii][lru] == cursor) {
+        item_unlink_q(engine, cursor);
+    }
+    cb_mutex_exit(&engine->items.lock[ii]);
+
+    if (++lru == NUM_LRU) {
+        lru = HOT_LRU;
+        ++ii;
+    }
+    return item_link_cursor_from(engine, cursor, ii, lru, true);
+}
+
+/*
+ * Move the cursor up to steplength items towards the head of its LRU
+ * (moving on to the next LRU when we reach the head) and call itemfunc
+ * for them. Returns false when there are no more items to visit.
+ */
+static bool item_walk_cursor_step(struct default_engine *engine,
+                                  hash_item *cursor,
+                                  int steplength,
+                                  ITERFUNC itemfunc,
+                                  void *itemdata)
+{
+    ENGINE_ERROR_CODE ret;
+    unsigned int clsid = cursor->slabs_clsid;
+    bool more;
+
+    mc_mutex_enter(&engine->items.lock[clsid], &engine->lock_stats.lru);
+    more = do_item_walk_cursor(engine, cursor, steplength, itemfunc,
+                               itemdata, &ret);
+    if (more && ret == ENGINE_EWOULDBLOCK) {
+        item_lru_backoff(engine, clsid);
+    }
+    cb_mutex_exit(&engine->items.lock[clsid]);
+
+    if (!more) {
+        /* find next LRU to look at.. */
+        return item_link_cursor_next_lru(engine, cursor);
+    }
+    return true;
+}
+
+/* Add to the batch of the client. Returns false when we've walked it all */
+static bool item_tap_step(struct default_engine *engine,
+                          struct tap_client *client)
+{
+    int room = ITEM_TAP_BATCH - client->nbatch;
+
+    if (client->vbuckets == NULL) {
+        return item_walk_cursor_step(engine, &client->cursor, room,
+                                     item_tap_iterfunc, client);
+    }
+
+    while (client->current < client->nvbuckets) {
+        if (item_vb_walk_step(engine, &client->cursor, room,
+                              item_tap_iterfunc, client)) {
+            return true;
+        }
+        item_vb_unlink_cursor(engine, &client->cursor);
+        if (++client->current < client->nvbuckets) {
+            item_vb_link_cursor(engine, &client->cursor,
+                                client->vbuckets[client->current]);
+        }
+    }
+    return false;
+}
+
 static tap_event_t do_item_tap_walker(struct default_engine *engine,
                                          const void *cookie, item **itm,
                                          void **es, uint16_t *nes, uint8_t *ttl,
                                          uint16_t *flags, uint32_t *seqno,
                                          uint16_t *vbucket)
 {
-    ENGINE_ERROR_CODE r;
     struct tap_client *client = engine->server.cookie->get_engine_specific(cookie);
     if (client == NULL) {
         return TAP_DISCONNECT;
@@ -1163,26 +4943,43 @@ static tap_event_t do_item_tap_walker(struct default_engine *engine,
     *seqno = 0;
     *flags = 0;
     *vbucket = 0;
-    client->it = NULL;
+    *itm = NULL;
+
+    while (*itm == NULL) {
+        hash_item *it;
+        if (client->current_item == client->nbatch) {
+            uint64_t sent = client->nbatch;
+            bool more = true;
+
+            /* Fill the next batch up (taking each list lock once) */
+            client->nbatch = client->current_item = 0;
+            while (client->nbatch < ITEM_TAP_BATCH &&
+                   (more = item_tap_step(engine, client))) {
+                continue;
+            }
 
-    do {
-        if (!do_item_walk_cursor(engine, &client->cursor, 1, item_tap_iterfunc, client, &r)) {
-            /* find next slab class to look at.. */
-            bool linked = false;
-            int ii;
-            for (ii = client->cursor.slabs_clsid + 1; ii < POWER_LARGEST && !linked;  ++ii) {
-                if (engine->items.heads[ii] != NULL) {
-                    /* add the item at the tail */
-                    do_item_link_cursor(engine, &client->cursor, ii);
-                    linked = true;
-                }
+            cb_mutex_enter(&engine->tap_connections.lock);
+            client->sent += sent;
+            if (!more && client->nbatch == 0) {
+                client->done = true;
+                client->stop_time = gethrtime();
             }
-            if (!linked) {
+            cb_mutex_exit(&engine->tap_connections.lock);
+            if (client->nbatch == 0) {
                 break;
             }
         }
-    } while (client->it == NULL);
-    *itm = client->it;
+
+        it = client->batch[client->current_item];
+        client->batch[client->current_item++] = NULL;
+        if ((it->iflag & ITEM_HDR) != 0) {
+            item_ext_take(engine, &it);
+        }
+        *itm = it;
+    }
+    if (*itm != NULL) {
+        *vbucket = item_get_vbucket(*itm);
+    }
 
     return (*itm == NULL) ? TAP_DISCONNECT : TAP_MUTATION;
 }
@@ -1193,132 +4990,659 @@ tap_event_t item_tap_walker(ENGINE_HANDLE* handle,
                             uint16_t *flags, uint32_t *seqno,
                             uint16_t *vbucket)
 {
-    tap_event_t ret;
     struct default_engine *engine = (struct default_engine*)handle;
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_item_tap_walker(engine, cookie, itm, es, nes, ttl, flags, seqno, vbucket);
-    cb_mutex_exit(&engine->cache_lock);
-
-    return ret;
+    return do_item_tap_walker(engine, cookie, itm, es, nes, ttl, flags,
+                              seqno, vbucket);
 }
 
 bool initialize_item_tap_walker(struct default_engine *engine,
-                                const void* cookie)
+                                const void* cookie, uint32_t flags,
+                                const void *userdata, size_t nuserdata)
 {
-    bool linked = false;
-    int ii;
     struct tap_client *client = calloc(1, sizeof(*client));
     if (client == NULL) {
         return false;
     }
-    client->cursor.refcount = 1;
 
-    /* Link the cursor! */
-    for (ii = 0; ii < POWER_LARGEST && !linked; ++ii) {
-        cb_mutex_enter(&engine->cache_lock);
-        if (engine->items.heads[ii] != NULL) {
-            /* add the item at the tail */
-            do_item_link_cursor(engine, &client->cursor, ii);
-            linked = true;
+    if ((flags & TAP_CONNECT_FLAG_LIST_VBUCKETS) != 0 &&
+        engine->config.vbucket_index) {
+        /* A count followed by the vbuckets (in network byte order) */
+        const char *ptr = userdata;
+        uint16_t nvbuckets = 0;
+        uint16_t ii;
+
+        if (nuserdata >= sizeof(nvbuckets)) {
+            memcpy(&nvbuckets, ptr, sizeof(nvbuckets));
+            nvbuckets = ntohs(nvbuckets);
         }
-        cb_mutex_exit(&engine->cache_lock);
+        if (nuserdata < sizeof(uint16_t) * (1 + (size_t)nvbuckets) ||
+            (client->vbuckets = calloc(nvbuckets + 1,
+                                       sizeof(uint16_t))) == NULL) {
+            free(client);
+            return false;
+        }
+        for (ii = 0; ii < nvbuckets; ++ii) {
+            memcpy(&client->vbuckets[ii], ptr + sizeof(uint16_t) * (ii + 1),
+                   sizeof(uint16_t));
+            client->vbuckets[ii] = ntohs(client->vbuckets[ii]);
+        }
+        client->nvbuckets = nvbuckets;
+    }
+
+    if (!item_cursor_init(engine, &client->cursor)) {
+        free(client->vbuckets);
+        free(client);
+        return false;
+    }
+
+    /* Link the cursor! */
+    if (client->vbuckets == NULL) {
+        item_link_cursor_from(engine, &client->cursor, 0, HOT_LRU, true);
+    } else if (client->nvbuckets != 0) {
+        item_vb_link_cursor(engine, &client->cursor, client->vbuckets[0]);
     }
 
+    /* Only an estimate of what we'll walk (with a vbucket list too) */
+    cb_mutex_enter(&engine->stats.lock);
+    client->expected = engine->stats.curr_items;
+    cb_mutex_exit(&engine->stats.lock);
+    client->start_time = gethrtime();
+
+    cb_mutex_enter(&engine->tap_connections.lock);
+    client->next = engine->tap_connections.walkers;
+    engine->tap_connections.walkers = client;
+    cb_mutex_exit(&engine->tap_connections.lock);
+
     engine->server.cookie->store_engine_specific(cookie, client);
     return true;
 }
 
-void link_dcp_walker(struct default_engine *engine,
-                     struct dcp_connection *connection)
+void destroy_item_tap_walker(struct default_engine *engine,
+                             const void* cookie)
 {
-    bool linked = false;
-    int ii;
-    connection->cursor.refcount = 1;
+    struct tap_client *client = engine->server.cookie->get_engine_specific(cookie);
+    if (client != NULL) {
+        struct tap_client **pp = &engine->tap_connections.walkers;
+        int ii;
 
-    /* Link the cursor! */
-    for (ii = 0; ii < POWER_LARGEST && !linked; ++ii) {
-        cb_mutex_enter(&engine->cache_lock);
-        if (engine->items.heads[ii] != NULL) {
-            /* add the item at the tail */
-            do_item_link_cursor(engine, &connection->cursor, ii);
-            linked = true;
+        while (*pp != client) {
+            pp = &(*pp)->next;
+        }
+        *pp = client->next;
+        engine->tap_connections.items_sent += client->sent +
+            client->current_item;
+        engine->tap_connections.backfills++;
+
+        for (ii = client->current_item; ii < client->nbatch; ++ii) {
+            item_release(engine, client->batch[ii]);
+        }
+        if (client->vbuckets == NULL) {
+            item_cursor_destroy(engine, &client->cursor);
+        } else {
+            item_vb_unlink_cursor(engine, &client->cursor);
+            item_cursor_release(engine, &client->cursor);
+            free(client->vbuckets);
+        }
+        free(client);
+    }
+}
+
+void item_tap_stats(struct default_engine *engine, ADD_STAT add_stats,
+                    const void *c)
+{
+    struct tap_connections *tap = &engine->tap_connections;
+    struct tap_client *client;
+    uint64_t sent;
+    unsigned int nwalkers = 0;
+    hrtime_t now = gethrtime();
+
+    cb_mutex_enter(&tap->lock);
+    sent = tap->items_sent;
+    for (client = tap->walkers; client != NULL; client = client->next) {
+        uint64_t percent = 100;
+        uint64_t rate = 0;
+        hrtime_t elapsed = (client->done ? client->stop_time : now) -
+            client->start_time;
+
+        /* The items may come and go while we walk, so this is an estimate */
+        if (!client->done && client->expected != 0) {
+            percent = client->sent * 100 / client->expected;
+            if (percent > 99) {
+                percent = 99;
+            }
+        }
+        if (elapsed != 0) {
+            rate = (uint64_t)((double)client->sent * 1000000000.0 /
+                              (double)elapsed);
         }
-        cb_mutex_exit(&engine->cache_lock);
+        add_statistics(c, add_stats, "tap", nwalkers, "sent", "%"PRIu64,
+                       client->sent);
+        add_statistics(c, add_stats, "tap", nwalkers, "percent", "%"PRIu64,
+                       percent);
+        add_statistics(c, add_stats, "tap", nwalkers, "items_per_second",
+                       "%"PRIu64, rate);
+        sent += client->sent;
+        ++nwalkers;
     }
+    add_statistics(c, add_stats, NULL, -1, "tap_backfills", "%u", nwalkers);
+    add_statistics(c, add_stats, NULL, -1, "tap_backfills_done", "%"PRIu64,
+                   tap->backfills);
+    add_statistics(c, add_stats, NULL, -1, "tap_backfill_items_sent",
+                   "%"PRIu64, sent);
+    cb_mutex_exit(&tap->lock);
 }
 
-static ENGINE_ERROR_CODE item_dcp_iterfunc(struct default_engine *engine,
-                                           hash_item *item,
-                                           void *cookie) {
-    struct dcp_connection *connection = cookie;
-    connection->it = item;
-    ++connection->it->refcount;
+ENGINE_ERROR_CODE item_backfill_start(struct default_engine *engine,
+                                      hash_item *cursor, uint16_t vbucket)
+{
+    if (!item_cursor_init(engine, cursor)) {
+        return ENGINE_ENOMEM;
+    }
+    if (engine->config.vbucket_index) {
+        if (!item_vb_link_cursor(engine, cursor, vbucket)) {
+            item_cursor_release(engine, cursor);
+            return ENGINE_KEY_ENOENT;
+        }
+        return ENGINE_SUCCESS;
+    }
+    if (!item_link_cursor_from(engine, cursor, 0, HOT_LRU, true)) {
+        item_cursor_destroy(engine, cursor);
+        return ENGINE_KEY_ENOENT;
+    }
     return ENGINE_SUCCESS;
 }
 
-static ENGINE_ERROR_CODE do_item_dcp_step(struct default_engine *engine,
-                                          struct dcp_connection *connection,
-                                          const void *cookie,
-                                          struct dcp_message_producers *producers)
+struct item_backfill {
+    bool (*filter)(const hash_item *it, void *arg);
+    void *arg;
+    hash_item *it;
+};
+
+static ENGINE_ERROR_CODE item_backfill_iterfunc(struct default_engine *engine,
+                                                hash_item *item,
+                                                uint32_t hv,
+                                                void *cookie) {
+    struct item_backfill *backfill = cookie;
+    if (backfill->filter(item, backfill->arg)) {
+        backfill->it = item;
+        ++item->refcount;
+        DEBUG_REFCNT(item, '+');
+    }
+    return ENGINE_SUCCESS;
+}
+
+hash_item *item_backfill_next(struct default_engine *engine,
+                              hash_item *cursor,
+                              bool (*filter)(const hash_item *it, void *arg),
+                              void *arg)
 {
-    ENGINE_ERROR_CODE ret = ENGINE_DISCONNECT;
-
-    while (connection->it == NULL) {
-        if (!do_item_walk_cursor(engine, &connection->cursor, 1,
-                                 item_dcp_iterfunc, connection, &ret)) {
-            /* find next slab class to look at.. */
-            bool linked = false;
-            int ii;
-            for (ii = connection->cursor.slabs_clsid + 1; ii < POWER_LARGEST && !linked;  ++ii) {
-                if (engine->items.heads[ii] != NULL) {
-                    /* add the item at the tail */
-                    do_item_link_cursor(engine, &connection->cursor, ii);
-                    linked = true;
-                }
-            }
-            if (!linked) {
-                break;
-            }
+    struct item_backfill backfill;
+    backfill.filter = filter;
+    backfill.arg = arg;
+    backfill.it = NULL;
+
+    while (backfill.it == NULL &&
+           (engine->config.vbucket_index ?
+            item_vb_walk_step(engine, cursor, 1, item_backfill_iterfunc,
+                              &backfill) :
+            item_walk_cursor_step(engine, cursor, 1, item_backfill_iterfunc,
+                                  &backfill))) {
+        if (backfill.it != NULL && (backfill.it->iflag & ITEM_HDR) != 0) {
+            item_ext_take(engine, &backfill.it);
         }
     }
+    return backfill.it;
+}
 
-    if (connection->it != NULL) {
-        rel_time_t current_time = engine->server.core->get_current_time();
-        rel_time_t exptime = connection->it->exptime;
+void item_backfill_stop(struct default_engine *engine, hash_item *cursor)
+{
+    if (engine->config.vbucket_index) {
+        item_vb_unlink_cursor(engine, cursor);
+        item_cursor_release(engine, cursor);
+    } else {
+        item_cursor_destroy(engine, cursor);
+    }
+}
 
-        if (exptime != 0 && exptime < current_time) {
-            ret = producers->expiration(cookie, connection->opaque,
-                                        item_get_key(connection->it),
-                                        connection->it->nkey,
-                                        item_get_cas(connection->it),
-                                        0, 0, 0, NULL, 0);
-            if (ret == ENGINE_SUCCESS) {
-                do_item_unlink(engine, connection->it);
-                do_item_release(engine, connection->it);
-            }
-        } else {
-            ret = producers->mutation(cookie, connection->opaque,
-                                      connection->it, 0, 0, 0, 0, NULL, 0, 0);
+ENGINE_ERROR_CODE item_snapshot_start(struct default_engine *engine,
+                                      hash_item *cursor)
+{
+    if (!item_cursor_init(engine, cursor)) {
+        return ENGINE_ENOMEM;
+    }
+    if (!item_link_cursor_from(engine, cursor, 0, HOT_LRU, true)) {
+        item_cursor_destroy(engine, cursor);
+        return ENGINE_KEY_ENOENT;
+    }
+    return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE item_snapshot_iterfunc(struct default_engine *engine,
+                                                hash_item *item,
+                                                uint32_t hv,
+                                                void *cookie) {
+    hash_item **found = cookie;
+    rel_time_t current_time = engine->server.core->get_current_time();
+
+    if (!item_is_flushed(engine, item, current_time) &&
+        (item->exptime == 0 || item->exptime > current_time)) {
+        *found = item;
+        ++item->refcount;
+        DEBUG_REFCNT(item, '+');
+    }
+    return ENGINE_SUCCESS;
+}
+
+hash_item *item_snapshot_next(struct default_engine *engine,
+                              hash_item *cursor)
+{
+    hash_item *it = NULL;
+
+    while (it == NULL &&
+           item_walk_cursor_step(engine, cursor, 1, item_snapshot_iterfunc,
+                                 &it)) {
+        if (it != NULL && (it->iflag & ITEM_HDR) != 0) {
+            item_ext_take(engine, &it);
+        }
+    }
+    return it;
+}
+
+void item_snapshot_stop(struct default_engine *engine, hash_item *cursor)
+{
+    item_cursor_destroy(engine, cursor);
+}
+
+ENGINE_ERROR_CODE item_vbucket_index_init(struct default_engine *engine)
+{
+    int ii;
+
+    engine->vbucket_index.lists = calloc(NUM_VBUCKETS,
+                                         sizeof(struct vbucket_items));
+    engine->vbucket_index.nlocks = (unsigned int)engine->config.vbucket_locks;
+    engine->vbucket_index.locks = calloc(engine->vbucket_index.nlocks,
+                                         sizeof(cb_mutex_t));
+    if (engine->vbucket_index.lists == NULL ||
+        engine->vbucket_index.locks == NULL) {
+        free(engine->vbucket_index.lists);
+        free(engine->vbucket_index.locks);
+        engine->vbucket_index.lists = NULL;
+        engine->vbucket_index.locks = NULL;
+        return ENGINE_ENOMEM;
+    }
+    for (ii = 0; ii < (int)engine->vbucket_index.nlocks; ++ii) {
+        cb_mutex_initialize(&engine->vbucket_index.locks[ii]);
+    }
+    return ENGINE_SUCCESS;
+}
+
+void item_vbucket_index_destroy(struct default_engine *engine)
+{
+    int ii;
+
+    if (engine->vbucket_index.lists == NULL) {
+        return;
+    }
+    for (ii = 0; ii < (int)engine->vbucket_index.nlocks; ++ii) {
+        cb_mutex_destroy(&engine->vbucket_index.locks[ii]);
+    }
+    free(engine->vbucket_index.locks);
+    free(engine->vbucket_index.lists);
+    engine->vbucket_index.locks = NULL;
+    engine->vbucket_index.lists = NULL;
+}
+
+uint64_t item_vbucket_delete(struct default_engine *engine, uint16_t vbucket)
+{
+    struct vbucket_items *list = &engine->vbucket_index.lists[vbucket];
+    cb_mutex_t *vblock = item_vb_lock(engine, vbucket);
+    uint64_t ret = 0;
+    uint64_t max;
+
+    mc_mutex_enter(vblock, &engine->lock_stats.vbuckets);
+    max = list->items;
+    while (ret < max) {
+        hash_item *it = list->head;
+        cb_mutex_t *lock;
+        uint32_t hv;
+
+        while (it != NULL && it->nkey == 0 && it->nbytes == 0) {
+            /* cursor */
+            it = item_deref(engine, item_vb_links(it)->next);
+        }
+        if (it == NULL) {
+            break;
         }
 
-        if (ret == ENGINE_SUCCESS) {
-            connection->it = NULL;
+        hv = item_hash(engine, it);
+        if (!item_trylock(engine, hv, NULL, &lock)) {
+            cb_mutex_exit(vblock);
+#ifdef WIN32
+            Sleep(0);
+#else
+            usleep(10);
+#endif
+            mc_mutex_enter(vblock, &engine->lock_stats.vbuckets);
+            continue;
         }
-    } else {
-        return ENGINE_DISCONNECT;
+
+        /* It stays linked for as long as we hold the item lock */
+        cb_mutex_exit(vblock);
+        do_item_unlink(engine, it, hv);
+        cb_mutex_exit(lock);
+        ++ret;
+        mc_mutex_enter(vblock, &engine->lock_stats.vbuckets);
     }
+    cb_mutex_exit(vblock);
 
     return ret;
 }
 
-ENGINE_ERROR_CODE item_dcp_step(struct default_engine *engine,
-                                struct dcp_connection *connection,
-                                const void *cookie,
-                                struct dcp_message_producers *producers)
+void item_vbucket_stats(struct default_engine *engine, ADD_STAT add_stats,
+                        const void *c)
 {
-    ENGINE_ERROR_CODE ret;
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_item_dcp_step(engine, connection, cookie, producers);
-    cb_mutex_exit(&engine->cache_lock);
+    int ii;
+
+    for (ii = 0; ii < NUM_VBUCKETS; ++ii) {
+        struct vbucket_items *list = &engine->vbucket_index.lists[ii];
+        uint64_t items, bytes;
+
+        mc_mutex_enter(item_vb_lock(engine, (uint16_t)ii),
+                       &engine->lock_stats.vbuckets);
+        items = list->items;
+        bytes = list->bytes;
+        cb_mutex_exit(item_vb_lock(engine, (uint16_t)ii));
+
+        if (items != 0) {
+            add_statistics(c, add_stats, "vb", ii, "items", "%"PRIu64,
+                           items);
+            add_statistics(c, add_stats, "vb", ii, "bytes", "%"PRIu64,
+                           bytes);
+        }
+    }
+}
+
+/* xorshift32 */
+static uint32_t item_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/* Take a reference to the item unless it is dead. Caller must hold the
+ * item lock */
+static hash_item *do_item_sample_ref(struct default_engine *engine,
+                                     hash_item *it,
+                                     rel_time_t current_time) {
+    if (it == NULL || item_is_flushed(engine, it, current_time) ||
+        (it->exptime != 0 && it->exptime <= current_time)) {
+        return NULL;
+    }
+    it->refcount++;
+    DEBUG_REFCNT(it, '+');
+    return it;
+}
+
+static hash_item *item_sample_one(struct default_engine *engine,
+                                  uint32_t *state,
+                                  rel_time_t current_time) {
+    hash_item *it;
+    uint32_t hash = 0;
+    uint32_t nbuckets;
+    uint32_t ii;
+
+    for (ii = 0; ii < SAMPLE_PROBES; ++ii) {
+        hash = item_random(state);
+        item_lock(engine, hash);
+        it = do_item_sample_ref(engine,
+                                assoc_random(engine, hash,
+                                             item_random(state)),
+                                current_time);
+        item_unlock(engine, hash);
+        if (it != NULL) {
+            return it;
+        }
+    }
+
+    item_lock(engine, hash);
+    nbuckets = assoc_buckets(engine);
+    item_unlock(engine, hash);
+    for (ii = 1; ii < nbuckets; ++ii) {
+        uint32_t bucket = (hash + ii) & (nbuckets - 1);
+        item_lock(engine, bucket);
+        it = do_item_sample_ref(engine,
+                                assoc_random(engine, bucket,
+                                             item_random(state)),
+                                current_time);
+        item_unlock(engine, bucket);
+        if (it != NULL) {
+            return it;
+        }
+    }
+    return NULL;
+}
+
+int item_sample(struct default_engine *engine, hash_item **items,
+                int nitems)
+{
+    rel_time_t current_time = engine->server.core->get_current_time();
+    /* Threads sampling at the same time shouldn't pick the same items */
+    uint32_t state = engine->items.sample_state ^ (uint32_t)gethrtime();
+    int found = 0;
+
+    if (state == 0) {
+        /* xorshift never leaves 0 */
+        state = 1;
+    }
+    while (found < nitems && engine->assoc.hash_items != 0) {
+        hash_item *it = item_sample_one(engine, &state, current_time);
+        if (it == NULL) {
+            break;
+        }
+        items[found++] = it;
+    }
+    engine->items.sample_state = state;
+    return found;
+}
+
+ENGINE_ERROR_CODE item_namespace_init(struct default_engine *engine)
+{
+    size_t nslots = engine->config.namespace_slots;
+
+    engine->namespaces.slots = calloc(nslots, sizeof(struct namespace_slot));
+    if (engine->namespaces.slots == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    engine->namespaces.mask = nslots - 1;
+    cb_mutex_initialize(&engine->namespaces.lock);
+    return ENGINE_SUCCESS;
+}
+
+void item_namespace_destroy(struct default_engine *engine)
+{
+    size_t ii;
+
+    if (engine->namespaces.slots == NULL) {
+        return;
+    }
+    for (ii = 0; ii <= engine->namespaces.mask; ++ii) {
+        free(engine->namespaces.slots[ii].name);
+    }
+    cb_mutex_destroy(&engine->namespaces.lock);
+    free(engine->namespaces.slots);
+    engine->namespaces.slots = NULL;
+}
+
+/*
+ * The items don't carry the generation of their namespace: a new one
+ * takes a CAS, and the items linked before it (with a lower CAS) are
+ * dead, just like with flush_all. They are misses from now on and get
+ * reclaimed by the allocator, the LRU maintainer and the crawler as they
+ * come across them.
+ */
+ENGINE_ERROR_CODE item_namespace_invalidate(struct default_engine *engine,
+                                            const void *name, size_t nname,
+                                            uint64_t *generation)
+{
+    uint32_t hash = item_namespace_hash(engine, name, nname);
+    struct namespace_slot *slot = NULL;
+    size_t ii;
+
+    cb_mutex_enter(&engine->namespaces.lock);
+    for (ii = 0; ii < NAMESPACE_PROBES; ++ii) {
+        slot = &engine->namespaces.slots[(hash + ii) & engine->namespaces.mask];
+        if (slot->hash == 0 ||
+            (slot->hash == hash && slot->nname == nname &&
+             memcmp(slot->name, name, nname) == 0)) {
+            break;
+        }
+    }
+    if (ii == NAMESPACE_PROBES) {
+        cb_mutex_exit(&engine->namespaces.lock);
+        return ENGINE_ENOMEM;
+    }
+
+    if (slot->hash == 0) {
+        slot->name = malloc(nname);
+        if (slot->name == NULL) {
+            cb_mutex_exit(&engine->namespaces.lock);
+            return ENGINE_ENOMEM;
+        }
+        memcpy(slot->name, name, nname);
+        slot->nname = nname;
+    }
+    slot->oldest_cas = get_cas_id(engine);
+    *generation = ++slot->generation;
+    if (slot->hash == 0) {
+        /* The lookups may see the hash as soon as it is set */
+        item_barrier();
+        slot->hash = hash;
+        engine->namespaces.used++;
+    }
+    engine->namespaces.invalidations++;
+    cb_mutex_exit(&engine->namespaces.lock);
+    return ENGINE_SUCCESS;
+}
+
+/* The items "stats key_prefixes" looks at, and the prefixes it lists */
+#define KEY_PREFIX_SAMPLES 1000
+#define KEY_PREFIX_TOP 10
+
+/* The prefix of a sampled key (up to and including its last delimiter) */
+struct key_prefix {
+    const char *name;
+    size_t nname;
+    unsigned int count;
+};
+
+static int key_prefix_compare(const void *a, const void *b) {
+    const struct key_prefix *pa = a;
+    const struct key_prefix *pb = b;
+    size_t n = pa->nname < pb->nname ? pa->nname : pb->nname;
+    int ret = memcmp(pa->name, pb->name, n);
+    if (ret == 0) {
+        ret = (pa->nname > pb->nname) - (pa->nname < pb->nname);
+    }
     return ret;
 }
+
+/* The most frequent first */
+static int key_prefix_count_compare(const void *a, const void *b) {
+    const struct key_prefix *pa = a;
+    const struct key_prefix *pb = b;
+    return (pa->count < pb->count) - (pa->count > pb->count);
+}
+
+void item_key_prefix_stats(struct default_engine *engine,
+                           ADD_STAT add_stat, const void *cookie)
+{
+    char delimiter = engine->config.namespace_delimiter != NULL ?
+        engine->config.namespace_delimiter[0] : ':';
+    hash_item **items = malloc(KEY_PREFIX_SAMPLES * sizeof(*items));
+    struct key_prefix *prefixes = malloc(KEY_PREFIX_SAMPLES * sizeof(*prefixes));
+    uint64_t item_bytes = 0, key_bytes = 0, prefix_bytes = 0, saveable = 0;
+    uint64_t curr_items;
+    int found, nprefixes = 0, ndistinct = 0, ii;
+    char val[64];
+    int len;
+
+    if (items == NULL || prefixes == NULL) {
+        free(items);
+        free(prefixes);
+        return;
+    }
+
+    found = item_sample(engine, items, KEY_PREFIX_SAMPLES);
+    for (ii = 0; ii < found; ++ii) {
+        const char *key = item_get_key(items[ii]);
+        size_t nkey = items[ii]->nkey;
+        size_t nname = nkey;
+
+        item_bytes += item_total_size(engine, items[ii]);
+        key_bytes += nkey;
+        while (nname > 0 && key[nname - 1] != delimiter) {
+            --nname;
+        }
+        if (nname != 0) {
+            prefixes[nprefixes].name = key;
+            prefixes[nprefixes].nname = nname;
+            prefixes[nprefixes].count = 1;
+            ++nprefixes;
+            prefix_bytes += nname;
+        }
+    }
+
+    /* Count the ones with the same prefix (keeping the first of them) */
+    qsort(prefixes, nprefixes, sizeof(*prefixes), key_prefix_compare);
+    for (ii = 0; ii < nprefixes; ++ii) {
+        if (ndistinct > 0 &&
+            key_prefix_compare(&prefixes[ndistinct - 1], &prefixes[ii]) == 0) {
+            prefixes[ndistinct - 1].count++;
+        } else {
+            prefixes[ndistinct++] = prefixes[ii];
+        }
+    }
+    qsort(prefixes, ndistinct, sizeof(*prefixes), key_prefix_count_compare);
+
+    /*
+     * What we'd save if each of the prefixes seen more than once was
+     * stored once, and the items referred to it by a byte
+     */
+    for (ii = 0; ii < ndistinct; ++ii) {
+        if (prefixes[ii].count > 1) {
+            saveable += (uint64_t)prefixes[ii].count * (prefixes[ii].nname - 1);
+        }
+    }
+    mc_mutex_enter(&engine->stats.lock, &engine->lock_stats.stats);
+    curr_items = engine->stats.curr_items;
+    cb_mutex_exit(&engine->stats.lock);
+
+    len = snprintf(val, sizeof(val), "%d", found);
+    add_stat("key_prefixes_sampled", 20, val, len, cookie);
+    len = snprintf(val, sizeof(val), "%d", ndistinct);
+    add_stat("key_prefixes_distinct", 21, val, len, cookie);
+    len = snprintf(val, sizeof(val), "%.1f", item_bytes == 0 ? 0.0 :
+                   100.0 * (double)key_bytes / (double)item_bytes);
+    add_stat("key_prefixes_key_bytes_pct", 26, val, len, cookie);
+    len = snprintf(val, sizeof(val), "%.1f", key_bytes == 0 ? 0.0 :
+                   100.0 * (double)prefix_bytes / (double)key_bytes);
+    add_stat("key_prefixes_prefix_bytes_pct", 29, val, len, cookie);
+    len = snprintf(val, sizeof(val), "%"PRIu64, found == 0 ? 0 :
+                   saveable * curr_items / (uint64_t)found);
+    add_stat("key_prefixes_saveable_bytes", 27, val, len, cookie);
+    for (ii = 0; ii < ndistinct && ii < KEY_PREFIX_TOP; ++ii) {
+        add_statistics(cookie, add_stat, "key_prefix", ii, "name", "%.*s",
+                       (int)prefixes[ii].nname, prefixes[ii].name);
+        add_statistics(cookie, add_stat, "key_prefix", ii, "sampled", "%u",
+                       prefixes[ii].count);
+    }
+
+    for (ii = 0; ii < found; ++ii) {
+        item_release(engine, items[ii]);
+    }
+    free(prefixes);
+    free(items);
+}
@@ -5,10 +5,28 @@
  * You should not try to aquire any of the item locks before calling these
  * functions.
  */
+#ifdef COMPACT_ITEMS
+/*
+ * With the compact item layout the LRU and hash chain links are 32 bit
+ * references instead of pointers: (offset in the slab arena divided by
+ * CHUNK_ALIGN_BYTES) + 1, or ITEM_REF_CURSOR plus a slot in the cursor
+ * table for the cursors (which don't live in the arena). 0 is NULL.
+ * Use item_deref() / item_ref() (and the item_next() family) to get
+ * between the two. This saves 12 bytes per item on 64 bit platforms.
+ */
+typedef uint32_t item_ref_t;
+#define ITEM_REF_CURSOR 0x80000000U
+#define ITEM_MAX_CURSORS 4096
+#else
+typedef struct _hash_item *item_ref_t;
+#endif
+
+/*
+ * The LRU links come last, so that the items of the tiny slab classes
+ * (which aren't on the LRUs) can leave them out (see ITEM_TINY)
+ */
 typedef struct _hash_item {
-    struct _hash_item *next;
-    struct _hash_item *prev;
-    struct _hash_item *h_next; /* hash chain next */
+    item_ref_t h_next; /* hash chain next (a cursor's own ref if compact) */
     rel_time_t time;  /* least recent access */
     rel_time_t exptime; /**< When the item will expire (relative to process
                          * startup) */
@@ -21,8 +39,44 @@ typedef struct _hash_item {
     unsigned short refcount;
     uint8_t slabs_clsid;/* which slab class we're in */
     uint8_t datatype;/* to identify the type of the data */
+    item_ref_t next;
+    item_ref_t prev;
 } hash_item;
 
+/* The size of the LRU links at the end of the header */
+#define ITEM_LINKS_SIZE (2 * sizeof(item_ref_t))
+
+/*
+ * The links of an item in the list of its vbucket (see vbucket_index in
+ * default_engine.h)
+ */
+struct item_vb_links {
+    item_ref_t next;
+    item_ref_t prev;
+};
+
+/*
+ * The links of an item in its slot of the expiry wheel, and the slot
+ * (level * EXPIRY_WHEEL_SLOTS + slot, or ITEM_EXPIRY_NONE)
+ */
+struct item_expiry_links {
+    item_ref_t next;
+    item_ref_t prev;
+    uint32_t slot;
+};
+
+#define ITEM_EXPIRY_NONE UINT32_MAX
+
+/*
+ * What the gdsf eviction policy keeps for an item: the cost of recreating
+ * it (see item_set_cost) and its priority (see item_gdsf_hit in items.c).
+ * It may be unaligned, so copy it in and out.
+ */
+struct item_cost {
+    uint32_t cost;
+    float priority;
+};
+
 typedef struct {
     unsigned int evicted;
     unsigned int evicted_nonzero;
@@ -30,15 +84,192 @@ typedef struct {
     unsigned int outofmemory;
     unsigned int tailrepairs;
     unsigned int reclaimed;
+    unsigned int moves_to_cold;
+    unsigned int moves_to_warm;
+    unsigned int evicted_temp;
+    unsigned int evicted_ahead;
+    unsigned int crawler_reclaimed;
 } itemstats_t;
 
+/*
+ * The LRU of each slab class is split into three segments. New items
+ * enter the hot segment, and the LRU maintainer moves them to warm (if
+ * they have been accessed) or cold. We evict from the tail of cold.
+ * With temporary_ttl the items which expire soon go to a fourth segment
+ * of their own instead, where they stay until they expire. We evict
+ * from it before any of the others, so that the churn of short lived
+ * items doesn't push the long lived ones out.
+ */
+#define HOT_LRU 0
+#define WARM_LRU 1
+#define COLD_LRU 2
+#define TEMP_LRU 3
+#define NUM_LRU 4
+
+/*
+ * The sequence of an item lock stripe, bumped to odd before and back to
+ * even after every change of the assoc buckets it protects (lookups with
+ * lockless_get check it instead of taking the lock). The changes nest (a
+ * replace is an unlink and a link, and nobody may see the key missing in
+ * between), so it only moves at the outermost one. One per cache line.
+ */
+struct item_lock_seq {
+    volatile uint32_t seq;
+    uint32_t depth;
+    char pad[56];
+};
+
+/*
+ * A slot of a reader in the middle of a lockless_get lookup: the epoch it
+ * entered in, or 0 if the slot is free. One per cache line.
+ */
+#define ITEM_EPOCH_SLOTS 64
+struct item_epoch_slot {
+    volatile uint64_t epoch;
+    char pad[56];
+};
+
 struct items {
-   hash_item *heads[POWER_LARGEST];
-   hash_item *tails[POWER_LARGEST];
+   hash_item *heads[POWER_LARGEST][NUM_LRU];
+   hash_item *tails[POWER_LARGEST][NUM_LRU];
    itemstats_t itemstats[POWER_LARGEST];
-   unsigned int sizes[POWER_LARGEST];
+   unsigned int sizes[POWER_LARGEST][NUM_LRU];
+   /* The priority of the last item gdsf evicted from each slab class */
+   float inflation[POWER_LARGEST];
+   /* Where the CLOCK of each tiny class looks next (the chunk number
+    * counting from the first one of its first page) */
+   unsigned int clock_hand[POWER_LARGEST];
+
+   /**
+    * Each slab class has its own LRU lock protecting its head, tail,
+    * size and itemstats entry. Never hold more than one of them at a
+    * time.
+    */
+   cb_mutex_t lock[POWER_LARGEST];
+
+   /* The state of the generator item_sample picks the buckets with. The
+    * threads share it without a lock (it only has to look random) */
+   uint32_t sample_state;
+
+   /* The ITEM_WITH_* flags of the items we allocate, and the size of the
+    * words they add after the header (see item_layout_init) */
+   uint16_t layout;
+   uint16_t header_extra;
+
+#ifdef COMPACT_ITEMS
+   /**
+    * The cursors linked into the LRUs (they can't be addressed by an
+    * offset in the slab arena). Slots are handed out under cursor_lock
+    * by item_cursor_init()
+    */
+   hash_item *cursors[ITEM_MAX_CURSORS];
+   cb_mutex_t cursor_lock;
+#endif
 };
 
+/**
+ * Pick the layout of the items from the configuration, once it is final
+ * (which words follow the header of the items we allocate)
+ * @param engine handle to the storage engine
+ */
+void item_layout_init(struct default_engine *engine);
+
+/**
+ * Allocate the striped item locks
+ * @param engine handle to the storage engine
+ * @param nlocks the requested number of locks (rounded up to a power of two)
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE item_locks_init(struct default_engine *engine, size_t nlocks);
+
+/**
+ * Release the striped item locks
+ * @param engine handle to the storage engine
+ */
+void item_locks_destroy(struct default_engine *engine);
+
+/**
+ * Acquire the item lock protecting the given hash value (and the assoc
+ * buckets it maps to)
+ * @param engine handle to the storage engine
+ * @param hv the hash value of the key
+ */
+void item_lock(struct default_engine *engine, uint32_t hv);
+
+/**
+ * Release a lock acquired with item_lock()
+ * @param engine handle to the storage engine
+ * @param hv the hash value of the key
+ */
+void item_unlock(struct default_engine *engine, uint32_t hv);
+
+/**
+ * Acquire all of the item locks (in order). This is used when the whole
+ * assoc table needs to be stable (e.g. when it is swapped out during
+ * expansion).
+ * @param engine handle to the storage engine
+ */
+void item_lock_all(struct default_engine *engine);
+
+/**
+ * Release all of the item locks
+ * @param engine handle to the storage engine
+ */
+void item_unlock_all(struct default_engine *engine);
+
+/**
+ * Mark the start of a change of the assoc buckets of hv for the lookups
+ * running without the item lock (see lockless_get). They may nest.
+ * Caller must hold the item lock for hv
+ * @param engine handle to the storage engine
+ * @param hv the hash value of the key
+ */
+void item_seq_write_begin(struct default_engine *engine, uint32_t hv);
+
+/**
+ * Mark the end of a change started with item_seq_write_begin()
+ * @param engine handle to the storage engine
+ * @param hv the hash value of the key
+ */
+void item_seq_write_end(struct default_engine *engine, uint32_t hv);
+
+/**
+ * Get the hash value of a key of a request, which the server may already
+ * have computed for it (see get_key_hash in server_api.h)
+ * @param engine handle to the storage engine
+ * @param cookie the cookie of the request (NULL for our own lookups)
+ * @param key the key
+ * @param nkey the number of bytes in the key
+ * @return the hash value of the key
+ */
+uint32_t item_key_hash(struct default_engine *engine, const void *cookie,
+                       const void *key, size_t nkey);
+
+/**
+ * Get the sequence of the stripe of hv to start a lookup without the lock
+ * @param engine handle to the storage engine
+ * @param hv the hash value of the key
+ * @return the sequence (odd while someone is changing the buckets)
+ */
+uint32_t item_seq_read(struct default_engine *engine, uint32_t hv);
+
+/**
+ * Check that nothing changed the buckets of hv since item_seq_read()
+ * @param engine handle to the storage engine
+ * @param hv the hash value of the key
+ * @param seq what item_seq_read() returned
+ * @return true if what we read since is consistent
+ */
+bool item_seq_check(struct default_engine *engine, uint32_t hv, uint32_t seq);
+
+/**
+ * Wait until no lookup without the item lock may still look at memory
+ * which was unlinked before the call (so that it may be freed or handed
+ * to another slab class). Must not be called with any of the locks held.
+ * @param engine handle to the storage engine
+ */
+void item_epoch_synchronize(struct default_engine *engine);
+
 
 /**
  * Allocate and initialize a new item structure
@@ -55,15 +286,27 @@ hash_item *item_alloc(struct default_engine *engine,
                       rel_time_t exptime, int nbytes, const void *cookie,
                       uint8_t datatype);
 
+/**
+ * Get a batch of items from the cache (see get_multi in engine.h)
+ *
+ * @param engine handle to the storage engine
+ * @param keys the keys to look up
+ * @param nkeys the number of keys
+ * @param items where to store the items (NULL for the ones not found)
+ */
+void item_get_multi(struct default_engine *engine, const engine_key_t *keys,
+                    int nkeys, hash_item **items);
+
 /**
  * Get an item from the cache
  *
  * @param engine handle to the storage engine
+ * @param cookie the cookie of the request (may be NULL)
  * @param key the key for the item to get
  * @param nkey the number of bytes in the key
  * @return pointer to the item if it exists or NULL otherwise
  */
-hash_item *item_get(struct default_engine *engine,
+hash_item *item_get(struct default_engine *engine, const void *cookie,
                     const void *key, const size_t nkey);
 
 /**
@@ -93,6 +336,17 @@ void item_stats(struct default_engine *engine,
 void item_stats_sizes(struct default_engine *engine,
                       ADD_STAT add_stat, const void *cookie);
 
+/**
+ * Get the age and ttl histograms of every slab class, as seen by the last
+ * complete run of the LRU crawler (there are none without the crawler)
+ * @param engine handle to the storage engine
+ * @param add_stat callback provided by the core used to
+ *                 push statistics into the response
+ * @param cookie cookie provided by the core to identify the client
+ */
+void item_stats_ages(struct default_engine *engine,
+                     ADD_STAT add_stat, const void *cookie);
+
 /**
  * Dump items from the cache
  * @param engine handle to the storage engine
@@ -129,19 +383,63 @@ void item_release(struct default_engine *engine, hash_item *it);
  */
 void item_unlink(struct default_engine *engine, hash_item *it);
 
+/**
+ * Unlink the item on behalf of a delete (logging it for the DCP streams)
+ * @param engine handle to the storage engine
+ * @param it the item to delete
+ */
+void item_delete(struct default_engine *engine, hash_item *it);
+
 /**
  * Set the expiration time for an object
  * @param engine handle to the storage engine
+ * @param cookie the cookie of the request (may be NULL)
  * @param key the key to set
  * @param nkey the number of characters in key..
  * @param exptime the expiration time
  * @return The (updated) item if it exists
  */
 hash_item *touch_item(struct default_engine *engine,
+                      const void *cookie,
                       const void *key,
                       uint16_t nkey,
                       uint32_t exptime);
 
+/**
+ * Overwrite a range of the value of an item where it is (see patch in
+ * engine.h)
+ * @param engine handle to the storage engine
+ * @param cookie the cookie of the request (may be NULL)
+ * @param key the key of the item
+ * @param nkey the number of characters in key
+ * @param offset where in the value the range starts
+ * @param data the new content of the range
+ * @param len the length of the range
+ * @param cas the CAS the item must have (0 for any), set to the new one
+ * @return ENGINE_SUCCESS, or ENGINE_ENOTSUP if the item has to be copied
+ */
+ENGINE_ERROR_CODE item_patch(struct default_engine *engine,
+                             const void *cookie,
+                             const void *key, uint16_t nkey,
+                             uint64_t offset, const void *data,
+                             uint32_t len, uint64_t *cas);
+
+/**
+ * Store a batch of allocated items (see store_multi in engine.h)
+ *
+ * @param engine handle to the storage engine
+ * @param reqs what to do with each of the items
+ * @param items the items to store (the NULL ones are skipped)
+ * @param n the number of items
+ * @param cas where to store the CAS of the stored items
+ * @param status where to store the result for each item
+ * @param cookie the connection storing the items
+ */
+void item_store_multi(struct default_engine *engine,
+                      const engine_store_t *reqs, hash_item **items, int n,
+                      uint64_t *cas, ENGINE_ERROR_CODE *status,
+                      const void *cookie);
+
 /**
  * Store an item in the cache
  * @param engine handle to the storage engine
@@ -170,15 +468,171 @@ ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
                              const rel_time_t exptime,
                              uint64_t *cas,
                              uint8_t datatype,
-                             uint64_t *result);
+                             uint64_t *result,
+                             uint16_t vbucket);
+
+
+/* What happened to an item we tried to move off a slab page */
+enum evacuate_result {
+    EVACUATE_FREE,     /* The chunk was already free */
+    EVACUATE_BUSY,     /* The item is in use; try again later */
+    EVACUATE_RESCUED,  /* The item was copied to another chunk */
+    EVACUATE_EVICTED   /* There was no memory to copy it to; evicted */
+};
+
+/**
+ * Move an item off a slab page which is being reassigned to another slab
+ * class. The item is copied to another chunk in the same class (keeping
+ * its place in the LRU and its CAS) if there is memory for it, and
+ * evicted otherwise.
+ * @param engine handle to the storage engine
+ * @param it the chunk on the page
+ * @return what happened to the item
+ */
+enum evacuate_result item_evacuate(struct default_engine *engine,
+                                   hash_item *it);
+
+/**
+ * Get the pieces of the item's value (there is more than one if the
+ * item is chunked, see slab_chunk_max)
+ * @param engine handle to the storage engine
+ * @param it the item
+ * @param iov where to store the pieces
+ * @param niov the number of elements in iov
+ * @return the number of pieces (which may be more than niov)
+ */
+int item_get_value_iov(struct default_engine *engine, const hash_item *it,
+                       struct iovec *iov, int niov);
+
+/**
+ * Copy data into the item's value
+ * @param engine handle to the storage engine
+ * @param it the item
+ * @param offset where in the value to store it
+ * @param data the data to store
+ * @param len the number of bytes to store
+ */
+void item_write_value(struct default_engine *engine, hash_item *it,
+                      size_t offset, const void *data, size_t len);
+
+/**
+ * Copy the item's value into a contiguous buffer
+ * @param engine handle to the storage engine
+ * @param it the item
+ * @param data where to store it (room for it->nbytes bytes)
+ */
+void item_read_value(struct default_engine *engine, const hash_item *it,
+                     void *data);
+
+/**
+ * Get the location of the value of an ITEM_HDR item (see extstore.h)
+ * @param engine handle to the storage engine
+ * @param it the header
+ */
+struct ext_loc *item_get_ext_loc(struct default_engine *engine,
+                                 const hash_item *it);
+
+/**
+ * Read the value of an ITEM_HDR item back in from extstore. The header
+ * stays where it is.
+ * @param engine handle to the storage engine
+ * @param hdr the header (the caller must hold a reference to it)
+ * @param cookie the connection we're reading it for (or NULL)
+ * @param it where to store the new item (with a reference held)
+ * @return ENGINE_SUCCESS, ENGINE_KEY_ENOENT if the value is lost or
+ *         ENGINE_ENOMEM
+ */
+ENGINE_ERROR_CODE item_ext_load(struct default_engine *engine,
+                                const hash_item *hdr, const void *cookie,
+                                hash_item **it);
+
+/**
+ * Put an item read with item_ext_load in place of its header (if the
+ * header is still linked), keeping the CAS of the header
+ * @param engine handle to the storage engine
+ * @param hdr the header
+ * @param it the item read back in
+ * @return true if the item took the place of the header
+ */
+bool item_ext_recache(struct default_engine *engine, hash_item *hdr,
+                      hash_item *it);
 
+/**
+ * Read the value of an ITEM_HDR item back in while the caller waits, and
+ * put the item in place of the header
+ * @param engine handle to the storage engine
+ * @param hdr the header (the reference held by the caller is released)
+ * @param cookie the connection we're reading it for (or NULL)
+ * @return the item (with a reference held), or NULL if the value is lost
+ *         or there is no memory for it
+ */
+hash_item *item_ext_fetch(struct default_engine *engine, hash_item *hdr,
+                          const void *cookie);
 
 /**
- * Start the item scrubber
+ * Start the item scrubber: scrub_threads workers splitting the slab
+ * classes between them, visiting no more than scrub_rate items a second
+ * (all together) unless it is 0
  * @param engine handle to the storage engine
+ * @return false if it is already running (or we couldn't start it)
  */
 bool item_start_scrub(struct default_engine *engine);
 
+/**
+ * Stop the scrubber workers (if they're running) and wait for them
+ * @param engine handle to the storage engine
+ */
+void item_scrubber_stop(struct default_engine *engine);
+
+/**
+ * Start the LRU maintainer thread moving items between the segments
+ * of the LRUs
+ * @param engine handle to the storage engine
+ * @return true if the thread was started
+ */
+bool item_lru_maintainer_start(struct default_engine *engine);
+
+/**
+ * Stop the LRU maintainer thread (and wait for it to terminate)
+ * @param engine handle to the storage engine
+ */
+void item_lru_maintainer_stop(struct default_engine *engine);
+
+/**
+ * Start the LRU crawler thread reclaiming expired items in the background
+ * @param engine handle to the storage engine
+ * @return true if the thread was started
+ */
+bool item_lru_crawler_start(struct default_engine *engine);
+
+/**
+ * Stop the LRU crawler thread (and wait for it to terminate)
+ * @param engine handle to the storage engine
+ */
+void item_lru_crawler_stop(struct default_engine *engine);
+
+/**
+ * Start the expiry thread unlinking the items in the expiry wheel as
+ * they expire
+ * @param engine handle to the storage engine
+ * @return true if the thread was started
+ */
+bool item_expiry_start(struct default_engine *engine);
+
+/**
+ * Stop the expiry thread (and wait for it to terminate)
+ * @param engine handle to the storage engine
+ */
+void item_expiry_stop(struct default_engine *engine);
+
+/**
+ * Link the items found in the arena at restart (see restart_file) into
+ * the hash table and the LRUs again, and free the rest of it. Items which
+ * expired or were flushed while we were down are dropped.
+ * @param engine handle to the storage engine
+ */
+ENGINE_ERROR_CODE item_restore(struct default_engine *engine);
+
 /**
  * The tap walker to walk the hashtables
  */
@@ -188,30 +642,175 @@ tap_event_t item_tap_walker(ENGINE_HANDLE* handle,
                             uint16_t *flags, uint32_t *seqno,
                             uint16_t *vbucket);
 
+/**
+ * Set up the tap walker for the connection. With the vbucket index and
+ * TAP_CONNECT_FLAG_LIST_VBUCKETS (the vbuckets listed in userdata) we
+ * only walk the items of those vbuckets.
+ */
 bool initialize_item_tap_walker(struct default_engine *engine,
-                                const void* cookie);
-
-
-struct dcp_connection {
-    void *gid;
-    size_t ngid;
-    uint32_t flags;
-    uint32_t opaque;
-    uint16_t vbucket;
-    uint64_t start_seqno;
-    uint64_t end_seqno;
-    uint64_t vbucket_uuid;
-    uint64_t snap_start_seqno;
-    uint64_t snap_end_seqno;
-    hash_item cursor;
-    hash_item *it;
-};
+                                const void* cookie, uint32_t flags,
+                                const void *userdata, size_t nuserdata);
+
+/*
+ * Unlink and release the tap walker set up for the connection. Caller
+ * must hold tap_connections.lock.
+ */
+void destroy_item_tap_walker(struct default_engine *engine,
+                             const void* cookie);
+
+/**
+ * Add the progress of the tap walkers (a walker takes up to
+ * ITEM_TAP_BATCH items off a list per lock acquisition, and hands them
+ * out one at a time)
+ * @param engine handle to the storage engine
+ * @param add_stats callback for the stats
+ * @param c the cookie to pass on to add_stats
+ */
+void item_tap_stats(struct default_engine *engine, ADD_STAT add_stats,
+                    const void *c);
 
-void link_dcp_walker(struct default_engine *engine,
-                     struct dcp_connection *connection);
-ENGINE_ERROR_CODE item_dcp_step(struct default_engine *engine,
-                                struct dcp_connection *connection,
-                                const void *cookie,
-                                struct dcp_message_producers *producers);
+
+/**
+ * Link a cursor for walking the items of a vbucket (for a DCP backfill).
+ * Without the vbucket index the cursor walks all of the items.
+ * @param engine handle to the storage engine
+ * @param cursor the cursor to link
+ * @param vbucket the vbucket to walk
+ * @return ENGINE_SUCCESS, ENGINE_KEY_ENOENT if there are no items (the
+ *         cursor is released) or ENGINE_ENOMEM if we're out of cursors
+ */
+ENGINE_ERROR_CODE item_backfill_start(struct default_engine *engine,
+                                      hash_item *cursor, uint16_t vbucket);
+
+/**
+ * Walk the cursor to the next item filter accepts (it is called with
+ * the item lock held)
+ * @param engine handle to the storage engine
+ * @param cursor the cursor set up with item_backfill_start
+ * @param filter picks the items to return
+ * @param arg passed on to filter
+ * @return the item (with a reference held), or NULL when the walk is done
+ */
+hash_item *item_backfill_next(struct default_engine *engine,
+                              hash_item *cursor,
+                              bool (*filter)(const hash_item *it, void *arg),
+                              void *arg);
+
+/**
+ * Unlink and release the cursor (it may be done with the walk)
+ * @param engine handle to the storage engine
+ * @param cursor the cursor set up with item_backfill_start
+ */
+void item_backfill_stop(struct default_engine *engine, hash_item *cursor);
+
+/**
+ * Link a cursor for walking all of the items (for a snapshot), whether
+ * or not we have the vbucket index
+ * @param engine handle to the storage engine
+ * @param cursor the cursor to link
+ * @return ENGINE_SUCCESS, ENGINE_KEY_ENOENT if there are no items (the
+ *         cursor is released) or ENGINE_ENOMEM if we're out of cursors
+ */
+ENGINE_ERROR_CODE item_snapshot_start(struct default_engine *engine,
+                                      hash_item *cursor);
+
+/**
+ * Walk the cursor to the next live item. An item moving to another LRU
+ * while we walk may be seen twice or not at all.
+ * @param engine handle to the storage engine
+ * @param cursor the cursor set up with item_snapshot_start
+ * @return the item (with a reference held, and its value read back in if
+ *         it was in extstore), or NULL when the walk is done
+ */
+hash_item *item_snapshot_next(struct default_engine *engine,
+                              hash_item *cursor);
+
+/**
+ * Unlink and release the cursor (it may be done with the walk)
+ * @param engine handle to the storage engine
+ * @param cursor the cursor set up with item_snapshot_start
+ */
+void item_snapshot_stop(struct default_engine *engine, hash_item *cursor);
+
+/**
+ * Set up the lists of the vbucket index
+ * @param engine handle to the storage engine
+ */
+ENGINE_ERROR_CODE item_vbucket_index_init(struct default_engine *engine);
+
+/**
+ * Release the lists of the vbucket index
+ * @param engine handle to the storage engine
+ */
+void item_vbucket_index_destroy(struct default_engine *engine);
+
+/**
+ * Unlink the items of a vbucket. The caller should keep new items from
+ * coming in first (we stop after as many items as it held when we
+ * started).
+ * @param engine handle to the storage engine
+ * @param vbucket the vbucket to empty
+ * @return the number of items we unlinked
+ */
+uint64_t item_vbucket_delete(struct default_engine *engine, uint16_t vbucket);
+
+/**
+ * Add the item and byte counts of the vbuckets holding items
+ * @param engine handle to the storage engine
+ * @param add_stats callback for the stats
+ * @param c the cookie to pass on to add_stats
+ */
+void item_vbucket_stats(struct default_engine *engine, ADD_STAT add_stats,
+                        const void *c);
+
+/**
+ * Pick items at random from the hash table. We look at random buckets,
+ * and walk the table from the last of them if they are all empty (so a
+ * nearly empty cache costs a walk of the table). The items are picked
+ * independently of each other, so we may pick one more than once.
+ * @param engine handle to the storage engine
+ * @param items where to store the items (with a reference held)
+ * @param nitems the number of items wanted
+ * @return the number of items we found (0 if the cache is empty)
+ */
+int item_sample(struct default_engine *engine, hash_item **items,
+                int nitems);
+
+/**
+ * Report how much of the bytes of a sample of the items are key prefixes
+ * (up to the last namespace_delimiter, or ':'), which prefixes we see
+ * most, and what sharing them between the items would save
+ * @param engine handle to the storage engine
+ * @param add_stat callback provided by the core used to
+ *                 push statistics into the response
+ * @param cookie cookie provided by the core to identify the client
+ */
+void item_key_prefix_stats(struct default_engine *engine,
+                           ADD_STAT add_stat, const void *cookie);
+
+/**
+ * Set up the namespace table (with namespace_delimiter)
+ * @param engine handle to the storage engine
+ */
+ENGINE_ERROR_CODE item_namespace_init(struct default_engine *engine);
+
+/**
+ * Release the namespace table
+ * @param engine handle to the storage engine
+ */
+void item_namespace_destroy(struct default_engine *engine);
+
+/**
+ * Invalidate all of the items in a namespace (the keys starting with the
+ * name and the delimiter)
+ * @param engine handle to the storage engine
+ * @param name the name of the namespace
+ * @param nname the length of the name
+ * @param generation where to store the new generation of the namespace
+ * @return ENGINE_SUCCESS, or ENGINE_ENOMEM if there is no room for it
+ */
+ENGINE_ERROR_CODE item_namespace_invalidate(struct default_engine *engine,
+                                            const void *name, size_t nname,
+                                            uint64_t *generation);
 
 #endif
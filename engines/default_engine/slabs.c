@@ -5,7 +5,8 @@
  * "item" structure plus space for a small key and value. They increase by
  * a multiplier factor from there, up to half the maximum slab size. The last
  * slab size is always 1MB, since that's the maximum item size allowed by the
- * memcached protocol.
+ * memcached protocol. With slab_sizes the chunk sizes are the ones given
+ * (which "stats slab_sizes" may derive from the sizes we were asked for).
  */
 #include "config.h"
 
@@ -16,6 +17,11 @@
 #include <string.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <limits.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include "default_engine.h"
 
@@ -75,6 +81,684 @@ static void *my_allocate(struct default_engine *e, size_t size) {
     return ptr;
 }
 
+/*
+ * The record of a clean shutdown we leave next to the restart_file (in
+ * restart_file.meta). It is followed by the offsets in the arena of the
+ * pages of each class (slabs[id] of them for class id, in order). We
+ * remove it as soon as we've read it, so that we start over with an
+ * empty cache if we don't get to shut down cleanly.
+ */
+#define RESTART_MAGIC 0x6d656d6361636865ULL
+#define RESTART_VERSION 7
+
+struct restart_meta {
+    uint64_t magic;
+    uint32_t version;
+    /* The item layout (this differs with COMPACT_ITEMS) */
+    uint32_t item_header;
+    uint64_t base;
+    uint64_t arena;
+    uint64_t used;
+    uint64_t malloced;
+    uint64_t cas_id;
+    uint64_t oldest_cas;
+    int64_t abstime;
+    uint32_t current_time;
+    uint32_t oldest_live;
+    uint32_t use_cas;
+    uint32_t vbucket_index;
+    uint32_t eviction_gdsf;
+    uint32_t expiry_wheel;
+    uint32_t native_counters;
+    uint32_t slab_reassign;
+    uint32_t tiny_max;
+    uint32_t chunk_clsid;
+    uint32_t power_largest;
+    uint32_t sizes[MAX_NUMBER_OF_SLAB_CLASSES];
+    uint32_t slabs[MAX_NUMBER_OF_SLAB_CLASSES];
+};
+
+#ifndef WIN32
+/*
+ * The anonymous arenas of the engines destroyed in this process (of
+ * regular pages), which the next ones of the same size take over instead
+ * of mapping new ones. We gave their memory back to the OS, so they read
+ * as zeros.
+ */
+#define SLABS_SPARE_ARENAS 4
+
+/* How much of an arena we give back at a time, so that we don't hold the
+ * lock of the address space of the process for long */
+#define SLABS_RELEASE_CHUNK ((size_t)64 * 1024 * 1024)
+
+enum { SPARE_EMPTY, SPARE_BUSY, SPARE_FULL };
+
+static struct slabs_spare_arena {
+    volatile unsigned int state;
+    void *base;
+    size_t size;
+} slabs_spare_arenas[SLABS_SPARE_ARENAS];
+
+#if defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+static bool slabs_spare_cas(volatile unsigned int *state, unsigned int prev,
+                            unsigned int next) {
+    return atomic_cas_uint(state, prev, next) == prev;
+}
+#else
+static bool slabs_spare_cas(volatile unsigned int *state, unsigned int prev,
+                            unsigned int next) {
+    return __sync_bool_compare_and_swap(state, prev, next);
+}
+#endif
+
+/* Take over a spare arena of size bytes (NULL if there is none) */
+static void *slabs_spare_get(size_t size) {
+    unsigned int ii;
+
+    for (ii = 0; ii < SLABS_SPARE_ARENAS; ++ii) {
+        struct slabs_spare_arena *spare = &slabs_spare_arenas[ii];
+        if (spare->state == SPARE_FULL &&
+            slabs_spare_cas(&spare->state, SPARE_FULL, SPARE_BUSY)) {
+            if (spare->size == size) {
+                void *ptr = spare->base;
+                spare->base = NULL;
+                slabs_spare_cas(&spare->state, SPARE_BUSY, SPARE_EMPTY);
+                return ptr;
+            }
+            slabs_spare_cas(&spare->state, SPARE_BUSY, SPARE_FULL);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Give the memory of the arena back to the OS, a chunk at a time, and
+ * keep it for the next engine if we may (and unmap it if we may not).
+ */
+static void slabs_release_arena(char *base, size_t size, bool spare) {
+    size_t offset;
+    unsigned int ii;
+
+    for (offset = 0; offset < size; offset += SLABS_RELEASE_CHUNK) {
+        size_t len = size - offset;
+        if (len > SLABS_RELEASE_CHUNK) {
+            len = SLABS_RELEASE_CHUNK;
+        }
+        madvise(base + offset, len, MADV_DONTNEED);
+    }
+
+    for (ii = 0; spare && ii < SLABS_SPARE_ARENAS; ++ii) {
+        struct slabs_spare_arena *s = &slabs_spare_arenas[ii];
+        if (s->state == SPARE_EMPTY &&
+            slabs_spare_cas(&s->state, SPARE_EMPTY, SPARE_BUSY)) {
+            s->base = base;
+            s->size = size;
+            slabs_spare_cas(&s->state, SPARE_BUSY, SPARE_FULL);
+            return;
+        }
+    }
+    munmap(base, size);
+}
+
+/*
+ * Map an anonymous arena of size bytes, from explicit hugepages of
+ * hugepage_size if we can get them. If we can't we fall back to regular
+ * pages (and ask for transparent hugepages). Returns NULL if we can't map
+ * it at all.
+ */
+static void *slabs_map_anon(struct default_engine *engine, size_t size) {
+    size_t hugepage = engine->config.hugepage_size;
+    void *ptr = MAP_FAILED;
+
+    if (hugepage == 0 && (ptr = slabs_spare_get(size)) != NULL) {
+        engine->slabs.mem_mapped = size;
+        engine->slabs.mem_page_size = 0;
+        return ptr;
+    }
+
+#ifdef MAP_HUGETLB
+    if (hugepage != 0) {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+        size_t len = (size + hugepage - 1) / hugepage * hugepage;
+#ifdef MAP_HUGE_SHIFT
+        int shift = 0;
+        while (((size_t)1 << shift) < hugepage) {
+            ++shift;
+        }
+        flags |= shift << MAP_HUGE_SHIFT;
+#endif
+        ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (ptr != MAP_FAILED) {
+            engine->slabs.mem_mapped = len;
+            engine->slabs.mem_page_size = hugepage;
+            return ptr;
+        }
+    }
+#endif
+
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (hugepage != 0) {
+        madvise(ptr, size, MADV_HUGEPAGE);
+    }
+#endif
+    engine->slabs.mem_mapped = size;
+    engine->slabs.mem_page_size = 0;
+    return ptr;
+}
+
+/* A slice of the arena for one of the prefault threads */
+struct slabs_prefault {
+    char *start;
+    size_t len;
+    size_t pagesize;
+    /* The node to touch it from (-1 if it doesn't matter) */
+    int node;
+    /* Set when the engine shuts down (NULL if we run to the end) */
+    volatile bool *stop;
+};
+
+/*
+ * Fault the page in without changing it, as the items may already live
+ * in it when we touch it in the background
+ */
+#if defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+static void slabs_touch(volatile char *ptr) {
+    atomic_or_8((volatile uint8_t *)ptr, 0);
+}
+#else
+static void slabs_touch(volatile char *ptr) {
+    __sync_fetch_and_or(ptr, 0);
+}
+#endif
+
+static void slabs_prefault_main(void *arg) {
+    struct slabs_prefault *range = arg;
+    size_t ii;
+
+    if (range->node != -1) {
+        /* The pages end up on the node of whoever touches them first */
+        mc_numa_bind_thread(range->node);
+    }
+    for (ii = 0; ii < range->len; ii += range->pagesize) {
+        if (range->stop != NULL && *range->stop) {
+            break;
+        }
+        slabs_touch(range->start + ii);
+    }
+}
+
+/* Split len bytes at start in (up to) n ranges of whole pages */
+static size_t slabs_prefault_split(struct slabs_prefault *ranges,
+                                   char *start, size_t len, size_t n,
+                                   size_t pagesize, int node) {
+    size_t npages = (len + pagesize - 1) / pagesize;
+    size_t per_range, offset, ii;
+
+    if (n > npages) {
+        n = npages;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    per_range = (npages + n - 1) / n * pagesize;
+    for (ii = 0, offset = 0; offset < len; ++ii, offset += per_range) {
+        ranges[ii].start = start + offset;
+        ranges[ii].len = len - offset;
+        if (ranges[ii].len > per_range) {
+            ranges[ii].len = per_range;
+        }
+        ranges[ii].pagesize = pagesize;
+        ranges[ii].node = node;
+        ranges[ii].stop = NULL;
+    }
+    return ii;
+}
+
+/*
+ * Touch every page of the arena (with prefault_threads threads) so that
+ * we don't take the page faults while serving the first requests. The
+ * threads keep at it while we start taking requests (see
+ * slabs_prefault_stop), except with numa, where each slice must be
+ * touched first by threads running on its node.
+ */
+static void slabs_prefault(struct default_engine *engine) {
+    struct slabs_prefault ranges[64];
+    cb_thread_t tids[64];
+    size_t nthreads = engine->config.prefault_threads;
+    size_t pagesize = engine->slabs.mem_page_size;
+    size_t count = 0, started, ii;
+
+    if (pagesize == 0) {
+        pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    }
+    if (nthreads > 64) {
+        nthreads = 64;
+    }
+
+    if (engine->slabs.nnodes == 0) {
+        struct slabs_prefault *bg = calloc(nthreads, sizeof(*bg));
+        cb_thread_t *bgtids = calloc(nthreads, sizeof(*bgtids));
+
+        if (bg != NULL && bgtids != NULL) {
+            count = slabs_prefault_split(bg, engine->slabs.mem_base,
+                                         engine->slabs.mem_mapped, nthreads,
+                                         pagesize, -1);
+            engine->slabs.prefault.stop = false;
+            for (started = 0; started < count; ++started) {
+                bg[started].stop = &engine->slabs.prefault.stop;
+                /* The rest of the pages fault in as we use them */
+                if (cb_create_thread(&bgtids[started], slabs_prefault_main,
+                                     &bg[started], 0) != 0) {
+                    break;
+                }
+            }
+            if (started > 0) {
+                engine->slabs.prefault.ranges = bg;
+                engine->slabs.prefault.tids = bgtids;
+                engine->slabs.prefault.nthreads = started;
+                return;
+            }
+        }
+        free(bg);
+        free(bgtids);
+        return;
+    } else if (nthreads != 0) {
+        unsigned int node;
+        size_t per_node = nthreads / engine->slabs.nnodes;
+        if (per_node == 0) {
+            per_node = 1;
+        }
+        for (node = 0; node < engine->slabs.nnodes && count < 64; ++node) {
+            struct slabs_node *n = &engine->slabs.nodes[node];
+            if (per_node > 64 - count) {
+                per_node = 64 - count;
+            }
+            count += slabs_prefault_split(ranges + count, n->start, n->size,
+                                          per_node, pagesize, (int)node);
+        }
+    }
+
+    for (started = 0; started < count; ++started) {
+        if (cb_create_thread(&tids[started], slabs_prefault_main,
+                             &ranges[started], 0) != 0) {
+            break;
+        }
+    }
+    /* Do whatever we couldn't start threads for ourselves */
+    for (ii = started; ii < count; ++ii) {
+        ranges[ii].node = -1;
+        slabs_prefault_main(&ranges[ii]);
+    }
+    while (started > 0) {
+        cb_join_thread(tids[--started]);
+    }
+}
+
+/* Wait for the threads touching the arena in the background */
+static void slabs_prefault_stop(struct default_engine *engine) {
+    size_t ii;
+
+    engine->slabs.prefault.stop = true;
+    for (ii = 0; ii < engine->slabs.prefault.nthreads; ++ii) {
+        cb_join_thread(engine->slabs.prefault.tids[ii]);
+    }
+    free(engine->slabs.prefault.ranges);
+    free(engine->slabs.prefault.tids);
+    engine->slabs.prefault.ranges = NULL;
+    engine->slabs.prefault.tids = NULL;
+    engine->slabs.prefault.nthreads = 0;
+}
+#endif
+
+/*
+ * Split the arena in one slice per NUMA node (in whole pages, so that
+ * each page lives on one node)
+ */
+static ENGINE_ERROR_CODE slabs_numa_init(struct default_engine *engine,
+                                         size_t arena) {
+    size_t pagesize = engine->slabs.mem_page_size;
+    unsigned int nnodes = (unsigned int)mc_numa_nodes();
+    size_t slice;
+    unsigned int ii;
+
+    if (pagesize == 0) {
+#ifdef WIN32
+        pagesize = 4096;
+#else
+        pagesize = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+    }
+    slice = arena / nnodes / pagesize * pagesize;
+    if (slice == 0) {
+        nnodes = 1;
+        slice = arena;
+    }
+
+    engine->slabs.nodes = calloc(nnodes, sizeof(struct slabs_node));
+    if (engine->slabs.nodes == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    for (ii = 0; ii < nnodes; ++ii) {
+        struct slabs_node *n = &engine->slabs.nodes[ii];
+        n->start = (char*)engine->slabs.mem_base + ii * slice;
+        n->size = (ii == nnodes - 1) ? arena - ii * slice : slice;
+        n->current = n->start;
+        n->avail = n->size;
+    }
+    engine->slabs.nnodes = nnodes;
+    return ENGINE_SUCCESS;
+}
+
+static void slabs_meta_path(struct default_engine *engine, char *path,
+                            size_t size, const char *suffix) {
+    snprintf(path, size, "%s.meta%s", engine->config.restart_file, suffix);
+}
+
+static int grow_slab_list (struct default_engine *engine, const unsigned int id);
+static void do_slabs_free(struct default_engine *engine, void *ptr,
+                          const size_t size, unsigned int id);
+static size_t slabs_page_size(struct default_engine *engine,
+                              const slabclass_t *p);
+
+/* Is the record from an engine with the same slab classes as ours? */
+static bool slabs_meta_matches(struct default_engine *engine,
+                               const struct restart_meta *meta,
+                               size_t arena) {
+    unsigned int ii;
+
+    if (meta->magic != RESTART_MAGIC || meta->version != RESTART_VERSION ||
+        meta->item_header != sizeof(hash_item) || meta->arena != arena ||
+        meta->used > arena ||
+        meta->use_cas != (uint32_t)engine->config.use_cas ||
+        meta->vbucket_index != (uint32_t)engine->config.vbucket_index ||
+        meta->eviction_gdsf != (uint32_t)engine->config.eviction_gdsf ||
+        meta->expiry_wheel != (uint32_t)engine->config.expiry_wheel ||
+        meta->native_counters != (uint32_t)engine->config.native_counters ||
+        meta->slab_reassign != (uint32_t)engine->config.slab_reassign ||
+        meta->tiny_max != engine->slabs.tiny_max ||
+        meta->chunk_clsid != engine->slabs.chunk_clsid ||
+        meta->power_largest != engine->slabs.power_largest) {
+        return false;
+    }
+    for (ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        if (meta->sizes[ii] != engine->slabs.slabclass[ii].size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Pick up the pages from the last process if it left a record of them
+ * (and we have the same slab classes). Returns false if we should start
+ * over with an empty arena.
+ */
+static bool slabs_load_meta(struct default_engine *engine, FILE *fp,
+                            const struct restart_meta *meta) {
+    unsigned int ii, jj;
+
+    for (ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        slabclass_t *p = &engine->slabs.slabclass[ii];
+        size_t len = slabs_page_size(engine, p);
+        for (jj = 0; jj < meta->slabs[ii]; ++jj) {
+            uint64_t offset;
+            if (fread(&offset, sizeof(offset), 1, fp) != 1 ||
+                offset + len > meta->used || offset % CHUNK_ALIGN_BYTES ||
+                grow_slab_list(engine, ii) == 0) {
+                return false;
+            }
+            p->slab_list[p->slabs++] = (char*)engine->slabs.mem_base + offset;
+        }
+    }
+
+    engine->slabs.mem_current = (char*)engine->slabs.mem_base + meta->used;
+    engine->slabs.mem_avail = meta->arena - meta->used;
+    engine->slabs.mem_malloced = (size_t)meta->malloced;
+    engine->slabs.restart.restored = true;
+    engine->slabs.restart.delta = (char*)engine->slabs.mem_base -
+        (char*)(uintptr_t)meta->base;
+    engine->slabs.restart.current_time = meta->current_time;
+    engine->slabs.restart.abstime = (time_t)meta->abstime;
+    engine->slabs.restart.oldest_live = meta->oldest_live;
+    engine->slabs.restart.oldest_cas = meta->oldest_cas;
+    engine->slabs.restart.cas_id = meta->cas_id;
+    return true;
+}
+
+/*
+ * Map the arena from restart_file, preferably at the same address as the
+ * last time (so that the pointers in it stay valid)
+ */
+static ENGINE_ERROR_CODE slabs_map_arena(struct default_engine *engine,
+                                         size_t arena) {
+#ifdef WIN32
+    return ENGINE_ENOTSUP;
+#else
+    EXTENSION_LOGGER_DESCRIPTOR *logger;
+    struct restart_meta meta;
+    char path[PATH_MAX];
+    bool have_meta = false;
+    void *hint = NULL;
+    void *base;
+    FILE *fp;
+    int fd;
+    unsigned int ii;
+
+    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+
+    slabs_meta_path(engine, path, sizeof(path), "");
+    if ((fp = fopen(path, "rb")) != NULL) {
+        have_meta = fread(&meta, sizeof(meta), 1, fp) == 1 &&
+            slabs_meta_matches(engine, &meta, arena);
+        if (have_meta) {
+            hint = (void*)(uintptr_t)meta.base;
+        } else {
+            logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Ignoring %s (it doesn't match our settings)\n",
+                        path);
+        }
+    }
+
+    if ((fd = open(engine->config.restart_file, O_RDWR | O_CREAT, 0600)) == -1 ||
+        ftruncate(fd, (off_t)arena) != 0) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to open %s: %s\n",
+                    engine->config.restart_file, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        return ENGINE_FAILED;
+    }
+
+    base = mmap(hint, arena, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to map %s: %s\n",
+                    engine->config.restart_file, strerror(errno));
+        close(fd);
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        return ENGINE_ENOMEM;
+    }
+    engine->slabs.restart.fd = fd;
+    engine->slabs.restart.arena = arena;
+    engine->slabs.mem_base = base;
+    engine->slabs.mem_current = base;
+    engine->slabs.mem_avail = arena;
+
+    if (have_meta && !slabs_load_meta(engine, fp, &meta)) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Ignoring %s (it is truncated)\n", path);
+        for (ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+            engine->slabs.slabclass[ii].slabs = 0;
+        }
+    }
+    if (fp != NULL) {
+        fclose(fp);
+        /* It is only good for one restart */
+        unlink(path);
+    }
+    return ENGINE_SUCCESS;
+#endif
+}
+
+/* Leave a record of where the pages are for the next process */
+static void slabs_save_meta(struct default_engine *engine) {
+#ifndef WIN32
+    EXTENSION_LOGGER_DESCRIPTOR *logger;
+    struct restart_meta meta;
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    rel_time_t current_time = engine->server.core->get_current_time();
+    bool ok;
+    FILE *fp;
+    unsigned int ii, jj;
+
+    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+
+    memset(&meta, 0, sizeof(meta));
+    meta.magic = RESTART_MAGIC;
+    meta.version = RESTART_VERSION;
+    meta.item_header = sizeof(hash_item);
+    meta.base = (uintptr_t)engine->slabs.mem_base;
+    meta.arena = engine->slabs.restart.arena;
+    meta.used = (char*)engine->slabs.mem_current - (char*)engine->slabs.mem_base;
+    meta.malloced = engine->slabs.mem_malloced;
+    meta.cas_id = engine->cas_id;
+    meta.abstime = engine->server.core->abstime(current_time);
+    meta.current_time = current_time;
+    meta.oldest_live = engine->config.oldest_live;
+    meta.oldest_cas = engine->config.oldest_cas;
+    meta.use_cas = engine->config.use_cas;
+    meta.vbucket_index = engine->config.vbucket_index;
+    meta.eviction_gdsf = engine->config.eviction_gdsf;
+    meta.expiry_wheel = engine->config.expiry_wheel;
+    meta.native_counters = engine->config.native_counters;
+    meta.slab_reassign = engine->config.slab_reassign;
+    meta.tiny_max = engine->slabs.tiny_max;
+    meta.chunk_clsid = engine->slabs.chunk_clsid;
+    meta.power_largest = engine->slabs.power_largest;
+    for (ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        meta.sizes[ii] = engine->slabs.slabclass[ii].size;
+        meta.slabs[ii] = engine->slabs.slabclass[ii].slabs;
+    }
+
+    /* Make sure the items are there before we say they are */
+    ok = msync(engine->slabs.mem_base, engine->slabs.restart.arena,
+               MS_SYNC) == 0;
+
+    slabs_meta_path(engine, path, sizeof(path), "");
+    slabs_meta_path(engine, tmp, sizeof(tmp), ".tmp");
+    if (ok && (fp = fopen(tmp, "wb")) != NULL) {
+        ok = fwrite(&meta, sizeof(meta), 1, fp) == 1;
+        for (ii = POWER_SMALLEST; ok && ii <= engine->slabs.power_largest; ++ii) {
+            slabclass_t *p = &engine->slabs.slabclass[ii];
+            for (jj = 0; ok && jj < p->slabs; ++jj) {
+                uint64_t offset = (char*)p->slab_list[jj] -
+                    (char*)engine->slabs.mem_base;
+                ok = fwrite(&offset, sizeof(offset), 1, fp) == 1;
+            }
+        }
+        ok = (fclose(fp) == 0) && ok && rename(tmp, path) == 0;
+        if (!ok) {
+            unlink(tmp);
+        }
+    } else {
+        ok = false;
+    }
+
+    if (!ok) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to write %s: %s\n", path, strerror(errno));
+    }
+#endif
+}
+
+void slabs_restore(struct default_engine *engine, SLABS_RESTORE_FUNC func,
+                   void *arg) {
+    unsigned int id, ii, jj;
+
+    for (id = POWER_SMALLEST; id <= engine->slabs.power_largest; ++id) {
+        slabclass_t *p = &engine->slabs.slabclass[id];
+        for (ii = 0; ii < p->slabs; ++ii) {
+            char *ptr = p->slab_list[ii];
+            for (jj = 0; jj < p->perslab; ++jj, ptr += p->size) {
+                size_t size = 0;
+                if (func(engine, ptr, id, &size, arg)) {
+                    p->requested += size;
+                } else {
+                    do_slabs_free(engine, ptr, 0, id);
+                }
+            }
+        }
+        /* Everything which is free is on the freelist now */
+        p->end_page_ptr = NULL;
+        p->end_page_free = 0;
+    }
+}
+
+/*
+ * The chunk sizes of the geometric series of factor, starting at the
+ * smallest item (without the class for the largest items). Returns the
+ * number of them.
+ */
+static unsigned int slabs_geometric_sizes(struct default_engine *engine,
+                                          const double factor,
+                                          unsigned int *sizes) {
+    unsigned int size = sizeof(hash_item) + (unsigned int)engine->config.chunk_size;
+    unsigned int n = 0;
+
+    while (n < POWER_LARGEST - POWER_SMALLEST &&
+           size <= engine->config.item_size_max / factor) {
+        /* Make sure items are always n-byte aligned */
+        if (size % CHUNK_ALIGN_BYTES)
+            size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
+        sizes[n++] = size;
+        size = (unsigned int)(size * factor);
+    }
+    return n;
+}
+
+/*
+ * The chunk sizes in slab_sizes (growing sizes separated by '-', which we
+ * align). Returns -1 if it isn't a list of them we can use.
+ */
+static int slabs_parse_sizes(struct default_engine *engine,
+                             unsigned int *sizes) {
+    const char *ptr = engine->config.slab_sizes;
+    int n = 0;
+
+    while (*ptr != '\0') {
+        char *end;
+        unsigned long size = strtoul(ptr, &end, 10);
+        if (end == ptr || (*end != '\0' && *end != '-') ||
+            n == POWER_LARGEST - POWER_SMALLEST) {
+            return -1;
+        }
+        if (size % CHUNK_ALIGN_BYTES) {
+            size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
+        }
+        if (size <= sizeof(hash_item) ||
+            size >= engine->config.item_size_max ||
+            (n > 0 && size <= sizes[n - 1])) {
+            return -1;
+        }
+        sizes[n++] = (unsigned int)size;
+        ptr = (*end == '-') ? end + 1 : end;
+    }
+    return n;
+}
+
 /**
  * Determines the chunk sizes and initializes the slab class descriptors
  * accordingly.
@@ -83,32 +767,33 @@ ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
                              const size_t limit,
                              const double factor,
                              const bool prealloc) {
-    int i = POWER_SMALLEST - 1;
-    unsigned int size = sizeof(hash_item) + (unsigned int)engine->config.chunk_size;
+    int i;
+    unsigned int sizes[POWER_LARGEST];
+    int nsizes;
+    /* The arena in restart_file (or split by node) is allocated up front */
+    size_t arena = (prealloc || engine->config.restart_file != NULL ||
+                    engine->config.numa) ? limit : 0;
 
     engine->slabs.mem_limit = limit;
 
-    if (prealloc) {
-        /* Allocate everything in a big chunk with malloc */
-        engine->slabs.mem_base = my_allocate(engine, engine->slabs.mem_limit);
-        if (engine->slabs.mem_base != NULL) {
-            engine->slabs.mem_current = engine->slabs.mem_base;
-            engine->slabs.mem_avail = engine->slabs.mem_limit;
-        } else {
-            return ENGINE_ENOMEM;
-        }
-    }
-
     memset(engine->slabs.slabclass, 0, sizeof(engine->slabs.slabclass));
 
-    while (++i < POWER_LARGEST && size <= engine->config.item_size_max / factor) {
-        /* Make sure items are always n-byte aligned */
-        if (size % CHUNK_ALIGN_BYTES)
-            size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
+    if (engine->config.slab_sizes != NULL) {
+        if ((nsizes = slabs_parse_sizes(engine, sizes)) <= 0) {
+            return ENGINE_EINVAL;
+        }
+    } else {
+        nsizes = (int)slabs_geometric_sizes(engine, factor, sizes);
+    }
+    if (engine->config.slab_sizes_auto &&
+        (engine->slabs.sizer = calloc(SLABS_SIZER_SLOTS,
+                                      sizeof(uint64_t))) == NULL) {
+        return ENGINE_ENOMEM;
+    }
 
-        engine->slabs.slabclass[i].size = size;
+    for (i = POWER_SMALLEST; i < POWER_SMALLEST + nsizes; ++i) {
+        engine->slabs.slabclass[i].size = sizes[i - POWER_SMALLEST];
         engine->slabs.slabclass[i].perslab = (unsigned int)engine->config.item_size_max / engine->slabs.slabclass[i].size;
-        size = (unsigned int)(size * factor);
         if (engine->config.verbose > 1) {
             EXTENSION_LOGGER_DESCRIPTOR *logger;
             logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
@@ -131,6 +816,87 @@ ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
                     engine->slabs.slabclass[i].perslab);
     }
 
+    if (engine->config.slab_chunk_max != 0) {
+        /* Pick the largest class which fits in slab_chunk_max */
+        for (i = engine->slabs.power_largest; i >= POWER_SMALLEST; --i) {
+            if (engine->slabs.slabclass[i].size <= engine->config.slab_chunk_max) {
+                break;
+            }
+        }
+        /* It must have room for the largest key and some data */
+        if (i < POWER_SMALLEST || i == engine->slabs.power_largest ||
+            engine->slabs.slabclass[i].size < 1024) {
+            return ENGINE_EINVAL;
+        }
+#ifdef IOV_MAX
+        /* The daemon reads a value into at most IOV_MAX pieces */
+        if (engine->config.item_size_max /
+            (engine->slabs.slabclass[i].size - sizeof(hash_item)) + 1 > IOV_MAX) {
+            return ENGINE_EINVAL;
+        }
+#endif
+        engine->slabs.chunk_clsid = i;
+    }
+
+    /*
+     * The small classes hold tiny items, which leave the LRU links out of
+     * their header (the CLOCK of the class picks what to evict). They
+     * can't hold the chunks of large values.
+     */
+    for (i = POWER_SMALLEST; i < (int)engine->slabs.power_largest &&
+             (engine->slabs.chunk_clsid == 0 ||
+              i < (int)engine->slabs.chunk_clsid) &&
+             engine->slabs.slabclass[i].size <= engine->config.tiny_items; ++i) {
+        engine->slabs.slabclass[i].tiny = true;
+        engine->slabs.tiny_max = engine->slabs.slabclass[i].size;
+    }
+
+#ifdef COMPACT_ITEMS
+    /*
+     * The items refer to each other by their offset in one big arena (see
+     * item_ref_t), so we always preallocate. Every slab class may get its
+     * first page even if that takes us over the limit, so make room for
+     * those too. The whole arena must fit in the references.
+     */
+    if (limit == 0) {
+        return ENGINE_EINVAL;
+    }
+    arena = limit + (engine->slabs.power_largest - POWER_SMALLEST + 1) *
+        engine->config.item_size_max;
+    if (arena / CHUNK_ALIGN_BYTES >= ITEM_REF_CURSOR - 1) {
+        return ENGINE_EINVAL;
+    }
+#endif
+
+    if (arena != 0 && engine->config.restart_file != NULL) {
+        ENGINE_ERROR_CODE ret = slabs_map_arena(engine, arena);
+        if (ret != ENGINE_SUCCESS) {
+            return ret;
+        }
+    } else if (arena != 0) {
+        /* Allocate everything in one big chunk */
+#ifdef WIN32
+        engine->slabs.mem_base = my_allocate(engine, arena);
+#else
+        engine->slabs.mem_base = slabs_map_anon(engine, arena);
+#endif
+        if (engine->slabs.mem_base != NULL) {
+            engine->slabs.mem_current = engine->slabs.mem_base;
+            engine->slabs.mem_avail = arena;
+        } else {
+            return ENGINE_ENOMEM;
+        }
+        if (engine->config.numa) {
+            ENGINE_ERROR_CODE ret = slabs_numa_init(engine, arena);
+            if (ret != ENGINE_SUCCESS) {
+                return ret;
+            }
+        }
+#ifndef WIN32
+        slabs_prefault(engine);
+#endif
+    }
+
     /* for the test suite:  faking of how much we've already malloc'd */
     {
         char *t_initial_malloc = getenv("T_MEMD_INITIAL_MALLOC");
@@ -185,9 +951,21 @@ static int grow_slab_list (struct default_engine *engine, const unsigned int id)
     return 1;
 }
 
+/*
+ * With slab_reassign all of the pages are the same size, so that they
+ * may be moved from one class to another
+ */
+static size_t slabs_page_size(struct default_engine *engine,
+                              const slabclass_t *p) {
+    if (engine->config.slab_reassign) {
+        return engine->config.item_size_max;
+    }
+    return (size_t)p->size * p->perslab;
+}
+
 static int do_slabs_newslab(struct default_engine *engine, const unsigned int id) {
     slabclass_t *p = &engine->slabs.slabclass[id];
-    int len = p->size * p->perslab;
+    int len = (int)slabs_page_size(engine, p);
     char *ptr;
 
     if ((engine->slabs.mem_limit && engine->slabs.mem_malloced + len > engine->slabs.mem_limit && p->slabs > 0) ||
@@ -262,6 +1040,17 @@ static void *do_slabs_alloc(struct default_engine *engine, const size_t size, un
     return ret;
 }
 
+/* Is ptr on the page we're moving to another class? */
+static bool slabs_is_dying(struct default_engine *engine, void *ptr,
+                           unsigned int id) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    slabclass_t *p = &engine->slabs.slabclass[id];
+    char *start = r->slab_start;
+
+    return r->s_clsid == id && (char*)ptr >= start &&
+        (char*)ptr < start + (size_t)p->size * p->perslab;
+}
+
 static void do_slabs_free(struct default_engine *engine, void *ptr, const size_t size, unsigned int id) {
     slabclass_t *p;
 
@@ -277,6 +1066,12 @@ static void do_slabs_free(struct default_engine *engine, void *ptr, const size_t
     return;
 #endif
 
+    if (slabs_is_dying(engine, ptr, id)) {
+        /* Keep it off the freelist; the whole page is going away */
+        p->requested -= size;
+        return;
+    }
+
     if (p->sl_curr == p->sl_total) { /* need more space on the free list */
         int new_size = (p->sl_total != 0) ? p->sl_total * 2 : 16;  /* 16 is arbitrary */
         void **new_slots = realloc(p->slots, new_size * sizeof(void *));
@@ -352,6 +1147,9 @@ static void do_slabs_stats(struct default_engine *engine, ADD_STAT add_stats, co
                            p->end_page_free);
             add_statistics(cookie, add_stats, NULL, i, "mem_requested", "%zu",
                            p->requested);
+            if (p->tiny) {
+                add_statistics(cookie, add_stats, NULL, i, "tiny", "true");
+            }
 #ifdef FUTURE
             add_statistics(cookie, add_stats, NULL, i, "get_hits", "%"PRIu64,
                            thread_stats.slab_stats[i].get_hits);
@@ -373,32 +1171,89 @@ static void do_slabs_stats(struct default_engine *engine, ADD_STAT add_stats, co
     add_statistics(cookie, add_stats, NULL, -1, "active_slabs", "%d", total);
     add_statistics(cookie, add_stats, NULL, -1, "total_malloced", "%zu",
                    engine->slabs.mem_malloced);
+    if (engine->slabs.mem_base != NULL) {
+        add_statistics(cookie, add_stats, NULL, -1, "arena_hugepage_size",
+                       "%zu", engine->slabs.mem_page_size);
+    }
+
+    if (engine->config.slab_reassign) {
+        struct slab_rebalance *r = &engine->slabs.rebalance;
+        add_statistics(cookie, add_stats, NULL, -1, "slab_reassign_running",
+                       "%d", r->s_clsid != 0);
+        add_statistics(cookie, add_stats, NULL, -1, "slabs_moved",
+                       "%"PRIu64, r->slabs_moved);
+        add_statistics(cookie, add_stats, NULL, -1, "slabs_released",
+                       "%"PRIu64, r->slabs_released);
+        add_statistics(cookie, add_stats, NULL, -1, "slab_reassign_rescues",
+                       "%"PRIu64, r->rescues);
+        add_statistics(cookie, add_stats, NULL, -1,
+                       "slab_reassign_evictions_nomem",
+                       "%"PRIu64, r->evictions_nomem);
+        add_statistics(cookie, add_stats, NULL, -1, "slab_reassign_busy_items",
+                       "%u", r->busy_items);
+        if (engine->config.slab_defrag_pct != 0) {
+            add_statistics(cookie, add_stats, NULL, -1, "slab_defrag_running",
+                           "%d", r->s_clsid != 0 && r->defrag);
+            add_statistics(cookie, add_stats, NULL, -1, "slab_defrag_pages",
+                           "%"PRIu64, r->defrag_pages);
+            add_statistics(cookie, add_stats, NULL, -1,
+                           "slab_defrag_bytes_recovered",
+                           "%"PRIu64, r->defrag_bytes);
+        }
+        if (engine->config.slab_madvise) {
+            add_statistics(cookie, add_stats, NULL, -1, "slab_free_pages",
+                           "%u", engine->slabs.spare.num);
+            add_statistics(cookie, add_stats, NULL, -1, "slab_pages_madvised",
+                           "%"PRIu64, engine->slabs.spare.advised);
+        }
+    }
+}
+
+/* Carve size bytes off the front of the free part of a preallocated chunk */
+static void *memory_carve(void **current, size_t *avail, size_t size) {
+    void *ret = *current;
+
+    if (size > *avail) {
+        return NULL;
+    }
+
+    /* mem_current pointer _must_ be aligned!!! */
+    if (size % CHUNK_ALIGN_BYTES) {
+        size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
+    }
+
+    *current = ((char*)*current) + size;
+    if (size < *avail) {
+        *avail -= size;
+    } else {
+        *avail = 0;
+    }
+    return ret;
 }
 
 static void *memory_allocate(struct default_engine *engine, size_t size) {
     void *ret;
 
-    if (engine->slabs.mem_base == NULL) {
+    if (engine->slabs.spare.num > 0) {
+        /* (they are all pages, as are all of the allocations) */
+        ret = engine->slabs.spare.ptrs[--engine->slabs.spare.num];
+    } else if (engine->slabs.mem_base == NULL) {
         /* We are not using a preallocated large memory chunk */
         ret = my_allocate(engine, size);
-    } else {
-        ret = engine->slabs.mem_current;
-
-        if (size > engine->slabs.mem_avail) {
-            return NULL;
-        }
-
-        /* mem_current pointer _must_ be aligned!!! */
-        if (size % CHUNK_ALIGN_BYTES) {
-            size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
-        }
-
-        engine->slabs.mem_current = ((char*)engine->slabs.mem_current) + size;
-        if (size < engine->slabs.mem_avail) {
-            engine->slabs.mem_avail -= size;
-        } else {
-            engine->slabs.mem_avail = 0;
+    } else if (engine->slabs.nnodes != 0) {
+        /* Prefer the slice of the node we're running on */
+        unsigned int node = (unsigned int)mc_numa_current_node() %
+            engine->slabs.nnodes;
+        unsigned int ii;
+        ret = NULL;
+        for (ii = 0; ii < engine->slabs.nnodes && ret == NULL; ++ii) {
+            struct slabs_node *n;
+            n = &engine->slabs.nodes[(node + ii) % engine->slabs.nnodes];
+            ret = memory_carve(&n->current, &n->avail, size);
         }
+    } else {
+        ret = memory_carve(&engine->slabs.mem_current,
+                           &engine->slabs.mem_avail, size);
     }
 
     return ret;
@@ -407,28 +1262,234 @@ static void *memory_allocate(struct default_engine *engine, size_t size) {
 void *slabs_alloc(struct default_engine *engine, size_t size, unsigned int id) {
     void *ret;
 
-    cb_mutex_enter(&engine->slabs.lock);
+    mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
     ret = do_slabs_alloc(engine, size, id);
     cb_mutex_exit(&engine->slabs.lock);
     return ret;
 }
 
 void slabs_free(struct default_engine *engine, void *ptr, size_t size, unsigned int id) {
-    cb_mutex_enter(&engine->slabs.lock);
+    mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
     do_slabs_free(engine, ptr, size, id);
     cb_mutex_exit(&engine->slabs.lock);
 }
 
+unsigned int slabs_free_chunks(struct default_engine *engine, unsigned int id,
+                               unsigned int limit) {
+    slabclass_t *p = &engine->slabs.slabclass[id];
+    unsigned int ret;
+
+    mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
+    ret = p->sl_curr + (p->end_page_ptr != NULL ? p->end_page_free : 0);
+    if (ret < limit &&
+        (engine->slabs.mem_limit == 0 || p->slabs == 0 ||
+         engine->slabs.mem_malloced + slabs_page_size(engine, p) <=
+         engine->slabs.mem_limit)) {
+        ret = limit;
+    }
+    cb_mutex_exit(&engine->slabs.lock);
+    return ret > limit ? limit : ret;
+}
+
 void slabs_stats(struct default_engine *engine, ADD_STAT add_stats, const void *c) {
-    cb_mutex_enter(&engine->slabs.lock);
+    mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
     do_slabs_stats(engine, add_stats, c);
     cb_mutex_exit(&engine->slabs.lock);
 }
 
+void slabs_count_alloc(struct default_engine *engine, size_t size) {
+    size_t slot = (size + CHUNK_ALIGN_BYTES - 1) / CHUNK_ALIGN_BYTES;
+    if (slot < SLABS_SIZER_SLOTS) {
+        engine->slabs.sizer[slot]++;
+    }
+}
+
+/* A size with a share of the allocations of at least this gets a class */
+#define SLABS_SIZER_PEAK_PCT 1
+
+struct slabs_peak {
+    unsigned int size;
+    uint64_t count;
+};
+
+/* The most frequent first */
+static int slabs_peak_count_compare(const void *a, const void *b) {
+    const struct slabs_peak *pa = a;
+    const struct slabs_peak *pb = b;
+    return (pa->count < pb->count) - (pa->count > pb->count);
+}
+
+static int slabs_peak_size_compare(const void *a, const void *b) {
+    const struct slabs_peak *pa = a;
+    const struct slabs_peak *pb = b;
+    return (pa->size > pb->size) - (pa->size < pb->size);
+}
+
+/*
+ * The classes for the peaks of counts (the most frequent of them if there
+ * isn't room for all), with the geometric series of factor filling the
+ * gaps between them. Returns the number of sizes.
+ */
+static unsigned int slabs_derive_sizes(struct default_engine *engine,
+                                       const uint64_t *counts,
+                                       uint64_t total,
+                                       unsigned int *sizes) {
+    struct slabs_peak peaks[100 / SLABS_SIZER_PEAK_PCT];
+    unsigned int geometric[POWER_LARGEST];
+    unsigned int npeaks = 0, ngeometric, room, n = 0, ii, jj;
+
+    ngeometric = slabs_geometric_sizes(engine, engine->config.factor,
+                                       geometric);
+    for (ii = 0; ii < SLABS_SIZER_SLOTS && npeaks < 100 / SLABS_SIZER_PEAK_PCT; ++ii) {
+        if (counts[ii] != 0 && counts[ii] * 100 >= total * SLABS_SIZER_PEAK_PCT &&
+            ii * CHUNK_ALIGN_BYTES > sizeof(hash_item)) {
+            peaks[npeaks].size = ii * CHUNK_ALIGN_BYTES;
+            peaks[npeaks].count = counts[ii];
+            ++npeaks;
+        }
+    }
+    room = POWER_LARGEST - POWER_SMALLEST - ngeometric;
+    if (npeaks > room) {
+        qsort(peaks, npeaks, sizeof(*peaks), slabs_peak_count_compare);
+        npeaks = room;
+        qsort(peaks, npeaks, sizeof(*peaks), slabs_peak_size_compare);
+    }
+
+    /* Merge the two (they are both in order) */
+    for (ii = jj = 0; ii < npeaks || jj < ngeometric;) {
+        unsigned int size;
+        if (jj == ngeometric ||
+            (ii < npeaks && peaks[ii].size <= geometric[jj])) {
+            size = peaks[ii++].size;
+        } else {
+            size = geometric[jj++];
+        }
+        if (n == 0 || size > sizes[n - 1]) {
+            sizes[n++] = size;
+        }
+    }
+    return n;
+}
+
+/*
+ * The percentage of the chunks holding the allocations in counts we'd
+ * waste with the classes in sizes (the ones which don't fit any of them
+ * go to the class for the largest items, and aren't counted).
+ */
+static double slabs_sizes_waste(const uint64_t *counts,
+                                const unsigned int *sizes, unsigned int n) {
+    uint64_t used = 0, chunks = 0;
+    unsigned int ii, id = 0;
+
+    for (ii = 0; ii < SLABS_SIZER_SLOTS; ++ii) {
+        unsigned int size = ii * CHUNK_ALIGN_BYTES;
+        while (id < n && sizes[id] < size) {
+            ++id;
+        }
+        if (id == n) {
+            break;
+        }
+        used += counts[ii] * size;
+        chunks += counts[ii] * sizes[id];
+    }
+    return chunks == 0 ? 0.0 : 100.0 * (double)(chunks - used) / (double)chunks;
+}
+
+void slabs_sizes_stats(struct default_engine *engine, ADD_STAT add_stats,
+                       const void *c) {
+    uint64_t *counts;
+    unsigned int current[POWER_LARGEST];
+    unsigned int derived[POWER_LARGEST];
+    unsigned int ncurrent, nderived, ii;
+    uint64_t total = 0;
+    char val[POWER_LARGEST * 8];
+    int len;
+
+    if (engine->slabs.sizer == NULL ||
+        (counts = malloc(SLABS_SIZER_SLOTS * sizeof(*counts))) == NULL) {
+        return;
+    }
+    /* Without the LRU locks it's only about right, which is all we need */
+    memcpy(counts, engine->slabs.sizer, SLABS_SIZER_SLOTS * sizeof(*counts));
+    for (ii = 0; ii < SLABS_SIZER_SLOTS; ++ii) {
+        total += counts[ii];
+    }
+
+    ncurrent = engine->slabs.power_largest - POWER_SMALLEST;
+    for (ii = 0; ii < ncurrent; ++ii) {
+        current[ii] = engine->slabs.slabclass[POWER_SMALLEST + ii].size;
+    }
+    nderived = total == 0 ? 0 : slabs_derive_sizes(engine, counts, total,
+                                                   derived);
+
+    len = snprintf(val, sizeof(val), "%"PRIu64, total);
+    add_stats("slab_sizes_samples", 18, val, len, c);
+    len = snprintf(val, sizeof(val), "%.1f",
+                   slabs_sizes_waste(counts, current, ncurrent));
+    add_stats("slab_sizes_waste_pct", 20, val, len, c);
+    if (nderived != 0) {
+        len = snprintf(val, sizeof(val), "%.1f",
+                       slabs_sizes_waste(counts, derived, nderived));
+        add_stats("slab_sizes_derived_waste_pct", 28, val, len, c);
+        len = 0;
+        for (ii = 0; ii < nderived; ++ii) {
+            len += snprintf(val + len, sizeof(val) - len, "%s%u",
+                            ii == 0 ? "" : "-", derived[ii]);
+        }
+        add_stats("slab_sizes", 10, val, len, c);
+    }
+    free(counts);
+}
+
+void slabs_numa_hit(struct default_engine *engine, const void *ptr) {
+    struct slabs_node *node;
+    unsigned int ii;
+
+    if (engine->slabs.nnodes == 0) {
+        return;
+    }
+    node = &engine->slabs.nodes[(unsigned int)mc_numa_current_node() %
+                                engine->slabs.nnodes];
+    for (ii = 0; ii < engine->slabs.nnodes; ++ii) {
+        struct slabs_node *n = &engine->slabs.nodes[ii];
+        if ((const char*)ptr >= n->start &&
+            (const char*)ptr < n->start + n->size) {
+            break;
+        }
+    }
+    /* Counted without a lock; they are only for the stats */
+    if (ii < engine->slabs.nnodes && node == &engine->slabs.nodes[ii]) {
+        node->local_hits++;
+    } else {
+        node->remote_hits++;
+    }
+}
+
+void slabs_numa_stats(struct default_engine *engine, ADD_STAT add_stats,
+                      const void *c) {
+    unsigned int ii;
+
+    add_statistics(c, add_stats, NULL, -1, "numa_nodes", "%u",
+                   engine->slabs.nnodes);
+    for (ii = 0; ii < engine->slabs.nnodes; ++ii) {
+        struct slabs_node *n = &engine->slabs.nodes[ii];
+        size_t used;
+        mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
+        used = n->size - n->avail;
+        cb_mutex_exit(&engine->slabs.lock);
+        add_statistics(c, add_stats, "node", ii, "memory", "%zu", n->size);
+        add_statistics(c, add_stats, "node", ii, "memory_used", "%zu", used);
+        add_statistics(c, add_stats, "node", ii, "local_hits", "%"PRIu64,
+                       n->local_hits);
+        add_statistics(c, add_stats, "node", ii, "remote_hits", "%"PRIu64,
+                       n->remote_hits);
+    }
+}
+
 void slabs_adjust_mem_requested(struct default_engine *engine, unsigned int id, size_t old, size_t ntotal)
 {
     slabclass_t *p;
-    cb_mutex_enter(&engine->slabs.lock);
+    mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
     if (id < POWER_SMALLEST || id > engine->slabs.power_largest) {
         EXTENSION_LOGGER_DESCRIPTOR *logger;
         logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
@@ -442,16 +1503,636 @@ void slabs_adjust_mem_requested(struct default_engine *engine, unsigned int id,
     cb_mutex_exit(&engine->slabs.lock);
 }
 
+void *slabs_page(struct default_engine *engine, unsigned int id,
+                 unsigned int page) {
+    void *ret = NULL;
+    mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
+    if (page < engine->slabs.slabclass[id].slabs) {
+        ret = engine->slabs.slabclass[id].slab_list[page];
+    }
+    cb_mutex_exit(&engine->slabs.lock);
+    return ret;
+}
+
+/*
+ * Pick the class with the most pages (other than dst and the tiny ones) to
+ * take a page from.
+ * Caller must hold slabs.lock
+ */
+static unsigned int slabs_pick_source(struct default_engine *engine,
+                                      unsigned int dst) {
+    unsigned int ii;
+    unsigned int src = 0;
+    unsigned int pages = 1;
+
+    for (ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        if (ii != dst && !engine->slabs.slabclass[ii].tiny &&
+            engine->slabs.slabclass[ii].slabs > pages) {
+            src = ii;
+            pages = engine->slabs.slabclass[ii].slabs;
+        }
+    }
+    return src;
+}
+
+static enum reassign_result_type do_slabs_start_move(struct default_engine *engine,
+                                                     unsigned int src,
+                                                     unsigned int dst,
+                                                     char *page);
+
+/* Caller must hold slabs.lock */
+static enum reassign_result_type do_slabs_reassign(struct default_engine *engine,
+                                                   unsigned int src,
+                                                   unsigned int dst) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+
+#ifdef USE_SYSTEM_MALLOC
+    return REASSIGN_DISABLED;
+#endif
+    if (!engine->config.slab_reassign) {
+        return REASSIGN_DISABLED;
+    }
+    if (r->s_clsid != 0) {
+        return REASSIGN_RUNNING;
+    }
+    if (dst < POWER_SMALLEST || dst > engine->slabs.power_largest) {
+        return REASSIGN_BADCLASS;
+    }
+    if (src == 0 && (src = slabs_pick_source(engine, dst)) == 0) {
+        return REASSIGN_NOSPARE;
+    }
+    if (src == dst) {
+        return REASSIGN_SRC_DST_SAME;
+    }
+    if (src < POWER_SMALLEST || src > engine->slabs.power_largest ||
+        engine->slabs.slabclass[src].tiny) {
+        /* The CLOCK of a tiny class walks its pages in place */
+        return REASSIGN_BADCLASS;
+    }
+
+    return do_slabs_start_move(engine, src, dst, NULL);
+}
+
+/*
+ * Start taking a page of class src off to class dst (or to give back if
+ * dst is 0). The page is the first one of the class unless the
+ * defragmenter picked one. Caller must hold slabs.lock
+ */
+static enum reassign_result_type do_slabs_start_move(struct default_engine *engine,
+                                                     unsigned int src,
+                                                     unsigned int dst,
+                                                     char *page) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    slabclass_t *p;
+    char *start;
+    char *end;
+    unsigned int ii, jj;
+
+    p = &engine->slabs.slabclass[src];
+    if (p->slabs < 2) {
+        return REASSIGN_NOSPARE;
+    }
+
+    start = (page != NULL) ? page : p->slab_list[0];
+    end = start + (size_t)p->size * p->perslab;
+
+    /* Nobody may allocate from the page while we're moving it */
+    if ((char*)p->end_page_ptr >= start && (char*)p->end_page_ptr < end) {
+        end = p->end_page_ptr;
+        p->end_page_ptr = NULL;
+        p->end_page_free = 0;
+    }
+
+    r->s_clsid = src;
+    r->d_clsid = dst;
+    r->slab_start = start;
+    r->slab_end = end;
+    r->defrag = (page != NULL);
+    r->busy_items = 0;
+
+    for (ii = jj = 0; ii < p->sl_curr; ++ii) {
+        if (!slabs_is_dying(engine, p->slots[ii], src)) {
+            p->slots[jj++] = p->slots[ii];
+        }
+    }
+    p->sl_curr = jj;
+    p->killing = 1;
+
+    cb_cond_signal(&r->cond);
+    return REASSIGN_OK;
+}
+
+/*
+ * Start giving a page back if we took more than the mem_limit (which may
+ * have shrunk since). Only the pages we malloc'ed may be given back.
+ * Caller must hold slabs.lock
+ */
+static bool do_slabs_release(struct default_engine *engine) {
+    unsigned int src;
+
+    if (!engine->config.slab_reassign || engine->slabs.mem_base != NULL ||
+        engine->slabs.rebalance.s_clsid != 0 ||
+        engine->slabs.mem_limit == 0 ||
+        engine->slabs.mem_malloced <= engine->slabs.mem_limit) {
+        return false;
+    }
+    if ((src = slabs_pick_source(engine, 0)) == 0) {
+        return false;
+    }
+    return do_slabs_start_move(engine, src, 0, NULL) == REASSIGN_OK;
+}
+
+bool slabs_set_mem_limit(struct default_engine *engine, size_t limit) {
+    bool ret = false;
+
+    mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
+    if (engine->slabs.mem_base == NULL) {
+        engine->slabs.mem_limit = limit;
+        /* The rebalancer gives back what's above it */
+        cb_cond_signal(&engine->slabs.rebalance.cond);
+        ret = true;
+    }
+    cb_mutex_exit(&engine->slabs.lock);
+
+    return ret;
+}
+
+enum reassign_result_type slabs_reassign(struct default_engine *engine,
+                                         unsigned int src, unsigned int dst) {
+    enum reassign_result_type ret;
+    mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
+    ret = do_slabs_reassign(engine, src, dst);
+    cb_mutex_exit(&engine->slabs.lock);
+    return ret;
+}
+
+/*
+ * Give the memory of a page we emptied back to the OS with slab_madvise
+ * (it reads as zeros the next time we use it). We leave the pages of
+ * hugepage and restart_file arenas alone.
+ * @return true if we could
+ */
+static bool slabs_page_advise(struct default_engine *engine, char *page,
+                              size_t len) {
+#ifndef WIN32
+    uintptr_t pagesize = (uintptr_t)sysconf(_SC_PAGESIZE);
+    /* A page we malloc'ed may not start on a page of the OS */
+    uintptr_t start = ((uintptr_t)page + pagesize - 1) & ~(pagesize - 1);
+    uintptr_t end = ((uintptr_t)page + len) & ~(pagesize - 1);
+
+    if (!engine->config.slab_madvise || engine->slabs.mem_page_size != 0 ||
+        engine->slabs.restart.fd != -1 || end <= start) {
+        return false;
+    }
+    return madvise((void*)start, end - start, MADV_DONTNEED) == 0;
+#else
+    (void)engine;
+    (void)page;
+    (void)len;
+    return false;
+#endif
+}
+
+/*
+ * All of the items are off the page we're moving; hand it over to the
+ * destination class (or give it back if there is none). Caller must hold
+ * slabs.lock
+ */
+static void do_slabs_rebalance_finish(struct default_engine *engine) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    slabclass_t *s = &engine->slabs.slabclass[r->s_clsid];
+    unsigned int dst = r->d_clsid;
+    bool defrag = r->defrag;
+    slabclass_t *d;
+    char *page = r->slab_start;
+    unsigned int ii;
+    size_t jj;
+
+    for (ii = 0; ii < s->slabs && s->slab_list[ii] != page; ++ii) {
+        /* empty */
+    }
+    cb_assert(ii < s->slabs);
+    s->slab_list[ii] = s->slab_list[--s->slabs];
+    s->killing = 0;
+
+    r->s_clsid = 0;
+    r->d_clsid = 0;
+    r->slab_start = r->slab_end = NULL;
+    r->defrag = false;
+    r->busy_items = 0;
+
+    if (defrag) {
+        r->defrag_pages++;
+        r->defrag_bytes += slabs_page_size(engine, s);
+    }
+
+    if (dst == 0 &&
+        (engine->slabs.mem_base != NULL || engine->config.slab_madvise)) {
+        /* The page is kept for the next class wanting one */
+        if (engine->slabs.spare.num == engine->slabs.spare.size) {
+            unsigned int n = engine->slabs.spare.size + 64;
+            void *ptrs = realloc(engine->slabs.spare.ptrs, n * sizeof(void*));
+            if (ptrs != NULL) {
+                engine->slabs.spare.ptrs = ptrs;
+                engine->slabs.spare.size = n;
+            }
+        }
+        if (engine->slabs.spare.num < engine->slabs.spare.size) {
+            engine->slabs.spare.ptrs[engine->slabs.spare.num++] = page;
+            engine->slabs.mem_malloced -= slabs_page_size(engine, s);
+            if (slabs_page_advise(engine, page, slabs_page_size(engine, s))) {
+                engine->slabs.spare.advised++;
+            }
+            return;
+        }
+        /* Or else it goes back where it came from */
+        if (defrag) {
+            r->defrag_pages--;
+            r->defrag_bytes -= slabs_page_size(engine, s);
+        }
+    } else if (dst == 0) {
+        /* Give it back (we only release the pages we malloc'ed) */
+        for (jj = 0; jj < engine->slabs.allocs.next &&
+                 engine->slabs.allocs.ptrs[jj] != page; ++jj) {
+            /* empty */
+        }
+        cb_assert(jj < engine->slabs.allocs.next);
+        engine->slabs.allocs.ptrs[jj] =
+            engine->slabs.allocs.ptrs[--engine->slabs.allocs.next];
+        engine->slabs.mem_malloced -= slabs_page_size(engine, s);
+        if (!defrag) {
+            r->slabs_released++;
+        }
+        free(page);
+        return;
+    }
+
+    if (dst == 0 || grow_slab_list(engine, dst) == 0) {
+        /* Give it back to the class we took it from */
+        dst = (unsigned int)(s - engine->slabs.slabclass);
+    } else {
+        r->slabs_moved++;
+    }
+    d = &engine->slabs.slabclass[dst];
+
+    memset(page, 0, slabs_page_size(engine, d));
+    d->slab_list[d->slabs++] = page;
+    for (ii = 0; ii < d->perslab; ++ii) {
+        hash_item *it = (void*)(page + (size_t)ii * d->size);
+        it->iflag = ITEM_SLABBED;
+        do_slabs_free(engine, it, 0, dst);
+    }
+}
+
+/* How often we look at the eviction rates (in ms) */
+#define SLAB_AUTOMOVE_INTERVAL 1000
+/* How many checks in a row a class must win (or lose) to move a page */
+#define SLAB_AUTOMOVE_WINDOW 3
+
+/*
+ * Look for the class with the most evictions in the last few checks, and
+ * a class without evictions (and with pages to spare) to take a page
+ * from. Only the rebalancer thread uses the automover state.
+ */
+static bool slabs_automove_decide(struct default_engine *engine,
+                                  unsigned int *src, unsigned int *dst) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    unsigned int evicted[MAX_NUMBER_OF_SLAB_CLASSES];
+    unsigned int pages[MAX_NUMBER_OF_SLAB_CLASSES];
+    unsigned int highest = 0;
+    unsigned int highest_slab = 0;
+    unsigned int source = 0;
+    unsigned int ii;
+
+    for (ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        mc_mutex_enter(&engine->items.lock[ii], &engine->lock_stats.lru);
+        evicted[ii] = engine->items.itemstats[ii].evicted;
+        cb_mutex_exit(&engine->items.lock[ii]);
+    }
+
+    mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
+    for (ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        pages[ii] = engine->slabs.slabclass[ii].slabs;
+    }
+    cb_mutex_exit(&engine->slabs.lock);
+
+    for (ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        unsigned int diff = evicted[ii];
+        if (evicted[ii] >= r->evicted_old[ii]) {
+            /* (the stats may have been reset since the last check) */
+            diff -= r->evicted_old[ii];
+        }
+        r->evicted_old[ii] = evicted[ii];
+
+        if (diff == 0 && pages[ii] > 2 && !engine->slabs.slabclass[ii].tiny) {
+            r->zero_evictions[ii]++;
+            if (source == 0 && r->zero_evictions[ii] >= SLAB_AUTOMOVE_WINDOW) {
+                source = ii;
+            }
+        } else {
+            r->zero_evictions[ii] = 0;
+            if (diff > highest) {
+                highest = diff;
+                highest_slab = ii;
+            }
+        }
+    }
+
+    if (highest_slab != 0 && highest_slab == r->winner) {
+        r->winner_count++;
+    } else {
+        r->winner = highest_slab;
+        r->winner_count = (highest_slab != 0) ? 1 : 0;
+    }
+
+    if (source != 0 && r->winner != 0 &&
+        r->winner_count >= SLAB_AUTOMOVE_WINDOW) {
+        *src = source;
+        *dst = r->winner;
+        return true;
+    }
+    return false;
+}
+
+/* A page of the class the defragmenter looks at */
+struct defrag_page {
+    char *start;
+    unsigned int free;
+};
+
+static int defrag_page_compare(const void *a, const void *b) {
+    const char *pa = ((const struct defrag_page*)a)->start;
+    const char *pb = ((const struct defrag_page*)b)->start;
+    return (pa < pb) ? -1 : (pa > pb);
+}
+
+/*
+ * Look for the page with the fewest items in it (of the class with the
+ * most free memory), and start moving the items off it to the free
+ * chunks of the other pages of the class if it is at least pct percent
+ * empty. Caller must hold slabs.lock (which we drop while we count the
+ * free chunks)
+ * @return true if we started moving a page
+ */
+static bool slabs_defrag(struct default_engine *engine, size_t pct) {
+    struct defrag_page *pages;
+    struct defrag_page best;
+    void **slots;
+    char *end_page;
+    unsigned int end_free, nslabs, nslots, perslab, size;
+    unsigned int ii, id = 0;
+    uint64_t most = 0, total_free = 0;
+    bool ret = false;
+
+    for (ii = POWER_SMALLEST; ii <= engine->slabs.power_largest; ++ii) {
+        slabclass_t *p = &engine->slabs.slabclass[ii];
+        uint64_t nfree = (uint64_t)(p->sl_curr + p->end_page_free) * p->size;
+        if (p->slabs >= 2 && !p->tiny &&
+            p->sl_curr + p->end_page_free >= p->perslab && nfree > most) {
+            id = ii;
+            most = nfree;
+        }
+    }
+    if (id == 0) {
+        return false;
+    }
+
+    {
+        slabclass_t *p = &engine->slabs.slabclass[id];
+        nslabs = p->slabs;
+        nslots = p->sl_curr;
+        perslab = p->perslab;
+        size = p->size;
+        end_page = p->end_page_ptr;
+        end_free = p->end_page_free;
+        pages = malloc(nslabs * sizeof(*pages));
+        slots = malloc((nslots + 1) * sizeof(*slots));
+        if (pages == NULL || slots == NULL) {
+            free(pages);
+            free(slots);
+            return false;
+        }
+        for (ii = 0; ii < nslabs; ++ii) {
+            pages[ii].start = p->slab_list[ii];
+            pages[ii].free = 0;
+        }
+        memcpy(slots, p->slots, nslots * sizeof(*slots));
+    }
+    cb_mutex_exit(&engine->slabs.lock);
+
+    qsort(pages, nslabs, sizeof(*pages), defrag_page_compare);
+    for (ii = 0; ii < nslots + (end_page != NULL); ++ii) {
+        char *ptr = (ii < nslots) ? slots[ii] : end_page;
+        unsigned int lo = 0, hi = nslabs;
+        while (hi - lo > 1) {
+            unsigned int mid = (lo + hi) / 2;
+            if (pages[mid].start <= ptr) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        if (ptr >= pages[lo].start &&
+            ptr < pages[lo].start + (size_t)size * perslab) {
+            pages[lo].free += (ii < nslots) ? 1 : end_free;
+            total_free += (ii < nslots) ? 1 : end_free;
+        }
+    }
+
+    best = pages[0];
+    for (ii = 1; ii < nslabs; ++ii) {
+        if (pages[ii].free > best.free) {
+            best = pages[ii];
+        }
+    }
+    free(pages);
+    free(slots);
+
+    mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
+    /* It's worth it, and the other pages have room for what's left */
+    if ((uint64_t)best.free * 100 >=
+        (uint64_t)perslab * pct &&
+        total_free - best.free >= perslab - best.free &&
+        engine->slabs.rebalance.s_clsid == 0 && !engine->slabs.rebalance.shutdown) {
+        slabclass_t *p = &engine->slabs.slabclass[id];
+        for (ii = 0; ii < p->slabs && p->slab_list[ii] != best.start; ++ii) {
+            /* empty */
+        }
+        if (ii < p->slabs && p->slabs >= 2) {
+            ret = do_slabs_start_move(engine, id, 0, best.start) == REASSIGN_OK;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Try to get all of the items off the page we're moving. Caller must hold
+ * slabs.lock (which we drop while we look at the items)
+ */
+static void slabs_rebalance_pass(struct default_engine *engine) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    unsigned int size = engine->slabs.slabclass[r->s_clsid].size;
+    char *end = r->slab_end;
+    char *ptr = r->slab_start;
+    unsigned int busy = 0;
+    uint64_t rescues = 0;
+    uint64_t evictions = 0;
+
+    cb_mutex_exit(&engine->slabs.lock);
+    for (; ptr < end; ptr += size) {
+        switch (item_evacuate(engine, (hash_item*)ptr)) {
+        case EVACUATE_BUSY:
+            ++busy;
+            break;
+        case EVACUATE_RESCUED:
+            ++rescues;
+            break;
+        case EVACUATE_EVICTED:
+            ++evictions;
+            break;
+        case EVACUATE_FREE:
+            break;
+        }
+    }
+    if (busy == 0) {
+        /* Lookups without the lock may still be looking at the items */
+        item_epoch_synchronize(engine);
+    }
+    mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
+
+    r->rescues += rescues;
+    r->evictions_nomem += evictions;
+    r->busy_items = busy;
+    if (busy == 0) {
+        do_slabs_rebalance_finish(engine);
+    }
+}
+
+static void slabs_rebalancer_main(void *arg) {
+    struct default_engine *engine = arg;
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    hrtime_t next_check = gethrtime();
+    hrtime_t next_defrag = gethrtime();
+
+    mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
+    while (!r->shutdown) {
+        if (r->s_clsid != 0) {
+            slabs_rebalance_pass(engine);
+            if (r->s_clsid != 0 && !r->shutdown) {
+                /* Give whoever uses the busy items a chance to finish */
+                cb_cond_timedwait(&r->cond, &engine->slabs.lock, 1);
+            }
+            continue;
+        }
+
+        if (do_slabs_release(engine)) {
+            continue;
+        }
+
+        if (engine->config.slab_automove && gethrtime() >= next_check) {
+            unsigned int src, dst;
+            bool move;
+
+            next_check = gethrtime() +
+                (hrtime_t)SLAB_AUTOMOVE_INTERVAL * 1000 * 1000;
+            cb_mutex_exit(&engine->slabs.lock);
+            move = slabs_automove_decide(engine, &src, &dst);
+            mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
+            if (move) {
+                do_slabs_reassign(engine, src, dst);
+                continue;
+            }
+        }
+
+        if ((engine->config.slab_defrag_pct != 0 ||
+             engine->config.slab_madvise) && gethrtime() >= next_defrag) {
+            /* slab_madvise alone only gives back the pages nobody uses */
+            size_t pct = engine->config.slab_defrag_pct;
+            if (slabs_defrag(engine, pct != 0 ? pct : 100)) {
+                continue;
+            }
+            /* Nothing worth moving; look again in a while */
+            next_defrag = gethrtime() +
+                (hrtime_t)SLAB_AUTOMOVE_INTERVAL * 1000 * 1000;
+        }
+
+        if (!r->shutdown && r->s_clsid == 0) {
+            cb_cond_timedwait(&r->cond, &engine->slabs.lock,
+                              SLAB_AUTOMOVE_INTERVAL);
+        }
+    }
+    r->running = false;
+    cb_mutex_exit(&engine->slabs.lock);
+}
+
+bool slabs_rebalancer_start(struct default_engine *engine) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    bool ret = true;
+
+    mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
+    if (!r->running) {
+        r->shutdown = false;
+        r->running = true;
+        if (cb_create_thread(&r->tid, slabs_rebalancer_main, engine, 0) != 0) {
+            r->running = false;
+            ret = false;
+        }
+    }
+    cb_mutex_exit(&engine->slabs.lock);
+
+    return ret;
+}
+
+void slabs_rebalancer_stop(struct default_engine *engine) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    bool running;
+
+    mc_mutex_enter(&engine->slabs.lock, &engine->lock_stats.slabs);
+    running = r->running;
+    r->shutdown = true;
+    cb_cond_signal(&r->cond);
+    cb_mutex_exit(&engine->slabs.lock);
+
+    if (running) {
+        cb_join_thread(r->tid);
+    }
+}
+
 void slabs_destroy(struct default_engine *e)
 {
     /* Release the allocated backing store */
     size_t ii;
     unsigned int jj;
 
+#ifndef WIN32
+    /* Before we unmap what they touch */
+    slabs_prefault_stop(e);
+#endif
+
     for (ii = 0; ii < e->slabs.allocs.next; ++ii) {
         free(e->slabs.allocs.ptrs[ii]);
     }
     free(e->slabs.allocs.ptrs);
+    free(e->slabs.spare.ptrs);
+
+#ifndef WIN32
+    if (e->slabs.restart.fd != -1) {
+        slabs_save_meta(e);
+        munmap(e->slabs.mem_base, e->slabs.restart.arena);
+        close(e->slabs.restart.fd);
+        e->slabs.restart.fd = -1;
+    } else if (e->slabs.mem_page_size != 0) {
+        munmap(e->slabs.mem_base, e->slabs.mem_mapped);
+    } else if (e->slabs.mem_mapped != 0) {
+        /* The ones bound to the nodes (or asked for transparent
+         * hugepages) aren't like a new one */
+        slabs_release_arena(e->slabs.mem_base, e->slabs.mem_mapped,
+                            e->slabs.nnodes == 0 &&
+                            e->config.hugepage_size == 0);
+    }
+#endif
+    free(e->slabs.nodes);
+    free(e->slabs.sizer);
 
     /* Release the freelists */
     for (jj = POWER_SMALLEST; jj <= e->slabs.power_largest; jj++) {
@@ -24,17 +24,102 @@ typedef struct {
 
     unsigned int killing;  /* index+1 of dying slab, or zero if none */
     size_t requested; /* The number of requested bytes */
+
+    /* Does it hold tiny items (see tiny_items)? Its pages never move */
+    bool tiny;
 } slabclass_t;
 
+/*
+ * The state of the slab rebalancer, which moves pages from one slab class
+ * to another (see slabs_reassign)
+ */
+struct slab_rebalance {
+   /* Signalled when there is a page to move (or we should stop) */
+   cb_cond_t cond;
+   cb_thread_t tid;
+   bool running;
+   bool shutdown;
+
+   /* The classes we're moving a page from and to (0 if we're not) */
+   unsigned int s_clsid;
+   unsigned int d_clsid;
+   /* The page we're moving, and the end of the chunks in use on it */
+   void *slab_start;
+   void *slab_end;
+   /* Is it a sparse page the defragmenter empties (see slabs_defrag) */
+   bool defrag;
+
+   /* For the automover: per class evictions at the last check */
+   unsigned int evicted_old[MAX_NUMBER_OF_SLAB_CLASSES];
+   unsigned int zero_evictions[MAX_NUMBER_OF_SLAB_CLASSES];
+   unsigned int winner;
+   unsigned int winner_count;
+
+   uint64_t slabs_moved;
+   /* The pages we gave back because we were over the mem_limit */
+   uint64_t slabs_released;
+   uint64_t rescues;
+   uint64_t evictions_nomem;
+   unsigned int busy_items;
+
+   /* The pages the defragmenter emptied, and the bytes of them */
+   uint64_t defrag_pages;
+   uint64_t defrag_bytes;
+};
+
 struct slabs {
    slabclass_t slabclass[MAX_NUMBER_OF_SLAB_CLASSES];
    size_t mem_limit;
    size_t mem_malloced;
    unsigned int power_largest;
+   /* The class large values are chunked into (0 if we don't chunk them) */
+   unsigned int chunk_clsid;
+   /* The chunk size of the largest tiny class (0 if there are none) */
+   unsigned int tiny_max;
+
+   /**
+    * With slab_sizes_auto the number of allocations of each size (in
+    * steps of CHUNK_ALIGN_BYTES up to SLABS_SIZER_MAX), which "stats
+    * slab_sizes" derives exact-fit classes from. A size always falls in
+    * the same class, so its count is only touched under the LRU lock of
+    * that class (see slabs_count_alloc).
+    */
+   uint64_t *sizer;
 
    void *mem_base;
    void *mem_current;
    size_t mem_avail;
+   /* The size of the arena if we mapped it with mmap (0 if not) */
+   size_t mem_mapped;
+   /* The size of the hugepages backing the arena (0 for regular pages) */
+   size_t mem_page_size;
+
+   /**
+    * With numa the arena is split in one slice per NUMA node, and new
+    * pages come from the slice of the node the caller runs on (or from
+    * the others when that one is used up). nnodes is 0 without numa.
+    */
+   struct slabs_node {
+      char *start;
+      size_t size;
+      void *current;
+      size_t avail;
+      /* Gets from threads on this node for items on it, and elsewhere */
+      uint64_t local_hits;
+      uint64_t remote_hits;
+   } *nodes;
+   unsigned int nnodes;
+
+   /**
+    * Without numa the pages of the arena are touched in the background
+    * (see slabs_prefault), so that we may take requests right away
+    */
+   struct {
+      struct slabs_prefault *ranges;
+      cb_thread_t *tids;
+      size_t nthreads;
+      volatile bool stop;
+   } prefault;
 
    struct {
       void **ptrs;
@@ -42,12 +127,60 @@ struct slabs {
       size_t size;
    } allocs;
 
+   struct slab_rebalance rebalance;
+
+   /* The pages of the arena the defragmenter emptied (we can't give them
+    * back), and with slab_madvise all of the pages we emptied, which the
+    * next class to want a page gets */
+   struct {
+      void **ptrs;
+      unsigned int num;
+      unsigned int size;
+      /* The pages we gave the memory of back to the OS */
+      uint64_t advised;
+   } spare;
+
    /**
-    * Access to the slab allocator is protected by this lock
+    * With restart_file the arena is a shared mapping of that file, and we
+    * leave a record of where everything was (see slabs_destroy) so that
+    * the next process may pick up the items from it (see item_restore).
+    */
+   struct {
+      int fd;
+      size_t arena;
+      /* Did we find the record of a clean shutdown? */
+      bool restored;
+      /* How far the arena moved since the last time */
+      ptrdiff_t delta;
+      /* The state of the engine when it shut down */
+      rel_time_t current_time;
+      time_t abstime;
+      rel_time_t oldest_live;
+      uint64_t oldest_cas;
+      uint64_t cas_id;
+   } restart;
+
+   /**
+    * Access to the slab allocator (and the rebalancer state) is protected
+    * by this lock
     */
    cb_mutex_t lock;
 };
 
+/* The largest allocation slab_sizes_auto counts (the larger are rare and
+ * waste little of their chunks anyway) */
+#define SLABS_SIZER_MAX 16384
+#define SLABS_SIZER_SLOTS (SLABS_SIZER_MAX / CHUNK_ALIGN_BYTES + 1)
+
+enum reassign_result_type {
+    REASSIGN_OK = 0,
+    REASSIGN_RUNNING,
+    REASSIGN_BADCLASS,
+    REASSIGN_NOSPARE,
+    REASSIGN_SRC_DST_SAME,
+    REASSIGN_DISABLED
+};
+
 
 
 
@@ -77,12 +210,95 @@ void *slabs_alloc(struct default_engine *engine, size_t size, unsigned int id);
 /** Free previously allocated object */
 void slabs_free(struct default_engine *engine, void *ptr, size_t size, unsigned int id);
 
+/**
+ * Get the number of chunks class id hands out before it has to evict,
+ * up to limit (a class which may still get a new page has got all of
+ * them)
+ */
+unsigned int slabs_free_chunks(struct default_engine *engine, unsigned int id,
+                               unsigned int limit);
+
+/**
+ * Get page number page of class id (in the order they were added), or
+ * NULL if it doesn't have that many. The pages of the tiny classes stay
+ * where they are, so the caller may look at the chunks on it after this
+ * returns.
+ */
+void *slabs_page(struct default_engine *engine, unsigned int id,
+                 unsigned int page);
+
 /** Adjust the stats for memory requested */
 void slabs_adjust_mem_requested(struct default_engine *engine, unsigned int id, size_t old, size_t ntotal);
 
+/**
+ * Move a page from class src to class dst. The items on the page are
+ * copied to other pages in src if there is memory for them, and evicted
+ * otherwise. src may be 0 to pick the class with the most pages. The move
+ * is done in the background by the rebalancer thread; this only starts it.
+ */
+enum reassign_result_type slabs_reassign(struct default_engine *engine,
+                                         unsigned int src, unsigned int dst);
+
+/**
+ * Change the most memory we may take for the pages. When it shrinks the
+ * rebalancer gives pages back (with slab_reassign) until we're below it.
+ *
+ * @return false if the memory was preallocated, so the limit can't change
+ */
+bool slabs_set_mem_limit(struct default_engine *engine, size_t limit);
+
+/**
+ * Called for every chunk of every page found in the arena at restart.
+ * Returns false if the chunk is free, and true if it is in use (with the
+ * number of bytes we should account for it in *size). This runs before
+ * any of the threads are started.
+ */
+typedef bool (*SLABS_RESTORE_FUNC)(struct default_engine *engine, void *ptr,
+                                   unsigned int id, size_t *size, void *arg);
+
+/**
+ * Rebuild the freelists of the pages found in the arena at restart
+ * @param engine handle to the storage engine
+ * @param func tells us which of the chunks are in use
+ * @param arg passed on to func
+ */
+void slabs_restore(struct default_engine *engine, SLABS_RESTORE_FUNC func,
+                   void *arg);
+
+/**
+ * Count a get of the item in ptr in the stats of the node we're on
+ * (as local if the item lives on it). Does nothing without numa.
+ */
+void slabs_numa_hit(struct default_engine *engine, const void *ptr);
+
+/** Fill buffer with the per node stats */
+void slabs_numa_stats(struct default_engine *engine, ADD_STAT add_stats,
+                      const void *c);
+
+/** Start the thread moving pages between classes (see slabs_reassign) */
+bool slabs_rebalancer_start(struct default_engine *engine);
+
+/** Stop the rebalancer thread (and wait for it to terminate) */
+void slabs_rebalancer_stop(struct default_engine *engine);
+
 /** Fill buffer with stats */ /*@null@*/
 void slabs_stats(struct default_engine *engine, ADD_STAT add_stats, const void *c);
 
+/**
+ * Count an allocation of size bytes for slab_sizes_auto. Caller must hold
+ * the LRU lock of the class it goes to.
+ */
+void slabs_count_alloc(struct default_engine *engine, size_t size);
+
+/**
+ * Report the slab_sizes derived from the allocations we counted (the
+ * sizes holding at least SLABS_SIZER_PEAK_PCT percent of them get a class
+ * that fits them exactly), and how much of the chunks we'd waste with
+ * those and with the classes we have.
+ */
+void slabs_sizes_stats(struct default_engine *engine, ADD_STAT add_stats,
+                       const void *c);
+
 void add_statistics(const void *cookie, ADD_STAT add_stats,
                     const char *prefix, int num, const char *key,
                     const char *fmt, ...);
@@ -0,0 +1,570 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <snappy-c.h>
+
+#include "default_engine.h"
+
+static EXTENSION_LOGGER_DESCRIPTOR *snapshot_logger(struct default_engine *engine)
+{
+    return (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+}
+
+/* The CRC-32 of zlib (and of ethernet) */
+static uint32_t crc_table[256];
+
+/* Called before any of the writers or loaders run */
+static void snapshot_crc_init(void) {
+    uint32_t ii;
+    int jj;
+
+    for (ii = 0; ii < 256; ++ii) {
+        uint32_t crc = ii;
+        for (jj = 0; jj < 8; ++jj) {
+            crc = (crc & 1) ? 0xedb88320U ^ (crc >> 1) : crc >> 1;
+        }
+        crc_table[ii] = crc;
+    }
+}
+
+static uint32_t snapshot_crc(const char *data, size_t len) {
+    uint32_t crc = 0xffffffffU;
+    size_t ii;
+
+    for (ii = 0; ii < len; ++ii) {
+        crc = crc_table[(crc ^ (uint8_t)data[ii]) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffffU;
+}
+
+static void put_word(char *ptr, uint32_t word) {
+    word = htonl(word);
+    memcpy(ptr, &word, sizeof(word));
+}
+
+static uint32_t get_word(const char *ptr) {
+    uint32_t word;
+    memcpy(&word, ptr, sizeof(word));
+    return ntohl(word);
+}
+
+struct snapshot_writer {
+    FILE *fp;
+    /* The records of the block we're filling */
+    char *records;
+    size_t used;
+    size_t size;
+    uint32_t count;
+    char *compressed;
+    size_t compressed_size;
+    uint64_t items;
+    uint64_t bytes;
+};
+
+static bool snapshot_write_block(struct snapshot_writer *w) {
+    char header[SNAPSHOT_BLOCK_HEADER_SIZE];
+    size_t length = snappy_max_compressed_length(w->used);
+
+    if (length > w->compressed_size) {
+        char *ptr = realloc(w->compressed, length);
+        if (ptr == NULL) {
+            return false;
+        }
+        w->compressed = ptr;
+        w->compressed_size = length;
+    }
+    if (snappy_compress(w->records, w->used, w->compressed,
+                        &length) != SNAPPY_OK) {
+        return false;
+    }
+
+    put_word(header, (uint32_t)length);
+    put_word(header + 4, (uint32_t)w->used);
+    put_word(header + 8, w->count);
+    put_word(header + 12, snapshot_crc(w->compressed, length));
+    if (fwrite(header, 1, sizeof(header), w->fp) != sizeof(header) ||
+        fwrite(w->compressed, 1, length, w->fp) != length) {
+        return false;
+    }
+
+    w->bytes += sizeof(header) + length;
+    w->used = 0;
+    w->count = 0;
+    return true;
+}
+
+/* The caller holds a reference to the item, so the value stays put */
+static bool snapshot_add_item(struct default_engine *engine,
+                              struct snapshot_writer *w,
+                              const hash_item *it) {
+    size_t need = SNAPSHOT_RECORD_HEADER_SIZE + it->nkey + it->nbytes;
+    uint32_t exptime = 0;
+    char *ptr;
+
+    if (w->used + need > w->size) {
+        size_t size = w->used + need;
+        if (size < SNAPSHOT_BLOCK_SIZE + SNAPSHOT_RECORD_HEADER_SIZE) {
+            size = SNAPSHOT_BLOCK_SIZE + SNAPSHOT_RECORD_HEADER_SIZE;
+        }
+        ptr = realloc(w->records, size);
+        if (ptr == NULL) {
+            return false;
+        }
+        w->records = ptr;
+        w->size = size;
+    }
+
+    if (it->exptime != 0) {
+        exptime = (uint32_t)engine->server.core->abstime(it->exptime);
+    }
+
+    ptr = w->records + w->used;
+    ptr[0] = (char)(it->nkey >> 8);
+    ptr[1] = (char)(it->nkey & 0xff);
+    ptr[2] = (char)it->datatype;
+    ptr[3] = 0;
+    memcpy(ptr + 4, &it->flags, sizeof(it->flags));
+    put_word(ptr + 8, exptime);
+    put_word(ptr + 12, it->nbytes);
+    ptr += SNAPSHOT_RECORD_HEADER_SIZE;
+    memcpy(ptr, item_get_key(it), it->nkey);
+    item_read_value(engine, it, ptr + it->nkey);
+
+    w->used += need;
+    w->count++;
+    w->items++;
+    return true;
+}
+
+static bool snapshot_stopping(struct snapshot *snap) {
+    bool ret;
+    cb_mutex_enter(&snap->lock);
+    ret = snap->shutdown;
+    cb_mutex_exit(&snap->lock);
+    return ret;
+}
+
+/* Walk the items into the file, returns false if we failed */
+static bool snapshot_write_items(struct default_engine *engine,
+                                 struct snapshot_writer *w) {
+    struct snapshot *snap = &engine->snapshot;
+    char header[sizeof(SNAPSHOT_MAGIC) - 1 + 4];
+    ENGINE_ERROR_CODE ret;
+    hash_item *it;
+    bool ok = true;
+
+    memcpy(header, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1);
+    put_word(header + sizeof(SNAPSHOT_MAGIC) - 1, SNAPSHOT_VERSION);
+    if (fwrite(header, 1, sizeof(header), w->fp) != sizeof(header)) {
+        return false;
+    }
+    w->bytes += sizeof(header);
+
+    ret = item_snapshot_start(engine, &snap->cursor);
+    if (ret == ENGINE_ENOMEM) {
+        return false;
+    }
+    if (ret == ENGINE_SUCCESS) {
+        while (ok && (it = item_snapshot_next(engine, &snap->cursor)) != NULL) {
+            ok = snapshot_add_item(engine, w, it);
+            item_release(engine, it);
+            if (ok && w->used >= SNAPSHOT_BLOCK_SIZE) {
+                ok = snapshot_write_block(w) && !snapshot_stopping(snap);
+            }
+        }
+        item_snapshot_stop(engine, &snap->cursor);
+    }
+
+    /* The rest of the records, and the empty block at the end */
+    return ok && (w->count == 0 || snapshot_write_block(w)) &&
+        snapshot_write_block(w);
+}
+
+static void snapshot_writer_main(void *arg) {
+    struct default_engine *engine = arg;
+    struct snapshot *snap = &engine->snapshot;
+    const char *path = engine->config.snapshot_file;
+    struct snapshot_writer w;
+    char *tmp = malloc(strlen(path) + sizeof(".tmp"));
+    bool ok = false;
+
+    memset(&w, 0, sizeof(w));
+    if (tmp != NULL) {
+        sprintf(tmp, "%s.tmp", path);
+        w.fp = fopen(tmp, "wb");
+    }
+
+    if (w.fp == NULL) {
+        snapshot_logger(engine)->log(EXTENSION_LOG_WARNING, NULL,
+                                     "Failed to create %s.tmp: %s\n",
+                                     path, strerror(errno));
+    } else {
+        ok = snapshot_write_items(engine, &w);
+        if (fclose(w.fp) != 0) {
+            ok = false;
+        }
+        if (ok) {
+#ifdef WIN32
+            /* rename doesn't replace the file */
+            remove(path);
+#endif
+            ok = rename(tmp, path) == 0;
+        }
+        if (!ok) {
+            remove(tmp);
+            snapshot_logger(engine)->log(EXTENSION_LOG_WARNING, NULL,
+                                         "Failed to write the snapshot %s\n",
+                                         path);
+        }
+    }
+
+    free(tmp);
+    free(w.records);
+    free(w.compressed);
+
+    cb_mutex_enter(&snap->lock);
+    if (ok) {
+        snap->stats.items_written += w.items;
+        snap->stats.bytes_written += w.bytes;
+    } else {
+        snap->stats.write_errors++;
+    }
+    snap->stopped = time(NULL);
+    snap->running = false;
+    cb_mutex_exit(&snap->lock);
+}
+
+ENGINE_ERROR_CODE snapshot_start(struct default_engine *engine)
+{
+    struct snapshot *snap = &engine->snapshot;
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+
+    cb_mutex_enter(&snap->lock);
+    if (snap->running || snap->shutdown) {
+        ret = ENGINE_TMPFAIL;
+    } else {
+        if (snap->joinable) {
+            /* It is done with the lock (and on its way out) */
+            cb_join_thread(snap->tid);
+            snap->joinable = false;
+        }
+        snapshot_crc_init();
+        snap->running = true;
+        snap->started = time(NULL);
+        snap->stopped = 0;
+        snap->stats.runs++;
+        if (cb_create_thread(&snap->tid, snapshot_writer_main,
+                             engine, 0) != 0) {
+            snap->running = false;
+            snap->stopped = snap->started;
+            ret = ENGINE_FAILED;
+        } else {
+            snap->joinable = true;
+        }
+    }
+    cb_mutex_exit(&snap->lock);
+
+    return ret;
+}
+
+void snapshot_destroy(struct default_engine *engine)
+{
+    struct snapshot *snap = &engine->snapshot;
+    bool joinable;
+
+    cb_mutex_enter(&snap->lock);
+    snap->shutdown = true;
+    joinable = snap->joinable;
+    snap->joinable = false;
+    cb_mutex_exit(&snap->lock);
+
+    if (joinable) {
+        cb_join_thread(snap->tid);
+    }
+}
+
+/* The loaders take turns reading the blocks and load them in parallel */
+struct snapshot_loader {
+    struct default_engine *engine;
+    FILE *fp;
+    /* Protects the file and everything below */
+    cb_mutex_t lock;
+    bool done;
+    /* The largest block we take (see snapshot_loader_main) */
+    size_t max_length;
+    uint64_t loaded;
+    uint64_t skipped;
+    uint64_t errors;
+};
+
+static bool snapshot_load_record(struct default_engine *engine,
+                                 const char *ptr) {
+    uint16_t nkey = (uint16_t)(((uint8_t)ptr[0] << 8) | (uint8_t)ptr[1]);
+    uint8_t datatype = (uint8_t)ptr[2];
+    uint32_t flags;
+    time_t exptime = get_word(ptr + 8);
+    uint32_t nbytes = get_word(ptr + 12);
+    rel_time_t rel = 0;
+    uint64_t cas = 0;
+    ENGINE_ERROR_CODE ret;
+    hash_item *it;
+
+    memcpy(&flags, ptr + 4, sizeof(flags));
+    if (exptime != 0) {
+        rel = engine->server.core->realtime(exptime);
+        if (rel <= engine->server.core->get_current_time()) {
+            return false;
+        }
+    }
+
+    ptr += SNAPSHOT_RECORD_HEADER_SIZE;
+    it = item_alloc(engine, ptr, nkey, flags, rel, nbytes, NULL, datatype);
+    if (it == NULL) {
+        return false;
+    }
+    item_write_value(engine, it, 0, ptr + nkey, nbytes);
+    ret = store_item(engine, it, &cas, OPERATION_SET, NULL);
+    item_release(engine, it);
+    return ret == ENGINE_SUCCESS;
+}
+
+/* Load the records of a block, returns false if it is corrupt */
+static bool snapshot_load_block(struct snapshot_loader *loader,
+                                const char *ptr, size_t length,
+                                uint32_t count) {
+    const char *end = ptr + length;
+    uint64_t loaded = 0;
+    uint64_t skipped = 0;
+    uint32_t ii;
+    bool ok = true;
+
+    for (ii = 0; ii < count; ++ii) {
+        size_t nkey, nbytes;
+
+        if ((size_t)(end - ptr) < SNAPSHOT_RECORD_HEADER_SIZE) {
+            ok = false;
+            break;
+        }
+        nkey = ((uint8_t)ptr[0] << 8) | (uint8_t)ptr[1];
+        nbytes = get_word(ptr + 12);
+        if ((size_t)(end - ptr) - SNAPSHOT_RECORD_HEADER_SIZE < nkey + nbytes) {
+            ok = false;
+            break;
+        }
+        if (snapshot_load_record(loader->engine, ptr)) {
+            ++loaded;
+        } else {
+            ++skipped;
+        }
+        ptr += SNAPSHOT_RECORD_HEADER_SIZE + nkey + nbytes;
+    }
+
+    cb_mutex_enter(&loader->lock);
+    loader->loaded += loaded;
+    loader->skipped += skipped;
+    cb_mutex_exit(&loader->lock);
+    return ok && ptr == end;
+}
+
+static void snapshot_loader_main(void *arg) {
+    struct snapshot_loader *loader = arg;
+    char *compressed = NULL;
+    char *records = NULL;
+    size_t compressed_size = 0;
+    size_t records_size = 0;
+
+    for (;;) {
+        char header[SNAPSHOT_BLOCK_HEADER_SIZE];
+        size_t nbytes, length;
+        uint32_t count, crc;
+        bool ok = true;
+
+        cb_mutex_enter(&loader->lock);
+        if (loader->done) {
+            cb_mutex_exit(&loader->lock);
+            break;
+        }
+        /* A file which was cut short has no empty block at the end */
+        if (fread(header, 1, sizeof(header), loader->fp) != sizeof(header)) {
+            loader->errors++;
+            loader->done = true;
+            cb_mutex_exit(&loader->lock);
+            break;
+        }
+        nbytes = get_word(header);
+        length = get_word(header + 4);
+        count = get_word(header + 8);
+        crc = get_word(header + 12);
+        if (count == 0) {
+            loader->done = true;
+            cb_mutex_exit(&loader->lock);
+            break;
+        }
+        if (length > loader->max_length ||
+            nbytes > snappy_max_compressed_length(loader->max_length)) {
+            ok = false;
+        } else if (nbytes > compressed_size) {
+            char *ptr = realloc(compressed, nbytes);
+            if (ptr == NULL) {
+                ok = false;
+            } else {
+                compressed = ptr;
+                compressed_size = nbytes;
+            }
+        }
+        if (ok && fread(compressed, 1, nbytes, loader->fp) != nbytes) {
+            ok = false;
+        }
+        if (!ok) {
+            loader->errors++;
+            loader->done = true;
+            cb_mutex_exit(&loader->lock);
+            break;
+        }
+        cb_mutex_exit(&loader->lock);
+
+        if (length > records_size) {
+            char *ptr = realloc(records, length);
+            if (ptr == NULL) {
+                ok = false;
+            } else {
+                records = ptr;
+                records_size = length;
+            }
+        }
+        if (ok) {
+            size_t ulength;
+            ok = snapshot_crc(compressed, nbytes) == crc &&
+                snappy_uncompressed_length(compressed, nbytes,
+                                           &ulength) == SNAPPY_OK &&
+                ulength == length &&
+                snappy_uncompress(compressed, nbytes, records,
+                                  &ulength) == SNAPPY_OK &&
+                snapshot_load_block(loader, records, length, count);
+        }
+        if (!ok) {
+            cb_mutex_enter(&loader->lock);
+            loader->errors++;
+            loader->done = true;
+            cb_mutex_exit(&loader->lock);
+            break;
+        }
+    }
+
+    free(compressed);
+    free(records);
+}
+
+ENGINE_ERROR_CODE snapshot_load(struct default_engine *engine)
+{
+    struct snapshot *snap = &engine->snapshot;
+    const char *path = engine->config.snapshot_file;
+    size_t nthreads = engine->config.snapshot_threads;
+    struct snapshot_loader loader;
+    char header[sizeof(SNAPSHOT_MAGIC) - 1 + 4];
+    cb_thread_t *tids;
+    size_t started = 0;
+    size_t ii;
+
+    memset(&loader, 0, sizeof(loader));
+    loader.engine = engine;
+    loader.fp = fopen(path, "rb");
+    if (loader.fp == NULL) {
+        /* Nothing to warm up from */
+        snapshot_logger(engine)->log(EXTENSION_LOG_INFO, NULL,
+                                     "Not loading the snapshot %s: %s\n",
+                                     path, strerror(errno));
+        return ENGINE_SUCCESS;
+    }
+
+    if (fread(header, 1, sizeof(header), loader.fp) != sizeof(header) ||
+        memcmp(header, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1) != 0 ||
+        get_word(header + sizeof(SNAPSHOT_MAGIC) - 1) > SNAPSHOT_VERSION) {
+        snapshot_logger(engine)->log(EXTENSION_LOG_WARNING, NULL,
+                                     "%s is not a snapshot we can read\n",
+                                     path);
+        fclose(loader.fp);
+        cb_mutex_enter(&snap->lock);
+        snap->stats.load_errors++;
+        cb_mutex_exit(&snap->lock);
+        return ENGINE_SUCCESS;
+    }
+
+    tids = calloc(nthreads, sizeof(cb_thread_t));
+    if (tids == NULL) {
+        fclose(loader.fp);
+        return ENGINE_ENOMEM;
+    }
+
+    /* A block holds a record past SNAPSHOT_BLOCK_SIZE, and the records we
+     * couldn't store anyway are no larger than an item */
+    loader.max_length = SNAPSHOT_BLOCK_SIZE + SNAPSHOT_RECORD_HEADER_SIZE +
+        UINT16_MAX + engine->config.item_size_max;
+    snapshot_crc_init();
+    cb_mutex_initialize(&loader.lock);
+    while (started < nthreads &&
+           cb_create_thread(&tids[started], snapshot_loader_main,
+                            &loader, 0) == 0) {
+        ++started;
+    }
+    if (started == 0) {
+        snapshot_loader_main(&loader);
+    }
+    for (ii = 0; ii < started; ++ii) {
+        cb_join_thread(tids[ii]);
+    }
+    cb_mutex_destroy(&loader.lock);
+    fclose(loader.fp);
+    free(tids);
+
+    snapshot_logger(engine)->log(EXTENSION_LOG_INFO, NULL,
+                                 "Loaded %"PRIu64" items from %s (skipped "
+                                 "%"PRIu64")\n", loader.loaded, path,
+                                 loader.skipped);
+    if (loader.errors != 0) {
+        snapshot_logger(engine)->log(EXTENSION_LOG_WARNING, NULL,
+                                     "The snapshot %s is corrupt or "
+                                     "truncated\n", path);
+    }
+
+    cb_mutex_enter(&snap->lock);
+    snap->stats.items_loaded += loader.loaded;
+    snap->stats.items_skipped += loader.skipped;
+    snap->stats.load_errors += loader.errors;
+    cb_mutex_exit(&snap->lock);
+    return ENGINE_SUCCESS;
+}
+
+void snapshot_stats(struct default_engine *engine, ADD_STAT add_stats,
+                    const void *c)
+{
+    struct snapshot *snap = &engine->snapshot;
+
+    cb_mutex_enter(&snap->lock);
+    add_statistics(c, add_stats, NULL, -1, "snapshot_status", "%s",
+                   snap->running ? "running" : "stopped");
+    add_statistics(c, add_stats, NULL, -1, "snapshot_runs", "%"PRIu64,
+                   snap->stats.runs);
+    if (snap->stopped != 0) {
+        add_statistics(c, add_stats, NULL, -1, "snapshot_last_run",
+                       "%"PRIu64, (uint64_t)(snap->stopped - snap->started));
+    }
+    add_statistics(c, add_stats, NULL, -1, "snapshot_items_written",
+                   "%"PRIu64, snap->stats.items_written);
+    add_statistics(c, add_stats, NULL, -1, "snapshot_bytes_written",
+                   "%"PRIu64, snap->stats.bytes_written);
+    add_statistics(c, add_stats, NULL, -1, "snapshot_write_errors",
+                   "%"PRIu64, snap->stats.write_errors);
+    add_statistics(c, add_stats, NULL, -1, "snapshot_items_loaded",
+                   "%"PRIu64, snap->stats.items_loaded);
+    add_statistics(c, add_stats, NULL, -1, "snapshot_items_skipped",
+                   "%"PRIu64, snap->stats.items_skipped);
+    add_statistics(c, add_stats, NULL, -1, "snapshot_load_errors",
+                   "%"PRIu64, snap->stats.load_errors);
+    cb_mutex_exit(&snap->lock);
+}
@@ -0,0 +1,97 @@
+/* Snapshots of the cache to warm a new one up from */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "default_engine.h"
+
+/*
+ * The snapshot command writes all of the live items to snapshot_file in
+ * the background, walking the LRUs with a cursor, and an engine started
+ * with snapshot_load reads the file back in (with snapshot_threads
+ * threads) before it takes any requests. Unlike the restart file the
+ * format doesn't depend on how the items are laid out in memory, so it
+ * survives an upgrade (and a change of the slab sizes).
+ *
+ * A file starts with SNAPSHOT_MAGIC and a 32 bit version, and the rest of
+ * it is blocks of records. A block has a header of four 32 bit words (the
+ * number of bytes of compressed data which follows it, the number of
+ * bytes it uncompresses to, the number of records in it and the CRC-32 of
+ * the compressed data), and then the records compressed with snappy. The
+ * last block has no records. A record is:
+ *
+ *     0  key length    16 bits
+ *     2  datatype       8 bits
+ *     3  (reserved)     8 bits
+ *     4  flags         32 bits (as the client gave them to us)
+ *     8  exptime       32 bits, seconds since the epoch (0 for never)
+ *    12  value length  32 bits
+ *    16  the key, and then the value (as it is stored, see the datatype)
+ *
+ * All of the numbers are in network byte order. The file is written next
+ * to snapshot_file and renamed once it is complete.
+ */
+#define SNAPSHOT_MAGIC "MCSNAPSH"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_RECORD_HEADER_SIZE 16
+#define SNAPSHOT_BLOCK_HEADER_SIZE 16
+
+/* We start a new block once the records of one take up this many bytes */
+#define SNAPSHOT_BLOCK_SIZE (1024 * 1024)
+
+struct snapshot {
+    /* Protects everything below (but not the walk and the file I/O) */
+    cb_mutex_t lock;
+    cb_thread_t tid;
+    bool running;
+    bool shutdown;
+    /* The writer thread of the last run has to be joined */
+    bool joinable;
+    hash_item cursor;
+
+    time_t started;
+    time_t stopped;
+
+    struct {
+        uint64_t runs;
+        uint64_t items_written;
+        uint64_t bytes_written;
+        uint64_t write_errors;
+        uint64_t items_loaded;
+        uint64_t items_skipped;
+        uint64_t load_errors;
+    } stats;
+};
+
+/**
+ * Start writing a snapshot in the background
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS, ENGINE_TMPFAIL if one is being written, or
+ *         ENGINE_FAILED if we couldn't start the writer
+ */
+ENGINE_ERROR_CODE snapshot_start(struct default_engine *engine);
+
+/**
+ * Load the items of the snapshot file (if there is one). A block which
+ * is corrupt ends the load, but the items before it stay.
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS unless we couldn't start the loaders
+ */
+ENGINE_ERROR_CODE snapshot_load(struct default_engine *engine);
+
+/**
+ * Stop the writer (if it runs) and wait for it. The snapshot it was
+ * writing is dropped.
+ * @param engine handle to the storage engine
+ */
+void snapshot_destroy(struct default_engine *engine);
+
+/**
+ * Add the snapshot stats
+ * @param engine handle to the storage engine
+ * @param add_stat callback for the stats
+ * @param cookie the cookie to pass on to add_stat
+ */
+void snapshot_stats(struct default_engine *engine, ADD_STAT add_stat,
+                    const void *cookie);
+
+#endif
@@ -109,6 +109,45 @@ extern "C" {
                                   const void *event_data,
                                   const void *cb_data);
 
+    static ENGINE_ERROR_CODE dcp_step(ENGINE_HANDLE* handle,
+                                      const void* cookie,
+                                      struct dcp_message_producers *producers);
+
+    static ENGINE_ERROR_CODE dcp_open(ENGINE_HANDLE* handle,
+                                      const void* cookie,
+                                      uint32_t opaque,
+                                      uint32_t seqno,
+                                      uint32_t flags,
+                                      void *name,
+                                      uint16_t nname);
+
+    static ENGINE_ERROR_CODE dcp_stream_req(ENGINE_HANDLE* handle,
+                                            const void* cookie,
+                                            uint32_t flags,
+                                            uint32_t opaque,
+                                            uint16_t vbucket,
+                                            uint64_t start_seqno,
+                                            uint64_t end_seqno,
+                                            uint64_t vbucket_uuid,
+                                            uint64_t snap_start_seqno,
+                                            uint64_t snap_end_seqno,
+                                            uint64_t *rollback_seqno,
+                                            dcp_add_failover_log callback);
+
+    static ENGINE_ERROR_CODE dcp_buffer_acknowledgement(ENGINE_HANDLE* handle,
+                                                        const void* cookie,
+                                                        uint32_t opaque,
+                                                        uint16_t vbucket,
+                                                        uint32_t buffer_bytes);
+
+    static ENGINE_ERROR_CODE dcp_control(ENGINE_HANDLE* handle,
+                                         const void* cookie,
+                                         uint32_t opaque,
+                                         const void *key,
+                                         uint16_t nkey,
+                                         const void *value,
+                                         uint32_t nvalue);
+
     static void mock_async_io_thread_main(void *arg);
     static void dispatch_notification(void *arg);
 }
@@ -126,16 +165,16 @@ public:
         key((const char*)kp, nkey), nbytes(nb), flags(fl), exptime(exp),
         cas(rand()), datatype(datatype)
     {
-        data = new char[nbytes];
+        data = new char[nbytes + FLEX_DATA_OFFSET + EXT_META_LEN];
+        *(data) = FLEX_META_CODE;
+        *(data + FLEX_DATA_OFFSET) = datatype;
     }
 
     Item(const Item &o) : key(o.key), nbytes(o.nbytes), flags(o.flags),
                           exptime(o.exptime), cas(o.cas), datatype(o.datatype)
     {
-        data = new char[nbytes + 2];
-        *(data) = FLEX_META_CODE;
-        *(data + FLEX_DATA_OFFSET) = datatype;
-        memcpy(data + FLEX_DATA_OFFSET + EXT_META_LEN, o.data, nbytes);
+        data = new char[nbytes + FLEX_DATA_OFFSET + EXT_META_LEN];
+        memcpy(data, o.data, nbytes + FLEX_DATA_OFFSET + EXT_META_LEN);
     }
 
     ~Item()
@@ -157,6 +196,10 @@ public:
         // ignored
     }
 
+    void fill(char c) {
+        memset(data + FLEX_DATA_OFFSET + EXT_META_LEN, c, nbytes);
+    }
+
     bool toItemInfo(item_info *info) const {
         info->cas = cas;
         info->exptime = exptime;
@@ -375,11 +418,17 @@ public:
                   uint32_t flags,
                   const void* userdata,
                   size_t nuserdat) :
-        cookie(c), disconnect(false), blocked(false), reserved(false)
+        cookie(c), disconnect(false), blocked(false), reserved(false),
+        mutations(0)
     {
 
     }
 
+    // The number of mutations we've sent (counting this one)
+    size_t countMutation(void) {
+        return ++mutations;
+    }
+
     void setBlocked(bool value) {
         blocked = value;
     }
@@ -420,6 +469,20 @@ private:
     bool disconnect;
     bool blocked;
     bool reserved;
+    size_t mutations;
+};
+
+// A DCP stream of the null engine (kept as the engine specific data of
+// the connection)
+struct DcpStream {
+    DcpStream() : opaque(0), vbucket(0), seqno(0), streaming(false),
+                  marker(false), ended(false) {}
+    uint32_t opaque;
+    uint16_t vbucket;
+    uint64_t seqno;
+    bool streaming;
+    bool marker;
+    bool ended;
 };
 
 class TapConnMap {
@@ -565,9 +628,20 @@ private:
     map<const void *, TapConnection*> connmap;
 };
 
+/*
+ * With null=true the engine doesn't keep anything: every get hits the
+ * same item (of value_size bytes), stores and deletes succeed right away
+ * and nothing blocks. That leaves only the cost of the server itself
+ * (parsing, dispatching and sending the responses) to measure, see the
+ * -b option of memcached_testapp. A TAP or DCP stream of it is made of
+ * that item too: it sends mutations of it (all for vbucket 0) and ends
+ * the stream.
+ */
 class MockEngine {
 public:
-    MockEngine(SERVER_HANDLE_V1 *api) : sapi(api), running(false) {
+    MockEngine(SERVER_HANDLE_V1 *api) : sapi(api), running(false),
+                                        null_engine(false), value_size(100),
+                                        mutations(1000000), null_item(NULL) {
         memset(&info, 0, sizeof(info));
         info.description = "TAP mock engine v0.1";
     }
@@ -577,6 +651,7 @@ public:
             running = false;
             cb_assert(cb_join_thread(io_thread) == 0);
         }
+        delete null_item;
     }
 
     // Method to handle the get_info engine function
@@ -584,8 +659,33 @@ public:
         return &info;
     }
 
-    ENGINE_ERROR_CODE initialize(ENGINE_HANDLE* handle, const char* ) {
+    ENGINE_ERROR_CODE initialize(ENGINE_HANDLE* handle, const char* cfg) {
         void *cookie = reinterpret_cast<void*>(this);
+
+        if (cfg != NULL) {
+            struct config_item items[4];
+            memset(items, 0, sizeof(items));
+            items[0].key = "null";
+            items[0].datatype = DT_BOOL;
+            items[0].value.dt_bool = &null_engine;
+            items[1].key = "value_size";
+            items[1].datatype = DT_SIZE;
+            items[1].value.dt_size = &value_size;
+            items[2].key = "mutations";
+            items[2].datatype = DT_SIZE;
+            items[2].value.dt_size = &mutations;
+            items[3].key = NULL;
+            if (sapi->core->parse_config(cfg, items, stderr) != 0) {
+                return ENGINE_FAILED;
+            }
+        }
+
+        if (null_engine) {
+            null_item = new Item("null", 4, value_size, 0, 0,
+                                 PROTOCOL_BINARY_RAW_BYTES);
+            null_item->fill('x');
+        }
+
         sapi->callback->register_callback(handle, ON_DISCONNECT,
                                           ::handle_disconnect, cookie);
 
@@ -628,6 +728,10 @@ public:
         //     return dispatchNotification(cookie);
         // }
 
+        if (null_engine) {
+            return ENGINE_SUCCESS;
+        }
+
         string k((const char*)key, nkey);
         if (kvstore.del(k, cas)) {
             return ENGINE_SUCCESS;
@@ -639,7 +743,9 @@ public:
     void itemRelease(const void *cookie, item* it)
     {
         Item *itm = reinterpret_cast<Item*>(it);
-        delete itm;
+        if (itm != null_item) {
+            delete itm;
+        }
     }
 
     void itemSetCas(const void *, item* itm, uint64_t val)
@@ -657,6 +763,10 @@ public:
     bool setItemInfo(const void *, item* itm, const item_info *itm_info)
     {
         Item *it = reinterpret_cast<Item*>(itm);
+        if (it == null_item) {
+            // Shared by all of the connections
+            return true;
+        }
         return it->setDataType(itm_info->datatype);
     }
 
@@ -666,6 +776,11 @@ public:
                           const int nkey,
                           uint16_t vbucket)
     {
+        if (null_engine) {
+            *itm = reinterpret_cast<item*>(null_item);
+            return ENGINE_SUCCESS;
+        }
+
         if ((rand() % 5) == 1) {
             return dispatchNotification(cookie);
         }
@@ -701,6 +816,10 @@ public:
                             ENGINE_STORE_OPERATION operation,
                             uint16_t vbucket)
     {
+        if (null_engine) {
+            return ENGINE_SUCCESS;
+        }
+
         if ((rand() % 10) == 1) {
             return dispatchNotification(cookie);
         }
@@ -718,6 +837,10 @@ public:
         //     return dispatchNotification(cookie);
         // }
 
+        if (null_engine) {
+            return ENGINE_SUCCESS;
+        }
+
         if (when == 0) {
             kvstore.flush();
             return ENGINE_SUCCESS;
@@ -783,6 +906,18 @@ public:
         *seqno = 0;
         *flags = 0;
 
+        if (null_engine) {
+            size_t sent = connection->countMutation();
+            if (sent <= mutations) {
+                *itm = reinterpret_cast<item*>(null_item);
+                *seqno = (uint32_t)sent;
+                *vbucket = 0;
+                ret = TAP_MUTATION;
+            }
+            tapconnmap.release(connection);
+            return ret;
+        }
+
         long r = rand() % 4;
         if (r < 1) {
             ret = TAP_NOOP;
@@ -795,9 +930,92 @@ public:
         return ret;
     }
 
+    ENGINE_ERROR_CODE dcpStep(const void *cookie,
+                              struct dcp_message_producers *producers)
+    {
+        DcpStream *stream;
+        ENGINE_ERROR_CODE ret;
+
+        stream = reinterpret_cast<DcpStream*>(sapi->cookie->get_engine_specific(cookie));
+        if (stream == NULL || !stream->streaming || stream->ended) {
+            return ENGINE_SUCCESS;
+        }
+
+        if (!stream->marker) {
+            ret = producers->marker(cookie, stream->opaque, stream->vbucket,
+                                    stream->seqno + 1, mutations, 1);
+            stream->marker = ret == ENGINE_SUCCESS;
+        } else if (stream->seqno < mutations) {
+            ret = producers->mutation(cookie, stream->opaque,
+                                      reinterpret_cast<item*>(null_item),
+                                      stream->vbucket, stream->seqno + 1,
+                                      stream->seqno + 1, 0, NULL, 0, 0);
+            if (ret == ENGINE_SUCCESS) {
+                ++stream->seqno;
+            }
+        } else {
+            ret = producers->stream_end(cookie, stream->opaque,
+                                        stream->vbucket, 0);
+            stream->ended = ret == ENGINE_SUCCESS;
+        }
+
+        return ret == ENGINE_SUCCESS ? ENGINE_WANT_MORE : ret;
+    }
+
+    ENGINE_ERROR_CODE dcpOpen(const void *cookie)
+    {
+        if (!null_engine) {
+            return ENGINE_ENOTSUP;
+        }
+
+        if (sapi->cookie->get_engine_specific(cookie) == NULL) {
+            sapi->cookie->store_engine_specific(cookie, new DcpStream());
+        }
+        return ENGINE_SUCCESS;
+    }
+
+    ENGINE_ERROR_CODE dcpStreamReq(const void *cookie, uint32_t opaque,
+                                   uint16_t vbucket, uint64_t start_seqno)
+    {
+        DcpStream *stream;
+
+        if (!null_engine) {
+            return ENGINE_ENOTSUP;
+        }
+
+        stream = reinterpret_cast<DcpStream*>(sapi->cookie->get_engine_specific(cookie));
+        if (stream == NULL) {
+            return ENGINE_DISCONNECT;
+        } else if (stream->streaming) {
+            return ENGINE_KEY_EEXISTS;
+        }
+
+        stream->opaque = opaque;
+        stream->vbucket = vbucket;
+        stream->seqno = start_seqno;
+        stream->streaming = true;
+        return ENGINE_SUCCESS;
+    }
+
+    ENGINE_ERROR_CODE dcpBufferAck(const void *) {
+        // The core keeps track of the window
+        return null_engine ? ENGINE_SUCCESS : ENGINE_ENOTSUP;
+    }
+
+    ENGINE_ERROR_CODE dcpControl(const void *) {
+        return null_engine ? ENGINE_SUCCESS : ENGINE_ENOTSUP;
+    }
+
     void handleDisconnect(const void *cookie, const void *event_data)
     {
         tapconnmap.setDisconnect(cookie);
+        if (null_engine) {
+            void *stream = sapi->cookie->get_engine_specific(cookie);
+            if (stream != NULL) {
+                sapi->cookie->store_engine_specific(cookie, NULL);
+                delete reinterpret_cast<DcpStream*>(stream);
+            }
+        }
     }
 
     void asyncIOThreadMain(void) {
@@ -836,11 +1054,16 @@ private:
     TapConnMap tapconnmap;
     volatile bool running;
     cb_thread_t io_thread;
+    bool null_engine;
+    size_t value_size;
+    size_t mutations;
+    Item *null_item;
 };
 
 
 struct EngineGlue {
     EngineGlue(SERVER_HANDLE_V1 *api): me(api) {
+        memset(&interface, 0, sizeof(interface));
         interface.interface.interface = 1;
         interface.get_info = get_info;
         interface.initialize = initialize;
@@ -849,6 +1072,8 @@ struct EngineGlue {
         interface.remove = item_delete;
         interface.release = item_release;
         interface.get = get;
+        interface.get_multi = NULL;
+        interface.store_multi = NULL;
         interface.get_stats = get_stats;
         interface.reset_stats = reset_stats;
         interface.store = store;
@@ -860,6 +1085,11 @@ struct EngineGlue {
         interface.item_set_cas = item_set_cas;
         interface.get_item_info = get_item_info;
         interface.set_item_info = set_item_info;
+        interface.dcp.step = dcp_step;
+        interface.dcp.open = dcp_open;
+        interface.dcp.stream_req = dcp_stream_req;
+        interface.dcp.buffer_acknowledgement = dcp_buffer_acknowledgement;
+        interface.dcp.control = dcp_control;
     }
 
     ENGINE_HANDLE_V1 interface;
@@ -1037,6 +1267,60 @@ static bool set_item_info(ENGINE_HANDLE *handle, const void *cookie,
     return getHandle(handle).setItemInfo(cookie, item, itm_info);
 }
 
+static ENGINE_ERROR_CODE dcp_step(ENGINE_HANDLE* handle, const void* cookie,
+                                  struct dcp_message_producers *producers)
+{
+    return getHandle(handle).dcpStep(cookie, producers);
+}
+
+static ENGINE_ERROR_CODE dcp_open(ENGINE_HANDLE* handle,
+                                  const void* cookie,
+                                  uint32_t opaque,
+                                  uint32_t seqno,
+                                  uint32_t flags,
+                                  void *name,
+                                  uint16_t nname)
+{
+    return getHandle(handle).dcpOpen(cookie);
+}
+
+static ENGINE_ERROR_CODE dcp_stream_req(ENGINE_HANDLE* handle,
+                                        const void* cookie,
+                                        uint32_t flags,
+                                        uint32_t opaque,
+                                        uint16_t vbucket,
+                                        uint64_t start_seqno,
+                                        uint64_t end_seqno,
+                                        uint64_t vbucket_uuid,
+                                        uint64_t snap_start_seqno,
+                                        uint64_t snap_end_seqno,
+                                        uint64_t *rollback_seqno,
+                                        dcp_add_failover_log callback)
+{
+    return getHandle(handle).dcpStreamReq(cookie, opaque, vbucket,
+                                           start_seqno);
+}
+
+static ENGINE_ERROR_CODE dcp_buffer_acknowledgement(ENGINE_HANDLE* handle,
+                                                    const void* cookie,
+                                                    uint32_t opaque,
+                                                    uint16_t vbucket,
+                                                    uint32_t buffer_bytes)
+{
+    return getHandle(handle).dcpBufferAck(cookie);
+}
+
+static ENGINE_ERROR_CODE dcp_control(ENGINE_HANDLE* handle,
+                                     const void* cookie,
+                                     uint32_t opaque,
+                                     const void *key,
+                                     uint16_t nkey,
+                                     const void *value,
+                                     uint32_t nvalue)
+{
+    return getHandle(handle).dcpControl(cookie);
+}
+
 static void handle_disconnect(const void *cookie,
                               ENGINE_EVENT_TYPE type,
                               const void *event_data,
@@ -19,6 +19,17 @@ static void logger_log(EXTENSION_LOG_LEVEL severity,
     (void)fmt;
 }
 
+static void logger_log_limited(EXTENSION_LOG_LEVEL severity,
+                               const void* client_cookie,
+                               EXTENSION_LOG_LIMIT *limit,
+                               const char *fmt, ...)
+{
+    (void)severity;
+    (void)client_cookie;
+    (void)limit;
+    (void)fmt;
+}
+
 static void logger_shutdown(void) {
     /* EMPTY */
 }
@@ -32,6 +43,7 @@ EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
     descriptor.get_name = get_name;
     descriptor.log = logger_log;
     descriptor.shutdown = logger_shutdown;
+    descriptor.log_limited = logger_log_limited;
 
 	(void)config;
     if (sapi == NULL) {
@@ -12,6 +12,7 @@
 #include <strings.h>
 #include <stdlib.h>
 #include <time.h>
+#include <snappy-c.h>
 
 #ifdef WIN32
 #include <io.h>
@@ -26,8 +27,10 @@
 
 #include <memcached/extension.h>
 #include <memcached/engine.h>
+#include <memcached/extension_loggers.h>
 
 #include "extensions/protocol_extension.h"
+#include "extensions/loggers/trace_format.h"
 
 /* Pointer to the server API */
 static SERVER_HANDLE_V1 *sapi;
@@ -50,20 +53,19 @@ static EXTENSION_LOG_LEVEL output_level = EXTENSION_LOG_WARNING;
 static size_t cyclesz = 100 * 1024 * 1024;
 
 /*
- * We're using two buffers for logging. We'll be inserting data into one,
- * while we're working on writing the other one to disk. Given that the disk
- * is way slower than our CPU, we might end up in a situation that we'll be
- * blocking the frontend threads if you're logging too much.
+ * The threads logging never touch the file (or wait for the thread which
+ * does). Every thread has a ring buffer of its own where it puts the
+ * messages, and the logger thread moves them from the rings to the buffer
+ * it writes to the file. If a thread logs faster than the logger thread
+ * empties its ring, the messages which don't fit are dropped (and counted,
+ * so that we may tell in the log how many we lost).
  */
 static struct logbuffer {
     /* Pointer to beginning of the datasegment of this buffer */
     char *data;
     /* The current offset of the buffer */
     size_t offset;
-} buffers[2];
-
-/* The index in the buffers where we're currently inserting more data */
-static int currbuffer;
+} outbuf;
 
 /* If we should try to pretty-print the severity or not */
 static bool prettyprint = false;
@@ -71,34 +73,88 @@ static bool prettyprint = false;
 /* Are we running in a unit test (don't print warnings to stderr) */
 static bool unit_test = false;
 
-/* The size of the buffers (this may be tuned by the buffersize configuration
+/* The size of the buffer (this may be tuned by the buffersize configuration
  * parameter */
 static size_t buffersz = 2048 * 1024;
 
+/* The size of the ring of each thread (this may be tuned by the ringsize
+ * configuration parameter) */
+static size_t ringsz = 1024 * 1024;
+
 /* The sleeptime between each forced flush of the buffer */
 static size_t sleeptime = 60;
 
-/* To avoid race condition we're protecting our shared resources with a
- * single mutex. */
-static cb_mutex_t mutex;
+/* The longest message we'll log (including the timestamp) */
+#define MAX_LOG_MESSAGE 2048
+
+/* The most threads which may have a ring of their own. The ones logging
+ * after that share one ring (and a mutex) */
+#define MAX_LOG_RINGS 64
 
-/* The thread performing the disk IO will be waiting for the input buffers
- * to be filled by sleeping on the following condition variable. The
- * frontend threads will notify the condition variable when the buffer is
- * > 75% full
+/* What's in the rings besides the messages */
+#define LOG_TEXT 0
+#define LOG_TRACE 1
+
+/* The messages in the rings are preceded by this header */
+struct logrecord {
+    uint32_t size;
+    uint16_t prefixlen;
+    uint16_t type;
+};
+
+/*
+ * A ring with a single producer (the thread owning it) and a single
+ * consumer (the logger thread). The producer moves the head, and the
+ * consumer the tail, so neither of them needs a lock.
  */
+struct logring {
+    /* Set when a thread takes the slot */
+    volatile int claimed;
+    /* Set when owner and data may be used */
+    volatile int ready;
+    cb_thread_t owner;
+    char *data;
+    /* The number of bytes ever put in the ring and taken out of it (the
+     * offsets into the data are these modulo ringsz) */
+    volatile size_t head;
+    volatile size_t tail;
+    /* The number of messages dropped because the ring was full, and how
+     * many of those the logger thread has told about */
+    volatile unsigned int dropped;
+    unsigned int reported;
+};
+
+/* The claimed slots are always the first ones (a thread takes the first
+ * free one) */
+static struct logring rings[MAX_LOG_RINGS];
+
+/* Used by the threads which didn't get a ring of their own */
+static struct logring shared_ring;
+static cb_mutex_t shared_mutex;
+
+/* The logger thread sleeps on the following condition variable (protected
+ * by the mutex) until it is time to empty the rings. The threads logging
+ * notify it when their ring is more than half full */
+static cb_mutex_t mutex;
 static cb_cond_t cond;
 
-/* In the "worst case scenarios" we're logging so much that the disk thread
- * can't keep up with the the frontend threads. In these rare situations
- * the frontend threads will block and wait for the flusher to free up log
- * space
+/*
+ * The request records (if we keep a trace) are collected in blocks, and
+ * every block is compressed by the logger thread before it goes to the
+ * trace file (see trace_format.h)
  */
-static cb_cond_t space_cond;
+static struct {
+    /* The records of the current block */
+    char *data;
+    int count;
+    /* Where we compress the block to (the block header first) */
+    char *compressed;
+} traceblock;
 
 /* To avoid the logs beeing flooded by the same log messages we try to
  * de-duplicate the messages and instead print out:
  *   "message repeated xxx times"
+ * (only used by the logger thread)
  */
 static struct {
     /* The last message being added to the log */
@@ -111,6 +167,45 @@ static struct {
     int offset;
 } lastlog;
 
+#ifdef WIN32
+static bool cas_int(volatile int *ptr, int old, int val) {
+    return InterlockedCompareExchange((volatile LONG *)ptr, val, old) == old;
+}
+
+static void ring_release(void) {
+    MemoryBarrier();
+}
+
+static void ring_acquire(void) {
+    MemoryBarrier();
+}
+#elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+static bool cas_int(volatile int *ptr, int old, int val) {
+    return atomic_cas_uint((volatile uint_t *)ptr, old, val) == (uint_t)old;
+}
+
+static void ring_release(void) {
+    membar_producer();
+}
+
+static void ring_acquire(void) {
+    membar_consumer();
+}
+#else
+static bool cas_int(volatile int *ptr, int old, int val) {
+    return __sync_bool_compare_and_swap(ptr, old, val);
+}
+
+static void ring_release(void) {
+    __sync_synchronize();
+}
+
+static void ring_acquire(void) {
+    __sync_synchronize();
+}
+#endif
+
 typedef void * HANDLE;
 
 static HANDLE stdio_open(const char *path, const char *mode) {
@@ -140,27 +235,89 @@ struct io_ops {
     ssize_t (*write)(HANDLE handle, const void *ptr, size_t nbytes);
 } iops;
 
-static const char *extension = "txt";
+/* A (numbered) file the logger thread writes to */
+struct logfile {
+    HANDLE fp;
+    /* The name of the files (before the number) and the extension */
+    char *name;
+    const char *extension;
+    /* What we start every file with (if anything) */
+    const char *magic;
+    /* How much we've written to the current one */
+    size_t size;
+    unsigned int next_id;
+};
+
+static struct logfile textlog = { NULL, NULL, "txt", NULL, 0, 0 };
+static struct logfile tracelog = { NULL, NULL, "trace", TRACE_FILE_MAGIC,
+                                   0, 0 };
+
+static void write_logfile(struct logfile *lf, const char *ptr,
+                          size_t towrite) {
+    if (lf->fp == NULL) {
+        return;
+    }
 
-static void do_add_log_entry(const char *msg, size_t size) {
-    /* wait until there is room in the current buffer */
-    while ((buffers[currbuffer].offset + size) >= buffersz) {
-        if (!unit_test) {
-            fprintf(stderr, "WARNING: waiting for log space to be available\n");
+    lf->size += towrite;
+    while (towrite > 0) {
+        int nw = iops.write(lf->fp, ptr, towrite);
+        if (nw > 0) {
+            ptr += nw;
+            towrite -= nw;
         }
-        cb_cond_wait(&space_cond, &mutex);
-    }
-
-    /* We could have performed the memcpy outside the locked region,
-     * but then we would need to handle the situation where we're
-     * flipping the ownership of the buffer (otherwise we could be
-     * writing rubbish to the file) */
-    memcpy(buffers[currbuffer].data + buffers[currbuffer].offset,
-           msg, size);
-    buffers[currbuffer].offset += size;
-    if (buffers[currbuffer].offset > (buffersz * 0.75)) {
-        /* we're getting full.. time get the logger to start doing stuff! */
-        cb_cond_signal(&cond);
+    }
+    iops.flush(lf->fp);
+}
+
+static void open_logfile(struct logfile *lf) {
+    char fname[1024];
+    do {
+        sprintf(fname, "%s.%d.%s", lf->name, lf->next_id++, lf->extension);
+    } while (access(fname, F_OK) == 0);
+    lf->fp = iops.open(fname, "wb");
+    lf->size = 0;
+    if (!lf->fp) {
+        fprintf(stderr, "Failed to open memcached log file\n");
+    } else if (lf->magic != NULL) {
+        write_logfile(lf, lf->magic, strlen(lf->magic));
+    }
+}
+
+static void close_logfile(struct logfile *lf) {
+    if (lf->fp) {
+        iops.close(lf->fp);
+        lf->fp = NULL;
+    }
+}
+
+static void reopen_logfile(struct logfile *lf) {
+    close_logfile(lf);
+    open_logfile(lf);
+}
+
+static void flush_pending_io(void) {
+    if (outbuf.offset > 0) {
+        write_logfile(&textlog, outbuf.data, outbuf.offset);
+        outbuf.offset = 0;
+    }
+
+    if (textlog.size > cyclesz) {
+        reopen_logfile(&textlog);
+    }
+}
+
+static void do_add_log_entry(const char *msg, size_t size) {
+    if ((outbuf.offset + size) >= buffersz) {
+        flush_pending_io();
+    }
+
+    if (size >= buffersz) {
+        /* It won't fit in the buffer at all */
+        write_logfile(&textlog, msg, size);
+        flush_pending_io();
+    } else {
+        memcpy(outbuf.data + outbuf.offset, msg, size);
+        outbuf.offset += size;
     }
 }
 
@@ -174,10 +331,15 @@ static void flush_last_log(void) {
     }
 }
 
+static void reset_last_log(void) {
+    flush_last_log();
+    lastlog.buffer[0] = '\0';
+    lastlog.count = 0;
+    lastlog.offset = 0;
+}
+
 static void add_log_entry(const char *msg, int prefixlen, size_t size)
 {
-    cb_mutex_enter(&mutex);
-
     if (size < sizeof(lastlog.buffer)) {
         if (memcmp(lastlog.buffer + lastlog.offset, msg + prefixlen, size-prefixlen) == 0) {
             ++lastlog.count;
@@ -189,14 +351,220 @@ static void add_log_entry(const char *msg, int prefixlen, size_t size)
             lastlog.count = 0;
         }
     } else {
-        flush_last_log();
-        lastlog.buffer[0] = '\0';
-        lastlog.count = 0;
-        lastlog.offset = 0;
+        reset_last_log();
         do_add_log_entry(msg, size);
     }
+}
 
-    cb_mutex_exit(&mutex);
+/* Compress the records we've got and write them to the trace file */
+static void flush_trace_block(void) {
+    size_t size = snappy_max_compressed_length(traceblock.count *
+                                               TRACE_RECORD_SIZE);
+    uint32_t word;
+
+    if (traceblock.count == 0) {
+        return;
+    }
+
+    if (snappy_compress(traceblock.data, traceblock.count * TRACE_RECORD_SIZE,
+                        traceblock.compressed + TRACE_BLOCK_HEADER_SIZE,
+                        &size) == SNAPPY_OK) {
+        word = htonl((uint32_t)size);
+        memcpy(traceblock.compressed, &word, sizeof(word));
+        word = htonl((uint32_t)traceblock.count);
+        memcpy(traceblock.compressed + sizeof(word), &word, sizeof(word));
+        write_logfile(&tracelog, traceblock.compressed,
+                      TRACE_BLOCK_HEADER_SIZE + size);
+        if (tracelog.size > cyclesz) {
+            reopen_logfile(&tracelog);
+        }
+    }
+    traceblock.count = 0;
+}
+
+static void add_trace_record(const EXTENSION_LOG_RECORD *record) {
+    char *ptr = traceblock.data + traceblock.count * TRACE_RECORD_SIZE;
+    uint64_t timestamp = htonll(record->timestamp);
+    uint32_t word;
+    uint16_t status = htons(record->status);
+    uint16_t keylen = htons(record->keylen);
+
+    memcpy(ptr, &timestamp, sizeof(timestamp));
+    word = htonl(record->latency);
+    memcpy(ptr + 8, &word, sizeof(word));
+    word = htonl(record->connection);
+    memcpy(ptr + 12, &word, sizeof(word));
+    word = htonl(record->key_hash);
+    memcpy(ptr + 16, &word, sizeof(word));
+    memcpy(ptr + 20, &status, sizeof(status));
+    ptr[22] = (char)record->opcode;
+    ptr[23] = 0;
+    word = htonl(record->value_length);
+    memcpy(ptr + 24, &word, sizeof(word));
+    memcpy(ptr + 28, &keylen, sizeof(keylen));
+    memset(ptr + 30, 0, 2);
+
+    if (++traceblock.count == TRACE_BLOCK_RECORDS) {
+        flush_trace_block();
+    }
+}
+
+static void ring_copy_in(struct logring *ring, size_t pos,
+                         const void *src, size_t size) {
+    size_t offset = pos % ringsz;
+    size_t first = ringsz - offset;
+
+    if (first > size) {
+        first = size;
+    }
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, (const char *)src + first, size - first);
+}
+
+static void ring_copy_out(struct logring *ring, size_t pos,
+                          void *dest, size_t size) {
+    size_t offset = pos % ringsz;
+    size_t first = ringsz - offset;
+
+    if (first > size) {
+        first = size;
+    }
+    memcpy(dest, ring->data + offset, first);
+    memcpy((char *)dest + first, ring->data, size - first);
+}
+
+/**
+ * Put a message in the ring (only called by the thread producing for it)
+ * @return true if the logger thread should be woken up to empty it
+ */
+static bool ring_push(struct logring *ring, uint16_t type, const char *msg,
+                      int prefixlen, size_t size) {
+    struct logrecord rec;
+    size_t head = ring->head;
+    size_t used = head - ring->tail;
+
+    if (ring->data == NULL || ringsz - used < sizeof(rec) + size) {
+        ++ring->dropped;
+        return true;
+    }
+
+    /* Don't overwrite what the logger thread is still reading */
+    ring_acquire();
+    rec.size = (uint32_t)size;
+    rec.prefixlen = (uint16_t)prefixlen;
+    rec.type = type;
+    ring_copy_in(ring, head, &rec, sizeof(rec));
+    ring_copy_in(ring, head + sizeof(rec), msg, size);
+
+    /* The message has to be in the ring before the logger may see it */
+    ring_release();
+    ring->head = head + sizeof(rec) + size;
+
+    used += sizeof(rec) + size;
+    return used > ringsz / 2 && used - sizeof(rec) - size <= ringsz / 2;
+}
+
+/* Find the ring of the calling thread (or give it one) */
+static struct logring *get_ring(void) {
+    cb_thread_t self = cb_thread_self();
+    char *data;
+    int ii;
+
+    for (ii = 0; ii < MAX_LOG_RINGS && rings[ii].claimed; ++ii) {
+        /* A thread which has exited may have had the same id, but then
+         * it doesn't produce for the ring anymore */
+        if (rings[ii].ready && cb_thread_equal(rings[ii].owner, self)) {
+            return rings + ii;
+        }
+    }
+
+    if (ii == MAX_LOG_RINGS || (data = malloc(ringsz)) == NULL) {
+        return NULL;
+    }
+
+    for (; ii < MAX_LOG_RINGS; ++ii) {
+        if (cas_int(&rings[ii].claimed, 0, 1)) {
+            rings[ii].owner = self;
+            rings[ii].data = data;
+            ring_release();
+            rings[ii].ready = 1;
+            return rings + ii;
+        }
+    }
+
+    free(data);
+    return NULL;
+}
+
+static void ring_add_log_entry(uint16_t type, const char *msg, int prefixlen,
+                               size_t size) {
+    struct logring *ring = get_ring();
+    bool notify;
+
+    if (ring != NULL) {
+        notify = ring_push(ring, type, msg, prefixlen, size);
+    } else {
+        cb_mutex_enter(&shared_mutex);
+        notify = ring_push(&shared_ring, type, msg, prefixlen, size);
+        cb_mutex_exit(&shared_mutex);
+    }
+
+    if (notify) {
+        /* It doesn't matter if the logger thread misses it, as it empties
+         * the rings at least once a second anyway */
+        cb_cond_signal(&cond);
+    }
+}
+
+/* Move the messages from the ring to the buffer (called by the logger
+ * thread) */
+static void ring_drain(struct logring *ring) {
+    char msg[MAX_LOG_MESSAGE];
+    size_t tail = ring->tail;
+    size_t head = ring->head;
+    unsigned int dropped;
+
+    ring_acquire();
+    while (tail != head) {
+        struct logrecord rec;
+        ring_copy_out(ring, tail, &rec, sizeof(rec));
+        ring_copy_out(ring, tail + sizeof(rec), msg, rec.size);
+        tail += sizeof(rec) + rec.size;
+
+        /* Let the producer have the space before we write anything */
+        ring_release();
+        ring->tail = tail;
+
+        if (rec.type == LOG_TRACE) {
+            EXTENSION_LOG_RECORD record;
+            memcpy(&record, msg, sizeof(record));
+            add_trace_record(&record);
+        } else {
+            add_log_entry(msg, (int)rec.prefixlen, rec.size);
+        }
+    }
+
+    dropped = ring->dropped;
+    if (dropped != ring->reported) {
+        char buffer[80];
+        size_t len = snprintf(buffer, sizeof(buffer),
+                              "%u messages dropped\n",
+                              dropped - ring->reported);
+        reset_last_log();
+        do_add_log_entry(buffer, len);
+        ring->reported = dropped;
+    }
+}
+
+static void drain_rings(void) {
+    int ii;
+
+    for (ii = 0; ii < MAX_LOG_RINGS && rings[ii].claimed; ++ii) {
+        if (rings[ii].ready) {
+            ring_drain(rings + ii);
+        }
+    }
+    ring_drain(&shared_ring);
 }
 
 static const char *severity2string(EXTENSION_LOG_LEVEL sev) {
@@ -214,136 +582,126 @@ static const char *severity2string(EXTENSION_LOG_LEVEL sev) {
     }
 }
 
-static void logger_log(EXTENSION_LOG_LEVEL severity,
-                       const void* client_cookie,
-                       const char *fmt, ...)
-{
-    (void)client_cookie;
-    if (severity >= current_log_level || severity >= output_level) {
-        /* @fixme: We shouldn't have to go through this temporary
-         *         buffer, but rather insert the data directly into
-         *         the destination buffer
-         */
-        char buffer[2048];
-        size_t avail = sizeof(buffer) - 1;
-        int prefixlen = 0;
-        va_list ap;
-        size_t len;
-        struct timeval now;
+static bool should_log(EXTENSION_LOG_LEVEL severity) {
+    return severity >= current_log_level || severity >= output_level;
+}
 
-        if (cb_get_timeofday(&now) == 0) {
-            struct tm tval;
-            time_t nsec = (time_t)now.tv_sec;
-            char str[40];
-            int error;
+static void logger_vlog(EXTENSION_LOG_LEVEL severity,
+                        const char *fmt, va_list ap)
+{
+    /* @fixme: We shouldn't have to go through this temporary
+     *         buffer, but rather insert the data directly into
+     *         the destination buffer
+     */
+    char buffer[MAX_LOG_MESSAGE];
+    size_t avail = sizeof(buffer) - 1;
+    int prefixlen = 0;
+    size_t len;
+    struct timeval now;
+
+    if (cb_get_timeofday(&now) == 0) {
+        struct tm tval;
+        time_t nsec = (time_t)now.tv_sec;
+        char str[40];
+        int error;
 
 #ifdef WIN32
-            localtime_s(&tval, &nsec);
-            error = (asctime_s(str, sizeof(str), &tval) != 0);
+        localtime_s(&tval, &nsec);
+        error = (asctime_s(str, sizeof(str), &tval) != 0);
 #else
-            localtime_r(&nsec, &tval);
-            error = (asctime_r(&tval, str) == NULL);
+        localtime_r(&nsec, &tval);
+        error = (asctime_r(&tval, str) == NULL);
 #endif
 
-            if (error) {
-                prefixlen = snprintf(buffer, avail, "%u.%06u",
-                                     (unsigned int)now.tv_sec,
-                                     (unsigned int)now.tv_usec);
-            } else {
-                const char *tz;
+        if (error) {
+            prefixlen = snprintf(buffer, avail, "%u.%06u",
+                                 (unsigned int)now.tv_sec,
+                                 (unsigned int)now.tv_usec);
+        } else {
+            const char *tz;
 #ifdef HAVE_TM_ZONE
-                tz = tval.tm_zone;
+            tz = tval.tm_zone;
 #else
-                tz = tzname[tval.tm_isdst ? 1 : 0];
+            tz = tzname[tval.tm_isdst ? 1 : 0];
 #endif
-                /* trim off ' YYYY\n' */
-                str[strlen(str) - 6] = '\0';
-                prefixlen = snprintf(buffer, avail, "%s.%06u %s",
-                                     str, (unsigned int)now.tv_usec,
-                                     tz);
-            }
-        } else {
-            fprintf(stderr, "gettimeofday failed: %s\n", strerror(errno));
-            return;
-        }
-
-        if (prettyprint) {
-            prefixlen += snprintf(buffer+prefixlen, avail-prefixlen,
-                                  " %s: ", severity2string(severity));
-        } else {
-            prefixlen += snprintf(buffer+prefixlen, avail-prefixlen,
-                                  " %u: ", (unsigned int)severity);
+            /* trim off ' YYYY\n' */
+            str[strlen(str) - 6] = '\0';
+            prefixlen = snprintf(buffer, avail, "%s.%06u %s",
+                                 str, (unsigned int)now.tv_usec,
+                                 tz);
         }
+    } else {
+        fprintf(stderr, "gettimeofday failed: %s\n", strerror(errno));
+        return;
+    }
 
-        avail -= prefixlen;
-        va_start(ap, fmt);
-        len = vsnprintf(buffer + prefixlen, avail, fmt, ap);
-        va_end(ap);
+    if (prettyprint) {
+        prefixlen += snprintf(buffer+prefixlen, avail-prefixlen,
+                              " %s: ", severity2string(severity));
+    } else {
+        prefixlen += snprintf(buffer+prefixlen, avail-prefixlen,
+                              " %u: ", (unsigned int)severity);
+    }
 
-        if (len < avail) {
-            len += prefixlen;
-            if (buffer[len - 1] != '\n') {
-                buffer[len++] = '\n';
-                buffer[len] ='\0';
-            }
+    avail -= prefixlen;
+    len = vsnprintf(buffer + prefixlen, avail, fmt, ap);
 
-            if (severity >= output_level) {
-                fputs(buffer, stderr);
-                fflush(stderr);
-            }
+    if (len < avail) {
+        len += prefixlen;
+        if (buffer[len - 1] != '\n') {
+            buffer[len++] = '\n';
+            buffer[len] ='\0';
+        }
 
-            if (severity >= current_log_level) {
-                add_log_entry(buffer, prefixlen, len);
-            }
-        } else {
-            fprintf(stderr, "Log message dropped... too big\n");
+        if (severity >= output_level) {
+            fputs(buffer, stderr);
+            fflush(stderr);
         }
-    }
-}
 
-static HANDLE open_logfile(const char *fnm) {
-    static unsigned int next_id = 0;
-    char fname[1024];
-    HANDLE ret;
-    do {
-        sprintf(fname, "%s.%d.%s", fnm, next_id++, extension);
-    } while (access(fname, F_OK) == 0);
-    ret = iops.open(fname, "wb");
-    if (!ret) {
-        fprintf(stderr, "Failed to open memcached log file\n");
+        if (severity >= current_log_level) {
+            ring_add_log_entry(LOG_TEXT, buffer, prefixlen, len);
+        }
+    } else {
+        fprintf(stderr, "Log message dropped... too big\n");
     }
-    return ret;
 }
 
-static void close_logfile(HANDLE fp) {
-    if (fp) {
-        iops.close(fp);
+static void logger_log(EXTENSION_LOG_LEVEL severity,
+                       const void* client_cookie,
+                       const char *fmt, ...)
+{
+    (void)client_cookie;
+    if (should_log(severity)) {
+        va_list ap;
+        va_start(ap, fmt);
+        logger_vlog(severity, fmt, ap);
+        va_end(ap);
     }
 }
 
-static HANDLE reopen_logfile(HANDLE old, const char *fnm) {
-    close_logfile(old);
-    return open_logfile(fnm);
-}
+static void logger_log_limited(EXTENSION_LOG_LEVEL severity,
+                               const void* client_cookie,
+                               EXTENSION_LOG_LIMIT *limit,
+                               const char *fmt, ...)
+{
+    uint32_t suppressed;
 
-static size_t flush_pending_io(HANDLE file, struct logbuffer *lb) {
-    size_t ret = 0;
-    if (lb->offset > 0) {
-        char *ptr = lb->data;
-        size_t towrite = ret = lb->offset;
+    if (should_log(severity) && extension_log_limit_take(limit, &suppressed)) {
+        va_list ap;
+        va_start(ap, fmt);
+        logger_vlog(severity, fmt, ap);
+        va_end(ap);
 
-        while (towrite > 0) {
-            int nw = iops.write(file, ptr, towrite);
-            if (nw > 0) {
-                ptr += nw;
-                towrite -= nw;
-            }
+        if (suppressed > 0) {
+            logger_log(severity, client_cookie,
+                       "%u similar messages suppressed", suppressed);
         }
-        lb->offset = 0;
-        iops.flush(file);
     }
+}
 
-    return ret;
+static void logger_log_record(const EXTENSION_LOG_RECORD *record)
+{
+    ring_add_log_entry(LOG_TRACE, (const char *)record, 0, sizeof(*record));
 }
 
 static volatile int run = 1;
@@ -351,58 +709,58 @@ static cb_thread_t tid;
 
 static void logger_thead_main(void* arg)
 {
-    size_t currsize = 0;
-    HANDLE fp = open_logfile(arg);
-
     struct timeval tp;
+    time_t next;
+
+    textlog.name = arg;
+    open_logfile(&textlog);
+    if (tracelog.name != NULL) {
+        open_logfile(&tracelog);
+    }
+
     cb_get_timeofday(&tp);
-    time_t next = (time_t)tp.tv_sec;
+    next = (time_t)tp.tv_sec + (time_t)sleeptime;
 
     cb_mutex_enter(&mutex);
     while (run) {
-        cb_get_timeofday(&tp);
-
-        while ((time_t)tp.tv_sec >= next  ||
-               buffers[currbuffer].offset > (buffersz * 0.75)) {
-            int this  = currbuffer;
-            next = (time_t)tp.tv_sec + 1;
-            currbuffer = (currbuffer == 0) ? 1 : 0;
-            /* Let people who is blocked for space continue */
-            cb_cond_broadcast(&space_cond);
-
-            /* Perform file IO without the lock */
-            cb_mutex_exit(&mutex);
-
-            currsize += flush_pending_io(fp, buffers + this);
-            if (currsize > cyclesz) {
-                fp = reopen_logfile(fp, arg);
-                currsize = 0;
-            }
-            cb_mutex_enter(&mutex);
-        }
+        /* Nobody waits for us while we're doing the file IO */
+        cb_mutex_exit(&mutex);
+        drain_rings();
 
         cb_get_timeofday(&tp);
-        next = (time_t)tp.tv_sec + (time_t)sleeptime;
-        if (unit_test) {
-            cb_cond_timedwait(&cond, &mutex, 100);
-        } else {
-            cb_cond_timedwait(&cond, &mutex, 1000 * sleeptime);
+        if ((time_t)tp.tv_sec >= next || outbuf.offset > (buffersz * 0.75)) {
+            flush_pending_io();
+            flush_trace_block();
+            cb_get_timeofday(&tp);
+            next = (time_t)tp.tv_sec + (time_t)sleeptime;
         }
-    }
+        cb_mutex_enter(&mutex);
 
-    if (fp) {
-        while (buffers[currbuffer].offset) {
-            int this  = currbuffer;
-            currbuffer = (currbuffer == 0) ? 1 : 0;
-            flush_pending_io(fp, buffers + this);
+        if (run) {
+            /* Don't let the rings fill up while we wait for the next
+             * flush */
+            cb_cond_timedwait(&cond, &mutex, unit_test ? 100 : 1000);
         }
-        close_logfile(fp);
     }
-
     cb_mutex_exit(&mutex);
-    free(arg);
-    free(buffers[0].data);
-    free(buffers[1].data);
+
+    drain_rings();
+    flush_last_log();
+    flush_pending_io();
+    flush_trace_block();
+    close_logfile(&textlog);
+    close_logfile(&tracelog);
+
+    free(textlog.name);
+    textlog.name = NULL;
+    free(tracelog.name);
+    tracelog.name = NULL;
+    free(outbuf.data);
+    outbuf.data = NULL;
+    free(traceblock.data);
+    traceblock.data = NULL;
+    free(traceblock.compressed);
+    traceblock.compressed = NULL;
 }
 
 static void exit_handler(void) {
@@ -437,7 +795,6 @@ static void on_log_level(const void *cookie, ENGINE_EVENT_TYPE type,
 static void logger_shutdown(void)  {
     int running;
     cb_mutex_enter(&mutex);
-    flush_last_log();
     running = run;
     run = 0;
     cb_cond_signal(&cond);
@@ -448,6 +805,20 @@ static void logger_shutdown(void)  {
     }
 }
 
+/* Free what we allocated if we fail to start the logger thread */
+static void free_logger_memory(void) {
+    free(outbuf.data);
+    outbuf.data = NULL;
+    free(shared_ring.data);
+    shared_ring.data = NULL;
+    free(traceblock.data);
+    traceblock.data = NULL;
+    free(traceblock.compressed);
+    traceblock.compressed = NULL;
+    free(tracelog.name);
+    tracelog.name = NULL;
+}
+
 MEMCACHED_PUBLIC_API
 EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
                                                      GET_SERVER_API get_server_api)
@@ -455,8 +826,8 @@ EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
     char *fname = NULL;
 
     cb_mutex_initialize(&mutex);
+    cb_mutex_initialize(&shared_mutex);
     cb_cond_initialize(&cond);
-    cb_cond_initialize(&space_cond);
 
     iops.open = stdio_open;
     iops.close = stdio_close;
@@ -465,6 +836,7 @@ EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
     descriptor.get_name = get_name;
     descriptor.log = logger_log;
     descriptor.shutdown = logger_shutdown;
+    descriptor.log_limited = logger_log_limited;
 
 #ifdef HAVE_TM_ZONE
     tzset();
@@ -477,7 +849,7 @@ EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
 
     if (config != NULL) {
         char *loglevel = NULL;
-        struct config_item items[8];
+        struct config_item items[10];
         int ii = 0;
         memset(&items, 0, sizeof(items));
 
@@ -486,6 +858,11 @@ EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
         items[ii].value.dt_string = &fname;
         ++ii;
 
+        items[ii].key = "tracefile";
+        items[ii].datatype = DT_STRING;
+        items[ii].value.dt_string = &tracelog.name;
+        ++ii;
+
         items[ii].key = "buffersize";
         items[ii].datatype = DT_SIZE;
         items[ii].value.dt_size = &buffersz;
@@ -496,6 +873,11 @@ EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
         items[ii].value.dt_size = &cyclesz;
         ++ii;
 
+        items[ii].key = "ringsize";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &ringsz;
+        ++ii;
+
         items[ii].key = "loglevel";
         items[ii].datatype = DT_STRING;
         items[ii].value.dt_string = &loglevel;
@@ -518,7 +900,7 @@ EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
 
         items[ii].key = NULL;
         ++ii;
-        cb_assert(ii == 8);
+        cb_assert(ii == 10);
 
         if (sapi->core->parse_config(config, items, stderr) != ENGINE_SUCCESS) {
             return EXTENSION_FATAL;
@@ -546,22 +928,36 @@ EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
         fname = strdup("memcached");
     }
 
-    buffers[0].data = malloc(buffersz);
-    buffers[1].data = malloc(buffersz);
+    /* A ring must hold the longest message */
+    if (ringsz < 2 * MAX_LOG_MESSAGE) {
+        ringsz = 2 * MAX_LOG_MESSAGE;
+    }
+
+    outbuf.data = malloc(buffersz);
+    outbuf.offset = 0;
+    shared_ring.data = malloc(ringsz);
+    if (tracelog.name != NULL) {
+        traceblock.data = malloc(TRACE_BLOCK_RECORDS * TRACE_RECORD_SIZE);
+        traceblock.compressed = malloc(TRACE_BLOCK_HEADER_SIZE +
+            snappy_max_compressed_length(TRACE_BLOCK_RECORDS *
+                                         TRACE_RECORD_SIZE));
+        traceblock.count = 0;
+        descriptor.log_record = logger_log_record;
+    }
 
-    if (buffers[0].data == NULL || buffers[1].data == NULL || fname == NULL) {
+    if (outbuf.data == NULL || shared_ring.data == NULL || fname == NULL ||
+        (tracelog.name != NULL &&
+         (traceblock.data == NULL || traceblock.compressed == NULL))) {
         fprintf(stderr, "Failed to allocate memory for the logger\n");
         free(fname);
-        free(buffers[0].data);
-        free(buffers[1].data);
+        free_logger_memory();
         return EXTENSION_FATAL;
     }
 
     if (cb_create_thread(&tid, logger_thead_main, fname, 0) < 0) {
         fprintf(stderr, "Failed to initialize the logger\n");
         free(fname);
-        free(buffers[0].data);
-        free(buffers[1].data);
+        free_logger_memory();
         return EXTENSION_FATAL;
     }
     atexit(exit_handler);
@@ -0,0 +1,39 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+/*
+ * The files of request traces the file logger writes (the records given
+ * to log_record in EXTENSION_LOGGER_DESCRIPTOR), which mctrace reads.
+ *
+ * A file starts with TRACE_FILE_MAGIC, and the rest of it is blocks of
+ * records. A block has a header of two 32 bit words (the number of bytes
+ * of compressed data which follows it, and the number of records in it),
+ * and then the records compressed with snappy. A record is
+ * TRACE_RECORD_SIZE bytes:
+ *
+ *     0  timestamp    64 bits, us since the epoch the response was ready
+ *     8  latency      32 bits, us
+ *    12  connection   32 bits
+ *    16  key hash     32 bits
+ *    20  status       16 bits
+ *    22  opcode        8 bits
+ *    23  (reserved)    8 bits
+ *    24  value length 32 bits
+ *    28  key length   16 bits
+ *    30  (reserved)   16 bits
+ *
+ * All of the numbers are in network byte order. The files of the older
+ * loggers (TRACE_FILE_MAGIC_V1) have the records without the lengths, of
+ * TRACE_RECORD_SIZE_V1 bytes.
+ */
+#define TRACE_FILE_MAGIC "MCTRACE2"
+#define TRACE_RECORD_SIZE 32
+#define TRACE_FILE_MAGIC_V1 "MCTRACE1"
+#define TRACE_RECORD_SIZE_V1 24
+#define TRACE_BLOCK_HEADER_SIZE 8
+
+/* The most records the logger puts in a block */
+#define TRACE_BLOCK_RECORDS 4096
+
+#endif
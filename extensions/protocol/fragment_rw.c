@@ -5,6 +5,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <inttypes.h>
+#include <limits.h>
 
 #include "extensions/protocol_extension.h"
 #include <memcached/util.h>
@@ -41,6 +42,65 @@ static void setup(void (*add)(EXTENSION_BINARY_PROTOCOL_DESCRIPTOR *descriptor,
     add(&descriptor, write_command, handle_fragment_rw);
 }
 
+/* Room for the value of an item in more than one piece (a chunked one) */
+typedef union {
+    item_info info;
+    char bytes[sizeof(item_info) + ((IOV_MAX - 1) * sizeof(struct iovec))];
+} item_info_holder;
+
+/* Skip to the piece of the value holding the byte at *offset */
+static int find_piece(const item_info *info, uint64_t *offset) {
+    int ii = 0;
+    while (ii < info->nvalue && *offset >= info->value[ii].iov_len) {
+        *offset -= info->value[ii].iov_len;
+        ++ii;
+    }
+    return ii;
+}
+
+/*
+ * Copy len bytes from the value described by src (starting at soff) to
+ * the value described by dest (starting at doff), piece by piece
+ */
+static void copy_value(item_info *dest, uint64_t doff,
+                       const item_info *src, uint64_t soff, uint64_t len) {
+    int di = find_piece(dest, &doff);
+    int si = find_piece(src, &soff);
+
+    while (len > 0 && di < dest->nvalue && si < src->nvalue) {
+        uint64_t n = dest->value[di].iov_len - doff;
+        if (n > src->value[si].iov_len - soff) {
+            n = src->value[si].iov_len - soff;
+        }
+        if (n > len) {
+            n = len;
+        }
+        memcpy((uint8_t*)dest->value[di].iov_base + doff,
+               (const uint8_t*)src->value[si].iov_base + soff, (size_t)n);
+        len -= n;
+        if ((doff += n) == dest->value[di].iov_len) {
+            doff = 0;
+            ++di;
+        }
+        if ((soff += n) == src->value[si].iov_len) {
+            soff = 0;
+            ++si;
+        }
+    }
+}
+
+/* Describe a buffer as a value in one piece */
+static void buffer_info(item_info *info, const void *buffer, uint64_t len) {
+    info->nvalue = 1;
+    info->value[0].iov_base = (void*)buffer;
+    info->value[0].iov_len = (size_t)len;
+}
+
+/*
+ * Store a copy of the item with the range replaced, for when the engine
+ * can't patch it where it is. Only the parts of the value around the
+ * range are copied over from the old item.
+ */
 static ENGINE_ERROR_CODE create_object(ENGINE_HANDLE_V1 *v1,
                                        ENGINE_HANDLE *v,
                                        const void *cookie,
@@ -54,8 +114,9 @@ static ENGINE_ERROR_CODE create_object(ENGINE_HANDLE_V1 *v1,
 {
     ENGINE_ERROR_CODE r;
     item *item = NULL;
-    item_info i2;
-    uint8_t *dest;
+    item_info_holder i2;
+    item_info patch;
+    uint64_t end = offset + len;
 
     r = v1->allocate(v, cookie, &item, org->key, org->nkey, org->nbytes,
                      org->flags, vbucket, datatype);
@@ -63,16 +124,16 @@ static ENGINE_ERROR_CODE create_object(ENGINE_HANDLE_V1 *v1,
         return r;
     }
 
-    i2.nvalue = 1;
-
-    if (!v1->get_item_info(v, cookie, item, &i2)) {
+    i2.info.nvalue = IOV_MAX;
+    if (!v1->get_item_info(v, cookie, item, &i2.info)) {
         v1->release(v, cookie, item);
         return ENGINE_DISCONNECT;
     }
 
-    dest = (void*)i2.value[0].iov_base;
-    memcpy(dest, org->value[0].iov_base, org->nbytes);
-    memcpy(dest + offset, data, len);
+    buffer_info(&patch, data, len);
+    copy_value(&i2.info, 0, org, 0, offset);
+    copy_value(&i2.info, offset, &patch, 0, len);
+    copy_value(&i2.info, end, org, end, org->nbytes - end);
 
     v1->item_set_cas(v, cookie, item, org->cas);
     r = v1->store(v, cookie, item, cas, OPERATION_CAS, vbucket);
@@ -80,6 +141,79 @@ static ENGINE_ERROR_CODE create_object(ENGINE_HANDLE_V1 *v1,
     return r;
 }
 
+/*
+ * Send the range of the value of the item. The server sends it from the
+ * item if it can (and then releases the item), else we copy it into the
+ * response. Returns true if the item was handed over to the server.
+ */
+static bool send_range(const void *cookie, item *item,
+                       const item_info *info, uint64_t offset,
+                       uint64_t len, ADD_RESPONSE response,
+                       ENGINE_ERROR_CODE *r)
+{
+    SERVER_HANDLE_V1 *server = server_api();
+    item_info range;
+    uint8_t *buffer = NULL;
+    const void *ptr;
+    bool ok;
+
+    if (server->cookie->send_item_response != NULL &&
+        server->cookie->send_item_response(cookie, item, offset,
+                                           (uint32_t)len, info->cas)) {
+        return true;
+    }
+
+    if (info->nvalue == 1) {
+        ptr = (uint8_t*)info->value[0].iov_base + offset;
+    } else if ((buffer = malloc(len ? (size_t)len : 1)) == NULL) {
+        *r = ENGINE_ENOMEM;
+        return false;
+    } else {
+        buffer_info(&range, buffer, len);
+        copy_value(&range, 0, info, offset, len);
+        ptr = buffer;
+    }
+
+    ok = response(NULL, 0, NULL, 0, ptr, (uint32_t)len,
+                  PROTOCOL_BINARY_RAW_BYTES,
+                  PROTOCOL_BINARY_RESPONSE_SUCCESS, info->cas, cookie);
+    free(buffer);
+    if (!ok) {
+        *r = ENGINE_DISCONNECT;
+    }
+    return false;
+}
+
+/* Let the server know that we've changed the item */
+static void item_changed(const void *key, uint16_t nkey) {
+    SERVER_HANDLE_V1 *server = server_api();
+    if (server->core->item_changed != NULL) {
+        server->core->item_changed(key, nkey);
+    }
+}
+
+/*
+ * Write the range with the patch call of the engine. Returns
+ * ENGINE_ENOTSUP if the engine can't, and the item has to be copied.
+ */
+static ENGINE_ERROR_CODE patch_object(ENGINE_HANDLE_V1 *v1,
+                                      ENGINE_HANDLE *handle,
+                                      const void *cookie,
+                                      const void *key,
+                                      uint16_t nkey,
+                                      uint16_t vbucket,
+                                      const void *data,
+                                      uint64_t offset,
+                                      uint64_t len,
+                                      uint64_t *cas)
+{
+    if (v1->patch == NULL) {
+        return ENGINE_ENOTSUP;
+    }
+    return v1->patch(handle, cookie, key, nkey, offset, data, (uint32_t)len,
+                     cas, vbucket);
+}
+
 static ENGINE_ERROR_CODE handle_fragment_rw(EXTENSION_BINARY_PROTOCOL_DESCRIPTOR *descriptor,
                                             ENGINE_HANDLE* handle,
                                             const void* cookie,
@@ -114,39 +248,56 @@ static ENGINE_ERROR_CODE handle_fragment_rw(EXTENSION_BINARY_PROTOCOL_DESCRIPTOR
     item = NULL;
     data = key + nkey;
 
+    /* The engine checks the CAS and the range itself when it patches */
+    if (request->request.opcode != read_command &&
+        request->request.datatype == PROTOCOL_BINARY_RAW_BYTES) {
+        r = patch_object(v1, handle, cookie, key, nkey, vbucket, data,
+                         offset, len, &cas);
+        if (r == ENGINE_SUCCESS) {
+            item_changed(key, nkey);
+            if (!response(NULL, 0, NULL, 0, NULL, 0,
+                          PROTOCOL_BINARY_RAW_BYTES,
+                          PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                          cas, cookie)) {
+                return ENGINE_DISCONNECT;
+            }
+            return r;
+        } else if (r != ENGINE_ENOTSUP) {
+            return r;
+        }
+    }
+
     r = v1->get(handle, cookie, &item, key, nkey, vbucket);
     if (r == ENGINE_SUCCESS) {
-        item_info item_info;
-        item_info.nvalue = 1;
+        item_info_holder info;
+        info.info.nvalue = IOV_MAX;
 
-        if (!v1->get_item_info(handle, NULL, item, &item_info)) {
+        if (!v1->get_item_info(handle, NULL, item, &info.info)) {
             r = ENGINE_FAILED;
-        } else if (cas != 0 && item_info.cas != cas) {
+        } else if (cas != 0 && info.info.cas != cas) {
             r = ENGINE_KEY_EEXISTS;
-        } else if (offset + len > (uint64_t)item_info.nbytes) {
+        } else if (offset + len > (uint64_t)info.info.nbytes) {
             r = ENGINE_ERANGE;
         }
 
         if (r == ENGINE_SUCCESS) {
             if (request->request.opcode == read_command) {
-                uint8_t *ptr;
-                ptr =  ((uint8_t*)item_info.value[0].iov_base) + offset;
-                if (!response(NULL, 0, NULL, 0, ptr,
-                              (uint32_t)len, PROTOCOL_BINARY_RAW_BYTES,
-                              PROTOCOL_BINARY_RESPONSE_SUCCESS,
-                              item_info.cas, cookie)) {
-                    return ENGINE_DISCONNECT;
+                if (send_range(cookie, item, &info.info, offset, len,
+                               response, &r)) {
+                    /* The server releases it once it is sent */
+                    return ENGINE_SUCCESS;
                 }
             } else {
-                r = create_object(v1, handle, cookie, &item_info,
+                r = create_object(v1, handle, cookie, &info.info,
                                   vbucket, data, offset, len, &cas,
                                   request->request.datatype);
                 if (r == ENGINE_SUCCESS) {
+                    item_changed(key, nkey);
                     if (!response(NULL, 0, NULL, 0, NULL, 0,
                                   PROTOCOL_BINARY_RAW_BYTES,
                                   PROTOCOL_BINARY_RESPONSE_SUCCESS,
                                   cas, cookie)) {
-                        return ENGINE_DISCONNECT;
+                        r = ENGINE_DISCONNECT;
                     }
                 }
             }
@@ -0,0 +1,584 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * A command which carries many small operations of different kinds in
+ * one packet (see multi_ops.h), so that a client doing a handful of gets,
+ * sets and incrs for a request sends one packet and gets one back rather
+ * than pipelining quiet commands. The gets and the stores next to each
+ * other are given to the engine in one go with get_multi and store_multi
+ * when it has them.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include "extensions/protocol_extension.h"
+#include <memcached/util.h>
+#include <platform/platform.h>
+#include "multi_ops.h"
+
+/* The most operations we give the engine in one go */
+#define MULTI_OPS_BATCH 64
+
+static uint8_t multi_command = PROTOCOL_BINARY_CMD_MULTI_OPS;
+
+static GET_SERVER_API server_api;
+
+static EXTENSION_BINARY_PROTOCOL_DESCRIPTOR descriptor;
+
+typedef union {
+    item_info info;
+    char bytes[sizeof(item_info) + ((IOV_MAX - 1) * sizeof(struct iovec))];
+} item_info_holder;
+
+/* An operation of the request, with the numbers in host byte order */
+struct multi_op {
+    uint8_t opcode;
+    uint8_t datatype;
+    uint16_t vbucket;
+    uint32_t flags; /* as it is sent over the network */
+    uint32_t expiration;
+    uint64_t cas;
+    const uint8_t *key;
+    uint16_t nkey;
+    const uint8_t *value;
+    uint32_t nvalue;
+};
+
+/* The body of the response */
+struct multi_response {
+    uint8_t *data;
+    size_t size;
+    size_t used;
+};
+
+static const char *get_name(void) {
+    return "multi operation";
+}
+
+static void item_changed(const struct multi_op *op) {
+    SERVER_HANDLE_V1 *server = server_api();
+    if (server->core->item_changed != NULL) {
+        server->core->item_changed(op->key, op->nkey);
+    }
+}
+
+static protocol_binary_response_status to_status(ENGINE_ERROR_CODE r,
+                                                 uint8_t opcode) {
+    switch (r) {
+    case ENGINE_SUCCESS:
+        return PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    case ENGINE_KEY_ENOENT:
+        return PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+    case ENGINE_KEY_EEXISTS:
+        return PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
+    case ENGINE_ENOMEM:
+        return PROTOCOL_BINARY_RESPONSE_ENOMEM;
+    case ENGINE_EWOULDBLOCK:
+        /* We can't wait in the middle of the batch (get_multi doesn't
+         * block, so only engines without it get here) */
+    case ENGINE_TMPFAIL:
+        return PROTOCOL_BINARY_RESPONSE_ETMPFAIL;
+    case ENGINE_NOT_STORED:
+        /* As the server responds to an ADD or a REPLACE */
+        if (opcode == PROTOCOL_BINARY_CMD_ADD) {
+            return PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
+        } else if (opcode == PROTOCOL_BINARY_CMD_REPLACE) {
+            return PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+        }
+        return PROTOCOL_BINARY_RESPONSE_NOT_STORED;
+    case ENGINE_EINVAL:
+        if (opcode == PROTOCOL_BINARY_CMD_INCREMENT ||
+            opcode == PROTOCOL_BINARY_CMD_DECREMENT) {
+            return PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL;
+        }
+        return PROTOCOL_BINARY_RESPONSE_EINVAL;
+    case ENGINE_ENOTSUP:
+        return PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED;
+    case ENGINE_E2BIG:
+        return PROTOCOL_BINARY_RESPONSE_E2BIG;
+    case ENGINE_NOT_MY_VBUCKET:
+        return PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET;
+    case ENGINE_ERANGE:
+        return PROTOCOL_BINARY_RESPONSE_ERANGE;
+    default:
+        return PROTOCOL_BINARY_RESPONSE_EINTERNAL;
+    }
+}
+
+/**
+ * Make room for the given number of bytes at the end of the response
+ * @return where to put them, or NULL if we're out of memory
+ */
+static uint8_t *response_grow(struct multi_response *rsp, size_t nbytes) {
+    uint8_t *ret;
+
+    if (rsp->used + nbytes > rsp->size) {
+        size_t size = rsp->size ? rsp->size : 1024;
+        uint8_t *ptr;
+        while (size < rsp->used + nbytes) {
+            size *= 2;
+        }
+        if ((ptr = realloc(rsp->data, size)) == NULL) {
+            return NULL;
+        }
+        rsp->data = ptr;
+        rsp->size = size;
+    }
+    ret = rsp->data + rsp->used;
+    rsp->used += nbytes;
+    return ret;
+}
+
+/**
+ * Add the result of an operation to the response, and make room for its
+ * value
+ * @return where to put the value, or NULL if we're out of memory
+ */
+static uint8_t *add_result(struct multi_response *rsp,
+                           const struct multi_op *op, ENGINE_ERROR_CODE r,
+                           uint8_t datatype, uint32_t flags, uint64_t cas,
+                           uint32_t nvalue) {
+    protocol_binary_multi_result res;
+    uint8_t *ptr = response_grow(rsp, sizeof(res.bytes) + nvalue);
+
+    if (ptr == NULL) {
+        return NULL;
+    }
+    memset(&res, 0, sizeof(res));
+    res.result.opcode = op->opcode;
+    res.result.datatype = datatype;
+    res.result.status = htons(to_status(r, op->opcode));
+    res.result.vallen = htonl(nvalue);
+    res.result.flags = flags;
+    res.result.cas = htonll(cas);
+    memcpy(ptr, res.bytes, sizeof(res.bytes));
+    return ptr + sizeof(res.bytes);
+}
+
+/**
+ * Add the result of a get (and the value of the item) to the response
+ * @return false if we're out of memory
+ */
+static bool add_get_result(ENGINE_HANDLE_V1 *v1, ENGINE_HANDLE *handle,
+                           const void *cookie, struct multi_response *rsp,
+                           const struct multi_op *op, ENGINE_ERROR_CODE r,
+                           item *it) {
+    item_info_holder info;
+    uint8_t *ptr;
+    int ii;
+
+    if (r == ENGINE_SUCCESS) {
+        info.info.nvalue = IOV_MAX;
+        if (!v1->get_item_info(handle, cookie, it, &info.info)) {
+            r = ENGINE_FAILED;
+        }
+    }
+    if (r != ENGINE_SUCCESS) {
+        return add_result(rsp, op, r, PROTOCOL_BINARY_RAW_BYTES, 0, 0,
+                          0) != NULL;
+    }
+
+    ptr = add_result(rsp, op, r, info.info.datatype, info.info.flags,
+                     info.info.cas, info.info.nbytes);
+    if (ptr == NULL) {
+        return false;
+    }
+    for (ii = 0; ii < info.info.nvalue; ++ii) {
+        memcpy(ptr, info.info.value[ii].iov_base,
+               info.info.value[ii].iov_len);
+        ptr += info.info.value[ii].iov_len;
+    }
+    return true;
+}
+
+/**
+ * Run a batch of gets
+ * @return ENGINE_SUCCESS, ENGINE_ENOMEM or ENGINE_DISCONNECT
+ */
+static ENGINE_ERROR_CODE run_gets(ENGINE_HANDLE_V1 *v1, ENGINE_HANDLE *handle,
+                                  const void *cookie,
+                                  const struct multi_op *ops, int num,
+                                  struct multi_response *rsp) {
+    engine_key_t keys[MULTI_OPS_BATCH];
+    item *items[MULTI_OPS_BATCH];
+    ENGINE_ERROR_CODE status[MULTI_OPS_BATCH];
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    bool batched = false;
+    int ii;
+
+    if (num > 1 && v1->get_multi != NULL) {
+        for (ii = 0; ii < num; ++ii) {
+            keys[ii].key = ops[ii].key;
+            keys[ii].nkey = ops[ii].nkey;
+            keys[ii].vbucket = ops[ii].vbucket;
+        }
+        batched = v1->get_multi(handle, cookie, keys, num, items,
+                                status) == ENGINE_SUCCESS;
+    }
+
+    for (ii = 0; ii < num; ++ii) {
+        if (!batched) {
+            items[ii] = NULL;
+            status[ii] = v1->get(handle, cookie, &items[ii], ops[ii].key,
+                                 ops[ii].nkey, ops[ii].vbucket);
+        }
+        if (status[ii] == ENGINE_DISCONNECT) {
+            ret = ENGINE_DISCONNECT;
+        } else if (ret == ENGINE_SUCCESS &&
+                   !add_get_result(v1, handle, cookie, rsp, &ops[ii],
+                                   status[ii], items[ii])) {
+            ret = ENGINE_ENOMEM;
+        }
+        if (status[ii] == ENGINE_SUCCESS && items[ii] != NULL) {
+            v1->release(handle, cookie, items[ii]);
+        }
+    }
+
+    return ret;
+}
+
+static ENGINE_STORE_OPERATION store_operation(const struct multi_op *op) {
+    if (op->cas != 0) {
+        return OPERATION_CAS;
+    } else if (op->opcode == PROTOCOL_BINARY_CMD_ADD) {
+        return OPERATION_ADD;
+    } else if (op->opcode == PROTOCOL_BINARY_CMD_REPLACE) {
+        return OPERATION_REPLACE;
+    }
+    return OPERATION_SET;
+}
+
+/* Allocate and store one item (for engines without store_multi) */
+static ENGINE_ERROR_CODE store_one(ENGINE_HANDLE_V1 *v1, ENGINE_HANDLE *handle,
+                                   const void *cookie,
+                                   const struct multi_op *op, uint64_t *cas) {
+    item_info_holder info;
+    item *it = NULL;
+    ENGINE_ERROR_CODE r;
+    const uint8_t *src = op->value;
+    int ii;
+
+    r = v1->allocate(handle, cookie, &it, op->key, op->nkey, op->nvalue,
+                     op->flags, op->expiration, op->datatype);
+    if (r != ENGINE_SUCCESS) {
+        return r;
+    }
+
+    info.info.nvalue = IOV_MAX;
+    if (!v1->get_item_info(handle, cookie, it, &info.info)) {
+        v1->release(handle, cookie, it);
+        return ENGINE_FAILED;
+    }
+    for (ii = 0; ii < info.info.nvalue; ++ii) {
+        memcpy(info.info.value[ii].iov_base, src,
+               info.info.value[ii].iov_len);
+        src += info.info.value[ii].iov_len;
+    }
+
+    v1->item_set_cas(handle, cookie, it, op->cas);
+    r = v1->store(handle, cookie, it, cas, store_operation(op), op->vbucket);
+    v1->release(handle, cookie, it);
+    return r;
+}
+
+/**
+ * Run a batch of stores
+ * @return ENGINE_SUCCESS, ENGINE_ENOMEM or ENGINE_DISCONNECT
+ */
+static ENGINE_ERROR_CODE run_stores(ENGINE_HANDLE_V1 *v1,
+                                    ENGINE_HANDLE *handle,
+                                    const void *cookie,
+                                    const struct multi_op *ops, int num,
+                                    struct multi_response *rsp) {
+    engine_store_t reqs[MULTI_OPS_BATCH];
+    uint64_t cas[MULTI_OPS_BATCH];
+    ENGINE_ERROR_CODE status[MULTI_OPS_BATCH];
+    bool batched = false;
+    int ii;
+
+    if (num > 1 && v1->store_multi != NULL) {
+        for (ii = 0; ii < num; ++ii) {
+            reqs[ii].key = ops[ii].key;
+            reqs[ii].nkey = ops[ii].nkey;
+            reqs[ii].vbucket = ops[ii].vbucket;
+            reqs[ii].value = ops[ii].value;
+            reqs[ii].nvalue = ops[ii].nvalue;
+            reqs[ii].flags = ops[ii].flags;
+            reqs[ii].exptime = ops[ii].expiration;
+            reqs[ii].datatype = ops[ii].datatype;
+            reqs[ii].operation = store_operation(&ops[ii]);
+            reqs[ii].cas = ops[ii].cas;
+        }
+        batched = v1->store_multi(handle, cookie, reqs, num, cas,
+                                  status) == ENGINE_SUCCESS;
+    }
+
+    for (ii = 0; ii < num; ++ii) {
+        /* The engine leaves the ones from a vbucket it doesn't own (and
+         * the ones after it) to us */
+        if (!batched || status[ii] == ENGINE_NOT_MY_VBUCKET) {
+            cas[ii] = 0;
+            status[ii] = store_one(v1, handle, cookie, &ops[ii], &cas[ii]);
+        }
+        if (status[ii] == ENGINE_DISCONNECT) {
+            return ENGINE_DISCONNECT;
+        }
+        if (status[ii] == ENGINE_SUCCESS) {
+            item_changed(&ops[ii]);
+        } else {
+            cas[ii] = 0;
+        }
+        if (add_result(rsp, &ops[ii], status[ii], PROTOCOL_BINARY_RAW_BYTES,
+                       0, cas[ii], 0) == NULL) {
+            return ENGINE_ENOMEM;
+        }
+    }
+
+    return ENGINE_SUCCESS;
+}
+
+/**
+ * Run a delete, incr or decr
+ * @return ENGINE_SUCCESS, ENGINE_ENOMEM or ENGINE_DISCONNECT
+ */
+static ENGINE_ERROR_CODE run_one(ENGINE_HANDLE_V1 *v1, ENGINE_HANDLE *handle,
+                                 const void *cookie,
+                                 const struct multi_op *op,
+                                 struct multi_response *rsp) {
+    ENGINE_ERROR_CODE r;
+    uint64_t cas = op->cas;
+    uint64_t delta, initial, result;
+    uint8_t *ptr;
+
+    if (op->opcode == PROTOCOL_BINARY_CMD_DELETE) {
+        r = v1->remove(handle, cookie, op->key, op->nkey, &cas, op->vbucket);
+        if (r == ENGINE_DISCONNECT) {
+            return r;
+        } else if (r == ENGINE_SUCCESS) {
+            item_changed(op);
+        } else {
+            cas = 0;
+        }
+        ptr = add_result(rsp, op, r, PROTOCOL_BINARY_RAW_BYTES, 0, cas, 0);
+        return ptr == NULL ? ENGINE_ENOMEM : ENGINE_SUCCESS;
+    }
+
+    memcpy(&delta, op->value, sizeof(delta));
+    memcpy(&initial, op->value + sizeof(delta), sizeof(initial));
+    cas = 0;
+    r = v1->arithmetic(handle, cookie, op->key, op->nkey,
+                       op->opcode == PROTOCOL_BINARY_CMD_INCREMENT,
+                       op->expiration != 0xffffffff, ntohll(delta),
+                       ntohll(initial), op->expiration, &cas,
+                       PROTOCOL_BINARY_RAW_BYTES, &result, op->vbucket);
+    if (r == ENGINE_DISCONNECT) {
+        return r;
+    } else if (r != ENGINE_SUCCESS) {
+        ptr = add_result(rsp, op, r, PROTOCOL_BINARY_RAW_BYTES, 0, 0, 0);
+        return ptr == NULL ? ENGINE_ENOMEM : ENGINE_SUCCESS;
+    }
+
+    item_changed(op);
+    if ((ptr = add_result(rsp, op, r, PROTOCOL_BINARY_RAW_BYTES, 0, cas,
+                          sizeof(result))) == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    result = htonll(result);
+    memcpy(ptr, &result, sizeof(result));
+    return ENGINE_SUCCESS;
+}
+
+static bool is_store(uint8_t opcode) {
+    return opcode == PROTOCOL_BINARY_CMD_SET ||
+        opcode == PROTOCOL_BINARY_CMD_ADD ||
+        opcode == PROTOCOL_BINARY_CMD_REPLACE;
+}
+
+/**
+ * Split the body of the request into the operations
+ * @return the number of operations, or -1 if the body is malformed
+ */
+static int parse_ops(const uint8_t *body, size_t nbody,
+                     struct multi_op *ops) {
+    int num = 0;
+
+    while (nbody > 0) {
+        protocol_binary_multi_op op;
+        size_t len;
+
+        if (nbody < sizeof(op.bytes)) {
+            return -1;
+        }
+        memcpy(op.bytes, body, sizeof(op.bytes));
+        body += sizeof(op.bytes);
+        nbody -= sizeof(op.bytes);
+
+        len = (size_t)ntohs(op.op.keylen) + ntohl(op.op.vallen);
+        if (op.op.keylen == 0 || len > nbody) {
+            return -1;
+        }
+
+        if (ops != NULL) {
+            struct multi_op *o = &ops[num];
+            o->opcode = op.op.opcode;
+            o->datatype = op.op.datatype;
+            o->vbucket = ntohs(op.op.vbucket);
+            o->flags = op.op.flags;
+            o->expiration = ntohl(op.op.expiration);
+            o->cas = ntohll(op.op.cas);
+            o->key = body;
+            o->nkey = ntohs(op.op.keylen);
+            o->value = body + o->nkey;
+            o->nvalue = ntohl(op.op.vallen);
+        }
+        body += len;
+        nbody -= len;
+        ++num;
+    }
+
+    return num;
+}
+
+/* Check that the operation makes sense */
+static ENGINE_ERROR_CODE validate_op(const struct multi_op *op) {
+    switch (op->opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_DELETE:
+        return op->nvalue == 0 ? ENGINE_SUCCESS : ENGINE_EINVAL;
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+        return op->nvalue == 16 ? ENGINE_SUCCESS : ENGINE_EINVAL;
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+        return ENGINE_SUCCESS;
+    default:
+        return ENGINE_ENOTSUP;
+    }
+}
+
+static ENGINE_ERROR_CODE run_ops(ENGINE_HANDLE_V1 *v1, ENGINE_HANDLE *handle,
+                                 const void *cookie,
+                                 const struct multi_op *ops, int nops,
+                                 struct multi_response *rsp) {
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    int ii = 0;
+
+    while (ii < nops && ret == ENGINE_SUCCESS) {
+        ENGINE_ERROR_CODE r = validate_op(&ops[ii]);
+        int num = 1;
+
+        if (r != ENGINE_SUCCESS) {
+            if (add_result(rsp, &ops[ii], r, PROTOCOL_BINARY_RAW_BYTES, 0, 0,
+                           0) == NULL) {
+                ret = ENGINE_ENOMEM;
+            }
+        } else if (ops[ii].opcode == PROTOCOL_BINARY_CMD_GET) {
+            /* Give the engine the run of gets in one go */
+            while (ii + num < nops && num < MULTI_OPS_BATCH &&
+                   ops[ii + num].opcode == PROTOCOL_BINARY_CMD_GET &&
+                   ops[ii + num].nvalue == 0) {
+                ++num;
+            }
+            ret = run_gets(v1, handle, cookie, ops + ii, num, rsp);
+        } else if (is_store(ops[ii].opcode)) {
+            while (ii + num < nops && num < MULTI_OPS_BATCH &&
+                   is_store(ops[ii + num].opcode)) {
+                ++num;
+            }
+            ret = run_stores(v1, handle, cookie, ops + ii, num, rsp);
+        } else {
+            ret = run_one(v1, handle, cookie, &ops[ii], rsp);
+        }
+        ii += num;
+    }
+
+    return ret;
+}
+
+static ENGINE_ERROR_CODE handle_multi_ops(EXTENSION_BINARY_PROTOCOL_DESCRIPTOR *descriptor,
+                                          ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          protocol_binary_request_header *request,
+                                          ADD_RESPONSE response)
+{
+    const uint8_t *body = (const uint8_t*)request + sizeof(request->bytes);
+    size_t nbody = ntohl(request->request.bodylen);
+    struct multi_response rsp;
+    struct multi_op *ops;
+    ENGINE_ERROR_CODE r;
+    int nops;
+
+    if (request->request.extlen != 0 || request->request.keylen != 0 ||
+        (nops = parse_ops(body, nbody, NULL)) <= 0) {
+        return response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
+                        PROTOCOL_BINARY_RESPONSE_EINVAL, 0, cookie);
+    }
+
+    if ((ops = malloc(nops * sizeof(*ops))) == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    parse_ops(body, nbody, ops);
+
+    memset(&rsp, 0, sizeof(rsp));
+    r = run_ops((ENGINE_HANDLE_V1*)handle, handle, cookie, ops, nops, &rsp);
+    if (r == ENGINE_SUCCESS &&
+        !response(NULL, 0, NULL, 0, rsp.data, (uint32_t)rsp.used,
+                  PROTOCOL_BINARY_RAW_BYTES,
+                  PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie)) {
+        r = ENGINE_DISCONNECT;
+    }
+
+    free(rsp.data);
+    free(ops);
+    return r;
+}
+
+static void setup(void (*add)(EXTENSION_BINARY_PROTOCOL_DESCRIPTOR *descriptor,
+                              uint8_t cmd,
+                              BINARY_COMMAND_CALLBACK new_handler))
+{
+    add(&descriptor, multi_command, handle_multi_ops);
+}
+
+MEMCACHED_PUBLIC_API
+EXTENSION_ERROR_CODE memcached_extensions_initialize(const char *config,
+                                                     GET_SERVER_API get_server_api) {
+    SERVER_HANDLE_V1 *server = get_server_api();
+    server_api = get_server_api;
+    descriptor.get_name = get_name;
+    descriptor.setup = setup;
+
+    if (server == NULL) {
+        return EXTENSION_FATAL;
+    }
+
+    if (config != NULL) {
+        size_t op;
+        struct config_item items[2];
+        memset(&items, 0, sizeof(items));
+        items[0].key = "c";
+        items[0].datatype = DT_SIZE;
+        items[0].value.dt_size = &op;
+        items[1].key = NULL;
+
+        if (server->core->parse_config(config, items, stderr) != 0) {
+            return EXTENSION_FATAL;
+        }
+
+        if (items[0].found) {
+            multi_command = (uint8_t)(op & 0xff);
+        }
+    }
+
+    if (!server->extension->register_extension(EXTENSION_BINARY_PROTOCOL,
+                                               &descriptor)) {
+        return EXTENSION_FATAL;
+    }
+
+    return EXTENSION_SUCCESS;
+}
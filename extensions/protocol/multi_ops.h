@@ -0,0 +1,82 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef EXTENSIONS_PROTOCOL_MULTI_OPS_H
+#define EXTENSIONS_PROTOCOL_MULTI_OPS_H
+
+#include <memcached/protocol_binary.h>
+
+/** The default command id for the multi operation (override with c=) */
+#define PROTOCOL_BINARY_CMD_MULTI_OPS (uint8_t)(0xe4 & 0xff)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+     * A multi operation request carries a number of operations (GET, SET,
+     * ADD, REPLACE, DELETE, INCREMENT and DECREMENT) in its body, with no
+     * extras and no key in the packet itself. The server runs them in
+     * order and responds with a single packet holding the result of each
+     * of them, in the same order.
+     *
+     * Each operation in the request is a protocol_binary_multi_op followed
+     * by the key and then the value. The value of a SET, ADD or REPLACE is
+     * what to store (a CAS other than 0 makes it a CAS store), and that of
+     * an INCREMENT or DECREMENT is the delta and the initial value (64
+     * bits each), with an expiration of 0xffffffff meaning don't create
+     * it. The others have no value; a DELETE checks the CAS if it isn't 0.
+     *
+     * Each result in the response is a protocol_binary_multi_result
+     * followed by the value: the value of the item for a GET (as it is
+     * stored, see the datatype), the new value (64 bits) of an INCREMENT
+     * or DECREMENT, and nothing for the rest or if it failed.
+     *
+     * All of the numbers are in network byte order.
+     */
+
+    /**
+     * Definition of an operation in a multi operation request
+     */
+    typedef union {
+        struct {
+            uint8_t opcode;
+            uint8_t datatype;
+            uint16_t keylen;
+            uint16_t vbucket;
+            uint16_t reserved;
+            uint32_t vallen;
+            uint32_t flags;
+            uint32_t expiration;
+            uint32_t reserved2;
+            uint64_t cas;
+        } op;
+        uint8_t bytes[32];
+    } protocol_binary_multi_op;
+
+    /**
+     * Definition of the result of an operation in a multi operation
+     * response
+     */
+    typedef union {
+        struct {
+            uint8_t opcode;
+            uint8_t datatype;
+            uint16_t status;
+            uint32_t vallen;
+            uint32_t flags;
+            uint32_t reserved;
+            uint64_t cas;
+        } result;
+        uint8_t bytes[24];
+    } protocol_binary_multi_result;
+
+    /**
+     * Definition of the packets used by the multi operation
+     */
+    typedef protocol_binary_request_no_extras protocol_binary_request_multi_ops;
+    typedef protocol_binary_response_no_extras protocol_binary_response_multi_ops;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -47,6 +47,22 @@ typedef struct allocator_stats {
     size_t ext_stats_size;
 } allocator_stats;
 
+/**
+ * What was allocated and freed on the threads while they were charging
+ * their memory to the account (see enter_account). Memory freed while
+ * another account is the current one is taken off that one instead, so
+ * the difference is only the memory in use if the owner of the account
+ * frees its own memory (as a bucket does, but a cache shared between
+ * the buckets wouldn't).
+ */
+typedef struct allocator_account {
+    volatile uint64_t allocated;
+    volatile uint64_t freed;
+    /* The arena to allocate from in the account (see create_arena), or
+     * 0 to keep the one of the thread */
+    unsigned int arena;
+} allocator_account;
+
 /**
  * Engine allocator hooks for memory tracking.
  */
@@ -115,6 +131,37 @@ typedef struct engine_allocator_hooks_v1 {
      */
     void (*release_free_memory)(void);
 
+    /**
+     * Charge the memory the calling thread allocates and frees from now
+     * on to the account, until the matching call to leave_account. The
+     * calls nest (the account before is the current one again after the
+     * leave_account), and the account must stay around until it's left.
+     * Returns false if the allocator can't tell us what the thread
+     * allocates, in which case the account isn't charged anything.
+     */
+    bool (*enter_account)(allocator_account *account);
+
+    /**
+     * Stop charging the memory of the calling thread to the account the
+     * last call to enter_account made the current one.
+     */
+    void (*leave_account)(void);
+
+    /**
+     * Create an arena of the allocator, for the threads to allocate from
+     * while they are in an account with it (so that the memory of an
+     * engine isn't mixed up with the memory of the others). Returns
+     * false if the server wasn't configured to use arenas.
+     */
+    bool (*create_arena)(unsigned int *arena);
+
+    /**
+     * Give the memory left in the arena back to the OS, once nothing
+     * allocates in it any more. The arena may be handed out again by
+     * create_arena.
+     */
+    void (*release_arena)(unsigned int arena);
+
 } ALLOCATOR_HOOKS_API;
 
 #ifdef __cplusplus
@@ -184,6 +184,46 @@ extern "C" {
         feature_info features[1];
     } engine_info;
 
+    /**
+     * A key to look up with get_multi
+     */
+    typedef struct {
+        const void *key;
+        uint16_t nkey;
+        uint16_t vbucket;
+    } engine_key_t;
+
+    /**
+     * An item to store with store_multi
+     */
+    typedef struct {
+        const void *key;
+        uint16_t nkey;
+        uint16_t vbucket;
+        /** The value (copied into the item) */
+        const void *value;
+        uint32_t nvalue;
+        /** The flags as they are sent over the network */
+        uint32_t flags;
+        rel_time_t exptime;
+        uint8_t datatype;
+        ENGINE_STORE_OPERATION operation;
+        /** The CAS to check (0 for none) */
+        uint64_t cas;
+    } engine_store_t;
+
+    /**
+     * The memory use of an engine (see get_mem_info)
+     */
+    typedef struct {
+        /** The most memory the engine may use for the items */
+        size_t limit;
+        /** The memory it took for them */
+        size_t used;
+        /** The items it had to evict to make room for others so far */
+        uint64_t evictions;
+    } engine_mem_info_t;
+
     /**
      * Definition of the first version of the engine interface
      */
@@ -568,6 +608,213 @@ extern "C" {
                                                engine_get_vb_map_cb callback);
 
         struct dcp_interface dcp;
+
+        /**
+         * Retrieve a batch of items. This is the same as calling get for
+         * each of the keys in order, but lets the engine look them up
+         * in one go. The engine may not return ENGINE_EWOULDBLOCK for
+         * any of the keys (leave it NULL if it has to block). Optional;
+         * the server calls get for each key if it is NULL.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param keys the keys to look up
+         * @param nkeys the number of keys
+         * @param items output array receiving the located items (NULL
+         *              for the ones not found)
+         * @param status output array receiving what get would have
+         *               returned for each of the keys
+         *
+         * @return ENGINE_SUCCESS if items and status are filled in
+         *         (anything else and the server calls get for each key)
+         */
+        ENGINE_ERROR_CODE (*get_multi)(ENGINE_HANDLE* handle,
+                                       const void* cookie,
+                                       const engine_key_t *keys,
+                                       int nkeys,
+                                       item** items,
+                                       ENGINE_ERROR_CODE *status);
+
+        /**
+         * Allocate and store a batch of items. This is the same as calling
+         * allocate, copying in the value and calling store for each of
+         * them in order, but lets the engine do it in one go. As with
+         * get_multi the engine may not return ENGINE_EWOULDBLOCK for any
+         * of the items. The engine stops at the first item for a vbucket
+         * it doesn't handle; that one and the ones after it are left alone
+         * and get ENGINE_NOT_MY_VBUCKET. Optional; the server goes through
+         * allocate and store for each item if it is NULL.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param reqs the items to store
+         * @param nreqs the number of items
+         * @param cas output array receiving the CAS of the stored items
+         * @param status output array receiving what allocate or store
+         *               returned for each of the items
+         *
+         * @return ENGINE_SUCCESS if cas and status are filled in
+         *         (anything else and the server stores the items itself)
+         */
+        ENGINE_ERROR_CODE (*store_multi)(ENGINE_HANDLE* handle,
+                                         const void* cookie,
+                                         const engine_store_t *reqs,
+                                         int nreqs,
+                                         uint64_t *cas,
+                                         ENGINE_ERROR_CODE *status);
+
+        /**
+         * Tell the engine how expensive the item is to recreate (the cost
+         * hint of a store), before the item is stored. An engine with a
+         * cost aware eviction policy prefers to evict the cheap items.
+         * Optional; the server drops the hint if it is NULL.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param item the item returned by allocate
+         * @param cost the cost (in whatever unit the clients agree on)
+         */
+        void (*item_set_cost)(ENGINE_HANDLE *handle, const void *cookie,
+                              item *item, uint32_t cost);
+
+        /**
+         * Get the memory use of the engine. Optional (as is
+         * set_mem_limit); the engines sharing a memory budget (see
+         * bucket_engine) need both.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend (may be NULL)
+         * @param info where to store the memory use
+         */
+        void (*get_mem_info)(ENGINE_HANDLE *handle, const void *cookie,
+                             engine_mem_info_t *info);
+
+        /**
+         * Change the most memory the engine may use for the items. When
+         * it shrinks the engine evicts the items above it and gives the
+         * memory back (as far as it can).
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend (may be NULL)
+         * @param limit the new limit in bytes
+         *
+         * @return ENGINE_SUCCESS if the limit changed, ENGINE_ENOTSUP if
+         *         it can't (the memory was preallocated)
+         */
+        ENGINE_ERROR_CODE (*set_mem_limit)(ENGINE_HANDLE *handle,
+                                           const void *cookie,
+                                           size_t limit);
+
+        /**
+         * Overwrite a range of the value of an item where it is, rather
+         * than building a new item with the whole value. The engine may
+         * only do so if nobody else can see the value while it changes.
+         * Optional; the server (or extension) allocates and stores a
+         * copy of the item with the range replaced if it is NULL.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param key the key of the item
+         * @param nkey the length of the key
+         * @param offset where in the value the range starts
+         * @param data the new content of the range
+         * @param length the length of the range
+         * @param cas the CAS the item must have (0 for any) on input,
+         *            the new CAS of the item on output
+         * @param vbucket the vbucket of the item
+         *
+         * @return ENGINE_SUCCESS if the range was replaced,
+         *         ENGINE_KEY_ENOENT or ENGINE_KEY_EEXISTS as for a CAS
+         *         store, ENGINE_ERANGE if the range is past the end of
+         *         the value, ENGINE_ENOTSUP if the engine can't change
+         *         the item where it is right now (the caller should
+         *         store a copy instead)
+         */
+        ENGINE_ERROR_CODE (*patch)(ENGINE_HANDLE *handle,
+                                   const void *cookie,
+                                   const void *key,
+                                   const uint16_t nkey,
+                                   uint64_t offset,
+                                   const void *data,
+                                   uint32_t length,
+                                   uint64_t *cas,
+                                   uint16_t vbucket);
+
+        /**
+         * Pick items at random, for sampling the cache (the keys, sizes
+         * and expiry times of what is in it) without walking all of it.
+         * The items are picked independently, so the same one may come
+         * up more than once. Optional.
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param items where to store the items (the caller must release
+         *              each of them)
+         * @param nitems the number of items wanted
+         * @param nfound where to store the number of items picked
+         *
+         * @return ENGINE_SUCCESS if we picked any, ENGINE_KEY_ENOENT if
+         *         the cache is empty
+         */
+        ENGINE_ERROR_CODE (*sample)(ENGINE_HANDLE *handle,
+                                    const void *cookie,
+                                    item **items,
+                                    int nitems,
+                                    int *nfound);
+
+        /**
+         * Change the expiry time of an item, and get it (get and touch).
+         * The server sends the value from the item the same way it
+         * does for get. Optional; the server sends TOUCH, GAT and GATQ
+         * to unknown_command if it is NULL (or returns ENGINE_ENOTSUP).
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param item output variable that will receive the located item
+         *             (NULL if the caller only wants the expiry time
+         *             changed)
+         * @param key the key to look up
+         * @param nkey the length of the key
+         * @param exptime the new expiry time (as for allocate)
+         * @param vbucket the virtual bucket id
+         *
+         * @return ENGINE_SUCCESS if all goes well
+         */
+        ENGINE_ERROR_CODE (*touch)(ENGINE_HANDLE *handle,
+                                   const void *cookie,
+                                   item **item,
+                                   const void *key,
+                                   const uint16_t nkey,
+                                   const rel_time_t exptime,
+                                   uint16_t vbucket);
+
+        /**
+         * Retrieve an item and its item info in one go. This is the same
+         * as calling get and then get_item_info, but saves the second
+         * pass through the engine. Optional; the server calls get and
+         * get_item_info if it is NULL (or returns ENGINE_ENOTSUP).
+         *
+         * @param handle the engine handle
+         * @param cookie The cookie provided by the frontend
+         * @param item output variable that will receive the located item
+         * @param item_info output variable that will receive the item
+         *                  info (set nvalue to the room in the value
+         *                  array on input, as for get_item_info)
+         * @param key the key to look up
+         * @param nkey the length of the key
+         * @param vbucket the virtual bucket id
+         *
+         * @return ENGINE_SUCCESS if all goes well (ENGINE_FAILED and no
+         *         item if it found the item but couldn't fill in the
+         *         item info)
+         */
+        ENGINE_ERROR_CODE (*get_with_info)(ENGINE_HANDLE *handle,
+                                           const void *cookie,
+                                           item **item,
+                                           item_info *item_info,
+                                           const void *key,
+                                           const int nkey,
+                                           uint16_t vbucket);
     } ENGINE_HANDLE_V1;
 
     /**
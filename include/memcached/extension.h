@@ -81,6 +81,47 @@ extern "C" {
         EXTENSION_LOG_WARNING
     } EXTENSION_LOG_LEVEL;
 
+    /**
+     * A fixed size record of a request the server has served, for the
+     * loggers which keep request traces (see log_record below)
+     */
+    typedef struct {
+        /** When the response was ready (us since the epoch) */
+        uint64_t timestamp;
+        /** How long the request took (us) */
+        uint32_t latency;
+        /** The connection (its socket) */
+        uint32_t connection;
+        /** The hash of the key (0 if the request didn't have one) */
+        uint32_t key_hash;
+        /** The status of the response */
+        uint16_t status;
+        /** The opcode of the request */
+        uint8_t opcode;
+        uint8_t reserved;
+        /** The length of the key of the request */
+        uint16_t keylen;
+        /** The length of its value (the body less the key and extras) */
+        uint32_t value_length;
+    } EXTENSION_LOG_RECORD;
+
+    /**
+     * The rate limit of a place which logs (see log_limited below). Every
+     * call site has one of its own (static, initialized with
+     * EXTENSION_LOG_LIMIT_INIT) which lets rate messages a second through,
+     * and up to burst more of them at once.
+     */
+    typedef struct {
+        uint32_t rate;
+        uint32_t burst;
+        /** When the bucket is full again (the gethrtime() ns) */
+        volatile uint64_t full_at;
+        /** The messages suppressed since the last one we logged */
+        volatile uint32_t suppressed;
+    } EXTENSION_LOG_LIMIT;
+
+#define EXTENSION_LOG_LIMIT_INIT(rate, burst) { rate, burst, 0, 0 }
+
     /**
      * Log extensions should provide the following rescriptor when
      * they register themselves. Please note that if you register a log
@@ -113,6 +154,35 @@ extern "C" {
          * Tell the logger to shut down (flush buffers, close files etc)
          */
         void (*shutdown)(void);
+
+        /**
+         * Add a record of a request to the request trace. This is NULL
+         * for the loggers which don't keep one, and the server doesn't
+         * make the records then.
+         * @param record the request (copied by the logger)
+         */
+        void (*log_record)(const EXTENSION_LOG_RECORD *record);
+
+        /**
+         * Add an entry to the log, unless the call site has used up its
+         * rate limit (which is checked before the message is formatted,
+         * see extension_log_limit_take). The first message which gets
+         * through after some were suppressed is followed by a line
+         * telling how many of them there were.
+         *
+         * The server fills this in for the loggers which leave it NULL
+         * (with one which formats the message and gives it to log).
+         *
+         * @param severity the severity for this log entry
+         * @param client_cookie the client we're serving (may be NULL if not
+         *                      known)
+         * @param limit the rate limit of the call site
+         * @param fmt format string to add to the log
+         */
+        void (*log_limited)(EXTENSION_LOG_LEVEL severity,
+                            const void* client_cookie,
+                            EXTENSION_LOG_LIMIT *limit,
+                            const char *fmt, ...);
     } EXTENSION_LOGGER_DESCRIPTOR;
 
     typedef struct {
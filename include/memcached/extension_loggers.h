@@ -14,6 +14,19 @@ MEMCACHED_PUBLIC_API EXTENSION_LOGGER_DESCRIPTOR* get_stderr_logger(void);
 MEMCACHED_PUBLIC_API
 EXTENSION_ERROR_CODE memcached_initialize_stderr_logger(GET_SERVER_API get_server_api);
 
+/**
+ * Take a token from the rate limit of a call site (for the loggers'
+ * log_limited)
+ *
+ * @param limit the rate limit of the call site
+ * @param suppressed where to store the number of messages suppressed since
+ *                   the last one which got through (if this one does)
+ * @return true if the message should be logged
+ */
+MEMCACHED_PUBLIC_API
+bool extension_log_limit_take(EXTENSION_LOG_LIMIT *limit,
+                              uint32_t *suppressed);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -294,6 +294,12 @@ extern "C"
         /* ns_server - memcached session validation */
         PROTOCOL_BINARY_CMD_SET_CTRL_TOKEN = 0xf4,
         PROTOCOL_BINARY_CMD_GET_CTRL_TOKEN = 0xf5,
+        /* Move a slab page from one slab class to another */
+        PROTOCOL_BINARY_CMD_SLABS_REASSIGN = 0xf6,
+        /* Invalidate all of the keys in a namespace */
+        PROTOCOL_BINARY_CMD_NAMESPACE_INVALIDATE = 0xf7,
+        /* Write a snapshot of the cache to warm a new one up from */
+        PROTOCOL_BINARY_CMD_SNAPSHOT = 0xf8,
 
         /* Reserved for being able to signal invalid opcode */
         PROTOCOL_BINARY_CMD_INVALID = 0xff
@@ -459,6 +465,23 @@ extern "C"
         } message;
         uint8_t bytes[sizeof(protocol_binary_request_header) + 8];
     } protocol_binary_request_set;
+
+    /**
+     * Set, add and replace may carry a third word of extras: a hint of
+     * how expensive the item is to recreate (see item_set_cost in
+     * engine.h). Servers that don't know about it reject the request.
+     */
+    typedef union {
+        struct {
+            protocol_binary_request_header header;
+            struct {
+                uint32_t flags;
+                uint32_t expiration;
+                uint32_t cost;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_request_header) + 12];
+    } protocol_binary_request_set_cost;
     typedef protocol_binary_request_set protocol_binary_request_add;
     typedef protocol_binary_request_set protocol_binary_request_replace;
 
@@ -844,6 +867,63 @@ extern "C"
     typedef protocol_binary_response_no_extras protocol_binary_response_scrub;
 
 
+    /**
+     * Definition of the packet used to move a slab page from one slab
+     * class to another. A source class of 0 means any class with pages
+     * to spare.
+     */
+    typedef union {
+        struct {
+            protocol_binary_request_header header;
+            struct {
+                uint32_t src;
+                uint32_t dst;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_request_header) + 8];
+    } protocol_binary_request_slabs_reassign;
+
+    /**
+     * Definition of the packet returned from slabs reassign.
+     */
+    typedef protocol_binary_response_no_extras protocol_binary_response_slabs_reassign;
+
+    /**
+     * Definition of the packet used to get a random key. The response
+     * is that of a get with the key (the flags, key and value of one of
+     * the items, picked at random).
+     */
+    typedef protocol_binary_request_no_extras protocol_binary_request_get_random_key;
+    typedef protocol_binary_response_getk protocol_binary_response_get_random_key;
+
+    /**
+     * Definition of the packet used to invalidate the keys of a namespace
+     * (the ones starting with the key of the packet and the delimiter the
+     * engine is configured with).
+     */
+    typedef protocol_binary_request_no_extras protocol_binary_request_namespace_invalidate;
+
+    /**
+     * Definition of the packet returned from namespace invalidate. The
+     * body is the new generation of the namespace (64 bits).
+     */
+    typedef union {
+        struct {
+            protocol_binary_response_header header;
+            struct {
+                uint64_t generation;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_response_header) + 8];
+    } protocol_binary_response_namespace_invalidate;
+
+    /**
+     * Definition of the packets used to start writing a snapshot (the
+     * "snapshot" stats tell when it is done).
+     */
+    typedef protocol_binary_request_no_extras protocol_binary_request_snapshot;
+    typedef protocol_binary_response_no_extras protocol_binary_response_snapshot;
+
     /**
      * Definition of the packet used by set vbucket
      */
@@ -892,15 +972,18 @@ extern "C"
      */
     typedef enum {
         PROTOCOL_BINARY_FEATURE_DATATYPE = 0x01,
-        PROTOCOL_BINARY_FEATURE_TLS = 0x2
+        PROTOCOL_BINARY_FEATURE_TLS = 0x2,
+        /* The server may send values snappy compressed (needs datatype) */
+        PROTOCOL_BINARY_FEATURE_SNAPPY = 0x3
     } protocol_binary_hello_features;
 
     #define MEMCACHED_FIRST_HELLO_FEATURE 0x01
-    #define MEMCACHED_TOTAL_HELLO_FEATURES 0x02
+    #define MEMCACHED_TOTAL_HELLO_FEATURES 0x03
 
 #define protocol_feature_2_text(a) \
     (a == PROTOCOL_BINARY_FEATURE_DATATYPE) ? "Datatype" : \
-    (a == PROTOCOL_BINARY_FEATURE_TLS) ? "TLS" : "Unknown"
+    (a == PROTOCOL_BINARY_FEATURE_TLS) ? "TLS" : \
+    (a == PROTOCOL_BINARY_FEATURE_SNAPPY) ? "Snappy" : "Unknown"
 
     /**
      * The HELLO command is used by the client and the server to agree
@@ -1172,6 +1255,11 @@ extern "C"
     typedef protocol_binary_request_no_extras protocol_binary_request_ssl_refresh;
     typedef protocol_binary_response_no_extras protocol_binary_response_ssl_refresh;
 
+    /**
+     * GET_CMD_TIMER gets the timings of the opcode in the extras. They
+     * are the ones of the whole server, or with a key the ones of the
+     * bucket by that name (or of the port, as port:<port>).
+     */
     typedef union {
         struct {
             protocol_binary_request_header header;
@@ -10,6 +10,38 @@
 extern "C" {
 #endif
 
+    /**
+     * The priorities of the tasks for submit_task (the high ones run first)
+     */
+    typedef enum {
+        EXECUTOR_PRIORITY_HIGH,
+        EXECUTOR_PRIORITY_LOW
+    } executor_priority_t;
+
+    /**
+     * The points of a request the server notes the time of in its trace
+     * span, if it samples the request (see trace_point). The span starts
+     * when the server has parsed the header of the request.
+     */
+    typedef enum {
+        SPAN_BUCKET,         /**< The bucket engine found the bucket */
+        SPAN_ENGINE_ENTER,   /**< We first called into the engine */
+        SPAN_ENGINE_EXIT,    /**< The engine was done with it */
+        SPAN_PARK,           /**< The engine returned EWOULDBLOCK */
+        SPAN_WAKE,           /**< The engine notified us of the io */
+        SPAN_FIRST_BYTE,     /**< We sent the first byte of the response */
+        SPAN_LAST_BYTE,      /**< We sent all of the response */
+        SPAN_POINTS
+    } span_point_t;
+
+    /**
+     * A task to run on the executor of the server
+     *
+     * @param arg the argument given to submit_task
+     * @return the status to notify the cookie of the task with
+     */
+    typedef ENGINE_ERROR_CODE (*EXECUTOR_TASK)(void *arg);
+
     typedef struct {
         /**
          * The current time.
@@ -59,6 +91,49 @@ extern "C" {
          */
         bool (*get_config)(struct config_item items[]);
 
+        /**
+         * Run blocking work on one of the threads the server keeps for it,
+         * instead of on the thread calling into the engine (or a thread
+         * of its own). May be NULL with older servers.
+         *
+         * @param cookie the cookie to notify_io_complete with the status
+         *               the task returns once it's done, or NULL
+         * @param task the work to do
+         * @param arg the argument to the task
+         * @param priority the priority of the task
+         * @return ENGINE_SUCCESS if the task is queued (so that the caller
+         *         may return ENGINE_EWOULDBLOCK for the cookie), or
+         *         ENGINE_TMPFAIL if the queue is full
+         */
+        ENGINE_ERROR_CODE (*submit_task)(const void *cookie,
+                                         EXECUTOR_TASK task, void *arg,
+                                         executor_priority_t priority);
+
+        /**
+         * The current time with millisecond resolution: the milliseconds
+         * since the same point in time as get_current_time counts the
+         * seconds from. It comes from a coarse clock which is cheap to
+         * read (it may be a few ms behind), so it may be called for
+         * every request. May be NULL with older servers.
+         */
+        uint64_t (*get_current_time_ms)(void);
+
+        /**
+         * The number of worker threads (see get_thread_index). May be
+         * NULL with older servers.
+         */
+        int (*get_num_threads)(void);
+
+        /**
+         * Tell the server that an extension changed (or removed) the item
+         * with the key through the engine, so that it forgets what it has
+         * cached of it. May be NULL with older servers.
+         *
+         * @param key the key of the item
+         * @param nkey the length of the key
+         */
+        void (*item_changed)(const void *key, size_t nkey);
+
     } SERVER_CORE_API;
 
     typedef struct {
@@ -77,6 +152,15 @@ extern "C" {
                          int nkey);
     } SERVER_STAT_API;
 
+    /**
+     * A connection to notify, and the status of its io (see
+     * notify_io_complete_batch)
+     */
+    typedef struct {
+        const void *cookie;
+        ENGINE_ERROR_CODE status;
+    } io_completion_t;
+
     /**
      * Commands to operate on a specific cookie.
      */
@@ -200,6 +284,92 @@ extern "C" {
          */
         bool (*is_admin)(const void *cookie);
 
+        /**
+         * Allocate scratch memory for the request the connection is
+         * running. The memory lives until the response to the request is
+         * sent, and is released by the server (don't free it). It may
+         * only be called from the thread which called into the engine.
+         *
+         * @param cookie The cookie provided by the frontend
+         * @param size the number of bytes
+         * @return the memory or NULL if we failed to allocate it
+         */
+        void *(*alloc_scratch)(const void *cookie, size_t size);
+
+        /**
+         * The index of the worker thread running the connection, so that
+         * the engine may keep state per thread which no other thread
+         * touches. It is below get_num_threads, and it only changes
+         * between requests.
+         *
+         * @param cookie The cookie provided by the frontend
+         * @return the index or -1 if it isn't run by a worker thread
+         */
+        int (*get_thread_index)(const void *cookie);
+
+        /**
+         * Let many connections know that their IO has completed, as
+         * notify_io_complete does for one, waking each of the threads
+         * running them up only once. May be NULL with older servers.
+         *
+         * @param completions the connections and the status of their io
+         * @param count the number of them
+         */
+        void (*notify_io_complete_batch)(const io_completion_t *completions,
+                                         size_t count);
+
+        /**
+         * Respond to the request the connection is running with a range
+         * of the value of an item, sent from the item itself rather than
+         * copied into the response. The server holds on to the reference
+         * to the item and releases it once the response is sent; the
+         * caller must not release it if this succeeds (it must if it
+         * fails). It may only be called from the thread which called
+         * into the engine, which must then return ENGINE_SUCCESS without
+         * responding any other way. May be NULL with older servers.
+         *
+         * @param cookie The cookie provided by the frontend
+         * @param item the item (the caller's reference to it)
+         * @param offset where in the value the range starts
+         * @param length the length of the range
+         * @param cas the CAS to put in the response
+         * @return true if the response is on its way
+         */
+        bool (*send_item_response)(const void *cookie, item *item,
+                                   uint64_t offset, uint32_t length,
+                                   uint64_t cas);
+
+        /**
+         * Note that the request the connection is running got to a point
+         * (if the server samples it), for the server to tell how long it
+         * took to get there. Only the first time a request gets to a
+         * point counts. It may only be called from the thread which
+         * called into the engine. May be NULL with older servers.
+         *
+         * @param cookie The cookie provided by the frontend
+         * @param point the point of the request
+         */
+        void (*trace_point)(const void *cookie, span_point_t point);
+
+        /**
+         * Hash a key of the request the connection is running (as
+         * core->hash(key, nkey, 0) does). The server keeps the hash of
+         * the key it hashed last for the request (by where the key is
+         * and its length), so that the server, the bucket engine and the
+         * engine hash the key of a request once between them rather than
+         * each of them on its own. Only use it for keys which stay where
+         * they are until the request is done, such as the keys the server
+         * hands to the engine. It may only be called from the thread
+         * which called into the engine. May be NULL with older servers.
+         *
+         * @param cookie The cookie provided by the frontend
+         * @param key the key
+         * @param nkey the length of the key
+         * @return the hash of the key
+         */
+        uint32_t (*get_key_hash)(const void *cookie, const void *key,
+                                 size_t nkey);
+
     } SERVER_COOKIE_API;
 
 #ifdef WIN32
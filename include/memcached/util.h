@@ -9,8 +9,10 @@
  *
  * returns true if conversion succeeded.
  */
+#include <platform/platform.h>
 #include <memcached/visibility.h>
 #include <memcached/protocol_binary.h>
+#include <memcached/engine_common.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -30,6 +32,89 @@ const char *memcached_protocol_errcode_2_text(protocol_binary_response_status er
 # define __gcc_attribute__(x)
 #endif
 
+/*
+ * The NUMA topology of the host (Linux only; everywhere else it looks
+ * like one node). Nodes are numbered from 0.
+ */
+#define MC_NUMA_MAX_NODES 64
+
+/** The number of NUMA nodes (1 if the host isn't NUMA or we can't tell) */
+MEMCACHED_PUBLIC_API int mc_numa_nodes(void);
+
+/** The node of the CPU (0 if we can't tell) */
+MEMCACHED_PUBLIC_API int mc_numa_cpu_node(int cpu);
+
+/** The node of the CPU the calling thread is running on */
+MEMCACHED_PUBLIC_API int mc_numa_current_node(void);
+
+/**
+ * Keep the calling thread on the CPUs of the node
+ * @return false if we can't
+ */
+MEMCACHED_PUBLIC_API bool mc_numa_bind_thread(int node);
+
+/**
+ * Keep the calling thread on the CPUs
+ * @return false if we can't
+ */
+MEMCACHED_PUBLIC_API bool mc_bind_thread_cpus(const int *cpus, int ncpus);
+
+/*
+ * The contention of the locks of the daemon and the engines. A lock (or a
+ * group of them, like the stripes of a lock) has an mc_mutex_stats_t it
+ * registers under a name, and is taken with mc_mutex_enter. Every
+ * mc_mutex_sample'th time (0 by default, which turns it off) we time how
+ * long we waited for it. They are reported by name (summed up over all of
+ * the ones with the same name) in "stats locks".
+ */
+typedef struct mc_mutex_stats {
+    const char *name;
+    /* Bumped without a barrier, so it is only good for the sampling */
+    unsigned int calls;
+    /* The ones we sampled, which are updated under mutex */
+    uint64_t samples;
+    uint64_t contended;
+    hrtime_t wait;
+    hrtime_t max_wait;
+    cb_mutex_t mutex;
+    bool registered;
+    struct mc_mutex_stats *next;
+} mc_mutex_stats_t;
+
+/**
+ * Turn the lock stats on (must be called before anyone registers)
+ * @param sample sample one of every this many acquisitions (0 is off)
+ */
+MEMCACHED_PUBLIC_API void mc_mutex_stats_init(unsigned int sample);
+
+/**
+ * Start counting the contention of a lock (it does nothing unless the
+ * lock stats are on)
+ * @param stats the stats of the lock
+ * @param name the name to report it under (it must outlive the stats)
+ */
+MEMCACHED_PUBLIC_API void mc_mutex_stats_register(mc_mutex_stats_t *stats,
+                                                  const char *name);
+
+/** Stop counting (before the stats go away) */
+MEMCACHED_PUBLIC_API void mc_mutex_stats_unregister(mc_mutex_stats_t *stats);
+
+/**
+ * Take a lock, and count how long we waited for it if it is sampled
+ * @param mutex the lock
+ * @param stats its stats (or NULL)
+ */
+MEMCACHED_PUBLIC_API void mc_mutex_enter(cb_mutex_t *mutex,
+                                         mc_mutex_stats_t *stats);
+
+/**
+ * Add the stats of the locks
+ * @param add_stat the callback to add them with
+ * @param cookie the cookie to pass to it
+ */
+MEMCACHED_PUBLIC_API void mc_mutex_stats(ADD_STAT add_stat,
+                                         const void *cookie);
+
 /**
  * Vararg variant of perror that makes for more useful error messages
  * when reporting with parameters.
@@ -175,6 +175,72 @@ static ENGINE_ERROR_CODE mock_get(ENGINE_HANDLE* handle,
     return ret;
 }
 
+static ENGINE_ERROR_CODE mock_get_with_info(ENGINE_HANDLE* handle,
+                                            const void* cookie,
+                                            item** item,
+                                            item_info *item_info,
+                                            const void* key,
+                                            const int nkey,
+                                            uint16_t vbucket) {
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    struct mock_engine *me = get_handle(handle);
+    struct mock_connstruct *c = (void*)cookie;
+    if (me->the_engine->get_with_info == NULL) {
+        return ENGINE_ENOTSUP;
+    }
+    if (c == NULL) {
+        c = (void*)create_mock_cookie();
+    }
+
+    c->nblocks = 0;
+    cb_mutex_enter(&c->mutex);
+    while (ret == ENGINE_SUCCESS &&
+           (ret = me->the_engine->get_with_info((ENGINE_HANDLE*)me->the_engine,
+                                                c, item, item_info, key, nkey,
+                                                vbucket)) == ENGINE_EWOULDBLOCK &&
+           c->handle_ewouldblock)
+    {
+        ++c->nblocks;
+        cb_cond_wait(&c->cond, &c->mutex);
+        ret = c->status;
+    }
+    cb_mutex_exit(&c->mutex);
+
+    if (c != cookie) {
+        destroy_mock_cookie(c);
+    }
+
+    return ret;
+}
+
+static ENGINE_ERROR_CODE mock_get_multi(ENGINE_HANDLE* handle,
+                                        const void* cookie,
+                                        const engine_key_t *keys,
+                                        int nkeys,
+                                        item** items,
+                                        ENGINE_ERROR_CODE *status) {
+    struct mock_engine *me = get_handle(handle);
+    if (me->the_engine->get_multi == NULL) {
+        return ENGINE_ENOTSUP;
+    }
+    return me->the_engine->get_multi((ENGINE_HANDLE*)me->the_engine, cookie,
+                                     keys, nkeys, items, status);
+}
+
+static ENGINE_ERROR_CODE mock_store_multi(ENGINE_HANDLE* handle,
+                                          const void* cookie,
+                                          const engine_store_t *reqs,
+                                          int nreqs,
+                                          uint64_t *cas,
+                                          ENGINE_ERROR_CODE *status) {
+    struct mock_engine *me = get_handle(handle);
+    if (me->the_engine->store_multi == NULL) {
+        return ENGINE_ENOTSUP;
+    }
+    return me->the_engine->store_multi((ENGINE_HANDLE*)me->the_engine, cookie,
+                                       reqs, nreqs, cas, status);
+}
+
 static ENGINE_ERROR_CODE mock_get_stats(ENGINE_HANDLE* handle,
                                         const void* cookie,
                                         const char* stat_key,
@@ -356,6 +422,111 @@ static void mock_item_set_cas(ENGINE_HANDLE *handle, const void *cookie,
     me->the_engine->item_set_cas((ENGINE_HANDLE*)me->the_engine, cookie, item, val);
 }
 
+static void mock_item_set_cost(ENGINE_HANDLE *handle, const void *cookie,
+                               item* item, uint32_t cost)
+{
+    struct mock_engine *me = get_handle(handle);
+    if (me->the_engine->item_set_cost != NULL) {
+        me->the_engine->item_set_cost((ENGINE_HANDLE*)me->the_engine, cookie,
+                                      item, cost);
+    }
+}
+
+static void mock_get_mem_info(ENGINE_HANDLE *handle, const void *cookie,
+                              engine_mem_info_t *info)
+{
+    struct mock_engine *me = get_handle(handle);
+    if (me->the_engine->get_mem_info == NULL) {
+        memset(info, 0, sizeof(*info));
+    } else {
+        me->the_engine->get_mem_info((ENGINE_HANDLE*)me->the_engine, cookie,
+                                     info);
+    }
+}
+
+static ENGINE_ERROR_CODE mock_set_mem_limit(ENGINE_HANDLE *handle,
+                                            const void *cookie,
+                                            size_t limit)
+{
+    struct mock_engine *me = get_handle(handle);
+    if (me->the_engine->set_mem_limit == NULL) {
+        return ENGINE_ENOTSUP;
+    }
+    return me->the_engine->set_mem_limit((ENGINE_HANDLE*)me->the_engine,
+                                         cookie, limit);
+}
+
+static ENGINE_ERROR_CODE mock_patch(ENGINE_HANDLE *handle,
+                                    const void *cookie,
+                                    const void *key,
+                                    const uint16_t nkey,
+                                    uint64_t offset,
+                                    const void *data,
+                                    uint32_t length,
+                                    uint64_t *cas,
+                                    uint16_t vbucket)
+{
+    struct mock_engine *me = get_handle(handle);
+    if (me->the_engine->patch == NULL) {
+        return ENGINE_ENOTSUP;
+    }
+    return me->the_engine->patch((ENGINE_HANDLE*)me->the_engine, cookie,
+                                 key, nkey, offset, data, length, cas,
+                                 vbucket);
+}
+
+static ENGINE_ERROR_CODE mock_sample(ENGINE_HANDLE *handle,
+                                     const void *cookie,
+                                     item **items,
+                                     int nitems,
+                                     int *nfound)
+{
+    struct mock_engine *me = get_handle(handle);
+    if (me->the_engine->sample == NULL) {
+        return ENGINE_ENOTSUP;
+    }
+    return me->the_engine->sample((ENGINE_HANDLE*)me->the_engine, cookie,
+                                  items, nitems, nfound);
+}
+
+static ENGINE_ERROR_CODE mock_touch(ENGINE_HANDLE *handle,
+                                    const void *cookie,
+                                    item **item,
+                                    const void *key,
+                                    const uint16_t nkey,
+                                    const rel_time_t exptime,
+                                    uint16_t vbucket)
+{
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+    struct mock_engine *me = get_handle(handle);
+    struct mock_connstruct *c = (void*)cookie;
+    if (me->the_engine->touch == NULL) {
+        return ENGINE_ENOTSUP;
+    }
+    if (c == NULL) {
+        c = (void*)create_mock_cookie();
+    }
+
+    c->nblocks = 0;
+    cb_mutex_enter(&c->mutex);
+    while (ret == ENGINE_SUCCESS &&
+           (ret = me->the_engine->touch((ENGINE_HANDLE*)me->the_engine, c,
+                                        item, key, nkey, exptime,
+                                        vbucket)) == ENGINE_EWOULDBLOCK &&
+           c->handle_ewouldblock)
+    {
+        ++c->nblocks;
+        cb_cond_wait(&c->cond, &c->mutex);
+        ret = c->status;
+    }
+    cb_mutex_exit(&c->mutex);
+
+    if (c != cookie) {
+        destroy_mock_cookie(c);
+    }
+
+    return ret;
+}
 
 static bool mock_get_item_info(ENGINE_HANDLE *handle, const void *cookie,
                                const item* item, item_info *item_info)
@@ -827,6 +998,12 @@ static void usage(void) {
     printf("\n");
     printf("-h                           Prints this usage text.\n");
     printf("-v                           verbose output\n");
+    printf("-P <threads>,<seconds>       Measure the engine instead of running\n");
+    printf("                             the tests: run the op mix in that many\n");
+    printf("                             threads for that long, and print the\n");
+    printf("                             ops per second and latencies.\n");
+    printf("-M <mix>                     The op mix and keys of -P (default\n");
+    printf("                             get=90,set=10,delete=0,keys=10000,value=100).\n");
     printf("\n");
 }
 
@@ -931,6 +1108,8 @@ static ENGINE_HANDLE_V1 *start_your_engines(const char *engine, const char* cfg,
     mock_engine.me.remove = mock_remove;
     mock_engine.me.release = mock_release;
     mock_engine.me.get = mock_get;
+    mock_engine.me.get_multi = mock_get_multi;
+    mock_engine.me.store_multi = mock_store_multi;
     mock_engine.me.store = mock_store;
     mock_engine.me.arithmetic = mock_arithmetic;
     mock_engine.me.flush = mock_flush;
@@ -942,6 +1121,13 @@ static ENGINE_HANDLE_V1 *start_your_engines(const char *engine, const char* cfg,
     mock_engine.me.tap_notify = mock_tap_notify;
     mock_engine.me.get_tap_iterator = mock_get_tap_iterator;
     mock_engine.me.item_set_cas = mock_item_set_cas;
+    mock_engine.me.item_set_cost = mock_item_set_cost;
+    mock_engine.me.get_mem_info = mock_get_mem_info;
+    mock_engine.me.set_mem_limit = mock_set_mem_limit;
+    mock_engine.me.patch = mock_patch;
+    mock_engine.me.sample = mock_sample;
+    mock_engine.me.touch = mock_touch;
+    mock_engine.me.get_with_info = mock_get_with_info;
     mock_engine.me.get_item_info = mock_get_item_info;
     mock_engine.me.errinfo = mock_errinfo;
     mock_engine.me.dcp.step = mock_dcp_step;
@@ -1110,6 +1296,337 @@ static int safe_append(char *buffer, const char *txt) {
     return len;
 }
 
+/*
+ * The perf mode (-P threads,seconds): the threads run the op mix of -M
+ * through the engine interface (and the mock engine above, so engines
+ * which return EWOULDBLOCK work too) as fast as they can, and we report
+ * the ops per second and the latency of each op.
+ */
+enum perf_op { PERF_GET, PERF_SET, PERF_DELETE, PERF_NUM_OPS };
+
+static const char *perf_op_names[PERF_NUM_OPS] = { "get", "set", "delete" };
+
+/* A latency histogram (in ns) with 16 buckets for each power of two */
+#define PERF_SUB_BITS 4
+#define PERF_BUCKETS (64 << PERF_SUB_BITS)
+
+struct perf_histogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[PERF_BUCKETS];
+};
+
+static struct {
+    int threads;
+    int seconds;
+    /* The percentage of each op */
+    int mix[PERF_NUM_OPS];
+    uint32_t keys;
+    size_t value_size;
+    char *value;
+    hrtime_t stop;
+} perf;
+
+struct perf_thread {
+    cb_thread_t tid;
+    const void *cookie;
+    uint32_t random;
+    uint64_t misses;
+    uint64_t errors;
+    struct perf_histogram latency[PERF_NUM_OPS];
+};
+
+static int perf_bucket(uint64_t value) {
+    int msb = 0;
+    int shift;
+
+    while ((value >> msb) > 1) {
+        ++msb;
+    }
+    if (msb < PERF_SUB_BITS) {
+        return (int)value;
+    }
+    shift = msb - PERF_SUB_BITS;
+    return ((shift + 1) << PERF_SUB_BITS) +
+        (int)((value >> shift) & ((1 << PERF_SUB_BITS) - 1));
+}
+
+/* The largest value which goes in the bucket */
+static uint64_t perf_bucket_value(int bucket) {
+    int shift;
+    uint64_t top;
+
+    if (bucket < (1 << PERF_SUB_BITS)) {
+        return bucket;
+    }
+    shift = (bucket >> PERF_SUB_BITS) - 1;
+    top = (1 << PERF_SUB_BITS) + (bucket & ((1 << PERF_SUB_BITS) - 1));
+    return ((top + 1) << shift) - 1;
+}
+
+static void perf_histogram_add(struct perf_histogram *h, uint64_t value) {
+    h->buckets[perf_bucket(value)]++;
+    h->count++;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+static void perf_histogram_merge(struct perf_histogram *h,
+                                 const struct perf_histogram *other) {
+    int ii;
+    for (ii = 0; ii < PERF_BUCKETS; ++ii) {
+        h->buckets[ii] += other->buckets[ii];
+    }
+    h->count += other->count;
+    if (other->max > h->max) {
+        h->max = other->max;
+    }
+}
+
+static double perf_percentile(const struct perf_histogram *h, double percent) {
+    uint64_t target = (uint64_t)(h->count * percent / 100.0 + 0.5);
+    uint64_t seen = 0;
+    int ii;
+
+    if (target == 0) {
+        target = 1;
+    }
+    for (ii = 0; ii < PERF_BUCKETS; ++ii) {
+        seen += h->buckets[ii];
+        if (seen >= target) {
+            uint64_t value = perf_bucket_value(ii);
+            return (value < h->max ? value : h->max) / 1000.0;
+        }
+    }
+    return h->max / 1000.0;
+}
+
+static uint32_t perf_random(struct perf_thread *t) {
+    uint32_t x = t->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return t->random = x;
+}
+
+static int perf_key(char *key, uint32_t num) {
+    return snprintf(key, 32, "perf_key_%u", num);
+}
+
+static ENGINE_ERROR_CODE perf_store(const void *cookie, const char *key,
+                                    int nkey) {
+    item *it;
+    item_info info;
+    uint64_t cas = 0;
+    ENGINE_ERROR_CODE ret;
+
+    ret = handle_v1->allocate(handle, cookie, &it, key, nkey,
+                              perf.value_size, 0, 0,
+                              PROTOCOL_BINARY_RAW_BYTES);
+    if (ret != ENGINE_SUCCESS) {
+        return ret;
+    }
+    info.nvalue = 1;
+    if (handle_v1->get_item_info(handle, cookie, it, &info) &&
+        info.value[0].iov_len == perf.value_size) {
+        memcpy(info.value[0].iov_base, perf.value, perf.value_size);
+    }
+    ret = handle_v1->store(handle, cookie, it, &cas, OPERATION_SET, 0);
+    handle_v1->release(handle, cookie, it);
+    return ret;
+}
+
+static void perf_main(void *arg) {
+    struct perf_thread *t = arg;
+    char key[32];
+
+    while (gethrtime() < perf.stop) {
+        int ii;
+        for (ii = 0; ii < 64; ++ii) {
+            int pick = (int)(perf_random(t) % 100);
+            int nkey = perf_key(key, perf_random(t) % perf.keys);
+            enum perf_op op = PERF_GET;
+            ENGINE_ERROR_CODE ret;
+            hrtime_t start;
+            item *it;
+            uint64_t cas = 0;
+
+            while (op < PERF_DELETE && pick >= perf.mix[op]) {
+                pick -= perf.mix[op];
+                op++;
+            }
+
+            start = gethrtime();
+            switch (op) {
+            case PERF_GET:
+                ret = handle_v1->get(handle, t->cookie, &it, key, nkey, 0);
+                if (ret == ENGINE_SUCCESS) {
+                    handle_v1->release(handle, t->cookie, it);
+                }
+                break;
+            case PERF_SET:
+                ret = perf_store(t->cookie, key, nkey);
+                break;
+            default:
+                ret = handle_v1->remove(handle, t->cookie, key, nkey, &cas, 0);
+                break;
+            }
+            perf_histogram_add(&t->latency[op], gethrtime() - start);
+
+            if (ret == ENGINE_KEY_ENOENT) {
+                t->misses++;
+            } else if (ret != ENGINE_SUCCESS) {
+                t->errors++;
+            }
+        }
+    }
+}
+
+static void perf_report(const char *name, const struct perf_histogram *h) {
+    printf("%-8s %12llu %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+           (unsigned long long)h->count, h->count / (double)perf.seconds,
+           perf_percentile(h, 50), perf_percentile(h, 90),
+           perf_percentile(h, 99), perf_percentile(h, 99.9),
+           h->max / 1000.0);
+}
+
+/**
+ * Parse the op mix (like "get=80,set=15,delete=5,keys=10000,value=100")
+ * @return false if it isn't one
+ */
+static bool perf_parse_mix(const char *mix) {
+    char *copy = strdup(mix);
+    char *token;
+    int total = 0;
+    int ii;
+
+    if (copy == NULL) {
+        return false;
+    }
+    memset(perf.mix, 0, sizeof(perf.mix));
+    for (token = strtok(copy, ","); token != NULL; token = strtok(NULL, ",")) {
+        char *value = strchr(token, '=');
+        if (value == NULL) {
+            free(copy);
+            return false;
+        }
+        *value++ = '\0';
+        if (strcmp(token, "keys") == 0) {
+            perf.keys = (uint32_t)strtoul(value, NULL, 10);
+            continue;
+        } else if (strcmp(token, "value") == 0) {
+            perf.value_size = (size_t)strtoul(value, NULL, 10);
+            continue;
+        }
+        for (ii = 0; ii < PERF_NUM_OPS; ++ii) {
+            if (strcmp(token, perf_op_names[ii]) == 0) {
+                perf.mix[ii] = atoi(value);
+                break;
+            }
+        }
+        if (ii == PERF_NUM_OPS || perf.mix[ii] < 0) {
+            free(copy);
+            return false;
+        }
+    }
+    free(copy);
+
+    for (ii = 0; ii < PERF_NUM_OPS; ++ii) {
+        total += perf.mix[ii];
+    }
+    return total == 100 && perf.keys > 0;
+}
+
+/**
+ * Run the perf mode on the engine
+ * @return the exit code of the program
+ */
+static int run_perf(const char *engine, const char *cfg) {
+    struct perf_thread *threads;
+    struct perf_histogram total[PERF_NUM_OPS];
+    struct perf_histogram all;
+    const void *cookie;
+    uint64_t misses = 0;
+    uint64_t errors = 0;
+    char key[32];
+    uint32_t ii;
+    int jj, kk;
+
+    /* Run like the server would, with a thread for each of ours */
+    mock_set_num_threads(perf.threads);
+    mock_set_hash_keys(true);
+    if (start_your_engines(engine, cfg, true) == NULL) {
+        return 1;
+    }
+
+    threads = calloc(perf.threads, sizeof(*threads));
+    perf.value = malloc(perf.value_size + 1);
+    if (threads == NULL || perf.value == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+    memset(perf.value, 'x', perf.value_size);
+
+    /* So that the gets find what they look for */
+    cookie = create_mock_cookie();
+    connect_mock_cookie(cookie);
+    for (ii = 0; ii < perf.keys; ++ii) {
+        int nkey = perf_key(key, ii);
+        if (perf_store(cookie, key, nkey) != ENGINE_SUCCESS) {
+            fprintf(stderr, "Failed to store the keys\n");
+            return 1;
+        }
+    }
+    destroy_mock_cookie(cookie);
+
+    perf.stop = gethrtime() + (hrtime_t)perf.seconds * 1000000000;
+    for (jj = 0; jj < perf.threads; ++jj) {
+        threads[jj].cookie = create_mock_cookie();
+        threads[jj].random = 2463534242UL + jj;
+        mock_set_thread_index(threads[jj].cookie, jj);
+        connect_mock_cookie(threads[jj].cookie);
+        if (cb_create_thread(&threads[jj].tid, perf_main, &threads[jj],
+                             0) != 0) {
+            fprintf(stderr, "Failed to create a thread\n");
+            return 1;
+        }
+    }
+
+    memset(total, 0, sizeof(total));
+    for (jj = 0; jj < perf.threads; ++jj) {
+        cb_join_thread(threads[jj].tid);
+        for (kk = 0; kk < PERF_NUM_OPS; ++kk) {
+            perf_histogram_merge(&total[kk], &threads[jj].latency[kk]);
+        }
+        misses += threads[jj].misses;
+        errors += threads[jj].errors;
+        destroy_mock_cookie(threads[jj].cookie);
+    }
+
+    printf("%s: %d threads for %d seconds, get=%d,set=%d,delete=%d of "
+           "%u keys (%lu byte values)\n", engine, perf.threads, perf.seconds,
+           perf.mix[PERF_GET], perf.mix[PERF_SET], perf.mix[PERF_DELETE],
+           perf.keys, (unsigned long)perf.value_size);
+    printf("%-8s %12s %12s %10s %10s %10s %10s %10s\n", "op", "ops",
+           "ops/s", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    memset(&all, 0, sizeof(all));
+    for (kk = 0; kk < PERF_NUM_OPS; ++kk) {
+        if (total[kk].count > 0) {
+            perf_report(perf_op_names[kk], &total[kk]);
+            perf_histogram_merge(&all, &total[kk]);
+        }
+    }
+    perf_report("all", &all);
+    printf("%llu misses, %llu errors\n", (unsigned long long)misses,
+           (unsigned long long)errors);
+
+    destroy_engine(false);
+    free(threads);
+    free(perf.value);
+    return errors > 0 ? 1 : 0;
+}
+
 int main(int argc, char **argv) {
     int c, exitcode = 0, num_cases = 0, timeout = 0, loop_count = 0;
     bool verbose = false;
@@ -1121,6 +1638,8 @@ int main(int argc, char **argv) {
     const char *engine_args = NULL;
     const char *test_suite = NULL;
     const char *test_case = NULL;
+    const char *perf_mix = "get=90,set=10,delete=0,keys=10000,value=100";
+    bool perf_mode = false;
     engine_test_t *testcases = NULL;
     cb_dlhandle_t handle;
     char *errmsg;
@@ -1177,6 +1696,8 @@ int main(int argc, char **argv) {
                        "Z"  /* Terminate on first error */
                        "C:" /* Test case id */
                        "s" /* spinlock the program */
+                       "P:" /* Perf mode */
+                       "M:" /* Op mix of the perf mode */
                        )) != -1) {
         switch (c) {
         case 's' : {
@@ -1222,6 +1743,17 @@ int main(int argc, char **argv) {
         case 'Z' :
             terminate_on_error = true;
             break;
+        case 'P':
+            if (sscanf(optarg, "%d,%d", &perf.threads, &perf.seconds) != 2 ||
+                perf.threads < 1 || perf.seconds < 1) {
+                fprintf(stderr, "-P takes <threads>,<seconds>\n");
+                return 1;
+            }
+            perf_mode = true;
+            break;
+        case 'M':
+            perf_mix = optarg;
+            break;
         default:
             fprintf(stderr, "Illegal argument \"%c\"\n", c);
             return 1;
@@ -1234,6 +1766,17 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    if (perf_mode) {
+        perf.keys = 10000;
+        perf.value_size = 100;
+        if (!perf_parse_mix(perf_mix)) {
+            fprintf(stderr, "Invalid op mix \"%s\" (the ops must add up "
+                    "to 100)\n", perf_mix);
+            return 1;
+        }
+        return run_perf(engine, engine_args);
+    }
+
     if (test_suite == NULL) {
         fprintf(stderr, "You must provide a path to the testsuite library.\n");
         return 1;
@@ -20,6 +20,8 @@ struct mock_callbacks *mock_event_handlers[MAX_ENGINE_EVENT_TYPE + 1];
 time_t process_started;     /* when the mock server was started */
 rel_time_t time_travel_offset;
 rel_time_t current_time;
+static int num_threads = 1;
+static bool hash_keys;
 struct mock_connstruct *connstructs;
 struct mock_extensions extensions;
 EXTENSION_LOGGER_DESCRIPTOR *null_logger = NULL;
@@ -33,6 +35,13 @@ uint64_t session_cas;
 uint8_t session_ctr;
 cb_mutex_t session_mutex;
 
+/**
+ * Guards the references of the cookies (the engine may reserve and
+ * release them from threads of its own, and while the tests hold the
+ * lock of the cookie)
+ */
+cb_mutex_t references_mutex;
+
 /**
  * SERVER CORE API FUNCTIONS
  */
@@ -101,15 +110,56 @@ static SOCKET mock_get_socket_fd(const void *cookie) {
 
 static ENGINE_ERROR_CODE mock_cookie_reserve(const void *cookie) {
     struct mock_connstruct *c = (struct mock_connstruct *)cookie;
+    cb_mutex_enter(&references_mutex);
     c->references++;
+    cb_mutex_exit(&references_mutex);
     return ENGINE_SUCCESS;
 }
 
+struct mock_scratch {
+    struct mock_scratch *next;
+};
+
+/* The tests run every cookie as if it were on the same worker thread */
+static int mock_get_thread_index(const void *cookie) {
+    const struct mock_connstruct *c = cookie;
+    return c != NULL ? c->thread_index : 0;
+}
+
+static int mock_get_num_threads(void) {
+    return num_threads;
+}
+
+static void *mock_alloc_scratch(const void *cookie, size_t size) {
+    struct mock_connstruct *c = (struct mock_connstruct *)cookie;
+    /* Keep the memory aligned for any type */
+    const size_t header = (sizeof(struct mock_scratch) + 15) & ~(size_t)15;
+    struct mock_scratch *s = malloc(header + size);
+    if (s == NULL) {
+        return NULL;
+    }
+    s->next = c->scratch;
+    c->scratch = s;
+    return (char *)s + header;
+}
+
+static void mock_free_scratch(struct mock_connstruct *c) {
+    while (c->scratch != NULL) {
+        struct mock_scratch *s = c->scratch;
+        c->scratch = s->next;
+        free(s);
+    }
+}
+
 static ENGINE_ERROR_CODE mock_cookie_release(const void *cookie) {
     struct mock_connstruct *c = (struct mock_connstruct *)cookie;
+    int references;
 
-    c->references--;
-    if (c->references == 0) {
+    cb_mutex_enter(&references_mutex);
+    references = --c->references;
+    cb_mutex_exit(&references_mutex);
+    if (references == 0) {
+        mock_free_scratch(c);
         free(c);
     }
     return ENGINE_SUCCESS;
@@ -120,8 +170,31 @@ static const char *mock_get_server_version(void) {
 }
 
 static uint32_t mock_hash( const void *key, size_t length, const uint32_t initval) {
-    /*this is a very stupid hash indeed */
-    return 1;
+    const unsigned char *ptr = key;
+    uint32_t hv = initval;
+    size_t ii;
+
+    if (!hash_keys) {
+        /*this is a very stupid hash indeed */
+        return 1;
+    }
+
+    /* Jenkins' one-at-a-time */
+    for (ii = 0; ii < length; ++ii) {
+        hv += ptr[ii];
+        hv += hv << 10;
+        hv ^= hv >> 6;
+    }
+    hv += hv << 3;
+    hv ^= hv >> 11;
+    hv += hv << 15;
+    return hv;
+}
+
+/* We don't keep the hash of the keys of the requests, there are none */
+static uint32_t mock_get_key_hash(const void *cookie, const void *key,
+                                  size_t nkey) {
+    return mock_hash(key, nkey, 0);
 }
 
 /* time-sensitive callers can call it by hand with this, outside the
@@ -138,6 +211,17 @@ static rel_time_t mock_get_current_time(void) {
     return current_time;
 }
 
+static uint64_t mock_get_current_time_ms(void) {
+#ifdef WIN32
+    return (uint64_t)(time(NULL) - process_started + time_travel_offset) * 1000;
+#else
+    struct timeval timer;
+    gettimeofday(&timer, NULL);
+    return (uint64_t)(timer.tv_sec - process_started + time_travel_offset) * 1000 +
+           timer.tv_usec / 1000;
+#endif
+}
+
 static rel_time_t mock_realtime(const time_t exptime) {
     /* no. of seconds in 30 days - largest possible delta exptime */
 
@@ -168,6 +252,15 @@ static void mock_notify_io_complete(const void *cookie, ENGINE_ERROR_CODE status
     }
 }
 
+static void mock_notify_io_complete_batch(const io_completion_t *completions,
+                                          size_t count) {
+    size_t ii;
+    for (ii = 0; ii < count; ++ii) {
+        mock_notify_io_complete(completions[ii].cookie,
+                                completions[ii].status);
+    }
+}
+
 static time_t mock_abstime(const rel_time_t exptime)
 {
     return process_started + exptime;
@@ -177,10 +270,56 @@ void mock_time_travel(int by) {
     time_travel_offset += by;
 }
 
+void mock_set_num_threads(int nthreads) {
+    num_threads = nthreads;
+}
+
+void mock_set_thread_index(const void *cookie, int index) {
+    struct mock_connstruct *c = (void*)cookie;
+    c->thread_index = index;
+}
+
+void mock_set_hash_keys(bool enable) {
+    hash_keys = enable;
+}
+
 static int mock_parse_config(const char *str, struct config_item items[], FILE *error) {
     return parse_config(str, items, error);
 }
 
+struct mock_task {
+    const void *cookie;
+    EXECUTOR_TASK task;
+    void *arg;
+};
+
+static void mock_task_main(void *arg) {
+    struct mock_task *t = arg;
+    ENGINE_ERROR_CODE status = t->task(t->arg);
+    mock_notify_io_complete(t->cookie, status);
+    free(t);
+}
+
+/* Every task gets a thread of its own */
+static ENGINE_ERROR_CODE mock_submit_task(const void *cookie,
+                                          EXECUTOR_TASK task, void *arg,
+                                          executor_priority_t priority) {
+    cb_thread_t tid;
+    struct mock_task *t = malloc(sizeof(*t));
+    (void)priority;
+    if (t == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    t->cookie = cookie;
+    t->task = task;
+    t->arg = arg;
+    if (cb_create_thread(&tid, mock_task_main, t, 1) != 0) {
+        free(t);
+        return ENGINE_TMPFAIL;
+    }
+    return ENGINE_SUCCESS;
+}
+
 /**
  * SERVER STAT API FUNCTIONS
  */
@@ -361,6 +500,9 @@ SERVER_HANDLE_V1 *get_mock_server_api(void)
       core_api.get_current_time = mock_get_current_time;
       core_api.abstime = mock_abstime;
       core_api.parse_config = mock_parse_config;
+      core_api.submit_task = mock_submit_task;
+      core_api.get_current_time_ms = mock_get_current_time_ms;
+      core_api.get_num_threads = mock_get_num_threads;
 
       server_cookie_api.get_auth_data = mock_get_auth_data;
       server_cookie_api.store_engine_specific = mock_store_engine_specific;
@@ -371,8 +513,12 @@ SERVER_HANDLE_V1 *get_mock_server_api(void)
       server_cookie_api.decrement_session_ctr = mock_decrement_session_ctr;
       server_cookie_api.get_socket_fd = mock_get_socket_fd;
       server_cookie_api.notify_io_complete = mock_notify_io_complete;
+      server_cookie_api.notify_io_complete_batch = mock_notify_io_complete_batch;
       server_cookie_api.reserve = mock_cookie_reserve;
       server_cookie_api.release = mock_cookie_release;
+      server_cookie_api.alloc_scratch = mock_alloc_scratch;
+      server_cookie_api.get_thread_index = mock_get_thread_index;
+      server_cookie_api.get_key_hash = mock_get_key_hash;
 
       server_stat_api.new_stats = mock_new_independent_stats;
       server_stat_api.release_stats = mock_release_independent_stats;
@@ -415,6 +561,7 @@ void init_mock_server(ENGINE_HANDLE *server_engine) {
     session_cas = 0x0102030405060708;
     session_ctr = 0;
     cb_mutex_initialize(&session_mutex);
+    cb_mutex_initialize(&references_mutex);
 }
 
 struct mock_connstruct *mk_mock_connection(const char *user, const char *config) {
@@ -456,12 +603,16 @@ const void *create_mock_cookie(void) {
     return rv;
 }
 
+void connect_mock_cookie(const void *cookie) {
+    mock_perform_callbacks(ON_CONNECT, NULL, cookie);
+}
+
 void destroy_mock_cookie(const void *cookie) {
     struct mock_connstruct *c = (struct mock_connstruct *)cookie;
-    disconnect_mock_connection(c);
-    if (c->references == 0) {
-        free((void*)cookie);
-    }
+    c->connected = false;
+    mock_perform_callbacks(ON_DISCONNECT, NULL, c);
+    /* Drop our reference last, as the engine may be releasing its own */
+    mock_cookie_release(c);
 }
 
 void mock_set_ewouldblock_handling(const void *cookie, bool enable) {
@@ -496,6 +647,7 @@ void disconnect_all_mock_connections(struct mock_connstruct *c) {
         disconnect_all_mock_connections(c->next);
         free((void*)c->uname);
         free((void*)c->config);
+        mock_free_scratch(c);
         free(c);
     }
 }
@@ -23,6 +23,10 @@ struct mock_connstruct {
     cb_mutex_t mutex;
     cb_cond_t cond;
     int references;
+    /* What the engine allocated with alloc_scratch */
+    struct mock_scratch *scratch;
+    /* The worker thread it is on (see mock_set_num_threads) */
+    int thread_index;
 };
 
 struct mock_callbacks {
@@ -45,6 +49,10 @@ struct mock_connstruct *mk_mock_connection(const char *user,
 
 MEMCACHED_PUBLIC_API const void *create_mock_cookie(void);
 
+/* Tell the engine about the cookie (as the server does when it accepts a
+   connection) */
+MEMCACHED_PUBLIC_API void connect_mock_cookie(const void *cookie);
+
 MEMCACHED_PUBLIC_API void destroy_mock_cookie(const void *cookie);
 
 MEMCACHED_PUBLIC_API void mock_set_ewouldblock_handling(const void *cookie, bool enable);
@@ -57,6 +65,15 @@ MEMCACHED_PUBLIC_API void waitfor_mock_cookie(const void *cookie);
 
 MEMCACHED_PUBLIC_API void mock_time_travel(int by);
 
+/* Pretend to have nthreads worker threads (the cookies are on the first
+   one unless mock_set_thread_index puts them on another) */
+MEMCACHED_PUBLIC_API void mock_set_num_threads(int nthreads);
+
+MEMCACHED_PUBLIC_API void mock_set_thread_index(const void *cookie, int index);
+
+/* Hash the keys for real, rather than putting them all in one bucket */
+MEMCACHED_PUBLIC_API void mock_set_hash_keys(bool enable);
+
 MEMCACHED_PUBLIC_API void disconnect_mock_connection(struct mock_connstruct *c);
 
 MEMCACHED_PUBLIC_API void disconnect_all_mock_connections(struct mock_connstruct *c);
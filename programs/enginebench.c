@@ -0,0 +1,673 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Microbenchmarks of the internals of the default engine:
+ *
+ *   assoc    assoc_insert, and assoc_find of keys we have and keys we
+ *            don't, as the table fills up to the load where it would grow
+ *   slabs    slabs_alloc and slabs_free of every slab class
+ *   items    item_alloc + store_item, and item_get of keys we have and
+ *            keys we don't
+ *   evict    item_alloc + store_item when every store has to evict
+ *
+ * Each of them runs with one thread and then with -t threads. The engine
+ * is built into the program (and runs on the mock server of engine_testapp,
+ * with the hash function of the server) as we call its internal functions.
+ *
+ * The results are CSV, one line for each run: the benchmark, what it ran
+ * with, the number of threads, the number of operations they did, the
+ * seconds it took, the nanoseconds of an operation (in one thread) and the
+ * millions of operations per second (of all of them).
+ *
+ * With -B the nanoseconds of each run are compared with a baseline (see
+ * perf_baseline.h), and it fails if any of them got slower than -T allows.
+ */
+#include "config.h"
+
+#include <platform/platform.h>
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "daemon/hash.h"
+#include "engines/default_engine/default_engine.h"
+#include "programs/engine_testapp/mock_server.h"
+#include "programs/perf_baseline.h"
+
+/* All of the keys have this many bytes */
+#define KEY_LENGTH 16
+
+/* A thread of the slabs benchmark allocates up to this much before it frees */
+#define SLABS_BATCH_BYTES (256 * 1024)
+#define SLABS_BATCH_MAX 64
+
+/* The size of the cache of the evict benchmark (in MB) */
+#define EVICT_CACHE_SIZE 32
+
+static struct {
+    int threads;
+    uint64_t ops;
+    int hashpower;
+    uint32_t keys;
+    int value_size;
+    size_t cache_size;
+    const char *config;
+} settings;
+
+struct bench;
+
+struct bench_thread {
+    struct bench *bench;
+    cb_thread_t tid;
+    int id;
+    const void *cookie;
+    uint64_t ops;
+};
+
+struct bench {
+    struct default_engine *engine;
+    int nthreads;
+    void (*run)(struct bench_thread *thread);
+    void *arg;
+    /* The threads wait for each other before they start */
+    cb_mutex_t lock;
+    cb_cond_t cond;
+    int ready;
+    bool go;
+};
+
+static void make_key(char *key, char prefix, uint64_t num) {
+    static const char digits[] = "0123456789abcdef";
+    int ii;
+
+    key[0] = prefix;
+    for (ii = KEY_LENGTH - 1; ii > 0; --ii) {
+        key[ii] = digits[num & 0xf];
+        num >>= 4;
+    }
+}
+
+/* xorshift, to visit the keys in a random order */
+static uint32_t next_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static uint32_t bench_get_key_hash(const void *cookie, const void *key,
+                                   size_t nkey) {
+    return hash(key, nkey, 0);
+}
+
+/* The mock server, but with the hash function of the server */
+static SERVER_HANDLE_V1 *get_bench_server_api(void) {
+    static SERVER_CORE_API core_api;
+    static SERVER_COOKIE_API cookie_api;
+    static SERVER_HANDLE_V1 rv;
+    static bool init;
+
+    if (!init) {
+        init = true;
+        rv = *get_mock_server_api();
+        core_api = *rv.core;
+        core_api.hash = hash;
+        rv.core = &core_api;
+        cookie_api = *rv.cookie;
+        cookie_api.get_key_hash = bench_get_key_hash;
+        rv.cookie = &cookie_api;
+    }
+    return &rv;
+}
+
+static struct default_engine *start_engine(size_t megabytes) {
+    ENGINE_HANDLE *handle;
+    char config[1024];
+
+    snprintf(config, sizeof(config), "cache_size=%lu;hashpower=%d%s%s",
+             (unsigned long)megabytes * 1024 * 1024, settings.hashpower,
+             settings.config ? ";" : "",
+             settings.config ? settings.config : "");
+
+    if (create_instance(1, get_bench_server_api, &handle) != ENGINE_SUCCESS ||
+        ((ENGINE_HANDLE_V1 *)handle)->initialize(handle, config)
+        != ENGINE_SUCCESS) {
+        fprintf(stderr, "Failed to start the engine with \"%s\"\n", config);
+        exit(EXIT_FAILURE);
+    }
+    return (struct default_engine *)handle;
+}
+
+static void stop_engine(struct default_engine *engine) {
+    engine->engine.destroy((ENGINE_HANDLE *)engine, false);
+    /* Or the next engine gets the disconnects of this one */
+    destroy_mock_event_callbacks();
+}
+
+static void bench_thread_main(void *arg) {
+    struct bench_thread *thread = arg;
+    struct bench *bench = thread->bench;
+
+    cb_mutex_enter(&bench->lock);
+    bench->ready++;
+    cb_cond_broadcast(&bench->cond);
+    while (!bench->go) {
+        cb_cond_wait(&bench->cond, &bench->lock);
+    }
+    cb_mutex_exit(&bench->lock);
+
+    bench->run(thread);
+}
+
+/**
+ * Run a benchmark in nthreads threads (all of them starting at the same
+ * time) and print how long it took them
+ * @param name the name of the benchmark
+ * @param param what it runs with (the load factor, the slab class etc)
+ * @param engine the engine to run it on
+ * @param nthreads the number of threads
+ * @param run what each of the threads runs (adding up what it did in ops)
+ * @param arg the state of the benchmark
+ */
+static void run_bench(const char *name, const char *param,
+                      struct default_engine *engine, int nthreads,
+                      void (*run)(struct bench_thread *), void *arg) {
+    struct bench bench;
+    struct bench_thread *threads = calloc(nthreads, sizeof(*threads));
+    hrtime_t start, elapsed;
+    uint64_t ops = 0;
+    double secs;
+    double ns_per_op;
+    char result[256];
+    int ii;
+
+    if (threads == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&bench, 0, sizeof(bench));
+    bench.engine = engine;
+    bench.nthreads = nthreads;
+    bench.run = run;
+    bench.arg = arg;
+    cb_mutex_initialize(&bench.lock);
+    cb_cond_initialize(&bench.cond);
+
+    for (ii = 0; ii < nthreads; ++ii) {
+        threads[ii].bench = &bench;
+        threads[ii].id = ii;
+        threads[ii].cookie = create_mock_cookie();
+        if (cb_create_thread(&threads[ii].tid, bench_thread_main,
+                             &threads[ii], 0) != 0) {
+            fprintf(stderr, "Failed to create a thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    cb_mutex_enter(&bench.lock);
+    while (bench.ready < nthreads) {
+        cb_cond_wait(&bench.cond, &bench.lock);
+    }
+    start = gethrtime();
+    bench.go = true;
+    cb_cond_broadcast(&bench.cond);
+    cb_mutex_exit(&bench.lock);
+
+    for (ii = 0; ii < nthreads; ++ii) {
+        cb_join_thread(threads[ii].tid);
+    }
+    elapsed = gethrtime() - start;
+
+    for (ii = 0; ii < nthreads; ++ii) {
+        ops += threads[ii].ops;
+        destroy_mock_cookie(threads[ii].cookie);
+    }
+    free(threads);
+    cb_mutex_destroy(&bench.lock);
+    cb_cond_destroy(&bench.cond);
+
+    secs = (double)elapsed / 1e9;
+    ns_per_op = ops ? (double)elapsed * nthreads / (double)ops : 0.0;
+    printf("%s,%s,%d,%llu,%.6f,%.1f,%.3f\n", name, param, nthreads,
+           (unsigned long long)ops, secs, ns_per_op,
+           secs > 0 ? (double)ops / secs / 1e6 : 0.0);
+    fflush(stdout);
+
+    snprintf(result, sizeof(result), "%s,%s,%d", name, param, nthreads);
+    perf_baseline_check(result, ns_per_op);
+}
+
+/* Run it with one thread, and then with all of them */
+static void run_benches(const char *name, const char *param,
+                        struct default_engine *engine,
+                        void (*run)(struct bench_thread *), void *arg) {
+    run_bench(name, param, engine, 1, run, arg);
+    if (settings.threads > 1) {
+        run_bench(name, param, engine, settings.threads, run, arg);
+    }
+}
+
+/*
+ * assoc
+ */
+struct assoc_bench {
+    hash_item **items;
+    uint32_t *hashes;
+    /* Keys we never insert, and their hashes */
+    char *missing;
+    uint32_t *missing_hashes;
+    /* The items in the table are [0, last), we insert [first, last) */
+    size_t first;
+    size_t last;
+};
+
+static void assoc_insert_main(struct bench_thread *thread) {
+    struct assoc_bench *a = thread->bench->arg;
+    struct default_engine *engine = thread->bench->engine;
+    size_t ii;
+
+    for (ii = a->first + thread->id; ii < a->last;
+         ii += thread->bench->nthreads) {
+        item_lock(engine, a->hashes[ii]);
+        assoc_insert(engine, a->hashes[ii], a->items[ii]);
+        item_unlock(engine, a->hashes[ii]);
+        thread->ops++;
+    }
+}
+
+static void assoc_find_main(struct bench_thread *thread) {
+    struct assoc_bench *a = thread->bench->arg;
+    struct default_engine *engine = thread->bench->engine;
+    uint32_t state = 2463534242UL + thread->id;
+    uint64_t ii;
+
+    for (ii = 0; ii < settings.ops; ++ii) {
+        size_t idx = next_random(&state) % a->last;
+        hash_item *it = a->items[idx];
+        hash_item *found;
+
+        item_lock(engine, a->hashes[idx]);
+        found = assoc_find(engine, a->hashes[idx], item_get_key(it), it->nkey);
+        item_unlock(engine, a->hashes[idx]);
+        cb_assert(found == it);
+    }
+    thread->ops = settings.ops;
+}
+
+static void assoc_miss_main(struct bench_thread *thread) {
+    struct assoc_bench *a = thread->bench->arg;
+    struct default_engine *engine = thread->bench->engine;
+    uint32_t state = 2463534242UL + thread->id;
+    uint64_t ii;
+
+    for (ii = 0; ii < settings.ops; ++ii) {
+        size_t idx = next_random(&state) % a->last;
+        hash_item *found;
+
+        item_lock(engine, a->missing_hashes[idx]);
+        found = assoc_find(engine, a->missing_hashes[idx],
+                           a->missing + idx * KEY_LENGTH, KEY_LENGTH);
+        item_unlock(engine, a->missing_hashes[idx]);
+        cb_assert(found == NULL);
+    }
+    thread->ops = settings.ops;
+}
+
+static void bench_assoc(void) {
+    /* As fractions of the load where the table grows (see assoc_grow_limit) */
+    static const double loads[] = { 0.25, 0.5, 0.75, 0.95 };
+    struct default_engine *engine = start_engine(settings.cache_size);
+    const void *cookie = create_mock_cookie();
+    double limit = engine->config.tagged_assoc ? 4.0 : 1.5;
+    size_t buckets = (size_t)1 << engine->assoc.hashpower;
+    size_t num = (size_t)(buckets * limit * loads[3]);
+    struct assoc_bench a;
+    char key[KEY_LENGTH];
+    char param[64];
+    size_t ii;
+
+    memset(&a, 0, sizeof(a));
+    a.items = calloc(num, sizeof(*a.items));
+    a.hashes = calloc(num, sizeof(*a.hashes));
+    a.missing = malloc(num * KEY_LENGTH);
+    a.missing_hashes = calloc(num, sizeof(*a.missing_hashes));
+    if (a.items == NULL || a.hashes == NULL || a.missing == NULL ||
+        a.missing_hashes == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the keys\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (ii = 0; ii < num; ++ii) {
+        make_key(key, 'a', ii);
+        a.items[ii] = item_alloc(engine, key, KEY_LENGTH, 0, 0, 8, cookie,
+                                 PROTOCOL_BINARY_RAW_BYTES);
+        if (a.items[ii] == NULL) {
+            fprintf(stderr, "Failed to allocate the items (try a bigger "
+                    "-m)\n");
+            exit(EXIT_FAILURE);
+        }
+        a.hashes[ii] = hash(key, KEY_LENGTH, 0);
+        make_key(a.missing + ii * KEY_LENGTH, 'm', ii);
+        a.missing_hashes[ii] = hash(a.missing + ii * KEY_LENGTH,
+                                    KEY_LENGTH, 0);
+    }
+
+    for (ii = 0; ii < sizeof(loads) / sizeof(loads[0]); ++ii) {
+        a.first = a.last;
+        a.last = (size_t)(buckets * limit * loads[ii]);
+        snprintf(param, sizeof(param), "load=%.2f",
+                 (double)a.last / (double)buckets);
+
+        /* Inserting all of them at once would take no time at all */
+        run_bench("assoc_insert", param, engine, 1, assoc_insert_main, &a);
+        run_benches("assoc_find_hit", param, engine, assoc_find_main, &a);
+        run_benches("assoc_find_miss", param, engine, assoc_miss_main, &a);
+    }
+
+    for (ii = 0; ii < num; ++ii) {
+        item_lock(engine, a.hashes[ii]);
+        assoc_delete(engine, a.hashes[ii], item_get_key(a.items[ii]),
+                     KEY_LENGTH);
+        item_unlock(engine, a.hashes[ii]);
+        item_release(engine, a.items[ii]);
+    }
+    free(a.items);
+    free(a.hashes);
+    free(a.missing);
+    free(a.missing_hashes);
+    destroy_mock_cookie(cookie);
+    stop_engine(engine);
+}
+
+/*
+ * slabs
+ */
+struct slabs_bench {
+    unsigned int id;
+    size_t size;
+    size_t batch;
+};
+
+static void slabs_main(struct bench_thread *thread) {
+    struct slabs_bench *s = thread->bench->arg;
+    struct default_engine *engine = thread->bench->engine;
+    void *ptrs[SLABS_BATCH_MAX];
+    size_t ii;
+
+    while (thread->ops < settings.ops) {
+        for (ii = 0; ii < s->batch; ++ii) {
+            if ((ptrs[ii] = slabs_alloc(engine, s->size, s->id)) == NULL) {
+                fprintf(stderr, "Ran out of memory in slab class %u (try a "
+                        "bigger -m)\n", s->id);
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (ii = 0; ii < s->batch; ++ii) {
+            slabs_free(engine, ptrs[ii], s->size, s->id);
+        }
+        thread->ops += s->batch;
+    }
+}
+
+static void bench_slabs(void) {
+    struct default_engine *engine = start_engine(settings.cache_size);
+    struct slabs_bench s;
+    char param[64];
+
+    for (s.id = POWER_SMALLEST; s.id <= engine->slabs.power_largest; ++s.id) {
+        s.size = engine->slabs.slabclass[s.id].size;
+        s.batch = SLABS_BATCH_BYTES / s.size;
+        if (s.batch < 1) {
+            s.batch = 1;
+        } else if (s.batch > SLABS_BATCH_MAX) {
+            s.batch = SLABS_BATCH_MAX;
+        }
+        snprintf(param, sizeof(param), "class=%u size=%lu", s.id,
+                 (unsigned long)s.size);
+        run_benches("slabs_alloc_free", param, engine, slabs_main, &s);
+    }
+    stop_engine(engine);
+}
+
+/*
+ * items and evict
+ */
+struct items_bench {
+    char prefix;
+    /* The keys are [base, base + num), and we wrap around unless 0 */
+    uint64_t base;
+    uint64_t num;
+};
+
+static bool store_one(struct default_engine *engine, const void *cookie,
+                      char prefix, uint64_t num) {
+    char key[KEY_LENGTH];
+    hash_item *it;
+    uint64_t cas;
+    ENGINE_ERROR_CODE ret;
+
+    make_key(key, prefix, num);
+    it = item_alloc(engine, key, KEY_LENGTH, 0, 0, settings.value_size,
+                    cookie, PROTOCOL_BINARY_RAW_BYTES);
+    if (it == NULL) {
+        return false;
+    }
+    ret = store_item(engine, it, &cas, OPERATION_SET, cookie);
+    item_release(engine, it);
+    return ret == ENGINE_SUCCESS;
+}
+
+static uint64_t items_key(struct items_bench *b, struct bench_thread *thread,
+                          uint64_t ii) {
+    uint64_t num = thread->id + ii * thread->bench->nthreads;
+    if (b->num != 0) {
+        num %= b->num;
+    }
+    return b->base + num;
+}
+
+static void items_store_main(struct bench_thread *thread) {
+    struct items_bench *b = thread->bench->arg;
+    struct default_engine *engine = thread->bench->engine;
+    uint64_t ii;
+
+    for (ii = 0; ii < settings.ops; ++ii) {
+        if (!store_one(engine, thread->cookie, b->prefix,
+                       items_key(b, thread, ii))) {
+            fprintf(stderr, "Failed to store an item\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    thread->ops = settings.ops;
+}
+
+static void items_get_main(struct bench_thread *thread) {
+    struct items_bench *b = thread->bench->arg;
+    struct default_engine *engine = thread->bench->engine;
+    uint32_t state = 2463534242UL + thread->id;
+    char key[KEY_LENGTH];
+    uint64_t ii;
+
+    for (ii = 0; ii < settings.ops; ++ii) {
+        hash_item *it;
+
+        make_key(key, b->prefix, b->base + next_random(&state) % b->num);
+        if ((it = item_get(engine, NULL, key, KEY_LENGTH)) != NULL) {
+            item_release(engine, it);
+        }
+    }
+    thread->ops = settings.ops;
+}
+
+static void bench_items(void) {
+    struct default_engine *engine = start_engine(settings.cache_size);
+    const void *cookie = create_mock_cookie();
+    struct items_bench b;
+    char param[64];
+    uint32_t ii;
+
+    for (ii = 0; ii < settings.keys; ++ii) {
+        if (!store_one(engine, cookie, 'i', ii)) {
+            fprintf(stderr, "Failed to store the keys (try a bigger -m)\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    snprintf(param, sizeof(param), "keys=%u value=%d", settings.keys,
+             settings.value_size);
+    b.prefix = 'i';
+    b.base = 0;
+    b.num = settings.keys;
+    run_benches("item_store", param, engine, items_store_main, &b);
+    run_benches("item_get_hit", param, engine, items_get_main, &b);
+    b.prefix = 'm';
+    run_benches("item_get_miss", param, engine, items_get_main, &b);
+
+    destroy_mock_cookie(cookie);
+    stop_engine(engine);
+}
+
+static void bench_evict(void) {
+    struct default_engine *engine = start_engine(EVICT_CACHE_SIZE);
+    struct mock_connstruct *cookie = (void *)create_mock_cookie();
+    struct items_bench b;
+    char param[64];
+    uint64_t ii;
+
+    /* Fill it up, so that all of the stores from now on evict */
+    for (ii = 0; cookie->evictions == 0; ++ii) {
+        if (!store_one(engine, cookie, 'e', ii)) {
+            fprintf(stderr, "Failed to fill the cache\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    snprintf(param, sizeof(param), "cache=%dMB value=%d", EVICT_CACHE_SIZE,
+             settings.value_size);
+    b.prefix = 'e';
+    b.num = 0;
+    b.base = ii;
+    run_bench("item_store_evict", param, engine, 1, items_store_main, &b);
+    if (settings.threads > 1) {
+        b.base += settings.ops;
+        run_bench("item_store_evict", param, engine, settings.threads,
+                  items_store_main, &b);
+    }
+
+    destroy_mock_cookie(cookie);
+    stop_engine(engine);
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: enginebench [-b benchmarks] [-t threads] [-n ops]\n"
+            "                   [-p hashpower] [-k keys] [-v value size]\n"
+            "                   [-m megabytes] [-H hash] [-e config]\n"
+            "                   [-B baseline [-T tolerance]]\n"
+            "  -b benchmarks  the ones to run, of assoc, slabs, items and "
+            "evict\n"
+            "                 (default all of them)\n"
+            "  -t threads     the threads of the second run (default 4)\n"
+            "  -n ops         what each thread does (default 1000000)\n"
+            "  -p hashpower   the size of the hash table (default 16)\n"
+            "  -k keys        the keys of the items benchmark "
+            "(default 100000)\n"
+            "  -v size        the size of the values (default 100)\n"
+            "  -m megabytes   the size of the cache (default 1024)\n"
+            "  -H hash        the hash function (see hash_init)\n"
+            "  -e config      more configuration for the engine\n"
+            "  -B baseline    fail if a run got slower than in this file\n"
+            "  -T tolerance   by more than this many percent (default 50)\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    const char *benchmarks = "assoc,slabs,items,evict";
+    const char *hash_function = NULL;
+    const char *baseline = NULL;
+    double tolerance = 50;
+    int cmd;
+
+    settings.threads = 4;
+    settings.ops = 1000000;
+    settings.hashpower = 16;
+    settings.keys = 100000;
+    settings.value_size = 100;
+    settings.cache_size = 1024;
+    settings.config = NULL;
+
+    while ((cmd = getopt(argc, argv, "b:t:n:p:k:v:m:H:e:B:T:")) != EOF) {
+        switch (cmd) {
+        case 'b':
+            benchmarks = optarg;
+            break;
+        case 't':
+            settings.threads = atoi(optarg);
+            break;
+        case 'n':
+            settings.ops = strtoull(optarg, NULL, 10);
+            break;
+        case 'p':
+            settings.hashpower = atoi(optarg);
+            break;
+        case 'k':
+            settings.keys = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'v':
+            settings.value_size = atoi(optarg);
+            break;
+        case 'm':
+            settings.cache_size = (size_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'H':
+            hash_function = optarg;
+            break;
+        case 'e':
+            settings.config = optarg;
+            break;
+        case 'B':
+            baseline = optarg;
+            break;
+        case 'T':
+            tolerance = atof(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (settings.threads < 1 || settings.ops < 1 || settings.hashpower < 1 ||
+        settings.hashpower > 30 || settings.keys < 1 ||
+        settings.value_size < 0 || settings.cache_size < 1 ||
+        tolerance < 0) {
+        usage();
+    }
+
+    if (baseline != NULL && !perf_baseline_load(baseline, tolerance)) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (!hash_init(hash_function)) {
+        fprintf(stderr, "Unknown hash function: %s\n", hash_function);
+        exit(EXIT_FAILURE);
+    }
+    init_mock_server(NULL);
+
+    printf("benchmark,param,threads,ops,seconds,ns_per_op,mops_per_sec\n");
+    if (strstr(benchmarks, "assoc") != NULL) {
+        bench_assoc();
+    }
+    if (strstr(benchmarks, "slabs") != NULL) {
+        bench_slabs();
+    }
+    if (strstr(benchmarks, "items") != NULL) {
+        bench_items();
+    }
+    if (strstr(benchmarks, "evict") != NULL) {
+        bench_evict();
+    }
+    return perf_baseline_failures() == 0 ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,253 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Compare the hash functions of the server (see daemon/hash.c): how fast
+ * they hash the keys, and how evenly they spread them over the buckets
+ * of a table the size of the one the default engine starts with.
+ *
+ * The keys are the lines of the file given with -f (a dump of the keys
+ * of a real bucket is the best thing to use), or made up ones which look
+ * like the keys of our users ("user:<n>", "session_<n>_<n>" and so on).
+ */
+#include "config.h"
+
+#include <platform/platform.h>
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "daemon/hash.h"
+
+struct keys {
+    char **key;
+    size_t *nkey;
+    size_t num;
+    size_t size;
+    size_t bytes;
+};
+
+static void add_key(struct keys *keys, const char *key, size_t nkey) {
+    if (keys->num == keys->size) {
+        keys->size = keys->size ? keys->size * 2 : 1024;
+        keys->key = realloc(keys->key, keys->size * sizeof(*keys->key));
+        keys->nkey = realloc(keys->nkey, keys->size * sizeof(*keys->nkey));
+        if (keys->key == NULL || keys->nkey == NULL) {
+            fprintf(stderr, "Failed to allocate memory for the keys\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    keys->key[keys->num] = malloc(nkey);
+    if (keys->key[keys->num] == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the keys\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(keys->key[keys->num], key, nkey);
+    keys->nkey[keys->num] = nkey;
+    keys->bytes += nkey;
+    keys->num++;
+}
+
+static void read_keys(struct keys *keys, const char *file) {
+    char line[1024];
+    FILE *fp = fopen(file, "r");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s\n", file);
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            --len;
+        }
+        if (len > 0) {
+            add_key(keys, line, len);
+        }
+    }
+    fclose(fp);
+}
+
+static void make_keys(struct keys *keys, size_t num) {
+    char key[256];
+    size_t ii;
+
+    for (ii = 0; ii < num; ++ii) {
+        int len;
+        switch (ii % 4) {
+        case 0:
+            len = snprintf(key, sizeof(key), "user:%lu", (unsigned long)ii);
+            break;
+        case 1:
+            len = snprintf(key, sizeof(key), "session_%lu_%lu",
+                           (unsigned long)(ii * 2654435761UL % 1000003),
+                           (unsigned long)ii);
+            break;
+        case 2:
+            len = snprintf(key, sizeof(key), "%08lx", (unsigned long)ii);
+            break;
+        default:
+            len = snprintf(key, sizeof(key),
+                           "pymc%lu:profile:avatar:thumbnail:%lu",
+                           (unsigned long)(ii % 97), (unsigned long)ii);
+            break;
+        }
+        add_key(keys, key, (size_t)len);
+    }
+}
+
+/**
+ * Hash all of the keys the given number of times
+ * @return the nanoseconds it took
+ */
+static hrtime_t time_hash(const struct keys *keys, int rounds,
+                          uint32_t *sink) {
+    hrtime_t start = gethrtime();
+    uint32_t sum = 0;
+    int round;
+    size_t ii;
+
+    for (round = 0; round < rounds; ++round) {
+        for (ii = 0; ii < keys->num; ++ii) {
+            sum += hash(keys->key[ii], keys->nkey[ii], 0);
+        }
+    }
+    *sink += sum;
+    return gethrtime() - start;
+}
+
+/**
+ * Put the keys in a table with 2^power buckets (by the low bits of the
+ * hash, as the assoc table does)
+ * @param chi where to store the chi-squared of the loads divided by what
+ *            we expect of a uniform hash (about 1.0 for a good one)
+ * @return the most keys in a bucket
+ */
+static unsigned int distribution(const struct keys *keys, int power,
+                                 double *chi) {
+    size_t nbuckets = (size_t)1 << power;
+    unsigned int *buckets = calloc(nbuckets, sizeof(*buckets));
+    double expected = (double)keys->num / (double)nbuckets;
+    double sum = 0;
+    unsigned int max = 0;
+    size_t ii;
+
+    if (buckets == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the table\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (ii = 0; ii < keys->num; ++ii) {
+        uint32_t hv = hash(keys->key[ii], keys->nkey[ii], 0);
+        buckets[hv & (nbuckets - 1)]++;
+    }
+    for (ii = 0; ii < nbuckets; ++ii) {
+        double diff = (double)buckets[ii] - expected;
+        sum += diff * diff / expected;
+        if (buckets[ii] > max) {
+            max = buckets[ii];
+        }
+    }
+    free(buckets);
+
+    /* The chi-squared of a uniform hash is about the degrees of freedom */
+    *chi = sum / (double)(nbuckets - 1);
+    return max;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: hashbench [-f file] [-n keys] [-r rounds] [-p power]\n"
+            "  -f file   hash the lines of the file (one key per line)\n"
+            "  -n keys   the number of keys to make up (default 1000000)\n"
+            "  -r rounds how many times to hash them (default 10)\n"
+            "  -p power  the table has 2^power buckets (default 16)\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    const char *algorithms[] = { "jenkins", "xxh32", "crc32c", NULL };
+    struct keys keys;
+    const char *file = NULL;
+    size_t num = 1000000;
+    int rounds = 10;
+    int power = 16;
+    uint32_t sink = 0;
+    int cmd;
+    int ii;
+
+    while ((cmd = getopt(argc, argv, "f:n:r:p:")) != EOF) {
+        switch (cmd) {
+        case 'f':
+            file = optarg;
+            break;
+        case 'n':
+            num = (size_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'p':
+            power = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (rounds < 1 || power < 1 || power > 30) {
+        usage();
+    }
+
+    memset(&keys, 0, sizeof(keys));
+    if (file != NULL) {
+        read_keys(&keys, file);
+    } else {
+        make_keys(&keys, num);
+    }
+    if (keys.num == 0) {
+        fprintf(stderr, "No keys to hash\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%lu keys of %.1f bytes on average, %d rounds, 2^%d buckets\n",
+           (unsigned long)keys.num, (double)keys.bytes / (double)keys.num,
+           rounds, power);
+    printf("%-10s %12s %10s %10s %10s\n", "hash", "Mkeys/s", "MB/s",
+           "chi2/df", "max load");
+
+    for (ii = 0; algorithms[ii] != NULL; ++ii) {
+        hrtime_t ns;
+        double chi;
+        double secs;
+        unsigned int max;
+
+        if (!hash_init(algorithms[ii])) {
+            printf("%-10s (not supported by this CPU)\n", algorithms[ii]);
+            continue;
+        }
+
+        /* Warm the caches up first */
+        time_hash(&keys, 1, &sink);
+        ns = time_hash(&keys, rounds, &sink);
+        secs = (double)ns / 1e9;
+        max = distribution(&keys, power, &chi);
+
+        printf("%-10s %12.1f %10.1f %10.3f %10u\n", hash_name(),
+               (double)keys.num * rounds / secs / 1e6,
+               (double)keys.bytes * rounds / secs / (1024 * 1024),
+               chi, max);
+    }
+
+    /* So that the compiler doesn't throw the hashing away */
+    if (sink == 0xdeadbeef) {
+        printf("\n");
+    }
+
+    for (ii = 0; ii < (int)keys.num; ++ii) {
+        free(keys.key[ii]);
+    }
+    free(keys.key);
+    free(keys.nkey);
+    return 0;
+}
@@ -0,0 +1,821 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+// mcbench is an open-loop load generator for the binary protocol. Unlike
+// mcbasher it reads the responses and matches them to the requests (by
+// their opaque), and it reports the throughput and the latency percentiles
+// of the run.
+//
+// The requests arrive at a fixed rate no matter how fast the server
+// answers them, and the latency of a request is measured from the time it
+// was supposed to be sent. A request which has to wait (because the
+// connection already has as many requests outstanding as the pipeline
+// allows) is charged for the time it waited, so a server which stalls for
+// a second shows up as a second of latency for all of the requests which
+// arrived during the stall, and not just for the one it was working on
+// (the "coordinated omission" of a closed-loop benchmark). The time from
+// sending a request to getting its response is reported as well, so the
+// two can be compared.
+
+#include "config.h"
+
+#include <memcached/protocol_binary.h>
+
+#include <getopt.h>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <string.h>
+#include <vector>
+#include <deque>
+#include <map>
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <cerrno>
+#include <platform/platform.h>
+
+using namespace std;
+
+// How long we wait for the requests which are outstanding at the end of
+// the run (in seconds)
+#define DRAIN_TIME 5
+
+static struct {
+    string host;
+    string port;
+    int threads;
+    int connections;
+    double rate;
+    int duration;
+    uint32_t keys;
+    double theta;
+    uint32_t minValue;
+    uint32_t maxValue;
+    int getRatio;
+    size_t depth;
+    bool preload;
+} settings;
+
+// The values we send (they're all 'x', we only care about the size)
+static vector<char> valueBuffer;
+
+static void die(const char *message)
+{
+    fprintf(stderr, "%s: %s\n", message, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * A histogram of the latencies (in ns). Each power of two is split into
+ * 16 buckets, so a value is reported within 1/16 (6.25%) of what it was.
+ */
+class Histogram {
+public:
+    Histogram() : count(0), max(0) {
+        memset(counts, 0, sizeof(counts));
+    }
+
+    void add(uint64_t value) {
+        ++counts[index(value)];
+        ++count;
+        if (value > max) {
+            max = value;
+        }
+    }
+
+    void merge(const Histogram &other) {
+        for (int ii = 0; ii < numBuckets; ++ii) {
+            counts[ii] += other.counts[ii];
+        }
+        count += other.count;
+        if (other.max > max) {
+            max = other.max;
+        }
+    }
+
+    /**
+     * Get the value which the given percentage of the values are below
+     * @param percent the percentile (0 - 100)
+     * @return the (upper bound of the bucket of) the value
+     */
+    uint64_t percentile(double percent) const {
+        uint64_t target = (uint64_t)ceil(count * percent / 100.0);
+        uint64_t seen = 0;
+
+        if (target == 0) {
+            target = 1;
+        }
+        for (int ii = 0; ii < numBuckets; ++ii) {
+            seen += counts[ii];
+            if (seen >= target) {
+                uint64_t value = upperBound(ii);
+                return value < max ? value : max;
+            }
+        }
+        return max;
+    }
+
+    uint64_t count;
+    uint64_t max;
+
+private:
+    static const int subBits = 4;
+    static const int numBuckets = 64 << subBits;
+
+    static int index(uint64_t value) {
+        int msb = 0;
+        while ((value >> msb) > 1) {
+            ++msb;
+        }
+        if (msb < subBits) {
+            return (int)value;
+        }
+        int shift = msb - subBits;
+        return ((shift + 1) << subBits) +
+            (int)((value >> shift) & ((1 << subBits) - 1));
+    }
+
+    static uint64_t upperBound(int idx) {
+        if (idx < (1 << subBits)) {
+            return idx;
+        }
+        int shift = (idx >> subBits) - 1;
+        uint64_t top = (1 << subBits) + (idx & ((1 << subBits) - 1));
+        return ((top + 1) << shift) - 1;
+    }
+
+    uint64_t counts[numBuckets];
+};
+
+/**
+ * xorshift64*, every thread has its own
+ */
+class Random {
+public:
+    Random(uint64_t seed) : state(seed ? seed : 0x9e3779b97f4a7c15ULL) {
+    }
+
+    uint64_t next(void) {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 2685821657736338717ULL;
+    }
+
+    // In [0, 1)
+    double nextDouble(void) {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    // In [0, n)
+    uint32_t nextInt(uint32_t n) {
+        return (uint32_t)(next() % n);
+    }
+
+private:
+    uint64_t state;
+};
+
+/**
+ * Picks the keys, either uniformly or with a zipfian distribution (with
+ * the method of Gray et al, "Quickly Generating Billion-Record Synthetic
+ * Databases"), where key 0 is the most popular one.
+ */
+class KeyChooser {
+public:
+    KeyChooser(uint32_t _n, double _theta) :
+        n(_n), theta(_theta), zetan(0), eta(0), alpha(0), half(0)
+    {
+        if (theta > 0) {
+            for (uint32_t ii = 1; ii <= n; ++ii) {
+                zetan += 1.0 / pow((double)ii, theta);
+            }
+            double zeta2 = 1.0 + pow(0.5, theta);
+            alpha = 1.0 / (1.0 - theta);
+            eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+            half = 1.0 + pow(0.5, theta);
+        }
+    }
+
+    uint32_t next(Random &rnd) const {
+        if (theta <= 0) {
+            return rnd.nextInt(n);
+        }
+
+        double u = rnd.nextDouble();
+        double uz = u * zetan;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < half) {
+            return 1;
+        }
+        uint32_t key = (uint32_t)(n * pow(eta * u - eta + 1.0, alpha));
+        return key < n ? key : n - 1;
+    }
+
+private:
+    const uint32_t n;
+    const double theta;
+    double zetan;
+    double eta;
+    double alpha;
+    double half;
+};
+
+struct Op {
+    // When it should have been sent, and when it was
+    hrtime_t intended;
+    hrtime_t sent;
+    uint8_t opcode;
+    uint32_t key;
+};
+
+struct Connection {
+    Connection() : sock(INVALID_SOCKET), outputOffset(0), input(65536),
+                   inputUsed(0), maxBacklog(0) {
+    }
+
+    ~Connection() {
+        if (sock != INVALID_SOCKET) {
+            closesocket(sock);
+        }
+    }
+
+    bool idle(void) const {
+        return backlog.empty() && outstanding.empty() && output.empty();
+    }
+
+    SOCKET sock;
+    // The requests which have arrived but can't be sent yet
+    deque<Op> backlog;
+    // The requests we sent, by their opaque
+    map<uint32_t, Op> outstanding;
+    vector<char> output;
+    size_t outputOffset;
+    vector<char> input;
+    size_t inputUsed;
+    size_t maxBacklog;
+};
+
+class Worker {
+public:
+    Worker(int _id, const KeyChooser &_keys) :
+        gets(0), sets(0), misses(0), errors(0), incomplete(0),
+        id(_id), keys(_keys), rnd(gethrtime() * (_id + 1)), nextOpaque(0),
+        record(false), start(0), end(0), interval(0), scheduled(0)
+    {
+    }
+
+    ~Worker() {
+        for (size_t ii = 0; ii < conns.size(); ++ii) {
+            delete conns[ii];
+        }
+    }
+
+    void connect(void) {
+        for (int ii = 0; ii < settings.connections; ++ii) {
+            Connection *c = new Connection;
+            c->sock = connectToServer();
+            conns.push_back(c);
+        }
+    }
+
+    // Store all of the keys of this thread (which aren't measured)
+    void preload(void) {
+        size_t rr = 0;
+        for (uint32_t key = id; key < settings.keys;
+             key += settings.threads) {
+            Op op;
+            op.intended = 0;
+            op.sent = 0;
+            op.opcode = PROTOCOL_BINARY_CMD_SET;
+            op.key = key;
+            conns[rr++ % conns.size()]->backlog.push_back(op);
+        }
+        record = false;
+        loop(false, gethrtime() + 3600 * 1000000000ULL);
+    }
+
+    /**
+     * Run the measured load
+     * @param _start when the first request arrives
+     * @param _end when the last one may arrive
+     */
+    void run(hrtime_t _start, hrtime_t _end) {
+        // The requests of the threads are interleaved
+        interval = 1000000000.0 * settings.threads / settings.rate;
+        start = _start + (hrtime_t)(interval * id / settings.threads);
+        end = _end;
+        scheduled = 0;
+        record = true;
+        loop(true, end + DRAIN_TIME * 1000000000ULL);
+
+        for (size_t ii = 0; ii < conns.size(); ++ii) {
+            incomplete += conns[ii]->backlog.size() +
+                conns[ii]->outstanding.size();
+        }
+    }
+
+    Histogram latency;
+    Histogram service;
+    uint64_t gets;
+    uint64_t sets;
+    uint64_t misses;
+    uint64_t errors;
+    uint64_t incomplete;
+
+    size_t maxBacklog(void) const {
+        size_t max = 0;
+        for (size_t ii = 0; ii < conns.size(); ++ii) {
+            if (conns[ii]->maxBacklog > max) {
+                max = conns[ii]->maxBacklog;
+            }
+        }
+        return max;
+    }
+
+private:
+    SOCKET connectToServer(void) {
+        struct addrinfo *ai = NULL;
+        struct addrinfo hints;
+        SOCKET sock = INVALID_SOCKET;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_protocol = IPPROTO_TCP;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if (getaddrinfo(settings.host.c_str(), settings.port.c_str(),
+                        &hints, &ai) != 0) {
+            fprintf(stderr, "Failed to look up %s\n", settings.host.c_str());
+            exit(EXIT_FAILURE);
+        }
+
+        for (struct addrinfo *e = ai; e != NULL; e = e->ai_next) {
+            if ((sock = socket(e->ai_family, e->ai_socktype,
+                               e->ai_protocol)) != INVALID_SOCKET) {
+                if (::connect(sock, e->ai_addr, e->ai_addrlen) == 0) {
+                    break;
+                }
+                closesocket(sock);
+                sock = INVALID_SOCKET;
+            }
+        }
+        freeaddrinfo(ai);
+
+        if (sock == INVALID_SOCKET) {
+            die("Failed to connect to the server");
+        }
+
+        int flag = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&flag,
+                   sizeof(flag));
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        return sock;
+    }
+
+    // Schedule the requests which have arrived by now
+    void arrive(hrtime_t now) {
+        hrtime_t next;
+        while ((next = start + (hrtime_t)(scheduled * interval)) <= now &&
+               next < end) {
+            Op op;
+            op.intended = next;
+            op.sent = 0;
+            if ((int)rnd.nextInt(100) < settings.getRatio) {
+                op.opcode = PROTOCOL_BINARY_CMD_GET;
+            } else {
+                op.opcode = PROTOCOL_BINARY_CMD_SET;
+            }
+            op.key = keys.next(rnd);
+
+            Connection *c = conns[scheduled % conns.size()];
+            c->backlog.push_back(op);
+            if (c->backlog.size() > c->maxBacklog) {
+                c->maxBacklog = c->backlog.size();
+            }
+            ++scheduled;
+        }
+    }
+
+    void loop(bool arrivals, hrtime_t deadline) {
+        vector<struct pollfd> fds(conns.size());
+
+        while (true) {
+            hrtime_t now = gethrtime();
+            bool arriving = arrivals && now < end;
+            if (arriving) {
+                arrive(now);
+            } else if (idle() || now >= deadline) {
+                return;
+            }
+
+            for (size_t ii = 0; ii < conns.size(); ++ii) {
+                Connection *c = conns[ii];
+                fill(*c, now);
+                flush(*c);
+                fds[ii].fd = c->sock;
+                fds[ii].events = POLLIN;
+                if (!c->output.empty()) {
+                    fds[ii].events |= POLLOUT;
+                }
+                fds[ii].revents = 0;
+            }
+
+            // Wake up in time for the next request (we spin for the last
+            // millisecond, as that's all the resolution poll has)
+            hrtime_t wakeup = deadline;
+            if (arriving) {
+                wakeup = start + (hrtime_t)(scheduled * interval);
+            }
+            int timeout = 100;
+            if (wakeup <= now) {
+                timeout = 0;
+            } else if ((wakeup - now) / 1000000 < (hrtime_t)timeout) {
+                timeout = (int)((wakeup - now) / 1000000);
+            }
+
+            if (poll(&fds[0], fds.size(), timeout) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                die("poll failed");
+            }
+
+            for (size_t ii = 0; ii < conns.size(); ++ii) {
+                if (fds[ii].revents & (POLLIN | POLLERR | POLLHUP)) {
+                    drain(*conns[ii]);
+                }
+                if (fds[ii].revents & POLLOUT) {
+                    flush(*conns[ii]);
+                }
+            }
+        }
+    }
+
+    bool idle(void) const {
+        for (size_t ii = 0; ii < conns.size(); ++ii) {
+            if (!conns[ii]->idle()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Move the requests from the backlog into the pipeline
+    void fill(Connection &c, hrtime_t now) {
+        while (!c.backlog.empty() && c.outstanding.size() < settings.depth) {
+            Op op = c.backlog.front();
+            c.backlog.pop_front();
+            op.sent = now;
+            uint32_t opaque = nextOpaque++;
+            encode(c, op, opaque);
+            c.outstanding[opaque] = op;
+        }
+    }
+
+    void encode(Connection &c, const Op &op, uint32_t opaque) {
+        char key[32];
+        int keylen = snprintf(key, sizeof(key), "mcbench_%u", op.key);
+        uint8_t extlen = 0;
+        uint32_t vallen = 0;
+        protocol_binary_request_set req;
+
+        memset(req.bytes, 0, sizeof(req.bytes));
+        if (op.opcode == PROTOCOL_BINARY_CMD_SET) {
+            extlen = 8;
+            vallen = settings.minValue;
+            if (settings.maxValue > settings.minValue) {
+                vallen += rnd.nextInt(settings.maxValue -
+                                      settings.minValue + 1);
+            }
+        }
+        req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+        req.message.header.request.opcode = op.opcode;
+        req.message.header.request.keylen = htons((uint16_t)keylen);
+        req.message.header.request.extlen = extlen;
+        req.message.header.request.bodylen = htonl(extlen + keylen + vallen);
+        req.message.header.request.opaque = opaque;
+
+        const char *ptr = reinterpret_cast<const char *>(req.bytes);
+        c.output.insert(c.output.end(), ptr,
+                        ptr + sizeof(req.message.header) + extlen);
+        c.output.insert(c.output.end(), key, key + keylen);
+        if (vallen > 0) {
+            c.output.insert(c.output.end(), valueBuffer.begin(),
+                            valueBuffer.begin() + vallen);
+        }
+    }
+
+    void flush(Connection &c) {
+        while (c.outputOffset < c.output.size()) {
+            ssize_t nw = send(c.sock, &c.output[c.outputOffset],
+                              c.output.size() - c.outputOffset, 0);
+            if (nw == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                    return;
+                }
+                die("Failed to send to the server");
+            }
+            c.outputOffset += nw;
+        }
+        c.output.clear();
+        c.outputOffset = 0;
+    }
+
+    void drain(Connection &c) {
+        ssize_t nr;
+
+        while ((nr = recv(c.sock, &c.input[c.inputUsed],
+                          c.input.size() - c.inputUsed, 0)) > 0) {
+            c.inputUsed += nr;
+
+            size_t offset = 0;
+            protocol_binary_response_header res;
+            while (c.inputUsed - offset >= sizeof(res.bytes)) {
+                memcpy(res.bytes, &c.input[offset], sizeof(res.bytes));
+                if (res.response.magic != PROTOCOL_BINARY_RES) {
+                    fprintf(stderr, "Invalid response from the server\n");
+                    exit(EXIT_FAILURE);
+                }
+                size_t total = sizeof(res.bytes) + ntohl(res.response.bodylen);
+                if (c.inputUsed - offset < total) {
+                    if (total > c.input.size()) {
+                        c.input.resize(total);
+                    }
+                    break;
+                }
+                complete(c, res);
+                offset += total;
+            }
+
+            if (offset > 0) {
+                memmove(&c.input[0], &c.input[offset], c.inputUsed - offset);
+                c.inputUsed -= offset;
+            }
+        }
+
+        if (nr == 0) {
+            fprintf(stderr, "The server closed the connection\n");
+            exit(EXIT_FAILURE);
+        }
+        if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) {
+            die("Failed to read from the server");
+        }
+    }
+
+    void complete(Connection &c, const protocol_binary_response_header &res) {
+        map<uint32_t, Op>::iterator iter;
+        iter = c.outstanding.find(res.response.opaque);
+        if (iter == c.outstanding.end() ||
+            iter->second.opcode != res.response.opcode) {
+            fprintf(stderr, "Got a response to a request we didn't send\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (record) {
+            const Op &op = iter->second;
+            hrtime_t now = gethrtime();
+            latency.add(now - op.intended);
+            service.add(now - op.sent);
+
+            uint16_t status = ntohs(res.response.status);
+            if (op.opcode == PROTOCOL_BINARY_CMD_GET) {
+                ++gets;
+                if (status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT) {
+                    ++misses;
+                } else if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+                    ++errors;
+                }
+            } else {
+                ++sets;
+                if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+                    ++errors;
+                }
+            }
+        }
+        c.outstanding.erase(iter);
+    }
+
+    const int id;
+    const KeyChooser &keys;
+    Random rnd;
+    vector<Connection*> conns;
+    uint32_t nextOpaque;
+    bool record;
+    hrtime_t start;
+    hrtime_t end;
+    // ns between the requests of this thread
+    double interval;
+    uint64_t scheduled;
+};
+
+static hrtime_t runStart;
+static hrtime_t runEnd;
+
+extern "C" {
+    static void preload_main(void *arg) {
+        reinterpret_cast<Worker*>(arg)->preload();
+    }
+
+    static void run_main(void *arg) {
+        reinterpret_cast<Worker*>(arg)->run(runStart, runEnd);
+    }
+}
+
+static void runThreads(vector<Worker*> &workers, void (*func)(void *))
+{
+    vector<cb_thread_t> tids(workers.size());
+    for (size_t ii = 0; ii < workers.size(); ++ii) {
+        void *arg = reinterpret_cast<void*>(workers[ii]);
+        cb_assert(cb_create_thread(&tids[ii], func, arg, 0) == 0);
+    }
+    for (size_t ii = 0; ii < tids.size(); ++ii) {
+        cb_assert(cb_join_thread(tids[ii]) == 0);
+    }
+}
+
+static void printLatency(const char *name, const Histogram &histogram)
+{
+    printf("%-10s p50 %9.1f  p90 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f\n",
+           name,
+           histogram.percentile(50) / 1000.0,
+           histogram.percentile(90) / 1000.0,
+           histogram.percentile(99) / 1000.0,
+           histogram.percentile(99.9) / 1000.0,
+           histogram.max / 1000.0);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage mcbench [-h host[:port]] [-p port] [-t threads]\n"
+            "              [-c connections per thread] [-r ops per second]\n"
+            "              [-d seconds] [-k keys] [-z zipf theta]\n"
+            "              [-v size[:max size]] [-g percent gets]\n"
+            "              [-P pipeline depth] [-L]\n"
+            "\n"
+            "  -z  pick the keys with a zipfian distribution with the\n"
+            "      given skew (0 < theta < 1) instead of uniformly\n"
+            "  -P  the most requests outstanding on a connection\n"
+            "  -L  store all of the keys before the run\n");
+}
+
+/**
+ * Program entry point. Throw the load at a memcached server (with the
+ * binary protocol) and report the throughput and latencies.
+ *
+ * @param argc argument count
+ * @param argv argument vector
+ * @return 0 if success, error code otherwise
+ */
+int main(int argc, char **argv)
+{
+    int cmd;
+    char *ptr;
+
+    settings.host = "localhost";
+    settings.port = "11211";
+    settings.threads = 4;
+    settings.connections = 1;
+    settings.rate = 10000;
+    settings.duration = 10;
+    settings.keys = 100000;
+    settings.theta = 0;
+    settings.minValue = settings.maxValue = 100;
+    settings.getRatio = 90;
+    settings.depth = 1;
+    settings.preload = false;
+
+    /* Initialize the socket subsystem */
+    cb_initialize_sockets();
+
+    while ((cmd = getopt(argc, argv, "h:p:t:c:r:d:k:z:v:g:P:L")) != EOF) {
+        switch (cmd) {
+        case 'h' :
+            ptr = strchr(optarg, ':');
+            if (ptr != NULL) {
+                *ptr = '\0';
+                settings.port = ptr + 1;
+            }
+            settings.host = optarg;
+            break;
+        case 'p' :
+            settings.port = optarg;
+            break;
+        case 't' :
+            settings.threads = atoi(optarg);
+            break;
+        case 'c' :
+            settings.connections = atoi(optarg);
+            break;
+        case 'r' :
+            settings.rate = atof(optarg);
+            break;
+        case 'd' :
+            settings.duration = atoi(optarg);
+            break;
+        case 'k' :
+            settings.keys = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'z' :
+            settings.theta = atof(optarg);
+            break;
+        case 'v' :
+            settings.minValue = (uint32_t)strtoul(optarg, &ptr, 10);
+            if (*ptr == ':') {
+                settings.maxValue = (uint32_t)strtoul(ptr + 1, NULL, 10);
+            } else {
+                settings.maxValue = settings.minValue;
+            }
+            break;
+        case 'g' :
+            settings.getRatio = atoi(optarg);
+            break;
+        case 'P' :
+            settings.depth = (size_t)atoi(optarg);
+            break;
+        case 'L' :
+            settings.preload = true;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (settings.threads < 1 || settings.connections < 1 ||
+        settings.rate <= 0 || settings.duration < 1 || settings.keys < 2 ||
+        settings.theta < 0 || settings.theta >= 1 ||
+        settings.maxValue < settings.minValue ||
+        settings.getRatio < 0 || settings.getRatio > 100 ||
+        settings.depth < 1) {
+        usage();
+        return 1;
+    }
+
+    valueBuffer.assign(settings.maxValue, 'x');
+    KeyChooser keys(settings.keys, settings.theta);
+
+    vector<Worker*> workers;
+    for (int ii = 0; ii < settings.threads; ++ii) {
+        Worker *w = new Worker(ii, keys);
+        w->connect();
+        workers.push_back(w);
+    }
+
+    if (settings.preload) {
+        runThreads(workers, preload_main);
+    }
+
+    runStart = gethrtime() + 10000000;
+    runEnd = runStart + settings.duration * 1000000000ULL;
+    runThreads(workers, run_main);
+
+    Histogram latency;
+    Histogram service;
+    uint64_t gets = 0, sets = 0, misses = 0, errors = 0, incomplete = 0;
+    size_t maxBacklog = 0;
+    for (size_t ii = 0; ii < workers.size(); ++ii) {
+        Worker *w = workers[ii];
+        latency.merge(w->latency);
+        service.merge(w->service);
+        gets += w->gets;
+        sets += w->sets;
+        misses += w->misses;
+        errors += w->errors;
+        incomplete += w->incomplete;
+        if (w->maxBacklog() > maxBacklog) {
+            maxBacklog = w->maxBacklog();
+        }
+        delete w;
+    }
+
+    printf("%d threads, %d connections each, %.0f ops/s offered for %ds\n",
+           settings.threads, settings.connections, settings.rate,
+           settings.duration);
+    printf("completed  %llu (%.0f ops/s), %llu gets (%llu misses), "
+           "%llu sets, %llu errors\n",
+           (unsigned long long)latency.count,
+           latency.count / (double)settings.duration,
+           (unsigned long long)gets, (unsigned long long)misses,
+           (unsigned long long)sets, (unsigned long long)errors);
+    if (incomplete > 0) {
+        printf("incomplete %llu (not answered within %ds of the end)\n",
+               (unsigned long long)incomplete, DRAIN_TIME);
+    }
+    printf("backlog    at most %lu requests waiting on a connection\n",
+           (unsigned long)maxBacklog);
+    printf("latency (us), from when the requests should have been sent:\n");
+    printLatency("  response", latency);
+    printf("latency (us), from when they were sent:\n");
+    printLatency("  service", service);
+
+    return incomplete > 0 || errors > 0 ? 1 : 0;
+}
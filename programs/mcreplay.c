@@ -0,0 +1,674 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Replay the request traces the file logger writes (with request_trace
+ * and the tracefile configuration parameter) against a server, or right
+ * against an engine on the mock server of engine_testapp, and report the
+ * latencies.
+ *
+ * The trace only has the hash of a key, its length and the length of the
+ * value, so every key hash of the trace becomes a key of its own of that
+ * length made of the hex digits of the hash (and the values are that many
+ * x'es). The gets hit and miss as they did then as long as the keys of
+ * the trace didn't share a hash.
+ *
+ * The requests go one at a time in the order they started in (and a
+ * request waits for the response of the one before it), so a replay of a
+ * trace does the same every time. With -x speed they start as far apart
+ * as they did in the trace (divided by speed), and with -x 0 as fast as
+ * the server gets through them. The connections of the trace are spread
+ * over -c connections by their number.
+ *
+ * We replay the gets, the mutations, the deletes, the arithmetic and the
+ * touches (the quiet ones as the ones which aren't), and skip the rest.
+ */
+#include "config.h"
+
+#include <memcached/protocol_binary.h>
+#include <memcached/engine.h>
+#include <memcached/extension_loggers.h>
+#include <platform/platform.h>
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "programs/engine_testapp/mock_server.h"
+#include "programs/trace_reader.h"
+#include "programs/utilities.h"
+#include "utilities/engine_loader.h"
+#include "utilities/protocol2text.h"
+
+/* The key of the requests of the old traces (without the lengths) */
+#define DEFAULT_KEY_LENGTH 16
+
+/* A request which starts this much after it should have is late (ns) */
+#define LATE_THRESHOLD 1000000
+
+struct replay_request {
+    trace_record_t record;
+    /* The start of the request in the trace (us since the epoch) */
+    uint64_t start;
+    /* Its place in the trace (for the ones which started at once) */
+    size_t seq;
+};
+
+struct replay_conn {
+    /* Against a server */
+    SSL_CTX *ctx;
+    BIO *bio;
+    /* Against an engine */
+    const void *cookie;
+};
+
+/* The latencies of one opcode */
+struct replay_stats {
+    uint32_t *recorded;     /* us */
+    uint32_t *replayed;     /* ns */
+    size_t count;
+    size_t size;
+    uint64_t mismatches;    /* it didn't get the status it got in the trace */
+};
+
+static struct {
+    const char *host;
+    const char *port;
+    const char *user;
+    const char *pass;
+    int secure;
+    const char *engine;
+    const char *config;
+    double speed;
+    int nconns;
+} settings;
+
+static ENGINE_HANDLE *handle;
+static ENGINE_HANDLE_V1 *handle_v1;
+static struct replay_conn *conns;
+static struct replay_stats stats[0x100];
+static char *value;
+static size_t value_size;
+static char *response;
+static size_t response_size;
+
+/**
+ * Get the opcode we replay a request with
+ * @return the opcode or -1 if we skip the request
+ */
+static int replay_opcode(uint8_t opcode) {
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GETK:
+    case PROTOCOL_BINARY_CMD_GETKQ:
+        return PROTOCOL_BINARY_CMD_GET;
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_SETQ:
+        return PROTOCOL_BINARY_CMD_SET;
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_ADDQ:
+        return PROTOCOL_BINARY_CMD_ADD;
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+        return PROTOCOL_BINARY_CMD_REPLACE;
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_APPENDQ:
+        return PROTOCOL_BINARY_CMD_APPEND;
+    case PROTOCOL_BINARY_CMD_PREPEND:
+    case PROTOCOL_BINARY_CMD_PREPENDQ:
+        return PROTOCOL_BINARY_CMD_PREPEND;
+    case PROTOCOL_BINARY_CMD_DELETE:
+    case PROTOCOL_BINARY_CMD_DELETEQ:
+        return PROTOCOL_BINARY_CMD_DELETE;
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_INCREMENTQ:
+        return PROTOCOL_BINARY_CMD_INCREMENT;
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENTQ:
+        return PROTOCOL_BINARY_CMD_DECREMENT;
+    case PROTOCOL_BINARY_CMD_TOUCH:
+        return PROTOCOL_BINARY_CMD_TOUCH;
+    case PROTOCOL_BINARY_CMD_GAT:
+    case PROTOCOL_BINARY_CMD_GATQ:
+        return PROTOCOL_BINARY_CMD_GAT;
+    default:
+        return -1;
+    }
+}
+
+/* The key of a key hash of the trace */
+static void make_key(char *key, uint32_t key_hash, uint16_t keylen) {
+    static const char digits[] = "0123456789abcdef";
+    uint16_t ii;
+
+    for (ii = 0; ii < keylen; ++ii) {
+        key[ii] = digits[(key_hash >> ((ii % 8) * 4)) & 0xf];
+    }
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+    if ((ptr = realloc(ptr, size)) == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+static const char *get_value(uint32_t length) {
+    if (length > value_size) {
+        value = xrealloc(value, length);
+        memset(value + value_size, 'x', length - value_size);
+        value_size = length;
+    }
+    return value;
+}
+
+/**
+ * Send the request to the server and wait for its response
+ * @return the status of the response
+ */
+static uint16_t server_replay(struct replay_conn *conn, int opcode,
+                              const char *key, uint16_t keylen,
+                              uint32_t value_length) {
+    protocol_binary_request_header request;
+    protocol_binary_response_header header;
+    char extras[20];
+    uint8_t extlen = 0;
+    uint32_t bodylen;
+
+    if (conn->bio == NULL &&
+        create_ssl_connection(&conn->ctx, &conn->bio, settings.host,
+                              settings.port, settings.user, settings.pass,
+                              settings.secure) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    memset(extras, 0, sizeof(extras));
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+        /* flags and exptime */
+        extlen = 8;
+        break;
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+        /* delta 1, initial 0 and exptime */
+        extlen = 20;
+        extras[7] = 1;
+        break;
+    case PROTOCOL_BINARY_CMD_TOUCH:
+    case PROTOCOL_BINARY_CMD_GAT:
+        extlen = 4;
+        break;
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_PREPEND:
+        break;
+    default:
+        value_length = 0;
+    }
+    bodylen = extlen + keylen + value_length;
+
+    memset(&request, 0, sizeof(request));
+    request.request.magic = PROTOCOL_BINARY_REQ;
+    request.request.opcode = (uint8_t)opcode;
+    request.request.keylen = htons(keylen);
+    request.request.extlen = extlen;
+    request.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    request.request.bodylen = htonl(bodylen);
+    ensure_send(conn->bio, &request, sizeof(request));
+    if (extlen > 0) {
+        ensure_send(conn->bio, extras, extlen);
+    }
+    ensure_send(conn->bio, key, keylen);
+    if (value_length > 0) {
+        ensure_send(conn->bio, get_value(value_length), (int)value_length);
+    }
+    (void)BIO_flush(conn->bio);
+
+    ensure_recv(conn->bio, &header, sizeof(header));
+    bodylen = ntohl(header.response.bodylen);
+    if (bodylen > 0) {
+        if (bodylen > response_size) {
+            response = xrealloc(response, bodylen);
+            response_size = bodylen;
+        }
+        ensure_recv(conn->bio, response, (int)bodylen);
+    }
+    return ntohs(header.response.status);
+}
+
+static uint16_t engine_error_2_status(ENGINE_ERROR_CODE ret) {
+    switch (ret) {
+    case ENGINE_SUCCESS:
+        return PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    case ENGINE_KEY_ENOENT:
+        return PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+    case ENGINE_KEY_EEXISTS:
+        return PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
+    case ENGINE_ENOMEM:
+        return PROTOCOL_BINARY_RESPONSE_ENOMEM;
+    case ENGINE_NOT_STORED:
+        return PROTOCOL_BINARY_RESPONSE_NOT_STORED;
+    case ENGINE_EINVAL:
+        return PROTOCOL_BINARY_RESPONSE_EINVAL;
+    case ENGINE_ENOTSUP:
+        return PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED;
+    case ENGINE_E2BIG:
+        return PROTOCOL_BINARY_RESPONSE_E2BIG;
+    case ENGINE_NOT_MY_VBUCKET:
+        return PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET;
+    case ENGINE_TMPFAIL:
+        return PROTOCOL_BINARY_RESPONSE_ETMPFAIL;
+    case ENGINE_ERANGE:
+        return PROTOCOL_BINARY_RESPONSE_ERANGE;
+    default:
+        return PROTOCOL_BINARY_RESPONSE_EINTERNAL;
+    }
+}
+
+static ENGINE_ERROR_CODE engine_call(const void *cookie, int opcode,
+                                     const char *key, uint16_t keylen,
+                                     uint32_t value_length) {
+    ENGINE_STORE_OPERATION operation;
+    ENGINE_ERROR_CODE ret;
+    item *it = NULL;
+    uint64_t cas = 0;
+    uint64_t result;
+
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+        ret = handle_v1->get(handle, cookie, &it, key, keylen, 0);
+        break;
+    case PROTOCOL_BINARY_CMD_DELETE:
+        return handle_v1->remove(handle, cookie, key, keylen, &cas, 0);
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+        return handle_v1->arithmetic(handle, cookie, key, keylen,
+                                     opcode == PROTOCOL_BINARY_CMD_INCREMENT,
+                                     true, 1, 0, 0, &cas,
+                                     PROTOCOL_BINARY_RAW_BYTES, &result, 0);
+    case PROTOCOL_BINARY_CMD_TOUCH:
+    case PROTOCOL_BINARY_CMD_GAT:
+        if (handle_v1->touch == NULL) {
+            return ENGINE_ENOTSUP;
+        }
+        ret = handle_v1->touch(handle, cookie,
+                               opcode == PROTOCOL_BINARY_CMD_GAT ? &it : NULL,
+                               key, keylen, 0, 0);
+        break;
+    default:
+        switch (opcode) {
+        case PROTOCOL_BINARY_CMD_ADD:
+            operation = OPERATION_ADD;
+            break;
+        case PROTOCOL_BINARY_CMD_REPLACE:
+            operation = OPERATION_REPLACE;
+            break;
+        case PROTOCOL_BINARY_CMD_APPEND:
+            operation = OPERATION_APPEND;
+            break;
+        case PROTOCOL_BINARY_CMD_PREPEND:
+            operation = OPERATION_PREPEND;
+            break;
+        default:
+            operation = OPERATION_SET;
+        }
+        ret = handle_v1->allocate(handle, cookie, &it, key, keylen,
+                                  value_length, 0, 0,
+                                  PROTOCOL_BINARY_RAW_BYTES);
+        if (ret == ENGINE_SUCCESS) {
+            item_info info;
+            info.nvalue = 1;
+            if (handle_v1->get_item_info(handle, cookie, it, &info)) {
+                memset(info.value[0].iov_base, 'x', info.value[0].iov_len);
+            }
+            ret = handle_v1->store(handle, cookie, it, &cas, operation, 0);
+        }
+    }
+
+    if (it != NULL) {
+        handle_v1->release(handle, cookie, it);
+    }
+    return ret;
+}
+
+/**
+ * Run the request in the engine (waiting for it if it blocks)
+ * @return the status the server would have responded with
+ */
+static uint16_t engine_replay(struct replay_conn *conn, int opcode,
+                              const char *key, uint16_t keylen,
+                              uint32_t value_length) {
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+
+    if (conn->cookie == NULL) {
+        conn->cookie = create_mock_cookie();
+        connect_mock_cookie(conn->cookie);
+    }
+
+    lock_mock_cookie(conn->cookie);
+    while (ret == ENGINE_SUCCESS &&
+           (ret = engine_call(conn->cookie, opcode, key, keylen,
+                              value_length)) == ENGINE_EWOULDBLOCK) {
+        waitfor_mock_cookie(conn->cookie);
+        ret = ((struct mock_connstruct *)conn->cookie)->status;
+    }
+    unlock_mock_cookie(conn->cookie);
+    return engine_error_2_status(ret);
+}
+
+static void add_stats(const struct replay_request *request, int opcode,
+                      hrtime_t elapsed, uint16_t status) {
+    struct replay_stats *st = &stats[opcode];
+
+    if (st->count == st->size) {
+        st->size = st->size == 0 ? 1024 : st->size * 2;
+        st->recorded = xrealloc(st->recorded,
+                                st->size * sizeof(*st->recorded));
+        st->replayed = xrealloc(st->replayed,
+                                st->size * sizeof(*st->replayed));
+    }
+    st->recorded[st->count] = request->record.latency;
+    st->replayed[st->count] = elapsed > UINT32_MAX ? UINT32_MAX :
+        (uint32_t)elapsed;
+    st->count++;
+    if (status != request->record.status) {
+        st->mismatches++;
+    }
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* The latency below which pct percent of the (sorted) latencies are */
+static uint32_t percentile(const uint32_t *latencies, size_t count,
+                           double pct) {
+    size_t ii = (size_t)(count * pct / 100);
+    return latencies[ii < count ? ii : count - 1];
+}
+
+static void print_stats(void) {
+    int ii;
+
+    printf("%-20s %10s %10s %10s %10s %10s %10s %10s\n", "opcode",
+           "count", "mismatch", "trace p50", "trace p99", "p50 us",
+           "p99 us", "max us");
+    for (ii = 0; ii < 0x100; ++ii) {
+        struct replay_stats *st = &stats[ii];
+        if (st->count == 0) {
+            continue;
+        }
+        qsort(st->recorded, st->count, sizeof(uint32_t), compare_latency);
+        qsort(st->replayed, st->count, sizeof(uint32_t), compare_latency);
+        printf("%-20s %10lu %10lu %10u %10u %10.1f %10.1f %10.1f\n",
+               memcached_opcode_2_text((uint8_t)ii),
+               (unsigned long)st->count, (unsigned long)st->mismatches,
+               percentile(st->recorded, st->count, 50),
+               percentile(st->recorded, st->count, 99),
+               percentile(st->replayed, st->count, 50) / 1000.0,
+               percentile(st->replayed, st->count, 99) / 1000.0,
+               st->replayed[st->count - 1] / 1000.0);
+    }
+}
+
+static int compare_requests(const void *a, const void *b) {
+    const struct replay_request *x = a;
+    const struct replay_request *y = b;
+    if (x->start != y->start) {
+        return x->start < y->start ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : (x->seq > y->seq ? 1 : 0);
+}
+
+/**
+ * Read the requests of the trace files we replay
+ * @return the number of them (or -1 if we failed to read the files)
+ */
+static long read_requests(char **files, int nfiles,
+                          struct replay_request **requests,
+                          size_t *skipped) {
+    size_t size = 0;
+    size_t count = 0;
+    int ii;
+
+    *requests = NULL;
+    *skipped = 0;
+    for (ii = 0; ii < nfiles; ++ii) {
+        trace_reader_t reader;
+        trace_record_t record;
+        int ret;
+
+        if (!trace_reader_open(&reader, files[ii])) {
+            return -1;
+        }
+        while ((ret = trace_reader_next(&reader, &record)) == 1) {
+            struct replay_request *request;
+            if (replay_opcode(record.opcode) == -1) {
+                ++*skipped;
+                continue;
+            }
+            if (count == size) {
+                size = size == 0 ? 4096 : size * 2;
+                *requests = xrealloc(*requests, size * sizeof(*request));
+            }
+            request = *requests + count;
+            request->record = record;
+            request->start = record.timestamp - record.latency;
+            request->seq = count++;
+        }
+        trace_reader_close(&reader);
+        if (ret != 0) {
+            return -1;
+        }
+    }
+
+    qsort(*requests, count, sizeof(**requests), compare_requests);
+    return (long)count;
+}
+
+static void replay(const struct replay_request *requests, size_t count) {
+    char key[0x10000];
+    hrtime_t begin = gethrtime();
+    hrtime_t took;
+    uint64_t late = 0;
+    size_t ii;
+
+    for (ii = 0; ii < count; ++ii) {
+        const trace_record_t *record = &requests[ii].record;
+        struct replay_conn *conn = &conns[record->connection %
+                                          settings.nconns];
+        int opcode = replay_opcode(record->opcode);
+        uint16_t keylen = record->keylen;
+        hrtime_t start;
+        uint16_t status;
+
+        if (settings.speed > 0) {
+            hrtime_t due = begin + (hrtime_t)((requests[ii].start -
+                                               requests[0].start) *
+                                              1000 / settings.speed);
+            hrtime_t now = gethrtime();
+            if (due > now) {
+                usleep((useconds_t)((due - now) / 1000));
+            } else if (now - due > LATE_THRESHOLD) {
+                ++late;
+            }
+        }
+
+        if (keylen == 0) {
+            keylen = DEFAULT_KEY_LENGTH;
+        }
+        make_key(key, record->key_hash, keylen);
+
+        start = gethrtime();
+        if (settings.engine != NULL) {
+            status = engine_replay(conn, opcode, key, keylen,
+                                   record->value_length);
+        } else {
+            status = server_replay(conn, opcode, key, keylen,
+                                   record->value_length);
+        }
+        add_stats(requests + ii, opcode, gethrtime() - start, status);
+    }
+
+    took = gethrtime() - begin;
+    printf("Replayed %lu requests in %.3f s (%.0f a second)",
+           (unsigned long)count, took / 1e9,
+           took > 0 ? count * 1e9 / took : 0.0);
+    if (settings.speed > 0) {
+        printf(", %lu of them late", (unsigned long)late);
+    }
+    printf("\n");
+}
+
+static void start_engine(void) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger = get_null_logger();
+
+    init_mock_server(NULL);
+    mock_set_hash_keys(true);
+    if (!load_engine(settings.engine, get_mock_server_api, logger,
+                     &handle)) {
+        fprintf(stderr, "Failed to load engine %s\n", settings.engine);
+        exit(EXIT_FAILURE);
+    }
+    if (!init_engine(handle, settings.config, logger)) {
+        fprintf(stderr, "Failed to init engine %s with config %s\n",
+                settings.engine, settings.config ? settings.config : "");
+        exit(EXIT_FAILURE);
+    }
+    handle_v1 = (ENGINE_HANDLE_V1 *)handle;
+}
+
+static void stop(void) {
+    int ii;
+
+    for (ii = 0; ii < settings.nconns; ++ii) {
+        if (conns[ii].bio != NULL) {
+            BIO_free_all(conns[ii].bio);
+            if (settings.secure) {
+                SSL_CTX_free(conns[ii].ctx);
+            }
+        }
+        if (conns[ii].cookie != NULL) {
+            destroy_mock_cookie(conns[ii].cookie);
+        }
+    }
+    if (handle != NULL) {
+        handle_v1->destroy(handle, false);
+        destroy_mock_event_callbacks();
+        unload_engine();
+    }
+    for (ii = 0; ii < 0x100; ++ii) {
+        free(stats[ii].recorded);
+        free(stats[ii].replayed);
+    }
+}
+
+int main(int argc, char **argv) {
+    struct replay_request *requests;
+    size_t skipped;
+    long count;
+    int cmd;
+    char *ptr;
+
+    settings.host = "localhost";
+    settings.port = "11210";
+    settings.speed = 1;
+    settings.nconns = 8;
+
+    /* Initialize the socket subsystem */
+    cb_initialize_sockets();
+
+    while ((cmd = getopt(argc, argv, "h:p:u:P:sE:e:x:c:")) != EOF) {
+        switch (cmd) {
+        case 'h' :
+            settings.host = optarg;
+            ptr = strchr(optarg, ':');
+            if (ptr != NULL) {
+                *ptr = '\0';
+                settings.port = ptr + 1;
+            }
+            break;
+        case 'p':
+            settings.port = optarg;
+            break;
+        case 'u' :
+            settings.user = optarg;
+            break;
+        case 'P':
+            settings.pass = optarg;
+            break;
+        case 's':
+            settings.secure = 1;
+            break;
+        case 'E':
+            settings.engine = optarg;
+            break;
+        case 'e':
+            settings.config = optarg;
+            break;
+        case 'x':
+            settings.speed = atof(optarg);
+            if (settings.speed < 0) {
+                fprintf(stderr, "Incorrect speed: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            settings.nconns = atoi(optarg);
+            if (settings.nconns <= 0) {
+                fprintf(stderr, "Incorrect number of connections: %s\n",
+                        optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            optind = argc;
+        }
+    }
+
+    if (optind == argc) {
+        fprintf(stderr,
+                "Usage: mcreplay [-h host[:port]] [-p port] [-u user] [-P pass] [-s]\n"
+                "                [-x speed] [-c connections] file...\n"
+                "       mcreplay -E engine [-e config] [-x speed] [-c connections] file...\n\n"
+                "  -E engine       replay against the engine (on a mock server) instead\n"
+                "  -e config       the configuration of the engine\n"
+                "  -x speed        as many times as fast as the trace (default 1, 0 is as\n"
+                "                  fast as it gets)\n"
+                "  -c connections  the connections (or cookies) to use (default 8)\n");
+        return EXIT_FAILURE;
+    }
+
+    if ((count = read_requests(argv + optind, argc - optind, &requests,
+                               &skipped)) < 0) {
+        return EXIT_FAILURE;
+    }
+    if ((conns = calloc(settings.nconns, sizeof(*conns))) == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return EXIT_FAILURE;
+    }
+    if (settings.engine != NULL) {
+        start_engine();
+    }
+
+    if (count > 0) {
+        replay(requests, (size_t)count);
+    }
+    if (skipped > 0) {
+        printf("Skipped %lu requests we don't replay\n",
+               (unsigned long)skipped);
+    }
+    print_stats();
+
+    stop();
+    free(conns);
+    free(requests);
+    free(value);
+    free(response);
+    return EXIT_SUCCESS;
+}
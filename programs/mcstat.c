@@ -8,6 +8,7 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "utilities.h"
 
@@ -27,12 +28,109 @@ static void print(const char *key, int keylen, const char *val, int vallen) {
     fflush(stdout);
 }
 
+/* The counters we always show in the watch mode */
+static const char *counters[] = {
+    "cmd_get", "get_hits", "get_misses", "cmd_set", "bytes_read",
+    "bytes_written", "evictions", "rbufs_allocated", NULL
+};
+
+/* The most of -b we take */
+#define MAX_BUCKETS 32
+
+/* A numeric stat (the ones which aren't numbers we don't watch) */
+struct stat_value {
+    char *name;
+    int64_t value;
+};
+
+/* All of the numeric stats of a bucket at one point in time */
+struct stat_snapshot {
+    struct stat_value *stats;
+    int nstats;
+    int size;
+    hrtime_t time;
+};
+
+typedef void (*stat_callback)(void *ctx, const char *key, int keylen,
+                              const char *val, int vallen);
+
+static void print_callback(void *ctx, const char *key, int keylen,
+                           const char *val, int vallen) {
+    (void)ctx;
+    print(key, keylen, val, vallen);
+}
+
+/**
+ * Add the stat to the snapshot if it is a number
+ */
+static void snapshot_callback(void *ctx, const char *key, int keylen,
+                              const char *val, int vallen) {
+    struct stat_snapshot *snapshot = ctx;
+    char number[32];
+    char *end;
+    int64_t value;
+
+    if (vallen == 0 || vallen >= (int)sizeof(number)) {
+        return;
+    }
+    memcpy(number, val, vallen);
+    number[vallen] = '\0';
+    value = (int64_t)strtoll(number, &end, 10);
+    if (*end != '\0') {
+        return;
+    }
+
+    if (snapshot->nstats == snapshot->size) {
+        int size = snapshot->size ? snapshot->size * 2 : 128;
+        void *stats = realloc(snapshot->stats, size * sizeof(*snapshot->stats));
+        if (stats == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+        snapshot->stats = stats;
+        snapshot->size = size;
+    }
+
+    if ((snapshot->stats[snapshot->nstats].name = malloc(keylen + 1)) == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+    memcpy(snapshot->stats[snapshot->nstats].name, key, keylen);
+    snapshot->stats[snapshot->nstats].name[keylen] = '\0';
+    snapshot->stats[snapshot->nstats].value = value;
+    ++snapshot->nstats;
+}
+
+static int compare_stat(const void *a, const void *b) {
+    return strcmp(((const struct stat_value *)a)->name,
+                  ((const struct stat_value *)b)->name);
+}
+
+static const struct stat_value *find_stat(const struct stat_snapshot *snapshot,
+                                          const char *name) {
+    struct stat_value key;
+    key.name = (char *)name;
+    return bsearch(&key, snapshot->stats, snapshot->nstats,
+                   sizeof(*snapshot->stats), compare_stat);
+}
+
+static void clear_snapshot(struct stat_snapshot *snapshot) {
+    int ii;
+    for (ii = 0; ii < snapshot->nstats; ++ii) {
+        free(snapshot->stats[ii].name);
+    }
+    snapshot->nstats = 0;
+}
+
 /**
  * Request a stat from the server
  * @param sock socket connected to the server
  * @param key the name of the stat to receive (NULL == ALL)
+ * @param callback what to do with each of them
+ * @param ctx passed on to the callback
  */
-static void request_stat(BIO *bio, const char *key)
+static void request_stat(BIO *bio, const char *key, stat_callback callback,
+                         void *ctx)
 {
     uint32_t buffsize = 0;
     char *buffer = NULL;
@@ -68,9 +166,179 @@ static void request_stat(BIO *bio, const char *key)
                 buffsize = vallen;
             }
             ensure_recv(bio, buffer, vallen);
-            print(buffer, keylen, buffer + keylen, vallen - keylen);
+            callback(ctx, buffer, keylen, buffer + keylen, vallen - keylen);
         }
     } while (response.message.header.response.keylen != 0);
+    free(buffer);
+}
+
+/**
+ * Make the connection use the bucket (as an admin)
+ * @param bio connection to the server
+ * @param bucket the name of the bucket
+ */
+static void select_bucket(BIO *bio, const char *bucket)
+{
+    uint16_t keylen = (uint16_t)strlen(bucket);
+    uint32_t bodylen;
+    protocol_binary_request_no_extras request;
+    protocol_binary_response_no_extras response;
+
+    memset(&request, 0, sizeof(request));
+    request.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    request.message.header.request.opcode = PROTOCOL_BINARY_CMD_SELECT_BUCKET;
+    request.message.header.request.keylen = htons(keylen);
+    request.message.header.request.bodylen = htonl(keylen);
+
+    ensure_send(bio, &request, sizeof(request.bytes));
+    ensure_send(bio, bucket, keylen);
+
+    ensure_recv(bio, &response, sizeof(response.bytes));
+    bodylen = ntohl(response.message.header.response.bodylen);
+    if (bodylen > 0) {
+        char *buffer = malloc(bodylen);
+        if (buffer == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+        ensure_recv(bio, buffer, bodylen);
+        free(buffer);
+    }
+    if (response.message.header.response.status != 0) {
+        fprintf(stderr, "Failed to select bucket \"%s\": %u\n", bucket,
+                ntohs(response.message.header.response.status));
+        exit(1);
+    }
+}
+
+/* How much a stat moved per second since the last time */
+struct stat_rate {
+    const char *name;
+    double rate;
+};
+
+static int compare_rate(const void *a, const void *b) {
+    double ra = ((const struct stat_rate *)a)->rate;
+    double rb = ((const struct stat_rate *)b)->rate;
+    if (ra < 0) {
+        ra = -ra;
+    }
+    if (rb < 0) {
+        rb = -rb;
+    }
+    return ra < rb ? 1 : (ra > rb ? -1 : 0);
+}
+
+static bool is_counter(const char *name) {
+    int ii;
+    for (ii = 0; counters[ii] != NULL; ++ii) {
+        if (strcmp(counters[ii], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Print the counters (and the top movers among all of the stats) per
+ * second since the previous snapshot. The top movers are marked with a *.
+ * @param bucket the name of the bucket (or NULL)
+ * @param prev the previous snapshot
+ * @param curr the current snapshot
+ * @param top how many of the top movers to show
+ */
+static void print_rates(const char *bucket, const struct stat_snapshot *prev,
+                        const struct stat_snapshot *curr, int top)
+{
+    double seconds = (double)(curr->time - prev->time) / 1000000000.0;
+    struct stat_rate *rates;
+    int nrates = 0;
+    int ii;
+
+    if (seconds <= 0) {
+        return;
+    }
+    rates = malloc((curr->nstats + 1) * sizeof(*rates));
+    if (rates == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    for (ii = 0; ii < curr->nstats; ++ii) {
+        const struct stat_value *old = find_stat(prev, curr->stats[ii].name);
+        if (old != NULL) {
+            rates[nrates].name = curr->stats[ii].name;
+            rates[nrates].rate = (double)(curr->stats[ii].value - old->value) /
+                seconds;
+            ++nrates;
+        }
+    }
+    qsort(rates, nrates, sizeof(*rates), compare_rate);
+
+    fprintf(stdout, "--- %s (%.2fs)\n", bucket ? bucket : "-", seconds);
+    for (ii = 0; ii < nrates; ++ii) {
+        bool mover = ii < top && rates[ii].rate != 0;
+        if (mover || is_counter(rates[ii].name)) {
+            fprintf(stdout, "%c %-32s %14.1f/s\n", mover ? '*' : ' ',
+                    rates[ii].name, rates[ii].rate);
+        }
+    }
+    fflush(stdout);
+    free(rates);
+}
+
+/**
+ * Poll the stats of the buckets every interval seconds and print their
+ * rates (with one STAT per bucket each time)
+ */
+static void watch_stats(BIO *bio, const char *key, const char **buckets,
+                        int nbuckets, int interval, int iterations, int top)
+{
+    struct stat_snapshot *snapshots[2];
+    int ii;
+    int jj;
+
+    snapshots[0] = calloc(nbuckets, sizeof(struct stat_snapshot));
+    snapshots[1] = calloc(nbuckets, sizeof(struct stat_snapshot));
+    if (snapshots[0] == NULL || snapshots[1] == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+    }
+
+    for (ii = 0; iterations == 0 || ii <= iterations; ++ii) {
+        struct stat_snapshot *curr = snapshots[ii % 2];
+        struct stat_snapshot *prev = snapshots[(ii + 1) % 2];
+
+        if (ii > 0) {
+#ifdef WIN32
+            Sleep(interval * 1000);
+#else
+            sleep(interval);
+#endif
+        }
+
+        for (jj = 0; jj < nbuckets; ++jj) {
+            clear_snapshot(&curr[jj]);
+            if (buckets[jj] != NULL) {
+                select_bucket(bio, buckets[jj]);
+            }
+            request_stat(bio, key, snapshot_callback, &curr[jj]);
+            curr[jj].time = gethrtime();
+            qsort(curr[jj].stats, curr[jj].nstats, sizeof(*curr[jj].stats),
+                  compare_stat);
+            if (ii > 0) {
+                print_rates(buckets[jj], &prev[jj], &curr[jj], top);
+            }
+        }
+    }
+
+    for (ii = 0; ii < 2; ++ii) {
+        for (jj = 0; jj < nbuckets; ++jj) {
+            clear_snapshot(&snapshots[ii][jj]);
+            free(snapshots[ii][jj].stats);
+        }
+        free(snapshots[ii]);
+    }
 }
 
 int main(int argc, char** argv) {
@@ -80,6 +348,11 @@ int main(int argc, char** argv) {
     const char *user = NULL;
     const char *pass = NULL;
     int secure = 0;
+    const char *buckets[MAX_BUCKETS];
+    int nbuckets = 0;
+    int interval = 0;
+    int iterations = 0;
+    int top = 5;
     char *ptr;
     SSL_CTX* ctx;
     BIO* bio;
@@ -87,7 +360,7 @@ int main(int argc, char** argv) {
     /* Initialize the socket subsystem */
     cb_initialize_sockets();
 
-    while ((cmd = getopt(argc, argv, "h:p:u:P:s")) != EOF) {
+    while ((cmd = getopt(argc, argv, "h:p:u:P:sb:i:c:n:")) != EOF) {
         switch (cmd) {
         case 'h' :
             host = optarg;
@@ -109,23 +382,70 @@ int main(int argc, char** argv) {
         case 's':
             secure = 1;
             break;
+        case 'b':
+            if (nbuckets == MAX_BUCKETS) {
+                fprintf(stderr, "No more than %d of -b\n", MAX_BUCKETS);
+                return 1;
+            }
+            buckets[nbuckets++] = optarg;
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            if (interval <= 0) {
+                fprintf(stderr, "Incorrect interval: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            iterations = atoi(optarg);
+            break;
+        case 'n':
+            top = atoi(optarg);
+            break;
         default:
             fprintf(stderr,
-                    "Usage mcstat [-h host[:port]] [-p port] [-u user] [-P pass] [-s] [statkey]*\n");
+                    "Usage mcstat [-h host[:port]] [-p port] [-u user] [-P pass] [-s] [statkey]*\n"
+                    "       mcstat [-h host[:port]] [-p port] [-u user] [-P pass] [-s] -i interval\n"
+                    "              [-c count] [-n top] [-b bucket]* [statkey]\n\n"
+                    "  -i interval  print the counters per second every interval seconds\n"
+                    "  -c count     stop after that many intervals\n"
+                    "  -n top       mark (and show) the top movers (default 5)\n"
+                    "  -b bucket    select the bucket (as an admin) before each STAT; may be\n"
+                    "               given more than once\n");
             return 1;
         }
     }
 
+    if (interval > 0 && argc - optind > 1) {
+        fprintf(stderr, "Only one statkey may be watched\n");
+        return 1;
+    }
+
     if (create_ssl_connection(&ctx, &bio, host, port, user, pass, secure) != 0) {
         return 1;
     }
 
-    if (optind == argc) {
-        request_stat(bio, NULL);
+    if (nbuckets == 0) {
+        buckets[nbuckets++] = NULL;
+    }
+
+    if (interval > 0) {
+        watch_stats(bio, optind == argc ? NULL : argv[optind], buckets,
+                    nbuckets, interval, iterations, top);
     } else {
         int ii;
-        for (ii = optind; ii < argc; ++ii) {
-            request_stat(bio, argv[ii]);
+        int jj;
+        for (jj = 0; jj < nbuckets; ++jj) {
+            if (buckets[jj] != NULL) {
+                select_bucket(bio, buckets[jj]);
+            }
+            if (optind == argc) {
+                request_stat(bio, NULL, print_callback, NULL);
+            } else {
+                for (ii = optind; ii < argc; ++ii) {
+                    request_stat(bio, argv[ii], print_callback, NULL);
+                }
+            }
         }
     }
 
@@ -6,167 +6,254 @@
 #include <platform/platform.h>
 
 #include <getopt.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
 #include <cJSON.h>
 
 #include "utilities.h"
 #include "utilities/protocol2text.h"
 
-typedef struct timings_st {
-    uint32_t max;
-
-    /* We collect timings for <=1 us */
-    uint32_t ns;
-
-    /* We collect timings per 10usec */
-    uint32_t us[100];
-
-    /* we collect timings from 0-49 ms (entry 0 is never used!) */
-    uint32_t ms[50];
+/* The most buckets the server has (every power of two split in eight) */
+#define MAX_BUCKETS 512
 
-    uint32_t halfsec[10];
+/* The most of -b we take */
+#define MAX_GROUPS 32
 
-    uint32_t wayout;
+typedef struct timings_st {
+    /* The largest bucket count (for the width of the bars) */
+    uint64_t max;
+
+    /* The number of samples, and the largest one in ns */
+    uint64_t count;
+    uint64_t slowest;
+
+    /* The buckets with samples in them (by their lower bound) */
+    int nbuckets;
+    struct {
+        uint64_t lower;
+        uint64_t upper;
+        uint64_t count;
+    } buckets[MAX_BUCKETS];
 } timings_t;
 
-timings_t timings;
+/* The percentiles we show (along with the count and the largest one) */
+static const struct {
+    const char *name;
+    double fraction;
+} percentiles[] = {
+    { "p50", 0.5 },
+    { "p90", 0.9 },
+    { "p99", 0.99 },
+    { "p99.9", 0.999 }
+};
+
+#define NUM_PERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
+
+/* Writes the ns in the unit which suits it */
+static int format_time(char *buffer, uint64_t ns)
+{
+    if (ns < 10000) {
+        return sprintf(buffer, "%" PRIu64 "ns", ns);
+    } else if (ns < 10000000) {
+        return sprintf(buffer, "%" PRIu64 "us", ns / 1000);
+    } else {
+        return sprintf(buffer, "%" PRIu64 "ms", ns / 1000000);
+    }
+}
 
-static void callback(const char *timeunit, uint32_t min, uint32_t max, uint32_t total)
+static void callback(const timings_t *timings, uint64_t min, uint64_t max,
+                     uint64_t total)
 {
     if (total > 0) {
         int ii;
         char buffer[1024];
         int offset;
         int num;
-        if (min > 0 && max == 0) {
-            offset = sprintf(buffer, "[%4u - inf.]%s", min, timeunit);
-        } else {
-            offset = sprintf(buffer, "[%4u - %4u]%s", min, max, timeunit);
+
+        offset = sprintf(buffer, "[");
+        offset += format_time(buffer + offset, min);
+        offset += sprintf(buffer + offset, " - ");
+        offset += format_time(buffer + offset, max);
+        offset += sprintf(buffer + offset, "]");
+        while (offset < 24) {
+            buffer[offset++] = ' ';
         }
-        num = (float)40.0 * (float)total / (float)timings.max;
+        num = (float)40.0 * (float)total / (float)timings->max;
         offset += sprintf(buffer + offset, " |");
         for (ii = 0; ii < num; ++ii) {
             offset += sprintf(buffer + offset, "#");
         }
 
-        sprintf(buffer + offset, " - %u\n", total);
+        sprintf(buffer + offset, " - %" PRIu64 "\n", total);
         fputs(buffer, stdout);
     }
 }
 
-static void dump_histogram(void)
+/* The value below which the fraction of the samples are, the way the
+ * server does it (the upper bound of the bucket the sample falls in, and
+ * no more than the largest one) */
+static uint64_t get_percentile(const timings_t *timings, double fraction)
 {
+    uint64_t rank = (uint64_t)(fraction * (double)timings->count);
+    uint64_t seen = 0;
     int ii;
 
-    callback("ns", 0, 999, timings.ns);
-    for (ii = 0; ii < 100; ++ii) {
-        callback("us", ii * 10, ((ii + 1) * 10 - 1), timings.us[ii]);
+    if ((double)rank < fraction * (double)timings->count || rank == 0) {
+        ++rank;
     }
-
-    for (ii = 1; ii < 50; ++ii) {
-        callback("ms", ii, ii, timings.ms[ii]);
+    for (ii = 0; ii < timings->nbuckets; ++ii) {
+        seen += timings->buckets[ii].count;
+        if (seen >= rank) {
+            uint64_t upper = timings->buckets[ii].upper;
+            return upper < timings->slowest ? upper : timings->slowest;
+        }
     }
+    return timings->slowest;
+}
+
+static void percentile(const char *name, uint64_t ns)
+{
+    char buffer[64];
+    format_time(buffer, ns);
+    fprintf(stdout, "%s: %s\n", name, buffer);
+}
+
+static void dump_histogram(const timings_t *timings)
+{
+    size_t ii;
 
-    for (ii = 0; ii < 10; ++ii) {
-        callback("ms", ii * 500, ((ii + 1) * 500) - 1, timings.halfsec[ii]);
+    for (ii = 0; ii < (size_t)timings->nbuckets; ++ii) {
+        callback(timings, timings->buckets[ii].lower,
+                 timings->buckets[ii].upper, timings->buckets[ii].count);
     }
 
-    callback("ms", (9 * 500), 0, timings.wayout);
+    fprintf(stdout, "samples: %" PRIu64 "\n", timings->count);
+    for (ii = 0; ii < NUM_PERCENTILES; ++ii) {
+        percentile(percentiles[ii].name,
+                   get_percentile(timings, percentiles[ii].fraction));
+    }
+    percentile("max", timings->slowest);
+}
 
+static int get_number(cJSON *r, const char *name, uint64_t *value)
+{
+    cJSON *o = cJSON_GetObjectItem(r, name);
+    if (o == NULL) {
+        fprintf(stderr, "Internal error.. failed to locate \"%s\"\n", name);
+        return -1;
+    }
+    *value = (uint64_t)o->valuedouble;
+    return 0;
 }
 
-static int json2internal(cJSON *r)
+static int json2internal(cJSON *r, timings_t *timings)
 {
-    int ii;
-    cJSON *o = cJSON_GetObjectItem(r, "ns");
+    cJSON *o;
     cJSON *i;
 
-    if (o == NULL) {
-        fprintf(stderr, "Internal error.. failed to locate \"ns\"\n");
+    memset(timings, 0, sizeof(*timings));
+    if (get_number(r, "count", &timings->count) == -1 ||
+        get_number(r, "max", &timings->slowest) == -1) {
         return -1;
     }
 
-    timings.max = timings.ns = o->valueint;
-    o = cJSON_GetObjectItem(r, "us");
+    o = cJSON_GetObjectItem(r, "histogram");
     if (o == NULL) {
-        fprintf(stderr, "Internal error.. failed to locate \"us\"\n");
+        fprintf(stderr, "Internal error.. failed to locate \"histogram\"\n");
         return -1;
     }
 
-    ii = 0;
-    i = o->child;
-    while (i) {
-        timings.us[ii] = i->valueint;
-        if (timings.us[ii] > timings.max) {
-            timings.max = timings.us[ii];
-        }
+    for (i = o->child; i != NULL; i = i->next) {
+        cJSON *lower = i->child;
+        cJSON *upper = lower ? lower->next : NULL;
+        cJSON *count = upper ? upper->next : NULL;
 
-        ++ii;
-        i = i->next;
-        if (ii == 100 && i != NULL) {
-            fprintf(stderr, "Internal error.. too many \"us\" samples\n");
+        if (count == NULL) {
+            fprintf(stderr, "Internal error.. invalid bucket\n");
             return -1;
         }
-    }
-
-    o = cJSON_GetObjectItem(r, "ms");
-    if (o == NULL) {
-        fprintf(stderr, "Internal error.. failed to locate \"ms\"\n");
-        return -1;
-    }
-    ii = 1;
-    i = o->child;
-    while (i) {
-        timings.ms[ii] = i->valueint;
-        if (timings.ms[ii] > timings.max) {
-            timings.max = timings.ms[ii];
+        if (timings->nbuckets == MAX_BUCKETS) {
+            fprintf(stderr, "Internal error.. too many buckets\n");
+            return -1;
         }
 
-        ++ii;
-        i = i->next;
-        if (ii == 50 && i != NULL) {
-            fprintf(stderr, "Internal error.. too many \"ms\" samples\n");
-            return -1;
+        timings->buckets[timings->nbuckets].lower = (uint64_t)lower->valuedouble;
+        timings->buckets[timings->nbuckets].upper = (uint64_t)upper->valuedouble;
+        timings->buckets[timings->nbuckets].count = (uint64_t)count->valuedouble;
+        if (timings->buckets[timings->nbuckets].count > timings->max) {
+            timings->max = timings->buckets[timings->nbuckets].count;
         }
+        ++timings->nbuckets;
     }
 
-    o = cJSON_GetObjectItem(r, "500ms");
-    if (o == NULL) {
-        fprintf(stderr, "Internal error.. failed to locate \"500ms\"\n");
-        return -1;
-    }
-    ii = 0;
-    i = o->child;
-    while (i) {
-        timings.halfsec[ii] = i->valueint;
-        if (timings.halfsec[ii] > timings.max) {
-            timings.max = timings.halfsec[ii];
+    return 0;
+}
+
+/*
+ * Turn the timings into the ones of what happened since the earlier ones
+ * (both of them are sorted by the bucket). We don't know what the slowest
+ * one was since then, unless it's a new record; otherwise it's at most the
+ * upper bound of the slowest bucket.
+ */
+static void diff_timings(timings_t *timings, const timings_t *earlier)
+{
+    int ii;
+    int jj = 0;
+    int nbuckets = 0;
+
+    timings->max = 0;
+    timings->count = 0;
+    for (ii = 0; ii < timings->nbuckets; ++ii) {
+        uint64_t count = timings->buckets[ii].count;
+
+        while (jj < earlier->nbuckets &&
+               earlier->buckets[jj].lower < timings->buckets[ii].lower) {
+            ++jj;
+        }
+        if (jj < earlier->nbuckets &&
+            earlier->buckets[jj].lower == timings->buckets[ii].lower) {
+            /* Or the server restarted */
+            count = count > earlier->buckets[jj].count ?
+                count - earlier->buckets[jj].count : 0;
         }
 
-        ++ii;
-        i = i->next;
-        if (ii == 10 && i != NULL) {
-            fprintf(stderr, "Internal error.. too many \"halfsec\" samples\n");
-            return -1;
+        if (count > 0) {
+            timings->buckets[nbuckets] = timings->buckets[ii];
+            timings->buckets[nbuckets].count = count;
+            timings->count += count;
+            if (count > timings->max) {
+                timings->max = count;
+            }
+            ++nbuckets;
         }
     }
+    timings->nbuckets = nbuckets;
 
-    i = cJSON_GetObjectItem(r, "wayout");
-    if (i == NULL) {
-        fprintf(stderr, "Internal error.. failed to locate \"wayout\"\n");
-        return -1;
-    }
-    timings.wayout = i->valueint;
-    if (timings.wayout > timings.max) {
-        timings.max = timings.wayout;
+    if (nbuckets == 0) {
+        timings->slowest = 0;
+    } else if (timings->slowest <= earlier->slowest &&
+               timings->buckets[nbuckets - 1].upper < timings->slowest) {
+        timings->slowest = timings->buckets[nbuckets - 1].upper;
     }
+}
 
-    return 0;
+static const char *opcode_name(uint8_t opcode, char *buffer)
+{
+    const char *cmd = memcached_opcode_2_text(opcode);
+    if (cmd == NULL) {
+        sprintf(buffer, "opcode %u", opcode);
+        cmd = buffer;
+    }
+    return cmd;
 }
 
-static void request_timings(BIO *bio, uint8_t opcode)
+static void request_timings(BIO *bio, uint8_t opcode, const char *bucket,
+                            timings_t *timings)
 {
+    uint16_t keylen = bucket ? (uint16_t)strlen(bucket) : 0;
     uint32_t buffsize;
     char *buffer;
     protocol_binary_request_get_cmd_timer request;
@@ -177,10 +264,14 @@ static void request_timings(BIO *bio, uint8_t opcode)
     request.message.header.request.magic = PROTOCOL_BINARY_REQ;
     request.message.header.request.opcode = PROTOCOL_BINARY_CMD_GET_CMD_TIMER;
     request.message.header.request.extlen = 1;
-    request.message.header.request.bodylen = htonl(1);
+    request.message.header.request.keylen = htons(keylen);
+    request.message.header.request.bodylen = htonl(1 + keylen);
     request.message.body.opcode = opcode;
 
     ensure_send(bio, &request, sizeof(request.bytes));
+    if (keylen > 0) {
+        ensure_send(bio, bucket, keylen);
+    }
 
     ensure_recv(bio, &response, sizeof(response.bytes));
     buffsize = ntohl(response.message.header.response.bodylen);
@@ -191,6 +282,11 @@ static void request_timings(BIO *bio, uint8_t opcode)
     }
 
     ensure_recv(bio, buffer, buffsize);
+    if (ntohs(response.message.header.response.status) ==
+        PROTOCOL_BINARY_RESPONSE_KEY_ENOENT) {
+        fprintf(stderr, "The server has no timings for \"%s\"\n", bucket);
+        exit(1);
+    }
     if (response.message.header.response.status != 0) {
         fprintf(stderr, "Command failed: %u\n",
                 ntohs(response.message.header.response.status));
@@ -204,44 +300,139 @@ static void request_timings(BIO *bio, uint8_t opcode)
         exit(EXIT_FAILURE);
     }
     obj = cJSON_GetObjectItem(json, "error");
-    if (obj == NULL) {
-        if (json2internal(json) == -1) {
-            fprintf(stderr, "Payload received:\n%s\n", buffer);
-            fprintf(stderr, "cJSON representation:\n%s\n", cJSON_Print(json));
-            exit(EXIT_FAILURE);
-        }
-
-        if (timings.max == 0) {
-            const char *cmd = memcached_opcode_2_text(opcode);
-            if (cmd) {
-                fprintf(stdout,
-                        "The server don't have information about \"%s\"\n",
-                        cmd);
-            } else {
-                fprintf(stdout,
-                        "The server don't have information about opcode %u\n",
-                        opcode);
-            }
-        } else {
-            const char *cmd = memcached_opcode_2_text(opcode);
-            if (cmd) {
-                fprintf(stdout,
-                        "The following data is collected for \"%s\"\n",
-                        cmd);
-            } else {
-                fprintf(stdout,
-                        "The following data is collected for opcode %u\n",
-                        opcode);
-            }
-
-            dump_histogram();
-        }
-    } else {
+    if (obj != NULL) {
         fprintf(stderr, "Error: %s\n", obj->valuestring);
         exit(EXIT_FAILURE);
     }
+    if (json2internal(json, timings) == -1) {
+        fprintf(stderr, "Payload received:\n%s\n", buffer);
+        fprintf(stderr, "cJSON representation:\n%s\n", cJSON_Print(json));
+        exit(EXIT_FAILURE);
+    }
 
     cJSON_Delete(json);
+    free(buffer);
+}
+
+/* What we show: the timings of an opcode (of the process or a group) */
+struct timings_entry {
+    uint8_t opcode;
+    const char *bucket;
+    timings_t timings;
+};
+
+static void print_histogram(const struct timings_entry *entry)
+{
+    char buffer[32];
+    const char *cmd = opcode_name(entry->opcode, buffer);
+    const char *of = entry->bucket ? " of " : "";
+    const char *bucket = entry->bucket ? entry->bucket : "";
+
+    if (entry->timings.max == 0) {
+        fprintf(stdout, "The server don't have information about \"%s\"%s%s\n",
+                cmd, of, bucket);
+    } else {
+        fprintf(stdout, "The following data is collected for \"%s\"%s%s\n",
+                cmd, of, bucket);
+        dump_histogram(&entry->timings);
+    }
+}
+
+/* All of them side by side, one line each */
+static void print_table(const struct timings_entry *entries, int num)
+{
+    char buffer[64];
+    int ii;
+    size_t jj;
+
+    fprintf(stdout, "%-24s %-16s %12s", "opcode", "bucket", "samples");
+    for (jj = 0; jj < NUM_PERCENTILES; ++jj) {
+        fprintf(stdout, " %8s", percentiles[jj].name);
+    }
+    fprintf(stdout, " %8s\n", "max");
+
+    for (ii = 0; ii < num; ++ii) {
+        const timings_t *timings = &entries[ii].timings;
+
+        fprintf(stdout, "%-24s %-16s %12" PRIu64,
+                opcode_name(entries[ii].opcode, buffer),
+                entries[ii].bucket ? entries[ii].bucket : "-",
+                timings->count);
+        for (jj = 0; jj < NUM_PERCENTILES; ++jj) {
+            format_time(buffer,
+                        get_percentile(timings, percentiles[jj].fraction));
+            fprintf(stdout, " %8s", buffer);
+        }
+        format_time(buffer, timings->slowest);
+        fprintf(stdout, " %8s\n", buffer);
+    }
+}
+
+/* An array of them, all in ns, with the histograms as the server has
+ * them ([lowest, highest, count] of the buckets with samples) */
+static void print_json(const struct timings_entry *entries, int num,
+                       int interval)
+{
+    cJSON *root = cJSON_CreateArray();
+    char buffer[32];
+    char *str;
+    int ii;
+    size_t jj;
+
+    for (ii = 0; ii < num; ++ii) {
+        const timings_t *timings = &entries[ii].timings;
+        cJSON *obj = cJSON_CreateObject();
+        cJSON *histogram = cJSON_CreateArray();
+        int kk;
+
+        cJSON_AddStringToObject(obj, "opcode",
+                                opcode_name(entries[ii].opcode, buffer));
+        if (entries[ii].bucket != NULL) {
+            cJSON_AddStringToObject(obj, "bucket", entries[ii].bucket);
+        }
+        if (interval > 0) {
+            cJSON_AddNumberToObject(obj, "interval", interval);
+        }
+        cJSON_AddNumberToObject(obj, "count", (double)timings->count);
+        cJSON_AddNumberToObject(obj, "max", (double)timings->slowest);
+        for (jj = 0; jj < NUM_PERCENTILES; ++jj) {
+            cJSON_AddNumberToObject(obj, percentiles[jj].name,
+                (double)get_percentile(timings, percentiles[jj].fraction));
+        }
+        for (kk = 0; kk < timings->nbuckets; ++kk) {
+            cJSON *bucket = cJSON_CreateArray();
+            cJSON_AddItemToArray(bucket,
+                cJSON_CreateNumber((double)timings->buckets[kk].lower));
+            cJSON_AddItemToArray(bucket,
+                cJSON_CreateNumber((double)timings->buckets[kk].upper));
+            cJSON_AddItemToArray(bucket,
+                cJSON_CreateNumber((double)timings->buckets[kk].count));
+            cJSON_AddItemToArray(histogram, bucket);
+        }
+        cJSON_AddItemToObject(obj, "histogram", histogram);
+        cJSON_AddItemToArray(root, obj);
+    }
+
+    str = cJSON_Print(root);
+    fprintf(stdout, "%s\n", str);
+    free(str);
+    cJSON_Delete(root);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage mctimings [-h host[:port]] [-p port] [-u user] [-P pass] [-b bucket|port:<port>]* [-s]\n"
+            "                [-d seconds] [-t|-j] [opcode]*\n\n"
+            "  -b bucket   the timings of a bucket or port (may be given "
+            "more than once)\n"
+            "  -d seconds  only what happened in that many seconds (rather "
+            "than since the\n"
+            "              server started)\n"
+            "  -t          all of them side by side in a table (rather than "
+            "a histogram\n"
+            "              each)\n"
+            "  -j          print them as JSON\n");
 }
 
 int main(int argc, char** argv) {
@@ -250,15 +441,23 @@ int main(int argc, char** argv) {
     const char *host = "localhost";
     const char *user = NULL;
     const char *pass = NULL;
+    const char *buckets[MAX_GROUPS];
+    int nbuckets = 0;
+    int interval = 0;
+    bool table = false;
+    bool json = false;
     int secure = 0;
     char *ptr;
     SSL_CTX* ctx;
     BIO* bio;
+    struct timings_entry *entries;
+    int num = 0;
+    int ii;
 
     /* Initialize the socket subsystem */
     cb_initialize_sockets();
 
-    while ((cmd = getopt(argc, argv, "h:p:u:P:s")) != EOF) {
+    while ((cmd = getopt(argc, argv, "h:p:u:P:b:sd:tj")) != EOF) {
         switch (cmd) {
         case 'h' :
             host = optarg;
@@ -277,24 +476,92 @@ int main(int argc, char** argv) {
         case 'P':
             pass = optarg;
             break;
+        case 'b':
+            if (nbuckets == MAX_GROUPS) {
+                fprintf(stderr, "No more than %d of -b\n", MAX_GROUPS);
+                return 1;
+            }
+            buckets[nbuckets++] = optarg;
+            break;
         case 's':
             secure = 1;
             break;
+        case 'd':
+            interval = atoi(optarg);
+            if (interval <= 0) {
+                fprintf(stderr, "Incorrect interval: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            table = true;
+            break;
+        case 'j':
+            json = true;
+            break;
         default:
-            fprintf(stderr,
-                    "Usage mctimings [-h host[:port]] [-p port] [-u user] [-P pass] [-s] [opcode]*\n");
+            usage();
             return 1;
         }
     }
 
+    if (nbuckets == 0) {
+        buckets[nbuckets++] = NULL;
+    }
+    entries = calloc((size_t)nbuckets * (argc - optind + 1), sizeof(*entries));
+    if (entries == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+    for (ii = 0; ii < nbuckets; ++ii) {
+        int jj;
+        for (jj = optind; jj < argc; ++jj) {
+            entries[num].opcode = memcached_text_2_opcode(argv[jj]);
+            entries[num].bucket = buckets[ii];
+            ++num;
+        }
+    }
+
     if (create_ssl_connection(&ctx, &bio, host, port, user, pass, secure) != 0) {
         return 1;
     }
 
-    for (; optind < argc; ++optind) {
-        request_timings(bio, memcached_text_2_opcode(argv[optind]));
+    for (ii = 0; ii < num; ++ii) {
+        request_timings(bio, entries[ii].opcode, entries[ii].bucket,
+                        &entries[ii].timings);
+    }
+
+    if (interval > 0) {
+        timings_t *earlier = malloc(sizeof(*earlier));
+        if (earlier == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            return 1;
+        }
+#ifdef WIN32
+        Sleep(interval * 1000);
+#else
+        sleep(interval);
+#endif
+        for (ii = 0; ii < num; ++ii) {
+            *earlier = entries[ii].timings;
+            request_timings(bio, entries[ii].opcode, entries[ii].bucket,
+                            &entries[ii].timings);
+            diff_timings(&entries[ii].timings, earlier);
+        }
+        free(earlier);
+    }
+
+    if (json) {
+        print_json(entries, num, interval);
+    } else if (table) {
+        print_table(entries, num);
+    } else {
+        for (ii = 0; ii < num; ++ii) {
+            print_histogram(&entries[ii]);
+        }
     }
 
+    free(entries);
     BIO_free_all(bio);
     if (secure) {
         SSL_CTX_free(ctx);
@@ -0,0 +1,86 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Print the request traces the file logger writes (with the tracefile
+ * configuration parameter) as text, one request per line.
+ */
+#include "config.h"
+
+#include <memcached/protocol_binary.h>
+#include <platform/platform.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "programs/trace_reader.h"
+#include "utilities/protocol2text.h"
+
+static void print_record(const trace_record_t *record) {
+    const char *name = memcached_opcode_2_text(record->opcode);
+    char when[40];
+    struct tm tval;
+    time_t sec;
+
+    sec = (time_t)(record->timestamp / 1000000);
+#ifdef WIN32
+    localtime_s(&tval, &sec);
+#else
+    localtime_r(&sec, &tval);
+#endif
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tval);
+
+    if (name != NULL) {
+        printf("%s.%06u %10u %-20s", when,
+               (unsigned int)(record->timestamp % 1000000),
+               record->connection, name);
+    } else {
+        printf("%s.%06u %10u 0x%02x                ", when,
+               (unsigned int)(record->timestamp % 1000000),
+               record->connection, (unsigned int)record->opcode);
+    }
+    printf(" 0x%04x %08x %10u %6u %10u\n", (unsigned int)record->status,
+           record->key_hash, record->latency, (unsigned int)record->keylen,
+           record->value_length);
+}
+
+/**
+ * Print the records in the trace file
+ * @return 0 if it was all right, -1 if it wasn't a trace or is corrupt
+ */
+static int decode_file(const char *file) {
+    trace_reader_t reader;
+    trace_record_t record;
+    int ret;
+
+    if (!trace_reader_open(&reader, file)) {
+        return -1;
+    }
+    while ((ret = trace_reader_next(&reader, &record)) == 1) {
+        print_record(&record);
+    }
+    trace_reader_close(&reader);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    int ret = EXIT_SUCCESS;
+    int ii;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: mctrace file...\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-26s %10s %-20s %6s %8s %10s %6s %10s\n", "time",
+           "connection", "opcode", "status", "key hash", "latency us",
+           "keylen", "value len");
+    for (ii = 1; ii < argc; ++ii) {
+        if (decode_file(argv[ii]) != 0) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,124 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include "perf_baseline.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct perf_result {
+    char *name;
+    double ns_per_op;
+};
+
+static struct {
+    struct perf_result *results;
+    size_t num;
+    size_t size;
+    double tolerance;
+    bool loaded;
+    int failures;
+} baseline;
+
+static char *trim(char *str) {
+    char *end;
+
+    while (*str == ' ' || *str == '\t') {
+        ++str;
+    }
+    end = str + strlen(str);
+    while (end > str && (end[-1] == ' ' || end[-1] == '\t' ||
+                         end[-1] == '\r' || end[-1] == '\n')) {
+        --end;
+    }
+    *end = '\0';
+    return str;
+}
+
+bool perf_baseline_load(const char *file, double tolerance) {
+    char buffer[1024];
+    int lineno = 0;
+    FILE *fp = fopen(file, "r");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open the baseline %s\n", file);
+        return false;
+    }
+
+    while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+        char *line = trim(buffer);
+        char *sep = strrchr(line, ',');
+        char *end;
+        double ns;
+
+        ++lineno;
+        if (*line == '\0' || *line == '#') {
+            continue;
+        }
+        if (sep == NULL || (ns = strtod(sep + 1, &end)) <= 0 ||
+            *trim(end) != '\0') {
+            fprintf(stderr, "%s:%d: Incorrect baseline: %s\n", file, lineno,
+                    line);
+            fclose(fp);
+            return false;
+        }
+        *sep = '\0';
+
+        if (baseline.num == baseline.size) {
+            size_t size = baseline.size ? baseline.size * 2 : 64;
+            void *ptr = realloc(baseline.results,
+                                size * sizeof(*baseline.results));
+            if (ptr == NULL) {
+                fprintf(stderr, "Failed to allocate memory for the "
+                        "baseline\n");
+                fclose(fp);
+                return false;
+            }
+            baseline.results = ptr;
+            baseline.size = size;
+        }
+        if ((baseline.results[baseline.num].name = strdup(line)) == NULL) {
+            fclose(fp);
+            return false;
+        }
+        baseline.results[baseline.num++].ns_per_op = ns;
+    }
+
+    fclose(fp);
+    baseline.tolerance = tolerance;
+    baseline.loaded = true;
+    return true;
+}
+
+bool perf_baseline_check(const char *name, double ns_per_op) {
+    size_t ii;
+
+    if (!baseline.loaded) {
+        return true;
+    }
+
+    for (ii = 0; ii < baseline.num; ++ii) {
+        if (strcmp(baseline.results[ii].name, name) == 0) {
+            double base = baseline.results[ii].ns_per_op;
+            double change = (ns_per_op - base) * 100 / base;
+
+            if (change > baseline.tolerance) {
+                fprintf(stderr, "REGRESSION %s: %.1f ns per op, the "
+                        "baseline is %.1f (%+.0f%%, the tolerance is "
+                        "%.0f%%)\n", name, ns_per_op, base, change,
+                        baseline.tolerance);
+                baseline.failures++;
+                return false;
+            }
+            return true;
+        }
+    }
+
+    /* Ready to go into the baseline */
+    fprintf(stderr, "Not in the baseline: %s,%.1f\n", name, ns_per_op);
+    return true;
+}
+
+int perf_baseline_failures(void) {
+    return baseline.failures;
+}
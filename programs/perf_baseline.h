@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef PROGRAMS_PERF_BASELINE_H
+#define PROGRAMS_PERF_BASELINE_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Comparing the results of the benchmarks with the ones we've checked in
+ * (see tests/perf_baseline.csv), for the perf tests of ctest.
+ *
+ * Every line of the file (but the empty ones and the comments starting
+ * with #) is a result: its name, a comma and the nanoseconds an operation
+ * took. The name is all up to the last comma, so it may have commas of
+ * its own.
+ */
+
+/**
+ * Read the baseline
+ * @param file the file to read it from
+ * @param tolerance how much slower (in percent) a result may be
+ * @return false if we failed to read it
+ */
+bool perf_baseline_load(const char *file, double tolerance);
+
+/**
+ * Compare a result with the baseline (if we have loaded one), and report
+ * it on stderr if it's slower than the tolerance allows (or we don't have
+ * it in the baseline)
+ * @param name the name of the result
+ * @param ns_per_op the nanoseconds an operation took
+ * @return false if it's too slow
+ */
+bool perf_baseline_check(const char *name, double ns_per_op);
+
+/**
+ * @return the number of results that were too slow
+ */
+int perf_baseline_failures(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,146 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include "trace_reader.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <snappy-c.h>
+
+#include "extensions/loggers/trace_format.h"
+
+static uint32_t get_word(const char *ptr) {
+    uint32_t word;
+    memcpy(&word, ptr, sizeof(word));
+    return ntohl(word);
+}
+
+static uint16_t get_short(const char *ptr) {
+    uint16_t word;
+    memcpy(&word, ptr, sizeof(word));
+    return ntohs(word);
+}
+
+static void decode_record(const char *ptr, size_t size,
+                          trace_record_t *record) {
+    uint64_t timestamp;
+
+    memcpy(&timestamp, ptr, sizeof(timestamp));
+    record->timestamp = ntohll(timestamp);
+    record->latency = get_word(ptr + 8);
+    record->connection = get_word(ptr + 12);
+    record->key_hash = get_word(ptr + 16);
+    record->status = get_short(ptr + 20);
+    record->opcode = (uint8_t)ptr[22];
+    if (size >= TRACE_RECORD_SIZE) {
+        record->value_length = get_word(ptr + 24);
+        record->keylen = get_short(ptr + 28);
+    } else {
+        record->value_length = 0;
+        record->keylen = 0;
+    }
+}
+
+bool trace_reader_open(trace_reader_t *reader, const char *file) {
+    char magic[sizeof(TRACE_FILE_MAGIC) - 1];
+
+    memset(reader, 0, sizeof(*reader));
+    reader->file = file;
+    if ((reader->fp = fopen(file, "rb")) == NULL) {
+        fprintf(stderr, "Failed to open %s\n", file);
+        return false;
+    }
+
+    if (fread(magic, 1, sizeof(magic), reader->fp) == sizeof(magic)) {
+        if (memcmp(magic, TRACE_FILE_MAGIC, sizeof(magic)) == 0) {
+            reader->record_size = TRACE_RECORD_SIZE;
+        } else if (memcmp(magic, TRACE_FILE_MAGIC_V1, sizeof(magic)) == 0) {
+            reader->record_size = TRACE_RECORD_SIZE_V1;
+        }
+    }
+    if (reader->record_size == 0) {
+        fprintf(stderr, "%s is not a request trace\n", file);
+        fclose(reader->fp);
+        reader->fp = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Read and uncompress the next block of the file
+ * @return 1 if we got one, 0 at the end and -1 if it's corrupt
+ */
+static int read_block(trace_reader_t *reader) {
+    char header[TRACE_BLOCK_HEADER_SIZE];
+    size_t nbytes;
+    size_t count;
+    size_t length;
+
+    if (fread(header, 1, sizeof(header), reader->fp) != sizeof(header)) {
+        return 0;
+    }
+    nbytes = get_word(header);
+    count = get_word(header + 4);
+
+    if (nbytes > reader->compressed_size) {
+        char *ptr = realloc(reader->compressed, nbytes);
+        if (ptr == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            return -1;
+        }
+        reader->compressed = ptr;
+        reader->compressed_size = nbytes;
+    }
+    if (fread(reader->compressed, 1, nbytes, reader->fp) != nbytes) {
+        return 0;
+    }
+
+    if (count > TRACE_BLOCK_RECORDS ||
+        snappy_uncompressed_length(reader->compressed, nbytes,
+                                   &length) != SNAPPY_OK ||
+        length != count * reader->record_size) {
+        fprintf(stderr, "%s: corrupt block\n", reader->file);
+        return -1;
+    }
+    if (length > reader->records_size) {
+        char *ptr = realloc(reader->records, length);
+        if (ptr == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            return -1;
+        }
+        reader->records = ptr;
+        reader->records_size = length;
+    }
+    if (snappy_uncompress(reader->compressed, nbytes, reader->records,
+                          &length) != SNAPPY_OK) {
+        fprintf(stderr, "%s: corrupt block\n", reader->file);
+        return -1;
+    }
+
+    reader->count = count;
+    reader->next = 0;
+    return 1;
+}
+
+int trace_reader_next(trace_reader_t *reader, trace_record_t *record) {
+    while (reader->next == reader->count) {
+        int ret = read_block(reader);
+        if (ret != 1) {
+            return ret;
+        }
+    }
+
+    decode_record(reader->records + reader->next * reader->record_size,
+                  reader->record_size, record);
+    reader->next++;
+    return 1;
+}
+
+void trace_reader_close(trace_reader_t *reader) {
+    if (reader->fp != NULL) {
+        fclose(reader->fp);
+    }
+    free(reader->compressed);
+    free(reader->records);
+    memset(reader, 0, sizeof(*reader));
+}
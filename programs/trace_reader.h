@@ -0,0 +1,75 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef PROGRAMS_TRACE_READER_H
+#define PROGRAMS_TRACE_READER_H
+
+#include <platform/platform.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Reading the request traces the file logger writes (the format is in
+ * extensions/loggers/trace_format.h), for mctrace and mcreplay. The files
+ * of the older loggers read with the key length and the value length 0.
+ */
+
+typedef struct {
+    /** When the response was ready (us since the epoch) */
+    uint64_t timestamp;
+    /** How long the request took (us) */
+    uint32_t latency;
+    uint32_t connection;
+    uint32_t key_hash;
+    uint32_t value_length;
+    uint16_t keylen;
+    uint16_t status;
+    uint8_t opcode;
+} trace_record_t;
+
+typedef struct {
+    FILE *fp;
+    const char *file;
+    size_t record_size;
+    char *compressed;
+    size_t compressed_size;
+    char *records;
+    size_t records_size;
+    /* The records of the block we've read, and the next one of them */
+    size_t count;
+    size_t next;
+} trace_reader_t;
+
+/**
+ * Open a trace file
+ * @param reader where to keep the state of the reader
+ * @param file the file name
+ * @return false if we couldn't open it or it isn't a trace (which we've
+ *         told on stderr)
+ */
+bool trace_reader_open(trace_reader_t *reader, const char *file);
+
+/**
+ * Read the next record of the trace
+ * @param reader the reader
+ * @param record where to put it
+ * @return 1 if we got one, 0 at the end of the trace (a block which was
+ *         cut short is where the logger stopped) and -1 if it's corrupt
+ *         (which we've told on stderr)
+ */
+int trace_reader_next(trace_reader_t *reader, trace_record_t *record);
+
+/**
+ * Close the file and release the buffers of the reader
+ * @param reader the reader
+ */
+void trace_reader_close(trace_reader_t *reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
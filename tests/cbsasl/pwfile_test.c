@@ -43,18 +43,78 @@ static void test_pwfile()
     cb_assert(load_user_db() == SASL_OK);
     password = find_pw(user1, &cfg);
     cb_assert(strncmp(password, pass1, strlen(pass1)) == 0);
+    free(password);
+    free(cfg);
 
     password = find_pw(user2, &cfg);
     cb_assert(strncmp(password, pass2, strlen(pass2)) == 0);
+    free(password);
+    free(cfg);
 
     password = find_pw(user3, &cfg);
     cb_assert(strncmp(password, pass3, strlen(pass3)) == 0);
+    free(password);
+    free(cfg);
 
     remove_pw_file();
 }
 
+static void test_pwfile_reload()
+{
+    char *cfg;
+    char *password;
+    FILE *fp;
+
+    create_pw_file();
+    cb_assert(load_user_db() == SASL_OK);
+
+    /* Nothing changed */
+    cb_assert(load_user_db() == SASL_OK);
+    password = find_pw(user1, &cfg);
+    cb_assert(password != NULL && strcmp(password, pass1) == 0);
+    free(password);
+    free(cfg);
+
+    /* One of them changed, one is gone and one is new (the last line of
+     * a user is the one which counts) */
+    fp = fopen(cbpwfile, "w");
+    cb_assert(fp != NULL);
+    fprintf(fp, "mikewied mikepw \ncseo oldpw \njlim limpw \n"
+            "cseo newpw somecfg\n");
+    cb_assert(fclose(fp) == 0);
+    cb_assert(load_user_db() == SASL_OK);
+
+    password = find_pw(user1, &cfg);
+    cb_assert(password != NULL && strcmp(password, pass1) == 0);
+    free(password);
+    free(cfg);
+
+    password = find_pw(user2, &cfg);
+    cb_assert(password != NULL && strcmp(password, "newpw") == 0);
+    cb_assert(cfg != NULL && strcmp(cfg, "somecfg") == 0);
+    free(password);
+    free(cfg);
+
+    fp = fopen(cbpwfile, "w");
+    cb_assert(fp != NULL);
+    fprintf(fp, "mikewied mikepw \nnewuser newuserpw \n");
+    cb_assert(fclose(fp) == 0);
+    cb_assert(load_user_db() == SASL_OK);
+
+    cb_assert(find_pw(user2, &cfg) == NULL);
+    cb_assert(find_pw(user3, &cfg) == NULL);
+    password = find_pw("newuser", &cfg);
+    cb_assert(password != NULL && strcmp(password, "newuserpw") == 0);
+    free(password);
+    free(cfg);
+
+    remove_pw_file();
+    cb_assert(find_pw(user1, &cfg) == NULL);
+}
+
 int main()
 {
     test_pwfile();
+    test_pwfile_reload();
     return 0;
 }
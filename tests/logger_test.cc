@@ -1,13 +1,17 @@
 /* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
 #include <stdio.h>
 #include <cstdlib>
 #include <cstring>
 #include <assert.h>
 #include <iostream>
+#include <snappy-c.h>
 
+#include <platform/platform.h>
 #include <platform/dirutils.h>
 #include <extensions/protocol_extension.h>
 #include <memcached/config_parser.h>
+#include "extensions/loggers/trace_format.h"
 
 using namespace std;
 
@@ -99,10 +103,9 @@ static void test_rotate(void) {
     }
 
 
-    // Note: Ensure buffer is at least 4* larger than the expected message
-    // length, otherwise the writer will be blocked waiting for the flusher
-    // thread to timeout and write (as we haven't actually hit the 75%
-    // watermark which would normally trigger an immediate flush).
+    // Note: The ring of this thread (1MB by default) must hold all of the
+    // messages, otherwise we'll drop the ones the logger thread doesn't
+    // get to in time.
     ret = memcached_extensions_initialize("unit_test=true;prettyprint=true;loglevel=warning;cyclesize=1024;buffersize=512;sleeptime=1;filename=log_test", get_server_api);
     assert(ret == EXTENSION_SUCCESS);
 
@@ -179,10 +182,198 @@ static void test_dedupe(void) {
     remove_files(files);
 }
 
+static void test_overrun(void) {
+    EXTENSION_ERROR_CODE ret;
+    int ii;
+
+    std::vector<std::string> files;
+    files = CouchbaseDirectoryUtilities::findFilesWithPrefix("log_test");
+    if (!files.empty()) {
+        remove_files(files);
+    }
+
+    // The smallest ring there is, so that we're logging faster than the
+    // logger thread empties it
+    ret = memcached_extensions_initialize("unit_test=true;prettyprint=true;loglevel=warning;cyclesize=104857600;buffersize=4096;ringsize=4096;sleeptime=1;filename=log_test", get_server_api);
+    assert(ret == EXTENSION_SUCCESS);
+
+    for (ii = 0; ii < 1024; ++ii) {
+        logger->log(EXTENSION_LOG_DETAIL, NULL,
+                    "Hei hopp, dette er bare noe tull... Paa tide med %05u!!",
+                    ii);
+    }
+
+    logger->shutdown();
+
+    files = CouchbaseDirectoryUtilities::findFilesWithPrefix("log_test");
+    assert(files.size() == 1);
+
+    FILE *fp = fopen(files[0].c_str(), "r");
+    assert(fp != NULL);
+    char buffer[1024];
+    unsigned int logged = 0;
+    unsigned int dropped = 0;
+
+    // Every message is either in the log or counted as dropped
+    while (my_fgets(buffer, sizeof(buffer), fp)) {
+        unsigned int num;
+        if (strstr(buffer, "Paa tide med") != NULL) {
+            ++logged;
+        } else if (sscanf(buffer, "%u messages dropped", &num) == 1) {
+            dropped += num;
+        }
+    }
+    assert(logged + dropped == 1024);
+
+    fclose(fp);
+    remove_files(files);
+}
+
+static uint32_t get_word(const char *ptr) {
+    uint32_t word;
+    memcpy(&word, ptr, sizeof(word));
+    return ntohl(word);
+}
+
+static void test_trace(void) {
+    EXTENSION_ERROR_CODE ret;
+    uint32_t ii;
+
+    std::vector<std::string> files;
+    files = CouchbaseDirectoryUtilities::findFilesWithPrefix("log_test");
+    remove_files(files);
+    files = CouchbaseDirectoryUtilities::findFilesWithPrefix("log_trace");
+    remove_files(files);
+
+    ret = memcached_extensions_initialize("unit_test=true;loglevel=warning;sleeptime=1;filename=log_test;tracefile=log_trace", get_server_api);
+    assert(ret == EXTENSION_SUCCESS);
+    assert(logger->log_record != NULL);
+
+    // More than fits in a block
+    const uint32_t total = TRACE_BLOCK_RECORDS * 2 + 100;
+    for (ii = 0; ii < total; ++ii) {
+        EXTENSION_LOG_RECORD record;
+        record.timestamp = 1400000000000000ULL + ii;
+        record.latency = ii * 3;
+        record.connection = ii % 7;
+        record.key_hash = ii * 2654435761U;
+        record.status = (uint16_t)(ii % 3);
+        record.opcode = (uint8_t)(ii % 256);
+        record.reserved = 0;
+        record.keylen = (uint16_t)(ii % 250);
+        record.value_length = ii * 5;
+        logger->log_record(&record);
+    }
+
+    logger->shutdown();
+
+    files = CouchbaseDirectoryUtilities::findFilesWithPrefix("log_trace");
+    assert(files.size() == 1);
+
+    FILE *fp = fopen(files[0].c_str(), "rb");
+    assert(fp != NULL);
+    char magic[sizeof(TRACE_FILE_MAGIC) - 1];
+    assert(fread(magic, 1, sizeof(magic), fp) == sizeof(magic));
+    assert(memcmp(magic, TRACE_FILE_MAGIC, sizeof(magic)) == 0);
+
+    std::vector<char> compressed;
+    std::vector<char> records(TRACE_BLOCK_RECORDS * TRACE_RECORD_SIZE);
+    char header[TRACE_BLOCK_HEADER_SIZE];
+    uint32_t seen = 0;
+    while (fread(header, 1, sizeof(header), fp) == sizeof(header)) {
+        size_t nbytes = get_word(header);
+        size_t count = get_word(header + 4);
+        size_t length = records.size();
+
+        assert(count > 0 && count <= TRACE_BLOCK_RECORDS);
+        compressed.resize(nbytes);
+        assert(fread(&compressed[0], 1, nbytes, fp) == nbytes);
+        assert(snappy_uncompress(&compressed[0], nbytes, &records[0],
+                                 &length) == SNAPPY_OK);
+        assert(length == count * TRACE_RECORD_SIZE);
+
+        for (size_t jj = 0; jj < count; ++jj, ++seen) {
+            const char *ptr = &records[jj * TRACE_RECORD_SIZE];
+            uint64_t timestamp;
+            memcpy(&timestamp, ptr, sizeof(timestamp));
+            assert(ntohll(timestamp) == 1400000000000000ULL + seen);
+            assert(get_word(ptr + 8) == seen * 3);
+            assert(get_word(ptr + 12) == seen % 7);
+            assert(get_word(ptr + 16) == seen * 2654435761U);
+            uint16_t status;
+            memcpy(&status, ptr + 20, sizeof(status));
+            assert(ntohs(status) == seen % 3);
+            assert((uint8_t)ptr[22] == seen % 256);
+            assert(get_word(ptr + 24) == seen * 5);
+            uint16_t keylen;
+            memcpy(&keylen, ptr + 28, sizeof(keylen));
+            assert(ntohs(keylen) == seen % 250);
+        }
+    }
+    assert(seen == total);
+
+    fclose(fp);
+    remove_files(files);
+    files = CouchbaseDirectoryUtilities::findFilesWithPrefix("log_test");
+    remove_files(files);
+}
+
+static void test_limit(void) {
+    EXTENSION_ERROR_CODE ret;
+    int ii;
+
+    std::vector<std::string> files;
+    files = CouchbaseDirectoryUtilities::findFilesWithPrefix("log_test");
+    if (!files.empty()) {
+        remove_files(files);
+    }
+
+    ret = memcached_extensions_initialize("unit_test=true;prettyprint=true;loglevel=warning;sleeptime=1;filename=log_test", get_server_api);
+    assert(ret == EXTENSION_SUCCESS);
+
+    // 20 a second (one every 50ms), and 4 more at once
+    static EXTENSION_LOG_LIMIT limit = EXTENSION_LOG_LIMIT_INIT(20, 4);
+    for (ii = 0; ii < 1000; ++ii) {
+        logger->log_limited(EXTENSION_LOG_DETAIL, NULL, &limit,
+                            "Hei hopp, dette er bare noe tull... Paa tide med %05u!!",
+                            ii);
+    }
+
+    // Wait for the next token
+    hrtime_t start = gethrtime();
+    while (gethrtime() - start < 100 * 1000000) {
+        /* EMPTY */
+    }
+    logger->log_limited(EXTENSION_LOG_DETAIL, NULL, &limit,
+                        "Hei hopp, dette er bare noe tull... Paa tide med %05u!!",
+                        ii);
+
+    logger->shutdown();
+
+    files = CouchbaseDirectoryUtilities::findFilesWithPrefix("log_test");
+    assert(files.size() == 1);
+
+    FILE *fp = fopen(files[0].c_str(), "r");
+    assert(fp != NULL);
+    char buffer[1024];
+    int logged = 0;
+
+    while (my_fgets(buffer, sizeof(buffer), fp)) {
+        if (strstr(buffer, "Paa tide med") != NULL) {
+            ++logged;
+        }
+    }
+    assert(logged == 6);
+    assert(strstr(buffer, ": 995 similar messages suppressed") != NULL);
+
+    fclose(fp);
+    remove_files(files);
+}
+
 int main(int argc, char **argv)
 {
     if (argc < 2) {
-        std::cerr << "Usage: memcached_logger dedupe|rotate" << std::endl;
+        std::cerr << "Usage: memcached_logger dedupe|rotate|overrun|trace|limit" << std::endl;
         return EXIT_FAILURE;
     }
 
@@ -190,8 +381,14 @@ int main(int argc, char **argv)
         test_dedupe();
     } else if (strcmp(argv[1], "rotate") == 0) {
         test_rotate();
+    } else if (strcmp(argv[1], "overrun") == 0) {
+        test_overrun();
+    } else if (strcmp(argv[1], "trace") == 0) {
+        test_trace();
+    } else if (strcmp(argv[1], "limit") == 0) {
+        test_limit();
     } else {
-        std::cerr << "Usage: memcached_logger dedupe|rotate" << std::endl;
+        std::cerr << "Usage: memcached_logger dedupe|rotate|overrun|trace|limit" << std::endl;
         return EXIT_FAILURE;
     }
 
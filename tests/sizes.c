@@ -1,4 +1,5 @@
 #include "config.h"
+#include <stddef.h>
 #include <stdio.h>
 
 #include "daemon/memcached.h"
@@ -7,6 +8,41 @@ static void display(const char *name, size_t size) {
     printf("%s\t%d\n", name, (int)size);
 }
 
+/* The per request fields of a connection must fit in these */
+#define CONN_HOT_CACHE_LINES 2
+#define CACHE_LINE_SIZE 64
+
+static int check_hot(const char *name, size_t offset, size_t size) {
+    if (offset + size > CONN_HOT_CACHE_LINES * CACHE_LINE_SIZE) {
+        fprintf(stderr, "conn.%s (at %d) is outside of the first %d "
+                "cache lines\n", name, (int)offset, CONN_HOT_CACHE_LINES);
+        return 1;
+    }
+    return 0;
+}
+
+#define CHECK_HOT(field) \
+    check_hot(#field, offsetof(conn, field), sizeof(((conn *)0)->field))
+
+static int check_conn_layout(void) {
+    int errors = 0;
+    errors += CHECK_HOT(state);
+    errors += CHECK_HOT(read);
+    errors += CHECK_HOT(write);
+    errors += CHECK_HOT(binary_header);
+    errors += CHECK_HOT(iov);
+    errors += CHECK_HOT(iovsize);
+    errors += CHECK_HOT(iovused);
+    errors += CHECK_HOT(msglist);
+    errors += CHECK_HOT(msgsize);
+    errors += CHECK_HOT(msgused);
+    errors += CHECK_HOT(msgcurr);
+    errors += CHECK_HOT(msgbytes);
+    errors += CHECK_HOT(sfd);
+    errors += CHECK_HOT(nevents);
+    return errors;
+}
+
 static long calc_conn_size(void) {
    long ret = sizeof(conn);
    ret += (sizeof(char *) * TEMP_ALLOC_LIST_INITIAL);
@@ -35,5 +71,5 @@ int main(int argc, char **argv) {
     display("libevent thread cumulative", sizeof(LIBEVENT_THREAD));
     display("Thread stats cumulative\t", sizeof(struct thread_stats));
 
-    return 0;
+    return check_conn_layout() == 0 ? 0 : 1;
 }
@@ -36,6 +36,15 @@ extern "C" {
         delete []p;
 
         assert(alloc_size == allocated);
+
+        // What the thread allocates in an account is charged to it
+        allocator_account account = { 0, 0 };
+        assert(mc_enter_account(&account));
+        p = new char[100];
+        delete []p;
+        mc_leave_account();
+        assert(account.allocated >= allocated);
+        assert(account.freed >= allocated);
     }
 }
 
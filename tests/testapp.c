@@ -8,30 +8,39 @@
 #include <fcntl.h>
 #include <ctype.h>
 #include <time.h>
+#include <getopt.h>
 #include <evutil.h>
 #include <snappy-c.h>
 #include <cJSON.h>
+#ifndef WIN32
+#include <sys/un.h>
+#endif
 
 
 #include "daemon/cache.h"
+#include "daemon/span.h"
 #include <memcached/util.h>
 #include <memcached/protocol_binary.h>
 #include <memcached/config_parser.h>
 #include "extensions/protocol/fragment_rw.h"
+#include "extensions/protocol/multi_ops.h"
 #include "extensions/protocol/testapp_extension.h"
 #include "platform/platform.h"
 #include "memcached/openssl.h"
 #include "programs/utilities.h"
+#include "programs/perf_baseline.h"
 
 /* Set the read/write commands differently than the default values
  * so that we can verify that the override works
  */
 static uint8_t read_command = 0xe1;
 static uint8_t write_command = 0xe2;
+static uint8_t multi_command = 0xe4;
 
 const char config_file[] = "memcached_testapp.json";
 
 #define TMP_TEMPLATE "/tmp/test_file.XXXXXXX"
+#define UNIX_SOCKET_PATH "memcached_testapp_unix.sock"
 
 enum test_return { TEST_SKIP, TEST_PASS, TEST_FAIL };
 
@@ -164,6 +173,106 @@ static enum test_return cache_bulkalloc(size_t datasize)
     return TEST_PASS;
 }
 
+#define MAGAZINE_OBJECTS 256
+
+static void cache_free_thread(void *arg)
+{
+    void **args = arg;
+    cache_t *cache = args[0];
+    void **ptr = args[1];
+    int ii;
+    for (ii = 0; ii < MAGAZINE_OBJECTS; ++ii) {
+        cache_free(cache, ptr[ii]);
+    }
+}
+
+/*
+ * Verify that the objects freed by another thread (more than fit in its
+ * magazine) make it back to the thread which allocated them
+ */
+static enum test_return cache_magazine_test(void)
+{
+    cache_t *cache = cache_create("test", sizeof(uint64_t), sizeof(char*),
+                                  NULL, NULL);
+    void *ptr[MAGAZINE_OBJECTS];
+    void *again[MAGAZINE_OBJECTS / 2];
+    void *args[2];
+    cb_thread_t tid;
+    int ii, jj;
+
+    cb_assert(cache != NULL);
+    for (ii = 0; ii < MAGAZINE_OBJECTS; ++ii) {
+        ptr[ii] = cache_alloc(cache);
+        cb_assert(ptr[ii] != NULL);
+    }
+
+    args[0] = cache;
+    args[1] = ptr;
+    cb_assert(cb_create_thread(&tid, cache_free_thread, args, 0) == 0);
+    cb_assert(cb_join_thread(tid) == 0);
+
+    /* Most of them are in the free list now */
+    for (ii = 0; ii < MAGAZINE_OBJECTS / 2; ++ii) {
+        void *p = cache_alloc(cache);
+        bool found = false;
+        for (jj = 0; jj < MAGAZINE_OBJECTS; ++jj) {
+            found |= ptr[jj] == p;
+        }
+        cb_assert(found);
+        again[ii] = p;
+    }
+    for (ii = 0; ii < MAGAZINE_OBJECTS / 2; ++ii) {
+        cache_free(cache, again[ii]);
+    }
+
+    /* The objects still in the magazine of the thread go away with it */
+    cache_destroy(cache);
+    return TEST_PASS;
+}
+#undef MAGAZINE_OBJECTS
+
+/*
+ * Verify that a span ring drops what doesn't fit, and hands out the rest
+ * in order in network byte order
+ */
+static enum test_return span_ring_test(void)
+{
+    struct span_ring *ring = span_ring_create(4);
+    char buffer[8 * SPAN_RECORD_SIZE];
+    span_record_t record;
+    uint32_t word;
+    size_t nbytes;
+    int ii;
+
+    cb_assert(ring != NULL);
+    cb_assert(span_ring_bytes(ring) == 4 * SPAN_RECORD_SIZE);
+    memset(&record, 0, sizeof(record));
+    for (ii = 0; ii < 6; ++ii) {
+        record.connection = ii;
+        record.points[SPAN_LAST_BYTE] = 1000 * ii;
+        cb_assert(span_ring_push(ring, &record) == (ii < 4));
+    }
+    cb_assert(span_ring_dropped(ring) == 2);
+
+    nbytes = span_ring_drain(ring, buffer, sizeof(buffer));
+    cb_assert(nbytes == 4 * SPAN_RECORD_SIZE);
+    for (ii = 0; ii < 4; ++ii) {
+        memcpy(&word, buffer + ii * SPAN_RECORD_SIZE + 8, sizeof(word));
+        cb_assert(ntohl(word) == (uint32_t)ii);
+        memcpy(&word, buffer + ii * SPAN_RECORD_SIZE + 20 +
+               SPAN_LAST_BYTE * 4, sizeof(word));
+        cb_assert(ntohl(word) == (uint32_t)(1000 * ii));
+    }
+    cb_assert(span_ring_drain(ring, buffer, sizeof(buffer)) == 0);
+
+    /* There is room again once it's drained */
+    cb_assert(span_ring_push(ring, &record));
+    cb_assert(span_ring_drain(ring, buffer, SPAN_RECORD_SIZE) ==
+              SPAN_RECORD_SIZE);
+    span_ring_destroy(ring);
+    return TEST_PASS;
+}
+
 static enum test_return test_issue_161(void)
 {
     enum test_return ret = cache_bulkalloc(1);
@@ -408,6 +517,10 @@ static int generate_config(const char *fname)
     cJSON_AddStringToObject(obj, "config", "r=225;w=226");
     cJSON_AddItemToArray(array, obj);
     obj = cJSON_CreateObject();
+    cJSON_AddStringToObject(obj, "module", "multi_ops.so");
+    cJSON_AddStringToObject(obj, "config", "c=228");
+    cJSON_AddItemToArray(array, obj);
+    obj = cJSON_CreateObject();
     cJSON_AddStringToObject(obj, "module", "testapp_extension.so");
     cJSON_AddItemToArray(array, obj);
 
@@ -425,6 +538,8 @@ static int generate_config(const char *fname)
     cJSON_AddNumberToObject(obj, "maxconn", 1000);
     cJSON_AddNumberToObject(obj, "backlog", 1024);
     cJSON_AddStringToObject(obj, "host", "*");
+    /* All of the multi-packet responses of the tests go out with MSG_MORE */
+    cJSON_AddTrueToObject(obj, "cork");
     cJSON_AddItemToArray(array, obj);
 
     obj = cJSON_CreateObject();
@@ -436,10 +551,26 @@ static int generate_config(const char *fname)
     cJSON_AddStringToObject(obj_ssl, "key", pem_path);
     cJSON_AddStringToObject(obj_ssl, "cert", cert_path);
     cJSON_AddItemToArray(array, obj);
+
+#ifndef WIN32
+    /* The port only names it */
+    obj = cJSON_CreateObject();
+    cJSON_AddNumberToObject(obj, "port", 11997);
+    cJSON_AddNumberToObject(obj, "maxconn", 1000);
+    cJSON_AddStringToObject(obj, "path", UNIX_SOCKET_PATH);
+    cJSON_AddStringToObject(obj, "priority", "low");
+    cJSON_AddItemToArray(array, obj);
+#endif
     cJSON_AddItemReferenceToObject(root, "interfaces", array);
 
     cJSON_AddStringToObject(root, "admin", "");
+    cJSON_AddNumberToObject(root, "threads", 4);
     cJSON_AddTrueToObject(root, "datatype_support");
+    cJSON_AddNumberToObject(root, "compress_responses", 64);
+    cJSON_AddTrueToObject(root, "json_detect");
+#ifndef WIN32
+    cJSON_AddStringToObject(root, "hot_restart", "memcached_testapp.sock");
+#endif
 
     if ((fp = fopen(fname, "w")) == NULL) {
         return -1;
@@ -1761,6 +1892,97 @@ static enum test_return test_binary_getkq(void) {
     return test_binary_getq_impl("test_binary_getkq", PROTOCOL_BINARY_CMD_GETKQ);
 }
 
+static off_t touch_command(char* buf,
+                           size_t bufsz,
+                           uint8_t cmd,
+                           const void* key,
+                           size_t keylen,
+                           uint32_t exp) {
+    protocol_binary_request_touch *request = (void*)buf;
+    cb_assert(bufsz >= sizeof(*request) + keylen);
+
+    memset(request, 0, sizeof(*request));
+    request->message.header.request.magic = PROTOCOL_BINARY_REQ;
+    request->message.header.request.opcode = cmd;
+    request->message.header.request.keylen = htons((uint16_t)keylen);
+    request->message.header.request.extlen = 4;
+    request->message.header.request.bodylen = htonl((uint32_t)(keylen + 4));
+    request->message.header.request.opaque = 0xdeadbeef;
+    request->message.body.expiration = htonl(exp);
+    memcpy(buf + sizeof(*request), key, keylen);
+
+    return (off_t)(sizeof(*request) + keylen);
+}
+
+static enum test_return test_binary_gat(void) {
+    const char *key = "test_binary_gat";
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } send, receive;
+    protocol_binary_response_get *rsp = (void*)receive.bytes;
+    size_t len;
+
+    len = touch_command(send.bytes, sizeof(send.bytes),
+                        PROTOCOL_BINARY_CMD_GAT, key, strlen(key), 10);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_GAT,
+                             PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+
+    len = storage_command(send.bytes, sizeof(send.bytes),
+                          PROTOCOL_BINARY_CMD_SET, key, strlen(key),
+                          "world", 5, 0xcafe, 0);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    /* GAT returns the value like GET (without the key) */
+    len = touch_command(send.bytes, sizeof(send.bytes),
+                        PROTOCOL_BINARY_CMD_GAT, key, strlen(key), 10);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_GAT,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(receive.response.message.header.response.keylen == 0);
+    cb_assert(receive.response.message.header.response.extlen == 4);
+    cb_assert(receive.response.message.header.response.bodylen == 9);
+    cb_assert(ntohl(rsp->message.body.flags) == 0xcafe);
+    cb_assert(memcmp(receive.bytes + sizeof(rsp->bytes), "world", 5) == 0);
+
+    /* TOUCH only returns the status */
+    len = touch_command(send.bytes, sizeof(send.bytes),
+                        PROTOCOL_BINARY_CMD_TOUCH, key, strlen(key), 10);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_TOUCH,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(receive.response.message.header.response.bodylen == 0);
+
+    /* A GATQ miss is quiet, so the NOOP behind it is the first response */
+    len = touch_command(send.bytes, sizeof(send.bytes),
+                        PROTOCOL_BINARY_CMD_GATQ, "test_binary_gat_missing",
+                        strlen("test_binary_gat_missing"), 10);
+    len += raw_command(send.bytes + len, sizeof(send.bytes) - len,
+                       PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_NOOP,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    /* The header only is not a valid request */
+    len = raw_command(send.bytes, sizeof(send.bytes), PROTOCOL_BINARY_CMD_GAT,
+                      key, strlen(key), NULL, 0);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_GAT,
+                             PROTOCOL_BINARY_RESPONSE_EINVAL);
+
+    return TEST_PASS;
+}
+
 static enum test_return test_binary_incr_impl(const char* key, uint8_t cmd) {
     union {
         protocol_binary_request_no_extras request;
@@ -2330,6 +2552,52 @@ static enum test_return test_binary_ioctl(void) {
     return TEST_PASS;
 }
 
+static enum test_return test_binary_ioctl_settings(void) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    static const struct {
+        const char *key;
+        const char *value;
+        uint16_t status;
+    } settings[] = {
+        { "reqs_per_event", "0", PROTOCOL_BINARY_RESPONSE_EINVAL },
+        { "reqs_per_event", "10", PROTOCOL_BINARY_RESPONSE_SUCCESS },
+        { "reqs_per_event", "20", PROTOCOL_BINARY_RESPONSE_SUCCESS },
+        { "reqs_per_tap_event", "50", PROTOCOL_BINARY_RESPONSE_SUCCESS },
+        { "tcp_nodelay", "maybe", PROTOCOL_BINARY_RESPONSE_EINVAL },
+        { "tcp_nodelay", "true", PROTOCOL_BINARY_RESPONSE_SUCCESS },
+        { "num_threads", "5", PROTOCOL_BINARY_RESPONSE_EINVAL },
+        /* Our connection moves to the first worker (if it isn't there) */
+        { "num_threads", "1", PROTOCOL_BINARY_RESPONSE_SUCCESS },
+        { "num_threads", "4", PROTOCOL_BINARY_RESPONSE_SUCCESS },
+        { "no_such_setting", "1", PROTOCOL_BINARY_RESPONSE_EINVAL }
+    };
+    size_t ii;
+
+    for (ii = 0; ii < sizeof(settings) / sizeof(settings[0]); ++ii) {
+        size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                                 PROTOCOL_BINARY_CMD_IOCTL_SET,
+                                 settings[ii].key, strlen(settings[ii].key),
+                                 settings[ii].value,
+                                 strlen(settings[ii].value));
+
+        safe_send(buffer.bytes, len, false);
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response,
+                                 PROTOCOL_BINARY_CMD_IOCTL_SET,
+                                 settings[ii].status);
+
+        /* Still served after it moved */
+        cb_assert(test_binary_noop() == TEST_PASS);
+        cb_assert(test_binary_noop() == TEST_PASS);
+    }
+
+    return TEST_PASS;
+}
+
 static enum test_return test_binary_verbosity(void) {
     union {
         protocol_binary_request_verbosity request;
@@ -2515,6 +2783,121 @@ static enum test_return test_binary_write(void) {
     return TEST_PASS;
 }
 
+/* Add an operation to the body of a multi operation request */
+static char *add_multi_op(char *ptr, uint8_t opcode, const char *key,
+                          const void *value, uint32_t nvalue,
+                          uint32_t expiration) {
+    protocol_binary_multi_op op;
+
+    memset(&op, 0, sizeof(op));
+    op.op.opcode = opcode;
+    op.op.keylen = htons((uint16_t)strlen(key));
+    op.op.vallen = htonl(nvalue);
+    op.op.expiration = htonl(expiration);
+    memcpy(ptr, op.bytes, sizeof(op.bytes));
+    ptr += sizeof(op.bytes);
+    memcpy(ptr, key, strlen(key));
+    ptr += strlen(key);
+    if (nvalue > 0) {
+        memcpy(ptr, value, nvalue);
+        ptr += nvalue;
+    }
+    return ptr;
+}
+
+/* Check the next result in the body of a multi operation response */
+static char *check_multi_result(char *ptr, uint8_t opcode, uint16_t status,
+                                const void *value, uint32_t nvalue) {
+    protocol_binary_multi_result res;
+
+    memcpy(res.bytes, ptr, sizeof(res.bytes));
+    cb_assert(res.result.opcode == opcode);
+    cb_assert(ntohs(res.result.status) == status);
+    cb_assert(ntohl(res.result.vallen) == nvalue);
+    if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS &&
+        opcode != PROTOCOL_BINARY_CMD_DELETE) {
+        cb_assert(res.result.cas != 0);
+    }
+    ptr += sizeof(res.bytes);
+    if (nvalue > 0) {
+        cb_assert(memcmp(ptr, value, nvalue) == 0);
+        ptr += nvalue;
+    }
+    return ptr;
+}
+
+static enum test_return test_binary_multi_ops(void) {
+    union {
+        protocol_binary_request_multi_ops request;
+        protocol_binary_response_multi_ops response;
+        char bytes[2048];
+    } buffer;
+    char body[1024];
+    char *ptr = body;
+    uint64_t arith[2];
+    uint64_t value = htonll(10);
+    size_t len;
+
+    arith[0] = htonll(5);
+    arith[1] = htonll(10);
+    ptr = add_multi_op(ptr, PROTOCOL_BINARY_CMD_SET, "multi_a", "abc", 3, 0);
+    ptr = add_multi_op(ptr, PROTOCOL_BINARY_CMD_SET, "multi_b", "de", 2, 0);
+    ptr = add_multi_op(ptr, PROTOCOL_BINARY_CMD_ADD, "multi_a", "x", 1, 0);
+    ptr = add_multi_op(ptr, PROTOCOL_BINARY_CMD_GET, "multi_a", NULL, 0, 0);
+    ptr = add_multi_op(ptr, PROTOCOL_BINARY_CMD_GET, "multi_c", NULL, 0, 0);
+    ptr = add_multi_op(ptr, PROTOCOL_BINARY_CMD_GET, "multi_b", NULL, 0, 0);
+    ptr = add_multi_op(ptr, PROTOCOL_BINARY_CMD_INCREMENT, "multi_n",
+                       arith, sizeof(arith), 0);
+    ptr = add_multi_op(ptr, PROTOCOL_BINARY_CMD_DELETE, "multi_n", NULL, 0, 0);
+    ptr = add_multi_op(ptr, PROTOCOL_BINARY_CMD_DELETE, "multi_a", NULL, 0, 0);
+    ptr = add_multi_op(ptr, PROTOCOL_BINARY_CMD_GET, "multi_a", NULL, 0, 0);
+    ptr = add_multi_op(ptr, PROTOCOL_BINARY_CMD_NOOP, "multi_a", NULL, 0, 0);
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes), multi_command,
+                      NULL, 0, body, ptr - body);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, multi_command,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    ptr = buffer.bytes + sizeof(buffer.response);
+    ptr = check_multi_result(ptr, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS, NULL, 0);
+    ptr = check_multi_result(ptr, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS, NULL, 0);
+    ptr = check_multi_result(ptr, PROTOCOL_BINARY_CMD_ADD,
+                             PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, NULL, 0);
+    ptr = check_multi_result(ptr, PROTOCOL_BINARY_CMD_GET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS, "abc", 3);
+    ptr = check_multi_result(ptr, PROTOCOL_BINARY_CMD_GET,
+                             PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, NULL, 0);
+    ptr = check_multi_result(ptr, PROTOCOL_BINARY_CMD_GET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS, "de", 2);
+    ptr = check_multi_result(ptr, PROTOCOL_BINARY_CMD_INCREMENT,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS, &value,
+                             sizeof(value));
+    ptr = check_multi_result(ptr, PROTOCOL_BINARY_CMD_DELETE,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS, NULL, 0);
+    ptr = check_multi_result(ptr, PROTOCOL_BINARY_CMD_DELETE,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS, NULL, 0);
+    ptr = check_multi_result(ptr, PROTOCOL_BINARY_CMD_GET,
+                             PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, NULL, 0);
+    ptr = check_multi_result(ptr, PROTOCOL_BINARY_CMD_NOOP,
+                             PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED, NULL, 0);
+    cb_assert(ptr == buffer.bytes + sizeof(buffer.response) +
+              buffer.response.message.header.response.bodylen);
+    validate_object("multi_b", "de");
+
+    /* A truncated operation makes the whole request invalid */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes), multi_command,
+                      NULL, 0, body, sizeof(protocol_binary_multi_op) + 2);
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response, multi_command,
+                             PROTOCOL_BINARY_RESPONSE_EINVAL);
+    return TEST_PASS;
+}
+
 static enum test_return test_binary_bad_tap_ttl(void) {
     union {
         protocol_binary_request_tap_flush request;
@@ -2748,6 +3131,26 @@ static enum test_return test_binary_datatype_json_without_support(void) {
     return TEST_PASS;
 }
 
+static enum test_return test_binary_datatype_json_detect(void) {
+    const char body[] = " { \"value\" : [ 1, 2 ] }\n";
+    const char broken[] = "{ \"value\" : [ 1, 2 }";
+    const char text[] = "value";
+
+    set_datatype_feature(true);
+    store_object_w_datatype("myjson", body, strlen(body), false, false);
+    get_object_w_datatype("myjson", body, strlen(body), false, true, false);
+
+    store_object_w_datatype("myjson", broken, strlen(broken), false, false);
+    get_object_w_datatype("myjson", broken, strlen(broken),
+                          false, false, false);
+
+    store_object_w_datatype("myjson", text, strlen(text), false, false);
+    get_object_w_datatype("myjson", text, strlen(text), false, false, false);
+    set_datatype_feature(false);
+
+    return TEST_PASS;
+}
+
 static enum test_return test_binary_datatype_compressed(void) {
     const char inflated[] = "aaaaaaaaabbbbbbbccccccdddddd";
     size_t inflated_len = strlen(inflated);
@@ -2777,6 +3180,35 @@ static enum test_return test_binary_datatype_compressed(void) {
     return TEST_PASS;
 }
 
+static enum test_return test_binary_datatype_compressed_reread(void) {
+    const char inflated[] = "aaaaaaaaabbbbbbbccccccddddddeeeeeeeeffffffff";
+    size_t inflated_len = strlen(inflated);
+    char deflated[256];
+    size_t deflated_len = 256;
+    int ii;
+
+    cb_assert(snappy_compress(inflated, inflated_len,
+                              deflated, &deflated_len) == SNAPPY_OK);
+
+    set_datatype_feature(true);
+    store_object_w_datatype("myrereadcompressed", deflated, deflated_len,
+                            true, false);
+
+    /* Read it often enough for a hot item to keep the inflated value */
+    set_datatype_feature(false);
+    for (ii = 0; ii < 8; ++ii) {
+        get_object_w_datatype("myrereadcompressed", inflated, inflated_len,
+                              true, false, true);
+    }
+
+    set_datatype_feature(true);
+    get_object_w_datatype("myrereadcompressed", deflated, deflated_len,
+                          true, false, false);
+    set_datatype_feature(false);
+
+    return TEST_PASS;
+}
+
 static enum test_return test_binary_datatype_compressed_json(void) {
     const char inflated[] = "{ \"value\" : \"aaaaaaaaabbbbbbbccccccdddddd\" }";
     size_t inflated_len = strlen(inflated);
@@ -2806,6 +3238,79 @@ static enum test_return test_binary_datatype_compressed_json(void) {
     return TEST_PASS;
 }
 
+static void set_snappy_feature(const uint16_t *features, size_t nfeatures,
+                               size_t expected) {
+    union {
+        protocol_binary_request_hello request;
+        protocol_binary_response_hello response;
+        char bytes[1024];
+    } buffer;
+    const char *useragent = "testapp";
+    uint16_t *ptr;
+    size_t len;
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_HELLO,
+                      useragent, strlen(useragent), features,
+                      nfeatures * sizeof(*features));
+
+    safe_send(buffer.bytes, len, false);
+    safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+    validate_response_header(&buffer.response,
+                             PROTOCOL_BINARY_CMD_HELLO,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    len = buffer.response.message.header.response.bodylen;
+    cb_assert(len == expected * 2);
+    ptr = (uint16_t*)(buffer.bytes + sizeof(buffer.response));
+    if (expected > 0) {
+        cb_assert(ntohs(ptr[0]) == PROTOCOL_BINARY_FEATURE_DATATYPE);
+    }
+    if (expected > 1) {
+        cb_assert(ntohs(ptr[1]) == PROTOCOL_BINARY_FEATURE_SNAPPY);
+    }
+}
+
+static enum test_return test_binary_snappy_responses(void) {
+    /* Asked for twice, and before datatype */
+    const uint16_t features[] = { htons(PROTOCOL_BINARY_FEATURE_SNAPPY),
+                                  htons(PROTOCOL_BINARY_FEATURE_DATATYPE),
+                                  htons(PROTOCOL_BINARY_FEATURE_SNAPPY) };
+    char inflated[1024];
+    size_t inflated_len = sizeof(inflated);
+    char deflated[2048];
+    size_t deflated_len = sizeof(deflated);
+    size_t ii;
+
+    for (ii = 0; ii < inflated_len; ++ii) {
+        inflated[ii] = "abcdefgh"[ii % 8];
+    }
+    cb_assert(snappy_compress(inflated, inflated_len,
+                              deflated, &deflated_len) == SNAPPY_OK);
+
+    set_datatype_feature(false);
+    store_object_w_datatype("mysnappy", inflated, inflated_len,
+                            false, false);
+
+    /* Snappy needs datatype */
+    set_snappy_feature(features, 1, 0);
+
+    set_snappy_feature(features, 3, 2);
+    get_object_w_datatype("mysnappy", deflated, deflated_len,
+                          true, false, false);
+    /* Small values are sent as they are */
+    store_object_w_datatype("mysnappy", inflated, 32, false, false);
+    get_object_w_datatype("mysnappy", inflated, 32, false, false, false);
+
+    set_datatype_feature(true);
+    store_object_w_datatype("mysnappy", inflated, inflated_len,
+                            false, false);
+    get_object_w_datatype("mysnappy", inflated, inflated_len,
+                          false, false, false);
+    set_datatype_feature(false);
+
+    return TEST_PASS;
+}
+
 static enum test_return test_binary_invalid_datatype(void) {
     protocol_binary_request_no_extras request;
     union {
@@ -3431,6 +3936,44 @@ static enum test_return test_binary_pipeline_set_get_del(void) {
     return rv;
 }
 
+static enum test_return test_binary_pipeline_quiet_tail(void) {
+    const char *key = "test_binary_pipeline_quiet_tail";
+    const char *missing = "test_binary_pipeline_quiet_tail_missing";
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } send, receive;
+    size_t len = storage_command(send.bytes, sizeof(send.bytes),
+                                 PROTOCOL_BINARY_CMD_SET,
+                                 key, strlen(key), "value", 5, 0, 0);
+
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    /* The response held back for the getq must go out without it */
+    len = raw_command(send.bytes, sizeof(send.bytes), PROTOCOL_BINARY_CMD_GET,
+                      key, strlen(key), NULL, 0);
+    len += raw_command(send.bytes + len, sizeof(send.bytes) - len,
+                       PROTOCOL_BINARY_CMD_GETQ,
+                       missing, strlen(missing), NULL, 0);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_GET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    len = raw_command(send.bytes, sizeof(send.bytes), PROTOCOL_BINARY_CMD_NOOP,
+                      NULL, 0, NULL, 0);
+    safe_send(send.bytes, len, false);
+    safe_recv_packet(receive.bytes, sizeof(receive.bytes));
+    validate_response_header(&receive.response, PROTOCOL_BINARY_CMD_NOOP,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    return TEST_PASS;
+}
+
 static enum test_return test_binary_pipeline_set_del(void) {
     enum test_return rv = test_binary_pipeline_impl(PROTOCOL_BINARY_CMD_SET,
                                 PROTOCOL_BINARY_RESPONSE_SUCCESS,
@@ -3445,6 +3988,479 @@ static enum test_return test_binary_pipeline_set_del(void) {
     return rv;
 }
 
+/*
+ * Start a new server, which takes the ports over from the running one,
+ * and check that the old one exits once we've closed our connections
+ */
+static enum test_return test_hot_restart(void) {
+#ifdef WIN32
+    return TEST_SKIP;
+#else
+    pid_t old_pid = server_pid;
+    in_port_t new_port;
+    in_port_t new_ssl_port;
+
+    close(sock);
+    close(sock_ssl);
+    server_pid = start_server(&new_port, &new_ssl_port, false, 600);
+    cb_assert(new_port == port);
+    cb_assert(new_ssl_port == ssl_port);
+    cb_assert(waitpid(old_pid, NULL, 0) == old_pid);
+
+    connect_to_server("127.0.0.1", port, ssl_port, false);
+    return test_binary_noop();
+#endif
+}
+
+/*
+ * Run a command over the Unix socket interface
+ */
+static enum test_return test_unix_socket(void) {
+#ifdef WIN32
+    return TEST_SKIP;
+#else
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    struct sockaddr_un addr;
+    size_t offset = 0;
+    size_t len;
+    int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    cb_assert(sfd != -1);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, UNIX_SOCKET_PATH);
+    cb_assert(connect(sfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_NOOP, NULL, 0, NULL, 0);
+    cb_assert(send(sfd, buffer.bytes, len, 0) == (ssize_t)len);
+    while (offset < sizeof(buffer.response.bytes)) {
+        ssize_t nr = recv(sfd, buffer.bytes + offset,
+                          sizeof(buffer.response.bytes) - offset, 0);
+        cb_assert(nr > 0);
+        offset += nr;
+    }
+    close(sfd);
+
+    buffer.response.message.header.response.status =
+        ntohs(buffer.response.message.header.response.status);
+    buffer.response.message.header.response.bodylen =
+        ntohl(buffer.response.message.header.response.bodylen);
+    validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_NOOP,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    return TEST_PASS;
+#endif
+}
+
+/*
+ * The -b and -r modes: measure the server rather than test it. They run
+ * the tap_mock_engine in its null mode, so the numbers are (almost) all
+ * the cost of reading, parsing and dispatching the commands and sending
+ * the responses (or of shipping the replication stream).
+ */
+struct bench_reader {
+    SOCKET sfd;
+    char *buffer;
+    size_t size;
+    size_t offset;
+    size_t avail;
+};
+
+struct bench_client {
+    cb_thread_t tid;
+    int id;
+    int depth;
+    size_t value_size;
+    uint64_t ops;
+    uint64_t errors;
+};
+
+static volatile bool bench_running;
+
+static int generate_bench_config(const char *fname, size_t value_size,
+                                 size_t mutations)
+{
+    FILE *fp;
+    char engine_config[128];
+    cJSON *root = cJSON_CreateObject();
+    cJSON *array = cJSON_CreateArray();
+    cJSON *obj = cJSON_CreateObject();
+
+    snprintf(engine_config, sizeof(engine_config),
+             "null=true;value_size=%lu;mutations=%lu",
+             (unsigned long)value_size, (unsigned long)mutations);
+    cJSON_AddStringToObject(obj, "module", "tap_mock_engine.so");
+    cJSON_AddStringToObject(obj, "config", engine_config);
+    cJSON_AddItemReferenceToObject(root, "engine", obj);
+
+    obj = cJSON_CreateObject();
+    cJSON_AddStringToObject(obj, "module", "blackhole_logger.so");
+    cJSON_AddItemToArray(array, obj);
+    cJSON_AddItemReferenceToObject(root, "extensions", array);
+
+    array = cJSON_CreateArray();
+    obj = cJSON_CreateObject();
+#ifdef WIN32
+    cJSON_AddNumberToObject(obj, "port", 11211);
+#else
+    cJSON_AddNumberToObject(obj, "port", 0);
+#endif
+    cJSON_AddNumberToObject(obj, "maxconn", 1000);
+    cJSON_AddNumberToObject(obj, "backlog", 1024);
+    cJSON_AddStringToObject(obj, "host", "*");
+    cJSON_AddItemToArray(array, obj);
+    cJSON_AddItemReferenceToObject(root, "interfaces", array);
+
+    cJSON_AddStringToObject(root, "admin", "");
+    cJSON_AddNumberToObject(root, "threads", 4);
+
+    if ((fp = fopen(fname, "w")) == NULL) {
+        return -1;
+    } else {
+        fprintf(fp, "%s", cJSON_Print(root));
+        fclose(fp);
+    }
+
+    return 0;
+}
+
+static void bench_reader_init(struct bench_reader *reader, SOCKET sfd,
+                              size_t size) {
+    reader->sfd = sfd;
+    reader->buffer = malloc(size);
+    reader->size = size;
+    reader->offset = reader->avail = 0;
+    cb_assert(reader->buffer != NULL);
+}
+
+/*
+ * Get the next packet (of the server) from the socket, reading as much as
+ * we can at a time. It stays there until the next call.
+ */
+static protocol_binary_response_header *bench_next_packet(struct bench_reader *reader) {
+    for (;;) {
+        protocol_binary_response_header *header =
+            (void*)(reader->buffer + reader->offset);
+        size_t left = reader->avail - reader->offset;
+        ssize_t nr;
+
+        if (left >= sizeof(*header) &&
+            left >= sizeof(*header) + ntohl(header->response.bodylen)) {
+            reader->offset += sizeof(*header) + ntohl(header->response.bodylen);
+            return header;
+        }
+
+        memmove(reader->buffer, reader->buffer + reader->offset, left);
+        reader->offset = 0;
+        reader->avail = left;
+        cb_assert(reader->avail < reader->size);
+        nr = recv(reader->sfd, reader->buffer + reader->avail,
+                  reader->size - reader->avail, 0);
+        if (nr <= 0) {
+            return NULL;
+        }
+        reader->avail += nr;
+    }
+}
+
+/*
+ * The CPU time (in seconds) the server has used so far
+ */
+static double bench_server_cpu(SOCKET sfd) {
+    struct bench_reader reader;
+    protocol_binary_response_header *header;
+    char buffer[sizeof(protocol_binary_request_no_extras)];
+    double cpu = 0;
+    size_t len = raw_command(buffer, sizeof(buffer), PROTOCOL_BINARY_CMD_STAT,
+                             NULL, 0, NULL, 0);
+
+    cb_assert(send(sfd, buffer, len, 0) == (ssize_t)len);
+    bench_reader_init(&reader, sfd, 65536);
+    while ((header = bench_next_packet(&reader)) != NULL) {
+        uint16_t nkey = ntohs(header->response.keylen);
+        uint32_t nval = ntohl(header->response.bodylen) - nkey;
+        const char *key = (const char*)(header + 1);
+        char val[32];
+
+        if (nkey == 0) {
+            break;
+        }
+        if ((nkey == 11 && memcmp(key, "rusage_user", 11) == 0) ||
+            (nkey == 13 && memcmp(key, "rusage_system", 13) == 0)) {
+            cb_assert(nval < sizeof(val));
+            memcpy(val, key + nkey, nval);
+            val[nval] = '\0';
+            cpu += atof(val);
+        }
+    }
+    cb_assert(header != NULL);
+    free(reader.buffer);
+    return cpu;
+}
+
+/*
+ * Each client sends depth commands (a set for every nine gets) at a
+ * time, and waits for all of the responses before it sends them again
+ */
+static void bench_client_main(void *arg) {
+    struct bench_client *client = arg;
+    SOCKET sfd = create_connect_plain_socket("127.0.0.1", port, false);
+    struct bench_reader reader;
+    char *request = malloc(client->depth * (64 + client->value_size));
+    char *value = calloc(1, client->value_size);
+    size_t len = 0;
+    int ii;
+
+    cb_assert(sfd != INVALID_SOCKET);
+    cb_assert(request != NULL && value != NULL);
+    bench_reader_init(&reader, sfd, 65536 + client->value_size);
+    for (ii = 0; ii < client->depth; ++ii) {
+        char key[32];
+        size_t nkey = snprintf(key, sizeof(key), "bench_%d_%d",
+                               client->id, ii);
+        if (ii % 10 == 9) {
+            len += storage_command(request + len, 64 + client->value_size,
+                                   PROTOCOL_BINARY_CMD_SET, key, nkey,
+                                   value, client->value_size, 0, 0);
+        } else {
+            len += raw_command(request + len, 64 + client->value_size,
+                               PROTOCOL_BINARY_CMD_GET, key, nkey, NULL, 0);
+        }
+    }
+
+    while (bench_running) {
+        cb_assert(send(sfd, request, len, 0) == (ssize_t)len);
+        for (ii = 0; ii < client->depth; ++ii) {
+            protocol_binary_response_header *header;
+
+            header = bench_next_packet(&reader);
+            cb_assert(header != NULL);
+            if (ntohs(header->response.status) !=
+                PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+                ++client->errors;
+            }
+            ++client->ops;
+        }
+    }
+
+    closesocket(sfd);
+    free(reader.buffer);
+    free(value);
+    free(request);
+}
+
+static int run_bench(int nclients, int seconds, int depth, size_t value_size)
+{
+    struct bench_client *clients = calloc(nclients, sizeof(*clients));
+    uint64_t ops = 0;
+    uint64_t errors = 0;
+    hrtime_t start;
+    hrtime_t elapsed;
+    char result[128];
+    int ii;
+
+    cb_assert(clients != NULL);
+    if (generate_bench_config(config_file, value_size, 0) == -1) {
+        fprintf(stderr, "Failed to write %s\n", config_file);
+        return 1;
+    }
+    server_pid = start_server(&port, &ssl_port, false, seconds + 600);
+
+    bench_running = true;
+    start = gethrtime();
+    for (ii = 0; ii < nclients; ++ii) {
+        clients[ii].id = ii;
+        clients[ii].depth = depth;
+        clients[ii].value_size = value_size;
+        cb_assert(cb_create_thread(&clients[ii].tid, bench_client_main,
+                                   &clients[ii], 0) == 0);
+    }
+#ifdef WIN32
+    Sleep(seconds * 1000);
+#else
+    sleep(seconds);
+#endif
+    bench_running = false;
+    for (ii = 0; ii < nclients; ++ii) {
+        cb_assert(cb_join_thread(clients[ii].tid) == 0);
+        ops += clients[ii].ops;
+        errors += clients[ii].errors;
+    }
+    elapsed = gethrtime() - start;
+
+    fprintf(stdout, "%d clients, pipeline of %d, %lu byte values: "
+            "%" PRIu64 " ops in %.2f s, %.0f ops/s, %" PRIu64 " errors\n",
+            nclients, depth, (unsigned long)value_size, ops,
+            elapsed / 1e9, ops * 1e9 / elapsed, errors);
+    snprintf(result, sizeof(result),
+             "server_get_set,clients=%d pipeline=%d value=%lu", nclients,
+             depth, (unsigned long)value_size);
+    perf_baseline_check(result, ops ? (double)elapsed / ops : 0.0);
+
+    free(clients);
+    sock = INVALID_SOCKET;
+    stop_memcached_server();
+    return errors == 0 && perf_baseline_failures() == 0 ? 0 : 1;
+}
+
+/*
+ * Send a command on a replication connection and check its response
+ */
+static void bench_command(struct bench_reader *reader, const char *buffer,
+                          size_t len) {
+    protocol_binary_response_header *header;
+
+    cb_assert(send(reader->sfd, buffer, len, 0) == (ssize_t)len);
+    header = bench_next_packet(reader);
+    cb_assert(header != NULL);
+    if (ntohs(header->response.status) != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        fprintf(stderr, "Command 0x%02x failed: 0x%04x\n",
+                header->response.opcode, ntohs(header->response.status));
+        abort();
+    }
+}
+
+/*
+ * Open a DCP stream of vbucket 0 (with a flow control window, unless it
+ * is 0)
+ */
+static void bench_open_dcp(struct bench_reader *reader, uint32_t window) {
+    union {
+        protocol_binary_request_dcp_open open;
+        protocol_binary_request_dcp_stream_req stream_req;
+        char bytes[1024];
+    } buffer;
+    size_t len;
+
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_DCP_OPEN, "bench", 5, NULL, 0);
+    buffer.open.message.header.request.extlen = 8;
+    buffer.open.message.header.request.bodylen = htonl(8 + 5);
+    buffer.open.message.body.seqno = 0;
+    buffer.open.message.body.flags = htonl(DCP_OPEN_PRODUCER);
+    memcpy(buffer.bytes + sizeof(buffer.open.bytes), "bench", 5);
+    bench_command(reader, buffer.bytes, sizeof(buffer.open.bytes) + 5);
+
+    if (window != 0) {
+        char value[16];
+        size_t nvalue = snprintf(value, sizeof(value), "%u", window);
+        len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                          PROTOCOL_BINARY_CMD_DCP_CONTROL,
+                          "connection_buffer_size", 22, value, nvalue);
+        bench_command(reader, buffer.bytes, len);
+    }
+
+    raw_command(buffer.bytes, sizeof(buffer.bytes),
+                PROTOCOL_BINARY_CMD_DCP_STREAM_REQ, NULL, 0, NULL, 0);
+    buffer.stream_req.message.header.request.extlen = 48;
+    buffer.stream_req.message.header.request.bodylen = htonl(48);
+    memset(buffer.bytes + sizeof(protocol_binary_request_header), 0, 48);
+    buffer.stream_req.message.body.end_seqno = htonll(UINT64_MAX);
+    bench_command(reader, buffer.bytes, sizeof(buffer.stream_req.bytes));
+}
+
+/*
+ * The -r mode: have the server ship a stream of mutations to us (over TAP
+ * or DCP, acknowledging what we've got when there's a flow control
+ * window), and see how fast it does that and how much CPU it takes.
+ */
+static int run_replication_bench(const char *type, size_t mutations,
+                                 size_t value_size, uint32_t window)
+{
+    bool dcp = strcmp(type, "dcp") == 0;
+    struct bench_reader reader;
+    protocol_binary_response_header *header;
+    SOCKET stats;
+    uint64_t received = 0;
+    uint64_t bytes = 0;
+    uint32_t unacked = 0;
+    double cpu;
+    hrtime_t start;
+    hrtime_t elapsed;
+    char result[128];
+
+    if (!dcp && strcmp(type, "tap") != 0) {
+        fprintf(stderr, "Unknown replication protocol: %s\n", type);
+        return 1;
+    }
+    if (generate_bench_config(config_file, value_size, mutations) == -1) {
+        fprintf(stderr, "Failed to write %s\n", config_file);
+        return 1;
+    }
+    server_pid = start_server(&port, &ssl_port, false, 600);
+    stats = create_connect_plain_socket("127.0.0.1", port, false);
+    cb_assert(stats != INVALID_SOCKET);
+    bench_reader_init(&reader,
+                      create_connect_plain_socket("127.0.0.1", port, false),
+                      65536 + value_size);
+    cb_assert(reader.sfd != INVALID_SOCKET);
+
+    cpu = bench_server_cpu(stats);
+    start = gethrtime();
+    if (dcp) {
+        bench_open_dcp(&reader, window);
+    } else {
+        char buffer[sizeof(protocol_binary_request_no_extras)];
+        size_t len = raw_command(buffer, sizeof(buffer),
+                                 PROTOCOL_BINARY_CMD_TAP_CONNECT,
+                                 NULL, 0, NULL, 0);
+        cb_assert(send(reader.sfd, buffer, len, 0) == (ssize_t)len);
+    }
+
+    /* The TAP stream ends with the server closing the connection */
+    while ((header = bench_next_packet(&reader)) != NULL) {
+        uint32_t nbytes = sizeof(*header) + ntohl(header->response.bodylen);
+
+        bytes += nbytes;
+        if (header->response.opcode == PROTOCOL_BINARY_CMD_DCP_MUTATION ||
+            header->response.opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION) {
+            ++received;
+        } else if (header->response.opcode ==
+                   PROTOCOL_BINARY_CMD_DCP_STREAM_END) {
+            break;
+        }
+
+        unacked += nbytes;
+        if (dcp && window != 0 && unacked >= window / 2) {
+            protocol_binary_request_dcp_buffer_acknowledgement ack;
+            raw_command((char*)ack.bytes, sizeof(ack.bytes),
+                        PROTOCOL_BINARY_CMD_DCP_BUFFER_ACKNOWLEDGEMENT,
+                        NULL, 0, NULL, 0);
+            ack.message.header.request.extlen = 4;
+            ack.message.header.request.bodylen = htonl(4);
+            ack.message.body.buffer_bytes = htonl(unacked);
+            cb_assert(send(reader.sfd, ack.bytes, sizeof(ack.bytes), 0) ==
+                      (ssize_t)sizeof(ack.bytes));
+            unacked = 0;
+        }
+    }
+    elapsed = gethrtime() - start;
+    cpu = bench_server_cpu(stats) - cpu;
+
+    fprintf(stdout, "%s, %lu byte values, window %u: %" PRIu64
+            " mutations in %.2f s, %.0f mutations/s, %.1f MB/s, "
+            "server CPU %.2f s (%.2f us per mutation)\n",
+            type, (unsigned long)value_size, window, received,
+            elapsed / 1e9, received * 1e9 / elapsed,
+            bytes * 1e9 / elapsed / (1024 * 1024), cpu,
+            received ? cpu * 1e6 / received : 0.0);
+    snprintf(result, sizeof(result),
+             "server_%s,mutations=%lu value=%lu window=%u", type,
+             (unsigned long)mutations, (unsigned long)value_size, window);
+    perf_baseline_check(result, received ? (double)elapsed / received : 0.0);
+
+    closesocket(reader.sfd);
+    free(reader.buffer);
+    closesocket(stats);
+    sock = INVALID_SOCKET;
+    stop_memcached_server();
+    return received == mutations && perf_baseline_failures() == 0 ? 0 : 1;
+}
+
 typedef enum test_return (*TEST_FUNC)(void);
 struct testcase {
     const char *description;
@@ -3470,7 +4486,9 @@ struct testcase testcases[] = {
     TESTCASE("cache_constructor_fail", cache_fail_constructor_test),
     TESTCASE("cache_destructor", cache_destructor_test),
     TESTCASE("cache_reuse", cache_reuse_test),
+    TESTCASE("cache_magazine", cache_magazine_test),
     TESTCASE("cache_redzone", cache_redzone_test),
+    TESTCASE("span_ring", span_ring_test),
     TESTCASE("issue_161", test_issue_161),
     TESTCASE("strtof", test_safe_strtof),
     TESTCASE("strtol", test_safe_strtol),
@@ -3498,6 +4516,7 @@ struct testcase testcases[] = {
     TESTCASE_PLAIN_AND_SSL("binary_getq", test_binary_getq),
     TESTCASE_PLAIN_AND_SSL("binary_getk", test_binary_getk),
     TESTCASE_PLAIN_AND_SSL("binary_getkq", test_binary_getkq),
+    TESTCASE_PLAIN_AND_SSL("binary_gat", test_binary_gat),
     TESTCASE_PLAIN_AND_SSL("binary_incr", test_binary_incr),
     TESTCASE_PLAIN_AND_SSL("binary_incrq", test_binary_incrq),
     TESTCASE_PLAIN_AND_SSL("binary_decr", test_binary_decr),
@@ -3519,6 +4538,7 @@ struct testcase testcases[] = {
     TESTCASE_PLAIN_AND_SSL("binary_verbosity", test_binary_verbosity),
     TESTCASE_PLAIN_AND_SSL("binary_read", test_binary_read),
     TESTCASE_PLAIN_AND_SSL("binary_write", test_binary_write),
+    TESTCASE_PLAIN_AND_SSL("binary_multi_ops", test_binary_multi_ops),
     TESTCASE_PLAIN_AND_SSL("binary_bad_tap_ttl", test_binary_bad_tap_ttl),
     TESTCASE_PLAIN_AND_SSL("MB-10114", test_mb_10114),
     TESTCASE_PLAIN_AND_SSL("binary_dcp_noop", test_binary_dcp_noop),
@@ -3528,10 +4548,14 @@ struct testcase testcases[] = {
     TESTCASE_PLAIN_AND_SSL("binary_isasl_refresh", test_binary_isasl_refresh),
 
     TESTCASE_PLAIN_AND_SSL("binary_ioctl", test_binary_ioctl),
+    TESTCASE_PLAIN_AND_SSL("binary_ioctl_settings", test_binary_ioctl_settings),
     TESTCASE_PLAIN_AND_SSL("binary_datatype_json", test_binary_datatype_json),
     TESTCASE_PLAIN_AND_SSL("binary_datatype_json_without_support", test_binary_datatype_json_without_support),
     TESTCASE_PLAIN_AND_SSL("binary_datatype_compressed", test_binary_datatype_compressed),
+    TESTCASE_PLAIN_AND_SSL("binary_datatype_compressed_reread", test_binary_datatype_compressed_reread),
+    TESTCASE_PLAIN_AND_SSL("binary_datatype_json_detect", test_binary_datatype_json_detect),
     TESTCASE_PLAIN_AND_SSL("binary_datatype_compressed_json", test_binary_datatype_compressed_json),
+    TESTCASE_PLAIN_AND_SSL("binary_snappy_responses", test_binary_snappy_responses),
     TESTCASE_PLAIN_AND_SSL("binary_invalid_datatype", test_binary_invalid_datatype),
     TESTCASE_PLAIN_AND_SSL("session_ctrl_token", test_session_ctrl_token),
     TESTCASE_PLAIN_AND_SSL("expiry_relative_with_clock_change", test_expiry_relative_with_clock_change_backwards),
@@ -3543,6 +4567,9 @@ struct testcase testcases[] = {
     TESTCASE_SSL("binary_pipeline_mb-11203",test_binary_pipeline_set),
     TESTCASE_PLAIN_AND_SSL("binary_pipeline_1", test_binary_pipeline_set_get_del),
     TESTCASE_PLAIN_AND_SSL("binary_pipeline_2", test_binary_pipeline_set_del),
+    TESTCASE_PLAIN_AND_SSL("binary_pipeline_quiet_tail", test_binary_pipeline_quiet_tail),
+    TESTCASE("unix_socket", test_unix_socket),
+    TESTCASE("hot_restart", test_hot_restart),
     TESTCASE_CLEANUP("stop_server", stop_memcached_server),
     TESTCASE(NULL, NULL)
 };
@@ -3556,12 +4583,75 @@ int main(int argc, char **argv)
     int test_phase_order[] = {phase_plain, phase_ssl, phase_cleanup};
     char* test_phase_strings[] = {"plain", "SSL", "cleanup"};
     int phase_index = 0;
+    int bench_clients = 0;
+    int bench_seconds = 0;
+    int bench_depth = 1;
+    unsigned long bench_value = 100;
+    char replication[4] = "";
+    unsigned long mutations = 1000000;
+    unsigned long window = 0;
+    const char *baseline = NULL;
+    double tolerance = 50;
+    int cmd;
 
     cb_initialize_sockets();
     /* Use unbuffered stdio */
     setbuf(stdout, NULL);
     setbuf(stderr, NULL);
 
+    while ((cmd = getopt(argc, argv, "b:r:B:T:")) != EOF) {
+        switch (cmd) {
+        case 'b':
+            if (sscanf(optarg, "%d,%d,%d,%lu", &bench_clients,
+                       &bench_seconds, &bench_depth, &bench_value) < 2 ||
+                bench_clients <= 0 || bench_seconds <= 0 ||
+                bench_depth <= 0) {
+                fprintf(stderr, "Incorrect -b: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            if (sscanf(optarg, "%3[a-z],%lu,%lu,%lu", replication,
+                       &mutations, &bench_value, &window) < 1) {
+                fprintf(stderr, "Incorrect -r: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'B':
+            baseline = optarg;
+            break;
+        case 'T':
+            tolerance = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b clients,seconds[,pipeline"
+                    "[,value_size]]]\n"
+                    "       [-r dcp|tap[,mutations[,value_size"
+                    "[,window]]]]\n"
+                    "       [-B baseline [-T tolerance]]\n\n"
+                    "-b and -r measure the server (with the null mode of "
+                    "the tap_mock_engine)\ninstead of running the tests: "
+                    "-b the gets and sets of the clients and\n-r "
+                    "shipping a stream of mutations. With -B they fail "
+                    "if it got\nslower than in the baseline by more "
+                    "than -T percent (default 50)\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if (baseline != NULL && !perf_baseline_load(baseline, tolerance)) {
+        return 1;
+    }
+
+    if (bench_clients > 0) {
+        return run_bench(bench_clients, bench_seconds, bench_depth,
+                         (size_t)bench_value);
+    } else if (replication[0] != '\0') {
+        return run_replication_bench(replication, (size_t)mutations,
+                                     (size_t)bench_value, (uint32_t)window);
+    }
+
     /* loop through the test phases and runs tests applicable to each phase*/
     while(phase_index < phase_max) {
         current_phase = test_phase_order[phase_index];
@@ -246,6 +246,52 @@ static enum test_result get_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+/*
+ * Verify that get_with_info finds the same item (and item info) as get
+ * and get_item_info do
+ */
+static enum test_result get_with_info_test(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    item *test_item_get = NULL;
+    item_info info;
+    item_info expected;
+    void *key = "get_with_info_key";
+    uint64_t cas = 0;
+
+    cb_assert(h1->get_with_info != NULL);
+    info.nvalue = 1;
+    cb_assert(h1->get_with_info(h, NULL, &test_item_get, &info, key,
+                                (int)strlen(key), 0) == ENGINE_KEY_ENOENT);
+
+    cb_assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 5, 0xcafe,
+                           0, PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    expected.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, test_item, &expected));
+    memcpy(expected.value[0].iov_base, "hello", 5);
+    cb_assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,
+                        0) == ENGINE_SUCCESS);
+
+    info.nvalue = 1;
+    cb_assert(h1->get_with_info(h, NULL, &test_item_get, &info, key,
+                                (int)strlen(key), 1) == ENGINE_NOT_MY_VBUCKET);
+    info.nvalue = 1;
+    cb_assert(h1->get_with_info(h, NULL, &test_item_get, &info, key,
+                                (int)strlen(key), 0) == ENGINE_SUCCESS);
+    cb_assert(test_item_get == test_item);
+    cb_assert(info.cas == cas);
+    cb_assert(info.flags == 0xcafe);
+    cb_assert(info.nbytes == 5);
+    cb_assert(info.nkey == strlen(key) &&
+              memcmp(info.key, key, info.nkey) == 0);
+    cb_assert(info.nvalue == 1 && info.value[0].iov_len == 5 &&
+              memcmp(info.value[0].iov_base, "hello", 5) == 0);
+
+    h1->release(h, NULL, test_item);
+    h1->release(h, NULL, test_item_get);
+    return SUCCESS;
+}
+
 static enum test_result expiry_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *test_item = NULL;
     item *test_item_get = NULL;
@@ -260,6 +306,100 @@ static enum test_result expiry_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+/*
+ * Look up more keys than item_get_multi does in one batch, where every
+ * other one is missing
+ */
+static enum test_result get_multi_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    char keys[150][32];
+    engine_key_t ekeys[150];
+    item *items[150];
+    ENGINE_ERROR_CODE status[150];
+    uint64_t cas;
+    int ii;
+
+    for (ii = 0; ii < 150; ++ii) {
+        snprintf(keys[ii], sizeof(keys[ii]), "get_multi_key_%d", ii);
+        ekeys[ii].key = keys[ii];
+        ekeys[ii].nkey = (uint16_t)strlen(keys[ii]);
+        ekeys[ii].vbucket = 0;
+        if (ii % 2 == 0) {
+            item *it;
+            cb_assert(h1->allocate(h, NULL, &it, keys[ii], ekeys[ii].nkey, 1,
+                                   0, 0, PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+            cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+            h1->release(h, NULL, it);
+        }
+    }
+
+    cb_assert(h1->get_multi(h, NULL, ekeys, 150, items, status) == ENGINE_SUCCESS);
+    for (ii = 0; ii < 150; ++ii) {
+        if (ii % 2 == 0) {
+            item_info info;
+            cb_assert(status[ii] == ENGINE_SUCCESS);
+            cb_assert(items[ii] != NULL);
+            info.nvalue = 1;
+            cb_assert(h1->get_item_info(h, NULL, items[ii], &info));
+            cb_assert(info.nkey == ekeys[ii].nkey);
+            cb_assert(memcmp(info.key, keys[ii], info.nkey) == 0);
+            h1->release(h, NULL, items[ii]);
+        } else {
+            cb_assert(status[ii] == ENGINE_KEY_ENOENT);
+            cb_assert(items[ii] == NULL);
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * Store a batch with more items than item_store_multi does at a time,
+ * with an add and a cas which should fail
+ */
+static enum test_result store_multi_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    char keys[100][32];
+    engine_store_t reqs[100];
+    uint64_t cas[100];
+    ENGINE_ERROR_CODE status[100];
+    int ii;
+
+    for (ii = 0; ii < 100; ++ii) {
+        snprintf(keys[ii], sizeof(keys[ii]), "store_multi_key_%d", ii);
+        memset(&reqs[ii], 0, sizeof(reqs[ii]));
+        reqs[ii].key = keys[ii];
+        reqs[ii].nkey = (uint16_t)strlen(keys[ii]);
+        reqs[ii].value = keys[ii];
+        reqs[ii].nvalue = reqs[ii].nkey;
+        reqs[ii].datatype = PROTOCOL_BINARY_RAW_BYTES;
+        reqs[ii].operation = OPERATION_SET;
+    }
+    /* The last two go for keys stored earlier in the batch */
+    reqs[98].key = keys[0];
+    reqs[98].nkey = reqs[0].nkey;
+    reqs[98].operation = OPERATION_ADD;
+    reqs[99].key = keys[1];
+    reqs[99].nkey = reqs[1].nkey;
+    reqs[99].operation = OPERATION_CAS;
+    reqs[99].cas = 1;
+
+    cb_assert(h1->store_multi(h, NULL, reqs, 100, cas, status) == ENGINE_SUCCESS);
+    for (ii = 0; ii < 98; ++ii) {
+        item *it;
+        item_info info;
+        cb_assert(status[ii] == ENGINE_SUCCESS);
+        cb_assert(cas[ii] != 0);
+        cb_assert(h1->get(h, NULL, &it, keys[ii], reqs[ii].nkey, 0) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, it, &info));
+        cb_assert(info.cas == cas[ii]);
+        cb_assert(info.nbytes == reqs[ii].nvalue);
+        cb_assert(memcmp(info.value[0].iov_base, keys[ii], info.nbytes) == 0);
+        h1->release(h, NULL, it);
+    }
+    cb_assert(status[98] == ENGINE_NOT_STORED);
+    cb_assert(status[99] == ENGINE_KEY_EEXISTS);
+    return SUCCESS;
+}
+
 /*
  * Make sure that we can release an item. For the most part all this test does
  * is ensure that thinds dont go splat when we call release. It does nothing to
@@ -371,6 +511,208 @@ static enum test_result mt_incr_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+/* Check that the value of the counter reads as text */
+static void check_counter_text(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                               const char *key, const char *text) {
+    item *it = NULL;
+    item_info info;
+
+    info.nvalue = 1;
+    cb_assert(h1->get(h, NULL, &it, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+    cb_assert(info.value[0].iov_len == strlen(text));
+    cb_assert(memcmp(info.value[0].iov_base, text, strlen(text)) == 0);
+    h1->release(h, NULL, it);
+}
+
+/*
+ * Make sure that native counters read as text as they grow and shrink,
+ * pick up the value of a text stored with set, and leave the value of a
+ * counter someone is reading alone
+ */
+static enum test_result native_counter_test(ENGINE_HANDLE *h,
+                                            ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    item_info info;
+    void *key = "native_counter";
+    uint64_t cas = 0;
+    uint64_t old_cas;
+    uint64_t res = 0;
+
+    cb_assert(h1->arithmetic(h, NULL, key, (int)strlen(key), true, true, 0, 7,
+           0, &cas, PROTOCOL_BINARY_RAW_BYTES, &res, 0) == ENGINE_SUCCESS);
+    cb_assert(res == 7);
+    check_counter_text(h, h1, key, "7");
+
+    old_cas = cas;
+    cb_assert(h1->arithmetic(h, NULL, key, (int)strlen(key), true, false, 993, 0,
+           0, &cas, PROTOCOL_BINARY_RAW_BYTES, &res, 0) == ENGINE_SUCCESS);
+    cb_assert(res == 1000);
+    cb_assert(cas != old_cas);
+    check_counter_text(h, h1, key, "1000");
+
+    cb_assert(h1->arithmetic(h, NULL, key, (int)strlen(key), true, false,
+           UINT64_C(10000000000000000000) - 1000, 0,
+           0, &cas, PROTOCOL_BINARY_RAW_BYTES, &res, 0) == ENGINE_SUCCESS);
+    cb_assert(res == UINT64_C(10000000000000000000));
+    check_counter_text(h, h1, key, "10000000000000000000");
+
+    /* Shrinking leaves padding, like the text counters do */
+    cb_assert(h1->arithmetic(h, NULL, key, (int)strlen(key), false, false,
+           UINT64_C(10000000000000000000) - 42, 0,
+           0, &cas, PROTOCOL_BINARY_RAW_BYTES, &res, 0) == ENGINE_SUCCESS);
+    cb_assert(res == 42);
+    check_counter_text(h, h1, key, "42                  ");
+    cb_assert(h1->arithmetic(h, NULL, key, (int)strlen(key), true, false, 1, 0,
+           0, &cas, PROTOCOL_BINARY_RAW_BYTES, &res, 0) == ENGINE_SUCCESS);
+    cb_assert(res == 43);
+
+    /* Someone reading it keeps the value they've got */
+    cb_assert(h1->get(h, NULL, &it, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    cb_assert(h1->arithmetic(h, NULL, key, (int)strlen(key), true, false, 1, 0,
+           0, &cas, PROTOCOL_BINARY_RAW_BYTES, &res, 0) == ENGINE_SUCCESS);
+    cb_assert(res == 44);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+    cb_assert(memcmp(info.value[0].iov_base, "43 ", 3) == 0);
+    h1->release(h, NULL, it);
+    check_counter_text(h, h1, key, "44");
+
+    /* A value stored as text is picked up by the next incr */
+    cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), 2, 0, 0,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+    memcpy(info.value[0].iov_base, "99", 2);
+    cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+    cb_assert(h1->arithmetic(h, NULL, key, (int)strlen(key), true, false, 1, 0,
+           0, &cas, PROTOCOL_BINARY_RAW_BYTES, &res, 0) == ENGINE_SUCCESS);
+    cb_assert(res == 100);
+    check_counter_text(h, h1, key, "100");
+
+    return SUCCESS;
+}
+
+struct mt_store_ctx {
+    ENGINE_HANDLE *h;
+    int id;
+};
+
+static void mt_store_main(void *arg) {
+    struct mt_store_ctx *ctx = arg;
+    ENGINE_HANDLE *h = ctx->h;
+    ENGINE_HANDLE_V1 *h1 = (ENGINE_HANDLE_V1*)ctx->h;
+    int ii;
+
+    for (ii = 0; ii < 500; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "mt_store_%d_%d", ctx->id, ii);
+        item *it = NULL;
+        uint64_t cas = 0;
+        cb_assert(h1->allocate(h, NULL, &it, key, keylen, 8, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+
+        cb_assert(h1->get(h, NULL, &it, key, (int)keylen, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+
+        if (ii % 4 == 0) {
+            cas = 0;
+            cb_assert(h1->remove(h, NULL, key, keylen, &cas, 0) == ENGINE_SUCCESS);
+            cb_assert(h1->get(h, NULL, &it, key, (int)keylen, 0) == ENGINE_KEY_ENOENT);
+        }
+    }
+}
+
+/*
+ * Make sure that concurrent stores, gets and removes of different keys
+ * don't step on each other
+ */
+static enum test_result mt_store_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    cb_thread_t tid[max_threads];
+    struct mt_store_ctx ctx[max_threads];
+    int ii;
+
+    for (ii = 0; ii < max_threads; ++ii) {
+        ctx[ii].h = h;
+        ctx[ii].id = ii;
+        cb_assert(cb_create_thread(&tid[ii], mt_store_main, &ctx[ii], 0) == 0);
+    }
+
+    for (ii = 0; ii < max_threads; ++ii) {
+        cb_assert(cb_join_thread(tid[ii]) == 0);
+    }
+
+    return SUCCESS;
+}
+
+static void mt_get_main(void *arg) {
+    struct mt_store_ctx *ctx = arg;
+    ENGINE_HANDLE *h = ctx->h;
+    ENGINE_HANDLE_V1 *h1 = (ENGINE_HANDLE_V1*)ctx->h;
+    int ii;
+
+    for (ii = 0; ii < 2000; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "mt_get_%d", ii % 64);
+        item *it = NULL;
+        uint64_t cas = 0;
+        item_info info;
+
+        info.nvalue = 1;
+        if (ctx->id % 2 == 0) {
+            ENGINE_ERROR_CODE ret = h1->get(h, NULL, &it, key, (int)keylen, 0);
+            cb_assert(ret == ENGINE_SUCCESS || ret == ENGINE_KEY_ENOENT);
+            if (ret == ENGINE_SUCCESS) {
+                cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+                cb_assert(info.value[0].iov_len == keylen);
+                cb_assert(memcmp(info.value[0].iov_base, key, keylen) == 0);
+                h1->release(h, NULL, it);
+            }
+        } else if (ii % 8 == 0) {
+            h1->remove(h, NULL, key, keylen, &cas, 0);
+        } else {
+            cb_assert(h1->allocate(h, NULL, &it, key, keylen, keylen, 0, 0,
+                                PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+            cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+            memcpy(info.value[0].iov_base, key, keylen);
+            cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+            h1->release(h, NULL, it);
+
+            /* Keep the table growing under the readers */
+            keylen = snprintf(key, sizeof(key), "mt_get_%d_%d", ctx->id, ii);
+            cb_assert(h1->allocate(h, NULL, &it, key, keylen, 8, 0, 0,
+                                PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+            cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+            h1->release(h, NULL, it);
+        }
+    }
+}
+
+/*
+ * Make sure that readers of the keys others keep storing and removing
+ * get the values that belong to them
+ */
+static enum test_result mt_get_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    cb_thread_t tid[8];
+    struct mt_store_ctx ctx[8];
+    int ii;
+
+    for (ii = 0; ii < 8; ++ii) {
+        ctx[ii].h = h;
+        ctx[ii].id = ii;
+        cb_assert(cb_create_thread(&tid[ii], mt_get_main, &ctx[ii], 0) == 0);
+    }
+
+    for (ii = 0; ii < 8; ++ii) {
+        cb_assert(cb_join_thread(tid[ii]) == 0);
+    }
+
+    return SUCCESS;
+}
+
 /*
  * Make sure we can arithmetic operations to set the initial value of a key and
  * to then later decrement that value
@@ -414,6 +756,40 @@ static enum test_result flush_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+/*
+ * The items stored right before a flush are gone, while the ones stored
+ * right after it (within the same second) are still there
+ */
+static enum test_result flush_generation_test(ENGINE_HANDLE *h,
+                                              ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    uint64_t cas = 0;
+    int ii;
+
+    test_harness.time_travel(3);
+    for (ii = 0; ii < 2; ++ii) {
+        const char *key = ii == 0 ? "flush_before" : "flush_after";
+        cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), 1, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET,
+                            0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+        if (ii == 0) {
+            cb_assert(h1->flush(h, NULL, 0) == ENGINE_SUCCESS);
+        }
+    }
+
+    cb_assert(h1->get(h, NULL, &it, "flush_before", 12, 0) == ENGINE_KEY_ENOENT);
+    cb_assert(h1->get(h, NULL, &it, "flush_after", 11, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    test_harness.time_travel(3);
+    cb_assert(h1->get(h, NULL, &it, "flush_before", 12, 0) == ENGINE_KEY_ENOENT);
+    cb_assert(h1->get(h, NULL, &it, "flush_after", 11, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+    return SUCCESS;
+}
+
 /*
  * Make sure we can successfully retrieve the item info struct for an item and
  * that the contents of the item_info are as expected.
@@ -525,88 +901,956 @@ static enum test_result lru_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
-static enum test_result get_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    return PENDING;
+/*
+ * Verify that the gdsf eviction policy keeps an expensive item nobody asks
+ * for around while it evicts the cheap ones stored after it
+ */
+static enum test_result gdsf_eviction_test(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    const char *precious_key = "precious_key";
+    uint64_t cas = 0;
+    int ii;
+
+    cb_assert(h1->allocate(h, NULL, &test_item,
+                           precious_key, strlen(precious_key), 4096, 0, 0,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    h1->item_set_cost(h, NULL, test_item, 100000);
+    cb_assert(h1->store(h, NULL, test_item,
+                        &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    evictions = 0;
+    for (ii = 0; ii < 250 && evictions < 5; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "gdsf_key_%08d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item,
+                               key, keylen, 4096, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item,
+                            &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+        cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                                eviction_stats_handler) == ENGINE_SUCCESS);
+    }
+    cb_assert(evictions == 5);
+
+    cb_assert(h1->get(h, NULL, &test_item, precious_key,
+                      (int)strlen(precious_key), 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    cb_assert(h1->get(h, NULL, &test_item, "gdsf_key_00000000", 17,
+                      0) == ENGINE_KEY_ENOENT);
+    return SUCCESS;
 }
 
-static enum test_result reset_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    return PENDING;
+static bool tiny_class_seen;
+static void tiny_stats_handler(const char *key, const uint16_t klen,
+                               const char *val, const uint32_t vlen,
+                               const void *cookie) {
+    (void)val; (void)vlen; (void)cookie;
+    if (klen > 5 && memcmp(key + klen - 5, ":tiny", 5) == 0) {
+        tiny_class_seen = true;
+    }
 }
 
-static enum test_result get_stats_struct_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    return PENDING;
+/*
+ * Verify that the small items go to a tiny slab class, and that its CLOCK
+ * evicts the ones nobody asked for since it last came by (and not the
+ * one we keep asking for)
+ */
+static enum test_result tiny_items_test(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    const char *hot_key = "hot_key";
+    uint64_t cas = 0;
+    item_info info;
+    int ii;
+
+    cb_assert(h1->allocate(h, NULL, &test_item, hot_key, strlen(hot_key), 8,
+                           0, 0, PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, test_item, &info) == true);
+    memcpy(info.value[0].iov_base, "hotvalue", 8);
+    cb_assert(h1->store(h, NULL, test_item,
+                        &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    tiny_class_seen = false;
+    cb_assert(h1->get_stats(h, NULL, "slabs", 5,
+                            tiny_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(tiny_class_seen);
+
+    evictions = 0;
+    for (ii = 0; ii < 50000 && evictions < 100; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "tiny_%08d", ii);
+        cb_assert(h1->get(h, NULL, &test_item, hot_key,
+                          (int)strlen(hot_key), 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 8, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item,
+                            &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+        if (ii % 100 == 0) {
+            cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                                    eviction_stats_handler) == ENGINE_SUCCESS);
+        }
+    }
+    cb_assert(evictions >= 100);
+
+    /* The hand went past the hot key first, and took the one after it */
+    cb_assert(h1->get(h, NULL, &test_item, "tiny_00000000", 13,
+                      0) == ENGINE_KEY_ENOENT);
+    cb_assert(h1->get(h, NULL, &test_item, hot_key, (int)strlen(hot_key),
+                      0) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, test_item, &info) == true);
+    cb_assert(info.value[0].iov_len == 8);
+    cb_assert(memcmp(info.value[0].iov_base, "hotvalue", 8) == 0);
+    cas = info.cas;
+    h1->release(h, NULL, test_item);
+
+    /* The cas lives right behind the shorter header */
+    cb_assert(h1->allocate(h, NULL, &test_item, hot_key, strlen(hot_key), 8,
+                           0, 0, PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    h1->item_set_cas(h, NULL, test_item, cas + 1);
+    cb_assert(h1->store(h, NULL, test_item,
+                        &cas, OPERATION_CAS, 0) == ENGINE_KEY_EEXISTS);
+    h1->item_set_cas(h, NULL, test_item, cas);
+    cb_assert(h1->store(h, NULL, test_item,
+                        &cas, OPERATION_CAS, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    return SUCCESS;
 }
 
-static enum test_result aggregate_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    return PENDING;
+static double slab_sizes_waste;
+static double slab_sizes_derived_waste;
+static char slab_sizes_derived[2048];
+static char slab_class1_chunk[32];
+static void slab_sizes_stats_handler(const char *key, const uint16_t klen,
+                                     const char *val, const uint32_t vlen,
+                                     const void *cookie) {
+    char buffer[2048];
+    (void)cookie;
+    cb_assert(vlen < sizeof(buffer));
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 20 && memcmp(key, "slab_sizes_waste_pct", klen) == 0) {
+        slab_sizes_waste = atof(buffer);
+    } else if (klen == 28 &&
+               memcmp(key, "slab_sizes_derived_waste_pct", klen) == 0) {
+        slab_sizes_derived_waste = atof(buffer);
+    } else if (klen == 10 && memcmp(key, "slab_sizes", klen) == 0) {
+        strcpy(slab_sizes_derived, buffer);
+    } else if (klen == 12 && memcmp(key, "1:chunk_size", klen) == 0) {
+        strcpy(slab_class1_chunk, buffer);
+    }
 }
 
-static protocol_binary_response_header *last_response;
+/*
+ * Verify that the classes derived from the sizes we store fit them better
+ * than the geometric series does, and that we may start with those
+ */
+static enum test_result slab_sizes_test(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    char config[2200];
+    int ii;
 
-static void release_last_response(void) {
-    free(last_response);
-    last_response = NULL;
-}
+    for (ii = 0; ii < 1000; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "slab_sizes_%08d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 300, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item,
+                            &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
 
-static bool response_handler(const void *key, uint16_t keylen,
-                             const void *ext, uint8_t extlen,
-                             const void *body, uint32_t bodylen,
-                             uint8_t datatype, uint16_t status,
-                             uint64_t cas, const void *cookie)
-{
-    protocol_binary_response_header *r;
-    char *ptr;
+    slab_sizes_derived[0] = '\0';
+    cb_assert(h1->get_stats(h, NULL, "slab_sizes", 10,
+                            slab_sizes_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(slab_sizes_derived[0] != '\0');
+    cb_assert(slab_sizes_derived_waste < 1.0);
+    cb_assert(slab_sizes_derived_waste < slab_sizes_waste);
+
+    /* Start over with the classes it came up with */
+    snprintf(config, sizeof(config), "slab_sizes=%s", slab_sizes_derived);
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path, config,
+                               true, false);
+    cb_assert(h1->allocate(h, NULL, &test_item, "slab_sizes_key", 14, 1, 0, 0,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, test_item,
+                        &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    slab_class1_chunk[0] = '\0';
+    cb_assert(h1->get_stats(h, NULL, "slabs", 5,
+                            slab_sizes_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(strncmp(slab_sizes_derived, slab_class1_chunk,
+                      strlen(slab_class1_chunk)) == 0);
+    cb_assert(slab_sizes_derived[strlen(slab_class1_chunk)] == '-');
+    return SUCCESS;
+}
 
-    cb_assert(last_response == NULL);
-    last_response = malloc(sizeof(*last_response) + keylen + extlen + bodylen);
-    if (last_response == NULL) {
-        return false;
+static char key_prefix_top[64];
+static uint64_t key_prefix_saveable;
+static void key_prefix_stats_handler(const char *key, const uint16_t klen,
+                                     const char *val, const uint32_t vlen,
+                                     const void *cookie) {
+    (void)cookie;
+    if (klen == 17 && memcmp(key, "key_prefix:0:name", klen) == 0) {
+        cb_assert(vlen < sizeof(key_prefix_top));
+        memcpy(key_prefix_top, val, vlen);
+        key_prefix_top[vlen] = '\0';
+    } else if (klen == 27 &&
+               memcmp(key, "key_prefixes_saveable_bytes", klen) == 0) {
+        char buffer[32];
+        cb_assert(vlen < sizeof(buffer));
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        key_prefix_saveable = strtoull(buffer, NULL, 10);
     }
+}
 
-    r = last_response;
-    r->response.magic = PROTOCOL_BINARY_RES;
-    r->response.opcode = 0xff; /* we don't know this! */
-    r->response.keylen = htons(keylen);
-    r->response.extlen = extlen;
-    r->response.datatype = PROTOCOL_BINARY_RAW_BYTES;
-    r->response.status = htons(status);
-    r->response.bodylen = htonl(keylen + extlen + bodylen);
-    r->response.opaque = 0xffffff; /* we don't know this */
-    r->response.cas = cas;
-    ptr = (void*)(r + 1);
-    memcpy(ptr, ext, extlen);
-    ptr += extlen;
-    memcpy(ptr, key, keylen);
-    ptr += keylen;
-    memcpy(ptr, body, bodylen);
+/*
+ * Verify that the prefix most of the keys share is the one we hear about
+ * (the keys without a delimiter have no prefix)
+ */
+static enum test_result key_prefix_test(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    int ii;
 
-    return true;
+    for (ii = 0; ii < 300; ++ii) {
+        char key[64];
+        size_t keylen;
+        if (ii % 4 == 0) {
+            keylen = snprintf(key, sizeof(key), "plain_%d", ii);
+        } else {
+            keylen = snprintf(key, sizeof(key), "tenant:12345:object:%d", ii);
+        }
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 10, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item,
+                            &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    key_prefix_top[0] = '\0';
+    key_prefix_saveable = 0;
+    cb_assert(h1->get_stats(h, NULL, "key_prefixes", 12,
+                            key_prefix_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(strcmp(key_prefix_top, "tenant:12345:object:") == 0);
+    cb_assert(key_prefix_saveable > 0);
+    return SUCCESS;
 }
 
-static enum test_result touch_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    ENGINE_ERROR_CODE ret;
-    union request {
-        protocol_binary_request_touch touch;
-        char buffer[512];
-    };
-    void *key = "get_test_key";
-    size_t keylen = strlen(key);
-    union request r;
-    item *item = NULL;
+static void null_stats_handler(const char *key, const uint16_t klen,
+                               const char *val, const uint32_t vlen,
+                               const void *cookie) {
+    (void)key; (void)klen; (void)val; (void)vlen; (void)cookie;
+}
 
-    memset(r.buffer, 0, sizeof(r));
-    r.touch.message.header.request.magic = PROTOCOL_BINARY_REQ;
-    r.touch.message.header.request.opcode = PROTOCOL_BINARY_CMD_TOUCH;
-    r.touch.message.header.request.keylen = htons((uint16_t)keylen);
-    r.touch.message.header.request.extlen = 4;
-    r.touch.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
-    r.touch.message.header.request.vbucket = 0;
-    r.touch.message.header.request.bodylen = htonl((uint32_t)keylen + 4);
-    r.touch.message.header.request.opaque = 0xdeadbeef;
-    r.touch.message.header.request.cas = 0;
-    r.touch.message.body.expiration = htonl(10);
+static void mt_lru_main(void *arg) {
+    struct mt_store_ctx *ctx = arg;
+    ENGINE_HANDLE *h = ctx->h;
+    ENGINE_HANDLE_V1 *h1 = (ENGINE_HANDLE_V1*)ctx->h;
+    /* Put each thread in a different slab class */
+    const size_t nbytes = 4096 << (ctx->id % 4);
+    int ii;
 
-    memcpy(r.buffer + sizeof(r.touch.bytes), key, keylen);
+    for (ii = 0; ii < 1000; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "mt_lru_%d_%d", ctx->id, ii);
+        item *it = NULL;
+        uint64_t cas = 0;
+        cb_assert(h1->allocate(h, NULL, &it, key, keylen, nbytes, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+        if (ii % 100 == 0) {
+            cb_assert(h1->get_stats(h, NULL, "items", 5,
+                                    null_stats_handler) == ENGINE_SUCCESS);
+        }
+    }
+}
+
+/*
+ * Make sure that we can evict from several slab classes at the same time
+ * while someone is looking at the item stats
+ */
+static enum test_result mt_lru_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    cb_thread_t tid[4];
+    struct mt_store_ctx ctx[4];
+    int ii;
+
+    for (ii = 0; ii < 4; ++ii) {
+        ctx[ii].h = h;
+        ctx[ii].id = ii;
+        cb_assert(cb_create_thread(&tid[ii], mt_lru_main, &ctx[ii], 0) == 0);
+    }
+
+    for (ii = 0; ii < 4; ++ii) {
+        cb_assert(cb_join_thread(tid[ii]) == 0);
+    }
+
+    evictions = 0;
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                         eviction_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(evictions > 0);
+    return SUCCESS;
+}
+
+static uint32_t lru_number_cold;
+static uint32_t lru_number;
+static void lru_segment_stats_handler(const char *key, const uint16_t klen,
+                                      const char *val, const uint32_t vlen,
+                                      const void *cookie) {
+    char buffer[1024];
+    const char *cold = ":number_cold";
+    const char *number = ":number";
+
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen > strlen(cold) &&
+        memcmp(key + klen - strlen(cold), cold, strlen(cold)) == 0) {
+        lru_number_cold += atoi(buffer);
+    } else if (klen > strlen(number) &&
+               memcmp(key + klen - strlen(number), number, strlen(number)) == 0) {
+        lru_number += atoi(buffer);
+    }
+}
+
+/*
+ * Make sure that the LRU maintainer moves the items we don't touch out of
+ * the hot segment, and that we can still find all of them
+ */
+static enum test_result lru_segment_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    int ii;
+
+    for (ii = 0; ii < 100; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "lru_segment_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 10, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    for (ii = 0; ii < 500; ++ii) {
+        lru_number_cold = lru_number = 0;
+        cb_assert(h1->get_stats(h, NULL, "items", 5,
+                             lru_segment_stats_handler) == ENGINE_SUCCESS);
+        if (lru_number_cold > 0) {
+            break;
+        }
+        usleep(10000);
+    }
+    cb_assert(lru_number_cold > 0);
+    cb_assert(lru_number == 100);
+
+    for (ii = 0; ii < 100; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "lru_segment_%d", ii);
+        cb_assert(h1->get(h, NULL, &test_item, key,
+                       (int)keylen, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    return SUCCESS;
+}
+
+static uint32_t lru_number_temp;
+static uint32_t lru_evicted_temp;
+static void temp_lru_stats_handler(const char *key, const uint16_t klen,
+                                   const char *val, const uint32_t vlen,
+                                   const void *cookie) {
+    char buffer[1024];
+    const char *number = ":number_temp";
+    const char *evicted = ":evicted_temp";
+
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen > strlen(number) &&
+        memcmp(key + klen - strlen(number), number, strlen(number)) == 0) {
+        lru_number_temp += atoi(buffer);
+    } else if (klen > strlen(evicted) &&
+               memcmp(key + klen - strlen(evicted), evicted,
+                      strlen(evicted)) == 0) {
+        lru_evicted_temp += atoi(buffer);
+    }
+}
+
+/*
+ * Make sure that the items which expire soon go to the temp segment, and
+ * that we get rid of them instead of an old item nobody touches
+ */
+static enum test_result temp_lru_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    const char *long_key = "long_key";
+    uint64_t cas = 0;
+    int ii;
+
+    cb_assert(h1->allocate(h, NULL, &test_item,
+                           long_key, strlen(long_key), 4096, 0, 0,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, test_item,
+                        &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    for (ii = 0; ii < 250; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "temp_lru_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 4096, 0, 10,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item,
+                            &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+        if (ii == 0) {
+            lru_number_temp = lru_evicted_temp = 0;
+            cb_assert(h1->get_stats(h, NULL, "items", 5,
+                                    temp_lru_stats_handler) == ENGINE_SUCCESS);
+            cb_assert(lru_number_temp == 1);
+        }
+        evictions = 0;
+        cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                                eviction_stats_handler) == ENGINE_SUCCESS);
+        if (evictions >= 10) {
+            break;
+        }
+    }
+    cb_assert(ii < 250);
+
+    lru_number_temp = lru_evicted_temp = 0;
+    cb_assert(h1->get_stats(h, NULL, "items", 5,
+                            temp_lru_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(lru_evicted_temp == evictions);
+    cb_assert(lru_number_temp > 0);
+    cb_assert(h1->get(h, NULL, &test_item, long_key,
+                      (int)strlen(long_key), 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    return SUCCESS;
+}
+
+static uint32_t evicted_ahead;
+static uint32_t maintainer_evicted_ahead;
+static void evicted_ahead_stats_handler(const char *key, const uint16_t klen,
+                                        const char *val, const uint32_t vlen,
+                                        const void *cookie) {
+    char buffer[1024];
+    const char *ahead = ":evicted_ahead";
+
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen > strlen(ahead) &&
+        memcmp(key + klen - strlen(ahead), ahead, strlen(ahead)) == 0) {
+        evicted_ahead += atoi(buffer);
+    } else if (klen == 28 &&
+               memcmp(key, "lru_maintainer_evicted_ahead", klen) == 0) {
+        maintainer_evicted_ahead = atoi(buffer);
+    }
+}
+
+/*
+ * Make sure that the LRU maintainer evicts from a full slab class to keep
+ * free chunks in it, and that it doesn't touch the items in the others
+ */
+static enum test_result free_chunk_reserve_test(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    const char *small_key = "small_key";
+    uint64_t cas = 0;
+    int ii;
+
+    cb_assert(h1->allocate(h, NULL, &test_item,
+                           small_key, strlen(small_key), 10, 0, 0,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, test_item,
+                        &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    for (ii = 0; ii < 250; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "reserve_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 4096, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item,
+                            &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+        evictions = 0;
+        cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                                eviction_stats_handler) == ENGINE_SUCCESS);
+        if (evictions > 0) {
+            break;
+        }
+    }
+    cb_assert(ii < 250);
+
+    for (ii = 0; ii < 500; ++ii) {
+        evicted_ahead = 0;
+        cb_assert(h1->get_stats(h, NULL, "items", 5,
+                                evicted_ahead_stats_handler) == ENGINE_SUCCESS);
+        if (evicted_ahead > 0) {
+            break;
+        }
+        usleep(10000);
+    }
+    cb_assert(evicted_ahead > 0);
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                            evicted_ahead_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(maintainer_evicted_ahead >= evicted_ahead);
+    cb_assert(h1->get(h, NULL, &test_item, small_key,
+                      (int)strlen(small_key), 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    return SUCCESS;
+}
+
+static uint32_t crawler_reclaimed;
+static int crawler_starts;
+static int crawler_running;
+static void crawler_stats_handler(const char *key, const uint16_t klen,
+                                  const char *val, const uint32_t vlen,
+                                  const void *cookie) {
+    char buffer[1024];
+    const char *reclaimed = ":crawler_reclaimed";
+
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen > strlen(reclaimed) &&
+        memcmp(key + klen - strlen(reclaimed), reclaimed, strlen(reclaimed)) == 0) {
+        crawler_reclaimed += atoi(buffer);
+    } else if (klen == 18 && memcmp(key, "lru_crawler_starts", klen) == 0) {
+        crawler_starts = atoi(buffer);
+    } else if (klen == 19 && memcmp(key, "lru_crawler_running", klen) == 0) {
+        crawler_running = atoi(buffer);
+    }
+}
+
+/*
+ * Make sure that the LRU crawler reclaims expired items without anyone
+ * asking for them, and leaves the rest alone
+ */
+static enum test_result lru_crawler_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    int starts;
+    int ii;
+
+    for (ii = 0; ii < 20; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "lru_crawler_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 10, 0,
+                            (ii % 2) ? 0 : 5,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    test_harness.time_travel(6);
+
+    /*
+     * Wait for the crawler to finish a run started after the items expired
+     * (we can't poll the item stats, as they reclaim expired items too)
+     */
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                         crawler_stats_handler) == ENGINE_SUCCESS);
+    starts = crawler_starts;
+    for (ii = 0; ii < 500; ++ii) {
+        cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                             crawler_stats_handler) == ENGINE_SUCCESS);
+        if (crawler_starts > starts + 1 && !crawler_running) {
+            break;
+        }
+        usleep(10000);
+    }
+
+    crawler_reclaimed = 0;
+    cb_assert(h1->get_stats(h, NULL, "items", 5,
+                         crawler_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(crawler_reclaimed == 10);
+
+    for (ii = 0; ii < 20; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "lru_crawler_%d", ii);
+        cb_assert(h1->get(h, NULL, &test_item, key, (int)keylen, 0) ==
+               ((ii % 2) ? ENGINE_SUCCESS : ENGINE_KEY_ENOENT));
+        if (ii % 2) {
+            h1->release(h, NULL, test_item);
+        }
+    }
+
+    return SUCCESS;
+}
+
+static int hash_power_level;
+static bool hash_is_resizing;
+static void assoc_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    char buffer[1024];
+
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 16 && memcmp(key, "hash_power_level", klen) == 0) {
+        hash_power_level = atoi(buffer);
+    } else if (klen == 17 && (memcmp(key, "hash_is_expanding", klen) == 0 ||
+                              memcmp(key, "hash_is_shrinking", klen) == 0)) {
+        hash_is_resizing |= atoi(buffer) != 0;
+    }
+}
+
+/*
+ * Wait for the hash table to grow beyond level (or to shrink back to it),
+ * and return its size
+ */
+static int wait_for_hash_resize(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                int level, bool grow) {
+    int ii;
+    for (ii = 0; ii < 500; ++ii) {
+        hash_is_resizing = false;
+        cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                             assoc_stats_handler) == ENGINE_SUCCESS);
+        if (!hash_is_resizing &&
+            (grow ? hash_power_level > level : hash_power_level == level)) {
+            break;
+        }
+        usleep(10000);
+    }
+    return hash_power_level;
+}
+
+/*
+ * Make sure that the hash table grows as we add items and shrinks back
+ * when we remove them, and that we can find all of the items in between
+ */
+/* What the sizes and ages stats said */
+static uint32_t histogram_sizes;
+static uint32_t histogram_items;
+static uint32_t histogram_ages;
+static uint32_t histogram_ttls;
+static uint32_t histogram_ttl_64;
+static uint32_t histogram_no_ttl;
+static uint64_t histogram_runs;
+
+static void histogram_stats_handler(const char *key, const uint16_t klen,
+                                    const char *val, const uint32_t vlen,
+                                    const void *cookie) {
+    char buffer[64];
+    char value[64];
+    const char *what;
+    uint32_t count;
+
+    cb_assert(klen < sizeof(buffer) && vlen < sizeof(value));
+    memcpy(buffer, key, klen);
+    buffer[klen] = '\0';
+    memcpy(value, val, vlen);
+    value[vlen] = '\0';
+    count = (uint32_t)strtoul(value, NULL, 10);
+
+    if (strcmp(buffer, "ages:runs") == 0) {
+        histogram_runs = strtoull(value, NULL, 10);
+    } else if (strncmp(buffer, "ages:", 5) == 0) {
+        what = strrchr(buffer, ':') + 1;
+        if (strncmp(what, "age_", 4) == 0) {
+            histogram_ages += count;
+        } else if (strcmp(what, "no_ttl") == 0) {
+            histogram_no_ttl += count;
+        } else {
+            cb_assert(strncmp(what, "ttl_", 4) == 0);
+            histogram_ttls += count;
+            if (strcmp(what, "ttl_64") == 0) {
+                histogram_ttl_64 += count;
+            }
+        }
+    } else {
+        /* stats sizes: the size of the bucket and the number in it */
+        histogram_sizes++;
+        histogram_items += count;
+    }
+}
+
+/*
+ * Verify that stats sizes follows the items as they come and go, and that
+ * the LRU crawler fills in the age and ttl histograms of stats ages
+ */
+static enum test_result item_histogram_test(ENGINE_HANDLE *h,
+                                            ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    uint64_t runs;
+    int ii;
+
+    for (ii = 0; ii < 20; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "histogram_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen,
+                               (ii % 2) ? 10 : 2000, 0, (ii % 2) ? 0 : 100,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item,
+                            &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+    cas = 0;
+    cb_assert(h1->remove(h, NULL, "histogram_0", 11, &cas, 0) ==
+              ENGINE_SUCCESS);
+
+    histogram_sizes = histogram_items = 0;
+    cb_assert(h1->get_stats(h, NULL, "sizes", 5,
+                            histogram_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(histogram_sizes >= 2);
+    cb_assert(histogram_items == 19);
+
+    /* Wait for a complete crawler run after the items got older */
+    test_harness.time_travel(3);
+    cb_assert(h1->get_stats(h, NULL, "ages", 4,
+                            histogram_stats_handler) == ENGINE_SUCCESS);
+    runs = histogram_runs;
+    for (ii = 0; ii < 500 && histogram_runs < runs + 2; ++ii) {
+        usleep(10000);
+        histogram_ages = histogram_ttls = histogram_ttl_64 = 0;
+        histogram_no_ttl = 0;
+        cb_assert(h1->get_stats(h, NULL, "ages", 4,
+                                histogram_stats_handler) == ENGINE_SUCCESS);
+    }
+    cb_assert(histogram_runs >= runs + 2);
+    cb_assert(histogram_ages == 19);
+    cb_assert(histogram_no_ttl == 10);
+    cb_assert(histogram_ttls == 9);
+    cb_assert(histogram_ttl_64 == 9);
+    return SUCCESS;
+}
+
+static enum test_result assoc_resize_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    int initial;
+    int ii;
+
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                         assoc_stats_handler) == ENGINE_SUCCESS);
+    initial = hash_power_level;
+
+    for (ii = 0; ii < 300; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "assoc_resize_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 10, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    cb_assert(wait_for_hash_resize(h, h1, initial, true) > initial);
+
+    for (ii = 0; ii < 300; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "assoc_resize_%d", ii);
+        cb_assert(h1->get(h, NULL, &test_item, key,
+                       (int)keylen, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+        cas = 0;
+        cb_assert(h1->remove(h, NULL, key, keylen, &cas, 0) == ENGINE_SUCCESS);
+    }
+
+    cb_assert(wait_for_hash_resize(h, h1, initial, false) == initial);
+    return SUCCESS;
+}
+
+static enum test_result get_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    return PENDING;
+}
+
+static enum test_result reset_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    return PENDING;
+}
+
+static enum test_result get_stats_struct_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    return PENDING;
+}
+
+static enum test_result aggregate_stats_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    return PENDING;
+}
+
+static protocol_binary_response_header *last_response;
+
+static void release_last_response(void) {
+    free(last_response);
+    last_response = NULL;
+}
+
+static bool response_handler(const void *key, uint16_t keylen,
+                             const void *ext, uint8_t extlen,
+                             const void *body, uint32_t bodylen,
+                             uint8_t datatype, uint16_t status,
+                             uint64_t cas, const void *cookie)
+{
+    protocol_binary_response_header *r;
+    char *ptr;
+
+    cb_assert(last_response == NULL);
+    last_response = malloc(sizeof(*last_response) + keylen + extlen + bodylen);
+    if (last_response == NULL) {
+        return false;
+    }
+
+    r = last_response;
+    r->response.magic = PROTOCOL_BINARY_RES;
+    r->response.opcode = 0xff; /* we don't know this! */
+    r->response.keylen = htons(keylen);
+    r->response.extlen = extlen;
+    r->response.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    r->response.status = htons(status);
+    r->response.bodylen = htonl(keylen + extlen + bodylen);
+    r->response.opaque = 0xffffff; /* we don't know this */
+    r->response.cas = cas;
+    ptr = (void*)(r + 1);
+    memcpy(ptr, ext, extlen);
+    ptr += extlen;
+    memcpy(ptr, key, keylen);
+    ptr += keylen;
+    memcpy(ptr, body, bodylen);
+
+    return true;
+}
+
+static uint64_t wheel_items;
+static uint64_t wheel_reclaimed;
+static uint64_t wheel_curr_items;
+static void expiry_wheel_stats_handler(const char *key, const uint16_t klen,
+                                       const char *val, const uint32_t vlen,
+                                       const void *cookie) {
+    char buffer[1024];
+
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 18 && memcmp(key, "expiry_wheel_items", klen) == 0) {
+        wheel_items = strtoull(buffer, NULL, 10);
+    } else if (klen == 22 && memcmp(key, "expiry_wheel_reclaimed", klen) == 0) {
+        wheel_reclaimed = strtoull(buffer, NULL, 10);
+    } else if (klen == 10 && memcmp(key, "curr_items", klen) == 0) {
+        wheel_curr_items = strtoull(buffer, NULL, 10);
+    }
+}
+
+/* Wait for the expiry wheel to have reclaimed count items */
+static void wait_for_expiry_wheel(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                  uint64_t count) {
+    int ii;
+    for (ii = 0; ii < 500; ++ii) {
+        cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                             expiry_wheel_stats_handler) == ENGINE_SUCCESS);
+        if (wheel_reclaimed >= count) {
+            break;
+        }
+        usleep(10000);
+    }
+}
+
+/*
+ * Make sure that the expiry wheel unlinks the items as they expire
+ * without anyone looking at them, also after a touch moved them
+ */
+static enum test_result expiry_wheel_test(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    union request {
+        protocol_binary_request_touch touch;
+        char buffer[512];
+    };
+    union request r;
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    char key[64];
+    size_t keylen;
+    int ii;
+
+    for (ii = 0; ii < 25; ++ii) {
+        keylen = snprintf(key, sizeof(key), "expiry_wheel_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 10, 0,
+                            ii < 10 ? 2 : ii < 20 ? 0 : 100,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                         expiry_wheel_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(wheel_items == 15);
+    cb_assert(wheel_reclaimed == 0);
+
+    test_harness.time_travel(5);
+    wait_for_expiry_wheel(h, h1, 10);
+    cb_assert(wheel_reclaimed == 10);
+    cb_assert(wheel_items == 5);
+    cb_assert(wheel_curr_items == 15);
+
+    /* Bring one of the long lived items forward */
+    keylen = snprintf(key, sizeof(key), "expiry_wheel_%d", 24);
+    memset(r.buffer, 0, sizeof(r));
+    r.touch.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.touch.message.header.request.opcode = PROTOCOL_BINARY_CMD_TOUCH;
+    r.touch.message.header.request.keylen = htons((uint16_t)keylen);
+    r.touch.message.header.request.extlen = 4;
+    r.touch.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    r.touch.message.header.request.bodylen = htonl((uint32_t)keylen + 4);
+    r.touch.message.body.expiration = htonl(2);
+    memcpy(r.buffer + sizeof(r.touch.bytes), key, keylen);
+    cb_assert(h1->unknown_command(h, NULL, &r.touch.message.header,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    cb_assert(ntohs(last_response->response.status) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    release_last_response();
+
+    test_harness.time_travel(5);
+    wait_for_expiry_wheel(h, h1, 11);
+    cb_assert(wheel_reclaimed == 11);
+    cb_assert(wheel_items == 4);
+    cb_assert(wheel_curr_items == 14);
+
+    for (ii = 0; ii < 25; ++ii) {
+        keylen = snprintf(key, sizeof(key), "expiry_wheel_%d", ii);
+        cb_assert(h1->get(h, NULL, &test_item, key, (int)keylen, 0) ==
+               ((ii < 10 || ii == 24) ? ENGINE_KEY_ENOENT : ENGINE_SUCCESS));
+        if (ii >= 10 && ii != 24) {
+            h1->release(h, NULL, test_item);
+        }
+    }
+
+    return SUCCESS;
+}
+
+static enum test_result touch_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    ENGINE_ERROR_CODE ret;
+    union request {
+        protocol_binary_request_touch touch;
+        char buffer[512];
+    };
+    void *key = "get_test_key";
+    size_t keylen = strlen(key);
+    union request r;
+    item *item = NULL;
+
+    memset(r.buffer, 0, sizeof(r));
+    r.touch.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.touch.message.header.request.opcode = PROTOCOL_BINARY_CMD_TOUCH;
+    r.touch.message.header.request.keylen = htons((uint16_t)keylen);
+    r.touch.message.header.request.extlen = 4;
+    r.touch.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    r.touch.message.header.request.vbucket = 0;
+    r.touch.message.header.request.bodylen = htonl((uint32_t)keylen + 4);
+    r.touch.message.header.request.opaque = 0xdeadbeef;
+    r.touch.message.header.request.cas = 0;
+    r.touch.message.body.expiration = htonl(10);
+
+    memcpy(r.buffer + sizeof(r.touch.bytes), key, keylen);
     ret = h1->unknown_command(h, NULL, &r.touch.message.header, response_handler);
     cb_assert(ret == ENGINE_SUCCESS);
     cb_assert(last_response != NULL);
@@ -616,189 +1860,1811 @@ static enum test_result touch_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     cb_assert(last_response->response.bodylen == 0);
     release_last_response();
 
-    /* store and get a key */
-    cb_assert(get_test(h, h1) == SUCCESS);
+    /* store and get a key */
+    cb_assert(get_test(h, h1) == SUCCESS);
+
+    /* Set expiry time to 10 secs.. */
+    ret = h1->unknown_command(h, NULL, &r.touch.message.header, response_handler);
+    cb_assert(ret == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(last_response->response.keylen == 0);
+    cb_assert(last_response->response.extlen == 0);
+    cb_assert(last_response->response.bodylen == 0);
+    release_last_response();
+
+    /* time-travel 11 secs.. */
+    test_harness.time_travel(11);
+
+    /* The item should have expired now... */
+    cb_assert(h1->get(h, NULL, &item, key, (int)keylen, 0) == ENGINE_KEY_ENOENT);
+
+    /* Verify that it doesn't accept bogus packets. extlen is mandatory */
+    r.touch.message.header.request.extlen = 0;
+    r.touch.message.header.request.bodylen = htonl((uint32_t)keylen);
+    ret = h1->unknown_command(h, NULL, &r.touch.message.header, response_handler);
+    cb_assert(ret == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    release_last_response();
+
+    /* key is mandatory! */
+    r.touch.message.header.request.extlen = 4;
+    r.touch.message.header.request.keylen = 0;
+    r.touch.message.header.request.bodylen = htonl(4);
+    ret = h1->unknown_command(h, NULL, &r.touch.message.header, response_handler);
+    cb_assert(ret == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    release_last_response();
+
+    return SUCCESS;
+}
+
+/*
+ * Verify that the touch method changes the expiry time, and hands back
+ * the item (with the value) when asked for it
+ */
+static enum test_result touch_api_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    void *key = "get_test_key";
+    uint16_t keylen = (uint16_t)strlen(key);
+    item *item = NULL;
+    item_info info;
+
+    cb_assert(h1->touch != NULL);
+    cb_assert(h1->touch(h, NULL, &item, key, keylen, 10, 0) ==
+              ENGINE_KEY_ENOENT);
+    cb_assert(h1->touch(h, NULL, NULL, key, keylen, 10, 0) ==
+              ENGINE_KEY_ENOENT);
+
+    /* store and get a key */
+    cb_assert(get_test(h, h1) == SUCCESS);
+
+    cb_assert(h1->touch(h, NULL, &item, key, keylen, 10, 1) ==
+              ENGINE_NOT_MY_VBUCKET);
+    cb_assert(h1->touch(h, NULL, &item, key, keylen, 10, 0) ==
+              ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, item, &info));
+    cb_assert(info.nkey == keylen && memcmp(info.key, key, keylen) == 0);
+    cb_assert(info.nbytes == 1);
+    cb_assert(info.exptime != 0);
+    h1->release(h, NULL, item);
+
+    /* Without an item it only changes the expiry time */
+    cb_assert(h1->touch(h, NULL, NULL, key, keylen, 20, 0) ==
+              ENGINE_SUCCESS);
+
+    test_harness.time_travel(11);
+    cb_assert(h1->get(h, NULL, &item, key, (int)keylen, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, item);
+
+    test_harness.time_travel(10);
+    cb_assert(h1->get(h, NULL, &item, key, (int)keylen, 0) ==
+              ENGINE_KEY_ENOENT);
+
+    return SUCCESS;
+}
+
+static enum test_result gat_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    union request {
+        protocol_binary_request_gat gat;
+        char buffer[512];
+    };
+
+    void *key = "get_test_key";
+    size_t keylen = strlen(key);
+    ENGINE_ERROR_CODE ret;
+    item *item = NULL;
+    union request r;
+    memset(r.buffer, 0, sizeof(r));
+    r.gat.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.gat.message.header.request.opcode = PROTOCOL_BINARY_CMD_GAT;
+    r.gat.message.header.request.keylen = htons((uint16_t)keylen);
+    r.gat.message.header.request.extlen = 4;
+    r.gat.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    r.gat.message.header.request.vbucket = 0;
+    r.gat.message.header.request.bodylen = htonl((uint32_t)keylen + 4);
+    r.gat.message.header.request.opaque = 0xdeadbeef;
+    r.gat.message.header.request.cas = 0;
+    r.gat.message.body.expiration = htonl(10);
+
+    memcpy(r.buffer + sizeof(r.gat.bytes), key, keylen);
+    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
+    cb_assert(ret == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+    cb_assert(last_response->response.keylen == 0);
+    cb_assert(last_response->response.extlen == 0);
+    cb_assert(last_response->response.bodylen == 0);
+    release_last_response();
+
+    /* store and get a key */
+    cb_assert(get_test(h, h1) == SUCCESS);
+
+    /* Set expiry time to 10 secs.. */
+    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
+    cb_assert(ret == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(last_response->response.keylen == 0);
+    cb_assert(last_response->response.extlen == 4);
+    cb_assert(ntohl(last_response->response.bodylen) == 5); /* get_test sets 1 byte datalen */
+    release_last_response();
+
+    /* time-travel 11 secs.. */
+    test_harness.time_travel(11);
+
+    /* The item should have expired now... */
+    cb_assert(h1->get(h, NULL, &item, key, (int)keylen, 0) == ENGINE_KEY_ENOENT);
+
+    /* Verify that it doesn't accept bogus packets. extlen is mandatory */
+    r.gat.message.header.request.extlen = 0;
+    r.gat.message.header.request.bodylen = htonl((uint32_t)keylen);
+    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
+    cb_assert(ret == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    release_last_response();
+
+    /* key is mandatory! */
+    r.gat.message.header.request.extlen = 4;
+    r.gat.message.header.request.keylen = 0;
+    r.gat.message.header.request.bodylen = htonl(4);
+    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
+    cb_assert(ret == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    release_last_response();
+
+    return SUCCESS;
+}
+
+static enum test_result gatq_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    union request {
+        protocol_binary_request_gat gat;
+        char buffer[512];
+    };
+
+    ENGINE_ERROR_CODE ret;
+    item *item = NULL;
+    void *key = "get_test_key";
+    size_t keylen = strlen(key);
+    union request r;
+    memset(r.buffer, 0, sizeof(r));
+    r.gat.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.gat.message.header.request.opcode = PROTOCOL_BINARY_CMD_GATQ;
+    r.gat.message.header.request.keylen = htons((uint16_t)keylen);
+    r.gat.message.header.request.extlen = 4;
+    r.gat.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    r.gat.message.header.request.vbucket = 0;
+    r.gat.message.header.request.bodylen = htonl((uint32_t)keylen + 4);
+    r.gat.message.header.request.opaque = 0xdeadbeef;
+    r.gat.message.header.request.cas = 0;
+    r.gat.message.body.expiration = htonl(10);
+
+    memcpy(r.buffer + sizeof(r.gat.bytes), key, keylen);
+    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
+    cb_assert(ret == ENGINE_SUCCESS);
+
+    /* GATQ is quiet and should not produce any result */
+    cb_assert(last_response == NULL);
+
+    /* store and get a key */
+    cb_assert(get_test(h, h1) == SUCCESS);
+
+    /* Set expiry time to 10 secs.. */
+    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
+    cb_assert(ret == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(last_response->response.keylen == 0);
+    cb_assert(last_response->response.extlen == 4);
+    cb_assert(ntohl(last_response->response.bodylen) == 5); /* get_test sets 1 byte datalen */
+    release_last_response();
+
+    /* time-travel 11 secs.. */
+    test_harness.time_travel(11);
+
+    /* The item should have expired now... */
+    cb_assert(h1->get(h, NULL, &item, key, (int)keylen, 0) == ENGINE_KEY_ENOENT);
+
+    /* Verify that it doesn't accept bogus packets. extlen is mandatory */
+    r.gat.message.header.request.extlen = 0;
+    r.gat.message.header.request.bodylen = htonl((uint32_t)keylen);
+    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
+    cb_assert(ret == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    release_last_response();
+
+    /* key is mandatory! */
+    r.gat.message.header.request.extlen = 4;
+    r.gat.message.header.request.keylen = 0;
+    r.gat.message.header.request.bodylen = htonl(4);
+    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
+    cb_assert(ret == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    release_last_response();
+
+    return SUCCESS;
+}
+
+static int slabs_moved;
+static int slab_reassign_running;
+static int slab_class1_pages;
+static int slab_defrag_pages;
+static int slab_defrag_running;
+static int slab_free_pages;
+static int slab_pages_madvised;
+static void slabs_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    char buffer[1024];
+
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 11 && memcmp(key, "slabs_moved", klen) == 0) {
+        slabs_moved = atoi(buffer);
+    } else if (klen == 21 && memcmp(key, "slab_reassign_running", klen) == 0) {
+        slab_reassign_running = atoi(buffer);
+    } else if (klen == 13 && memcmp(key, "1:total_pages", klen) == 0) {
+        slab_class1_pages = atoi(buffer);
+    } else if (klen == 17 && memcmp(key, "slab_defrag_pages", klen) == 0) {
+        slab_defrag_pages = atoi(buffer);
+    } else if (klen == 19 && memcmp(key, "slab_defrag_running", klen) == 0) {
+        slab_defrag_running = atoi(buffer);
+    } else if (klen == 15 && memcmp(key, "slab_free_pages", klen) == 0) {
+        slab_free_pages = atoi(buffer);
+    } else if (klen == 19 && memcmp(key, "slab_pages_madvised", klen) == 0) {
+        slab_pages_madvised = atoi(buffer);
+    }
+}
+
+static protocol_binary_response_status slabs_reassign(ENGINE_HANDLE *h,
+                                                      ENGINE_HANDLE_V1 *h1,
+                                                      uint32_t src,
+                                                      uint32_t dst) {
+    protocol_binary_request_slabs_reassign req;
+    protocol_binary_response_status ret;
+
+    memset(&req, 0, sizeof(req));
+    req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    req.message.header.request.opcode = PROTOCOL_BINARY_CMD_SLABS_REASSIGN;
+    req.message.header.request.extlen = 8;
+    req.message.header.request.bodylen = htonl(8);
+    req.message.body.src = htonl(src);
+    req.message.body.dst = htonl(dst);
+
+    cb_assert(h1->unknown_command(h, NULL, &req.message.header,
+                               response_handler) == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    ret = ntohs(last_response->response.status);
+    release_last_response();
+    return ret;
+}
+
+/*
+ * Make sure that we can move a page from one slab class to another, and
+ * that the items on it survive the move
+ */
+static enum test_result slab_reassign_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    int ii;
+
+    for (ii = 0; ii < 30; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "slab_reassign_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 100000, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    cb_assert(slabs_reassign(h, h1, 0, 0) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    cb_assert(slabs_reassign(h, h1, 1, 1) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    cb_assert(slabs_reassign(h, h1, 0, 1) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    for (ii = 0; ii < 500; ++ii) {
+        cb_assert(h1->get_stats(h, NULL, "slabs", 5,
+                             slabs_stats_handler) == ENGINE_SUCCESS);
+        if (slabs_moved == 1 && !slab_reassign_running) {
+            break;
+        }
+        usleep(10000);
+    }
+    cb_assert(slabs_moved == 1);
+    cb_assert(slab_class1_pages == 1);
+
+    for (ii = 0; ii < 30; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "slab_reassign_%d", ii);
+        cb_assert(h1->get(h, NULL, &test_item, key,
+                       (int)keylen, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Make sure that the defragmenter empties the pages most of the items
+ * were deleted from, and that the items left on them survive the move
+ */
+static enum test_result slab_defrag_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    int ii;
+
+    for (ii = 0; ii < 40; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "slab_defrag_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 100000, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    /* Leave every page three quarters empty */
+    for (ii = 0; ii < 40; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "slab_defrag_%d", ii);
+        if (ii % 4 != 0) {
+            cas = 0;
+            cb_assert(h1->remove(h, NULL, key, keylen, &cas, 0) == ENGINE_SUCCESS);
+        }
+    }
+
+    for (ii = 0; ii < 1000; ++ii) {
+        cb_assert(h1->get_stats(h, NULL, "slabs", 5,
+                             slabs_stats_handler) == ENGINE_SUCCESS);
+        if (slab_defrag_pages >= 1 && !slab_defrag_running) {
+            break;
+        }
+        usleep(10000);
+    }
+    cb_assert(slab_defrag_pages >= 1);
+
+    for (ii = 0; ii < 40; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "slab_defrag_%d", ii);
+        if (ii % 4 == 0) {
+            cb_assert(h1->get(h, NULL, &test_item, key,
+                           (int)keylen, 0) == ENGINE_SUCCESS);
+            h1->release(h, NULL, test_item);
+        } else {
+            cb_assert(h1->get(h, NULL, &test_item, key,
+                           (int)keylen, 0) == ENGINE_KEY_ENOENT);
+        }
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Make sure that the pages nothing is left on go to the pool of free
+ * pages (with their memory given back to the OS), and that the classes
+ * get their pages from it.
+ */
+static enum test_result slab_madvise_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    int ii;
+
+    for (ii = 0; ii < 40; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "slab_madvise_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 100000, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+    for (ii = 0; ii < 40; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "slab_madvise_%d", ii);
+        cas = 0;
+        cb_assert(h1->remove(h, NULL, key, keylen, &cas, 0) == ENGINE_SUCCESS);
+    }
+
+    for (ii = 0; ii < 1000; ++ii) {
+        cb_assert(h1->get_stats(h, NULL, "slabs", 5,
+                             slabs_stats_handler) == ENGINE_SUCCESS);
+        if (slab_free_pages >= 2 && !slab_reassign_running) {
+            break;
+        }
+        usleep(10000);
+    }
+    cb_assert(slab_free_pages >= 2);
+    cb_assert(slab_pages_madvised == slab_free_pages);
+
+    /* A class of items of another size takes them */
+    for (ii = 0; ii < 20; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "slab_madvise_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 200000, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+    cb_assert(h1->get_stats(h, NULL, "slabs", 5,
+                         slabs_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(slab_free_pages == 0);
+
+    return SUCCESS;
+}
+
+/*
+ * Make sure that the pages above a smaller mem_limit are given back
+ */
+static enum test_result mem_limit_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    engine_mem_info_t info;
+    size_t limit;
+    int ii;
+
+    for (ii = 0; ii < 30; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "mem_limit_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &test_item, key, keylen, 100000, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    h1->get_mem_info(h, NULL, &info);
+    cb_assert(info.used >= 30 * 100000);
+    cb_assert(info.used <= info.limit);
+
+    cb_assert(h1->set_mem_limit(h, NULL, 0) == ENGINE_EINVAL);
+    limit = info.used - 1;
+    cb_assert(h1->set_mem_limit(h, NULL, limit) == ENGINE_SUCCESS);
+
+    for (ii = 0; ii < 500; ++ii) {
+        h1->get_mem_info(h, NULL, &info);
+        if (info.used <= limit) {
+            break;
+        }
+        usleep(10000);
+    }
+    cb_assert(info.limit == limit);
+    cb_assert(info.used <= limit);
+    return SUCCESS;
+}
+
+/*
+ * Fill the value of the item (which may be in many pieces) with a pattern
+ * starting at the offset'th byte of it.
+ */
+static void fill_item_value(item_info *info, size_t offset) {
+    int ii;
+    for (ii = 0; ii < info->nvalue; ++ii) {
+        unsigned char *ptr = info->value[ii].iov_base;
+        size_t jj;
+        for (jj = 0; jj < info->value[ii].iov_len; ++jj) {
+            ptr[jj] = (unsigned char)(offset++ % 251);
+        }
+    }
+}
+
+/*
+ * Check that the value of the item is the pattern from fill_item_value
+ */
+static bool check_item_value(item_info *info) {
+    size_t offset = 0;
+    int ii;
+    for (ii = 0; ii < info->nvalue; ++ii) {
+        unsigned char *ptr = info->value[ii].iov_base;
+        size_t jj;
+        for (jj = 0; jj < info->value[ii].iov_len; ++jj) {
+            if (ptr[jj] != (unsigned char)(offset++ % 251)) {
+                return false;
+            }
+        }
+    }
+    return offset == info->nbytes;
+}
+
+/*
+ * Verify that large values are stored in chunks, and that they survive
+ * being appended to
+ */
+static enum test_result chunked_item_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    union {
+        item_info info;
+        char bytes[sizeof(item_info) + 63 * sizeof(struct iovec)];
+    } holder;
+    item *it;
+    void *key = "chunked";
+    uint64_t cas;
+
+    cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), 300000, 0, 0,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    /* It doesn't fit in one piece.. */
+    holder.info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == false);
+    holder.info.nvalue = 64;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.nvalue > 1);
+    cb_assert(holder.info.nbytes == 300000);
+    fill_item_value(&holder.info, 0);
+    cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), 50000, 0, 0,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    holder.info.nvalue = 64;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    fill_item_value(&holder.info, 300000);
+    cb_assert(h1->store(h, NULL, it, &cas, OPERATION_APPEND, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
 
-    /* Set expiry time to 10 secs.. */
-    ret = h1->unknown_command(h, NULL, &r.touch.message.header, response_handler);
-    cb_assert(ret == ENGINE_SUCCESS);
-    cb_assert(last_response != NULL);
-    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
-    cb_assert(last_response->response.keylen == 0);
-    cb_assert(last_response->response.extlen == 0);
-    cb_assert(last_response->response.bodylen == 0);
-    release_last_response();
+    cb_assert(h1->get(h, NULL, &it, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    holder.info.nvalue = 64;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.nbytes == 350000);
+    cb_assert(check_item_value(&holder.info));
+    h1->release(h, NULL, it);
+
+    cb_assert(h1->remove(h, NULL, key, strlen(key), &cas, 0) == ENGINE_SUCCESS);
+    return SUCCESS;
+}
+
+static uint64_t appends_in_place;
+static uint64_t patches_in_place;
+static void append_stats_handler(const char *key, const uint16_t klen,
+                                 const char *val, const uint32_t vlen,
+                                 const void *cookie) {
+    char buffer[1024];
+
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 16 && memcmp(key, "appends_in_place", klen) == 0) {
+        appends_in_place = strtoull(buffer, NULL, 10);
+    } else if (klen == 16 && memcmp(key, "patches_in_place", klen) == 0) {
+        patches_in_place = strtoull(buffer, NULL, 10);
+    }
+}
+
+/*
+ * Verify that appends grow the item where it is (also once it is
+ * chunked), but leave an item someone is reading alone
+ */
+static enum test_result append_in_place_test(ENGINE_HANDLE *h,
+                                             ENGINE_HANDLE_V1 *h1) {
+    union {
+        item_info info;
+        char bytes[sizeof(item_info) + 63 * sizeof(struct iovec)];
+    } holder;
+    item *it;
+    item *held;
+    void *key = "append_in_place";
+    size_t nbytes = 100;
+    uint64_t cas;
+    int ii;
+
+    cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), nbytes, 0, 0,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    holder.info.nvalue = 64;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    fill_item_value(&holder.info, 0);
+    cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    for (ii = 0; ii < 100; ++ii) {
+        uint64_t old_cas = cas;
+        cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), 1000, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        holder.info.nvalue = 64;
+        cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+        fill_item_value(&holder.info, nbytes);
+        cb_assert(h1->store(h, NULL, it, &cas,
+                         OPERATION_APPEND, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+        cb_assert(cas != old_cas);
+        nbytes += 1000;
+    }
+
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                         append_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(appends_in_place > 50);
+
+    /* Someone reading it keeps the value they've got */
+    cb_assert(h1->get(h, NULL, &held, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), 1000, 0, 0,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    holder.info.nvalue = 64;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    fill_item_value(&holder.info, nbytes);
+    cb_assert(h1->store(h, NULL, it, &cas, OPERATION_APPEND, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+    holder.info.nvalue = 64;
+    cb_assert(h1->get_item_info(h, NULL, held, &holder.info) == true);
+    cb_assert(holder.info.nbytes == nbytes);
+    cb_assert(check_item_value(&holder.info));
+    h1->release(h, NULL, held);
+    nbytes += 1000;
+
+    cb_assert(h1->get(h, NULL, &it, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    holder.info.nvalue = 64;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.nbytes == nbytes);
+    cb_assert(holder.info.cas == cas);
+    cb_assert(check_item_value(&holder.info));
+    h1->release(h, NULL, it);
+
+    cb_assert(h1->remove(h, NULL, key, strlen(key), &cas, 0) == ENGINE_SUCCESS);
+    return SUCCESS;
+}
+
+/*
+ * Verify that patch overwrites a range of a chunked value where it is,
+ * and that it leaves an item someone is reading alone
+ */
+static enum test_result patch_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    union {
+        item_info info;
+        char bytes[sizeof(item_info) + 63 * sizeof(struct iovec)];
+    } holder;
+    item *it;
+    item *held;
+    void *key = "patch";
+    size_t nbytes = 100000;
+    size_t offset = 20000;
+    uint32_t len = 40000;
+    char *data = malloc(len);
+    uint64_t cas;
+    uint64_t old_cas;
+    uint32_t ii;
+
+    cb_assert(data != NULL);
+    cb_assert(h1->patch != NULL);
+    cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), nbytes, 0, 0,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    holder.info.nvalue = 64;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.nvalue > 1);
+    fill_item_value(&holder.info, 0);
+    cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    /* Spoil the range (over several chunks), then put the pattern back */
+    memset(data, 0xff, len);
+    old_cas = cas;
+    cb_assert(h1->patch(h, NULL, key, strlen(key), offset, data, len,
+                        &cas, 0) == ENGINE_SUCCESS);
+    cb_assert(cas != old_cas);
+    cb_assert(h1->get(h, NULL, &it, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    holder.info.nvalue = 64;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.nbytes == nbytes);
+    cb_assert(holder.info.cas == cas);
+    cb_assert(!check_item_value(&holder.info));
+    h1->release(h, NULL, it);
+
+    for (ii = 0; ii < len; ++ii) {
+        data[ii] = (char)((offset + ii) % 251);
+    }
+    old_cas = 1;
+    cb_assert(h1->patch(h, NULL, key, strlen(key), offset, data, len,
+                        &old_cas, 0) == ENGINE_KEY_EEXISTS);
+    old_cas = cas;
+    cb_assert(h1->patch(h, NULL, key, strlen(key), nbytes - len + 1, data,
+                        len, &old_cas, 0) == ENGINE_ERANGE);
+    cb_assert(h1->patch(h, NULL, "nokey", 5, offset, data, len,
+                        &old_cas, 0) == ENGINE_KEY_ENOENT);
+    cb_assert(h1->patch(h, NULL, key, strlen(key), offset, data, len,
+                        &cas, 0) == ENGINE_SUCCESS);
+    cb_assert(cas != old_cas);
+
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                         append_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(patches_in_place == 2);
+
+    /* Someone reading it keeps the value they've got */
+    cb_assert(h1->get(h, NULL, &held, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    old_cas = cas;
+    cb_assert(h1->patch(h, NULL, key, strlen(key), offset, data, len,
+                        &old_cas, 0) == ENGINE_ENOTSUP);
+    holder.info.nvalue = 64;
+    cb_assert(h1->get_item_info(h, NULL, held, &holder.info) == true);
+    cb_assert(holder.info.cas == cas);
+    cb_assert(check_item_value(&holder.info));
+    h1->release(h, NULL, held);
+
+    free(data);
+    cb_assert(h1->remove(h, NULL, key, strlen(key), &cas, 0) == ENGINE_SUCCESS);
+    return SUCCESS;
+}
+
+static uint64_t values_compressed;
+static uint64_t values_inflated;
+static void compression_stats_handler(const char *key, const uint16_t klen,
+                                      const char *val, const uint32_t vlen,
+                                      const void *cookie) {
+    char buffer[1024];
+
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 17 && memcmp(key, "values_compressed", klen) == 0) {
+        values_compressed = strtoull(buffer, NULL, 10);
+    } else if (klen == 15 && memcmp(key, "values_inflated", klen) == 0) {
+        values_inflated = strtoull(buffer, NULL, 10);
+    }
+}
+
+/* Store nbytes of the pattern from fill_item_value (starting at offset) */
+static uint64_t store_pattern(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                              const char *key, size_t offset, size_t nbytes,
+                              uint8_t datatype,
+                              ENGINE_STORE_OPERATION operation) {
+    union {
+        item_info info;
+        char bytes[sizeof(item_info) + 63 * sizeof(struct iovec)];
+    } holder;
+    item *it;
+    uint64_t cas;
+
+    cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), nbytes, 0, 0,
+                        datatype) == ENGINE_SUCCESS);
+    holder.info.nvalue = 64;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    fill_item_value(&holder.info, offset);
+    cb_assert(h1->store(h, NULL, it, &cas, operation, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+    return cas;
+}
+
+/*
+ * Verify that the values above the threshold are stored compressed, and
+ * that appends and arithmetic work on what the client stored
+ */
+static enum test_result compression_test(ENGINE_HANDLE *h,
+                                         ENGINE_HANDLE_V1 *h1) {
+    union {
+        item_info info;
+        char bytes[sizeof(item_info) + 63 * sizeof(struct iovec)];
+    } holder;
+    item *it;
+    void *key = "compressed";
+    void *counter = "compressed_counter";
+    char *value = "00000000000000000041";
+    uint64_t cas;
+    uint64_t res;
+
+    cas = store_pattern(h, h1, key, 0, 4000, PROTOCOL_BINARY_RAW_BYTES,
+                        OPERATION_SET);
+    cb_assert(h1->get(h, NULL, &it, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    holder.info.nvalue = 64;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.datatype == PROTOCOL_BINARY_DATATYPE_COMPRESSED);
+    cb_assert(holder.info.nvalue == 1);
+    cb_assert(holder.info.nbytes < 1000);
+    cb_assert(holder.info.cas == cas);
+    h1->release(h, NULL, it);
+
+    /* Appending to it gets us the value we stored (and the new piece) */
+    store_pattern(h, h1, key, 4000, 1000, PROTOCOL_BINARY_RAW_BYTES,
+                  OPERATION_APPEND);
+    cb_assert(h1->get(h, NULL, &it, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    holder.info.nvalue = 64;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.datatype == PROTOCOL_BINARY_RAW_BYTES);
+    cb_assert(holder.info.nbytes == 5000);
+    cb_assert(check_item_value(&holder.info));
+    h1->release(h, NULL, it);
+
+    /* And so does prepending to it */
+    store_pattern(h, h1, key, 1000, 4000, PROTOCOL_BINARY_DATATYPE_JSON,
+                  OPERATION_SET);
+    cb_assert(h1->get(h, NULL, &it, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    holder.info.nvalue = 64;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.datatype ==
+              PROTOCOL_BINARY_DATATYPE_COMPRESSED_JSON);
+    h1->release(h, NULL, it);
+    store_pattern(h, h1, key, 0, 1000, PROTOCOL_BINARY_DATATYPE_JSON,
+                  OPERATION_PREPEND);
+    cb_assert(h1->get(h, NULL, &it, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    holder.info.nvalue = 64;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.datatype == PROTOCOL_BINARY_DATATYPE_JSON);
+    cb_assert(holder.info.nbytes == 5000);
+    cb_assert(check_item_value(&holder.info));
+    h1->release(h, NULL, it);
+
+    /* Values below the threshold are left alone */
+    store_pattern(h, h1, key, 0, 8, PROTOCOL_BINARY_RAW_BYTES,
+                  OPERATION_SET);
+    cb_assert(h1->get(h, NULL, &it, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    holder.info.nvalue = 64;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.datatype == PROTOCOL_BINARY_RAW_BYTES);
+    cb_assert(holder.info.nbytes == 8);
+    h1->release(h, NULL, it);
+
+    /* A compressed counter */
+    cb_assert(h1->allocate(h, NULL, &it, counter, strlen(counter),
+                        strlen(value), 0, 0,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    holder.info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    memcpy(holder.info.value[0].iov_base, value, strlen(value));
+    cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+    cb_assert(h1->get(h, NULL, &it, counter, (int)strlen(counter),
+                      0) == ENGINE_SUCCESS);
+    holder.info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.datatype == PROTOCOL_BINARY_DATATYPE_COMPRESSED);
+    h1->release(h, NULL, it);
+    cb_assert(h1->arithmetic(h, NULL, counter, (int)strlen(counter), true,
+                             false, 1, 0, 0, &cas, PROTOCOL_BINARY_RAW_BYTES,
+                             &res, 0) == ENGINE_SUCCESS);
+    cb_assert(res == 42);
+    cb_assert(h1->get(h, NULL, &it, counter, (int)strlen(counter),
+                      0) == ENGINE_SUCCESS);
+    holder.info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.datatype == PROTOCOL_BINARY_RAW_BYTES);
+    cb_assert(holder.info.nbytes == 2);
+    cb_assert(memcmp(holder.info.value[0].iov_base, "42", 2) == 0);
+    h1->release(h, NULL, it);
+
+    cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                         compression_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(values_compressed == 3);
+    cb_assert(values_inflated == 3);
+
+    cas = 0;
+    cb_assert(h1->remove(h, NULL, key, strlen(key), &cas, 0) == ENGINE_SUCCESS);
+    cb_assert(h1->remove(h, NULL, counter, strlen(counter),
+                         &cas, 0) == ENGINE_SUCCESS);
+    return SUCCESS;
+}
+
+static int ext_items_written;
+static int ext_reads;
+static int ext_pages_evicted;
+static int ext_inline_reads;
+static void ext_stats_handler(const char *key, const uint16_t klen,
+                              const char *val, const uint32_t vlen,
+                              const void *cookie) {
+    char buffer[1024];
+
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 17 && memcmp(key, "ext_items_written", klen) == 0) {
+        ext_items_written = atoi(buffer);
+    } else if (klen == 9 && memcmp(key, "ext_reads", klen) == 0) {
+        ext_reads = atoi(buffer);
+    } else if (klen == 17 && memcmp(key, "ext_pages_evicted", klen) == 0) {
+        ext_pages_evicted = atoi(buffer);
+    } else if (klen == 16 && memcmp(key, "ext_inline_reads", klen) == 0) {
+        ext_inline_reads = atoi(buffer);
+    }
+}
+
+#define EXT_TEST_FILE "/tmp/basic_engine_testsuite_ext"
+
+/*
+ * Check that the value of the key is the pattern from fill_item_value
+ * (nbytes of it)
+ */
+static void check_ext_item(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                           const char *key, size_t nbytes) {
+    union {
+        item_info info;
+        char bytes[sizeof(item_info) + 15 * sizeof(struct iovec)];
+    } holder;
+    item *it;
+
+    /* The mock server waits for the engine to read it back in */
+    cb_assert(h1->get(h, NULL, &it, key, (int)strlen(key), 0) == ENGINE_SUCCESS);
+    holder.info.nvalue = 16;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.nbytes == nbytes);
+    cb_assert(check_item_value(&holder.info));
+    h1->release(h, NULL, it);
+}
+
+/*
+ * Verify that the LRU maintainer writes the cold values out to extstore,
+ * and that we can read them back in (and update them)
+ */
+static enum test_result extstore_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item_info info;
+    item *it;
+    uint64_t cas;
+    int ii;
+
+    for (ii = 0; ii < 16; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "extstore_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &it, key, keylen, 1000, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+        fill_item_value(&info, 0);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+
+    /* Everything outside of the hot segment is cold (nothing is active) */
+    for (ii = 0; ii < 500; ++ii) {
+        cb_assert(h1->get_stats(h, NULL, "extstore", 8,
+                             ext_stats_handler) == ENGINE_SUCCESS);
+        if (ext_items_written >= 10) {
+            break;
+        }
+        usleep(10000);
+    }
+    /* More than a page (so some are read from the file) */
+    cb_assert(ext_items_written >= 10);
+
+    for (ii = 0; ii < 16; ++ii) {
+        char key[64];
+        snprintf(key, sizeof(key), "extstore_%d", ii);
+        check_ext_item(h, h1, key, 1000);
+    }
+    cb_assert(h1->get_stats(h, NULL, "extstore", 8,
+                         ext_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(ext_reads >= 10);
+    /* The page being filled is in memory */
+    cb_assert(ext_inline_reads > 0);
+
+    for (ii = 0; ii < 16; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "extstore_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &it, key, keylen, 100, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+        fill_item_value(&info, 1000);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_APPEND, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+        check_ext_item(h, h1, key, 1100);
+    }
+
+    unlink(EXT_TEST_FILE);
+    return SUCCESS;
+}
+
+/*
+ * Verify that the keys whose values were lost when extstore wrapped
+ * around are gone, and the rest are still there
+ */
+static enum test_result extstore_miss_test(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    item_info info;
+    item *it;
+    uint64_t cas;
+    int missing = 0;
+    int ii;
+
+    /* Twice as much as fits */
+    for (ii = 0; ii < 128; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "extmiss_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &it, key, keylen, 1000, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+        fill_item_value(&info, 0);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+
+    ext_pages_evicted = 0;
+    for (ii = 0; ii < 500; ++ii) {
+        cb_assert(h1->get_stats(h, NULL, "extstore", 8,
+                             ext_stats_handler) == ENGINE_SUCCESS);
+        if (ext_pages_evicted > 0) {
+            break;
+        }
+        usleep(10000);
+    }
+    cb_assert(ext_pages_evicted > 0);
+
+    for (ii = 0; ii < 128; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "extmiss_%d", ii);
+        ENGINE_ERROR_CODE ret = h1->get(h, NULL, &it, key, (int)keylen, 0);
+        if (ret == ENGINE_SUCCESS) {
+            h1->release(h, NULL, it);
+        } else {
+            cb_assert(ret == ENGINE_KEY_ENOENT);
+            ++missing;
+        }
+    }
+    cb_assert(missing > 0 && missing < 128);
+
+    unlink(EXT_TEST_FILE);
+    return SUCCESS;
+}
+
+#define RESTART_TEST_FILE "/tmp/basic_engine_testsuite_restart"
+
+/*
+ * Verify that the items survive a restart with restart_file (and that
+ * the ones which expired while we were down don't)
+ */
+static enum test_result restart_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    union {
+        item_info info;
+        char bytes[sizeof(item_info) + 15 * sizeof(struct iovec)];
+    } holder;
+    uint64_t cas[32];
+    uint64_t chunked_cas;
+    item *it;
+    int ii;
+
+    for (ii = 0; ii < 32; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "restart_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &it, key, keylen, 100 * ii, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        holder.info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+        fill_item_value(&holder.info, 0);
+        cb_assert(h1->store(h, NULL, it, &cas[ii], OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+
+    cb_assert(h1->allocate(h, NULL, &it, "restart_chunked", 15, 100000, 0, 0,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    holder.info.nvalue = 16;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.nvalue > 1);
+    fill_item_value(&holder.info, 0);
+    cb_assert(h1->store(h, NULL, it, &chunked_cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    cb_assert(h1->allocate(h, NULL, &it, "restart_expired", 15, 10, 0, 5,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, it, &cas[0], OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
 
-    /* time-travel 11 secs.. */
     test_harness.time_travel(11);
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path,
+                               test_harness.get_current_testcase()->cfg,
+                               true, false);
+
+    for (ii = 0; ii < 32; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "restart_%d", ii);
+        cb_assert(h1->get(h, NULL, &it, key, (int)keylen, 0) == ENGINE_SUCCESS);
+        holder.info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+        cb_assert(holder.info.nbytes == 100 * ii);
+        cb_assert(holder.info.cas == cas[ii] || ii == 0);
+        cb_assert(check_item_value(&holder.info));
+        h1->release(h, NULL, it);
+    }
 
-    /* The item should have expired now... */
-    cb_assert(h1->get(h, NULL, &item, key, (int)keylen, 0) == ENGINE_KEY_ENOENT);
+    cb_assert(h1->get(h, NULL, &it, "restart_chunked", 15, 0) == ENGINE_SUCCESS);
+    holder.info.nvalue = 16;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.nbytes == 100000);
+    cb_assert(holder.info.cas == chunked_cas);
+    cb_assert(check_item_value(&holder.info));
+    h1->release(h, NULL, it);
 
-    /* Verify that it doesn't accept bogus packets. extlen is mandatory */
-    r.touch.message.header.request.extlen = 0;
-    r.touch.message.header.request.bodylen = htonl((uint32_t)keylen);
-    ret = h1->unknown_command(h, NULL, &r.touch.message.header, response_handler);
-    cb_assert(ret == ENGINE_SUCCESS);
-    cb_assert(last_response != NULL);
-    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
-    release_last_response();
+    cb_assert(h1->get(h, NULL, &it, "restart_expired", 15, 0) == ENGINE_KEY_ENOENT);
 
-    /* key is mandatory! */
-    r.touch.message.header.request.extlen = 4;
-    r.touch.message.header.request.keylen = 0;
-    r.touch.message.header.request.bodylen = htonl(4);
-    ret = h1->unknown_command(h, NULL, &r.touch.message.header, response_handler);
-    cb_assert(ret == ENGINE_SUCCESS);
-    cb_assert(last_response != NULL);
-    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
-    release_last_response();
+    /* The CAS values carry on from where we were */
+    cb_assert(h1->allocate(h, NULL, &it, "restart_new", 11, 10, 0, 0,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, it, &cas[1], OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+    cb_assert(cas[1] > chunked_cas);
 
+    /* Don't leave anything behind for the next run */
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path,
+                               test_harness.default_engine_cfg, true, false);
+    unlink(RESTART_TEST_FILE);
+    unlink(RESTART_TEST_FILE ".meta");
     return SUCCESS;
 }
 
-static enum test_result gat_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    union request {
-        protocol_binary_request_gat gat;
-        char buffer[512];
-    };
+static int arena_hugepage_size = -1;
+static void arena_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    char buffer[1024];
 
-    void *key = "get_test_key";
-    size_t keylen = strlen(key);
-    ENGINE_ERROR_CODE ret;
-    item *item = NULL;
-    union request r;
-    memset(r.buffer, 0, sizeof(r));
-    r.gat.message.header.request.magic = PROTOCOL_BINARY_REQ;
-    r.gat.message.header.request.opcode = PROTOCOL_BINARY_CMD_GAT;
-    r.gat.message.header.request.keylen = htons((uint16_t)keylen);
-    r.gat.message.header.request.extlen = 4;
-    r.gat.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
-    r.gat.message.header.request.vbucket = 0;
-    r.gat.message.header.request.bodylen = htonl((uint32_t)keylen + 4);
-    r.gat.message.header.request.opaque = 0xdeadbeef;
-    r.gat.message.header.request.cas = 0;
-    r.gat.message.body.expiration = htonl(10);
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 19 && memcmp(key, "arena_hugepage_size", klen) == 0) {
+        arena_hugepage_size = atoi(buffer);
+    }
+}
 
-    memcpy(r.buffer + sizeof(r.gat.bytes), key, keylen);
-    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
-    cb_assert(ret == ENGINE_SUCCESS);
-    cb_assert(last_response != NULL);
-    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
-    cb_assert(last_response->response.keylen == 0);
-    cb_assert(last_response->response.extlen == 0);
-    cb_assert(last_response->response.bodylen == 0);
-    release_last_response();
+/*
+ * Verify that we get a working preallocated arena when asking for
+ * hugepages (if the host has none we fall back to regular pages)
+ */
+static enum test_result hugepage_arena_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item_info info;
+    item *it;
+    uint64_t cas;
+    int ii;
+
+    cb_assert(h1->get_stats(h, NULL, "slabs", 5,
+                         arena_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(arena_hugepage_size == 0 || arena_hugepage_size == 2097152);
+
+    for (ii = 0; ii < 100; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "hugepage_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &it, key, keylen, 10 * ii, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+        fill_item_value(&info, 0);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+    for (ii = 0; ii < 100; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "hugepage_%d", ii);
+        cb_assert(h1->get(h, NULL, &it, key, (int)keylen, 0) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+        cb_assert(info.nbytes == 10 * ii);
+        cb_assert(check_item_value(&info));
+        h1->release(h, NULL, it);
+    }
+    return SUCCESS;
+}
+
+static int numa_nodes;
+static uint64_t numa_memory_used;
+static uint64_t numa_hits;
+static void numa_stats_handler(const char *key, const uint16_t klen,
+                               const char *val, const uint32_t vlen,
+                               const void *cookie) {
+    char buffer[1024];
+    const char *used = ":memory_used";
+    const char *hits = "_hits";
+
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 10 && memcmp(key, "numa_nodes", klen) == 0) {
+        numa_nodes = atoi(buffer);
+    } else if (klen > strlen(used) &&
+               memcmp(key + klen - strlen(used), used, strlen(used)) == 0) {
+        numa_memory_used += atoi(buffer);
+    } else if (klen > strlen(hits) &&
+               memcmp(key + klen - strlen(hits), hits, strlen(hits)) == 0) {
+        numa_hits += atoi(buffer);
+    }
+}
+
+/*
+ * Verify that the arena is split by NUMA node (there is at least one),
+ * and that the gets are counted per node
+ */
+static enum test_result numa_arena_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item_info info;
+    item *it;
+    uint64_t cas;
+    int ii;
+
+    for (ii = 0; ii < 100; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "numa_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &it, key, keylen, 10 * ii, 0, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+        fill_item_value(&info, 0);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+    for (ii = 0; ii < 100; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "numa_%d", ii);
+        cb_assert(h1->get(h, NULL, &it, key, (int)keylen, 0) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+        cb_assert(check_item_value(&info));
+        h1->release(h, NULL, it);
+    }
+
+    cb_assert(h1->get_stats(h, NULL, "numa", 4,
+                         numa_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(numa_nodes >= 1);
+    cb_assert(numa_memory_used > 0);
+    cb_assert(numa_hits == 100);
+    return SUCCESS;
+}
 
-    /* store and get a key */
-    cb_assert(get_test(h, h1) == SUCCESS);
+static uint64_t vb_items[3];
+static uint64_t vb_bytes[3];
+
+static void vbucket_stats_handler(const char *key, const uint16_t klen,
+                                  const char *val, const uint32_t vlen,
+                                  const void *cookie) {
+    char buffer[64];
+    unsigned int vbucket;
+    char what[16];
+
+    cb_assert(klen < sizeof(buffer) && vlen < sizeof(buffer));
+    memcpy(buffer, key, klen);
+    buffer[klen] = '\0';
+    cb_assert(sscanf(buffer, "vb:%u:%15s", &vbucket, what) == 2);
+    cb_assert(vbucket < 3);
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (strcmp(what, "items") == 0) {
+        vb_items[vbucket] = strtoull(buffer, NULL, 10);
+    } else {
+        cb_assert(strcmp(what, "bytes") == 0);
+        vb_bytes[vbucket] = strtoull(buffer, NULL, 10);
+    }
+}
 
-    /* Set expiry time to 10 secs.. */
-    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
-    cb_assert(ret == ENGINE_SUCCESS);
-    cb_assert(last_response != NULL);
-    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
-    cb_assert(last_response->response.keylen == 0);
-    cb_assert(last_response->response.extlen == 4);
-    cb_assert(ntohl(last_response->response.bodylen) == 5); /* get_test sets 1 byte datalen */
+static void vbucket_index_store(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                const char *key, uint16_t vbucket) {
+    item *it;
+    uint64_t cas;
+    cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), 10, 0, 0,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET,
+                        vbucket) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+}
+
+/*
+ * Verify that the items are counted per vbucket, that a tap stream
+ * listing vbuckets only gets the items of those, and that deleting a
+ * vbucket drops its items
+ */
+static enum test_result vbucket_index_test(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    const void *cookie = test_harness.create_cookie();
+    protocol_binary_request_header req;
+    uint16_t tap_vbuckets[2];
+    TAP_ITERATOR iter;
+    tap_event_t event;
+    uint64_t cas = 0;
+    item *it;
+    int ntap = 0;
+    int ii;
+
+    for (ii = 0; ii < 10; ++ii) {
+        char key[64];
+        snprintf(key, sizeof(key), "vbi_a_%d", ii);
+        vbucket_index_store(h, h1, key, 1);
+        snprintf(key, sizeof(key), "vbi_b_%d", ii);
+        vbucket_index_store(h, h1, key, 2);
+    }
+    vbucket_index_store(h, h1, "vbi_a_0", 1);
+    cb_assert(h1->remove(h, NULL, "vbi_b_0", 7, &cas, 2) == ENGINE_SUCCESS);
+
+    cb_assert(h1->get_stats(h, NULL, "vbucket", 7,
+                         vbucket_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(vb_items[0] == 0);
+    cb_assert(vb_items[1] == 10);
+    cb_assert(vb_items[2] == 9);
+    cb_assert(vb_bytes[1] != 0);
+    cb_assert(vb_bytes[1] > vb_bytes[2]);
+
+    tap_vbuckets[0] = htons(1);
+    tap_vbuckets[1] = htons(2);
+    iter = h1->get_tap_iterator(h, cookie, NULL, 0,
+                                TAP_CONNECT_FLAG_LIST_VBUCKETS,
+                                tap_vbuckets, sizeof(tap_vbuckets));
+    cb_assert(iter != NULL);
+    do {
+        void *es;
+        uint16_t nes, flags, vbucket;
+        uint8_t ttl;
+        uint32_t seqno;
+
+        event = iter(h, cookie, &it, &es, &nes, &ttl, &flags, &seqno,
+                     &vbucket);
+        if (event == TAP_MUTATION) {
+            item_info info;
+            info.nvalue = 1;
+            cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+            cb_assert(vbucket == 2);
+            cb_assert(memcmp(info.key, "vbi_b_", 6) == 0);
+            h1->release(h, NULL, it);
+            ++ntap;
+        }
+    } while (event == TAP_MUTATION);
+    cb_assert(event == TAP_DISCONNECT);
+    cb_assert(ntap == 9);
+    test_harness.destroy_cookie(cookie);
+
+    memset(&req, 0, sizeof(req));
+    req.request.magic = PROTOCOL_BINARY_REQ;
+    req.request.opcode = PROTOCOL_BINARY_CMD_DEL_VBUCKET;
+    req.request.vbucket = htons(1);
+    cb_assert(h1->unknown_command(h, NULL, &req,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(ntohs(last_response->response.status) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
     release_last_response();
 
-    /* time-travel 11 secs.. */
-    test_harness.time_travel(11);
+    cb_assert(h1->get(h, NULL, &it, "vbi_a_1", 7, 1) == ENGINE_KEY_ENOENT);
+    cb_assert(h1->get(h, NULL, &it, "vbi_b_1", 7, 2) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
 
-    /* The item should have expired now... */
-    cb_assert(h1->get(h, NULL, &item, key, (int)keylen, 0) == ENGINE_KEY_ENOENT);
+    memset(vb_items, 0, sizeof(vb_items));
+    cb_assert(h1->get_stats(h, NULL, "vbucket", 7,
+                         vbucket_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(vb_items[1] == 0);
+    cb_assert(vb_items[2] == 9);
+    return SUCCESS;
+}
 
-    /* Verify that it doesn't accept bogus packets. extlen is mandatory */
-    r.gat.message.header.request.extlen = 0;
-    r.gat.message.header.request.bodylen = htonl((uint32_t)keylen);
-    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
-    cb_assert(ret == ENGINE_SUCCESS);
-    cb_assert(last_response != NULL);
-    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
-    release_last_response();
+/* What the tap stats said */
+static uint64_t tap_sent;
+static uint64_t tap_percent;
+static uint64_t tap_backfills;
+static uint64_t tap_backfills_done;
+static uint64_t tap_items_sent;
+
+static void tap_stats_handler(const char *key, const uint16_t klen,
+                              const char *val, const uint32_t vlen,
+                              const void *cookie) {
+    char buffer[64];
+    char value[64];
+
+    cb_assert(klen < sizeof(buffer) && vlen < sizeof(value));
+    memcpy(buffer, key, klen);
+    buffer[klen] = '\0';
+    memcpy(value, val, vlen);
+    value[vlen] = '\0';
+    if (strcmp(buffer, "tap:0:sent") == 0) {
+        tap_sent = strtoull(value, NULL, 10);
+    } else if (strcmp(buffer, "tap:0:percent") == 0) {
+        tap_percent = strtoull(value, NULL, 10);
+    } else if (strcmp(buffer, "tap_backfills") == 0) {
+        tap_backfills = strtoull(value, NULL, 10);
+    } else if (strcmp(buffer, "tap_backfills_done") == 0) {
+        tap_backfills_done = strtoull(value, NULL, 10);
+    } else if (strcmp(buffer, "tap_backfill_items_sent") == 0) {
+        tap_items_sent = strtoull(value, NULL, 10);
+    }
+}
 
-    /* key is mandatory! */
-    r.gat.message.header.request.extlen = 4;
-    r.gat.message.header.request.keylen = 0;
-    r.gat.message.header.request.bodylen = htonl(4);
-    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
-    cb_assert(ret == ENGINE_SUCCESS);
-    cb_assert(last_response != NULL);
-    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
-    release_last_response();
+/*
+ * Walk the cache in batches for a tap stream, and follow its progress
+ * in the stats
+ */
+static enum test_result tap_backfill_test(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    const void *cookie = test_harness.create_cookie();
+    TAP_ITERATOR iter;
+    tap_event_t event;
+    item *it;
+    int ntap = 0;
+    int ii;
+
+    for (ii = 0; ii < 300; ++ii) {
+        char key[64];
+        uint64_t cas;
+        snprintf(key, sizeof(key), "tap_backfill_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), 10, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET,
+                            0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
 
+    iter = h1->get_tap_iterator(h, cookie, NULL, 0, 0, NULL, 0);
+    cb_assert(iter != NULL);
+    do {
+        void *es;
+        uint16_t nes, flags, vbucket;
+        uint8_t ttl;
+        uint32_t seqno;
+
+        event = iter(h, cookie, &it, &es, &nes, &ttl, &flags, &seqno,
+                     &vbucket);
+        if (event == TAP_MUTATION) {
+            h1->release(h, NULL, it);
+            if (++ntap == 150) {
+                cb_assert(h1->get_stats(h, NULL, "tap", 3,
+                                        tap_stats_handler) == ENGINE_SUCCESS);
+                cb_assert(tap_backfills == 1);
+                /* Counted a batch at a time */
+                cb_assert(tap_sent > 0 && tap_sent < 150);
+                cb_assert(tap_percent > 0 && tap_percent < 100);
+            }
+        }
+    } while (event == TAP_MUTATION);
+    cb_assert(event == TAP_DISCONNECT);
+    cb_assert(ntap == 300);
+
+    cb_assert(h1->get_stats(h, NULL, "tap", 3,
+                            tap_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(tap_sent == 300);
+    cb_assert(tap_percent == 100);
+
+    test_harness.destroy_cookie(cookie);
+    tap_backfills = 1;
+    cb_assert(h1->get_stats(h, NULL, "tap", 3,
+                            tap_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(tap_backfills == 0);
+    cb_assert(tap_backfills_done == 1);
+    cb_assert(tap_items_sent == 300);
     return SUCCESS;
 }
 
-static enum test_result gatq_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    union request {
-        protocol_binary_request_gat gat;
-        char buffer[512];
-    };
+/* What the dcp test producers got */
+static ENGINE_HANDLE *dcp_h;
+static ENGINE_HANDLE_V1 *dcp_h1;
+static int dcp_markers;
+static uint32_t dcp_marker_flags;
+static uint64_t dcp_marker_end;
+static int dcp_mutations;
+static int dcp_deletions;
+static int dcp_stream_ends;
+static uint64_t dcp_last_seqno;
+static char dcp_last_key[64];
+static uint64_t dcp_uuid;
+
+static ENGINE_ERROR_CODE dcp_test_failover_log(vbucket_failover_t *entries,
+                                               size_t nentries,
+                                               const void *cookie) {
+    cb_assert(nentries == 1);
+    dcp_uuid = entries[0].uuid;
+    return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE dcp_test_marker(const void *cookie, uint32_t opaque,
+                                         uint16_t vbucket, uint64_t start_seqno,
+                                         uint64_t end_seqno, uint32_t flags) {
+    cb_assert(start_seqno <= end_seqno);
+    dcp_markers++;
+    dcp_marker_flags = flags;
+    dcp_marker_end = end_seqno;
+    return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE dcp_test_mutation(const void* cookie, uint32_t opaque,
+                                           item *it, uint16_t vbucket,
+                                           uint64_t by_seqno, uint64_t rev_seqno,
+                                           uint32_t lock_time, const void *meta,
+                                           uint16_t nmeta, uint8_t nru) {
+    item_info info;
+    info.nvalue = 1;
+    cb_assert(dcp_h1->get_item_info(dcp_h, NULL, it, &info) == true);
+    cb_assert(info.nkey < sizeof(dcp_last_key));
+    memcpy(dcp_last_key, info.key, info.nkey);
+    dcp_last_key[info.nkey] = '\0';
+    cb_assert(by_seqno != 0 && by_seqno <= dcp_marker_end);
+    dcp_h1->release(dcp_h, NULL, it);
+    dcp_mutations++;
+    dcp_last_seqno = by_seqno;
+    return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE dcp_test_deletion(const void* cookie, uint32_t opaque,
+                                           const void *key, uint16_t nkey,
+                                           uint64_t cas, uint16_t vbucket,
+                                           uint64_t by_seqno, uint64_t rev_seqno,
+                                           const void *meta, uint16_t nmeta) {
+    cb_assert(nkey < sizeof(dcp_last_key));
+    memcpy(dcp_last_key, key, nkey);
+    dcp_last_key[nkey] = '\0';
+    dcp_deletions++;
+    dcp_last_seqno = by_seqno;
+    return ENGINE_SUCCESS;
+}
+
+static ENGINE_ERROR_CODE dcp_test_stream_end(const void *cookie, uint32_t opaque,
+                                             uint16_t vbucket, uint32_t flags) {
+    dcp_stream_ends++;
+    return ENGINE_SUCCESS;
+}
 
+/* Step until the engine has got nothing more to send */
+static void dcp_test_drain(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                           const void *cookie) {
+    struct dcp_message_producers producers;
     ENGINE_ERROR_CODE ret;
-    item *item = NULL;
-    void *key = "get_test_key";
-    size_t keylen = strlen(key);
-    union request r;
-    memset(r.buffer, 0, sizeof(r));
-    r.gat.message.header.request.magic = PROTOCOL_BINARY_REQ;
-    r.gat.message.header.request.opcode = PROTOCOL_BINARY_CMD_GATQ;
-    r.gat.message.header.request.keylen = htons((uint16_t)keylen);
-    r.gat.message.header.request.extlen = 4;
-    r.gat.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
-    r.gat.message.header.request.vbucket = 0;
-    r.gat.message.header.request.bodylen = htonl((uint32_t)keylen + 4);
-    r.gat.message.header.request.opaque = 0xdeadbeef;
-    r.gat.message.header.request.cas = 0;
-    r.gat.message.body.expiration = htonl(10);
+    int ii;
 
-    memcpy(r.buffer + sizeof(r.gat.bytes), key, keylen);
-    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
+    memset(&producers, 0, sizeof(producers));
+    producers.marker = dcp_test_marker;
+    producers.mutation = dcp_test_mutation;
+    producers.deletion = dcp_test_deletion;
+    producers.expiration = dcp_test_deletion;
+    producers.stream_end = dcp_test_stream_end;
+
+    dcp_markers = dcp_mutations = dcp_deletions = dcp_stream_ends = 0;
+    for (ii = 0; ii < 1000; ++ii) {
+        ret = h1->dcp.step(h, cookie, &producers);
+        if (ret != ENGINE_WANT_MORE) {
+            break;
+        }
+    }
     cb_assert(ret == ENGINE_SUCCESS);
+}
 
-    /* GATQ is quiet and should not produce any result */
-    cb_assert(last_response == NULL);
+static void dcp_test_store(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                           const char *key) {
+    item *it;
+    uint64_t cas;
+    cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), 10, 0, 0,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+}
 
-    /* store and get a key */
-    cb_assert(get_test(h, h1) == SUCCESS);
+/*
+ * Stream a vbucket: a backfill of what's in the cache (the log is too
+ * short to hold it), followed by the changes as they come in, and a
+ * stream resumed from the log
+ */
+static enum test_result dcp_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const void *cookie = test_harness.create_cookie();
+    uint64_t rollback = 0;
+    uint64_t cas = 0;
+    int ii;
 
-    /* Set expiry time to 10 secs.. */
-    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
-    cb_assert(ret == ENGINE_SUCCESS);
+    dcp_h = h;
+    dcp_h1 = h1;
+    for (ii = 0; ii < 10; ++ii) {
+        char key[64];
+        snprintf(key, sizeof(key), "dcp_%d", ii);
+        dcp_test_store(h, h1, key);
+    }
+    /* seqno 11 */
+    dcp_test_store(h, h1, "dcp_0");
+
+    cb_assert(h1->dcp.open(h, cookie, 0, 0, DCP_OPEN_PRODUCER,
+                           "test", 4) == ENGINE_SUCCESS);
+    cb_assert(h1->dcp.stream_req(h, cookie, 0, 1, 0, 0, (uint64_t)-1, 0, 0, 0,
+                                 &rollback,
+                                 dcp_test_failover_log) == ENGINE_SUCCESS);
+    cb_assert(dcp_uuid != 0);
+    cb_assert(h1->dcp.stream_req(h, cookie, 0, 1, 0, 0, (uint64_t)-1, 0, 0, 0,
+                                 &rollback,
+                                 dcp_test_failover_log) == ENGINE_KEY_EEXISTS);
+
+    dcp_test_drain(h, h1, cookie);
+    cb_assert(dcp_markers == 1);
+    cb_assert(dcp_marker_flags == 0x02);
+    cb_assert(dcp_marker_end == 11);
+    cb_assert(dcp_mutations == 10);
+
+    /* The notifier wakes the paused connection up */
+    test_harness.lock_cookie(cookie);
+    cb_assert(h1->remove(h, NULL, "dcp_1", 5, &cas, 0) == ENGINE_SUCCESS);
+    test_harness.waitfor_cookie(cookie);
+    test_harness.unlock_cookie(cookie);
+    dcp_test_store(h, h1, "dcp_new");
+
+    dcp_test_drain(h, h1, cookie);
+    cb_assert(dcp_markers >= 1);
+    cb_assert(dcp_marker_flags == 0x01);
+    cb_assert(dcp_deletions == 1);
+    cb_assert(dcp_mutations == 1);
+    cb_assert(dcp_last_seqno == 13);
+    cb_assert(strcmp(dcp_last_key, "dcp_new") == 0);
+
+    cb_assert(h1->dcp.close_stream(h, cookie, 1, 0) == ENGINE_SUCCESS);
+    cb_assert(h1->dcp.close_stream(h, cookie, 1, 0) == ENGINE_KEY_ENOENT);
+
+    /* Someone else's history, and one picked up from the log */
+    cb_assert(h1->dcp.stream_req(h, cookie, 0, 1, 0, 11, (uint64_t)-1,
+                                 dcp_uuid + 1, 11, 11, &rollback,
+                                 dcp_test_failover_log) == ENGINE_ROLLBACK);
+    cb_assert(rollback == 0);
+    cb_assert(h1->dcp.stream_req(h, cookie, 0, 1, 0, 11, 13, dcp_uuid,
+                                 11, 11, &rollback,
+                                 dcp_test_failover_log) == ENGINE_SUCCESS);
+    dcp_test_drain(h, h1, cookie);
+    cb_assert(dcp_deletions == 1);
+    cb_assert(dcp_mutations == 1);
+    cb_assert(dcp_stream_ends == 1);
+
+    test_harness.destroy_cookie(cookie);
+    return SUCCESS;
+}
+
+static void dcp_test_set_vbucket(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                 uint16_t vbucket, vbucket_state_t state) {
+    protocol_binary_request_set_vbucket req;
+
+    memset(&req, 0, sizeof(req));
+    req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    req.message.header.request.opcode = PROTOCOL_BINARY_CMD_SET_VBUCKET;
+    req.message.header.request.vbucket = htons(vbucket);
+    req.message.header.request.bodylen = htonl(sizeof(state));
+    req.message.body.state = htonl(state);
+    cb_assert(h1->unknown_command(h, NULL, &req.message.header,
+                                  response_handler) == ENGINE_SUCCESS);
     cb_assert(last_response != NULL);
-    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
-    cb_assert(last_response->response.keylen == 0);
-    cb_assert(last_response->response.extlen == 4);
-    cb_assert(ntohl(last_response->response.bodylen) == 5); /* get_test sets 1 byte datalen */
+    cb_assert(ntohs(last_response->response.status) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
     release_last_response();
+}
 
-    /* time-travel 11 secs.. */
-    test_harness.time_travel(11);
+static bool dcp_test_cached(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                            const char *key, uint16_t vbucket) {
+    item *it;
+    if (h1->get(h, NULL, &it, key, (int)strlen(key),
+                vbucket) != ENGINE_SUCCESS) {
+        return false;
+    }
+    h1->release(h, NULL, it);
+    return true;
+}
 
-    /* The item should have expired now... */
-    cb_assert(h1->get(h, NULL, &item, key, (int)keylen, 0) == ENGINE_KEY_ENOENT);
+/*
+ * Feed a replica vbucket through a consumer: the mutations of a snapshot
+ * go in together at its end, and a takeover stores what's held back
+ * before the vbucket is served
+ */
+static enum test_result dcp_consumer_test(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    const void *cookie = test_harness.create_cookie();
+    uint64_t rollback = 0;
+    item *it;
+    item_info info;
+
+    dcp_test_set_vbucket(h, h1, 1, vbucket_state_replica);
+    cb_assert(h1->dcp.open(h, cookie, 0, 0, 0, "test", 4) == ENGINE_SUCCESS);
+    cb_assert(h1->dcp.stream_req(h, cookie, 0, 1, 0, 0, (uint64_t)-1, 0, 0, 0,
+                                 &rollback,
+                                 dcp_test_failover_log) == ENGINE_EINVAL);
+
+    /* We only take changes for the vbuckets we don't serve */
+    cb_assert(h1->dcp.snapshot_marker(h, cookie, 1, 0, 1, 3,
+                                      0x01) == ENGINE_NOT_MY_VBUCKET);
+    cb_assert(h1->dcp.snapshot_marker(h, cookie, 1, 1, 1, 3,
+                                      0x01) == ENGINE_SUCCESS);
+    cb_assert(h1->dcp.mutation(h, cookie, 1, "dcp_c1", 6, "one", 3, 1, 1,
+                               0x01020304, PROTOCOL_BINARY_RAW_BYTES, 1, 1,
+                               0, 0, NULL, 0, 0) == ENGINE_SUCCESS);
+    cb_assert(h1->dcp.mutation(h, cookie, 1, "dcp_c2", 6, "two", 3, 2, 1,
+                               0, PROTOCOL_BINARY_RAW_BYTES, 2, 1,
+                               0, 0, NULL, 0, 0) == ENGINE_SUCCESS);
+    /* Held back until the end of the snapshot (the keys are shared) */
+    cb_assert(!dcp_test_cached(h, h1, "dcp_c1", 0));
+    cb_assert(h1->dcp.mutation(h, cookie, 1, "dcp_c3", 6, "three", 5, 3, 1,
+                               0, PROTOCOL_BINARY_RAW_BYTES, 3, 1,
+                               0, 0, NULL, 0, 0) == ENGINE_SUCCESS);
+    cb_assert(dcp_test_cached(h, h1, "dcp_c1", 0));
+    cb_assert(dcp_test_cached(h, h1, "dcp_c2", 0));
+    cb_assert(dcp_test_cached(h, h1, "dcp_c3", 0));
+
+    cb_assert(h1->dcp.snapshot_marker(h, cookie, 1, 1, 4, 10,
+                                      0x01) == ENGINE_SUCCESS);
+    cb_assert(h1->dcp.deletion(h, cookie, 1, "dcp_c2", 6, 0, 1, 4, 1,
+                               NULL, 0) == ENGINE_SUCCESS);
+    cb_assert(!dcp_test_cached(h, h1, "dcp_c2", 0));
+    cb_assert(h1->dcp.mutation(h, cookie, 1, "dcp_c4", 6, "four", 4, 5, 1,
+                               0, PROTOCOL_BINARY_RAW_BYTES, 5, 1,
+                               0, 0, NULL, 0, 0) == ENGINE_SUCCESS);
+    cb_assert(!dcp_test_cached(h, h1, "dcp_c4", 0));
+
+    /* Promoted with everything we got */
+    cb_assert(h1->dcp.set_vbucket_state(h, cookie, 1, 1,
+                                        vbucket_state_active) == ENGINE_SUCCESS);
+    cb_assert(dcp_test_cached(h, h1, "dcp_c4", 1));
+    cb_assert(h1->get(h, NULL, &it, "dcp_c1", 6, 1) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, it, &info));
+    cb_assert(info.nbytes == 3);
+    cb_assert(memcmp(info.value[0].iov_base, "one", 3) == 0);
+    cb_assert(info.flags == htonl(0x01020304));
+    h1->release(h, NULL, it);
+    cb_assert(h1->dcp.mutation(h, cookie, 1, "dcp_c5", 6, "five", 4, 6, 1,
+                               0, PROTOCOL_BINARY_RAW_BYTES, 6, 1,
+                               0, 0, NULL, 0, 0) == ENGINE_NOT_MY_VBUCKET);
 
-    /* Verify that it doesn't accept bogus packets. extlen is mandatory */
-    r.gat.message.header.request.extlen = 0;
-    r.gat.message.header.request.bodylen = htonl((uint32_t)keylen);
-    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
-    cb_assert(ret == ENGINE_SUCCESS);
-    cb_assert(last_response != NULL);
-    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    test_harness.destroy_cookie(cookie);
+    return SUCCESS;
+}
+
+/* What the scrub stats said */
+static bool scrub_running;
+static uint64_t scrub_visited;
+static uint64_t scrub_cleaned;
+static uint64_t scrub_threads;
+static uint64_t scrub_percent;
+
+static void scrub_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    char buffer[64];
+    char value[64];
+
+    cb_assert(klen < sizeof(buffer) && vlen < sizeof(value));
+    memcpy(buffer, key, klen);
+    buffer[klen] = '\0';
+    memcpy(value, val, vlen);
+    value[vlen] = '\0';
+    if (strcmp(buffer, "scrubber:status") == 0) {
+        scrub_running = strcmp(value, "running") == 0;
+    } else if (strcmp(buffer, "scrubber:visited") == 0) {
+        scrub_visited = strtoull(value, NULL, 10);
+    } else if (strcmp(buffer, "scrubber:cleaned") == 0) {
+        scrub_cleaned = strtoull(value, NULL, 10);
+    } else if (strcmp(buffer, "scrubber:threads") == 0) {
+        scrub_threads = strtoull(value, NULL, 10);
+    } else if (strcmp(buffer, "scrubber:percent") == 0) {
+        scrub_percent = strtoull(value, NULL, 10);
+    }
+}
+
+/*
+ * Verify that the scrubber workers split the slab classes between them
+ * and reclaim all of the expired items, and that a second scrub can't
+ * start while one is running
+ */
+static enum test_result scrub_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    protocol_binary_request_header req;
+    char key[32];
+    int ii;
+
+    for (ii = 0; ii < 100; ++ii) {
+        item *it;
+        uint64_t cas;
+        int len = sprintf(key, "scrub_%d", ii);
+        /* Spread them over the slab classes */
+        cb_assert(h1->allocate(h, NULL, &it, key, len, 10 + (ii % 10) * 1000,
+                               0, (ii % 2) ? 5 : 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET,
+                            0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+    test_harness.time_travel(10);
+
+    memset(&req, 0, sizeof(req));
+    req.request.magic = PROTOCOL_BINARY_REQ;
+    req.request.opcode = PROTOCOL_BINARY_CMD_SCRUB;
+    cb_assert(h1->unknown_command(h, NULL, &req,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(ntohs(last_response->response.status) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
     release_last_response();
 
-    /* key is mandatory! */
-    r.gat.message.header.request.extlen = 4;
-    r.gat.message.header.request.keylen = 0;
-    r.gat.message.header.request.bodylen = htonl(4);
-    ret = h1->unknown_command(h, NULL, &r.gat.message.header, response_handler);
-    cb_assert(ret == ENGINE_SUCCESS);
-    cb_assert(last_response != NULL);
-    cb_assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    /* We're limited to 400 items a second, so it's still at it */
+    cb_assert(h1->unknown_command(h, NULL, &req,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(ntohs(last_response->response.status) ==
+              PROTOCOL_BINARY_RESPONSE_EBUSY);
     release_last_response();
 
+    do {
+        usleep(10000);
+        cb_assert(h1->get_stats(h, NULL, "scrub", 5,
+                                scrub_stats_handler) == ENGINE_SUCCESS);
+    } while (scrub_running);
+
+    cb_assert(scrub_threads == 3);
+    cb_assert(scrub_visited == 100);
+    cb_assert(scrub_cleaned == 50);
+    cb_assert(scrub_percent == 100);
+
+    for (ii = 0; ii < 100; ++ii) {
+        item *it;
+        int len = sprintf(key, "scrub_%d", ii);
+        if (ii % 2) {
+            cb_assert(h1->get(h, NULL, &it, key, len, 0) == ENGINE_KEY_ENOENT);
+        } else {
+            cb_assert(h1->get(h, NULL, &it, key, len, 0) == ENGINE_SUCCESS);
+            h1->release(h, NULL, it);
+        }
+    }
     return SUCCESS;
 }
 
@@ -823,6 +3689,271 @@ static enum test_result test_datatype(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static void namespace_store(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                            const char *key) {
+    item *it = NULL;
+    uint64_t cas = 0;
+
+    cb_assert(h1->allocate(h, NULL, &it, key, strlen(key), 10, 0, 0,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+}
+
+static bool namespace_hit(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                          const char *key) {
+    item *it = NULL;
+    ENGINE_ERROR_CODE ret = h1->get(h, NULL, &it, key, (int)strlen(key), 0);
+
+    if (ret == ENGINE_SUCCESS) {
+        h1->release(h, NULL, it);
+        return true;
+    }
+    cb_assert(ret == ENGINE_KEY_ENOENT);
+    return false;
+}
+
+static uint64_t namespace_invalidate(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                     const char *name) {
+    union {
+        protocol_binary_request_namespace_invalidate req;
+        char buffer[512];
+    } r;
+    uint16_t nname = (uint16_t)strlen(name);
+    uint64_t generation;
+
+    memset(r.buffer, 0, sizeof(r));
+    r.req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.req.message.header.request.opcode =
+        PROTOCOL_BINARY_CMD_NAMESPACE_INVALIDATE;
+    r.req.message.header.request.keylen = htons(nname);
+    r.req.message.header.request.bodylen = htonl(nname);
+    memcpy(r.buffer + sizeof(r.req.bytes), name, nname);
+    cb_assert(h1->unknown_command(h, NULL, &r.req.message.header,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    cb_assert(ntohs(last_response->response.status) ==
+              PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(ntohl(last_response->response.bodylen) == sizeof(generation));
+    memcpy(&generation, last_response + 1, sizeof(generation));
+    release_last_response();
+    return ntohll(generation);
+}
+
+/*
+ * Verify that invalidating a namespace makes misses of the keys in it
+ * (and only of those), and that the keys stored after it are hits
+ */
+static enum test_result namespace_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    namespace_store(h, h1, "user:1");
+    namespace_store(h, h1, "user:2");
+    namespace_store(h, h1, "session:1");
+    namespace_store(h, h1, "user");
+
+    cb_assert(namespace_invalidate(h, h1, "user") == 1);
+    cb_assert(!namespace_hit(h, h1, "user:1"));
+    cb_assert(!namespace_hit(h, h1, "user:2"));
+    cb_assert(namespace_hit(h, h1, "session:1"));
+    cb_assert(namespace_hit(h, h1, "user"));
+
+    namespace_store(h, h1, "user:1");
+    cb_assert(namespace_hit(h, h1, "user:1"));
+    cb_assert(namespace_invalidate(h, h1, "user") == 2);
+    cb_assert(!namespace_hit(h, h1, "user:1"));
+    cb_assert(namespace_invalidate(h, h1, "session") == 1);
+    cb_assert(!namespace_hit(h, h1, "session:1"));
+    cb_assert(namespace_hit(h, h1, "user"));
+
+    return SUCCESS;
+}
+
+/* The response is left in last_response */
+static protocol_binary_response_status get_random_key(ENGINE_HANDLE *h,
+                                                      ENGINE_HANDLE_V1 *h1) {
+    protocol_binary_request_get_random_key req;
+    protocol_binary_response_status ret;
+
+    memset(&req, 0, sizeof(req));
+    req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    req.message.header.request.opcode = PROTOCOL_BINARY_CMD_GET_RANDOM_KEY;
+    cb_assert(h1->unknown_command(h, NULL, &req.message.header,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    ret = ntohs(last_response->response.status);
+    return ret;
+}
+
+/*
+ * Verify that sampling (and get random key) picks live items, more than
+ * one of them, and nothing once they are gone
+ */
+static enum test_result sample_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *items[20];
+    item_info info;
+    const char *key;
+    int found;
+    bool mixed = false;
+    int ii;
+
+    cb_assert(h1->sample != NULL);
+    cb_assert(h1->sample(h, NULL, items, 20, &found) == ENGINE_KEY_ENOENT);
+    /* See flush_test */
+    test_harness.time_travel(3);
+    cb_assert(get_random_key(h, h1) == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+    release_last_response();
+
+    for (ii = 0; ii < 10; ++ii) {
+        char name[64];
+        snprintf(name, sizeof(name), "sample_%d", ii);
+        namespace_store(h, h1, name);
+    }
+
+    cb_assert(h1->sample(h, NULL, items, 20, &found) == ENGINE_SUCCESS);
+    cb_assert(found == 20);
+    for (ii = 0; ii < found; ++ii) {
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, items[ii], &info) == true);
+        cb_assert(info.nkey > 7 && memcmp(info.key, "sample_", 7) == 0);
+        if (items[ii] != items[0]) {
+            mixed = true;
+        }
+    }
+    for (ii = 0; ii < found; ++ii) {
+        h1->release(h, NULL, items[ii]);
+    }
+    cb_assert(mixed);
+
+    cb_assert(get_random_key(h, h1) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    cb_assert(last_response->response.extlen == 4);
+    cb_assert(ntohs(last_response->response.keylen) > 7);
+    key = (const char*)(last_response + 1) + 4;
+    cb_assert(memcmp(key, "sample_", 7) == 0);
+    release_last_response();
+
+    cb_assert(h1->flush(h, NULL, 0) == ENGINE_SUCCESS);
+    cb_assert(h1->sample(h, NULL, items, 20, &found) == ENGINE_KEY_ENOENT);
+
+    return SUCCESS;
+}
+
+#define SNAPSHOT_TEST_FILE "/tmp/basic_engine_testsuite_snapshot"
+
+static bool snapshot_running;
+static uint64_t snapshot_loaded;
+static uint64_t snapshot_skipped;
+static void snapshot_stats_handler(const char *key, const uint16_t klen,
+                                   const char *val, const uint32_t vlen,
+                                   const void *cookie) {
+    char buffer[1024];
+
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 15 && memcmp(key, "snapshot_status", klen) == 0) {
+        snapshot_running = strcmp(buffer, "running") == 0;
+    } else if (klen == 21 && memcmp(key, "snapshot_items_loaded", klen) == 0) {
+        snapshot_loaded = strtoull(buffer, NULL, 10);
+    } else if (klen == 22 && memcmp(key, "snapshot_items_skipped", klen) == 0) {
+        snapshot_skipped = strtoull(buffer, NULL, 10);
+    }
+}
+
+static protocol_binary_response_status snapshot_request(ENGINE_HANDLE *h,
+                                                        ENGINE_HANDLE_V1 *h1) {
+    protocol_binary_request_snapshot req;
+    protocol_binary_response_status ret;
+
+    memset(&req, 0, sizeof(req));
+    req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    req.message.header.request.opcode = PROTOCOL_BINARY_CMD_SNAPSHOT;
+    cb_assert(h1->unknown_command(h, NULL, &req.message.header,
+                                  response_handler) == ENGINE_SUCCESS);
+    cb_assert(last_response != NULL);
+    ret = ntohs(last_response->response.status);
+    release_last_response();
+    return ret;
+}
+
+/*
+ * Verify that the items written to a snapshot (chunked ones too) are
+ * loaded by the next engine, and that the ones expired by then aren't
+ */
+static enum test_result snapshot_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    union {
+        item_info info;
+        char bytes[sizeof(item_info) + 15 * sizeof(struct iovec)];
+    } holder;
+    uint64_t cas;
+    item *it;
+    int ii;
+
+    unlink(SNAPSHOT_TEST_FILE);
+    for (ii = 0; ii < 32; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "snapshot_%d", ii);
+        cb_assert(h1->allocate(h, NULL, &it, key, keylen, 100 * ii, ii, 0,
+                            PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        holder.info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+        fill_item_value(&holder.info, 0);
+        cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+
+    cb_assert(h1->allocate(h, NULL, &it, "snapshot_chunked", 16, 100000, 0, 0,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    holder.info.nvalue = 16;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.nvalue > 1);
+    fill_item_value(&holder.info, 0);
+    cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    cb_assert(h1->allocate(h, NULL, &it, "snapshot_expired", 16, 10, 0, 5,
+                        PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    cb_assert(snapshot_request(h, h1) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    do {
+        usleep(10000);
+        cb_assert(h1->get_stats(h, NULL, "snapshot", 8,
+                             snapshot_stats_handler) == ENGINE_SUCCESS);
+    } while (snapshot_running);
+
+    test_harness.time_travel(11);
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path,
+                               test_harness.get_current_testcase()->cfg,
+                               true, false);
+    cb_assert(h1->get_stats(h, NULL, "snapshot", 8,
+                         snapshot_stats_handler) == ENGINE_SUCCESS);
+    cb_assert(snapshot_loaded == 33);
+    cb_assert(snapshot_skipped == 1);
+
+    for (ii = 0; ii < 32; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "snapshot_%d", ii);
+        cb_assert(h1->get(h, NULL, &it, key, (int)keylen, 0) == ENGINE_SUCCESS);
+        holder.info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+        cb_assert(holder.info.nbytes == 100 * ii);
+        cb_assert(holder.info.flags == (uint32_t)ii);
+        cb_assert(check_item_value(&holder.info));
+        h1->release(h, NULL, it);
+    }
+
+    cb_assert(h1->get(h, NULL, &it, "snapshot_chunked", 16, 0) == ENGINE_SUCCESS);
+    holder.info.nvalue = 16;
+    cb_assert(h1->get_item_info(h, NULL, it, &holder.info) == true);
+    cb_assert(holder.info.nbytes == 100000);
+    cb_assert(check_item_value(&holder.info));
+    h1->release(h, NULL, it);
+
+    cb_assert(h1->get(h, NULL, &it, "snapshot_expired", 16, 0) == ENGINE_KEY_ENOENT);
+
+    unlink(SNAPSHOT_TEST_FILE);
+    return SUCCESS;
+}
+
 MEMCACHED_PUBLIC_API
 engine_test_t* get_tests(void) {
     static engine_test_t tests[]  = {
@@ -837,24 +3968,116 @@ engine_test_t* get_tests(void) {
         {"prepend test", prepend_test, NULL, NULL, NULL},
         {"store test", store_test, NULL, NULL, NULL},
         {"get test", get_test, NULL, NULL, NULL},
+        {"get with info test", get_with_info_test, NULL, NULL, NULL},
         {"expiry test", expiry_test, NULL, NULL, NULL},
+        {"get multi test", get_multi_test, NULL, NULL, NULL},
+        {"store multi test", store_multi_test, NULL, NULL, NULL},
         {"remove test", remove_test, NULL, NULL, NULL},
         {"release test", release_test, NULL, NULL, NULL},
         {"incr test", incr_test, NULL, NULL, NULL},
         {"mt incr test", mt_incr_test, NULL, NULL, NULL},
+        {"native counter test", native_counter_test, NULL, NULL,
+         "native_counters=true"},
+        {"mt incr test (native counters)", mt_incr_test, NULL, NULL,
+         "native_counters=true"},
+        {"mt store test", mt_store_test, NULL, NULL, NULL},
+        {"mt store test (tagged assoc)", mt_store_test, NULL, NULL,
+         "tagged_assoc=true"},
+        {"mt get test", mt_get_test, NULL, NULL, "hashpower=4"},
+        {"mt get test (lockless get)", mt_get_test, NULL, NULL,
+         "lockless_get=true;hashpower=4"},
+        {"mt get test (lockless get, tagged assoc)", mt_get_test, NULL,
+         NULL, "lockless_get=true;tagged_assoc=true;hashpower=4"},
         {"decr test", decr_test, NULL, NULL, NULL},
         {"flush test", flush_test, NULL, NULL, NULL},
+        {"flush generation test", flush_generation_test, NULL, NULL, NULL},
+        {"flush generation test without cas", flush_generation_test, NULL,
+         NULL, "use_cas=false"},
         {"get item info test", get_item_info_test, NULL, NULL, NULL},
         {"set cas test", item_set_cas_test, NULL, NULL, NULL},
         {"LRU test", lru_test, NULL, NULL, "cache_size=48"},
+        {"mt LRU test", mt_lru_test, NULL, NULL, "cache_size=48"},
+        {"gdsf eviction test", gdsf_eviction_test, NULL, NULL,
+         "cache_size=48;eviction_policy=gdsf"},
+        {"tiny items test", tiny_items_test, NULL, NULL,
+         "cache_size=48;tiny_items=96"},
+        {"slab sizes test", slab_sizes_test, NULL, NULL,
+         "slab_sizes_auto=true"},
+        {"segmented LRU test", lru_segment_test, NULL, NULL, NULL},
+        {"temp LRU test", temp_lru_test, NULL, NULL,
+         "cache_size=48;temporary_ttl=60"},
+        {"free chunk reserve test", free_chunk_reserve_test, NULL, NULL,
+         "cache_size=48;free_chunk_reserve=2;lru_segmented=false"},
+        {"LRU crawler test", lru_crawler_test, NULL, NULL,
+         "lru_crawler_interval=1;lru_segmented=false"},
+        {"item histogram test", item_histogram_test, NULL, NULL,
+         "lru_crawler_interval=1;lru_segmented=false"},
+        {"expiry wheel test", expiry_wheel_test, NULL, NULL,
+         "expiry_wheel=true;lru_crawler=false;lru_segmented=false"},
+        {"assoc resize test", assoc_resize_test, NULL, NULL, "hashpower=4"},
+        {"assoc resize test (tagged assoc)", assoc_resize_test, NULL, NULL,
+         "hashpower=4;tagged_assoc=true"},
         {"get stats test", get_stats_test, NULL, NULL, NULL},
         {"reset stats test", reset_stats_test, NULL, NULL, NULL},
         {"get stats struct test", get_stats_struct_test, NULL, NULL, NULL},
         {"aggregate stats test", aggregate_stats_test, NULL, NULL, NULL},
         {"touch", touch_test, NULL, NULL, NULL},
+        {"touch api", touch_api_test, NULL, NULL, NULL},
         {"Get And Touch", gat_test, NULL, NULL, NULL},
         {"Get And Touch Quiet", gatq_test, NULL, NULL, NULL},
         {"Test datatype", test_datatype, NULL, NULL, NULL},
+        {"slab reassign test", slab_reassign_test, NULL, NULL,
+         "slab_reassign=true"},
+        {"slab defrag test", slab_defrag_test, NULL, NULL,
+         "slab_reassign=true;slab_defrag_pct=50"},
+        {"slab madvise test", slab_madvise_test, NULL, NULL,
+         "slab_reassign=true;slab_madvise=true"},
+        {"mem limit test", mem_limit_test, NULL, NULL,
+         "slab_reassign=true"},
+        {"chunked item test", chunked_item_test, NULL, NULL,
+         "slab_chunk_max=16384"},
+        {"append in place test", append_in_place_test, NULL, NULL,
+         "slab_chunk_max=16384"},
+        {"patch test", patch_test, NULL, NULL, "slab_chunk_max=16384"},
+        {"compression test", compression_test, NULL, NULL,
+         "compression_threshold=16;slab_chunk_max=2048"},
+        {"extstore test", extstore_test, NULL, NULL,
+         "ext_path=" EXT_TEST_FILE ";ext_size=65536;ext_page_size=8192;"
+         "ext_item_size=512;ext_recache_rate=0"},
+        {"extstore miss test", extstore_miss_test, NULL, NULL,
+         "ext_path=" EXT_TEST_FILE ";ext_size=65536;ext_page_size=8192;"
+         "ext_item_size=512;ext_recache_rate=0"},
+        {"warm restart test", restart_test, NULL, NULL,
+         "restart_file=" RESTART_TEST_FILE ";cache_size=67108864;"
+         "slab_chunk_max=16384"},
+        {"hugepage arena test", hugepage_arena_test, NULL, NULL,
+         "preallocate=true;cache_size=67108864;hugepage_size=2097152;"
+         "prefault_threads=4"},
+        {"numa arena test", numa_arena_test, NULL, NULL,
+         "numa=true;cache_size=67108864"},
+        {"tap backfill test", tap_backfill_test, NULL, NULL, NULL},
+        {"tap backfill test (tiny items)", tap_backfill_test, NULL, NULL,
+         "tiny_items=96"},
+        {"dcp test", dcp_test, NULL, NULL, "dcp=true;dcp_log_size=8"},
+        {"dcp consumer test", dcp_consumer_test, NULL, NULL,
+         "dcp=true;dcp_log_size=64"},
+        {"vbucket index test", vbucket_index_test, NULL, NULL,
+         "ignore_vbucket=true;vbucket_index=true"},
+        {"vbucket index test (a lock per vbucket)", vbucket_index_test,
+         NULL, NULL,
+         "ignore_vbucket=true;vbucket_index=true;vbucket_locks=65536"},
+        {"scrub test", scrub_test, NULL, NULL,
+         "scrub_threads=3;scrub_rate=400;lru_crawler=false;"
+         "lru_segmented=false"},
+        {"namespace test", namespace_test, NULL, NULL,
+         "namespace_delimiter=:;namespace_slots=64"},
+        {"sample test", sample_test, NULL, NULL, NULL},
+        {"key prefix test", key_prefix_test, NULL, NULL, NULL},
+        {"sample test (tagged hash table)", sample_test, NULL, NULL,
+         "tagged_assoc=true"},
+        {"snapshot test", snapshot_test, NULL, NULL,
+         "snapshot_file=" SNAPSHOT_TEST_FILE ";snapshot_load=true;"
+         "slab_chunk_max=16384"},
         {NULL, NULL, NULL, NULL, NULL}
     };
     return tests;
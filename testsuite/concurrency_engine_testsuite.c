@@ -0,0 +1,710 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Tests hammering the engine from many threads at the same time. Each of
+ * them checks afterwards that the result is one that some order of the
+ * operations could have produced: no lost updates, no CAS value handed
+ * out twice and item counts matching what was stored and removed. They
+ * all run with a tiny hash table so that it keeps growing under them.
+ */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <platform/platform.h>
+#include "concurrency_engine_testsuite.h"
+
+struct test_harness test_harness;
+
+/* The number of threads each of the tests starts */
+#define NUM_THREADS 8
+
+/* The counters the arithmetic test keeps incrementing */
+#define ARITHMETIC_KEYS 4
+
+struct thread_ctx {
+    ENGINE_HANDLE *h;
+    int id;
+    /* What the thread saw, for the checks once they're all done */
+    uint64_t *values;
+    uint64_t *cas;
+    int nvalues;
+    int count;
+    /* How many of the values are of each of the counters */
+    int nresults[ARITHMETIC_KEYS];
+};
+
+/* What the engine stats said */
+static uint64_t curr_items;
+static uint64_t evictions;
+static int hash_power_level;
+static bool hash_is_resizing;
+
+static void stats_handler(const char *key, const uint16_t klen,
+                          const char *val, const uint32_t vlen,
+                          const void *cookie) {
+    char buffer[1024];
+
+    (void)cookie;
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 10 && memcmp(key, "curr_items", klen) == 0) {
+        curr_items = strtoull(buffer, NULL, 10);
+    } else if (klen == 9 && memcmp(key, "evictions", klen) == 0) {
+        evictions = strtoull(buffer, NULL, 10);
+    } else if (klen == 16 && memcmp(key, "hash_power_level", klen) == 0) {
+        hash_power_level = atoi(buffer);
+    } else if (klen == 17 && (memcmp(key, "hash_is_expanding", klen) == 0 ||
+                              memcmp(key, "hash_is_shrinking", klen) == 0)) {
+        hash_is_resizing |= atoi(buffer) != 0;
+    }
+}
+
+/* Get the stats (once the hash table is done resizing) */
+static void update_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    int ii;
+    for (ii = 0; ii < 500; ++ii) {
+        hash_is_resizing = false;
+        cb_assert(h1->get_stats(h, NULL, NULL, 0,
+                                stats_handler) == ENGINE_SUCCESS);
+        if (!hash_is_resizing) {
+            break;
+        }
+        usleep(10000);
+    }
+}
+
+static void run_threads(void (*func)(void *), struct thread_ctx *ctx,
+                        int num) {
+    cb_thread_t tid[NUM_THREADS];
+    int ii;
+
+    cb_assert(num <= NUM_THREADS);
+    for (ii = 0; ii < num; ++ii) {
+        cb_assert(cb_create_thread(&tid[ii], func, &ctx[ii], 0) == 0);
+    }
+    for (ii = 0; ii < num; ++ii) {
+        cb_assert(cb_join_thread(tid[ii]) == 0);
+    }
+}
+
+static void init_threads(ENGINE_HANDLE *h, struct thread_ctx *ctx, int num,
+                         int nvalues) {
+    int ii;
+    for (ii = 0; ii < num; ++ii) {
+        memset(&ctx[ii], 0, sizeof(ctx[ii]));
+        ctx[ii].h = h;
+        ctx[ii].id = ii;
+        ctx[ii].nvalues = nvalues;
+        if (nvalues > 0) {
+            ctx[ii].values = calloc(nvalues, sizeof(uint64_t));
+            ctx[ii].cas = calloc(nvalues, sizeof(uint64_t));
+            cb_assert(ctx[ii].values != NULL && ctx[ii].cas != NULL);
+        }
+    }
+}
+
+static void destroy_threads(struct thread_ctx *ctx, int num) {
+    int ii;
+    for (ii = 0; ii < num; ++ii) {
+        free(ctx[ii].values);
+        free(ctx[ii].cas);
+    }
+}
+
+static int compare_uint64(const void *a, const void *b) {
+    uint64_t ua = *(const uint64_t *)a;
+    uint64_t ub = *(const uint64_t *)b;
+    return ua < ub ? -1 : (ua > ub ? 1 : 0);
+}
+
+/*
+ * Put what all of the threads saw (count of them from each, starting at
+ * offset) in one sorted array
+ * @return the array (to free) and the number of values in it in total
+ */
+static uint64_t *gather(struct thread_ctx *ctx, int num, bool cas,
+                        int offset, const int *counts, int *total) {
+    uint64_t *all;
+    int ii;
+
+    *total = 0;
+    for (ii = 0; ii < num; ++ii) {
+        *total += counts ? counts[ii] : ctx[ii].count;
+    }
+    all = malloc((*total + 1) * sizeof(uint64_t));
+    cb_assert(all != NULL);
+
+    *total = 0;
+    for (ii = 0; ii < num; ++ii) {
+        int count = counts ? counts[ii] : ctx[ii].count;
+        memcpy(all + *total, (cas ? ctx[ii].cas : ctx[ii].values) + offset,
+               count * sizeof(uint64_t));
+        *total += count;
+    }
+    qsort(all, *total, sizeof(uint64_t), compare_uint64);
+    return all;
+}
+
+/*
+ * Check that the values are exactly 1, 2, ... total (so each of them was
+ * handed out once, and none was skipped)
+ */
+static void check_sequence(const uint64_t *all, int total) {
+    int ii;
+    for (ii = 0; ii < total; ++ii) {
+        cb_assert(all[ii] == (uint64_t)ii + 1);
+    }
+}
+
+/* Check that no two of the values are the same */
+static void check_unique(const uint64_t *all, int total) {
+    int ii;
+    for (ii = 1; ii < total; ++ii) {
+        cb_assert(all[ii] != all[ii - 1]);
+    }
+}
+
+/* Store the key with a value starting with the key (and nbytes long) */
+static ENGINE_ERROR_CODE store_key(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                   const char *key, size_t keylen,
+                                   size_t nbytes,
+                                   ENGINE_STORE_OPERATION operation,
+                                   uint64_t *cas) {
+    item *it = NULL;
+    item_info info;
+    ENGINE_ERROR_CODE ret;
+
+    cb_assert(nbytes >= keylen);
+    ret = h1->allocate(h, NULL, &it, key, keylen, nbytes, 0, 0,
+                       PROTOCOL_BINARY_RAW_BYTES);
+    if (ret != ENGINE_SUCCESS) {
+        return ret;
+    }
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+    cb_assert(info.value[0].iov_len >= keylen);
+    memcpy(info.value[0].iov_base, key, keylen);
+    ret = h1->store(h, NULL, it, cas, operation, 0);
+    h1->release(h, NULL, it);
+    return ret;
+}
+
+/*
+ * Check that the key is either gone or has the value store_key gave it
+ * (and not the one of some other key we raced with)
+ */
+static bool check_key(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                      const char *key, size_t keylen) {
+    item *it = NULL;
+    item_info info;
+    ENGINE_ERROR_CODE ret = h1->get(h, NULL, &it, key, (int)keylen, 0);
+
+    cb_assert(ret == ENGINE_SUCCESS || ret == ENGINE_KEY_ENOENT);
+    if (ret == ENGINE_SUCCESS) {
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+        cb_assert(info.nkey == keylen);
+        cb_assert(memcmp(info.key, key, keylen) == 0);
+        cb_assert(info.value[0].iov_len >= keylen);
+        cb_assert(memcmp(info.value[0].iov_base, key, keylen) == 0);
+        h1->release(h, NULL, it);
+    }
+    return ret == ENGINE_SUCCESS;
+}
+
+#define CAS_UPDATES 500
+
+static void mt_cas_main(void *arg) {
+    struct thread_ctx *ctx = arg;
+    ENGINE_HANDLE *h = ctx->h;
+    ENGINE_HANDLE_V1 *h1 = (ENGINE_HANDLE_V1*)ctx->h;
+    const char *key = "mt_cas_key";
+
+    while (ctx->count < ctx->nvalues) {
+        item *it = NULL;
+        item *next = NULL;
+        item_info info;
+        uint64_t value;
+        uint64_t old_cas;
+        uint64_t cas;
+        char buffer[32];
+        ENGINE_ERROR_CODE ret;
+
+        cb_assert(h1->get(h, NULL, &it, key, (int)strlen(key),
+                          0) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+        cb_assert(info.value[0].iov_len < sizeof(buffer));
+        memcpy(buffer, info.value[0].iov_base, info.value[0].iov_len);
+        buffer[info.value[0].iov_len] = '\0';
+        value = strtoull(buffer, NULL, 10) + 1;
+        old_cas = cas = info.cas;
+        h1->release(h, NULL, it);
+
+        snprintf(buffer, sizeof(buffer), "%020" PRIu64, value);
+        cb_assert(h1->allocate(h, NULL, &next, key, strlen(key), 20, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, next, &info) == true);
+        memcpy(info.value[0].iov_base, buffer, 20);
+        h1->item_set_cas(h, NULL, next, cas);
+        ret = h1->store(h, NULL, next, &cas, OPERATION_CAS, 0);
+        h1->release(h, NULL, next);
+
+        cb_assert(ret == ENGINE_SUCCESS || ret == ENGINE_KEY_EEXISTS);
+        if (ret == ENGINE_SUCCESS) {
+            /* A CAS value only ever grows */
+            cb_assert(cas > old_cas);
+            if (ctx->count > 0) {
+                cb_assert(cas > ctx->cas[ctx->count - 1]);
+            }
+            ctx->values[ctx->count] = value;
+            ctx->cas[ctx->count] = cas;
+            ++ctx->count;
+        }
+
+        /* Keep the table growing under them */
+        snprintf(buffer, sizeof(buffer), "mt_cas_%d_%d", ctx->id, ctx->count);
+        cb_assert(store_key(h, h1, buffer, strlen(buffer), strlen(buffer),
+                            OPERATION_SET, &cas) == ENGINE_SUCCESS);
+    }
+}
+
+/*
+ * Make sure that a CAS update only succeeds for one of the threads racing
+ * for the same version of the item: if an update got lost, two threads
+ * would have written the same value
+ */
+static enum test_result mt_cas_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    struct thread_ctx ctx[NUM_THREADS];
+    uint64_t cas = 0;
+    uint64_t *all;
+    int total;
+    item *it = NULL;
+    item_info info;
+
+    cb_assert(h1->allocate(h, NULL, &it, "mt_cas_key", 10, 1, 0, 0,
+                           PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+    memcpy(info.value[0].iov_base, "0", 1);
+    cb_assert(h1->store(h, NULL, it, &cas, OPERATION_SET,
+                        0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    init_threads(h, ctx, NUM_THREADS, CAS_UPDATES);
+    run_threads(mt_cas_main, ctx, NUM_THREADS);
+
+    all = gather(ctx, NUM_THREADS, false, 0, NULL, &total);
+    check_sequence(all, total);
+    free(all);
+    all = gather(ctx, NUM_THREADS, true, 0, NULL, &total);
+    check_unique(all, total);
+    free(all);
+
+    cb_assert(h1->get(h, NULL, &it, "mt_cas_key", 10, 0) == ENGINE_SUCCESS);
+    cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+    cb_assert(info.value[0].iov_len == 20);
+    cb_assert(strtoull(info.value[0].iov_base, NULL, 10) ==
+              NUM_THREADS * CAS_UPDATES);
+    h1->release(h, NULL, it);
+
+    destroy_threads(ctx, NUM_THREADS);
+    return SUCCESS;
+}
+
+#define ARITHMETIC_UPDATES 1000
+
+static void mt_arithmetic_main(void *arg) {
+    struct thread_ctx *ctx = arg;
+    ENGINE_HANDLE *h = ctx->h;
+    ENGINE_HANDLE_V1 *h1 = (ENGINE_HANDLE_V1*)ctx->h;
+    int ii;
+
+    for (ii = 0; ii < ARITHMETIC_UPDATES; ++ii) {
+        char key[32];
+        uint64_t cas = 0;
+        uint64_t res = 0;
+        int keyid = (ii + ctx->id) % ARITHMETIC_KEYS;
+
+        /* The first one to get there creates it with 1 */
+        snprintf(key, sizeof(key), "mt_arithmetic_%d", keyid);
+        cb_assert(h1->arithmetic(h, NULL, key, (int)strlen(key), true, true,
+                                 1, 1, 0, &cas, PROTOCOL_BINARY_RAW_BYTES,
+                                 &res, 0) == ENGINE_SUCCESS);
+        cb_assert(res > 0);
+        /* Recorded by the key, and sorted out once we're all done */
+        ctx->values[keyid * ARITHMETIC_UPDATES + ctx->nresults[keyid]] = res;
+        ++ctx->nresults[keyid];
+
+        /* And one that goes up and down, and never below zero */
+        cb_assert(h1->arithmetic(h, NULL, "mt_updown", 9, true, false,
+                                 2, 0, 0, &cas, PROTOCOL_BINARY_RAW_BYTES,
+                                 &res, 0) == ENGINE_SUCCESS);
+        cb_assert(res >= 2);
+        cb_assert(h1->arithmetic(h, NULL, "mt_updown", 9, false, false,
+                                 2, 0, 0, &cas, PROTOCOL_BINARY_RAW_BYTES,
+                                 &res, 0) == ENGINE_SUCCESS);
+    }
+}
+
+/*
+ * Make sure that incr and decr are atomic: every result of an incr by one
+ * is handed out once (the create included), and a counter which everyone
+ * increments before they decrement it ends up where it started
+ */
+static enum test_result mt_arithmetic_test(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    struct thread_ctx ctx[NUM_THREADS];
+    uint64_t cas = 0;
+    uint64_t res = 0;
+    int ii;
+    int jj;
+
+    cb_assert(h1->arithmetic(h, NULL, "mt_updown", 9, true, true, 0, 0, 0,
+                             &cas, PROTOCOL_BINARY_RAW_BYTES,
+                             &res, 0) == ENGINE_SUCCESS);
+
+    init_threads(h, ctx, NUM_THREADS, ARITHMETIC_KEYS * ARITHMETIC_UPDATES);
+    run_threads(mt_arithmetic_main, ctx, NUM_THREADS);
+
+    for (ii = 0; ii < ARITHMETIC_KEYS; ++ii) {
+        int counts[NUM_THREADS];
+        uint64_t *all;
+        int total;
+
+        for (jj = 0; jj < NUM_THREADS; ++jj) {
+            counts[jj] = ctx[jj].nresults[ii];
+        }
+        all = gather(ctx, NUM_THREADS, false, ii * ARITHMETIC_UPDATES,
+                     counts, &total);
+        check_sequence(all, total);
+        free(all);
+    }
+
+    cb_assert(h1->arithmetic(h, NULL, "mt_updown", 9, true, false, 0, 0, 0,
+                             &cas, PROTOCOL_BINARY_RAW_BYTES,
+                             &res, 0) == ENGINE_SUCCESS);
+    cb_assert(res == 0);
+
+    destroy_threads(ctx, NUM_THREADS);
+    return SUCCESS;
+}
+
+#define CONTENDED_KEYS 16
+#define ADD_ATTEMPTS 2000
+
+static void mt_add_remove_main(void *arg) {
+    struct thread_ctx *ctx = arg;
+    ENGINE_HANDLE *h = ctx->h;
+    ENGINE_HANDLE_V1 *h1 = (ENGINE_HANDLE_V1*)ctx->h;
+    int ii;
+
+    for (ii = 0; ii < ADD_ATTEMPTS; ++ii) {
+        char key[32];
+        char value[32];
+        item *it = NULL;
+        item_info info;
+        uint64_t cas = 0;
+        size_t keylen;
+        ENGINE_ERROR_CODE ret;
+
+        keylen = snprintf(key, sizeof(key), "mt_add_%d", ii % CONTENDED_KEYS);
+        snprintf(value, sizeof(value), "%08d", ctx->id);
+
+        cb_assert(h1->allocate(h, NULL, &it, key, keylen, 8, 0, 0,
+                               PROTOCOL_BINARY_RAW_BYTES) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+        memcpy(info.value[0].iov_base, value, 8);
+        ret = h1->store(h, NULL, it, &cas, OPERATION_ADD, 0);
+        h1->release(h, NULL, it);
+        cb_assert(ret == ENGINE_SUCCESS || ret == ENGINE_NOT_STORED);
+
+        if (ret == ENGINE_SUCCESS) {
+            /* It's ours until we remove it: nobody else may replace it */
+            ++ctx->count;
+            cb_assert(h1->get(h, NULL, &it, key, (int)keylen,
+                              0) == ENGINE_SUCCESS);
+            cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+            cb_assert(info.cas == cas);
+            cb_assert(memcmp(info.value[0].iov_base, value, 8) == 0);
+            h1->release(h, NULL, it);
+            cb_assert(h1->remove(h, NULL, key, keylen, &cas,
+                                 0) == ENGINE_SUCCESS);
+        } else if (h1->get(h, NULL, &it, key, (int)keylen,
+                           0) == ENGINE_SUCCESS) {
+            /* Someone else's, if it isn't gone by now */
+            cb_assert(h1->get_item_info(h, NULL, it, &info) == true);
+            cb_assert(info.value[0].iov_len == 8);
+            cb_assert(memcmp(info.value[0].iov_base, value, 8) != 0);
+            memcpy(value, info.value[0].iov_base, 8);
+            value[8] = '\0';
+            cb_assert(atoi(value) < NUM_THREADS);
+            h1->release(h, NULL, it);
+        }
+    }
+}
+
+/*
+ * Make sure that only one of the threads adding the same key gets to do
+ * it, and that it is the only one to see and remove it until it does
+ */
+static enum test_result mt_add_remove_test(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    struct thread_ctx ctx[NUM_THREADS];
+    int total = 0;
+    int ii;
+
+    update_stats(h, h1);
+    cb_assert(curr_items == 0);
+
+    init_threads(h, ctx, NUM_THREADS, 0);
+    run_threads(mt_add_remove_main, ctx, NUM_THREADS);
+
+    for (ii = 0; ii < NUM_THREADS; ++ii) {
+        total += ctx[ii].count;
+    }
+    cb_assert(total >= CONTENDED_KEYS);
+
+    update_stats(h, h1);
+    cb_assert(curr_items == 0);
+
+    destroy_threads(ctx, NUM_THREADS);
+    return SUCCESS;
+}
+
+#define ITEMS_PER_THREAD 1000
+
+static void mt_item_count_main(void *arg) {
+    struct thread_ctx *ctx = arg;
+    ENGINE_HANDLE *h = ctx->h;
+    ENGINE_HANDLE_V1 *h1 = (ENGINE_HANDLE_V1*)ctx->h;
+    int ii;
+
+    for (ii = 0; ii < ITEMS_PER_THREAD; ++ii) {
+        char key[32];
+        size_t keylen;
+        uint64_t cas = 0;
+
+        keylen = snprintf(key, sizeof(key), "mt_count_%d_%d", ctx->id, ii);
+        cb_assert(store_key(h, h1, key, keylen, 32, OPERATION_SET,
+                            &cas) == ENGINE_SUCCESS);
+        ++ctx->count;
+
+        /* Replacing one doesn't change the count */
+        if (ii % 5 == 0) {
+            cb_assert(store_key(h, h1, key, keylen, 64, OPERATION_REPLACE,
+                                &cas) == ENGINE_SUCCESS);
+        }
+
+        /* Removing one does */
+        if (ii % 3 == 0) {
+            cas = 0;
+            cb_assert(h1->remove(h, NULL, key, keylen, &cas,
+                                 0) == ENGINE_SUCCESS);
+            --ctx->count;
+            cb_assert(!check_key(h, h1, key, keylen));
+        }
+
+        /* And look at what the others are doing */
+        keylen = snprintf(key, sizeof(key), "mt_count_%d_%d",
+                          (ctx->id + 1) % NUM_THREADS, ii);
+        check_key(h, h1, key, keylen);
+    }
+}
+
+/*
+ * Make sure that the item count adds up to what the threads stored and
+ * removed, and that all of the items are still there, while the hash
+ * table grows under them
+ */
+static enum test_result mt_item_count_test(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    struct thread_ctx ctx[NUM_THREADS];
+    uint64_t total = 0;
+    int initial;
+    int ii;
+    int jj;
+
+    update_stats(h, h1);
+    initial = hash_power_level;
+
+    init_threads(h, ctx, NUM_THREADS, 0);
+    run_threads(mt_item_count_main, ctx, NUM_THREADS);
+
+    for (ii = 0; ii < NUM_THREADS; ++ii) {
+        total += ctx[ii].count;
+    }
+    update_stats(h, h1);
+    cb_assert(curr_items == total);
+    cb_assert(hash_power_level > initial);
+
+    for (ii = 0; ii < NUM_THREADS; ++ii) {
+        for (jj = 0; jj < ITEMS_PER_THREAD; ++jj) {
+            char key[32];
+            size_t keylen = snprintf(key, sizeof(key), "mt_count_%d_%d",
+                                     ii, jj);
+            cb_assert(check_key(h, h1, key, keylen) == (jj % 3 != 0));
+        }
+    }
+
+    destroy_threads(ctx, NUM_THREADS);
+    return SUCCESS;
+}
+
+#define EVICTION_STORES 2000
+
+static void mt_eviction_main(void *arg) {
+    struct thread_ctx *ctx = arg;
+    ENGINE_HANDLE *h = ctx->h;
+    ENGINE_HANDLE_V1 *h1 = (ENGINE_HANDLE_V1*)ctx->h;
+    int ii;
+
+    for (ii = 0; ii < EVICTION_STORES; ++ii) {
+        char key[32];
+        size_t keylen;
+        uint64_t cas = 0;
+        ENGINE_ERROR_CODE ret;
+
+        /* Half of them share the keys so the evictions hit the others */
+        keylen = snprintf(key, sizeof(key), "mt_evict_%d_%d",
+                          ctx->id % (NUM_THREADS / 2), ii);
+        ret = store_key(h, h1, key, keylen, 4096, OPERATION_SET, &cas);
+        /* We may give up on an eviction if the whole tail is busy */
+        cb_assert(ret == ENGINE_SUCCESS || ret == ENGINE_ENOMEM);
+        if (ret == ENGINE_ENOMEM) {
+            ++ctx->count;
+        }
+        check_key(h, h1, key, keylen);
+
+        keylen = snprintf(key, sizeof(key), "mt_evict_%d_%d",
+                          ctx->id % (NUM_THREADS / 2), ii / 2);
+        check_key(h, h1, key, keylen);
+    }
+}
+
+/*
+ * Make sure that an item being evicted by one thread while others read
+ * and replace it is either there with its own value, or gone
+ */
+static enum test_result mt_eviction_test(ENGINE_HANDLE *h,
+                                         ENGINE_HANDLE_V1 *h1) {
+    struct thread_ctx ctx[NUM_THREADS];
+    int failed = 0;
+    int ii;
+
+    init_threads(h, ctx, NUM_THREADS, 0);
+    run_threads(mt_eviction_main, ctx, NUM_THREADS);
+
+    /* But hardly ever */
+    for (ii = 0; ii < NUM_THREADS; ++ii) {
+        failed += ctx[ii].count;
+    }
+    cb_assert(failed < NUM_THREADS * EVICTION_STORES / 100);
+
+    update_stats(h, h1);
+    cb_assert(evictions > 0);
+    cb_assert(curr_items > 0);
+    cb_assert(curr_items < (NUM_THREADS / 2) * EVICTION_STORES);
+
+    destroy_threads(ctx, NUM_THREADS);
+    return SUCCESS;
+}
+
+#define FLUSHES 50
+
+static void mt_flush_main(void *arg) {
+    struct thread_ctx *ctx = arg;
+    ENGINE_HANDLE *h = ctx->h;
+    ENGINE_HANDLE_V1 *h1 = (ENGINE_HANDLE_V1*)ctx->h;
+    int ii;
+
+    if (ctx->id == 0) {
+        for (ii = 0; ii < FLUSHES; ++ii) {
+            cb_assert(h1->flush(h, NULL, 0) == ENGINE_SUCCESS);
+            usleep(1000);
+        }
+        return;
+    }
+
+    for (ii = 0; ii < 1000; ++ii) {
+        char key[32];
+        size_t keylen;
+        uint64_t cas = 0;
+        ENGINE_ERROR_CODE ret;
+
+        keylen = snprintf(key, sizeof(key), "mt_flush_%d", ii % 100);
+        cb_assert(store_key(h, h1, key, keylen, 32, OPERATION_SET,
+                            &cas) == ENGINE_SUCCESS);
+        check_key(h, h1, key, keylen);
+
+        /* The ones flushed away may be added again */
+        ret = store_key(h, h1, key, keylen, 32, OPERATION_ADD, &cas);
+        cb_assert(ret == ENGINE_SUCCESS || ret == ENGINE_NOT_STORED);
+    }
+}
+
+/*
+ * Make sure that flushing while others store and read doesn't hand out
+ * the wrong values, and that nothing stored before the last flush
+ * survives it
+ */
+static enum test_result mt_flush_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    struct thread_ctx ctx[NUM_THREADS];
+    int ii;
+
+    /* A flush in the first second of the engine doesn't flush anything */
+    test_harness.time_travel(3);
+    init_threads(h, ctx, NUM_THREADS, 0);
+    run_threads(mt_flush_main, ctx, NUM_THREADS);
+
+    cb_assert(h1->flush(h, NULL, 0) == ENGINE_SUCCESS);
+    for (ii = 0; ii < 100; ++ii) {
+        char key[32];
+        size_t keylen = snprintf(key, sizeof(key), "mt_flush_%d", ii);
+        cb_assert(!check_key(h, h1, key, keylen));
+    }
+
+    destroy_threads(ctx, NUM_THREADS);
+    return SUCCESS;
+}
+
+MEMCACHED_PUBLIC_API
+engine_test_t* get_tests(void) {
+    static engine_test_t tests[]  = {
+        {"mt cas test", mt_cas_test, NULL, NULL, "hashpower=4"},
+        {"mt cas test (lockless get)", mt_cas_test, NULL, NULL,
+         "lockless_get=true;hashpower=4"},
+        {"mt arithmetic test", mt_arithmetic_test, NULL, NULL,
+         "hashpower=4"},
+        {"mt arithmetic test (native counters)", mt_arithmetic_test, NULL,
+         NULL, "native_counters=true;hashpower=4"},
+        {"mt add remove test", mt_add_remove_test, NULL, NULL,
+         "hashpower=4"},
+        {"mt add remove test (lockless get, tagged assoc)",
+         mt_add_remove_test, NULL, NULL,
+         "lockless_get=true;tagged_assoc=true;hashpower=4"},
+        {"mt item count test", mt_item_count_test, NULL, NULL,
+         "hashpower=4"},
+        {"mt item count test (tagged assoc)", mt_item_count_test, NULL,
+         NULL, "tagged_assoc=true;hashpower=4"},
+        {"mt item count test (lockless get)", mt_item_count_test, NULL,
+         NULL, "lockless_get=true;hashpower=4"},
+        {"mt eviction test", mt_eviction_test, NULL, NULL,
+         "cache_size=48;lru_segmented=false;hashpower=4"},
+        {"mt eviction test (lockless get)", mt_eviction_test, NULL, NULL,
+         "lockless_get=true;cache_size=48;lru_segmented=false;hashpower=4"},
+        {"mt flush test", mt_flush_test, NULL, NULL, "hashpower=4"},
+        {"mt flush test (lockless get)", mt_flush_test, NULL, NULL,
+         "lockless_get=true;hashpower=4"},
+        {NULL, NULL, NULL, NULL, NULL}
+    };
+    return tests;
+}
+
+MEMCACHED_PUBLIC_API
+bool setup_suite(struct test_harness *th) {
+    test_harness = *th;
+    return true;
+}
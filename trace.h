@@ -44,8 +44,16 @@
 #define MEMCACHED_CONN_DESTROY_ENABLED() (0)
 #define MEMCACHED_CONN_DISPATCH(arg0, arg1)
 #define MEMCACHED_CONN_DISPATCH_ENABLED() (0)
+#define MEMCACHED_CONN_IO_COMPLETE(arg0, arg1)
+#define MEMCACHED_CONN_IO_COMPLETE_ENABLED() (0)
+#define MEMCACHED_CONN_IO_RESUME(arg0, arg1)
+#define MEMCACHED_CONN_IO_RESUME_ENABLED() (0)
 #define MEMCACHED_CONN_RELEASE(arg0)
 #define MEMCACHED_CONN_RELEASE_ENABLED() (0)
+#define MEMCACHED_ITEM_BUMP(arg0, arg1, arg2, arg3)
+#define MEMCACHED_ITEM_BUMP_ENABLED() (0)
+#define MEMCACHED_ITEM_EVICT(arg0, arg1, arg2, arg3, arg4)
+#define MEMCACHED_ITEM_EVICT_ENABLED() (0)
 #define MEMCACHED_ITEM_LINK(arg0, arg1, arg2)
 #define MEMCACHED_ITEM_LINK_ENABLED() (0)
 #define MEMCACHED_ITEM_REMOVE(arg0, arg1, arg2)
@@ -56,6 +64,8 @@
 #define MEMCACHED_ITEM_UNLINK_ENABLED() (0)
 #define MEMCACHED_ITEM_UPDATE(arg0, arg1, arg2)
 #define MEMCACHED_ITEM_UPDATE_ENABLED() (0)
+#define MEMCACHED_LOCK_WAIT(arg0, arg1)
+#define MEMCACHED_LOCK_WAIT_ENABLED() (0)
 #define MEMCACHED_PROCESS_COMMAND_END(arg0, arg1, arg2)
 #define MEMCACHED_PROCESS_COMMAND_END_ENABLED() (0)
 #define MEMCACHED_PROCESS_COMMAND_START(arg0, arg1, arg2)
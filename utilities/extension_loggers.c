@@ -1,10 +1,86 @@
 /* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <memcached/extension.h>
 #include <memcached/extension_loggers.h>
 #include <memcached/engine.h>
+#include <platform/platform.h>
+
+#ifdef WIN32
+static bool cas_uint64(volatile uint64_t *ptr, uint64_t old, uint64_t val) {
+    return InterlockedCompareExchange64((volatile LONGLONG *)ptr, val,
+                                        old) == (LONGLONG)old;
+}
+
+static void incr_uint32(volatile uint32_t *ptr) {
+    InterlockedIncrement((volatile LONG *)ptr);
+}
+
+static uint32_t swap_uint32(volatile uint32_t *ptr, uint32_t val) {
+    return (uint32_t)InterlockedExchange((volatile LONG *)ptr, val);
+}
+#elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+static bool cas_uint64(volatile uint64_t *ptr, uint64_t old, uint64_t val) {
+    return atomic_cas_64(ptr, old, val) == old;
+}
+
+static void incr_uint32(volatile uint32_t *ptr) {
+    atomic_inc_32(ptr);
+}
+
+static uint32_t swap_uint32(volatile uint32_t *ptr, uint32_t val) {
+    return atomic_swap_32(ptr, val);
+}
+#else
+static bool cas_uint64(volatile uint64_t *ptr, uint64_t old, uint64_t val) {
+    return __sync_bool_compare_and_swap(ptr, old, val);
+}
+
+static void incr_uint32(volatile uint32_t *ptr) {
+    __sync_add_and_fetch(ptr, 1);
+}
+
+static uint32_t swap_uint32(volatile uint32_t *ptr, uint32_t val) {
+    return __sync_lock_test_and_set(ptr, val);
+}
+#endif
+
+/*
+ * The limit is a token bucket kept as the time it is full again: every
+ * message moves it one interval (1/rate seconds) further into the future,
+ * and a message is suppressed if that would be more than burst intervals
+ * from now.
+ */
+bool extension_log_limit_take(EXTENSION_LOG_LIMIT *limit,
+                              uint32_t *suppressed) {
+    uint64_t interval;
+    uint64_t now;
+    uint64_t full_at;
+    uint64_t from;
+
+    if (limit->rate == 0) {
+        *suppressed = 0;
+        return true;
+    }
+
+    interval = 1000000000 / limit->rate;
+    now = (uint64_t)gethrtime();
+    do {
+        full_at = limit->full_at;
+        from = full_at > now ? full_at : now;
+        if (from - now > (uint64_t)limit->burst * interval) {
+            incr_uint32(&limit->suppressed);
+            return false;
+        }
+    } while (!cas_uint64(&limit->full_at, full_at, from + interval));
+
+    *suppressed = limit->suppressed == 0 ? 0 :
+        swap_uint32(&limit->suppressed, 0);
+    return true;
+}
 
 static EXTENSION_LOG_LEVEL current_log_level = EXTENSION_LOG_WARNING;
 SERVER_HANDLE_V1 *sapi;
@@ -32,6 +108,32 @@ static void stderror_logger_log(EXTENSION_LOG_LEVEL severity,
     }
 }
 
+static void stderror_logger_log_limited(EXTENSION_LOG_LEVEL severity,
+                                        const void* client_cookie,
+                                        EXTENSION_LOG_LIMIT *limit,
+                                        const char *fmt, ...)
+{
+    uint32_t suppressed;
+
+    (void)client_cookie;
+    if (severity >= current_log_level &&
+        extension_log_limit_take(limit, &suppressed)) {
+        size_t len = strlen(fmt);
+        bool needlf = (len > 0 && fmt[len - 1] != '\n');
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        if (needlf) {
+            fprintf(stderr, "\n");
+        }
+        if (suppressed > 0) {
+            fprintf(stderr, "%u similar messages suppressed\n", suppressed);
+        }
+        fflush(stderr);
+    }
+}
+
 static EXTENSION_LOGGER_DESCRIPTOR stderror_logger_descriptor;
 
 static void on_log_level(const void *cookie,
@@ -46,6 +148,7 @@ static void on_log_level(const void *cookie,
 EXTENSION_ERROR_CODE memcached_initialize_stderr_logger(GET_SERVER_API get_server_api) {
     stderror_logger_descriptor.get_name = stderror_get_name;
     stderror_logger_descriptor.log = stderror_logger_log;
+    stderror_logger_descriptor.log_limited = stderror_logger_log_limited;
 
     sapi = get_server_api();
     if (sapi == NULL) {
@@ -73,16 +176,30 @@ static void null_logger_log(EXTENSION_LOG_LEVEL severity,
     /* EMPTY */
 }
 
+static void null_logger_log_limited(EXTENSION_LOG_LEVEL severity,
+                                    const void* client_cookie,
+                                    EXTENSION_LOG_LIMIT *limit,
+                                    const char *fmt, ...)
+{
+    (void)severity;
+    (void)client_cookie;
+    (void)limit;
+    (void)fmt;
+    /* EMPTY */
+}
+
 static EXTENSION_LOGGER_DESCRIPTOR null_logger_descriptor;
 
 EXTENSION_LOGGER_DESCRIPTOR* get_null_logger(void) {
     null_logger_descriptor.get_name = null_get_name;
     null_logger_descriptor.log = null_logger_log;
+    null_logger_descriptor.log_limited = null_logger_log_limited;
     return &null_logger_descriptor;
 }
 
 EXTENSION_LOGGER_DESCRIPTOR* get_stderr_logger(void) {
     stderror_logger_descriptor.get_name = stderror_get_name;
     stderror_logger_descriptor.log = stderror_logger_log;
+    stderror_logger_descriptor.log_limited = stderror_logger_log_limited;
     return &stderror_logger_descriptor;
 }
@@ -248,6 +248,12 @@ const char *memcached_opcode_2_text(uint8_t opcode) {
         return "SET_CTRL_TOKEN";
     case PROTOCOL_BINARY_CMD_GET_CTRL_TOKEN:
         return "GET_CTRL_TOKEN";
+    case PROTOCOL_BINARY_CMD_SLABS_REASSIGN:
+        return "SLABS_REASSIGN";
+    case PROTOCOL_BINARY_CMD_NAMESPACE_INVALIDATE:
+        return "NAMESPACE_INVALIDATE";
+    case PROTOCOL_BINARY_CMD_SNAPSHOT:
+        return "SNAPSHOT";
     default:
         return NULL;
     }
@@ -635,6 +641,15 @@ uint8_t memcached_text_2_opcode(const char *cmd) {
     if (strcasecmp("GET_CTRL_TOKEN", cmd) == 0) {
         return (uint8_t)PROTOCOL_BINARY_CMD_GET_CTRL_TOKEN;
     }
+    if (strcasecmp("SLABS_REASSIGN", cmd) == 0) {
+        return (uint8_t)PROTOCOL_BINARY_CMD_SLABS_REASSIGN;
+    }
+    if (strcasecmp("NAMESPACE_INVALIDATE", cmd) == 0) {
+        return (uint8_t)PROTOCOL_BINARY_CMD_NAMESPACE_INVALIDATE;
+    }
+    if (strcasecmp("SNAPSHOT", cmd) == 0) {
+        return (uint8_t)PROTOCOL_BINARY_CMD_SNAPSHOT;
+    }
 
     return 0xff;
 }
@@ -1,3 +1,7 @@
+#ifdef __linux__
+/* For sched_getcpu() and the CPU_SET() macros */
+#define _GNU_SOURCE
+#endif
 #include "config.h"
 #include <stdio.h>
 #include <ctype.h>
@@ -7,6 +11,12 @@
 #include <stdarg.h>
 
 #include "memcached/util.h"
+#include "trace.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#endif
 
 /* Avoid warnings on solaris, where isspace() is an index into an array, and gcc uses signed chars */
 #define xisspace(c) isspace((unsigned char)c)
@@ -221,3 +231,275 @@ const char *memcached_protocol_errcode_2_text(protocol_binary_response_status er
         return "Unknown error code";
     }
 }
+
+#ifdef __linux__
+#define MC_NUMA_MAX_CPUS 4096
+
+/*
+ * The NUMA topology from sysfs (read once, the first time anyone asks).
+ * We don't use libnuma so that memcached doesn't depend on it.
+ */
+static struct {
+    int nodes;
+    unsigned char cpu_node[MC_NUMA_MAX_CPUS];
+} numa;
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+
+static void numa_init(void) {
+    int node;
+
+    for (node = 0; node < MC_NUMA_MAX_NODES; ++node) {
+        char path[80];
+        char list[4096];
+        char *ptr;
+        FILE *fp;
+
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+        if ((fp = fopen(path, "r")) == NULL) {
+            break;
+        }
+        if (fgets(list, sizeof(list), fp) == NULL) {
+            list[0] = '\0';
+        }
+        fclose(fp);
+
+        /* It looks like "0-3,8-11" */
+        ptr = list;
+        while (isdigit((unsigned char)*ptr)) {
+            long first = strtol(ptr, &ptr, 10);
+            long last = first;
+            long cpu;
+            if (*ptr == '-') {
+                last = strtol(ptr + 1, &ptr, 10);
+            }
+            for (cpu = first; cpu <= last && cpu < MC_NUMA_MAX_CPUS; ++cpu) {
+                numa.cpu_node[cpu] = (unsigned char)node;
+            }
+            if (*ptr == ',') {
+                ++ptr;
+            }
+        }
+    }
+    numa.nodes = node > 0 ? node : 1;
+}
+#endif
+
+int mc_numa_nodes(void) {
+#ifdef __linux__
+    pthread_once(&numa_once, numa_init);
+    return numa.nodes;
+#else
+    return 1;
+#endif
+}
+
+int mc_numa_cpu_node(int cpu) {
+#ifdef __linux__
+    pthread_once(&numa_once, numa_init);
+    if (cpu >= 0 && cpu < MC_NUMA_MAX_CPUS) {
+        return numa.cpu_node[cpu];
+    }
+#endif
+    (void)cpu;
+    return 0;
+}
+
+int mc_numa_current_node(void) {
+#ifdef __linux__
+    return mc_numa_cpu_node(sched_getcpu());
+#else
+    return 0;
+#endif
+}
+
+bool mc_numa_bind_thread(int node) {
+#ifdef __linux__
+    cpu_set_t set;
+    int cpu;
+
+    pthread_once(&numa_once, numa_init);
+    CPU_ZERO(&set);
+    for (cpu = 0; cpu < MC_NUMA_MAX_CPUS && cpu < CPU_SETSIZE; ++cpu) {
+        if (numa.cpu_node[cpu] == node) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)node;
+    return false;
+#endif
+}
+
+bool mc_bind_thread_cpus(const int *cpus, int ncpus) {
+#ifdef __linux__
+    cpu_set_t set;
+    int ii;
+
+    CPU_ZERO(&set);
+    for (ii = 0; ii < ncpus; ++ii) {
+        if (cpus[ii] < 0 || cpus[ii] >= CPU_SETSIZE) {
+            return false;
+        }
+        CPU_SET(cpus[ii], &set);
+    }
+    return ncpus > 0 && sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    (void)ncpus;
+    return false;
+#endif
+}
+
+/* See mc_mutex_stats_init */
+static struct {
+    unsigned int sample;
+    bool initialized;
+    cb_mutex_t mutex;
+    mc_mutex_stats_t *list;
+} mutex_stats;
+
+void mc_mutex_stats_init(unsigned int sample) {
+    if (!mutex_stats.initialized) {
+        cb_mutex_initialize(&mutex_stats.mutex);
+        mutex_stats.initialized = true;
+    }
+    mutex_stats.sample = sample;
+}
+
+void mc_mutex_stats_register(mc_mutex_stats_t *stats, const char *name) {
+    memset(stats, 0, sizeof(*stats));
+    stats->name = name;
+    if (!mutex_stats.initialized || mutex_stats.sample == 0) {
+        return;
+    }
+
+    cb_mutex_initialize(&stats->mutex);
+    cb_mutex_enter(&mutex_stats.mutex);
+    stats->next = mutex_stats.list;
+    mutex_stats.list = stats;
+    stats->registered = true;
+    cb_mutex_exit(&mutex_stats.mutex);
+}
+
+void mc_mutex_stats_unregister(mc_mutex_stats_t *stats) {
+    mc_mutex_stats_t **ptr;
+
+    if (!stats->registered) {
+        return;
+    }
+
+    cb_mutex_enter(&mutex_stats.mutex);
+    for (ptr = &mutex_stats.list; *ptr != NULL; ptr = &(*ptr)->next) {
+        if (*ptr == stats) {
+            *ptr = stats->next;
+            break;
+        }
+    }
+    stats->registered = false;
+    cb_mutex_exit(&mutex_stats.mutex);
+    cb_mutex_destroy(&stats->mutex);
+}
+
+void mc_mutex_enter(cb_mutex_t *mutex, mc_mutex_stats_t *stats) {
+    hrtime_t wait = 0;
+    bool contended = false;
+
+    if (stats == NULL || !stats->registered || mutex_stats.sample == 0 ||
+        ++stats->calls % mutex_stats.sample != 0) {
+        /* Time every wait (not just the sampled ones) while traced */
+        if (MEMCACHED_LOCK_WAIT_ENABLED()) {
+            if (cb_mutex_try_enter(mutex) != 0) {
+                hrtime_t start = gethrtime();
+                cb_mutex_enter(mutex);
+                MEMCACHED_LOCK_WAIT(stats && stats->name ? stats->name : "",
+                                    (int64_t)(gethrtime() - start));
+            }
+        } else {
+            cb_mutex_enter(mutex);
+        }
+        return;
+    }
+
+    if (cb_mutex_try_enter(mutex) != 0) {
+        hrtime_t start = gethrtime();
+        cb_mutex_enter(mutex);
+        wait = gethrtime() - start;
+        contended = true;
+        MEMCACHED_LOCK_WAIT(stats->name, (int64_t)wait);
+    }
+
+    cb_mutex_enter(&stats->mutex);
+    stats->samples++;
+    if (contended) {
+        stats->contended++;
+        stats->wait += wait;
+        if (wait > stats->max_wait) {
+            stats->max_wait = wait;
+        }
+    }
+    cb_mutex_exit(&stats->mutex);
+}
+
+static void add_mutex_stat(ADD_STAT add_stat, const void *cookie,
+                           const char *name, const char *stat,
+                           uint64_t value) {
+    char key[128];
+    char val[32];
+    int klen = snprintf(key, sizeof(key), "%s:%s", name, stat);
+    int vlen = snprintf(val, sizeof(val), "%" PRIu64, value);
+    add_stat(key, (uint16_t)klen, val, (uint32_t)vlen, cookie);
+}
+
+void mc_mutex_stats(ADD_STAT add_stat, const void *cookie) {
+    mc_mutex_stats_t *stats;
+    mc_mutex_stats_t *other;
+
+    if (!mutex_stats.initialized) {
+        return;
+    }
+
+    add_mutex_stat(add_stat, cookie, "locks", "sample", mutex_stats.sample);
+    cb_mutex_enter(&mutex_stats.mutex);
+    for (stats = mutex_stats.list; stats != NULL; stats = stats->next) {
+        uint64_t samples = 0;
+        uint64_t contended = 0;
+        hrtime_t wait = 0;
+        hrtime_t max_wait = 0;
+        bool reported = false;
+
+        /* The first one of the name sums them all up */
+        for (other = mutex_stats.list; other != stats; other = other->next) {
+            if (strcmp(other->name, stats->name) == 0) {
+                reported = true;
+                break;
+            }
+        }
+        if (reported) {
+            continue;
+        }
+
+        for (other = stats; other != NULL; other = other->next) {
+            if (strcmp(other->name, stats->name) == 0) {
+                cb_mutex_enter(&other->mutex);
+                samples += other->samples;
+                contended += other->contended;
+                wait += other->wait;
+                if (other->max_wait > max_wait) {
+                    max_wait = other->max_wait;
+                }
+                cb_mutex_exit(&other->mutex);
+            }
+        }
+
+        add_mutex_stat(add_stat, cookie, stats->name, "samples", samples);
+        add_mutex_stat(add_stat, cookie, stats->name, "contended",
+                       contended);
+        add_mutex_stat(add_stat, cookie, stats->name, "wait_usec",
+                       wait / 1000);
+        add_mutex_stat(add_stat, cookie, stats->name, "max_wait_usec",
+                       max_wait / 1000);
+    }
+    cb_mutex_exit(&mutex_stats.mutex);
+}